@@ -54,6 +54,7 @@
 #define QGA_FSFREEZE_HOOK_DEFAULT CONFIG_QEMU_CONFDIR "/fsfreeze-hook"
 #endif
 #define QGA_SENTINEL_BYTE 0xFF
+#define QGA_STATUS_CACHE_MS_DEFAULT 1000
 
 static struct {
     const char *state_dir;
@@ -90,6 +91,9 @@ struct GAState {
 #endif
     const gchar *pstate_filepath;
     GAPersistentState pstate;
+    GTimer *clock;
+    int status_cache_ms;
+    GHashTable *status_cache;   /* command name -> GAStatusCacheEntry */
 };
 
 struct GAState *ga_state;
@@ -105,6 +109,35 @@ static const char *ga_freeze_whitelist[] = {
     NULL
 };
 
+/*
+ * Status commands whose last response is reused for status_cache_ms.
+ * Monitoring hosts poll these from several collectors at once; within the
+ * window they all get the same sample instead of one scan each.
+ */
+static const char *ga_status_cache_commands[] = {
+    "guest-get-memory-status",
+    "guest-get-system-info",
+    "guest-get-disk-status",
+    "guest-get-app-status",
+    NULL
+};
+
+/* commands that leave the cached status alone */
+static const char *ga_status_cache_keep[] = {
+    "guest-ping",
+    "guest-info",
+    "guest-sync",
+    "guest-sync-delimited",
+    "guest-get-time",
+    "guest-get-oom-status",
+    NULL
+};
+
+typedef struct GAStatusCacheEntry {
+    QObject *rsp;
+    double time;                /* seconds on GAState.clock */
+} GAStatusCacheEntry;
+
 #ifdef _WIN32
 DWORD WINAPI service_ctrl_handler(DWORD ctrl, DWORD type, LPVOID data,
                                   LPVOID ctx);
@@ -211,6 +244,9 @@ static void usage(const char *cmd)
 #endif
 "  -b, --blacklist   comma-separated list of RPCs to disable (no spaces, \"?\"\n"
 "                    to list available RPCs)\n"
+"  -C, --status-cache\n"
+"                    milliseconds for which status command results are\n"
+"                    reused, 0 disables the cache (default is %d)\n"
 "  -h, --help        display this help and exit\n"
 "\n"
 "Report bugs to <mdroth@linux.vnet.ibm.com>\n"
@@ -218,7 +254,7 @@ static void usage(const char *cmd)
 #ifdef CONFIG_FSFREEZE
     QGA_FSFREEZE_HOOK_DEFAULT,
 #endif
-    dfl_pathnames.state_dir);
+    dfl_pathnames.state_dir, QGA_STATUS_CACHE_MS_DEFAULT);
 }
 
 static const char *ga_log_level_str(GLogLevelFlags level)
@@ -551,14 +587,148 @@ static int send_response(GAState *s, QObject *payload)
     return 0;
 }
 
+/* the entry of @list equal to @str, or NULL */
+static const char *ga_str_find(const char *str, const char **list)
+{
+    int i;
+
+    for (i = 0; list[i]; i++) {
+        if (strcmp(str, list[i]) == 0) {
+            return list[i];
+        }
+    }
+    return NULL;
+}
+
+static void ga_status_cache_free(gpointer p)
+{
+    GAStatusCacheEntry *entry = p;
+
+    qobject_decref(entry->rsp);
+    g_free(entry);
+}
+
+/*
+ * Dispatch @req, answering argument-less status commands from the cache
+ * while their last response is recent enough.  Anything that may change
+ * the guest drops the cache.
+ */
+static QObject *ga_dispatch(GAState *s, QDict *req)
+{
+    const char *name = qdict_get_try_str(req, "execute");
+    const char *key = NULL;
+    GAStatusCacheEntry *entry;
+    QObject *rsp;
+
+    if (!name || !s->status_cache_ms) {
+        return qmp_dispatch(QOBJECT(req));
+    }
+
+    if (!qdict_haskey(req, "arguments")) {
+        key = ga_str_find(name, ga_status_cache_commands);
+    }
+    if (!key) {
+        if (!ga_str_find(name, ga_status_cache_keep)) {
+            g_hash_table_remove_all(s->status_cache);
+        }
+        return qmp_dispatch(QOBJECT(req));
+    }
+
+    /* not if disabled meanwhile, e.g. while file systems are frozen */
+    entry = g_hash_table_lookup(s->status_cache, key);
+    if (entry && qmp_command_is_enabled(key) &&
+        (g_timer_elapsed(s->clock, NULL) - entry->time) * 1000 <
+        s->status_cache_ms) {
+        qobject_incref(entry->rsp);
+        return entry->rsp;
+    }
+
+    rsp = qmp_dispatch(QOBJECT(req));
+    if (rsp && qdict_haskey(qobject_to_qdict(rsp), "return")) {
+        entry = g_malloc0(sizeof(*entry));
+        entry->rsp = rsp;
+        entry->time = g_timer_elapsed(s->clock, NULL);
+        qobject_incref(rsp);
+        g_hash_table_insert(s->status_cache, (gpointer)key, entry);
+    }
+    return rsp;
+}
+
+static QObject *ga_batch_error(Error *err)
+{
+    QDict *rsp = qdict_new();
+
+    qdict_put_obj(rsp, "error", qmp_build_error_object(err));
+    error_free(err);
+    return QOBJECT(rsp);
+}
+
+/*
+ * guest-batch: {"execute": "guest-batch", "arguments": {"commands": [
+ * {"execute": ..., "arguments": ...}, ...]}} runs the commands in order
+ * and returns one response per command, each holding "return" or "error"
+ * as the standalone response would, so a collector pays one round trip
+ * on the channel instead of one per command.  The schema of this tree
+ * cannot describe arbitrary arguments, so it is handled here rather than
+ * as a QAPI command.
+ */
+static QObject *ga_dispatch_batch(GAState *s, QDict *req)
+{
+    const QListEntry *e;
+    QObject *args, *cmds = NULL;
+    QList *results;
+    QDict *cmd, *rsp;
+    const char *name;
+    Error *err = NULL;
+
+    if (g_list_find_custom(s->blacklist, "guest-batch", ga_strcmp)) {
+        error_set(&err, QERR_COMMAND_DISABLED, "guest-batch");
+        return ga_batch_error(err);
+    }
+    args = qdict_get(req, "arguments");
+    if (args && qobject_type(args) == QTYPE_QDICT) {
+        cmds = qdict_get(qobject_to_qdict(args), "commands");
+    }
+    if (!cmds || qobject_type(cmds) != QTYPE_QLIST) {
+        error_set(&err, QERR_INVALID_PARAMETER_TYPE, "commands", "list");
+        return ga_batch_error(err);
+    }
+
+    results = qlist_new();
+    for (e = qlist_first(qobject_to_qlist(cmds)); e; e = qlist_next(e)) {
+        cmd = qobject_to_qdict(qlist_entry_obj(e));
+        name = cmd ? qdict_get_try_str(cmd, "execute") : NULL;
+        if (!name) {
+            error_set(&err, QERR_MISSING_PARAMETER, "execute");
+            qlist_append_obj(results, ga_batch_error(err));
+        } else if (!strcmp(name, "guest-batch") ||
+                   !strcmp(name, "guest-sync-delimited")) {
+            /* the sentinel byte only makes sense for a whole response */
+            error_set(&err, QERR_COMMAND_DISABLED, name);
+            qlist_append_obj(results, ga_batch_error(err));
+        } else {
+            qlist_append_obj(results, ga_dispatch(s, cmd));
+        }
+    }
+
+    rsp = qdict_new();
+    qdict_put_obj(rsp, "return", QOBJECT(results));
+    return QOBJECT(rsp);
+}
+
 static void process_command(GAState *s, QDict *req)
 {
+    const char *name = qdict_get_try_str(req, "execute");
     QObject *rsp = NULL;
     int ret;
 
     g_assert(req);
     g_debug("processing command");
-    rsp = qmp_dispatch(QOBJECT(req));
+    if (name && !strcmp(name, "guest-batch")) {
+        rsp = ga_dispatch_batch(s, req);
+    } else {
+        rsp = ga_dispatch(s, req);
+    }
     if (rsp) {
         ret = send_response(s, rsp);
         if (ret) {
@@ -921,7 +1091,7 @@ int64_t ga_get_fd_handle(GAState *s, Error **errp)
 
 int main(int argc, char **argv)
 {
-    const char *sopt = "hVvdm:p:l:f:F::b:s:t:";
+    const char *sopt = "hVvdm:p:l:f:F::b:s:t:C:";
     const char *method = NULL, *path = NULL;
     const char *log_filepath = NULL;
     const char *pid_filepath;
@@ -949,11 +1119,13 @@ int main(int argc, char **argv)
         { "service", 1, NULL, 's' },
 #endif
         { "statedir", 1, NULL, 't' },
+        { "status-cache", 1, NULL, 'C' },
         { NULL, 0, NULL, 0 }
     };
     int opt_ind = 0, ch, daemonize = 0, i, j, len;
     GLogLevelFlags log_level = G_LOG_LEVEL_ERROR | G_LOG_LEVEL_CRITICAL;
     GList *blacklist = NULL;
+    int status_cache_ms = QGA_STATUS_CACHE_MS_DEFAULT;
     GAState *s;
 
     module_call_init(MODULE_INIT_QAPI);
@@ -984,6 +1156,13 @@ int main(int argc, char **argv)
         case 't':
              state_dir = optarg;
              break;
+        case 'C':
+            status_cache_ms = atoi(optarg);
+            if (status_cache_ms < 0) {
+                g_print("status cache time must not be negative\n");
+                return EXIT_FAILURE;
+            }
+            break;
         case 'v':
             /* enable all log levels */
             log_level = G_LOG_LEVEL_MASK;
@@ -1150,6 +1329,10 @@ int main(int argc, char **argv)
             blacklist = g_list_next(blacklist);
         } while (blacklist);
     }
+    s->clock = g_timer_new();
+    s->status_cache_ms = status_cache_ms;
+    s->status_cache = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+                                            ga_status_cache_free);
     s->command_state = ga_command_state_new();
     ga_command_state_init(s, s->command_state);
     ga_command_state_init_all(s->command_state);
@@ -1180,6 +1363,8 @@ int main(int argc, char **argv)
 #endif
 
     ga_command_state_cleanup_all(ga_state->command_state);
+    g_hash_table_destroy(ga_state->status_cache);
+    g_timer_destroy(ga_state->clock);
     ga_channel_free(ga_state->channel);
 
     if (daemonize) {
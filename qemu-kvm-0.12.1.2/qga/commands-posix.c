@@ -16,6 +16,7 @@
 #if defined(__linux__)
 #include <mntent.h>
 #include <linux/fs.h>
+#include "qga/bc/collect.h"
 
 #ifdef FIFREEZE
 #define CONFIG_FSFREEZE
@@ -38,6 +39,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <inttypes.h>
 #include "qga/guest-agent-core.h"
 #include "qga-qmp-commands.h"
@@ -1411,94 +1413,34 @@ int64_t qmp_guest_set_vcpus(GuestLogicalProcessorList *vcpus, Error **errp)
 
 /*MemoryStatus*/
 /*########################################################################################################*/
-GuestMemoryStatus *qmp_guest_get_memory_status(Error **errp)
+static void ga_collect_error(Error **errp, GError *gerr)
 {
-    Error *local_err = NULL;
-    int oflag;
-    const char *mode = "r";
-    const char *path = "/proc/meminfo";
-    SwapInfo *info = g_malloc0(sizeof(SwapInfo));
-    GuestMemoryStatus *status = g_malloc0(sizeof(GuestMemoryStatus));
-
-    oflag = find_open_flag(mode, &local_err);
-    if (local_err == NULL) {
-        int fd;
-        fd = open(path, oflag | ((oflag & O_CREAT) ? O_EXCL : 0), 0);
-        if (fd == -1 && errno == EEXIST) {
-            oflag &= ~(unsigned)O_CREAT;
-            fd = open(path, oflag);
-        }
+    error_setg(errp, "%s", gerr->message);
+    g_error_free(gerr);
+}
 
-        if (fd == -1) {
-            error_setg_errno(&local_err, errno, "failed to open file '%s' "
-                             "(mode: '%s')", path, mode);
-        } else {
-            qemu_set_cloexec(fd);
-            FILE *f;
-            char StrLine[1024] = "";
-            f = fdopen(fd, mode);
-            if (f == NULL) {
-                error_setg_errno(&local_err, errno, "failed to associate "
-                                 "stdio stream with file descriptor %d, "
-                                 "file '%s' (mode: '%s')", fd, path, mode);
-            } else {
-                const char *fields[] = {"MemTotal", "MemFree", "Buffers", "Cached",
-                                "SwapTotal", "SwapFree"};
-                while (!feof(f)) {
-                    fgets(StrLine, 1024, f);
-                    char *p;
-                    p = strtok(StrLine, ":");
-                    int i,m;
-                    for(i=0; i<6; i++){
-                        if(!strcmp(p, fields[i])){
-                            p = strtok(NULL, " ");
-                            if(p){
-                                m = atoi(p);
-                                switch (i){
-                                    case 0:
-                                        m/=1024;
-                                        status->total = m;
-                                        break;
-                                    case 1:
-                                        m/=1024;
-                                        status->used = m;
-                                        break;
-                                    case 2:
-                                         m/=1024;
-                                        status->buffer = m;
-                                        break;
-                                    case 3:
-                                         m/=1024;
-                                        status->cached = m;
-                                        break;
-                                    case 4:
-                                         m/=1024;
-                                        info->total = m;
-                                        break;
-                                    case 5:
-                                         m/=1024;
-                                        info->used = m;
-                                        break;
-                                }
-                            }
-                        }
-                    }
-                }
-                status->used = status->total - status->used;
-                info->used = info->total - info->used;
-                status->swap = info;
-                fclose(f);
-            }
+/* sizes are in MiB, "used" includes buffers and cache */
+GuestMemoryStatus *qmp_guest_get_memory_status(Error **errp)
+{
+    GuestMemoryStatus *status;
+    GuestMeminfo mi;
+    GError *gerr = NULL;
 
-            close(fd);
-            if (oflag & O_CREAT) {
-                unlink(path);
-            }
-        }
-        error_free(local_err);
+    if (!ga_collect_memory(&mi, &gerr)) {
+        ga_collect_error(errp, gerr);
+        return NULL;
     }
-    else
-        error_propagate(errp, local_err);
+
+    status = g_malloc0(sizeof(GuestMemoryStatus));
+    status->total = mi.value[MEMINFO_MEM_TOTAL] >> 20;
+    status->used = (mi.value[MEMINFO_MEM_TOTAL] -
+                    mi.value[MEMINFO_MEM_FREE]) >> 20;
+    status->buffer = mi.value[MEMINFO_BUFFERS] >> 20;
+    status->cached = mi.value[MEMINFO_CACHED] >> 20;
+    status->swap = g_malloc0(sizeof(SwapInfo));
+    status->swap->total = mi.value[MEMINFO_SWAP_TOTAL] >> 20;
+    status->swap->used = (mi.value[MEMINFO_SWAP_TOTAL] -
+                          mi.value[MEMINFO_SWAP_FREE]) >> 20;
 
     return status;
 }
@@ -1509,51 +1451,15 @@ GuestMemoryStatus *qmp_guest_get_memory_status(Error **errp)
 GuestSystemInfo *qmp_guest_get_system_info(Error **errp)
 {
     GuestSystemInfo *info = g_malloc0(sizeof(GuestSystemInfo));
+    GACollectSystem si = { NULL };
 
-    FILE * fp = NULL;
-    char line[200]="";
-
-    fp = popen("timeout -s SIGKILL 2s uname -s","r");
-    if(fp !=NULL){
-        if(fgets(line, 200, fp) != NULL) {
-                info->os_name = g_strdup(line);
-        }
-    }
-    pclose(fp);
-
-    fp = popen("timeout -s SIGKILL 2s uname -r","r");
-    if(fp !=NULL){
-        if(fgets(line, 200, fp) != NULL) {
-                info->kernel_version = g_strdup(line);
-        }
-    }
-    pclose(fp);
-
-    fp = popen("timeout -s SIGKILL 2s uname -v","r");
-    if(fp !=NULL){
-        if(fgets(line, 200, fp) != NULL) {
-                info->system_version = g_strdup(line);
-        }
-    }
-    pclose(fp);
-
-    fp = popen("timeout -s SIGKILL 2s hostname -f","r");
-    if(fp !=NULL){
-        if(fgets(line, 200, fp) != NULL) {
-                info->fqdn = g_strdup(line);
-        }
-    }
-    pclose(fp);
-
-    fp = popen("timeout -s SIGKILL 2s lastlog","r");
-    if(fp !=NULL){
-        if(fgets(line, 200, fp) != NULL) {
-            if(fgets(line, 200, fp) != NULL) {
-                info->fqdn = g_strdup(line);
-            }
-        }
-    }
-    pclose(fp);
+    ga_collect_system(&si);
+    info->os_name = si.os_name;
+    info->kernel_version = si.kernel_version;
+    info->system_version = si.system_version;
+    info->fqdn = si.fqdn;
+    info->lastlogin = si.lastlogin;
+    g_free(si.pretty_name);
 
     return info;
 }
@@ -1561,23 +1467,21 @@ GuestSystemInfo *qmp_guest_get_system_info(Error **errp)
 
 /*APPStatus*/
 /*########################################################################################################*/
+/* the process scan is shared with qemu-master, see qga/bc/collect-posix.c */
 struct APPStatus *qmp_guest_get_app_status(Error **errp)
 {
-    FILE * fp = NULL;
-    char buffer[40000] = "";
-    char line[200] = "";
-    APPStatus *status = g_malloc0(sizeof(APPStatus));
-    int count = 0;
-    fp = popen("timeout -s SIGKILL 2s top -n 1 -b","r");
-    if(fp !=NULL){
-        while ((fgets(line, 200, fp) != NULL) && count < 200 ){
-                strcat(buffer, line);
-                count++;
-        }
+    APPStatus *status;
+    GError *gerr = NULL;
+    char *text;
+
+    text = ga_collect_app_status(&gerr);
+    if (!text) {
+        ga_collect_error(errp, gerr);
+        return NULL;
     }
-    pclose(fp);
-    status->appStatus = g_strdup(buffer);
 
+    status = g_malloc0(sizeof(APPStatus));
+    status->appStatus = text;
     return status;
 }
 /*########################################################################################################*/
@@ -1586,49 +1490,34 @@ struct APPStatus *qmp_guest_get_app_status(Error **errp)
 /*########################################################################################################*/
 struct GuestDiskStatusList *qmp_guest_get_disk_status(Error **errp)
 {
-    FILE * fp = NULL;
-    char line[200] = "";
-    GuestDiskStatusList *head, **link;
-
-    head = NULL;
-    link = &head;
-
-    char *p = NULL;
-    int i;
-
-    GuestDiskStatus *status = NULL;
-    GuestDiskStatusList *entry = NULL;
-
-    fp = popen("timeout -s SIGKILL 2s df -Ph","r");
-    if((fgets(line, 200, fp) != NULL) && (fp != NULL)) {
-        while (fgets(line, 200, fp) != NULL) {
-            status = g_malloc0(sizeof *status);
-            MountInfo *info = g_malloc0(sizeof(MountInfo));
-            p=strtok(line," ");
-            if(p){
-                for(i=0; i<5; i++ ){
-                    p=strtok(NULL," ");
-                    if(i == 0){
-                        info->total = g_strdup(p);
-                    }
-                    if(i==1){
-                        info->used = g_strdup(p);
-                    }
-                }
-                info->writable = true;
-                status->mount_place = g_strdup(p);
-                status->mount_info = info;
-            }
+    GuestDiskStatusList *head = NULL, **link = &head, *entry;
+    GuestDiskStatus *status;
+    GACollectDisk *disk;
+    GPtrArray *disks;
+    GError *gerr = NULL;
+    guint i;
+
+    disks = ga_collect_disks(&gerr);
+    if (!disks) {
+        ga_collect_error(errp, gerr);
+        return NULL;
+    }
 
-            entry = g_malloc0(sizeof *entry);
-            entry->value = status;
+    for (i = 0; i < disks->len; i++) {
+        disk = g_ptr_array_index(disks, i);
+        status = g_malloc0(sizeof(*status));
+        status->mount_place = g_strdup(disk->mount);
+        status->mount_info = g_malloc0(sizeof(MountInfo));
+        status->mount_info->total = ga_collect_size_human(disk->total);
+        status->mount_info->used = ga_collect_size_human(disk->used);
+        status->mount_info->writable = disk->writable;
 
-            *link = entry;
-            link = &entry->next;
-        }
+        entry = g_malloc0(sizeof(*entry));
+        entry->value = status;
+        *link = entry;
+        link = &entry->next;
     }
-    pclose(fp);
-    g_assert(head != NULL);
+    g_ptr_array_free(disks, true);
 
     return head;
 }
@@ -1636,350 +1525,195 @@ struct GuestDiskStatusList *qmp_guest_get_disk_status(Error **errp)
 
 /*OOMStatus*/
 /*########################################################################################################*/
+/*
+ * The 2.6.32 kernels of CentOS 6 have no /dev/kmsg, so OOM kills are
+ * picked up from the syslog file by the shared follower, which only
+ * parses the lines logged since the previous call.
+ */
 struct OOMStatus *qmp_guest_get_oom_status(Error **errp)
 {
-    Error *local_err = NULL;
-    int oflag;
-    const char *mode = "r";
-    const char *path = "/var/log/messages";
-    OOMStatus *status = g_malloc0(sizeof(OOMStatus));
-    const char *oom = "Out of memory: Kill process";
-
-    oflag = find_open_flag(mode, &local_err);
-    if (local_err == NULL) {
-        int fd;
-
-        fd = open(path, oflag | ((oflag & O_CREAT) ? O_EXCL : 0), 0);
-        if (fd == -1 && errno == EEXIST) {
-            oflag &= ~(unsigned)O_CREAT;
-            fd = open(path, oflag);
-        }
+    OOMStatus *status;
+    GError *gerr = NULL;
 
-        if (fd == -1) {
-            error_setg_errno(&local_err, errno, "failed to open file '%s' "
-                             "(mode: '%s')", path, mode);
-        } else {
-            qemu_set_cloexec(fd);
-            FILE *f = NULL;
-            char StrLine[1024] = "";
-            f = fdopen(fd, mode);
-            if (f == NULL) {
-                error_setg_errno(&local_err, errno, "failed to associate "
-                                 "stdio stream with file descriptor %d, "
-                                 "file '%s' (mode: '%s')", fd, path, mode);
-            } else {
-                while (!feof(f)) {
-                    fgets(StrLine, 1024, f);
-
-                    char *p = NULL;
-                    p = strstr(StrLine,oom);
-                    if(p)
-                        status->oom_happened = true;
-                    else
-                        status->oom_happened = false;
-                }
-                fclose(f);
-            }
-            close(fd);
-            if (oflag & O_CREAT) {
-                unlink(path);
-            }
-        }
-        error_free(local_err);
+    if (!ga_collect_oom_scan_syslog(&gerr)) {
+        ga_collect_error(errp, gerr);
+        return NULL;
     }
-    else
-        error_propagate(errp, local_err);
 
+    status = g_malloc0(sizeof(OOMStatus));
+    status->oom_happened = ga_collect_oom_count() > 0;
     return status;
 }
 /*########################################################################################################*/
 
 /*UserCheck*/
 /*########################################################################################################*/
+#define GUEST_USER_CHECK_TIMEOUT_MS 2000
+#define GUEST_USER_CHECK_MAX_OUTPUT 40000
+
 struct UserCheck *qmp_guest_user_check(const char *command_name, const char *command, Error **errp)
 {
-    FILE * fp = NULL;
-    char buffer[40000] = "";
-    char line[200] = "";
-    UserCheck *check = g_malloc0(sizeof(UserCheck));
-    int count = 0;
-    char command_with_kill[500] = "";
-    strcat(command_with_kill, "timeout -s SIGKILL 2s ");
-    strcat(command_with_kill, command);
-    fp = popen(command_with_kill, "r");
-
-    if(fp !=NULL){
-        while ((fgets(line, 200, fp) != NULL) && count < 200 ){
-                strcat(buffer, line);
-                count++;
-        }
+    UserCheck *check;
+    GError *gerr = NULL;
+    char *out;
+
+    out = ga_collect_check(command, GUEST_USER_CHECK_TIMEOUT_MS,
+                           GUEST_USER_CHECK_MAX_OUTPUT, &gerr);
+    if (!out) {
+        ga_collect_error(errp, gerr);
+        return NULL;
     }
-    pclose(fp);
-    check->command_name = g_strdup(command_name);
-    check->result = g_strdup(buffer);
 
+    check = g_malloc0(sizeof(UserCheck));
+    check->command_name = g_strdup(command_name);
+    check->result = out;
     return check;
 }
 /*########################################################################################################*/
 
 /*Password*/
 /*########################################################################################################*/
+/*
+ * Set the root password, in /etc/shadow directly where possible.  This
+ * used to run "echo root:<password> | chpasswd" through the shell.
+ */
 struct ErrNO *qmp_change_password(const char *new_password, Error **errp)
 {
-    ErrNO *err = g_malloc0(sizeof(ErrNO));
-    int ret;
-    const char *a = "echo root:";
-    const char *b = " | chpasswd";
-    char *cmd = g_malloc0(strlen(a)+strlen(b)+strlen(new_password)+1);
+    ErrNO *err;
 
-    strcpy(cmd, a);
-    strcat(cmd, new_password);
-    strcat(cmd, b);
-    ret = system(cmd);
-    err->errnum = ret;
-
-    g_free(cmd);
+    if (strchr(new_password, '\n')) {
+        error_setg(errp, "forbidden characters in raw password");
+        return NULL;
+    }
 
+    err = g_malloc0(sizeof(ErrNO));
+    err->errnum = ga_collect_change_password("root", new_password);
     return err;
 }
 /*########################################################################################################*/
 
 /*Hostname*/
 /*########################################################################################################*/
+/*
+ * Set the running host name and store it where the distribution reads it
+ * at boot, /etc/sysconfig/network on CentOS 6.  This used to run hostname
+ * and sed through the shell.
+ */
 struct ErrNum *qmp_change_hostname(const char *new_hostname, Error **errp)
 {
-    ErrNum *err = g_malloc0(sizeof(ErrNum));
-    const char *spe = " s/.*HOSTNAME=.*/HOSTNAME=";
-    char *new_hostname_spe = g_malloc0(strlen(new_hostname)+strlen(spe)+1);
-
-    strcat(new_hostname_spe, spe);
-    strcat(new_hostname_spe, new_hostname);
-    const char *a = "hostname ";
-    const char *a0 = "sed -i";
-    const char *a1 = "echo ";
-    const char *b0 = "/ /etc/sysconfig/network";
-    const char *b1 = " > /etc/hostname";
-    const char *b2 = " /etc/HOSTNAME";
-
-    char *cmd_flag = g_malloc0(strlen(a)+strlen(new_hostname)+1);
-    char *cmd_flag0 = g_malloc0(strlen(a0)+strlen(b0)+strlen(new_hostname_spe)+1);
-    char *cmd_flag1 = g_malloc0(strlen(a1)+strlen(b1)+strlen(new_hostname)+1);
-    char *cmd_flag2 = g_malloc0(strlen(a0)+strlen(b2)+strlen(new_hostname)+1);
-
-    strcpy(cmd_flag, a);
-    strcat(cmd_flag, new_hostname);
-    strcpy(cmd_flag0, a0);
-    strcat(cmd_flag0, new_hostname_spe);
-    strcat(cmd_flag0, b0);
-    strcpy(cmd_flag1, a1);
-    strcat(cmd_flag1, new_hostname);
-    strcat(cmd_flag1, b1);
-    strcpy(cmd_flag2, a0);
-    strcat(cmd_flag2, new_hostname);
-    strcat(cmd_flag2, b2);
-
-    const char *cmd0 = "cat /etc/issue |grep CentOS";
-    const char *cmd1 = "cat /etc/issue |grep Red";
-    const char *cmd2 = "cat /etc/issue |grep Fedora";
-    const char *cmd3 = "cat /etc/issue |grep Ubuntu";
-    const char *cmd4 = "cat /etc/issue |grep Debian";
-    const char *cmd5 = "cat /etc/issue |grep SUSE";
-    const char *cmd6 = "cat /etc/issue |grep 'CentOS Linux 7'";
-    int ret1 =1, ret2, ret3;
-
-    ret1 = system(cmd6);
-    if(ret1 == 0){
-        ret2 = system(cmd_flag);
-        if(ret2 ==0){
-            ret3 = system(cmd_flag1);
-            err->errnum = ret3; 
-
-            g_free(new_hostname_spe);
-            g_free(cmd_flag);
-            g_free(cmd_flag0);
-            g_free(cmd_flag1);
-            g_free(cmd_flag2);
-
-            return err;
-        }
-        else{
-            err->errnum = ret2;
-            
-            g_free(new_hostname_spe);
-            g_free(cmd_flag);
-            g_free(cmd_flag0);
-            g_free(cmd_flag1);
-            g_free(cmd_flag2);
-
-            return err;
-        }
-    }
-    ret1 = system(cmd0);
-    if(ret1 == 0){
-        ret2 = system(cmd_flag);
-        if(ret2 ==0){
-            ret3 = system(cmd_flag0);
-            err->errnum = ret3;
-            
-            g_free(new_hostname_spe);
-            g_free(cmd_flag);
-            g_free(cmd_flag0);
-            g_free(cmd_flag1);
-            g_free(cmd_flag2);
-
-            return err;
-        }
-        else{
-            err->errnum = ret2;
+    ErrNum *err;
+    GError *gerr = NULL;
 
-            g_free(new_hostname_spe);
-            g_free(cmd_flag);
-            g_free(cmd_flag0);
-            g_free(cmd_flag1);
-            g_free(cmd_flag2);
-
-            return err;
-        }
+    if (!ga_collect_hostname_valid(new_hostname, &gerr)) {
+        ga_collect_error(errp, gerr);
+        return NULL;
     }
-    ret1 = system(cmd1);
-    if(ret1 == 0){
-        ret2 = system(cmd_flag);
-        if(ret2 ==0){
-            ret3 = system(cmd_flag0);
-            err->errnum = ret3;
 
-            g_free(new_hostname_spe);
-            g_free(cmd_flag);
-            g_free(cmd_flag0);
-            g_free(cmd_flag1);
-            g_free(cmd_flag2);
+    err = g_malloc0(sizeof(ErrNum));
+    err->errnum = ga_collect_change_hostname(new_hostname);
+    return err;
+}
+/*########################################################################################################*/
 
-            return err;
-        }
-        else{
-            err->errnum = ret2; 
-            
-            g_free(new_hostname_spe);
-            g_free(cmd_flag);
-            g_free(cmd_flag0);
-            g_free(cmd_flag1);
-            g_free(cmd_flag2);
-
-            return err;
-        }
+/*ServiceStatus*/
+/*########################################################################################################*/
+GuestServiceStatusList *qmp_guest_get_service_status(
+    GuestServiceUnitList *units, Error **errp)
+{
+    GuestServiceStatusList *head = NULL, **link = &head, *entry;
+    GuestServiceStatus *status;
+    GuestServiceUnitList *u;
+    GACollectService *svc;
+    GPtrArray *services;
+    GError *gerr = NULL;
+    char **names;
+    size_t n = 0;
+    guint i;
+
+    for (u = units; u; u = u->next) {
+        n++;
+    }
+    names = g_malloc0((n + 1) * sizeof(*names));
+    for (u = units, i = 0; u; u = u->next, i++) {
+        names[i] = u->value->name;
+    }
+    services = ga_collect_services(names, &gerr);
+    g_free(names);
+    if (!services) {
+        ga_collect_error(errp, gerr);
+        return NULL;
     }
-    ret1 = system(cmd2);
-    if(ret1 == 0){
-        ret2 = system(cmd_flag);
-        if(ret2 ==0){
-            ret3 = system(cmd_flag0);
-            err->errnum = ret3;
-
-            g_free(new_hostname_spe);
-            g_free(cmd_flag);
-            g_free(cmd_flag0);
-            g_free(cmd_flag1);
-            g_free(cmd_flag2);
 
-            return err;
+    for (i = 0; i < services->len; i++) {
+        svc = g_ptr_array_index(services, i);
+        status = g_malloc0(sizeof(*status));
+        status->name = g_strdup(svc->name);
+        status->load_state = g_strdup(svc->load_state);
+        status->active_state = g_strdup(svc->active_state);
+        if (svc->sub_state) {
+            status->has_sub_state = true;
+            status->sub_state = g_strdup(svc->sub_state);
         }
-        else{
-            err->errnum = ret2;
-            
-            g_free(new_hostname_spe);
-            g_free(cmd_flag);
-            g_free(cmd_flag0);
-            g_free(cmd_flag1);
-            g_free(cmd_flag2);
-
-            return err;
+        if (svc->main_pid > 0) {
+            status->has_main_pid = true;
+            status->main_pid = svc->main_pid;
         }
-    }
-    ret1 = system(cmd3);
-    if(ret1 == 0){
-        ret2 = system(cmd_flag);
-        if(ret2 ==0){
-            ret3 = system(cmd_flag1);
-            err->errnum = ret3;
-
-            g_free(new_hostname_spe);
-            g_free(cmd_flag);
-            g_free(cmd_flag0);
-            g_free(cmd_flag1);
-            g_free(cmd_flag2);
 
-            return err;
-        }
-        else{
-            err->errnum = ret2;
-
-            g_free(new_hostname_spe);
-            g_free(cmd_flag);
-            g_free(cmd_flag0);
-            g_free(cmd_flag1);
-            g_free(cmd_flag2);
-
-            return err;
-        }
+        entry = g_malloc0(sizeof(*entry));
+        entry->value = status;
+        *link = entry;
+        link = &entry->next;
     }
-    ret1 = system(cmd4);
-    if(ret1 == 0){
-        ret2 = system(cmd_flag);
-        if(ret2 ==0){
-            ret3 = system(cmd_flag1);
-            err->errnum = ret3;
+    g_ptr_array_free(services, true);
 
-            g_free(new_hostname_spe);
-            g_free(cmd_flag);
-            g_free(cmd_flag0);
-            g_free(cmd_flag1);
-            g_free(cmd_flag2);
+    return head;
+}
+/*########################################################################################################*/
 
-            return err;
-        }
-        else{
-            err->errnum = ret2;
-            
-            g_free(new_hostname_spe);
-            g_free(cmd_flag);
-            g_free(cmd_flag0);
-            g_free(cmd_flag1);
-            g_free(cmd_flag2);
-
-            return err;
-        }
+/*Packages*/
+/*########################################################################################################*/
+static GuestPackageList *guest_package_list(GPtrArray *packages)
+{
+    GuestPackageList *head = NULL, **link = &head, *entry;
+    GACollectPackage *pkg;
+    guint i;
+
+    for (i = 0; i < packages->len; i++) {
+        pkg = g_ptr_array_index(packages, i);
+        entry = g_malloc0(sizeof(*entry));
+        entry->value = g_malloc0(sizeof(GuestPackage));
+        entry->value->name = g_strdup(pkg->name);
+        entry->value->version = g_strdup(pkg->version);
+        entry->value->arch = g_strdup(pkg->arch);
+        *link = entry;
+        link = &entry->next;
     }
-    ret1 = system(cmd5);
-    if(ret1 == 0){
-        ret2 = system(cmd_flag);
-        if(ret2 ==0){
-            ret3 = system(cmd_flag2);
-            err->errnum = ret3;
-
-            g_free(new_hostname_spe);
-            g_free(cmd_flag);
-            g_free(cmd_flag0);
-            g_free(cmd_flag1);
-            g_free(cmd_flag2);
-
-            return err;
-        }
-        else{
-            err->errnum = ret2;
+    return head;
+}
 
-            g_free(new_hostname_spe);
-            g_free(cmd_flag);
-            g_free(cmd_flag0);
-            g_free(cmd_flag1);
-            g_free(cmd_flag2);
+GuestPackages *qmp_guest_get_packages(bool has_since, const char *since,
+                                      Error **errp)
+{
+    GuestPackages *ret;
+    GACollectPackages pk;
+    GError *gerr = NULL;
 
-            return err;
-        }
+    if (!ga_collect_packages(has_since ? since : NULL, &pk, &gerr)) {
+        ga_collect_error(errp, gerr);
+        return NULL;
     }
 
-    err->errnum = 1;
+    ret = g_malloc0(sizeof(*ret));
+    ret->manager = pk.manager == GA_COLLECT_PACKAGES_RPM ?
+                   GUEST_PACKAGE_MANAGER_RPM : GUEST_PACKAGE_MANAGER_DPKG;
+    ret->token = pk.token;
+    pk.token = NULL;
+    ret->full = pk.full;
+    ret->installed = guest_package_list(pk.installed);
+    ret->removed = guest_package_list(pk.removed);
+    ga_collect_packages_clear(&pk);
 
-    return err;
+    return ret;
 }
 /*########################################################################################################*/
 
@@ -2058,5 +1792,14 @@ void ga_command_state_init(GAState *s, GACommandState *cs)
     ga_command_state_add(cs, NULL, guest_fsfreeze_cleanup);
 #endif
     ga_command_state_add(cs, guest_file_init, NULL);
+#if defined(__linux__)
+    ga_command_state_add(cs, ga_collect_system_init,
+                         ga_collect_system_cleanup);
+    ga_command_state_add(cs, NULL, ga_collect_disks_cleanup);
+    ga_command_state_add(cs, NULL, ga_collect_services_cleanup);
+    ga_command_state_add(cs, NULL, ga_collect_packages_cleanup);
+    ga_command_state_add(cs, NULL, ga_collect_processes_cleanup);
+    ga_command_state_add(cs, NULL, ga_collect_oom_cleanup);
+#endif
 }
 
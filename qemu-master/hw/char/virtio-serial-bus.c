@@ -73,6 +73,12 @@ static VirtIOSerialPort *find_port_by_name(char *name)
     return NULL;
 }
 
+/*
+ * The most virtio_serial_guest_ready() reports, which bounds what a
+ * chardev hands to the port in one go
+ */
+#define VIRTIO_SERIAL_READY_MAX (64 * 1024)
+
 static bool use_multiport(VirtIOSerial *vser)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(vser);
@@ -85,6 +91,7 @@ static size_t write_to_port(VirtIOSerialPort *port,
     VirtQueueElement elem;
     VirtQueue *vq;
     size_t offset;
+    unsigned int count;
 
     vq = port->ivq;
     if (!virtio_queue_ready(vq)) {
@@ -92,6 +99,7 @@ static size_t write_to_port(VirtIOSerialPort *port,
     }
 
     offset = 0;
+    count = 0;
     while (offset < size) {
         size_t len;
 
@@ -103,9 +111,13 @@ static size_t write_to_port(VirtIOSerialPort *port,
                            buf + offset, size - offset);
         offset += len;
 
-        virtqueue_push(vq, &elem, len);
+        /* hand all the buffers back to the guest at once, below */
+        virtqueue_fill(vq, &elem, len, count++);
     }
 
+    if (count) {
+        virtqueue_flush(vq, count);
+    }
     virtio_notify(VIRTIO_DEVICE(port->vser), vq);
     return offset;
 }
@@ -123,15 +135,118 @@ static void discard_vq_data(VirtQueue *vq, VirtIODevice *vdev)
     virtio_notify(vdev, vq);
 }
 
+/* elements passed to have_datav at once by a tx_batch port */
+#define VIRTIO_SERIAL_TX_BATCH 8
+
+/*
+ * The have_datav flavour of do_flush_queued_data: the rest of port->elem
+ * and, with tx_batch, the elements queued after it go to the app in one
+ * call.  The element the app stops in becomes port->elem, and the ones
+ * after it are put back in the queue.
+ */
+static void do_flush_queued_datav(VirtIOSerialPort *port, VirtQueue *vq,
+                                  VirtIODevice *vdev)
+{
+    VirtIOSerialPortClass *vsc = VIRTIO_SERIAL_PORT_GET_CLASS(port);
+    VirtQueueElement *elems[VIRTIO_SERIAL_TX_BATCH];
+    struct iovec iov[VIRTQUEUE_MAX_SIZE];
+    unsigned int count = 0, n, i, j, niov;
+    size_t done, left;
+    ssize_t ret;
+
+    if (port->tx_batch && !port->batch) {
+        port->batch = g_new(VirtQueueElement, VIRTIO_SERIAL_TX_BATCH - 1);
+    }
+
+    while (!port->throttled) {
+        /* Pop an elem only if we haven't left off a previous one mid-way */
+        if (!port->elem.out_num) {
+            if (!virtqueue_pop(vq, &port->elem)) {
+                break;
+            }
+            port->iov_idx = 0;
+            port->iov_offset = 0;
+        }
+        elems[0] = &port->elem;
+        niov = iov_copy(iov, ARRAY_SIZE(iov), port->elem.out_sg,
+                        port->elem.out_num,
+                        iov_size(port->elem.out_sg, port->iov_idx) +
+                        port->iov_offset, -1);
+        for (n = 1; port->tx_batch && n < VIRTIO_SERIAL_TX_BATCH; n++) {
+            elems[n] = &port->batch[n - 1];
+            if (!virtqueue_pop(vq, elems[n])) {
+                break;
+            }
+            if (niov + elems[n]->out_num > ARRAY_SIZE(iov)) {
+                virtqueue_discard(vq, elems[n], 0);
+                break;
+            }
+            memcpy(iov + niov, elems[n]->out_sg,
+                   elems[n]->out_num * sizeof(iov[0]));
+            niov += elems[n]->out_num;
+        }
+
+        ret = vsc->have_datav(port, iov, niov);
+        if (!port->throttled) {
+            /* as with have_data, what was not taken is dropped */
+            ret = iov_size(iov, niov);
+        }
+        done = ret > 0 ? ret : 0;
+
+        for (i = 0; i < n; i++) {
+            left = iov_size(elems[i]->out_sg, elems[i]->out_num);
+            if (i == 0) {
+                left -= iov_size(elems[i]->out_sg, port->iov_idx) +
+                        port->iov_offset;
+            }
+            if (done < left) {
+                break;
+            }
+            done -= left;
+            virtqueue_fill(vq, elems[i], 0, count++);
+        }
+        if (i == n) {
+            port->elem.out_num = 0;
+            continue;
+        }
+
+        /* the app stopped in elems[i] */
+        for (j = n - 1; j > i; j--) {
+            virtqueue_discard(vq, elems[j], 0);
+        }
+        if (i > 0) {
+            port->elem = *elems[i];
+            port->iov_idx = 0;
+            port->iov_offset = 0;
+        }
+        done += port->iov_offset;
+        while (done >= port->elem.out_sg[port->iov_idx].iov_len) {
+            done -= port->elem.out_sg[port->iov_idx].iov_len;
+            port->iov_idx++;
+        }
+        port->iov_offset = done;
+        break;
+    }
+    if (count) {
+        virtqueue_flush(vq, count);
+    }
+    virtio_notify(vdev, vq);
+}
+
 static void do_flush_queued_data(VirtIOSerialPort *port, VirtQueue *vq,
                                  VirtIODevice *vdev)
 {
     VirtIOSerialPortClass *vsc;
+    unsigned int count = 0;
 
     assert(port);
     assert(virtio_queue_ready(vq));
 
     vsc = VIRTIO_SERIAL_PORT_GET_CLASS(port);
+    if (vsc->have_datav) {
+        do_flush_queued_datav(port, vq, vdev);
+        return;
+    }
 
     while (!port->throttled) {
         unsigned int i;
@@ -166,9 +281,12 @@ static void do_flush_queued_data(VirtIOSerialPort *port, VirtQueue *vq,
         if (port->throttled) {
             break;
         }
-        virtqueue_push(vq, &port->elem, 0);
+        virtqueue_fill(vq, &port->elem, 0, count++);
         port->elem.out_num = 0;
     }
+    if (count) {
+        virtqueue_flush(vq, count);
+    }
     virtio_notify(vdev, vq);
 }
 
@@ -274,7 +392,7 @@ size_t virtio_serial_guest_ready(VirtIOSerialPort *port)
     if (use_multiport(port->vser) && !port->guest_connected) {
         return 0;
     }
-    virtqueue_get_avail_bytes(vq, &bytes, NULL, 4096, 0);
+    virtqueue_get_avail_bytes(vq, &bytes, NULL, VIRTIO_SERIAL_READY_MAX, 0);
     return bytes;
 }
 
@@ -282,7 +400,30 @@ static void flush_queued_data_bh(void *opaque)
 {
     VirtIOSerialPort *port = opaque;
 
-    flush_queued_data(port);
+    if (!port->tx_batch) {
+        flush_queued_data(port);
+        return;
+    }
+    if (!virtio_queue_ready(port->ovq)) {
+        return;
+    }
+
+    /*
+     * The guest is not kicking us while handle_output() has the flush
+     * pending.  Listen again, unless more came in while flushing: then go
+     * for another round without a notification.
+     */
+    if (!port->host_connected) {
+        virtio_queue_set_notification(port->ovq, 1);
+        discard_vq_data(port->ovq, VIRTIO_DEVICE(port->vser));
+        return;
+    }
+    do_flush_queued_data(port, port->ovq, VIRTIO_DEVICE(port->vser));
+    virtio_queue_set_notification(port->ovq, 1);
+    if (!port->throttled && !virtio_queue_empty(port->ovq)) {
+        virtio_queue_set_notification(port->ovq, 0);
+        qemu_bh_schedule(port->bh);
+    }
 }
 
 void virtio_serial_throttle_port(VirtIOSerialPort *port, bool throttle)
@@ -459,10 +600,16 @@ static void handle_output(VirtIODevice *vdev, VirtQueue *vq)
         return;
     }
 
-    if (!port->throttled) {
-        do_flush_queued_data(port, vq, vdev);
+    if (port->throttled) {
+        return;
+    }
+    if (port->tx_batch) {
+        /* let the guest queue more before we look, see flush_queued_data_bh */
+        virtio_queue_set_notification(vq, 0);
+        qemu_bh_schedule(port->bh);
         return;
     }
+    do_flush_queued_data(port, vq, vdev);
 }
 
 static void handle_input(VirtIODevice *vdev, VirtQueue *vq)
@@ -779,6 +926,7 @@ static void virtser_bus_dev_print(Monitor *mon, DeviceState *qdev, int indent);
 static Property virtser_props[] = {
     DEFINE_PROP_UINT32("nr", VirtIOSerialPort, id, VIRTIO_CONSOLE_BAD_ID),
     DEFINE_PROP_STRING("name", VirtIOSerialPort, name),
+    DEFINE_PROP_BOOL("tx_batch", VirtIOSerialPort, tx_batch, false),
     DEFINE_PROP_END_OF_LIST()
 };
 
@@ -955,6 +1103,7 @@ static void virtser_port_device_unrealize(DeviceState *dev, Error **errp)
     VirtIOSerial *vser = port->vser;
 
     qemu_bh_delete(port->bh);
+    g_free(port->batch);
     remove_port(port->vser, port->id);
 
     QTAILQ_REMOVE(&vser->ports, port, next);
@@ -983,6 +1132,14 @@ static void virtio_serial_device_realize(DeviceState *dev, Error **errp)
         return;
     }
 
+    if (vser->serial.vq_size < 2 ||
+        vser->serial.vq_size > VIRTQUEUE_MAX_SIZE ||
+        (vser->serial.vq_size & (vser->serial.vq_size - 1))) {
+        error_setg(errp, "vq_size must be a power of 2 between 2 and %d",
+                   VIRTQUEUE_MAX_SIZE);
+        return;
+    }
+
     /* We don't support emergency write, skip it for now. */
     /* TODO: cleaner fix, depending on host features. */
     virtio_init(vdev, "virtio-serial", VIRTIO_ID_CONSOLE,
@@ -1002,9 +1159,10 @@ static void virtio_serial_device_realize(DeviceState *dev, Error **errp)
                           * sizeof(VirtQueue *));
 
     /* Add a queue for host to guest transfers for port 0 (backward compat) */
-    vser->ivqs[0] = virtio_add_queue(vdev, 128, handle_input);
+    vser->ivqs[0] = virtio_add_queue(vdev, vser->serial.vq_size, handle_input);
     /* Add a queue for guest to host transfers for port 0 (backward compat) */
-    vser->ovqs[0] = virtio_add_queue(vdev, 128, handle_output);
+    vser->ovqs[0] = virtio_add_queue(vdev, vser->serial.vq_size,
+                                     handle_output);
 
     /* TODO: host to guest notifications can get dropped
      * if the queue fills up. Implement queueing in host,
@@ -1019,9 +1177,11 @@ static void virtio_serial_device_realize(DeviceState *dev, Error **errp)
 
     for (i = 1; i < vser->bus.max_nr_ports; i++) {
         /* Add a per-port queue for host to guest transfers */
-        vser->ivqs[i] = virtio_add_queue(vdev, 128, handle_input);
+        vser->ivqs[i] = virtio_add_queue(vdev, vser->serial.vq_size,
+                                         handle_input);
         /* Add a per-per queue for guest to host transfers */
-        vser->ovqs[i] = virtio_add_queue(vdev, 128, handle_output);
+        vser->ovqs[i] = virtio_add_queue(vdev, vser->serial.vq_size,
+                                         handle_output);
     }
 
     vser->ports_map = g_malloc0(((vser->serial.max_virtserial_ports + 31) / 32)
@@ -1088,6 +1248,7 @@ static void virtio_serial_device_unrealize(DeviceState *dev, Error **errp)
 static Property virtio_serial_properties[] = {
     DEFINE_PROP_UINT32("max_ports", VirtIOSerial, serial.max_virtserial_ports,
                                                   31),
+    DEFINE_PROP_UINT32("vq_size", VirtIOSerial, serial.vq_size, 128),
     DEFINE_PROP_END_OF_LIST(),
 };
 
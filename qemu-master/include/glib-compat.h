@@ -23,6 +23,12 @@
 #define G_TIME_SPAN_SECOND              (G_GINT64_CONSTANT(1000000))
 #endif
 
+#ifndef G_SOURCE_CONTINUE
+/* added in glib 2.32, for the return value of GSourceFunc */
+#define G_SOURCE_CONTINUE TRUE
+#define G_SOURCE_REMOVE FALSE
+#endif
+
 #if !GLIB_CHECK_VERSION(2, 28, 0)
 static inline gint64 qemu_g_get_monotonic_time(void)
 {
@@ -135,6 +141,22 @@ static inline void (g_cond_wait)(CompatGCond *cond, CompatGMutex *mutex)
 }
 #undef g_cond_wait
 
+static inline gboolean (g_cond_wait_until)(CompatGCond *cond,
+                                           CompatGMutex *mutex,
+                                           gint64 end_time)
+{
+    gint64 diff = end_time - g_get_monotonic_time();
+    GTimeVal time;
+
+    g_assert(mutex->once.status != G_ONCE_STATUS_PROGRESS);
+    g_once(&cond->once, do_g_cond_new, NULL);
+    g_get_current_time(&time);
+    g_time_val_add(&time, diff);
+    return g_cond_timed_wait((GCond *) cond->once.retval,
+                             (GMutex *) mutex->once.retval, &time);
+}
+#undef g_cond_wait_until
+
 static inline void (g_cond_broadcast)(CompatGCond *cond)
 {
     g_once(&cond->once, do_g_cond_new, NULL);
@@ -22,6 +22,8 @@
 struct virtio_serial_conf {
     /* Max. number of ports we can have for a virtio-serial device */
     uint32_t max_virtserial_ports;
+    /* Size of the data queues of every port */
+    uint32_t vq_size;
 };
 
 #define TYPE_VIRTIO_SERIAL_PORT "virtio-serial-port"
@@ -78,6 +80,12 @@ typedef struct VirtIOSerialPortClass {
      */
     ssize_t (*have_data)(VirtIOSerialPort *port, const uint8_t *buf,
                          ssize_t len);
+    /*
+     * Optional: like have_data, for all the buffers of one or more
+     * elements at once, so that the app can pass them on in one go.
+     */
+    ssize_t (*have_datav)(VirtIOSerialPort *port, const struct iovec *iov,
+                          int iovcnt);
 } VirtIOSerialPortClass;
 
 /*
@@ -131,6 +139,13 @@ struct VirtIOSerialPort {
     uint32_t iov_idx;
     uint64_t iov_offset;
 
+    /*
+     * Elements popped after elem to pass to have_datav in the same call,
+     * with tx_batch.  Whatever the app does not take is put back in the
+     * queue before returning, so these are never kept across calls.
+     */
+    VirtQueueElement *batch;
+
     /*
      * When unthrottling we use a bottom-half to call flush_queued_data.
      */
@@ -142,6 +157,12 @@ struct VirtIOSerialPort {
     bool host_connected;
     /* Do apps not want to receive data? */
     bool throttled;
+    /*
+     * Consume guest output from a bottom-half with notifications off,
+     * so that the guest can queue many buffers per kick.  Meant for bulk
+     * traffic such as the guest agent's.
+     */
+    bool tx_batch;
 };
 
 /* The virtio-serial bus on top of which the ports will ride as devices */
@@ -29,6 +29,9 @@ typedef enum QmpCommandOptions
 {
     QCO_NO_OPTIONS = 0x0,
     QCO_NO_SUCCESS_RESP = 0x1,
+    QCO_WORKER = 0x2,
+    QCO_CACHEABLE = 0x4,
+    QCO_READ_ONLY = 0x8,
 } QmpCommandOptions;
 
 typedef struct QmpCommand
@@ -39,17 +42,26 @@ typedef struct QmpCommand
     QmpCommandOptions options;
     QTAILQ_ENTRY(QmpCommand) node;
     bool enabled;
+    /* result of a QCO_CACHEABLE command, valid for cached_generation */
+    QObject *cached_ret;
+    unsigned int cached_generation;
 } QmpCommand;
 
 void qmp_register_command(const char *name, QmpCommandFunc *fn,
                           QmpCommandOptions options);
 QmpCommand *qmp_find_command(const char *name);
 QObject *qmp_dispatch(QObject *request);
+QObject *qmp_dispatch_command(QmpCommand *cmd, QObject *request);
 void qmp_disable_command(const char *name);
 void qmp_enable_command(const char *name);
 bool qmp_command_is_enabled(const QmpCommand *cmd);
 const char *qmp_command_name(const QmpCommand *cmd);
 bool qmp_has_success_response(const QmpCommand *cmd);
+bool qmp_command_runs_on_worker(const QmpCommand *cmd);
+bool qmp_command_is_read_only(const QmpCommand *cmd);
+QObject *qmp_command_get_cached(QmpCommand *cmd);
+void qmp_command_set_cached(QmpCommand *cmd, QObject *ret);
+void qmp_invalidate_cached_results(void);
 QObject *qmp_build_error_object(Error *err);
 typedef void (*qmp_cmd_callback_fn)(QmpCommand *cmd, void *opaque);
 void qmp_for_each_command(qmp_cmd_callback_fn fn, void *opaque);
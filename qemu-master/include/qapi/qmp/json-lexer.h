@@ -40,6 +40,8 @@ struct JSONLexer
     int x, y;
 };
 
+size_t json_plain_prefix(const char *ptr, size_t len, char quote);
+
 void json_lexer_init(JSONLexer *lexer, JSONLexerEmitter func);
 
 int json_lexer_feed(JSONLexer *lexer, const char *buffer, size_t size);
@@ -20,17 +20,25 @@
 #include <stdint.h>
 
 #define QDICT_BUCKET_MAX 512
+/* up to this many entries, a QDict is a single list searched linearly */
+#define QDICT_SMALL_MAX 16
 
 typedef struct QDictEntry {
     char *key;
     QObject *value;
+    unsigned int hash;
     QLIST_ENTRY(QDictEntry) next;
 } QDictEntry;
 
 typedef struct QDict {
     QObject_HEAD;
     size_t size;
-    QLIST_HEAD(,QDictEntry) table[QDICT_BUCKET_MAX];
+    /* 1 while the QDict is small and table is &small, QDICT_BUCKET_MAX
+     * once it grew past QDICT_SMALL_MAX entries
+     */
+    unsigned int buckets;
+    QLIST_HEAD(QDictBucket, QDictEntry) *table;
+    struct QDictBucket small;
 } QDict;
 
 /* Object API */
@@ -26,4 +26,7 @@ QObject *qobject_from_jsonv(const char *string, va_list *ap) GCC_FMT_ATTR(1, 0);
 QString *qobject_to_json(const QObject *obj);
 QString *qobject_to_json_pretty(const QObject *obj);
 
+void qjson_append_str(QString *str, const char *value);
+void qjson_append_number(QString *str, double value);
+
 #endif /* QJSON_H */
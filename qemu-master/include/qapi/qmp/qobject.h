@@ -44,6 +44,7 @@ typedef enum {
     QTYPE_QLIST,
     QTYPE_QFLOAT,
     QTYPE_QBOOL,
+    QTYPE_QRAWJSON,
     QTYPE_MAX,
 } qtype_code;
 
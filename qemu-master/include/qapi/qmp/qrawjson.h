@@ -0,0 +1,28 @@
+/*
+ * QRawJSON Module
+ *
+ * A value that has already been serialized to JSON text, for producers
+ * that write JSON directly instead of building a QObject tree first.
+ * qobject_to_json() emits the text as is; nothing parses it back.
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2.1 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#ifndef QRAWJSON_H
+#define QRAWJSON_H
+
+#include "qapi/qmp/qobject.h"
+#include "qapi/qmp/qstring.h"
+
+typedef struct QRawJSON {
+    QObject_HEAD;
+    QString *json;
+} QRawJSON;
+
+QRawJSON *qrawjson_from_qstring(QString *json);
+QString *qrawjson_get_qstring(const QRawJSON *qrj);
+QRawJSON *qobject_to_qrawjson(const QObject *obj);
+
+#endif /* QRAWJSON_H */
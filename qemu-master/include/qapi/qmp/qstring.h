@@ -30,7 +30,9 @@ size_t qstring_get_length(const QString *qstring);
 const char *qstring_get_str(const QString *qstring);
 void qstring_append_int(QString *qstring, int64_t value);
 void qstring_append(QString *qstring, const char *str);
+void qstring_append_len(QString *qstring, const char *str, size_t len);
 void qstring_append_chr(QString *qstring, int c);
+void qstring_reserve(QString *qstring, size_t len);
 QString *qobject_to_qstring(const QObject *obj);
 
 #endif /* QSTRING_H */
@@ -0,0 +1,35 @@
+/*
+ * Base64 encoding and decoding
+ *
+ * Copyright (c) 2015 Red Hat, Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_BASE64_H
+#define QEMU_BASE64_H
+
+#include "qemu-common.h"
+
+/* Number of characters qemu_base64_encode() makes of @len bytes, not
+ * counting the terminating NUL
+ */
+static inline size_t qemu_base64_encoded_len(size_t len)
+{
+    return (len + 2) / 3 * 4;
+}
+
+/* Size of the buffer qemu_base64_decode_buf() needs for @len characters,
+ * which is a little more than it writes
+ */
+static inline size_t qemu_base64_decoded_max(size_t len)
+{
+    return len / 4 * 3 + 3;
+}
+
+char *qemu_base64_encode(const void *in, size_t len);
+size_t qemu_base64_decode_buf(const char *in, size_t len, uint8_t *out);
+uint8_t *qemu_base64_decode(const char *in, size_t *out_len);
+
+#endif
@@ -0,0 +1,25 @@
+/*
+ * Pool of large buffers
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_BUFFER_POOL_H
+#define QEMU_BUFFER_POOL_H
+
+#include "qemu-common.h"
+
+/* buffers of at least this size are rounded up to a power of two, and
+ * those up to QEMU_BUFFER_POOL_MAX are kept for reuse once freed
+ */
+#define QEMU_BUFFER_POOL_MIN    (128 * 1024)
+#define QEMU_BUFFER_POOL_MAX    (128 * 1024 * 1024)
+
+void *qemu_buffer_pool_alloc(size_t size);
+size_t qemu_buffer_pool_size(const void *buf);
+void qemu_buffer_pool_free(void *buf);
+size_t qemu_buffer_pool_idle(void);
+size_t qemu_buffer_pool_trim(int64_t idle_us);
+
+#endif
@@ -57,6 +57,8 @@ struct CharDriverState {
     QemuMutex chr_write_lock;
     void (*init)(struct CharDriverState *s);
     int (*chr_write)(struct CharDriverState *s, const uint8_t *buf, int len);
+    int (*chr_writev)(struct CharDriverState *s, const struct iovec *iov,
+                      int iovcnt);
     int (*chr_sync_read)(struct CharDriverState *s,
                          const uint8_t *buf, int len);
     GSource *(*chr_add_watch)(struct CharDriverState *s, GIOCondition cond);
@@ -188,6 +190,21 @@ int qemu_chr_fe_add_watch(CharDriverState *s, GIOCondition cond,
  */
 int qemu_chr_fe_write(CharDriverState *s, const uint8_t *buf, int len);
 
+/**
+ * @qemu_chr_fe_writev:
+ *
+ * Like @qemu_chr_fe_write, for data scattered over several buffers.  A
+ * back end that supports it sends them with a single system call.  This
+ * function is thread-safe.
+ *
+ * @iov the buffers
+ * @iovcnt the number of buffers
+ *
+ * Returns: the number of bytes consumed
+ */
+int qemu_chr_fe_writev(CharDriverState *s, const struct iovec *iov,
+                       int iovcnt);
+
 /**
  * @qemu_chr_fe_write_all:
  *
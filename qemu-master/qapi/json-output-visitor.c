@@ -0,0 +1,218 @@
+/*
+ * JSON Output Visitor
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2.1 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#include "qapi/json-output-visitor.h"
+#include "qapi/visitor-impl.h"
+#include "qemu/queue.h"
+#include "qemu-common.h"
+#include "qapi/qmp/types.h"
+
+/* an object or array that is still open */
+typedef struct JsonStackEntry
+{
+    bool is_list;
+    bool is_list_head;
+    unsigned int count;
+    QTAILQ_ENTRY(JsonStackEntry) node;
+} JsonStackEntry;
+
+struct JsonOutputVisitor
+{
+    Visitor visitor;
+    QTAILQ_HEAD(, JsonStackEntry) stack;
+    QString *str;
+};
+
+static JsonOutputVisitor *to_jov(Visitor *v)
+{
+    return container_of(v, JsonOutputVisitor, visitor);
+}
+
+static void json_output_push(JsonOutputVisitor *jov, bool is_list)
+{
+    JsonStackEntry *e = g_slice_new0(JsonStackEntry);
+
+    e->is_list = is_list;
+    e->is_list_head = is_list;
+    QTAILQ_INSERT_HEAD(&jov->stack, e, node);
+}
+
+static void json_output_pop(JsonOutputVisitor *jov)
+{
+    JsonStackEntry *e = QTAILQ_FIRST(&jov->stack);
+
+    QTAILQ_REMOVE(&jov->stack, e, node);
+    g_slice_free(JsonStackEntry, e);
+}
+
+/* start the next member of the innermost object or array; the name of
+ * the outermost value, or of array elements, is not emitted
+ */
+static void json_output_name(JsonOutputVisitor *jov, const char *name)
+{
+    JsonStackEntry *e = QTAILQ_FIRST(&jov->stack);
+
+    if (!e) {
+        return;
+    }
+    if (e->count++) {
+        qstring_append(jov->str, ", ");
+    }
+    if (!e->is_list) {
+        qjson_append_str(jov->str, name);
+        qstring_append(jov->str, ": ");
+    }
+}
+
+static void json_output_start_struct(Visitor *v, void **obj, const char *kind,
+                                     const char *name, size_t unused,
+                                     Error **errp)
+{
+    JsonOutputVisitor *jov = to_jov(v);
+
+    json_output_name(jov, name);
+    qstring_append(jov->str, "{");
+    json_output_push(jov, false);
+}
+
+static void json_output_end_struct(Visitor *v, Error **errp)
+{
+    JsonOutputVisitor *jov = to_jov(v);
+
+    json_output_pop(jov);
+    qstring_append(jov->str, "}");
+}
+
+static void json_output_start_list(Visitor *v, const char *name, Error **errp)
+{
+    JsonOutputVisitor *jov = to_jov(v);
+
+    json_output_name(jov, name);
+    qstring_append(jov->str, "[");
+    json_output_push(jov, true);
+}
+
+static GenericList *json_output_next_list(Visitor *v, GenericList **listp,
+                                          Error **errp)
+{
+    GenericList *list = *listp;
+    JsonOutputVisitor *jov = to_jov(v);
+    JsonStackEntry *e = QTAILQ_FIRST(&jov->stack);
+
+    assert(e);
+    if (e->is_list_head) {
+        e->is_list_head = false;
+        return list;
+    }
+
+    return list ? list->next : NULL;
+}
+
+static void json_output_end_list(Visitor *v, Error **errp)
+{
+    JsonOutputVisitor *jov = to_jov(v);
+
+    json_output_pop(jov);
+    qstring_append(jov->str, "]");
+}
+
+static void json_output_type_int(Visitor *v, int64_t *obj, const char *name,
+                                 Error **errp)
+{
+    JsonOutputVisitor *jov = to_jov(v);
+
+    json_output_name(jov, name);
+    qstring_append_int(jov->str, *obj);
+}
+
+static void json_output_type_bool(Visitor *v, bool *obj, const char *name,
+                                  Error **errp)
+{
+    JsonOutputVisitor *jov = to_jov(v);
+
+    json_output_name(jov, name);
+    qstring_append(jov->str, *obj ? "true" : "false");
+}
+
+static void json_output_type_str(Visitor *v, char **obj, const char *name,
+                                 Error **errp)
+{
+    JsonOutputVisitor *jov = to_jov(v);
+
+    json_output_name(jov, name);
+    qjson_append_str(jov->str, *obj ? *obj : "");
+}
+
+static void json_output_type_number(Visitor *v, double *obj, const char *name,
+                                    Error **errp)
+{
+    JsonOutputVisitor *jov = to_jov(v);
+
+    json_output_name(jov, name);
+    qjson_append_number(jov->str, *obj);
+}
+
+static void json_output_type_any(Visitor *v, QObject **obj, const char *name,
+                                 Error **errp)
+{
+    JsonOutputVisitor *jov = to_jov(v);
+    QString *json = qobject_to_json(*obj);
+
+    json_output_name(jov, name);
+    qstring_append(jov->str, qstring_get_str(json));
+    QDECREF(json);
+}
+
+/* the JSON text visited so far, as a QRawJSON */
+QObject *json_output_get_qobject(JsonOutputVisitor *jov)
+{
+    if (!qstring_get_length(jov->str)) {
+        return qnull();
+    }
+
+    QINCREF(jov->str);
+    return QOBJECT(qrawjson_from_qstring(jov->str));
+}
+
+Visitor *json_output_get_visitor(JsonOutputVisitor *v)
+{
+    return &v->visitor;
+}
+
+void json_output_visitor_cleanup(JsonOutputVisitor *v)
+{
+    while (!QTAILQ_EMPTY(&v->stack)) {
+        json_output_pop(v);
+    }
+    QDECREF(v->str);
+    g_free(v);
+}
+
+JsonOutputVisitor *json_output_visitor_new(void)
+{
+    JsonOutputVisitor *v;
+
+    v = g_malloc0(sizeof(*v));
+
+    v->visitor.start_struct = json_output_start_struct;
+    v->visitor.end_struct = json_output_end_struct;
+    v->visitor.start_list = json_output_start_list;
+    v->visitor.next_list = json_output_next_list;
+    v->visitor.end_list = json_output_end_list;
+    v->visitor.type_enum = output_type_enum;
+    v->visitor.type_int = json_output_type_int;
+    v->visitor.type_bool = json_output_type_bool;
+    v->visitor.type_str = json_output_type_str;
+    v->visitor.type_number = json_output_type_number;
+    v->visitor.type_any = json_output_type_any;
+
+    QTAILQ_INIT(&v->stack);
+    v->str = qstring_new();
+
+    return v;
+}
@@ -18,11 +18,16 @@
 #include "qapi/error.h"
 #include "qapi/qmp/qerror.h"
 
-static QDict *qmp_dispatch_check_obj(const QObject *request, Error **errp)
+/* check the members of @request, and hand back the "execute" and
+ * "arguments" ones as they go by
+ */
+static QDict *qmp_dispatch_check_obj(const QObject *request,
+                                     const char **command, QDict **args,
+                                     Error **errp)
 {
     const QDictEntry *ent;
     const char *arg_name;
-    const QObject *arg_obj;
+    QObject *arg_obj;
     bool has_exec_key = false;
     QDict *dict = NULL;
 
@@ -45,8 +50,16 @@ static QDict *qmp_dispatch_check_obj(const QObject *request, Error **errp)
                            "string");
                 return NULL;
             }
+            *command = qstring_get_str(qobject_to_qstring(arg_obj));
             has_exec_key = true;
-        } else if (strcmp(arg_name, "arguments")) {
+        } else if (!strcmp(arg_name, "arguments")) {
+            if (qobject_type(arg_obj) != QTYPE_QDICT) {
+                error_setg(errp, QERR_QMP_BAD_INPUT_OBJECT_MEMBER,
+                           "arguments", "object");
+                return NULL;
+            }
+            *args = qobject_to_qdict(arg_obj);
+        } else {
             error_setg(errp, QERR_QMP_EXTRA_MEMBER, arg_name);
             return NULL;
         }
@@ -60,21 +73,24 @@ static QDict *qmp_dispatch_check_obj(const QObject *request, Error **errp)
     return dict;
 }
 
-static QObject *do_qmp_dispatch(QObject *request, Error **errp)
+static QObject *do_qmp_dispatch(QmpCommand *cmd, QObject *request,
+                                Error **errp)
 {
     Error *local_err = NULL;
-    const char *command;
-    QDict *args, *dict;
-    QmpCommand *cmd;
+    const char *command = NULL;
+    QDict *args = NULL, *dict;
     QObject *ret = NULL;
+    bool cacheable;
 
-    dict = qmp_dispatch_check_obj(request, errp);
+    dict = qmp_dispatch_check_obj(request, &command, &args, errp);
     if (!dict) {
         return NULL;
     }
 
-    command = qdict_get_str(dict, "execute");
-    cmd = qmp_find_command(command);
+    if (cmd == NULL) {
+        cmd = qmp_find_command(command);
+    }
+    g_assert(!cmd || strcmp(cmd->name, command) == 0);
     if (cmd == NULL) {
         error_set(errp, ERROR_CLASS_COMMAND_NOT_FOUND,
                   "The command %s has not been found", command);
@@ -86,13 +102,20 @@ static QObject *do_qmp_dispatch(QObject *request, Error **errp)
         return NULL;
     }
 
-    if (!qdict_haskey(dict, "arguments")) {
+    if (!args) {
         args = qdict_new();
     } else {
-        args = qdict_get_qdict(dict, "arguments");
         QINCREF(args);
     }
 
+    /* the same call would return the same thing, answer from the cache */
+    cacheable = (cmd->options & QCO_CACHEABLE) && !qdict_size(args);
+    ret = cacheable ? qmp_command_get_cached(cmd) : NULL;
+    if (ret) {
+        QDECREF(args);
+        return ret;
+    }
+
     switch (cmd->type) {
     case QCT_NORMAL:
         cmd->fn(args, &ret, &local_err);
@@ -105,6 +128,9 @@ static QObject *do_qmp_dispatch(QObject *request, Error **errp)
         }
         break;
     }
+    if (cacheable && ret) {
+        qmp_command_set_cached(cmd, ret);
+    }
 
     QDECREF(args);
 
@@ -118,13 +144,17 @@ QObject *qmp_build_error_object(Error *err)
                               error_get_pretty(err));
 }
 
-QObject *qmp_dispatch(QObject *request)
+/*
+ * Like qmp_dispatch(), for a caller that already looked up the command
+ * @request executes; @cmd may be NULL to have it looked up here.
+ */
+QObject *qmp_dispatch_command(QmpCommand *cmd, QObject *request)
 {
     Error *err = NULL;
     QObject *ret;
     QDict *rsp;
 
-    ret = do_qmp_dispatch(request, &err);
+    ret = do_qmp_dispatch(cmd, request, &err);
 
     rsp = qdict_new();
     if (err) {
@@ -139,3 +169,8 @@ QObject *qmp_dispatch(QObject *request)
 
     return QOBJECT(rsp);
 }
+
+QObject *qmp_dispatch(QObject *request)
+{
+    return qmp_dispatch_command(NULL, request);
+}
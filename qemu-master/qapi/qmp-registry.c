@@ -18,6 +18,10 @@
 
 static QTAILQ_HEAD(QmpCommandList, QmpCommand) qmp_commands =
     QTAILQ_HEAD_INITIALIZER(qmp_commands);
+/* the same commands by name, the list keeps registration order */
+static GHashTable *qmp_command_table;
+/* bumped whenever cached command results may have gone stale */
+static unsigned int qmp_cache_generation;
 
 void qmp_register_command(const char *name, QmpCommandFunc *fn,
                           QmpCommandOptions options)
@@ -30,29 +34,29 @@ void qmp_register_command(const char *name, QmpCommandFunc *fn,
     cmd->enabled = true;
     cmd->options = options;
     QTAILQ_INSERT_TAIL(&qmp_commands, cmd, node);
+
+    if (!qmp_command_table) {
+        qmp_command_table = g_hash_table_new(g_str_hash, g_str_equal);
+    }
+    g_hash_table_insert(qmp_command_table, (gpointer)name, cmd);
+    qmp_invalidate_cached_results();
 }
 
 QmpCommand *qmp_find_command(const char *name)
 {
-    QmpCommand *cmd;
-
-    QTAILQ_FOREACH(cmd, &qmp_commands, node) {
-        if (strcmp(cmd->name, name) == 0) {
-            return cmd;
-        }
+    if (!qmp_command_table) {
+        return NULL;
     }
-    return NULL;
+    return g_hash_table_lookup(qmp_command_table, name);
 }
 
 static void qmp_toggle_command(const char *name, bool enabled)
 {
-    QmpCommand *cmd;
+    QmpCommand *cmd = qmp_find_command(name);
 
-    QTAILQ_FOREACH(cmd, &qmp_commands, node) {
-        if (strcmp(cmd->name, name) == 0) {
-            cmd->enabled = enabled;
-            return;
-        }
+    if (cmd && cmd->enabled != enabled) {
+        cmd->enabled = enabled;
+        qmp_invalidate_cached_results();
     }
 }
 
@@ -81,6 +85,45 @@ bool qmp_has_success_response(const QmpCommand *cmd)
     return !(cmd->options & QCO_NO_SUCCESS_RESP);
 }
 
+bool qmp_command_runs_on_worker(const QmpCommand *cmd)
+{
+    return cmd->options & QCO_WORKER;
+}
+
+bool qmp_command_is_read_only(const QmpCommand *cmd)
+{
+    return cmd->options & QCO_READ_ONLY;
+}
+
+/* a new reference to the stored result of @cmd, or NULL if there is none
+ * or it is stale
+ */
+QObject *qmp_command_get_cached(QmpCommand *cmd)
+{
+    if (!cmd->cached_ret || cmd->cached_generation != qmp_cache_generation) {
+        return NULL;
+    }
+    qobject_incref(cmd->cached_ret);
+    return cmd->cached_ret;
+}
+
+void qmp_command_set_cached(QmpCommand *cmd, QObject *ret)
+{
+    qobject_incref(ret);
+    qobject_decref(cmd->cached_ret);
+    cmd->cached_ret = ret;
+    cmd->cached_generation = qmp_cache_generation;
+}
+
+/*
+ * Drop all cached results.  Enabling or disabling a command does this
+ * already; call it for other changes that show in a QCO_CACHEABLE result.
+ */
+void qmp_invalidate_cached_results(void)
+{
+    qmp_cache_generation++;
+}
+
 void qmp_for_each_command(qmp_cmd_callback_fn fn, void *opaque)
 {
     QmpCommand *cmd;
@@ -26,6 +26,7 @@
 #include "sysemu/sysemu.h"
 #include "qemu/error-report.h"
 #include "qemu/timer.h"
+#include "qemu/iov.h"
 #include "sysemu/char.h"
 #include "hw/usb.h"
 #include "qmp-commands.h"
@@ -222,6 +223,31 @@ int qemu_chr_fe_write(CharDriverState *s, const uint8_t *buf, int len)
     return ret;
 }
 
+int qemu_chr_fe_writev(CharDriverState *s, const struct iovec *iov,
+                       int iovcnt)
+{
+    int ret = 0, res, i;
+
+    qemu_mutex_lock(&s->chr_write_lock);
+    if (s->chr_writev) {
+        ret = s->chr_writev(s, iov, iovcnt);
+    } else {
+        for (i = 0; i < iovcnt; i++) {
+            res = s->chr_write(s, iov[i].iov_base, iov[i].iov_len);
+            if (res < 0) {
+                ret = ret ? ret : res;
+                break;
+            }
+            ret += res;
+            if (res < iov[i].iov_len) {
+                break;
+            }
+        }
+    }
+    qemu_mutex_unlock(&s->chr_write_lock);
+    return ret;
+}
+
 int qemu_chr_fe_write_all(CharDriverState *s, const uint8_t *buf, int len)
 {
     int offset = 0;
@@ -2554,6 +2580,10 @@ static CharDriverState *qemu_chr_open_udp_fd(int fd)
 /***********************************************************/
 /* TCP Net console */
 
+/* large enough for a bulk stream, such as the guest agent's, to go
+ * through in few reads */
+#define TCP_READ_BUF_LEN (64 * 1024)
+
 typedef struct {
 
     GIOChannel *chan, *listen_chan;
@@ -2576,6 +2606,8 @@ typedef struct {
     guint reconnect_timer;
     int64_t reconnect_time;
     bool connect_err_reported;
+
+    uint8_t read_buf[TCP_READ_BUF_LEN];
 } TCPCharDriver;
 
 static gboolean socket_reconnect_timeout(gpointer opaque);
@@ -2604,11 +2636,11 @@ static void check_report_connect_error(CharDriverState *chr,
 static gboolean tcp_chr_accept(GIOChannel *chan, GIOCondition cond, void *opaque);
 
 #ifndef _WIN32
-static int unix_send_msgfds(CharDriverState *chr, const uint8_t *buf, int len)
+static int unix_send_msgfds(CharDriverState *chr, const struct iovec *iov,
+                            int iovcnt)
 {
     TCPCharDriver *s = chr->opaque;
     struct msghdr msgh;
-    struct iovec iov;
     int r;
 
     size_t fd_size = s->write_msgfds_num * sizeof(int);
@@ -2619,11 +2651,8 @@ static int unix_send_msgfds(CharDriverState *chr, const uint8_t *buf, int len)
     memset(control, 0, sizeof(control));
 
     /* set the payload */
-    iov.iov_base = (uint8_t *) buf;
-    iov.iov_len = len;
-
-    msgh.msg_iov = &iov;
-    msgh.msg_iovlen = 1;
+    msgh.msg_iov = (struct iovec *)iov;
+    msgh.msg_iovlen = iovcnt;
 
     msgh.msg_control = control;
     msgh.msg_controllen = sizeof(control);
@@ -2648,6 +2677,27 @@ static int unix_send_msgfds(CharDriverState *chr, const uint8_t *buf, int len)
 
     return r;
 }
+
+/* Called with chr_write_lock held.  */
+static int tcp_chr_writev(CharDriverState *chr, const struct iovec *iov,
+                          int iovcnt)
+{
+    TCPCharDriver *s = chr->opaque;
+    ssize_t r;
+
+    if (!s->connected) {
+        /* like tcp_chr_write, drop it */
+        return iov_size(iov, iovcnt);
+    }
+    iovcnt = MIN(iovcnt, IOV_MAX);
+    if (s->is_unix && s->write_msgfds_num) {
+        return unix_send_msgfds(chr, iov, iovcnt);
+    }
+    do {
+        r = writev(s->fd, iov, iovcnt);
+    } while (r < 0 && errno == EINTR);
+    return r;
+}
 #endif
 
 /* Called with chr_write_lock held.  */
@@ -2657,7 +2707,9 @@ static int tcp_chr_write(CharDriverState *chr, const uint8_t *buf, int len)
     if (s->connected) {
 #ifndef _WIN32
         if (s->is_unix && s->write_msgfds_num) {
-            return unix_send_msgfds(chr, buf, len);
+            struct iovec iov = { .iov_base = (uint8_t *)buf, .iov_len = len };
+
+            return unix_send_msgfds(chr, &iov, 1);
         } else
 #endif
         {
@@ -2900,13 +2952,13 @@ static gboolean tcp_chr_read(GIOChannel *chan, GIOCondition cond, void *opaque)
 {
     CharDriverState *chr = opaque;
     TCPCharDriver *s = chr->opaque;
-    uint8_t buf[READ_BUF_LEN];
+    uint8_t *buf = s->read_buf;
     int len, size;
 
     if (!s->connected || s->max_size <= 0) {
         return TRUE;
     }
-    len = sizeof(buf);
+    len = sizeof(s->read_buf);
     if (len > s->max_size)
         len = s->max_size;
     size = tcp_chr_recv(chr, (void *)buf, len);
@@ -4224,6 +4276,9 @@ static CharDriverState *qmp_chardev_open_socket(const char *id,
 
     chr->opaque = s;
     chr->chr_write = tcp_chr_write;
+#ifndef _WIN32
+    chr->chr_writev = tcp_chr_writev;
+#endif
     chr->chr_sync_read = tcp_chr_sync_read;
     chr->chr_close = tcp_chr_close;
     chr->get_msgfds = tcp_get_msgfds;
@@ -5,33 +5,103 @@
 #include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
+#include <poll.h>
 #include "qemu/osdep.h"
 #include "qemu/sockets.h"
+#include "qemu/iov.h"
+#include "qga/guest-agent-core.h"
 #include "qga/channel.h"
 
 #ifdef CONFIG_SOLARIS
 #include <stropts.h>
 #endif
+#ifdef CONFIG_AF_VSOCK
+#include <linux/vm_sockets.h>
+#endif
 
 #define GA_CHANNEL_BAUDRATE_DEFAULT B38400 /* for isa-serial channels */
 
+/* the line speeds an isa-serial channel can be switched to */
+static const struct {
+    int speed;
+    speed_t baud;
+} ga_channel_bauds[] = {
+    { 9600, B9600 },
+    { 19200, B19200 },
+    { 38400, B38400 },
+    { 57600, B57600 },
+    { 115200, B115200 },
+#ifdef B230400
+    { 230400, B230400 },
+#endif
+#ifdef B460800
+    { 460800, B460800 },
+#endif
+#ifdef B921600
+    { 921600, B921600 },
+#endif
+#ifdef B1500000
+    { 1500000, B1500000 },
+#endif
+#ifdef B3000000
+    { 3000000, B3000000 },
+#endif
+#ifdef B4000000
+    { 4000000, B4000000 },
+#endif
+};
+
+/* the receive buffer doubles when a read fills it, up to this size */
+#define GA_CHANNEL_READ_MAX (1024 * 1024)
+
+/* stop reading requests from a client while this much output is queued
+ * for it, and start again once it has come down to the low mark
+ */
+#define GA_CHANNEL_OUT_HIGH (1024 * 1024)
+#define GA_CHANNEL_OUT_LOW (256 * 1024)
+
+/* how often to look for the host while nothing is attached, in ms */
+#define GA_CHANNEL_HOST_POLL_MIN 10
+#define GA_CHANNEL_HOST_POLL_MAX 1000
+
+/* how long a speed change waits for queued output to go out, in ms */
+#define GA_CHANNEL_SPEED_FLUSH_MS 5000
+
+struct GAChannelClient {
+    GAChannel *channel;
+    GIOChannel *io;
+    guint watch;
+    gchar *buf;
+    gsize buf_size;
+    GByteArray *out;            /* output the client has not taken yet */
+    gsize out_pos;
+    guint out_watch;
+    gpointer data;
+    GDestroyNotify destroy;
+    bool host_gone;             /* virtio-serial: no host process attached */
+    guint host_poll_source;
+    guint host_poll_ms;
+};
+
 struct GAChannel {
     GIOChannel *listen_channel;
-    GIOChannel *client_channel;
+    guint listen_watch;
+    GList *clients;
     GAChannelMethod method;
     GAChannelCallback event_cb;
     gpointer user_data;
 };
 
 static int ga_channel_client_add(GAChannel *c, int fd);
+static gboolean ga_channel_client_event(GIOChannel *channel,
+                                        GIOCondition condition, gpointer data);
 
 static gboolean ga_channel_listen_accept(GIOChannel *channel,
                                          GIOCondition condition, gpointer data)
 {
     GAChannel *c = data;
     int ret, client_fd;
-    bool accepted = false;
-    struct sockaddr_un addr;
+    struct sockaddr_storage addr;
     socklen_t addrlen = sizeof(addr);
 
     g_assert(channel != NULL);
@@ -40,20 +110,22 @@ static gboolean ga_channel_listen_accept(GIOChannel *channel,
                             (struct sockaddr *)&addr, &addrlen);
     if (client_fd == -1) {
         g_warning("error converting fd to gsocket: %s", strerror(errno));
-        goto out;
+        return true;
     }
     qemu_set_nonblock(client_fd);
     ret = ga_channel_client_add(c, client_fd);
     if (ret) {
         g_warning("error setting up connection");
         close(client_fd);
-        goto out;
+        return true;
     }
-    accepted = true;
 
-out:
-    /* only accept 1 connection at a time */
-    return !accepted;
+    /* stop accepting once full, ga_channel_client_close() resumes */
+    if (g_list_length(c->clients) < GA_CHANNEL_MAX_CLIENTS) {
+        return true;
+    }
+    c->listen_watch = 0;
+    return false;
 }
 
 /* start polling for readable events on listen fd, new==true
@@ -64,28 +136,91 @@ static void ga_channel_listen_add(GAChannel *c, int listen_fd, bool create)
     if (create) {
         c->listen_channel = g_io_channel_unix_new(listen_fd);
     }
-    g_io_add_watch(c->listen_channel, G_IO_IN, ga_channel_listen_accept, c);
+    c->listen_watch = ga_io_add_watch(c->listen_channel, G_IO_IN,
+                                      ga_channel_listen_accept, c);
 }
 
 static void ga_channel_listen_close(GAChannel *c)
 {
-    g_assert(c->method == GA_CHANNEL_UNIX_LISTEN);
+    g_assert(c->method == GA_CHANNEL_UNIX_LISTEN ||
+             c->method == GA_CHANNEL_VSOCK_LISTEN);
     g_assert(c->listen_channel);
+    if (c->listen_watch) {
+        ga_io_remove_watch(c->listen_watch);
+        c->listen_watch = 0;
+    }
     g_io_channel_shutdown(c->listen_channel, true, NULL);
     g_io_channel_unref(c->listen_channel);
     c->listen_channel = NULL;
 }
 
+/* a virtio-serial port reports POLLHUP for as long as no process has the
+ * host-side chardev open, so rather than watching the port and waking up
+ * on every main loop iteration, check it with a backing-off timer until
+ * the host shows up, then go back to watching it
+ */
+static gboolean ga_channel_host_poll(gpointer data)
+{
+    GAChannelClient *client = data;
+    struct pollfd pfd = {
+        .fd = g_io_channel_unix_get_fd(client->io),
+        .events = POLLIN,
+    };
+
+    if (poll(&pfd, 1, 0) == 1 &&
+        (pfd.revents & (POLLIN | POLLHUP)) == POLLHUP) {
+        client->host_poll_ms = MIN(client->host_poll_ms * 2,
+                                   GA_CHANNEL_HOST_POLL_MAX);
+        client->host_poll_source = g_timeout_add(client->host_poll_ms,
+                                                 ga_channel_host_poll, client);
+        return false;
+    }
+
+    g_debug("host connected to channel");
+    client->host_gone = false;
+    client->host_poll_source = 0;
+    if (client->out->len - client->out_pos <= GA_CHANNEL_OUT_LOW) {
+        client->watch = ga_io_add_watch(client->io, G_IO_IN | G_IO_HUP,
+                                        ga_channel_client_event, client);
+    }
+    return false;
+}
+
+static void ga_channel_host_wait(GAChannelClient *client)
+{
+    g_debug("no host connected to channel, waiting");
+    client->host_poll_ms = GA_CHANNEL_HOST_POLL_MIN;
+    client->host_poll_source = g_timeout_add(client->host_poll_ms,
+                                             ga_channel_host_poll, client);
+}
+
 /* cleanup state for closed connection/session, start accepting new
- * connections if we're in listening mode
+ * connections again if we're in listening mode and were full
  */
-static void ga_channel_client_close(GAChannel *c)
+static void ga_channel_client_close(GAChannelClient *client)
 {
-    g_assert(c->client_channel);
-    g_io_channel_shutdown(c->client_channel, true, NULL);
-    g_io_channel_unref(c->client_channel);
-    c->client_channel = NULL;
-    if (c->method == GA_CHANNEL_UNIX_LISTEN && c->listen_channel) {
+    GAChannel *c = client->channel;
+
+    if (client->watch) {
+        ga_io_remove_watch(client->watch);
+    }
+    if (client->host_poll_source) {
+        g_source_remove(client->host_poll_source);
+    }
+    if (client->out_watch) {
+        ga_io_remove_watch(client->out_watch);
+    }
+    g_io_channel_shutdown(client->io, true, NULL);
+    g_io_channel_unref(client->io);
+    if (client->destroy) {
+        client->destroy(client->data);
+    }
+    c->clients = g_list_remove(c->clients, client);
+    g_free(client->buf);
+    g_byte_array_free(client->out, true);
+    g_free(client);
+
+    if (c->listen_channel && !c->listen_watch) {
         ga_channel_listen_add(c, 0, false);
     }
 }
@@ -93,52 +228,119 @@ static void ga_channel_client_close(GAChannel *c)
 static gboolean ga_channel_client_event(GIOChannel *channel,
                                         GIOCondition condition, gpointer data)
 {
-    GAChannel *c = data;
+    GAChannelClient *client = data;
+    GAChannel *c = client->channel;
     gboolean client_cont;
 
     g_assert(c);
     if (c->event_cb) {
-        client_cont = c->event_cb(condition, c->user_data);
+        client_cont = c->event_cb(client, condition, c->user_data);
         if (!client_cont) {
-            ga_channel_client_close(c);
+            ga_channel_client_close(client);
             return false;
         }
     }
+    if (client->host_gone) {
+        /* drop this watch, ga_channel_host_poll() adds a new one */
+        client->watch = 0;
+        ga_channel_host_wait(client);
+        return false;
+    }
     return true;
 }
 
 static int ga_channel_client_add(GAChannel *c, int fd)
 {
+    GAChannelClient *client;
     GIOChannel *client_channel;
     GError *err = NULL;
 
-    g_assert(c && !c->client_channel);
+    g_assert(c);
     client_channel = g_io_channel_unix_new(fd);
     g_assert(client_channel);
     g_io_channel_set_encoding(client_channel, NULL, &err);
     if (err != NULL) {
         g_warning("error setting channel encoding to binary");
         g_error_free(err);
+        g_io_channel_unref(client_channel);
         return -1;
     }
-    g_io_add_watch(client_channel, G_IO_IN | G_IO_HUP,
-                   ga_channel_client_event, c);
-    c->client_channel = client_channel;
+    /* we do our own buffering, GIOChannel would refill 1 KB at a time */
+    g_io_channel_set_buffered(client_channel, false);
+    client = g_new0(GAChannelClient, 1);
+    client->channel = c;
+    client->io = client_channel;
+    client->buf_size = QGA_READ_COUNT_DEFAULT;
+    client->buf = g_malloc(client->buf_size);
+    client->out = g_byte_array_new();
+    client->watch = ga_io_add_watch(client_channel, G_IO_IN | G_IO_HUP,
+                                    ga_channel_client_event, client);
+    c->clients = g_list_append(c->clients, client);
     return 0;
 }
 
-static gboolean ga_channel_open(GAChannel *c, const gchar *path, GAChannelMethod method)
+#ifdef CONFIG_AF_VSOCK
+/* listen on @path, given as <cid>:<port> */
+static int ga_channel_vsock_listen(const gchar *path)
+{
+    struct sockaddr_vm svm = { .svm_family = AF_VSOCK };
+    unsigned long cid, port;
+    char *end;
+    int fd;
+
+    errno = 0;
+    cid = strtoul(path, &end, 10);
+    if (errno || end == path || *end != ':' || cid > UINT32_MAX) {
+        g_critical("invalid vsock address '%s', expected <cid>:<port>", path);
+        return -1;
+    }
+    port = strtoul(end + 1, &end, 10);
+    if (errno || *end || port > UINT32_MAX) {
+        g_critical("invalid vsock address '%s', expected <cid>:<port>", path);
+        return -1;
+    }
+    svm.svm_cid = cid;
+    svm.svm_port = port;
+
+    fd = qemu_socket(AF_VSOCK, SOCK_STREAM, 0);
+    if (fd == -1) {
+        g_critical("error creating vsock socket: %s", strerror(errno));
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr *)&svm, sizeof(svm)) == -1 ||
+        listen(fd, 1) == -1) {
+        g_critical("error listening on vsock address %s: %s",
+                   path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+#endif
+
+/* @fd, if not -1, is the channel passed by the service manager, or by
+ * the agent before an upgrade if @resume is set
+ */
+static gboolean ga_channel_open(GAChannel *c, const gchar *path,
+                                GAChannelMethod method, int fd, bool resume)
 {
     int ret;
     c->method = method;
 
     switch (c->method) {
     case GA_CHANNEL_VIRTIO_SERIAL: {
-        int fd = qemu_open(path, O_RDWR | O_NONBLOCK
+        if (fd != -1) {
+            qemu_set_nonblock(fd);
+#ifndef CONFIG_SOLARIS
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_ASYNC);
+#endif
+        } else {
+            fd = qemu_open(path, O_RDWR | O_NONBLOCK
 #ifndef CONFIG_SOLARIS
                            | O_ASYNC
 #endif
                            );
+        }
         if (fd == -1) {
             g_critical("error opening channel: %s", strerror(errno));
             return false;
@@ -162,7 +364,11 @@ static gboolean ga_channel_open(GAChannel *c, const gchar *path, GAChannelMethod
     }
     case GA_CHANNEL_ISA_SERIAL: {
         struct termios tio;
-        int fd = qemu_open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+        if (fd != -1) {
+            qemu_set_nonblock(fd);
+        } else {
+            fd = qemu_open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+        }
         if (fd == -1) {
             g_critical("error opening channel: %s", strerror(errno));
             return false;
@@ -174,14 +380,22 @@ static gboolean ga_channel_open(GAChannel *c, const gchar *path, GAChannelMethod
                          IMAXBEL);
         tio.c_oflag = 0;
         tio.c_lflag = 0;
-        tio.c_cflag |= GA_CHANNEL_BAUDRATE_DEFAULT;
+        /* keep the speed the agent that exec'd this one negotiated */
+        if (!resume) {
+            cfsetispeed(&tio, GA_CHANNEL_BAUDRATE_DEFAULT);
+            cfsetospeed(&tio, GA_CHANNEL_BAUDRATE_DEFAULT);
+        }
         /* 1 available byte min or reads will block (we'll set non-blocking
          * elsewhere, else we have to deal with read()=0 instead)
          */
         tio.c_cc[VMIN] = 1;
         tio.c_cc[VTIME] = 0;
-        /* flush everything waiting for read/xmit, it's garbage at this point */
-        tcflush(fd, TCIFLUSH);
+        /* flush everything waiting for read/xmit, it's garbage at this point,
+         * unless the agent that exec'd this one left it for us
+         */
+        if (!resume) {
+            tcflush(fd, TCIFLUSH);
+        }
         tcsetattr(fd, TCSANOW, &tio);
         ret = ga_channel_client_add(c, fd);
         if (ret) {
@@ -193,7 +407,9 @@ static gboolean ga_channel_open(GAChannel *c, const gchar *path, GAChannelMethod
     }
     case GA_CHANNEL_UNIX_LISTEN: {
         Error *local_err = NULL;
-        int fd = unix_listen(path, NULL, strlen(path), &local_err);
+        if (fd == -1) {
+            fd = unix_listen(path, NULL, strlen(path), &local_err);
+        }
         if (local_err != NULL) {
             g_critical("%s", error_get_pretty(local_err));
             error_free(local_err);
@@ -202,6 +418,18 @@ static gboolean ga_channel_open(GAChannel *c, const gchar *path, GAChannelMethod
         ga_channel_listen_add(c, fd, true);
         break;
     }
+#ifdef CONFIG_AF_VSOCK
+    case GA_CHANNEL_VSOCK_LISTEN: {
+        if (fd == -1) {
+            fd = ga_channel_vsock_listen(path);
+        }
+        if (fd == -1) {
+            return false;
+        }
+        ga_channel_listen_add(c, fd, true);
+        break;
+    }
+#endif
     default:
         g_critical("error binding/listening to specified socket");
         return false;
@@ -210,49 +438,164 @@ static gboolean ga_channel_open(GAChannel *c, const gchar *path, GAChannelMethod
     return true;
 }
 
-GIOStatus ga_channel_write_all(GAChannel *c, const gchar *buf, gsize size)
+/*
+ * Drop the already-written head of the output queue once it is large
+ * enough to be worth the move, so a client that never quite catches up
+ * does not keep every byte ever queued for it.
+ */
+static void ga_channel_client_trim(GAChannelClient *client)
 {
-    GError *err = NULL;
-    gsize written = 0;
-    GIOStatus status = G_IO_STATUS_NORMAL;
-
-    while (size) {
-        g_debug("sending data, count: %d", (int)size);
-        status = g_io_channel_write_chars(c->client_channel, buf, size,
-                                          &written, &err);
-        if (status == G_IO_STATUS_NORMAL) {
-            size -= written;
-            buf += written;
-        } else if (status != G_IO_STATUS_AGAIN) {
-            g_warning("error writing to channel: %s", err->message);
-            return status;
+    if (client->out_pos >= GA_CHANNEL_OUT_LOW) {
+        g_byte_array_remove_range(client->out, 0, client->out_pos);
+        client->out_pos = 0;
+    }
+}
+
+/* G_IO_OUT handler, passes queued output on as the client makes room */
+static gboolean ga_channel_client_flush(GIOChannel *channel,
+                                        GIOCondition condition, gpointer data)
+{
+    GAChannelClient *client = data;
+    GByteArray *out = client->out;
+    ssize_t ret;
+
+    ret = write(g_io_channel_unix_get_fd(channel), out->data + client->out_pos,
+                out->len - client->out_pos);
+    if (ret < 0) {
+        if (errno == EAGAIN || errno == EINTR) {
+            return true;
         }
+        /* the input watch sees the hangup and closes the client */
+        g_warning("error writing to channel: %s", strerror(errno));
+        ret = out->len - client->out_pos;
     }
+    client->out_pos += ret;
 
-    do {
-        status = g_io_channel_flush(c->client_channel, &err);
-    } while (status == G_IO_STATUS_AGAIN);
+    if (!client->watch && !client->host_poll_source &&
+        out->len - client->out_pos <= GA_CHANNEL_OUT_LOW) {
+        g_debug("resuming input, output queue drained");
+        client->watch = ga_io_add_watch(client->io, G_IO_IN | G_IO_HUP,
+                                        ga_channel_client_event, client);
+    }
+    if (client->out_pos < out->len) {
+        ga_channel_client_trim(client);
+        return true;
+    }
+    g_byte_array_set_size(out, 0);
+    client->out_pos = 0;
+    client->out_watch = 0;
+    return false;
+}
+
+/*
+ * Write @iov out as far as the client takes it without blocking, and queue
+ * the rest for ga_channel_client_flush().  Reading from the client stops
+ * while its queue is over the high-water mark.  @iov is consumed.
+ */
+GIOStatus ga_channel_writev_all(GAChannelClient *client, struct iovec *iov,
+                                unsigned int iov_cnt)
+{
+    int fd = g_io_channel_unix_get_fd(client->io);
+    ssize_t ret;
 
-    if (status != G_IO_STATUS_NORMAL) {
-        g_warning("error flushing channel: %s", err->message);
+    g_debug("sending data, count: %zu", iov_size(iov, iov_cnt));
+    /* anything already queued has to go out first */
+    while (iov_cnt && !client->out->len) {
+        ret = writev(fd, iov, iov_cnt);
+        if (ret < 0) {
+            if (errno == EAGAIN) {
+                break;
+            } else if (errno != EINTR) {
+                g_warning("error writing to channel: %s", strerror(errno));
+                return G_IO_STATUS_ERROR;
+            }
+            continue;
+        }
+        iov_discard_front(&iov, &iov_cnt, ret);
+    }
+    if (!iov_cnt) {
+        return G_IO_STATUS_NORMAL;
     }
 
+    ga_channel_client_trim(client);
+    for (; iov_cnt; iov++, iov_cnt--) {
+        g_byte_array_append(client->out, iov->iov_base, iov->iov_len);
+    }
+    if (!client->out_watch) {
+        client->out_watch = ga_io_add_watch(client->io, G_IO_OUT,
+                                            ga_channel_client_flush, client);
+    }
+    if (client->watch &&
+        client->out->len - client->out_pos > GA_CHANNEL_OUT_HIGH) {
+        g_debug("pausing input, output queue over high-water mark");
+        ga_io_remove_watch(client->watch);
+        client->watch = 0;
+    }
+
+    return G_IO_STATUS_NORMAL;
+}
+
+/*
+ * Read everything that is pending on @client, as far as the receive buffer
+ * goes, and grow the buffer if that filled it.  *@buf points to the data
+ * until the next call.
+ */
+GIOStatus ga_channel_read(GAChannelClient *client, const gchar **buf,
+                          gsize *count)
+{
+    GIOStatus status;
+    gsize len = 0, n;
+
+    do {
+        status = g_io_channel_read_chars(client->io, client->buf + len,
+                                         client->buf_size - len, &n, NULL);
+        len += n;
+    } while (status == G_IO_STATUS_NORMAL && len < client->buf_size);
+
+    if (len == client->buf_size && client->buf_size < GA_CHANNEL_READ_MAX) {
+        client->buf_size *= 2;
+        client->buf = g_realloc(client->buf, client->buf_size);
+    }
+    *buf = client->buf;
+    *count = len;
+    if (len) {
+        /* EOF or EAGAIN after some data is reported by the next read */
+        return G_IO_STATUS_NORMAL;
+    }
+    if (client->channel->method == GA_CHANNEL_VIRTIO_SERIAL &&
+        (status == G_IO_STATUS_EOF || status == G_IO_STATUS_AGAIN)) {
+        client->host_gone = true;
+    }
     return status;
 }
 
-GIOStatus ga_channel_read(GAChannel *c, gchar *buf, gsize size, gsize *count)
+gpointer ga_channel_client_get_data(GAChannelClient *client)
 {
-    return g_io_channel_read_chars(c->client_channel, buf, size, count, NULL);
+    return client->data;
+}
+
+/* @destroy is called on @data when the client goes away */
+void ga_channel_client_set_data(GAChannelClient *client, gpointer data,
+                                GDestroyNotify destroy)
+{
+    client->data = data;
+    client->destroy = destroy;
+}
+
+void ga_channel_foreach_client(GAChannel *c, GFunc func, gpointer opaque)
+{
+    g_list_foreach(c->clients, func, opaque);
 }
 
 GAChannel *ga_channel_new(GAChannelMethod method, const gchar *path,
-                          GAChannelCallback cb, gpointer opaque)
+                          int listen_fd, GAChannelCallback cb,
+                          gpointer opaque)
 {
     GAChannel *c = g_new0(GAChannel, 1);
     c->event_cb = cb;
     c->user_data = opaque;
 
-    if (!ga_channel_open(c, path, method)) {
+    if (!ga_channel_open(c, path, method, listen_fd, false)) {
         g_critical("error opening channel");
         ga_channel_free(c);
         return NULL;
@@ -263,12 +606,173 @@ GAChannel *ga_channel_new(GAChannelMethod method, const gchar *path,
 
 void ga_channel_free(GAChannel *c)
 {
-    if (c->method == GA_CHANNEL_UNIX_LISTEN
-        && c->listen_channel) {
+    if (c->listen_channel) {
         ga_channel_listen_close(c);
     }
-    if (c->client_channel) {
-        ga_channel_client_close(c);
+    while (c->clients) {
+        ga_channel_client_close(c->clients->data);
     }
     g_free(c);
 }
+
+/*
+ * Take over the channel of an agent that exec'd this one: @fd is the
+ * listening socket or the port, and @client_fds the clients connected to
+ * the socket, in the order ga_channel_foreach_client() went through them.
+ */
+GAChannel *ga_channel_resume(GAChannelMethod method, int fd,
+                             const int *client_fds, int nclients,
+                             GAChannelCallback cb, gpointer opaque)
+{
+    GAChannel *c = g_new0(GAChannel, 1);
+    int i;
+
+    c->event_cb = cb;
+    c->user_data = opaque;
+
+    if (!ga_channel_open(c, NULL, method, fd, true)) {
+        g_critical("error resuming channel");
+        ga_channel_free(c);
+        return NULL;
+    }
+    for (i = 0; i < nclients; i++) {
+        if (!c->listen_channel || ga_channel_client_add(c, client_fds[i])) {
+            g_warning("error resuming connection");
+            close(client_fds[i]);
+        }
+    }
+    if (c->listen_watch &&
+        g_list_length(c->clients) >= GA_CHANNEL_MAX_CLIENTS) {
+        ga_io_remove_watch(c->listen_watch);
+        c->listen_watch = 0;
+    }
+
+    return c;
+}
+
+/* the listening socket, or the port of a virtio-serial or isa-serial
+ * channel; -1 if the port was closed after an error
+ */
+int ga_channel_get_fd(GAChannel *c)
+{
+    GAChannelClient *client;
+
+    if (c->listen_channel) {
+        return g_io_channel_unix_get_fd(c->listen_channel);
+    }
+    if (!c->clients) {
+        return -1;
+    }
+    client = c->clients->data;
+    return g_io_channel_unix_get_fd(client->io);
+}
+
+int ga_channel_client_get_fd(GAChannelClient *client)
+{
+    return g_io_channel_unix_get_fd(client->io);
+}
+
+gboolean ga_channel_serial_speed_valid(int speed)
+{
+    unsigned int i;
+
+    for (i = 0; i < ARRAY_SIZE(ga_channel_bauds); i++) {
+        if (ga_channel_bauds[i].speed == speed) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Switch an isa-serial channel to @speed, with RTS/CTS flow control if
+ * @flow_control.  Whatever is queued for the host goes out at the old
+ * speed first.  0 or a negative errno.
+ */
+int ga_channel_set_serial_speed(GAChannel *c, int speed,
+                                gboolean flow_control)
+{
+    GAChannelClient *client;
+    struct termios tio;
+    unsigned int i;
+    int fd;
+
+    if (c->method != GA_CHANNEL_ISA_SERIAL || !c->clients) {
+        return -ENOTSUP;
+    }
+    for (i = 0; i < ARRAY_SIZE(ga_channel_bauds); i++) {
+        if (ga_channel_bauds[i].speed == speed) {
+            break;
+        }
+    }
+    if (i == ARRAY_SIZE(ga_channel_bauds)) {
+        return -EINVAL;
+    }
+#ifndef CRTSCTS
+    if (flow_control) {
+        return -ENOTSUP;
+    }
+#endif
+
+    client = c->clients->data;
+    fd = g_io_channel_unix_get_fd(client->io);
+    if (!ga_channel_flush(c, GA_CHANNEL_SPEED_FLUSH_MS)) {
+        return -ETIMEDOUT;
+    }
+    if (tcdrain(fd) < 0 || tcgetattr(fd, &tio) < 0) {
+        return -errno;
+    }
+    cfsetispeed(&tio, ga_channel_bauds[i].baud);
+    cfsetospeed(&tio, ga_channel_bauds[i].baud);
+#ifdef CRTSCTS
+    if (flow_control) {
+        tio.c_cflag |= CRTSCTS;
+    } else {
+        tio.c_cflag &= ~CRTSCTS;
+    }
+#endif
+    if (tcsetattr(fd, TCSANOW, &tio) < 0) {
+        return -errno;
+    }
+    return 0;
+}
+
+/*
+ * Write out the output queued for every client, waiting up to
+ * @timeout_ms for them to take it.  Output for a client that went away
+ * is dropped.  False if some is left.
+ */
+gboolean ga_channel_flush(GAChannel *c, int timeout_ms)
+{
+    int64_t deadline = g_get_monotonic_time() + timeout_ms * 1000LL;
+    int64_t left;
+    GAChannelClient *client;
+    struct pollfd pfd;
+    ssize_t ret;
+    GList *l;
+
+    for (l = c->clients; l; l = l->next) {
+        client = l->data;
+        pfd.fd = g_io_channel_unix_get_fd(client->io);
+        pfd.events = POLLOUT;
+        while (client->out_pos < client->out->len) {
+            left = deadline - g_get_monotonic_time();
+            if (left <= 0) {
+                return false;
+            }
+            if (poll(&pfd, 1, (left + 999) / 1000) != 1) {
+                continue;
+            }
+            ret = write(pfd.fd, client->out->data + client->out_pos,
+                        client->out->len - client->out_pos);
+            if (ret < 0) {
+                if (errno == EAGAIN || errno == EINTR) {
+                    continue;
+                }
+                ret = client->out->len - client->out_pos;
+            }
+            client->out_pos += ret;
+        }
+    }
+    return true;
+}
@@ -5,35 +5,100 @@
 #include <windows.h>
 #include <errno.h>
 #include <io.h>
+#include "qemu/osdep.h"
 #include "qga/guest-agent-core.h"
 #include "qga/channel.h"
 
-typedef struct GAChannelReadState {
-    guint thread_id;
+/* reads kept in flight at the same time; each slot has its own buffer and
+ * is handed to the client in place, so nothing needs compacting
+ */
+#define GA_CHANNEL_READ_SLOTS 4
+
+/* stop submitting reads while this much output is waiting to be written */
+#define GA_CHANNEL_OUT_HIGH (1024 * 1024)
+
+typedef struct GAChannelReadSlot {
     uint8_t *buf;
-    size_t buf_size;
-    size_t cur; /* current buffer start */
-    size_t pending; /* pending buffered bytes to read */
+    DWORD count; /* bytes read, once ready */
     OVERLAPPED ov;
-    bool ov_pending; /* whether on async read is outstanding */
+    bool ov_pending; /* whether a read is outstanding on this slot */
+    bool ready; /* read completed, data not handed out yet */
+} GAChannelReadSlot;
+
+/* slots are submitted at tail and handed out at head, both going round
+ * the ring, so data comes out in the order the reads were issued
+ */
+typedef struct GAChannelReadState {
+    GAChannelReadSlot slots[GA_CHANNEL_READ_SLOTS];
+    size_t buf_size;
+    unsigned int head;
+    unsigned int tail;
 } GAChannelReadState;
 
+/* output goes out one overlapped WriteFile at a time, in queue order */
+typedef struct GAChannelWriteState {
+    GQueue queue; /* GByteArray, oldest first */
+    size_t queued; /* bytes in the queue */
+    size_t offset; /* bytes of the oldest buffer already written */
+    OVERLAPPED ov;
+    bool ov_pending;
+} GAChannelWriteState;
+
+/* the channel is a single serial port, so it has exactly one client */
+struct GAChannelClient {
+    GAChannel *channel;
+    gpointer data;
+    GDestroyNotify destroy;
+};
+
 struct GAChannel {
+    GAChannelClient client;
     HANDLE handle;
+    GAChannelMethod method;
     GAChannelCallback cb;
     gpointer user_data;
     GAChannelReadState rstate;
+    GAChannelWriteState wstate;
     GIOCondition pending_events; /* TODO: use GAWatch.pollfd.revents */
     GSource *source;
 };
 
 typedef struct GAWatch {
     GSource source;
-    GPollFD pollfd;
+    GPollFD pollfd[GA_CHANNEL_READ_SLOTS + 1]; /* read slots, then write */
     GAChannel *channel;
     GIOCondition events_mask;
 } GAWatch;
 
+static GIOCondition ga_channel_write_kick(GAChannel *c);
+
+/* submit reads on every free slot, in ring order */
+static GIOCondition ga_channel_read_submit(GAChannel *c)
+{
+    GAChannelReadState *rs = &c->rstate;
+    GAChannelReadSlot *slot;
+    BOOL success;
+
+    while (c->wstate.queued <= GA_CHANNEL_OUT_HIGH) {
+        slot = &rs->slots[rs->tail];
+        if (slot->ov_pending || slot->ready) {
+            break;
+        }
+        success = ReadFile(c->handle, slot->buf, rs->buf_size, &slot->count,
+                           &slot->ov);
+        if (success) {
+            slot->ready = true;
+        } else if (GetLastError() == ERROR_IO_PENDING) {
+            slot->ov_pending = true;
+        } else {
+            return G_IO_ERR;
+        }
+        rs->tail = (rs->tail + 1) % GA_CHANNEL_READ_SLOTS;
+    }
+
+    return 0;
+}
+
 /*
  * Called by glib prior to polling to set up poll events if polling is needed.
  *
@@ -43,49 +108,18 @@ static gboolean ga_channel_prepare(GSource *source, gint *timeout_ms)
     GAWatch *watch = (GAWatch *)source;
     GAChannel *c = (GAChannel *)watch->channel;
     GAChannelReadState *rs = &c->rstate;
-    DWORD count_read, count_to_read = 0;
-    bool success;
     GIOCondition new_events = 0;
 
     g_debug("prepare");
-    /* go ahead and submit another read if there's room in the buffer
-     * and no previous reads are outstanding
-     */
-    if (!rs->ov_pending) {
-        if (rs->cur + rs->pending >= rs->buf_size) {
-            if (rs->cur) {
-                memmove(rs->buf, rs->buf + rs->cur, rs->pending);
-                rs->cur = 0;
-            }
-        }
-        count_to_read = rs->buf_size - rs->cur - rs->pending;
-    }
+    /* keep as many reads outstanding as there are free slots */
+    new_events |= ga_channel_read_submit(c);
 
-    if (rs->ov_pending || count_to_read <= 0) {
-            goto out;
-    }
-
-    /* submit the read */
-    success = ReadFile(c->handle, rs->buf + rs->cur + rs->pending,
-                       count_to_read, &count_read, &rs->ov);
-    if (success) {
-        rs->pending += count_read;
-        rs->ov_pending = false;
-    } else {
-        if (GetLastError() == ERROR_IO_PENDING) {
-            rs->ov_pending = true;
-        } else {
-            new_events |= G_IO_ERR;
-        }
-    }
-
-out:
     /* dont block forever, iterate the main loop every once and a while */
     *timeout_ms = 500;
     /* if there's data in the read buffer, or another event is pending,
      * skip polling and issue user cb.
      */
-    if (rs->pending) {
+    if (rs->slots[rs->head].ready) {
         new_events |= G_IO_IN;
     }
     c->pending_events |= new_events;
@@ -93,35 +127,40 @@ out:
 }
 
 /*
- * Called by glib after an outstanding read request is completed.
+ * Called by glib after an outstanding read or write request is completed.
  */
 static gboolean ga_channel_check(GSource *source)
 {
     GAWatch *watch = (GAWatch *)source;
     GAChannel *c = (GAChannel *)watch->channel;
     GAChannelReadState *rs = &c->rstate;
-    DWORD count_read, error;
+    GAChannelWriteState *ws = &c->wstate;
+    GAChannelReadSlot *slot;
+    DWORD count, error;
     BOOL success;
+    unsigned int i;
 
     GIOCondition new_events = 0;
 
     g_debug("check");
 
-    /* failing this implies we issued a read that completed immediately,
-     * yet no data was placed into the buffer (and thus we did not skip
-     * polling). but since EOF is not obtainable until we retrieve an
-     * overlapped result, it must be the case that there was data placed
-     * into the buffer, or an error was generated by Readfile(). in either
-     * case, we should've skipped the polling for this round.
+    /* reads may finish out of order and the auto-reset events only tell
+     * us about one of them per poll, so look at every outstanding slot
      */
-    g_assert(rs->ov_pending);
-
-    success = GetOverlappedResult(c->handle, &rs->ov, &count_read, FALSE);
-    if (success) {
-        g_debug("thread: overlapped result, count_read: %d", (int)count_read);
-        rs->pending += count_read;
-        new_events |= G_IO_IN;
-    } else {
+    for (i = 0; i < GA_CHANNEL_READ_SLOTS; i++) {
+        slot = &rs->slots[i];
+        if (!slot->ov_pending) {
+            continue;
+        }
+        success = GetOverlappedResult(c->handle, &slot->ov, &slot->count,
+                                      FALSE);
+        if (success) {
+            g_debug("thread: overlapped result, count_read: %d",
+                    (int)slot->count);
+            slot->ov_pending = false;
+            slot->ready = true;
+            continue;
+        }
         error = GetLastError();
         if (error == 0 || error == ERROR_HANDLE_EOF ||
             error == ERROR_NO_SYSTEM_RESOURCES ||
@@ -135,15 +174,34 @@ static gboolean ga_channel_check(GSource *source)
              * handle that in the same fashion.
              */
             new_events |= G_IO_HUP;
+            /* an empty completion keeps the slot's place in the ring */
+            slot->count = 0;
+            slot->ov_pending = false;
+            slot->ready = true;
         } else if (error != ERROR_IO_INCOMPLETE) {
             g_critical("error retrieving overlapped result: %d", (int)error);
             new_events |= G_IO_ERR;
+            slot->ov_pending = false;
         }
     }
+    if (rs->slots[rs->head].ready) {
+        new_events |= G_IO_IN;
+    }
 
-    if (new_events) {
-        rs->ov_pending = 0;
+    if (ws->ov_pending) {
+        success = GetOverlappedResult(c->handle, &ws->ov, &count, FALSE);
+        if (success) {
+            ws->ov_pending = false;
+            ws->offset += count;
+            new_events |= ga_channel_write_kick(c);
+        } else if (GetLastError() != ERROR_IO_INCOMPLETE) {
+            g_critical("error retrieving overlapped write result: %d",
+                       (int)GetLastError());
+            ws->ov_pending = false;
+            new_events |= G_IO_ERR;
+        }
     }
+
     c->pending_events |= new_events;
 
     return !!c->pending_events;
@@ -161,16 +219,15 @@ static gboolean ga_channel_dispatch(GSource *source, GSourceFunc unused,
     gboolean success;
 
     g_debug("dispatch");
-    success = c->cb(watch->pollfd.revents, c->user_data);
+    success = c->cb(&c->client, c->pending_events, c->user_data);
 
     if (c->pending_events & G_IO_ERR) {
         g_critical("channel error, removing source");
         return false;
     }
 
-    /* TODO: replace rs->pending with watch->revents */
     c->pending_events &= ~G_IO_HUP;
-    if (!rs->pending) {
+    if (!rs->slots[rs->head].ready) {
         c->pending_events &= ~G_IO_IN;
     } else {
         c->pending_events = 0;
@@ -194,94 +251,104 @@ static GSource *ga_channel_create_watch(GAChannel *c)
 {
     GSource *source = g_source_new(&ga_channel_watch_funcs, sizeof(GAWatch));
     GAWatch *watch = (GAWatch *)source;
+    unsigned int i;
 
     watch->channel = c;
-    watch->pollfd.fd = (gintptr) c->rstate.ov.hEvent;
-    g_source_add_poll(source, &watch->pollfd);
+    for (i = 0; i < GA_CHANNEL_READ_SLOTS; i++) {
+        watch->pollfd[i].fd = (gintptr) c->rstate.slots[i].ov.hEvent;
+        watch->pollfd[i].events = G_IO_IN;
+        g_source_add_poll(source, &watch->pollfd[i]);
+    }
+    watch->pollfd[i].fd = (gintptr) c->wstate.ov.hEvent;
+    watch->pollfd[i].events = G_IO_IN;
+    g_source_add_poll(source, &watch->pollfd[i]);
 
     return source;
 }
 
-GIOStatus ga_channel_read(GAChannel *c, char *buf, size_t size, gsize *count)
+/* hand out the oldest completed read; its buffer stays put until we return
+ * to the main loop, which is when the slot gets submitted again
+ */
+GIOStatus ga_channel_read(GAChannelClient *client, const gchar **buf,
+                          gsize *count)
 {
+    GAChannel *c = client->channel;
     GAChannelReadState *rs = &c->rstate;
-    GIOStatus status;
-    size_t to_read = 0;
+    GAChannelReadSlot *slot = &rs->slots[rs->head];
 
     if (c->pending_events & G_IO_ERR) {
         return G_IO_STATUS_ERROR;
     }
 
-    *count = to_read = MIN(size, rs->pending);
-    if (to_read) {
-        memcpy(buf, rs->buf + rs->cur, to_read);
-        rs->cur += to_read;
-        rs->pending -= to_read;
-        status = G_IO_STATUS_NORMAL;
-    } else {
-        status = G_IO_STATUS_AGAIN;
+    if (!slot->ready) {
+        return G_IO_STATUS_AGAIN;
+    }
+    slot->ready = false;
+    rs->head = (rs->head + 1) % GA_CHANNEL_READ_SLOTS;
+    if (!slot->count) {
+        return G_IO_STATUS_AGAIN;
     }
 
-    return status;
+    *buf = (const gchar *)slot->buf;
+    *count = slot->count;
+    return G_IO_STATUS_NORMAL;
 }
 
-static GIOStatus ga_channel_write(GAChannel *c, const char *buf, size_t size,
-                                  size_t *count)
+/* retire what has been written and start writing the next buffer */
+static GIOCondition ga_channel_write_kick(GAChannel *c)
 {
-    GIOStatus status;
-    OVERLAPPED ov = {0};
-    BOOL ret;
+    GAChannelWriteState *ws = &c->wstate;
+    GByteArray *head;
     DWORD written;
+    BOOL ret;
 
-    ov.hEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
-    ret = WriteFile(c->handle, buf, size, &written, &ov);
-    if (!ret) {
-        if (GetLastError() == ERROR_IO_PENDING) {
-            /* write is pending */
-            ret = GetOverlappedResult(c->handle, &ov, &written, TRUE);
-            if (!ret) {
-                if (!GetLastError()) {
-                    status = G_IO_STATUS_AGAIN;
-                } else {
-                    status = G_IO_STATUS_ERROR;
-                }
-            } else {
-                /* write is complete */
-                status = G_IO_STATUS_NORMAL;
-                *count = written;
-            }
+    while ((head = g_queue_peek_head(&ws->queue))) {
+        if (ws->offset == head->len) {
+            g_queue_pop_head(&ws->queue);
+            ws->queued -= head->len;
+            ws->offset = 0;
+            g_byte_array_free(head, true);
+            continue;
+        }
+        ret = WriteFile(c->handle, head->data + ws->offset,
+                        head->len - ws->offset, &written, &ws->ov);
+        if (ret) {
+            /* write returned immediately */
+            ws->offset += written;
+        } else if (GetLastError() == ERROR_IO_PENDING) {
+            /* write is pending, ga_channel_check() picks it up */
+            ws->ov_pending = true;
+            break;
         } else {
-            status = G_IO_STATUS_ERROR;
+            g_critical("error writing to channel: %d", (int)GetLastError());
+            return G_IO_ERR;
         }
-    } else {
-        /* write returned immediately */
-        status = G_IO_STATUS_NORMAL;
-        *count = written;
     }
 
-    if (ov.hEvent) {
-        CloseHandle(ov.hEvent);
-        ov.hEvent = NULL;
-    }
-    return status;
+    return 0;
 }
 
-GIOStatus ga_channel_write_all(GAChannel *c, const char *buf, size_t size)
+GIOStatus ga_channel_writev_all(GAChannelClient *client, struct iovec *iov,
+                                unsigned int iov_cnt)
 {
-    GIOStatus status = G_IO_STATUS_NORMAL;
-    size_t count = 0;
-
-    while (size) {
-        status = ga_channel_write(c, buf, size, &count);
-        if (status == G_IO_STATUS_NORMAL) {
-            size -= count;
-            buf += count;
-        } else if (status != G_IO_STATUS_AGAIN) {
-            break;
-        }
+    GAChannel *c = client->channel;
+    GAChannelWriteState *ws = &c->wstate;
+    GByteArray *buf = g_byte_array_new();
+    unsigned int i;
+
+    /* the caller's buffers go away when we return, so queue a copy */
+    for (i = 0; i < iov_cnt; i++) {
+        g_byte_array_append(buf, iov[i].iov_base, iov[i].iov_len);
+    }
+    g_queue_push_tail(&ws->queue, buf);
+    ws->queued += buf->len;
+
+    if (!ws->ov_pending && ga_channel_write_kick(c)) {
+        c->pending_events |= G_IO_ERR;
+        return G_IO_STATUS_ERROR;
     }
 
-    return status;
+    return G_IO_STATUS_NORMAL;
 }
 
 static gboolean ga_channel_open(GAChannel *c, GAChannelMethod method,
@@ -315,15 +382,18 @@ static gboolean ga_channel_open(GAChannel *c, GAChannelMethod method,
         CloseHandle(c->handle);
         return false;
     }
+    c->method = method;
 
     return true;
 }
 
 GAChannel *ga_channel_new(GAChannelMethod method, const gchar *path,
-                          GAChannelCallback cb, gpointer opaque)
+                          int listen_fd, GAChannelCallback cb,
+                          gpointer opaque)
 {
     GAChannel *c = g_new0(GAChannel, 1);
     SECURITY_ATTRIBUTES sec_attrs;
+    unsigned int i;
 
     if (!ga_channel_open(c, method, path)) {
         g_critical("error opening channel");
@@ -331,6 +401,7 @@ GAChannel *ga_channel_new(GAChannelMethod method, const gchar *path,
         return NULL;
     }
 
+    c->client.channel = c;
     c->cb = cb;
     c->user_data = opaque;
 
@@ -339,22 +410,129 @@ GAChannel *ga_channel_new(GAChannelMethod method, const gchar *path,
     sec_attrs.bInheritHandle = false;
 
     c->rstate.buf_size = QGA_READ_COUNT_DEFAULT;
-    c->rstate.buf = g_malloc(QGA_READ_COUNT_DEFAULT);
-    c->rstate.ov.hEvent = CreateEvent(&sec_attrs, FALSE, FALSE, NULL);
+    for (i = 0; i < GA_CHANNEL_READ_SLOTS; i++) {
+        c->rstate.slots[i].buf = g_malloc(QGA_READ_COUNT_DEFAULT);
+        c->rstate.slots[i].ov.hEvent = CreateEvent(&sec_attrs, FALSE, FALSE,
+                                                   NULL);
+    }
+    g_queue_init(&c->wstate.queue);
+    c->wstate.ov.hEvent = CreateEvent(&sec_attrs, FALSE, FALSE, NULL);
 
     c->source = ga_channel_create_watch(c);
     g_source_attach(c->source, NULL);
     return c;
 }
 
+gpointer ga_channel_client_get_data(GAChannelClient *client)
+{
+    return client->data;
+}
+
+void ga_channel_client_set_data(GAChannelClient *client, gpointer data,
+                                GDestroyNotify destroy)
+{
+    client->data = data;
+    client->destroy = destroy;
+}
+
+void ga_channel_foreach_client(GAChannel *c, GFunc func, gpointer opaque)
+{
+    func(&c->client, opaque);
+}
+
+gboolean ga_channel_serial_speed_valid(int speed)
+{
+    switch (speed) {
+    case 9600: case 19200: case 38400: case 57600: case 115200:
+    case 230400: case 460800: case 921600: case 1500000: case 3000000:
+    case 4000000:
+        return true;
+    }
+    return false;
+}
+
+/* see channel-posix.c */
+int ga_channel_set_serial_speed(GAChannel *c, int speed,
+                                gboolean flow_control)
+{
+    GAChannelWriteState *ws = &c->wstate;
+    DCB dcb = { .DCBlength = sizeof(dcb) };
+    DWORD count;
+
+    if (c->method != GA_CHANNEL_ISA_SERIAL) {
+        return -ENOTSUP;
+    }
+    if (!ga_channel_serial_speed_valid(speed)) {
+        return -EINVAL;
+    }
+    /* what is queued for the host goes out at the old speed */
+    while (ws->ov_pending) {
+        ws->ov_pending = false;
+        if (!GetOverlappedResult(c->handle, &ws->ov, &count, TRUE)) {
+            return -EIO;
+        }
+        ws->offset += count;
+        if (ga_channel_write_kick(c)) {
+            return -EIO;
+        }
+    }
+    if (!GetCommState(c->handle, &dcb)) {
+        return -EIO;
+    }
+    dcb.BaudRate = speed;
+    dcb.fOutxCtsFlow = flow_control;
+    dcb.fRtsControl = flow_control ? RTS_CONTROL_HANDSHAKE
+                                   : RTS_CONTROL_ENABLE;
+    if (!SetCommState(c->handle, &dcb)) {
+        return -EIO;
+    }
+    return 0;
+}
+
 void ga_channel_free(GAChannel *c)
 {
+    GAChannelWriteState *ws = &c->wstate;
+    GAChannelReadSlot *slot;
+    GByteArray *buf;
+    DWORD count;
+    unsigned int i;
+
     if (c->source) {
         g_source_destroy(c->source);
     }
-    if (c->rstate.ov.hEvent) {
-        CloseHandle(c->rstate.ov.hEvent);
+    if (c->client.destroy) {
+        c->client.destroy(c->client.data);
+    }
+
+    /* let queued output, e.g. a guest-shutdown response, reach the host */
+    while (ws->ov_pending) {
+        ws->ov_pending = false;
+        if (!GetOverlappedResult(c->handle, &ws->ov, &count, TRUE)) {
+            break;
+        }
+        ws->offset += count;
+        if (ga_channel_write_kick(c)) {
+            break;
+        }
+    }
+    while ((buf = g_queue_pop_head(&ws->queue))) {
+        g_byte_array_free(buf, true);
+    }
+    if (ws->ov.hEvent) {
+        CloseHandle(ws->ov.hEvent);
+    }
+
+    /* the buffers of outstanding reads must outlive the reads */
+    CancelIo(c->handle);
+    for (i = 0; i < GA_CHANNEL_READ_SLOTS; i++) {
+        slot = &c->rstate.slots[i];
+        if (slot->ov_pending) {
+            GetOverlappedResult(c->handle, &slot->ov, &count, TRUE);
+        }
+        if (slot->ov.hEvent) {
+            CloseHandle(slot->ov.hEvent);
+        }
+        g_free(slot->buf);
     }
-    g_free(c->rstate.buf);
     g_free(c);
 }
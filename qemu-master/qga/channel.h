@@ -15,19 +15,47 @@
 #include <glib.h>
 
 typedef struct GAChannel GAChannel;
+typedef struct GAChannelClient GAChannelClient;
+struct iovec;
 
 typedef enum {
     GA_CHANNEL_VIRTIO_SERIAL,
     GA_CHANNEL_ISA_SERIAL,
     GA_CHANNEL_UNIX_LISTEN,
+    GA_CHANNEL_VSOCK_LISTEN,
 } GAChannelMethod;
 
-typedef gboolean (*GAChannelCallback)(GIOCondition condition, gpointer opaque);
+/* listening channels serve up to this many clients at the same time */
+#define GA_CHANNEL_MAX_CLIENTS 16
+
+/* isa-serial channels start out at this line speed, in bits/s */
+#define GA_CHANNEL_SERIAL_SPEED_DEFAULT 38400
+
+typedef gboolean (*GAChannelCallback)(GAChannelClient *client,
+                                      GIOCondition condition, gpointer opaque);
 
 GAChannel *ga_channel_new(GAChannelMethod method, const gchar *path,
-                          GAChannelCallback cb, gpointer opaque);
+                          int listen_fd, GAChannelCallback cb,
+                          gpointer opaque);
 void ga_channel_free(GAChannel *c);
-GIOStatus ga_channel_read(GAChannel *c, gchar *buf, gsize size, gsize *count);
-GIOStatus ga_channel_write_all(GAChannel *c, const gchar *buf, gsize size);
+#ifndef _WIN32
+GAChannel *ga_channel_resume(GAChannelMethod method, int fd,
+                             const int *client_fds, int nclients,
+                             GAChannelCallback cb, gpointer opaque);
+int ga_channel_get_fd(GAChannel *c);
+int ga_channel_client_get_fd(GAChannelClient *client);
+gboolean ga_channel_flush(GAChannel *c, int timeout_ms);
+#endif
+gboolean ga_channel_serial_speed_valid(int speed);
+int ga_channel_set_serial_speed(GAChannel *c, int speed,
+                                gboolean flow_control);
+void ga_channel_foreach_client(GAChannel *c, GFunc func, gpointer opaque);
+GIOStatus ga_channel_read(GAChannelClient *client, const gchar **buf,
+                          gsize *count);
+GIOStatus ga_channel_writev_all(GAChannelClient *client, struct iovec *iov,
+                                unsigned int iov_cnt);
+gpointer ga_channel_client_get_data(GAChannelClient *client);
+void ga_channel_client_set_data(GAChannelClient *client, gpointer data,
+                                GDestroyNotify destroy);
 
 #endif
@@ -19,15 +19,29 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <dirent.h>
+#include <fnmatch.h>
 #include <stdio.h>
+#include <zlib.h>
 #include <string.h>
+#include <setjmp.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <inttypes.h>
 #include "qga/guest-agent-core.h"
 #include "qga-qmp-commands.h"
+#include "qga-qapi-event.h"
 #include "qapi/qmp/qerror.h"
 #include "qemu/queue.h"
+#include "qemu/rcu.h"
 #include "qemu/host-utils.h"
+#include "qemu/base64.h"
+#include "qemu/buffer-pool.h"
+#include "qapi/qmp-event.h"
+#include "qapi/qmp/types.h"
+#include "qapi/util.h"
+#include "qapi/json-output-visitor.h"
+#include "qga-qapi-visit.h"
+#include "trace.h"
 
 #ifndef CONFIG_HAS_ENVIRON
 #ifdef __APPLE__
@@ -41,10 +55,35 @@ extern char **environ;
 #if defined(__linux__)
 #include <mntent.h>
 #include <linux/fs.h>
-#include <ifaddrs.h>
+#include <sys/sendfile.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <net/if.h>
+#include <sys/statvfs.h>
+#include <sys/utsname.h>
+#include <netdb.h>
+#include <pwd.h>
+#include <utmp.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/sock_diag.h>
+#include <linux/inet_diag.h>
+#include <linux/ethtool.h>
+#include <linux/sockios.h>
+#include <netinet/tcp.h>
+#include <netinet/ip_icmp.h>
+#include <netinet/icmp6.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/timex.h>
+#include <sys/inotify.h>
+#include <syslog.h>
+#include <glob.h>
+#include "qga/bc/collect.h"
+#ifdef CONFIG_FALLOCATE_PUNCH_HOLE
+#include <linux/falloc.h>
+#endif
 
 #ifdef FIFREEZE
 #define CONFIG_FSFREEZE
@@ -54,30 +93,19 @@ extern char **environ;
 #endif
 #endif
 
-static void ga_wait_child(pid_t pid, int *status, Error **errp)
+/* run @path and wait for it, through the helper forked at startup */
+static void ga_run_child(const char *path, const char *const *argv,
+                         const void *input, size_t input_len, int *status,
+                         Error **errp)
 {
-    pid_t rpid;
-
-    *status = 0;
-
-    do {
-        rpid = waitpid(pid, status, 0);
-    } while (rpid == -1 && errno == EINTR);
-
-    if (rpid == -1) {
-        error_setg_errno(errp, errno, "failed to wait for child (pid: %d)",
-                         pid);
-        return;
-    }
-
-    g_assert(rpid == pid);
+    ga_spawn_sync(ga_get_spawner(ga_state), path, argv, input, input_len,
+                  status, errp);
 }
 
 void qmp_guest_shutdown(bool has_mode, const char *mode, Error **errp)
 {
     const char *shutdown_flag;
     Error *local_err = NULL;
-    pid_t pid;
     int status;
 
     slog("guest-shutdown called, mode: %s", mode);
@@ -93,23 +121,12 @@ void qmp_guest_shutdown(bool has_mode, const char *mode, Error **errp)
         return;
     }
 
-    pid = fork();
-    if (pid == 0) {
-        /* child, start the shutdown */
-        setsid();
-        reopen_fd_to_null(0);
-        reopen_fd_to_null(1);
-        reopen_fd_to_null(2);
+    {
+        const char *argv[] = { "shutdown", "-h", shutdown_flag, "+0",
+                               "hypervisor initiated shutdown", NULL };
 
-        execle("/sbin/shutdown", "shutdown", "-h", shutdown_flag, "+0",
-               "hypervisor initiated shutdown", (char*)NULL, environ);
-        _exit(EXIT_FAILURE);
-    } else if (pid < 0) {
-        error_setg_errno(errp, errno, "failed to create child process");
-        return;
+        ga_run_child("/sbin/shutdown", argv, NULL, 0, &status, &local_err);
     }
-
-    ga_wait_child(pid, &status, &local_err);
     if (local_err) {
         error_propagate(errp, local_err);
         return;
@@ -148,7 +165,7 @@ void qmp_guest_set_time(bool has_time, int64_t time_ns, Error **errp)
 {
     int ret;
     int status;
-    pid_t pid;
+    const char *hwclock_argv[] = { "hwclock", NULL, NULL };
     Error *local_err = NULL;
     struct timeval tv;
 
@@ -181,24 +198,10 @@ void qmp_guest_set_time(bool has_time, int64_t time_ns, Error **errp)
      * just need to synchronize the hardware clock. However, if no time was
      * passed, user is requesting the opposite: set the system time from the
      * hardware clock (RTC). */
-    pid = fork();
-    if (pid == 0) {
-        setsid();
-        reopen_fd_to_null(0);
-        reopen_fd_to_null(1);
-        reopen_fd_to_null(2);
-
-        /* Use '/sbin/hwclock -w' to set RTC from the system time,
-         * or '/sbin/hwclock -s' to set the system time from RTC. */
-        execle("/sbin/hwclock", "hwclock", has_time ? "-w" : "-s",
-               NULL, environ);
-        _exit(EXIT_FAILURE);
-    } else if (pid < 0) {
-        error_setg_errno(errp, errno, "failed to create child process");
-        return;
-    }
-
-    ga_wait_child(pid, &status, &local_err);
+    /* Use '/sbin/hwclock -w' to set RTC from the system time,
+     * or '/sbin/hwclock -s' to set the system time from RTC. */
+    hwclock_argv[1] = has_time ? "-w" : "-s";
+    ga_run_child("/sbin/hwclock", hwclock_argv, NULL, 0, &status, &local_err);
     if (local_err) {
         error_propagate(errp, local_err);
         return;
@@ -216,48 +219,117 @@ void qmp_guest_set_time(bool has_time, int64_t time_ns, Error **errp)
 }
 
 typedef struct GuestFileHandle {
-    uint64_t id;
+    int64_t id;
     FILE *fh;
-    QTAILQ_ENTRY(GuestFileHandle) next;
+    GuestFileCaching caching;
+    GASession *session;         /* the client that opened it */
 } GuestFileHandle;
 
+typedef struct GuestFileArchive GuestFileArchive;
+
+/* a guest-file-pull, guest-file-push or guest-file-archive stream */
+typedef struct GuestFileTransfer {
+    int64_t id;
+    FILE *fh;                   /* only the fd is used, with pread()/pwrite() */
+    GuestFileArchive *archive;  /* instead of fh */
+    GAReader *reader;           /* pull: reads ahead of the sender */
+    int64_t offset;             /* of the next chunk */
+    int64_t remaining;          /* pull: bytes left to send */
+    bool sparse;                /* pull: holes are sent as such */
+    int64_t data_end;           /* sparse pull: of the data @reader reads */
+    size_t chunk_size;
+    int64_t count;              /* bytes transferred so far */
+    GAStream *stream;           /* pull: the sender */
+    GASession *session;
+    QTAILQ_ENTRY(GuestFileTransfer) next;
+} GuestFileTransfer;
+
+static void guest_file_session_close(Notifier *notifier, void *data);
+
 static struct {
-    QTAILQ_HEAD(, GuestFileHandle) filehandles;
+    GHashTable *filehandles;    /* GuestFileHandle by id */
+    GHashTable *session_count;  /* open handles by GASession */
+    QTAILQ_HEAD(, GuestFileTransfer) transfers;
+    Notifier session_close;
 } guest_file_state = {
-    .filehandles = QTAILQ_HEAD_INITIALIZER(guest_file_state.filehandles),
+    .transfers = QTAILQ_HEAD_INITIALIZER(guest_file_state.transfers),
+    .session_close = { .notify = guest_file_session_close },
 };
 
-static int64_t guest_file_handle_add(FILE *fh, Error **errp)
+/* open handles of @session, changed by @delta */
+static int guest_file_session_count(GASession *session, int delta)
+{
+    int count = GPOINTER_TO_INT(g_hash_table_lookup(
+                                    guest_file_state.session_count, session));
+
+    count += delta;
+    if (delta && count) {
+        g_hash_table_insert(guest_file_state.session_count, session,
+                            GINT_TO_POINTER(count));
+    } else if (delta) {
+        g_hash_table_remove(guest_file_state.session_count, session);
+    }
+    return count;
+}
+
+static bool guest_file_handle_check_limit(Error **errp)
+{
+    int max = ga_get_max_file_handles(ga_state);
+
+    if (max && guest_file_session_count(ga_get_session(ga_state), 0) >= max) {
+        error_setg(errp, "too many open files, the limit is %d per client",
+                   max);
+        return false;
+    }
+    return true;
+}
+
+static void guest_file_handle_insert(int64_t id, FILE *fh,
+                                     GuestFileCaching caching,
+                                     GASession *session)
+{
+    GuestFileHandle *gfh = g_new0(GuestFileHandle, 1);
+
+    gfh->id = id;
+    gfh->fh = fh;
+    gfh->caching = caching;
+    gfh->session = session;
+    g_hash_table_insert(guest_file_state.filehandles, &gfh->id, gfh);
+    guest_file_session_count(session, 1);
+    ga_busy_ref(ga_state);
+}
+
+static int64_t guest_file_handle_add(FILE *fh, GuestFileCaching caching,
+                                     Error **errp)
 {
-    GuestFileHandle *gfh;
     int64_t handle;
 
     handle = ga_get_fd_handle(ga_state, errp);
     if (handle < 0) {
         return -1;
     }
-
-    gfh = g_new0(GuestFileHandle, 1);
-    gfh->id = handle;
-    gfh->fh = fh;
-    QTAILQ_INSERT_TAIL(&guest_file_state.filehandles, gfh, next);
+    guest_file_handle_insert(handle, fh, caching, ga_get_session(ga_state));
 
     return handle;
 }
 
+/* handles can only be used by the client that opened them */
 static GuestFileHandle *guest_file_handle_find(int64_t id, Error **errp)
 {
-    GuestFileHandle *gfh;
+    GuestFileHandle *gfh = g_hash_table_lookup(guest_file_state.filehandles,
+                                               &id);
 
-    QTAILQ_FOREACH(gfh, &guest_file_state.filehandles, next)
-    {
-        if (gfh->id == id) {
-            return gfh;
-        }
+    if (!gfh || gfh->session != ga_get_session(ga_state)) {
+        error_setg(errp, "handle '%" PRId64 "' has not been found", id);
+        return NULL;
     }
+    return gfh;
+}
 
-    error_setg(errp, "handle '%" PRId64 "' has not been found", id);
-    return NULL;
+static void guest_file_handle_remove(GuestFileHandle *gfh)
+{
+    guest_file_session_count(gfh->session, -1);
+    g_hash_table_remove(guest_file_state.filehandles, &gfh->id);
 }
 
 typedef const char * const ccpc;
@@ -406,7 +478,49 @@ static int guest_file_toggle_flags(int fd, int flags, bool set, Error **err)
     return ret;
 }
 
+/* take stdio buffering out of the way of unbuffered and direct handles */
+static int guest_file_set_caching(FILE *fh, GuestFileCaching caching,
+                                  Error **errp)
+{
+    setvbuf(fh, NULL, _IONBF, 0);
+    if (caching == GUEST_FILE_CACHING_DIRECT) {
+#ifdef O_DIRECT
+        return guest_file_toggle_flags(fileno(fh), O_DIRECT, true, errp);
+#else
+        error_setg(errp, QERR_UNSUPPORTED);
+        return -1;
+#endif
+    }
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fileno(fh), 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    return 0;
+}
+
+/* what an unbuffered handle read or wrote has no business in the cache */
+static void guest_file_drop_cache(GuestFileHandle *gfh, off_t offset,
+                                  size_t len)
+{
+#ifdef POSIX_FADV_DONTNEED
+    if (gfh->caching == GUEST_FILE_CACHING_UNBUFFERED && len) {
+        posix_fadvise(fileno(gfh->fh), offset, len, POSIX_FADV_DONTNEED);
+    }
+#endif
+}
+
+/* the stdio stream of a direct handle cannot do unaligned I/O */
+static bool guest_file_check_stream(GuestFileHandle *gfh, const char *cmd,
+                                    Error **errp)
+{
+    if (gfh->caching == GUEST_FILE_CACHING_DIRECT) {
+        error_setg(errp, "%s is not available with direct caching", cmd);
+        return false;
+    }
+    return true;
+}
+
 int64_t qmp_guest_file_open(const char *path, bool has_mode, const char *mode,
+                            bool has_caching, GuestFileCaching caching,
                             Error **errp)
 {
     FILE *fh;
@@ -416,7 +530,13 @@ int64_t qmp_guest_file_open(const char *path, bool has_mode, const char *mode,
     if (!has_mode) {
         mode = "r";
     }
+    if (!has_caching) {
+        caching = GUEST_FILE_CACHING_BUFFERED;
+    }
     slog("guest-file-open called, filepath: %s, mode: %s", path, mode);
+    if (!guest_file_handle_check_limit(errp)) {
+        return -1;
+    }
     fh = safe_open_or_create(path, mode, &local_err);
     if (local_err != NULL) {
         error_propagate(errp, local_err);
@@ -430,8 +550,13 @@ int64_t qmp_guest_file_open(const char *path, bool has_mode, const char *mode,
         fclose(fh);
         return -1;
     }
+    if (caching != GUEST_FILE_CACHING_BUFFERED &&
+        guest_file_set_caching(fh, caching, errp) < 0) {
+        fclose(fh);
+        return -1;
+    }
 
-    handle = guest_file_handle_add(fh, errp);
+    handle = guest_file_handle_add(fh, caching, errp);
     if (handle < 0) {
         fclose(fh);
         return -1;
@@ -457,8 +582,129 @@ void qmp_guest_file_close(int64_t handle, Error **errp)
         return;
     }
 
-    QTAILQ_REMOVE(&guest_file_state.filehandles, gfh, next);
-    g_free(gfh);
+    guest_file_handle_remove(gfh);
+}
+
+/*
+ * @read_count bytes read, for the client.  @buf is the buffer from
+ * qemu_buffer_pool_alloc() holding them and is consumed; if it is NULL,
+ * @data is not ours to keep (a file mapping) and is only read.
+ */
+static GuestFileRead *guest_file_read_result(const guchar *data, guchar *buf,
+                                             size_t read_count, bool eof)
+{
+    GuestFileRead *read_data = g_new0(GuestFileRead, 1);
+    guchar *compressed;
+    size_t len;
+
+    read_data->count = read_count;
+    read_data->eof = eof;
+    compressed = ga_compress(ga_state, data, read_count, &len);
+    if (compressed) {
+        data = compressed;
+        read_data->has_compressed = read_data->compressed = true;
+    } else {
+        len = read_count;
+    }
+    if (ga_is_framed(ga_state) && compressed) {
+        ga_set_response_attachment(ga_state, compressed, len);
+        compressed = NULL;
+    } else if (ga_is_framed(ga_state)) {
+        if (!buf) {
+            buf = qemu_buffer_pool_alloc(len);
+            memcpy(buf, data, len);
+        }
+        ga_set_response_buffer(ga_state, buf, len);
+        buf = NULL;
+    } else {
+        read_data->has_buf_b64 = true;
+        if (len) {
+            read_data->buf_b64 = qemu_base64_encode(data, len);
+        }
+    }
+    g_free(compressed);
+    qemu_buffer_pool_free(buf);
+
+    return read_data;
+}
+
+/*
+ * Reads of at least this much from a regular file are served from a
+ * mapping of it, which saves zeroing a buffer and copying into it
+ */
+#define GUEST_FILE_MMAP_MIN (64 * 1024)
+
+/* where a SIGBUS on a file mapping of this thread returns to */
+static __thread sigjmp_buf *guest_file_sigbus_jmp;
+
+static void guest_file_sigbus_handler(int signum)
+{
+    if (guest_file_sigbus_jmp) {
+        siglongjmp(*guest_file_sigbus_jmp, 1);
+    }
+    /* not ours, die the way we would have without the handler */
+    signal(SIGBUS, SIG_DFL);
+    raise(SIGBUS);
+}
+
+/*
+ * Up to @count bytes at @offset of the regular file of @gfh, straight from
+ * a mapping of the file.  Returns NULL, without setting @errp, if the read
+ * should go through the file descriptor instead.
+ */
+static GuestFileRead *guest_file_read_mapped(GuestFileHandle *gfh,
+                                             int64_t offset, int64_t count,
+                                             int64_t *read_count,
+                                             Error **errp)
+{
+    static bool sigbus_installed;
+    GuestFileRead *volatile read_data = NULL;
+    sigjmp_buf jmp;
+    struct sigaction act;
+    struct stat st;
+    size_t page = getpagesize(), delta, len;
+    guchar *map;
+
+    if (count < GUEST_FILE_MMAP_MIN ||
+        gfh->caching == GUEST_FILE_CACHING_DIRECT ||
+        fstat(fileno(gfh->fh), &st) < 0 || !S_ISREG(st.st_mode) ||
+        offset >= st.st_size) {
+        return NULL;
+    }
+
+    *read_count = MIN(count, st.st_size - offset);
+    delta = offset & (page - 1);
+    len = *read_count + delta;
+    map = mmap(NULL, len, PROT_READ, MAP_SHARED, fileno(gfh->fh),
+               offset - delta);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+#ifdef MADV_SEQUENTIAL
+    madvise(map, len, MADV_SEQUENTIAL);
+#endif
+
+    if (!sigbus_installed) {
+        memset(&act, 0, sizeof(act));
+        act.sa_handler = guest_file_sigbus_handler;
+        sigaction(SIGBUS, &act, NULL);
+        sigbus_installed = true;
+    }
+
+    /* the file can be truncated under the mapping while it is encoded */
+    if (sigsetjmp(jmp, 1)) {
+        guest_file_sigbus_jmp = NULL;
+        qapi_free_GuestFileRead(read_data);
+        read_data = NULL;
+        error_setg(errp, "file was truncated while it was read");
+    } else {
+        guest_file_sigbus_jmp = &jmp;
+        read_data = guest_file_read_result(map + delta, NULL, *read_count,
+                                           *read_count < count);
+        guest_file_sigbus_jmp = NULL;
+    }
+    munmap(map, len);
+    return read_data;
 }
 
 struct GuestFileRead *qmp_guest_file_read(int64_t handle, bool has_count,
@@ -466,11 +712,14 @@ struct GuestFileRead *qmp_guest_file_read(int64_t handle, bool has_count,
 {
     GuestFileHandle *gfh = guest_file_handle_find(handle, errp);
     GuestFileRead *read_data = NULL;
+    Error *err = NULL;
     guchar *buf;
     FILE *fh;
+    off_t offset = 0;
     size_t read_count;
+    int64_t mapped;
 
-    if (!gfh) {
+    if (!gfh || !guest_file_check_stream(gfh, "guest-file-read", errp)) {
         return NULL;
     }
 
@@ -483,68 +732,266 @@ struct GuestFileRead *qmp_guest_file_read(int64_t handle, bool has_count,
     }
 
     fh = gfh->fh;
-    buf = g_malloc0(count+1);
+    if (count >= GUEST_FILE_MMAP_MIN) {
+        /* data in the stdio buffers has to be accounted for first */
+        fflush(fh);
+        offset = ftello(fh);
+        read_data = guest_file_read_mapped(gfh, offset, count, &mapped,
+                                           &err);
+        if (read_data) {
+            fseeko(fh, offset + mapped, SEEK_SET);
+            guest_file_drop_cache(gfh, offset, mapped);
+            return read_data;
+        }
+        if (err) {
+            error_propagate(errp, err);
+            return NULL;
+        }
+    } else if (gfh->caching == GUEST_FILE_CACHING_UNBUFFERED) {
+        offset = ftello(fh);
+    }
+    /* a pooled buffer: a large read does not fault in fresh pages */
+    buf = qemu_buffer_pool_alloc(count);
     read_count = fread(buf, 1, count, fh);
     if (ferror(fh)) {
         error_setg_errno(errp, errno, "failed to read file");
         slog("guest-file-read failed, handle: %" PRId64, handle);
+        qemu_buffer_pool_free(buf);
     } else {
-        buf[read_count] = 0;
-        read_data = g_new0(GuestFileRead, 1);
-        read_data->count = read_count;
-        read_data->eof = feof(fh);
-        if (read_count) {
-            read_data->buf_b64 = g_base64_encode(buf, read_count);
-        }
+        trace_qga_file_read(handle, count, read_count);
+        guest_file_drop_cache(gfh, offset, read_count);
+        read_data = guest_file_read_result(buf, buf, read_count, feof(fh));
     }
-    g_free(buf);
     clearerr(fh);
 
     return read_data;
 }
 
-GuestFileWrite *qmp_guest_file_write(int64_t handle, const char *buf_b64,
+GuestFileRead *qmp_guest_file_pread(int64_t handle, int64_t offset,
+                                    bool has_count, int64_t count,
+                                    Error **errp)
+{
+    GuestFileHandle *gfh = guest_file_handle_find(handle, errp);
+    GuestFileRead *read_data;
+    Error *err = NULL;
+    guchar *buf, *bounce = NULL, *dst;
+    size_t read_count = 0;
+    int64_t mapped;
+    ssize_t ret;
+
+    if (!gfh) {
+        return NULL;
+    }
+
+    if (!has_count) {
+        count = QGA_READ_COUNT_DEFAULT;
+    } else if (count < 0) {
+        error_setg(errp, "value '%" PRId64 "' is invalid for argument count",
+                   count);
+        return NULL;
+    }
+    if (offset < 0) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "offset",
+                   "a non-negative number");
+        return NULL;
+    }
+
+    if (gfh->caching == GUEST_FILE_CACHING_BUFFERED) {
+        /* writes still in the stdio buffer come first */
+        fflush(gfh->fh);
+    }
+    read_data = guest_file_read_mapped(gfh, offset, count, &mapped, &err);
+    if (read_data) {
+        guest_file_drop_cache(gfh, offset, mapped);
+        return read_data;
+    }
+    if (err) {
+        error_propagate(errp, err);
+        return NULL;
+    }
+
+    buf = qemu_buffer_pool_alloc(count);
+    dst = buf;
+    if (gfh->caching == GUEST_FILE_CACHING_DIRECT) {
+        dst = bounce = qemu_try_memalign(getpagesize(), MAX(count, 1));
+        if (!bounce) {
+            error_setg_errno(errp, ENOMEM, "failed to read file");
+            qemu_buffer_pool_free(buf);
+            return NULL;
+        }
+    }
+
+    for (;;) {
+        ret = pread(fileno(gfh->fh), dst + read_count, count - read_count,
+                    offset + read_count);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret < 0) {
+            error_setg_errno(errp, errno, "failed to read file");
+            slog("guest-file-pread failed, handle: %" PRId64, handle);
+            qemu_buffer_pool_free(buf);
+            qemu_vfree(bounce);
+            return NULL;
+        }
+        read_count += ret;
+        /* a direct read that comes up short is at the end of the file */
+        if (!ret || read_count == count || bounce) {
+            break;
+        }
+    }
+
+    if (bounce) {
+        memcpy(buf, bounce, read_count);
+        qemu_vfree(bounce);
+    }
+    guest_file_drop_cache(gfh, offset, read_count);
+    return guest_file_read_result(buf, buf, read_count, read_count < count);
+}
+
+/*
+ * The data of a guest-file-write or guest-file-pwrite: @buf_b64 decoded
+ * into *@buf, from qemu_buffer_pool_alloc() and to be freed by the caller,
+ * or the attachment of the request.  *@count is checked against it, or set
+ * to its length if not given.
+ */
+static bool guest_file_write_data(bool has_buf_b64, const char *buf_b64,
+                                  bool has_count, int64_t *count,
+                                  const guchar **data, guchar **buf,
+                                  Error **errp)
+{
+    size_t buf_len;
+
+    *buf = NULL;
+    if (has_buf_b64) {
+        buf_len = strlen(buf_b64);
+        *buf = qemu_buffer_pool_alloc(qemu_base64_decoded_max(buf_len));
+        buf_len = qemu_base64_decode_buf(buf_b64, buf_len, *buf);
+        *data = *buf;
+    } else if (ga_is_framed(ga_state)) {
+        *data = ga_get_attachment(ga_state, &buf_len);
+    } else {
+        error_setg(errp, QERR_MISSING_PARAMETER, "buf-b64");
+        return false;
+    }
+
+    if (!has_count) {
+        *count = buf_len;
+    } else if (*count < 0 || *count > buf_len) {
+        error_setg(errp, "value '%" PRId64 "' is invalid for argument count",
+                   *count);
+        qemu_buffer_pool_free(*buf);
+        *buf = NULL;
+        return false;
+    }
+    return true;
+}
+
+GuestFileWrite *qmp_guest_file_write(int64_t handle, bool has_buf_b64,
+                                     const char *buf_b64,
                                      bool has_count, int64_t count,
                                      Error **errp)
 {
     GuestFileWrite *write_data = NULL;
+    const guchar *data;
     guchar *buf;
-    gsize buf_len;
     int write_count;
     GuestFileHandle *gfh = guest_file_handle_find(handle, errp);
     FILE *fh;
+    off_t offset = 0;
 
-    if (!gfh) {
+    if (!gfh || !guest_file_check_stream(gfh, "guest-file-write", errp)) {
         return NULL;
     }
 
     fh = gfh->fh;
-    buf = g_base64_decode(buf_b64, &buf_len);
-
-    if (!has_count) {
-        count = buf_len;
-    } else if (count < 0 || count > buf_len) {
-        error_setg(errp, "value '%" PRId64 "' is invalid for argument count",
-                   count);
-        g_free(buf);
+    if (!guest_file_write_data(has_buf_b64, buf_b64, has_count, &count,
+                               &data, &buf, errp)) {
         return NULL;
     }
 
-    write_count = fwrite(buf, 1, count, fh);
+    if (gfh->caching == GUEST_FILE_CACHING_UNBUFFERED) {
+        offset = ftello(fh);
+    }
+    write_count = fwrite(data, 1, count, fh);
     if (ferror(fh)) {
         error_setg_errno(errp, errno, "failed to write to file");
         slog("guest-file-write failed, handle: %" PRId64, handle);
     } else {
+        trace_qga_file_write(handle, count, write_count);
+        guest_file_drop_cache(gfh, offset, write_count);
         write_data = g_new0(GuestFileWrite, 1);
         write_data->count = write_count;
         write_data->eof = feof(fh);
     }
-    g_free(buf);
+    qemu_buffer_pool_free(buf);
     clearerr(fh);
 
     return write_data;
 }
 
+GuestFileWrite *qmp_guest_file_pwrite(int64_t handle, int64_t offset,
+                                      bool has_buf_b64, const char *buf_b64,
+                                      bool has_count, int64_t count,
+                                      Error **errp)
+{
+    GuestFileHandle *gfh = guest_file_handle_find(handle, errp);
+    GuestFileWrite *write_data = NULL;
+    const guchar *data;
+    guchar *buf, *bounce = NULL;
+    size_t write_count = 0;
+    ssize_t ret;
+
+    if (!gfh) {
+        return NULL;
+    }
+    if (offset < 0) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "offset",
+                   "a non-negative number");
+        return NULL;
+    }
+    if (!guest_file_write_data(has_buf_b64, buf_b64, has_count, &count,
+                               &data, &buf, errp)) {
+        return NULL;
+    }
+
+    if (gfh->caching == GUEST_FILE_CACHING_DIRECT) {
+        bounce = qemu_try_memalign(getpagesize(), MAX(count, 1));
+        if (!bounce) {
+            error_setg_errno(errp, ENOMEM, "failed to write to file");
+            goto out;
+        }
+        memcpy(bounce, data, count);
+        data = bounce;
+    } else if (gfh->caching == GUEST_FILE_CACHING_BUFFERED) {
+        /* or they would land on top of this write later */
+        fflush(gfh->fh);
+    }
+
+    while (write_count < count) {
+        ret = pwrite(fileno(gfh->fh), data + write_count, count - write_count,
+                     offset + write_count);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret < 0) {
+            error_setg_errno(errp, errno, "failed to write to file");
+            slog("guest-file-pwrite failed, handle: %" PRId64, handle);
+            goto out;
+        }
+        write_count += ret;
+    }
+
+    guest_file_drop_cache(gfh, offset, write_count);
+    write_data = g_new0(GuestFileWrite, 1);
+    write_data->count = write_count;
+
+out:
+    qemu_vfree(bounce);
+    qemu_buffer_pool_free(buf);
+    return write_data;
+}
+
 struct GuestFileSeek *qmp_guest_file_seek(int64_t handle, int64_t offset,
                                           int64_t whence, Error **errp)
 {
@@ -588,2378 +1035,16312 @@ void qmp_guest_file_flush(int64_t handle, Error **errp)
     }
 }
 
-/* linux-specific implementations. avoid this if at all possible. */
-#if defined(__linux__)
-
-#if defined(CONFIG_FSFREEZE) || defined(CONFIG_FSTRIM)
-typedef struct FsMount {
-    char *dirname;
-    char *devtype;
-    unsigned int devmajor, devminor;
-    QTAILQ_ENTRY(FsMount) next;
-} FsMount;
+static void guest_file_archive_free(GuestFileArchive *ga);
 
-typedef QTAILQ_HEAD(FsMountList, FsMount) FsMountList;
+#define GUEST_FILE_CHUNK_DEFAULT (1024 * 1024)
+#define GUEST_FILE_CHUNK_MAX (16 * 1024 * 1024)
+#define GUEST_FILE_CREDITS_DEFAULT 16
 
-static void free_fs_mount_list(FsMountList *mounts)
+static GuestFileTransfer *guest_file_transfer_new(FILE *fh, int64_t offset,
+                                                  Error **errp)
 {
-     FsMount *mount, *temp;
+    GuestFileTransfer *gft;
+    int64_t id;
 
-     if (!mounts) {
-         return;
-     }
+    id = ga_get_fd_handle(ga_state, errp);
+    if (id < 0) {
+        return NULL;
+    }
 
-     QTAILQ_FOREACH_SAFE(mount, mounts, next, temp) {
-         QTAILQ_REMOVE(mounts, mount, next);
-         g_free(mount->dirname);
-         g_free(mount->devtype);
-         g_free(mount);
-     }
+    gft = g_new0(GuestFileTransfer, 1);
+    gft->id = id;
+    gft->fh = fh;
+    gft->offset = offset;
+    gft->session = ga_get_session(ga_state);
+    QTAILQ_INSERT_TAIL(&guest_file_state.transfers, gft, next);
+    return gft;
 }
 
-static int dev_major_minor(const char *devpath,
-                           unsigned int *devmajor, unsigned int *devminor)
+static GuestFileTransfer *guest_file_transfer_find(int64_t id, Error **errp)
 {
-    struct stat st;
-
-    *devmajor = 0;
-    *devminor = 0;
+    GuestFileTransfer *gft;
 
-    if (stat(devpath, &st) < 0) {
-        slog("failed to stat device file '%s': %s", devpath, strerror(errno));
-        return -1;
+    QTAILQ_FOREACH(gft, &guest_file_state.transfers, next) {
+        if (gft->id == id && gft->session == ga_get_session(ga_state)) {
+            return gft;
+        }
     }
-    if (S_ISDIR(st.st_mode)) {
-        /* It is bind mount */
-        return -2;
+
+    error_setg(errp, "stream '%" PRId64 "' has not been found", id);
+    return NULL;
+}
+
+static void guest_file_transfer_free(gpointer opaque)
+{
+    GuestFileTransfer *gft = opaque;
+
+    QTAILQ_REMOVE(&guest_file_state.transfers, gft, next);
+    ga_reader_free(gft->reader);
+    if (gft->archive) {
+        guest_file_archive_free(gft->archive);
+    } else {
+        fclose(gft->fh);
     }
-    if (S_ISBLK(st.st_mode)) {
-        *devmajor = major(st.st_rdev);
-        *devminor = minor(st.st_rdev);
-        return 0;
+    g_free(gft);
+}
+
+static gboolean guest_file_handle_orphaned(gpointer key, gpointer value,
+                                           gpointer opaque)
+{
+    GuestFileHandle *gfh = value;
+
+    if (opaque && gfh->session != opaque) {
+        return false;
     }
-    return -1;
+    slog("guest-file: closing handle %" PRId64 " left open", gfh->id);
+    fclose(gfh->fh);
+    return true;
 }
 
-/*
- * Walk the mount table and build a list of local file systems
- */
-static void build_fs_mount_list_from_mtab(FsMountList *mounts, Error **errp)
+/* pull transfers end with their stream, before this is called */
+static void guest_file_session_close(Notifier *notifier, void *data)
 {
-    struct mntent *ment;
-    FsMount *mount;
-    char const *mtab = "/proc/self/mounts";
-    FILE *fp;
-    unsigned int devmajor, devminor;
-
-    fp = setmntent(mtab, "r");
-    if (!fp) {
-        error_setg(errp, "failed to open mtab file: '%s'", mtab);
-        return;
+    GASession *session = data;
+    GuestFileTransfer *gft, *tmp;
+
+    g_hash_table_foreach_remove(guest_file_state.filehandles,
+                                guest_file_handle_orphaned, session);
+    g_hash_table_remove(guest_file_state.session_count, session);
+    QTAILQ_FOREACH_SAFE(gft, &guest_file_state.transfers, next, tmp) {
+        if (gft->session == session) {
+            guest_file_transfer_free(gft);
+        }
     }
+}
 
-    while ((ment = getmntent(fp))) {
-        /*
-         * An entry which device name doesn't start with a '/' is
-         * either a dummy file system or a network file system.
-         * Add special handling for smbfs and cifs as is done by
-         * coreutils as well.
-         */
-        if ((ment->mnt_fsname[0] != '/') ||
-            (strcmp(ment->mnt_type, "smbfs") == 0) ||
-            (strcmp(ment->mnt_type, "cifs") == 0)) {
-            continue;
-        }
-        if (dev_major_minor(ment->mnt_fsname, &devmajor, &devminor) == -2) {
-            /* Skip bind mounts */
-            continue;
-        }
+/* however the handle goes away, the agent no longer has to stay for it */
+static void guest_file_handle_free(gpointer data)
+{
+    ga_busy_unref(ga_state);
+    g_free(data);
+}
 
-        mount = g_new0(FsMount, 1);
-        mount->dirname = g_strdup(ment->mnt_dir);
-        mount->devtype = g_strdup(ment->mnt_type);
-        mount->devmajor = devmajor;
-        mount->devminor = devminor;
+static void guest_file_init(void)
+{
+    guest_file_state.filehandles = g_hash_table_new_full(g_int64_hash,
+                                                         g_int64_equal,
+                                                         NULL,
+                                                         guest_file_handle_free);
+    guest_file_state.session_count = g_hash_table_new(NULL, NULL);
+}
 
-        QTAILQ_INSERT_TAIL(mounts, mount, next);
-    }
+static void guest_file_cleanup(void)
+{
+    /* the channel, and with it the clients, goes away later */
+    notifier_remove(&guest_file_state.session_close);
+    g_hash_table_foreach_remove(guest_file_state.filehandles,
+                                guest_file_handle_orphaned, NULL);
+    g_hash_table_destroy(guest_file_state.filehandles);
+    g_hash_table_destroy(guest_file_state.session_count);
+}
 
-    endmntent(fp);
+/* guest-upgrade-agent hands open handles over, but not transfers */
+bool ga_file_handoff_check(Error **errp)
+{
+    if (!QTAILQ_EMPTY(&guest_file_state.transfers)) {
+        error_setg(errp, "file transfers are in progress");
+        return false;
+    }
+    return true;
 }
 
-static void decode_mntname(char *name, int len)
+void ga_file_handoff_save(GAHandoff *h)
 {
-    int i, j = 0;
-    for (i = 0; i <= len; i++) {
-        if (name[i] != '\\') {
-            name[j++] = name[i];
-        } else if (name[i + 1] == '\\') {
-            name[j++] = '\\';
-            i++;
-        } else if (name[i + 1] >= '0' && name[i + 1] <= '3' &&
-                   name[i + 2] >= '0' && name[i + 2] <= '7' &&
-                   name[i + 3] >= '0' && name[i + 3] <= '7') {
-            name[j++] = (name[i + 1] - '0') * 64 +
-                        (name[i + 2] - '0') * 8 +
-                        (name[i + 3] - '0');
-            i += 3;
-        } else {
-            name[j++] = name[i];
+    GHashTableIter iter;
+    GuestFileHandle *gfh;
+    gchar *group;
+    int session;
+
+    g_hash_table_iter_init(&iter, guest_file_state.filehandles);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&gfh)) {
+        session = ga_handoff_session_index(h, gfh->session);
+        if (session < 0) {
+            continue;
         }
+        /* puts the offset of the descriptor where the stream is, whether
+         * it was reading ahead or holding back writes
+         */
+        fflush(gfh->fh);
+        group = g_strdup_printf("file %" PRId64, gfh->id);
+        g_key_file_set_integer(h->keyfile, group, "fd", fileno(gfh->fh));
+        g_key_file_set_integer(h->keyfile, group, "session", session);
+        g_key_file_set_string(h->keyfile, group, "caching",
+                              GuestFileCaching_lookup[gfh->caching]);
+        ga_handoff_keep_fd(h, fileno(gfh->fh));
+        g_free(group);
     }
 }
 
-static void build_fs_mount_list(FsMountList *mounts, Error **errp)
+/* the fopen() mode the descriptor was opened with, near enough */
+static const char *guest_file_fd_mode(int fd)
 {
-    FsMount *mount;
-    char const *mountinfo = "/proc/self/mountinfo";
-    FILE *fp;
-    char *line = NULL, *dash;
-    size_t n;
-    char check;
-    unsigned int devmajor, devminor;
-    int ret, dir_s, dir_e, type_s, type_e, dev_s, dev_e;
+    int flags = fcntl(fd, F_GETFL);
 
-    fp = fopen(mountinfo, "r");
-    if (!fp) {
-        build_fs_mount_list_from_mtab(mounts, errp);
-        return;
+    if (flags < 0) {
+        return NULL;
+    }
+    switch (flags & O_ACCMODE) {
+    case O_RDONLY:
+        return "r";
+    case O_WRONLY:
+        return flags & O_APPEND ? "a" : "w";
+    default:
+        return flags & O_APPEND ? "a+" : "r+";
     }
+}
 
-    while (getline(&line, &n, fp) != -1) {
-        ret = sscanf(line, "%*u %*u %u:%u %*s %n%*s%n%c",
-                     &devmajor, &devminor, &dir_s, &dir_e, &check);
-        if (ret < 3) {
-            continue;
-        }
-        dash = strstr(line + dir_e, " - ");
-        if (!dash) {
+void ga_file_handoff_load(GAHandoff *h)
+{
+    gchar **groups = g_key_file_get_groups(h->keyfile, NULL);
+    GuestFileCaching caching;
+    GASession *session;
+    const char *mode;
+    gchar *str;
+    FILE *fh;
+    int64_t id;
+    int i, fd;
+
+    for (i = 0; groups[i]; i++) {
+        if (!g_str_has_prefix(groups[i], "file ")) {
             continue;
         }
-        ret = sscanf(dash, " - %n%*s%n %n%*s%n%c",
-                     &type_s, &type_e, &dev_s, &dev_e, &check);
-        if (ret < 1) {
+        id = g_ascii_strtoll(groups[i] + 5, NULL, 10);
+        fd = g_key_file_get_integer(h->keyfile, groups[i], "fd", NULL);
+        session = ga_handoff_session(h, g_key_file_get_integer(
+                                         h->keyfile, groups[i], "session",
+                                         NULL));
+        str = g_key_file_get_string(h->keyfile, groups[i], "caching", NULL);
+        caching = qapi_enum_parse(GuestFileCaching_lookup, str,
+                                  GUEST_FILE_CACHING_MAX,
+                                  GUEST_FILE_CACHING_BUFFERED, NULL);
+        g_free(str);
+
+        qemu_set_cloexec(fd);
+        mode = guest_file_fd_mode(fd);
+        fh = session && mode ? fdopen(fd, mode) : NULL;
+        if (!fh) {
+            g_warning("guest-file: cannot take over handle %" PRId64, id);
+            close(fd);
             continue;
         }
-        line[dir_e] = 0;
-        dash[type_e] = 0;
-        dash[dev_e] = 0;
-        decode_mntname(line + dir_s, dir_e - dir_s);
-        decode_mntname(dash + dev_s, dev_e - dev_s);
-        if (devmajor == 0) {
-            /* btrfs reports major number = 0 */
-            if (strcmp("btrfs", dash + type_s) != 0 ||
-                dev_major_minor(dash + dev_s, &devmajor, &devminor) < 0) {
-                continue;
-            }
+        if (caching != GUEST_FILE_CACHING_BUFFERED) {
+            setvbuf(fh, NULL, _IONBF, 0);
         }
-
-        mount = g_new0(FsMount, 1);
-        mount->dirname = g_strdup(line + dir_s);
-        mount->devtype = g_strdup(dash + type_s);
-        mount->devmajor = devmajor;
-        mount->devminor = devminor;
-
-        QTAILQ_INSERT_TAIL(mounts, mount, next);
+        guest_file_handle_insert(id, fh, caching, session);
     }
-    free(line);
-
-    fclose(fp);
+    g_strfreev(groups);
 }
-#endif
-
-#if defined(CONFIG_FSFREEZE)
 
-static char *get_pci_driver(char const *syspath, int pathlen, Error **errp)
+static GuestFileStream *guest_file_stream_info(GuestFileTransfer *gft)
 {
-    char *path;
-    char *dpath;
-    char *driver = NULL;
-    char buf[PATH_MAX];
-    ssize_t len;
+    GuestFileStream *info = g_new0(GuestFileStream, 1);
+    struct stat st;
 
-    path = g_strndup(syspath, pathlen);
-    dpath = g_strdup_printf("%s/driver", path);
-    len = readlink(dpath, buf, sizeof(buf) - 1);
-    if (len != -1) {
-        buf[len] = 0;
-        driver = g_strdup(basename(buf));
+    info->stream = gft->id;
+    if (gft->fh && fstat(fileno(gft->fh), &st) == 0) {
+        info->size = st.st_size;
     }
-    g_free(dpath);
-    g_free(path);
-    return driver;
+    return info;
 }
 
-static int compare_uint(const void *_a, const void *_b)
+/*
+ * For a sparse pull that is done with the data it was reading: the length
+ * of the hole at the offset, or 0 after starting the reader on the data
+ * there, up to the next hole.  Without SEEK_DATA, or on a file system
+ * that does not know about holes, the rest of the file is data.
+ */
+static int64_t guest_file_pull_extent(GuestFileTransfer *gft)
 {
-    unsigned int a = *(unsigned int *)_a;
-    unsigned int b = *(unsigned int *)_b;
+    int fd = fileno(gft->fh);
+    int64_t data = gft->offset, hole = INT64_MAX;
+#ifdef SEEK_DATA
+    struct stat st;
 
-    return a < b ? -1 : a > b ? 1 : 0;
+    data = lseek(fd, gft->offset, SEEK_DATA);
+    if (data < 0 && errno == ENXIO) {
+        /* no data after the offset, only a hole up to the end, if any */
+        data = fstat(fd, &st) == 0 ? MAX(st.st_size, gft->offset)
+                                   : gft->offset;
+    } else if (data < 0) {
+        data = gft->offset;
+    }
+    if (data > gft->offset) {
+        return MIN(data - gft->offset, gft->remaining);
+    }
+    hole = lseek(fd, gft->offset, SEEK_HOLE);
+    if (hole <= gft->offset) {
+        hole = INT64_MAX;
+    }
+#endif
+
+    gft->data_end = hole;
+    ga_reader_free(gft->reader);
+    gft->reader = ga_reader_new(fd, gft->offset,
+                                MIN(gft->remaining, hole - gft->offset),
+                                gft->chunk_size);
+    return 0;
 }
 
-/* Walk the specified sysfs and build a sorted list of host or ata numbers */
-static int build_hosts(char const *syspath, char const *host, bool ata,
-                       unsigned int *hosts, int hosts_max, Error **errp)
+/* a GUEST_FILE_DATA event for the @hole bytes at the offset */
+static QDict *guest_file_pull_hole(GuestFileTransfer *gft, int64_t hole,
+                                   bool *last)
 {
-    char *path;
-    DIR *dir;
-    struct dirent *entry;
-    int i = 0;
+    QDict *data = qdict_new(), *event;
+
+    qdict_put(data, "stream", qint_from_int(gft->id));
+    qdict_put(data, "offset", qint_from_int(gft->offset));
+    qdict_put(data, "count", qint_from_int(hole));
+    qdict_put(data, "hole", qbool_from_bool(true));
+    gft->offset += hole;
+    gft->remaining -= hole;
+    gft->count += hole;
+    *last = !gft->remaining;
+    qdict_put(data, "eof", qbool_from_bool(*last));
+
+    event = qmp_event_build_dict("GUEST_FILE_DATA");
+    qdict_put(event, "data", data);
+    return event;
+}
 
-    path = g_strndup(syspath, host - syspath);
-    dir = opendir(path);
-    if (!dir) {
-        error_setg_errno(errp, errno, "opendir(\"%s\")", path);
-        g_free(path);
-        return -1;
+/* the next GUEST_FILE_DATA event: the chunk the reader has ready goes
+ * into the attachment, compressed or copied once, with no stdio buffer or
+ * base64 copy in between
+ */
+static QDict *guest_file_pull_next(void *opaque, void **attachment,
+                                   size_t *len, bool *last)
+{
+    GuestFileTransfer *gft = opaque;
+    size_t want, got = 0;
+    const guchar *buf = NULL;
+    guchar *compressed;
+    QDict *data, *event;
+    int64_t hole;
+    ssize_t ret;
+    int err = 0;
+
+    if (gft->sparse && gft->offset >= gft->data_end) {
+        hole = guest_file_pull_extent(gft);
+        if (hole) {
+            return guest_file_pull_hole(gft, hole, last);
+        }
     }
+    want = MIN(MIN(gft->remaining, gft->data_end - gft->offset),
+               (int64_t)gft->chunk_size);
 
-    while (i < hosts_max) {
-        entry = readdir(dir);
-        if (!entry) {
-            break;
-        }
-        if (ata && sscanf(entry->d_name, "ata%d", hosts + i) == 1) {
-            ++i;
-        } else if (!ata && sscanf(entry->d_name, "host%d", hosts + i) == 1) {
-            ++i;
-        }
+    data = qdict_new();
+    ret = ga_reader_next(gft->reader, &buf);
+    if (ret < 0) {
+        err = -ret;
+    } else {
+        got = ret;
     }
 
-    qsort(hosts, i, sizeof(hosts[0]), compare_uint);
+    qdict_put(data, "stream", qint_from_int(gft->id));
+    qdict_put(data, "offset", qint_from_int(gft->offset));
+    qdict_put(data, "count", qint_from_int(got));
+    if (err) {
+        qdict_put(data, "error", qstring_from_str(strerror(err)));
+        slog("guest-file-pull failed, stream: %" PRId64, gft->id);
+    }
+    gft->offset += got;
+    gft->remaining -= got;
+    gft->count += got;
+    *last = err || got < want || !gft->remaining;
+    qdict_put(data, "eof", qbool_from_bool(*last));
+
+    compressed = ga_compress(ga_state, buf, got, len);
+    if (compressed) {
+        *attachment = compressed;
+        qdict_put(data, "compressed", qbool_from_bool(true));
+    } else {
+        *attachment = g_memdup(buf, got);
+        *len = got;
+    }
 
-    g_free(path);
-    closedir(dir);
-    return i;
+    event = qmp_event_build_dict("GUEST_FILE_DATA");
+    qdict_put(event, "data", data);
+    return event;
 }
 
-/* Store disk device info specified by @sysfs into @fs */
-static void build_guest_fsinfo_for_real_device(char const *syspath,
-                                               GuestFilesystemInfo *fs,
-                                               Error **errp)
+GuestFileStream *qmp_guest_file_pull(const char *path, bool has_offset,
+                                     int64_t offset, bool has_length,
+                                     int64_t length, bool has_chunk_size,
+                                     int64_t chunk_size, bool has_credits,
+                                     int64_t credits, bool has_sparse,
+                                     bool sparse, Error **errp)
 {
-    unsigned int pci[4], host, hosts[8], tgt[3];
-    int i, nhosts = 0, pcilen;
-    GuestDiskAddress *disk;
-    GuestPCIAddress *pciaddr;
-    GuestDiskAddressList *list = NULL;
-    bool has_ata = false, has_host = false, has_tgt = false;
-    char *p, *q, *driver = NULL;
+    GuestFileTransfer *gft;
+    GuestFileStream *info;
+    FILE *fh;
 
-    p = strstr(syspath, "/devices/pci");
-    if (!p || sscanf(p + 12, "%*x:%*x/%x:%x:%x.%x%n",
-                     pci, pci + 1, pci + 2, pci + 3, &pcilen) < 4) {
-        g_debug("only pci device is supported: sysfs path \"%s\"", syspath);
-        return;
+    if (!ga_is_framed(ga_state)) {
+        error_setg(errp, "guest-file-pull requires length-prefixed framing");
+        return NULL;
     }
-
-    driver = get_pci_driver(syspath, (p + 12 + pcilen) - syspath, errp);
-    if (!driver) {
-        goto cleanup;
+    if (!has_offset) {
+        offset = 0;
+    } else if (offset < 0) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "offset",
+                   "a non-negative number");
+        return NULL;
     }
-
-    p = strstr(syspath, "/target");
-    if (p && sscanf(p + 7, "%*u:%*u:%*u/%*u:%u:%u:%u",
-                    tgt, tgt + 1, tgt + 2) == 3) {
-        has_tgt = true;
+    if (!has_length) {
+        length = INT64_MAX;
+    } else if (length < 0) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "length",
+                   "a non-negative number");
+        return NULL;
     }
-
-    p = strstr(syspath, "/ata");
-    if (p) {
-        q = p + 4;
-        has_ata = true;
-    } else {
-        p = strstr(syspath, "/host");
-        q = p + 5;
+    if (!has_chunk_size) {
+        chunk_size = GUEST_FILE_CHUNK_DEFAULT;
+    } else if (chunk_size < 1 || chunk_size > GUEST_FILE_CHUNK_MAX) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "chunk-size",
+                   "a number of bytes between 1 and 16M");
+        return NULL;
     }
-    if (p && sscanf(q, "%u", &host) == 1) {
-        has_host = true;
-        nhosts = build_hosts(syspath, p, has_ata, hosts,
-                             sizeof(hosts) / sizeof(hosts[0]), errp);
-        if (nhosts < 0) {
-            goto cleanup;
-        }
+    if (!has_credits) {
+        credits = GUEST_FILE_CREDITS_DEFAULT;
+    } else if (credits < 0) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "credits",
+                   "a non-negative number");
+        return NULL;
     }
 
-    pciaddr = g_malloc0(sizeof(*pciaddr));
-    pciaddr->domain = pci[0];
-    pciaddr->bus = pci[1];
-    pciaddr->slot = pci[2];
-    pciaddr->function = pci[3];
+    slog("guest-file-pull called, filepath: %s", path);
+    fh = safe_open_or_create(path, "r", errp);
+    if (!fh) {
+        return NULL;
+    }
+    gft = guest_file_transfer_new(fh, offset, errp);
+    if (!gft) {
+        fclose(fh);
+        return NULL;
+    }
+    gft->remaining = length;
+    gft->chunk_size = chunk_size;
+    gft->sparse = has_sparse && sparse;
+    if (gft->sparse) {
+        /* the first event looks for the first data */
+        gft->data_end = offset;
+    } else {
+        gft->data_end = INT64_MAX;
+        gft->reader = ga_reader_new(fileno(fh), offset, length, chunk_size);
+    }
 
-    disk = g_malloc0(sizeof(*disk));
-    disk->pci_controller = pciaddr;
+    info = guest_file_stream_info(gft);
+    gft->stream = ga_stream_new(ga_state, credits, guest_file_pull_next, gft,
+                                guest_file_transfer_free);
+    return info;
+}
 
-    list = g_malloc0(sizeof(*list));
-    list->value = disk;
+void qmp_guest_file_stream_credit(int64_t stream, int64_t credits,
+                                  Error **errp)
+{
+    GuestFileTransfer *gft = guest_file_transfer_find(stream, errp);
 
-    if (strcmp(driver, "ata_piix") == 0) {
-        /* a host per ide bus, target*:0:<unit>:0 */
-        if (!has_host || !has_tgt) {
-            g_debug("invalid sysfs path '%s' (driver '%s')", syspath, driver);
-            goto cleanup;
+    if (!gft) {
+        return;
+    }
+    if (!gft->stream) {
+        error_setg(errp, "stream '%" PRId64 "' is not a guest-file-pull",
+                   stream);
+        return;
+    }
+    if (credits < 0) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "credits",
+                   "a non-negative number");
+        return;
+    }
+    ga_stream_add_credits(gft->stream, credits);
+}
+
+GuestFileStream *qmp_guest_file_push(const char *path, bool has_offset,
+                                     int64_t offset, bool has_truncate,
+                                     bool truncate, Error **errp)
+{
+    GuestFileTransfer *gft;
+    FILE *fh;
+
+    if (!ga_is_framed(ga_state)) {
+        error_setg(errp, "guest-file-push requires length-prefixed framing");
+        return NULL;
+    }
+    if (!has_offset) {
+        offset = 0;
+    } else if (offset < 0) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "offset",
+                   "a non-negative number");
+        return NULL;
+    }
+
+    slog("guest-file-push called, filepath: %s", path);
+    fh = safe_open_or_create(path, has_truncate && !truncate ? "r+" : "w",
+                             errp);
+    if (!fh) {
+        return NULL;
+    }
+    gft = guest_file_transfer_new(fh, offset, errp);
+    if (!gft) {
+        fclose(fh);
+        return NULL;
+    }
+    return guest_file_stream_info(gft);
+}
+
+void qmp_guest_file_push_data(int64_t stream, Error **errp)
+{
+    GuestFileTransfer *gft = guest_file_transfer_find(stream, errp);
+    const guchar *data;
+    size_t len;
+    ssize_t ret;
+
+    if (!gft) {
+        return;
+    }
+    if (gft->stream) {
+        error_setg(errp, "stream '%" PRId64 "' is not a guest-file-push",
+                   stream);
+        return;
+    }
+    if (!ga_is_framed(ga_state)) {
+        error_setg(errp, "guest-file-push-data requires length-prefixed "
+                   "framing");
+        return;
+    }
+
+    data = ga_get_attachment(ga_state, &len);
+    while (len) {
+        ret = pwrite(fileno(gft->fh), data, len, gft->offset);
+        if (ret < 0 && errno == EINTR) {
+            continue;
         }
-        for (i = 0; i < nhosts; i++) {
-            if (host == hosts[i]) {
-                disk->bus_type = GUEST_DISK_BUS_TYPE_IDE;
-                disk->bus = i;
-                disk->unit = tgt[1];
-                break;
+        if (ret < 0) {
+            error_setg_errno(errp, errno, "failed to write to file");
+            slog("guest-file-push failed, stream: %" PRId64, stream);
+            return;
+        }
+        data += ret;
+        len -= ret;
+        gft->offset += ret;
+        gft->count += ret;
+    }
+}
+
+/* zeros for the part of a hole that cannot be punched */
+static int guest_file_write_zeros(int fd, int64_t offset, int64_t length)
+{
+    static const char zeros[64 * 1024];
+    ssize_t ret;
+
+    while (length) {
+        ret = pwrite(fd, zeros, MIN(length, (int64_t)sizeof(zeros)), offset);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret < 0) {
+            return -errno;
+        }
+        offset += ret;
+        length -= ret;
+    }
+    return 0;
+}
+
+void qmp_guest_file_push_hole(int64_t stream, int64_t length, Error **errp)
+{
+    GuestFileTransfer *gft = guest_file_transfer_find(stream, errp);
+    int fd, ret = 0;
+    int64_t end;
+    struct stat st;
+
+    if (!gft) {
+        return;
+    }
+    if (gft->stream) {
+        error_setg(errp, "stream '%" PRId64 "' is not a guest-file-push",
+                   stream);
+        return;
+    }
+    if (length < 0 || length > INT64_MAX - gft->offset) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "length",
+                   "a non-negative number");
+        return;
+    }
+
+    /* past the end of the file, growing it leaves the hole */
+    fd = fileno(gft->fh);
+    if (fstat(fd, &st) < 0) {
+        ret = -errno;
+    } else {
+        end = MIN(st.st_size, gft->offset + length);
+        if (end > gft->offset) {
+#ifdef CONFIG_FALLOCATE_PUNCH_HOLE
+            if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                          gft->offset, end - gft->offset) < 0) {
+                ret = guest_file_write_zeros(fd, gft->offset,
+                                             end - gft->offset);
             }
+#else
+            ret = guest_file_write_zeros(fd, gft->offset, end - gft->offset);
+#endif
         }
-        if (i >= nhosts) {
-            g_debug("no host for '%s' (driver '%s')", syspath, driver);
-            goto cleanup;
+        if (!ret && gft->offset + length > st.st_size &&
+            ftruncate(fd, gft->offset + length) < 0) {
+            ret = -errno;
         }
-    } else if (strcmp(driver, "sym53c8xx") == 0) {
-        /* scsi(LSI Logic): target*:0:<unit>:0 */
-        if (!has_tgt) {
-            g_debug("invalid sysfs path '%s' (driver '%s')", syspath, driver);
-            goto cleanup;
+    }
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "failed to write hole to file");
+        slog("guest-file-push failed, stream: %" PRId64, stream);
+        return;
+    }
+    gft->offset += length;
+    gft->count += length;
+}
+
+GuestFileStreamClose *qmp_guest_file_stream_close(int64_t stream,
+                                                  Error **errp)
+{
+    GuestFileTransfer *gft = guest_file_transfer_find(stream, errp);
+    GuestFileStreamClose *info;
+
+    if (!gft) {
+        return NULL;
+    }
+
+    info = g_new0(GuestFileStreamClose, 1);
+    info->count = gft->count;
+    if (gft->stream) {
+        ga_stream_free(gft->stream);
+    } else {
+        guest_file_transfer_free(gft);
+    }
+    return info;
+}
+
+#define GUEST_FILE_ARCHIVE_DEPTH_MAX 64
+/* smaller files are read directly, a reader would not pay off */
+#define GUEST_FILE_ARCHIVE_READER_MIN (4 * 1024 * 1024)
+#define TAR_BLOCK 512
+
+/* a directory being archived */
+typedef struct GuestFileArchiveDir {
+    DIR *dir;
+    char *path;
+} GuestFileArchiveDir;
+
+struct GuestFileArchive {
+    strList *paths;             /* still to be archived */
+    strList *exclude;
+    GQueue dirs;                /* GuestFileArchiveDir, innermost first */
+    int64_t max_size;           /* of the tar data, 0 for no limit */
+    int64_t tar_size;           /* taken up by the members so far */
+    GByteArray *pending;        /* headers and padding not sent yet */
+    guint pending_pos;
+    int fd;                     /* the file whose data is being sent */
+    GAReader *reader;           /* for it, if it is large */
+    const guchar *chunk;        /* what the reader handed out, not sent */
+    size_t chunk_len;
+    int64_t file_size;
+    int64_t file_left;
+    bool finished;              /* the end of archive is in pending */
+    int64_t skipped;
+    z_stream *zs;               /* for gzip */
+    guchar *raw;                /* tar data not compressed yet */
+    size_t raw_size;
+};
+
+static void guest_file_archive_free(GuestFileArchive *ga)
+{
+    GuestFileArchiveDir *d;
+
+    while ((d = g_queue_pop_head(&ga->dirs))) {
+        closedir(d->dir);
+        g_free(d->path);
+        g_free(d);
+    }
+    ga_reader_free(ga->reader);
+    if (ga->fd >= 0) {
+        close(ga->fd);
+    }
+    if (ga->zs) {
+        deflateEnd(ga->zs);
+        g_free(ga->zs);
+    }
+    qapi_free_strList(ga->paths);
+    qapi_free_strList(ga->exclude);
+    g_byte_array_free(ga->pending, true);
+    g_free(ga->raw);
+    g_free(ga);
+}
+
+static bool guest_file_archive_excluded(GuestFileArchive *ga,
+                                        const char *name, const char *path)
+{
+    strList *l;
+
+    for (l = ga->exclude; l; l = l->next) {
+        if (!fnmatch(l->value, name, 0) || !fnmatch(l->value, path, 0)) {
+            return true;
         }
-        disk->bus_type = GUEST_DISK_BUS_TYPE_SCSI;
-        disk->unit = tgt[1];
-    } else if (strcmp(driver, "virtio-pci") == 0) {
-        if (has_tgt) {
-            /* virtio-scsi: target*:0:0:<unit> */
-            disk->bus_type = GUEST_DISK_BUS_TYPE_SCSI;
-            disk->unit = tgt[2];
+    }
+    return false;
+}
+
+/* octal, or base-256 for what does not fit, as GNU tar does */
+static void tar_number(char *field, size_t len, uint64_t value)
+{
+    if (value < (1ULL << (3 * (len - 1)))) {
+        snprintf(field, len, "%0*" PRIo64, (int)len - 1, value);
+        return;
+    }
+    memset(field, 0, len);
+    field[0] = 0x80;
+    while (--len) {
+        field[len] = value & 0xff;
+        value >>= 8;
+    }
+}
+
+/* a ustar header, with the checksum filled in */
+static void tar_header(guchar *block, const char *name, const char *link,
+                       const struct stat *st, char type, uint64_t size)
+{
+    unsigned int sum = 0;
+    int i;
+
+    memset(block, 0, TAR_BLOCK);
+    strncpy((char *)block, name, 100);
+    tar_number((char *)block + 100, 8, st->st_mode & 07777);
+    tar_number((char *)block + 108, 8, st->st_uid);
+    tar_number((char *)block + 116, 8, st->st_gid);
+    tar_number((char *)block + 124, 12, size);
+    tar_number((char *)block + 136, 12, MAX(st->st_mtime, 0));
+    block[156] = type;
+    if (link) {
+        strncpy((char *)block + 157, link, 100);
+    }
+    memcpy(block + 257, "ustar", 6);
+    memcpy(block + 263, "00", 2);
+    if (type == '3' || type == '4') {
+        tar_number((char *)block + 329, 8, major(st->st_rdev));
+        tar_number((char *)block + 337, 8, minor(st->st_rdev));
+    }
+    memset(block + 148, ' ', 8);
+    for (i = 0; i < TAR_BLOCK; i++) {
+        sum += block[i];
+    }
+    snprintf((char *)block + 148, 8, "%06o", sum);
+}
+
+static void tar_pad(GByteArray *out, uint64_t size)
+{
+    static const guchar zero[TAR_BLOCK];
+
+    if (size % TAR_BLOCK) {
+        g_byte_array_append(out, zero, TAR_BLOCK - size % TAR_BLOCK);
+    }
+}
+
+/* a GNU ././@LongLink member of @type holding @str, if it is too long */
+static size_t tar_long_name(GByteArray *out, const char *str, char type,
+                            const struct stat *st)
+{
+    size_t len = strlen(str) + 1;
+    guchar block[TAR_BLOCK];
+
+    if (len <= 100) {
+        return 0;
+    }
+    if (out) {
+        tar_header(block, "././@LongLink", NULL, st, type, len);
+        g_byte_array_append(out, block, TAR_BLOCK);
+        g_byte_array_append(out, (const guchar *)str, len);
+        tar_pad(out, len);
+    }
+    return TAR_BLOCK + QEMU_ALIGN_UP(len, TAR_BLOCK);
+}
+
+/*
+ * Queue the member for @path, found as @name in @dirfd.  Returns false if
+ * it was left out.
+ */
+static bool guest_file_archive_add(GuestFileArchive *ga, int dirfd,
+                                   const char *name, const char *path,
+                                   const struct stat *st)
+{
+    GuestFileArchiveDir *d;
+    guchar block[TAR_BLOCK];
+    char *member, *link = NULL;
+    uint64_t size = 0, need;
+    ssize_t len;
+    char type;
+    int fd = -1;
+    DIR *dir;
+
+    switch (st->st_mode & S_IFMT) {
+    case S_IFREG:
+        type = '0';
+        size = st->st_size;
+        break;
+    case S_IFDIR:
+        type = '5';
+        break;
+    case S_IFLNK:
+        type = '2';
+        link = g_malloc(PATH_MAX);
+        len = readlinkat(dirfd, name, link, PATH_MAX - 1);
+        if (len < 0) {
+            g_free(link);
+            ga->skipped++;
+            return false;
+        }
+        link[len] = '\0';
+        break;
+    case S_IFCHR:
+        type = '3';
+        break;
+    case S_IFBLK:
+        type = '4';
+        break;
+    case S_IFIFO:
+        type = '6';
+        break;
+    default:
+        return false;
+    }
+
+    while (*path == '/') {
+        path++;
+    }
+    member = g_strconcat(*path ? path : ".", type == '5' ? "/" : "", NULL);
+    need = TAR_BLOCK + QEMU_ALIGN_UP(size, TAR_BLOCK) +
+           tar_long_name(NULL, member, 'L', st) +
+           (link ? tar_long_name(NULL, link, 'K', st) : 0);
+    /* room is kept for the two blocks that end the archive */
+    if (ga->max_size && ga->tar_size + need + 2 * TAR_BLOCK > ga->max_size) {
+        goto skip;
+    }
+
+    if (type == '0') {
+        fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd < 0) {
+            goto skip;
+        }
+        if (size >= GUEST_FILE_ARCHIVE_READER_MIN) {
+            ga->reader = ga_reader_new(fd, 0, size, GUEST_FILE_CHUNK_DEFAULT);
         } else {
-            /* virtio-blk: 1 disk per 1 device */
-            disk->bus_type = GUEST_DISK_BUS_TYPE_VIRTIO;
+#ifdef POSIX_FADV_SEQUENTIAL
+            posix_fadvise(fd, 0, size, POSIX_FADV_SEQUENTIAL);
+#endif
         }
-    } else if (strcmp(driver, "ahci") == 0) {
-        /* ahci: 1 host per 1 unit */
-        if (!has_host || !has_tgt) {
-            g_debug("invalid sysfs path '%s' (driver '%s')", syspath, driver);
-            goto cleanup;
+    } else if (type == '5') {
+        if (g_queue_get_length(&ga->dirs) >= GUEST_FILE_ARCHIVE_DEPTH_MAX) {
+            goto skip;
         }
-        for (i = 0; i < nhosts; i++) {
-            if (host == hosts[i]) {
-                disk->unit = i;
-                disk->bus_type = GUEST_DISK_BUS_TYPE_SATA;
-                break;
+        fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW |
+                                 O_CLOEXEC);
+        dir = fd < 0 ? NULL : fdopendir(fd);
+        if (!dir) {
+            if (fd >= 0) {
+                close(fd);
             }
+            goto skip;
         }
-        if (i >= nhosts) {
-            g_debug("no host for '%s' (driver '%s')", syspath, driver);
-            goto cleanup;
+        d = g_new0(GuestFileArchiveDir, 1);
+        d->dir = dir;
+        d->path = g_strdup(path - (path[-1] == '/'));
+        g_queue_push_head(&ga->dirs, d);
+        fd = -1;
+    }
+
+    tar_long_name(ga->pending, member, 'L', st);
+    if (link) {
+        tar_long_name(ga->pending, link, 'K', st);
+    }
+    tar_header(block, member, link, st, type, size);
+    g_byte_array_append(ga->pending, block, TAR_BLOCK);
+    ga->tar_size += need;
+    ga->fd = fd;
+    ga->file_size = size;
+    ga->file_left = size;
+    g_free(member);
+    g_free(link);
+    return true;
+
+skip:
+    slog("guest-file-archive: left out %s", path);
+    ga->skipped++;
+    g_free(member);
+    g_free(link);
+    return false;
+}
+
+/* queue the next member, false at the end of the archive */
+static bool guest_file_archive_next_member(GuestFileArchive *ga)
+{
+    GuestFileArchiveDir *d;
+    struct dirent *de;
+    struct stat st;
+    strList *root;
+    char *path;
+    bool added;
+
+    for (;;) {
+        d = g_queue_peek_head(&ga->dirs);
+        if (d) {
+            de = readdir(d->dir);
+            if (!de) {
+                g_queue_pop_head(&ga->dirs);
+                closedir(d->dir);
+                g_free(d->path);
+                g_free(d);
+                continue;
+            }
+            if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) {
+                continue;
+            }
+            path = g_strconcat(d->path, "/", de->d_name, NULL);
+            added = false;
+            if (guest_file_archive_excluded(ga, de->d_name, path)) {
+                /* left out on purpose */
+            } else if (fstatat(dirfd(d->dir), de->d_name, &st,
+                               AT_SYMLINK_NOFOLLOW) < 0) {
+                ga->skipped++;
+            } else {
+                added = guest_file_archive_add(ga, dirfd(d->dir), de->d_name,
+                                               path, &st);
+            }
+            g_free(path);
+        } else if (ga->paths) {
+            root = ga->paths;
+            ga->paths = root->next;
+            root->next = NULL;
+            path = g_path_get_basename(root->value);
+            added = false;
+            if (guest_file_archive_excluded(ga, path, root->value)) {
+                /* left out on purpose */
+            } else if (lstat(root->value, &st) < 0) {
+                ga->skipped++;
+            } else {
+                added = guest_file_archive_add(ga, AT_FDCWD, root->value,
+                                               root->value, &st);
+            }
+            g_free(path);
+            qapi_free_strList(root);
+        } else {
+            return false;
+        }
+        if (added) {
+            return true;
         }
-    } else {
-        g_debug("unknown driver '%s' (sysfs path '%s')", driver, syspath);
-        goto cleanup;
     }
+}
 
-    list->next = fs->disk;
-    fs->disk = list;
-    g_free(driver);
-    return;
+/* up to @len bytes of tar data, less only at the end; -errno on errors */
+static ssize_t guest_file_archive_fill(GuestFileArchive *ga, guchar *buf,
+                                       size_t len)
+{
+    static const guchar zero[2 * TAR_BLOCK];
+    size_t done = 0, n;
+    ssize_t ret;
+
+    while (done < len) {
+        if (ga->pending_pos < ga->pending->len) {
+            n = MIN(len - done, ga->pending->len - ga->pending_pos);
+            memcpy(buf + done, ga->pending->data + ga->pending_pos, n);
+            ga->pending_pos += n;
+            done += n;
+            continue;
+        }
+        g_byte_array_set_size(ga->pending, 0);
+        ga->pending_pos = 0;
+
+        if (ga->file_left) {
+            n = MIN(len - done, ga->file_left);
+            if (ga->reader) {
+                if (!ga->chunk_len) {
+                    ret = ga_reader_next(ga->reader, &ga->chunk);
+                    if (ret < 0) {
+                        return ret;
+                    }
+                    ga->chunk_len = ret;
+                }
+                ret = MIN(n, ga->chunk_len);
+                memcpy(buf + done, ga->chunk, ret);
+                ga->chunk += ret;
+                ga->chunk_len -= ret;
+            } else {
+                ret = ga->fd < 0 ? 0 : read(ga->fd, buf + done, n);
+                if (ret < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (ret < 0) {
+                    return -errno;
+                }
+            }
+            /* the file shrank, make up for it */
+            if (ret == 0) {
+                memset(buf + done, 0, n);
+                ret = n;
+            }
+            done += ret;
+            ga->file_left -= ret;
+            if (!ga->file_left) {
+                tar_pad(ga->pending, ga->file_size);
+            }
+            continue;
+        }
+        ga_reader_free(ga->reader);
+        ga->reader = NULL;
+        ga->chunk_len = 0;
+        if (ga->fd >= 0) {
+            close(ga->fd);
+            ga->fd = -1;
+        }
 
-cleanup:
-    if (list) {
-        qapi_free_GuestDiskAddressList(list);
+        if (ga->finished) {
+            break;
+        }
+        if (!guest_file_archive_next_member(ga)) {
+            g_byte_array_append(ga->pending, zero, sizeof(zero));
+            ga->finished = true;
+        }
     }
-    g_free(driver);
+    return done;
 }
 
-static void build_guest_fsinfo_for_device(char const *devpath,
-                                          GuestFilesystemInfo *fs,
-                                          Error **errp);
+/* whether all of the tar data has been handed out */
+static bool guest_file_archive_done(GuestFileArchive *ga)
+{
+    return ga->finished && ga->pending_pos == ga->pending->len;
+}
 
-/* Store a list of slave devices of virtual volume specified by @syspath into
- * @fs */
-static void build_guest_fsinfo_for_virtual_device(char const *syspath,
-                                                  GuestFilesystemInfo *fs,
-                                                  Error **errp)
+/* up to @len bytes of the stream, compressed if asked for */
+static ssize_t guest_file_archive_read(GuestFileArchive *ga, guchar *buf,
+                                       size_t len, bool *eof)
 {
-    DIR *dir;
-    char *dirpath;
-    struct dirent *entry;
+    ssize_t n;
+    int ret;
+
+    if (!ga->zs) {
+        n = guest_file_archive_fill(ga, buf, len);
+        *eof = n >= 0 && n < len;
+        return n;
+    }
+
+    ga->zs->next_out = buf;
+    ga->zs->avail_out = len;
+    do {
+        if (!ga->zs->avail_in && !guest_file_archive_done(ga)) {
+            n = guest_file_archive_fill(ga, ga->raw, ga->raw_size);
+            if (n < 0) {
+                return n;
+            }
+            ga->zs->next_in = ga->raw;
+            ga->zs->avail_in = n;
+        }
+        ret = deflate(ga->zs, guest_file_archive_done(ga) ? Z_FINISH
+                                                         : Z_NO_FLUSH);
+    } while (ret == Z_OK && ga->zs->avail_out);
+    if (ret != Z_OK && ret != Z_STREAM_END) {
+        return -EIO;
+    }
+    *eof = ret == Z_STREAM_END;
+    return len - ga->zs->avail_out;
+}
+
+static QDict *guest_file_archive_next(void *opaque, void **attachment,
+                                      size_t *len, bool *last)
+{
+    GuestFileTransfer *gft = opaque;
+    guchar *buf = g_malloc(gft->chunk_size), *compressed = NULL;
+    QDict *data = qdict_new(), *event;
+    bool eof = false;
+    ssize_t got;
+
+    got = guest_file_archive_read(gft->archive, buf, gft->chunk_size, &eof);
+    qdict_put(data, "stream", qint_from_int(gft->id));
+    qdict_put(data, "offset", qint_from_int(gft->offset));
+    if (got < 0) {
+        qdict_put(data, "error", qstring_from_str(strerror(-got)));
+        slog("guest-file-archive failed, stream: %" PRId64, gft->id);
+        got = 0;
+    }
+    qdict_put(data, "count", qint_from_int(got));
+    gft->offset += got;
+    gft->count += got;
+    *last = eof || qdict_haskey(data, "error");
+    qdict_put(data, "eof", qbool_from_bool(*last));
+    if (*last) {
+        qdict_put(data, "skipped", qint_from_int(gft->archive->skipped));
+    }
+
+    if (!gft->archive->zs) {
+        compressed = ga_compress(ga_state, buf, got, len);
+    }
+    if (compressed) {
+        g_free(buf);
+        buf = compressed;
+        qdict_put(data, "compressed", qbool_from_bool(true));
+    } else {
+        *len = got;
+    }
+    *attachment = buf;
+
+    event = qmp_event_build_dict("GUEST_FILE_DATA");
+    qdict_put(event, "data", data);
+    return event;
+}
+
+GuestFileStream *qmp_guest_file_archive(strList *paths, bool has_exclude,
+                                        strList *exclude, bool has_max_size,
+                                        int64_t max_size, bool has_gzip,
+                                        bool gzip, bool has_chunk_size,
+                                        int64_t chunk_size, bool has_credits,
+                                        int64_t credits, Error **errp)
+{
+    GuestFileTransfer *gft;
+    GuestFileArchive *ga;
+    GuestFileStream *info;
+    strList **tail, *l;
+
+    if (!ga_is_framed(ga_state)) {
+        error_setg(errp,
+                   "guest-file-archive requires length-prefixed framing");
+        return NULL;
+    }
+    if (!has_max_size) {
+        max_size = 0;
+    } else if (max_size < 2 * TAR_BLOCK) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "max-size",
+                   "at least 1024");
+        return NULL;
+    }
+    if (!has_chunk_size) {
+        chunk_size = GUEST_FILE_CHUNK_DEFAULT;
+    } else if (chunk_size < 1 || chunk_size > GUEST_FILE_CHUNK_MAX) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "chunk-size",
+                   "a number of bytes between 1 and 16M");
+        return NULL;
+    }
+    if (!has_credits) {
+        credits = GUEST_FILE_CREDITS_DEFAULT;
+    } else if (credits < 0) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "credits",
+                   "a non-negative number");
+        return NULL;
+    }
+
+    slog("guest-file-archive called, first path: %s",
+         paths ? paths->value : "");
+    ga = g_new0(GuestFileArchive, 1);
+    g_queue_init(&ga->dirs);
+    ga->max_size = max_size;
+    ga->pending = g_byte_array_new();
+    ga->fd = -1;
+    /* both lists belong to the caller */
+    for (l = paths, tail = &ga->paths; l; l = l->next) {
+        *tail = g_new0(strList, 1);
+        (*tail)->value = g_strdup(l->value);
+        tail = &(*tail)->next;
+    }
+    for (l = has_exclude ? exclude : NULL, tail = &ga->exclude; l;
+         l = l->next) {
+        *tail = g_new0(strList, 1);
+        (*tail)->value = g_strdup(l->value);
+        tail = &(*tail)->next;
+    }
+    if (has_gzip && gzip) {
+        ga->zs = g_new0(z_stream, 1);
+        if (deflateInit2(ga->zs, Z_BEST_SPEED, Z_DEFLATED, 15 + 16, 8,
+                         Z_DEFAULT_STRATEGY) != Z_OK) {
+            g_free(ga->zs);
+            ga->zs = NULL;
+            guest_file_archive_free(ga);
+            error_setg(errp, "failed to set up gzip compression");
+            return NULL;
+        }
+        ga->raw_size = chunk_size;
+        ga->raw = g_malloc(ga->raw_size);
+    }
+
+    gft = guest_file_transfer_new(NULL, 0, errp);
+    if (!gft) {
+        guest_file_archive_free(ga);
+        return NULL;
+    }
+    gft->archive = ga;
+    gft->chunk_size = chunk_size;
+
+    info = guest_file_stream_info(gft);
+    gft->stream = ga_stream_new(ga_state, credits, guest_file_archive_next,
+                                gft, guest_file_transfer_free);
+    return info;
+}
+
+/* the hidden file next to @path an upload is staged in */
+static char *guest_file_upload_path(const char *path, Error **errp)
+{
+    char *dir, *base, *staged;
+
+    if (!*path || g_str_has_suffix(path, "/")) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "path",
+                   "the path of a file");
+        return NULL;
+    }
+    dir = g_path_get_dirname(path);
+    base = g_path_get_basename(path);
+    staged = g_strdup_printf("%s/.%s.qga-upload", dir, base);
+    g_free(dir);
+    g_free(base);
+    return staged;
+}
+
+/*
+ * Open the staged file of an upload to @path, creating it as
+ * guest-file-open mode "w" would if @create; returns -1 on errors
+ */
+static int guest_file_upload_open(const char *path, bool create,
+                                  bool restart, char **staged, Error **errp)
+{
+    FILE *fh;
+    bool exists;
+    int fd;
+
+    *staged = guest_file_upload_path(path, errp);
+    if (!*staged) {
+        return -1;
+    }
+    exists = g_file_test(*staged, G_FILE_TEST_EXISTS);
+    if (!exists && !create) {
+        error_setg(errp, "no upload to '%s' in progress", path);
+        fh = NULL;
+    } else {
+        fh = safe_open_or_create(*staged, restart || !exists ? "w" : "r+",
+                                 errp);
+    }
+    if (!fh) {
+        g_free(*staged);
+        *staged = NULL;
+        return -1;
+    }
+
+    /* only the descriptor is used */
+    fd = dup(fileno(fh));
+    fclose(fh);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "failed to open '%s'", *staged);
+        g_free(*staged);
+        *staged = NULL;
+        return -1;
+    }
+    qemu_set_cloexec(fd);
+    return fd;
+}
+
+/* the size of the staged file @fd, -1 on errors */
+static int64_t guest_file_upload_size(int fd, const char *staged,
+                                      Error **errp)
+{
+    struct stat st;
+
+    if (fstat(fd, &st) < 0) {
+        error_setg_errno(errp, errno, "failed to stat '%s'", staged);
+        return -1;
+    }
+    return st.st_size;
+}
+
+GuestFileUpload *qmp_guest_file_upload_begin(const char *path,
+                                             bool has_restart, bool restart,
+                                             Error **errp)
+{
+    GuestFileUpload *upload;
+    char *staged;
+    int64_t size;
+    int fd;
+
+    slog("guest-file-upload-begin called, filepath: %s", path);
+    fd = guest_file_upload_open(path, true, has_restart && restart, &staged,
+                                errp);
+    if (fd < 0) {
+        return NULL;
+    }
+    size = guest_file_upload_size(fd, staged, errp);
+    close(fd);
+    g_free(staged);
+    if (size < 0) {
+        return NULL;
+    }
+
+    upload = g_new0(GuestFileUpload, 1);
+    upload->offset = size;
+    return upload;
+}
+
+GuestFileUpload *qmp_guest_file_upload_write(const char *path, int64_t offset,
+                                             bool has_buf_b64,
+                                             const char *buf_b64,
+                                             bool has_count, int64_t count,
+                                             Error **errp)
+{
+    GuestFileUpload *upload = NULL;
+    const guchar *data;
+    guchar *buf;
+    char *staged;
+    int64_t size, done = 0;
+    ssize_t ret;
+    int fd;
+
+    if (offset < 0) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "offset",
+                   "a non-negative number");
+        return NULL;
+    }
+    if (!guest_file_write_data(has_buf_b64, buf_b64, has_count, &count,
+                               &data, &buf, errp)) {
+        return NULL;
+    }
+    fd = guest_file_upload_open(path, false, false, &staged, errp);
+    if (fd < 0) {
+        qemu_buffer_pool_free(buf);
+        return NULL;
+    }
+
+    size = guest_file_upload_size(fd, staged, errp);
+    if (size < 0) {
+        goto out;
+    }
+    if (offset > size) {
+        error_setg(errp, "upload to '%s' is at offset %" PRId64
+                   ", not %" PRId64, path, size, offset);
+        goto out;
+    }
+    while (done < count) {
+        ret = pwrite(fd, data + done, count - done, offset + done);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret < 0) {
+            error_setg_errno(errp, errno, "failed to write '%s'", staged);
+            slog("guest-file-upload-write failed, filepath: %s", path);
+            goto out;
+        }
+        done += ret;
+    }
+
+    upload = g_new0(GuestFileUpload, 1);
+    upload->offset = MAX(size, offset + count);
+
+out:
+    close(fd);
+    g_free(staged);
+    qemu_buffer_pool_free(buf);
+    return upload;
+}
+
+/* make the rename of an entry of the directory of @path durable */
+static void guest_file_sync_dir(const char *path)
+{
+    char *dir = g_path_get_dirname(path);
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+    g_free(dir);
+}
+
+void qmp_guest_file_upload_commit(const char *path, bool has_size,
+                                  int64_t size, Error **errp)
+{
+    struct stat st;
+    char *staged;
+    int64_t staged_size;
+    int fd;
+
+    slog("guest-file-upload-commit called, filepath: %s", path);
+    fd = guest_file_upload_open(path, false, false, &staged, errp);
+    if (fd < 0) {
+        return;
+    }
+
+    staged_size = guest_file_upload_size(fd, staged, errp);
+    if (staged_size < 0) {
+        goto out;
+    }
+    if (has_size && size != staged_size) {
+        error_setg(errp, "upload to '%s' has %" PRId64 " bytes, not %"
+                   PRId64, path, staged_size, size);
+        goto out;
+    }
+
+    /* the new file looks like the one it replaces */
+    if (stat(path, &st) == 0) {
+        if (fchown(fd, st.st_uid, st.st_gid) < 0) {
+            slog("guest-file-upload-commit: failed to keep the owner of %s",
+                 path);
+        }
+        if (fchmod(fd, st.st_mode & 07777) < 0) {
+            error_setg_errno(errp, errno, "failed to set the permissions "
+                             "of '%s'", staged);
+            goto out;
+        }
+    }
+    if (fsync(fd) < 0) {
+        error_setg_errno(errp, errno, "failed to sync '%s'", staged);
+        goto out;
+    }
+    if (rename(staged, path) < 0) {
+        error_setg_errno(errp, errno, "failed to rename '%s' to '%s'",
+                         staged, path);
+        goto out;
+    }
+    guest_file_sync_dir(path);
+
+out:
+    close(fd);
+    g_free(staged);
+}
+
+void qmp_guest_file_upload_abort(const char *path, Error **errp)
+{
+    char *staged = guest_file_upload_path(path, errp);
+
+    if (!staged) {
+        return;
+    }
+    slog("guest-file-upload-abort called, filepath: %s", path);
+    if (unlink(staged) < 0) {
+        if (errno == ENOENT) {
+            error_setg(errp, "no upload to '%s' in progress", path);
+        } else {
+            error_setg_errno(errp, errno, "failed to remove '%s'", staged);
+        }
+    }
+    g_free(staged);
+}
+
+#define GUEST_FILE_LIST_DEPTH_MAX 64
+#define GUEST_FILE_LIST_ENTRIES_DEFAULT 1000
+#define GUEST_FILE_LIST_ENTRIES_MAX 100000
+
+typedef struct GuestFileLister {
+    const char *pattern;
+    int64_t depth;
+    int64_t left;               /* entries that may still be added */
+    GuestFileEntryList **tail;
+    const char *last;           /* name of the last entry added */
+    bool truncated;
+    bool cancelled;
+} GuestFileLister;
+
+static GuestFileType guest_file_type(mode_t mode)
+{
+    switch (mode & S_IFMT) {
+    case S_IFREG:
+        return GUEST_FILE_TYPE_FILE;
+    case S_IFDIR:
+        return GUEST_FILE_TYPE_DIRECTORY;
+    case S_IFLNK:
+        return GUEST_FILE_TYPE_SYMLINK;
+    case S_IFIFO:
+        return GUEST_FILE_TYPE_FIFO;
+    case S_IFSOCK:
+        return GUEST_FILE_TYPE_SOCKET;
+    case S_IFCHR:
+        return GUEST_FILE_TYPE_CHAR_DEVICE;
+    case S_IFBLK:
+        return GUEST_FILE_TYPE_BLOCK_DEVICE;
+    default:
+        return GUEST_FILE_TYPE_UNKNOWN;
+    }
+}
+
+static gint guest_file_name_cmp(gconstpointer a, gconstpointer b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static void guest_file_list_add(GuestFileLister *l, char *name,
+                                const struct stat *st)
+{
+    GuestFileEntry *entry = g_new0(GuestFileEntry, 1);
+
+    entry->name = name;
+    entry->type = guest_file_type(st->st_mode);
+    entry->size = st->st_size;
+    entry->mtime = st->st_mtime;
+    entry->mode = st->st_mode & 07777;
+    *l->tail = g_new0(GuestFileEntryList, 1);
+    (*l->tail)->value = entry;
+    l->tail = &(*l->tail)->next;
+    l->last = name;
+    l->left--;
+}
+
+/*
+ * Add what is in @dir, whose entries are named @prefix/<name>, in order.
+ * @resume are the components of the cursor below @dir that are still to
+ * be skipped, NULL when listing from the start.  Returns false when the
+ * listing is to stop.
+ */
+static bool guest_file_list_dir(GuestFileLister *l, DIR *dir,
+                                const char *prefix, int64_t level,
+                                char **resume)
+{
+    GPtrArray *names = g_ptr_array_new();
+    struct dirent *de;
+    struct stat st;
+    char *name, *path, **sub;
+    bool ok = true, added;
+    DIR *subdir;
+    guint i;
+    int fd;
+
+    /* glibc fills readdir() with large getdents64() batches already */
+    while ((de = readdir(dir))) {
+        if (strcmp(de->d_name, ".") && strcmp(de->d_name, "..")) {
+            g_ptr_array_add(names, g_strdup(de->d_name));
+        }
+    }
+    g_ptr_array_sort(names, guest_file_name_cmp);
+
+    for (i = 0; i < names->len && ok; i++) {
+        name = g_ptr_array_index(names, i);
+        sub = NULL;
+        if (resume && *resume) {
+            if (strcmp(name, resume[0]) < 0) {
+                continue;
+            }
+            /* the cursor itself was sent, but maybe not all below it */
+            if (!strcmp(name, resume[0])) {
+                sub = resume + 1;
+            }
+            resume = NULL;
+        }
+        if (fstatat(dirfd(dir), name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+            continue;
+        }
+
+        path = prefix ? g_strconcat(prefix, "/", name, NULL) : g_strdup(name);
+        added = !sub && (!l->pattern || !fnmatch(l->pattern, name, 0));
+        if (added && !l->left) {
+            l->truncated = true;
+            g_free(path);
+            break;
+        }
+        if (added) {
+            guest_file_list_add(l, path, &st);
+        }
+
+        if (S_ISDIR(st.st_mode) && level < l->depth) {
+            fd = openat(dirfd(dir), name,
+                        O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            subdir = fd < 0 ? NULL : fdopendir(fd);
+            if (subdir) {
+                ok = guest_file_list_dir(l, subdir, path, level + 1, sub);
+                closedir(subdir);
+            } else if (fd >= 0) {
+                close(fd);
+            }
+        }
+        if (!added) {
+            g_free(path);
+        }
+        if (ok && ga_worker_cancelled()) {
+            l->cancelled = true;
+            ok = false;
+        }
+    }
+
+    for (i = 0; i < names->len; i++) {
+        g_free(g_ptr_array_index(names, i));
+    }
+    g_ptr_array_free(names, true);
+    return ok && !l->truncated;
+}
+
+GuestFileListing *qmp_guest_file_list(const char *path, bool has_depth,
+                                      int64_t depth, bool has_pattern,
+                                      const char *pattern,
+                                      bool has_max_entries,
+                                      int64_t max_entries, bool has_cursor,
+                                      const char *cursor, Error **errp)
+{
+    GuestFileListing *listing;
+    GuestFileLister l = { 0 };
+    char **resume = NULL;
+    DIR *dir;
+    int fd;
+
+    if (!has_depth) {
+        depth = 0;
+    } else if (depth < 0 || depth > GUEST_FILE_LIST_DEPTH_MAX) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "depth",
+                   "a number from 0 to 64");
+        return NULL;
+    }
+    if (!has_max_entries) {
+        max_entries = GUEST_FILE_LIST_ENTRIES_DEFAULT;
+    } else if (max_entries < 1 || max_entries > GUEST_FILE_LIST_ENTRIES_MAX) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "max-entries",
+                   "a number from 1 to 100000");
+        return NULL;
+    }
+
+    slog("guest-file-list called, path: %s", path);
+    fd = qemu_open(path, O_RDONLY | O_DIRECTORY);
+    dir = fd < 0 ? NULL : fdopendir(fd);
+    if (!dir) {
+        error_setg_errno(errp, errno, "failed to open directory '%s'", path);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+
+    listing = g_new0(GuestFileListing, 1);
+    l.pattern = has_pattern ? pattern : NULL;
+    l.depth = depth;
+    l.left = max_entries;
+    l.tail = &listing->entries;
+    if (has_cursor) {
+        resume = g_strsplit(cursor, "/", -1);
+    }
+    guest_file_list_dir(&l, dir, NULL, 0, resume);
+    closedir(dir);
+    g_strfreev(resume);
+
+    if (l.cancelled) {
+        error_setg(errp, "guest-file-list cancelled");
+        qapi_free_GuestFileListing(listing);
+        return NULL;
+    }
+    if (l.truncated) {
+        listing->has_cursor = true;
+        listing->cursor = g_strdup(l.last);
+    }
+    return listing;
+}
+
+#define GUEST_FILE_READ_MANY_FILES_MAX 1024
+#define GUEST_FILE_READ_MANY_SIZE_DEFAULT (64 * 1024)
+#define GUEST_FILE_READ_MANY_SIZE_TOTAL (16 * 1024 * 1024)
+
+/*
+ * Read up to @max_size bytes of @path, relative to @dirfd, into @content.
+ * One more byte is asked for to tell whether the file goes on; its size
+ * cannot be trusted for that, files in /proc and /sys claim to be empty.
+ */
+static void guest_file_read_one(int dirfd, const char *path,
+                                int64_t max_size, GuestFileContent *content)
+{
+    guchar *buf;
+    size_t count = 0;
+    ssize_t ret;
+    int fd;
+
+    content->path = g_strdup(path);
+    /* O_NONBLOCK so that a FIFO cannot hold up the whole batch */
+    fd = openat(dirfd, path, O_RDONLY | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        content->has_error = true;
+        content->error = g_strdup(strerror(errno));
+        return;
+    }
+
+    buf = g_malloc(max_size + 1);
+    while (count <= max_size) {
+        ret = pread(fd, buf + count, max_size + 1 - count, count);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret < 0) {
+            content->has_error = true;
+            content->error = g_strdup(strerror(errno));
+            g_free(buf);
+            close(fd);
+            return;
+        }
+        if (!ret) {
+            break;
+        }
+        count += ret;
+    }
+    close(fd);
+
+    content->truncated = count > max_size;
+    content->count = MIN(count, max_size);
+    content->has_buf_b64 = true;
+    content->buf_b64 = qemu_base64_encode(buf, content->count);
+    g_free(buf);
+}
+
+GuestFileContentList *qmp_guest_file_read_many(GuestFileReadRequestList *files,
+                                               bool has_dir, const char *dir,
+                                               bool has_max_size,
+                                               int64_t max_size,
+                                               Error **errp)
+{
+    GuestFileContentList *head, *entry;
+    GuestFileReadRequestList *f;
+    int64_t total = 0, size;
+    size_t n = 0;
+    int dirfd = AT_FDCWD;
+
+    if (!has_max_size) {
+        max_size = GUEST_FILE_READ_MANY_SIZE_DEFAULT;
+    }
+    for (f = files; f; f = f->next) {
+        size = f->value->has_max_size ? f->value->max_size : max_size;
+        if (size < 0 || size > GUEST_FILE_READ_MANY_SIZE_TOTAL) {
+            error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "max-size",
+                       "a number from 0 to 16MB");
+            return NULL;
+        }
+        total += size;
+        n++;
+    }
+    if (!n || n > GUEST_FILE_READ_MANY_FILES_MAX) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "files",
+                   "a list of 1 to 1024 files");
+        return NULL;
+    }
+    if (total > GUEST_FILE_READ_MANY_SIZE_TOTAL) {
+        error_setg(errp, "the files may add up to %" PRId64 " bytes,"
+                   " more than 16MB", total);
+        return NULL;
+    }
+
+    slog("guest-file-read-many called, %zu files", n);
+    if (has_dir) {
+        dirfd = qemu_open(dir, O_RDONLY | O_DIRECTORY);
+        if (dirfd < 0) {
+            error_setg_errno(errp, errno, "failed to open directory '%s'",
+                             dir);
+            return NULL;
+        }
+    }
+
+    head = qapi_GuestFileContentList_new(n);
+    for (f = files, entry = head; f; f = f->next, entry = entry->next) {
+        if (ga_worker_cancelled()) {
+            error_setg(errp, "guest-file-read-many cancelled");
+            qapi_free_GuestFileContentList(head);
+            head = NULL;
+            break;
+        }
+        guest_file_read_one(dirfd, f->value->path,
+                            f->value->has_max_size ? f->value->max_size
+                                                   : max_size,
+                            entry->value);
+    }
+
+    if (dirfd != AT_FDCWD) {
+        close(dirfd);
+    }
+    return head;
+}
+
+void qmp_guest_upgrade_agent(bool has_path, const char *path, Error **errp)
+{
+    const char *argv[] = { NULL, "--version", NULL };
+    Error *local_err = NULL;
+    int status;
+
+    if (!has_path) {
+        path = ga_get_exe_path(ga_state);
+        if (!path) {
+            error_setg(errp, "the path of the agent binary is unknown");
+            return;
+        }
+    }
+    slog("guest-upgrade-agent called, path: %s", path);
+
+    /* a binary that does not even start would leave no agent behind */
+    argv[0] = path;
+    ga_run_child(path, argv, NULL, 0, &status, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return;
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+        error_setg(errp, "'%s --version' failed", path);
+        return;
+    }
+    ga_schedule_upgrade(ga_state, path, errp);
+}
+
+#ifdef CONFIG_QGA_BPF
+GuestLatencyHistograms *qmp_guest_get_latency_histograms(Error **errp)
+{
+    GABpf *bpf = ga_get_bpf(ga_state);
+    GuestLatencyHistograms *lh;
+    GuestLatencyHistogramList **tail;
+    GuestLatencyHistogram *h;
+    intList **bucket;
+    uint64_t slots[GA_BPF_SLOTS], count;
+    int kind, n, i;
+
+    if (!bpf) {
+        error_setg(errp, "latency histograms are not collected, see the "
+                   "latency-histograms option");
+        return NULL;
+    }
+
+    lh = g_new0(GuestLatencyHistograms, 1);
+    lh->since = ga_bpf_get_start_time(bpf);
+    tail = &lh->histograms;
+    for (kind = 0; kind < GA_BPF_NHISTOGRAMS; kind++) {
+        if (!ga_bpf_read_histogram(bpf, kind, slots)) {
+            continue;
+        }
+        h = g_new0(GuestLatencyHistogram, 1);
+        h->type = kind;
+        for (n = GA_BPF_SLOTS; n > 0 && !slots[n - 1]; n--) {
+            /* empty buckets at the end are left out */
+        }
+        bucket = &h->buckets;
+        for (i = 0; i < n; i++) {
+            *bucket = g_new0(intList, 1);
+            (*bucket)->value = slots[i];
+            bucket = &(*bucket)->next;
+            h->count += slots[i];
+        }
+        *tail = g_new0(GuestLatencyHistogramList, 1);
+        (*tail)->value = h;
+        tail = &(*tail)->next;
+    }
+    if (ga_bpf_read_tcp_retransmits(bpf, &count)) {
+        lh->has_tcp_retransmits = true;
+        lh->tcp_retransmits = count;
+    }
+    return lh;
+}
+#else
+GuestLatencyHistograms *qmp_guest_get_latency_histograms(Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
+#endif
+
+/* linux-specific implementations. avoid this if at all possible. */
+#if defined(__linux__)
+
+typedef struct FsMount {
+    char *dirname;
+    char *devtype;
+    unsigned int devmajor, devminor;
+    QTAILQ_ENTRY(FsMount) next;
+} FsMount;
+
+typedef QTAILQ_HEAD(FsMountList, FsMount) FsMountList;
+
+static void free_fs_mount_list(FsMountList *mounts)
+{
+     FsMount *mount, *temp;
+
+     if (!mounts) {
+         return;
+     }
+
+     QTAILQ_FOREACH_SAFE(mount, mounts, next, temp) {
+         QTAILQ_REMOVE(mounts, mount, next);
+         g_free(mount->dirname);
+         g_free(mount->devtype);
+         g_free(mount);
+     }
+}
+
+static GuestDiskAddressList *guest_disk_address_list_copy(
+    const GuestDiskAddressList *src)
+{
+    GuestDiskAddressList *head = NULL, **tail = &head;
+
+    for (; src; src = src->next) {
+        GuestDiskAddressList *entry = g_new0(GuestDiskAddressList, 1);
+
+        entry->value = g_new0(GuestDiskAddress, 1);
+        *entry->value = *src->value;
+        entry->value->pci_controller = g_new0(GuestPCIAddress, 1);
+        *entry->value->pci_controller = *src->value->pci_controller;
+        *tail = entry;
+        tail = &entry->next;
+    }
+    return head;
+}
+
+static int dev_major_minor(const char *devpath,
+                           unsigned int *devmajor, unsigned int *devminor)
+{
+    struct stat st;
+
+    *devmajor = 0;
+    *devminor = 0;
+
+    if (stat(devpath, &st) < 0) {
+        slog("failed to stat device file '%s': %s", devpath, strerror(errno));
+        return -1;
+    }
+    if (S_ISDIR(st.st_mode)) {
+        /* It is bind mount */
+        return -2;
+    }
+    if (S_ISBLK(st.st_mode)) {
+        *devmajor = major(st.st_rdev);
+        *devminor = minor(st.st_rdev);
+        return 0;
+    }
+    return -1;
+}
+
+/*
+ * Walk the mount table and build a list of local file systems
+ */
+static void build_fs_mount_list_from_mtab(FsMountList *mounts, Error **errp)
+{
+    struct mntent *ment;
+    FsMount *mount;
+    char const *mtab = "/proc/self/mounts";
+    FILE *fp;
+    unsigned int devmajor, devminor;
+
+    fp = setmntent(mtab, "r");
+    if (!fp) {
+        error_setg(errp, "failed to open mtab file: '%s'", mtab);
+        return;
+    }
+
+    while ((ment = getmntent(fp))) {
+        /*
+         * An entry which device name doesn't start with a '/' is
+         * either a dummy file system or a network file system.
+         * Add special handling for smbfs and cifs as is done by
+         * coreutils as well.
+         */
+        if ((ment->mnt_fsname[0] != '/') ||
+            (strcmp(ment->mnt_type, "smbfs") == 0) ||
+            (strcmp(ment->mnt_type, "cifs") == 0)) {
+            continue;
+        }
+        if (dev_major_minor(ment->mnt_fsname, &devmajor, &devminor) == -2) {
+            /* Skip bind mounts */
+            continue;
+        }
+
+        mount = g_new0(FsMount, 1);
+        mount->dirname = g_strdup(ment->mnt_dir);
+        mount->devtype = g_strdup(ment->mnt_type);
+        mount->devmajor = devmajor;
+        mount->devminor = devminor;
+
+        QTAILQ_INSERT_TAIL(mounts, mount, next);
+    }
+
+    endmntent(fp);
+}
+
+static void decode_mntname(char *name, int len)
+{
+    int i, j = 0;
+    for (i = 0; i <= len; i++) {
+        if (name[i] != '\\') {
+            name[j++] = name[i];
+        } else if (name[i + 1] == '\\') {
+            name[j++] = '\\';
+            i++;
+        } else if (name[i + 1] >= '0' && name[i + 1] <= '3' &&
+                   name[i + 2] >= '0' && name[i + 2] <= '7' &&
+                   name[i + 3] >= '0' && name[i + 3] <= '7') {
+            name[j++] = (name[i + 1] - '0') * 64 +
+                        (name[i + 2] - '0') * 8 +
+                        (name[i + 3] - '0');
+            i += 3;
+        } else {
+            name[j++] = name[i];
+        }
+    }
+}
+
+static void read_fs_mount_list(FsMountList *mounts, Error **errp)
+{
+    FsMount *mount;
+    char const *mountinfo = "/proc/self/mountinfo";
+    FILE *fp;
+    char *line = NULL, *dash;
+    size_t n;
+    char check;
+    unsigned int devmajor, devminor;
+    int ret, dir_s, dir_e, type_s, type_e, dev_s, dev_e;
+
+    fp = fopen(mountinfo, "r");
+    if (!fp) {
+        build_fs_mount_list_from_mtab(mounts, errp);
+        return;
+    }
+
+    while (getline(&line, &n, fp) != -1) {
+        ret = sscanf(line, "%*u %*u %u:%u %*s %n%*s%n%c",
+                     &devmajor, &devminor, &dir_s, &dir_e, &check);
+        if (ret < 3) {
+            continue;
+        }
+        dash = strstr(line + dir_e, " - ");
+        if (!dash) {
+            continue;
+        }
+        ret = sscanf(dash, " - %n%*s%n %n%*s%n%c",
+                     &type_s, &type_e, &dev_s, &dev_e, &check);
+        if (ret < 1) {
+            continue;
+        }
+        line[dir_e] = 0;
+        dash[type_e] = 0;
+        dash[dev_e] = 0;
+        decode_mntname(line + dir_s, dir_e - dir_s);
+        decode_mntname(dash + dev_s, dev_e - dev_s);
+        if (devmajor == 0) {
+            /* btrfs reports major number = 0 */
+            if (strcmp("btrfs", dash + type_s) != 0 ||
+                dev_major_minor(dash + dev_s, &devmajor, &devminor) < 0) {
+                continue;
+            }
+        }
+
+        mount = g_new0(FsMount, 1);
+        mount->dirname = g_strdup(line + dir_s);
+        mount->devtype = g_strdup(dash + type_s);
+        mount->devmajor = devmajor;
+        mount->devminor = devminor;
+
+        QTAILQ_INSERT_TAIL(mounts, mount, next);
+    }
+    free(line);
+
+    fclose(fp);
+}
+
+/*
+ * The mount table as read_fs_mount_list() last returned it.  The kernel
+ * flags an open /proc/self/mountinfo with POLLPRI once for every change
+ * of the mount table, so it is only read again after such a change.
+ * Each reading is a snapshot that is never modified and replaces the
+ * previous one under RCU: commands on any thread copy from the snapshot
+ * they find without blocking, and only those that read the table again
+ * take the lock.
+ */
+typedef struct GuestMountSnapshot {
+    struct rcu_head rcu;
+    FsMountList mounts;
+} GuestMountSnapshot;
+
+static struct {
+    CompatGMutex lock;          /* serializes readings of the table */
+    int fd;                     /* polled for changes, -1 if unavailable */
+    GuestMountSnapshot *snap;   /* RCU, NULL if there is none to use */
+} guest_mount_cache = { .fd = -1 };
+
+static void guest_mount_snapshot_free(GuestMountSnapshot *snap)
+{
+    free_fs_mount_list(&snap->mounts);
+    g_free(snap);
+}
+
+/* make @snap, which may be NULL, the one to use; with the lock held */
+static void guest_mount_cache_publish(GuestMountSnapshot *snap)
+{
+    GuestMountSnapshot *old = guest_mount_cache.snap;
+
+    atomic_rcu_set(&guest_mount_cache.snap, snap);
+    if (old) {
+        call_rcu(old, guest_mount_snapshot_free, rcu);
+    }
+}
+
+/* whether the table changed; the kernel tells only the first to ask */
+static bool guest_mount_cache_changed(void)
+{
+    struct pollfd pfd = {
+        .fd = atomic_read(&guest_mount_cache.fd),
+        .events = POLLPRI,
+    };
+
+    return poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLPRI | POLLERR));
+}
+
+static void guest_mount_snapshot_copy(const GuestMountSnapshot *snap,
+                                      FsMountList *mounts)
+{
+    FsMount *mount, *copy;
+
+    QTAILQ_FOREACH(mount, &snap->mounts, next) {
+        copy = g_new0(FsMount, 1);
+        copy->dirname = g_strdup(mount->dirname);
+        copy->devtype = g_strdup(mount->devtype);
+        copy->devmajor = mount->devmajor;
+        copy->devminor = mount->devminor;
+        QTAILQ_INSERT_TAIL(mounts, copy, next);
+    }
+}
+
+static void build_fs_mount_list(FsMountList *mounts, Error **errp)
+{
+    GuestMountSnapshot *snap;
+    Error *local_err = NULL;
+    bool changed = false;
+
+    rcu_read_lock();
+    snap = atomic_rcu_read(&guest_mount_cache.snap);
+    if (snap) {
+        changed = guest_mount_cache_changed();
+        if (!changed) {
+            guest_mount_snapshot_copy(snap, mounts);
+            rcu_read_unlock();
+            return;
+        }
+    }
+    rcu_read_unlock();
+
+    g_mutex_lock(&guest_mount_cache.lock);
+    if (guest_mount_cache.fd == -1) {
+        /* before reading, so that no change goes unnoticed */
+        atomic_set(&guest_mount_cache.fd,
+                   qemu_open("/proc/self/mountinfo", O_RDONLY));
+    }
+    /* another thread may have read it meanwhile, unless it changed */
+    snap = guest_mount_cache.snap;
+    if (changed || !snap) {
+        snap = g_new0(GuestMountSnapshot, 1);
+        QTAILQ_INIT(&snap->mounts);
+        read_fs_mount_list(&snap->mounts, &local_err);
+        if (local_err || guest_mount_cache.fd == -1) {
+            guest_mount_cache_publish(NULL);
+            if (!local_err) {
+                guest_mount_snapshot_copy(snap, mounts);
+            }
+            g_mutex_unlock(&guest_mount_cache.lock);
+            guest_mount_snapshot_free(snap);
+            error_propagate(errp, local_err);
+            return;
+        }
+        guest_mount_cache_publish(snap);
+    }
+    guest_mount_snapshot_copy(snap, mounts);
+    g_mutex_unlock(&guest_mount_cache.lock);
+}
+
+static void guest_mount_cache_invalidate(void)
+{
+    g_mutex_lock(&guest_mount_cache.lock);
+    guest_mount_cache_publish(NULL);
+    g_mutex_unlock(&guest_mount_cache.lock);
+}
+
+static void guest_mount_cache_warm(void)
+{
+    FsMountList mounts;
+    Error *local_err = NULL;
+
+    QTAILQ_INIT(&mounts);
+    build_fs_mount_list(&mounts, &local_err);
+    free_fs_mount_list(&mounts);
+    error_free(local_err);
+}
+
+/* the workers are gone, so there is no reader left to wait for */
+static void guest_mount_cache_cleanup(void)
+{
+    if (guest_mount_cache.snap) {
+        guest_mount_snapshot_free(guest_mount_cache.snap);
+        guest_mount_cache.snap = NULL;
+    }
+    if (guest_mount_cache.fd != -1) {
+        close(guest_mount_cache.fd);
+        guest_mount_cache.fd = -1;
+    }
+}
+
+/* the forecast of the shared collector for @mountpoint, if it has one */
+static void guest_fs_forecast(const char *mountpoint, bool *has_fill_rate,
+                              double *fill_rate, bool *has_time_to_full,
+                              int64_t *time_to_full)
+{
+    GACollectFsForecast fc;
+
+    if (!ga_collect_fs_forecast(mountpoint, &fc)) {
+        return;
+    }
+    *has_fill_rate = true;
+    *fill_rate = fc.fill_rate;
+    *has_time_to_full = fc.has_time_to_full;
+    *time_to_full = fc.time_to_full;
+}
+
+#if defined(CONFIG_FSFREEZE)
+
+static char *get_pci_driver(char const *syspath, int pathlen, Error **errp)
+{
+    char *path;
+    char *dpath;
+    char *driver = NULL;
+    char buf[PATH_MAX];
+    ssize_t len;
+
+    path = g_strndup(syspath, pathlen);
+    dpath = g_strdup_printf("%s/driver", path);
+    len = readlink(dpath, buf, sizeof(buf) - 1);
+    if (len != -1) {
+        buf[len] = 0;
+        driver = g_strdup(basename(buf));
+    }
+    g_free(dpath);
+    g_free(path);
+    return driver;
+}
+
+static int compare_uint(const void *_a, const void *_b)
+{
+    unsigned int a = *(unsigned int *)_a;
+    unsigned int b = *(unsigned int *)_b;
+
+    return a < b ? -1 : a > b ? 1 : 0;
+}
+
+/* Walk the specified sysfs and build a sorted list of host or ata numbers */
+static int build_hosts(char const *syspath, char const *host, bool ata,
+                       unsigned int *hosts, int hosts_max, Error **errp)
+{
+    char *path;
+    DIR *dir;
+    struct dirent *entry;
+    int i = 0;
+
+    path = g_strndup(syspath, host - syspath);
+    dir = opendir(path);
+    if (!dir) {
+        error_setg_errno(errp, errno, "opendir(\"%s\")", path);
+        g_free(path);
+        return -1;
+    }
+
+    while (i < hosts_max) {
+        entry = readdir(dir);
+        if (!entry) {
+            break;
+        }
+        if (ata && sscanf(entry->d_name, "ata%d", hosts + i) == 1) {
+            ++i;
+        } else if (!ata && sscanf(entry->d_name, "host%d", hosts + i) == 1) {
+            ++i;
+        }
+    }
+
+    qsort(hosts, i, sizeof(hosts[0]), compare_uint);
+
+    g_free(path);
+    closedir(dir);
+    return i;
+}
+
+/* Store disk device info specified by @sysfs into @fs */
+static void build_guest_fsinfo_for_real_device(char const *syspath,
+                                               GuestFilesystemInfo *fs,
+                                               Error **errp)
+{
+    unsigned int pci[4], host, hosts[8], tgt[3];
+    int i, nhosts = 0, pcilen;
+    GuestDiskAddress *disk;
+    GuestPCIAddress *pciaddr;
+    GuestDiskAddressList *list = NULL;
+    bool has_ata = false, has_host = false, has_tgt = false;
+    char *p, *q, *driver = NULL;
+
+    p = strstr(syspath, "/devices/pci");
+    if (!p || sscanf(p + 12, "%*x:%*x/%x:%x:%x.%x%n",
+                     pci, pci + 1, pci + 2, pci + 3, &pcilen) < 4) {
+        g_debug("only pci device is supported: sysfs path \"%s\"", syspath);
+        return;
+    }
+
+    driver = get_pci_driver(syspath, (p + 12 + pcilen) - syspath, errp);
+    if (!driver) {
+        goto cleanup;
+    }
+
+    p = strstr(syspath, "/target");
+    if (p && sscanf(p + 7, "%*u:%*u:%*u/%*u:%u:%u:%u",
+                    tgt, tgt + 1, tgt + 2) == 3) {
+        has_tgt = true;
+    }
+
+    p = strstr(syspath, "/ata");
+    if (p) {
+        q = p + 4;
+        has_ata = true;
+    } else {
+        p = strstr(syspath, "/host");
+        q = p + 5;
+    }
+    if (p && sscanf(q, "%u", &host) == 1) {
+        has_host = true;
+        nhosts = build_hosts(syspath, p, has_ata, hosts,
+                             sizeof(hosts) / sizeof(hosts[0]), errp);
+        if (nhosts < 0) {
+            goto cleanup;
+        }
+    }
+
+    pciaddr = g_malloc0(sizeof(*pciaddr));
+    pciaddr->domain = pci[0];
+    pciaddr->bus = pci[1];
+    pciaddr->slot = pci[2];
+    pciaddr->function = pci[3];
+
+    disk = g_malloc0(sizeof(*disk));
+    disk->pci_controller = pciaddr;
+
+    list = g_malloc0(sizeof(*list));
+    list->value = disk;
+
+    if (strcmp(driver, "ata_piix") == 0) {
+        /* a host per ide bus, target*:0:<unit>:0 */
+        if (!has_host || !has_tgt) {
+            g_debug("invalid sysfs path '%s' (driver '%s')", syspath, driver);
+            goto cleanup;
+        }
+        for (i = 0; i < nhosts; i++) {
+            if (host == hosts[i]) {
+                disk->bus_type = GUEST_DISK_BUS_TYPE_IDE;
+                disk->bus = i;
+                disk->unit = tgt[1];
+                break;
+            }
+        }
+        if (i >= nhosts) {
+            g_debug("no host for '%s' (driver '%s')", syspath, driver);
+            goto cleanup;
+        }
+    } else if (strcmp(driver, "sym53c8xx") == 0) {
+        /* scsi(LSI Logic): target*:0:<unit>:0 */
+        if (!has_tgt) {
+            g_debug("invalid sysfs path '%s' (driver '%s')", syspath, driver);
+            goto cleanup;
+        }
+        disk->bus_type = GUEST_DISK_BUS_TYPE_SCSI;
+        disk->unit = tgt[1];
+    } else if (strcmp(driver, "virtio-pci") == 0) {
+        if (has_tgt) {
+            /* virtio-scsi: target*:0:0:<unit> */
+            disk->bus_type = GUEST_DISK_BUS_TYPE_SCSI;
+            disk->unit = tgt[2];
+        } else {
+            /* virtio-blk: 1 disk per 1 device */
+            disk->bus_type = GUEST_DISK_BUS_TYPE_VIRTIO;
+        }
+    } else if (strcmp(driver, "ahci") == 0) {
+        /* ahci: 1 host per 1 unit */
+        if (!has_host || !has_tgt) {
+            g_debug("invalid sysfs path '%s' (driver '%s')", syspath, driver);
+            goto cleanup;
+        }
+        for (i = 0; i < nhosts; i++) {
+            if (host == hosts[i]) {
+                disk->unit = i;
+                disk->bus_type = GUEST_DISK_BUS_TYPE_SATA;
+                break;
+            }
+        }
+        if (i >= nhosts) {
+            g_debug("no host for '%s' (driver '%s')", syspath, driver);
+            goto cleanup;
+        }
+    } else {
+        g_debug("unknown driver '%s' (sysfs path '%s')", driver, syspath);
+        goto cleanup;
+    }
+
+    list->next = fs->disk;
+    fs->disk = list;
+    g_free(driver);
+    return;
+
+cleanup:
+    if (list) {
+        qapi_free_GuestDiskAddressList(list);
+    }
+    g_free(driver);
+}
+
+static void build_guest_fsinfo_for_device(char const *devpath,
+                                          GuestFilesystemInfo *fs,
+                                          Error **errp);
+
+/* Store a list of slave devices of virtual volume specified by @syspath into
+ * @fs */
+static void build_guest_fsinfo_for_virtual_device(char const *syspath,
+                                                  GuestFilesystemInfo *fs,
+                                                  Error **errp)
+{
+    DIR *dir;
+    char *dirpath;
+    struct dirent *entry;
+
+    dirpath = g_strdup_printf("%s/slaves", syspath);
+    dir = opendir(dirpath);
+    if (!dir) {
+        error_setg_errno(errp, errno, "opendir(\"%s\")", dirpath);
+        g_free(dirpath);
+        return;
+    }
+
+    for (;;) {
+        errno = 0;
+        entry = readdir(dir);
+        if (entry == NULL) {
+            if (errno) {
+                error_setg_errno(errp, errno, "readdir(\"%s\")", dirpath);
+            }
+            break;
+        }
+
+        if (entry->d_type == DT_LNK) {
+            char *path;
+
+            g_debug(" slave device '%s'", entry->d_name);
+            path = g_strdup_printf("%s/slaves/%s", syspath, entry->d_name);
+            build_guest_fsinfo_for_device(path, fs, errp);
+            g_free(path);
+
+            if (*errp) {
+                break;
+            }
+        }
+    }
+
+    g_free(dirpath);
+    closedir(dir);
+}
+
+/* Dispatch to functions for virtual/real device */
+static void build_guest_fsinfo_for_device(char const *devpath,
+                                          GuestFilesystemInfo *fs,
+                                          Error **errp)
+{
+    char *syspath = realpath(devpath, NULL);
+
+    if (!syspath) {
+        error_setg_errno(errp, errno, "realpath(\"%s\")", devpath);
+        return;
+    }
+
+    if (!fs->name) {
+        fs->name = g_strdup(basename(syspath));
+    }
+
+    g_debug("  parse sysfs path '%s'", syspath);
+
+    if (strstr(syspath, "/devices/virtual/block/")) {
+        build_guest_fsinfo_for_virtual_device(syspath, fs, errp);
+    } else {
+        build_guest_fsinfo_for_real_device(syspath, fs, errp);
+    }
+
+    free(syspath);
+}
+
+/* what build_guest_fsinfo_for_device() found for a block device */
+typedef struct GuestFsinfoTopology {
+    char *name;
+    GuestDiskAddressList *disk;
+} GuestFsinfoTopology;
+
+/*
+ * The disks behind each block device, kept until a block device is added,
+ * removed or changed, as the kernel reports on its uevent socket.  Without
+ * that socket nothing is kept.  Like the mount table, the table is a
+ * snapshot under RCU: lookups do not block, and a device that is not in
+ * it yet is looked up in sysfs without the lock and then added to a copy
+ * that replaces it.  A uevent replaces it with an empty one of the next
+ * generation, to which lookups that started before add nothing.
+ */
+typedef struct GuestTopologySnapshot {
+    struct rcu_head rcu;
+    unsigned int generation;
+    GHashTable *devices;        /* "major:minor" -> GuestFsinfoTopology */
+} GuestTopologySnapshot;
+
+static struct {
+    CompatGMutex lock;          /* serializes changes of the table */
+    bool opened;
+    int uevent_fd;
+    GuestTopologySnapshot *snap; /* RCU, set while uevent_fd is open */
+} guest_topology_cache = { .uevent_fd = -1 };
+
+static GuestFsinfoTopology *guest_topology_new(const char *name,
+                                               const GuestDiskAddressList *disk)
+{
+    GuestFsinfoTopology *t = g_new0(GuestFsinfoTopology, 1);
+
+    t->name = g_strdup(name);
+    t->disk = guest_disk_address_list_copy(disk);
+    return t;
+}
+
+static void guest_topology_free(gpointer p)
+{
+    GuestFsinfoTopology *t = p;
+
+    g_free(t->name);
+    qapi_free_GuestDiskAddressList(t->disk);
+    g_free(t);
+}
+
+/* a copy of @from, or an empty table if it is NULL */
+static GuestTopologySnapshot *guest_topology_snapshot_new(
+    const GuestTopologySnapshot *from)
+{
+    GuestTopologySnapshot *snap = g_new0(GuestTopologySnapshot, 1);
+    GuestFsinfoTopology *t;
+    GHashTableIter iter;
+    gpointer key, value;
+
+    snap->devices = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                          guest_topology_free);
+    if (!from) {
+        return snap;
+    }
+    snap->generation = from->generation;
+    g_hash_table_iter_init(&iter, from->devices);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        t = value;
+        g_hash_table_insert(snap->devices, g_strdup(key),
+                            guest_topology_new(t->name, t->disk));
+    }
+    return snap;
+}
+
+static void guest_topology_snapshot_free(GuestTopologySnapshot *snap)
+{
+    g_hash_table_destroy(snap->devices);
+    g_free(snap);
+}
+
+/* with the lock held */
+static void guest_topology_publish(GuestTopologySnapshot *snap)
+{
+    GuestTopologySnapshot *old = guest_topology_cache.snap;
+
+    atomic_rcu_set(&guest_topology_cache.snap, snap);
+    if (old) {
+        call_rcu(old, guest_topology_snapshot_free, rcu);
+    }
+}
+
+/* with the lock held */
+static void guest_topology_open(void)
+{
+    struct sockaddr_nl addr = { .nl_family = AF_NETLINK, .nl_groups = 1 };
+    int fd;
+
+    fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK,
+                NETLINK_KOBJECT_UEVENT);
+    if (fd == -1) {
+        g_debug("no uevent socket, not caching disks: %s", strerror(errno));
+    } else if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        g_debug("no uevents, not caching disks: %s", strerror(errno));
+        close(fd);
+    } else {
+        guest_topology_cache.uevent_fd = fd;
+        guest_topology_publish(guest_topology_snapshot_new(NULL));
+    }
+    atomic_mb_set(&guest_topology_cache.opened, true);
+}
+
+static void guest_topology_invalidate(void)
+{
+    GuestTopologySnapshot *snap;
+
+    g_mutex_lock(&guest_topology_cache.lock);
+    if (guest_topology_cache.snap) {
+        snap = guest_topology_snapshot_new(NULL);
+        snap->generation = guest_topology_cache.snap->generation + 1;
+        guest_topology_publish(snap);
+    }
+    g_mutex_unlock(&guest_topology_cache.lock);
+}
+
+/* whether a block device uevent arrived since the last call */
+static bool guest_topology_changed(void)
+{
+    char buf[4096];
+    bool changed = false;
+    ssize_t len;
+
+    for (;;) {
+        len = recv(guest_topology_cache.uevent_fd, buf, sizeof(buf), 0);
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+        if (len < 0) {
+            /* ENOBUFS means some were lost */
+            return changed || errno != EAGAIN;
+        }
+        /* "ACTION@DEVPATH\0KEY=VALUE\0..." */
+        if (memmem(buf, len, "SUBSYSTEM=block", sizeof("SUBSYSTEM=block"))) {
+            changed = true;
+        }
+    }
+}
+
+/* build_guest_fsinfo_for_device() for /sys/dev/block/@major:@minor, into
+ * the name and disks of @fs, which has none yet
+ */
+static void guest_fsinfo_for_devnum(unsigned int major, unsigned int minor,
+                                    GuestFilesystemInfo *fs, Error **errp)
+{
+    GuestTopologySnapshot *snap;
+    GuestFsinfoTopology *t;
+    unsigned int generation;
+    char *devpath, *key;
+    Error *local_err = NULL;
+
+    if (!atomic_mb_read(&guest_topology_cache.opened)) {
+        g_mutex_lock(&guest_topology_cache.lock);
+        if (!guest_topology_cache.opened) {
+            guest_topology_open();
+        }
+        g_mutex_unlock(&guest_topology_cache.lock);
+    }
+    devpath = g_strdup_printf("/sys/dev/block/%u:%u", major, minor);
+    if (guest_topology_cache.uevent_fd == -1) {
+        build_guest_fsinfo_for_device(devpath, fs, errp);
+        g_free(devpath);
+        return;
+    }
+    if (guest_topology_changed()) {
+        guest_topology_invalidate();
+    }
+
+    key = devpath + strlen("/sys/dev/block/");
+    rcu_read_lock();
+    snap = atomic_rcu_read(&guest_topology_cache.snap);
+    generation = snap->generation;
+    t = g_hash_table_lookup(snap->devices, key);
+    if (t) {
+        fs->name = g_strdup(t->name);
+        fs->disk = guest_disk_address_list_copy(t->disk);
+    }
+    rcu_read_unlock();
+    if (t) {
+        g_free(devpath);
+        return;
+    }
+
+    build_guest_fsinfo_for_device(devpath, fs, &local_err);
+    if (local_err) {
+        g_free(devpath);
+        error_propagate(errp, local_err);
+        return;
+    }
+    g_mutex_lock(&guest_topology_cache.lock);
+    snap = guest_topology_cache.snap;
+    if (snap->generation == generation &&
+        !g_hash_table_lookup(snap->devices, key)) {
+        snap = guest_topology_snapshot_new(snap);
+        g_hash_table_insert(snap->devices, g_strdup(key),
+                            guest_topology_new(fs->name, fs->disk));
+        guest_topology_publish(snap);
+    }
+    g_mutex_unlock(&guest_topology_cache.lock);
+    g_free(devpath);
+}
+
+static void guest_topology_cleanup(void)
+{
+    if (guest_topology_cache.snap) {
+        guest_topology_snapshot_free(guest_topology_cache.snap);
+        guest_topology_cache.snap = NULL;
+    }
+    if (guest_topology_cache.uevent_fd != -1) {
+        close(guest_topology_cache.uevent_fd);
+        guest_topology_cache.uevent_fd = -1;
+    }
+    guest_topology_cache.opened = false;
+}
+
+/* Return a list of the disk device(s)' info which @mount lies on */
+static GuestFilesystemInfo *build_guest_fsinfo(struct FsMount *mount,
+                                               Error **errp)
+{
+    GuestFilesystemInfo *fs = g_malloc0(sizeof(*fs));
+
+    fs->mountpoint = g_strdup(mount->dirname);
+    fs->type = g_strdup(mount->devtype);
+    guest_fsinfo_for_devnum(mount->devmajor, mount->devminor, fs, errp);
+
+    return fs;
+}
+
+/* the disks of every mounted block device, without their usage */
+static void guest_topology_warm(void)
+{
+    FsMountList mounts;
+    struct FsMount *mount;
+    Error *local_err = NULL;
+
+    QTAILQ_INIT(&mounts);
+    build_fs_mount_list(&mounts, &local_err);
+    QTAILQ_FOREACH(mount, &mounts, next) {
+        qapi_free_GuestFilesystemInfo(build_guest_fsinfo(mount, &local_err));
+        error_free(local_err);
+        local_err = NULL;
+    }
+    free_fs_mount_list(&mounts);
+    error_free(local_err);
+}
+
+/* Longest guest-get-fsinfo waits for the usage of the filesystems */
+#define GUEST_FSINFO_MAX_TIMEOUT 60000
+#define GUEST_FSINFO_DEFAULT_TIMEOUT 5000
+
+/*
+ * statvfs() of one filesystem for guest-get-fsinfo.  Each runs as a task
+ * of a pool without a thread limit, so that a filesystem that does not
+ * answer only holds up its own thread; the command stops waiting at its
+ * deadline, and whichever of it and the tasks finishes last frees the
+ * call.
+ */
+typedef struct GuestFsUsageCall GuestFsUsageCall;
+
+typedef struct GuestFsUsage {
+    GuestFsUsageCall *call;
+    char *path;
+    struct statvfs st;
+    int err;
+    bool done;
+} GuestFsUsage;
+
+struct GuestFsUsageCall {
+    CompatGMutex lock;
+    CompatGCond cond;
+    unsigned int refcount;      /* the command and every pending task */
+    unsigned int pending;
+    size_t n;
+    GuestFsUsage *usage;
+};
+
+static GThreadPool *guest_fsusage_pool;
+
+static void guest_fsusage_call_unref(GuestFsUsageCall *call)
+{
+    size_t i;
+
+    /* called with the lock held, which is gone afterwards */
+    if (--call->refcount) {
+        g_mutex_unlock(&call->lock);
+        return;
+    }
+    g_mutex_unlock(&call->lock);
+    for (i = 0; i < call->n; i++) {
+        g_free(call->usage[i].path);
+    }
+    g_free(call->usage);
+    g_mutex_clear(&call->lock);
+    g_cond_clear(&call->cond);
+    g_free(call);
+}
+
+static void guest_fsusage_task(gpointer data, gpointer opaque)
+{
+    GuestFsUsage *u = data;
+    GuestFsUsageCall *call = u->call;
+    struct statvfs st;
+    int err = 0;
+
+    if (statvfs(u->path, &st) < 0) {
+        err = errno;
+    }
+
+    g_mutex_lock(&call->lock);
+    u->st = st;
+    u->err = err;
+    u->done = true;
+    call->pending--;
+    g_cond_broadcast(&call->cond);
+    guest_fsusage_call_unref(call);
+}
+
+static GThreadPool *guest_fsusage_get_pool(void)
+{
+    static CompatGMutex lock;
+
+    g_mutex_lock(&lock);
+    if (!guest_fsusage_pool) {
+        guest_fsusage_pool = g_thread_pool_new(guest_fsusage_task, NULL, -1,
+                                               false, NULL);
+    }
+    g_mutex_unlock(&lock);
+    return guest_fsusage_pool;
+}
+
+/* get the usage of the @n filesystems @fs, waiting at most @timeout_ms
+ * for all of them together
+ */
+static void guest_fsinfo_fill_usage(GuestFilesystemInfo **fs, size_t n,
+                                    int64_t timeout_ms)
+{
+    GuestFsUsageCall *call = g_new0(GuestFsUsageCall, 1);
+    GThreadPool *pool = guest_fsusage_get_pool();
+    int64_t deadline = g_get_monotonic_time() + timeout_ms * 1000;
+    GuestFsUsage *u;
+    size_t i;
+
+    g_mutex_init(&call->lock);
+    g_cond_init(&call->cond);
+    call->n = n;
+    call->usage = g_new0(GuestFsUsage, n);
+    call->refcount = n + 1;
+    call->pending = n;
+
+    g_mutex_lock(&call->lock);
+    for (i = 0; i < n; i++) {
+        call->usage[i].call = call;
+        call->usage[i].path = g_strdup(fs[i]->mountpoint);
+        g_thread_pool_push(pool, &call->usage[i], NULL);
+    }
+    while (call->pending && g_get_monotonic_time() < deadline) {
+        g_cond_wait_until(&call->cond, &call->lock, deadline);
+    }
+
+    for (i = 0; i < n; i++) {
+        u = &call->usage[i];
+        if (!u->done || u->err) {
+            fs[i]->has_usage_error = true;
+            fs[i]->usage_error = g_strdup(u->done ? strerror(u->err) :
+                                          "timeout");
+            continue;
+        }
+        fs[i]->has_total_bytes = true;
+        fs[i]->total_bytes = (uint64_t)u->st.f_blocks * u->st.f_frsize;
+        fs[i]->has_used_bytes = true;
+        fs[i]->used_bytes = (uint64_t)(u->st.f_blocks - u->st.f_bfree) *
+                            u->st.f_frsize;
+        fs[i]->has_avail_bytes = true;
+        fs[i]->avail_bytes = (uint64_t)u->st.f_bavail * u->st.f_frsize;
+        ga_collect_fs_usage_add(fs[i]->mountpoint, fs[i]->used_bytes,
+                                fs[i]->avail_bytes);
+        guest_fs_forecast(fs[i]->mountpoint, &fs[i]->has_fill_rate,
+                          &fs[i]->fill_rate, &fs[i]->has_time_to_full,
+                          &fs[i]->time_to_full);
+        /* btrfs and others allocate inodes as needed and report none */
+        if (u->st.f_files) {
+            fs[i]->has_total_inodes = true;
+            fs[i]->total_inodes = u->st.f_files;
+            fs[i]->has_used_inodes = true;
+            fs[i]->used_inodes = u->st.f_files - u->st.f_ffree;
+        }
+    }
+    guest_fsusage_call_unref(call);
+}
+
+static void guest_fsinfo_cleanup(void)
+{
+    /* not waiting for tasks, which may be stuck */
+    if (guest_fsusage_pool) {
+        g_thread_pool_free(guest_fsusage_pool, true, false);
+        guest_fsusage_pool = NULL;
+    }
+}
+
+GuestFilesystemInfoList *qmp_guest_get_fsinfo(bool has_timeout,
+                                              int64_t timeout, Error **errp)
+{
+    FsMountList mounts;
+    struct FsMount *mount;
+    GuestFilesystemInfoList *new, *ret = NULL;
+    GPtrArray *fs;
+    Error *local_err = NULL;
+
+    if (has_timeout &&
+        (timeout < 0 || timeout > GUEST_FSINFO_MAX_TIMEOUT)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "timeout",
+                   "a number of milliseconds between 0 and 60000");
+        return NULL;
+    }
+
+    QTAILQ_INIT(&mounts);
+    build_fs_mount_list(&mounts, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return NULL;
+    }
+
+    QTAILQ_FOREACH(mount, &mounts, next) {
+        if (ga_worker_cancelled()) {
+            error_setg(errp, "cancelled");
+            qapi_free_GuestFilesystemInfoList(ret);
+            ret = NULL;
+            break;
+        }
+        g_debug("Building guest fsinfo for '%s'", mount->dirname);
+
+        new = g_malloc0(sizeof(*ret));
+        new->value = build_guest_fsinfo(mount, &local_err);
+        new->next = ret;
+        ret = new;
+        if (local_err) {
+            error_propagate(errp, local_err);
+            qapi_free_GuestFilesystemInfoList(ret);
+            ret = NULL;
+            break;
+        }
+    }
+    free_fs_mount_list(&mounts);
+
+    fs = g_ptr_array_new();
+    for (new = ret; new; new = new->next) {
+        g_ptr_array_add(fs, new->value);
+    }
+    if (fs->len) {
+        guest_fsinfo_fill_usage((GuestFilesystemInfo **)fs->pdata, fs->len,
+                                has_timeout ? timeout :
+                                GUEST_FSINFO_DEFAULT_TIMEOUT);
+    }
+    g_ptr_array_free(fs, true);
+    return ret;
+}
+
+
+typedef enum {
+    FSFREEZE_HOOK_THAW = 0,
+    FSFREEZE_HOOK_FREEZE,
+} FsfreezeHookArg;
+
+static const char *fsfreeze_hook_arg_string[] = {
+    "thaw",
+    "freeze",
+};
+
+/*
+ * A directory given as the fsfreeze hook is run by the agent itself, the
+ * way the stock fsfreeze-hook script runs fsfreeze-hook.d, except that
+ * the programs whose names start with the same number (or none) form a
+ * group and run in parallel, each with its own timeout.  Their output
+ * goes to the log the script writes too.
+ */
+#define FSFREEZE_HOOK_LOG "/var/log/qga-fsfreeze-hook.log"
+
+typedef struct GuestFsfreezeHookRun {
+    GMainContext *ctx;          /* NULL for the main loop's */
+    Coroutine *co;              /* waiting in the main loop, if any */
+    unsigned int running;
+} GuestFsfreezeHookRun;
+
+typedef struct GuestFsfreezeHook {
+    GuestFsfreezeHookRun *run;
+    char *path;
+    GuestFsfreezeHookTiming *timing;
+    GPid pid;
+    int64_t start;
+    GSource *timeout;           /* while it runs, if it has one */
+} GuestFsfreezeHook;
+
+/* backups and package manager leftovers, as the stock script skips them */
+static bool guest_fsfreeze_hook_ignored(const char *name)
+{
+    static const char *const suffixes[] = {
+        "~", ".bak", ".orig", ".rpmnew", ".rpmorig", ".rpmsave", ".sample",
+        NULL
+    };
+    int i;
+
+    if (name[0] == '.') {
+        return true;
+    }
+    for (i = 0; suffixes[i]; i++) {
+        if (g_str_has_suffix(name, suffixes[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static gint guest_fsfreeze_hook_compare(gconstpointer a, gconstpointer b)
+{
+    const GuestFsfreezeHook *ha = *(GuestFsfreezeHook *const *)a;
+    const GuestFsfreezeHook *hb = *(GuestFsfreezeHook *const *)b;
+
+    if (ha->timing->group != hb->timing->group) {
+        return ha->timing->group < hb->timing->group ? -1 : 1;
+    }
+    return strcmp(ha->timing->name, hb->timing->name);
+}
+
+static void guest_fsfreeze_hook_free(gpointer p)
+{
+    GuestFsfreezeHook *h = p;
+
+    g_free(h->path);
+    qapi_free_GuestFsfreezeHookTiming(h->timing);
+    g_free(h);
+}
+
+/* the programs of @dir, sorted by group and name */
+static GPtrArray *guest_fsfreeze_hook_list(const char *dir, Error **errp)
+{
+    GPtrArray *hooks;
+    GuestFsfreezeHook *h;
+    const char *name;
+    struct stat st;
+    GError *gerr = NULL;
+    GDir *d;
+    char *path;
+
+    d = g_dir_open(dir, 0, &gerr);
+    if (!d) {
+        error_setg(errp, "can't open fsfreeze hook directory '%s': %s", dir,
+                   gerr->message);
+        g_error_free(gerr);
+        return NULL;
+    }
+    hooks = g_ptr_array_new_with_free_func(guest_fsfreeze_hook_free);
+    while ((name = g_dir_read_name(d))) {
+        if (guest_fsfreeze_hook_ignored(name)) {
+            continue;
+        }
+        path = g_build_filename(dir, name, NULL);
+        if (stat(path, &st) < 0 || !S_ISREG(st.st_mode) ||
+            access(path, X_OK) < 0) {
+            g_free(path);
+            continue;
+        }
+        h = g_new0(GuestFsfreezeHook, 1);
+        h->path = path;
+        h->timing = g_new0(GuestFsfreezeHookTiming, 1);
+        h->timing->name = g_strdup(name);
+        h->timing->group = g_ascii_isdigit(name[0]) ?
+                           g_ascii_strtoll(name, NULL, 10) : 0;
+        g_ptr_array_add(hooks, h);
+    }
+    g_dir_close(d);
+    g_ptr_array_sort(hooks, guest_fsfreeze_hook_compare);
+    return hooks;
+}
+
+static void guest_fsfreeze_hook_setup(gpointer opaque)
+{
+    int logfd = GPOINTER_TO_INT(opaque);
+
+    /* its own process group, so a timeout kills whatever it started */
+    setsid();
+    if (logfd >= 0) {
+        dup2(logfd, STDOUT_FILENO);
+        dup2(logfd, STDERR_FILENO);
+    }
+}
+
+static void guest_fsfreeze_hook_exited(GPid pid, gint status, gpointer opaque)
+{
+    GuestFsfreezeHook *h = opaque;
+    GuestFsfreezeHookRun *run = h->run;
+
+    h->timing->duration = g_get_monotonic_time() - h->start;
+    if (WIFEXITED(status)) {
+        h->timing->has_exit_status = true;
+        h->timing->exit_status = WEXITSTATUS(status);
+    }
+    g_spawn_close_pid(pid);
+    if (h->timeout) {
+        g_source_destroy(h->timeout);
+        h->timeout = NULL;
+    }
+    slog("fsfreeze hook '%s' finished after %" PRId64 "us, status %d%s",
+         h->timing->name, h->timing->duration, status,
+         h->timing->timed_out ? " (timed out)" : "");
+
+    if (--run->running == 0 && run->co) {
+        qemu_coroutine_enter(run->co, NULL);
+    }
+}
+
+static gboolean guest_fsfreeze_hook_timeout(gpointer opaque)
+{
+    GuestFsfreezeHook *h = opaque;
+
+    h->timing->timed_out = true;
+    h->timeout = NULL;
+    kill(-h->pid, SIGKILL);
+    return G_SOURCE_REMOVE;
+}
+
+static void guest_fsfreeze_hook_start(GuestFsfreezeHook *h,
+                                      const char *arg_str, int logfd)
+{
+    char *argv[] = { h->path, (char *)arg_str, NULL };
+    GSpawnFlags flags = G_SPAWN_DO_NOT_REAP_CHILD;
+    int timeout = ga_fsfreeze_hook_timeout(ga_state);
+    GError *gerr = NULL;
+    GSource *source;
+
+    if (logfd < 0) {
+        flags |= G_SPAWN_STDOUT_TO_DEV_NULL | G_SPAWN_STDERR_TO_DEV_NULL;
+    }
+    h->start = g_get_monotonic_time();
+    if (!g_spawn_async(NULL, argv, NULL, flags, guest_fsfreeze_hook_setup,
+                       GINT_TO_POINTER(logfd), &h->pid, &gerr)) {
+        slog("fsfreeze hook '%s' could not be run: %s", h->timing->name,
+             gerr->message);
+        g_error_free(gerr);
+        return;
+    }
+    h->run->running++;
+
+    source = g_child_watch_source_new(h->pid);
+    g_source_set_callback(source, (GSourceFunc)guest_fsfreeze_hook_exited, h,
+                          NULL);
+    g_source_attach(source, h->run->ctx);
+    g_source_unref(source);
+    if (timeout) {
+        h->timeout = g_timeout_source_new_seconds(timeout);
+        g_source_set_callback(h->timeout, guest_fsfreeze_hook_timeout, h,
+                              NULL);
+        g_source_attach(h->timeout, h->run->ctx);
+        g_source_unref(h->timeout);
+    }
+}
+
+/*
+ * Run the programs of the hook directory @dir, a group at a time, and
+ * return how each went.  In a coroutine the main loop goes on meanwhile;
+ * otherwise the agent waits for them.  Like the stock script, a program
+ * that fails does not fail the freeze or thaw.
+ */
+static GuestFsfreezeHookTimingList *
+guest_fsfreeze_run_hook_dir(const char *dir, FsfreezeHookArg arg,
+                            Error **errp)
+{
+    GuestFsfreezeHookTimingList *head = NULL, **tail = &head;
+    const char *arg_str = fsfreeze_hook_arg_string[arg];
+    GuestFsfreezeHookRun run = { 0 };
+    GuestFsfreezeHook *h;
+    GPtrArray *hooks;
+    guint i, first, n;
+    int logfd;
+
+    hooks = guest_fsfreeze_hook_list(dir, errp);
+    if (!hooks) {
+        return NULL;
+    }
+    /* groups go the other way round for thaw */
+    if (arg == FSFREEZE_HOOK_THAW) {
+        for (i = 0; i < hooks->len / 2; i++) {
+            h = g_ptr_array_index(hooks, i);
+            hooks->pdata[i] = hooks->pdata[hooks->len - 1 - i];
+            hooks->pdata[hooks->len - 1 - i] = h;
+        }
+    }
+
+    slog("executing fsfreeze hook directory with arg '%s'", arg_str);
+    logfd = qemu_open(FSFREEZE_HOOK_LOG, O_WRONLY | O_APPEND | O_CREAT,
+                      0600);
+    if (qemu_in_coroutine()) {
+        run.co = qemu_coroutine_self();
+    } else {
+        run.ctx = g_main_context_new();
+    }
+    for (first = 0; first < hooks->len; first = n) {
+        h = g_ptr_array_index(hooks, first);
+        for (n = first; n < hooks->len; n++) {
+            GuestFsfreezeHook *g = g_ptr_array_index(hooks, n);
+
+            if (g->timing->group != h->timing->group) {
+                break;
+            }
+            g->run = &run;
+            guest_fsfreeze_hook_start(g, arg_str, logfd);
+        }
+        while (run.running) {
+            if (run.co) {
+                qemu_coroutine_yield();
+            } else {
+                g_main_context_iteration(run.ctx, TRUE);
+            }
+        }
+    }
+    if (run.ctx) {
+        g_main_context_unref(run.ctx);
+    }
+    if (logfd >= 0) {
+        close(logfd);
+    }
+
+    for (i = 0; i < hooks->len; i++) {
+        h = g_ptr_array_index(hooks, i);
+        *tail = g_new0(GuestFsfreezeHookTimingList, 1);
+        (*tail)->value = h->timing;
+        h->timing = NULL;
+        tail = &(*tail)->next;
+    }
+    g_ptr_array_free(hooks, true);
+    return head;
+}
+
+/* run the fsfreeze hook; @hooks gets the programs run for a directory */
+static void execute_fsfreeze_hook(FsfreezeHookArg arg,
+                                  GuestFsfreezeHookTimingList **hooks,
+                                  Error **errp)
+{
+    int status;
+    const char *hook;
+    const char *arg_str = fsfreeze_hook_arg_string[arg];
+    const char *argv[3];
+    Error *local_err = NULL;
+
+    hook = ga_fsfreeze_hook(ga_state);
+    if (!hook) {
+        return;
+    }
+    if (g_file_test(hook, G_FILE_TEST_IS_DIR)) {
+        *hooks = guest_fsfreeze_run_hook_dir(hook, arg, errp);
+        return;
+    }
+    if (access(hook, X_OK) != 0) {
+        error_setg_errno(errp, errno, "can't access fsfreeze hook '%s'", hook);
+        return;
+    }
+
+    slog("executing fsfreeze hook with arg '%s'", arg_str);
+    argv[0] = hook;
+    argv[1] = arg_str;
+    argv[2] = NULL;
+    ga_run_child(hook, argv, NULL, 0, &status, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return;
+    }
+
+    if (!WIFEXITED(status)) {
+        error_setg(errp, "fsfreeze hook has terminated abnormally");
+        return;
+    }
+
+    status = WEXITSTATUS(status);
+    if (status) {
+        error_setg(errp, "fsfreeze hook has failed with status %d", status);
+        return;
+    }
+}
+
+/*
+ * Return status of freeze/thaw
+ */
+GuestFsfreezeStatus qmp_guest_fsfreeze_status(Error **errp)
+{
+    if (ga_is_frozen(ga_state)) {
+        return GUEST_FSFREEZE_STATUS_FROZEN;
+    }
+
+    return GUEST_FSFREEZE_STATUS_THAWED;
+}
+
+/* there are no VSS writers to leave out, so @exclude_writers is ignored */
+int64_t qmp_guest_fsfreeze_freeze(bool has_exclude_writers,
+                                  strList *exclude_writers, Error **errp)
+{
+    return qmp_guest_fsfreeze_freeze_list(false, NULL, false, false, errp);
+}
+
+/* threads for the syncfs() pass of guest-fsfreeze-freeze-list */
+#define GUEST_FSFREEZE_SYNC_THREADS 8
+
+static void guest_fsfreeze_sync_one(gpointer data, gpointer opaque)
+{
+    FsMount *mount = data;
+    int fd;
+
+    fd = qemu_open(mount->dirname, O_RDONLY);
+    if (fd == -1) {
+        return;
+    }
+    /* errors show up again when freezing, which syncs once more */
+#ifdef SYS_syncfs
+    if (syscall(SYS_syncfs, fd) < 0) {
+        g_debug("failed to sync %s: %s", mount->dirname, strerror(errno));
+    }
+#endif
+    close(fd);
+}
+
+/* sync all of @targets at once, so that each FIFREEZE has little left to
+ * write out and the filesystems are frozen for a shorter time
+ */
+static void guest_fsfreeze_sync(GPtrArray *targets)
+{
+    GThreadPool *pool;
+    guint i;
+
+    pool = g_thread_pool_new(guest_fsfreeze_sync_one, NULL,
+                             GUEST_FSFREEZE_SYNC_THREADS, false, NULL);
+    for (i = 0; i < targets->len; i++) {
+        g_thread_pool_push(pool, g_ptr_array_index(targets, i), NULL);
+    }
+    g_thread_pool_free(pool, false, true);
+}
+
+/*
+ * guest-fsfreeze-prepare does everything but freezing, so that
+ * guest-fsfreeze-commit only has the FIFREEZE pass left.  How long each
+ * phase took is kept for guest-fsfreeze-get-timings, in microseconds, -1
+ * for a phase that did not run.
+ */
+static struct {
+    FsMountList mounts;
+    GPtrArray *targets;         /* prepared, in the order to freeze them */
+    int64_t filesystems;        /* frozen by the last commit */
+    int64_t hook_us, scan_us, sync_us, freeze_us, thaw_us;
+    int64_t frozen_since;       /* while frozen */
+    int64_t frozen_us;          /* of the last freeze, once thawed */
+    bool thaw_hook_running;     /* by a guest-fsfreeze-thaw coroutine */
+    /* the programs of a hook directory, for "freeze" and "thaw" */
+    GuestFsfreezeHookTimingList *hooks, *thaw_hooks;
+} guest_fsfreeze_state = {
+    .mounts = QTAILQ_HEAD_INITIALIZER(guest_fsfreeze_state.mounts),
+    .filesystems = -1,
+    .hook_us = -1, .scan_us = -1, .sync_us = -1, .freeze_us = -1,
+    .thaw_us = -1, .frozen_us = -1,
+};
+
+static void guest_fsfreeze_drop_prepared(void)
+{
+    if (guest_fsfreeze_state.targets) {
+        g_ptr_array_free(guest_fsfreeze_state.targets, true);
+        guest_fsfreeze_state.targets = NULL;
+    }
+    free_fs_mount_list(&guest_fsfreeze_state.mounts);
+}
+
+/* run the freeze hook, find the filesystems to freeze and optionally
+ * sync them; nothing is frozen yet
+ */
+static bool guest_fsfreeze_prepare(bool has_mountpoints, strList *mountpoints,
+                                   bool presync, Error **errp)
+{
+    strList *list;
+    struct FsMount *mount;
+    GHashTable *wanted = NULL;
+    GPtrArray *targets;
+    Error *local_err = NULL;
+    int64_t start;
+
+    if (guest_fsfreeze_state.thaw_hook_running) {
+        error_setg(errp, "the fsfreeze hook is still running for the last "
+                   "thaw");
+        return false;
+    }
+
+    guest_fsfreeze_drop_prepared();
+    guest_fsfreeze_state.filesystems = -1;
+    guest_fsfreeze_state.hook_us = guest_fsfreeze_state.scan_us = -1;
+    guest_fsfreeze_state.sync_us = guest_fsfreeze_state.freeze_us = -1;
+    guest_fsfreeze_state.thaw_us = guest_fsfreeze_state.frozen_us = -1;
+    qapi_free_GuestFsfreezeHookTimingList(guest_fsfreeze_state.hooks);
+    qapi_free_GuestFsfreezeHookTimingList(guest_fsfreeze_state.thaw_hooks);
+    guest_fsfreeze_state.hooks = guest_fsfreeze_state.thaw_hooks = NULL;
+
+    start = g_get_monotonic_time();
+    execute_fsfreeze_hook(FSFREEZE_HOOK_FREEZE, &guest_fsfreeze_state.hooks,
+                          &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return false;
+    }
+    if (ga_fsfreeze_hook(ga_state)) {
+        guest_fsfreeze_state.hook_us = g_get_monotonic_time() - start;
+    }
+
+    start = g_get_monotonic_time();
+    build_fs_mount_list(&guest_fsfreeze_state.mounts, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return false;
+    }
+
+    if (has_mountpoints) {
+        wanted = g_hash_table_new(g_str_hash, g_str_equal);
+        for (list = mountpoints; list; list = list->next) {
+            g_hash_table_insert(wanted, list->value, list->value);
+        }
+    }
+
+    /* in the reverse order of mounts, so that a filesystem is frozen
+     * before the one it is mounted on */
+    targets = g_ptr_array_new();
+    QTAILQ_FOREACH_REVERSE(mount, &guest_fsfreeze_state.mounts, FsMountList,
+                           next) {
+        if (!wanted || g_hash_table_lookup(wanted, mount->dirname)) {
+            g_ptr_array_add(targets, mount);
+        }
+    }
+    if (wanted) {
+        g_hash_table_destroy(wanted);
+    }
+    guest_fsfreeze_state.targets = targets;
+    guest_fsfreeze_state.scan_us = g_get_monotonic_time() - start;
+
+    if (presync) {
+        start = g_get_monotonic_time();
+        guest_fsfreeze_sync(targets);
+        guest_fsfreeze_state.sync_us = g_get_monotonic_time() - start;
+    }
+    return true;
+}
+
+static int64_t guest_fsfreeze_thaw(Error **errp);
+
+/* freeze what guest_fsfreeze_prepare() found */
+static int64_t guest_fsfreeze_commit(Error **errp)
+{
+    GPtrArray *targets = guest_fsfreeze_state.targets;
+    struct FsMount *mount;
+    int ret = 0, i = 0;
+    int fd;
+    guint j;
+
+    /* cannot risk guest agent blocking itself on a write in this state */
+    ga_set_frozen(ga_state);
+    guest_fsfreeze_state.frozen_since = g_get_monotonic_time();
+
+    for (j = 0; j < targets->len; j++) {
+        mount = g_ptr_array_index(targets, j);
+        fd = qemu_open(mount->dirname, O_RDONLY);
+        if (fd == -1) {
+            error_setg_errno(errp, errno, "failed to open %s", mount->dirname);
+            goto error;
+        }
+
+        /* we try to cull filesytems we know won't work in advance, but other
+         * filesytems may not implement fsfreeze for less obvious reasons.
+         * these will report EOPNOTSUPP. we simply ignore these when tallying
+         * the number of frozen filesystems.
+         *
+         * any other error means a failure to freeze a filesystem we
+         * expect to be freezable, so return an error in those cases
+         * and return system to thawed state.
+         */
+        ret = ioctl(fd, FIFREEZE);
+        if (ret == -1) {
+            if (errno != EOPNOTSUPP) {
+                error_setg_errno(errp, errno, "failed to freeze %s",
+                                 mount->dirname);
+                close(fd);
+                goto error;
+            }
+        } else {
+            i++;
+        }
+        close(fd);
+    }
+
+    guest_fsfreeze_state.freeze_us = g_get_monotonic_time() -
+                                     guest_fsfreeze_state.frozen_since;
+    guest_fsfreeze_state.filesystems = i;
+    trace_qga_fsfreeze_freeze(i, guest_fsfreeze_state.freeze_us);
+    guest_fsfreeze_drop_prepared();
+    return i;
+
+error:
+    guest_fsfreeze_drop_prepared();
+    guest_fsfreeze_thaw(NULL);
+    return 0;
+}
+
+/*
+ * Walk list of mounted file systems in the guest, and freeze the ones which
+ * are real local file systems.
+ */
+int64_t qmp_guest_fsfreeze_freeze_list(bool has_mountpoints,
+                                       strList *mountpoints,
+                                       bool has_presync, bool presync,
+                                       Error **errp)
+{
+    slog("guest-fsfreeze called");
+
+    if (!guest_fsfreeze_prepare(has_mountpoints, mountpoints,
+                                has_presync && presync, errp)) {
+        guest_fsfreeze_drop_prepared();
+        return -1;
+    }
+    return guest_fsfreeze_commit(errp);
+}
+
+void qmp_guest_fsfreeze_prepare(bool has_mountpoints, strList *mountpoints,
+                                Error **errp)
+{
+    slog("guest-fsfreeze-prepare called");
+
+    if (ga_is_frozen(ga_state)) {
+        error_setg(errp, "filesystems are frozen already");
+        return;
+    }
+    if (!guest_fsfreeze_prepare(has_mountpoints, mountpoints, true, errp)) {
+        guest_fsfreeze_drop_prepared();
+    }
+}
+
+GuestFsfreezeTimings *qmp_guest_fsfreeze_commit(Error **errp)
+{
+    Error *local_err = NULL;
+
+    slog("guest-fsfreeze-commit called");
+
+    if (!guest_fsfreeze_state.targets) {
+        error_setg(errp, "guest-fsfreeze-prepare has to be run first");
+        return NULL;
+    }
+    guest_fsfreeze_commit(&local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return NULL;
+    }
+    return qmp_guest_fsfreeze_get_timings(errp);
+}
+
+static GuestFsfreezeHookTimingList *
+guest_fsfreeze_hook_timings_copy(GuestFsfreezeHookTimingList *list)
+{
+    GuestFsfreezeHookTimingList *head, *e, *l;
+    size_t n = 0;
+
+    for (l = list; l; l = l->next) {
+        n++;
+    }
+    head = qapi_GuestFsfreezeHookTimingList_new(n);
+    for (e = head, l = list; l; e = e->next, l = l->next) {
+        *e->value = *l->value;
+        e->value->name = g_strdup(l->value->name);
+    }
+    return head;
+}
+
+GuestFsfreezeTimings *qmp_guest_fsfreeze_get_timings(Error **errp)
+{
+    GuestFsfreezeTimings *t = g_new0(GuestFsfreezeTimings, 1);
+
+    t->status = qmp_guest_fsfreeze_status(NULL);
+    t->prepared = guest_fsfreeze_state.targets != NULL;
+    t->has_filesystems = guest_fsfreeze_state.filesystems >= 0;
+    t->filesystems = guest_fsfreeze_state.filesystems;
+    t->has_hook = guest_fsfreeze_state.hook_us >= 0;
+    t->hook = guest_fsfreeze_state.hook_us;
+    t->has_scan = guest_fsfreeze_state.scan_us >= 0;
+    t->scan = guest_fsfreeze_state.scan_us;
+    t->has_sync = guest_fsfreeze_state.sync_us >= 0;
+    t->sync = guest_fsfreeze_state.sync_us;
+    t->has_freeze = guest_fsfreeze_state.freeze_us >= 0;
+    t->freeze = guest_fsfreeze_state.freeze_us;
+    t->has_thaw = guest_fsfreeze_state.thaw_us >= 0;
+    t->thaw = guest_fsfreeze_state.thaw_us;
+    if (guest_fsfreeze_state.frozen_since) {
+        t->has_frozen = true;
+        t->frozen = g_get_monotonic_time() -
+                    guest_fsfreeze_state.frozen_since;
+    } else {
+        t->has_frozen = guest_fsfreeze_state.frozen_us >= 0;
+        t->frozen = guest_fsfreeze_state.frozen_us;
+    }
+    t->hooks = guest_fsfreeze_hook_timings_copy(guest_fsfreeze_state.hooks);
+    t->has_hooks = t->hooks != NULL;
+    t->thaw_hooks =
+        guest_fsfreeze_hook_timings_copy(guest_fsfreeze_state.thaw_hooks);
+    t->has_thaw_hooks = t->thaw_hooks != NULL;
+    return t;
+}
+
+/*
+ * Walk list of frozen file systems in the guest, and thaw them.
+ */
+static int64_t guest_fsfreeze_thaw(Error **errp)
+{
+    int ret;
+    FsMountList mounts;
+    FsMount *mount;
+    int fd, i = 0, logged;
+    Error *local_err = NULL;
+    int64_t start = g_get_monotonic_time();
+
+    /* a prepare that was not committed is given up on */
+    guest_fsfreeze_drop_prepared();
+
+    QTAILQ_INIT(&mounts);
+    build_fs_mount_list(&mounts, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return 0;
+    }
+
+    QTAILQ_FOREACH(mount, &mounts, next) {
+        logged = false;
+        fd = qemu_open(mount->dirname, O_RDONLY);
+        if (fd == -1) {
+            continue;
+        }
+        /* we have no way of knowing whether a filesystem was actually unfrozen
+         * as a result of a successful call to FITHAW, only that if an error
+         * was returned the filesystem was *not* unfrozen by that particular
+         * call.
+         *
+         * since multiple preceding FIFREEZEs require multiple calls to FITHAW
+         * to unfreeze, continuing issuing FITHAW until an error is returned,
+         * in which case either the filesystem is in an unfreezable state, or,
+         * more likely, it was thawed previously (and remains so afterward).
+         *
+         * also, since the most recent successful call is the one that did
+         * the actual unfreeze, we can use this to provide an accurate count
+         * of the number of filesystems unfrozen by guest-fsfreeze-thaw, which
+         * may * be useful for determining whether a filesystem was unfrozen
+         * during the freeze/thaw phase by a process other than qemu-ga.
+         */
+        do {
+            ret = ioctl(fd, FITHAW);
+            if (ret == 0 && !logged) {
+                i++;
+                logged = true;
+            }
+        } while (ret == 0);
+        close(fd);
+    }
+
+    ga_unset_frozen(ga_state);
+    free_fs_mount_list(&mounts);
+    if (guest_fsfreeze_state.frozen_since) {
+        guest_fsfreeze_state.frozen_us = g_get_monotonic_time() -
+                                         guest_fsfreeze_state.frozen_since;
+        guest_fsfreeze_state.frozen_since = 0;
+    }
+
+    /* in a coroutine, other requests are handled while the hook runs */
+    guest_fsfreeze_state.thaw_hook_running = true;
+    qapi_free_GuestFsfreezeHookTimingList(guest_fsfreeze_state.thaw_hooks);
+    guest_fsfreeze_state.thaw_hooks = NULL;
+    execute_fsfreeze_hook(FSFREEZE_HOOK_THAW, &guest_fsfreeze_state.thaw_hooks,
+                          errp);
+    guest_fsfreeze_state.thaw_hook_running = false;
+    guest_fsfreeze_state.thaw_us = g_get_monotonic_time() - start;
+    trace_qga_fsfreeze_thaw(i, guest_fsfreeze_state.thaw_us);
+
+    return i;
+}
+
+typedef struct GuestFsfreezeThaw {
+    int64_t count;
+    Error *err;
+} GuestFsfreezeThaw;
+
+static void coroutine_fn guest_fsfreeze_thaw_co(void *opaque)
+{
+    GuestFsfreezeThaw *t = opaque;
+
+    t->count = guest_fsfreeze_thaw(&t->err);
+}
+
+/* the answer to a guest-fsfreeze-thaw that ran as a coroutine */
+static QObject *guest_fsfreeze_thaw_result(void *opaque, Error **errp)
+{
+    GuestFsfreezeThaw *t = opaque;
+
+    if (t->err) {
+        error_propagate(errp, t->err);
+        return NULL;
+    }
+    return QOBJECT(qint_from_int(t->count));
+}
+
+int64_t qmp_guest_fsfreeze_thaw(Error **errp)
+{
+    GuestFsfreezeThaw *t = g_new0(GuestFsfreezeThaw, 1);
+    int64_t count;
+
+    if (ga_co_run(ga_state, guest_fsfreeze_thaw_co,
+                  guest_fsfreeze_thaw_result, t)) {
+        return 0;
+    }
+    count = t->count;
+    error_propagate(errp, t->err);
+    g_free(t);
+    return count;
+}
+
+static void guest_fsfreeze_cleanup(void)
+{
+    Error *err = NULL;
+
+    if (ga_is_frozen(ga_state) == GUEST_FSFREEZE_STATUS_FROZEN ||
+        guest_fsfreeze_state.targets) {
+        guest_fsfreeze_thaw(&err);
+        if (err) {
+            slog("failed to clean up frozen filesystems: %s",
+                 error_get_pretty(err));
+            error_free(err);
+        }
+    }
+    qapi_free_GuestFsfreezeHookTimingList(guest_fsfreeze_state.hooks);
+    qapi_free_GuestFsfreezeHookTimingList(guest_fsfreeze_state.thaw_hooks);
+    guest_fsfreeze_state.hooks = guest_fsfreeze_state.thaw_hooks = NULL;
+}
+#endif /* CONFIG_FSFREEZE */
+
+#if defined(CONFIG_FSTRIM)
+/* Most trim jobs kept at a time, running or waiting for their status */
+#define GUEST_FSTRIM_MAX_JOBS 16
+#define GUEST_FSTRIM_MAX_PARALLEL 64
+#define GUEST_FSTRIM_MIN_CHUNK (1024 * 1024)
+
+/* the progress of one filesystem; written by the thread trimming it */
+typedef struct GuestFstrimMount {
+    char *path;
+    char *disk;                 /* mounts on the same disk go together */
+    int64_t size;
+    int64_t done;
+    int64_t trimmed;
+    int64_t minimum;
+    bool has_minimum;
+    char *error;
+    bool finished;
+} GuestFstrimMount;
+
+/*
+ * A trim job has a thread pool of up to @max_parallel threads and pushes
+ * each disk to it, as a GPtrArray of its mounts.  Everything the threads
+ * and the main loop share is protected by @lock.
+ */
+typedef struct GuestFstrimJob {
+    int64_t id;
+    int64_t minimum;
+    int64_t chunk;              /* 0 for the whole range at once */
+    int64_t bandwidth;          /* bytes per second, 0 for no limit */
+    GThreadPool *pool;
+    GuestFstrimMount *mounts;
+    size_t nmounts;
+    GPtrArray *disks;
+    CompatGMutex lock;
+    CompatGCond cond;           /* signalled when a disk is done */
+    unsigned int pending;       /* disks not done yet */
+    bool cancelled;
+    int64_t start_time;         /* for @bandwidth, in us */
+    int64_t trimmed;            /* by all threads together */
+    QTAILQ_ENTRY(GuestFstrimJob) next;
+} GuestFstrimJob;
+
+static struct {
+    QTAILQ_HEAD(, GuestFstrimJob) jobs;
+    unsigned int count;
+    int64_t last_id;
+} guest_fstrim_state = {
+    .jobs = QTAILQ_HEAD_INITIALIZER(guest_fstrim_state.jobs),
+};
+
+/* the sysfs directory of the disk @mount is on, or a unique name if it
+ * has none, like btrfs or network filesystems
+ */
+static char *guest_fstrim_disk(FsMount *mount)
+{
+    char *path = g_strdup_printf("/sys/dev/block/%u:%u", mount->devmajor,
+                                 mount->devminor);
+    char *real = realpath(path, NULL);
+    char *part, *disk;
+
+    g_free(path);
+    if (!real) {
+        return g_strdup_printf("%u:%u", mount->devmajor, mount->devminor);
+    }
+    part = g_build_filename(real, "partition", NULL);
+    if (g_file_test(part, G_FILE_TEST_EXISTS)) {
+        disk = g_path_get_dirname(real);
+    } else {
+        disk = g_strdup(real);
+    }
+    g_free(part);
+    free(real);
+    return disk;
+}
+
+static bool guest_fstrim_cancelled(GuestFstrimJob *job)
+{
+    bool cancelled;
+
+    g_mutex_lock(&job->lock);
+    cancelled = job->cancelled;
+    g_mutex_unlock(&job->lock);
+    return cancelled;
+}
+
+/* account for @len more bytes discarded and wait as long as @bandwidth
+ * asks for, in steps short enough to notice a cancel
+ */
+static void guest_fstrim_throttle(GuestFstrimJob *job, int64_t len)
+{
+    int64_t now, until;
+
+    g_mutex_lock(&job->lock);
+    job->trimmed += len;
+    if (job->bandwidth) {
+        until = job->start_time +
+                (int64_t)((double)job->trimmed * 1000000 / job->bandwidth);
+        while (!job->cancelled && (now = g_get_monotonic_time()) < until) {
+            g_cond_wait_until(&job->cond, &job->lock,
+                              MIN(until, now + 100000));
+        }
+    }
+    g_mutex_unlock(&job->lock);
+}
+
+static void guest_fstrim_set_error(GuestFstrimJob *job, GuestFstrimMount *m,
+                                   char *error)
+{
+    g_mutex_lock(&job->lock);
+    m->error = error;
+    g_mutex_unlock(&job->lock);
+}
+
+static void guest_fstrim_mount(GuestFstrimJob *job, GuestFstrimMount *m)
+{
+    struct fstrim_range r;
+    struct statvfs st;
+    uint64_t start = 0;
+    int fd, ret;
+
+    fd = qemu_open(m->path, O_RDONLY);
+    if (fd == -1) {
+        guest_fstrim_set_error(job, m, g_strdup_printf("failed to open: %s",
+                                                       strerror(errno)));
+        return;
+    }
+    if (fstatvfs(fd, &st) == 0) {
+        g_mutex_lock(&job->lock);
+        m->size = (int64_t)st.f_blocks * st.f_frsize;
+        g_mutex_unlock(&job->lock);
+    }
+
+    do {
+        if (guest_fstrim_cancelled(job)) {
+            guest_fstrim_set_error(job, m, g_strdup("cancelled"));
+            break;
+        }
+
+        /* the last chunk goes to the end, whatever the size was */
+        r.start = start;
+        r.len = job->chunk && start + job->chunk < m->size ? job->chunk : -1;
+        r.minlen = job->minimum;
+
+        /* We try to cull filesytems we know won't work in advance, but other
+         * filesytems may not implement fstrim for less obvious reasons.  These
+         * will report EOPNOTSUPP; while in some other cases ENOTTY will be
+         * reported (e.g. CD-ROMs).
+         * Any other error means an unexpected error.
+         */
+        ret = ioctl(fd, FITRIM, &r);
+        if (ret == -1) {
+            if (errno == ENOTTY || errno == EOPNOTSUPP) {
+                guest_fstrim_set_error(job, m,
+                                       g_strdup("trim not supported"));
+            } else {
+                guest_fstrim_set_error(job, m,
+                    g_strdup_printf("failed to trim: %s", strerror(errno)));
+            }
+            break;
+        }
+
+        start = job->chunk && start + job->chunk < m->size ?
+                start + job->chunk : m->size;
+        g_mutex_lock(&job->lock);
+        m->has_minimum = true;
+        m->minimum = r.minlen;
+        m->trimmed += r.len;
+        m->done = start;
+        g_mutex_unlock(&job->lock);
+        guest_fstrim_throttle(job, r.len);
+    } while (start < m->size);
+
+    close(fd);
+}
+
+static void guest_fstrim_thread(gpointer data, gpointer opaque)
+{
+    GPtrArray *disk = data;
+    GuestFstrimJob *job = opaque;
+    GuestFstrimMount *m;
+    guint i;
+
+    for (i = 0; i < disk->len; i++) {
+        m = g_ptr_array_index(disk, i);
+        guest_fstrim_mount(job, m);
+        g_mutex_lock(&job->lock);
+        m->finished = true;
+        g_mutex_unlock(&job->lock);
+    }
+
+    g_mutex_lock(&job->lock);
+    job->pending--;
+    g_cond_broadcast(&job->cond);
+    g_mutex_unlock(&job->lock);
+}
+
+static bool guest_fstrim_check(bool has_minimum, int64_t minimum,
+                               bool has_chunk_size, int64_t chunk_size,
+                               bool has_bandwidth, int64_t bandwidth,
+                               bool has_max_parallel, int64_t max_parallel,
+                               Error **errp)
+{
+    if (has_minimum && minimum < 0) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "minimum",
+                   "a number of bytes");
+        return false;
+    }
+    if (has_chunk_size && chunk_size < GUEST_FSTRIM_MIN_CHUNK) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "chunk-size",
+                   "a number of bytes, at least 1M");
+        return false;
+    }
+    if (has_bandwidth && bandwidth <= 0) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "bandwidth",
+                   "a positive number of bytes per second");
+        return false;
+    }
+    if (has_max_parallel &&
+        (max_parallel < 1 || max_parallel > GUEST_FSTRIM_MAX_PARALLEL)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "max-parallel",
+                   "a number between 1 and 64");
+        return false;
+    }
+    return true;
+}
+
+static void guest_fstrim_job_free(GuestFstrimJob *job)
+{
+    size_t i;
+
+    /* waits for the threads, which are done with their work by now */
+    g_thread_pool_free(job->pool, false, true);
+    for (i = 0; i < job->nmounts; i++) {
+        g_free(job->mounts[i].path);
+        g_free(job->mounts[i].disk);
+        g_free(job->mounts[i].error);
+    }
+    g_free(job->mounts);
+    g_ptr_array_free(job->disks, true);
+    g_mutex_clear(&job->lock);
+    g_cond_clear(&job->cond);
+    g_free(job);
+}
+
+/* start trimming every filesystem, one thread per disk at most */
+static GuestFstrimJob *guest_fstrim_job_start(bool has_minimum,
+                                              int64_t minimum,
+                                              bool has_chunk_size,
+                                              int64_t chunk_size,
+                                              bool has_bandwidth,
+                                              int64_t bandwidth,
+                                              bool has_max_parallel,
+                                              int64_t max_parallel,
+                                              Error **errp)
+{
+    GuestFstrimJob *job;
+    GuestFstrimMount *m;
+    FsMountList mounts;
+    struct FsMount *mount;
+    GPtrArray *disk;
+    GuestFstrimMount *first;
+    Error *local_err = NULL;
+    size_t i, j;
+
+    if (!guest_fstrim_check(has_minimum, minimum, has_chunk_size, chunk_size,
+                            has_bandwidth, bandwidth, has_max_parallel,
+                            max_parallel, errp)) {
+        return NULL;
+    }
+
+    QTAILQ_INIT(&mounts);
+    build_fs_mount_list(&mounts, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return NULL;
+    }
+
+    job = g_new0(GuestFstrimJob, 1);
+    job->minimum = has_minimum ? minimum : 0;
+    job->bandwidth = has_bandwidth ? bandwidth : 0;
+    job->chunk = has_chunk_size ? chunk_size :
+                 MAX(job->bandwidth, has_bandwidth ? GUEST_FSTRIM_MIN_CHUNK :
+                                                     0);
+    g_mutex_init(&job->lock);
+    g_cond_init(&job->cond);
+
+    /* the order guest-fstrim has always reported them in */
+    QTAILQ_FOREACH(mount, &mounts, next) {
+        job->nmounts++;
+    }
+    job->mounts = g_new0(GuestFstrimMount, job->nmounts);
+    i = job->nmounts;
+    QTAILQ_FOREACH(mount, &mounts, next) {
+        m = &job->mounts[--i];
+        m->path = g_strdup(mount->dirname);
+        m->disk = guest_fstrim_disk(mount);
+    }
+    free_fs_mount_list(&mounts);
+
+    /* in mount order within a disk, so a filesystem is not trimmed
+     * before the one it is mounted on
+     */
+    job->disks = g_ptr_array_new_with_free_func(
+        (GDestroyNotify)g_ptr_array_unref);
+    for (i = job->nmounts; i-- > 0;) {
+        m = &job->mounts[i];
+        disk = NULL;
+        for (j = 0; j < job->disks->len && !disk; j++) {
+            disk = g_ptr_array_index(job->disks, j);
+            first = g_ptr_array_index(disk, 0);
+            if (strcmp(first->disk, m->disk)) {
+                disk = NULL;
+            }
+        }
+        if (!disk) {
+            disk = g_ptr_array_new();
+            g_ptr_array_add(job->disks, disk);
+        }
+        g_ptr_array_add(disk, m);
+    }
+
+    job->pool = g_thread_pool_new(guest_fstrim_thread, job,
+                                  has_max_parallel ? max_parallel : 4,
+                                  false, NULL);
+    job->pending = job->disks->len;
+    job->start_time = g_get_monotonic_time();
+    for (i = 0; i < job->disks->len; i++) {
+        g_thread_pool_push(job->pool, g_ptr_array_index(job->disks, i),
+                           NULL);
+    }
+    return job;
+}
+
+/*
+ * Walk list of mounted file systems in the guest, and trim them.
+ */
+GuestFilesystemTrimResponse *
+qmp_guest_fstrim(bool has_minimum, int64_t minimum,
+                 bool has_chunk_size, int64_t chunk_size,
+                 bool has_bandwidth, int64_t bandwidth,
+                 bool has_max_parallel, int64_t max_parallel, Error **errp)
+{
+    GuestFilesystemTrimResponse *response;
+    GuestFilesystemTrimResultList *list, **tail;
+    GuestFilesystemTrimResult *result;
+    GuestFstrimJob *job;
+    GuestFstrimMount *m;
+    size_t i;
+
+    slog("guest-fstrim called");
+
+    job = guest_fstrim_job_start(has_minimum, minimum, has_chunk_size,
+                                 chunk_size, has_bandwidth, bandwidth,
+                                 has_max_parallel, max_parallel, errp);
+    if (!job) {
+        return NULL;
+    }
+
+    g_mutex_lock(&job->lock);
+    while (job->pending) {
+        if (ga_worker_cancelled()) {
+            job->cancelled = true;
+            g_cond_broadcast(&job->cond);
+        }
+        g_cond_wait_until(&job->cond, &job->lock,
+                          g_get_monotonic_time() + 100000);
+    }
+    g_mutex_unlock(&job->lock);
+
+    if (job->cancelled) {
+        error_setg(errp, "cancelled");
+        guest_fstrim_job_free(job);
+        return NULL;
+    }
+
+    response = g_malloc0(sizeof(*response));
+    tail = &response->paths;
+    for (i = 0; i < job->nmounts; i++) {
+        m = &job->mounts[i];
+        result = g_malloc0(sizeof(*result));
+        result->path = g_strdup(m->path);
+        if (m->error) {
+            result->has_error = true;
+            result->error = g_strdup(m->error);
+        } else {
+            result->has_minimum = m->has_minimum;
+            result->minimum = m->minimum;
+            result->has_trimmed = true;
+            result->trimmed = m->trimmed;
+        }
+
+        list = g_malloc0(sizeof(*list));
+        list->value = result;
+        *tail = list;
+        tail = &list->next;
+    }
+
+    guest_fstrim_job_free(job);
+    return response;
+}
+
+GuestFilesystemTrimStart *
+qmp_guest_fstrim_start(bool has_minimum, int64_t minimum,
+                       bool has_chunk_size, int64_t chunk_size,
+                       bool has_bandwidth, int64_t bandwidth,
+                       bool has_max_parallel, int64_t max_parallel,
+                       Error **errp)
+{
+    GuestFilesystemTrimStart *start;
+    GuestFstrimJob *job;
+
+    slog("guest-fstrim-start called");
+
+    if (guest_fstrim_state.count >= GUEST_FSTRIM_MAX_JOBS) {
+        error_setg(errp, "too many trim jobs, get the status of finished "
+                   "ones to release them");
+        return NULL;
+    }
+    job = guest_fstrim_job_start(has_minimum, minimum, has_chunk_size,
+                                 chunk_size, has_bandwidth, bandwidth,
+                                 has_max_parallel, max_parallel, errp);
+    if (!job) {
+        return NULL;
+    }
+
+    job->id = ++guest_fstrim_state.last_id;
+    QTAILQ_INSERT_TAIL(&guest_fstrim_state.jobs, job, next);
+    guest_fstrim_state.count++;
+
+    start = g_new0(GuestFilesystemTrimStart, 1);
+    start->id = job->id;
+    return start;
+}
+
+static GuestFstrimJob *guest_fstrim_job_find(int64_t id, Error **errp)
+{
+    GuestFstrimJob *job;
+
+    QTAILQ_FOREACH(job, &guest_fstrim_state.jobs, next) {
+        if (job->id == id) {
+            return job;
+        }
+    }
+    error_setg(errp, QERR_INVALID_PARAMETER, "id");
+    return NULL;
+}
+
+static void guest_fstrim_job_remove(GuestFstrimJob *job)
+{
+    QTAILQ_REMOVE(&guest_fstrim_state.jobs, job, next);
+    guest_fstrim_state.count--;
+    guest_fstrim_job_free(job);
+}
+
+GuestFilesystemTrimJob *qmp_guest_fstrim_status(int64_t id, Error **errp)
+{
+    GuestFstrimJob *job = guest_fstrim_job_find(id, errp);
+    GuestFilesystemTrimJob *info;
+    GuestFilesystemTrimProgressList *list, **tail;
+    GuestFilesystemTrimProgress *p;
+    GuestFstrimMount *m;
+    size_t i;
+
+    if (!job) {
+        return NULL;
+    }
+
+    info = g_new0(GuestFilesystemTrimJob, 1);
+    info->id = job->id;
+    tail = &info->paths;
+    g_mutex_lock(&job->lock);
+    info->finished = !job->pending;
+    for (i = 0; i < job->nmounts; i++) {
+        m = &job->mounts[i];
+        p = g_new0(GuestFilesystemTrimProgress, 1);
+        p->path = g_strdup(m->path);
+        p->size = m->size;
+        p->done = m->done;
+        p->trimmed = m->trimmed;
+        p->has_minimum = m->has_minimum;
+        p->minimum = m->minimum;
+        p->has_error = m->error != NULL;
+        p->error = g_strdup(m->error);
+        p->finished = m->finished;
+
+        list = g_new0(GuestFilesystemTrimProgressList, 1);
+        list->value = p;
+        *tail = list;
+        tail = &list->next;
+    }
+    g_mutex_unlock(&job->lock);
+
+    if (info->finished) {
+        guest_fstrim_job_remove(job);
+    }
+    return info;
+}
+
+static void guest_fstrim_job_cancel(GuestFstrimJob *job)
+{
+    g_mutex_lock(&job->lock);
+    job->cancelled = true;
+    g_cond_broadcast(&job->cond);
+    g_mutex_unlock(&job->lock);
+}
+
+void qmp_guest_fstrim_cancel(int64_t id, Error **errp)
+{
+    GuestFstrimJob *job = guest_fstrim_job_find(id, errp);
+
+    if (job) {
+        guest_fstrim_job_cancel(job);
+    }
+}
+
+static void guest_fstrim_cleanup(void)
+{
+    GuestFstrimJob *job;
+
+    QTAILQ_FOREACH(job, &guest_fstrim_state.jobs, next) {
+        guest_fstrim_job_cancel(job);
+    }
+    while ((job = QTAILQ_FIRST(&guest_fstrim_state.jobs))) {
+        guest_fstrim_job_remove(job);
+    }
+}
+#endif /* CONFIG_FSTRIM */
+
+
+#define LINUX_SYS_STATE_FILE "/sys/power/state"
+#define LINUX_SYS_DISK_FILE "/sys/power/disk"
+#define SUSPEND_SUPPORTED 0
+#define SUSPEND_NOT_SUPPORTED 1
+
+/*
+ * The sleep states /sys/power offered when the agent started.  They do
+ * not change while the guest runs, so unless --pm-utils is given neither
+ * probing nor suspending forks anything.
+ */
+static struct {
+    bool mem;
+    bool disk;
+    bool hybrid;                /* "suspend" in /sys/power/disk */
+} guest_suspend_modes;
+
+static bool guest_suspend_read(const char *path, char *buf, size_t size)
+{
+    ssize_t ret = -1;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd >= 0) {
+        ret = read(fd, buf, size - 1);
+        close(fd);
+    }
+    if (ret <= 0) {
+        return false;
+    }
+    buf[ret] = '\0';
+    return true;
+}
+
+/* whether @mode is one of the words of @buf; the current one is in [] */
+static bool guest_suspend_has_mode(const char *buf, const char *mode)
+{
+    gchar **words = g_strsplit_set(buf, " []\n", -1);
+    bool found = false;
+    int i;
+
+    for (i = 0; words[i] && !found; i++) {
+        found = strcmp(words[i], mode) == 0;
+    }
+    g_strfreev(words);
+    return found;
+}
+
+/* the mode of /sys/power/disk in use, the one in [], or NULL */
+static char *guest_suspend_disk_mode(void)
+{
+    char buf[256];
+    char *start, *end;
+
+    if (!guest_suspend_read(LINUX_SYS_DISK_FILE, buf, sizeof(buf))) {
+        return NULL;
+    }
+    start = strchr(buf, '[');
+    end = start ? strchr(start, ']') : NULL;
+    return end ? g_strndup(start + 1, end - start - 1) : NULL;
+}
+
+static void guest_suspend_init(void)
+{
+    char buf[256];
+
+    if (guest_suspend_read(LINUX_SYS_STATE_FILE, buf, sizeof(buf))) {
+        guest_suspend_modes.mem = guest_suspend_has_mode(buf, "mem");
+        guest_suspend_modes.disk = guest_suspend_has_mode(buf, "disk");
+    }
+    if (guest_suspend_modes.disk &&
+        guest_suspend_read(LINUX_SYS_DISK_FILE, buf, sizeof(buf))) {
+        guest_suspend_modes.hybrid = guest_suspend_has_mode(buf, "suspend");
+    }
+}
+
+static bool guest_suspend_write(const char *path, const char *str,
+                                Error **errp)
+{
+    int fd;
+
+    fd = qemu_open(path, O_WRONLY);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "failed to open '%s'", path);
+        return false;
+    }
+    /* returns once the guest is up again */
+    if (write(fd, str, strlen(str)) < 0) {
+        error_setg_errno(errp, errno, "failed to write '%s' to '%s'", str,
+                         path);
+        close(fd);
+        return false;
+    }
+    close(fd);
+    return true;
+}
+
+/*
+ * Suspend by writing @state to /sys/power/state; with @disk_mode, the mode
+ * of /sys/power/disk is set to it for the time of the suspend.
+ */
+static void guest_suspend_sysfs(bool supported, const char *disk_mode,
+                                const char *state, Error **errp)
+{
+    char *old_mode = NULL;
+
+    if (!supported) {
+        error_setg(errp,
+                   "the requested suspend mode is not supported by the guest");
+        return;
+    }
+    if (disk_mode) {
+        old_mode = guest_suspend_disk_mode();
+        if (!guest_suspend_write(LINUX_SYS_DISK_FILE, disk_mode, errp)) {
+            g_free(old_mode);
+            return;
+        }
+    }
+    guest_suspend_write(LINUX_SYS_STATE_FILE, state, errp);
+    if (old_mode) {
+        guest_suspend_write(LINUX_SYS_DISK_FILE, old_mode, NULL);
+        g_free(old_mode);
+    }
+}
+
+static void bios_supports_mode(const char *pmutils_bin, const char *pmutils_arg,
+                               const char *sysfile_str, Error **errp)
+{
+    Error *local_err = NULL;
+    char *pmutils_path;
+    const char *argv[] = { pmutils_bin, pmutils_arg, NULL };
+    int status;
+
+    pmutils_path = g_find_program_in_path(pmutils_bin);
+
+    if (pmutils_path) {
+        ga_run_child(pmutils_path, argv, NULL, 0, &status, &local_err);
+    }
+
+    /*
+     * If pm-utils is not installed or could not be executed, let's try
+     * the manual method if the caller wants it.
+     */
+    if (!pmutils_path || local_err) {
+        char buf[32]; /* hopefully big enough */
+        ssize_t ret = -1;
+        int fd;
+
+        error_free(local_err);
+        status = W_EXITCODE(SUSPEND_NOT_SUPPORTED, 0);
+        fd = sysfile_str ? open(LINUX_SYS_STATE_FILE, O_RDONLY) : -1;
+        if (fd >= 0) {
+            ret = read(fd, buf, sizeof(buf)-1);
+            close(fd);
+        }
+        if (ret > 0) {
+            buf[ret] = '\0';
+            if (strstr(buf, sysfile_str)) {
+                status = W_EXITCODE(SUSPEND_SUPPORTED, 0);
+            }
+        }
+    }
+
+    if (!WIFEXITED(status)) {
+        error_setg(errp, "child process has terminated abnormally");
+        goto out;
+    }
+
+    switch (WEXITSTATUS(status)) {
+    case SUSPEND_SUPPORTED:
+        goto out;
+    case SUSPEND_NOT_SUPPORTED:
+        error_setg(errp,
+                   "the requested suspend mode is not supported by the guest");
+        goto out;
+    default:
+        error_setg(errp,
+                   "the helper program '%s' returned an unexpected exit status"
+                   " code (%d)", pmutils_path, WEXITSTATUS(status));
+        goto out;
+    }
+
+out:
+    g_free(pmutils_path);
+}
+
+static void guest_suspend(const char *pmutils_bin, const char *sysfile_str,
+                          Error **errp)
+{
+    Error *local_err = NULL;
+    char *pmutils_path;
+    const char *argv[] = { pmutils_bin, NULL };
+    int status;
+
+    pmutils_path = g_find_program_in_path(pmutils_bin);
+
+    if (pmutils_path) {
+        ga_run_child(pmutils_path, argv, NULL, 0, &status, &local_err);
+    }
+
+    /*
+     * If pm-utils is not installed or could not be executed, let's try
+     * the manual method if the caller wants it.
+     */
+    if (!pmutils_path || local_err) {
+        int fd;
+
+        error_free(local_err);
+        status = W_EXITCODE(EXIT_FAILURE, 0);
+        fd = sysfile_str ? open(LINUX_SYS_STATE_FILE, O_WRONLY) : -1;
+        if (fd >= 0) {
+            if (write(fd, sysfile_str, strlen(sysfile_str)) >= 0) {
+                status = W_EXITCODE(EXIT_SUCCESS, 0);
+            }
+            close(fd);
+        }
+    }
+
+    if (!WIFEXITED(status)) {
+        error_setg(errp, "child process has terminated abnormally");
+        goto out;
+    }
+
+    if (WEXITSTATUS(status)) {
+        error_setg(errp, "child process has failed to suspend");
+        goto out;
+    }
+
+out:
+    g_free(pmutils_path);
+}
+
+void qmp_guest_suspend_disk(Error **errp)
+{
+    Error *local_err = NULL;
+
+    if (!ga_uses_pm_utils(ga_state)) {
+        ga_command_state_run(ga_get_command_state(ga_state),
+                             guest_suspend_init);
+        guest_suspend_sysfs(guest_suspend_modes.disk, NULL, "disk", errp);
+        return;
+    }
+
+    bios_supports_mode("pm-is-supported", "--hibernate", "disk", &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return;
+    }
+
+    guest_suspend("pm-hibernate", "disk", errp);
+}
+
+void qmp_guest_suspend_ram(Error **errp)
+{
+    Error *local_err = NULL;
+
+    if (!ga_uses_pm_utils(ga_state)) {
+        ga_command_state_run(ga_get_command_state(ga_state),
+                             guest_suspend_init);
+        guest_suspend_sysfs(guest_suspend_modes.mem, NULL, "mem", errp);
+        return;
+    }
+
+    bios_supports_mode("pm-is-supported", "--suspend", "mem", &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return;
+    }
+
+    guest_suspend("pm-suspend", "mem", errp);
+}
+
+void qmp_guest_suspend_hybrid(Error **errp)
+{
+    Error *local_err = NULL;
+
+    if (!ga_uses_pm_utils(ga_state)) {
+        ga_command_state_run(ga_get_command_state(ga_state),
+                             guest_suspend_init);
+        guest_suspend_sysfs(guest_suspend_modes.hybrid, "suspend", "disk",
+                            errp);
+        return;
+    }
+
+    bios_supports_mode("pm-is-supported", "--suspend-hybrid", NULL,
+                       &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return;
+    }
+
+    guest_suspend("pm-suspend-hybrid", NULL, errp);
+}
+
+/* adjtimex() slews by 500 ppm at most; ntpd steps above 128 ms too */
+#define GUEST_SYNC_TIME_STEP_DEFAULT (128 * 1000 * 1000LL)
+
+static struct {
+    bool synced;
+    int64_t last;               /* CLOCK_MONOTONIC_RAW of the last sync */
+} guest_sync_time_state;
+
+static int guest_sync_time_slew(long usec, Error **errp)
+{
+    struct timex tx = { .modes = ADJ_OFFSET_SINGLESHOT, .offset = usec };
+
+    if (adjtimex(&tx) < 0) {
+        error_setg_errno(errp, errno, "failed to slew the clock");
+        return -1;
+    }
+    return 0;
+}
+
+GuestTimeSync *qmp_guest_sync_time(int64_t offset, bool has_step_threshold,
+                                   int64_t step_threshold, Error **errp)
+{
+    struct timex tx = { .modes = ADJ_OFFSET_SS_READ };
+    struct timespec ts;
+    GuestTimeSync *sync;
+    int64_t now, pending, elapsed, t;
+
+    if (!has_step_threshold) {
+        step_threshold = GUEST_SYNC_TIME_STEP_DEFAULT;
+    }
+    if (step_threshold < 0) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "step-threshold",
+                   "a non-negative number of nanoseconds");
+        return NULL;
+    }
+
+    /* what is left of the previous slew still counts as corrected */
+    if (adjtimex(&tx) < 0) {
+        error_setg_errno(errp, errno, "failed to read the clock's slew");
+        return NULL;
+    }
+    pending = (int64_t)tx.offset * 1000;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    now = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+
+    sync = g_new0(GuestTimeSync, 1);
+    sync->offset = offset;
+    if (guest_sync_time_state.synced) {
+        elapsed = now - guest_sync_time_state.last;
+        if (elapsed >= 1000000000LL) {
+            sync->has_drift = true;
+            sync->drift = (double)(offset - pending) * 1e9 / elapsed;
+        }
+    }
+
+    if (llabs(offset) <= step_threshold &&
+        offset / 1000 == (long)(offset / 1000)) {
+        if (guest_sync_time_slew(offset / 1000, errp) < 0) {
+            goto fail;
+        }
+    } else {
+        /* the step makes up for everything, the old slew must not */
+        if (guest_sync_time_slew(0, errp) < 0) {
+            goto fail;
+        }
+        clock_gettime(CLOCK_REALTIME, &ts);
+        t = ts.tv_sec * 1000000000LL + ts.tv_nsec + offset;
+        if (t < 0 || t / 1000000000 != (time_t)(t / 1000000000)) {
+            error_setg(errp, "Time %" PRId64 " is out of range", t);
+            goto fail;
+        }
+        ts.tv_sec = t / 1000000000;
+        ts.tv_nsec = t % 1000000000;
+        if (clock_settime(CLOCK_REALTIME, &ts) < 0) {
+            error_setg_errno(errp, errno, "failed to set the clock");
+            goto fail;
+        }
+        sync->stepped = true;
+    }
+
+    guest_sync_time_state.synced = true;
+    guest_sync_time_state.last = now;
+    return sync;
+
+fail:
+    qapi_free_GuestTimeSync(sync);
+    return NULL;
+}
+
+static void ga_read_sysfs_file(int dirfd, const char *pathname, char *buf,
+                               int size, Error **errp)
+{
+    int fd;
+    int res;
+
+    errno = 0;
+    fd = openat(dirfd, pathname, O_RDONLY);
+    if (fd == -1) {
+        error_setg_errno(errp, errno, "open sysfs file \"%s\"", pathname);
+        return;
+    }
+
+    res = pread(fd, buf, size, 0);
+    if (res == -1) {
+        error_setg_errno(errp, errno, "pread sysfs file \"%s\"", pathname);
+    } else if (res == 0) {
+        error_setg(errp, "pread sysfs file \"%s\": unexpected EOF", pathname);
+    }
+    close(fd);
+}
+
+static void ga_write_sysfs_file(int dirfd, const char *pathname,
+                                const char *buf, int size, Error **errp)
+{
+    int fd;
+
+    errno = 0;
+    fd = openat(dirfd, pathname, O_WRONLY);
+    if (fd == -1) {
+        error_setg_errno(errp, errno, "open sysfs file \"%s\"", pathname);
+        return;
+    }
+
+    if (pwrite(fd, buf, size, 0) == -1) {
+        error_setg_errno(errp, errno, "pwrite sysfs file \"%s\"", pathname);
+    }
+
+    close(fd);
+}
+
+/*
+ * Read the start of @path, relative to @dirfd, into @buf.  If *@fdp is an
+ * open descriptor of the file it is read through; otherwise the file is
+ * opened, and left open in *@fdp if @keep.  A descriptor that fails, as
+ * those of removed devices do, is closed and the file opened again.
+ * Returns the length read, or -1 with errno set.
+ */
+static ssize_t ga_sysfs_pread(int dirfd, const char *path, int *fdp,
+                              bool keep, char *buf, size_t size)
+{
+    ssize_t len;
+    int fd, saved_errno;
+
+    if (*fdp != -1) {
+        len = pread(*fdp, buf, size, 0);
+        if (len >= 0) {
+            return len;
+        }
+        /* the device was removed since, and may have been added again */
+        close(*fdp);
+        *fdp = -1;
+    }
+
+    fd = openat(dirfd, path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    len = pread(fd, buf, size, 0);
+    if (len >= 0 && keep) {
+        *fdp = fd;
+    } else {
+        saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+    }
+    return len;
+}
+
+#define SYSCONF_EXACT(name, errp) sysconf_exact((name), #name, (errp))
+
+static long sysconf_exact(int name, const char *name_str, Error **errp)
+{
+    long ret;
+
+    errno = 0;
+    ret = sysconf(name);
+    if (ret == -1) {
+        if (errno == 0) {
+            error_setg(errp, "sysconf(%s): value indefinite", name_str);
+        } else {
+            error_setg_errno(errp, errno, "sysconf(%s)", name_str);
+        }
+    }
+    return ret;
+}
+
+typedef struct GuestVcpu {
+    int online_fd;              /* -1 unless open */
+    bool writable;              /* @online_fd was opened read-write */
+    bool has_topology;
+    int64_t socket_id;
+    int64_t core_id;
+    int64_t node_id;            /* -1 without NUMA */
+} GuestVcpu;
+
+/*
+ * The logical processors up to _SC_NPROCESSORS_CONF.  The directory of
+ * /sys/devices/system/cpu stays open, and so do its "present" file and the
+ * "online" file of each processor.  The processors are counted again when
+ * "present" says some were added or removed.
+ */
+static struct {
+    CompatGMutex lock;
+    int dirfd;
+    int present_fd;
+    char present[256];
+    GuestVcpu *cpus;
+    int64_t count;
+} guest_vcpu_state = { .dirfd = -1, .present_fd = -1 };
+
+static void guest_vcpu_close(GuestVcpu *cpu)
+{
+    if (cpu->online_fd != -1) {
+        close(cpu->online_fd);
+        cpu->online_fd = -1;
+    }
+}
+
+static void guest_vcpu_free_all(void)
+{
+    int64_t i;
+
+    for (i = 0; i < guest_vcpu_state.count; i++) {
+        guest_vcpu_close(&guest_vcpu_state.cpus[i]);
+    }
+    g_free(guest_vcpu_state.cpus);
+    guest_vcpu_state.cpus = NULL;
+    guest_vcpu_state.count = 0;
+}
+
+/* open the directory, and count the processors again if they changed */
+static void guest_vcpu_refresh(Error **errp)
+{
+    char present[sizeof(guest_vcpu_state.present)] = "";
+    Error *local_err = NULL;
+    ssize_t len = -1;
+    long count;
+    int64_t i;
+
+    if (guest_vcpu_state.dirfd == -1) {
+        guest_vcpu_state.dirfd = open("/sys/devices/system/cpu",
+                                      O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (guest_vcpu_state.dirfd == -1) {
+            error_setg_errno(errp, errno, "open(\"%s\")",
+                             "/sys/devices/system/cpu/");
+            return;
+        }
+        guest_vcpu_state.present_fd = openat(guest_vcpu_state.dirfd,
+                                             "present",
+                                             O_RDONLY | O_CLOEXEC);
+    }
+
+    if (guest_vcpu_state.present_fd != -1) {
+        len = pread(guest_vcpu_state.present_fd, present,
+                    sizeof(present) - 1, 0);
+        if (len >= 0 && guest_vcpu_state.cpus &&
+            !strcmp(present, guest_vcpu_state.present)) {
+            return;
+        }
+    }
+
+    count = SYSCONF_EXACT(_SC_NPROCESSORS_CONF, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return;
+    }
+    /* without "present", it is only the count that can tell */
+    if (len < 0 && guest_vcpu_state.cpus && count == guest_vcpu_state.count) {
+        return;
+    }
+
+    guest_vcpu_free_all();
+    guest_vcpu_state.cpus = g_new0(GuestVcpu, count);
+    guest_vcpu_state.count = count;
+    for (i = 0; i < count; i++) {
+        guest_vcpu_state.cpus[i].online_fd = -1;
+    }
+    pstrcpy(guest_vcpu_state.present, sizeof(guest_vcpu_state.present),
+            present);
+}
+
+static bool guest_vcpu_read_int(int dirfd, const char *path, int64_t *val)
+{
+    char buf[32] = "";
+    Error *local_err = NULL;
+
+    ga_read_sysfs_file(dirfd, path, buf, sizeof(buf) - 1, &local_err);
+    if (local_err) {
+        error_free(local_err);
+        return false;
+    }
+    *val = strtoll(buf, NULL, 10);
+    return true;
+}
+
+/* the package, core and node of processor @id, once while it is online */
+static void guest_vcpu_topology(int64_t id, GuestVcpu *cpu)
+{
+    struct dirent *de;
+    char path[64];
+    DIR *dir;
+    int fd;
+
+    snprintf(path, sizeof(path), "cpu%" PRId64, id);
+    fd = openat(guest_vcpu_state.dirfd, path, O_RDONLY | O_DIRECTORY);
+    if (fd == -1) {
+        return;
+    }
+    if (!guest_vcpu_read_int(fd, "topology/physical_package_id",
+                             &cpu->socket_id) ||
+        !guest_vcpu_read_int(fd, "topology/core_id", &cpu->core_id)) {
+        close(fd);
+        return;
+    }
+
+    /* the node is the "nodeN" link to the processor's node */
+    cpu->node_id = -1;
+    dir = fdopendir(fd);
+    if (!dir) {
+        close(fd);
+        return;
+    }
+    while ((de = readdir(dir)) != NULL) {
+        if (!strncmp(de->d_name, "node", 4) &&
+            g_ascii_isdigit(de->d_name[4])) {
+            cpu->node_id = strtoll(de->d_name + 4, NULL, 10);
+            break;
+        }
+    }
+    closedir(dir);
+    cpu->has_topology = true;
+}
+
+/* make sure @cpu has its "online" file @path open, for writing if @write;
+ * returns false with errno set
+ */
+static bool guest_vcpu_open(GuestVcpu *cpu, const char *path, bool write)
+{
+    if (cpu->online_fd != -1 && (cpu->writable || !write)) {
+        return true;
+    }
+    guest_vcpu_close(cpu);
+
+    cpu->online_fd = openat(guest_vcpu_state.dirfd, path,
+                            O_RDWR | O_CLOEXEC);
+    cpu->writable = cpu->online_fd != -1;
+    if (cpu->online_fd == -1 && !write && errno == EACCES) {
+        cpu->online_fd = openat(guest_vcpu_state.dirfd, path,
+                                O_RDONLY | O_CLOEXEC);
+    }
+    return cpu->online_fd != -1;
+}
+
+/* Transfer online/offline status between @vcpu and the guest system.
+ *
+ * On input either @errp or *@errp must be NULL.
+ *
+ * In system-to-@vcpu direction, the following @vcpu fields are accessed:
+ * - R: vcpu->logical_id
+ * - W: vcpu->online
+ * - W: vcpu->can_offline
+ *
+ * In @vcpu-to-system direction, the following @vcpu fields are accessed:
+ * - R: vcpu->logical_id
+ * - R: vcpu->online
+ *
+ * Written members remain unmodified on error.  Called with
+ * guest_vcpu_state.lock held, after guest_vcpu_refresh().
+ */
+static void transfer_vcpu(GuestLogicalProcessor *vcpu, bool sys2vcpu,
+                          Error **errp)
+{
+    GuestVcpu *cpu;
+    unsigned char status;
+    char path[64];
+    ssize_t res;
+    int retry;
+
+    snprintf(path, sizeof(path), "cpu%" PRId64 "/online", vcpu->logical_id);
+    if (vcpu->logical_id < 0 || vcpu->logical_id >= guest_vcpu_state.count) {
+        *strchr(path, '/') = '\0';
+        error_setg_errno(errp, ENOENT, "open(\"/sys/devices/system/cpu/%s/\")",
+                         path);
+        return;
+    }
+    cpu = &guest_vcpu_state.cpus[vcpu->logical_id];
+
+    for (retry = 0;; retry++) {
+        if (!guest_vcpu_open(cpu, path, !sys2vcpu)) {
+            if (errno != ENOENT) {
+                error_setg_errno(errp, errno,
+                                 "open(\"/sys/devices/system/cpu/%s\")", path);
+                return;
+            }
+            *strchr(path, '/') = '\0';
+            if (faccessat(guest_vcpu_state.dirfd, path, F_OK, 0) == -1) {
+                error_setg_errno(errp, errno,
+                                 "open(\"/sys/devices/system/cpu/%s/\")",
+                                 path);
+            } else if (sys2vcpu) {
+                vcpu->online = true;
+                vcpu->can_offline = false;
+            } else if (!vcpu->online) {
+                error_setg(errp, "logical processor #%" PRId64 " can't be "
+                           "offlined", vcpu->logical_id);
+            } /* otherwise pretend successful re-onlining */
+            return;
+        }
+        res = pread(cpu->online_fd, &status, 1, 0);
+        if (res != -1 || retry) {
+            break;
+        }
+        /* the processor was removed since, and may have been added again */
+        guest_vcpu_close(cpu);
+    }
+
+    if (res == -1) {
+        error_setg_errno(errp, errno, "pread(\"/sys/devices/system/cpu/%s\")",
+                         path);
+    } else if (res == 0) {
+        error_setg(errp, "pread(\"/sys/devices/system/cpu/%s\"): "
+                   "unexpected EOF", path);
+    } else if (sys2vcpu) {
+        vcpu->online = (status != '0');
+        vcpu->can_offline = true;
+    } else if (vcpu->online != (status != '0')) {
+        status = '0' + vcpu->online;
+        if (pwrite(cpu->online_fd, &status, 1, 0) == -1) {
+            error_setg_errno(errp, errno,
+                             "pwrite(\"/sys/devices/system/cpu/%s\")", path);
+        }
+    } /* otherwise pretend successful re-(on|off)-lining */
+}
+
+static void guest_vcpu_cleanup(void)
+{
+    guest_vcpu_free_all();
+    if (guest_vcpu_state.present_fd != -1) {
+        close(guest_vcpu_state.present_fd);
+        guest_vcpu_state.present_fd = -1;
+    }
+    if (guest_vcpu_state.dirfd != -1) {
+        close(guest_vcpu_state.dirfd);
+        guest_vcpu_state.dirfd = -1;
+    }
+    guest_vcpu_state.present[0] = '\0';
+}
+
+GuestLogicalProcessorList *qmp_guest_get_vcpus(Error **errp)
+{
+    int64_t current;
+    GuestLogicalProcessorList *head, **link;
+    Error *local_err = NULL;
+    GuestVcpu *cpu;
+
+    current = 0;
+    head = NULL;
+    link = &head;
+    g_mutex_lock(&guest_vcpu_state.lock);
+    guest_vcpu_refresh(&local_err);
+
+    while (local_err == NULL && current < guest_vcpu_state.count) {
+        GuestLogicalProcessor *vcpu;
+        GuestLogicalProcessorList *entry;
+
+        cpu = &guest_vcpu_state.cpus[current];
+        vcpu = g_malloc0(sizeof *vcpu);
+        vcpu->logical_id = current++;
+        vcpu->has_can_offline = true; /* lolspeak ftw */
+        transfer_vcpu(vcpu, true, &local_err);
+        if (!cpu->has_topology && vcpu->online) {
+            guest_vcpu_topology(vcpu->logical_id, cpu);
+        }
+        if (cpu->has_topology) {
+            vcpu->has_socket_id = true;
+            vcpu->socket_id = cpu->socket_id;
+            vcpu->has_core_id = true;
+            vcpu->core_id = cpu->core_id;
+            vcpu->has_node_id = cpu->node_id != -1;
+            vcpu->node_id = cpu->node_id;
+        }
+
+        entry = g_malloc0(sizeof *entry);
+        entry->value = vcpu;
+
+        *link = entry;
+        link = &entry->next;
+    }
+    g_mutex_unlock(&guest_vcpu_state.lock);
+
+    if (local_err == NULL) {
+        /* there's no guest with zero VCPUs */
+        g_assert(head != NULL);
+        return head;
+    }
+
+    qapi_free_GuestLogicalProcessorList(head);
+    error_propagate(errp, local_err);
+    return NULL;
+}
+
+int64_t qmp_guest_set_vcpus(GuestLogicalProcessorList *vcpus, Error **errp)
+{
+    int64_t processed;
+    Error *local_err = NULL;
+
+    processed = 0;
+    g_mutex_lock(&guest_vcpu_state.lock);
+    guest_vcpu_refresh(&local_err);
+    while (local_err == NULL && vcpus != NULL) {
+        transfer_vcpu(vcpus->value, false, &local_err);
+        if (local_err != NULL) {
+            break;
+        }
+        ++processed;
+        vcpus = vcpus->next;
+    }
+    g_mutex_unlock(&guest_vcpu_state.lock);
+
+    if (local_err != NULL) {
+        if (processed == 0) {
+            error_propagate(errp, local_err);
+        } else {
+            error_free(local_err);
+        }
+    }
+
+    return processed;
+}
+
+GuestLogicalProcessorResponseList *
+qmp_guest_set_vcpus_batch(GuestLogicalProcessorList *vcpus, Error **errp)
+{
+    GuestLogicalProcessorResponseList *head = NULL, **link = &head, *entry;
+    GuestLogicalProcessorResponse **results;
+    GuestLogicalProcessorList *v;
+    Error *local_err = NULL;
+    size_t i, n = 0;
+    int pass;
+
+    for (v = vcpus; v; v = v->next) {
+        n++;
+    }
+    results = g_new0(GuestLogicalProcessorResponse *, n);
+
+    g_mutex_lock(&guest_vcpu_state.lock);
+    guest_vcpu_refresh(&local_err);
+    if (local_err) {
+        g_mutex_unlock(&guest_vcpu_state.lock);
+        g_free(results);
+        error_propagate(errp, local_err);
+        return NULL;
+    }
+    /* onlining first never leaves the guest with fewer processors than
+     * it is going to have
+     */
+    for (pass = 0; pass < 2; pass++) {
+        for (v = vcpus, i = 0; v; v = v->next, i++) {
+            if (v->value->online != !pass) {
+                continue;
+            }
+            results[i] = g_new0(GuestLogicalProcessorResponse, 1);
+            results[i]->logical_id = v->value->logical_id;
+            results[i]->online = v->value->online;
+            transfer_vcpu(v->value, false, &local_err);
+            if (local_err) {
+                results[i]->has_error = true;
+                results[i]->error = g_strdup(error_get_pretty(local_err));
+                error_free(local_err);
+                local_err = NULL;
+            }
+        }
+    }
+    g_mutex_unlock(&guest_vcpu_state.lock);
+
+    for (i = 0; i < n; i++) {
+        entry = g_new0(GuestLogicalProcessorResponseList, 1);
+        entry->value = results[i];
+        *link = entry;
+        link = &entry->next;
+    }
+    g_free(results);
+    return head;
+}
+
+void qmp_guest_set_user_password(const char *username,
+                                 const char *password,
+                                 bool crypted,
+                                 Error **errp)
+{
+    Error *local_err = NULL;
+    char *passwd_path = NULL;
+    const char *argv[] = { "chpasswd", crypted ? "-e" : NULL, NULL };
+    int status;
+    char *rawpasswddata = NULL;
+    size_t rawpasswdlen;
+    char *chpasswddata = NULL;
+    size_t chpasswdlen;
+
+    rawpasswddata = (char *)g_base64_decode(password, &rawpasswdlen);
+    rawpasswddata = g_renew(char, rawpasswddata, rawpasswdlen + 1);
+    rawpasswddata[rawpasswdlen] = '\0';
+
+    if (strchr(rawpasswddata, '\n')) {
+        error_setg(errp, "forbidden characters in raw password");
+        goto out;
+    }
+
+    if (strchr(username, '\n') ||
+        strchr(username, ':')) {
+        error_setg(errp, "forbidden characters in username");
+        goto out;
+    }
+
+    chpasswddata = g_strdup_printf("%s:%s\n", username, rawpasswddata);
+    chpasswdlen = strlen(chpasswddata);
+
+    passwd_path = g_find_program_in_path("chpasswd");
+
+    if (!passwd_path) {
+        error_setg(errp, "cannot find 'passwd' program in PATH");
+        goto out;
+    }
+
+    /* chpasswd reads the new password from its stdin */
+    ga_run_child(passwd_path, argv, chpasswddata, chpasswdlen, &status,
+                 &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        goto out;
+    }
+
+    if (!WIFEXITED(status)) {
+        error_setg(errp, "child process has terminated abnormally");
+        goto out;
+    }
+
+    if (WEXITSTATUS(status)) {
+        error_setg(errp, "child process has failed to set user password");
+        goto out;
+    }
+
+out:
+    g_free(chpasswddata);
+    g_free(rawpasswddata);
+    g_free(passwd_path);
+}
+
+typedef struct GuestMemblk {
+    int64_t phys_index;
+    int state_fd;               /* -1 unless kept open */
+    int removable_fd;
+    bool online;
+    bool can_offline;
+    int64_t changed;            /* scan that saw it appear or change */
+    int64_t scan;               /* scan that last saw it */
+} GuestMemblk;
+
+/* never keep more files open than this, whatever RLIMIT_NOFILE allows */
+#define GUEST_MEMBLK_FDS_MAX 16384
+
+/*
+ * The memory blocks seen by the last scan of /sys/devices/system/memory.
+ * The directory stays open, and so do the "state" and "removable" files
+ * of as many blocks as a quarter of RLIMIT_NOFILE allows, so that a scan
+ * mostly costs one pread per file instead of opening and closing every
+ * block directory and file in it.
+ */
+static struct {
+    CompatGMutex lock;
+    int dirfd;
+    GHashTable *blocks;         /* phys_index -> GuestMemblk */
+    int64_t scan;
+    unsigned int open_fds;
+    unsigned int max_fds;
+} guest_memblk_state = { .dirfd = -1 };
+
+static void guest_memblk_close(int *fdp)
+{
+    if (*fdp != -1) {
+        close(*fdp);
+        *fdp = -1;
+        guest_memblk_state.open_fds--;
+    }
+}
+
+static void guest_memblk_free(gpointer p)
+{
+    GuestMemblk *blk = p;
+
+    guest_memblk_close(&blk->state_fd);
+    guest_memblk_close(&blk->removable_fd);
+    g_free(blk);
+}
+
+/* open /sys/devices/system/memory once; returns false with errno set */
+static bool guest_memblk_open(void)
+{
+    struct rlimit rlim;
+
+    if (guest_memblk_state.dirfd != -1) {
+        return true;
+    }
+    guest_memblk_state.dirfd = open("/sys/devices/system/memory",
+                                    O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (guest_memblk_state.dirfd == -1) {
+        return false;
+    }
+    guest_memblk_state.blocks = g_hash_table_new_full(g_int64_hash,
+                                                      g_int64_equal,
+                                                      NULL, guest_memblk_free);
+    /* leave most descriptors to the rest of the agent */
+    guest_memblk_state.max_fds = 0;
+    if (getrlimit(RLIMIT_NOFILE, &rlim) == 0) {
+        guest_memblk_state.max_fds = MIN(rlim.rlim_cur / 4,
+                                         GUEST_MEMBLK_FDS_MAX);
+    }
+    return true;
+}
+
+/* read the start of @name of @blk into @buf, keeping the file open if the
+ * budget allows; returns the length read, or -1 with errno set
+ */
+static ssize_t guest_memblk_pread(GuestMemblk *blk, int *fdp,
+                                  const char *name, char *buf, size_t size)
+{
+    char path[64];
+    bool was_open = *fdp != -1;
+    ssize_t len;
+
+    snprintf(path, sizeof(path), "memory%" PRId64 "/%s", blk->phys_index,
+             name);
+    len = ga_sysfs_pread(guest_memblk_state.dirfd, path, fdp,
+                         guest_memblk_state.open_fds <
+                         guest_memblk_state.max_fds, buf, size);
+    if (was_open != (*fdp != -1)) {
+        guest_memblk_state.open_fds += was_open ? -1 : 1;
+    }
+    return len;
+}
+
+static void guest_memblk_read(GuestMemblk *blk, Error **errp)
+{
+    char status[10], removable = '0';
+    bool online, can_offline;
+    ssize_t len;
+
+    len = guest_memblk_pread(blk, &blk->state_fd, "state", status,
+                             sizeof(status));
+    if (len == -1 && errno == ENOENT) {
+        /* treat with sysfs file that not exist in old kernel */
+        online = true;
+        can_offline = false;
+    } else if (len <= 0) {
+        error_setg_errno(errp, len ? errno : 0,
+                         "pread sysfs file \"memory%" PRId64 "/state\"%s",
+                         blk->phys_index, len ? "" : ": unexpected EOF");
+        return;
+    } else {
+        online = len >= 6 && strncmp(status, "online", 6) == 0;
+
+        len = guest_memblk_pread(blk, &blk->removable_fd, "removable",
+                                 &removable, 1);
+        if (len == 0 || (len == -1 && errno != ENOENT)) {
+            error_setg_errno(errp, len ? errno : 0,
+                             "pread sysfs file \"memory%" PRId64
+                             "/removable\"%s", blk->phys_index,
+                             len ? "" : ": unexpected EOF");
+            return;
+        }
+        /* if no 'removable' file, it doesn't support offline mem blk */
+        can_offline = len == 1 && removable != '0';
+    }
+
+    if (!blk->changed || blk->online != online ||
+        blk->can_offline != can_offline) {
+        blk->changed = guest_memblk_state.scan;
+    }
+    blk->online = online;
+    blk->can_offline = can_offline;
+}
+
+static gboolean guest_memblk_expired(gpointer key, gpointer value,
+                                     gpointer opaque)
+{
+    GuestMemblk *blk = value;
+
+    return blk->scan != guest_memblk_state.scan;
+}
+
+/* bring guest_memblk_state.blocks up to date with sysfs */
+static void guest_memblk_scan(Error **errp)
+{
+    Error *local_err = NULL;
+    GuestMemblk *blk;
+    struct dirent *de;
+    int64_t phys_index;
+    DIR *dir;
+    int fd;
+
+    /* readdir needs a descriptor of its own, which closedir will close */
+    fd = openat(guest_memblk_state.dirfd, ".", O_RDONLY | O_DIRECTORY);
+    dir = fd == -1 ? NULL : fdopendir(fd);
+    if (!dir) {
+        error_setg_errno(errp, errno, "Can't open directory"
+                         "\"/sys/devices/system/memory/\"");
+        if (fd != -1) {
+            close(fd);
+        }
+        return;
+    }
+    guest_memblk_state.scan++;
+
+    /* Note: the phys_index of memory block may be discontinuous,
+     * this is because a memblk is the unit of the Sparse Memory design, which
+     * allows discontinuous memory ranges (ex. NUMA), so here we should
+     * traverse the memory block directory.
+     */
+    while (!local_err && (de = readdir(dir)) != NULL) {
+        if ((strncmp(de->d_name, "memory", 6) != 0) ||
+            !(de->d_type & DT_DIR)) {
+            continue;
+        }
+
+        /* The d_name is "memoryXXX",  phys_index is block id, same as XXX */
+        phys_index = strtoul(&de->d_name[6], NULL, 10);
+        blk = g_hash_table_lookup(guest_memblk_state.blocks, &phys_index);
+        if (!blk) {
+            blk = g_new0(GuestMemblk, 1);
+            blk->phys_index = phys_index;
+            blk->state_fd = -1;
+            blk->removable_fd = -1;
+            g_hash_table_insert(guest_memblk_state.blocks, &blk->phys_index,
+                                blk);
+        }
+        blk->scan = guest_memblk_state.scan;
+        guest_memblk_read(blk, &local_err);
+    }
+    closedir(dir);
+
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return;
+    }
+    g_hash_table_foreach_remove(guest_memblk_state.blocks,
+                                guest_memblk_expired, NULL);
+}
+
+static void guest_memblk_cleanup(void)
+{
+    if (guest_memblk_state.dirfd != -1) {
+        g_hash_table_destroy(guest_memblk_state.blocks);
+        close(guest_memblk_state.dirfd);
+    }
+    guest_memblk_state.dirfd = -1;
+    guest_memblk_state.blocks = NULL;
+    guest_memblk_state.scan = 0;
+}
+
+/* fail @result because /sys/devices/system/memory could not be opened */
+static void guest_memblk_set_failed(GuestMemoryBlockResponse *result,
+                                    int err)
+{
+    /* if there is no 'memory' directory in sysfs,
+     * we think this VM does not support online/offline memory block,
+     * any other solution?
+     */
+    if (err == ENOENT) {
+        result->response =
+            GUEST_MEMORY_BLOCK_RESPONSE_TYPE_OPERATION_NOT_SUPPORTED;
+    } else {
+        result->response = GUEST_MEMORY_BLOCK_RESPONSE_TYPE_OPERATION_FAILED;
+    }
+    result->has_error_code = true;
+    result->error_code = err;
+}
+
+/* Transfer online/offline status from @mem_blk to the guest system, through
+ * @dirfd open on /sys/devices/system/memory.  This may run on any thread.
+ *
+ * The following @mem_blk fields are accessed:
+ * - R: mem_blk->phys_index
+ * - R: mem_blk->online
+ */
+static void transfer_memory_block(int dirfd, GuestMemoryBlock *mem_blk,
+                                  GuestMemoryBlockResponse *result)
+{
+    char path[64], status[10] = "";
+    Error *local_err = NULL;
+
+    snprintf(path, sizeof(path), "memory%" PRId64 "/state",
+             mem_blk->phys_index);
+    ga_read_sysfs_file(dirfd, path, status, sizeof(status) - 1, &local_err);
+    if (local_err) {
+        error_free(local_err);
+        if (errno != ENOENT) {
+            result->response =
+                GUEST_MEMORY_BLOCK_RESPONSE_TYPE_OPERATION_FAILED;
+            goto out;
+        }
+        /* either there is no such block, or an old kernel without the
+         * file, which can't offline the block
+         */
+        *strchr(path, '/') = '\0';
+        if (faccessat(dirfd, path, F_OK, 0) == -1) {
+            result->response = errno == ENOENT ?
+                GUEST_MEMORY_BLOCK_RESPONSE_TYPE_NOT_FOUND :
+                GUEST_MEMORY_BLOCK_RESPONSE_TYPE_OPERATION_FAILED;
+            goto out;
+        }
+        errno = ENOENT;
+        if (!mem_blk->online) {
+            result->response =
+                GUEST_MEMORY_BLOCK_RESPONSE_TYPE_OPERATION_NOT_SUPPORTED;
+        }
+        goto out;
+    }
+
+    if (mem_blk->online != (strncmp(status, "online", 6) == 0)) {
+        const char *new_state = mem_blk->online ? "online" : "offline";
+
+        ga_write_sysfs_file(dirfd, path, new_state, strlen(new_state),
+                            &local_err);
+        if (local_err) {
+            error_free(local_err);
+            result->response =
+                GUEST_MEMORY_BLOCK_RESPONSE_TYPE_OPERATION_FAILED;
+            goto out;
+        }
+
+        result->response = GUEST_MEMORY_BLOCK_RESPONSE_TYPE_SUCCESS;
+        result->has_error_code = false;
+    } /* otherwise pretend successful re-(on|off)-lining */
+    return;
+
+out:
+    result->has_error_code = true;
+    result->error_code = errno;
+}
+
+GuestMemoryBlockList *qmp_guest_get_memory_blocks(bool has_changed_since,
+                                                  int64_t changed_since,
+                                                  Error **errp)
+{
+    GuestMemoryBlockList *head = NULL, *entry;
+    GuestMemoryBlock *mem_blk;
+    Error *local_err = NULL;
+    GHashTableIter iter;
+    GuestMemblk *blk;
+    gpointer value;
+    size_t count = 0;
+
+    g_mutex_lock(&guest_memblk_state.lock);
+    if (!guest_memblk_open()) {
+        /* it's ok if this happens to be a system that doesn't expose
+         * memory blocks via sysfs, but otherwise we should report
+         * an error
+         */
+        if (errno != ENOENT) {
+            error_setg_errno(errp, errno, "Can't open directory"
+                             "\"/sys/devices/system/memory/\"");
+        }
+        goto out;
+    }
+
+    guest_memblk_scan(&local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        goto out;
+    }
+    /* there's no guest with zero memory blocks */
+    if (!g_hash_table_size(guest_memblk_state.blocks)) {
+        error_setg(errp, "guest reported zero memory blocks!");
+        goto out;
+    }
+
+    /* count first, so that the whole list is a single allocation */
+    g_hash_table_iter_init(&iter, guest_memblk_state.blocks);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        blk = value;
+        if (!has_changed_since || blk->changed > changed_since) {
+            count++;
+        }
+    }
+
+    head = qapi_GuestMemoryBlockList_new(count);
+    entry = head;
+    g_hash_table_iter_init(&iter, guest_memblk_state.blocks);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        blk = value;
+        if (has_changed_since && blk->changed <= changed_since) {
+            continue;
+        }
+
+        mem_blk = entry->value;
+        mem_blk->phys_index = blk->phys_index;
+        mem_blk->online = blk->online;
+        mem_blk->has_can_offline = true; /* lolspeak ftw */
+        mem_blk->can_offline = blk->can_offline;
+        mem_blk->has_changed = true;
+        mem_blk->changed = blk->changed;
+        entry = entry->next;
+    }
+
+out:
+    g_mutex_unlock(&guest_memblk_state.lock);
+    return head;
+}
+
+GuestMemoryBlockResponseList *
+qmp_guest_set_memory_blocks(GuestMemoryBlockList *mem_blks, Error **errp)
+{
+    GuestMemoryBlockResponseList *head, **link;
+    int dirfd, err;
+
+    head = NULL;
+    link = &head;
+
+    g_mutex_lock(&guest_memblk_state.lock);
+    dirfd = guest_memblk_open() ? guest_memblk_state.dirfd : -1;
+    err = errno;
+    while (mem_blks != NULL) {
+        GuestMemoryBlockResponse *result;
+        GuestMemoryBlockResponseList *entry;
+        GuestMemoryBlock *current_mem_blk = mem_blks->value;
+
+        result = g_malloc0(sizeof(*result));
+        result->phys_index = current_mem_blk->phys_index;
+        if (dirfd == -1) {
+            guest_memblk_set_failed(result, err);
+        } else {
+            transfer_memory_block(dirfd, current_mem_blk, result);
+        }
+        entry = g_malloc0(sizeof *entry);
+        entry->value = result;
+
+        *link = entry;
+        link = &entry->next;
+        mem_blks = mem_blks->next;
+    }
+    g_mutex_unlock(&guest_memblk_state.lock);
+
+    return head;
+}
+
+/* Most jobs kept at a time, running or waiting for their status */
+#define GUEST_MEMBLK_MAX_JOBS 16
+#define GUEST_MEMBLK_MAX_PARALLEL 64
+#define GUEST_MEMBLK_MAX_RANGES 1024
+
+/* one block of a job; @result is written by the thread setting it */
+typedef struct GuestMemblkOp {
+    uint64_t phys_index;
+    bool online;
+    GuestMemoryBlockResponse result;
+    bool finished;
+} GuestMemblkOp;
+
+/*
+ * A job pushes each of its blocks, in order, to a thread pool of up to
+ * @max-parallel threads.  @finished, @pending and @cancelled are shared
+ * by the threads and the main loop and protected by @lock.
+ */
+typedef struct GuestMemblkJob {
+    int64_t id;
+    int dirfd;                  /* its own, so it can outlive the cache */
+    GThreadPool *pool;
+    GuestMemblkOp *ops;
+    size_t nops;
+    CompatGMutex lock;
+    size_t pending;
+    bool cancelled;
+    QTAILQ_ENTRY(GuestMemblkJob) next;
+} GuestMemblkJob;
+
+static struct {
+    QTAILQ_HEAD(, GuestMemblkJob) jobs;
+    unsigned int count;
+    int64_t last_id;
+} guest_memblk_jobs = {
+    .jobs = QTAILQ_HEAD_INITIALIZER(guest_memblk_jobs.jobs),
+};
+
+static void guest_memblk_job_thread(gpointer data, gpointer opaque)
+{
+    GuestMemblkOp *op = data;
+    GuestMemblkJob *job = opaque;
+    GuestMemoryBlock mem_blk = {
+        .phys_index = op->phys_index,
+        .online = op->online,
+    };
+    bool cancelled;
+
+    g_mutex_lock(&job->lock);
+    cancelled = job->cancelled;
+    g_mutex_unlock(&job->lock);
+
+    op->result.phys_index = op->phys_index;
+    if (cancelled) {
+        op->result.response =
+            GUEST_MEMORY_BLOCK_RESPONSE_TYPE_OPERATION_FAILED;
+        op->result.has_error_code = true;
+        op->result.error_code = ECANCELED;
+    } else {
+        transfer_memory_block(job->dirfd, &mem_blk, &op->result);
+    }
+
+    g_mutex_lock(&job->lock);
+    op->finished = true;
+    job->pending--;
+    g_mutex_unlock(&job->lock);
+}
+
+static void guest_memblk_job_free(GuestMemblkJob *job)
+{
+    /* runs what is still queued, which a cancel makes quick */
+    g_thread_pool_free(job->pool, false, true);
+    close(job->dirfd);
+    g_free(job->ops);
+    g_mutex_clear(&job->lock);
+    g_free(job);
+}
+
+static gint guest_memblk_cmp(gconstpointer a, gconstpointer b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* the blocks of the guest in each range, in the order the job sets them;
+ * called with guest_memblk_state.lock held, after a scan
+ */
+static GArray *guest_memblk_job_ops(GuestMemoryBlockRangeList *ranges)
+{
+    GArray *ops = g_array_new(false, false, sizeof(GuestMemblkOp));
+    GArray *indexes = g_array_new(false, false, sizeof(uint64_t));
+    GuestMemoryBlockRange *r;
+    GuestMemblkOp op = { 0 };
+    GHashTableIter iter;
+    gpointer value;
+    uint64_t lo, hi, index;
+    guint i;
+
+    for (; ranges; ranges = ranges->next) {
+        r = ranges->value;
+        lo = MIN(r->first, r->last);
+        hi = MAX(r->first, r->last);
+        g_array_set_size(indexes, 0);
+        g_hash_table_iter_init(&iter, guest_memblk_state.blocks);
+        while (g_hash_table_iter_next(&iter, NULL, &value)) {
+            index = ((GuestMemblk *)value)->phys_index;
+            if (index >= lo && index <= hi) {
+                g_array_append_val(indexes, index);
+            }
+        }
+        g_array_sort(indexes, guest_memblk_cmp);
+
+        op.online = r->online;
+        for (i = 0; i < indexes->len; i++) {
+            op.phys_index = g_array_index(indexes,
+                                          uint64_t, r->first <= r->last ?
+                                          i : indexes->len - 1 - i);
+            g_array_append_val(ops, op);
+        }
+    }
+    g_array_free(indexes, true);
+    return ops;
+}
+
+GuestMemoryBlockJobStart *
+qmp_guest_set_memory_blocks_start(GuestMemoryBlockRangeList *ranges,
+                                  bool has_max_parallel,
+                                  int64_t max_parallel,
+                                  Error **errp)
+{
+    GuestMemoryBlockRangeList *r;
+    GuestMemoryBlockJobStart *start;
+    GuestMemblkJob *job;
+    Error *local_err = NULL;
+    GArray *ops;
+    int dirfd = -1, nranges = 0;
+    size_t i;
+
+    slog("guest-set-memory-blocks-start called");
+
+    for (r = ranges; r; r = r->next) {
+        nranges++;
+    }
+    if (!nranges || nranges > GUEST_MEMBLK_MAX_RANGES) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "ranges",
+                   "a list of 1 to 1024 ranges");
+        return NULL;
+    }
+    if (has_max_parallel &&
+        (max_parallel < 1 || max_parallel > GUEST_MEMBLK_MAX_PARALLEL)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "max-parallel",
+                   "a number between 1 and 64");
+        return NULL;
+    }
+    if (guest_memblk_jobs.count >= GUEST_MEMBLK_MAX_JOBS) {
+        error_setg(errp, "too many memory block jobs, get the status of "
+                   "finished ones to release them");
+        return NULL;
+    }
+
+    g_mutex_lock(&guest_memblk_state.lock);
+    if (!guest_memblk_open()) {
+        error_setg_errno(errp, errno, "Can't open directory"
+                         "\"/sys/devices/system/memory/\"");
+        g_mutex_unlock(&guest_memblk_state.lock);
+        return NULL;
+    }
+    guest_memblk_scan(&local_err);
+    if (!local_err) {
+        dirfd = fcntl(guest_memblk_state.dirfd, F_DUPFD_CLOEXEC, 0);
+        if (dirfd == -1) {
+            error_setg_errno(&local_err, errno, "failed to duplicate the "
+                             "descriptor of /sys/devices/system/memory");
+        }
+    }
+    if (local_err) {
+        g_mutex_unlock(&guest_memblk_state.lock);
+        error_propagate(errp, local_err);
+        return NULL;
+    }
+    ops = guest_memblk_job_ops(ranges);
+    g_mutex_unlock(&guest_memblk_state.lock);
+
+    if (!ops->len) {
+        error_setg(errp, "the guest has no memory block in 'ranges'");
+        g_array_free(ops, true);
+        close(dirfd);
+        return NULL;
+    }
+
+    job = g_new0(GuestMemblkJob, 1);
+    job->id = ++guest_memblk_jobs.last_id;
+    job->dirfd = dirfd;
+    job->nops = ops->len;
+    job->ops = (GuestMemblkOp *)g_array_free(ops, false);
+    job->pending = job->nops;
+    g_mutex_init(&job->lock);
+    job->pool = g_thread_pool_new(guest_memblk_job_thread, job,
+                                  has_max_parallel ? max_parallel : 4,
+                                  false, NULL);
+    for (i = 0; i < job->nops; i++) {
+        g_thread_pool_push(job->pool, &job->ops[i], NULL);
+    }
+    QTAILQ_INSERT_TAIL(&guest_memblk_jobs.jobs, job, next);
+    guest_memblk_jobs.count++;
+
+    start = g_new0(GuestMemoryBlockJobStart, 1);
+    start->id = job->id;
+    return start;
+}
+
+static GuestMemblkJob *guest_memblk_job_find(int64_t id, Error **errp)
+{
+    GuestMemblkJob *job;
+
+    QTAILQ_FOREACH(job, &guest_memblk_jobs.jobs, next) {
+        if (job->id == id) {
+            return job;
+        }
+    }
+    error_setg(errp, QERR_INVALID_PARAMETER, "id");
+    return NULL;
+}
+
+static void guest_memblk_job_remove(GuestMemblkJob *job)
+{
+    QTAILQ_REMOVE(&guest_memblk_jobs.jobs, job, next);
+    guest_memblk_jobs.count--;
+    guest_memblk_job_free(job);
+}
+
+GuestMemoryBlockJob *qmp_guest_set_memory_blocks_status(int64_t id,
+                                                        Error **errp)
+{
+    GuestMemblkJob *job = guest_memblk_job_find(id, errp);
+    GuestMemoryBlockJob *info;
+    GuestMemoryBlockResponseList *list, **tail;
+    GuestMemblkOp *op;
+    size_t i;
+
+    if (!job) {
+        return NULL;
+    }
+
+    info = g_new0(GuestMemoryBlockJob, 1);
+    info->id = job->id;
+    info->total = job->nops;
+    tail = &info->results;
+    g_mutex_lock(&job->lock);
+    info->finished = !job->pending;
+    for (i = 0; i < job->nops; i++) {
+        op = &job->ops[i];
+        if (!op->finished) {
+            continue;
+        }
+        info->done++;
+        if (op->result.response != GUEST_MEMORY_BLOCK_RESPONSE_TYPE_SUCCESS) {
+            info->failed++;
+        }
+
+        list = g_new0(GuestMemoryBlockResponseList, 1);
+        list->value = g_memdup(&op->result, sizeof(op->result));
+        *tail = list;
+        tail = &list->next;
+    }
+    g_mutex_unlock(&job->lock);
+
+    if (info->finished) {
+        guest_memblk_job_remove(job);
+    }
+    return info;
+}
+
+static void guest_memblk_job_cancel(GuestMemblkJob *job)
+{
+    g_mutex_lock(&job->lock);
+    job->cancelled = true;
+    g_mutex_unlock(&job->lock);
+}
+
+void qmp_guest_set_memory_blocks_cancel(int64_t id, Error **errp)
+{
+    GuestMemblkJob *job = guest_memblk_job_find(id, errp);
+
+    if (job) {
+        guest_memblk_job_cancel(job);
+    }
+}
+
+static void guest_memblk_jobs_cleanup(void)
+{
+    GuestMemblkJob *job;
+
+    QTAILQ_FOREACH(job, &guest_memblk_jobs.jobs, next) {
+        guest_memblk_job_cancel(job);
+    }
+    while ((job = QTAILQ_FIRST(&guest_memblk_jobs.jobs))) {
+        guest_memblk_job_remove(job);
+    }
+}
+
+GuestMemoryBlockInfo *qmp_guest_get_memory_block_info(Error **errp)
+{
+    Error *local_err = NULL;
+    char *buf;
+    GuestMemoryBlockInfo *info;
+
+    g_mutex_lock(&guest_memblk_state.lock);
+    if (!guest_memblk_open()) {
+        error_setg_errno(errp, errno, "open(\"%s\")",
+                         "/sys/devices/system/memory/");
+        g_mutex_unlock(&guest_memblk_state.lock);
+        return NULL;
+    }
+
+    buf = g_malloc0(20);
+    ga_read_sysfs_file(guest_memblk_state.dirfd, "block_size_bytes", buf, 20,
+                       &local_err);
+    g_mutex_unlock(&guest_memblk_state.lock);
+    if (local_err) {
+        g_free(buf);
+        error_propagate(errp, local_err);
+        return NULL;
+    }
+
+    info = g_new0(GuestMemoryBlockInfo, 1);
+    info->size = strtol(buf, NULL, 16); /* the unit is bytes */
+
+    g_free(buf);
+
+    return info;
+}
+
+/*MemoryStatus*/
+/*########################################################################################################*/
+/* errors of the shared collectors in qga/bc, as an Error */
+static void ga_collect_error(Error **errp, GError *gerr)
+{
+    error_setg(errp, "%s", gerr->message);
+    g_error_free(gerr);
+}
+
+/* fill @mi from a single read of /proc/meminfo */
+static void ga_read_meminfo(GuestMeminfo *mi, Error **errp)
+{
+    GError *gerr = NULL;
+
+    if (!ga_collect_memory(mi, &gerr)) {
+        ga_collect_error(errp, gerr);
+    }
+}
+
+/* MemAvailable, estimated as the kernel did before 3.14 if it is missing */
+static uint64_t ga_meminfo_available(const GuestMeminfo *mi)
+{
+    if (MEMINFO_HAS(mi, MEMINFO_MEM_AVAILABLE)) {
+        return mi->value[MEMINFO_MEM_AVAILABLE];
+    }
+    return mi->value[MEMINFO_MEM_FREE] + mi->value[MEMINFO_BUFFERS] +
+           mi->value[MEMINFO_CACHED];
+}
+
+GuestMemoryStatus *qmp_guest_get_memory_status(Error **errp)
+{
+    GuestMemoryStatus *status;
+    SwapInfo *swap;
+    GuestMeminfo mi;
+    Error *local_err = NULL;
+    uint64_t *v = mi.value;
+
+    ga_read_meminfo(&mi, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return NULL;
+    }
+
+    swap = g_new0(SwapInfo, 1);
+    swap->total = v[MEMINFO_SWAP_TOTAL] >> 20;
+    swap->used = (v[MEMINFO_SWAP_TOTAL] - v[MEMINFO_SWAP_FREE]) >> 20;
+    swap->has_total_bytes = true;
+    swap->total_bytes = v[MEMINFO_SWAP_TOTAL];
+    swap->has_free_bytes = true;
+    swap->free_bytes = v[MEMINFO_SWAP_FREE];
+
+    /* the legacy members are in MiB */
+    status = g_new0(GuestMemoryStatus, 1);
+    status->total = v[MEMINFO_MEM_TOTAL] >> 20;
+    status->used = (v[MEMINFO_MEM_TOTAL] - v[MEMINFO_MEM_FREE]) >> 20;
+    status->buffer = v[MEMINFO_BUFFERS] >> 20;
+    status->cached = v[MEMINFO_CACHED] >> 20;
+    status->swap = swap;
+
+    status->has_total_bytes = true;
+    status->total_bytes = v[MEMINFO_MEM_TOTAL];
+    status->has_free_bytes = true;
+    status->free_bytes = v[MEMINFO_MEM_FREE];
+    status->has_buffers_bytes = true;
+    status->buffers_bytes = v[MEMINFO_BUFFERS];
+    status->has_cached_bytes = true;
+    status->cached_bytes = v[MEMINFO_CACHED];
+    /* these are missing from older kernels */
+    status->has_available_bytes = MEMINFO_HAS(&mi, MEMINFO_MEM_AVAILABLE);
+    status->available_bytes = v[MEMINFO_MEM_AVAILABLE];
+    status->has_shmem_bytes = MEMINFO_HAS(&mi, MEMINFO_SHMEM);
+    status->shmem_bytes = v[MEMINFO_SHMEM];
+    status->has_slab_bytes = MEMINFO_HAS(&mi, MEMINFO_SLAB);
+    status->slab_bytes = v[MEMINFO_SLAB];
+    status->has_hugepages_total = MEMINFO_HAS(&mi, MEMINFO_HUGEPAGES_TOTAL);
+    status->hugepages_total = v[MEMINFO_HUGEPAGES_TOTAL];
+    status->has_hugepages_free = MEMINFO_HAS(&mi, MEMINFO_HUGEPAGES_FREE);
+    status->hugepages_free = v[MEMINFO_HUGEPAGES_FREE];
+    status->has_hugepage_size = MEMINFO_HAS(&mi, MEMINFO_HUGEPAGESIZE);
+    status->hugepage_size = v[MEMINFO_HUGEPAGESIZE];
+
+    return status;
+}
+
+/* the files of a NUMA node that stay open between calls */
+typedef struct GuestNumaNodeFiles {
+    int64_t id;
+    int meminfo_fd;
+    int numastat_fd;
+    int cpulist_fd;
+    int distance_fd;
+    unsigned int scan;
+} GuestNumaNodeFiles;
+
+/*
+ * The NUMA nodes seen by the last guest-get-numa-info.  As for memory
+ * blocks, the directory of /sys/devices/system/node stays open, and so do
+ * the files of each node, which are only pread() on later calls.
+ */
+static struct {
+    CompatGMutex lock;
+    int dirfd;
+    GHashTable *nodes;          /* id -> GuestNumaNodeFiles */
+    unsigned int scan;
+} guest_numa_state = { .dirfd = -1 };
+
+static void guest_numa_node_free(gpointer p)
+{
+    GuestNumaNodeFiles *f = p;
+    int *fds[] = {
+        &f->meminfo_fd, &f->numastat_fd, &f->cpulist_fd, &f->distance_fd
+    };
+    size_t i;
+
+    for (i = 0; i < ARRAY_SIZE(fds); i++) {
+        if (*fds[i] != -1) {
+            close(*fds[i]);
+        }
+    }
+    g_free(f);
+}
+
+static gboolean guest_numa_node_expired(gpointer key, gpointer value,
+                                        gpointer opaque)
+{
+    GuestNumaNodeFiles *f = value;
+
+    return f->scan != guest_numa_state.scan;
+}
+
+static void guest_numa_cleanup(void)
+{
+    if (guest_numa_state.dirfd != -1) {
+        g_hash_table_destroy(guest_numa_state.nodes);
+        close(guest_numa_state.dirfd);
+    }
+    guest_numa_state.dirfd = -1;
+    guest_numa_state.nodes = NULL;
+}
+
+/* read the file @name of node @f into @buf as a string; returns false if
+ * it could not be read
+ */
+static bool guest_numa_read(GuestNumaNodeFiles *f, int *fdp,
+                            const char *name, char *buf, size_t size)
+{
+    char path[64];
+    ssize_t len;
+
+    snprintf(path, sizeof(path), "node%" PRId64 "/%s", f->id, name);
+    len = ga_sysfs_pread(guest_numa_state.dirfd, path, fdp, true, buf,
+                         size - 1);
+    if (len < 0) {
+        return false;
+    }
+    buf[len] = '\0';
+    return true;
+}
+
+/* parse a cpulist like "0-3,8,10-11" */
+static intList *guest_numa_cpulist(const char *str)
+{
+    intList *head = NULL, **tail = &head, *entry;
+    int64_t first, last;
+    char *end;
+
+    while (g_ascii_isdigit(*str)) {
+        first = last = strtoll(str, &end, 10);
+        if (*end == '-') {
+            last = strtoll(end + 1, &end, 10);
+        }
+        for (; first <= last; first++) {
+            entry = g_new0(intList, 1);
+            entry->value = first;
+            *tail = entry;
+            tail = &entry->next;
+        }
+        str = *end == ',' ? end + 1 : end;
+    }
+    return head;
+}
+
+static void guest_numa_node_read(GuestNumaNodeFiles *f, GuestNumaNode *node)
+{
+    char buf[8192], *p, *end;
+    intList **tail;
+    GuestMeminfo mi;
+    uint64_t *v = mi.value;
+    uint64_t val;
+
+    node->id = f->id;
+    if (guest_numa_read(f, &f->cpulist_fd, "cpulist", buf, sizeof(buf))) {
+        node->cpus = guest_numa_cpulist(buf);
+    }
+
+    if (guest_numa_read(f, &f->meminfo_fd, "meminfo", buf, sizeof(buf))) {
+        ga_parse_meminfo(buf, &mi);
+        node->has_total_bytes = MEMINFO_HAS(&mi, MEMINFO_MEM_TOTAL);
+        node->total_bytes = v[MEMINFO_MEM_TOTAL];
+        node->has_free_bytes = MEMINFO_HAS(&mi, MEMINFO_MEM_FREE);
+        node->free_bytes = v[MEMINFO_MEM_FREE];
+        node->has_hugepages_total = MEMINFO_HAS(&mi,
+                                                MEMINFO_HUGEPAGES_TOTAL);
+        node->hugepages_total = v[MEMINFO_HUGEPAGES_TOTAL];
+        node->has_hugepages_free = MEMINFO_HAS(&mi, MEMINFO_HUGEPAGES_FREE);
+        node->hugepages_free = v[MEMINFO_HUGEPAGES_FREE];
+    }
+
+    if (guest_numa_read(f, &f->distance_fd, "distance", buf, sizeof(buf))) {
+        node->has_distances = true;
+        tail = &node->distances;
+        for (p = buf; ; p = end) {
+            val = strtoull(p, &end, 10);
+            if (end == p) {
+                break;
+            }
+            *tail = g_new0(intList, 1);
+            (*tail)->value = val;
+            tail = &(*tail)->next;
+        }
+    }
+
+    if (guest_numa_read(f, &f->numastat_fd, "numastat", buf, sizeof(buf))) {
+        for (p = buf; *p; p = end) {
+            end = strchr(p, ' ');
+            if (!end) {
+                break;
+            }
+            *end++ = '\0';
+            val = strtoull(end, &end, 10);
+            if (!strcmp(p, "numa_hit")) {
+                node->has_numa_hit = true;
+                node->numa_hit = val;
+            } else if (!strcmp(p, "numa_miss")) {
+                node->has_numa_miss = true;
+                node->numa_miss = val;
+            } else if (!strcmp(p, "numa_foreign")) {
+                node->has_numa_foreign = true;
+                node->numa_foreign = val;
+            } else if (!strcmp(p, "interleave_hit")) {
+                node->has_interleave_hit = true;
+                node->interleave_hit = val;
+            } else if (!strcmp(p, "local_node")) {
+                node->has_local_node = true;
+                node->local_node = val;
+            } else if (!strcmp(p, "other_node")) {
+                node->has_other_node = true;
+                node->other_node = val;
+            }
+            while (*end == '\n') {
+                end++;
+            }
+        }
+    }
+}
+
+GuestNumaInfo *qmp_guest_get_numa_info(Error **errp)
+{
+    GuestNumaInfo *info = g_new0(GuestNumaInfo, 1);
+    GuestNumaNodeList *entry, **link;
+    GuestNumaNodeFiles *f;
+    GuestNumaNode *node;
+    struct dirent *de;
+    int64_t id;
+    DIR *dir;
+    int fd;
+
+    g_mutex_lock(&guest_numa_state.lock);
+    if (guest_numa_state.dirfd == -1) {
+        guest_numa_state.dirfd = open("/sys/devices/system/node",
+                                      O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (guest_numa_state.dirfd == -1) {
+            /* a kernel without NUMA support has no nodes to report */
+            if (errno != ENOENT) {
+                error_setg_errno(errp, errno, "failed to open %s",
+                                 "/sys/devices/system/node");
+                qapi_free_GuestNumaInfo(info);
+                info = NULL;
+            }
+            goto out;
+        }
+        guest_numa_state.nodes = g_hash_table_new_full(g_int64_hash,
+                                                       g_int64_equal, NULL,
+                                                       guest_numa_node_free);
+    }
+
+    /* readdir needs a descriptor of its own, which closedir will close */
+    fd = openat(guest_numa_state.dirfd, ".", O_RDONLY | O_DIRECTORY);
+    dir = fd == -1 ? NULL : fdopendir(fd);
+    if (!dir) {
+        error_setg_errno(errp, errno, "failed to open %s",
+                         "/sys/devices/system/node");
+        if (fd != -1) {
+            close(fd);
+        }
+        qapi_free_GuestNumaInfo(info);
+        info = NULL;
+        goto out;
+    }
+    guest_numa_state.scan++;
+
+    while ((de = readdir(dir)) != NULL) {
+        if (strncmp(de->d_name, "node", 4) ||
+            !g_ascii_isdigit(de->d_name[4])) {
+            continue;
+        }
+        id = strtoll(de->d_name + 4, NULL, 10);
+        f = g_hash_table_lookup(guest_numa_state.nodes, &id);
+        if (!f) {
+            f = g_new0(GuestNumaNodeFiles, 1);
+            f->id = id;
+            f->meminfo_fd = f->numastat_fd = -1;
+            f->cpulist_fd = f->distance_fd = -1;
+            g_hash_table_insert(guest_numa_state.nodes, &f->id, f);
+        }
+        f->scan = guest_numa_state.scan;
+
+        node = g_new0(GuestNumaNode, 1);
+        guest_numa_node_read(f, node);
+
+        /* in the order of the node ids */
+        link = &info->nodes;
+        while (*link && (*link)->value->id < id) {
+            link = &(*link)->next;
+        }
+        entry = g_new0(GuestNumaNodeList, 1);
+        entry->value = node;
+        entry->next = *link;
+        *link = entry;
+    }
+    closedir(dir);
+    g_hash_table_foreach_remove(guest_numa_state.nodes,
+                                guest_numa_node_expired, NULL);
+
+out:
+    g_mutex_unlock(&guest_numa_state.lock);
+    return info;
+}
+/*########################################################################################################*/
+
+/*OSStatus*/
+/*########################################################################################################*/
+/*
+ * uname(), the distribution name, the fqdn and the file the persistent
+ * host name lives in are cached by the shared collector in qga/bc.
+ */
+static void guest_sysinfo_init(void)
+{
+    ga_collect_system_init();
+}
+
+/* the deferred guest_sysinfo_init() has to have run before these are read */
+static void guest_sysinfo_ensure(void)
+{
+    ga_command_state_run(ga_get_command_state(ga_state), guest_sysinfo_init);
+}
+
+static void guest_sysinfo_cleanup(void)
+{
+    ga_collect_system_cleanup();
+}
+
+GuestSystemInfo *qmp_guest_get_system_info(Error **errp)
+{
+    GuestSystemInfo *info = g_new0(GuestSystemInfo, 1);
+    GACollectSystem si;
+
+    guest_sysinfo_ensure();
+    ga_collect_system(&si);
+    info->os_name = si.os_name;
+    info->kernel_version = si.kernel_version;
+    info->system_version = si.system_version;
+    info->fqdn = si.fqdn;
+    info->lastlogin = si.lastlogin;
+    info->has_pretty_name = si.pretty_name != NULL;
+    info->pretty_name = si.pretty_name;
+
+    return info;
+}
+
+GuestUserLoginList *qmp_guest_get_users(Error **errp)
+{
+    GuestUserLoginList *head = NULL, **tail = &head;
+    GuestUserLogin *user;
+    GACollectLogin *login;
+    GPtrArray *logins;
+    guint i;
+
+    logins = ga_collect_logins();
+    for (i = 0; i < logins->len; i++) {
+        login = g_ptr_array_index(logins, i);
+        user = g_new0(GuestUserLogin, 1);
+        user->user = g_strdup(login->user);
+        user->has_tty = *login->tty != '\0';
+        user->tty = g_strdup(login->tty);
+        user->has_host = *login->host != '\0';
+        user->host = g_strdup(login->host);
+        user->pid = login->pid;
+        user->login_time = login->time;
+        user->has_idle = login->idle >= 0;
+        user->idle = login->idle;
+        user->has_session = login->session != NULL;
+        user->session = g_strdup(login->session);
+        user->has_session_type = login->session_type != NULL;
+        user->session_type = g_strdup(login->session_type);
+        user->has_session_state = login->session_state != NULL;
+        user->session_state = g_strdup(login->session_state);
+
+        *tail = g_new0(GuestUserLoginList, 1);
+        (*tail)->value = user;
+        tail = &(*tail)->next;
+    }
+    g_ptr_array_free(logins, true);
+    return head;
+}
+/*########################################################################################################*/
+
+/*APPStatus*/
+/*########################################################################################################*/
+static ssize_t ga_read_proc_file(int dirfd, const char *pathname,
+                                 char *buf, size_t size)
+{
+    int fd;
+    ssize_t res;
+
+    fd = openat(dirfd, pathname, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    res = pread(fd, buf, size - 1, 0);
+    close(fd);
+    if (res >= 0) {
+        buf[res] = '\0';
+    }
+    return res;
+}
+
+static GuestProcessInfo *guest_process_info(const GACollectProcess *proc)
+{
+    GuestProcessInfo *info = g_new0(GuestProcessInfo, 1);
+
+    info->pid = proc->pid;
+    info->comm = g_strdup(proc->comm);
+    info->has_state = true;
+    info->state = g_strdup_printf("%c", proc->state);
+    info->rss = proc->rss;
+    info->threads = proc->threads;
+    info->utime = proc->utime;
+    info->stime = proc->stime;
+    if (proc->has_delta) {
+        info->has_utime_delta = true;
+        info->utime_delta = proc->utime_delta;
+        info->has_stime_delta = true;
+        info->stime_delta = proc->stime_delta;
+    }
+    return info;
+}
+
+/* the process scan and its CPU time deltas live in the shared collector */
+GuestProcessInfoList *qmp_guest_get_processes(bool has_sort,
+                                              GuestProcessSortKey sort,
+                                              bool has_limit, int64_t limit,
+                                              Error **errp)
+{
+    GuestProcessInfoList *head = NULL, **link = &head, *entry;
+    GACollectProcess *proc;
+    GArray *procs;
+    GError *gerr = NULL;
+    guint i;
+
+    if (has_limit && limit < 0) {
+        error_setg(errp, "value '%" PRId64 "' is invalid for argument limit",
+                   limit);
+        return NULL;
+    }
+
+    procs = ga_collect_processes(&gerr);
+    if (!procs) {
+        ga_collect_error(errp, gerr);
+        return NULL;
+    }
+
+    if (has_limit) {
+        ga_collect_processes_top(procs, has_sort &&
+                                 sort == GUEST_PROCESS_SORT_KEY_RSS,
+                                 MIN(limit, G_MAXSIZE));
+    } else if (has_sort) {
+        ga_collect_processes_sort(procs, sort == GUEST_PROCESS_SORT_KEY_RSS);
+    }
+
+    for (i = 0; i < procs->len && (!has_limit || i < limit); i++) {
+        proc = &g_array_index(procs, GACollectProcess, i);
+        entry = g_new0(GuestProcessInfoList, 1);
+        entry->value = guest_process_info(proc);
+        *link = entry;
+        link = &entry->next;
+    }
+
+    g_array_free(procs, true);
+    return head;
+}
+
+/* the generations and the proc connector live in the collector as well */
+GuestProcessChanges *qmp_guest_get_process_changes(bool has_since,
+                                                   const char *since,
+                                                   Error **errp)
+{
+    GuestProcessChanges *changes;
+    GuestProcessInfoList **plink;
+    GuestProcessExitList **elink;
+    GuestProcessInfoList *pentry;
+    GuestProcessExitList *eentry;
+    GuestProcessExit *pexit;
+    GACollectProcExit *rec;
+    GACollectProcChanges ch;
+    GError *gerr = NULL;
+    guint i;
+
+    if (!ga_collect_process_changes(has_since ? since : NULL, &ch, &gerr)) {
+        ga_collect_error(errp, gerr);
+        return NULL;
+    }
+
+    changes = g_new0(GuestProcessChanges, 1);
+    changes->token = ch.token;
+    ch.token = NULL;
+    changes->full = ch.full;
+    changes->exits_complete = ch.exits_complete;
+
+    plink = &changes->processes;
+    for (i = 0; i < ch.procs->len; i++) {
+        pentry = g_new0(GuestProcessInfoList, 1);
+        pentry->value = guest_process_info(&g_array_index(ch.procs,
+                                                          GACollectProcess,
+                                                          i));
+        *plink = pentry;
+        plink = &pentry->next;
+    }
+
+    elink = &changes->exits;
+    for (i = 0; i < ch.exits->len; i++) {
+        rec = &g_array_index(ch.exits, GACollectProcExit, i);
+        pexit = g_new0(GuestProcessExit, 1);
+        pexit->pid = rec->pid;
+        pexit->comm = g_strdup(rec->comm);
+        if (rec->has_status && rec->signal) {
+            pexit->has_signal = true;
+            pexit->signal = rec->signal;
+        } else if (rec->has_status) {
+            pexit->has_exit_code = true;
+            pexit->exit_code = rec->exit_code;
+        }
+        eentry = g_new0(GuestProcessExitList, 1);
+        eentry->value = pexit;
+        *elink = eentry;
+        elink = &eentry->next;
+    }
+
+    ga_collect_process_changes_clear(&ch);
+    return changes;
+}
+
+struct APPStatus *qmp_guest_get_app_status(Error **errp)
+{
+    APPStatus *status;
+    GError *gerr = NULL;
+    char *text;
+
+    text = ga_collect_app_status(&gerr);
+    if (!text) {
+        ga_collect_error(errp, gerr);
+        return NULL;
+    }
+
+    status = g_new0(APPStatus, 1);
+    status->appStatus = text;
+    return status;
+}
+/*########################################################################################################*/
+
+/*DiskStatus*/
+/*########################################################################################################*/
+/*
+ * Report usage of the local, block device backed file systems, as the
+ * shared collector in qga/bc lists them.  The legacy sizes are formatted
+ * like "df -h" prints them.  The collector keeps the usage of each
+ * reading, and fits the fill rate to them here.
+ */
+struct GuestDiskStatusList *qmp_guest_get_disk_status(Error **errp)
+{
+    GuestDiskStatusList *head = NULL, **link = &head, *entry;
+    GuestDiskStatus *status;
+    MountInfo *info;
+    GACollectDisk *disk;
+    GPtrArray *disks;
+    GError *gerr = NULL;
+    guint i;
+
+    disks = ga_collect_disks(&gerr);
+    if (!disks) {
+        ga_collect_error(errp, gerr);
+        return NULL;
+    }
+
+    for (i = 0; i < disks->len; i++) {
+        disk = g_ptr_array_index(disks, i);
+
+        info = g_new0(MountInfo, 1);
+        info->total = ga_collect_size_human(disk->total);
+        info->used = ga_collect_size_human(disk->used);
+        info->writable = disk->writable;
+        info->has_total_bytes = true;
+        info->total_bytes = disk->total;
+        info->has_used_bytes = true;
+        info->used_bytes = disk->used;
+        info->has_avail_bytes = true;
+        info->avail_bytes = disk->avail;
+        guest_fs_forecast(disk->mount, &info->has_fill_rate,
+                          &info->fill_rate, &info->has_time_to_full,
+                          &info->time_to_full);
+
+        status = g_new0(GuestDiskStatus, 1);
+        status->mount_place = g_strdup(disk->mount);
+        status->mount_info = info;
+
+        entry = g_new0(GuestDiskStatusList, 1);
+        entry->value = status;
+
+        *link = entry;
+        link = &entry->next;
+    }
+
+    g_ptr_array_free(disks, true);
+    return head;
+}
+/*########################################################################################################*/
+
+/*KernelLog*/
+/*########################################################################################################*/
+#define GUEST_KMSG_MAX_RECORDS 2048
+#define GUEST_KMSG_MAX_EVENT 256
+#define GUEST_KMSG_DEFAULT_LIMIT 256
+
+typedef struct GuestKmsgRecord {
+    int64_t seq;
+    int64_t time;               /* ns since the Epoch */
+    int level;
+    int facility;
+    char *message;
+} GuestKmsgRecord;
+
+/*
+ * /dev/kmsg is opened the first time it is needed and then read from the
+ * main loop as records come in, so that nothing the kernel overwrites in
+ * between calls is missed.  Records up to LOG_INFO are kept in a ring;
+ * the OOM kill detection looks at every record as it goes by.  The
+ * kernel's own sequence numbers are the cursors.
+ */
+static struct {
+    int fd;
+    guint watch;                /* ga_io_add_watch() of @fd */
+    int64_t next_seq;           /* of the next record the kernel writes */
+    int64_t lost_below;         /* records before this one may be missing */
+    GuestKmsgRecord ring[GUEST_KMSG_MAX_RECORDS];
+    unsigned int head;          /* the oldest record */
+    unsigned int count;
+    bool events;
+    int event_level;
+    GRegex *event_pattern;
+} guest_kmsg_state = { .fd = -1 };
+
+static GuestKernelLogRecord *guest_kmsg_to_qapi(const GuestKmsgRecord *rec)
+{
+    GuestKernelLogRecord *r = g_new0(GuestKernelLogRecord, 1);
+
+    r->seq = rec->seq;
+    r->level = rec->level;
+    r->facility = rec->facility;
+    r->time = rec->time;
+    r->message = g_strdup(rec->message);
+    return r;
+}
+
+/* GuestKernelLogLevel follows the syslog priorities, LOG_EMERG first */
+static bool guest_kmsg_match(const GuestKmsgRecord *rec, int level,
+                             int facility, GRegex *pattern)
+{
+    return rec->level <= level &&
+           (facility < 0 || rec->facility == facility) &&
+           (!pattern || g_regex_match(pattern, rec->message, 0, NULL));
+}
+
+static void guest_kmsg_read(void)
+{
+    char buf[8192], *msg, *end;
+    struct timespec rt, mono;
+    unsigned long long usec;
+    unsigned int prio;
+    int64_t seq, boot_ns;
+    GuestKmsgRecord *rec;
+    GuestKernelLogRecordList *events = NULL, **link = &events, *entry;
+    int nevents = 0;
+    ssize_t len;
+
+    if (guest_kmsg_state.fd == -1) {
+        return;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &rt);
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    boot_ns = (rt.tv_sec - mono.tv_sec) * 1000000000LL +
+              (rt.tv_nsec - mono.tv_nsec);
+
+    /* each read returns one record: "prio,seq,usec,flags;message\n" */
+    for (;;) {
+        len = read(guest_kmsg_state.fd, buf, sizeof(buf) - 1);
+        if (len < 0) {
+            if (errno == EPIPE || errno == EINTR) {
+                /* records were overwritten, the gap in seq tells */
+                continue;
+            }
+            break;
+        }
+        if (len == 0) {
+            break;
+        }
+        buf[len] = '\0';
+
+        msg = strchr(buf, ';');
+        if (!msg || sscanf(buf, "%u,%" SCNd64 ",%llu", &prio, &seq,
+                           &usec) != 3) {
+            continue;
+        }
+        msg++;
+        /* dictionary lines (" SUBSYSTEM=...") follow the message */
+        end = strchr(msg, '\n');
+        if (end) {
+            *end = '\0';
+        }
+
+        if (seq > guest_kmsg_state.next_seq) {
+            guest_kmsg_state.lost_below = seq;
+        }
+        guest_kmsg_state.next_seq = seq + 1;
+
+        if (LOG_FAC(prio) == 0) {
+            ga_collect_oom_record(msg, boot_ns + usec * 1000LL);
+        }
+        if (LOG_PRI(prio) > LOG_INFO) {
+            continue;
+        }
+
+        if (guest_kmsg_state.count == GUEST_KMSG_MAX_RECORDS) {
+            rec = &guest_kmsg_state.ring[guest_kmsg_state.head];
+            guest_kmsg_state.lost_below = rec->seq + 1;
+            g_free(rec->message);
+            guest_kmsg_state.head = (guest_kmsg_state.head + 1) %
+                                    GUEST_KMSG_MAX_RECORDS;
+            guest_kmsg_state.count--;
+        }
+        rec = &guest_kmsg_state.ring[(guest_kmsg_state.head +
+                                      guest_kmsg_state.count) %
+                                     GUEST_KMSG_MAX_RECORDS];
+        guest_kmsg_state.count++;
+        rec->seq = seq;
+        rec->time = boot_ns + usec * 1000LL;
+        rec->level = LOG_PRI(prio);
+        rec->facility = LOG_FAC(prio);
+        rec->message = g_strdup(msg);
+
+        if (guest_kmsg_state.events && nevents < GUEST_KMSG_MAX_EVENT &&
+            guest_kmsg_match(rec, guest_kmsg_state.event_level, -1,
+                             guest_kmsg_state.event_pattern)) {
+            entry = g_new0(GuestKernelLogRecordList, 1);
+            entry->value = guest_kmsg_to_qapi(rec);
+            *link = entry;
+            link = &entry->next;
+            nevents++;
+        }
+    }
+
+    if (events) {
+        qapi_event_send_guest_kernel_log(events, &error_abort);
+        qapi_free_GuestKernelLogRecordList(events);
+    }
+}
+
+static gboolean guest_kmsg_readable(GIOChannel *channel,
+                                    GIOCondition condition, gpointer opaque)
+{
+    guest_kmsg_read();
+    return true;
+}
+
+static bool guest_kmsg_open(Error **errp)
+{
+    GIOChannel *channel;
+
+    if (guest_kmsg_state.fd != -1) {
+        return true;
+    }
+    guest_kmsg_state.fd = open("/dev/kmsg", O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (guest_kmsg_state.fd == -1) {
+        error_setg_errno(errp, errno, "failed to open /dev/kmsg");
+        return false;
+    }
+#ifdef SEEK_DATA
+    /* skip what was cleared with "dmesg -c" */
+    lseek(guest_kmsg_state.fd, 0, SEEK_DATA);
+#endif
+    channel = g_io_channel_unix_new(guest_kmsg_state.fd);
+    guest_kmsg_state.watch = ga_io_add_watch(channel, G_IO_IN,
+                                             guest_kmsg_readable, NULL);
+    g_io_channel_unref(channel);
+
+    guest_kmsg_read();
+    return true;
+}
+
+static void guest_kmsg_cleanup(void)
+{
+    unsigned int i;
+
+    if (guest_kmsg_state.fd == -1) {
+        return;
+    }
+    ga_io_remove_watch(guest_kmsg_state.watch);
+    close(guest_kmsg_state.fd);
+    for (i = 0; i < guest_kmsg_state.count; i++) {
+        g_free(guest_kmsg_state.ring[(guest_kmsg_state.head + i) %
+                                     GUEST_KMSG_MAX_RECORDS].message);
+    }
+    if (guest_kmsg_state.event_pattern) {
+        g_regex_unref(guest_kmsg_state.event_pattern);
+    }
+    memset(&guest_kmsg_state, 0, sizeof(guest_kmsg_state));
+    guest_kmsg_state.fd = -1;
+}
+
+static GRegex *guest_kmsg_compile(const char *pattern, Error **errp)
+{
+    GError *gerr = NULL;
+    GRegex *re;
+
+    re = g_regex_new(pattern, G_REGEX_OPTIMIZE, 0, &gerr);
+    if (!re) {
+        error_setg(errp, "invalid pattern '%s': %s", pattern, gerr->message);
+        g_error_free(gerr);
+    }
+    return re;
+}
+
+GuestKernelLog *qmp_guest_get_kernel_log(bool has_cursor, int64_t cursor,
+                                         bool has_level,
+                                         GuestKernelLogLevel level,
+                                         bool has_facility, int64_t facility,
+                                         bool has_pattern, const char *pattern,
+                                         bool has_limit, int64_t limit,
+                                         Error **errp)
+{
+    GuestKernelLog *log = NULL;
+    GuestKernelLogRecordList **link, *entry;
+    GuestKmsgRecord *rec;
+    GRegex *re = NULL;
+    unsigned int i;
+
+    if (has_facility && facility < 0) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "facility",
+                   "a syslog facility");
+        return NULL;
+    }
+    if (has_limit && limit <= 0) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "limit",
+                   "a positive number");
+        return NULL;
+    }
+    if (!has_limit) {
+        limit = GUEST_KMSG_DEFAULT_LIMIT;
+    }
+    if (has_pattern) {
+        re = guest_kmsg_compile(pattern, errp);
+        if (!re) {
+            return NULL;
+        }
+    }
+    if (!guest_kmsg_open(errp)) {
+        goto out;
+    }
+    guest_kmsg_read();
+
+    /* a cursor from the future belongs to an earlier boot */
+    if (!has_cursor || cursor < 0 || cursor > guest_kmsg_state.next_seq) {
+        cursor = 0;
+    }
+
+    log = g_new0(GuestKernelLog, 1);
+    log->truncated = has_cursor && cursor < guest_kmsg_state.lost_below;
+    log->cursor = guest_kmsg_state.next_seq;
+    link = &log->records;
+    for (i = 0; i < guest_kmsg_state.count; i++) {
+        rec = &guest_kmsg_state.ring[(guest_kmsg_state.head + i) %
+                                     GUEST_KMSG_MAX_RECORDS];
+        if (rec->seq < cursor ||
+            !guest_kmsg_match(rec, has_level ? level : LOG_INFO,
+                              has_facility ? facility : -1, re)) {
+            continue;
+        }
+        entry = g_new0(GuestKernelLogRecordList, 1);
+        entry->value = guest_kmsg_to_qapi(rec);
+        *link = entry;
+        link = &entry->next;
+        if (--limit == 0) {
+            log->cursor = rec->seq + 1;
+            break;
+        }
+    }
+
+out:
+    if (re) {
+        g_regex_unref(re);
+    }
+    return log;
+}
+
+void qmp_guest_set_kernel_log_events(bool enable, bool has_level,
+                                     GuestKernelLogLevel level,
+                                     bool has_pattern, const char *pattern,
+                                     Error **errp)
+{
+    GRegex *re = NULL;
+
+    if (enable) {
+        if (has_pattern) {
+            re = guest_kmsg_compile(pattern, errp);
+            if (!re) {
+                return;
+            }
+        }
+        if (!guest_kmsg_open(errp)) {
+            if (re) {
+                g_regex_unref(re);
+            }
+            return;
+        }
+    }
+
+    if (guest_kmsg_state.event_pattern) {
+        g_regex_unref(guest_kmsg_state.event_pattern);
+    }
+    guest_kmsg_state.events = enable;
+    guest_kmsg_state.event_level = has_level ? level
+                                             : GUEST_KERNEL_LOG_LEVEL_WARNING;
+    guest_kmsg_state.event_pattern = re;
+}
+/*########################################################################################################*/
+
+/*OOMStatus*/
+/*########################################################################################################*/
+/*
+ * The kill counting and the syslog follower are shared with the other
+ * trees; kernel messages are fed to it by the /dev/kmsg reader above
+ * where that can be opened.
+ */
+static struct {
+    bool initialized;
+    bool kmsg;
+} guest_oom_state;
+
+static void guest_oom_cleanup(void)
+{
+    ga_collect_oom_cleanup();
+    guest_oom_state.initialized = false;
+}
+
+/* pick up the kills logged since the last scan */
+static void guest_oom_scan(Error **errp)
+{
+    GError *gerr = NULL;
+
+    if (!guest_oom_state.initialized) {
+        guest_oom_state.kmsg = guest_kmsg_open(NULL);
+        guest_oom_state.initialized = true;
+    }
+    if (guest_oom_state.kmsg) {
+        guest_kmsg_read();
+    } else if (!ga_collect_oom_scan_syslog(&gerr)) {
+        ga_collect_error(errp, gerr);
+    }
+}
+
+struct OOMStatus *qmp_guest_get_oom_status(bool has_cursor, int64_t cursor,
+                                           Error **errp)
+{
+    OOMStatus *status;
+    GuestOOMKillList *head = NULL, *entry;
+    GACollectOOMKill rec;
+    Error *local_err = NULL;
+    int64_t count, seq;
+
+    guest_oom_scan(&local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return NULL;
+    }
+    count = ga_collect_oom_count();
+
+    /* a cursor from the future belongs to an earlier agent instance */
+    if (!has_cursor || cursor < 0 || cursor > count) {
+        cursor = 0;
+    }
+
+    /* build the list newest first so that it ends up oldest first */
+    for (seq = count - 1; seq >= cursor && ga_collect_oom_kill(seq, &rec);
+         seq--) {
+        entry = g_new0(GuestOOMKillList, 1);
+        entry->value = g_new0(GuestOOMKill, 1);
+        entry->value->time = rec.time;
+        if (rec.pid != -1) {
+            entry->value->has_pid = true;
+            entry->value->pid = rec.pid;
+        }
+        if (rec.comm[0]) {
+            entry->value->has_comm = true;
+            entry->value->comm = g_strdup(rec.comm);
+        }
+        entry->next = head;
+        head = entry;
+    }
+
+    status = g_new0(OOMStatus, 1);
+    status->oom_happened = count > cursor;
+    status->has_count = true;
+    status->count = count - cursor;
+    status->has_cursor = true;
+    status->cursor = count;
+    status->has_kills = true;
+    status->kills = head;
+    return status;
+}
+/*########################################################################################################*/
+
+/*MetricsHistory*/
+/*########################################################################################################*/
+static bool guest_sample_cpu(GASample *sample)
+{
+    char buf[512];
+    uint64_t v[8] = { 0 };
+
+    if (ga_read_proc_file(AT_FDCWD, "/proc/stat", buf, sizeof(buf)) <= 0 ||
+        sscanf(buf, "cpu %" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64
+               " %" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64,
+               &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7]) < 4) {
+        return false;
+    }
+    sample->cpu_user = ga_collect_ticks_to_ms(v[0]);
+    sample->cpu_nice = ga_collect_ticks_to_ms(v[1]);
+    sample->cpu_system = ga_collect_ticks_to_ms(v[2]);
+    sample->cpu_idle = ga_collect_ticks_to_ms(v[3]);
+    sample->cpu_iowait = ga_collect_ticks_to_ms(v[4]);
+    sample->cpu_irq = ga_collect_ticks_to_ms(v[5]);
+    sample->cpu_softirq = ga_collect_ticks_to_ms(v[6]);
+    sample->cpu_steal = ga_collect_ticks_to_ms(v[7]);
+    return true;
+}
+
+static bool guest_sample_memory(GASample *sample)
+{
+    GuestMeminfo mi;
+    Error *local_err = NULL;
+    uint64_t *v = mi.value;
+
+    ga_read_meminfo(&mi, &local_err);
+    if (local_err) {
+        error_free(local_err);
+        return false;
+    }
+    sample->mem_total = v[MEMINFO_MEM_TOTAL];
+    sample->mem_free = v[MEMINFO_MEM_FREE];
+    if (MEMINFO_HAS(&mi, MEMINFO_MEM_AVAILABLE)) {
+        sample->mem_available = v[MEMINFO_MEM_AVAILABLE];
+    } else {
+        sample->mem_available = v[MEMINFO_MEM_FREE] + v[MEMINFO_BUFFERS] +
+                                v[MEMINFO_CACHED];
+    }
+    sample->swap_total = v[MEMINFO_SWAP_TOTAL];
+    sample->swap_free = v[MEMINFO_SWAP_FREE];
+    return true;
+}
+
+/* only count disks with a device behind them, see GuestMetricsDisk */
+static bool guest_sample_disk(GASample *sample)
+{
+    char buf[16384], name[64], path[128];
+    char *line, *nl;
+    uint64_t rd_ios, rd_sec, wr_ios, wr_sec;
+    unsigned int major, minor;
+
+    if (ga_read_proc_file(AT_FDCWD, "/proc/diskstats", buf,
+                          sizeof(buf)) <= 0) {
+        return false;
+    }
+    for (line = buf; line && *line; line = nl) {
+        nl = strchr(line, '\n');
+        if (nl) {
+            *nl++ = '\0';
+        }
+        /* major minor name rd_ios rd_merges rd_sectors rd_ticks wr_ios ... */
+        if (sscanf(line, "%u %u %63s %" SCNu64 " %*u %" SCNu64 " %*u %"
+                   SCNu64 " %*u %" SCNu64, &major, &minor, name, &rd_ios,
+                   &rd_sec, &wr_ios, &wr_sec) != 7) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "/sys/block/%s/device", name);
+        if (access(path, F_OK) < 0) {
+            continue;
+        }
+        sample->disk_read_ios += rd_ios;
+        sample->disk_read_bytes += rd_sec * 512;
+        sample->disk_write_ios += wr_ios;
+        sample->disk_write_bytes += wr_sec * 512;
+    }
+    return true;
+}
+
+static bool guest_sample_net(GASample *sample)
+{
+    char buf[16384];
+    char *line, *nl, *colon;
+    uint64_t rx_bytes, rx_packets, tx_bytes, tx_packets;
+
+    if (ga_read_proc_file(AT_FDCWD, "/proc/net/dev", buf,
+                          sizeof(buf)) <= 0) {
+        return false;
+    }
+    for (line = buf; line && *line; line = nl) {
+        nl = strchr(line, '\n');
+        if (nl) {
+            *nl++ = '\0';
+        }
+        colon = strchr(line, ':');
+        if (!colon) {
+            continue;               /* the two header lines */
+        }
+        *colon = '\0';
+        if (!strcmp(g_strstrip(line), "lo")) {
+            continue;
+        }
+        /* rx: bytes packets errs drop fifo frame compressed multicast */
+        if (sscanf(colon + 1, "%" SCNu64 " %" SCNu64
+                   " %*u %*u %*u %*u %*u %*u %" SCNu64 " %" SCNu64,
+                   &rx_bytes, &rx_packets, &tx_bytes, &tx_packets) != 4) {
+            continue;
+        }
+        sample->net_rx_bytes += rx_bytes;
+        sample->net_rx_packets += rx_packets;
+        sample->net_tx_bytes += tx_bytes;
+        sample->net_tx_packets += tx_packets;
+    }
+    return true;
+}
+
+void ga_sample_collect(GASample *sample, uint32_t groups)
+{
+    if ((groups & GA_SAMPLE_CPU) && guest_sample_cpu(sample)) {
+        sample->present |= GA_SAMPLE_CPU;
+    }
+    if ((groups & GA_SAMPLE_MEMORY) && guest_sample_memory(sample)) {
+        sample->present |= GA_SAMPLE_MEMORY;
+    }
+    if ((groups & GA_SAMPLE_DISK) && guest_sample_disk(sample)) {
+        sample->present |= GA_SAMPLE_DISK;
+    }
+    if ((groups & GA_SAMPLE_NET) && guest_sample_net(sample)) {
+        sample->present |= GA_SAMPLE_NET;
+    }
+}
+
+typedef struct GuestMetricsBuild {
+    GuestMetricsSampleList **tail;
+    GArray *compact;            /* GASamples for the compact format */
+    int64_t count;
+} GuestMetricsBuild;
+
+/* the columns of GUEST_METRICS_FORMAT_COMPACT, in the documented order */
+#define GUEST_METRICS_COLUMN(field) \
+    { offsetof(GASample, field), sizeof(((GASample *)0)->field) }
+static const struct {
+    size_t offset, size;
+} guest_metrics_columns[] = {
+    GUEST_METRICS_COLUMN(seq),
+    GUEST_METRICS_COLUMN(time),
+    GUEST_METRICS_COLUMN(present),
+    GUEST_METRICS_COLUMN(cpu_user),
+    GUEST_METRICS_COLUMN(cpu_nice),
+    GUEST_METRICS_COLUMN(cpu_system),
+    GUEST_METRICS_COLUMN(cpu_idle),
+    GUEST_METRICS_COLUMN(cpu_iowait),
+    GUEST_METRICS_COLUMN(cpu_irq),
+    GUEST_METRICS_COLUMN(cpu_softirq),
+    GUEST_METRICS_COLUMN(cpu_steal),
+    GUEST_METRICS_COLUMN(mem_total),
+    GUEST_METRICS_COLUMN(mem_free),
+    GUEST_METRICS_COLUMN(mem_available),
+    GUEST_METRICS_COLUMN(swap_total),
+    GUEST_METRICS_COLUMN(swap_free),
+    GUEST_METRICS_COLUMN(disk_read_ios),
+    GUEST_METRICS_COLUMN(disk_read_bytes),
+    GUEST_METRICS_COLUMN(disk_write_ios),
+    GUEST_METRICS_COLUMN(disk_write_bytes),
+    GUEST_METRICS_COLUMN(net_rx_bytes),
+    GUEST_METRICS_COLUMN(net_rx_packets),
+    GUEST_METRICS_COLUMN(net_tx_bytes),
+    GUEST_METRICS_COLUMN(net_tx_packets),
+};
+#define GUEST_METRICS_COMPACT_VERSION 1
+
+static void guest_metrics_put_varint(GByteArray *buf, uint64_t val)
+{
+    uint8_t byte;
+
+    do {
+        byte = val & 0x7f;
+        val >>= 7;
+        if (val) {
+            byte |= 0x80;
+        }
+        g_byte_array_append(buf, &byte, 1);
+    } while (val);
+}
+
+static uint64_t guest_metrics_column_value(const GASample *sample, int col)
+{
+    const char *p = (const char *)sample + guest_metrics_columns[col].offset;
+    uint32_t v32;
+    uint64_t v64;
+
+    if (guest_metrics_columns[col].size == sizeof(v32)) {
+        memcpy(&v32, p, sizeof(v32));
+        return v32;
+    }
+    memcpy(&v64, p, sizeof(v64));
+    return v64;
+}
+
+/* encode @samples as described for GUEST_METRICS_FORMAT_COMPACT */
+static char *guest_metrics_encode(GArray *samples)
+{
+    GByteArray *buf = g_byte_array_new();
+    uint64_t prev, val, delta;
+    char *b64;
+    int col;
+    guint i;
+
+    guest_metrics_put_varint(buf, GUEST_METRICS_COMPACT_VERSION);
+    guest_metrics_put_varint(buf, samples->len);
+    guest_metrics_put_varint(buf, ARRAY_SIZE(guest_metrics_columns));
+    for (col = 0; col < ARRAY_SIZE(guest_metrics_columns); col++) {
+        prev = 0;
+        for (i = 0; i < samples->len; i++) {
+            val = guest_metrics_column_value(&g_array_index(samples, GASample,
+                                                            i), col);
+            delta = val - prev;
+            /* zigzag: small negative deltas stay short, too */
+            guest_metrics_put_varint(buf, (delta << 1) ^
+                                     -(uint64_t)(delta >> 63));
+            prev = val;
+        }
+    }
+
+    b64 = qemu_base64_encode(buf->data, buf->len);
+    g_byte_array_free(buf, true);
+    return b64;
+}
+
+static void guest_metrics_add_sample(const GASample *sample, void *opaque)
+{
+    GuestMetricsBuild *b = opaque;
+    GuestMetricsSampleList *entry;
+    GuestMetricsSample *m;
+
+    b->count++;
+    if (b->compact) {
+        g_array_append_val(b->compact, *sample);
+        return;
+    }
+
+    entry = g_new0(GuestMetricsSampleList, 1);
+    m = g_new0(GuestMetricsSample, 1);
+
+    m->seq = sample->seq;
+    m->time = sample->time;
+    if (sample->present & GA_SAMPLE_CPU) {
+        m->has_cpu = true;
+        m->cpu = g_new0(GuestMetricsCPU, 1);
+        m->cpu->user = sample->cpu_user;
+        m->cpu->nice = sample->cpu_nice;
+        m->cpu->system = sample->cpu_system;
+        m->cpu->idle = sample->cpu_idle;
+        m->cpu->iowait = sample->cpu_iowait;
+        m->cpu->irq = sample->cpu_irq;
+        m->cpu->softirq = sample->cpu_softirq;
+        m->cpu->steal = sample->cpu_steal;
+    }
+    if (sample->present & GA_SAMPLE_MEMORY) {
+        m->has_memory = true;
+        m->memory = g_new0(GuestMetricsMemory, 1);
+        m->memory->total = sample->mem_total;
+        m->memory->free = sample->mem_free;
+        m->memory->available = sample->mem_available;
+        m->memory->swap_total = sample->swap_total;
+        m->memory->swap_free = sample->swap_free;
+    }
+    if (sample->present & GA_SAMPLE_DISK) {
+        m->has_disk = true;
+        m->disk = g_new0(GuestMetricsDisk, 1);
+        m->disk->read_ios = sample->disk_read_ios;
+        m->disk->read_bytes = sample->disk_read_bytes;
+        m->disk->write_ios = sample->disk_write_ios;
+        m->disk->write_bytes = sample->disk_write_bytes;
+    }
+    if (sample->present & GA_SAMPLE_NET) {
+        m->has_net = true;
+        m->net = g_new0(GuestMetricsNet, 1);
+        m->net->rx_bytes = sample->net_rx_bytes;
+        m->net->rx_packets = sample->net_rx_packets;
+        m->net->tx_bytes = sample->net_tx_bytes;
+        m->net->tx_packets = sample->net_tx_packets;
+    }
+
+    entry->value = m;
+    *b->tail = entry;
+    b->tail = &entry->next;
+}
+
+GuestMetricsHistory *qmp_guest_get_metrics_history(bool has_cursor,
+                                                   int64_t cursor,
+                                                   bool has_format,
+                                                   GuestMetricsFormat format,
+                                                   Error **errp)
+{
+    GASampler *sampler;
+    GuestMetricsHistory *history;
+    GuestMetricsSampleList *head = NULL;
+    GuestMetricsBuild b = { .tail = &head };
+    uint64_t lost;
+
+    rcu_read_lock();
+    sampler = ga_get_sampler(ga_state);
+    if (!sampler) {
+        rcu_read_unlock();
+        error_setg(errp, "metrics sampling is disabled, see the "
+                   "metrics-interval option");
+        return NULL;
+    }
+    if (!has_cursor || cursor < 0) {
+        cursor = 0;
+    }
+
+    if (has_format && format == GUEST_METRICS_FORMAT_COMPACT) {
+        b.compact = g_array_new(false, false, sizeof(GASample));
+    }
+
+    history = g_new0(GuestMetricsHistory, 1);
+    history->cursor = ga_sampler_foreach(sampler, cursor, &lost,
+                                         guest_metrics_add_sample, &b);
+    history->interval = ga_sampler_get_interval(sampler);
+    rcu_read_unlock();
+    history->lost = lost;
+    history->count = b.count;
+    if (b.compact) {
+        history->has_buf_b64 = true;
+        history->buf_b64 = guest_metrics_encode(b.compact);
+        g_array_free(b.compact, true);
+    } else {
+        history->has_samples = true;
+        history->samples = head;
+    }
+    return history;
+}
+
+/* the columns of GuestMetricsRollup, in the order of GARollupBucket */
+static const char *const guest_metrics_rollup_columns[GA_ROLLUP_NCOLUMNS] = {
+    "cpu-user", "cpu-nice", "cpu-system", "cpu-idle", "cpu-iowait",
+    "cpu-irq", "cpu-softirq", "cpu-steal",
+    "memory-total", "memory-free", "memory-available", "memory-swap-total",
+    "memory-swap-free",
+    "disk-read-ios", "disk-read-bytes", "disk-write-ios", "disk-write-bytes",
+    "net-rx-bytes", "net-rx-packets", "net-tx-bytes", "net-tx-packets",
+};
+
+static numberList *guest_metrics_number_list(const double *values)
+{
+    numberList *head = NULL, *entry;
+    int col;
+
+    for (col = GA_ROLLUP_NCOLUMNS - 1; col >= 0; col--) {
+        entry = g_new0(numberList, 1);
+        entry->value = values[col];
+        entry->next = head;
+        head = entry;
+    }
+    return head;
+}
+
+static void guest_metrics_add_bucket(const GARollupBucket *b, void *opaque)
+{
+    GuestMetricsBucketList ***tail = opaque;
+    GuestMetricsBucketList *entry = g_new0(GuestMetricsBucketList, 1);
+    GuestMetricsBucket *m = g_new0(GuestMetricsBucket, 1);
+    double avg[GA_ROLLUP_NCOLUMNS];
+    int col;
+
+    for (col = 0; col < GA_ROLLUP_NCOLUMNS; col++) {
+        avg[col] = ga_rollup_bucket_avg(b, col);
+    }
+
+    m->time = b->start;
+    m->samples = b->samples;
+    m->present = b->present;
+    m->min = guest_metrics_number_list(b->min);
+    m->max = guest_metrics_number_list(b->max);
+    m->avg = guest_metrics_number_list(avg);
+    m->last = guest_metrics_number_list(b->last);
+
+    entry->value = m;
+    **tail = entry;
+    *tail = &entry->next;
+}
+
+GuestMetricsRollup *
+qmp_guest_get_metrics_rollup(GuestMetricsResolution resolution, bool has_start,
+                             int64_t start, bool has_end, int64_t end,
+                             Error **errp)
+{
+    GASampler *sampler;
+    GuestMetricsRollup *rollup;
+    GuestMetricsBucketList **tail;
+    strList **name;
+    bool kept;
+    int col;
+
+    rcu_read_lock();
+    sampler = ga_get_sampler(ga_state);
+    if (!sampler) {
+        rcu_read_unlock();
+        error_setg(errp, "metrics sampling is disabled, see the "
+                   "metrics-interval option");
+        return NULL;
+    }
+
+    rollup = g_new0(GuestMetricsRollup, 1);
+    tail = &rollup->buckets;
+    kept = ga_sampler_foreach_rollup(sampler, resolution,
+                                     has_start ? start : INT64_MIN,
+                                     has_end ? end : INT64_MAX,
+                                     guest_metrics_add_bucket, &tail);
+    rcu_read_unlock();
+    if (!kept) {
+        error_setg(errp, "no rollups of resolution '%s' are kept, see the "
+                   "rollup options of the sampler",
+                   GuestMetricsResolution_lookup[resolution]);
+        qapi_free_GuestMetricsRollup(rollup);
+        return NULL;
+    }
+    rollup->resolution = ga_sampler_get_rollup_resolution(resolution);
+    name = &rollup->columns;
+    for (col = 0; col < GA_ROLLUP_NCOLUMNS; col++) {
+        *name = g_new0(strList, 1);
+        (*name)->value = g_strdup(guest_metrics_rollup_columns[col]);
+        name = &(*name)->next;
+    }
+    return rollup;
+}
+/*########################################################################################################*/
+
+/*CpuStats*/
+/*########################################################################################################*/
+/* the time columns of a /proc/stat cpu line, in order */
+enum {
+    CPUSTAT_USER, CPUSTAT_NICE, CPUSTAT_SYSTEM, CPUSTAT_IDLE,
+    CPUSTAT_IOWAIT, CPUSTAT_IRQ, CPUSTAT_SOFTIRQ, CPUSTAT_STEAL,
+    CPUSTAT_MAX
+};
+
+typedef struct GuestCpuTicks {
+    bool valid;
+    uint64_t t[CPUSTAT_MAX];
+} GuestCpuTicks;
+
+/* big enough for the cpu lines of a few hundred CPUs */
+#define GUEST_CPUSTAT_BUF_SIZE (64 * 1024)
+
+/*
+ * What the previous guest-get-cpu-stats call saw, so that utilization can
+ * be reported for the time in between.  @cpus is indexed by CPU number,
+ * @cgroups maps a cgroup path to its CPU usage in ns.
+ */
+static struct {
+    char *buf;
+    int64_t time;               /* g_get_monotonic_time() */
+    GuestCpuTicks total;
+    GuestCpuTicks *cpus;
+    int ncpus;
+    GHashTable *cgroups;
+} guest_cpustat_state;
+
+/* what each time column took of the time between @prev and @cur */
+static GuestCpuUsage *guest_cpustat_usage(const GuestCpuTicks *prev,
+                                          const GuestCpuTicks *cur)
+{
+    GuestCpuUsage *usage = g_new0(GuestCpuUsage, 1);
+    double d[CPUSTAT_MAX], total = 0;
+    uint64_t before;
+    int i;
+
+    for (i = 0; i < CPUSTAT_MAX; i++) {
+        before = prev->valid ? prev->t[i] : 0;
+        /* counters can go backwards after a CPU was offline */
+        d[i] = cur->t[i] > before ? cur->t[i] - before : 0;
+        total += d[i];
+    }
+    if (total > 0) {
+        for (i = 0; i < CPUSTAT_MAX; i++) {
+            d[i] = d[i] * 100 / total;
+        }
+    }
+
+    usage->user = d[CPUSTAT_USER];
+    usage->nice = d[CPUSTAT_NICE];
+    usage->system = d[CPUSTAT_SYSTEM];
+    usage->idle = d[CPUSTAT_IDLE];
+    usage->iowait = d[CPUSTAT_IOWAIT];
+    usage->irq = d[CPUSTAT_IRQ];
+    usage->softirq = d[CPUSTAT_SOFTIRQ];
+    usage->steal = d[CPUSTAT_STEAL];
+    return usage;
+}
+
+/* parse the "cpu" and "cpuN" lines of /proc/stat into the state */
+static GuestCpuUsageList *guest_cpustat_parse(char *buf,
+                                              GuestCpuUsage **total)
+{
+    GuestCpuUsageList *head = NULL, **tail = &head, *entry;
+    GuestCpuTicks cur, *prev;
+    char *line, *nl, *p;
+    long cpu;
+    int i;
+
+    for (line = buf; line && g_str_has_prefix(line, "cpu"); line = nl) {
+        nl = strchr(line, '\n');
+        if (nl) {
+            *nl++ = '\0';
+        }
+        p = line + strlen("cpu");
+        if (*p == ' ') {
+            cpu = -1;
+        } else {
+            cpu = strtol(p, &p, 10);
+            if (cpu < 0 || cpu > INT_MAX / 2) {
+                continue;
+            }
+        }
+
+        /* old kernels have fewer columns */
+        memset(&cur, 0, sizeof(cur));
+        cur.valid = true;
+        for (i = 0; i < CPUSTAT_MAX && *p; i++) {
+            cur.t[i] = strtoull(p, &p, 10);
+        }
+
+        if (cpu == -1) {
+            *total = guest_cpustat_usage(&guest_cpustat_state.total, &cur);
+            guest_cpustat_state.total = cur;
+            continue;
+        }
+
+        if (cpu >= guest_cpustat_state.ncpus) {
+            guest_cpustat_state.cpus = g_renew(GuestCpuTicks,
+                                               guest_cpustat_state.cpus,
+                                               cpu + 1);
+            memset(guest_cpustat_state.cpus + guest_cpustat_state.ncpus, 0,
+                   (cpu + 1 - guest_cpustat_state.ncpus) *
+                   sizeof(GuestCpuTicks));
+            guest_cpustat_state.ncpus = cpu + 1;
+        }
+        prev = &guest_cpustat_state.cpus[cpu];
+
+        entry = g_new0(GuestCpuUsageList, 1);
+        entry->value = guest_cpustat_usage(prev, &cur);
+        entry->value->has_cpu = true;
+        entry->value->cpu = cpu;
+        *tail = entry;
+        tail = &entry->next;
+        *prev = cur;
+    }
+
+    return head;
+}
+
+/*
+ * CPU time used by the cgroup in @dirfd, in ns, and its user and system
+ * time in ms if the cgroup tells.  cgroup v2 has all of it in cpu.stat,
+ * v1 splits it into cpuacct.usage and cpuacct.stat.
+ */
+static bool guest_cgroup_cpu_read(int dirfd, bool unified, uint64_t *usage,
+                                  bool *has_split, uint64_t *user,
+                                  uint64_t *sys)
+{
+    char buf[1024], *p;
+
+    *has_split = false;
+    if (unified) {
+        if (ga_read_proc_file(dirfd, "cpu.stat", buf, sizeof(buf)) <= 0 ||
+            !(p = strstr(buf, "usage_usec "))) {
+            return false;
+        }
+        *usage = strtoull(p + strlen("usage_usec "), NULL, 10) * 1000;
+        if ((p = strstr(buf, "user_usec "))) {
+            *user = strtoull(p + strlen("user_usec "), NULL, 10) / 1000;
+            *has_split = true;
+        }
+        if ((p = strstr(buf, "system_usec "))) {
+            *sys = strtoull(p + strlen("system_usec "), NULL, 10) / 1000;
+        }
+        return true;
+    }
+
+    if (ga_read_proc_file(dirfd, "cpuacct.usage", buf, sizeof(buf)) <= 0) {
+        return false;
+    }
+    *usage = strtoull(buf, NULL, 10);
+    if (ga_read_proc_file(dirfd, "cpuacct.stat", buf, sizeof(buf)) > 0 &&
+        sscanf(buf, "user %" SCNu64 " system %" SCNu64, user, sys) == 2) {
+        *user = ga_collect_ticks_to_ms(*user);
+        *sys = ga_collect_ticks_to_ms(*sys);
+        *has_split = true;
+    }
+    return true;
+}
+
+static void guest_cgroup_cpu_add(GuestCgroupCpuUsageList ***tail,
+                                 GHashTable *seen, int parentfd,
+                                 const char *name, const char *path,
+                                 bool unified, int64_t elapsed_us)
+{
+    GuestCgroupCpuUsageList *entry;
+    GuestCgroupCpuUsage *cg;
+    uint64_t usage, user = 0, sys = 0;
+    gpointer prev;
+    bool has_split;
+    int fd;
+
+    fd = openat(parentfd, name, O_RDONLY | O_DIRECTORY);
+    if (fd == -1) {
+        return;
+    }
+    if (!guest_cgroup_cpu_read(fd, unified, &usage, &has_split, &user,
+                               &sys)) {
+        close(fd);
+        return;
+    }
+    close(fd);
+
+    cg = g_new0(GuestCgroupCpuUsage, 1);
+    cg->path = g_strdup(path);
+    cg->usage_ms = usage / 1000000;
+    cg->has_user_ms = cg->has_system_ms = has_split;
+    cg->user_ms = user;
+    cg->system_ms = sys;
+    prev = g_hash_table_lookup(guest_cpustat_state.cgroups, path);
+    if (prev && elapsed_us > 0 && usage >= *(uint64_t *)prev) {
+        /* in percent of one CPU, like top(1) */
+        cg->has_usage = true;
+        cg->usage = (usage - *(uint64_t *)prev) / 10.0 / elapsed_us;
+    }
+    g_hash_table_insert(seen, g_strdup(path), g_memdup(&usage,
+                                                       sizeof(usage)));
+
+    entry = g_new0(GuestCgroupCpuUsageList, 1);
+    entry->value = cg;
+    **tail = entry;
+    *tail = &entry->next;
+}
+
+static bool guest_cgroup_is_unit(const char *name)
+{
+    return g_str_has_suffix(name, ".slice") ||
+           g_str_has_suffix(name, ".service") ||
+           g_str_has_suffix(name, ".scope");
+}
+
+/* the top-level systemd slices and the units right below them */
+static GuestCgroupCpuUsageList *guest_cgroup_cpu_list(int64_t elapsed_us)
+{
+    GuestCgroupCpuUsageList *head = NULL, **tail = &head;
+    GHashTable *seen;
+    const char *root = "/sys/fs/cgroup";
+    struct dirent *de, *child;
+    DIR *dir, *sub;
+    bool unified;
+    char *path;
+    int subfd;
+
+    unified = access("/sys/fs/cgroup/cgroup.controllers", F_OK) == 0;
+    if (!unified) {
+        root = "/sys/fs/cgroup/cpuacct";
+    }
+    dir = opendir(root);
+    if (!dir) {
+        return NULL;
+    }
+
+    seen = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    while ((de = readdir(dir))) {
+        if (!g_str_has_suffix(de->d_name, ".slice")) {
+            continue;
+        }
+        path = g_strdup_printf("/%s", de->d_name);
+        guest_cgroup_cpu_add(&tail, seen, dirfd(dir), de->d_name, path,
+                             unified, elapsed_us);
+        g_free(path);
+
+        subfd = openat(dirfd(dir), de->d_name, O_RDONLY | O_DIRECTORY);
+        sub = subfd == -1 ? NULL : fdopendir(subfd);
+        if (!sub) {
+            if (subfd != -1) {
+                close(subfd);
+            }
+            continue;
+        }
+        while ((child = readdir(sub))) {
+            if (!guest_cgroup_is_unit(child->d_name)) {
+                continue;
+            }
+            path = g_strdup_printf("/%s/%s", de->d_name, child->d_name);
+            guest_cgroup_cpu_add(&tail, seen, dirfd(sub), child->d_name,
+                                 path, unified, elapsed_us);
+            g_free(path);
+        }
+        closedir(sub);
+    }
+    closedir(dir);
+
+    /* forget cgroups that went away */
+    g_hash_table_unref(guest_cpustat_state.cgroups);
+    guest_cpustat_state.cgroups = seen;
+    return head;
+}
+
+GuestCpuStats *qmp_guest_get_cpu_stats(bool has_cgroups, bool cgroups,
+                                       Error **errp)
+{
+    GuestCpuStats *stats;
+    int64_t now, elapsed_us = 0;
+    ssize_t len;
+
+    if (!guest_cpustat_state.buf) {
+        guest_cpustat_state.buf = g_malloc(GUEST_CPUSTAT_BUF_SIZE);
+        guest_cpustat_state.cgroups =
+            g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    }
+
+    /* the cpu lines come first, so the rest may well be cut off */
+    len = ga_read_proc_file(AT_FDCWD, "/proc/stat", guest_cpustat_state.buf,
+                            GUEST_CPUSTAT_BUF_SIZE);
+    if (len <= 0) {
+        error_setg_errno(errp, len ? errno : EIO,
+                         "failed to read /proc/stat");
+        return NULL;
+    }
+    now = g_get_monotonic_time();
+
+    stats = g_new0(GuestCpuStats, 1);
+    if (guest_cpustat_state.time) {
+        elapsed_us = now - guest_cpustat_state.time;
+        stats->has_interval = true;
+        stats->interval = elapsed_us / 1000;
+    }
+    guest_cpustat_state.time = now;
+
+    stats->cpus = guest_cpustat_parse(guest_cpustat_state.buf, &stats->total);
+    if (!stats->total) {
+        qapi_free_GuestCpuStats(stats);
+        error_setg(errp, "unexpected contents of /proc/stat");
+        return NULL;
+    }
+
+    if (has_cgroups && cgroups) {
+        stats->has_cgroups = true;
+        stats->cgroups = guest_cgroup_cpu_list(elapsed_us);
+    }
+
+    return stats;
+}
+
+static void guest_cpustat_cleanup(void)
+{
+    g_free(guest_cpustat_state.buf);
+    g_free(guest_cpustat_state.cpus);
+    if (guest_cpustat_state.cgroups) {
+        g_hash_table_unref(guest_cpustat_state.cgroups);
+    }
+    memset(&guest_cpustat_state, 0, sizeof(guest_cpustat_state));
+}
+/*########################################################################################################*/
+
+/*DiskIOStats*/
+/*########################################################################################################*/
+/* the counters of a /proc/diskstats line that are reported, in order */
+enum {
+    DISKSTAT_RD_IOS, DISKSTAT_RD_SECTORS, DISKSTAT_RD_TICKS,
+    DISKSTAT_WR_IOS, DISKSTAT_WR_SECTORS, DISKSTAT_WR_TICKS,
+    DISKSTAT_IO_TICKS, DISKSTAT_MAX
+};
+
+/*
+ * What the previous guest-get-disk-io-stats call saw of a disk.  The disk
+ * addresses are looked up in sysfs once per device number, they do not
+ * change while the disk is there.
+ */
+typedef struct GuestDiskIOSnapshot {
+    unsigned int major, minor;
+    uint64_t v[DISKSTAT_MAX];
+    int64_t time;               /* g_get_monotonic_time() */
+    GuestDiskAddressList *disk;
+    unsigned int generation;
+} GuestDiskIOSnapshot;
+
+#define GUEST_DISKSTAT_BUF_SIZE (64 * 1024)
+
+static struct {
+    char *buf;
+    GHashTable *disks;          /* kernel name -> GuestDiskIOSnapshot */
+    unsigned int generation;
+} guest_diskstat_state;
+
+static void guest_diskstat_snapshot_free(gpointer p)
+{
+    GuestDiskIOSnapshot *snap = p;
+
+    qapi_free_GuestDiskAddressList(snap->disk);
+    g_free(snap);
+}
+
+/*
+ * Find the controller addresses behind a disk the way guest-get-fsinfo does,
+ * following the slaves of device-mapper and md devices.  Disks the guest
+ * agent cannot map to a QEMU device get an empty list.
+ */
+static GuestDiskAddressList *guest_diskstat_resolve(unsigned int major,
+                                                    unsigned int minor)
+{
+#if defined(CONFIG_FSFREEZE)
+    GuestFilesystemInfo fs = { 0 };
+    Error *local_err = NULL;
+
+    guest_fsinfo_for_devnum(major, minor, &fs, &local_err);
+    if (local_err) {
+        g_debug("no disk address for %u:%u: %s", major, minor,
+                error_get_pretty(local_err));
+        error_free(local_err);
+    }
+    g_free(fs.name);
+    return fs.disk;
+#else
+    return NULL;
+#endif
+}
+
+/* @cur minus @prev per second of @elapsed_us; counters may wrap */
+static double guest_counter_rate(uint64_t cur, uint64_t prev,
+                                 int64_t elapsed_us)
+{
+    return cur > prev ? (cur - prev) * 1e6 / elapsed_us : 0;
+}
+
+/* milliseconds spent per request completed between the two snapshots */
+static double guest_diskstat_await(uint64_t ticks, uint64_t prev_ticks,
+                                   uint64_t ios, uint64_t prev_ios)
+{
+    if (ios <= prev_ios || ticks <= prev_ticks) {
+        return 0;
+    }
+    return (double)(ticks - prev_ticks) / (ios - prev_ios);
+}
+
+static GuestDiskIOStats *guest_diskstat_entry(const char *name,
+                                              GuestDiskIOSnapshot *snap,
+                                              const uint64_t *v, int64_t now)
+{
+    GuestDiskIOStats *stats = g_new0(GuestDiskIOStats, 1);
+    int64_t elapsed_us = now - snap->time;
+
+    stats->name = g_strdup(name);
+    stats->disk = guest_disk_address_list_copy(snap->disk);
+    stats->read_ios = v[DISKSTAT_RD_IOS];
+    stats->read_bytes = v[DISKSTAT_RD_SECTORS] * 512;
+    stats->read_ms = v[DISKSTAT_RD_TICKS];
+    stats->write_ios = v[DISKSTAT_WR_IOS];
+    stats->write_bytes = v[DISKSTAT_WR_SECTORS] * 512;
+    stats->write_ms = v[DISKSTAT_WR_TICKS];
+    stats->io_ms = v[DISKSTAT_IO_TICKS];
+
+    if (snap->time && elapsed_us > 0) {
+        const uint64_t *p = snap->v;
+
+        stats->has_interval = true;
+        stats->interval = elapsed_us / 1000;
+        stats->has_read_iops = true;
+        stats->read_iops = guest_counter_rate(v[DISKSTAT_RD_IOS],
+                                              p[DISKSTAT_RD_IOS], elapsed_us);
+        stats->has_write_iops = true;
+        stats->write_iops = guest_counter_rate(v[DISKSTAT_WR_IOS],
+                                               p[DISKSTAT_WR_IOS],
+                                               elapsed_us);
+        stats->has_read_bps = true;
+        stats->read_bps = guest_counter_rate(v[DISKSTAT_RD_SECTORS],
+                                             p[DISKSTAT_RD_SECTORS],
+                                             elapsed_us) * 512;
+        stats->has_write_bps = true;
+        stats->write_bps = guest_counter_rate(v[DISKSTAT_WR_SECTORS],
+                                              p[DISKSTAT_WR_SECTORS],
+                                              elapsed_us) * 512;
+        stats->has_read_await = true;
+        stats->read_await = guest_diskstat_await(v[DISKSTAT_RD_TICKS],
+                                                 p[DISKSTAT_RD_TICKS],
+                                                 v[DISKSTAT_RD_IOS],
+                                                 p[DISKSTAT_RD_IOS]);
+        stats->has_write_await = true;
+        stats->write_await = guest_diskstat_await(v[DISKSTAT_WR_TICKS],
+                                                  p[DISKSTAT_WR_TICKS],
+                                                  v[DISKSTAT_WR_IOS],
+                                                  p[DISKSTAT_WR_IOS]);
+        /* io_ticks is the time in ms the disk had requests in flight */
+        stats->has_util = true;
+        stats->util = guest_counter_rate(v[DISKSTAT_IO_TICKS],
+                                         p[DISKSTAT_IO_TICKS],
+                                         elapsed_us) / 10;
+        if (stats->util > 100) {
+            stats->util = 100;
+        }
+    }
+
+    memcpy(snap->v, v, sizeof(snap->v));
+    snap->time = now;
+    return stats;
+}
+
+static gboolean guest_diskstat_expired(gpointer key, gpointer value,
+                                       gpointer opaque)
+{
+    GuestDiskIOSnapshot *snap = value;
+
+    return snap->generation != guest_diskstat_state.generation;
+}
+
+GuestDiskIOStatsList *qmp_guest_get_disk_io_stats(Error **errp)
+{
+    GuestDiskIOStatsList *head = NULL, **tail = &head;
+    char name[64], path[128];
+    char *line, *nl;
+    uint64_t v[DISKSTAT_MAX];
+    unsigned int major, minor;
+    int64_t now;
+
+    if (!guest_diskstat_state.buf) {
+        guest_diskstat_state.buf = g_malloc(GUEST_DISKSTAT_BUF_SIZE);
+        guest_diskstat_state.disks =
+            g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                  guest_diskstat_snapshot_free);
+    }
+
+    if (ga_read_proc_file(AT_FDCWD, "/proc/diskstats",
+                          guest_diskstat_state.buf,
+                          GUEST_DISKSTAT_BUF_SIZE) < 0) {
+        error_setg_errno(errp, errno, "failed to read /proc/diskstats");
+        return NULL;
+    }
+    now = g_get_monotonic_time();
+    guest_diskstat_state.generation++;
+
+    for (line = guest_diskstat_state.buf; line && *line; line = nl) {
+        GuestDiskIOSnapshot *snap;
+        GuestDiskIOStatsList *entry;
+
+        nl = strchr(line, '\n');
+        if (nl) {
+            *nl++ = '\0';
+        }
+        /*
+         * major minor name rd_ios rd_merges rd_sectors rd_ticks
+         * wr_ios wr_merges wr_sectors wr_ticks in_flight io_ticks ...
+         */
+        if (sscanf(line, "%u %u %63s %" SCNu64 " %*u %" SCNu64 " %" SCNu64
+                   " %" SCNu64 " %*u %" SCNu64 " %" SCNu64 " %*u %" SCNu64,
+                   &major, &minor, name,
+                   &v[DISKSTAT_RD_IOS], &v[DISKSTAT_RD_SECTORS],
+                   &v[DISKSTAT_RD_TICKS], &v[DISKSTAT_WR_IOS],
+                   &v[DISKSTAT_WR_SECTORS], &v[DISKSTAT_WR_TICKS],
+                   &v[DISKSTAT_IO_TICKS]) != 10) {
+            continue;
+        }
+        /* whole disks only, and not those that never did any I/O */
+        if (!v[DISKSTAT_RD_IOS] && !v[DISKSTAT_WR_IOS]) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/partition",
+                 major, minor);
+        if (access(path, F_OK) == 0) {
+            continue;
+        }
+
+        snap = g_hash_table_lookup(guest_diskstat_state.disks, name);
+        if (snap && (snap->major != major || snap->minor != minor)) {
+            /* a different disk that took over the name */
+            g_hash_table_remove(guest_diskstat_state.disks, name);
+            snap = NULL;
+        }
+        if (!snap) {
+            snap = g_new0(GuestDiskIOSnapshot, 1);
+            snap->major = major;
+            snap->minor = minor;
+            snap->disk = guest_diskstat_resolve(major, minor);
+            g_hash_table_insert(guest_diskstat_state.disks, g_strdup(name),
+                                snap);
+        }
+        snap->generation = guest_diskstat_state.generation;
+
+        entry = g_new0(GuestDiskIOStatsList, 1);
+        entry->value = guest_diskstat_entry(name, snap, v, now);
+        *tail = entry;
+        tail = &entry->next;
+    }
+
+    /* forget disks that went away */
+    g_hash_table_foreach_remove(guest_diskstat_state.disks,
+                                guest_diskstat_expired, NULL);
+    return head;
+}
+
+static void guest_diskstat_cleanup(void)
+{
+    g_free(guest_diskstat_state.buf);
+    if (guest_diskstat_state.disks) {
+        g_hash_table_destroy(guest_diskstat_state.disks);
+    }
+    memset(&guest_diskstat_state, 0, sizeof(guest_diskstat_state));
+}
+/*########################################################################################################*/
+
+/*CgroupStats*/
+/*########################################################################################################*/
+/* the controllers read, and their hierarchies with cgroup v1 */
+enum {
+    CGROUP_CPU, CGROUP_MEMORY, CGROUP_BLKIO, CGROUP_PIDS, CGROUP_MAX
+};
+
+static const char *const guest_cgroup_v1_dirs[CGROUP_MAX] = {
+    "cpuacct", "memory", "blkio", "pids"
+};
+
+#define GUEST_CGROUP_DEFAULT_DEPTH 3
+#define GUEST_CGROUP_MAX_DEPTH 8
+#define GUEST_CGROUP_MAX_COUNT 4096
+/* directories kept open, well below the usual limit of 1024 fds */
+#define GUEST_CGROUP_MAX_FDS 256
+#define GUEST_CGROUP_BUF_SIZE (16 * 1024)
+
+/* what the previous guest-get-cgroup-stats call saw of a cgroup */
+typedef struct GuestCgroupSnapshot {
+    int fd;                     /* the cgroup directory, or -1 */
+    uint64_t cpu;               /* ns */
+    uint64_t rbytes, wbytes;
+    int64_t time;               /* g_get_monotonic_time(), 0 if never */
+    unsigned int generation;
+} GuestCgroupSnapshot;
+
+/*
+ * The hierarchy roots stay open, and so do the directories of the first
+ * GUEST_CGROUP_MAX_FDS cgroups seen, so that a call mostly reads files
+ * relative to open directories.  With cgroup v1 the walk follows the
+ * cpuacct hierarchy, and a cgroup is looked up at the same path in the
+ * others, where systemd and the container runtimes create it too.
+ */
+static struct {
+    bool unified;
+    int root[CGROUP_MAX];       /* v2 only has root[CGROUP_CPU] */
+    char *buf;
+    GHashTable *cgroups;        /* path -> GuestCgroupSnapshot */
+    unsigned int generation;
+    int nfds;
+} guest_cgroup_state;
+
+static void guest_cgroup_snapshot_free(gpointer p)
+{
+    GuestCgroupSnapshot *snap = p;
+
+    if (snap->fd != -1) {
+        close(snap->fd);
+        guest_cgroup_state.nfds--;
+    }
+    g_free(snap);
+}
+
+static bool guest_cgroup_init(Error **errp)
+{
+    char *path;
+    int i;
+
+    if (guest_cgroup_state.cgroups) {
+        return true;
+    }
+
+    guest_cgroup_state.unified =
+        access("/sys/fs/cgroup/cgroup.controllers", F_OK) == 0;
+    for (i = 0; i < CGROUP_MAX; i++) {
+        guest_cgroup_state.root[i] = -1;
+        if (guest_cgroup_state.unified && i != CGROUP_CPU) {
+            continue;
+        }
+        path = guest_cgroup_state.unified ? g_strdup("/sys/fs/cgroup") :
+               g_strdup_printf("/sys/fs/cgroup/%s", guest_cgroup_v1_dirs[i]);
+        guest_cgroup_state.root[i] = open(path, O_RDONLY | O_DIRECTORY |
+                                                O_CLOEXEC);
+        g_free(path);
+    }
+    if (guest_cgroup_state.root[CGROUP_CPU] == -1) {
+        error_setg_errno(errp, errno, "failed to open the cgroup hierarchy");
+        for (i = 0; i < CGROUP_MAX; i++) {
+            if (guest_cgroup_state.root[i] != -1) {
+                close(guest_cgroup_state.root[i]);
+            }
+        }
+        return false;
+    }
+
+    guest_cgroup_state.buf = g_malloc(GUEST_CGROUP_BUF_SIZE);
+    guest_cgroup_state.cgroups =
+        g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                              guest_cgroup_snapshot_free);
+    return true;
+}
+
+/* the value of @key in a flat keyed file such as memory.stat */
+static bool guest_cgroup_keyed(const char *buf, const char *key,
+                               uint64_t *value)
+{
+    size_t len = strlen(key);
+    const char *p = buf;
+
+    while (p) {
+        if (!strncmp(p, key, len) && p[len] == ' ') {
+            *value = strtoull(p + len + 1, NULL, 10);
+            return true;
+        }
+        p = strchr(p, '\n');
+        if (p) {
+            p++;
+        }
+    }
+    return false;
+}
+
+static bool guest_cgroup_read_u64(int dirfd, const char *name,
+                                  uint64_t *value)
+{
+    char buf[32];
+
+    if (ga_read_proc_file(dirfd, name, buf, sizeof(buf)) <= 0 ||
+        !g_ascii_isdigit(buf[0])) {
+        return false;
+    }
+    *value = strtoull(buf, NULL, 10);
+    return true;
+}
+
+/* bytes read and written, summed over the block devices */
+static bool guest_cgroup_io_read(int dirfd, uint64_t *rbytes,
+                                 uint64_t *wbytes)
+{
+    char *buf = guest_cgroup_state.buf, *line, *end, *p, op[16];
+    uint64_t n;
+
+    *rbytes = *wbytes = 0;
+    if (guest_cgroup_state.unified) {
+        /* 8:0 rbytes=1 wbytes=2 rios=3 wios=4 dbytes=0 dios=0 */
+        if (ga_read_proc_file(dirfd, "io.stat", buf,
+                              GUEST_CGROUP_BUF_SIZE) < 0) {
+            return false;
+        }
+        for (line = buf; *line; line = end) {
+            end = strchrnul(line, '\n');
+            if (*end) {
+                *end++ = '\0';
+            }
+            if ((p = strstr(line, " rbytes="))) {
+                *rbytes += strtoull(p + strlen(" rbytes="), NULL, 10);
+            }
+            if ((p = strstr(line, " wbytes="))) {
+                *wbytes += strtoull(p + strlen(" wbytes="), NULL, 10);
+            }
+        }
+        return true;
+    }
+
+    /* 8:0 Read 1234, then Write, Sync, Async and Total of each device */
+    if (ga_read_proc_file(dirfd, "blkio.throttle.io_service_bytes", buf,
+                          GUEST_CGROUP_BUF_SIZE) < 0) {
+        return false;
+    }
+    for (line = buf; *line; line = end) {
+        end = strchrnul(line, '\n');
+        if (*end) {
+            *end++ = '\0';
+        }
+        if (sscanf(line, "%*u:%*u %15s %" SCNu64, op, &n) != 2) {
+            continue;
+        }
+        if (!strcmp(op, "Read")) {
+            *rbytes += n;
+        } else if (!strcmp(op, "Write")) {
+            *wbytes += n;
+        }
+    }
+    return true;
+}
+
+/* the directory of the cgroup at @path in the hierarchy of @ctrl */
+static int guest_cgroup_ctrl_dir(int fd, const char *path, int ctrl)
+{
+    if (guest_cgroup_state.unified) {
+        return fd;
+    }
+    if (guest_cgroup_state.root[ctrl] == -1) {
+        return -1;
+    }
+    return openat(guest_cgroup_state.root[ctrl], path + 1,
+                  O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+static void guest_cgroup_ctrl_done(int fd, int ctrlfd)
+{
+    if (ctrlfd != -1 && ctrlfd != fd) {
+        close(ctrlfd);
+    }
+}
+
+/*
+ * Read the cgroup at @path, whose directory is @fd, and compute the rates
+ * since @snap.  Returns NULL if the cgroup is gone.
+ */
+static GuestCgroupStats *guest_cgroup_stats_read(const char *path, int fd,
+                                                 GuestCgroupSnapshot *snap,
+                                                 int64_t now)
+{
+    GuestCgroupStats *stats;
+    int64_t elapsed_us = now - snap->time;
+    uint64_t cpu, user, sys, rbytes, wbytes, v;
+    bool has_split, has_io;
+    int ctrlfd;
+
+    if (!guest_cgroup_cpu_read(fd, guest_cgroup_state.unified, &cpu,
+                               &has_split, &user, &sys)) {
+        return NULL;
+    }
+
+    stats = g_new0(GuestCgroupStats, 1);
+    stats->path = g_strdup(path);
+    stats->cpu_ms = cpu / 1000000;
+
+    ctrlfd = guest_cgroup_ctrl_dir(fd, path, CGROUP_MEMORY);
+    if (ctrlfd != -1) {
+        stats->has_memory = guest_cgroup_read_u64(ctrlfd,
+            guest_cgroup_state.unified ? "memory.current"
+                                       : "memory.usage_in_bytes",
+            &stats->memory);
+        if (ga_read_proc_file(ctrlfd, "memory.stat", guest_cgroup_state.buf,
+                              GUEST_CGROUP_BUF_SIZE) > 0) {
+            /* v1 has the totals of the subtree as total_* */
+            if (guest_cgroup_keyed(guest_cgroup_state.buf,
+                    guest_cgroup_state.unified ? "anon" : "total_rss", &v)) {
+                stats->has_memory_anon = true;
+                stats->memory_anon = v;
+            }
+            if (guest_cgroup_keyed(guest_cgroup_state.buf,
+                    guest_cgroup_state.unified ? "file" : "total_cache",
+                    &v)) {
+                stats->has_memory_file = true;
+                stats->memory_file = v;
+            }
+        }
+        guest_cgroup_ctrl_done(fd, ctrlfd);
+    }
+
+    ctrlfd = guest_cgroup_ctrl_dir(fd, path, CGROUP_BLKIO);
+    has_io = ctrlfd != -1 && guest_cgroup_io_read(ctrlfd, &rbytes, &wbytes);
+    guest_cgroup_ctrl_done(fd, ctrlfd);
+    if (has_io) {
+        stats->has_io_read_bytes = stats->has_io_write_bytes = true;
+        stats->io_read_bytes = rbytes;
+        stats->io_write_bytes = wbytes;
+    }
+
+    ctrlfd = guest_cgroup_ctrl_dir(fd, path, CGROUP_PIDS);
+    if (ctrlfd != -1 && guest_cgroup_read_u64(ctrlfd, "pids.current", &v)) {
+        stats->has_pids = true;
+        stats->pids = v;
+    }
+    guest_cgroup_ctrl_done(fd, ctrlfd);
+
+    if (snap->time && elapsed_us > 0) {
+        stats->has_interval = true;
+        stats->interval = elapsed_us / 1000;
+        if (cpu >= snap->cpu) {
+            /* in percent of one CPU, like top(1) */
+            stats->has_cpu_usage = true;
+            stats->cpu_usage = (cpu - snap->cpu) / 10.0 / elapsed_us;
+        }
+        if (has_io) {
+            stats->has_io_read_bps = stats->has_io_write_bps = true;
+            stats->io_read_bps = guest_counter_rate(rbytes, snap->rbytes,
+                                                    elapsed_us);
+            stats->io_write_bps = guest_counter_rate(wbytes, snap->wbytes,
+                                                     elapsed_us);
+        }
+    }
+
+    snap->cpu = cpu;
+    if (has_io) {
+        snap->rbytes = rbytes;
+        snap->wbytes = wbytes;
+    }
+    snap->time = now;
+    return stats;
+}
+
+/* add the cgroups below @dirfd, @depth levels down, to @out */
+static void guest_cgroup_walk(GPtrArray *out, int dirfd, const char *path,
+                              int depth)
+{
+    GuestCgroupSnapshot *snap;
+    GuestCgroupStats *stats;
+    struct dirent *de;
+    char *child;
+    DIR *dir;
+    int fd;
+
+    /* the copy shares the offset of @dirfd, which may be walked again */
+    fd = dup(dirfd);
+    dir = fd == -1 ? NULL : fdopendir(fd);
+    if (!dir) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return;
+    }
+    rewinddir(dir);
+
+    while ((de = readdir(dir)) && out->len < GUEST_CGROUP_MAX_COUNT) {
+        if (de->d_type != DT_DIR || de->d_name[0] == '.') {
+            continue;
+        }
+        child = g_strdup_printf("%s/%s", path, de->d_name);
+        snap = g_hash_table_lookup(guest_cgroup_state.cgroups, child);
+        if (!snap) {
+            snap = g_new0(GuestCgroupSnapshot, 1);
+            snap->fd = -1;
+            g_hash_table_insert(guest_cgroup_state.cgroups, g_strdup(child),
+                                snap);
+        }
+
+        fd = snap->fd;
+        if (fd == -1) {
+            fd = openat(dirfd, de->d_name, O_RDONLY | O_DIRECTORY |
+                                           O_CLOEXEC);
+        }
+        stats = fd == -1 ? NULL :
+                guest_cgroup_stats_read(child, fd, snap,
+                                        g_get_monotonic_time());
+        if (!stats && fd != -1 && fd == snap->fd) {
+            /* removed, and maybe created again under the same name */
+            close(snap->fd);
+            guest_cgroup_state.nfds--;
+            snap->fd = -1;
+            snap->time = 0;
+            fd = openat(dirfd, de->d_name, O_RDONLY | O_DIRECTORY |
+                                           O_CLOEXEC);
+            stats = fd == -1 ? NULL :
+                    guest_cgroup_stats_read(child, fd, snap,
+                                            g_get_monotonic_time());
+        }
+        if (!stats) {
+            if (fd != -1) {
+                close(fd);
+            }
+            g_free(child);
+            continue;
+        }
+
+        snap->generation = guest_cgroup_state.generation;
+        if (snap->fd == -1 && guest_cgroup_state.nfds < GUEST_CGROUP_MAX_FDS) {
+            snap->fd = fd;
+            guest_cgroup_state.nfds++;
+        }
+        g_ptr_array_add(out, stats);
+        if (depth > 1) {
+            guest_cgroup_walk(out, fd, child, depth - 1);
+        }
+        if (fd != snap->fd) {
+            close(fd);
+        }
+        g_free(child);
+    }
+    closedir(dir);
+}
+
+static gboolean guest_cgroup_expired(gpointer key, gpointer value,
+                                     gpointer opaque)
+{
+    GuestCgroupSnapshot *snap = value;
+
+    return snap->generation != guest_cgroup_state.generation;
+}
+
+/* the busiest first; cgroups seen for the first time by their total */
+static gint guest_cgroup_compare(gconstpointer a, gconstpointer b)
+{
+    const GuestCgroupStats *sa = *(GuestCgroupStats *const *)a;
+    const GuestCgroupStats *sb = *(GuestCgroupStats *const *)b;
+
+    if (sa->has_cpu_usage != sb->has_cpu_usage) {
+        return sa->has_cpu_usage ? -1 : 1;
+    }
+    if (sa->has_cpu_usage && sa->cpu_usage != sb->cpu_usage) {
+        return sa->cpu_usage > sb->cpu_usage ? -1 : 1;
+    }
+    if (sa->cpu_ms != sb->cpu_ms) {
+        return sa->cpu_ms > sb->cpu_ms ? -1 : 1;
+    }
+    return strcmp(sa->path, sb->path);
+}
+
+GuestCgroupStatsList *qmp_guest_get_cgroup_stats(bool has_depth,
+                                                 int64_t depth, bool has_top,
+                                                 int64_t top, Error **errp)
+{
+    GuestCgroupStatsList *head = NULL, **tail = &head, *entry;
+    GPtrArray *cgroups;
+    guint i;
+
+    if (!has_depth) {
+        depth = GUEST_CGROUP_DEFAULT_DEPTH;
+    }
+    if (depth < 1 || depth > GUEST_CGROUP_MAX_DEPTH) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "depth",
+                   "between 1 and 8");
+        return NULL;
+    }
+    if (has_top && top < 1) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "top",
+                   "a positive number");
+        return NULL;
+    }
+    if (!guest_cgroup_init(errp)) {
+        return NULL;
+    }
+
+    cgroups = g_ptr_array_new();
+    guest_cgroup_state.generation++;
+    guest_cgroup_walk(cgroups, guest_cgroup_state.root[CGROUP_CPU], "",
+                      depth);
+    /* forget cgroups that went away, and those now out of @depth */
+    g_hash_table_foreach_remove(guest_cgroup_state.cgroups,
+                                guest_cgroup_expired, NULL);
+
+    if (has_top) {
+        g_ptr_array_sort(cgroups, guest_cgroup_compare);
+    }
+    for (i = 0; i < cgroups->len; i++) {
+        if (has_top && i >= top) {
+            qapi_free_GuestCgroupStats(g_ptr_array_index(cgroups, i));
+            continue;
+        }
+        entry = g_new0(GuestCgroupStatsList, 1);
+        entry->value = g_ptr_array_index(cgroups, i);
+        *tail = entry;
+        tail = &entry->next;
+    }
+    g_ptr_array_free(cgroups, true);
+
+    return head;
+}
+
+static void guest_cgroup_cleanup(void)
+{
+    int i;
+
+    if (!guest_cgroup_state.cgroups) {
+        return;
+    }
+    g_hash_table_destroy(guest_cgroup_state.cgroups);
+    for (i = 0; i < CGROUP_MAX; i++) {
+        if (guest_cgroup_state.root[i] != -1) {
+            close(guest_cgroup_state.root[i]);
+        }
+    }
+    g_free(guest_cgroup_state.buf);
+    memset(&guest_cgroup_state, 0, sizeof(guest_cgroup_state));
+}
+/*########################################################################################################*/
+
+/*NetworkStats*/
+/*########################################################################################################*/
+/*
+ * One NETLINK_ROUTE socket is kept open for the life of the agent, so that
+ * polling the counters of many (container) interfaces costs a single dump
+ * rather than a socket and an ioctl per interface.  guest-get-sockets
+ * keeps a NETLINK_SOCK_DIAG one the same way.  The lock covers a request
+ * and its replies, which all go through the one buffer.
+ */
+#define GUEST_NETLINK_BUF_SIZE (32 * 1024)
+
+static struct {
+    CompatGMutex lock;
+    int fd;
+    int diag_fd;
+    uint32_t seq;
+    char *buf;
+} guest_netlink_state = { .fd = -1, .diag_fd = -1 };
+
+typedef void (*GuestNetlinkFunc)(struct nlmsghdr *nlh, void *opaque);
+
+static void guest_netlink_close(int *fd)
+{
+    if (*fd != -1) {
+        close(*fd);
+        *fd = -1;
+    }
+}
+
+static int guest_netlink_receive(int fd, GuestNetlinkFunc func, void *opaque,
+                                 Error **errp)
+{
+    struct nlmsghdr *nlh;
+    ssize_t len;
+
+    for (;;) {
+        do {
+            len = recv(fd, guest_netlink_state.buf, GUEST_NETLINK_BUF_SIZE, 0);
+        } while (len < 0 && errno == EINTR);
+        if (len <= 0) {
+            error_setg_errno(errp, len ? errno : EIO,
+                             "failed to receive netlink reply");
+            return -1;
+        }
+
+        for (nlh = (struct nlmsghdr *)guest_netlink_state.buf;
+             NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+            if (nlh->nlmsg_seq != guest_netlink_state.seq) {
+                continue;
+            }
+            if (nlh->nlmsg_type == NLMSG_DONE) {
+                return 0;
+            }
+            if (nlh->nlmsg_type == NLMSG_ERROR) {
+                struct nlmsgerr *err = NLMSG_DATA(nlh);
+
+                error_setg_errno(errp, -err->error, "netlink request failed");
+                return -1;
+            }
+            func(nlh, opaque);
+        }
+    }
+}
+
+/*
+ * Send the NLM_F_DUMP request @nlh on *@fd, a netlink socket of @protocol
+ * that is opened if need be, and pass each reply message to @func
+ */
+static void guest_netlink_request(int *fd, int protocol, struct nlmsghdr *nlh,
+                                  GuestNetlinkFunc func, void *opaque,
+                                  Error **errp)
+{
+    struct sockaddr_nl addr = { .nl_family = AF_NETLINK };
+    ssize_t len;
+
+    g_mutex_lock(&guest_netlink_state.lock);
+    if (*fd == -1) {
+        *fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, protocol);
+        if (*fd == -1) {
+            g_mutex_unlock(&guest_netlink_state.lock);
+            error_setg_errno(errp, errno, "failed to create netlink socket");
+            return;
+        }
+        if (!guest_netlink_state.buf) {
+            guest_netlink_state.buf = g_malloc(GUEST_NETLINK_BUF_SIZE);
+        }
+    }
+
+    nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    nlh->nlmsg_seq = ++guest_netlink_state.seq;
+    do {
+        len = sendto(*fd, nlh, nlh->nlmsg_len, 0, (struct sockaddr *)&addr,
+                     sizeof(addr));
+    } while (len < 0 && errno == EINTR);
+    if (len < 0) {
+        error_setg_errno(errp, errno, "failed to send netlink request");
+        guest_netlink_close(fd);
+    } else if (guest_netlink_receive(*fd, func, opaque, errp) < 0) {
+        /* the rest of the dump may still be queued, start afresh next time */
+        guest_netlink_close(fd);
+    }
+    g_mutex_unlock(&guest_netlink_state.lock);
+}
+
+/* Run a NLM_F_DUMP request of @type and pass each reply message to @func */
+static void guest_netlink_dump(uint16_t type, GuestNetlinkFunc func,
+                               void *opaque, Error **errp)
+{
+    struct {
+        struct nlmsghdr nlh;
+        struct rtgenmsg gen;
+    } req;
+
+    memset(&req, 0, sizeof(req));
+    req.nlh.nlmsg_len = NLMSG_LENGTH(sizeof(req.gen));
+    req.nlh.nlmsg_type = type;
+    req.gen.rtgen_family = AF_UNSPEC;
+    guest_netlink_request(&guest_netlink_state.fd, NETLINK_ROUTE, &req.nlh,
+                          func, opaque, errp);
+}
+
+static void guest_netlink_add_link(struct nlmsghdr *nlh, void *opaque)
+{
+    GuestNetworkStatsList ***tail = opaque;
+    GuestNetworkStatsList *entry;
+    GuestNetworkInterfaceStat *st;
+    struct ifinfomsg *ifi = NLMSG_DATA(nlh);
+    struct rtattr *rta;
+    struct rtnl_link_stats64 s64;
+    struct rtnl_link_stats s32;
+    const char *name = NULL;
+    unsigned char *mac = NULL;
+    bool has_s64 = false, has_s32 = false;
+    int len;
+
+    if (nlh->nlmsg_type != RTM_NEWLINK ||
+        nlh->nlmsg_len < NLMSG_LENGTH(sizeof(*ifi))) {
+        return;
+    }
+
+    len = IFLA_PAYLOAD(nlh);
+    for (rta = IFLA_RTA(ifi); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+        switch (rta->rta_type) {
+        case IFLA_IFNAME:
+            name = RTA_DATA(rta);
+            break;
+        case IFLA_ADDRESS:
+            if (RTA_PAYLOAD(rta) == 6) {
+                mac = RTA_DATA(rta);
+            }
+            break;
+        case IFLA_STATS64:
+            /* attribute data is only 4-byte aligned */
+            if (RTA_PAYLOAD(rta) >= sizeof(s64)) {
+                memcpy(&s64, RTA_DATA(rta), sizeof(s64));
+                has_s64 = true;
+            }
+            break;
+        case IFLA_STATS:
+            if (RTA_PAYLOAD(rta) >= sizeof(s32)) {
+                memcpy(&s32, RTA_DATA(rta), sizeof(s32));
+                has_s32 = true;
+            }
+            break;
+        }
+    }
+    if (!name || (!has_s64 && !has_s32)) {
+        return;
+    }
+
+    entry = g_new0(GuestNetworkStatsList, 1);
+    entry->value = g_new0(GuestNetworkStats, 1);
+    entry->value->name = g_strndup(name, IFNAMSIZ);
+    entry->value->ifindex = ifi->ifi_index;
+    entry->value->up = !!(ifi->ifi_flags & IFF_UP);
+    if (mac) {
+        entry->value->has_hardware_address = true;
+        entry->value->hardware_address =
+            g_strdup_printf("%02x:%02x:%02x:%02x:%02x:%02x",
+                            mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+    }
+
+    st = entry->value->statistics = g_new0(GuestNetworkInterfaceStat, 1);
+    if (has_s64) {
+        st->rx_bytes = s64.rx_bytes;
+        st->rx_packets = s64.rx_packets;
+        st->rx_errs = s64.rx_errors;
+        st->rx_dropped = s64.rx_dropped;
+        st->tx_bytes = s64.tx_bytes;
+        st->tx_packets = s64.tx_packets;
+        st->tx_errs = s64.tx_errors;
+        st->tx_dropped = s64.tx_dropped;
+    } else {
+        /* kernels before 2.6.35 only have the 32-bit counters */
+        st->rx_bytes = s32.rx_bytes;
+        st->rx_packets = s32.rx_packets;
+        st->rx_errs = s32.rx_errors;
+        st->rx_dropped = s32.rx_dropped;
+        st->tx_bytes = s32.tx_bytes;
+        st->tx_packets = s32.tx_packets;
+        st->tx_errs = s32.tx_errors;
+        st->tx_dropped = s32.tx_dropped;
+    }
+
+    **tail = entry;
+    *tail = &entry->next;
+}
+
+GuestNetworkStatsList *qmp_guest_get_network_stats(Error **errp)
+{
+    GuestNetworkStatsList *head = NULL, **tail = &head;
+    Error *local_err = NULL;
+
+    guest_netlink_dump(RTM_GETLINK, guest_netlink_add_link, &tail,
+                       &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        qapi_free_GuestNetworkStatsList(head);
+        return NULL;
+    }
+    return head;
+}
+
+/*
+ * The process that has a listening socket open, found by looking for its
+ * inode among the /proc/<pid>/fd links.  The next time it is checked with
+ * a single readlink() of the same link, so that only new sockets cost a
+ * look through /proc.  A socket without an owner, say of another pid
+ * namespace, is looked for again after a while.
+ */
+#define GUEST_SOCK_OWNER_RETRY_US (60 * G_USEC_PER_SEC)
+
+typedef struct GuestSockOwner {
+    int pid;                    /* 0 if none was found */
+    int fd;
+    char *comm;
+    int64_t missed;             /* g_get_monotonic_time() of the search */
+    unsigned int generation;
+} GuestSockOwner;
+
+static struct {
+    GHashTable *owners;         /* inode -> GuestSockOwner */
+    unsigned int generation;
+} guest_sock_state;
+
+typedef struct GuestSockDump {
+    GuestListeningSocketList **tail;
+    GuestSocketProtocol protocol;
+    int64_t counts[GUEST_TCP_STATE__MAX];
+} GuestSockDump;
+
+/*
+ * Dump the sockets of @family and @protocol in one of @states, and with
+ * the local port @port unless it is -1
+ */
+static void guest_sock_dump(int family, int protocol, uint32_t states,
+                            int port, GuestNetlinkFunc func, void *opaque,
+                            Error **errp)
+{
+    struct {
+        struct nlmsghdr nlh;
+        struct inet_diag_req_v2 req;
+        struct rtattr rta;
+        struct inet_diag_bc_op ops[4];
+    } req;
+    const int cmp = 2 * sizeof(struct inet_diag_bc_op);
+
+    memset(&req, 0, sizeof(req));
+    req.nlh.nlmsg_len = NLMSG_LENGTH(sizeof(req.req));
+    req.nlh.nlmsg_type = SOCK_DIAG_BY_FAMILY;
+    req.req.sdiag_family = family;
+    req.req.sdiag_protocol = protocol;
+    req.req.idiag_states = states;
+    if (port != -1) {
+        /*
+         * Filter in the kernel: sport >= @port, then sport <= @port.  A
+         * test that fails jumps past the end of the program, which
+         * rejects the socket.
+         */
+        req.rta.rta_type = INET_DIAG_REQ_BYTECODE;
+        req.rta.rta_len = RTA_LENGTH(sizeof(req.ops));
+        req.ops[0].code = INET_DIAG_BC_S_GE;
+        req.ops[0].yes = cmp;
+        req.ops[0].no = 2 * cmp + 4;
+        req.ops[1].no = port;
+        req.ops[2].code = INET_DIAG_BC_S_LE;
+        req.ops[2].yes = cmp;
+        req.ops[2].no = cmp + 4;
+        req.ops[3].no = port;
+        req.nlh.nlmsg_len += req.rta.rta_len;
+    }
+    guest_netlink_request(&guest_netlink_state.diag_fd, NETLINK_SOCK_DIAG,
+                          &req.nlh, func, opaque, errp);
+}
+
+static void guest_sock_add_listener(struct nlmsghdr *nlh, void *opaque)
+{
+    GuestSockDump *d = opaque;
+    struct inet_diag_msg *msg = NLMSG_DATA(nlh);
+    GuestListeningSocket *ls;
+    char buf[INET6_ADDRSTRLEN];
+
+    if (nlh->nlmsg_type != SOCK_DIAG_BY_FAMILY ||
+        nlh->nlmsg_len < NLMSG_LENGTH(sizeof(*msg)) ||
+        !msg->id.idiag_sport ||
+        !inet_ntop(msg->idiag_family, msg->id.idiag_src, buf, sizeof(buf))) {
+        return;
+    }
+
+    ls = g_new0(GuestListeningSocket, 1);
+    ls->protocol = d->protocol;
+    ls->address = g_strdup(buf);
+    ls->port = ntohs(msg->id.idiag_sport);
+    ls->inode = msg->idiag_inode;
+    if (d->protocol == GUEST_SOCKET_PROTOCOL_TCP) {
+        ls->has_queued = ls->has_backlog = true;
+        ls->queued = msg->idiag_rqueue;
+        ls->backlog = msg->idiag_wqueue;
+    }
+    *d->tail = g_new0(GuestListeningSocketList, 1);
+    (*d->tail)->value = ls;
+    d->tail = &(*d->tail)->next;
+}
+
+static void guest_sock_count(struct nlmsghdr *nlh, void *opaque)
+{
+    GuestSockDump *d = opaque;
+    struct inet_diag_msg *msg = NLMSG_DATA(nlh);
+
+    /* GuestTcpState follows the kernel's TCP_ESTABLISHED...TCP_CLOSING */
+    if (nlh->nlmsg_type == SOCK_DIAG_BY_FAMILY &&
+        nlh->nlmsg_len >= NLMSG_LENGTH(sizeof(*msg)) &&
+        msg->idiag_state >= TCP_ESTABLISHED &&
+        msg->idiag_state - TCP_ESTABLISHED < GUEST_TCP_STATE__MAX) {
+        d->counts[msg->idiag_state - TCP_ESTABLISHED]++;
+    }
+}
+
+static void guest_sock_owner_free(gpointer data)
+{
+    GuestSockOwner *o = data;
+
+    g_free(o->comm);
+    g_free(o);
+}
+
+/* whether the fd where @o was found still is socket @inode */
+static bool guest_sock_owner_valid(const GuestSockOwner *o, uint32_t inode)
+{
+    char path[64], link[64], want[32];
+    ssize_t len;
+
+    snprintf(path, sizeof(path), "/proc/%d/fd/%d", o->pid, o->fd);
+    len = readlink(path, link, sizeof(link) - 1);
+    if (len < 0) {
+        return false;
+    }
+    link[len] = '\0';
+    snprintf(want, sizeof(want), "socket:[%u]", inode);
+    return !strcmp(link, want);
+}
+
+/*
+ * Find the owners of the sockets in @wanted, inode -> GuestSockOwner.
+ * /proc lists processes by increasing pid, so the first owner found is
+ * the one with the lowest pid, usually the parent of the others.
+ */
+static void guest_sock_scan(GHashTable *wanted)
+{
+    guint left = g_hash_table_size(wanted);
+    struct dirent *de, *fde;
+    GuestSockOwner *o;
+    DIR *proc, *fds;
+    char path[64], link[64], comm[64];
+    unsigned long inode;
+    ssize_t len;
+    int fd;
+
+    proc = opendir("/proc");
+    if (!proc) {
+        return;
+    }
+    while (left && (de = readdir(proc)) != NULL) {
+        if (!g_ascii_isdigit(de->d_name[0])) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/fd", de->d_name);
+        fd = openat(dirfd(proc), path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        fds = fd < 0 ? NULL : fdopendir(fd);
+        if (!fds) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            continue;
+        }
+        while (left && (fde = readdir(fds)) != NULL) {
+            len = readlinkat(dirfd(fds), fde->d_name, link, sizeof(link) - 1);
+            if (len < 0) {
+                continue;
+            }
+            link[len] = '\0';
+            if (sscanf(link, "socket:[%lu]", &inode) != 1) {
+                continue;
+            }
+            o = g_hash_table_lookup(wanted, GUINT_TO_POINTER(inode));
+            if (!o || o->pid) {
+                continue;
+            }
+            o->pid = atoi(de->d_name);
+            o->fd = atoi(fde->d_name);
+            snprintf(path, sizeof(path), "%s/comm", de->d_name);
+            if (ga_read_proc_file(dirfd(proc), path, comm, sizeof(comm)) > 0) {
+                o->comm = g_strdup(g_strchomp(comm));
+            }
+            left--;
+        }
+        closedir(fds);
+    }
+    closedir(proc);
+}
+
+static gboolean guest_sock_owner_expired(gpointer key, gpointer value,
+                                         gpointer opaque)
+{
+    GuestSockOwner *o = value;
+
+    return o->generation != GPOINTER_TO_UINT(opaque);
+}
+
+/* fill in the owners of @list; with @all, forget those of other sockets */
+static void guest_sock_resolve(GuestListeningSocketList *list, bool all)
+{
+    int64_t now = g_get_monotonic_time();
+    GHashTable *wanted = NULL;
+    GuestListeningSocketList *l;
+    GuestSockOwner *o;
+    gpointer inode;
+
+    if (!guest_sock_state.owners) {
+        guest_sock_state.owners =
+            g_hash_table_new_full(NULL, NULL, NULL, guest_sock_owner_free);
+    }
+    guest_sock_state.generation++;
+
+    for (l = list; l; l = l->next) {
+        if (!l->value->inode) {
+            continue;
+        }
+        inode = GUINT_TO_POINTER(l->value->inode);
+        o = g_hash_table_lookup(guest_sock_state.owners, inode);
+        if (o && (o->pid ? !guest_sock_owner_valid(o, l->value->inode)
+                         : now - o->missed >= GUEST_SOCK_OWNER_RETRY_US)) {
+            g_hash_table_remove(guest_sock_state.owners, inode);
+            o = NULL;
+        }
+        if (!o) {
+            o = g_new0(GuestSockOwner, 1);
+            g_hash_table_insert(guest_sock_state.owners, inode, o);
+            if (!wanted) {
+                wanted = g_hash_table_new(NULL, NULL);
+            }
+            g_hash_table_insert(wanted, inode, o);
+        }
+        o->generation = guest_sock_state.generation;
+    }
+
+    if (wanted) {
+        guest_sock_scan(wanted);
+        g_hash_table_destroy(wanted);
+    }
+
+    for (l = list; l; l = l->next) {
+        o = l->value->inode ?
+            g_hash_table_lookup(guest_sock_state.owners,
+                                GUINT_TO_POINTER(l->value->inode)) : NULL;
+        if (!o) {
+            continue;
+        }
+        if (!o->pid) {
+            o->missed = o->missed ? o->missed : now;
+            continue;
+        }
+        l->value->has_pid = true;
+        l->value->pid = o->pid;
+        l->value->has_comm = !!o->comm;
+        l->value->comm = g_strdup(o->comm);
+    }
+
+    if (all) {
+        g_hash_table_foreach_remove(
+            guest_sock_state.owners, guest_sock_owner_expired,
+            GUINT_TO_POINTER(guest_sock_state.generation));
+    }
+}
+
+static void guest_sock_cleanup(void)
+{
+    if (guest_sock_state.owners) {
+        g_hash_table_destroy(guest_sock_state.owners);
+    }
+    memset(&guest_sock_state, 0, sizeof(guest_sock_state));
+}
+
+GuestSockets *qmp_guest_get_sockets(bool has_port, int64_t port,
+                                    bool has_owners, bool owners,
+                                    bool has_connections, bool connections,
+                                    Error **errp)
+{
+    static const int families[] = { AF_INET, AF_INET6 };
+    /* every state but TCP_LISTEN, bit 0 is no state */
+    const uint32_t conn_states = ((1 << (TCP_CLOSING + 1)) - 2) &
+                                 ~(1 << TCP_LISTEN);
+    GuestTcpStateCountList **tail;
+    GuestSockDump d = { 0 };
+    GuestSockets *socks;
+    Error *local_err = NULL;
+    int i;
+
+    if (has_port && (port < 0 || port > 65535)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "port",
+                   "a number from 0 to 65535");
+        return NULL;
+    }
+    if (!has_port) {
+        port = -1;
+    }
+
+    socks = g_new0(GuestSockets, 1);
+    d.tail = &socks->listening;
+    for (i = 0; i < ARRAY_SIZE(families); i++) {
+        d.protocol = GUEST_SOCKET_PROTOCOL_TCP;
+        guest_sock_dump(families[i], IPPROTO_TCP, 1 << TCP_LISTEN, port,
+                        guest_sock_add_listener, &d, &local_err);
+        if (local_err) {
+            goto fail;
+        }
+        /* udp_diag can be a module of its own that is not there */
+        d.protocol = GUEST_SOCKET_PROTOCOL_UDP;
+        guest_sock_dump(families[i], IPPROTO_UDP, 1 << TCP_CLOSE, port,
+                        guest_sock_add_listener, &d, &local_err);
+        if (local_err) {
+            g_debug("no UDP sockets: %s", error_get_pretty(local_err));
+            error_free(local_err);
+            local_err = NULL;
+        }
+        if (has_connections && connections) {
+            guest_sock_dump(families[i], IPPROTO_TCP, conn_states, port,
+                            guest_sock_count, &d, &local_err);
+            if (local_err) {
+                goto fail;
+            }
+        }
+    }
+
+    if (!has_owners || owners) {
+        guest_sock_resolve(socks->listening, !has_port);
+    }
+    if (has_connections && connections) {
+        socks->has_connections = true;
+        tail = &socks->connections;
+        for (i = 0; i < GUEST_TCP_STATE__MAX; i++) {
+            if (!d.counts[i]) {
+                continue;
+            }
+            *tail = g_new0(GuestTcpStateCountList, 1);
+            (*tail)->value = g_new0(GuestTcpStateCount, 1);
+            (*tail)->value->state = i;
+            (*tail)->value->count = d.counts[i];
+            tail = &(*tail)->next;
+        }
+    }
+    return socks;
+
+fail:
+    error_propagate(errp, local_err);
+    qapi_free_GuestSockets(socks);
+    return NULL;
+}
+
+/*
+ * guest-network-get-interfaces is served from a table of the links and
+ * their addresses, hashed by ifindex.  It is filled by one dump and then
+ * kept up to date from the RTNLGRP_LINK and RTNLGRP_IPV{4,6}_IFADDR
+ * groups, whose messages are read when the command runs.  If some were
+ * lost (ENOBUFS) the table is dumped again; without the subscription it is
+ * dumped on every call.
+ *
+ * The table is not changed once published: events are applied to a copy
+ * that replaces it under RCU, so the command can list the interfaces on
+ * any thread while another one updates them.  While an update is under
+ * way it lists those of the table before.
+ */
+typedef struct GuestNetifAddr {
+    int family;
+    uint8_t prefix;
+    uint8_t addr[16];
+    char *label;                /* IPv4 only, e.g. "eth0:1" for an alias */
+} GuestNetifAddr;
+
+typedef struct GuestNetif {
+    int index;
+    char *name;                 /* NULL until the link message is seen */
+    char *hwaddr;
+    GArray *addrs;              /* GuestNetifAddr, in the kernel's order */
+} GuestNetif;
+
+typedef struct GuestNetifTable {
+    struct rcu_head rcu;
+    GHashTable *links;          /* ifindex -> GuestNetif */
+} GuestNetifTable;
+
+static struct {
+    CompatGMutex lock;          /* serializes updates */
+    bool opened;
+    int fd;                     /* subscription, -1 if none */
+    bool valid;                 /* complete, events only need applying */
+    GuestNetifTable *table;     /* RCU, NULL until the first dump */
+} guest_netif_state = { .fd = -1 };
+
+static void guest_netif_free(gpointer p)
+{
+    GuestNetif *nif = p;
+    guint i;
+
+    for (i = 0; i < nif->addrs->len; i++) {
+        g_free(g_array_index(nif->addrs, GuestNetifAddr, i).label);
+    }
+    g_array_free(nif->addrs, true);
+    g_free(nif->name);
+    g_free(nif->hwaddr);
+    g_free(nif);
+}
+
+static GuestNetif *guest_netif_new(int index)
+{
+    GuestNetif *nif = g_new0(GuestNetif, 1);
+
+    nif->index = index;
+    nif->addrs = g_array_new(false, false, sizeof(GuestNetifAddr));
+    return nif;
+}
+
+/* a copy of @from, or an empty table if it is NULL */
+static GuestNetifTable *guest_netif_table_new(const GuestNetifTable *from)
+{
+    GuestNetifTable *table = g_new0(GuestNetifTable, 1);
+    GuestNetif *nif, *copy;
+    GuestNetifAddr a;
+    GHashTableIter iter;
+    gpointer value;
+    guint i;
+
+    table->links = g_hash_table_new_full(NULL, NULL, NULL, guest_netif_free);
+    if (!from) {
+        return table;
+    }
+    g_hash_table_iter_init(&iter, from->links);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        nif = value;
+        copy = guest_netif_new(nif->index);
+        copy->name = g_strdup(nif->name);
+        copy->hwaddr = g_strdup(nif->hwaddr);
+        for (i = 0; i < nif->addrs->len; i++) {
+            a = g_array_index(nif->addrs, GuestNetifAddr, i);
+            a.label = g_strdup(a.label);
+            g_array_append_val(copy->addrs, a);
+        }
+        g_hash_table_insert(table->links, GINT_TO_POINTER(nif->index), copy);
+    }
+    return table;
+}
+
+static void guest_netif_table_free(GuestNetifTable *table)
+{
+    g_hash_table_destroy(table->links);
+    g_free(table);
+}
+
+/* with the lock held */
+static void guest_netif_publish(GuestNetifTable *table)
+{
+    GuestNetifTable *old = guest_netif_state.table;
+
+    atomic_rcu_set(&guest_netif_state.table, table);
+    if (old) {
+        call_rcu(old, guest_netif_table_free, rcu);
+    }
+}
+
+static void guest_netif_open(void)
+{
+    struct sockaddr_nl addr = {
+        .nl_family = AF_NETLINK,
+        .nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR,
+    };
+    int fd;
+
+    guest_netif_state.opened = true;
+    fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK,
+                NETLINK_ROUTE);
+    if (fd == -1) {
+        g_debug("no rtnetlink socket, not caching interfaces: %s",
+                strerror(errno));
+        return;
+    }
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        g_debug("no rtnetlink events, not caching interfaces: %s",
+                strerror(errno));
+        close(fd);
+        return;
+    }
+    guest_netif_state.fd = fd;
+}
+
+static GuestNetif *guest_netif_get(GuestNetifTable *table, int index)
+{
+    GuestNetif *nif = g_hash_table_lookup(table->links,
+                                          GINT_TO_POINTER(index));
+
+    if (!nif) {
+        nif = guest_netif_new(index);
+        g_hash_table_insert(table->links, GINT_TO_POINTER(index), nif);
+    }
+    return nif;
+}
+
+static void guest_netif_link(GuestNetifTable *table, struct nlmsghdr *nlh)
+{
+    struct ifinfomsg *ifi = NLMSG_DATA(nlh);
+    struct rtattr *rta;
+    unsigned char mac[6] = { 0 };
+    const char *name = NULL;
+    GuestNetif *nif;
+    int len;
+
+    /* bridge port messages are about the port, not the link */
+    if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(*ifi)) ||
+        ifi->ifi_family == AF_BRIDGE) {
+        return;
+    }
+    if (nlh->nlmsg_type == RTM_DELLINK) {
+        g_hash_table_remove(table->links, GINT_TO_POINTER(ifi->ifi_index));
+        return;
+    }
+
+    len = IFLA_PAYLOAD(nlh);
+    for (rta = IFLA_RTA(ifi); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+        switch (rta->rta_type) {
+        case IFLA_IFNAME:
+            name = RTA_DATA(rta);
+            break;
+        case IFLA_ADDRESS:
+            /* zero-padded or cut to 6 bytes, as getifaddrs() callers did */
+            memcpy(mac, RTA_DATA(rta), MIN(RTA_PAYLOAD(rta), sizeof(mac)));
+            break;
+        }
+    }
+    if (!name) {
+        return;
+    }
+
+    nif = guest_netif_get(table, ifi->ifi_index);
+    g_free(nif->name);
+    nif->name = g_strndup(name, IFNAMSIZ);
+    g_free(nif->hwaddr);
+    nif->hwaddr = g_strdup_printf("%02x:%02x:%02x:%02x:%02x:%02x",
+                                  mac[0], mac[1], mac[2], mac[3], mac[4],
+                                  mac[5]);
+}
+
+static void guest_netif_addr(GuestNetifTable *table, struct nlmsghdr *nlh)
+{
+    struct ifaddrmsg *ifa = NLMSG_DATA(nlh);
+    struct rtattr *rta;
+    GuestNetifAddr a = { 0 }, *cur;
+    void *address = NULL, *local = NULL;
+    const char *label = NULL;
+    size_t addrlen;
+    GuestNetif *nif;
+    guint i;
+    int len;
+
+    if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(*ifa))) {
+        return;
+    }
+    if (ifa->ifa_family == AF_INET) {
+        addrlen = 4;
+    } else if (ifa->ifa_family == AF_INET6) {
+        addrlen = 16;
+    } else {
+        return;
+    }
+
+    len = IFA_PAYLOAD(nlh);
+    for (rta = IFA_RTA(ifa); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+        switch (rta->rta_type) {
+        case IFA_ADDRESS:
+            address = RTA_DATA(rta);
+            break;
+        case IFA_LOCAL:
+            local = RTA_DATA(rta);
+            break;
+        case IFA_LABEL:
+            label = RTA_DATA(rta);
+            break;
+        }
+    }
+    /* on point-to-point links IFA_ADDRESS is the peer */
+    if (local) {
+        address = local;
+    }
+    if (!address) {
+        return;
+    }
+    a.family = ifa->ifa_family;
+    a.prefix = ifa->ifa_prefixlen;
+    memcpy(a.addr, address, addrlen);
+
+    nif = guest_netif_get(table, ifa->ifa_index);
+    for (i = 0; i < nif->addrs->len; i++) {
+        cur = &g_array_index(nif->addrs, GuestNetifAddr, i);
+        if (cur->family == a.family && cur->prefix == a.prefix &&
+            !memcmp(cur->addr, a.addr, addrlen)) {
+            break;
+        }
+    }
+
+    if (nlh->nlmsg_type == RTM_DELADDR) {
+        if (i < nif->addrs->len) {
+            g_free(g_array_index(nif->addrs, GuestNetifAddr, i).label);
+            g_array_remove_index(nif->addrs, i);
+        }
+        return;
+    }
+    if (label && a.family == AF_INET) {
+        a.label = g_strndup(label, IFNAMSIZ);
+    }
+    if (i < nif->addrs->len) {
+        cur = &g_array_index(nif->addrs, GuestNetifAddr, i);
+        g_free(cur->label);
+        cur->label = a.label;
+    } else {
+        g_array_append_val(nif->addrs, a);
+    }
+}
+
+/* @opaque is the GuestNetifTable */
+static void guest_netif_message(struct nlmsghdr *nlh, void *opaque)
+{
+    switch (nlh->nlmsg_type) {
+    case RTM_NEWLINK:
+    case RTM_DELLINK:
+        guest_netif_link(opaque, nlh);
+        break;
+    case RTM_NEWADDR:
+    case RTM_DELADDR:
+        guest_netif_addr(opaque, nlh);
+        break;
+    }
+}
+
+/*
+ * Apply the queued events to a copy of the table, made in *@copy when the
+ * first one is read, or with @discard drop them.  Returns false if some
+ * were lost.
+ */
+static bool guest_netif_read_events(GuestNetifTable **copy, bool discard)
+{
+    struct nlmsghdr *nlh;
+    bool lost = false;
+    ssize_t len;
+
+    g_mutex_lock(&guest_netlink_state.lock);
+    for (;;) {
+        len = recv(guest_netif_state.fd, guest_netlink_state.buf,
+                   GUEST_NETLINK_BUF_SIZE, 0);
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+        if (len < 0 && errno == ENOBUFS) {
+            lost = true;
+            continue;
+        }
+        if (len <= 0) {
+            break;
+        }
+        if (lost || discard) {
+            continue;
+        }
+        if (!*copy) {
+            *copy = guest_netif_table_new(guest_netif_state.table);
+        }
+        for (nlh = (struct nlmsghdr *)guest_netlink_state.buf;
+             NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+            guest_netif_message(nlh, *copy);
+        }
+    }
+    g_mutex_unlock(&guest_netlink_state.lock);
+    return !lost;
+}
+
+/* with the lock held */
+static void guest_netif_update(Error **errp)
+{
+    GuestNetifTable *table = NULL;
+    Error *local_err = NULL;
+
+    if (!guest_netif_state.opened) {
+        guest_netif_open();
+    }
+    if (guest_netif_state.valid) {
+        if (guest_netif_read_events(&table, false)) {
+            if (table) {
+                guest_netif_publish(table);
+            }
+            return;
+        }
+        if (table) {
+            guest_netif_table_free(table);
+            table = NULL;
+        }
+        /* what is still queued is older than the dump below */
+        guest_netif_read_events(&table, true);
+    }
+
+    guest_netif_state.valid = false;
+    table = guest_netif_table_new(NULL);
+    guest_netlink_dump(RTM_GETLINK, guest_netif_message, table, &local_err);
+    if (!local_err) {
+        guest_netlink_dump(RTM_GETADDR, guest_netif_message, table,
+                           &local_err);
+    }
+    if (local_err) {
+        guest_netif_table_free(table);
+        error_propagate(errp, local_err);
+        return;
+    }
+    guest_netif_publish(table);
+    guest_netif_state.valid = guest_netif_state.fd != -1;
+}
+
+static void guest_netif_invalidate(void)
+{
+    g_mutex_lock(&guest_netif_state.lock);
+    guest_netif_state.valid = false;
+    g_mutex_unlock(&guest_netif_state.lock);
+}
+
+static void guest_netif_warm(void)
+{
+    Error *local_err = NULL;
+
+    g_mutex_lock(&guest_netif_state.lock);
+    guest_netif_update(&local_err);
+    g_mutex_unlock(&guest_netif_state.lock);
+    error_free(local_err);
+}
+
+static gint guest_netif_compare(gconstpointer a, gconstpointer b)
+{
+    const GuestNetif *na = a, *nb = b;
+
+    return na->index - nb->index;
+}
+
+typedef struct GuestNetifOutput {
+    GuestNetworkInterface *iface;
+    GuestIpAddressList **tail;
+} GuestNetifOutput;
+
+static void guest_netif_output_addr(GuestNetifOutput *out,
+                                    const GuestNetifAddr *a)
+{
+    char buf[INET6_ADDRSTRLEN];
+    GuestIpAddressList *entry;
+
+    if (!inet_ntop(a->family, a->addr, buf, sizeof(buf))) {
+        return;
+    }
+    entry = g_new0(GuestIpAddressList, 1);
+    entry->value = g_new0(GuestIpAddress, 1);
+    entry->value->ip_address = g_strdup(buf);
+    entry->value->ip_address_type = a->family == AF_INET ?
+        GUEST_IP_ADDRESS_TYPE_IPV4 : GUEST_IP_ADDRESS_TYPE_IPV6;
+    entry->value->prefix = a->prefix;
+    *out->tail = entry;
+    out->tail = &entry->next;
+    out->iface->has_ip_addresses = true;
+}
+
+/*
+ * Interfaces come in ifindex order, each with its addresses in the order
+ * the kernel has them.  IPv4 addresses with a label of their own show up
+ * as an interface of that name after all the links, like getifaddrs()
+ * reports them.
+ */
+GuestNetworkInterfaceList *qmp_guest_network_get_interfaces(Error **errp)
+{
+    GuestNetworkInterfaceList *head = NULL, **tail = &head, *entry;
+    GHashTable *aliases = NULL;
+    GuestNetifOutput out, *alias;
+    Error *local_err = NULL;
+    const GuestNetifAddr *a;
+    GuestNetifTable *table;
+    bool locked = false;
+    GList *links, *l;
+    GuestNetif *nif;
+    guint i;
+
+    /*
+     * While another thread updates the table, list the one before rather
+     * than wait: the update only adds what happened just now.
+     */
+    if (g_mutex_trylock(&guest_netif_state.lock)) {
+        locked = true;
+    } else if (!atomic_rcu_read(&guest_netif_state.table)) {
+        g_mutex_lock(&guest_netif_state.lock);
+        locked = true;
+    }
+    if (locked) {
+        guest_netif_update(&local_err);
+        g_mutex_unlock(&guest_netif_state.lock);
+        if (local_err) {
+            error_propagate(errp, local_err);
+            return NULL;
+        }
+    }
+
+    rcu_read_lock();
+    table = atomic_rcu_read(&guest_netif_state.table);
+    links = g_list_sort(g_hash_table_get_values(table->links),
+                        guest_netif_compare);
+    for (l = links; l; l = l->next) {
+        nif = l->data;
+        if (!nif->name) {
+            continue;
+        }
+        entry = g_new0(GuestNetworkInterfaceList, 1);
+        entry->value = g_new0(GuestNetworkInterface, 1);
+        entry->value->name = g_strdup(nif->name);
+        entry->value->has_hardware_address = true;
+        entry->value->hardware_address = g_strdup(nif->hwaddr);
+        *tail = entry;
+        tail = &entry->next;
+
+        out.iface = entry->value;
+        out.tail = &entry->value->ip_addresses;
+        for (i = 0; i < nif->addrs->len; i++) {
+            a = &g_array_index(nif->addrs, GuestNetifAddr, i);
+            if (!a->label || !strcmp(a->label, nif->name)) {
+                guest_netif_output_addr(&out, a);
+            }
+        }
+    }
+
+    for (l = links; l; l = l->next) {
+        nif = l->data;
+        if (!nif->name) {
+            continue;
+        }
+        for (i = 0; i < nif->addrs->len; i++) {
+            a = &g_array_index(nif->addrs, GuestNetifAddr, i);
+            if (!a->label || !strcmp(a->label, nif->name)) {
+                continue;
+            }
+            if (!aliases) {
+                aliases = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                NULL, g_free);
+            }
+            alias = g_hash_table_lookup(aliases, a->label);
+            if (!alias) {
+                entry = g_new0(GuestNetworkInterfaceList, 1);
+                entry->value = g_new0(GuestNetworkInterface, 1);
+                entry->value->name = g_strdup(a->label);
+                *tail = entry;
+                tail = &entry->next;
+
+                alias = g_new0(GuestNetifOutput, 1);
+                alias->iface = entry->value;
+                alias->tail = &entry->value->ip_addresses;
+                g_hash_table_insert(aliases, entry->value->name, alias);
+            }
+            guest_netif_output_addr(alias, a);
+        }
+    }
+
+    rcu_read_unlock();
+
+    if (aliases) {
+        g_hash_table_destroy(aliases);
+    }
+    g_list_free(links);
+    return head;
+}
+
+static void guest_netif_cleanup(void)
+{
+    if (guest_netif_state.fd != -1) {
+        close(guest_netif_state.fd);
+        guest_netif_state.fd = -1;
+    }
+    if (guest_netif_state.table) {
+        guest_netif_table_free(guest_netif_state.table);
+        guest_netif_state.table = NULL;
+    }
+    guest_netif_state.opened = false;
+    guest_netif_state.valid = false;
+}
+
+static void guest_netlink_cleanup(void)
+{
+    guest_netlink_close(&guest_netlink_state.fd);
+    guest_netlink_close(&guest_netlink_state.diag_fd);
+    g_free(guest_netlink_state.buf);
+    guest_netlink_state.buf = NULL;
+}
+/*########################################################################################################*/
+
+/*NetworkProbe*/
+/*########################################################################################################*/
+#define GUEST_NET_PROBE_MAX_TARGETS 256
+#define GUEST_NET_PROBE_MAX_COUNT 100
+#define GUEST_NET_PROBE_MAX_TIMEOUT 60000
+
+typedef struct GuestNetProbe {
+    GuestNetProbeResult *res;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    bool usable;                /* resolved, and the ICMP socket open */
+    bool icmp;
+    bool raw;                   /* a raw ICMP socket, not a ping socket */
+    uint16_t id;                /* ICMP identifier, raw sockets only */
+    int fd;                     /* the TCP connect, or the ICMP socket */
+    int64_t start;              /* when the probe of this round was sent */
+    bool pending;               /* waiting for its answer */
+    int64_t rtt_sum;
+} GuestNetProbe;
+
+static void guest_net_probe_fail(GuestNetProbe *p, const char *msg)
+{
+    g_free(p->res->error);
+    p->res->has_error = true;
+    p->res->error = g_strdup(msg);
+}
+
+static void guest_net_probe_answered(GuestNetProbe *p, int64_t now)
+{
+    GuestNetProbeResult *res = p->res;
+    int64_t rtt = now - p->start;
+
+    if (!res->received || rtt < res->rtt_min) {
+        res->rtt_min = rtt;
+    }
+    if (!res->received || rtt > res->rtt_max) {
+        res->rtt_max = rtt;
+    }
+    res->received++;
+    p->rtt_sum += rtt;
+    p->pending = false;
+}
+
+/* resolve the target and, for ICMP, open the socket used for every round */
+static bool guest_net_probe_init(GuestNetProbe *p, GuestNetProbeTarget *t)
+{
+    struct addrinfo hints, *ai;
+    char addr[INET6_ADDRSTRLEN];
+    int ret, proto;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    ret = getaddrinfo(t->host, NULL, &hints, &ai);
+    if (ret) {
+        guest_net_probe_fail(p, gai_strerror(ret));
+        return false;
+    }
+    memcpy(&p->addr, ai->ai_addr, ai->ai_addrlen);
+    p->addrlen = ai->ai_addrlen;
+    freeaddrinfo(ai);
+
+    if (getnameinfo((struct sockaddr *)&p->addr, p->addrlen, addr,
+                    sizeof(addr), NULL, 0, NI_NUMERICHOST) == 0) {
+        p->res->has_address = true;
+        p->res->address = g_strdup(addr);
+    }
+
+    if (!p->icmp) {
+        if (p->addr.ss_family == AF_INET) {
+            ((struct sockaddr_in *)&p->addr)->sin_port = htons(t->port);
+        } else {
+            ((struct sockaddr_in6 *)&p->addr)->sin6_port = htons(t->port);
+        }
+        return true;
+    }
+
+    /* ping sockets where ping_group_range allows them, raw ones as root */
+    proto = p->addr.ss_family == AF_INET ? IPPROTO_ICMP : IPPROTO_ICMPV6;
+    p->fd = socket(p->addr.ss_family, SOCK_DGRAM | SOCK_NONBLOCK |
+                   SOCK_CLOEXEC, proto);
+    if (p->fd < 0 && (errno == EACCES || errno == EPERM ||
+                      errno == EPROTONOSUPPORT)) {
+        p->fd = socket(p->addr.ss_family, SOCK_RAW | SOCK_NONBLOCK |
+                       SOCK_CLOEXEC, proto);
+        p->raw = true;
+    }
+    /* only the replies from the target are received from now on */
+    if (p->fd < 0 ||
+        connect(p->fd, (struct sockaddr *)&p->addr, p->addrlen) < 0) {
+        guest_net_probe_fail(p, strerror(errno));
+        if (p->fd >= 0) {
+            close(p->fd);
+            p->fd = -1;
+        }
+        return false;
+    }
+    return true;
+}
+
+/* send the probe of round @seq */
+static void guest_net_probe_send(GuestNetProbe *p, uint16_t seq)
+{
+    unsigned char pkt[sizeof(struct icmphdr) + 16] = { 0 };
+    struct icmphdr *icmp = (struct icmphdr *)pkt;
+    struct icmp6_hdr *icmp6 = (struct icmp6_hdr *)pkt;
+    uint32_t sum = 0;
+    int i;
+
+    p->start = g_get_monotonic_time();
+    p->res->sent++;
+    p->pending = true;
+
+    if (!p->icmp) {
+        p->fd = socket(p->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK |
+                       SOCK_CLOEXEC, 0);
+        if (p->fd < 0) {
+            guest_net_probe_fail(p, strerror(errno));
+            p->pending = false;
+        } else if (connect(p->fd, (struct sockaddr *)&p->addr,
+                           p->addrlen) == 0) {
+            guest_net_probe_answered(p, g_get_monotonic_time());
+        } else if (errno != EINPROGRESS) {
+            guest_net_probe_fail(p, strerror(errno));
+            p->pending = false;
+        }
+        return;
+    }
+
+    /*
+     * The kernel sets the identifier of ping sockets and the checksum of
+     * ICMPv6; the rest of the header is ours.
+     */
+    if (p->addr.ss_family == AF_INET) {
+        icmp->type = ICMP_ECHO;
+        icmp->un.echo.id = htons(p->id);
+        icmp->un.echo.sequence = htons(seq);
+        for (i = 0; i < sizeof(pkt); i += 2) {
+            sum += pkt[i] << 8 | pkt[i + 1];
+        }
+        sum = (sum >> 16) + (sum & 0xffff);
+        sum += sum >> 16;
+        icmp->checksum = htons(~sum & 0xffff);
+    } else {
+        icmp6->icmp6_type = ICMP6_ECHO_REQUEST;
+        icmp6->icmp6_id = htons(p->id);
+        icmp6->icmp6_seq = htons(seq);
+    }
+    if (send(p->fd, pkt, sizeof(pkt), 0) < 0) {
+        guest_net_probe_fail(p, strerror(errno));
+        p->pending = false;
+    }
+}
+
+/* take what arrived on the ICMP socket, looking for the reply to @seq */
+static void guest_net_probe_recv(GuestNetProbe *p, uint16_t seq)
+{
+    unsigned char buf[1024], *pkt;
+    struct icmphdr *icmp;
+    struct icmp6_hdr *icmp6;
+    ssize_t len;
+    size_t hlen;
+
+    while ((len = recv(p->fd, buf, sizeof(buf), 0)) > 0) {
+        pkt = buf;
+        /* raw IPv4 sockets get the IP header too */
+        if (p->raw && p->addr.ss_family == AF_INET) {
+            hlen = (buf[0] & 0x0f) * 4;
+            if (len < hlen) {
+                continue;
+            }
+            pkt += hlen;
+            len -= hlen;
+        }
+        if (p->addr.ss_family == AF_INET) {
+            icmp = (struct icmphdr *)pkt;
+            if (len < sizeof(*icmp) || icmp->type != ICMP_ECHOREPLY ||
+                (p->raw && ntohs(icmp->un.echo.id) != p->id) ||
+                ntohs(icmp->un.echo.sequence) != seq) {
+                continue;
+            }
+        } else {
+            icmp6 = (struct icmp6_hdr *)pkt;
+            if (len < sizeof(*icmp6) ||
+                icmp6->icmp6_type != ICMP6_ECHO_REPLY ||
+                (p->raw && ntohs(icmp6->icmp6_id) != p->id) ||
+                ntohs(icmp6->icmp6_seq) != seq) {
+                continue;
+            }
+        }
+        if (p->pending) {
+            guest_net_probe_answered(p, g_get_monotonic_time());
+        }
+    }
+    /* e.g. ECONNREFUSED or EHOSTUNREACH from an ICMP error */
+    if (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        guest_net_probe_fail(p, strerror(errno));
+    }
+}
+
+/* one probe to every target, answered or not within @timeout ms */
+static void guest_net_probe_round(GuestNetProbe *probes, int n, uint16_t seq,
+                                  int64_t timeout)
+{
+    struct pollfd *pfds = g_new(struct pollfd, n);
+    int *idx = g_new(int, n);
+    int64_t deadline, left;
+    GuestNetProbe *p;
+    int i, npfds, err;
+    socklen_t errlen;
+
+    for (i = 0; i < n; i++) {
+        if (probes[i].usable) {
+            guest_net_probe_send(&probes[i], seq);
+        }
+    }
+    deadline = g_get_monotonic_time() + timeout * 1000;
+
+    for (;;) {
+        npfds = 0;
+        for (i = 0; i < n; i++) {
+            if (probes[i].pending) {
+                pfds[npfds].fd = probes[i].fd;
+                pfds[npfds].events = probes[i].icmp ? POLLIN : POLLOUT;
+                idx[npfds++] = i;
+            }
+        }
+        left = deadline - g_get_monotonic_time();
+        if (!npfds || left <= 0 || ga_worker_cancelled()) {
+            break;
+        }
+        if (poll(pfds, npfds, (left + 999) / 1000) < 0 && errno != EINTR) {
+            break;
+        }
+        for (i = 0; i < npfds; i++) {
+            if (!pfds[i].revents) {
+                continue;
+            }
+            p = &probes[idx[i]];
+            if (p->icmp) {
+                guest_net_probe_recv(p, seq);
+                continue;
+            }
+            err = 0;
+            errlen = sizeof(err);
+            getsockopt(p->fd, SOL_SOCKET, SO_ERROR, &err, &errlen);
+            if (err) {
+                guest_net_probe_fail(p, strerror(err));
+                p->pending = false;
+            } else {
+                guest_net_probe_answered(p, g_get_monotonic_time());
+            }
+        }
+    }
+
+    /*
+     * Whatever is still pending is lost; late echo replies are skipped in
+     * the next round by their sequence number.
+     */
+    for (i = 0; i < n; i++) {
+        probes[i].pending = false;
+        if (!probes[i].icmp && probes[i].fd >= 0) {
+            close(probes[i].fd);
+            probes[i].fd = -1;
+        }
+    }
+    g_free(pfds);
+    g_free(idx);
+}
+
+GuestNetProbeResultList *qmp_guest_net_probe(GuestNetProbeTargetList *targets,
+                                             bool has_count, int64_t count,
+                                             bool has_timeout, int64_t timeout,
+                                             Error **errp)
+{
+    GuestNetProbeResultList *head = NULL, **link = &head;
+    GuestNetProbeTargetList *t;
+    GuestNetProbe *probes, *p;
+    int n = 0, i, round;
+
+    for (t = targets; t; t = t->next) {
+        if (t->value->has_port &&
+            (t->value->port < 1 || t->value->port > 65535)) {
+            error_setg(errp, "value '%" PRId64 "' is invalid for argument "
+                       "port", t->value->port);
+            return NULL;
+        }
+        n++;
+    }
+    if (!n || n > GUEST_NET_PROBE_MAX_TARGETS) {
+        error_setg(errp, "between 1 and %d targets can be probed",
+                   GUEST_NET_PROBE_MAX_TARGETS);
+        return NULL;
+    }
+    if (!has_count) {
+        count = 3;
+    } else if (count < 1 || count > GUEST_NET_PROBE_MAX_COUNT) {
+        error_setg(errp, "value '%" PRId64 "' is invalid for argument count",
+                   count);
+        return NULL;
+    }
+    if (!has_timeout) {
+        timeout = 1000;
+    } else if (timeout < 1 || timeout > GUEST_NET_PROBE_MAX_TIMEOUT) {
+        error_setg(errp, "value '%" PRId64 "' is invalid for argument "
+                   "timeout", timeout);
+        return NULL;
+    }
+
+    probes = g_new0(GuestNetProbe, n);
+    for (t = targets, i = 0; t; t = t->next, i++) {
+        p = &probes[i];
+        p->fd = -1;
+        p->icmp = !t->value->has_port;
+        p->id = (getpid() + i) & 0xffff;
+        p->res = g_new0(GuestNetProbeResult, 1);
+        p->res->host = g_strdup(t->value->host);
+        p->res->has_port = t->value->has_port;
+        p->res->port = t->value->port;
+        p->usable = guest_net_probe_init(p, t->value);
+    }
+
+    for (round = 0; round < count && !ga_worker_cancelled(); round++) {
+        guest_net_probe_round(probes, n, round, timeout);
+    }
+
+    for (i = 0; i < n; i++) {
+        p = &probes[i];
+        if (p->fd >= 0) {
+            close(p->fd);
+        }
+        if (p->res->received) {
+            p->res->has_rtt_min = p->res->has_rtt_avg = true;
+            p->res->has_rtt_max = true;
+            p->res->rtt_avg = p->rtt_sum / p->res->received;
+        }
+        *link = g_new0(GuestNetProbeResultList, 1);
+        (*link)->value = p->res;
+        link = &(*link)->next;
+    }
+    g_free(probes);
+    return head;
+}
+/*########################################################################################################*/
+
+/*NetworkQueues*/
+/*########################################################################################################*/
+/*
+ * Queue q of an interface is served by the q-th processor of the order
+ * guest_netq_cpus() picks, wrapping around; with more processors than
+ * queues the extra ones send through (and, with RPS, receive for) the
+ * queue they would have got.
+ */
+
+/* the online processors, one per core first, then their siblings */
+static GArray *guest_netq_cpus(Error **errp)
+{
+    GuestLogicalProcessorList *vcpus, *l, *m;
+    GuestLogicalProcessor *v;
+    GArray *cpus, *ranks, *order;
+    Error *local_err = NULL;
+    int64_t rank, max_rank = 0;
+    guint i;
+
+    vcpus = qmp_guest_get_vcpus(&local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return NULL;
+    }
+
+    cpus = g_array_new(false, false, sizeof(int64_t));
+    ranks = g_array_new(false, false, sizeof(int64_t));
+    for (l = vcpus; l; l = l->next) {
+        v = l->value;
+        if (!v->online) {
+            continue;
+        }
+        /* how many online siblings on the same core come before it */
+        rank = 0;
+        for (m = vcpus; m != l && v->has_core_id; m = m->next) {
+            rank += m->value->online && m->value->has_core_id &&
+                    m->value->socket_id == v->socket_id &&
+                    m->value->core_id == v->core_id;
+        }
+        g_array_append_val(cpus, v->logical_id);
+        g_array_append_val(ranks, rank);
+        max_rank = MAX(max_rank, rank);
+    }
+
+    order = g_array_sized_new(false, false, sizeof(int64_t), cpus->len);
+    for (rank = 0; rank <= max_rank; rank++) {
+        for (i = 0; i < cpus->len; i++) {
+            if (g_array_index(ranks, int64_t, i) == rank) {
+                g_array_append_val(order, g_array_index(cpus, int64_t, i));
+            }
+        }
+    }
+
+    g_array_free(cpus, true);
+    g_array_free(ranks, true);
+    qapi_free_GuestLogicalProcessorList(vcpus);
+    return order;
+}
+
+/* the processors queue @q of @nqueues is served by, as a sysfs CPU mask */
+static char *guest_netq_mask(GArray *cpus, int64_t q, int64_t nqueues)
+{
+    uint32_t *words;
+    int64_t cpu, max = 0;
+    GString *mask;
+    guint i, n;
+
+    for (i = 0; i < cpus->len; i++) {
+        max = MAX(max, g_array_index(cpus, int64_t, i));
+    }
+    n = max / 32 + 1;
+    words = g_new0(uint32_t, n);
+    for (i = q; i < cpus->len; i += nqueues) {
+        cpu = g_array_index(cpus, int64_t, i);
+        words[cpu / 32] |= 1U << (cpu % 32);
+    }
+
+    /* 32-bit words, most significant first, separated by commas */
+    mask = g_string_new(NULL);
+    g_string_append_printf(mask, "%x", words[n - 1]);
+    for (i = n - 1; i-- > 0;) {
+        g_string_append_printf(mask, ",%08x", words[i]);
+    }
+    g_free(words);
+    return g_string_free(mask, false);
+}
+
+static int guest_netq_ethtool(int sock, const char *name,
+                              struct ethtool_channels *ch)
+{
+    struct ifreq ifr;
+
+    memset(&ifr, 0, sizeof(ifr));
+    pstrcpy(ifr.ifr_name, sizeof(ifr.ifr_name), name);
+    ifr.ifr_data = (void *)ch;
+    return ioctl(sock, SIOCETHTOOL, &ifr);
+}
+
+/* the virtio device of interface @name, "virtio0", or NULL */
+static char *guest_netq_virtio_dev(const char *name)
+{
+    char *path, *link, *dev = NULL;
+
+    path = g_strdup_printf("/sys/class/net/%s/device/driver", name);
+    link = g_file_read_link(path, NULL);
+    g_free(path);
+    if (link && g_str_has_suffix(link, "/virtio_net")) {
+        g_free(link);
+        path = g_strdup_printf("/sys/class/net/%s/device", name);
+        link = g_file_read_link(path, NULL);
+        g_free(path);
+        dev = link ? g_path_get_basename(link) : NULL;
+    }
+    g_free(link);
+    return dev;
+}
+
+/*
+ * Bind the "virtioN-input.Q" and "virtioN-output.Q" interrupts of queues
+ * below @nqueues to their processor.  Returns how many were bound.
+ */
+static int64_t guest_netq_irqs(const char *dev, int64_t nqueues,
+                               GArray *cpus, Error **errp)
+{
+    char *contents, *line, *nl, *label, *p, *path, *cpu;
+    unsigned int irq, q;
+    int64_t bound = 0;
+    size_t len = strlen(dev);
+    Error *local_err = NULL;
+    GError *gerr = NULL;
+
+    if (!g_file_get_contents("/proc/interrupts", &contents, NULL, &gerr)) {
+        error_setg(errp, "failed to read /proc/interrupts: %s",
+                   gerr->message);
+        g_error_free(gerr);
+        return -1;
+    }
+
+    for (line = contents; line && *line && !local_err; line = nl) {
+        nl = strchr(line, '\n');
+        if (nl) {
+            *nl++ = '\0';
+        }
+        /* " 24:  12  0  PCI-MSI 49153-edge  virtio0-input.0" */
+        label = strrchr(line, ' ');
+        if (!label || sscanf(line, " %u:", &irq) != 1) {
+            continue;
+        }
+        label++;
+        if (strncmp(label, dev, len) || label[len] != '-') {
+            continue;
+        }
+        p = label + len + 1;
+        if (sscanf(p, "input.%u", &q) != 1 &&
+            sscanf(p, "output.%u", &q) != 1) {
+            continue;
+        }
+        if (q >= nqueues) {
+            continue;
+        }
+
+        path = g_strdup_printf("/proc/irq/%u/smp_affinity_list", irq);
+        cpu = g_strdup_printf("%" PRId64, g_array_index(cpus, int64_t,
+                                                        q % cpus->len));
+        ga_write_sysfs_file(AT_FDCWD, path, cpu, strlen(cpu), &local_err);
+        if (local_err && errno == EIO) {
+            /* the kernel manages the affinity of this one */
+            error_free(local_err);
+            local_err = NULL;
+        } else if (!local_err) {
+            bound++;
+        }
+        g_free(cpu);
+        g_free(path);
+    }
+    g_free(contents);
+
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return -1;
+    }
+    return bound;
+}
+
+/* set the "xps_cpus" or "rps_cpus" masks of the tx-Q or rx-Q queues */
+static bool guest_netq_steering(const char *name, const char *dir,
+                                const char *attr, int64_t nqueues,
+                                GArray *cpus, Error **errp)
+{
+    Error *local_err = NULL;
+    char *path, *mask;
+    int64_t q;
+
+    for (q = 0; q < nqueues && !local_err; q++) {
+        path = g_strdup_printf("/sys/class/net/%s/queues/%s-%" PRId64 "/%s",
+                               name, dir, q, attr);
+        mask = guest_netq_mask(cpus, q, nqueues);
+        ga_write_sysfs_file(AT_FDCWD, path, mask, strlen(mask), &local_err);
+        g_free(mask);
+        g_free(path);
+    }
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return false;
+    }
+    return true;
+}
+
+static GuestNetQueues *guest_netq_set(int sock, const char *name,
+                                      bool has_combined, int64_t combined,
+                                      GArray *cpus, bool irq_affinity,
+                                      bool xps, bool rps, Error **errp)
+{
+    struct ethtool_channels ch = { .cmd = ETHTOOL_GCHANNELS };
+    GuestNetQueues *nq;
+    char *dev = NULL;
+    int64_t irqs = 0;
+
+    if (!*name || strlen(name) >= IFNAMSIZ || strchr(name, '/')) {
+        error_setg(errp, "no network interface '%s'", name);
+        return NULL;
+    }
+    if (guest_netq_ethtool(sock, name, &ch) < 0) {
+        if (errno != EOPNOTSUPP) {
+            error_setg_errno(errp, errno, "failed to get the channels of %s",
+                             name);
+            return NULL;
+        }
+        /* a single queue pair */
+        ch.max_combined = ch.combined_count = 1;
+    }
+    if (!has_combined) {
+        combined = MIN(cpus->len, MAX(ch.max_combined, 1));
+    } else if (combined < 1 || combined > MAX(ch.max_combined, 1)) {
+        error_setg(errp, "%s offers 1 to %u channels", name,
+                   MAX(ch.max_combined, 1));
+        return NULL;
+    }
+
+    if (combined != ch.combined_count) {
+        ch.cmd = ETHTOOL_SCHANNELS;
+        ch.combined_count = combined;
+        if (guest_netq_ethtool(sock, name, &ch) < 0) {
+            error_setg_errno(errp, errno, "failed to set the channels of %s",
+                             name);
+            return NULL;
+        }
+    }
+
+    if (irq_affinity) {
+        dev = guest_netq_virtio_dev(name);
+    }
+    if (dev) {
+        irqs = guest_netq_irqs(dev, combined, cpus, errp);
+        g_free(dev);
+        if (irqs < 0) {
+            return NULL;
+        }
+    }
+    if ((xps && !guest_netq_steering(name, "tx", "xps_cpus", combined, cpus,
+                                     errp)) ||
+        (rps && !guest_netq_steering(name, "rx", "rps_cpus", combined, cpus,
+                                     errp))) {
+        return NULL;
+    }
+
+    nq = g_new0(GuestNetQueues, 1);
+    nq->name = g_strdup(name);
+    nq->combined = combined;
+    nq->max_combined = MAX(ch.max_combined, 1);
+    nq->irqs = irqs;
+    return nq;
+}
+
+GuestNetQueuesList *qmp_guest_set_net_queues(bool has_interfaces,
+                                             strList *interfaces,
+                                             bool has_combined,
+                                             int64_t combined,
+                                             bool has_irq_affinity,
+                                             bool irq_affinity, bool has_xps,
+                                             bool xps, bool has_rps, bool rps,
+                                             Error **errp)
+{
+    GuestNetQueuesList *head = NULL, **link = &head, *entry;
+    GuestNetQueues *nq;
+    GPtrArray *names;
+    GArray *cpus;
+    Error *local_err = NULL;
+    struct dirent *de;
+    char *dev;
+    DIR *d;
+    guint i;
+    int sock;
+
+    names = g_ptr_array_new_with_free_func(g_free);
+    if (has_interfaces) {
+        for (; interfaces; interfaces = interfaces->next) {
+            g_ptr_array_add(names, g_strdup(interfaces->value));
+        }
+    } else if ((d = opendir("/sys/class/net"))) {
+        while ((de = readdir(d))) {
+            dev = de->d_name[0] != '.' ? guest_netq_virtio_dev(de->d_name)
+                                       : NULL;
+            if (dev) {
+                g_ptr_array_add(names, g_strdup(de->d_name));
+                g_free(dev);
+            }
+        }
+        closedir(d);
+    }
+    if (!names->len) {
+        g_ptr_array_free(names, true);
+        return NULL;
+    }
+
+    cpus = guest_netq_cpus(errp);
+    if (!cpus) {
+        g_ptr_array_free(names, true);
+        return NULL;
+    }
+    sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        error_setg_errno(errp, errno, "failed to create socket");
+        goto out;
+    }
+
+    for (i = 0; i < names->len && !local_err; i++) {
+        nq = guest_netq_set(sock, g_ptr_array_index(names, i), has_combined,
+                            combined, cpus,
+                            !has_irq_affinity || irq_affinity,
+                            !has_xps || xps, has_rps && rps, &local_err);
+        if (nq) {
+            entry = g_new0(GuestNetQueuesList, 1);
+            entry->value = nq;
+            *link = entry;
+            link = &entry->next;
+        }
+    }
+    close(sock);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        qapi_free_GuestNetQueuesList(head);
+        head = NULL;
+    }
+
+out:
+    g_array_free(cpus, true);
+    g_ptr_array_free(names, true);
+    return head;
+}
+/*########################################################################################################*/
+
+/*Alerts*/
+/*########################################################################################################*/
+#if !defined(CONFIG_QGA_LEAN)
+#define GUEST_ALERT_INTERVAL_DEFAULT 5
+
+/*
+ * A rule set with guest-set-alert-rules and whether its condition held at
+ * the previous check, so that an event is only sent when that changes.  A
+ * disk rule without a mount point keeps the file systems it matches in
+ * @mounts.
+ */
+typedef struct GuestAlert {
+    GuestAlertRule *rule;
+    bool active;
+    GHashTable *mounts;
+} GuestAlert;
+
+static struct {
+    GuestAlert *alerts;
+    int nalerts;
+    int64_t interval;
+    guint source;
+    bool has_oom;
+    int64_t oom_seq;            /* ga_collect_oom_count() at the last check */
+} guest_alert_state;
+
+static void guest_alert_emit(GuestAlert *alert, bool active, double value,
+                             const char *mountpoint)
+{
+    GuestAlertRule *rule = alert->rule;
+
+    g_debug("alert %s %s: %g", GuestAlertType_lookup[rule->type],
+            active ? "raised" : "cleared", value);
+    qapi_event_send_guest_alert(rule->type, active, value,
+                                rule->has_threshold, rule->threshold,
+                                !!mountpoint, mountpoint, &error_abort);
+}
+
+/*
+ * What a disk rule checks for @mountpoint: the percentage of the space used
+ * like df computes it, or for time-to-full the forecast in seconds, -1 if
+ * the file system is not filling up.  False if there is nothing to check
+ * yet.
+ */
+static bool guest_alert_disk_value(GuestAlert *alert, const char *mountpoint,
+                                   double *value, bool *active)
+{
+    GACollectFsForecast fc;
+    struct statvfs buf;
+    uint64_t used, avail;
+
+    if (statvfs(mountpoint, &buf) < 0) {
+        g_debug("failed to statvfs '%s': %s", mountpoint, strerror(errno));
+        return false;
+    }
+    used = buf.f_blocks - buf.f_bfree;
+    avail = buf.f_bavail;
+    ga_collect_fs_usage_add(mountpoint, used * buf.f_frsize,
+                            avail * buf.f_frsize);
+
+    if (alert->rule->type == GUEST_ALERT_TYPE_TIME_TO_FULL) {
+        if (!ga_collect_fs_forecast(mountpoint, &fc)) {
+            return false;
+        }
+        *value = fc.has_time_to_full ? fc.time_to_full : -1;
+        *active = fc.has_time_to_full &&
+                  fc.time_to_full <= alert->rule->threshold;
+        return true;
+    }
+    if (used + avail == 0) {
+        return false;
+    }
+    *value = used * 100.0 / (used + avail);
+    *active = *value >= alert->rule->threshold;
+    return true;
+}
+
+static void guest_alert_check_disks(GuestAlert *alert)
+{
+    GHashTable *active;
+    FsMountList mounts;
+    FsMount *mount;
+    Error *local_err = NULL;
+    double value;
+    bool was, now;
+
+    if (alert->rule->has_mountpoint) {
+        if (guest_alert_disk_value(alert, alert->rule->mountpoint,
+                                   &value, &now) && now != alert->active) {
+            alert->active = now;
+            guest_alert_emit(alert, now, value, alert->rule->mountpoint);
+        }
+        return;
+    }
+
+    QTAILQ_INIT(&mounts);
+    build_fs_mount_list(&mounts, &local_err);
+    if (local_err) {
+        g_debug("%s", error_get_pretty(local_err));
+        error_free(local_err);
+        return;
+    }
+
+    /* file systems that went away are forgotten without an event */
+    active = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    QTAILQ_FOREACH(mount, &mounts, next) {
+        if (g_hash_table_lookup_extended(active, mount->dirname,
+                                         NULL, NULL)) {
+            continue;
+        }
+        was = alert->mounts &&
+              g_hash_table_lookup_extended(alert->mounts, mount->dirname,
+                                           NULL, NULL);
+        if (!guest_alert_disk_value(alert, mount->dirname, &value, &now)) {
+            if (was) {
+                g_hash_table_insert(active, g_strdup(mount->dirname), NULL);
+            }
+            continue;
+        }
+        if (now) {
+            g_hash_table_insert(active, g_strdup(mount->dirname), NULL);
+            if (!was) {
+                guest_alert_emit(alert, true, value, mount->dirname);
+            }
+        } else if (was) {
+            guest_alert_emit(alert, false, value, mount->dirname);
+        }
+    }
+    free_fs_mount_list(&mounts);
+
+    if (alert->mounts) {
+        g_hash_table_destroy(alert->mounts);
+    }
+    alert->mounts = active;
+}
+
+static double guest_alert_mem_available(void)
+{
+    GuestMeminfo mi;
+    Error *local_err = NULL;
+
+    ga_read_meminfo(&mi, &local_err);
+    if (local_err) {
+        g_debug("%s", error_get_pretty(local_err));
+        error_free(local_err);
+        return -1;
+    }
+    return ga_meminfo_available(&mi);
+}
+
+static double guest_alert_load_average(void)
+{
+    char buf[128];
+
+    if (ga_read_proc_file(AT_FDCWD, "/proc/loadavg", buf, sizeof(buf)) <= 0) {
+        return -1;
+    }
+    return g_ascii_strtod(buf, NULL);
+}
+
+static void guest_alert_check_level(GuestAlert *alert, double value,
+                                    bool active)
+{
+    if (value >= 0 && active != alert->active) {
+        alert->active = active;
+        guest_alert_emit(alert, active, value, NULL);
+    }
+}
+
+static gboolean guest_alert_check(gpointer opaque)
+{
+    GuestAlert *alert;
+    Error *local_err = NULL;
+    int64_t oom_seq = 0;
+    double value;
+    int i;
+
+    if (guest_alert_state.has_oom) {
+        guest_oom_scan(&local_err);
+        if (local_err) {
+            g_debug("%s", error_get_pretty(local_err));
+            error_free(local_err);
+        }
+        oom_seq = ga_collect_oom_count();
+    }
+
+    for (i = 0; i < guest_alert_state.nalerts; i++) {
+        alert = &guest_alert_state.alerts[i];
+        switch (alert->rule->type) {
+        case GUEST_ALERT_TYPE_DISK_USAGE:
+        case GUEST_ALERT_TYPE_TIME_TO_FULL:
+            guest_alert_check_disks(alert);
+            break;
+        case GUEST_ALERT_TYPE_MEMORY_AVAILABLE:
+            value = guest_alert_mem_available();
+            guest_alert_check_level(alert, value,
+                                    value <= alert->rule->threshold);
+            break;
+        case GUEST_ALERT_TYPE_LOAD_AVERAGE:
+            value = guest_alert_load_average();
+            guest_alert_check_level(alert, value,
+                                    value >= alert->rule->threshold);
+            break;
+        case GUEST_ALERT_TYPE_OOM_KILL:
+            if (oom_seq > guest_alert_state.oom_seq) {
+                guest_alert_emit(alert, true,
+                                 oom_seq - guest_alert_state.oom_seq, NULL);
+            }
+            break;
+        default:
+            g_assert_not_reached();
+        }
+    }
+    guest_alert_state.oom_seq = oom_seq;
+
+    return G_SOURCE_CONTINUE;
+}
+
+static void guest_alert_cleanup(void)
+{
+    int i;
+
+    if (guest_alert_state.source) {
+        g_source_remove(guest_alert_state.source);
+    }
+    for (i = 0; i < guest_alert_state.nalerts; i++) {
+        qapi_free_GuestAlertRule(guest_alert_state.alerts[i].rule);
+        if (guest_alert_state.alerts[i].mounts) {
+            g_hash_table_destroy(guest_alert_state.alerts[i].mounts);
+        }
+    }
+    g_free(guest_alert_state.alerts);
+    memset(&guest_alert_state, 0, sizeof(guest_alert_state));
+}
+
+static GuestAlertRule *guest_alert_rule_copy(const GuestAlertRule *src)
+{
+    GuestAlertRule *rule = g_new0(GuestAlertRule, 1);
+
+    *rule = *src;
+    rule->mountpoint = g_strdup(src->mountpoint);
+    return rule;
+}
+
+void qmp_guest_set_alert_rules(GuestAlertRuleList *rules, bool has_interval,
+                               int64_t interval, Error **errp)
+{
+    GuestAlertRuleList *l;
+    GuestAlertRule *rule;
+    Error *local_err = NULL;
+    int n = 0;
+
+    if (!has_interval) {
+        interval = GUEST_ALERT_INTERVAL_DEFAULT;
+    } else if (interval < 1 || interval > G_MAXUINT / 1000) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "interval",
+                   "a positive number of seconds");
+        return;
+    }
+
+    for (l = rules; l; l = l->next, n++) {
+        rule = l->value;
+        if (rule->type == GUEST_ALERT_TYPE_OOM_KILL) {
+            continue;
+        }
+        if (!rule->has_threshold) {
+            error_setg(errp, QERR_MISSING_PARAMETER, "threshold");
+            return;
+        }
+        if (rule->has_mountpoint && rule->type != GUEST_ALERT_TYPE_DISK_USAGE &&
+            rule->type != GUEST_ALERT_TYPE_TIME_TO_FULL) {
+            error_setg(errp, "'mountpoint' is only valid for disk-usage and "
+                       "time-to-full");
+            return;
+        }
+    }
+
+    guest_alert_cleanup();
+    if (!n) {
+        return;
+    }
+
+    guest_alert_state.alerts = g_new0(GuestAlert, n);
+    for (l = rules; l; l = l->next) {
+        guest_alert_state.alerts[guest_alert_state.nalerts++].rule =
+            guest_alert_rule_copy(l->value);
+        if (l->value->type == GUEST_ALERT_TYPE_OOM_KILL) {
+            guest_alert_state.has_oom = true;
+        }
+    }
+
+    /* only kills after this point are reported */
+    if (guest_alert_state.has_oom) {
+        guest_oom_scan(&local_err);
+        error_free(local_err);
+        guest_alert_state.oom_seq = ga_collect_oom_count();
+    }
+
+    guest_alert_state.interval = interval;
+    guest_alert_state.source = g_timeout_add_seconds(interval,
+                                                     guest_alert_check, NULL);
+}
+
+GuestAlertRules *qmp_guest_get_alert_rules(Error **errp)
+{
+    GuestAlertRules *info = g_new0(GuestAlertRules, 1);
+    GuestAlertRuleList **tail = &info->rules;
+    int i;
+
+    info->interval = guest_alert_state.nalerts ? guest_alert_state.interval
+                                               : GUEST_ALERT_INTERVAL_DEFAULT;
+    for (i = 0; i < guest_alert_state.nalerts; i++) {
+        *tail = g_new0(GuestAlertRuleList, 1);
+        (*tail)->value =
+            guest_alert_rule_copy(guest_alert_state.alerts[i].rule);
+        tail = &(*tail)->next;
+    }
+    return info;
+}
+#endif /* !CONFIG_QGA_LEAN */
+/*########################################################################################################*/
+
+/*HealthChecks*/
+/*########################################################################################################*/
+#if !defined(CONFIG_QGA_LEAN)
+/*
+ * Checks set with guest-set-health-checks run on timers of the main loop
+ * and only ever update their cached result, which guest-get-health copies.
+ * Connections and child processes are watched, never waited for.
+ */
+#define GUEST_HEALTH_MAX_CHECKS 256
+#define GUEST_HEALTH_MAX_INTERVAL 86400
+#define GUEST_HEALTH_MAX_TIMEOUT 600000
+#define GUEST_HEALTH_TIMEOUT_DEFAULT 5000
+#define GUEST_HEALTH_OUTPUT_MAX 4096
+
+typedef struct GuestHealth {
+    GuestHealthResult *res;
+    int64_t interval;           /* in ms */
+    int64_t timeout;            /* in ms */
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    char *host;
+    char *path;
+    bool has_max_age;
+    int64_t max_age;
+    char *process;
+    char **argv;
+    guint timer;                /* the next run */
+    guint timeout_timer;        /* the end of the run in progress */
+    guint watch;                /* ga_io_add_watch() of @fd */
+    guint child_watch;          /* until the exec child is reaped */
+    int fd;                     /* the socket, or the output of exec */
+    GPid pid;
+    bool connected;
+    bool exited;
+    gint status;
+    GString *buf;               /* the HTTP answer, or the output of exec */
+    int64_t start;
+    int64_t start_real;
+} GuestHealth;
+
+static struct {
+    GuestHealth *checks;
+    int nchecks;
+} guest_health_state;
+
+static gboolean guest_health_run(gpointer opaque);
+
+static void guest_health_schedule(GuestHealth *h, bool first)
+{
+    int32_t ms = h->interval;
+
+    /* spread the first runs over the interval, then keep them apart */
+    if (first) {
+        ms = g_random_int_range(0, ms);
+    } else {
+        ms += g_random_int_range(-ms / 10, ms / 10 + 1);
+    }
+    h->timer = g_timeout_add(ms, guest_health_run, h);
+}
+
+static void guest_health_reap(GPid pid, gint status, gpointer opaque)
+{
+    g_spawn_close_pid(pid);
+}
+
+/* end the run in progress, if any */
+static void guest_health_stop(GuestHealth *h)
+{
+    if (h->timeout_timer) {
+        g_source_remove(h->timeout_timer);
+        h->timeout_timer = 0;
+    }
+    if (h->watch) {
+        ga_io_remove_watch(h->watch);
+        h->watch = 0;
+    }
+    if (h->fd != -1) {
+        close(h->fd);
+        h->fd = -1;
+    }
+    if (h->child_watch) {
+        /* the child is still reaped, but nobody cares about it any more */
+        kill(-h->pid, SIGKILL);
+        g_source_remove(h->child_watch);
+        h->child_watch = 0;
+        g_child_watch_add(h->pid, guest_health_reap, NULL);
+    }
+    if (h->buf) {
+        g_string_free(h->buf, true);
+        h->buf = NULL;
+    }
+    h->connected = false;
+    h->exited = false;
+}
+
+static void guest_health_finish(GuestHealth *h, bool passed, const char *msg)
+{
+    GuestHealthResult *res = h->res;
+
+    res->status = passed ? GUEST_HEALTH_STATUS_PASSING
+                         : GUEST_HEALTH_STATUS_FAILING;
+    res->has_last_run = true;
+    res->last_run = h->start_real * 1000;
+    res->has_duration = true;
+    res->duration = g_get_monotonic_time() - h->start;
+    g_free(res->message);
+    res->has_message = msg && *msg;
+    res->message = res->has_message ? g_strdup(msg) : NULL;
+    res->failures = passed ? 0 : res->failures + 1;
+
+    guest_health_stop(h);
+    guest_health_schedule(h, false);
+}
+
+static void guest_health_fail_errno(GuestHealth *h, int err)
+{
+    guest_health_finish(h, false, strerror(err));
+}
+
+static gboolean guest_health_timed_out(gpointer opaque)
+{
+    GuestHealth *h = opaque;
+
+    h->timeout_timer = 0;
+    guest_health_finish(h, false, "timed out");
+    return G_SOURCE_REMOVE;
+}
+
+static void guest_health_watch(GuestHealth *h, GIOCondition cond,
+                               GIOFunc func)
+{
+    GIOChannel *channel = g_io_channel_unix_new(h->fd);
+
+    h->watch = ga_io_add_watch(channel, cond, func, h);
+    g_io_channel_unref(channel);
+}
+
+/* the status line of the HTTP answer in @h->buf, once it is complete */
+static gboolean guest_health_http_readable(GIOChannel *channel,
+                                           GIOCondition cond, gpointer opaque)
+{
+    GuestHealth *h = opaque;
+    char buf[512], *msg;
+    ssize_t len;
+    int code;
+
+    len = read(h->fd, buf, sizeof(buf));
+    if (len < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return G_SOURCE_CONTINUE;
+    }
+    if (len < 0) {
+        h->watch = 0;
+        guest_health_fail_errno(h, errno);
+        return G_SOURCE_REMOVE;
+    }
+    g_string_append_len(h->buf, buf, len);
+    if (len && !strchr(h->buf->str, '\n') && h->buf->len < sizeof(buf)) {
+        return G_SOURCE_CONTINUE;
+    }
+
+    h->watch = 0;
+    if (sscanf(h->buf->str, "HTTP/%*d.%*d %d", &code) != 1) {
+        guest_health_finish(h, false, "invalid HTTP answer");
+    } else if (code < 200 || code >= 400) {
+        msg = g_strdup_printf("HTTP status %d", code);
+        guest_health_finish(h, false, msg);
+        g_free(msg);
+    } else {
+        guest_health_finish(h, true, NULL);
+    }
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean guest_health_connected(GIOChannel *channel,
+                                       GIOCondition cond, gpointer opaque)
+{
+    GuestHealth *h = opaque;
+    socklen_t optlen = sizeof(int);
+    char *request;
+    ssize_t len;
+    int err = 0;
+
+    h->watch = 0;
+    if (getsockopt(h->fd, SOL_SOCKET, SO_ERROR, &err, &optlen) < 0) {
+        err = errno;
+    }
+    if (err) {
+        guest_health_fail_errno(h, err);
+        return G_SOURCE_REMOVE;
+    }
+    if (h->res->type == GUEST_HEALTH_CHECK_TYPE_TCP) {
+        guest_health_finish(h, true, NULL);
+        return G_SOURCE_REMOVE;
+    }
+
+    /* the request is small enough for the empty send buffer */
+    request = g_strdup_printf("GET %s HTTP/1.0\r\n"
+                              "Host: %s%s%s\r\n"
+                              "Connection: close\r\n\r\n", h->path,
+                              strchr(h->host, ':') ? "[" : "", h->host,
+                              strchr(h->host, ':') ? "]" : "");
+    len = send(h->fd, request, strlen(request), MSG_NOSIGNAL);
+    err = errno;
+    if (len != strlen(request)) {
+        g_free(request);
+        guest_health_fail_errno(h, len < 0 ? err : EAGAIN);
+        return G_SOURCE_REMOVE;
+    }
+    g_free(request);
+
+    h->connected = true;
+    h->buf = g_string_new("");
+    guest_health_watch(h, G_IO_IN | G_IO_HUP | G_IO_ERR,
+                       guest_health_http_readable);
+    return G_SOURCE_REMOVE;
+}
+
+static void guest_health_connect(GuestHealth *h)
+{
+    h->fd = socket(h->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK |
+                   SOCK_CLOEXEC, 0);
+    if (h->fd == -1 ||
+        (connect(h->fd, (struct sockaddr *)&h->addr, h->addrlen) < 0 &&
+         errno != EINPROGRESS)) {
+        guest_health_fail_errno(h, errno);
+        return;
+    }
+    h->timeout_timer = g_timeout_add(h->timeout, guest_health_timed_out, h);
+    guest_health_watch(h, G_IO_OUT, guest_health_connected);
+}
+
+static void guest_health_check_file(GuestHealth *h)
+{
+    struct stat st;
+    int64_t age;
+    char *msg;
+
+    if (stat(h->path, &st) < 0) {
+        guest_health_fail_errno(h, errno);
+        return;
+    }
+    age = h->start_real / G_USEC_PER_SEC - st.st_mtime;
+    if (h->has_max_age && age > h->max_age) {
+        msg = g_strdup_printf("modified %" PRId64 " seconds ago", age);
+        guest_health_finish(h, false, msg);
+        g_free(msg);
+        return;
+    }
+    guest_health_finish(h, true, NULL);
+}
+
+/* only the names of the processes are read, nothing else of /proc */
+static void guest_health_check_process(GuestHealth *h)
+{
+    DIR *dir = opendir("/proc");
+    struct dirent *de;
+    char path[NAME_MAX + 8], comm[64];
+    bool found = false;
+
+    if (!dir) {
+        guest_health_fail_errno(h, errno);
+        return;
+    }
+    while (!found && (de = readdir(dir))) {
+        if (!g_ascii_isdigit(de->d_name[0])) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/comm", de->d_name);
+        if (ga_read_proc_file(dirfd(dir), path, comm, sizeof(comm)) > 0) {
+            found = !strcmp(g_strchomp(comm), h->process);
+        }
+    }
+    closedir(dir);
+
+    guest_health_finish(h, found, found ? NULL : "no such process");
+}
+
+static void guest_health_exec_done(GuestHealth *h)
+{
+    GuestHealthResult *res = h->res;
+    char *msg;
+
+    if (h->fd != -1 || !h->exited) {
+        return;
+    }
+    res->has_exit_code = WIFEXITED(h->status);
+    res->exit_code = WIFEXITED(h->status) ? WEXITSTATUS(h->status) : 0;
+    if (h->buf->len || WIFEXITED(h->status)) {
+        msg = g_strndup(h->buf->str, h->buf->len);
+    } else {
+        msg = g_strdup_printf("killed by signal %d", WTERMSIG(h->status));
+    }
+    guest_health_finish(h, res->has_exit_code && !res->exit_code, msg);
+    g_free(msg);
+}
+
+static void guest_health_exited(GPid pid, gint status, gpointer opaque)
+{
+    GuestHealth *h = opaque;
+
+    g_spawn_close_pid(pid);
+    h->child_watch = 0;
+    h->exited = true;
+    h->status = status;
+    guest_health_exec_done(h);
+}
+
+static gboolean guest_health_exec_readable(GIOChannel *channel,
+                                           GIOCondition cond, gpointer opaque)
+{
+    GuestHealth *h = opaque;
+    char buf[1024];
+    ssize_t len;
+
+    len = read(h->fd, buf, sizeof(buf));
+    if (len < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return G_SOURCE_CONTINUE;
+    }
+    if (len > 0) {
+        /* the rest is read and dropped, so that the child is not blocked */
+        g_string_append_len(h->buf, buf,
+                            MIN(len, GUEST_HEALTH_OUTPUT_MAX - h->buf->len));
+        return G_SOURCE_CONTINUE;
+    }
+
+    h->watch = 0;
+    close(h->fd);
+    h->fd = -1;
+    guest_health_exec_done(h);
+    return G_SOURCE_REMOVE;
+}
+
+/* in the child: its own process group, which a timeout kills as a whole */
+static void guest_health_child_setup(gpointer opaque)
+{
+    setpgid(0, 0);
+    dup2(STDOUT_FILENO, STDERR_FILENO);
+}
+
+static void guest_health_exec(GuestHealth *h)
+{
+    GError *gerr = NULL;
+    int fd;
+
+    if (!g_spawn_async_with_pipes(NULL, h->argv, NULL,
+                                  G_SPAWN_SEARCH_PATH |
+                                  G_SPAWN_DO_NOT_REAP_CHILD,
+                                  guest_health_child_setup, NULL, &h->pid,
+                                  NULL, &fd, NULL, &gerr)) {
+        guest_health_finish(h, false, gerr->message);
+        g_error_free(gerr);
+        return;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    h->fd = fd;
+    h->buf = g_string_new("");
+    h->child_watch = g_child_watch_add(h->pid, guest_health_exited, h);
+    h->timeout_timer = g_timeout_add(h->timeout, guest_health_timed_out, h);
+    guest_health_watch(h, G_IO_IN | G_IO_HUP | G_IO_ERR,
+                       guest_health_exec_readable);
+}
+
+static gboolean guest_health_run(gpointer opaque)
+{
+    GuestHealth *h = opaque;
+
+    h->timer = 0;
+    h->start = g_get_monotonic_time();
+    h->start_real = g_get_real_time();
+
+    switch (h->res->type) {
+    case GUEST_HEALTH_CHECK_TYPE_TCP:
+    case GUEST_HEALTH_CHECK_TYPE_HTTP:
+        guest_health_connect(h);
+        break;
+    case GUEST_HEALTH_CHECK_TYPE_FILE:
+        guest_health_check_file(h);
+        break;
+    case GUEST_HEALTH_CHECK_TYPE_PROCESS:
+        guest_health_check_process(h);
+        break;
+    case GUEST_HEALTH_CHECK_TYPE_EXEC:
+        guest_health_exec(h);
+        break;
+    default:
+        g_assert_not_reached();
+    }
+    return G_SOURCE_REMOVE;
+}
+
+static void guest_health_free(GuestHealth *h)
+{
+    qapi_free_GuestHealthResult(h->res);
+    g_free(h->host);
+    g_free(h->path);
+    g_free(h->process);
+    g_strfreev(h->argv);
+}
+
+static void guest_health_cleanup(void)
+{
+    GuestHealth *h;
+    int i;
+
+    for (i = 0; i < guest_health_state.nchecks; i++) {
+        h = &guest_health_state.checks[i];
+        guest_health_stop(h);
+        if (h->timer) {
+            g_source_remove(h->timer);
+        }
+        guest_health_free(h);
+    }
+    g_free(guest_health_state.checks);
+    memset(&guest_health_state, 0, sizeof(guest_health_state));
+}
+
+/* check @c and fill in @h, which owns nothing yet if that fails */
+static bool guest_health_init(GuestHealth *h, GuestHealthCheck *c,
+                              Error **errp)
+{
+    struct addrinfo hints, *ai;
+    strList *l;
+    int ret, i;
+
+    if (c->interval < 1 || c->interval > GUEST_HEALTH_MAX_INTERVAL) {
+        error_setg(errp, "value '%" PRId64 "' is invalid for argument "
+                   "interval", c->interval);
+        return false;
+    }
+    h->timeout = c->has_timeout ? c->timeout : GUEST_HEALTH_TIMEOUT_DEFAULT;
+    if (h->timeout < 1 || h->timeout > GUEST_HEALTH_MAX_TIMEOUT) {
+        error_setg(errp, "value '%" PRId64 "' is invalid for argument "
+                   "timeout", h->timeout);
+        return false;
+    }
+
+    switch (c->type) {
+    case GUEST_HEALTH_CHECK_TYPE_TCP:
+    case GUEST_HEALTH_CHECK_TYPE_HTTP:
+        if (!c->has_port) {
+            error_setg(errp, QERR_MISSING_PARAMETER, "port");
+            return false;
+        }
+        if (c->port < 1 || c->port > 65535) {
+            error_setg(errp, "value '%" PRId64 "' is invalid for argument "
+                       "port", c->port);
+            return false;
+        }
+        if (c->has_path && (c->path[0] != '/' || strpbrk(c->path, "\r\n "))) {
+            error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "path",
+                       "an absolute URL path");
+            return false;
+        }
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+        ret = getaddrinfo(c->has_host ? c->host : "127.0.0.1", NULL,
+                          &hints, &ai);
+        if (ret) {
+            error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "host",
+                       "an IP address");
+            return false;
+        }
+        memcpy(&h->addr, ai->ai_addr, ai->ai_addrlen);
+        h->addrlen = ai->ai_addrlen;
+        freeaddrinfo(ai);
+        if (h->addr.ss_family == AF_INET) {
+            ((struct sockaddr_in *)&h->addr)->sin_port = htons(c->port);
+        } else {
+            ((struct sockaddr_in6 *)&h->addr)->sin6_port = htons(c->port);
+        }
+        h->host = g_strdup(c->has_host ? c->host : "127.0.0.1");
+        h->path = g_strdup(c->has_path ? c->path : "/");
+        break;
+    case GUEST_HEALTH_CHECK_TYPE_FILE:
+        if (!c->has_path) {
+            error_setg(errp, QERR_MISSING_PARAMETER, "path");
+            return false;
+        }
+        if (c->has_max_age && c->max_age < 0) {
+            error_setg(errp, "value '%" PRId64 "' is invalid for argument "
+                       "max-age", c->max_age);
+            return false;
+        }
+        h->path = g_strdup(c->path);
+        h->has_max_age = c->has_max_age;
+        h->max_age = c->max_age;
+        break;
+    case GUEST_HEALTH_CHECK_TYPE_PROCESS:
+        if (!c->has_process) {
+            error_setg(errp, QERR_MISSING_PARAMETER, "process");
+            return false;
+        }
+        h->process = g_strdup(c->process);
+        break;
+    case GUEST_HEALTH_CHECK_TYPE_EXEC:
+        if (!c->has_argv || !c->argv) {
+            error_setg(errp, QERR_MISSING_PARAMETER, "argv");
+            return false;
+        }
+        for (l = c->argv, i = 0; l; l = l->next) {
+            i++;
+        }
+        h->argv = g_new0(char *, i + 1);
+        for (l = c->argv, i = 0; l; l = l->next) {
+            h->argv[i++] = g_strdup(l->value);
+        }
+        break;
+    default:
+        g_assert_not_reached();
+    }
+
+    h->interval = c->interval * 1000;
+    h->fd = -1;
+    h->res = g_new0(GuestHealthResult, 1);
+    h->res->name = g_strdup(c->name);
+    h->res->type = c->type;
+    h->res->status = GUEST_HEALTH_STATUS_PENDING;
+    return true;
+}
+
+void qmp_guest_set_health_checks(GuestHealthCheckList *checks, Error **errp)
+{
+    GuestHealthCheckList *l, *m;
+    GuestHealth *list;
+    int n = 0, i;
+
+    for (l = checks; l; l = l->next, n++) {
+        for (m = l->next; m; m = m->next) {
+            if (!strcmp(l->value->name, m->value->name)) {
+                error_setg(errp, "check '%s' is given twice", l->value->name);
+                return;
+            }
+        }
+    }
+    if (n > GUEST_HEALTH_MAX_CHECKS) {
+        error_setg(errp, "at most %d checks can be set",
+                   GUEST_HEALTH_MAX_CHECKS);
+        return;
+    }
+
+    list = g_new0(GuestHealth, MAX(n, 1));
+    for (l = checks, i = 0; l; l = l->next, i++) {
+        if (!guest_health_init(&list[i], l->value, errp)) {
+            while (i--) {
+                guest_health_free(&list[i]);
+            }
+            g_free(list);
+            return;
+        }
+    }
+
+    guest_health_cleanup();
+    if (!n) {
+        g_free(list);
+        return;
+    }
+    guest_health_state.checks = list;
+    guest_health_state.nchecks = n;
+    for (i = 0; i < n; i++) {
+        guest_health_schedule(&list[i], true);
+    }
+}
+
+GuestHealthResultList *qmp_guest_get_health(Error **errp)
+{
+    GuestHealthResultList *head = NULL, **link = &head;
+    GuestHealthResult *res, *src;
+    int i;
+
+    for (i = 0; i < guest_health_state.nchecks; i++) {
+        src = guest_health_state.checks[i].res;
+        res = g_new0(GuestHealthResult, 1);
+        *res = *src;
+        res->name = g_strdup(src->name);
+        res->message = g_strdup(src->message);
+        *link = g_new0(GuestHealthResultList, 1);
+        (*link)->value = res;
+        link = &(*link)->next;
+    }
+    return head;
+}
+#endif /* !CONFIG_QGA_LEAN */
+/*########################################################################################################*/
+
+/*FileWatch*/
+/*########################################################################################################*/
+/* changes are held this long so that a burst of them is delivered once */
+#define GUEST_FILE_WATCH_DELAY_MS 100
+#define GUEST_FILE_WATCH_CHANGES_MAX 4096
+
+static const uint32_t guest_file_watch_masks[GUEST_FILE_WATCH_EVENT__MAX] = {
+    [GUEST_FILE_WATCH_EVENT_MODIFY] = IN_MODIFY,
+    [GUEST_FILE_WATCH_EVENT_ATTRIB] = IN_ATTRIB,
+    [GUEST_FILE_WATCH_EVENT_CLOSE_WRITE] = IN_CLOSE_WRITE,
+    [GUEST_FILE_WATCH_EVENT_CREATE] = IN_CREATE,
+    [GUEST_FILE_WATCH_EVENT_DELETE] = IN_DELETE,
+    [GUEST_FILE_WATCH_EVENT_MOVE] = IN_MOVE,
+    [GUEST_FILE_WATCH_EVENT_DELETE_SELF] = IN_DELETE_SELF,
+    [GUEST_FILE_WATCH_EVENT_MOVE_SELF] = IN_MOVE_SELF,
+    [GUEST_FILE_WATCH_EVENT_GONE] = IN_IGNORED,
+};
+
+typedef struct GuestFileWatcher {
+    int wd;
+    char *path;
+    bool notify;
+} GuestFileWatcher;
+
+/* the changes to @path seen by watch @wd since they were last delivered */
+typedef struct GuestFilePendingChange {
+    char *key;                  /* "@wd @path" */
+    int wd;
+    char *path;
+    uint32_t mask;
+    int64_t count;
+    bool notify;
+} GuestFilePendingChange;
+
+static struct {
+    int fd;
+    guint watch;                /* ga_io_add_watch() of @fd */
+    GHashTable *watchers;       /* wd -> GuestFileWatcher */
+    GHashTable *pending;        /* key -> GuestFilePendingChange */
+    GQueue queue;               /* the same, oldest first */
+    int nread;                  /* those for guest-file-watch-read */
+    bool overflow;
+    guint flush_timer;
+    GAPendingResponse *reader;  /* a guest-file-watch-read that waits */
+    guint reader_timer;
+} guest_fwatch_state = { .fd = -1 };
+
+static GuestFileWatchEventList *guest_fwatch_events(uint32_t mask)
+{
+    GuestFileWatchEventList *head = NULL, **tail = &head;
+    int i;
+
+    for (i = 0; i < GUEST_FILE_WATCH_EVENT__MAX; i++) {
+        if (mask & guest_file_watch_masks[i]) {
+            *tail = g_new0(GuestFileWatchEventList, 1);
+            (*tail)->value = i;
+            tail = &(*tail)->next;
+        }
+    }
+    return head;
+}
+
+static void guest_fwatch_drop(GList *link)
+{
+    GuestFilePendingChange *c = link->data;
+
+    g_hash_table_remove(guest_fwatch_state.pending, c->key);
+    g_queue_delete_link(&guest_fwatch_state.queue, link);
+    if (!c->notify) {
+        guest_fwatch_state.nread--;
+    }
+    g_free(c->key);
+    g_free(c->path);
+    g_free(c);
+}
+
+/* take the changes for guest-file-watch-read */
+static GuestFileChanges *guest_fwatch_take(void)
+{
+    GuestFileChanges *changes = g_new0(GuestFileChanges, 1);
+    GuestFileChangeList **tail = &changes->changes;
+    GuestFilePendingChange *c;
+    GList *l, *next;
+
+    for (l = guest_fwatch_state.queue.head; l; l = next) {
+        next = l->next;
+        c = l->data;
+        if (c->notify) {
+            continue;
+        }
+        *tail = g_new0(GuestFileChangeList, 1);
+        (*tail)->value = g_new0(GuestFileChange, 1);
+        (*tail)->value->watch = c->wd;
+        (*tail)->value->path = g_strdup(c->path);
+        (*tail)->value->events = guest_fwatch_events(c->mask);
+        (*tail)->value->count = c->count;
+        tail = &(*tail)->next;
+        guest_fwatch_drop(l);
+    }
+    changes->overflow = guest_fwatch_state.overflow;
+    guest_fwatch_state.overflow = false;
+    return changes;
+}
+
+/* the answer to a guest-file-watch-read that waited */
+static QObject *guest_fwatch_read_result(void *opaque, Error **errp)
+{
+    GuestFileChanges *changes;
+    JsonOutputVisitor *jov;
+    QObject *ret = NULL;
+    Error *err = NULL;
+
+    /* keep the changes for the next read if the client went away */
+    if (!ga_get_session(ga_state)) {
+        return NULL;
+    }
+
+    changes = guest_fwatch_take();
+    jov = json_output_visitor_new();
+    visit_type_GuestFileChanges(json_output_get_visitor(jov), &changes,
+                                "unused", &err);
+    if (!err) {
+        ret = json_output_get_qobject(jov);
+    }
+    error_propagate(errp, err);
+    json_output_visitor_cleanup(jov);
+    qapi_free_GuestFileChanges(changes);
+    return ret;
+}
+
+static void guest_fwatch_read_done(void)
+{
+    GAPendingResponse *reader = guest_fwatch_state.reader;
+
+    if (!reader) {
+        return;
+    }
+    if (guest_fwatch_state.reader_timer) {
+        g_source_remove(guest_fwatch_state.reader_timer);
+        guest_fwatch_state.reader_timer = 0;
+    }
+    guest_fwatch_state.reader = NULL;
+    ga_complete_response(ga_state, reader, guest_fwatch_read_result, NULL);
+}
+
+static gboolean guest_fwatch_read_timeout(gpointer opaque)
+{
+    guest_fwatch_state.reader_timer = 0;
+    guest_fwatch_read_done();
+    return false;
+}
+
+static gboolean guest_fwatch_flush(gpointer opaque)
+{
+    GuestFileWatchEventList *events;
+    GuestFilePendingChange *c;
+    GList *l, *next;
+
+    guest_fwatch_state.flush_timer = 0;
+    for (l = guest_fwatch_state.queue.head; l; l = next) {
+        next = l->next;
+        c = l->data;
+        if (!c->notify) {
+            continue;
+        }
+        events = guest_fwatch_events(c->mask);
+        qapi_event_send_guest_file_changed(c->wd, c->path, events, c->count,
+                                           &error_abort);
+        qapi_free_GuestFileWatchEventList(events);
+        guest_fwatch_drop(l);
+    }
+    if (guest_fwatch_state.nread || guest_fwatch_state.overflow) {
+        guest_fwatch_read_done();
+    }
+    return false;
+}
+
+static void guest_fwatch_record(const struct inotify_event *ev)
+{
+    GuestFileWatcher *w;
+    GuestFilePendingChange *c;
+    char *path, *key;
+
+    w = g_hash_table_lookup(guest_fwatch_state.watchers,
+                            GINT_TO_POINTER(ev->wd));
+    if (!w) {
+        /* IN_Q_OVERFLOW, or what was left of a removed watch */
+        guest_fwatch_state.overflow |= !!(ev->mask & IN_Q_OVERFLOW);
+        goto out;
+    }
+
+    path = ev->len ? g_build_filename(w->path, ev->name, NULL)
+                   : g_strdup(w->path);
+    key = g_strdup_printf("%d %s", ev->wd, path);
+    c = g_hash_table_lookup(guest_fwatch_state.pending, key);
+    if (c) {
+        c->mask |= ev->mask;
+        c->count++;
+        g_free(key);
+        g_free(path);
+    } else if (g_queue_get_length(&guest_fwatch_state.queue) >=
+               GUEST_FILE_WATCH_CHANGES_MAX) {
+        guest_fwatch_state.overflow = true;
+        g_free(key);
+        g_free(path);
+    } else {
+        c = g_new0(GuestFilePendingChange, 1);
+        c->key = key;
+        c->wd = ev->wd;
+        c->path = path;
+        c->mask = ev->mask;
+        c->count = 1;
+        c->notify = w->notify;
+        g_hash_table_insert(guest_fwatch_state.pending, c->key, c);
+        g_queue_push_tail(&guest_fwatch_state.queue, c);
+        if (!c->notify) {
+            guest_fwatch_state.nread++;
+        }
+    }
+
+    if (ev->mask & IN_IGNORED) {
+        g_hash_table_remove(guest_fwatch_state.watchers,
+                            GINT_TO_POINTER(ev->wd));
+    }
+
+out:
+    if (!guest_fwatch_state.flush_timer) {
+        guest_fwatch_state.flush_timer =
+            g_timeout_add(GUEST_FILE_WATCH_DELAY_MS, guest_fwatch_flush, NULL);
+    }
+}
+
+static gboolean guest_fwatch_readable(GIOChannel *channel,
+                                      GIOCondition condition, gpointer opaque)
+{
+    char buf[4096]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *ev;
+    ssize_t len;
+    char *p;
+
+    for (;;) {
+        len = read(guest_fwatch_state.fd, buf, sizeof(buf));
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+        if (len <= 0) {
+            break;
+        }
+        for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+            ev = (const struct inotify_event *)p;
+            guest_fwatch_record(ev);
+        }
+    }
+    return true;
+}
+
+static void guest_fwatch_watcher_free(gpointer data)
+{
+    GuestFileWatcher *w = data;
+
+    g_free(w->path);
+    g_free(w);
+}
+
+static bool guest_fwatch_open(Error **errp)
+{
+    GIOChannel *channel;
+
+    if (guest_fwatch_state.fd != -1) {
+        return true;
+    }
+    guest_fwatch_state.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (guest_fwatch_state.fd == -1) {
+        error_setg_errno(errp, errno, "failed to initialize inotify");
+        return false;
+    }
+    channel = g_io_channel_unix_new(guest_fwatch_state.fd);
+    guest_fwatch_state.watch = ga_io_add_watch(channel, G_IO_IN,
+                                               guest_fwatch_readable, NULL);
+    g_io_channel_unref(channel);
+    guest_fwatch_state.watchers =
+        g_hash_table_new_full(NULL, NULL, NULL, guest_fwatch_watcher_free);
+    guest_fwatch_state.pending = g_hash_table_new(g_str_hash, g_str_equal);
+    g_queue_init(&guest_fwatch_state.queue);
+    return true;
+}
+
+static void guest_fwatch_cleanup(void)
+{
+    if (guest_fwatch_state.fd == -1) {
+        return;
+    }
+    while (guest_fwatch_state.queue.head) {
+        guest_fwatch_drop(guest_fwatch_state.queue.head);
+    }
+    if (guest_fwatch_state.flush_timer) {
+        g_source_remove(guest_fwatch_state.flush_timer);
+    }
+    if (guest_fwatch_state.reader_timer) {
+        g_source_remove(guest_fwatch_state.reader_timer);
+    }
+    ga_io_remove_watch(guest_fwatch_state.watch);
+    close(guest_fwatch_state.fd);
+    g_hash_table_destroy(guest_fwatch_state.watchers);
+    g_hash_table_destroy(guest_fwatch_state.pending);
+    memset(&guest_fwatch_state, 0, sizeof(guest_fwatch_state));
+    guest_fwatch_state.fd = -1;
+}
+
+GuestFileWatch *qmp_guest_file_watch(const char *path, bool has_events,
+                                     GuestFileWatchEventList *events,
+                                     bool has_notify, bool notify,
+                                     Error **errp)
+{
+    GuestFileWatchEventList *e;
+    GuestFileWatcher *w;
+    GuestFileWatch *ret;
+    uint32_t mask = 0;
+    int wd, i;
+
+    if (has_events) {
+        for (e = events; e; e = e->next) {
+            mask |= guest_file_watch_masks[e->value];
+        }
+    } else {
+        for (i = 0; i < GUEST_FILE_WATCH_EVENT__MAX; i++) {
+            mask |= guest_file_watch_masks[i];
+        }
+    }
+    /* IN_IGNORED always comes, asking for it is meaningless */
+    mask &= ~IN_IGNORED;
+
+    if (!guest_fwatch_open(errp)) {
+        return NULL;
+    }
+    wd = inotify_add_watch(guest_fwatch_state.fd, path, mask);
+    if (wd < 0) {
+        error_setg_errno(errp, errno, "failed to watch '%s'", path);
+        return NULL;
+    }
+    slog("guest-file-watch called, path: %s", path);
+
+    w = g_hash_table_lookup(guest_fwatch_state.watchers, GINT_TO_POINTER(wd));
+    if (!w) {
+        w = g_new0(GuestFileWatcher, 1);
+        w->wd = wd;
+        w->path = g_strdup(path);
+        g_hash_table_insert(guest_fwatch_state.watchers, GINT_TO_POINTER(wd),
+                            w);
+    }
+    w->notify = has_notify && notify;
+
+    ret = g_new0(GuestFileWatch, 1);
+    ret->watch = wd;
+    return ret;
+}
+
+void qmp_guest_file_unwatch(int64_t watch, Error **errp)
+{
+    GuestFilePendingChange *c;
+    GList *l, *next;
+
+    if (guest_fwatch_state.fd == -1 || watch < 0 || watch > INT_MAX ||
+        !g_hash_table_lookup(guest_fwatch_state.watchers,
+                             GINT_TO_POINTER(watch))) {
+        error_setg(errp, QERR_INVALID_PARAMETER, "watch");
+        return;
+    }
+
+    /* its IN_IGNORED finds no watcher and is dropped */
+    inotify_rm_watch(guest_fwatch_state.fd, watch);
+    g_hash_table_remove(guest_fwatch_state.watchers, GINT_TO_POINTER(watch));
+    for (l = guest_fwatch_state.queue.head; l; l = next) {
+        next = l->next;
+        c = l->data;
+        if (c->wd == watch) {
+            guest_fwatch_drop(l);
+        }
+    }
+}
+
+GuestFileChanges *qmp_guest_file_watch_read(bool has_timeout_ms,
+                                            int64_t timeout_ms, Error **errp)
+{
+    if (has_timeout_ms && timeout_ms < 0) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "timeout-ms",
+                   "a non-negative number");
+        return NULL;
+    }
+    if (guest_fwatch_state.fd == -1) {
+        return g_new0(GuestFileChanges, 1);
+    }
+
+    /* a new read takes over from one still waiting */
+    guest_fwatch_read_done();
+
+    if (guest_fwatch_state.nread || guest_fwatch_state.overflow ||
+        (has_timeout_ms && !timeout_ms)) {
+        return guest_fwatch_take();
+    }
+    guest_fwatch_state.reader = ga_defer_response(ga_state);
+    if (!guest_fwatch_state.reader) {
+        /* no id, so it cannot be answered out of order */
+        return guest_fwatch_take();
+    }
+    if (has_timeout_ms) {
+        guest_fwatch_state.reader_timer =
+            g_timeout_add(MIN(timeout_ms, G_MAXUINT),
+                          guest_fwatch_read_timeout, NULL);
+    }
+
+    /* dropped, the answer comes from guest_fwatch_read_done() */
+    return g_new0(GuestFileChanges, 1);
+}
+
+/*FileCopy*/
+/*########################################################################################################*/
+/* Most jobs kept at a time, running or waiting for their status */
+#define GUEST_FCOPY_MAX_JOBS 16
+/* copied per system call, so that progress and cancels are seen */
+#define GUEST_FCOPY_CHUNK (16 * 1024 * 1024)
+#define GUEST_FCOPY_BUF (1024 * 1024)
+
+/*
+ * A job copies on a thread pool of its own with a single thread.
+ * @method, @done, @error, @finished and @cancelled are shared by the
+ * thread and the main loop and protected by @lock.
+ */
+typedef struct GuestFcopyJob {
+    int64_t id;
+    FILE *src, *dst;
+    int64_t offset;
+    int64_t total;
+    bool whole;                 /* of the source, which can be cloned */
+    GThreadPool *pool;
+    CompatGMutex lock;
+    GuestFileCopyMethod method;
+    bool started;
+    int64_t done;
+    char *error;
+    bool finished;
+    bool cancelled;
+    QTAILQ_ENTRY(GuestFcopyJob) next;
+} GuestFcopyJob;
+
+static struct {
+    QTAILQ_HEAD(, GuestFcopyJob) jobs;
+    unsigned int count;
+    int64_t last_id;
+} guest_fcopy_state = {
+    .jobs = QTAILQ_HEAD_INITIALIZER(guest_fcopy_state.jobs),
+};
+
+/* whether the kernel or the filesystems turned @method down */
+static bool guest_fcopy_unsupported(int err)
+{
+    return err == ENOSYS || err == EXDEV || err == EINVAL ||
+           err == EOPNOTSUPP;
+}
+
+/*
+ * Copy up to @len bytes from @in to @out with *@method, moving on to the
+ * next method while the current one is not supported.  The number of
+ * bytes copied, 0 at the end of the source, or -errno.
+ */
+static ssize_t guest_fcopy_step(GuestFcopyJob *job,
+                                GuestFileCopyMethod *method,
+                                int64_t in, int64_t out, size_t len,
+                                char **buf)
+{
+    int src = fileno(job->src), dst = fileno(job->dst);
+    loff_t in_off = in, out_off = out;
+    off_t off = in;
+    ssize_t ret, n, w;
+
+    for (;;) {
+        switch (*method) {
+        case GUEST_FILE_COPY_METHOD_COPY_FILE_RANGE:
+#ifdef __NR_copy_file_range
+            ret = syscall(__NR_copy_file_range, src, &in_off, dst, &out_off,
+                          len, 0);
+#else
+            ret = -1;
+            errno = ENOSYS;
+#endif
+            break;
+        case GUEST_FILE_COPY_METHOD_SENDFILE:
+            /* sendfile() writes where the descriptor is */
+            ret = lseek(dst, out, SEEK_SET) < 0 ? -1 :
+                  sendfile(dst, src, &off, len);
+            break;
+        default:
+            if (!*buf) {
+                *buf = g_malloc(GUEST_FCOPY_BUF);
+            }
+            ret = pread(src, *buf, MIN(len, GUEST_FCOPY_BUF), in);
+            for (n = 0; ret > 0 && n < ret; n += w) {
+                w = pwrite(dst, *buf + n, ret - n, out + n);
+                if (w < 0 && errno != EINTR) {
+                    ret = -1;
+                    break;
+                }
+                w = MAX(w, 0);
+            }
+            break;
+        }
+        if (ret >= 0) {
+            return ret;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (*method == GUEST_FILE_COPY_METHOD_READ_WRITE ||
+            !guest_fcopy_unsupported(errno)) {
+            return -errno;
+        }
+        g_debug("file copy: %s not supported: %s",
+                GuestFileCopyMethod_lookup[*method], strerror(errno));
+        (*method)++;
+    }
+}
+
+static void guest_fcopy_thread(gpointer data, gpointer opaque)
+{
+    GuestFcopyJob *job = data;
+    GuestFileCopyMethod method = GUEST_FILE_COPY_METHOD_COPY_FILE_RANGE;
+    int64_t done = 0;
+    char *buf = NULL;
+    bool cancelled;
+    ssize_t ret = 0;
+
+#ifdef FICLONE
+    /* the whole file at once, with nothing to copy */
+    if (job->whole && ioctl(fileno(job->dst), FICLONE,
+                            fileno(job->src)) == 0) {
+        method = GUEST_FILE_COPY_METHOD_CLONE;
+        done = job->total;
+    }
+#endif
+
+    while (done < job->total) {
+        g_mutex_lock(&job->lock);
+        job->method = method;
+        job->started = true;
+        job->done = done;
+        cancelled = job->cancelled;
+        g_mutex_unlock(&job->lock);
+        if (cancelled) {
+            ret = -ECANCELED;
+            break;
+        }
+
+        ret = guest_fcopy_step(job, &method, job->offset + done, done,
+                               MIN(job->total - done, GUEST_FCOPY_CHUNK),
+                               &buf);
+        if (ret <= 0) {
+            /* 0 if the source shrank meanwhile; the copy ends there */
+            break;
+        }
+        done += ret;
+    }
+    g_free(buf);
+
+    g_mutex_lock(&job->lock);
+    job->method = method;
+    job->started = true;
+    job->done = done;
+    if (ret < 0) {
+        job->error = g_strdup(strerror(-ret));
+    }
+    job->finished = true;
+    g_mutex_unlock(&job->lock);
+}
+
+static void guest_fcopy_job_free(GuestFcopyJob *job)
+{
+    /* waits for the thread, which a cancel makes quick */
+    g_thread_pool_free(job->pool, false, true);
+    fclose(job->src);
+    fclose(job->dst);
+    g_free(job->error);
+    g_mutex_clear(&job->lock);
+    g_free(job);
+}
+
+GuestFileCopyStart *qmp_guest_file_copy_start(const char *src,
+                                              const char *dst,
+                                              bool has_offset, int64_t offset,
+                                              bool has_length, int64_t length,
+                                              Error **errp)
+{
+    GuestFileCopyStart *start;
+    GuestFcopyJob *job;
+    struct stat st, dst_st;
+    FILE *in, *out;
+
+    slog("guest-file-copy-start called, src: %s, dst: %s", src, dst);
+
+    if (!has_offset) {
+        offset = 0;
+    } else if (offset < 0) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "offset",
+                   "a non-negative number");
+        return NULL;
+    }
+    if (!has_length) {
+        length = INT64_MAX;
+    } else if (length < 0) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "length",
+                   "a non-negative number");
+        return NULL;
+    }
+    if (guest_fcopy_state.count >= GUEST_FCOPY_MAX_JOBS) {
+        error_setg(errp, "too many copy jobs, get the status of finished "
+                   "ones to release them");
+        return NULL;
+    }
+
+    in = safe_open_or_create(src, "r", errp);
+    if (!in) {
+        return NULL;
+    }
+    if (fstat(fileno(in), &st) < 0) {
+        error_setg_errno(errp, errno, "failed to stat file '%s'", src);
+        fclose(in);
+        return NULL;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        error_setg(errp, "'%s' is not a regular file", src);
+        fclose(in);
+        return NULL;
+    }
+    /* opening the copy truncates it */
+    if (stat(dst, &dst_st) == 0 && dst_st.st_dev == st.st_dev &&
+        dst_st.st_ino == st.st_ino) {
+        error_setg(errp, "'%s' and '%s' are the same file", src, dst);
+        fclose(in);
+        return NULL;
+    }
+    out = safe_open_or_create(dst, "w", errp);
+    if (!out) {
+        fclose(in);
+        return NULL;
+    }
+
+    job = g_new0(GuestFcopyJob, 1);
+    job->id = ++guest_fcopy_state.last_id;
+    job->src = in;
+    job->dst = out;
+    job->offset = offset;
+    job->total = offset < st.st_size ? MIN(st.st_size - offset, length) : 0;
+    job->whole = !offset && job->total == st.st_size;
+    g_mutex_init(&job->lock);
+    job->pool = g_thread_pool_new(guest_fcopy_thread, NULL, 1, false, NULL);
+    g_thread_pool_push(job->pool, job, NULL);
+    QTAILQ_INSERT_TAIL(&guest_fcopy_state.jobs, job, next);
+    guest_fcopy_state.count++;
+
+    start = g_new0(GuestFileCopyStart, 1);
+    start->id = job->id;
+    return start;
+}
+
+static GuestFcopyJob *guest_fcopy_job_find(int64_t id, Error **errp)
+{
+    GuestFcopyJob *job;
+
+    QTAILQ_FOREACH(job, &guest_fcopy_state.jobs, next) {
+        if (job->id == id) {
+            return job;
+        }
+    }
+    error_setg(errp, QERR_INVALID_PARAMETER, "id");
+    return NULL;
+}
+
+static void guest_fcopy_job_remove(GuestFcopyJob *job)
+{
+    QTAILQ_REMOVE(&guest_fcopy_state.jobs, job, next);
+    guest_fcopy_state.count--;
+    guest_fcopy_job_free(job);
+}
+
+GuestFileCopyJob *qmp_guest_file_copy_status(int64_t id, Error **errp)
+{
+    GuestFcopyJob *job = guest_fcopy_job_find(id, errp);
+    GuestFileCopyJob *info;
+
+    if (!job) {
+        return NULL;
+    }
+
+    info = g_new0(GuestFileCopyJob, 1);
+    info->id = job->id;
+    info->total = job->total;
+    g_mutex_lock(&job->lock);
+    info->finished = job->finished;
+    info->done = job->done;
+    info->has_method = job->started;
+    info->method = job->method;
+    info->has_error = job->error != NULL;
+    info->error = g_strdup(job->error);
+    g_mutex_unlock(&job->lock);
+
+    if (info->finished) {
+        guest_fcopy_job_remove(job);
+    }
+    return info;
+}
+
+static void guest_fcopy_job_cancel(GuestFcopyJob *job)
+{
+    g_mutex_lock(&job->lock);
+    job->cancelled = true;
+    g_mutex_unlock(&job->lock);
+}
+
+void qmp_guest_file_copy_cancel(int64_t id, Error **errp)
+{
+    GuestFcopyJob *job = guest_fcopy_job_find(id, errp);
+
+    if (job) {
+        guest_fcopy_job_cancel(job);
+    }
+}
+
+static void guest_fcopy_cleanup(void)
+{
+    GuestFcopyJob *job;
+
+    QTAILQ_FOREACH(job, &guest_fcopy_state.jobs, next) {
+        guest_fcopy_job_cancel(job);
+    }
+    while ((job = QTAILQ_FIRST(&guest_fcopy_state.jobs))) {
+        guest_fcopy_job_remove(job);
+    }
+}
+
+/*FilePrefetch*/
+/*########################################################################################################*/
+/* mapped at a time to look at the residency of a file */
+#define GUEST_RESIDENCY_WINDOW (256 * 1024 * 1024)
+/* Most jobs kept at a time, running or waiting for their status */
+#define GUEST_PREFETCH_MAX_JOBS 16
+/* read ahead per system call, so that progress and cancels are seen */
+#define GUEST_PREFETCH_CHUNK (4 * 1024 * 1024)
+/* longest sleep of a rate-limited job before it looks for a cancel */
+#define GUEST_PREFETCH_SLEEP_US (100 * 1000)
+
+/* pages of @fd, of @size bytes, in the page cache, or -errno */
+static int64_t guest_file_cached_pages(int fd, int64_t size)
+{
+    size_t page = getpagesize();
+    unsigned char *vec;
+    int64_t off, cached = 0;
+    size_t len, i;
+    void *addr;
+    int ret = 0;
+
+    vec = g_malloc(GUEST_RESIDENCY_WINDOW / page);
+    for (off = 0; off < size && !ret; off += len) {
+        len = MIN(size - off, GUEST_RESIDENCY_WINDOW);
+        addr = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, off);
+        if (addr == MAP_FAILED) {
+            ret = -errno;
+            break;
+        }
+        if (mincore(addr, len, vec) < 0) {
+            ret = -errno;
+        } else {
+            for (i = 0; i < DIV_ROUND_UP(len, page); i++) {
+                cached += vec[i] & 1;
+            }
+        }
+        munmap(addr, len);
+    }
+    g_free(vec);
+    return ret ? ret : cached;
+}
+
+GuestFileResidencyList *qmp_guest_file_residency(strList *paths,
+                                                 Error **errp)
+{
+    GuestFileResidencyList *head = NULL, **tail = &head;
+    GuestFileResidency *res;
+    struct stat st;
+    int64_t pages;
+    strList *l;
+    int fd;
+
+    for (l = paths; l; l = l->next) {
+        res = g_new0(GuestFileResidency, 1);
+        res->path = g_strdup(l->value);
+        *tail = g_new0(GuestFileResidencyList, 1);
+        (*tail)->value = res;
+        tail = &(*tail)->next;
+
+        fd = qemu_open(l->value, O_RDONLY);
+        if (fd < 0) {
+            res->has_error = true;
+            res->error = g_strdup(strerror(errno));
+            continue;
+        }
+        if (fstat(fd, &st) < 0) {
+            res->has_error = true;
+            res->error = g_strdup(strerror(errno));
+            close(fd);
+            continue;
+        }
+        if (!S_ISREG(st.st_mode)) {
+            res->has_error = true;
+            res->error = g_strdup("not a regular file");
+            close(fd);
+            continue;
+        }
+        pages = guest_file_cached_pages(fd, st.st_size);
+        close(fd);
+        if (pages < 0) {
+            res->has_error = true;
+            res->error = g_strdup(strerror(-pages));
+            continue;
+        }
+        res->has_size = res->has_cached = res->has_percent = true;
+        res->size = st.st_size;
+        /* the last page may be partly past the end */
+        res->cached = MIN(pages * getpagesize(), st.st_size);
+        res->percent = st.st_size ? 100.0 * res->cached / st.st_size : 100;
+    }
+    return head;
+}
+
+/*
+ * A job reads on a thread pool of its own with a single thread.  @done,
+ * @failed, @finished and @cancelled are shared by the thread and the
+ * main loop and protected by @lock.
+ */
+typedef struct GuestPrefetchJob {
+    int64_t id;
+    char **paths;
+    int64_t total;
+    int64_t rate;               /* bytes/s, 0 for no limit */
+    GThreadPool *pool;
+    CompatGMutex lock;
+    int64_t done;
+    int64_t failed;
+    bool finished;
+    bool cancelled;
+    QTAILQ_ENTRY(GuestPrefetchJob) next;
+} GuestPrefetchJob;
+
+static struct {
+    QTAILQ_HEAD(, GuestPrefetchJob) jobs;
+    unsigned int count;
+    int64_t last_id;
+} guest_prefetch_state = {
+    .jobs = QTAILQ_HEAD_INITIALIZER(guest_prefetch_state.jobs),
+};
+
+/* publish the progress, and tell whether the job was cancelled */
+static bool guest_prefetch_update(GuestPrefetchJob *job, int64_t done,
+                                  int64_t failed)
+{
+    bool cancelled;
+
+    g_mutex_lock(&job->lock);
+    job->done = done;
+    job->failed = failed;
+    cancelled = job->cancelled;
+    g_mutex_unlock(&job->lock);
+    return cancelled;
+}
+
+/* read the page cache full of @fd, false if the job was cancelled */
+static bool guest_prefetch_file(GuestPrefetchJob *job, int fd, int64_t size,
+                                int64_t start, int64_t *done, int64_t *failed)
+{
+    int64_t off, len, wait;
+
+    for (off = 0; off < size; off += len) {
+        len = MIN(size - off, GUEST_PREFETCH_CHUNK);
+        /* readahead() waits for the reads, posix_fadvise() only starts them */
+        if (readahead(fd, off, len) < 0 &&
+            posix_fadvise(fd, off, len, POSIX_FADV_WILLNEED)) {
+            (*failed)++;
+            return !guest_prefetch_update(job, *done, *failed);
+        }
+        *done += len;
+        if (guest_prefetch_update(job, *done, *failed)) {
+            return false;
+        }
+        while (job->rate) {
+            wait = start + *done * G_USEC_PER_SEC / job->rate -
+                   g_get_monotonic_time();
+            if (wait <= 0) {
+                break;
+            }
+            g_usleep(MIN(wait, GUEST_PREFETCH_SLEEP_US));
+            if (guest_prefetch_update(job, *done, *failed)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static void guest_prefetch_thread(gpointer data, gpointer opaque)
+{
+    GuestPrefetchJob *job = data;
+    int64_t start = g_get_monotonic_time(), done = 0, failed = 0;
+    struct stat st;
+    char **path;
+    bool more = true;
+    int fd;
+
+    for (path = job->paths; *path && more; path++) {
+        fd = qemu_open(*path, O_RDONLY);
+        if (fd < 0) {
+            failed++;
+            continue;
+        }
+        if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+            failed++;
+        } else {
+            more = guest_prefetch_file(job, fd, st.st_size, start, &done,
+                                       &failed);
+        }
+        close(fd);
+    }
+
+    g_mutex_lock(&job->lock);
+    job->done = done;
+    job->failed = failed;
+    job->finished = true;
+    g_mutex_unlock(&job->lock);
+}
+
+static void guest_prefetch_job_free(GuestPrefetchJob *job)
+{
+    /* waits for the thread, which a cancel makes quick */
+    g_thread_pool_free(job->pool, false, true);
+    g_strfreev(job->paths);
+    g_mutex_clear(&job->lock);
+    g_free(job);
+}
+
+GuestFilePrefetchStart *qmp_guest_file_prefetch(strList *paths,
+                                                bool has_rate, int64_t rate,
+                                                Error **errp)
+{
+    GuestFilePrefetchStart *start;
+    GuestPrefetchJob *job;
+    struct stat st;
+    unsigned int n = 0;
+    strList *l;
+
+    slog("guest-file-prefetch called, first path: %s",
+         paths ? paths->value : "");
+
+    if (!has_rate) {
+        rate = 0;
+    } else if (rate < 0 || rate > INT64_MAX >> 20) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "rate",
+                   "a non-negative number");
+        return NULL;
+    }
+    if (guest_prefetch_state.count >= GUEST_PREFETCH_MAX_JOBS) {
+        error_setg(errp, "too many prefetch jobs, get the status of "
+                   "finished ones to release them");
+        return NULL;
+    }
+
+    job = g_new0(GuestPrefetchJob, 1);
+    job->id = ++guest_prefetch_state.last_id;
+    for (l = paths; l; l = l->next) {
+        n++;
+    }
+    job->paths = g_new0(char *, n + 1);
+    for (l = paths, n = 0; l; l = l->next) {
+        job->paths[n++] = g_strdup(l->value);
+        if (stat(l->value, &st) == 0 && S_ISREG(st.st_mode)) {
+            job->total += st.st_size;
+        }
+    }
+    job->rate = rate << 20;
+    g_mutex_init(&job->lock);
+    job->pool = g_thread_pool_new(guest_prefetch_thread, NULL, 1, false,
+                                  NULL);
+    g_thread_pool_push(job->pool, job, NULL);
+    QTAILQ_INSERT_TAIL(&guest_prefetch_state.jobs, job, next);
+    guest_prefetch_state.count++;
+
+    start = g_new0(GuestFilePrefetchStart, 1);
+    start->id = job->id;
+    return start;
+}
+
+static GuestPrefetchJob *guest_prefetch_job_find(int64_t id, Error **errp)
+{
+    GuestPrefetchJob *job;
+
+    QTAILQ_FOREACH(job, &guest_prefetch_state.jobs, next) {
+        if (job->id == id) {
+            return job;
+        }
+    }
+    error_setg(errp, QERR_INVALID_PARAMETER, "id");
+    return NULL;
+}
+
+static void guest_prefetch_job_remove(GuestPrefetchJob *job)
+{
+    QTAILQ_REMOVE(&guest_prefetch_state.jobs, job, next);
+    guest_prefetch_state.count--;
+    guest_prefetch_job_free(job);
+}
+
+GuestFilePrefetchJob *qmp_guest_file_prefetch_status(int64_t id,
+                                                     Error **errp)
+{
+    GuestPrefetchJob *job = guest_prefetch_job_find(id, errp);
+    GuestFilePrefetchJob *info;
+
+    if (!job) {
+        return NULL;
+    }
+
+    info = g_new0(GuestFilePrefetchJob, 1);
+    info->id = job->id;
+    info->total = job->total;
+    g_mutex_lock(&job->lock);
+    info->finished = job->finished;
+    info->done = job->done;
+    info->failed = job->failed;
+    g_mutex_unlock(&job->lock);
+
+    if (info->finished) {
+        guest_prefetch_job_remove(job);
+    }
+    return info;
+}
+
+static void guest_prefetch_job_cancel(GuestPrefetchJob *job)
+{
+    g_mutex_lock(&job->lock);
+    job->cancelled = true;
+    g_mutex_unlock(&job->lock);
+}
+
+void qmp_guest_file_prefetch_cancel(int64_t id, Error **errp)
+{
+    GuestPrefetchJob *job = guest_prefetch_job_find(id, errp);
+
+    if (job) {
+        guest_prefetch_job_cancel(job);
+    }
+}
+
+static void guest_prefetch_cleanup(void)
+{
+    GuestPrefetchJob *job;
+
+    QTAILQ_FOREACH(job, &guest_prefetch_state.jobs, next) {
+        guest_prefetch_job_cancel(job);
+    }
+    while ((job = QTAILQ_FIRST(&guest_prefetch_state.jobs))) {
+        guest_prefetch_job_remove(job);
+    }
+}
+
+/*FileOps*/
+/*########################################################################################################*/
+static void guest_fops_close_dir(gpointer value)
+{
+    close(GPOINTER_TO_INT(value));
+}
+
+/*
+ * The fd of the directory @path is in, opened once per request, or
+ * -errno.  *@base is set to the last component of @path.
+ */
+static int guest_fops_dir(GHashTable *dirs, const char *path, char **base)
+{
+    char *dir = g_path_get_dirname(path);
+    gpointer value;
+    int fd;
+
+    *base = g_path_get_basename(path);
+    if (g_hash_table_lookup_extended(dirs, dir, NULL, &value)) {
+        g_free(dir);
+        return GPOINTER_TO_INT(value);
+    }
+    fd = qemu_open(dir, O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        fd = -errno;
+        g_free(dir);
+        return fd;
+    }
+    g_hash_table_insert(dirs, dir, GINT_TO_POINTER(fd));
+    return fd;
+}
+
+/* drop the fds of @path and the directories below it, which went away */
+static void guest_fops_forget(GHashTable *dirs, const char *path)
+{
+    size_t len = strlen(path);
+    GHashTableIter iter;
+    gpointer key;
+
+    g_hash_table_iter_init(&iter, dirs);
+    while (g_hash_table_iter_next(&iter, &key, NULL)) {
+        if (!strncmp(key, path, len) &&
+            (((char *)key)[len] == '\0' || ((char *)key)[len] == '/')) {
+            g_hash_table_iter_remove(&iter);
+        }
+    }
+}
+
+static int guest_fops_mkdir(GHashTable *dirs, const char *path, mode_t mode,
+                            bool parents)
+{
+    struct stat st;
+    char *base, *parent;
+    int dirfd, ret = 0;
+
+    dirfd = guest_fops_dir(dirs, path, &base);
+    if (dirfd == -ENOENT && parents) {
+        g_free(base);
+        parent = g_path_get_dirname(path);
+        ret = guest_fops_mkdir(dirs, parent, 0777, true);
+        g_free(parent);
+        if (ret < 0) {
+            return ret;
+        }
+        dirfd = guest_fops_dir(dirs, path, &base);
+    }
+    if (dirfd < 0) {
+        ret = dirfd;
+    } else if (mkdirat(dirfd, base, mode) < 0) {
+        ret = -errno;
+        if (ret == -EEXIST && parents &&
+            fstatat(dirfd, base, &st, 0) == 0 && S_ISDIR(st.st_mode)) {
+            ret = 0;
+        }
+    }
+    g_free(base);
+    return ret;
+}
+
+/* @path without the slashes it may end in */
+static char *guest_fops_path(const char *path)
+{
+    char *p = g_strdup(path);
+    size_t len = strlen(p);
+
+    while (len > 1 && p[len - 1] == '/') {
+        p[--len] = '\0';
+    }
+    return p;
+}
+
+/* 0 or -errno */
+static int guest_fops_do(GHashTable *dirs, GuestFileOp *op)
+{
+    char *path = guest_fops_path(op->path), *target = NULL;
+    char *base = NULL, *target_base = NULL;
+    int dirfd, target_dirfd, ret = 0;
+
+    if (op->op == GUEST_FILE_OP_TYPE_MKDIR) {
+        ret = guest_fops_mkdir(dirs, path, op->has_mode ? op->mode : 0777,
+                               op->has_parents && op->parents);
+        goto out;
+    }
+    dirfd = guest_fops_dir(dirs, path, &base);
+    if (dirfd < 0) {
+        ret = dirfd;
+        goto out;
+    }
+
+    switch (op->op) {
+    case GUEST_FILE_OP_TYPE_RMDIR:
+        ret = unlinkat(dirfd, base, AT_REMOVEDIR);
+        guest_fops_forget(dirs, path);
+        break;
+    case GUEST_FILE_OP_TYPE_UNLINK:
+        ret = unlinkat(dirfd, base, 0);
+        break;
+    case GUEST_FILE_OP_TYPE_RENAME:
+        target = guest_fops_path(op->target);
+        target_dirfd = guest_fops_dir(dirs, target, &target_base);
+        if (target_dirfd < 0) {
+            ret = target_dirfd;
+            goto out;
+        }
+        ret = renameat(dirfd, base, target_dirfd, target_base);
+        guest_fops_forget(dirs, path);
+        guest_fops_forget(dirs, target);
+        break;
+    case GUEST_FILE_OP_TYPE_CHMOD:
+        ret = fchmodat(dirfd, base, op->mode, 0);
+        break;
+    case GUEST_FILE_OP_TYPE_CHOWN:
+        ret = fchownat(dirfd, base, op->has_uid ? op->uid : (uid_t)-1,
+                       op->has_gid ? op->gid : (gid_t)-1, 0);
+        break;
+    case GUEST_FILE_OP_TYPE_SYMLINK:
+        ret = symlinkat(op->target, dirfd, base);
+        break;
+    default:
+        g_assert_not_reached();
+    }
+    if (ret < 0) {
+        ret = -errno;
+    }
+
+out:
+    g_free(path);
+    g_free(target);
+    g_free(base);
+    g_free(target_base);
+    return ret;
+}
+
+static bool guest_fops_check(GuestFileOp *op, Error **errp)
+{
+    bool needs_target = op->op == GUEST_FILE_OP_TYPE_RENAME ||
+                        op->op == GUEST_FILE_OP_TYPE_SYMLINK;
+
+    if (!g_path_is_absolute(op->path) || !op->path[strspn(op->path, "/")]) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "path",
+                   "an absolute path below /");
+        return false;
+    }
+    if (needs_target && !op->has_target) {
+        error_setg(errp, QERR_MISSING_PARAMETER, "target");
+        return false;
+    }
+    if (!needs_target && op->has_target) {
+        error_setg(errp, "parameter 'target' is only for rename and symlink");
+        return false;
+    }
+    if (op->op == GUEST_FILE_OP_TYPE_RENAME &&
+        (!g_path_is_absolute(op->target) ||
+         !op->target[strspn(op->target, "/")])) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "target",
+                   "an absolute path below /");
+        return false;
+    }
+    if (op->op == GUEST_FILE_OP_TYPE_CHMOD && !op->has_mode) {
+        error_setg(errp, QERR_MISSING_PARAMETER, "mode");
+        return false;
+    }
+    if (op->has_mode && (op->mode < 0 || op->mode > 07777)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "mode",
+                   "permission bits, up to 07777");
+        return false;
+    }
+    if ((op->has_uid && (op->uid < 0 || op->uid >= (uid_t)-1)) ||
+        (op->has_gid && (op->gid < 0 || op->gid >= (gid_t)-1))) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   op->has_uid ? "uid" : "gid", "a user or group id");
+        return false;
+    }
+    return true;
+}
+
+GuestFileOpResultList *qmp_guest_file_ops(GuestFileOpList *ops,
+                                          bool has_stop_on_error,
+                                          bool stop_on_error, Error **errp)
+{
+    GuestFileOpResultList *head = NULL, **tail = &head;
+    GuestFileOpResult *res;
+    GuestFileOpList *l;
+    GHashTable *dirs;
+    unsigned int n = 0;
+    int ret;
+
+    for (l = ops; l; l = l->next, n++) {
+        if (!guest_fops_check(l->value, errp)) {
+            return NULL;
+        }
+    }
+    if (!has_stop_on_error) {
+        stop_on_error = true;
+    }
+    slog("guest-file-ops called, %u operations", n);
+
+    dirs = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                 guest_fops_close_dir);
+    for (l = ops; l; l = l->next) {
+        ret = guest_fops_do(dirs, l->value);
+        res = g_new0(GuestFileOpResult, 1);
+        res->success = ret == 0;
+        if (ret < 0) {
+            res->has_error = true;
+            res->error = g_strdup_printf("%s %s: %s",
+                                         GuestFileOpType_lookup[l->value->op],
+                                         l->value->path, strerror(-ret));
+        }
+        *tail = g_new0(GuestFileOpResultList, 1);
+        (*tail)->value = res;
+        tail = &(*tail)->next;
+        if (ret < 0 && stop_on_error) {
+            break;
+        }
+    }
+    g_hash_table_destroy(dirs);
+    return head;
+}
+
+/*LogFollow*/
+/*########################################################################################################*/
+#if !defined(CONFIG_QGA_LEAN)
+/*
+ * Log files followed for guest-log-follow.  The directories of the paths
+ * are watched by an inotify instance of their own; a change to a file that
+ * matches reads what was appended to it through a GACollectTail.  Lines
+ * are batched per file, and each batch sent waits in the queue of its
+ * follow until guest-log-ack.  The state file keeps, for every file, the
+ * end of the last batch acknowledged, which is where guest-log-resume
+ * starts again.  Watches of directories no follow needs any more are only
+ * dropped when the last follow is.
+ */
+#define GUEST_LOG_STATE_FILE "qga.logs"
+#define GUEST_LOG_MAX_FOLLOWS 16
+#define GUEST_LOG_MAX_PATHS 64
+#define GUEST_LOG_MAX_FILES 256             /* per follow */
+#define GUEST_LOG_MAX_UNACKED 64            /* batches per follow */
+#define GUEST_LOG_BATCH_SIZE 65536
+#define GUEST_LOG_MAX_BATCH_SIZE (1024 * 1024)
+#define GUEST_LOG_BATCH_DELAY 1000
+#define GUEST_LOG_MAX_BATCH_DELAY 60000
+#define GUEST_LOG_WATCH_MASK (IN_MODIFY | IN_CREATE | IN_MOVED_TO | \
+                              IN_CLOSE_WRITE)
+
+typedef struct GuestLogFollower GuestLogFollower;
+
+typedef struct GuestLogFile {
+    GuestLogFollower *f;
+    GACollectTail tail;
+    strList *lines;             /* the batch being filled */
+    strList **last;
+    size_t bytes;
+    uint64_t batch_ino;         /* where the batch ends */
+    int64_t batch_end;
+    uint64_t acked_ino;         /* where the last acknowledged batch ends */
+    int64_t acked_offset;
+} GuestLogFile;
+
+typedef struct GuestLogBatch {
+    int64_t cursor;
+    GuestLogFile *file;
+    uint64_t ino;
+    int64_t offset;
+} GuestLogBatch;
+
+struct GuestLogFollower {
+    int64_t id;
+    char **paths;
+    int64_t batch_size;
+    int64_t batch_delay;
+    GPtrArray *files;           /* GuestLogFile */
+    GQueue unacked;             /* GuestLogBatch, oldest first */
+    int64_t cursor;             /* of the last batch sent */
+    bool paused;                /* restored, waiting for guest-log-resume */
+    guint flush_timer;
+};
+
+static struct {
+    int fd;
+    guint watch;                /* ga_io_add_watch() of @fd */
+    GHashTable *dirs;           /* wd -> directory */
+    GList *follows;
+    int64_t next_id;
+} guest_log_state = { .fd = -1, .next_id = 1 };
+
+static void guest_log_send(GuestLogFile *lf)
+{
+    GuestLogFollower *f = lf->f;
+    GuestLogBatch *b;
+
+    if (!lf->lines) {
+        return;
+    }
+    b = g_new0(GuestLogBatch, 1);
+    b->cursor = ++f->cursor;
+    b->file = lf;
+    b->ino = lf->batch_ino;
+    b->offset = lf->batch_end;
+    g_queue_push_tail(&f->unacked, b);
+
+    qapi_event_send_guest_log_lines(f->id, b->cursor, lf->tail.path,
+                                    lf->lines, &error_abort);
+    qapi_free_strList(lf->lines);
+    lf->lines = NULL;
+    lf->last = &lf->lines;
+    lf->bytes = 0;
+}
+
+static bool guest_log_line(const char *line, size_t len, void *opaque)
+{
+    GuestLogFile *lf = opaque;
+    GuestLogFollower *f = lf->f;
+
+    /* a batch covers one file, whose offsets only it knows */
+    if (lf->lines && (lf->tail.ino != lf->batch_ino ||
+                      lf->bytes + len > f->batch_size)) {
+        guest_log_send(lf);
+    }
+    if (g_queue_get_length(&f->unacked) >= GUEST_LOG_MAX_UNACKED) {
+        return false;
+    }
+
+    *lf->last = g_new0(strList, 1);
+    (*lf->last)->value = g_strndup(line, len);
+    lf->last = &(*lf->last)->next;
+    lf->bytes += len + 1;
+    lf->batch_ino = lf->tail.ino;
+    lf->batch_end = lf->tail.offset;
+    if (lf->bytes >= f->batch_size) {
+        guest_log_send(lf);
+    }
+    return true;
+}
+
+static gboolean guest_log_flush(gpointer opaque)
+{
+    GuestLogFollower *f = opaque;
+    int i;
+
+    f->flush_timer = 0;
+    for (i = 0; i < f->files->len; i++) {
+        guest_log_send(g_ptr_array_index(f->files, i));
+    }
+    return false;
+}
+
+static void guest_log_read(GuestLogFile *lf)
+{
+    GuestLogFollower *f = lf->f;
+
+    if (f->paused) {
+        return;
+    }
+    ga_collect_tail_read(&lf->tail, guest_log_line, lf);
+    if (lf->lines && !f->flush_timer) {
+        f->flush_timer = g_timeout_add(f->batch_delay, guest_log_flush, f);
+    }
+}
+
+static void guest_log_read_all(GuestLogFollower *f)
+{
+    int i;
+
+    for (i = 0; i < f->files->len; i++) {
+        guest_log_read(g_ptr_array_index(f->files, i));
+    }
+}
+
+static GuestLogFile *guest_log_find_file(GuestLogFollower *f,
+                                         const char *path)
+{
+    GuestLogFile *lf;
+    int i;
+
+    for (i = 0; i < f->files->len; i++) {
+        lf = g_ptr_array_index(f->files, i);
+        if (!strcmp(lf->tail.path, path)) {
+            return lf;
+        }
+    }
+    return NULL;
+}
+
+static GuestLogFile *guest_log_add_file(GuestLogFollower *f,
+                                        const char *path, bool at_end)
+{
+    GuestLogFile *lf = guest_log_find_file(f, path);
+
+    if (lf || f->files->len >= GUEST_LOG_MAX_FILES) {
+        return lf;
+    }
+    lf = g_new0(GuestLogFile, 1);
+    lf->f = f;
+    lf->last = &lf->lines;
+    ga_collect_tail_open(&lf->tail, path, at_end);
+    lf->acked_ino = lf->tail.ino;
+    lf->acked_offset = lf->tail.offset;
+    g_ptr_array_add(f->files, lf);
+    return lf;
+}
+
+static void guest_log_free_file(gpointer data)
+{
+    GuestLogFile *lf = data;
+
+    ga_collect_tail_close(&lf->tail);
+    qapi_free_strList(lf->lines);
+    g_free(lf);
+}
+
+/* start following the files that match the paths of @f now */
+static void guest_log_scan(GuestLogFollower *f, bool at_end)
+{
+    glob_t g;
+    int i, j;
+
+    for (i = 0; f->paths[i]; i++) {
+        if (glob(f->paths[i], 0, NULL, &g) != 0) {
+            continue;
+        }
+        for (j = 0; j < g.gl_pathc; j++) {
+            guest_log_add_file(f, g.gl_pathv[j], at_end);
+        }
+        globfree(&g);
+    }
+}
+
+/* the file @name of @dir changed: read it for the follows it matches */
+static void guest_log_changed(const char *dir, const char *name)
+{
+    GuestLogFollower *f;
+    GuestLogFile *lf;
+    GList *l;
+    char *path, *pdir, *pbase;
+    bool match;
+    int i;
+
+    path = g_build_filename(dir, name, NULL);
+    for (l = guest_log_state.follows; l; l = l->next) {
+        f = l->data;
+        match = false;
+        for (i = 0; f->paths[i] && !match; i++) {
+            pdir = g_path_get_dirname(f->paths[i]);
+            pbase = g_path_get_basename(f->paths[i]);
+            match = !strcmp(pdir, dir) && !fnmatch(pbase, name, 0);
+            g_free(pdir);
+            g_free(pbase);
+        }
+        lf = match ? guest_log_add_file(f, path, false) : NULL;
+        if (lf) {
+            guest_log_read(lf);
+        }
+    }
+    g_free(path);
+}
+
+static gboolean guest_log_readable(GIOChannel *channel,
+                                   GIOCondition condition, gpointer opaque)
+{
+    char buf[4096]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *ev;
+    const char *dir;
+    ssize_t len;
+    char *p;
+    GList *l;
+
+    for (;;) {
+        len = read(guest_log_state.fd, buf, sizeof(buf));
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+        if (len <= 0) {
+            break;
+        }
+        for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+            ev = (const struct inotify_event *)p;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                /* changes were lost, look at every file */
+                for (l = guest_log_state.follows; l; l = l->next) {
+                    guest_log_scan(l->data, false);
+                    guest_log_read_all(l->data);
+                }
+                continue;
+            }
+            if (ev->mask & IN_IGNORED) {
+                g_hash_table_remove(guest_log_state.dirs,
+                                    GINT_TO_POINTER(ev->wd));
+                continue;
+            }
+            dir = g_hash_table_lookup(guest_log_state.dirs,
+                                      GINT_TO_POINTER(ev->wd));
+            if (dir && ev->len) {
+                guest_log_changed(dir, ev->name);
+            }
+        }
+    }
+    return true;
+}
+
+static bool guest_log_open(Error **errp)
+{
+    GIOChannel *channel;
+
+    if (guest_log_state.fd != -1) {
+        return true;
+    }
+    guest_log_state.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (guest_log_state.fd == -1) {
+        error_setg_errno(errp, errno, "failed to initialize inotify");
+        return false;
+    }
+    channel = g_io_channel_unix_new(guest_log_state.fd);
+    guest_log_state.watch = ga_io_add_watch(channel, G_IO_IN,
+                                            guest_log_readable, NULL);
+    g_io_channel_unref(channel);
+    guest_log_state.dirs = g_hash_table_new_full(NULL, NULL, NULL, g_free);
+    return true;
+}
+
+static bool guest_log_watch_dirs(char **paths, Error **errp)
+{
+    char *dir;
+    int i, wd;
+
+    for (i = 0; paths[i]; i++) {
+        dir = g_path_get_dirname(paths[i]);
+        wd = inotify_add_watch(guest_log_state.fd, dir, GUEST_LOG_WATCH_MASK);
+        if (wd == -1) {
+            error_setg_errno(errp, errno, "failed to watch %s", dir);
+            g_free(dir);
+            return false;
+        }
+        g_hash_table_replace(guest_log_state.dirs, GINT_TO_POINTER(wd), dir);
+    }
+    return true;
+}
+
+static void guest_log_free(GuestLogFollower *f)
+{
+    if (f->flush_timer) {
+        g_source_remove(f->flush_timer);
+    }
+    while (!g_queue_is_empty(&f->unacked)) {
+        g_free(g_queue_pop_head(&f->unacked));
+    }
+    g_ptr_array_free(f->files, true);
+    g_strfreev(f->paths);
+    g_free(f);
+}
+
+static GuestLogFollower *guest_log_new(int64_t id, char **paths,
+                                       int64_t batch_size,
+                                       int64_t batch_delay)
+{
+    GuestLogFollower *f = g_new0(GuestLogFollower, 1);
+
+    f->id = id;
+    f->paths = paths;
+    f->batch_size = batch_size;
+    f->batch_delay = batch_delay;
+    f->files = g_ptr_array_new_with_free_func(guest_log_free_file);
+    g_queue_init(&f->unacked);
+    guest_log_state.follows = g_list_append(guest_log_state.follows, f);
+    guest_log_state.next_id = MAX(guest_log_state.next_id, id + 1);
+    return f;
+}
+
+static GuestLogFollower *guest_log_find(int64_t id, Error **errp)
+{
+    GList *l;
+
+    for (l = guest_log_state.follows; l; l = l->next) {
+        if (((GuestLogFollower *)l->data)->id == id) {
+            return l->data;
+        }
+    }
+    error_setg(errp, "value '%" PRId64 "' is invalid for argument follow",
+               id);
+    return NULL;
+}
+
+static char *guest_log_filename(void)
+{
+    return g_build_filename(ga_get_state_dir(ga_state), GUEST_LOG_STATE_FILE,
+                            NULL);
+}
+
+/* one group per follow; the files with their acknowledged positions */
+static void guest_log_save(void)
+{
+    GKeyFile *kf = g_key_file_new();
+    GuestLogFollower *f;
+    GuestLogFile *lf;
+    char *group, *filename, *data, **files, **positions;
+    gsize len;
+    GList *l;
+    int i, ret;
+
+    for (l = guest_log_state.follows; l; l = l->next) {
+        f = l->data;
+        group = g_strdup_printf("follow %" PRId64, f->id);
+        g_key_file_set_string_list(kf, group, "paths",
+                                   (const gchar * const *)f->paths,
+                                   g_strv_length(f->paths));
+        g_key_file_set_integer(kf, group, "batch-size", f->batch_size);
+        g_key_file_set_integer(kf, group, "batch-delay", f->batch_delay);
+        files = g_new0(char *, f->files->len + 1);
+        positions = g_new0(char *, f->files->len + 1);
+        for (i = 0; i < f->files->len; i++) {
+            lf = g_ptr_array_index(f->files, i);
+            files[i] = lf->tail.path;
+            positions[i] = g_strdup_printf("%" PRIu64 " %" PRId64,
+                                           lf->acked_ino, lf->acked_offset);
+        }
+        g_key_file_set_string_list(kf, group, "files",
+                                   (const gchar * const *)files, i);
+        g_key_file_set_string_list(kf, group, "positions",
+                                   (const gchar * const *)positions, i);
+        g_free(files);
+        g_strfreev(positions);
+        g_free(group);
+    }
+
+    filename = guest_log_filename();
+    data = g_key_file_to_data(kf, &len, NULL);
+    ret = ga_collect_replace_file(filename, data, len);
+    if (ret) {
+        g_warning("failed to write %s: %s", filename, strerror(ret));
+    }
+    g_free(data);
+    g_free(filename);
+    g_key_file_free(kf);
+}
+
+/* restore the follows of the state file, paused until guest-log-resume */
+static void guest_log_init(void)
+{
+    GKeyFile *kf = g_key_file_new();
+    GuestLogFollower *f;
+    GuestLogFile *lf;
+    Error *local_err = NULL;
+    char *filename = guest_log_filename();
+    char **groups, **paths, **files, **positions;
+    gsize nfiles, npositions;
+    uint64_t ino;
+    int64_t id, offset, batch_size, batch_delay;
+    int i, j;
+
+    if (!g_key_file_load_from_file(kf, filename, G_KEY_FILE_NONE, NULL)) {
+        goto out;
+    }
+    groups = g_key_file_get_groups(kf, NULL);
+    for (i = 0; groups[i]; i++) {
+        paths = g_key_file_get_string_list(kf, groups[i], "paths", NULL,
+                                           NULL);
+        if (sscanf(groups[i], "follow %" SCNd64, &id) != 1 || !paths ||
+            (!guest_log_open(&local_err) ||
+             !guest_log_watch_dirs(paths, &local_err))) {
+            if (local_err) {
+                g_warning("cannot restore %s: %s", groups[i],
+                          error_get_pretty(local_err));
+                error_free(local_err);
+                local_err = NULL;
+            }
+            g_strfreev(paths);
+            continue;
+        }
+        batch_size = g_key_file_get_integer(kf, groups[i], "batch-size",
+                                            NULL);
+        batch_delay = g_key_file_get_integer(kf, groups[i], "batch-delay",
+                                             NULL);
+        f = guest_log_new(id, paths, MAX(batch_size, 1), MAX(batch_delay, 0));
+        f->paused = true;
+
+        files = g_key_file_get_string_list(kf, groups[i], "files", &nfiles,
+                                           NULL);
+        positions = g_key_file_get_string_list(kf, groups[i], "positions",
+                                               &npositions, NULL);
+        for (j = 0; j < nfiles && j < npositions; j++) {
+            lf = guest_log_add_file(f, files[j], false);
+            if (lf && sscanf(positions[j], "%" SCNu64 " %" SCNd64, &ino,
+                             &offset) == 2 &&
+                ga_collect_tail_seek(&lf->tail, ino, offset)) {
+                lf->acked_ino = ino;
+                lf->acked_offset = offset;
+            }
+        }
+        g_strfreev(files);
+        g_strfreev(positions);
+
+        /* files that appeared while the agent was not running */
+        guest_log_scan(f, false);
+    }
+    g_strfreev(groups);
+
+out:
+    g_free(filename);
+    g_key_file_free(kf);
+}
+
+static void guest_log_cleanup(void)
+{
+    GList *l;
+
+    for (l = guest_log_state.follows; l; l = l->next) {
+        guest_log_free(l->data);
+    }
+    g_list_free(guest_log_state.follows);
+    if (guest_log_state.fd != -1) {
+        ga_io_remove_watch(guest_log_state.watch);
+        close(guest_log_state.fd);
+        g_hash_table_destroy(guest_log_state.dirs);
+    }
+    memset(&guest_log_state, 0, sizeof(guest_log_state));
+    guest_log_state.fd = -1;
+    guest_log_state.next_id = 1;
+}
+
+GuestLogFollowInfo *qmp_guest_log_follow(strList *paths,
+                                         bool has_from_start,
+                                         bool from_start,
+                                         bool has_batch_size,
+                                         int64_t batch_size,
+                                         bool has_batch_delay,
+                                         int64_t batch_delay, Error **errp)
+{
+    GuestLogFollowInfo *info;
+    GuestLogFollower *f;
+    strList *l;
+    char **argv, *dir;
+    int n = 0;
+
+    if (!has_batch_size) {
+        batch_size = GUEST_LOG_BATCH_SIZE;
+    } else if (batch_size < 1 || batch_size > GUEST_LOG_MAX_BATCH_SIZE) {
+        error_setg(errp, "value '%" PRId64 "' is invalid for argument "
+                   "batch-size", batch_size);
+        return NULL;
+    }
+    if (!has_batch_delay) {
+        batch_delay = GUEST_LOG_BATCH_DELAY;
+    } else if (batch_delay < 0 || batch_delay > GUEST_LOG_MAX_BATCH_DELAY) {
+        error_setg(errp, "value '%" PRId64 "' is invalid for argument "
+                   "batch-delay", batch_delay);
+        return NULL;
+    }
+    for (l = paths; l; l = l->next, n++) {
+        dir = g_path_get_dirname(l->value);
+        if (l->value[0] != '/' || strpbrk(dir, "*?[")) {
+            error_setg(errp, "'%s' is not an absolute path without "
+                       "wildcards in the directory", l->value);
+            g_free(dir);
+            return NULL;
+        }
+        g_free(dir);
+    }
+    if (!n || n > GUEST_LOG_MAX_PATHS) {
+        error_setg(errp, "between 1 and %d paths can be followed",
+                   GUEST_LOG_MAX_PATHS);
+        return NULL;
+    }
+    if (g_list_length(guest_log_state.follows) >= GUEST_LOG_MAX_FOLLOWS) {
+        error_setg(errp, "at most %d follows can be set",
+                   GUEST_LOG_MAX_FOLLOWS);
+        return NULL;
+    }
+
+    argv = g_new0(char *, n + 1);
+    for (l = paths, n = 0; l; l = l->next) {
+        argv[n++] = g_strdup(l->value);
+    }
+    if (!guest_log_open(errp) || !guest_log_watch_dirs(argv, errp)) {
+        g_strfreev(argv);
+        return NULL;
+    }
+
+    f = guest_log_new(guest_log_state.next_id, argv, batch_size,
+                      batch_delay);
+    guest_log_scan(f, !(has_from_start && from_start));
+    guest_log_read_all(f);
+    guest_log_save();
+
+    info = g_new0(GuestLogFollowInfo, 1);
+    info->follow = f->id;
+    return info;
+}
+
+void qmp_guest_log_unfollow(int64_t follow, Error **errp)
+{
+    GuestLogFollower *f = guest_log_find(follow, errp);
+
+    if (!f) {
+        return;
+    }
+    guest_log_state.follows = g_list_remove(guest_log_state.follows, f);
+    guest_log_free(f);
+    if (!guest_log_state.follows) {
+        guest_log_cleanup();
+    }
+    guest_log_save();
+}
+
+void qmp_guest_log_ack(int64_t follow, int64_t cursor, Error **errp)
+{
+    GuestLogFollower *f = guest_log_find(follow, errp);
+    GuestLogBatch *b;
+    bool full;
+
+    if (!f) {
+        return;
+    }
+    if (cursor < 0 || cursor > f->cursor) {
+        error_setg(errp, "value '%" PRId64 "' is invalid for argument "
+                   "cursor", cursor);
+        return;
+    }
+
+    full = g_queue_get_length(&f->unacked) >= GUEST_LOG_MAX_UNACKED;
+    while ((b = g_queue_peek_head(&f->unacked)) && b->cursor <= cursor) {
+        b->file->acked_ino = b->ino;
+        b->file->acked_offset = b->offset;
+        g_free(g_queue_pop_head(&f->unacked));
+    }
+    guest_log_save();
+
+    /* reading stopped while the queue was full */
+    if (full) {
+        guest_log_read_all(f);
+    }
+}
+
+void qmp_guest_log_resume(int64_t follow, Error **errp)
+{
+    GuestLogFollower *f = guest_log_find(follow, errp);
+    GuestLogFile *lf;
+    int i;
+
+    if (!f) {
+        return;
+    }
+    if (f->flush_timer) {
+        g_source_remove(f->flush_timer);
+        f->flush_timer = 0;
+    }
+    while (!g_queue_is_empty(&f->unacked)) {
+        g_free(g_queue_pop_head(&f->unacked));
+    }
+    for (i = 0; i < f->files->len; i++) {
+        lf = g_ptr_array_index(f->files, i);
+        qapi_free_strList(lf->lines);
+        lf->lines = NULL;
+        lf->last = &lf->lines;
+        lf->bytes = 0;
+        /* a file rotated away since is lost, its successor sent whole */
+        if (!ga_collect_tail_seek(&lf->tail, lf->acked_ino,
+                                  lf->acked_offset)) {
+            ga_collect_tail_seek(&lf->tail, lf->tail.ino, 0);
+        }
+    }
+    f->paused = false;
+    guest_log_read_all(f);
+}
+#endif /* !CONFIG_QGA_LEAN */
+/*########################################################################################################*/
+
+/*MemoryPressure*/
+/*########################################################################################################*/
+enum {
+    VMSTAT_PGSCAN, VMSTAT_PGSTEAL, VMSTAT_PSWPIN, VMSTAT_PSWPOUT, VMSTAT_MAX
+};
+
+/* /proc/vmstat grew past 4k with per-node and per-memcg counters */
+#define GUEST_VMSTAT_BUF_SIZE (32 * 1024)
+
+static struct {
+    char *buf;
+    int64_t time;               /* g_get_monotonic_time() */
+    uint64_t v[VMSTAT_MAX];
+} guest_vmstat_state;
+
+/* NULL if the kernel has no pressure stall information */
+static GuestPressure *guest_read_pressure(const char *path)
+{
+    GuestPressure *pressure;
+    GuestPressureStall st[2];
+    char buf[256], *line, *nl;
+    char kind[8];
+    bool has[2] = { false, false };
+
+    if (ga_read_proc_file(AT_FDCWD, path, buf, sizeof(buf)) <= 0) {
+        return NULL;
+    }
+    for (line = buf; line && *line; line = nl) {
+        GuestPressureStall cur;
+        int i;
+
+        nl = strchr(line, '\n');
+        if (nl) {
+            *nl++ = '\0';
+        }
+        if (sscanf(line, "%7s avg10=%lf avg60=%lf avg300=%lf total=%" SCNu64,
+                   kind, &cur.avg10, &cur.avg60, &cur.avg300,
+                   &cur.total) != 5) {
+            continue;
+        }
+        if (!strcmp(kind, "some")) {
+            i = 0;
+        } else if (!strcmp(kind, "full")) {
+            i = 1;
+        } else {
+            continue;
+        }
+        st[i] = cur;
+        has[i] = true;
+    }
+    if (!has[0]) {
+        return NULL;
+    }
+
+    pressure = g_new0(GuestPressure, 1);
+    pressure->some = g_memdup(&st[0], sizeof(st[0]));
+    if (has[1]) {
+        pressure->has_full = true;
+        pressure->full = g_memdup(&st[1], sizeof(st[1]));
+    }
+    return pressure;
+}
+
+/*
+ * Which counter a /proc/vmstat key adds to.  Reclaim is split by who did
+ * it (kswapd, direct, khugepaged...) and, before Linux 4.8, by zone as
+ * well; the _anon and _file counters repeat the same pages by LRU list.
+ */
+static int guest_vmstat_field(const char *key)
+{
+    const char *rest;
+    int field;
+
+    if (!strcmp(key, "pswpin")) {
+        return VMSTAT_PSWPIN;
+    }
+    if (!strcmp(key, "pswpout")) {
+        return VMSTAT_PSWPOUT;
+    }
+    if (!strncmp(key, "pgscan_", 7)) {
+        field = VMSTAT_PGSCAN;
+        rest = key + 7;
+    } else if (!strncmp(key, "pgsteal_", 8)) {
+        field = VMSTAT_PGSTEAL;
+        rest = key + 8;
+    } else {
+        return -1;
+    }
+    if (!strcmp(rest, "anon") || !strcmp(rest, "file") ||
+        !strcmp(rest, "direct_throttle")) {
+        return -1;
+    }
+    return field;
+}
+
+GuestMemoryPressure *qmp_guest_get_memory_pressure(Error **errp)
+{
+    GuestMemoryPressure *mp;
+    char key[64], *line, *nl;
+    uint64_t v[VMSTAT_MAX] = { 0 }, val;
+    int64_t now, elapsed_us;
+    int field;
+
+    if (!guest_vmstat_state.buf) {
+        guest_vmstat_state.buf = g_malloc(GUEST_VMSTAT_BUF_SIZE);
+    }
+    if (ga_read_proc_file(AT_FDCWD, "/proc/vmstat", guest_vmstat_state.buf,
+                          GUEST_VMSTAT_BUF_SIZE) <= 0) {
+        error_setg_errno(errp, errno, "failed to read /proc/vmstat");
+        return NULL;
+    }
+    now = g_get_monotonic_time();
+
+    for (line = guest_vmstat_state.buf; line && *line; line = nl) {
+        nl = strchr(line, '\n');
+        if (nl) {
+            *nl++ = '\0';
+        }
+        if (sscanf(line, "%63s %" SCNu64, key, &val) != 2) {
+            continue;
+        }
+        field = guest_vmstat_field(key);
+        if (field >= 0) {
+            v[field] += val;
+        }
+    }
+
+    mp = g_new0(GuestMemoryPressure, 1);
+    mp->memory = guest_read_pressure("/proc/pressure/memory");
+    mp->has_memory = mp->memory != NULL;
+    mp->io = guest_read_pressure("/proc/pressure/io");
+    mp->has_io = mp->io != NULL;
+    mp->cpu = guest_read_pressure("/proc/pressure/cpu");
+    mp->has_cpu = mp->cpu != NULL;
+
+    mp->pgscan = v[VMSTAT_PGSCAN];
+    mp->pgsteal = v[VMSTAT_PGSTEAL];
+    mp->pswpin = v[VMSTAT_PSWPIN];
+    mp->pswpout = v[VMSTAT_PSWPOUT];
+
+    elapsed_us = now - guest_vmstat_state.time;
+    if (guest_vmstat_state.time && elapsed_us > 0) {
+        const uint64_t *p = guest_vmstat_state.v;
+
+        mp->has_interval = true;
+        mp->interval = elapsed_us / 1000;
+        mp->has_pgscan_rate = true;
+        mp->pgscan_rate = guest_counter_rate(v[VMSTAT_PGSCAN],
+                                             p[VMSTAT_PGSCAN], elapsed_us);
+        mp->has_pgsteal_rate = true;
+        mp->pgsteal_rate = guest_counter_rate(v[VMSTAT_PGSTEAL],
+                                              p[VMSTAT_PGSTEAL], elapsed_us);
+        mp->has_pswpin_rate = true;
+        mp->pswpin_rate = guest_counter_rate(v[VMSTAT_PSWPIN],
+                                             p[VMSTAT_PSWPIN], elapsed_us);
+        mp->has_pswpout_rate = true;
+        mp->pswpout_rate = guest_counter_rate(v[VMSTAT_PSWPOUT],
+                                              p[VMSTAT_PSWPOUT], elapsed_us);
+    }
+    memcpy(guest_vmstat_state.v, v, sizeof(v));
+    guest_vmstat_state.time = now;
+
+    return mp;
+}
+
+static void guest_vmstat_cleanup(void)
+{
+    g_free(guest_vmstat_state.buf);
+    memset(&guest_vmstat_state, 0, sizeof(guest_vmstat_state));
+}
+/*########################################################################################################*/
+
+/*MemoryReclaim*/
+/*########################################################################################################*/
+#define GUEST_THP_DEFRAG_FILE "/sys/kernel/mm/transparent_hugepage/defrag"
+
+/* set the THP defrag mode, returning the one it replaces */
+static char *guest_reclaim_thp_defrag(const char *mode, Error **errp)
+{
+    char buf[256], *start, *end;
+    Error *local_err = NULL;
+    const char *p;
+
+    for (p = mode; *p && (g_ascii_isalpha(*p) || *p == '+'); p++) {
+        /* "defer+madvise" */
+    }
+    if (*p || !*mode) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "thp-defrag",
+                   "a defrag mode");
+        return NULL;
+    }
+
+    memset(buf, 0, sizeof(buf));
+    ga_read_sysfs_file(AT_FDCWD, GUEST_THP_DEFRAG_FILE, buf, sizeof(buf) - 1,
+                       &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return NULL;
+    }
+    /* "always defer defer+madvise [madvise] never" */
+    if (!guest_suspend_has_mode(buf, mode)) {
+        error_setg(errp, "no transparent huge page defrag mode '%s'", mode);
+        return NULL;
+    }
+    start = strchr(buf, '[');
+    end = start ? strchr(start, ']') : NULL;
+    if (!end) {
+        error_setg(errp, "unexpected contents of %s", GUEST_THP_DEFRAG_FILE);
+        return NULL;
+    }
+    *end = '\0';
+
+    ga_write_sysfs_file(AT_FDCWD, GUEST_THP_DEFRAG_FILE, mode, strlen(mode),
+                        &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return NULL;
+    }
+    return g_strdup(start + 1);
+}
+
+/* reclaim @bytes from cgroup v2 @cgroup, returning by how much it shrank */
+static int64_t guest_reclaim_cgroup(const char *cgroup, int64_t bytes,
+                                    Error **errp)
+{
+    uint64_t before = 0, after = 0;
+    char *path, buf[32];
+    int dirfd, fd;
+    ssize_t len;
+
+    if (cgroup[0] != '/' || strstr(cgroup, "/..")) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "cgroup",
+                   "an absolute cgroup path");
+        return -1;
+    }
+    path = g_strconcat("/sys/fs/cgroup", cgroup, NULL);
+    dirfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    g_free(path);
+    if (dirfd == -1) {
+        error_setg_errno(errp, errno, "failed to open cgroup '%s'", cgroup);
+        return -1;
+    }
+    /* memory.reclaim only exists with cgroup v2, since Linux 5.19 */
+    fd = openat(dirfd, "memory.reclaim", O_WRONLY | O_CLOEXEC);
+    if (fd == -1) {
+        error_setg_errno(errp, errno, "failed to open memory.reclaim of '%s'",
+                         cgroup);
+        close(dirfd);
+        return -1;
+    }
+
+    guest_cgroup_read_u64(dirfd, "memory.current", &before);
+    snprintf(buf, sizeof(buf), "%" PRId64, bytes);
+    do {
+        len = write(fd, buf, strlen(buf));
+    } while (len < 0 && errno == EINTR);
+    /* EAGAIN: less than @bytes could be reclaimed, which is fine here */
+    if (len < 0 && errno != EAGAIN) {
+        error_setg_errno(errp, errno, "failed to reclaim memory of '%s'",
+                         cgroup);
+        close(fd);
+        close(dirfd);
+        return -1;
+    }
+    guest_cgroup_read_u64(dirfd, "memory.current", &after);
+    close(fd);
+    close(dirfd);
+
+    return before > after ? before - after : 0;
+}
+
+GuestMemoryReclaim *qmp_guest_reclaim_memory(bool has_cgroup,
+                                             const char *cgroup,
+                                             bool has_reclaim_bytes,
+                                             int64_t reclaim_bytes,
+                                             bool has_drop_caches,
+                                             int64_t drop_caches,
+                                             bool has_compact, bool compact,
+                                             bool has_thp_defrag,
+                                             const char *thp_defrag,
+                                             Error **errp)
+{
+    GuestMemoryReclaim *reclaim;
+    GuestMeminfo mi;
+    Error *local_err = NULL;
+    char *previous = NULL, value[2];
+    int64_t start, reclaimed = -1;
+    uint64_t before;
+
+    if (has_cgroup != has_reclaim_bytes) {
+        error_setg(errp, "'cgroup' and 'reclaim-bytes' go together");
+        return NULL;
+    }
+    if (has_reclaim_bytes && reclaim_bytes <= 0) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "reclaim-bytes",
+                   "a positive number");
+        return NULL;
+    }
+    if (has_drop_caches && (drop_caches < 1 || drop_caches > 3)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "drop-caches",
+                   "1, 2 or 3");
+        return NULL;
+    }
+
+    ga_read_meminfo(&mi, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return NULL;
+    }
+    before = ga_meminfo_available(&mi);
+    start = g_get_monotonic_time();
+
+    if (has_thp_defrag) {
+        previous = guest_reclaim_thp_defrag(thp_defrag, &local_err);
+    }
+    if (!local_err && has_cgroup) {
+        reclaimed = guest_reclaim_cgroup(cgroup, reclaim_bytes, &local_err);
+    }
+    if (!local_err && has_drop_caches) {
+        snprintf(value, sizeof(value), "%" PRId64, drop_caches);
+        ga_write_sysfs_file(AT_FDCWD, "/proc/sys/vm/drop_caches", value, 1,
+                            &local_err);
+    }
+    if (!local_err && has_compact && compact) {
+        ga_write_sysfs_file(AT_FDCWD, "/proc/sys/vm/compact_memory", "1", 1,
+                            &local_err);
+    }
+    if (!local_err) {
+        ga_read_meminfo(&mi, &local_err);
+    }
+    if (local_err) {
+        error_propagate(errp, local_err);
+        g_free(previous);
+        return NULL;
+    }
+
+    reclaim = g_new0(GuestMemoryReclaim, 1);
+    reclaim->available_before = before;
+    reclaim->available_after = ga_meminfo_available(&mi);
+    reclaim->elapsed_ms = (g_get_monotonic_time() - start) / 1000;
+    reclaim->has_cgroup_reclaimed = reclaimed >= 0;
+    reclaim->cgroup_reclaimed = reclaimed;
+    reclaim->has_thp_defrag_previous = previous != NULL;
+    reclaim->thp_defrag_previous = previous;
+    return reclaim;
+}
+/*########################################################################################################*/
+
+/*TopProcesses*/
+/*########################################################################################################*/
+#if !defined(CONFIG_QGA_LEAN)
+#define GUEST_TOP_LIMIT_DEFAULT 10
+#define GUEST_TOP_BUDGET_DEFAULT 200                     /* milliseconds */
+#define GUEST_TOP_FD_INTERVAL (10 * G_USEC_PER_SEC)
+
+typedef struct GuestTopSample {
+    int64_t pid;
+    uint64_t read_bytes;
+    uint64_t write_bytes;
+    int64_t time;               /* g_get_monotonic_time() */
+    bool has_rate;
+    double read_bps;
+    double write_bps;
+    int64_t fds;                /* -1 until counted */
+    int64_t fd_time;
+    unsigned int generation;
+} GuestTopSample;
+
+typedef struct GuestTopEntry {
+    double key;
+    GuestTopSample *sample;
+} GuestTopEntry;
+
+/*
+ * I/O counters and fd counts of every process seen so far, kept between
+ * calls so that rates come from the previous visit of each pid.
+ */
+static struct {
+    int procfd;
+    GHashTable *samples;
+    unsigned int generation;
+} guest_top_state = { .procfd = -1 };
+
+static bool guest_top_parse_io(const char *buf, uint64_t *rd, uint64_t *wr)
+{
+    const char *p, *q;
+
+    p = strstr(buf, "\nread_bytes:");
+    q = strstr(buf, "\nwrite_bytes:");
+    return p && q &&
+        sscanf(p, "\nread_bytes: %" SCNu64, rd) == 1 &&
+        sscanf(q, "\nwrite_bytes: %" SCNu64, wr) == 1;
+}
+
+static int64_t guest_top_count_fds(int procfd, const char *pid)
+{
+    char path[64];
+    struct dirent *de;
+    DIR *dir;
+    int64_t n = 0;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/fd", pid);
+    fd = openat(procfd, path, O_RDONLY | O_DIRECTORY);
+    if (fd == -1) {
+        return -1;
+    }
+    dir = fdopendir(fd);
+    if (!dir) {
+        close(fd);
+        return -1;
+    }
+    while ((de = readdir(dir)) != NULL) {
+        if (de->d_name[0] != '.') {
+            n++;
+        }
+    }
+    closedir(dir);
+    return n;
+}
+
+static gboolean guest_top_sample_expired(gpointer key, gpointer value,
+                                         gpointer opaque)
+{
+    GuestTopSample *sample = value;
+
+    return sample->generation != GPOINTER_TO_UINT(opaque);
+}
+
+/*
+ * Refresh the samples from /proc/<pid>/io, and /proc/<pid>/fd for those
+ * whose fd count is older than GUEST_TOP_FD_INTERVAL.  The scan stops at
+ * @deadline; the processes it did not reach keep their previous values.
+ * Returns false if the scan was cut short.
+ */
+static bool guest_top_scan(int64_t deadline, int64_t *scanned, Error **errp)
+{
+    GuestTopSample *sample;
+    struct dirent *de;
+    DIR *dir;
+    char path[64], buf[512];
+    uint64_t rd, wr;
+    int64_t now, pid;
+    bool complete = true;
+    int fd;
+
+    if (guest_top_state.procfd == -1) {
+        guest_top_state.procfd = open("/proc", O_RDONLY | O_DIRECTORY);
+        if (guest_top_state.procfd == -1) {
+            error_setg_errno(errp, errno, "failed to open /proc");
+            return false;
+        }
+        guest_top_state.samples = g_hash_table_new_full(g_int64_hash,
+                                                        g_int64_equal,
+                                                        NULL, g_free);
+    }
+
+    /* readdir needs a descriptor of its own, which closedir will close */
+    fd = openat(guest_top_state.procfd, ".", O_RDONLY | O_DIRECTORY);
+    dir = fd == -1 ? NULL : fdopendir(fd);
+    if (!dir) {
+        error_setg_errno(errp, errno, "failed to open /proc");
+        if (fd != -1) {
+            close(fd);
+        }
+        return false;
+    }
+    guest_top_state.generation++;
+
+    while ((de = readdir(dir)) != NULL) {
+        if (!g_ascii_isdigit(de->d_name[0])) {
+            continue;
+        }
+        if (g_get_monotonic_time() > deadline) {
+            complete = false;
+            break;
+        }
+        snprintf(path, sizeof(path), "%s/io", de->d_name);
+        if (ga_read_proc_file(guest_top_state.procfd, path,
+                              buf, sizeof(buf)) <= 0 ||
+            !guest_top_parse_io(buf, &rd, &wr)) {
+            /* exited, or a kernel without task I/O accounting */
+            continue;
+        }
+        now = g_get_monotonic_time();
+        pid = g_ascii_strtoll(de->d_name, NULL, 10);
+        (*scanned)++;
+
+        sample = g_hash_table_lookup(guest_top_state.samples, &pid);
+        if (!sample) {
+            sample = g_new0(GuestTopSample, 1);
+            sample->pid = pid;
+            sample->fds = -1;
+            g_hash_table_insert(guest_top_state.samples, &sample->pid, sample);
+        } else if (rd >= sample->read_bytes && wr >= sample->write_bytes &&
+                   now > sample->time) {
+            sample->has_rate = true;
+            sample->read_bps = guest_counter_rate(rd, sample->read_bytes,
+                                                  now - sample->time);
+            sample->write_bps = guest_counter_rate(wr, sample->write_bytes,
+                                                   now - sample->time);
+        } else {
+            /* counters went backwards: the pid was reused */
+            sample->has_rate = false;
+            sample->fds = -1;
+        }
+        sample->read_bytes = rd;
+        sample->write_bytes = wr;
+        sample->time = now;
+        sample->generation = guest_top_state.generation;
+
+        if (sample->fds == -1 ||
+            now - sample->fd_time >= GUEST_TOP_FD_INTERVAL) {
+            sample->fds = guest_top_count_fds(guest_top_state.procfd,
+                                              de->d_name);
+            sample->fd_time = now;
+        }
+    }
+    closedir(dir);
+
+    /* only a full scan can tell which processes are gone */
+    if (complete) {
+        g_hash_table_foreach_remove(guest_top_state.samples,
+                                    guest_top_sample_expired,
+                                    GUINT_TO_POINTER(
+                                        guest_top_state.generation));
+    }
+    return complete;
+}
+
+/* the heap keeps its smallest key at the root, ready to be evicted */
+static void guest_top_heap_down(GuestTopEntry *heap, size_t n, size_t i)
+{
+    GuestTopEntry tmp;
+    size_t min, child;
+
+    for (;;) {
+        min = i;
+        child = 2 * i + 1;
+        if (child < n && heap[child].key < heap[min].key) {
+            min = child;
+        }
+        if (child + 1 < n && heap[child + 1].key < heap[min].key) {
+            min = child + 1;
+        }
+        if (min == i) {
+            return;
+        }
+        tmp = heap[i];
+        heap[i] = heap[min];
+        heap[min] = tmp;
+        i = min;
+    }
+}
+
+static void guest_top_heap_up(GuestTopEntry *heap, size_t i)
+{
+    GuestTopEntry tmp;
+
+    while (i > 0 && heap[i].key < heap[(i - 1) / 2].key) {
+        tmp = heap[i];
+        heap[i] = heap[(i - 1) / 2];
+        heap[(i - 1) / 2] = tmp;
+        i = (i - 1) / 2;
+    }
+}
+
+static int guest_top_entry_cmp(const void *a, const void *b)
+{
+    double ka = ((const GuestTopEntry *)a)->key;
+    double kb = ((const GuestTopEntry *)b)->key;
+
+    return ka < kb ? 1 : ka > kb ? -1 : 0;
+}
+
+static void guest_top_cleanup(void)
+{
+    if (guest_top_state.procfd != -1) {
+        close(guest_top_state.procfd);
+        g_hash_table_destroy(guest_top_state.samples);
+    }
+    memset(&guest_top_state, 0, sizeof(guest_top_state));
+    guest_top_state.procfd = -1;
+}
+
+GuestTopProcesses *qmp_guest_get_top_processes(bool has_sort,
+                                               GuestTopProcessSortKey sort,
+                                               bool has_limit, int64_t limit,
+                                               bool has_budget, int64_t budget,
+                                               Error **errp)
+{
+    GuestTopProcesses *top;
+    GuestTopProcessList **link;
+    GuestTopProcess *proc;
+    GuestTopSample *sample;
+    GuestTopEntry *heap;
+    GHashTableIter iter;
+    Error *local_err = NULL;
+    char path[64], buf[64];
+    int64_t scanned = 0;
+    size_t n = 0, size, i;
+    bool complete;
+    double key;
+
+    if (!has_sort) {
+        sort = GUEST_TOP_PROCESS_SORT_KEY_IO;
+    }
+    if (!has_limit) {
+        limit = GUEST_TOP_LIMIT_DEFAULT;
+    } else if (limit <= 0) {
+        error_setg(errp, "value '%" PRId64 "' is invalid for argument limit",
+                   limit);
+        return NULL;
+    }
+    if (!has_budget) {
+        budget = GUEST_TOP_BUDGET_DEFAULT;
+    } else if (budget <= 0) {
+        error_setg(errp, "value '%" PRId64 "' is invalid for argument budget",
+                   budget);
+        return NULL;
+    }
+
+    complete = guest_top_scan(g_get_monotonic_time() + budget * 1000,
+                              &scanned, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return NULL;
+    }
+
+    size = MIN(limit, g_hash_table_size(guest_top_state.samples));
+    heap = g_new(GuestTopEntry, MAX(size, 1));
+    g_hash_table_iter_init(&iter, guest_top_state.samples);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&sample)) {
+        if (sort == GUEST_TOP_PROCESS_SORT_KEY_FDS) {
+            key = sample->fds;
+        } else {
+            key = sample->has_rate ? sample->read_bps + sample->write_bps : 0;
+        }
+        if (key <= 0) {
+            continue;
+        }
+        if (n < size) {
+            heap[n].key = key;
+            heap[n].sample = sample;
+            guest_top_heap_up(heap, n++);
+        } else if (key > heap[0].key) {
+            heap[0].key = key;
+            heap[0].sample = sample;
+            guest_top_heap_down(heap, n, 0);
+        }
+    }
+    qsort(heap, n, sizeof(*heap), guest_top_entry_cmp);
+
+    top = g_new0(GuestTopProcesses, 1);
+    top->complete = complete;
+    top->scanned = scanned;
+    link = &top->processes;
+    for (i = 0; i < n; i++) {
+        sample = heap[i].sample;
+        proc = g_new0(GuestTopProcess, 1);
+        proc->pid = sample->pid;
+        snprintf(path, sizeof(path), "%" PRId64 "/comm", sample->pid);
+        if (ga_read_proc_file(guest_top_state.procfd, path,
+                              buf, sizeof(buf)) > 0) {
+            proc->comm = g_strdup(g_strchomp(buf));
+        } else {
+            proc->comm = g_strdup("");
+        }
+        proc->read_bytes = sample->read_bytes;
+        proc->write_bytes = sample->write_bytes;
+        if (sample->has_rate) {
+            proc->has_read_bps = proc->has_write_bps = true;
+            proc->read_bps = sample->read_bps;
+            proc->write_bps = sample->write_bps;
+        }
+        if (sample->fds >= 0) {
+            proc->has_fds = true;
+            proc->fds = sample->fds;
+        }
+
+        *link = g_new0(GuestTopProcessList, 1);
+        (*link)->value = proc;
+        link = &(*link)->next;
+    }
+    g_free(heap);
+
+    return top;
+}
+#endif /* !CONFIG_QGA_LEAN */
+/*########################################################################################################*/
 
-    dirpath = g_strdup_printf("%s/slaves", syspath);
-    dir = opendir(dirpath);
-    if (!dir) {
-        error_setg_errno(errp, errno, "opendir(\"%s\")", dirpath);
-        g_free(dirpath);
+/*ProcessMemory*/
+/*########################################################################################################*/
+#define GUEST_PROCMEM_MAX 256
+#define GUEST_PROCMEM_TOP_DEFAULT 10
+#define GUEST_SMAPS_BUF_SIZE 8192
+
+/* the smaps counters we add up, in kB as the kernel reports them */
+typedef struct GuestSmapsSum {
+    uint64_t rss;
+    uint64_t pss;
+    uint64_t shared_clean;
+    uint64_t shared_dirty;
+    uint64_t private_clean;
+    uint64_t private_dirty;
+    uint64_t anon;
+    uint64_t swap;
+    uint64_t swap_pss;
+    bool has_swap_pss;
+} GuestSmapsSum;
+
+typedef struct GuestProcmemRank {
+    int64_t pid;
+    uint64_t rss;               /* pages */
+} GuestProcmemRank;
+
+/* smaps_rollup is missing before Linux 4.14; once seen missing, skip it */
+static bool guest_smaps_no_rollup;
+
+/*
+ * Add the value of a "Key:   1234 kB" line to @sum.  The header line of
+ * each mapping and the counters we do not use fall through, as do
+ * "Pss_Anon:" and the like, which only the rollup has.
+ */
+static void guest_smaps_line(GuestSmapsSum *sum, const char *line)
+{
+    static const struct {
+        const char *key;
+        size_t offset;
+    } keys[] = {
+        { "Rss", offsetof(GuestSmapsSum, rss) },
+        { "Pss", offsetof(GuestSmapsSum, pss) },
+        { "Shared_Clean", offsetof(GuestSmapsSum, shared_clean) },
+        { "Shared_Dirty", offsetof(GuestSmapsSum, shared_dirty) },
+        { "Private_Clean", offsetof(GuestSmapsSum, private_clean) },
+        { "Private_Dirty", offsetof(GuestSmapsSum, private_dirty) },
+        { "Anonymous", offsetof(GuestSmapsSum, anon) },
+        { "Swap", offsetof(GuestSmapsSum, swap) },
+        { "SwapPss", offsetof(GuestSmapsSum, swap_pss) },
+    };
+    const char *colon = strchr(line, ':');
+    uint64_t *counter;
+    size_t len, i;
+
+    if (!colon) {
         return;
     }
-
-    for (;;) {
-        errno = 0;
-        entry = readdir(dir);
-        if (entry == NULL) {
-            if (errno) {
-                error_setg_errno(errp, errno, "readdir(\"%s\")", dirpath);
+    len = colon - line;
+    for (i = 0; i < ARRAY_SIZE(keys); i++) {
+        if (strlen(keys[i].key) == len && !memcmp(line, keys[i].key, len)) {
+            counter = (uint64_t *)((char *)sum + keys[i].offset);
+            *counter += g_ascii_strtoull(colon + 1, NULL, 10);
+            if (keys[i].offset == offsetof(GuestSmapsSum, swap_pss)) {
+                sum->has_swap_pss = true;
             }
-            break;
+            return;
         }
+    }
+}
 
-        if (entry->d_type == DT_LNK) {
-            char *path;
-
-            g_debug(" slave device '%s'", entry->d_name);
-            path = g_strdup_printf("%s/slaves/%s", syspath, entry->d_name);
-            build_guest_fsinfo_for_device(path, fs, errp);
-            g_free(path);
+/*
+ * Sum up @path, smaps or smaps_rollup, a buffer at a time: the smaps of a
+ * large JVM run to megabytes.  A line longer than the buffer can only be
+ * the header of a mapping with a long path, and is skipped.
+ */
+static bool guest_smaps_read(const char *path, GuestSmapsSum *sum)
+{
+    char buf[GUEST_SMAPS_BUF_SIZE];
+    char *line, *nl;
+    size_t have = 0;
+    bool skip = false;
+    ssize_t n;
+    int fd;
 
-            if (*errp) {
-                break;
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    for (;;) {
+        n = read(fd, buf + have, sizeof(buf) - 1 - have);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        have += n;
+        buf[have] = '\0';
+        for (line = buf; (nl = strchr(line, '\n')); line = nl + 1) {
+            *nl = '\0';
+            if (!skip) {
+                guest_smaps_line(sum, line);
             }
+            skip = false;
+        }
+        have -= line - buf;
+        if (have == sizeof(buf) - 1) {
+            skip = true;
+            have = 0;
+        } else {
+            memmove(buf, line, have);
         }
     }
-
-    g_free(dirpath);
-    closedir(dir);
+    close(fd);
+    return n == 0;
 }
 
-/* Dispatch to functions for virtual/real device */
-static void build_guest_fsinfo_for_device(char const *devpath,
-                                          GuestFilesystemInfo *fs,
-                                          Error **errp)
+static GuestProcessMemory *guest_procmem_get(int64_t pid)
 {
-    char *syspath = realpath(devpath, NULL);
-
-    if (!syspath) {
-        error_setg_errno(errp, errno, "realpath(\"%s\")", devpath);
-        return;
+    GuestProcessMemory *mem;
+    GuestSmapsSum sum = { 0 };
+    char path[64], buf[64];
+    bool ok = false;
+
+    if (!guest_smaps_no_rollup) {
+        snprintf(path, sizeof(path), "/proc/%" PRId64 "/smaps_rollup", pid);
+        ok = guest_smaps_read(path, &sum);
+        if (!ok && errno != ENOENT) {
+            return NULL;
+        }
     }
-
-    if (!fs->name) {
-        fs->name = g_strdup(basename(syspath));
+    if (!ok) {
+        memset(&sum, 0, sizeof(sum));
+        snprintf(path, sizeof(path), "/proc/%" PRId64 "/smaps", pid);
+        if (!guest_smaps_read(path, &sum)) {
+            /* gone, or a kernel thread */
+            return NULL;
+        }
+        guest_smaps_no_rollup = true;
     }
 
-    g_debug("  parse sysfs path '%s'", syspath);
-
-    if (strstr(syspath, "/devices/virtual/block/")) {
-        build_guest_fsinfo_for_virtual_device(syspath, fs, errp);
+    mem = g_new0(GuestProcessMemory, 1);
+    mem->pid = pid;
+    snprintf(path, sizeof(path), "/proc/%" PRId64 "/comm", pid);
+    if (ga_read_proc_file(AT_FDCWD, path, buf, sizeof(buf)) > 0) {
+        mem->comm = g_strdup(g_strchomp(buf));
     } else {
-        build_guest_fsinfo_for_real_device(syspath, fs, errp);
+        mem->comm = g_strdup("");
     }
-
-    free(syspath);
+    mem->rss = sum.rss * 1024;
+    mem->pss = sum.pss * 1024;
+    mem->uss = (sum.private_clean + sum.private_dirty) * 1024;
+    mem->shared = (sum.shared_clean + sum.shared_dirty) * 1024;
+    mem->anon = sum.anon * 1024;
+    mem->file = sum.rss > sum.anon ? (sum.rss - sum.anon) * 1024 : 0;
+    mem->swap = sum.swap * 1024;
+    mem->has_swap_pss = sum.has_swap_pss;
+    mem->swap_pss = sum.swap_pss * 1024;
+    return mem;
 }
 
-/* Return a list of the disk device(s)' info which @mount lies on */
-static GuestFilesystemInfo *build_guest_fsinfo(struct FsMount *mount,
-                                               Error **errp)
+static int guest_procmem_rank_cmp(const void *a, const void *b)
 {
-    GuestFilesystemInfo *fs = g_malloc0(sizeof(*fs));
-    char *devpath = g_strdup_printf("/sys/dev/block/%u:%u",
-                                    mount->devmajor, mount->devminor);
-
-    fs->mountpoint = g_strdup(mount->dirname);
-    fs->type = g_strdup(mount->devtype);
-    build_guest_fsinfo_for_device(devpath, fs, errp);
+    uint64_t ra = ((const GuestProcmemRank *)a)->rss;
+    uint64_t rb = ((const GuestProcmemRank *)b)->rss;
 
-    g_free(devpath);
-    return fs;
+    return ra < rb ? 1 : ra > rb ? -1 : 0;
 }
 
-GuestFilesystemInfoList *qmp_guest_get_fsinfo(Error **errp)
+/* the processes by resident set, largest first, from the cheap statm */
+static GArray *guest_procmem_rank(Error **errp)
 {
-    FsMountList mounts;
-    struct FsMount *mount;
-    GuestFilesystemInfoList *new, *ret = NULL;
-    Error *local_err = NULL;
+    GuestProcmemRank r;
+    struct dirent *de;
+    GArray *ranks;
+    char path[64], buf[128];
+    uint64_t size;
+    DIR *dir;
 
-    QTAILQ_INIT(&mounts);
-    build_fs_mount_list(&mounts, &local_err);
-    if (local_err) {
-        error_propagate(errp, local_err);
+    dir = opendir("/proc");
+    if (!dir) {
+        error_setg_errno(errp, errno, "failed to open /proc");
         return NULL;
     }
-
-    QTAILQ_FOREACH(mount, &mounts, next) {
-        g_debug("Building guest fsinfo for '%s'", mount->dirname);
-
-        new = g_malloc0(sizeof(*ret));
-        new->value = build_guest_fsinfo(mount, &local_err);
-        new->next = ret;
-        ret = new;
-        if (local_err) {
-            error_propagate(errp, local_err);
-            qapi_free_GuestFilesystemInfoList(ret);
-            ret = NULL;
-            break;
+    ranks = g_array_new(false, false, sizeof(GuestProcmemRank));
+    while ((de = readdir(dir)) != NULL) {
+        if (!g_ascii_isdigit(de->d_name[0])) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/statm", de->d_name);
+        if (ga_read_proc_file(dirfd(dir), path, buf, sizeof(buf)) <= 0 ||
+            sscanf(buf, "%" SCNu64 " %" SCNu64, &size, &r.rss) != 2 ||
+            !r.rss) {
+            /* exited, or a kernel thread */
+            continue;
         }
+        r.pid = g_ascii_strtoll(de->d_name, NULL, 10);
+        g_array_append_val(ranks, r);
     }
+    closedir(dir);
 
-    free_fs_mount_list(&mounts);
-    return ret;
+    qsort(ranks->data, ranks->len, sizeof(GuestProcmemRank),
+          guest_procmem_rank_cmp);
+    return ranks;
 }
 
-
-typedef enum {
-    FSFREEZE_HOOK_THAW = 0,
-    FSFREEZE_HOOK_FREEZE,
-} FsfreezeHookArg;
-
-static const char *fsfreeze_hook_arg_string[] = {
-    "thaw",
-    "freeze",
-};
-
-static void execute_fsfreeze_hook(FsfreezeHookArg arg, Error **errp)
+GuestProcessMemoryList *qmp_guest_get_process_memory(bool has_pids,
+                                                     intList *pids,
+                                                     bool has_top,
+                                                     int64_t top,
+                                                     Error **errp)
 {
-    int status;
-    pid_t pid;
-    const char *hook;
-    const char *arg_str = fsfreeze_hook_arg_string[arg];
-    Error *local_err = NULL;
-
-    hook = ga_fsfreeze_hook(ga_state);
-    if (!hook) {
-        return;
-    }
-    if (access(hook, X_OK) != 0) {
-        error_setg_errno(errp, errno, "can't access fsfreeze hook '%s'", hook);
-        return;
+    GuestProcessMemoryList *head = NULL, **link = &head;
+    GuestProcessMemory *mem;
+    GArray *ranks;
+    intList *p;
+    size_t n = 0;
+    guint i;
+
+    if (has_pids && has_top) {
+        error_setg(errp, "'pids' and 'top' cannot both be given");
+        return NULL;
     }
-
-    slog("executing fsfreeze hook with arg '%s'", arg_str);
-    pid = fork();
-    if (pid == 0) {
-        setsid();
-        reopen_fd_to_null(0);
-        reopen_fd_to_null(1);
-        reopen_fd_to_null(2);
-
-        execle(hook, hook, arg_str, NULL, environ);
-        _exit(EXIT_FAILURE);
-    } else if (pid < 0) {
-        error_setg_errno(errp, errno, "failed to create child process");
-        return;
+    if (has_pids) {
+        for (p = pids; p; p = p->next) {
+            n++;
+        }
+        if (n > GUEST_PROCMEM_MAX) {
+            error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "pids",
+                       "a list of at most 256 processes");
+            return NULL;
+        }
+        for (p = pids; p; p = p->next) {
+            mem = p->value > 0 ? guest_procmem_get(p->value) : NULL;
+            if (mem) {
+                *link = g_new0(GuestProcessMemoryList, 1);
+                (*link)->value = mem;
+                link = &(*link)->next;
+            }
+        }
+        return head;
     }
 
-    ga_wait_child(pid, &status, &local_err);
-    if (local_err) {
-        error_propagate(errp, local_err);
-        return;
+    if (!has_top) {
+        top = GUEST_PROCMEM_TOP_DEFAULT;
+    } else if (top < 1 || top > GUEST_PROCMEM_MAX) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "top",
+                   "a number from 1 to 256");
+        return NULL;
     }
-
-    if (!WIFEXITED(status)) {
-        error_setg(errp, "fsfreeze hook has terminated abnormally");
-        return;
+    ranks = guest_procmem_rank(errp);
+    if (!ranks) {
+        return NULL;
     }
-
-    status = WEXITSTATUS(status);
-    if (status) {
-        error_setg(errp, "fsfreeze hook has failed with status %d", status);
-        return;
+    for (i = 0; i < ranks->len && (int64_t)n < top; i++) {
+        mem = guest_procmem_get(g_array_index(ranks, GuestProcmemRank,
+                                              i).pid);
+        if (mem) {
+            *link = g_new0(GuestProcessMemoryList, 1);
+            (*link)->value = mem;
+            link = &(*link)->next;
+            n++;
+        }
     }
+    g_array_free(ranks, true);
+    return head;
 }
+/*########################################################################################################*/
 
+/*Password*/
+/*########################################################################################################*/
 /*
- * Return status of freeze/thaw
+ * Set the root password, in /etc/shadow directly where possible; see
+ * ga_collect_change_password().  @errnum is 0 on success, otherwise an
+ * errno value, or 1 if chpasswd failed.
  */
-GuestFsfreezeStatus qmp_guest_fsfreeze_status(Error **errp)
+struct ErrNO *qmp_change_password(const char *new_password, Error **errp)
 {
-    if (ga_is_frozen(ga_state)) {
-        return GUEST_FSFREEZE_STATUS_FROZEN;
-    }
+    ErrNO *err;
 
-    return GUEST_FSFREEZE_STATUS_THAWED;
-}
+    if (strchr(new_password, '\n')) {
+        error_setg(errp, "forbidden characters in raw password");
+        return NULL;
+    }
 
-int64_t qmp_guest_fsfreeze_freeze(Error **errp)
-{
-    return qmp_guest_fsfreeze_freeze_list(false, NULL, errp);
+    err = g_new0(ErrNO, 1);
+    err->errnum = ga_collect_change_password("root", new_password);
+    if (err->errnum) {
+        slog("change-password: failed to set the password: %s",
+             err->errnum == 1 ? "chpasswd failed" : strerror(err->errnum));
+    }
+    return err;
 }
+/*########################################################################################################*/
 
+/*Hostname*/
+/*########################################################################################################*/
 /*
- * Walk list of mounted file systems in the guest, and freeze the ones which
- * are real local file systems.
+ * Set the running host name and store it where the distribution reads it
+ * at boot.  @errnum is 0 on success, otherwise the errno value of the step
+ * that failed, or 1 if this distribution keeps the host name somewhere
+ * unknown.
  */
-int64_t qmp_guest_fsfreeze_freeze_list(bool has_mountpoints,
-                                       strList *mountpoints,
-                                       Error **errp)
+struct ErrNum *qmp_change_hostname(const char *new_hostname, Error **errp)
 {
-    int ret = 0, i = 0;
-    strList *list;
-    FsMountList mounts;
-    struct FsMount *mount;
-    Error *local_err = NULL;
-    int fd;
-
-    slog("guest-fsfreeze called");
+    ErrNum *err;
+    GError *gerr = NULL;
 
-    execute_fsfreeze_hook(FSFREEZE_HOOK_FREEZE, &local_err);
-    if (local_err) {
-        error_propagate(errp, local_err);
-        return -1;
+    if (!ga_collect_hostname_valid(new_hostname, &gerr)) {
+        ga_collect_error(errp, gerr);
+        return NULL;
     }
 
-    QTAILQ_INIT(&mounts);
-    build_fs_mount_list(&mounts, &local_err);
-    if (local_err) {
-        error_propagate(errp, local_err);
-        return -1;
+    guest_sysinfo_ensure();
+    err = g_new0(ErrNum, 1);
+    err->errnum = ga_collect_change_hostname(new_hostname);
+    if (err->errnum) {
+        slog("guest-change-hostname: failed to set the host name: %s",
+             err->errnum == 1 ? "unknown host name file" :
+             strerror(err->errnum));
     }
+    return err;
+}
+/*########################################################################################################*/
 
-    /* cannot risk guest agent blocking itself on a write in this state */
-    ga_set_frozen(ga_state);
+/*ServiceStatus*/
+/*########################################################################################################*/
+GuestServiceStatusList *qmp_guest_get_service_status(strList *units,
+                                                     Error **errp)
+{
+    GuestServiceStatusList *head, *entry;
+    GuestServiceStatus *status;
+    GACollectService *svc;
+    GPtrArray *services;
+    GError *gerr = NULL;
+    char **names;
+    strList *u;
+    size_t n = 0;
+    guint i;
+
+    for (u = units; u; u = u->next) {
+        n++;
+    }
+    names = g_new0(char *, n + 1);
+    for (u = units, i = 0; u; u = u->next, i++) {
+        names[i] = u->value;
+    }
+    services = ga_collect_services(names, &gerr);
+    g_free(names);
+    if (!services) {
+        ga_collect_error(errp, gerr);
+        return NULL;
+    }
 
-    QTAILQ_FOREACH_REVERSE(mount, &mounts, FsMountList, next) {
-        /* To issue fsfreeze in the reverse order of mounts, check if the
-         * mount is listed in the list here */
-        if (has_mountpoints) {
-            for (list = mountpoints; list; list = list->next) {
-                if (strcmp(list->value, mount->dirname) == 0) {
-                    break;
-                }
-            }
-            if (!list) {
-                continue;
-            }
+    head = qapi_GuestServiceStatusList_new(services->len);
+    for (i = 0, entry = head; i < services->len; i++, entry = entry->next) {
+        svc = g_ptr_array_index(services, i);
+        status = entry->value;
+        status->name = g_strdup(svc->name);
+        status->load_state = g_strdup(svc->load_state);
+        status->active_state = g_strdup(svc->active_state);
+        if (svc->sub_state) {
+            status->has_sub_state = true;
+            status->sub_state = g_strdup(svc->sub_state);
         }
-
-        fd = qemu_open(mount->dirname, O_RDONLY);
-        if (fd == -1) {
-            error_setg_errno(errp, errno, "failed to open %s", mount->dirname);
-            goto error;
+        if (svc->main_pid > 0) {
+            status->has_main_pid = true;
+            status->main_pid = svc->main_pid;
         }
-
-        /* we try to cull filesytems we know won't work in advance, but other
-         * filesytems may not implement fsfreeze for less obvious reasons.
-         * these will report EOPNOTSUPP. we simply ignore these when tallying
-         * the number of frozen filesystems.
-         *
-         * any other error means a failure to freeze a filesystem we
-         * expect to be freezable, so return an error in those cases
-         * and return system to thawed state.
-         */
-        ret = ioctl(fd, FIFREEZE);
-        if (ret == -1) {
-            if (errno != EOPNOTSUPP) {
-                error_setg_errno(errp, errno, "failed to freeze %s",
-                                 mount->dirname);
-                close(fd);
-                goto error;
-            }
-        } else {
-            i++;
+        if (svc->restarts >= 0) {
+            status->has_restarts = true;
+            status->restarts = svc->restarts;
         }
-        close(fd);
+        if (svc->memory >= 0) {
+            status->has_memory = true;
+            status->memory = svc->memory;
+        }
+    }
+    g_ptr_array_free(services, true);
+
+    return head;
+}
+/*########################################################################################################*/
+
+/*Packages*/
+/*########################################################################################################*/
+static GuestPackageList *guest_package_list(GPtrArray *packages)
+{
+    GuestPackageList *head, *entry;
+    GACollectPackage *pkg;
+    guint i;
+
+    head = qapi_GuestPackageList_new(packages->len);
+    for (i = 0, entry = head; i < packages->len; i++, entry = entry->next) {
+        pkg = g_ptr_array_index(packages, i);
+        entry->value->name = g_strdup(pkg->name);
+        entry->value->version = g_strdup(pkg->version);
+        entry->value->arch = g_strdup(pkg->arch);
+    }
+    return head;
+}
+
+GuestPackages *qmp_guest_get_packages(bool has_since, const char *since,
+                                      Error **errp)
+{
+    GuestPackages *ret;
+    GACollectPackages pk;
+    GError *gerr = NULL;
+
+    if (!ga_collect_packages(has_since ? since : NULL, &pk, &gerr)) {
+        ga_collect_error(errp, gerr);
+        return NULL;
     }
 
-    free_fs_mount_list(&mounts);
-    return i;
+    ret = g_new0(GuestPackages, 1);
+    ret->manager = pk.manager == GA_COLLECT_PACKAGES_RPM ?
+                   GUEST_PACKAGE_MANAGER_RPM : GUEST_PACKAGE_MANAGER_DPKG;
+    ret->token = pk.token;
+    pk.token = NULL;
+    ret->full = pk.full;
+    ret->installed = guest_package_list(pk.installed);
+    ret->removed = guest_package_list(pk.removed);
+    ga_collect_packages_clear(&pk);
 
-error:
-    free_fs_mount_list(&mounts);
-    qmp_guest_fsfreeze_thaw(NULL);
-    return 0;
+    return ret;
 }
+/*########################################################################################################*/
 
-/*
- * Walk list of frozen file systems in the guest, and thaw them.
- */
-int64_t qmp_guest_fsfreeze_thaw(Error **errp)
+/*BlockQueue*/
+/*########################################################################################################*/
+#define GUEST_BLKQ_RULES "/etc/udev/rules.d/61-qemu-ga-block-queue.rules"
+#define GUEST_BLKQ_RULE_PREFIX \
+    "ACTION==\"add|change\", SUBSYSTEM==\"block\", ENV{DEVTYPE}==\"disk\", "
+
+/* the attributes in the order they are written: the scheduler first */
+static const char *const guest_blkq_attrs[] = {
+    "scheduler", "nr_requests", "read_ahead_kb"
+};
+
+static bool guest_disk_address_equal(const GuestDiskAddress *a,
+                                     const GuestDiskAddress *b)
 {
-    int ret;
-    FsMountList mounts;
-    FsMount *mount;
-    int fd, i = 0, logged;
-    Error *local_err = NULL;
+    return a->pci_controller->domain == b->pci_controller->domain &&
+           a->pci_controller->bus == b->pci_controller->bus &&
+           a->pci_controller->slot == b->pci_controller->slot &&
+           a->pci_controller->function == b->pci_controller->function &&
+           a->bus_type == b->bus_type && a->bus == b->bus &&
+           a->target == b->target && a->unit == b->unit;
+}
 
-    QTAILQ_INIT(&mounts);
-    build_fs_mount_list(&mounts, &local_err);
-    if (local_err) {
-        error_propagate(errp, local_err);
-        return 0;
-    }
+static bool guest_blkq_devnum(const char *name, unsigned int *major,
+                              unsigned int *minor)
+{
+    char path[PATH_MAX], buf[32];
 
-    QTAILQ_FOREACH(mount, &mounts, next) {
-        logged = false;
-        fd = qemu_open(mount->dirname, O_RDONLY);
-        if (fd == -1) {
-            continue;
-        }
-        /* we have no way of knowing whether a filesystem was actually unfrozen
-         * as a result of a successful call to FITHAW, only that if an error
-         * was returned the filesystem was *not* unfrozen by that particular
-         * call.
-         *
-         * since multiple preceding FIFREEZEs require multiple calls to FITHAW
-         * to unfreeze, continuing issuing FITHAW until an error is returned,
-         * in which case either the filesystem is in an unfreezable state, or,
-         * more likely, it was thawed previously (and remains so afterward).
-         *
-         * also, since the most recent successful call is the one that did
-         * the actual unfreeze, we can use this to provide an accurate count
-         * of the number of filesystems unfrozen by guest-fsfreeze-thaw, which
-         * may * be useful for determining whether a filesystem was unfrozen
-         * during the freeze/thaw phase by a process other than qemu-ga.
-         */
-        do {
-            ret = ioctl(fd, FITHAW);
-            if (ret == 0 && !logged) {
-                i++;
-                logged = true;
-            }
-        } while (ret == 0);
-        close(fd);
-    }
+    snprintf(path, sizeof(path), "/sys/block/%s/dev", name);
+    return ga_read_proc_file(AT_FDCWD, path, buf, sizeof(buf)) > 0 &&
+           sscanf(buf, "%u:%u", major, minor) == 2;
+}
 
-    ga_unset_frozen(ga_state);
-    free_fs_mount_list(&mounts);
+/* whether @name is a disk with a device behind it, see guest_sample_disk() */
+static bool guest_blkq_is_disk(const char *name)
+{
+    char path[PATH_MAX];
+
+    if (!*name || name[0] == '.' || strchr(name, '/')) {
+        return false;
+    }
+    snprintf(path, sizeof(path), "/sys/block/%s/device", name);
+    return access(path, F_OK) == 0;
+}
 
-    execute_fsfreeze_hook(FSFREEZE_HOOK_THAW, errp);
+static void guest_blkq_add(GPtrArray *names, const char *name)
+{
+    guint i;
 
-    return i;
+    for (i = 0; i < names->len; i++) {
+        if (!strcmp(g_ptr_array_index(names, i), name)) {
+            return;
+        }
+    }
+    g_ptr_array_add(names, g_strdup(name));
 }
 
-static void guest_fsfreeze_cleanup(void)
+/* add the names of the disks @dev stands for to @names */
+static bool guest_blkq_find(const GuestBlockQueueDevice *dev,
+                            GPtrArray *names, Error **errp)
 {
-    Error *err = NULL;
+    GuestDiskAddressList *disk, *l;
+    struct dirent *de;
+    unsigned int major, minor;
+    bool found = false;
+    DIR *d;
 
-    if (ga_is_frozen(ga_state) == GUEST_FSFREEZE_STATUS_FROZEN) {
-        qmp_guest_fsfreeze_thaw(&err);
-        if (err) {
-            slog("failed to clean up frozen filesystems: %s",
-                 error_get_pretty(err));
-            error_free(err);
+    if (dev->has_name == dev->has_disk) {
+        error_setg(errp, "a device needs either 'name' or 'disk'");
+        return false;
+    }
+    if (dev->has_name) {
+        if (!guest_blkq_is_disk(dev->name)) {
+            error_setg(errp, "no disk '%s'", dev->name);
+            return false;
+        }
+        guest_blkq_add(names, dev->name);
+        return true;
+    }
+
+    d = opendir("/sys/block");
+    if (!d) {
+        error_setg_errno(errp, errno, "failed to open /sys/block");
+        return false;
+    }
+    while ((de = readdir(d))) {
+        if (!guest_blkq_is_disk(de->d_name) ||
+            !guest_blkq_devnum(de->d_name, &major, &minor)) {
+            continue;
         }
+        disk = guest_diskstat_resolve(major, minor);
+        for (l = disk; l; l = l->next) {
+            if (guest_disk_address_equal(l->value, dev->disk)) {
+                guest_blkq_add(names, de->d_name);
+                found = true;
+                break;
+            }
+        }
+        qapi_free_GuestDiskAddressList(disk);
+    }
+    closedir(d);
+
+    if (!found) {
+        error_setg(errp, "no disk at %04" PRIx64 ":%02" PRIx64 ":%02" PRIx64
+                   ".%" PRIx64 " %s %" PRId64 ":%" PRId64 ":%" PRId64,
+                   dev->disk->pci_controller->domain,
+                   dev->disk->pci_controller->bus,
+                   dev->disk->pci_controller->slot,
+                   dev->disk->pci_controller->function,
+                   GuestDiskBusType_lookup[dev->disk->bus_type],
+                   dev->disk->bus, dev->disk->target, dev->disk->unit);
     }
+    return found;
 }
-#endif /* CONFIG_FSFREEZE */
 
-#if defined(CONFIG_FSTRIM)
-/*
- * Walk list of mounted file systems in the guest, and trim them.
- */
-GuestFilesystemTrimResponse *
-qmp_guest_fstrim(bool has_minimum, int64_t minimum, Error **errp)
+static bool guest_blkq_read_attr(int dirfd, const char *attr, char *buf,
+                                 size_t size, Error **errp)
 {
-    GuestFilesystemTrimResponse *response;
-    GuestFilesystemTrimResultList *list;
-    GuestFilesystemTrimResult *result;
-    int ret = 0;
-    FsMountList mounts;
-    struct FsMount *mount;
-    int fd;
     Error *local_err = NULL;
-    struct fstrim_range r;
-
-    slog("guest-fstrim called");
 
-    QTAILQ_INIT(&mounts);
-    build_fs_mount_list(&mounts, &local_err);
+    memset(buf, 0, size);
+    ga_read_sysfs_file(dirfd, attr, buf, size - 1, &local_err);
     if (local_err) {
         error_propagate(errp, local_err);
-        return NULL;
+        return false;
     }
+    g_strstrip(buf);
+    return true;
+}
 
-    response = g_malloc0(sizeof(*response));
-
-    QTAILQ_FOREACH(mount, &mounts, next) {
-        result = g_malloc0(sizeof(*result));
-        result->path = g_strdup(mount->dirname);
+/*
+ * Read what @params would change on disk @name, making sure the scheduler
+ * it asks for is one the disk offers.
+ */
+static GuestBlockQueueParams *
+guest_blkq_get(const char *name, const GuestBlockQueueParams *params,
+               Error **errp)
+{
+    GuestBlockQueueParams *prev = g_new0(GuestBlockQueueParams, 1);
+    char path[PATH_MAX], buf[256], *start, *end;
+    int dirfd;
 
-        list = g_malloc0(sizeof(*list));
-        list->value = result;
-        list->next = response->paths;
-        response->paths = list;
+    snprintf(path, sizeof(path), "/sys/block/%s/queue", name);
+    dirfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirfd == -1) {
+        error_setg_errno(errp, errno, "failed to open %s", path);
+        goto fail;
+    }
 
-        fd = qemu_open(mount->dirname, O_RDONLY);
-        if (fd == -1) {
-            result->error = g_strdup_printf("failed to open: %s",
-                                            strerror(errno));
-            result->has_error = true;
-            continue;
+    if (params->has_scheduler) {
+        /* "mq-deadline kyber [none]", or just "none" without a choice */
+        if (!guest_blkq_read_attr(dirfd, "scheduler", buf, sizeof(buf),
+                                  errp)) {
+            goto fail;
         }
-
-        /* We try to cull filesytems we know won't work in advance, but other
-         * filesytems may not implement fstrim for less obvious reasons.  These
-         * will report EOPNOTSUPP; while in some other cases ENOTTY will be
-         * reported (e.g. CD-ROMs).
-         * Any other error means an unexpected error.
-         */
-        r.start = 0;
-        r.len = -1;
-        r.minlen = has_minimum ? minimum : 0;
-        ret = ioctl(fd, FITRIM, &r);
-        if (ret == -1) {
-            result->has_error = true;
-            if (errno == ENOTTY || errno == EOPNOTSUPP) {
-                result->error = g_strdup("trim not supported");
-            } else {
-                result->error = g_strdup_printf("failed to trim: %s",
-                                                strerror(errno));
-            }
-            close(fd);
-            continue;
+        if (!guest_suspend_has_mode(buf, params->scheduler)) {
+            error_setg(errp, "disk '%s' has no scheduler '%s'", name,
+                       params->scheduler);
+            goto fail;
         }
-
-        result->has_minimum = true;
-        result->minimum = r.minlen;
-        result->has_trimmed = true;
-        result->trimmed = r.len;
-        close(fd);
+        start = strchr(buf, '[');
+        end = start ? strchr(start, ']') : NULL;
+        if (start && end) {
+            *end = '\0';
+            start++;
+        } else {
+            start = buf;
+        }
+        prev->has_scheduler = true;
+        prev->scheduler = g_strdup(start);
+    }
+    /* switching the scheduler resets nr_requests to its default */
+    if (params->has_nr_requests || params->has_scheduler) {
+        if (!guest_blkq_read_attr(dirfd, "nr_requests", buf, sizeof(buf),
+                                  errp)) {
+            goto fail;
+        }
+        prev->has_nr_requests = true;
+        prev->nr_requests = g_ascii_strtoll(buf, NULL, 10);
+    }
+    if (params->has_read_ahead_kb) {
+        if (!guest_blkq_read_attr(dirfd, "read_ahead_kb", buf, sizeof(buf),
+                                  errp)) {
+            goto fail;
+        }
+        prev->has_read_ahead_kb = true;
+        prev->read_ahead_kb = g_ascii_strtoll(buf, NULL, 10);
     }
 
-    free_fs_mount_list(&mounts);
-    return response;
-}
-#endif /* CONFIG_FSTRIM */
+    close(dirfd);
+    return prev;
 
+fail:
+    if (dirfd != -1) {
+        close(dirfd);
+    }
+    qapi_free_GuestBlockQueueParams(prev);
+    return NULL;
+}
 
-#define LINUX_SYS_STATE_FILE "/sys/power/state"
-#define SUSPEND_SUPPORTED 0
-#define SUSPEND_NOT_SUPPORTED 1
+/* the values of @params as sysfs strings, NULL for those left out */
+static void guest_blkq_values(const GuestBlockQueueParams *params,
+                              char **values)
+{
+    values[0] = params->has_scheduler ? g_strdup(params->scheduler) : NULL;
+    values[1] = params->has_nr_requests ?
+                g_strdup_printf("%" PRId64, params->nr_requests) : NULL;
+    values[2] = params->has_read_ahead_kb ?
+                g_strdup_printf("%" PRId64, params->read_ahead_kb) : NULL;
+}
 
-static void bios_supports_mode(const char *pmutils_bin, const char *pmutils_arg,
-                               const char *sysfile_str, Error **errp)
+static bool guest_blkq_set(const char *name,
+                           const GuestBlockQueueParams *params, Error **errp)
 {
+    char path[PATH_MAX], *values[G_N_ELEMENTS(guest_blkq_attrs)];
     Error *local_err = NULL;
-    char *pmutils_path;
-    pid_t pid;
-    int status;
+    int dirfd, i;
 
-    pmutils_path = g_find_program_in_path(pmutils_bin);
+    snprintf(path, sizeof(path), "/sys/block/%s/queue", name);
+    dirfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirfd == -1) {
+        error_setg_errno(errp, errno, "failed to open %s", path);
+        return false;
+    }
+    guest_blkq_values(params, values);
+    for (i = 0; i < G_N_ELEMENTS(guest_blkq_attrs); i++) {
+        if (values[i] && !local_err) {
+            ga_write_sysfs_file(dirfd, guest_blkq_attrs[i], values[i],
+                                strlen(values[i]), &local_err);
+        }
+        g_free(values[i]);
+    }
+    close(dirfd);
 
-    pid = fork();
-    if (!pid) {
-        char buf[32]; /* hopefully big enough */
-        ssize_t ret;
-        int fd;
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return false;
+    }
+    return true;
+}
 
-        setsid();
-        reopen_fd_to_null(0);
-        reopen_fd_to_null(1);
-        reopen_fd_to_null(2);
+/* how the udev rule recognizes disk @name: by ID_PATH if udev knows it */
+static char *guest_blkq_udev_match(const char *name)
+{
+    char path[64], *data = NULL, *line, *nl, *match = NULL;
+    unsigned int major, minor;
 
-        if (pmutils_path) {
-            execle(pmutils_path, pmutils_bin, pmutils_arg, NULL, environ);
+    if (guest_blkq_devnum(name, &major, &minor)) {
+        snprintf(path, sizeof(path), "/run/udev/data/b%u:%u", major, minor);
+        g_file_get_contents(path, &data, NULL, NULL);
+    }
+    for (line = data; line && *line && !match; line = nl) {
+        nl = strchr(line, '\n');
+        if (nl) {
+            *nl++ = '\0';
+        }
+        if (g_str_has_prefix(line, "E:ID_PATH=") && line[10]) {
+            match = g_strdup_printf("ENV{ID_PATH}==\"%s\"", line + 10);
         }
+    }
+    g_free(data);
+    return match ? match : g_strdup_printf("KERNEL==\"%s\"", name);
+}
 
-        /*
-         * If we get here either pm-utils is not installed or execle() has
-         * failed. Let's try the manual method if the caller wants it.
-         */
+/*
+ * Update the udev rule of disk @name in @rules so that it sets @params too.
+ * Attributes an earlier call persisted and @params leaves out are kept.
+ */
+static void guest_blkq_update_rule(GString *rules, const char *name,
+                                   const GuestBlockQueueParams *params)
+{
+    char *values[G_N_ELEMENTS(guest_blkq_attrs)];
+    char *prefix, *match, *start, *end, *line, *p, attr[32], value[64];
+    const char *sep = "";
+    int i;
 
-        if (!sysfile_str) {
-            _exit(SUSPEND_NOT_SUPPORTED);
-        }
+    match = guest_blkq_udev_match(name);
+    prefix = g_strdup_printf(GUEST_BLKQ_RULE_PREFIX "%s, ", match);
+    guest_blkq_values(params, values);
 
-        fd = open(LINUX_SYS_STATE_FILE, O_RDONLY);
-        if (fd < 0) {
-            _exit(SUSPEND_NOT_SUPPORTED);
+    /* take over the old line's attributes, then drop it */
+    for (start = rules->str; *start; start = end) {
+        end = strchr(start, '\n');
+        end = end ? end + 1 : start + strlen(start);
+        if (!g_str_has_prefix(start, prefix)) {
+            continue;
         }
-
-        ret = read(fd, buf, sizeof(buf)-1);
-        if (ret <= 0) {
-            _exit(SUSPEND_NOT_SUPPORTED);
+        line = g_strndup(start, end - start);
+        for (p = strstr(line, "ATTR{queue/"); p;
+             p = strstr(p + 1, "ATTR{queue/")) {
+            if (sscanf(p, "ATTR{queue/%31[^}]}=\"%63[^\"]\"", attr,
+                       value) != 2) {
+                continue;
+            }
+            for (i = 0; i < G_N_ELEMENTS(guest_blkq_attrs); i++) {
+                if (!strcmp(attr, guest_blkq_attrs[i]) && !values[i]) {
+                    values[i] = g_strdup(value);
+                }
+            }
         }
-        buf[ret] = '\0';
+        g_free(line);
+        g_string_erase(rules, start - rules->str, end - start);
+        break;
+    }
 
-        if (strstr(buf, sysfile_str)) {
-            _exit(SUSPEND_SUPPORTED);
+    g_string_append(rules, prefix);
+    for (i = 0; i < G_N_ELEMENTS(guest_blkq_attrs); i++) {
+        if (values[i]) {
+            g_string_append_printf(rules, "%sATTR{queue/%s}=\"%s\"", sep,
+                                   guest_blkq_attrs[i], values[i]);
+            sep = ", ";
         }
-
-        _exit(SUSPEND_NOT_SUPPORTED);
-    } else if (pid < 0) {
-        error_setg_errno(errp, errno, "failed to create child process");
-        goto out;
+        g_free(values[i]);
     }
+    g_string_append_c(rules, '\n');
 
-    ga_wait_child(pid, &status, &local_err);
-    if (local_err) {
-        error_propagate(errp, local_err);
-        goto out;
-    }
+    g_free(prefix);
+    g_free(match);
+}
 
-    if (!WIFEXITED(status)) {
-        error_setg(errp, "child process has terminated abnormally");
-        goto out;
-    }
+static bool guest_blkq_persist(GPtrArray *names,
+                               const GuestBlockQueueParams *params,
+                               Error **errp)
+{
+    GString *rules;
+    char *contents = NULL;
+    guint i;
+    int ret;
 
-    switch (WEXITSTATUS(status)) {
-    case SUSPEND_SUPPORTED:
-        goto out;
-    case SUSPEND_NOT_SUPPORTED:
-        error_setg(errp,
-                   "the requested suspend mode is not supported by the guest");
-        goto out;
-    default:
-        error_setg(errp,
-                   "the helper program '%s' returned an unexpected exit status"
-                   " code (%d)", pmutils_path, WEXITSTATUS(status));
-        goto out;
+    rules = g_string_new(NULL);
+    if (g_file_get_contents(GUEST_BLKQ_RULES, &contents, NULL, NULL)) {
+        g_string_append(rules, contents);
+        g_free(contents);
+    } else {
+        g_string_append(rules, "# written by qemu-ga, see "
+                        "guest-set-block-queue-params\n");
+    }
+    if (rules->len && rules->str[rules->len - 1] != '\n') {
+        g_string_append_c(rules, '\n');
+    }
+    for (i = 0; i < names->len; i++) {
+        guest_blkq_update_rule(rules, g_ptr_array_index(names, i), params);
     }
 
-out:
-    g_free(pmutils_path);
+    ret = ga_collect_replace_file(GUEST_BLKQ_RULES, rules->str, rules->len);
+    if (ret) {
+        error_setg_errno(errp, ret, "failed to write %s", GUEST_BLKQ_RULES);
+    }
+    g_string_free(rules, true);
+    return !ret;
 }
 
-static void guest_suspend(const char *pmutils_bin, const char *sysfile_str,
-                          Error **errp)
+GuestBlockQueueResultList *
+qmp_guest_set_block_queue_params(GuestBlockQueueDeviceList *devices,
+                                 GuestBlockQueueParams *params,
+                                 bool has_persist, bool persist,
+                                 Error **errp)
 {
+    GuestBlockQueueResultList *head = NULL, **link = &head, *entry;
+    GuestBlockQueueParams **prev = NULL;
+    GPtrArray *names;
     Error *local_err = NULL;
-    char *pmutils_path;
-    pid_t pid;
-    int status;
+    guint i, done = 0;
+    const char *p;
 
-    pmutils_path = g_find_program_in_path(pmutils_bin);
-
-    pid = fork();
-    if (pid == 0) {
-        /* child */
-        int fd;
-
-        setsid();
-        reopen_fd_to_null(0);
-        reopen_fd_to_null(1);
-        reopen_fd_to_null(2);
-
-        if (pmutils_path) {
-            execle(pmutils_path, pmutils_bin, NULL, environ);
+    if (!params->has_scheduler && !params->has_nr_requests &&
+        !params->has_read_ahead_kb) {
+        error_setg(errp, "no attribute to set");
+        return NULL;
+    }
+    if (params->has_scheduler) {
+        for (p = params->scheduler; *p; p++) {
+            if (!g_ascii_isalnum(*p) && !strchr("-_", *p)) {
+                break;
+            }
         }
-
-        /*
-         * If we get here either pm-utils is not installed or execle() has
-         * failed. Let's try the manual method if the caller wants it.
-         */
-
-        if (!sysfile_str) {
-            _exit(EXIT_FAILURE);
+        if (*p || !*params->scheduler) {
+            error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "scheduler",
+                       "a scheduler name");
+            return NULL;
         }
+    }
+    if (params->has_nr_requests && params->nr_requests <= 0) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "nr-requests",
+                   "a positive number");
+        return NULL;
+    }
+    if (params->has_read_ahead_kb && params->read_ahead_kb < 0) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "read-ahead-kb",
+                   "a number of KiB");
+        return NULL;
+    }
 
-        fd = open(LINUX_SYS_STATE_FILE, O_WRONLY);
-        if (fd < 0) {
-            _exit(EXIT_FAILURE);
+    names = g_ptr_array_new_with_free_func(g_free);
+    for (; devices; devices = devices->next) {
+        if (!guest_blkq_find(devices->value, names, &local_err)) {
+            goto out;
         }
+    }
 
-        if (write(fd, sysfile_str, strlen(sysfile_str)) < 0) {
-            _exit(EXIT_FAILURE);
+    /* check and read everything first, so that little can fail later */
+    prev = g_new0(GuestBlockQueueParams *, names->len);
+    for (i = 0; i < names->len; i++) {
+        prev[i] = guest_blkq_get(g_ptr_array_index(names, i), params,
+                                 &local_err);
+        if (!prev[i]) {
+            goto out;
         }
-
-        _exit(EXIT_SUCCESS);
-    } else if (pid < 0) {
-        error_setg_errno(errp, errno, "failed to create child process");
-        goto out;
     }
 
-    ga_wait_child(pid, &status, &local_err);
+    for (done = 0; done < names->len && !local_err; done++) {
+        guest_blkq_set(g_ptr_array_index(names, done), params, &local_err);
+    }
+    if (!local_err && has_persist && persist) {
+        guest_blkq_persist(names, params, &local_err);
+    }
     if (local_err) {
-        error_propagate(errp, local_err);
+        /* undo, including the disk that failed part way */
+        while (done-- > 0) {
+            guest_blkq_set(g_ptr_array_index(names, done), prev[done], NULL);
+        }
         goto out;
     }
 
-    if (!WIFEXITED(status)) {
-        error_setg(errp, "child process has terminated abnormally");
-        goto out;
+    for (i = 0; i < names->len; i++) {
+        entry = g_new0(GuestBlockQueueResultList, 1);
+        entry->value = g_new0(GuestBlockQueueResult, 1);
+        entry->value->name = g_strdup(g_ptr_array_index(names, i));
+        entry->value->previous = prev[i];
+        prev[i] = NULL;
+        *link = entry;
+        link = &entry->next;
     }
 
-    if (WEXITSTATUS(status)) {
-        error_setg(errp, "child process has failed to suspend");
-        goto out;
+out:
+    if (prev) {
+        for (i = 0; i < names->len; i++) {
+            qapi_free_GuestBlockQueueParams(prev[i]);
+        }
+        g_free(prev);
     }
+    g_ptr_array_free(names, true);
+    error_propagate(errp, local_err);
+    return head;
+}
+/*########################################################################################################*/
 
-out:
-    g_free(pmutils_path);
+/*Profile*/
+/*########################################################################################################*/
+/*
+ * The applied profile lives in a key file in the state directory: its name,
+ * its settings in order, and the value each file it wrote had before the
+ * first profile touched it.
+ */
+#define GUEST_PROFILE_FILE "qga.profile"
+
+typedef struct GuestProfileEntry {
+    const char *key;
+    char *path;
+    const char *value;
+    char *current;              /* as guest_profile_normalize() leaves it */
+} GuestProfileEntry;
+
+static char *guest_profile_filename(void)
+{
+    return g_build_filename(ga_get_state_dir(ga_state), GUEST_PROFILE_FILE,
+                            NULL);
 }
 
-void qmp_guest_suspend_disk(Error **errp)
+/*
+ * Contents of a file as they compare to a value: of choices shown as
+ * "a [b] c" the one in brackets, otherwise the words separated by single
+ * spaces.  Either can be written back.
+ */
+static char *guest_profile_normalize(const char *contents)
 {
-    Error *local_err = NULL;
+    const char *start = strchr(contents, '[');
+    const char *end = start ? strchr(start, ']') : NULL;
+    GString *out;
+    gchar **words;
+    int i;
 
-    bios_supports_mode("pm-is-supported", "--hibernate", "disk", &local_err);
-    if (local_err) {
-        error_propagate(errp, local_err);
-        return;
+    if (end) {
+        return g_strndup(start + 1, end - start - 1);
     }
-
-    guest_suspend("pm-hibernate", "disk", errp);
+    out = g_string_new(NULL);
+    words = g_strsplit_set(contents, " \t\n", -1);
+    for (i = 0; words[i]; i++) {
+        if (*words[i]) {
+            if (out->len) {
+                g_string_append_c(out, ' ');
+            }
+            g_string_append(out, words[i]);
+        }
+    }
+    g_strfreev(words);
+    return g_string_free(out, false);
 }
 
-void qmp_guest_suspend_ram(Error **errp)
+static char *guest_profile_read(const char *path)
 {
-    Error *local_err = NULL;
+    char buf[4096];
+    ssize_t len;
+    int fd;
 
-    bios_supports_mode("pm-is-supported", "--suspend", "mem", &local_err);
-    if (local_err) {
-        error_propagate(errp, local_err);
-        return;
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return NULL;
     }
-
-    guest_suspend("pm-suspend", "mem", errp);
+    len = pread(fd, buf, sizeof(buf) - 1, 0);
+    close(fd);
+    if (len < 0) {
+        return NULL;
+    }
+    buf[len] = '\0';
+    return guest_profile_normalize(buf);
 }
 
-void qmp_guest_suspend_hybrid(Error **errp)
+static bool guest_profile_write(const char *path, const char *value,
+                                Error **errp)
 {
-    Error *local_err = NULL;
+    ssize_t len;
+    int fd;
 
-    bios_supports_mode("pm-is-supported", "--suspend-hybrid", NULL,
-                       &local_err);
-    if (local_err) {
-        error_propagate(errp, local_err);
-        return;
+    fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd == -1) {
+        error_setg_errno(errp, errno, "failed to open %s", path);
+        return false;
     }
-
-    guest_suspend("pm-suspend-hybrid", NULL, errp);
+    len = pwrite(fd, value, strlen(value), 0);
+    if (len < 0) {
+        error_setg_errno(errp, errno, "failed to write '%s' to %s", value,
+                         path);
+    }
+    close(fd);
+    return len >= 0;
 }
 
-static GuestNetworkInterfaceList *
-guest_find_interface(GuestNetworkInterfaceList *head,
-                     const char *name)
+/* add the files setting @key stands for to @entries */
+static bool guest_profile_expand(const char *key, const char *value,
+                                 GArray *entries, Error **errp)
 {
-    for (; head; head = head->next) {
-        if (strcmp(head->value->name, name) == 0) {
-            break;
+    GuestProfileEntry e = { .key = key, .value = value };
+    char *path;
+    glob_t g;
+    size_t i;
+
+    if (g_str_has_prefix(key, "/sys/")) {
+        path = g_strdup(key);
+    } else if (*key && *key != '/' && !strpbrk(key, "*?[")) {
+        path = g_strconcat("/proc/sys/", key, NULL);
+        if (!strchr(key, '/')) {
+            /* "vm.swappiness" */
+            g_strdelimit(path + strlen("/proc/sys/"), ".", '/');
         }
+    } else {
+        error_setg(errp, "'%s' is neither a sysctl nor a path below /sys",
+                   key);
+        return false;
+    }
+    if (strstr(path, "/../") || g_str_has_suffix(path, "/..")) {
+        error_setg(errp, "'%s' is neither a sysctl nor a path below /sys",
+                   key);
+        g_free(path);
+        return false;
     }
 
-    return head;
+    if (glob(path, 0, NULL, &g) != 0) {
+        error_setg(errp, "no file for '%s'", key);
+        g_free(path);
+        return false;
+    }
+    for (i = 0; i < g.gl_pathc; i++) {
+        e.path = g_strdup(g.gl_pathv[i]);
+        g_array_append_val(entries, e);
+    }
+    globfree(&g);
+    g_free(path);
+    return true;
 }
 
-/*
- * Build information about guest interfaces
- */
-GuestNetworkInterfaceList *qmp_guest_network_get_interfaces(Error **errp)
+static void guest_profile_entries_free(GArray *entries)
 {
-    GuestNetworkInterfaceList *head = NULL, *cur_item = NULL;
-    struct ifaddrs *ifap, *ifa;
+    GuestProfileEntry *e;
+    guint i;
 
-    if (getifaddrs(&ifap) < 0) {
-        error_setg_errno(errp, errno, "getifaddrs failed");
-        goto error;
+    for (i = 0; i < entries->len; i++) {
+        e = &g_array_index(entries, GuestProfileEntry, i);
+        g_free(e->path);
+        g_free(e->current);
     }
+    g_array_free(entries, true);
+}
 
-    for (ifa = ifap; ifa; ifa = ifa->ifa_next) {
-        GuestNetworkInterfaceList *info;
-        GuestIpAddressList **address_list = NULL, *address_item = NULL;
-        char addr4[INET_ADDRSTRLEN];
-        char addr6[INET6_ADDRSTRLEN];
-        int sock;
-        struct ifreq ifr;
-        unsigned char *mac_addr;
-        void *p;
-
-        g_debug("Processing %s interface", ifa->ifa_name);
+static GKeyFile *guest_profile_load(void)
+{
+    GKeyFile *kf = g_key_file_new();
+    char *filename = guest_profile_filename();
 
-        info = guest_find_interface(head, ifa->ifa_name);
+    if (!g_key_file_load_from_file(kf, filename, G_KEY_FILE_NONE, NULL)) {
+        g_key_file_free(kf);
+        kf = NULL;
+    }
+    g_free(filename);
+    return kf;
+}
 
-        if (!info) {
-            info = g_malloc0(sizeof(*info));
-            info->value = g_malloc0(sizeof(*info->value));
-            info->value->name = g_strdup(ifa->ifa_name);
+static bool guest_profile_save(const char *name,
+                               GuestProfileSettingList *settings,
+                               GHashTable *previous, Error **errp)
+{
+    GKeyFile *kf = g_key_file_new();
+    GHashTableIter iter;
+    gpointer path, value;
+    char *filename, *data;
+    gsize len;
+    int ret;
 
-            if (!cur_item) {
-                head = cur_item = info;
-            } else {
-                cur_item->next = info;
-                cur_item = info;
-            }
-        }
+    g_key_file_set_string(kf, "profile", "name", name);
+    for (; settings; settings = settings->next) {
+        g_key_file_set_string(kf, "settings", settings->value->key,
+                              settings->value->value);
+    }
+    g_hash_table_iter_init(&iter, previous);
+    while (g_hash_table_iter_next(&iter, &path, &value)) {
+        g_key_file_set_string(kf, "previous", path, value);
+    }
 
-        if (!info->value->has_hardware_address &&
-            ifa->ifa_flags & SIOCGIFHWADDR) {
-            /* we haven't obtained HW address yet */
-            sock = socket(PF_INET, SOCK_STREAM, 0);
-            if (sock == -1) {
-                error_setg_errno(errp, errno, "failed to create socket");
-                goto error;
-            }
+    filename = guest_profile_filename();
+    data = g_key_file_to_data(kf, &len, NULL);
+    ret = ga_collect_replace_file(filename, data, len);
+    if (ret) {
+        error_setg_errno(errp, ret, "failed to write %s", filename);
+    }
+    g_free(data);
+    g_free(filename);
+    g_key_file_free(kf);
+    return !ret;
+}
 
-            memset(&ifr, 0, sizeof(ifr));
-            pstrcpy(ifr.ifr_name, IF_NAMESIZE, info->value->name);
-            if (ioctl(sock, SIOCGIFHWADDR, &ifr) == -1) {
-                error_setg_errno(errp, errno,
-                                 "failed to get MAC address of %s",
-                                 ifa->ifa_name);
-                close(sock);
-                goto error;
+static GuestProfile *guest_profile_report(GKeyFile *kf)
+{
+    GuestProfile *profile = g_new0(GuestProfile, 1);
+    GuestProfileFileList **link = &profile->files, *entry;
+    GuestProfileEntry *e;
+    GArray *entries;
+    gchar **keys;
+    char *value, *wanted;
+    guint i;
+    int k;
+
+    if (!kf) {
+        return profile;
+    }
+    profile->name = g_key_file_get_string(kf, "profile", "name", NULL);
+    profile->has_name = profile->name != NULL;
+
+    keys = g_key_file_get_keys(kf, "settings", NULL, NULL);
+    for (k = 0; keys && keys[k]; k++) {
+        value = g_key_file_get_string(kf, "settings", keys[k], NULL);
+        entries = g_array_new(false, false, sizeof(GuestProfileEntry));
+        /* a key that matches no file any more has nothing to report */
+        if (value && guest_profile_expand(keys[k], value, entries, NULL)) {
+            wanted = guest_profile_normalize(value);
+            for (i = 0; i < entries->len; i++) {
+                e = &g_array_index(entries, GuestProfileEntry, i);
+                entry = g_new0(GuestProfileFileList, 1);
+                entry->value = g_new0(GuestProfileFile, 1);
+                entry->value->key = g_strdup(keys[k]);
+                entry->value->path = g_strdup(e->path);
+                entry->value->value = g_strdup(value);
+                entry->value->current = guest_profile_read(e->path);
+                entry->value->has_current = entry->value->current != NULL;
+                entry->value->drifted = !entry->value->current ||
+                                        strcmp(entry->value->current, wanted);
+                profile->drifted |= entry->value->drifted;
+                *link = entry;
+                link = &entry->next;
             }
-
-            close(sock);
-            mac_addr = (unsigned char *) &ifr.ifr_hwaddr.sa_data;
-
-            info->value->hardware_address =
-                g_strdup_printf("%02x:%02x:%02x:%02x:%02x:%02x",
-                                (int) mac_addr[0], (int) mac_addr[1],
-                                (int) mac_addr[2], (int) mac_addr[3],
-                                (int) mac_addr[4], (int) mac_addr[5]);
-
-            info->value->has_hardware_address = true;
+            g_free(wanted);
         }
+        guest_profile_entries_free(entries);
+        g_free(value);
+    }
+    g_strfreev(keys);
+    return profile;
+}
 
-        if (ifa->ifa_addr &&
-            ifa->ifa_addr->sa_family == AF_INET) {
-            /* interface with IPv4 address */
-            p = &((struct sockaddr_in *)ifa->ifa_addr)->sin_addr;
-            if (!inet_ntop(AF_INET, p, addr4, sizeof(addr4))) {
-                error_setg_errno(errp, errno, "inet_ntop failed");
-                goto error;
-            }
-
-            address_item = g_malloc0(sizeof(*address_item));
-            address_item->value = g_malloc0(sizeof(*address_item->value));
-            address_item->value->ip_address = g_strdup(addr4);
-            address_item->value->ip_address_type = GUEST_IP_ADDRESS_TYPE_IPV4;
-
-            if (ifa->ifa_netmask) {
-                /* Count the number of set bits in netmask.
-                 * This is safe as '1' and '0' cannot be shuffled in netmask. */
-                p = &((struct sockaddr_in *)ifa->ifa_netmask)->sin_addr;
-                address_item->value->prefix = ctpop32(((uint32_t *) p)[0]);
-            }
-        } else if (ifa->ifa_addr &&
-                   ifa->ifa_addr->sa_family == AF_INET6) {
-            /* interface with IPv6 address */
-            p = &((struct sockaddr_in6 *)ifa->ifa_addr)->sin6_addr;
-            if (!inet_ntop(AF_INET6, p, addr6, sizeof(addr6))) {
-                error_setg_errno(errp, errno, "inet_ntop failed");
-                goto error;
-            }
+GuestProfile *qmp_guest_set_profile(const char *name,
+                                    GuestProfileSettingList *settings,
+                                    Error **errp)
+{
+    GuestProfile *profile = NULL;
+    GuestProfileSettingList *l;
+    GuestProfileEntry *e;
+    GHashTable *previous, *paths;
+    GHashTableIter iter;
+    GKeyFile *kf;
+    GArray *entries;
+    Error *local_err = NULL;
+    gpointer path, value;
+    gchar **keys;
+    guint i, done;
+    int k;
+
+    entries = g_array_new(false, false, sizeof(GuestProfileEntry));
+    previous = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+    /* find and read every file first, so that little can fail later */
+    for (l = settings; l; l = l->next) {
+        if (!*l->value->value) {
+            error_setg(&local_err, "no value for '%s'", l->value->key);
+            goto out;
+        }
+        if (!guest_profile_expand(l->value->key, l->value->value, entries,
+                                  &local_err)) {
+            goto out;
+        }
+    }
+    for (i = 0; i < entries->len; i++) {
+        e = &g_array_index(entries, GuestProfileEntry, i);
+        e->current = guest_profile_read(e->path);
+        if (!e->current) {
+            error_setg_errno(&local_err, errno, "failed to read %s", e->path);
+            goto out;
+        }
+    }
 
-            address_item = g_malloc0(sizeof(*address_item));
-            address_item->value = g_malloc0(sizeof(*address_item->value));
-            address_item->value->ip_address = g_strdup(addr6);
-            address_item->value->ip_address_type = GUEST_IP_ADDRESS_TYPE_IPV6;
+    for (done = 0; done < entries->len && !local_err; done++) {
+        e = &g_array_index(entries, GuestProfileEntry, done);
+        guest_profile_write(e->path, e->value, &local_err);
+    }
+    if (local_err) {
+        while (done-- > 0) {
+            e = &g_array_index(entries, GuestProfileEntry, done);
+            guest_profile_write(e->path, e->current, NULL);
+        }
+        goto out;
+    }
 
-            if (ifa->ifa_netmask) {
-                /* Count the number of set bits in netmask.
-                 * This is safe as '1' and '0' cannot be shuffled in netmask. */
-                p = &((struct sockaddr_in6 *)ifa->ifa_netmask)->sin6_addr;
-                address_item->value->prefix =
-                    ctpop32(((uint32_t *) p)[0]) +
-                    ctpop32(((uint32_t *) p)[1]) +
-                    ctpop32(((uint32_t *) p)[2]) +
-                    ctpop32(((uint32_t *) p)[3]);
-            }
+    /* what the files had before the first profile, then before this one */
+    kf = guest_profile_load();
+    keys = kf ? g_key_file_get_keys(kf, "previous", NULL, NULL) : NULL;
+    for (k = 0; keys && keys[k]; k++) {
+        g_hash_table_insert(previous, g_strdup(keys[k]),
+                            g_key_file_get_string(kf, "previous", keys[k],
+                                                  NULL));
+    }
+    g_strfreev(keys);
+    if (kf) {
+        g_key_file_free(kf);
+    }
+    paths = g_hash_table_new(g_str_hash, g_str_equal);
+    for (i = 0; i < entries->len; i++) {
+        e = &g_array_index(entries, GuestProfileEntry, i);
+        g_hash_table_insert(paths, e->path, e->path);
+        if (!g_hash_table_lookup(previous, e->path)) {
+            g_hash_table_insert(previous, g_strdup(e->path),
+                                g_strdup(e->current));
         }
+    }
 
-        if (!address_item) {
+    /* restore what the previous profile set and this one does not */
+    g_hash_table_iter_init(&iter, previous);
+    while (g_hash_table_iter_next(&iter, &path, &value)) {
+        if (g_hash_table_lookup(paths, path)) {
             continue;
         }
-
-        address_list = &info->value->ip_addresses;
-
-        while (*address_list && (*address_list)->next) {
-            address_list = &(*address_list)->next;
+        if (value && !guest_profile_write(path, value, &local_err)) {
+            g_debug("%s", error_get_pretty(local_err));
+            error_free(local_err);
+            local_err = NULL;
         }
+        g_hash_table_iter_remove(&iter);
+    }
+    g_hash_table_destroy(paths);
 
-        if (!*address_list) {
-            *address_list = address_item;
-        } else {
-            (*address_list)->next = address_item;
+    if (!guest_profile_save(name, settings, previous, &local_err)) {
+        /* without the previous values there is no way back, so go back now */
+        for (i = entries->len; i-- > 0;) {
+            e = &g_array_index(entries, GuestProfileEntry, i);
+            guest_profile_write(e->path, e->current, NULL);
         }
+        goto out;
+    }
 
-        info->value->has_ip_addresses = true;
+    kf = guest_profile_load();
+    profile = guest_profile_report(kf);
+    if (kf) {
+        g_key_file_free(kf);
+    }
+
+out:
+    error_propagate(errp, local_err);
+    g_hash_table_destroy(previous);
+    guest_profile_entries_free(entries);
+    return profile;
+}
 
+GuestProfile *qmp_guest_get_profile(Error **errp)
+{
+    GKeyFile *kf = guest_profile_load();
+    GuestProfile *profile = guest_profile_report(kf);
 
+    if (kf) {
+        g_key_file_free(kf);
     }
+    return profile;
+}
 
-    freeifaddrs(ifap);
-    return head;
+void qmp_guest_reset_profile(Error **errp)
+{
+    GKeyFile *kf = guest_profile_load();
+    Error *local_err = NULL;
+    char *value, *filename;
+    gchar **keys;
+    int k;
 
-error:
-    freeifaddrs(ifap);
-    qapi_free_GuestNetworkInterfaceList(head);
-    return NULL;
-}
+    if (!kf) {
+        return;
+    }
+    keys = g_key_file_get_keys(kf, "previous", NULL, NULL);
+    for (k = 0; keys && keys[k]; k++) {
+        value = g_key_file_get_string(kf, "previous", keys[k], NULL);
+        /* keep going, but report the first failure */
+        if (value) {
+            guest_profile_write(keys[k], value,
+                                local_err ? NULL : &local_err);
+        }
+        g_free(value);
+    }
+    g_strfreev(keys);
+    g_key_file_free(kf);
 
-#define SYSCONF_EXACT(name, errp) sysconf_exact((name), #name, (errp))
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return;
+    }
+    filename = guest_profile_filename();
+    if (unlink(filename) < 0 && errno != ENOENT) {
+        error_setg_errno(errp, errno, "failed to remove %s", filename);
+    }
+    g_free(filename);
+}
+/*########################################################################################################*/
 
-static long sysconf_exact(int name, const char *name_str, Error **errp)
+/*SSHKeys*/
+/*########################################################################################################*/
+/* look up @user into @pw; its strings are in *@buf, for the caller to free */
+static bool guest_getpwnam(const char *user, struct passwd *pw, char **buf,
+                           Error **errp)
 {
-    long ret;
+    struct passwd *res = NULL;
+    long size = sysconf(_SC_GETPW_R_SIZE_MAX);
+    int ret;
 
-    errno = 0;
-    ret = sysconf(name);
-    if (ret == -1) {
-        if (errno == 0) {
-            error_setg(errp, "sysconf(%s): value indefinite", name_str);
+    if (size <= 0) {
+        size = 16384;
+    }
+    for (;;) {
+        *buf = g_malloc(size);
+        ret = getpwnam_r(user, pw, *buf, size, &res);
+        if (ret != ERANGE) {
+            break;
+        }
+        g_free(*buf);
+        size *= 2;
+    }
+    if (!res) {
+        g_free(*buf);
+        *buf = NULL;
+        if (ret) {
+            error_setg_errno(errp, ret, "failed to look up user '%s'", user);
         } else {
-            error_setg_errno(errp, errno, "sysconf(%s)", name_str);
+            error_setg(errp, "user '%s' does not exist", user);
         }
+        return false;
     }
-    return ret;
+    return true;
 }
 
-/* Transfer online/offline status between @vcpu and the guest system.
- *
- * On input either @errp or *@errp must be NULL.
- *
- * In system-to-@vcpu direction, the following @vcpu fields are accessed:
- * - R: vcpu->logical_id
- * - W: vcpu->online
- * - W: vcpu->can_offline
- *
- * In @vcpu-to-system direction, the following @vcpu fields are accessed:
- * - R: vcpu->logical_id
- * - R: vcpu->online
- *
- * Written members remain unmodified on error.
+/*
+ * What identifies the key of an authorized_keys line: its type and blob,
+ * without the options before them and the comment after them.  NULL for
+ * blank lines and comments.
  */
-static void transfer_vcpu(GuestLogicalProcessor *vcpu, bool sys2vcpu,
-                          Error **errp)
+static char *guest_ssh_key_id(const char *line)
 {
-    char *dirpath;
-    int dirfd;
-
-    dirpath = g_strdup_printf("/sys/devices/system/cpu/cpu%" PRId64 "/",
-                              vcpu->logical_id);
-    dirfd = open(dirpath, O_RDONLY | O_DIRECTORY);
-    if (dirfd == -1) {
-        error_setg_errno(errp, errno, "open(\"%s\")", dirpath);
-    } else {
-        static const char fn[] = "online";
-        int fd;
-        int res;
-
-        fd = openat(dirfd, fn, sys2vcpu ? O_RDONLY : O_RDWR);
-        if (fd == -1) {
-            if (errno != ENOENT) {
-                error_setg_errno(errp, errno, "open(\"%s/%s\")", dirpath, fn);
-            } else if (sys2vcpu) {
-                vcpu->online = true;
-                vcpu->can_offline = false;
-            } else if (!vcpu->online) {
-                error_setg(errp, "logical processor #%" PRId64 " can't be "
-                           "offlined", vcpu->logical_id);
-            } /* otherwise pretend successful re-onlining */
-        } else {
-            unsigned char status;
-
-            res = pread(fd, &status, 1, 0);
-            if (res == -1) {
-                error_setg_errno(errp, errno, "pread(\"%s/%s\")", dirpath, fn);
-            } else if (res == 0) {
-                error_setg(errp, "pread(\"%s/%s\"): unexpected EOF", dirpath,
-                           fn);
-            } else if (sys2vcpu) {
-                vcpu->online = (status != '0');
-                vcpu->can_offline = true;
-            } else if (vcpu->online != (status != '0')) {
-                status = '0' + vcpu->online;
-                if (pwrite(fd, &status, 1, 0) == -1) {
-                    error_setg_errno(errp, errno, "pwrite(\"%s/%s\")", dirpath,
-                                     fn);
-                }
-            } /* otherwise pretend successful re-(on|off)-lining */
-
-            res = close(fd);
-            g_assert(res == 0);
+    static const char *const types[] = { "ssh-", "ecdsa-", "sk-" };
+    GPtrArray *words = g_ptr_array_new_with_free_func(g_free);
+    const char *p = line, *start;
+    bool quoted;
+    char *id = NULL;
+    guint i, t;
+
+    while (g_ascii_isspace(*p)) {
+        p++;
+    }
+    if (!*p || *p == '#') {
+        g_ptr_array_free(words, true);
+        return NULL;
+    }
+    /* options may hold quoted blanks, as in command="a b" */
+    while (*p) {
+        start = p;
+        quoted = false;
+        while (*p && (quoted || !g_ascii_isspace(*p))) {
+            if (*p == '"') {
+                quoted = !quoted;
+            }
+            p++;
+        }
+        g_ptr_array_add(words, g_strndup(start, p - start));
+        while (g_ascii_isspace(*p)) {
+            p++;
         }
-
-        res = close(dirfd);
-        g_assert(res == 0);
     }
-
-    g_free(dirpath);
+    for (i = 0; i + 1 < words->len && !id; i++) {
+        for (t = 0; t < G_N_ELEMENTS(types); t++) {
+            if (g_str_has_prefix(words->pdata[i], types[t])) {
+                id = g_strdup_printf("%s %s", (char *)words->pdata[i],
+                                     (char *)words->pdata[i + 1]);
+                break;
+            }
+        }
+    }
+    if (!id) {
+        id = g_strdup(words->pdata[0]);
+    }
+    g_ptr_array_free(words, true);
+    return id;
 }
 
-GuestLogicalProcessorList *qmp_guest_get_vcpus(Error **errp)
+/*
+ * Open ~@pw/.ssh, creating it as sshd wants it.  The user owns it, so
+ * neither it nor the files in it are followed if they are symbolic links.
+ */
+static int guest_ssh_open_dir(struct passwd *pw, Error **errp)
 {
-    int64_t current;
-    GuestLogicalProcessorList *head, **link;
-    long sc_max;
-    Error *local_err = NULL;
-
-    current = 0;
-    head = NULL;
-    link = &head;
-    sc_max = SYSCONF_EXACT(_SC_NPROCESSORS_CONF, &local_err);
-
-    while (local_err == NULL && current < sc_max) {
-        GuestLogicalProcessor *vcpu;
-        GuestLogicalProcessorList *entry;
-
-        vcpu = g_malloc0(sizeof *vcpu);
-        vcpu->logical_id = current++;
-        vcpu->has_can_offline = true; /* lolspeak ftw */
-        transfer_vcpu(vcpu, true, &local_err);
+    int home, dir;
 
-        entry = g_malloc0(sizeof *entry);
-        entry->value = vcpu;
-
-        *link = entry;
-        link = &entry->next;
+    home = open(pw->pw_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (home < 0) {
+        error_setg_errno(errp, errno, "failed to open %s", pw->pw_dir);
+        return -1;
     }
-
-    if (local_err == NULL) {
-        /* there's no guest with zero VCPUs */
-        g_assert(head != NULL);
-        return head;
+    if (mkdirat(home, ".ssh", 0700) == 0) {
+        if (fchownat(home, ".ssh", pw->pw_uid, pw->pw_gid,
+                     AT_SYMLINK_NOFOLLOW) < 0) {
+            error_setg_errno(errp, errno, "failed to change owner of %s/.ssh",
+                             pw->pw_dir);
+            close(home);
+            return -1;
+        }
+    } else if (errno != EEXIST) {
+        error_setg_errno(errp, errno, "failed to create %s/.ssh", pw->pw_dir);
+        close(home);
+        return -1;
     }
-
-    qapi_free_GuestLogicalProcessorList(head);
-    error_propagate(errp, local_err);
-    return NULL;
+    dir = openat(home, ".ssh", O_RDONLY | O_DIRECTORY | O_NOFOLLOW |
+                 O_CLOEXEC);
+    if (dir < 0) {
+        error_setg_errno(errp, errno, "failed to open %s/.ssh", pw->pw_dir);
+    }
+    close(home);
+    return dir;
 }
 
-int64_t qmp_guest_set_vcpus(GuestLogicalProcessorList *vcpus, Error **errp)
+/* the authorized_keys file in @dir, "" if there is none */
+static char *guest_ssh_read(int dir, struct passwd *pw, Error **errp)
 {
-    int64_t processed;
-    Error *local_err = NULL;
+    GString *out = g_string_new("");
+    char buf[4096];
+    ssize_t n;
+    int fd;
 
-    processed = 0;
-    while (vcpus != NULL) {
-        transfer_vcpu(vcpus->value, false, &local_err);
-        if (local_err != NULL) {
-            break;
+    fd = openat(dir, "authorized_keys", O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno == ENOENT) {
+            return g_string_free(out, false);
         }
-        ++processed;
-        vcpus = vcpus->next;
+        error_setg_errno(errp, errno, "failed to open %s/.ssh/authorized_keys",
+                         pw->pw_dir);
+        g_string_free(out, true);
+        return NULL;
     }
-
-    if (local_err != NULL) {
-        if (processed == 0) {
-            error_propagate(errp, local_err);
-        } else {
-            error_free(local_err);
+    while ((n = read(fd, buf, sizeof(buf))) != 0) {
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            error_setg_errno(errp, errno,
+                             "failed to read %s/.ssh/authorized_keys",
+                             pw->pw_dir);
+            close(fd);
+            g_string_free(out, true);
+            return NULL;
         }
+        g_string_append_len(out, buf, n);
     }
-
-    return processed;
+    close(fd);
+    return g_string_free(out, false);
 }
 
-void qmp_guest_set_user_password(const char *username,
-                                 const char *password,
-                                 bool crypted,
-                                 Error **errp)
+/* replace the authorized_keys file in @dir by @data, owned by @pw, 0600 */
+static bool guest_ssh_write(int dir, struct passwd *pw, GString *data,
+                            Error **errp)
 {
-    Error *local_err = NULL;
-    char *passwd_path = NULL;
-    pid_t pid;
-    int status;
-    int datafd[2] = { -1, -1 };
-    char *rawpasswddata = NULL;
-    size_t rawpasswdlen;
-    char *chpasswddata = NULL;
-    size_t chpasswdlen;
-
-    rawpasswddata = (char *)g_base64_decode(password, &rawpasswdlen);
-    rawpasswddata = g_renew(char, rawpasswddata, rawpasswdlen + 1);
-    rawpasswddata[rawpasswdlen] = '\0';
+    char tmp[64];
+    size_t done = 0;
+    ssize_t n;
+    int fd, tries = 0, ret = 0;
 
-    if (strchr(rawpasswddata, '\n')) {
-        error_setg(errp, "forbidden characters in raw password");
-        goto out;
+    do {
+        snprintf(tmp, sizeof(tmp), "authorized_keys.%08x", g_random_int());
+        fd = openat(dir, tmp, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW |
+                    O_CLOEXEC, 0600);
+    } while (fd < 0 && errno == EEXIST && ++tries < 16);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "failed to create a file in %s/.ssh",
+                         pw->pw_dir);
+        return false;
     }
-
-    if (strchr(username, '\n') ||
-        strchr(username, ':')) {
-        error_setg(errp, "forbidden characters in username");
-        goto out;
+    if (fchown(fd, pw->pw_uid, pw->pw_gid) < 0) {
+        ret = errno;
     }
-
-    chpasswddata = g_strdup_printf("%s:%s\n", username, rawpasswddata);
-    chpasswdlen = strlen(chpasswddata);
-
-    passwd_path = g_find_program_in_path("chpasswd");
-
-    if (!passwd_path) {
-        error_setg(errp, "cannot find 'passwd' program in PATH");
-        goto out;
+    while (!ret && done < data->len) {
+        n = write(fd, data->str + done, data->len - done);
+        if (n < 0 && errno != EINTR) {
+            ret = errno;
+        } else if (n > 0) {
+            done += n;
+        }
     }
-
-    if (pipe(datafd) < 0) {
-        error_setg(errp, "cannot create pipe FDs");
-        goto out;
+    if (!ret && fsync(fd) < 0) {
+        ret = errno;
+    }
+    close(fd);
+    if (!ret && renameat(dir, tmp, dir, "authorized_keys") < 0) {
+        ret = errno;
+    }
+    if (ret) {
+        unlinkat(dir, tmp, 0);
+        error_setg_errno(errp, ret, "failed to write %s/.ssh/authorized_keys",
+                         pw->pw_dir);
+        return false;
     }
+    return true;
+}
 
-    pid = fork();
-    if (pid == 0) {
-        close(datafd[1]);
-        /* child */
-        setsid();
-        dup2(datafd[0], 0);
-        reopen_fd_to_null(1);
-        reopen_fd_to_null(2);
+typedef enum GuestSSHUpdate {
+    GUEST_SSH_ADD,              /* add the keys it lacks */
+    GUEST_SSH_REMOVE,           /* drop the lines with these keys */
+    GUEST_SSH_SET,              /* these keys and nothing else */
+} GuestSSHUpdate;
 
-        if (crypted) {
-            execle(passwd_path, "chpasswd", "-e", NULL, environ);
-        } else {
-            execle(passwd_path, "chpasswd", NULL, environ);
-        }
-        _exit(EXIT_FAILURE);
-    } else if (pid < 0) {
-        error_setg_errno(errp, errno, "failed to create child process");
-        goto out;
+/*
+ * Update the authorized_keys file of @user with @keys, with *@changed
+ * telling whether that changed it.  Keys are compared by type and blob
+ * only, so none is there twice.
+ */
+static bool guest_ssh_update(const char *user, strList *keys,
+                             GuestSSHUpdate how, bool *changed, Error **errp)
+{
+    struct passwd pw;
+    GHashTable *ids, *wanted;
+    strList *l;
+    GString *out;
+    char *buf, *contents, *id;
+    gchar **lines;
+    bool ret = false;
+    int dir, i;
+
+    *changed = false;
+    if (!guest_getpwnam(user, &pw, &buf, errp)) {
+        return false;
     }
-    close(datafd[0]);
-    datafd[0] = -1;
-
-    if (qemu_write_full(datafd[1], chpasswddata, chpasswdlen) != chpasswdlen) {
-        error_setg_errno(errp, errno, "cannot write new account password");
+    dir = guest_ssh_open_dir(&pw, errp);
+    if (dir < 0) {
+        g_free(buf);
+        return false;
+    }
+    contents = guest_ssh_read(dir, &pw, errp);
+    if (!contents) {
         goto out;
     }
-    close(datafd[1]);
-    datafd[1] = -1;
 
-    ga_wait_child(pid, &status, &local_err);
-    if (local_err) {
-        error_propagate(errp, local_err);
-        goto out;
+    wanted = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    for (l = keys; how == GUEST_SSH_REMOVE && l; l = l->next) {
+        id = guest_ssh_key_id(l->value);
+        if (id) {
+            g_hash_table_insert(wanted, id, id);
+        }
     }
 
-    if (!WIFEXITED(status)) {
-        error_setg(errp, "child process has terminated abnormally");
-        goto out;
+    /* the lines kept, and what they hold */
+    ids = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    out = g_string_new("");
+    lines = g_strsplit(contents, "\n", -1);
+    for (i = 0; how != GUEST_SSH_SET && lines[i]; i++) {
+        if (!lines[i + 1] && !*lines[i]) {
+            break;
+        }
+        id = guest_ssh_key_id(lines[i]);
+        if (id && g_hash_table_lookup(wanted, id)) {
+            g_free(id);
+            continue;
+        }
+        if (id) {
+            g_hash_table_insert(ids, id, id);
+        }
+        g_string_append_printf(out, "%s\n", lines[i]);
     }
+    g_strfreev(lines);
 
-    if (WEXITSTATUS(status)) {
-        error_setg(errp, "child process has failed to set user password");
-        goto out;
+    for (l = keys; how != GUEST_SSH_REMOVE && l; l = l->next) {
+        id = guest_ssh_key_id(l->value);
+        if (!id || g_hash_table_lookup(ids, id)) {
+            g_free(id);
+            continue;
+        }
+        g_hash_table_insert(ids, id, id);
+        g_string_append_printf(out, "%s\n", g_strstrip(l->value));
     }
 
+    *changed = strcmp(out->str, contents) != 0;
+    ret = !*changed || guest_ssh_write(dir, &pw, out, errp);
+    g_string_free(out, true);
+    g_hash_table_destroy(wanted);
+    g_hash_table_destroy(ids);
+    g_free(contents);
+
 out:
-    g_free(chpasswddata);
-    g_free(rawpasswddata);
-    g_free(passwd_path);
-    if (datafd[0] != -1) {
-        close(datafd[0]);
-    }
-    if (datafd[1] != -1) {
-        close(datafd[1]);
-    }
+    close(dir);
+    g_free(buf);
+    return ret;
 }
 
-static void ga_read_sysfs_file(int dirfd, const char *pathname, char *buf,
-                               int size, Error **errp)
+/* reject keys that would not stay a single authorized_keys line */
+static bool guest_ssh_check_keys(strList *keys, Error **errp)
 {
-    int fd;
-    int res;
+    char *id;
 
-    errno = 0;
-    fd = openat(dirfd, pathname, O_RDONLY);
-    if (fd == -1) {
-        error_setg_errno(errp, errno, "open sysfs file \"%s\"", pathname);
-        return;
+    for (; keys; keys = keys->next) {
+        if (strpbrk(keys->value, "\r\n")) {
+            error_setg(errp, "an SSH key must be a single line");
+            return false;
+        }
+        id = guest_ssh_key_id(keys->value);
+        if (!id) {
+            error_setg(errp, "'%s' is not an SSH public key", keys->value);
+            return false;
+        }
+        g_free(id);
     }
+    return true;
+}
 
-    res = pread(fd, buf, size, 0);
-    if (res == -1) {
-        error_setg_errno(errp, errno, "pread sysfs file \"%s\"", pathname);
-    } else if (res == 0) {
-        error_setg(errp, "pread sysfs file \"%s\": unexpected EOF", pathname);
+void qmp_guest_ssh_add_authorized_keys(const char *username, strList *keys,
+                                       Error **errp)
+{
+    bool changed;
+
+    if (guest_ssh_check_keys(keys, errp)) {
+        guest_ssh_update(username, keys, GUEST_SSH_ADD, &changed, errp);
     }
-    close(fd);
 }
 
-static void ga_write_sysfs_file(int dirfd, const char *pathname,
-                                const char *buf, int size, Error **errp)
+void qmp_guest_ssh_remove_authorized_keys(const char *username,
+                                          strList *keys, Error **errp)
 {
-    int fd;
+    bool changed;
 
-    errno = 0;
-    fd = openat(dirfd, pathname, O_WRONLY);
-    if (fd == -1) {
-        error_setg_errno(errp, errno, "open sysfs file \"%s\"", pathname);
-        return;
+    if (guest_ssh_check_keys(keys, errp)) {
+        guest_ssh_update(username, keys, GUEST_SSH_REMOVE, &changed, errp);
     }
+}
 
-    if (pwrite(fd, buf, size, 0) == -1) {
-        error_setg_errno(errp, errno, "pwrite sysfs file \"%s\"", pathname);
-    }
+void qmp_guest_ssh_set_authorized_keys(const char *username, strList *keys,
+                                       Error **errp)
+{
+    bool changed;
 
-    close(fd);
+    if (guest_ssh_check_keys(keys, errp)) {
+        guest_ssh_update(username, keys, GUEST_SSH_SET, &changed, errp);
+    }
 }
+/*########################################################################################################*/
 
-/* Transfer online/offline status between @mem_blk and the guest system.
- *
- * On input either @errp or *@errp must be NULL.
- *
- * In system-to-@mem_blk direction, the following @mem_blk fields are accessed:
- * - R: mem_blk->phys_index
- * - W: mem_blk->online
- * - W: mem_blk->can_offline
- *
- * In @mem_blk-to-system direction, the following @mem_blk fields are accessed:
- * - R: mem_blk->phys_index
- * - R: mem_blk->online
- *-  R: mem_blk->can_offline
- * Written members remain unmodified on error.
+/*Provision*/
+/*########################################################################################################*/
+/*
+ * For each bundle with an id, the state directory keeps a group in this
+ * key file: the index of each command that succeeded, with a checksum of
+ * its argv so that a changed command runs again.
  */
-static void transfer_memory_block(GuestMemoryBlock *mem_blk, bool sys2memblk,
-                                  GuestMemoryBlockResponse *result,
-                                  Error **errp)
+#define GUEST_PROVISION_FILE "qga.provision"
+#define GUEST_PROVISION_OUTPUT 4096
+
+typedef struct GuestProvision {
+    GuestProvisionResult *result;
+    GuestProvisionStepList **link;
+    bool failed;
+    const char *id;
+    GKeyFile *done;
+    int command;
+} GuestProvision;
+
+typedef bool (*GuestProvisionFunc)(GuestProvision *p, void *arg,
+                                   GuestProvisionStep *step, Error **errp);
+
+/*
+ * Take one step and time it, unless one before it failed.  @func sets
+ * @step->status unless it fails.
+ */
+static void guest_provision_step(GuestProvision *p,
+                                 GuestProvisionStepType type,
+                                 const char *target, GuestProvisionFunc func,
+                                 void *arg)
 {
-    char *dirpath;
-    int dirfd;
-    char *status;
+    GuestProvisionStepList *entry = g_new0(GuestProvisionStepList, 1);
+    GuestProvisionStep *step = g_new0(GuestProvisionStep, 1);
     Error *local_err = NULL;
+    int64_t start;
 
-    if (!sys2memblk) {
-        DIR *dp;
+    step->type = type;
+    step->target = g_strdup(target);
+    entry->value = step;
+    *p->link = entry;
+    p->link = &entry->next;
 
-        if (!result) {
-            error_setg(errp, "Internal error, 'result' should not be NULL");
-            return;
-        }
-        errno = 0;
-        dp = opendir("/sys/devices/system/memory/");
-         /* if there is no 'memory' directory in sysfs,
-         * we think this VM does not support online/offline memory block,
-         * any other solution?
-         */
-        if (!dp && errno == ENOENT) {
-            result->response =
-                GUEST_MEMORY_BLOCK_RESPONSE_TYPE_OPERATION_NOT_SUPPORTED;
-            goto out1;
-        }
-        closedir(dp);
-    }
-
-    dirpath = g_strdup_printf("/sys/devices/system/memory/memory%" PRId64 "/",
-                              mem_blk->phys_index);
-    dirfd = open(dirpath, O_RDONLY | O_DIRECTORY);
-    if (dirfd == -1) {
-        if (sys2memblk) {
-            error_setg_errno(errp, errno, "open(\"%s\")", dirpath);
-        } else {
-            if (errno == ENOENT) {
-                result->response = GUEST_MEMORY_BLOCK_RESPONSE_TYPE_NOT_FOUND;
-            } else {
-                result->response =
-                    GUEST_MEMORY_BLOCK_RESPONSE_TYPE_OPERATION_FAILED;
-            }
-        }
-        g_free(dirpath);
-        goto out1;
+    if (p->failed) {
+        step->status = GUEST_PROVISION_STATUS_SKIPPED;
+        return;
     }
-    g_free(dirpath);
-
-    status = g_malloc0(10);
-    ga_read_sysfs_file(dirfd, "state", status, 10, &local_err);
-    if (local_err) {
-        /* treat with sysfs file that not exist in old kernel */
-        if (errno == ENOENT) {
-            error_free(local_err);
-            if (sys2memblk) {
-                mem_blk->online = true;
-                mem_blk->can_offline = false;
-            } else if (!mem_blk->online) {
-                result->response =
-                    GUEST_MEMORY_BLOCK_RESPONSE_TYPE_OPERATION_NOT_SUPPORTED;
-            }
-        } else {
-            if (sys2memblk) {
-                error_propagate(errp, local_err);
-            } else {
-                result->response =
-                    GUEST_MEMORY_BLOCK_RESPONSE_TYPE_OPERATION_FAILED;
-            }
-        }
-        goto out2;
+    start = g_get_monotonic_time();
+    if (!func(p, arg, step, &local_err)) {
+        step->status = GUEST_PROVISION_STATUS_FAILED;
+        step->has_error = true;
+        step->error = g_strdup(error_get_pretty(local_err));
+        error_free(local_err);
+        p->failed = true;
     }
+    step->duration = g_get_monotonic_time() - start;
+}
 
-    if (sys2memblk) {
-        char removable = '0';
-
-        mem_blk->online = (strncmp(status, "online", 6) == 0);
-
-        ga_read_sysfs_file(dirfd, "removable", &removable, 1, &local_err);
-        if (local_err) {
-            /* if no 'removable' file, it doesn't support offline mem blk */
-            if (errno == ENOENT) {
-                error_free(local_err);
-                mem_blk->can_offline = false;
-            } else {
-                error_propagate(errp, local_err);
-            }
-        } else {
-            mem_blk->can_offline = (removable != '0');
-        }
-    } else {
-        if (mem_blk->online != (strncmp(status, "online", 6) == 0)) {
-            char *new_state = mem_blk->online ? g_strdup("online") :
-                                                g_strdup("offline");
-
-            ga_write_sysfs_file(dirfd, "state", new_state, strlen(new_state),
-                                &local_err);
-            g_free(new_state);
-            if (local_err) {
-                error_free(local_err);
-                result->response =
-                    GUEST_MEMORY_BLOCK_RESPONSE_TYPE_OPERATION_FAILED;
-                goto out2;
-            }
+static bool guest_provision_hostname(GuestProvision *p, void *arg,
+                                     GuestProvisionStep *step, Error **errp)
+{
+    const char *hostname = arg;
+    char current[HOST_NAME_MAX + 1] = "";
+    int ret;
 
-            result->response = GUEST_MEMORY_BLOCK_RESPONSE_TYPE_SUCCESS;
-            result->has_error_code = false;
-        } /* otherwise pretend successful re-(on|off)-lining */
+    guest_sysinfo_ensure();
+    gethostname(current, sizeof(current) - 1);
+    /* written again either way, in case only the file failed last time */
+    ret = ga_collect_change_hostname(hostname);
+    if (ret) {
+        error_setg(errp, "failed to set the host name: %s",
+                   ret == 1 ? "unknown host name file" : strerror(ret));
+        return false;
     }
-    g_free(status);
-    close(dirfd);
-    return;
+    step->status = strcmp(current, hostname) ? GUEST_PROVISION_STATUS_CHANGED
+                                             : GUEST_PROVISION_STATUS_UNCHANGED;
+    return true;
+}
 
-out2:
-    g_free(status);
-    close(dirfd);
-out1:
-    if (!sys2memblk) {
-        result->has_error_code = true;
-        result->error_code = errno;
+static bool guest_provision_password(GuestProvision *p, void *arg,
+                                     GuestProvisionStep *step, Error **errp)
+{
+    GuestProvisionPassword *pw = arg;
+    int ret;
+
+    ret = ga_collect_change_password(pw->user, pw->password);
+    if (ret) {
+        error_setg(errp, "failed to set the password: %s",
+                   ret == 1 ? "chpasswd failed" : strerror(ret));
+        return false;
     }
+    step->status = GUEST_PROVISION_STATUS_CHANGED;
+    return true;
 }
 
-GuestMemoryBlockList *qmp_guest_get_memory_blocks(Error **errp)
+static bool guest_provision_file(GuestProvision *p, void *arg,
+                                 GuestProvisionStep *step, Error **errp)
 {
-    GuestMemoryBlockList *head, **link;
-    Error *local_err = NULL;
-    struct dirent *de;
-    DIR *dp;
+    GuestProvisionFile *f = arg;
+    struct passwd pw;
+    struct stat st;
+    char *buf = NULL, *dir, *current = NULL;
+    gsize current_len = 0;
+    uint8_t *data;
+    size_t len;
+    bool exists, same, ret = false;
+    int fd, err;
+
+    if (f->has_owner && !guest_getpwnam(f->owner, &pw, &buf, errp)) {
+        return false;
+    }
+    data = qemu_base64_decode(f->content, &len);
 
-    head = NULL;
-    link = &head;
+    exists = stat(f->path, &st) == 0;
+    if (!exists && errno != ENOENT) {
+        error_setg_errno(errp, errno, "failed to stat %s", f->path);
+        goto out;
+    }
+    if (exists && !S_ISREG(st.st_mode)) {
+        error_setg(errp, "%s is not a regular file", f->path);
+        goto out;
+    }
+    same = exists && g_file_get_contents(f->path, &current, &current_len,
+                                         NULL) &&
+           current_len == len && !memcmp(current, data, len);
+    if (same && (!f->has_mode || (st.st_mode & 07777) == f->mode) &&
+        (!f->has_owner || (st.st_uid == pw.pw_uid &&
+                           st.st_gid == pw.pw_gid))) {
+        step->status = GUEST_PROVISION_STATUS_UNCHANGED;
+        ret = true;
+        goto out;
+    }
 
-    dp = opendir("/sys/devices/system/memory/");
-    if (!dp) {
-        /* it's ok if this happens to be a system that doesn't expose
-         * memory blocks via sysfs, but otherwise we should report
-         * an error
-         */
-        if (errno != ENOENT) {
-            error_setg_errno(errp, errno, "Can't open directory"
-                             "\"/sys/devices/system/memory/\"\n");
+    /* mode and owner first, so that the contents are never exposed */
+    if (!exists) {
+        dir = g_path_get_dirname(f->path);
+        err = g_mkdir_with_parents(dir, 0755) < 0 ? errno : 0;
+        g_free(dir);
+        if (err) {
+            error_setg_errno(errp, err, "failed to create the directory of %s",
+                             f->path);
+            goto out;
+        }
+        fd = open(f->path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0);
+        if (fd < 0) {
+            error_setg_errno(errp, errno, "failed to create %s", f->path);
+            goto out;
+        }
+        close(fd);
+    }
+    if ((f->has_mode || !exists) &&
+        chmod(f->path, f->has_mode ? f->mode : 0644) < 0) {
+        error_setg_errno(errp, errno, "failed to change the mode of %s",
+                         f->path);
+        goto out;
+    }
+    if (f->has_owner && chown(f->path, pw.pw_uid, pw.pw_gid) < 0) {
+        error_setg_errno(errp, errno, "failed to change the owner of %s",
+                         f->path);
+        goto out;
+    }
+    if (!same) {
+        err = ga_collect_replace_file(f->path, (char *)data, len);
+        if (err) {
+            error_setg_errno(errp, err, "failed to write %s", f->path);
+            goto out;
         }
-        return NULL;
     }
+    step->status = GUEST_PROVISION_STATUS_CHANGED;
+    ret = true;
 
-    /* Note: the phys_index of memory block may be discontinuous,
-     * this is because a memblk is the unit of the Sparse Memory design, which
-     * allows discontinuous memory ranges (ex. NUMA), so here we should
-     * traverse the memory block directory.
-     */
-    while ((de = readdir(dp)) != NULL) {
-        GuestMemoryBlock *mem_blk;
-        GuestMemoryBlockList *entry;
+out:
+    g_free(current);
+    g_free(data);
+    g_free(buf);
+    return ret;
+}
 
-        if ((strncmp(de->d_name, "memory", 6) != 0) ||
-            !(de->d_type & DT_DIR)) {
+static bool guest_provision_ssh_keys(GuestProvision *p, void *arg,
+                                     GuestProvisionStep *step, Error **errp)
+{
+    GuestProvisionSSHKeys *k = arg;
+    bool changed;
+
+    if (!guest_ssh_update(k->user, k->keys, GUEST_SSH_ADD, &changed, errp)) {
+        return false;
+    }
+    step->status = changed ? GUEST_PROVISION_STATUS_CHANGED
+                           : GUEST_PROVISION_STATUS_UNCHANGED;
+    return true;
+}
+
+static bool guest_provision_sysctl(GuestProvision *p, void *arg,
+                                   GuestProvisionStep *step, Error **errp)
+{
+    GuestProfileSetting *s = arg;
+    GuestProfileEntry *e;
+    GArray *entries;
+    char *wanted;
+    bool ret = true;
+    guint i;
+
+    entries = g_array_new(false, false, sizeof(GuestProfileEntry));
+    if (!guest_profile_expand(s->key, s->value, entries, errp)) {
+        guest_profile_entries_free(entries);
+        return false;
+    }
+    wanted = guest_profile_normalize(s->value);
+    step->status = GUEST_PROVISION_STATUS_UNCHANGED;
+    for (i = 0; i < entries->len && ret; i++) {
+        e = &g_array_index(entries, GuestProfileEntry, i);
+        e->current = guest_profile_read(e->path);
+        if (e->current && !strcmp(e->current, wanted)) {
             continue;
         }
+        ret = guest_profile_write(e->path, s->value, errp);
+        step->status = GUEST_PROVISION_STATUS_CHANGED;
+    }
+    g_free(wanted);
+    guest_profile_entries_free(entries);
+    return ret;
+}
 
-        mem_blk = g_malloc0(sizeof *mem_blk);
-        /* The d_name is "memoryXXX",  phys_index is block id, same as XXX */
-        mem_blk->phys_index = strtoul(&de->d_name[6], NULL, 10);
-        mem_blk->has_can_offline = true; /* lolspeak ftw */
-        transfer_memory_block(mem_blk, true, NULL, &local_err);
+static char *guest_provision_checksum(strList *argv)
+{
+    GChecksum *sum = g_checksum_new(G_CHECKSUM_SHA256);
+    char *ret;
 
-        entry = g_malloc0(sizeof *entry);
-        entry->value = mem_blk;
+    for (; argv; argv = argv->next) {
+        g_checksum_update(sum, (guchar *)argv->value,
+                          strlen(argv->value) + 1);
+    }
+    ret = g_strdup(g_checksum_get_string(sum));
+    g_checksum_free(sum);
+    return ret;
+}
 
-        *link = entry;
-        link = &entry->next;
+static char *guest_provision_filename(void)
+{
+    return g_build_filename(ga_get_state_dir(ga_state), GUEST_PROVISION_FILE,
+                            NULL);
+}
+
+static bool guest_provision_command(GuestProvision *p, void *arg,
+                                    GuestProvisionStep *step, Error **errp)
+{
+    GuestProvisionCommand *c = arg;
+    GString *out = g_string_new("");
+    GError *gerr = NULL;
+    const char **argv;
+    char *key, *sum, *done, *filename, *data;
+    strList *l;
+    gsize len;
+    int status, n = 0, ret;
+
+    key = g_strdup_printf("%d", p->command);
+    sum = guest_provision_checksum(c->argv);
+    done = p->done ? g_key_file_get_string(p->done, p->id, key, NULL) : NULL;
+    if (done && !strcmp(done, sum)) {
+        step->status = GUEST_PROVISION_STATUS_UNCHANGED;
+        status = 0;
+        goto out;
     }
 
-    closedir(dp);
-    if (local_err == NULL) {
-        /* there's no guest with zero memory blocks */
-        if (head == NULL) {
-            error_setg(errp, "guest reported zero memory blocks!");
+    for (l = c->argv; l; l = l->next) {
+        n++;
+    }
+    argv = g_new0(const char *, n + 1);
+    for (n = 0, l = c->argv; l; l = l->next) {
+        argv[n++] = l->value;
+    }
+    status = ga_collect_run(argv, GUEST_PROVISION_OUTPUT,
+                            (c->has_timeout ? c->timeout : 30) * 1000, out,
+                            &gerr);
+    g_free(argv);
+
+    if (status < 0) {
+        if (gerr) {
+            error_setg(errp, "failed to run %s: %s", c->argv->value,
+                       gerr->message);
+            g_error_free(gerr);
+        } else {
+            error_setg(errp, "%s timed out", c->argv->value);
         }
-        return head;
+        goto out;
+    }
+    step->has_output = true;
+    step->output = g_strdup(out->str);
+    if (WIFSIGNALED(status)) {
+        error_setg(errp, "%s was killed by signal %d", c->argv->value,
+                   WTERMSIG(status));
+        status = -1;
+        goto out;
+    }
+    step->has_exit_code = true;
+    step->exit_code = WEXITSTATUS(status);
+    if (step->exit_code) {
+        error_setg(errp, "%s exited with status %" PRId64, c->argv->value,
+                   step->exit_code);
+        status = -1;
+        goto out;
+    }
+    step->status = GUEST_PROVISION_STATUS_CHANGED;
+
+    /* saved after each command, so that a retry starts where this stopped */
+    if (p->done) {
+        g_key_file_set_string(p->done, p->id, key, sum);
+        filename = guest_provision_filename();
+        data = g_key_file_to_data(p->done, &len, NULL);
+        ret = ga_collect_replace_file(filename, data, len);
+        if (ret) {
+            g_debug("failed to write %s: %s", filename, strerror(ret));
+        }
+        g_free(data);
+        g_free(filename);
     }
 
-    qapi_free_GuestMemoryBlockList(head);
-    error_propagate(errp, local_err);
-    return NULL;
+out:
+    g_string_free(out, true);
+    g_free(done);
+    g_free(sum);
+    g_free(key);
+    return status == 0;
 }
 
-GuestMemoryBlockResponseList *
-qmp_guest_set_memory_blocks(GuestMemoryBlockList *mem_blks, Error **errp)
+/* reject a malformed bundle before any of it is applied */
+static bool guest_provision_check(bool has_hostname, const char *hostname,
+                                  GuestProvisionPasswordList *passwords,
+                                  GuestProvisionFileList *files,
+                                  GuestProvisionSSHKeysList *ssh_keys,
+                                  GuestProvisionCommandList *commands,
+                                  Error **errp)
 {
-    GuestMemoryBlockResponseList *head, **link;
-    Error *local_err = NULL;
-
-    head = NULL;
-    link = &head;
-
-    while (mem_blks != NULL) {
-        GuestMemoryBlockResponse *result;
-        GuestMemoryBlockResponseList *entry;
-        GuestMemoryBlock *current_mem_blk = mem_blks->value;
+    GError *gerr = NULL;
 
-        result = g_malloc0(sizeof(*result));
-        result->phys_index = current_mem_blk->phys_index;
-        transfer_memory_block(current_mem_blk, false, result, &local_err);
-        if (local_err) { /* should never happen */
-            goto err;
+    if (has_hostname && !ga_collect_hostname_valid(hostname, &gerr)) {
+        ga_collect_error(errp, gerr);
+        return false;
+    }
+    for (; passwords; passwords = passwords->next) {
+        if (!*passwords->value->user || strpbrk(passwords->value->user,
+                                                ":\n")) {
+            error_setg(errp, "forbidden characters in username");
+            return false;
+        }
+        if (strchr(passwords->value->password, '\n')) {
+            error_setg(errp, "forbidden characters in raw password");
+            return false;
         }
-        entry = g_malloc0(sizeof *entry);
-        entry->value = result;
-
-        *link = entry;
-        link = &entry->next;
-        mem_blks = mem_blks->next;
     }
-
-    return head;
-err:
-    qapi_free_GuestMemoryBlockResponseList(head);
-    error_propagate(errp, local_err);
-    return NULL;
+    for (; files; files = files->next) {
+        if (!g_path_is_absolute(files->value->path)) {
+            error_setg(errp, "path '%s' is not absolute", files->value->path);
+            return false;
+        }
+        if (files->value->has_mode &&
+            (files->value->mode < 0 || files->value->mode > 07777)) {
+            error_setg(errp, "value '%" PRId64 "' is invalid for argument "
+                       "mode", files->value->mode);
+            return false;
+        }
+    }
+    for (; ssh_keys; ssh_keys = ssh_keys->next) {
+        if (!guest_ssh_check_keys(ssh_keys->value->keys, errp)) {
+            return false;
+        }
+    }
+    for (; commands; commands = commands->next) {
+        if (!commands->value->argv) {
+            error_setg(errp, QERR_MISSING_PARAMETER, "argv");
+            return false;
+        }
+        if (commands->value->has_timeout &&
+            (commands->value->timeout < 1 ||
+             commands->value->timeout > 86400)) {
+            error_setg(errp, "value '%" PRId64 "' is invalid for argument "
+                       "timeout", commands->value->timeout);
+            return false;
+        }
+    }
+    return true;
 }
 
-GuestMemoryBlockInfo *qmp_guest_get_memory_block_info(Error **errp)
+GuestProvisionResult *qmp_guest_provision(bool has_id, const char *id,
+                                          bool has_hostname,
+                                          const char *hostname,
+                                          bool has_passwords,
+                                          GuestProvisionPasswordList *passwords,
+                                          bool has_files,
+                                          GuestProvisionFileList *files,
+                                          bool has_ssh_keys,
+                                          GuestProvisionSSHKeysList *ssh_keys,
+                                          bool has_sysctls,
+                                          GuestProfileSettingList *sysctls,
+                                          bool has_commands,
+                                          GuestProvisionCommandList *commands,
+                                          Error **errp)
 {
-    Error *local_err = NULL;
-    char *dirpath;
-    int dirfd;
-    char *buf;
-    GuestMemoryBlockInfo *info;
+    GuestProvision p = { 0 };
+    int64_t start = g_get_monotonic_time();
+    char *filename;
 
-    dirpath = g_strdup_printf("/sys/devices/system/memory/");
-    dirfd = open(dirpath, O_RDONLY | O_DIRECTORY);
-    if (dirfd == -1) {
-        error_setg_errno(errp, errno, "open(\"%s\")", dirpath);
-        g_free(dirpath);
+    if (has_id && !*id) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "id",
+                   "a non-empty string");
         return NULL;
     }
-    g_free(dirpath);
-
-    buf = g_malloc0(20);
-    ga_read_sysfs_file(dirfd, "block_size_bytes", buf, 20, &local_err);
-    close(dirfd);
-    if (local_err) {
-        g_free(buf);
-        error_propagate(errp, local_err);
+    if (!guest_provision_check(has_hostname, hostname, passwords, files,
+                               ssh_keys, commands, errp)) {
         return NULL;
     }
 
-    info = g_new0(GuestMemoryBlockInfo, 1);
-    info->size = strtol(buf, NULL, 16); /* the unit is bytes */
+    p.result = g_new0(GuestProvisionResult, 1);
+    p.link = &p.result->steps;
+    if (has_id) {
+        p.id = id;
+        p.done = g_key_file_new();
+        filename = guest_provision_filename();
+        g_key_file_load_from_file(p.done, filename, G_KEY_FILE_NONE, NULL);
+        g_free(filename);
+    }
 
-    g_free(buf);
+    if (has_hostname) {
+        guest_provision_step(&p, GUEST_PROVISION_STEP_TYPE_HOSTNAME, hostname,
+                             guest_provision_hostname, (void *)hostname);
+    }
+    for (; passwords; passwords = passwords->next) {
+        guest_provision_step(&p, GUEST_PROVISION_STEP_TYPE_PASSWORD,
+                             passwords->value->user, guest_provision_password,
+                             passwords->value);
+    }
+    for (; files; files = files->next) {
+        guest_provision_step(&p, GUEST_PROVISION_STEP_TYPE_FILE,
+                             files->value->path, guest_provision_file,
+                             files->value);
+    }
+    for (; ssh_keys; ssh_keys = ssh_keys->next) {
+        guest_provision_step(&p, GUEST_PROVISION_STEP_TYPE_SSH_KEYS,
+                             ssh_keys->value->user, guest_provision_ssh_keys,
+                             ssh_keys->value);
+    }
+    for (; sysctls; sysctls = sysctls->next) {
+        guest_provision_step(&p, GUEST_PROVISION_STEP_TYPE_SYSCTL,
+                             sysctls->value->key, guest_provision_sysctl,
+                             sysctls->value);
+    }
+    for (; commands; commands = commands->next, p.command++) {
+        guest_provision_step(&p, GUEST_PROVISION_STEP_TYPE_COMMAND,
+                             commands->value->argv->value,
+                             guest_provision_command, commands->value);
+    }
 
-    return info;
+    if (p.done) {
+        g_key_file_free(p.done);
+    }
+    p.result->complete = !p.failed;
+    p.result->duration = g_get_monotonic_time() - start;
+    return p.result;
 }
-
-/*MemoryStatus*/
 /*########################################################################################################*/
-GuestMemoryStatus *qmp_guest_get_memory_status(Error **errp)
+
+
+#else /* defined(__linux__) */
+
+void qmp_guest_suspend_disk(Error **errp)
 {
-    Error *local_err = NULL;
-    int oflag;
-    const char *mode = "r";
-    const char *path = "/proc/meminfo";
-    SwapInfo *info = g_malloc0(sizeof(SwapInfo));
-    GuestMemoryStatus *status = g_malloc0(sizeof(GuestMemoryStatus));
+    error_setg(errp, QERR_UNSUPPORTED);
+}
 
-    oflag = find_open_flag(mode, &local_err);
-    if (local_err == NULL) {
-        int fd;
-        fd = open(path, oflag | ((oflag & O_CREAT) ? O_EXCL : 0), 0);
-        if (fd == -1 && errno == EEXIST) {
-            oflag &= ~(unsigned)O_CREAT;
-            fd = open(path, oflag);
-        }
+void qmp_guest_suspend_ram(Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+}
 
-        if (fd == -1) {
-            error_setg_errno(&local_err, errno, "failed to open file '%s' "
-                             "(mode: '%s')", path, mode);
-        } else {
-            qemu_set_cloexec(fd);
-            FILE *f;
-            char StrLine[1024] = "";
-            f = fdopen(fd, mode);
-            if (f == NULL) {
-                error_setg_errno(&local_err, errno, "failed to associate "
-                                 "stdio stream with file descriptor %d, "
-                                 "file '%s' (mode: '%s')", fd, path, mode);
-            } else {
-                const char *fields[] = {"MemTotal", "MemFree", "Buffers", "Cached",
-                                "SwapTotal", "SwapFree"};
-                while (!feof(f)) {
-                    fgets(StrLine, 1024, f);
-                    char *p;
-                    p = strtok(StrLine, ":");
-                    int i,m;
-                    for(i=0; i<6; i++){
-                        if(!strcmp(p, fields[i])){
-                            p = strtok(NULL, " ");
-                            if(p){
-                                m = atoi(p);
-                                switch (i){
-                                    case 0:
-                                        m/=1024;
-                                        status->total = m;
-                                        break;
-                                    case 1:
-                                        m/=1024;
-                                        status->used = m;
-                                        break;
-                                    case 2:
-                                         m/=1024;
-                                        status->buffer = m;
-                                        break;
-                                    case 3:
-                                         m/=1024;
-                                        status->cached = m;
-                                        break;
-                                    case 4:
-                                         m/=1024;
-                                        info->total = m;
-                                        break;
-                                    case 5:
-                                         m/=1024;
-                                        info->used = m;
-                                        break;
-                                }
-                            }
-                        }
-                    }
-                }
-                status->used = status->total - status->used;
-                info->used = info->total - info->used;
-                status->swap = info;
-                fclose(f);
-            }
+void qmp_guest_suspend_hybrid(Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+}
 
-            close(fd);
-            if (oflag & O_CREAT) {
-                unlink(path);
-            }
-        }
-        error_free(local_err);
-    }
-    else
-        error_propagate(errp, local_err);
+GuestTimeSync *qmp_guest_sync_time(int64_t offset, bool has_step_threshold,
+                                   int64_t step_threshold, Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
 
-    return status;
+GuestNetworkInterfaceList *qmp_guest_network_get_interfaces(Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
 }
-/*########################################################################################################*/
 
-/*OSStatus*/
-/*########################################################################################################*/
-GuestSystemInfo *qmp_guest_get_system_info(Error **errp)
+GuestLogicalProcessorList *qmp_guest_get_vcpus(Error **errp)
 {
-    GuestSystemInfo *info = g_malloc0(sizeof(GuestSystemInfo));
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
 
-    FILE * fp = NULL;
-    char line[200] = "";
+int64_t qmp_guest_set_vcpus(GuestLogicalProcessorList *vcpus, Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return -1;
+}
 
-    fp = popen("timeout -s SIGKILL 2s uname -s","r");
-    if(fp !=NULL){
-        if(fgets(line, 200, fp) != NULL) {
-                info->os_name = g_strdup(line);
-        }
-    }
-    pclose(fp);
+GuestLogicalProcessorResponseList *
+qmp_guest_set_vcpus_batch(GuestLogicalProcessorList *vcpus, Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
 
-    fp = popen("timeout -s SIGKILL 2s uname -r","r");
-    if(fp !=NULL){
-        if(fgets(line, 200, fp) != NULL) {
-                info->kernel_version = g_strdup(line);
-        }
-    }
-    pclose(fp);
+void qmp_guest_set_user_password(const char *username,
+                                 const char *password,
+                                 bool crypted,
+                                 Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+}
 
-    fp = popen("timeout -s SIGKILL 2s uname -v","r");
-    if(fp !=NULL){
-        if(fgets(line, 200, fp) != NULL) {
-                info->system_version = g_strdup(line);
-        }
-    }
-    pclose(fp);
+GuestMemoryBlockList *qmp_guest_get_memory_blocks(bool has_changed_since,
+                                                  int64_t changed_since,
+                                                  Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
 
-    fp = popen("timeout -s SIGKILL 2s hostname -f","r");
-    if(fp !=NULL){
-        if(fgets(line, 200, fp) != NULL) {
-                info->fqdn = g_strdup(line);
-        }
-    }
-    pclose(fp);
+GuestMemoryBlockResponseList *
+qmp_guest_set_memory_blocks(GuestMemoryBlockList *mem_blks, Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
 
-    fp = popen("timeout -s SIGKILL 2s lastlog","r");
-    if(fp !=NULL){
-        if(fgets(line, 200, fp) != NULL) {
-            if(fgets(line, 200, fp) != NULL) {
-                info->fqdn = g_strdup(line);
-            }
-        }
-    }
-    pclose(fp);
+GuestMemoryBlockJobStart *
+qmp_guest_set_memory_blocks_start(GuestMemoryBlockRangeList *ranges,
+                                  bool has_max_parallel,
+                                  int64_t max_parallel,
+                                  Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
 
-    return info;
+GuestMemoryBlockJob *qmp_guest_set_memory_blocks_status(int64_t id,
+                                                        Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
 }
-/*########################################################################################################*/
 
-/*APPStatus*/
-/*########################################################################################################*/
-struct APPStatus *qmp_guest_get_app_status(Error **errp)
+void qmp_guest_set_memory_blocks_cancel(int64_t id, Error **errp)
 {
-    FILE * fp = NULL;
-    char buffer[40000] = "";
-    char line[200] = "";
-    APPStatus *status = g_malloc0(sizeof(APPStatus));
-    int count = 0;
-    fp = popen("timeout -s SIGKILL 2s top -n 1 -b","r");
-    if(fp !=NULL){
-        while ((fgets(line, 200, fp) != NULL) && count < 200 ){
-                strcat(buffer, line);
-                count++;
-        }
-    }
-    pclose(fp);
-    status->appStatus = g_strdup(buffer);
+    error_setg(errp, QERR_UNSUPPORTED);
+}
 
-    return status;
+GuestMemoryBlockInfo *qmp_guest_get_memory_block_info(Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
 }
-/*########################################################################################################*/
 
-/*DiskStatus*/
-/*########################################################################################################*/
-struct GuestDiskStatusList *qmp_guest_get_disk_status(Error **errp)
+GuestNumaInfo *qmp_guest_get_numa_info(Error **errp)
 {
-    FILE * fp = NULL;
-    char line[200] = "";
-    GuestDiskStatusList *head, **link;
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
 
-    head = NULL;
-    link = &head;
+GuestProcessInfoList *qmp_guest_get_processes(bool has_sort,
+                                              GuestProcessSortKey sort,
+                                              bool has_limit, int64_t limit,
+                                              Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
 
-    char *p = NULL;
-    int i;
+GuestProcessChanges *qmp_guest_get_process_changes(bool has_since,
+                                                   const char *since,
+                                                   Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
 
-    GuestDiskStatus *status = NULL;
-    GuestDiskStatusList *entry = NULL;
-
-    fp = popen("timeout -s SIGKILL 2s df -h","r");
-    if((fgets(line, 200, fp) != NULL) && (fp != NULL)) {
-        while (fgets(line, 200, fp) != NULL) {
-            status = g_malloc0(sizeof *status);
-            MountInfo *info = g_malloc0(sizeof(MountInfo));
-            p=strtok(line," ");
-            if(p){
-                for(i=0; i<5; i++ ){
-                    p=strtok(NULL," ");
-                    if(i == 0){
-                        info->total = g_strdup(p);
-                    }
-                    if(i==1){
-                        info->used = g_strdup(p);
-                    }
-                }
-                info->writable = true;
-                status->mount_place = g_strdup(p);
-                status->mount_info = info;
-            }
+void ga_sample_collect(GASample *sample, uint32_t groups)
+{
+}
 
-            entry = g_malloc0(sizeof *entry);
-            entry->value = status;
+GuestCpuStats *qmp_guest_get_cpu_stats(bool has_cgroups, bool cgroups,
+                                       Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
 
-            *link = entry;
-            link = &entry->next;
-        }
-    }
-    pclose(fp);
-    g_assert(head != NULL);
+GuestDiskIOStatsList *qmp_guest_get_disk_io_stats(Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
 
-    return head;
+GuestNetworkStatsList *qmp_guest_get_network_stats(Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
 }
-/*########################################################################################################*/
 
-/*OOMStatus*/
-/*########################################################################################################*/
-struct OOMStatus *qmp_guest_get_oom_status(Error **errp)
+GuestMemoryPressure *qmp_guest_get_memory_pressure(Error **errp)
 {
-    Error *local_err = NULL;
-    int oflag;
-    const char *mode = "r";
-    const char *path = "/var/log/messages";
-    OOMStatus *status = g_malloc0(sizeof(OOMStatus));
-    const char *oom = "Out of memory: Kill process";
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
 
-    oflag = find_open_flag(mode, &local_err);
-    if (local_err == NULL) {
-        int fd;
+GuestMetricsHistory *qmp_guest_get_metrics_history(bool has_cursor,
+                                                   int64_t cursor,
+                                                   bool has_format,
+                                                   GuestMetricsFormat format,
+                                                   Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
 
-        fd = open(path, oflag | ((oflag & O_CREAT) ? O_EXCL : 0), 0);
-        if (fd == -1 && errno == EEXIST) {
-            oflag &= ~(unsigned)O_CREAT;
-            fd = open(path, oflag);
-        }
+GuestMetricsRollup *
+qmp_guest_get_metrics_rollup(GuestMetricsResolution resolution, bool has_start,
+                             int64_t start, bool has_end, int64_t end,
+                             Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
 
-        if (fd == -1) {
-            error_setg_errno(&local_err, errno, "failed to open file '%s' "
-                             "(mode: '%s')", path, mode);
-        } else {
-            qemu_set_cloexec(fd);
-            FILE *f = NULL;
-            char StrLine[1024] = "";
-            f = fdopen(fd, mode);
-            if (f == NULL) {
-                error_setg_errno(&local_err, errno, "failed to associate "
-                                 "stdio stream with file descriptor %d, "
-                                 "file '%s' (mode: '%s')", fd, path, mode);
-            } else {
-                while (!feof(f)) {
-                    fgets(StrLine, 1024, f);
-
-                    char *p = NULL;
-                    p = strstr(StrLine,oom);
-                    if(p)
-                        status->oom_happened = true;
-                    else
-                        status->oom_happened = false;
-                }
-                fclose(f);
-            }
-            close(fd);
-            if (oflag & O_CREAT) {
-                unlink(path);
-            }
-        }
-        error_free(local_err);
-    }
-    else
-        error_propagate(errp, local_err);
+GuestFileWatch *qmp_guest_file_watch(const char *path, bool has_events,
+                                     GuestFileWatchEventList *events,
+                                     bool has_notify, bool notify,
+                                     Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
 
-    return status;
+void qmp_guest_file_unwatch(int64_t watch, Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
 }
-/*########################################################################################################*/
 
-/*UserCheck*/
-/*########################################################################################################*/
-struct UserCheck *qmp_guest_user_check(const char *command_name, const char *command, Error **errp)
+GuestFileChanges *qmp_guest_file_watch_read(bool has_timeout_ms,
+                                            int64_t timeout_ms, Error **errp)
 {
-    FILE * fp = NULL;
-    char buffer[40000] = "";
-    char line[200] = "";
-    UserCheck *check = g_malloc0(sizeof(UserCheck));
-    int count = 0;
-    char command_with_kill[500] = "";
-    strcat(command_with_kill, "timeout -s SIGKILL 2s ");
-    strcat(command_with_kill, command);
-    fp = popen(command_with_kill, "r");
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
 
-    if(fp !=NULL){
-        while ((fgets(line, 200, fp) != NULL) && count < 200 ){
-                strcat(buffer, line);
-                count++;
-        }
-    }
-    pclose(fp);
-    check->command_name = g_strdup(command_name);
-    check->result = g_strdup(buffer);
+GuestFileCopyStart *qmp_guest_file_copy_start(const char *src,
+                                              const char *dst,
+                                              bool has_offset, int64_t offset,
+                                              bool has_length, int64_t length,
+                                              Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
 
-    return check;
+GuestFileCopyJob *qmp_guest_file_copy_status(int64_t id, Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
 }
-/*########################################################################################################*/
 
-/*Password*/
-/*########################################################################################################*/
-struct ErrNO *qmp_change_password(const char *new_password, Error **errp)
+void qmp_guest_file_copy_cancel(int64_t id, Error **errp)
 {
-    ErrNO *err = g_malloc0(sizeof(ErrNO));
-    int ret;
-    const char *a = "echo root:";
-    const char *b = " | chpasswd";
-    char *cmd = g_malloc0(strlen(a)+strlen(b)+strlen(new_password)+1);
-    strcpy(cmd, a);
-    strcat(cmd, new_password);
-    strcat(cmd, b);
-    ret = system(cmd);
-    err->errnum = ret;
+    error_setg(errp, QERR_UNSUPPORTED);
+}
 
-    g_free(cmd);
+GuestFileResidencyList *qmp_guest_file_residency(strList *paths,
+                                                 Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
 
-    return err;
+GuestFilePrefetchStart *qmp_guest_file_prefetch(strList *paths,
+                                                bool has_rate, int64_t rate,
+                                                Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
 }
-/*########################################################################################################*/
 
-/*Hostname*/
-/*########################################################################################################*/
-struct ErrNum *qmp_change_hostname(const char *new_hostname, Error **errp)
+GuestFilePrefetchJob *qmp_guest_file_prefetch_status(int64_t id,
+                                                     Error **errp)
 {
-    ErrNum *err = g_malloc0(sizeof(ErrNum));
-    const char *spe = " s/.*HOSTNAME=.*/HOSTNAME=";
-    char *new_hostname_spe = g_malloc0(strlen(new_hostname)+strlen(spe)+1);
-    strcat(new_hostname_spe, spe);
-    strcat(new_hostname_spe, new_hostname);
-    const char *a = "hostname ";
-    const char *a0 = "sed -i";
-    const char *a1 = "echo ";
-    const char *b0 = "/ /etc/sysconfig/network";
-    const char *b1 = " > /etc/hostname";
-    const char *b2 = " /etc/HOSTNAME";
-
-    char *cmd_flag = g_malloc0(strlen(a)+strlen(new_hostname)+1);
-    char *cmd_flag0 = g_malloc0(strlen(a0)+strlen(b0)+strlen(new_hostname_spe)+1);
-    char *cmd_flag1 = g_malloc0(strlen(a1)+strlen(b1)+strlen(new_hostname)+1);
-    char *cmd_flag2 = g_malloc0(strlen(a0)+strlen(b2)+strlen(new_hostname)+1);
-
-    strcpy(cmd_flag, a);
-    strcat(cmd_flag, new_hostname);
-    strcpy(cmd_flag0, a0);
-    strcat(cmd_flag0, new_hostname_spe);
-    strcat(cmd_flag0, b0);
-    strcpy(cmd_flag1, a1);
-    strcat(cmd_flag1, new_hostname);
-    strcat(cmd_flag1, b1);
-    strcpy(cmd_flag2, a0);
-    strcat(cmd_flag2, new_hostname);
-    strcat(cmd_flag2, b2);
-
-    const char *cmd0 = "cat /etc/issue |grep CentOS";
-    const char *cmd1 = "cat /etc/issue |grep Red";
-    const char *cmd2 = "cat /etc/issue |grep Fedora";
-    const char *cmd3 = "cat /etc/issue |grep Ubuntu";
-    const char *cmd4 = "cat /etc/issue |grep Debian";
-    const char *cmd5 = "cat /etc/issue |grep SUSE";
-    const char *cmd6 = "cat /etc/issue |grep 'CentOS Linux 7'";
-    int ret1 =1, ret2, ret3;
-
-    ret1 = system(cmd6);
-    if(ret1 == 0){
-        ret2 = system(cmd_flag);
-        if(ret2 ==0){
-            ret3 = system(cmd_flag1);
-            err->errnum = ret3;
-
-            g_free(new_hostname_spe);
-            g_free(cmd_flag);
-            g_free(cmd_flag0);
-            g_free(cmd_flag1);
-            g_free(cmd_flag2);
-
-            return err;
-        }
-        else{
-            err->errnum = ret2;
-
-            g_free(new_hostname_spe);
-            g_free(cmd_flag);
-            g_free(cmd_flag0);
-            g_free(cmd_flag1);
-            g_free(cmd_flag2);
-
-            return err;
-        }
-    }
-    ret1 = system(cmd0);
-    if(ret1 == 0){
-        ret2 = system(cmd_flag);
-        if(ret2 ==0){
-            ret3 = system(cmd_flag0);
-            err->errnum = ret3;
-
-            g_free(new_hostname_spe);
-            g_free(cmd_flag);
-            g_free(cmd_flag0);
-            g_free(cmd_flag1);
-            g_free(cmd_flag2);
-
-            return err;
-        }
-        else{
-            err->errnum = ret2;
-
-            g_free(new_hostname_spe);
-            g_free(cmd_flag);
-            g_free(cmd_flag0);
-            g_free(cmd_flag1);
-            g_free(cmd_flag2);
-
-            return err;
-        }
-    }
-    ret1 = system(cmd1);
-    if(ret1 == 0){
-        ret2 = system(cmd_flag);
-        if(ret2 ==0){
-            ret3 = system(cmd_flag0);
-            err->errnum = ret3;
-
-            g_free(new_hostname_spe);
-            g_free(cmd_flag);
-            g_free(cmd_flag0);
-            g_free(cmd_flag1);
-            g_free(cmd_flag2);
-
-            return err;
-        }
-        else{
-            err->errnum = ret2;
-
-            g_free(new_hostname_spe);
-            g_free(cmd_flag);
-            g_free(cmd_flag0);
-            g_free(cmd_flag1);
-            g_free(cmd_flag2);
-
-            return err;
-        }
-    }
-    ret1 = system(cmd2);
-    if(ret1 == 0){
-        ret2 = system(cmd_flag);
-        if(ret2 ==0){
-            ret3 = system(cmd_flag0);
-            err->errnum = ret3;
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
 
-            g_free(new_hostname_spe);
-            g_free(cmd_flag);
-            g_free(cmd_flag0);
-            g_free(cmd_flag1);
-            g_free(cmd_flag2);
+void qmp_guest_file_prefetch_cancel(int64_t id, Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+}
 
-            return err;
-        }
-        else{
-            err->errnum = ret2;
+GuestFileOpResultList *qmp_guest_file_ops(GuestFileOpList *ops,
+                                          bool has_stop_on_error,
+                                          bool stop_on_error, Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
 
-            g_free(new_hostname_spe);
-            g_free(cmd_flag);
-            g_free(cmd_flag0);
-            g_free(cmd_flag1);
-            g_free(cmd_flag2);
+GuestUserLoginList *qmp_guest_get_users(Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
 
-            return err;
-        }
-    }
-    ret1 = system(cmd3);
-    if(ret1 == 0){
-        ret2 = system(cmd_flag);
-        if(ret2 ==0){
-            ret3 = system(cmd_flag1);
-            err->errnum = ret3;
+GuestSockets *qmp_guest_get_sockets(bool has_port, int64_t port,
+                                    bool has_owners, bool owners,
+                                    bool has_connections, bool connections,
+                                    Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
 
-            g_free(new_hostname_spe);
-            g_free(cmd_flag);
-            g_free(cmd_flag0);
-            g_free(cmd_flag1);
-            g_free(cmd_flag2);
+GuestNetProbeResultList *qmp_guest_net_probe(GuestNetProbeTargetList *targets,
+                                             bool has_count, int64_t count,
+                                             bool has_timeout, int64_t timeout,
+                                             Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
 
-            return err;
-        }
-        else{
-            err->errnum = ret2;
+GuestServiceStatusList *qmp_guest_get_service_status(strList *units,
+                                                     Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
 
-            g_free(new_hostname_spe);
-            g_free(cmd_flag);
-            g_free(cmd_flag0);
-            g_free(cmd_flag1);
-            g_free(cmd_flag2);
+GuestPackages *qmp_guest_get_packages(bool has_since, const char *since,
+                                      Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
 
-            return err;
-        }
-    }
-    ret1 = system(cmd4);
-    if(ret1 == 0){
-        ret2 = system(cmd_flag);
-        if(ret2 ==0){
-            ret3 = system(cmd_flag1);
-            err->errnum = ret3;
+GuestProcessMemoryList *qmp_guest_get_process_memory(bool has_pids,
+                                                     intList *pids,
+                                                     bool has_top,
+                                                     int64_t top,
+                                                     Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
 
-            g_free(new_hostname_spe);
-            g_free(cmd_flag);
-            g_free(cmd_flag0);
-            g_free(cmd_flag1);
-            g_free(cmd_flag2);
+GuestCgroupStatsList *qmp_guest_get_cgroup_stats(bool has_depth,
+                                                 int64_t depth, bool has_top,
+                                                 int64_t top, Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
 
-            return err;
-        }
-        else{
-            err->errnum = ret2;
+GuestKernelLog *qmp_guest_get_kernel_log(bool has_cursor, int64_t cursor,
+                                         bool has_level,
+                                         GuestKernelLogLevel level,
+                                         bool has_facility, int64_t facility,
+                                         bool has_pattern, const char *pattern,
+                                         bool has_limit, int64_t limit,
+                                         Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
 
-            g_free(new_hostname_spe);
-            g_free(cmd_flag);
-            g_free(cmd_flag0);
-            g_free(cmd_flag1);
-            g_free(cmd_flag2);
+void qmp_guest_set_kernel_log_events(bool enable, bool has_level,
+                                     GuestKernelLogLevel level,
+                                     bool has_pattern, const char *pattern,
+                                     Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+}
 
-            return err;
-        }
-    }
-    ret1 = system(cmd5);
-    if(ret1 == 0){
-        ret2 = system(cmd_flag);
-        if(ret2 ==0){
-            ret3 = system(cmd_flag2);
-            err->errnum = ret3;
+GuestBlockQueueResultList *
+qmp_guest_set_block_queue_params(GuestBlockQueueDeviceList *devices,
+                                 GuestBlockQueueParams *params,
+                                 bool has_persist, bool persist,
+                                 Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
 
-            g_free(new_hostname_spe);
-            g_free(cmd_flag);
-            g_free(cmd_flag0);
-            g_free(cmd_flag1);
-            g_free(cmd_flag2);
+GuestNetQueuesList *qmp_guest_set_net_queues(bool has_interfaces,
+                                             strList *interfaces,
+                                             bool has_combined,
+                                             int64_t combined,
+                                             bool has_irq_affinity,
+                                             bool irq_affinity, bool has_xps,
+                                             bool xps, bool has_rps, bool rps,
+                                             Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
 
-            return err;
-        }
-        else{
-            err->errnum = ret2;
+GuestMemoryReclaim *qmp_guest_reclaim_memory(bool has_cgroup,
+                                             const char *cgroup,
+                                             bool has_reclaim_bytes,
+                                             int64_t reclaim_bytes,
+                                             bool has_drop_caches,
+                                             int64_t drop_caches,
+                                             bool has_compact, bool compact,
+                                             bool has_thp_defrag,
+                                             const char *thp_defrag,
+                                             Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
 
-            g_free(new_hostname_spe);
-            g_free(cmd_flag);
-            g_free(cmd_flag0);
-            g_free(cmd_flag1);
-            g_free(cmd_flag2);
+GuestProfile *qmp_guest_set_profile(const char *name,
+                                    GuestProfileSettingList *settings,
+                                    Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
 
-            return err;
-        }
-    }
+GuestProfile *qmp_guest_get_profile(Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
 
-    err->errnum = 1;
-    return err;
+void qmp_guest_reset_profile(Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
 }
-/*########################################################################################################*/
 
+GuestProvisionResult *qmp_guest_provision(bool has_id, const char *id,
+                                          bool has_hostname,
+                                          const char *hostname,
+                                          bool has_passwords,
+                                          GuestProvisionPasswordList *passwords,
+                                          bool has_files,
+                                          GuestProvisionFileList *files,
+                                          bool has_ssh_keys,
+                                          GuestProvisionSSHKeysList *ssh_keys,
+                                          bool has_sysctls,
+                                          GuestProfileSettingList *sysctls,
+                                          bool has_commands,
+                                          GuestProvisionCommandList *commands,
+                                          Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
 
-#else /* defined(__linux__) */
+void qmp_guest_ssh_add_authorized_keys(const char *username, strList *keys,
+                                       Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+}
 
-void qmp_guest_suspend_disk(Error **errp)
+void qmp_guest_ssh_remove_authorized_keys(const char *username,
+                                          strList *keys, Error **errp)
 {
     error_setg(errp, QERR_UNSUPPORTED);
 }
 
-void qmp_guest_suspend_ram(Error **errp)
+void qmp_guest_ssh_set_authorized_keys(const char *username, strList *keys,
+                                       Error **errp)
 {
     error_setg(errp, QERR_UNSUPPORTED);
 }
 
-void qmp_guest_suspend_hybrid(Error **errp)
+#endif
+
+/* compiled out of lean builds, see ga_command_blacklist_init() */
+#if !defined(__linux__) || defined(CONFIG_QGA_LEAN)
+
+void qmp_guest_set_alert_rules(GuestAlertRuleList *rules, bool has_interval,
+                               int64_t interval, Error **errp)
 {
     error_setg(errp, QERR_UNSUPPORTED);
 }
 
-GuestNetworkInterfaceList *qmp_guest_network_get_interfaces(Error **errp)
+GuestAlertRules *qmp_guest_get_alert_rules(Error **errp)
 {
     error_setg(errp, QERR_UNSUPPORTED);
     return NULL;
 }
 
-GuestLogicalProcessorList *qmp_guest_get_vcpus(Error **errp)
+void qmp_guest_set_health_checks(GuestHealthCheckList *checks, Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+}
+
+GuestHealthResultList *qmp_guest_get_health(Error **errp)
 {
     error_setg(errp, QERR_UNSUPPORTED);
     return NULL;
 }
 
-int64_t qmp_guest_set_vcpus(GuestLogicalProcessorList *vcpus, Error **errp)
+GuestLogFollowInfo *qmp_guest_log_follow(strList *paths,
+                                         bool has_from_start,
+                                         bool from_start,
+                                         bool has_batch_size,
+                                         int64_t batch_size,
+                                         bool has_batch_delay,
+                                         int64_t batch_delay, Error **errp)
 {
     error_setg(errp, QERR_UNSUPPORTED);
-    return -1;
+    return NULL;
 }
 
-void qmp_guest_set_user_password(const char *username,
-                                 const char *password,
-                                 bool crypted,
-                                 Error **errp)
+void qmp_guest_log_unfollow(int64_t follow, Error **errp)
 {
     error_setg(errp, QERR_UNSUPPORTED);
 }
 
-GuestMemoryBlockList *qmp_guest_get_memory_blocks(Error **errp)
+void qmp_guest_log_ack(int64_t follow, int64_t cursor, Error **errp)
 {
     error_setg(errp, QERR_UNSUPPORTED);
-    return NULL;
 }
 
-GuestMemoryBlockResponseList *
-qmp_guest_set_memory_blocks(GuestMemoryBlockList *mem_blks, Error **errp)
+void qmp_guest_log_resume(int64_t follow, Error **errp)
 {
     error_setg(errp, QERR_UNSUPPORTED);
-    return NULL;
 }
 
-GuestMemoryBlockInfo *qmp_guest_get_memory_block_info(Error **errp)
+GuestTopProcesses *qmp_guest_get_top_processes(bool has_sort,
+                                               GuestTopProcessSortKey sort,
+                                               bool has_limit, int64_t limit,
+                                               bool has_budget, int64_t budget,
+                                               Error **errp)
 {
     error_setg(errp, QERR_UNSUPPORTED);
     return NULL;
@@ -2969,7 +17350,8 @@ GuestMemoryBlockInfo *qmp_guest_get_memory_block_info(Error **errp)
 
 #if !defined(CONFIG_FSFREEZE)
 
-GuestFilesystemInfoList *qmp_guest_get_fsinfo(Error **errp)
+GuestFilesystemInfoList *qmp_guest_get_fsinfo(bool has_timeout,
+                                              int64_t timeout, Error **errp)
 {
     error_setg(errp, QERR_UNSUPPORTED);
     return NULL;
@@ -2982,7 +17364,8 @@ GuestFsfreezeStatus qmp_guest_fsfreeze_status(Error **errp)
     return 0;
 }
 
-int64_t qmp_guest_fsfreeze_freeze(Error **errp)
+int64_t qmp_guest_fsfreeze_freeze(bool has_exclude_writers,
+                                  strList *exclude_writers, Error **errp)
 {
     error_setg(errp, QERR_UNSUPPORTED);
 
@@ -2991,6 +17374,7 @@ int64_t qmp_guest_fsfreeze_freeze(Error **errp)
 
 int64_t qmp_guest_fsfreeze_freeze_list(bool has_mountpoints,
                                        strList *mountpoints,
+                                       bool has_presync, bool presync,
                                        Error **errp)
 {
     error_setg(errp, QERR_UNSUPPORTED);
@@ -3004,15 +17388,58 @@ int64_t qmp_guest_fsfreeze_thaw(Error **errp)
 
     return 0;
 }
+
+void qmp_guest_fsfreeze_prepare(bool has_mountpoints, strList *mountpoints,
+                                Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+}
+
+GuestFsfreezeTimings *qmp_guest_fsfreeze_commit(Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
+
+GuestFsfreezeTimings *qmp_guest_fsfreeze_get_timings(Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
 #endif /* CONFIG_FSFREEZE */
 
 #if !defined(CONFIG_FSTRIM)
 GuestFilesystemTrimResponse *
-qmp_guest_fstrim(bool has_minimum, int64_t minimum, Error **errp)
+qmp_guest_fstrim(bool has_minimum, int64_t minimum,
+                 bool has_chunk_size, int64_t chunk_size,
+                 bool has_bandwidth, int64_t bandwidth,
+                 bool has_max_parallel, int64_t max_parallel, Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
+
+GuestFilesystemTrimStart *
+qmp_guest_fstrim_start(bool has_minimum, int64_t minimum,
+                       bool has_chunk_size, int64_t chunk_size,
+                       bool has_bandwidth, int64_t bandwidth,
+                       bool has_max_parallel, int64_t max_parallel,
+                       Error **errp)
 {
     error_setg(errp, QERR_UNSUPPORTED);
     return NULL;
 }
+
+GuestFilesystemTrimJob *qmp_guest_fstrim_status(int64_t id, Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
+
+void qmp_guest_fstrim_cancel(int64_t id, Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+}
 #endif
 
 /* add unsupported commands to the blacklist */
@@ -3023,9 +17450,25 @@ GList *ga_command_blacklist_init(GList *blacklist)
         const char *list[] = {
             "guest-suspend-disk", "guest-suspend-ram",
             "guest-suspend-hybrid", "guest-network-get-interfaces",
-            "guest-get-vcpus", "guest-set-vcpus",
+            "guest-sync-time", "guest-get-vcpus", "guest-set-vcpus",
+            "guest-set-vcpus-batch",
             "guest-get-memory-blocks", "guest-set-memory-blocks",
-            "guest-get-memory-block-size", NULL};
+            "guest-set-memory-blocks-start",
+            "guest-set-memory-blocks-status",
+            "guest-set-memory-blocks-cancel",
+            "guest-get-memory-block-size", "guest-get-numa-info",
+            "guest-file-watch", "guest-file-unwatch", "guest-file-watch-read",
+            "guest-file-copy-start", "guest-file-copy-status",
+            "guest-file-copy-cancel", "guest-file-residency",
+            "guest-file-prefetch", "guest-file-prefetch-status",
+            "guest-file-prefetch-cancel", "guest-file-ops",
+            "guest-get-users",
+            "guest-get-sockets", "guest-get-service-status",
+            "guest-get-packages", "guest-get-cgroup-stats",
+            "guest-get-kernel-log", "guest-set-kernel-log-events",
+            "guest-set-block-queue-params", "guest-set-net-queues",
+            "guest-reclaim-memory", "guest-set-profile", "guest-get-profile",
+            "guest-reset-profile", NULL};
         char **p = (char **)list;
 
         while (*p) {
@@ -3039,7 +17482,9 @@ GList *ga_command_blacklist_init(GList *blacklist)
         const char *list[] = {
             "guest-get-fsinfo", "guest-fsfreeze-status",
             "guest-fsfreeze-freeze", "guest-fsfreeze-freeze-list",
-            "guest-fsfreeze-thaw", "guest-get-fsinfo", NULL};
+            "guest-fsfreeze-thaw", "guest-get-fsinfo",
+            "guest-fsfreeze-prepare", "guest-fsfreeze-commit",
+            "guest-fsfreeze-get-timings", NULL};
         char **p = (char **)list;
 
         while (*p) {
@@ -3049,7 +17494,29 @@ GList *ga_command_blacklist_init(GList *blacklist)
 #endif
 
 #if !defined(CONFIG_FSTRIM)
-    blacklist = g_list_append(blacklist, g_strdup("guest-fstrim"));
+    {
+        const char *list[] = {
+            "guest-fstrim", "guest-fstrim-start", "guest-fstrim-status",
+            "guest-fstrim-cancel", NULL};
+        char **p = (char **)list;
+
+        while (*p) {
+            blacklist = g_list_append(blacklist, g_strdup(*p++));
+        }
+    }
+#endif
+
+#if defined(CONFIG_QGA_LEAN)
+    {
+        const char *list[] = {
+            "guest-set-alert-rules", "guest-get-alert-rules",
+            "guest-get-top-processes", NULL};
+        char **p = (char **)list;
+
+        while (*p) {
+            blacklist = g_list_append(blacklist, g_strdup(*p++));
+        }
+    }
 #endif
 
     return blacklist;
@@ -3058,7 +17525,56 @@ GList *ga_command_blacklist_init(GList *blacklist)
 /* register init/cleanup routines for stateful command groups */
 void ga_command_state_init(GAState *s, GACommandState *cs)
 {
+    ga_command_state_add(cs, guest_file_init, guest_file_cleanup);
+    ga_add_session_close_notifier(s, &guest_file_state.session_close);
 #if defined(CONFIG_FSFREEZE)
     ga_command_state_add(cs, NULL, guest_fsfreeze_cleanup);
+    ga_command_state_add(cs, NULL, guest_topology_cleanup);
+    ga_command_state_add(cs, NULL, guest_fsinfo_cleanup);
+    ga_command_state_add_cache(cs, guest_topology_invalidate,
+                               guest_topology_warm);
+#endif
+#if defined(CONFIG_FSTRIM)
+    ga_command_state_add(cs, NULL, guest_fstrim_cleanup);
+#endif
+#if defined(__linux__)
+    ga_command_state_add(cs, NULL, guest_mount_cache_cleanup);
+    ga_command_state_add(cs, NULL, ga_collect_disks_cleanup);
+    ga_command_state_add(cs, NULL, ga_collect_services_cleanup);
+    ga_command_state_add(cs, NULL, ga_collect_packages_cleanup);
+    ga_command_state_add_cache(cs, guest_mount_cache_invalidate,
+                               guest_mount_cache_warm);
+    ga_command_state_add_cache(cs, ga_collect_disks_invalidate, NULL);
+    ga_command_state_add_cache(cs, ga_collect_services_invalidate, NULL);
+    ga_command_state_add_cache(cs, ga_collect_packages_invalidate, NULL);
+    ga_command_state_add_cache(cs, ga_collect_system_invalidate_fqdn, NULL);
+    ga_command_state_add(cs, NULL, ga_collect_processes_cleanup);
+    ga_command_state_add(cs, NULL, ga_collect_logins_cleanup);
+    ga_command_state_add_deferred(cs, guest_sysinfo_init,
+                                  guest_sysinfo_cleanup);
+    ga_command_state_add_deferred(cs, guest_suspend_init, NULL);
+    ga_command_state_add(cs, NULL, guest_oom_cleanup);
+    ga_command_state_add(cs, NULL, guest_kmsg_cleanup);
+    ga_command_state_add(cs, NULL, guest_cpustat_cleanup);
+    ga_command_state_add(cs, NULL, guest_diskstat_cleanup);
+    ga_command_state_add(cs, NULL, guest_cgroup_cleanup);
+    ga_command_state_add(cs, NULL, guest_netif_cleanup);
+    ga_command_state_add_cache(cs, guest_netif_invalidate, guest_netif_warm);
+    ga_command_state_add(cs, NULL, guest_netlink_cleanup);
+    ga_command_state_add(cs, NULL, guest_sock_cleanup);
+    ga_command_state_add(cs, NULL, guest_fwatch_cleanup);
+    ga_command_state_add(cs, NULL, guest_fcopy_cleanup);
+    ga_command_state_add(cs, NULL, guest_prefetch_cleanup);
+    ga_command_state_add(cs, NULL, guest_vmstat_cleanup);
+#if !defined(CONFIG_QGA_LEAN)
+    ga_command_state_add(cs, NULL, guest_alert_cleanup);
+    ga_command_state_add(cs, NULL, guest_health_cleanup);
+    ga_command_state_add_deferred(cs, guest_log_init, guest_log_cleanup);
+    ga_command_state_add(cs, NULL, guest_top_cleanup);
+#endif
+    ga_command_state_add(cs, NULL, guest_memblk_cleanup);
+    ga_command_state_add(cs, NULL, guest_memblk_jobs_cleanup);
+    ga_command_state_add(cs, NULL, guest_vcpu_cleanup);
+    ga_command_state_add(cs, NULL, guest_numa_cleanup);
 #endif
 }
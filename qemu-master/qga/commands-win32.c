@@ -34,6 +34,10 @@
 #include "qapi/qmp/qerror.h"
 #include "qemu/queue.h"
 #include "qemu/host-utils.h"
+#include "qemu/base64.h"
+#include "qemu/buffer-pool.h"
+#include "qapi/qmp-event.h"
+#include "qapi/qmp/types.h"
 
 #ifndef SHTDN_REASON_FLAG_PLANNED
 #define SHTDN_REASON_FLAG_PLANNED 0x80000000
@@ -50,13 +54,33 @@
 typedef struct GuestFileHandle {
     int64_t id;
     HANDLE fh;
-    QTAILQ_ENTRY(GuestFileHandle) next;
+    GuestFileCaching caching;
+    GASession *session;         /* the client that opened it */
 } GuestFileHandle;
 
+/* a guest-file-pull or guest-file-push stream */
+typedef struct GuestFileTransfer {
+    int64_t id;
+    HANDLE fh;                  /* read and written at explicit offsets */
+    int64_t offset;             /* of the next chunk */
+    int64_t remaining;          /* pull: bytes left to send */
+    size_t chunk_size;
+    int64_t count;              /* bytes transferred so far */
+    GAStream *stream;           /* pull: the sender */
+    GASession *session;
+    QTAILQ_ENTRY(GuestFileTransfer) next;
+} GuestFileTransfer;
+
+static void guest_file_session_close(Notifier *notifier, void *data);
+
 static struct {
-    QTAILQ_HEAD(, GuestFileHandle) filehandles;
+    GHashTable *filehandles;    /* GuestFileHandle by id */
+    GHashTable *session_count;  /* open handles by GASession */
+    QTAILQ_HEAD(, GuestFileTransfer) transfers;
+    Notifier session_close;
 } guest_file_state = {
-    .filehandles = QTAILQ_HEAD_INITIALIZER(guest_file_state.filehandles),
+    .transfers = QTAILQ_HEAD_INITIALIZER(guest_file_state.transfers),
+    .session_close = { .notify = guest_file_session_close },
 };
 
 
@@ -99,7 +123,36 @@ static OpenFlags *find_open_flag(const char *mode_str)
     return NULL;
 }
 
-static int64_t guest_file_handle_add(HANDLE fh, Error **errp)
+/* open handles of @session, changed by @delta */
+static int guest_file_session_count(GASession *session, int delta)
+{
+    int count = GPOINTER_TO_INT(g_hash_table_lookup(
+                                    guest_file_state.session_count, session));
+
+    count += delta;
+    if (delta && count) {
+        g_hash_table_insert(guest_file_state.session_count, session,
+                            GINT_TO_POINTER(count));
+    } else if (delta) {
+        g_hash_table_remove(guest_file_state.session_count, session);
+    }
+    return count;
+}
+
+static bool guest_file_handle_check_limit(Error **errp)
+{
+    int max = ga_get_max_file_handles(ga_state);
+
+    if (max && guest_file_session_count(ga_get_session(ga_state), 0) >= max) {
+        error_setg(errp, "too many open files, the limit is %d per client",
+                   max);
+        return false;
+    }
+    return true;
+}
+
+static int64_t guest_file_handle_add(HANDLE fh, GuestFileCaching caching,
+                                     Error **errp)
 {
     GuestFileHandle *gfh;
     int64_t handle;
@@ -111,25 +164,96 @@ static int64_t guest_file_handle_add(HANDLE fh, Error **errp)
     gfh = g_new0(GuestFileHandle, 1);
     gfh->id = handle;
     gfh->fh = fh;
-    QTAILQ_INSERT_TAIL(&guest_file_state.filehandles, gfh, next);
+    gfh->caching = caching;
+    gfh->session = ga_get_session(ga_state);
+    g_hash_table_insert(guest_file_state.filehandles, &gfh->id, gfh);
+    guest_file_session_count(gfh->session, 1);
 
     return handle;
 }
 
+/* handles can only be used by the client that opened them */
 static GuestFileHandle *guest_file_handle_find(int64_t id, Error **errp)
 {
-    GuestFileHandle *gfh;
-    QTAILQ_FOREACH(gfh, &guest_file_state.filehandles, next) {
-        if (gfh->id == id) {
-            return gfh;
+    GuestFileHandle *gfh = g_hash_table_lookup(guest_file_state.filehandles,
+                                               &id);
+
+    if (!gfh || gfh->session != ga_get_session(ga_state)) {
+        error_setg(errp, "handle '%" PRId64 "' has not been found", id);
+        return NULL;
+    }
+    return gfh;
+}
+
+static void guest_file_handle_remove(GuestFileHandle *gfh)
+{
+    guest_file_session_count(gfh->session, -1);
+    g_hash_table_remove(guest_file_state.filehandles, &gfh->id);
+}
+
+static gboolean guest_file_handle_orphaned(gpointer key, gpointer value,
+                                           gpointer opaque)
+{
+    GuestFileHandle *gfh = value;
+
+    if (opaque && gfh->session != opaque) {
+        return false;
+    }
+    slog("guest-file: closing handle %" PRId64 " left open", gfh->id);
+    CloseHandle(gfh->fh);
+    return true;
+}
+
+static void guest_file_transfer_free(gpointer opaque);
+
+/* pull transfers end with their stream, before this is called */
+static void guest_file_session_close(Notifier *notifier, void *data)
+{
+    GASession *session = data;
+    GuestFileTransfer *gft, *tmp;
+
+    g_hash_table_foreach_remove(guest_file_state.filehandles,
+                                guest_file_handle_orphaned, session);
+    g_hash_table_remove(guest_file_state.session_count, session);
+    QTAILQ_FOREACH_SAFE(gft, &guest_file_state.transfers, next, tmp) {
+        if (gft->session == session) {
+            guest_file_transfer_free(gft);
         }
     }
-    error_setg(errp, "handle '%" PRId64 "' has not been found", id);
-    return NULL;
+}
+
+static void guest_file_init(void)
+{
+    guest_file_state.filehandles = g_hash_table_new_full(g_int64_hash,
+                                                         g_int64_equal,
+                                                         NULL, g_free);
+    guest_file_state.session_count = g_hash_table_new(NULL, NULL);
+}
+
+static void guest_file_cleanup(void)
+{
+    /* the channel, and with it the clients, goes away later */
+    notifier_remove(&guest_file_state.session_close);
+    g_hash_table_foreach_remove(guest_file_state.filehandles,
+                                guest_file_handle_orphaned, NULL);
+    g_hash_table_destroy(guest_file_state.filehandles);
+    g_hash_table_destroy(guest_file_state.session_count);
+}
+
+/* unaligned ReadFile()/WriteFile() fail on a direct handle */
+static bool guest_file_check_stream(GuestFileHandle *gfh, const char *cmd,
+                                    Error **errp)
+{
+    if (gfh->caching == GUEST_FILE_CACHING_DIRECT) {
+        error_setg(errp, "%s is not available with direct caching", cmd);
+        return false;
+    }
+    return true;
 }
 
 int64_t qmp_guest_file_open(const char *path, bool has_mode,
-                            const char *mode, Error **errp)
+                            const char *mode, bool has_caching,
+                            GuestFileCaching caching, Error **errp)
 {
     int64_t fd;
     HANDLE fh;
@@ -142,12 +266,26 @@ int64_t qmp_guest_file_open(const char *path, bool has_mode,
     if (!has_mode) {
         mode = "r";
     }
+    if (!has_caching) {
+        caching = GUEST_FILE_CACHING_BUFFERED;
+    }
     slog("guest-file-open called, filepath: %s, mode: %s", path, mode);
+    if (!guest_file_handle_check_limit(errp)) {
+        return -1;
+    }
     guest_flags = find_open_flag(mode);
     if (guest_flags == NULL) {
         error_setg(errp, "invalid file open mode");
         return -1;
     }
+    /* there is no dropping pages after the fact, let the cache manager
+     * know up front that they are not going to be needed again
+     */
+    if (caching == GUEST_FILE_CACHING_UNBUFFERED) {
+        flags_and_attr |= FILE_FLAG_SEQUENTIAL_SCAN;
+    } else if (caching == GUEST_FILE_CACHING_DIRECT) {
+        flags_and_attr |= FILE_FLAG_NO_BUFFERING;
+    }
 
     fh = CreateFile(path, guest_flags->desired_access, share_mode, sa_attr,
                     guest_flags->creation_disposition, flags_and_attr,
@@ -158,7 +296,7 @@ int64_t qmp_guest_file_open(const char *path, bool has_mode,
         return -1;
     }
 
-    fd = guest_file_handle_add(fh, errp);
+    fd = guest_file_handle_add(fh, caching, errp);
     if (fd < 0) {
         CloseHandle(&fh);
         error_setg(errp, "failed to add handle to qmp handle table");
@@ -183,8 +321,7 @@ void qmp_guest_file_close(int64_t handle, Error **errp)
         return;
     }
 
-    QTAILQ_REMOVE(&guest_file_state.filehandles, gfh, next);
-    g_free(gfh);
+    guest_file_handle_remove(gfh);
 }
 
 static void acquire_privilege(const char *name, Error **errp)
@@ -271,6 +408,44 @@ void qmp_guest_shutdown(bool has_mode, const char *mode, Error **errp)
     }
 }
 
+/* @read_count bytes read into @buf, from qemu_buffer_pool_alloc(), which
+ * is consumed, for the client
+ */
+static GuestFileRead *guest_file_read_result(guchar *buf, DWORD read_count,
+                                             bool eof)
+{
+    GuestFileRead *read_data = g_new0(GuestFileRead, 1);
+    guchar *compressed, *data = buf;
+    size_t len;
+
+    read_data->count = (size_t)read_count;
+    read_data->eof = eof;
+
+    compressed = ga_compress(ga_state, buf, read_count, &len);
+    if (compressed) {
+        data = compressed;
+        read_data->has_compressed = read_data->compressed = true;
+    } else {
+        len = read_count;
+    }
+    if (ga_is_framed(ga_state) && compressed) {
+        ga_set_response_attachment(ga_state, compressed, len);
+        compressed = NULL;
+    } else if (ga_is_framed(ga_state)) {
+        ga_set_response_buffer(ga_state, buf, len);
+        buf = NULL;
+    } else {
+        read_data->has_buf_b64 = true;
+        if (len != 0) {
+            read_data->buf_b64 = qemu_base64_encode(data, len);
+        }
+    }
+    g_free(compressed);
+    qemu_buffer_pool_free(buf);
+
+    return read_data;
+}
+
 GuestFileRead *qmp_guest_file_read(int64_t handle, bool has_count,
                                    int64_t count, Error **errp)
 {
@@ -281,7 +456,7 @@ GuestFileRead *qmp_guest_file_read(int64_t handle, bool has_count,
     DWORD read_count;
     GuestFileHandle *gfh = guest_file_handle_find(handle, errp);
 
-    if (!gfh) {
+    if (!gfh || !guest_file_check_stream(gfh, "guest-file-read", errp)) {
         return NULL;
     }
     if (!has_count) {
@@ -293,53 +468,145 @@ GuestFileRead *qmp_guest_file_read(int64_t handle, bool has_count,
     }
 
     fh = gfh->fh;
-    buf = g_malloc0(count+1);
+    buf = qemu_buffer_pool_alloc(count);
     is_ok = ReadFile(fh, buf, count, &read_count, NULL);
     if (!is_ok) {
         error_setg_win32(errp, GetLastError(), "failed to read file");
         slog("guest-file-read failed, handle %" PRId64, handle);
+        qemu_buffer_pool_free(buf);
     } else {
-        buf[read_count] = 0;
-        read_data = g_new0(GuestFileRead, 1);
-        read_data->count = (size_t)read_count;
-        read_data->eof = read_count == 0;
+        read_data = guest_file_read_result(buf, read_count, read_count == 0);
+    }
+
+    return read_data;
+}
+
+/* ReadFile()/WriteFile() at @offset; the position of a synchronous
+ * handle still moves to the end of the data
+ */
+static OVERLAPPED guest_file_offset(int64_t offset)
+{
+    OVERLAPPED ov = {
+        .Offset = (DWORD)offset,
+        .OffsetHigh = (DWORD)(offset >> 32),
+    };
+
+    return ov;
+}
+
+GuestFileRead *qmp_guest_file_pread(int64_t handle, int64_t offset,
+                                    bool has_count, int64_t count,
+                                    Error **errp)
+{
+    GuestFileHandle *gfh = guest_file_handle_find(handle, errp);
+    guchar *buf, *bounce = NULL;
+    DWORD read_count = 0;
+    OVERLAPPED ov;
+
+    if (!gfh) {
+        return NULL;
+    }
+    if (!has_count) {
+        count = QGA_READ_COUNT_DEFAULT;
+    } else if (count < 0 || count > UINT32_MAX) {
+        error_setg(errp, "value '%" PRId64
+                   "' is invalid for argument count", count);
+        return NULL;
+    }
+    if (offset < 0) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "offset",
+                   "a non-negative number");
+        return NULL;
+    }
 
-        if (read_count != 0) {
-            read_data->buf_b64 = g_base64_encode(buf, read_count);
+    buf = qemu_buffer_pool_alloc(count);
+    if (gfh->caching == GUEST_FILE_CACHING_DIRECT) {
+        bounce = qemu_try_memalign(getpagesize(), MAX(count, 1));
+        if (!bounce) {
+            error_setg(errp, "failed to read file: out of memory");
+            qemu_buffer_pool_free(buf);
+            return NULL;
         }
     }
-    g_free(buf);
 
-    return read_data;
+    ov = guest_file_offset(offset);
+    if (!ReadFile(gfh->fh, bounce ? bounce : buf, count, &read_count, &ov) &&
+        GetLastError() != ERROR_HANDLE_EOF) {
+        error_setg_win32(errp, GetLastError(), "failed to read file");
+        slog("guest-file-pread failed, handle %" PRId64, handle);
+        qemu_buffer_pool_free(buf);
+        qemu_vfree(bounce);
+        return NULL;
+    }
+    if (bounce) {
+        memcpy(buf, bounce, read_count);
+        qemu_vfree(bounce);
+    }
+
+    return guest_file_read_result(buf, read_count, read_count < count);
+}
+
+/*
+ * The data of a guest-file-write or guest-file-pwrite: @buf_b64 decoded
+ * into *@buf, from qemu_buffer_pool_alloc() and to be freed by the caller,
+ * or the attachment of the request.  *@count is checked against it, or set
+ * to its length if not given.
+ */
+static bool guest_file_write_data(bool has_buf_b64, const char *buf_b64,
+                                  bool has_count, int64_t *count,
+                                  const guchar **data, guchar **buf,
+                                  Error **errp)
+{
+    size_t buf_len;
+
+    *buf = NULL;
+    if (has_buf_b64) {
+        buf_len = strlen(buf_b64);
+        *buf = qemu_buffer_pool_alloc(qemu_base64_decoded_max(buf_len));
+        buf_len = qemu_base64_decode_buf(buf_b64, buf_len, *buf);
+        *data = *buf;
+    } else if (ga_is_framed(ga_state)) {
+        *data = ga_get_attachment(ga_state, &buf_len);
+    } else {
+        error_setg(errp, QERR_MISSING_PARAMETER, "buf-b64");
+        return false;
+    }
+
+    if (!has_count) {
+        *count = buf_len;
+    } else if (*count < 0 || *count > buf_len) {
+        error_setg(errp, "value '%" PRId64
+                   "' is invalid for argument count", *count);
+        qemu_buffer_pool_free(*buf);
+        *buf = NULL;
+        return false;
+    }
+    return true;
 }
 
-GuestFileWrite *qmp_guest_file_write(int64_t handle, const char *buf_b64,
+GuestFileWrite *qmp_guest_file_write(int64_t handle, bool has_buf_b64,
+                                     const char *buf_b64,
                                      bool has_count, int64_t count,
                                      Error **errp)
 {
     GuestFileWrite *write_data = NULL;
+    const guchar *data;
     guchar *buf;
-    gsize buf_len;
     bool is_ok;
     DWORD write_count;
     GuestFileHandle *gfh = guest_file_handle_find(handle, errp);
     HANDLE fh;
 
-    if (!gfh) {
+    if (!gfh || !guest_file_check_stream(gfh, "guest-file-write", errp)) {
         return NULL;
     }
     fh = gfh->fh;
-    buf = g_base64_decode(buf_b64, &buf_len);
-
-    if (!has_count) {
-        count = buf_len;
-    } else if (count < 0 || count > buf_len) {
-        error_setg(errp, "value '%" PRId64
-                   "' is invalid for argument count", count);
-        goto done;
+    if (!guest_file_write_data(has_buf_b64, buf_b64, has_count, &count,
+                               &data, &buf, errp)) {
+        return NULL;
     }
 
-    is_ok = WriteFile(fh, buf, count, &write_count, NULL);
+    is_ok = WriteFile(fh, data, count, &write_count, NULL);
     if (!is_ok) {
         error_setg_win32(errp, GetLastError(), "failed to write to file");
         slog("guest-file-write-failed, handle: %" PRId64, handle);
@@ -348,8 +615,57 @@ GuestFileWrite *qmp_guest_file_write(int64_t handle, const char *buf_b64,
         write_data->count = (size_t) write_count;
     }
 
+    qemu_buffer_pool_free(buf);
+    return write_data;
+}
+
+GuestFileWrite *qmp_guest_file_pwrite(int64_t handle, int64_t offset,
+                                      bool has_buf_b64, const char *buf_b64,
+                                      bool has_count, int64_t count,
+                                      Error **errp)
+{
+    GuestFileHandle *gfh = guest_file_handle_find(handle, errp);
+    GuestFileWrite *write_data = NULL;
+    const guchar *data;
+    guchar *buf, *bounce = NULL;
+    DWORD write_count;
+    OVERLAPPED ov;
+
+    if (!gfh) {
+        return NULL;
+    }
+    if (offset < 0) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "offset",
+                   "a non-negative number");
+        return NULL;
+    }
+    if (!guest_file_write_data(has_buf_b64, buf_b64, has_count, &count,
+                               &data, &buf, errp)) {
+        return NULL;
+    }
+
+    if (gfh->caching == GUEST_FILE_CACHING_DIRECT) {
+        bounce = qemu_try_memalign(getpagesize(), MAX(count, 1));
+        if (!bounce) {
+            error_setg(errp, "failed to write to file: out of memory");
+            goto done;
+        }
+        memcpy(bounce, data, count);
+        data = bounce;
+    }
+
+    ov = guest_file_offset(offset);
+    if (!WriteFile(gfh->fh, data, count, &write_count, &ov)) {
+        error_setg_win32(errp, GetLastError(), "failed to write to file");
+        slog("guest-file-pwrite failed, handle: %" PRId64, handle);
+    } else {
+        write_data = g_new0(GuestFileWrite, 1);
+        write_data->count = (size_t) write_count;
+    }
+
 done:
-    g_free(buf);
+    qemu_vfree(bounce);
+    qemu_buffer_pool_free(buf);
     return write_data;
 }
 
@@ -662,7 +978,8 @@ free:
     return fs;
 }
 
-GuestFilesystemInfoList *qmp_guest_get_fsinfo(Error **errp)
+GuestFilesystemInfoList *qmp_guest_get_fsinfo(bool has_timeout,
+                                              int64_t timeout, Error **errp)
 {
     HANDLE vol_h;
     GuestFilesystemInfoList *new, *ret = NULL;
@@ -710,13 +1027,28 @@ GuestFsfreezeStatus qmp_guest_fsfreeze_status(Error **errp)
     return GUEST_FSFREEZE_STATUS_THAWED;
 }
 
+/* what the VSS requester measured of the last freeze and thaw */
+static struct {
+    QGAVSSRequest req;
+    int64_t filesystems;        /* -1 before the first freeze */
+    int64_t frozen_since;       /* while frozen, or 0 */
+    int64_t frozen_us;          /* of the last freeze once thawed, or -1 */
+} guest_vss_state = {
+    .req.timings = { -1, -1, -1, -1, -1 },
+    .filesystems = -1,
+    .frozen_us = -1,
+};
+
 /*
  * Freeze local file systems using Volume Shadow-copy Service.
  * The frozen state is limited for up to 10 seconds by VSS.
  */
-int64_t qmp_guest_fsfreeze_freeze(Error **errp)
+int64_t qmp_guest_fsfreeze_freeze(bool has_exclude_writers,
+                                  strList *exclude_writers, Error **errp)
 {
-    int i;
+    int i, n = 0;
+    gunichar2 **writers = NULL;
+    strList *l;
     Error *local_err = NULL;
 
     if (!vss_initialized()) {
@@ -726,15 +1058,38 @@ int64_t qmp_guest_fsfreeze_freeze(Error **errp)
 
     slog("guest-fsfreeze called");
 
+    if (has_exclude_writers) {
+        for (l = exclude_writers; l; l = l->next) {
+            n++;
+        }
+        writers = g_new0(gunichar2 *, n + 1);
+        for (l = exclude_writers, n = 0; l; l = l->next, n++) {
+            writers[n] = g_utf8_to_utf16(l->value, -1, NULL, NULL, NULL);
+            if (!writers[n]) {
+                error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                           "exclude-writers", "a list of writer names");
+                g_strfreev((gchar **)writers);
+                return 0;
+            }
+        }
+    }
+
     /* cannot risk guest agent blocking itself on a write in this state */
     ga_set_frozen(ga_state);
 
-    qga_vss_fsfreeze(&i, &local_err, true);
+    guest_vss_state.req.exclude_writers = (const wchar_t *const *)writers;
+    qga_vss_fsfreeze(&i, &guest_vss_state.req, &local_err, true);
+    guest_vss_state.req.exclude_writers = NULL;
+    g_strfreev((gchar **)writers);
     if (local_err) {
         error_propagate(errp, local_err);
         goto error;
     }
 
+    guest_vss_state.filesystems = i;
+    guest_vss_state.frozen_since = g_get_monotonic_time() -
+                                   MAX(guest_vss_state.req.timings.freeze, 0);
+    guest_vss_state.frozen_us = -1;
     return i;
 
 error:
@@ -749,6 +1104,7 @@ error:
 
 int64_t qmp_guest_fsfreeze_freeze_list(bool has_mountpoints,
                                        strList *mountpoints,
+                                       bool has_presync, bool presync,
                                        Error **errp)
 {
     error_setg(errp, QERR_UNSUPPORTED);
@@ -756,6 +1112,52 @@ int64_t qmp_guest_fsfreeze_freeze_list(bool has_mountpoints,
     return 0;
 }
 
+void qmp_guest_fsfreeze_prepare(bool has_mountpoints, strList *mountpoints,
+                                Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+}
+
+GuestFsfreezeTimings *qmp_guest_fsfreeze_commit(Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
+
+GuestFsfreezeTimings *qmp_guest_fsfreeze_get_timings(Error **errp)
+{
+    QGAVSSTimings *vt = &guest_vss_state.req.timings;
+    GuestFsfreezeTimings *t;
+
+    if (!vss_initialized()) {
+        error_setg(errp, QERR_UNSUPPORTED);
+        return NULL;
+    }
+
+    t = g_new0(GuestFsfreezeTimings, 1);
+    t->status = qmp_guest_fsfreeze_status(NULL);
+    t->has_filesystems = guest_vss_state.filesystems >= 0;
+    t->filesystems = guest_vss_state.filesystems;
+    t->has_writer_metadata = vt->writer_metadata >= 0;
+    t->writer_metadata = vt->writer_metadata;
+    t->has_scan = vt->add_volumes >= 0;
+    t->scan = vt->add_volumes;
+    t->has_prepare_backup = vt->prepare >= 0;
+    t->prepare_backup = vt->prepare;
+    t->has_freeze = vt->freeze >= 0;
+    t->freeze = vt->freeze;
+    t->has_thaw = vt->thaw >= 0;
+    t->thaw = vt->thaw;
+    if (guest_vss_state.frozen_since) {
+        t->has_frozen = true;
+        t->frozen = g_get_monotonic_time() - guest_vss_state.frozen_since;
+    } else {
+        t->has_frozen = guest_vss_state.frozen_us >= 0;
+        t->frozen = guest_vss_state.frozen_us;
+    }
+    return t;
+}
+
 /*
  * Thaw local file systems using Volume Shadow-copy Service.
  */
@@ -768,7 +1170,12 @@ int64_t qmp_guest_fsfreeze_thaw(Error **errp)
         return 0;
     }
 
-    qga_vss_fsfreeze(&i, errp, false);
+    qga_vss_fsfreeze(&i, &guest_vss_state.req, errp, false);
+    if (guest_vss_state.frozen_since) {
+        guest_vss_state.frozen_us = g_get_monotonic_time() -
+                                    guest_vss_state.frozen_since;
+        guest_vss_state.frozen_since = 0;
+    }
 
     ga_unset_frozen(ga_state);
     return i;
@@ -799,12 +1206,37 @@ static void guest_fsfreeze_cleanup(void)
  * areas.
  */
 GuestFilesystemTrimResponse *
-qmp_guest_fstrim(bool has_minimum, int64_t minimum, Error **errp)
+qmp_guest_fstrim(bool has_minimum, int64_t minimum,
+                 bool has_chunk_size, int64_t chunk_size,
+                 bool has_bandwidth, int64_t bandwidth,
+                 bool has_max_parallel, int64_t max_parallel, Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
+
+GuestFilesystemTrimStart *
+qmp_guest_fstrim_start(bool has_minimum, int64_t minimum,
+                       bool has_chunk_size, int64_t chunk_size,
+                       bool has_bandwidth, int64_t bandwidth,
+                       bool has_max_parallel, int64_t max_parallel,
+                       Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
+
+GuestFilesystemTrimJob *qmp_guest_fstrim_status(int64_t id, Error **errp)
 {
     error_setg(errp, QERR_UNSUPPORTED);
     return NULL;
 }
 
+void qmp_guest_fstrim_cancel(int64_t id, Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+}
+
 typedef enum {
     GUEST_SUSPEND_MODE_DISK,
     GUEST_SUSPEND_MODE_RAM
@@ -1179,6 +1611,13 @@ void qmp_guest_set_time(bool has_time, int64_t time_ns, Error **errp)
     }
 }
 
+GuestTimeSync *qmp_guest_sync_time(int64_t offset, bool has_step_threshold,
+                                   int64_t step_threshold, Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
+
 GuestLogicalProcessorList *qmp_guest_get_vcpus(Error **errp)
 {
     error_setg(errp, QERR_UNSUPPORTED);
@@ -1191,6 +1630,13 @@ int64_t qmp_guest_set_vcpus(GuestLogicalProcessorList *vcpus, Error **errp)
     return -1;
 }
 
+GuestLogicalProcessorResponseList *
+qmp_guest_set_vcpus_batch(GuestLogicalProcessorList *vcpus, Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
+
 static gchar *
 get_net_error_message(gint error)
 {
@@ -1271,7 +1717,9 @@ void qmp_guest_set_user_password(const char *username,
     g_free(rawpasswddata);
 }
 
-GuestMemoryBlockList *qmp_guest_get_memory_blocks(Error **errp)
+GuestMemoryBlockList *qmp_guest_get_memory_blocks(bool has_changed_since,
+                                                  int64_t changed_since,
+                                                  Error **errp)
 {
     error_setg(errp, QERR_UNSUPPORTED);
     return NULL;
@@ -1284,22 +1732,896 @@ qmp_guest_set_memory_blocks(GuestMemoryBlockList *mem_blks, Error **errp)
     return NULL;
 }
 
+GuestMemoryBlockJobStart *
+qmp_guest_set_memory_blocks_start(GuestMemoryBlockRangeList *ranges,
+                                  bool has_max_parallel,
+                                  int64_t max_parallel,
+                                  Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
+
+GuestMemoryBlockJob *qmp_guest_set_memory_blocks_status(int64_t id,
+                                                        Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
+
+void qmp_guest_set_memory_blocks_cancel(int64_t id, Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+}
+
 GuestMemoryBlockInfo *qmp_guest_get_memory_block_info(Error **errp)
 {
     error_setg(errp, QERR_UNSUPPORTED);
     return NULL;
 }
 
+GuestNumaInfo *qmp_guest_get_numa_info(Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
+
+void ga_sample_collect(GASample *sample, uint32_t groups)
+{
+}
+
+GuestMetricsHistory *qmp_guest_get_metrics_history(bool has_cursor,
+                                                   int64_t cursor,
+                                                   bool has_format,
+                                                   GuestMetricsFormat format,
+                                                   Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
+
+GuestMetricsRollup *
+qmp_guest_get_metrics_rollup(GuestMetricsResolution resolution, bool has_start,
+                             int64_t start, bool has_end, int64_t end,
+                             Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
+
+GuestCpuStats *qmp_guest_get_cpu_stats(bool has_cgroups, bool cgroups,
+                                       Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
+
+GuestDiskIOStatsList *qmp_guest_get_disk_io_stats(Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
+
+GuestNetworkStatsList *qmp_guest_get_network_stats(Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
+
+void qmp_guest_set_alert_rules(GuestAlertRuleList *rules, bool has_interval,
+                               int64_t interval, Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+}
+
+GuestAlertRules *qmp_guest_get_alert_rules(Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
+
+void qmp_guest_set_health_checks(GuestHealthCheckList *checks, Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+}
+
+GuestHealthResultList *qmp_guest_get_health(Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
+
+GuestLogFollowInfo *qmp_guest_log_follow(strList *paths,
+                                         bool has_from_start,
+                                         bool from_start,
+                                         bool has_batch_size,
+                                         int64_t batch_size,
+                                         bool has_batch_delay,
+                                         int64_t batch_delay, Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
+
+void qmp_guest_log_unfollow(int64_t follow, Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+}
+
+void qmp_guest_log_ack(int64_t follow, int64_t cursor, Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+}
+
+void qmp_guest_log_resume(int64_t follow, Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+}
+
+GuestMemoryPressure *qmp_guest_get_memory_pressure(Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
+
+GuestTopProcesses *qmp_guest_get_top_processes(bool has_sort,
+                                               GuestTopProcessSortKey sort,
+                                               bool has_limit, int64_t limit,
+                                               bool has_budget, int64_t budget,
+                                               Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
+
+GuestProcessMemoryList *qmp_guest_get_process_memory(bool has_pids,
+                                                     intList *pids,
+                                                     bool has_top,
+                                                     int64_t top,
+                                                     Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
+
+GuestProcessInfoList *qmp_guest_get_processes(bool has_sort,
+                                              GuestProcessSortKey sort,
+                                              bool has_limit, int64_t limit,
+                                              Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
+
+GuestProcessChanges *qmp_guest_get_process_changes(bool has_since,
+                                                   const char *since,
+                                                   Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
+
+#define GUEST_FILE_CHUNK_DEFAULT (1024 * 1024)
+#define GUEST_FILE_CHUNK_MAX (16 * 1024 * 1024)
+#define GUEST_FILE_CREDITS_DEFAULT 16
+
+static GuestFileTransfer *guest_file_transfer_new(HANDLE fh, int64_t offset,
+                                                  Error **errp)
+{
+    GuestFileTransfer *gft;
+    int64_t id;
+
+    id = ga_get_fd_handle(ga_state, errp);
+    if (id < 0) {
+        return NULL;
+    }
+
+    gft = g_new0(GuestFileTransfer, 1);
+    gft->id = id;
+    gft->fh = fh;
+    gft->offset = offset;
+    gft->session = ga_get_session(ga_state);
+    QTAILQ_INSERT_TAIL(&guest_file_state.transfers, gft, next);
+    return gft;
+}
+
+static GuestFileTransfer *guest_file_transfer_find(int64_t id, Error **errp)
+{
+    GuestFileTransfer *gft;
+
+    QTAILQ_FOREACH(gft, &guest_file_state.transfers, next) {
+        if (gft->id == id && gft->session == ga_get_session(ga_state)) {
+            return gft;
+        }
+    }
+
+    error_setg(errp, "stream '%" PRId64 "' has not been found", id);
+    return NULL;
+}
+
+static void guest_file_transfer_free(gpointer opaque)
+{
+    GuestFileTransfer *gft = opaque;
+
+    QTAILQ_REMOVE(&guest_file_state.transfers, gft, next);
+    CloseHandle(gft->fh);
+    g_free(gft);
+}
+
+static GuestFileStream *guest_file_stream_info(GuestFileTransfer *gft)
+{
+    GuestFileStream *info = g_new0(GuestFileStream, 1);
+    LARGE_INTEGER size;
+
+    info->stream = gft->id;
+    if (GetFileSizeEx(gft->fh, &size)) {
+        info->size = size.QuadPart;
+    }
+    return info;
+}
+
+/* CreateFile() for a transfer; the cache manager reads ahead further for
+ * FILE_FLAG_SEQUENTIAL_SCAN, which is what a whole-file copy wants
+ */
+static HANDLE guest_file_transfer_open(const char *path, const char *mode,
+                                       DWORD share_mode, Error **errp)
+{
+    OpenFlags *flags = find_open_flag(mode);
+    HANDLE fh;
+
+    fh = CreateFile(path, flags->desired_access, share_mode, NULL,
+                    flags->creation_disposition,
+                    FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (fh == INVALID_HANDLE_VALUE) {
+        error_setg_win32(errp, GetLastError(), "failed to open file '%s'",
+                         path);
+    }
+    return fh;
+}
+
+/* the next GUEST_FILE_DATA event: the file is read straight into the
+ * attachment, at the offset of the chunk
+ */
+static QDict *guest_file_pull_next(void *opaque, void **attachment,
+                                   size_t *len, bool *last)
+{
+    GuestFileTransfer *gft = opaque;
+    size_t want = MIN(gft->remaining, gft->chunk_size), got = 0;
+    guchar *buf = g_malloc(want), *compressed;
+    QDict *data = qdict_new(), *event;
+    DWORD ret, err = 0;
+    OVERLAPPED ov;
+    char *msg;
+
+    while (got < want) {
+        ov = guest_file_offset(gft->offset + got);
+        if (!ReadFile(gft->fh, buf + got, want - got, &ret, &ov)) {
+            err = GetLastError();
+            if (err == ERROR_HANDLE_EOF) {
+                err = 0;
+            }
+            break;
+        }
+        if (!ret) {
+            break;
+        }
+        got += ret;
+    }
+
+    qdict_put(data, "stream", qint_from_int(gft->id));
+    qdict_put(data, "offset", qint_from_int(gft->offset));
+    qdict_put(data, "count", qint_from_int(got));
+    if (err) {
+        msg = g_win32_error_message(err);
+        qdict_put(data, "error", qstring_from_str(msg));
+        g_free(msg);
+        slog("guest-file-pull failed, stream: %" PRId64, gft->id);
+    }
+    gft->offset += got;
+    gft->remaining -= got;
+    gft->count += got;
+    *last = err || got < want || !gft->remaining;
+    qdict_put(data, "eof", qbool_from_bool(*last));
+
+    compressed = ga_compress(ga_state, buf, got, len);
+    if (compressed) {
+        g_free(buf);
+        buf = compressed;
+        qdict_put(data, "compressed", qbool_from_bool(true));
+    } else {
+        *len = got;
+    }
+    *attachment = buf;
+
+    event = qmp_event_build_dict("GUEST_FILE_DATA");
+    qdict_put(event, "data", data);
+    return event;
+}
+
+GuestFileStream *qmp_guest_file_pull(const char *path, bool has_offset,
+                                     int64_t offset, bool has_length,
+                                     int64_t length, bool has_chunk_size,
+                                     int64_t chunk_size, bool has_credits,
+                                     int64_t credits, bool has_sparse,
+                                     bool sparse, Error **errp)
+{
+    GuestFileTransfer *gft;
+    GuestFileStream *info;
+    HANDLE fh;
+
+    if (!ga_is_framed(ga_state)) {
+        error_setg(errp, "guest-file-pull requires length-prefixed framing");
+        return NULL;
+    }
+    if (!has_offset) {
+        offset = 0;
+    } else if (offset < 0) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "offset",
+                   "a non-negative number");
+        return NULL;
+    }
+    if (!has_length) {
+        length = INT64_MAX;
+    } else if (length < 0) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "length",
+                   "a non-negative number");
+        return NULL;
+    }
+    if (!has_chunk_size) {
+        chunk_size = GUEST_FILE_CHUNK_DEFAULT;
+    } else if (chunk_size < 1 || chunk_size > GUEST_FILE_CHUNK_MAX) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "chunk-size",
+                   "a number of bytes between 1 and 16M");
+        return NULL;
+    }
+    if (!has_credits) {
+        credits = GUEST_FILE_CREDITS_DEFAULT;
+    } else if (credits < 0) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "credits",
+                   "a non-negative number");
+        return NULL;
+    }
+
+    slog("guest-file-pull called, filepath: %s", path);
+    /* files still being written to, such as logs, can be pulled too */
+    fh = guest_file_transfer_open(path, "r",
+                                  FILE_SHARE_READ | FILE_SHARE_WRITE, errp);
+    if (fh == INVALID_HANDLE_VALUE) {
+        return NULL;
+    }
+    gft = guest_file_transfer_new(fh, offset, errp);
+    if (!gft) {
+        CloseHandle(fh);
+        return NULL;
+    }
+    gft->remaining = length;
+    gft->chunk_size = chunk_size;
+
+    info = guest_file_stream_info(gft);
+    gft->stream = ga_stream_new(ga_state, credits, guest_file_pull_next, gft,
+                                guest_file_transfer_free);
+    return info;
+}
+
+void qmp_guest_file_stream_credit(int64_t stream, int64_t credits,
+                                  Error **errp)
+{
+    GuestFileTransfer *gft = guest_file_transfer_find(stream, errp);
+
+    if (!gft) {
+        return;
+    }
+    if (!gft->stream) {
+        error_setg(errp, "stream '%" PRId64 "' is not a guest-file-pull",
+                   stream);
+        return;
+    }
+    if (credits < 0) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "credits",
+                   "a non-negative number");
+        return;
+    }
+    ga_stream_add_credits(gft->stream, credits);
+}
+
+GuestFileStream *qmp_guest_file_push(const char *path, bool has_offset,
+                                     int64_t offset, bool has_truncate,
+                                     bool truncate, Error **errp)
+{
+    GuestFileTransfer *gft;
+    HANDLE fh;
+
+    if (!ga_is_framed(ga_state)) {
+        error_setg(errp, "guest-file-push requires length-prefixed framing");
+        return NULL;
+    }
+    if (!has_offset) {
+        offset = 0;
+    } else if (offset < 0) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "offset",
+                   "a non-negative number");
+        return NULL;
+    }
+
+    slog("guest-file-push called, filepath: %s", path);
+    fh = guest_file_transfer_open(path, has_truncate && !truncate ? "r+" : "w",
+                                  FILE_SHARE_READ, errp);
+    if (fh == INVALID_HANDLE_VALUE) {
+        return NULL;
+    }
+    gft = guest_file_transfer_new(fh, offset, errp);
+    if (!gft) {
+        CloseHandle(fh);
+        return NULL;
+    }
+    return guest_file_stream_info(gft);
+}
+
+void qmp_guest_file_push_data(int64_t stream, Error **errp)
+{
+    GuestFileTransfer *gft = guest_file_transfer_find(stream, errp);
+    const guchar *data;
+    size_t len;
+    DWORD ret;
+    OVERLAPPED ov;
+
+    if (!gft) {
+        return;
+    }
+    if (gft->stream) {
+        error_setg(errp, "stream '%" PRId64 "' is not a guest-file-push",
+                   stream);
+        return;
+    }
+    if (!ga_is_framed(ga_state)) {
+        error_setg(errp, "guest-file-push-data requires length-prefixed "
+                   "framing");
+        return;
+    }
+
+    data = ga_get_attachment(ga_state, &len);
+    while (len) {
+        ov = guest_file_offset(gft->offset);
+        if (!WriteFile(gft->fh, data, len, &ret, &ov)) {
+            error_setg_win32(errp, GetLastError(), "failed to write to file");
+            slog("guest-file-push failed, stream: %" PRId64, stream);
+            return;
+        }
+        data += ret;
+        len -= ret;
+        gft->offset += ret;
+        gft->count += ret;
+    }
+}
+
+/*
+ * Pushed files are not made sparse, so the part of the hole inside the
+ * file is written with zeros, and the part past its end left to
+ * SetEndOfFile().
+ */
+void qmp_guest_file_push_hole(int64_t stream, int64_t length, Error **errp)
+{
+    GuestFileTransfer *gft = guest_file_transfer_find(stream, errp);
+    static const char zeros[64 * 1024];
+    LARGE_INTEGER size, end;
+    int64_t offset;
+    DWORD ret;
+    OVERLAPPED ov;
+
+    if (!gft) {
+        return;
+    }
+    if (gft->stream) {
+        error_setg(errp, "stream '%" PRId64 "' is not a guest-file-push",
+                   stream);
+        return;
+    }
+    if (length < 0 || length > INT64_MAX - gft->offset) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "length",
+                   "a non-negative number");
+        return;
+    }
+    if (!GetFileSizeEx(gft->fh, &size)) {
+        error_setg_win32(errp, GetLastError(), "failed to write hole to file");
+        return;
+    }
+
+    for (offset = gft->offset;
+         offset < MIN(size.QuadPart, gft->offset + length); offset += ret) {
+        ov = guest_file_offset(offset);
+        if (!WriteFile(gft->fh, zeros,
+                       MIN(MIN(size.QuadPart, gft->offset + length) - offset,
+                           (int64_t)sizeof(zeros)), &ret, &ov)) {
+            error_setg_win32(errp, GetLastError(),
+                             "failed to write hole to file");
+            slog("guest-file-push failed, stream: %" PRId64, stream);
+            return;
+        }
+    }
+    if (gft->offset + length > size.QuadPart) {
+        end.QuadPart = gft->offset + length;
+        if (!SetFilePointerEx(gft->fh, end, NULL, FILE_BEGIN) ||
+            !SetEndOfFile(gft->fh)) {
+            error_setg_win32(errp, GetLastError(),
+                             "failed to write hole to file");
+            slog("guest-file-push failed, stream: %" PRId64, stream);
+            return;
+        }
+    }
+    gft->offset += length;
+    gft->count += length;
+}
+
+GuestFileStreamClose *qmp_guest_file_stream_close(int64_t stream,
+                                                  Error **errp)
+{
+    GuestFileTransfer *gft = guest_file_transfer_find(stream, errp);
+    GuestFileStreamClose *info;
+
+    if (!gft) {
+        return NULL;
+    }
+
+    info = g_new0(GuestFileStreamClose, 1);
+    info->count = gft->count;
+    if (gft->stream) {
+        ga_stream_free(gft->stream);
+    } else {
+        guest_file_transfer_free(gft);
+    }
+    return info;
+}
+
+GuestFileListing *qmp_guest_file_list(const char *path, bool has_depth,
+                                      int64_t depth, bool has_pattern,
+                                      const char *pattern,
+                                      bool has_max_entries,
+                                      int64_t max_entries, bool has_cursor,
+                                      const char *cursor, Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
+
+GuestFileContentList *qmp_guest_file_read_many(GuestFileReadRequestList *files,
+                                               bool has_dir, const char *dir,
+                                               bool has_max_size,
+                                               int64_t max_size,
+                                               Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
+
+GuestFileWatch *qmp_guest_file_watch(const char *path, bool has_events,
+                                     GuestFileWatchEventList *events,
+                                     bool has_notify, bool notify,
+                                     Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
+
+void qmp_guest_file_unwatch(int64_t watch, Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+}
+
+GuestFileChanges *qmp_guest_file_watch_read(bool has_timeout_ms,
+                                            int64_t timeout_ms, Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
+
+GuestFileCopyStart *qmp_guest_file_copy_start(const char *src,
+                                              const char *dst,
+                                              bool has_offset, int64_t offset,
+                                              bool has_length, int64_t length,
+                                              Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
+
+GuestFileCopyJob *qmp_guest_file_copy_status(int64_t id, Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
+
+void qmp_guest_file_copy_cancel(int64_t id, Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+}
+
+GuestFileResidencyList *qmp_guest_file_residency(strList *paths,
+                                                 Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
+
+GuestFilePrefetchStart *qmp_guest_file_prefetch(strList *paths,
+                                                bool has_rate, int64_t rate,
+                                                Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
+
+GuestFilePrefetchJob *qmp_guest_file_prefetch_status(int64_t id,
+                                                     Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
+
+void qmp_guest_file_prefetch_cancel(int64_t id, Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+}
+
+GuestFileOpResultList *qmp_guest_file_ops(GuestFileOpList *ops,
+                                          bool has_stop_on_error,
+                                          bool stop_on_error, Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
+
+GuestUserLoginList *qmp_guest_get_users(Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
+
+GuestSockets *qmp_guest_get_sockets(bool has_port, int64_t port,
+                                    bool has_owners, bool owners,
+                                    bool has_connections, bool connections,
+                                    Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
+
+GuestNetProbeResultList *qmp_guest_net_probe(GuestNetProbeTargetList *targets,
+                                             bool has_count, int64_t count,
+                                             bool has_timeout, int64_t timeout,
+                                             Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
+
+GuestServiceStatusList *qmp_guest_get_service_status(strList *units,
+                                                     Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
+
+GuestPackages *qmp_guest_get_packages(bool has_since, const char *since,
+                                      Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
+
+GuestCgroupStatsList *qmp_guest_get_cgroup_stats(bool has_depth,
+                                                 int64_t depth, bool has_top,
+                                                 int64_t top, Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
+
+GuestKernelLog *qmp_guest_get_kernel_log(bool has_cursor, int64_t cursor,
+                                         bool has_level,
+                                         GuestKernelLogLevel level,
+                                         bool has_facility, int64_t facility,
+                                         bool has_pattern, const char *pattern,
+                                         bool has_limit, int64_t limit,
+                                         Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
+
+void qmp_guest_set_kernel_log_events(bool enable, bool has_level,
+                                     GuestKernelLogLevel level,
+                                     bool has_pattern, const char *pattern,
+                                     Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+}
+
+GuestBlockQueueResultList *
+qmp_guest_set_block_queue_params(GuestBlockQueueDeviceList *devices,
+                                 GuestBlockQueueParams *params,
+                                 bool has_persist, bool persist,
+                                 Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
+
+GuestNetQueuesList *qmp_guest_set_net_queues(bool has_interfaces,
+                                             strList *interfaces,
+                                             bool has_combined,
+                                             int64_t combined,
+                                             bool has_irq_affinity,
+                                             bool irq_affinity, bool has_xps,
+                                             bool xps, bool has_rps, bool rps,
+                                             Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
+
+GuestMemoryReclaim *qmp_guest_reclaim_memory(bool has_cgroup,
+                                             const char *cgroup,
+                                             bool has_reclaim_bytes,
+                                             int64_t reclaim_bytes,
+                                             bool has_drop_caches,
+                                             int64_t drop_caches,
+                                             bool has_compact, bool compact,
+                                             bool has_thp_defrag,
+                                             const char *thp_defrag,
+                                             Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
+
+GuestProfile *qmp_guest_set_profile(const char *name,
+                                    GuestProfileSettingList *settings,
+                                    Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
+
+GuestProfile *qmp_guest_get_profile(Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
+
+void qmp_guest_reset_profile(Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+}
+
+GuestProvisionResult *qmp_guest_provision(bool has_id, const char *id,
+                                          bool has_hostname,
+                                          const char *hostname,
+                                          bool has_passwords,
+                                          GuestProvisionPasswordList *passwords,
+                                          bool has_files,
+                                          GuestProvisionFileList *files,
+                                          bool has_ssh_keys,
+                                          GuestProvisionSSHKeysList *ssh_keys,
+                                          bool has_sysctls,
+                                          GuestProfileSettingList *sysctls,
+                                          bool has_commands,
+                                          GuestProvisionCommandList *commands,
+                                          Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
+
+void qmp_guest_ssh_add_authorized_keys(const char *username, strList *keys,
+                                       Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+}
+
+void qmp_guest_ssh_remove_authorized_keys(const char *username,
+                                          strList *keys, Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+}
+
+void qmp_guest_ssh_set_authorized_keys(const char *username, strList *keys,
+                                       Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+}
+
+void qmp_guest_upgrade_agent(bool has_path, const char *path, Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+}
+
+GuestLatencyHistograms *qmp_guest_get_latency_histograms(Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
+
+GuestFileStream *qmp_guest_file_archive(strList *paths, bool has_exclude,
+                                        strList *exclude, bool has_max_size,
+                                        int64_t max_size, bool has_gzip,
+                                        bool gzip, bool has_chunk_size,
+                                        int64_t chunk_size, bool has_credits,
+                                        int64_t credits, Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
+
+GuestFileUpload *qmp_guest_file_upload_begin(const char *path,
+                                             bool has_restart, bool restart,
+                                             Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
+
+GuestFileUpload *qmp_guest_file_upload_write(const char *path, int64_t offset,
+                                             bool has_buf_b64,
+                                             const char *buf_b64,
+                                             bool has_count, int64_t count,
+                                             Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
+
+void qmp_guest_file_upload_commit(const char *path, bool has_size,
+                                  int64_t size, Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+}
+
+void qmp_guest_file_upload_abort(const char *path, Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+}
+
 /* add unsupported commands to the blacklist */
 GList *ga_command_blacklist_init(GList *blacklist)
 {
     const char *list_unsupported[] = {
-        "guest-suspend-hybrid",
-        "guest-get-vcpus", "guest-set-vcpus",
+        "guest-suspend-hybrid", "guest-sync-time",
+        "guest-get-vcpus", "guest-set-vcpus", "guest-set-vcpus-batch",
         "guest-get-memory-blocks", "guest-set-memory-blocks",
-        "guest-get-memory-block-size",
-        "guest-fsfreeze-freeze-list",
-        "guest-fstrim", NULL};
+        "guest-set-memory-blocks-start", "guest-set-memory-blocks-status",
+        "guest-set-memory-blocks-cancel", "guest-get-memory-block-size",
+        "guest-get-numa-info",
+        "guest-fsfreeze-freeze-list", "guest-fsfreeze-prepare",
+        "guest-fsfreeze-commit",
+        "guest-fstrim", "guest-fstrim-start", "guest-fstrim-status",
+        "guest-fstrim-cancel", "guest-get-metrics-history",
+        "guest-get-metrics-rollup", "guest-get-cpu-stats",
+        "guest-get-disk-io-stats", "guest-get-network-stats",
+        "guest-set-alert-rules", "guest-get-alert-rules",
+        "guest-get-memory-pressure", "guest-get-processes",
+        "guest-get-top-processes", "guest-get-process-memory",
+        "guest-get-process-changes",
+        "guest-file-list", "guest-file-archive", "guest-file-upload-begin",
+        "guest-file-upload-write", "guest-file-upload-commit",
+        "guest-file-upload-abort", "guest-file-read-many",
+        "guest-file-watch", "guest-file-unwatch", "guest-file-watch-read",
+        "guest-file-copy-start", "guest-file-copy-status",
+        "guest-file-copy-cancel",
+        "guest-file-residency", "guest-file-prefetch",
+        "guest-file-prefetch-status", "guest-file-prefetch-cancel",
+        "guest-file-ops", "guest-get-users",
+        "guest-get-sockets", "guest-get-service-status",
+        "guest-get-packages", "guest-get-cgroup-stats",
+        "guest-get-kernel-log", "guest-set-kernel-log-events",
+        "guest-set-block-queue-params", "guest-set-net-queues",
+        "guest-reclaim-memory", "guest-set-profile", "guest-get-profile",
+        "guest-reset-profile", "guest-upgrade-agent",
+        "guest-get-latency-histograms", "guest-net-probe",
+        "guest-set-health-checks", "guest-get-health", "guest-log-follow",
+        "guest-log-unfollow", "guest-log-ack", "guest-log-resume",
+        "guest-provision", "guest-ssh-add-authorized-keys",
+        "guest-ssh-remove-authorized-keys", "guest-ssh-set-authorized-keys",
+        NULL};
     char **p = (char **)list_unsupported;
 
     while (*p) {
@@ -1310,7 +2632,8 @@ GList *ga_command_blacklist_init(GList *blacklist)
         g_debug("vss_init failed, vss commands are going to be disabled");
         const char *list[] = {
             "guest-get-fsinfo", "guest-fsfreeze-status",
-            "guest-fsfreeze-freeze", "guest-fsfreeze-thaw", NULL};
+            "guest-fsfreeze-freeze", "guest-fsfreeze-thaw",
+            "guest-fsfreeze-get-timings", NULL};
         p = (char **)list;
 
         while (*p) {
@@ -1324,6 +2647,8 @@ GList *ga_command_blacklist_init(GList *blacklist)
 /* register init/cleanup routines for stateful command groups */
 void ga_command_state_init(GAState *s, GACommandState *cs)
 {
+    ga_command_state_add(cs, guest_file_init, guest_file_cleanup);
+    ga_add_session_close_notifier(s, &guest_file_state.session_close);
     if (!vss_initialized()) {
         ga_command_state_add(cs, NULL, guest_fsfreeze_cleanup);
     }
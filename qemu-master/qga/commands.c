@@ -11,14 +11,57 @@
  */
 
 #include <glib.h>
+#include <zlib.h>
+#ifndef _WIN32
+#include <sys/resource.h>
+#include <dirent.h>
+#include <spawn.h>
+#else
+#include <io.h>
+#endif
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#ifdef CONFIG_MALLINFO
+#include <malloc.h>
+#endif
 #include "qga/guest-agent-core.h"
 #include "qga-qmp-commands.h"
+#include "qga-qmp-introspect.h"
 #include "qapi/qmp/qerror.h"
+#include "qapi/qmp/qstring.h"
+#include "qapi/qmp/qjson.h"
+#include "qapi/qmp/dispatch.h"
+#include "qemu/base64.h"
+#include "qemu/buffer-pool.h"
+#include "qemu/crc32c.h"
+#include "qapi/json-output-visitor.h"
+#include "qga-qapi-visit.h"
+#include "qga-qapi-event.h"
+#include "trace.h"
 
 /* Maximum captured guest-exec out_data/err_data - 16MB */
 #define GUEST_EXEC_MAX_OUTPUT (16*1024*1024)
-/* Allocation and I/O buffer for reading guest-exec out_data/err_data - 4KB */
+/* Smallest guest-exec output ring - 4KB */
 #define GUEST_EXEC_IO_SIZE (4*1024)
+/* Largest single read of guest-exec output, and the first allocation for
+ * captured out_data/err_data, which then doubles as needed - 64KB */
+#define GUEST_EXEC_READ_SIZE (64*1024)
+/* Stdin written with guest-exec-write that the process may leave unread
+ * before further writes have to wait - 1MB */
+#define GUEST_EXEC_WRITE_BUFFER (1024*1024)
+
+#if !defined(_WIN32) && !defined(CONFIG_HAS_ENVIRON)
+#ifdef __APPLE__
+#include <crt_externs.h>
+#define environ (*_NSGetEnviron())
+#else
+extern char **environ;
+#endif
+#endif
+
+/* bulk data smaller than this goes out uncompressed */
+#define GA_COMPRESS_MIN (4*1024)
 
 /* Note: in some situations, like with the fsfreeze, logging may be
  * temporarilly disabled. if it is necessary that a command be able
@@ -34,14 +77,65 @@ void slog(const gchar *fmt, ...)
     va_end(ap);
 }
 
-int64_t qmp_guest_sync_delimited(int64_t id, Error **errp)
+/*
+ * Deflate @data for the current client if it asked for compression and
+ * @data is big enough for it to pay off.  Returns NULL, and leaves it to
+ * the caller to send @data as is, when it does not.
+ */
+guchar *ga_compress(GAState *s, const guchar *data, size_t len,
+                    size_t *out_len)
+{
+    uLongf zlen;
+    guchar *buf;
+
+    if (!ga_is_compressing(s) || len < GA_COMPRESS_MIN) {
+        return NULL;
+    }
+
+    zlen = compressBound(len);
+    buf = g_malloc(zlen);
+    if (compress2(buf, &zlen, data, len, Z_BEST_SPEED) != Z_OK ||
+        zlen >= len) {
+        g_free(buf);
+        return NULL;
+    }
+    *out_len = zlen;
+    return buf;
+}
+
+int64_t qmp_guest_sync_delimited(int64_t id, bool has_framing,
+                                 GuestFraming framing, bool has_compression,
+                                 GuestCompression compression,
+                                 bool has_serial_speed, int64_t serial_speed,
+                                 bool has_serial_flow_control,
+                                 bool serial_flow_control, Error **errp)
 {
+    if (has_serial_speed &&
+        !ga_set_serial_speed(ga_state, serial_speed,
+                             has_serial_flow_control && serial_flow_control,
+                             errp)) {
+        return 0;
+    }
     ga_set_response_delimited(ga_state);
+    if (has_framing) {
+        ga_set_framing(ga_state, framing == GUEST_FRAMING_LENGTH_PREFIXED);
+    }
+    if (has_compression) {
+        ga_set_compression(ga_state, compression == GUEST_COMPRESSION_ZLIB);
+    }
     return id;
 }
 
-int64_t qmp_guest_sync(int64_t id, Error **errp)
+int64_t qmp_guest_sync(int64_t id, bool has_serial_speed,
+                       int64_t serial_speed, bool has_serial_flow_control,
+                       bool serial_flow_control, Error **errp)
 {
+    if (has_serial_speed &&
+        !ga_set_serial_speed(ga_state, serial_speed,
+                             has_serial_flow_control && serial_flow_control,
+                             errp)) {
+        return 0;
+    }
     return id;
 }
 
@@ -50,6 +144,18 @@ void qmp_guest_ping(Error **errp)
     slog("guest-ping called");
 }
 
+void qmp_guest_notify_resume(Error **errp)
+{
+    ga_notify_resume(ga_state);
+}
+
+void qmp_guest_cancel(QObject *id, Error **errp)
+{
+    if (!ga_cancel_request(ga_state, id)) {
+        error_setg(errp, "no running request with this id");
+    }
+}
+
 static void qmp_command_info(QmpCommand *cmd, void *opaque)
 {
     GuestAgentInfo *info = opaque;
@@ -73,16 +179,309 @@ struct GuestAgentInfo *qmp_guest_info(Error **errp)
 
     info->version = g_strdup(QEMU_VERSION);
     qmp_for_each_command(qmp_command_info, info);
+    info->compression = g_new0(GuestCompressionList, 1);
+    info->compression->value = GUEST_COMPRESSION_ZLIB;
+    info->schema_hash = g_strdup(qga_qmp_schema_hash);
     return info;
 }
 
+/* cacheable, so the blob is only parsed on the first call */
+GuestSchema *qmp_guest_query_schema(Error **errp)
+{
+    GuestSchema *schema = g_new0(GuestSchema, 1);
+
+    schema->hash = g_strdup(qga_qmp_schema_hash);
+    schema->schema = qobject_from_json(qga_qmp_schema_json);
+    return schema;
+}
+
+static GuestAgentLogLevel guest_agent_log_level(GLogLevelFlags level)
+{
+    switch (level & G_LOG_LEVEL_MASK) {
+    case G_LOG_LEVEL_ERROR:
+        return GUEST_AGENT_LOG_LEVEL_ERROR;
+    case G_LOG_LEVEL_CRITICAL:
+        return GUEST_AGENT_LOG_LEVEL_CRITICAL;
+    case G_LOG_LEVEL_WARNING:
+        return GUEST_AGENT_LOG_LEVEL_WARNING;
+    case G_LOG_LEVEL_MESSAGE:
+        return GUEST_AGENT_LOG_LEVEL_MESSAGE;
+    case G_LOG_LEVEL_INFO:
+        return GUEST_AGENT_LOG_LEVEL_INFO;
+    default:
+        return GUEST_AGENT_LOG_LEVEL_DEBUG;
+    }
+}
+
+static void guest_agent_log_add(const GALogRecordInfo *info, void *opaque)
+{
+    GuestAgentLogRecordList ***tail = opaque;
+    GuestAgentLogRecordList *entry = g_new0(GuestAgentLogRecordList, 1);
+    GuestAgentLogRecord *r = g_new0(GuestAgentLogRecord, 1);
+
+    r->seq = info->seq;
+    r->time = info->time;
+    r->level = guest_agent_log_level(info->level);
+    r->syslog = info->is_syslog;
+    r->message = g_strdup(info->message);
+
+    entry->value = r;
+    **tail = entry;
+    *tail = &entry->next;
+}
+
+GuestAgentLog *qmp_guest_get_agent_log(bool has_cursor, int64_t cursor,
+                                       Error **errp)
+{
+    GALog *l = ga_get_log(ga_state);
+    GuestAgentLogRecordList **tail;
+    GuestAgentLog *log;
+    uint64_t lost;
+
+    if (!l) {
+        error_setg(errp, "the agent log is not available yet");
+        return NULL;
+    }
+    if (!has_cursor || cursor < 0) {
+        cursor = 0;
+    }
+
+    log = g_new0(GuestAgentLog, 1);
+    tail = &log->records;
+    log->cursor = ga_log_foreach(l, cursor, &lost, guest_agent_log_add,
+                                 &tail);
+    log->lost = lost;
+    return log;
+}
+
+static GuestAgentLatency *guest_agent_latency(const GAHistogram *h,
+                                              bool histograms)
+{
+    GuestAgentLatency *lat = g_new0(GuestAgentLatency, 1);
+    GuestAgentLatencyBucketList **tail = &lat->buckets;
+    GuestAgentLatencyBucketList *entry;
+    GuestAgentLatencyBucket *b;
+    int i;
+
+    lat->count = h->count;
+    lat->total = h->total;
+    lat->min = h->min;
+    lat->max = h->max;
+    lat->p50 = ga_histogram_quantile(h, 500);
+    lat->p90 = ga_histogram_quantile(h, 900);
+    lat->p99 = ga_histogram_quantile(h, 990);
+    if (!histograms) {
+        return lat;
+    }
+
+    lat->has_buckets = true;
+    for (i = 0; i < GA_HISTOGRAM_BUCKETS; i++) {
+        if (!h->buckets[i]) {
+            continue;
+        }
+        b = g_new0(GuestAgentLatencyBucket, 1);
+        b->has_limit = i < GA_HISTOGRAM_BUCKETS - 1;
+        b->limit = b->has_limit ? ga_histogram_bucket_limit(i) : 0;
+        b->count = h->buckets[i];
+        entry = g_new0(GuestAgentLatencyBucketList, 1);
+        entry->value = b;
+        *tail = entry;
+        tail = &entry->next;
+    }
+    return lat;
+}
+
+typedef struct GuestAgentStatsBuild {
+    GuestAgentCommandStatsList **tail;
+    bool histograms;
+} GuestAgentStatsBuild;
+
+static void guest_agent_stats_add(const GACommandStats *cs, void *opaque)
+{
+    GuestAgentStatsBuild *b = opaque;
+    GuestAgentCommandStatsList *entry;
+    GuestAgentCommandStats *c = g_new0(GuestAgentCommandStats, 1);
+
+    c->name = g_strdup(cs->name);
+    c->requests = cs->requests;
+    c->errors = cs->errors;
+    c->parse = guest_agent_latency(&cs->phases[GA_STATS_PARSE],
+                                   b->histograms);
+    c->dispatch = guest_agent_latency(&cs->phases[GA_STATS_DISPATCH],
+                                      b->histograms);
+    c->serialize = guest_agent_latency(&cs->phases[GA_STATS_SERIALIZE],
+                                       b->histograms);
+    c->write = guest_agent_latency(&cs->phases[GA_STATS_WRITE],
+                                   b->histograms);
+    if (ga_alloc_stats_enabled()) {
+        c->has_allocs = c->has_alloc_bytes = c->has_alloc_peak = true;
+        c->allocs = cs->allocs;
+        c->alloc_bytes = cs->alloc_bytes;
+        c->alloc_peak = cs->alloc_peak;
+    }
+
+    entry = g_new0(GuestAgentCommandStatsList, 1);
+    entry->value = c;
+    *b->tail = entry;
+    b->tail = &entry->next;
+}
+
+/* VmRSS and VmHWM of the agent, if /proc tells */
+static void guest_agent_stats_rss(GuestAgentStats *stats)
+{
+#ifdef __linux__
+    gchar *status, **lines, **line;
+    unsigned long kb;
+
+    if (!g_file_get_contents("/proc/self/status", &status, NULL, NULL)) {
+        return;
+    }
+    lines = g_strsplit(status, "\n", -1);
+    for (line = lines; *line; line++) {
+        if (sscanf(*line, "VmRSS: %lu kB", &kb) == 1) {
+            stats->has_rss = true;
+            stats->rss = (int64_t)kb * 1024;
+        } else if (sscanf(*line, "VmHWM: %lu kB", &kb) == 1) {
+            stats->has_peak_rss = true;
+            stats->peak_rss = (int64_t)kb * 1024;
+        }
+    }
+    g_strfreev(lines);
+    g_free(status);
+#endif
+}
+
+/* what the agent holds that a leak would make grow */
+static void guest_agent_stats_usage(GuestAgentStats *stats)
+{
+#ifdef CONFIG_MALLINFO
+    struct mallinfo mi = mallinfo();
+#endif
+#ifdef __linux__
+    GDir *dir = g_dir_open("/proc/self/fd", 0, NULL);
+#endif
+
+#ifdef CONFIG_MALLINFO
+    /* in use from the arenas plus the chunks that were mmap()ed */
+    stats->has_heap = true;
+    stats->heap = (int64_t)(unsigned int)mi.uordblks +
+                  (unsigned int)mi.hblkhd;
+#endif
+#ifdef __linux__
+    if (dir) {
+        stats->has_open_fds = true;
+        /* less the one of @dir itself */
+        stats->open_fds = -1;
+        while (g_dir_read_name(dir)) {
+            stats->open_fds++;
+        }
+        g_dir_close(dir);
+    }
+#endif
+}
+
+static GuestAgentStall *guest_agent_stall(const GAStallInfo *info)
+{
+    GuestAgentStall *stall = g_new0(GuestAgentStall, 1);
+    strList **tail = &stall->stack;
+    strList *entry;
+    const char * const *frame;
+
+    stall->time = info->time;
+    stall->lag = info->lag_us;
+    stall->has_command = info->culprit != NULL;
+    stall->command = g_strdup(info->culprit);
+    stall->has_stack = info->stack != NULL;
+    for (frame = info->stack; frame && *frame; frame++) {
+        entry = g_new0(strList, 1);
+        entry->value = g_strdup(*frame);
+        *tail = entry;
+        tail = &entry->next;
+    }
+    return stall;
+}
+
+static void guest_agent_stats_stall(const GAStallInfo *info, void *opaque)
+{
+    GuestAgentStallList ***tail = opaque;
+    GuestAgentStallList *entry = g_new0(GuestAgentStallList, 1);
+
+    entry->value = guest_agent_stall(info);
+    **tail = entry;
+    *tail = &entry->next;
+}
+
+void ga_stall_event(const GAStallInfo *info, void *opaque)
+{
+    GuestAgentStall *stall = guest_agent_stall(info);
+
+    qapi_event_send_guest_agent_stall(stall, &error_abort);
+    qapi_free_GuestAgentStall(stall);
+}
+
+GuestAgentStats *qmp_guest_get_agent_stats(bool has_histograms,
+                                           bool histograms,
+                                           bool has_reset, bool reset,
+                                           Error **errp)
+{
+    GAStats *st = ga_get_stats(ga_state);
+    GuestAgentStats *stats = g_new0(GuestAgentStats, 1);
+    GuestAgentStatsBuild b = {
+        .tail = &stats->commands,
+        .histograms = has_histograms && histograms,
+    };
+    GAWatchdog *w = ga_get_watchdog(ga_state);
+    GuestAgentStallList **stalls = &stats->stalls;
+    GAStatsTotals totals;
+    int64_t ready_us;
+
+    ga_get_startup_times(ga_state, &stats->startup_us, &ready_us);
+    stats->has_ready_us = ready_us >= 0;
+    stats->ready_us = ready_us;
+    guest_agent_stats_rss(stats);
+    guest_agent_stats_usage(stats);
+    ga_stats_get_totals(st, &totals);
+    stats->bytes_in = totals.bytes_in;
+    stats->bytes_out = totals.bytes_out;
+    stats->requests = totals.requests;
+    stats->errors = totals.errors;
+    stats->parse_errors = totals.parse_errors;
+    ga_stats_foreach(st, guest_agent_stats_add, &b);
+    if (w) {
+        stats->has_main_loop_lag = true;
+        stats->main_loop_lag = guest_agent_latency(ga_watchdog_get_lag(w),
+                                                   b.histograms);
+        stats->has_stalls = true;
+        ga_watchdog_foreach_stall(w, guest_agent_stats_stall, &stalls);
+    }
+    if (has_reset && reset) {
+        ga_stats_reset(st);
+        if (w) {
+            ga_watchdog_reset(w);
+        }
+    }
+    return stats;
+}
+
 struct GuestExecIOData {
     guchar *data;
-    gsize size;
+    size_t size;
     gsize length;
+    gsize limit;
     gint closed;
     bool truncated;
     const char *name;
+    bool ring;                  /* data is a ring of limit bytes */
+    gsize head;                 /* ring: where the oldest byte is */
+    uint64_t offset;            /* ring: stream position of the oldest byte */
+    uint64_t dropped;           /* ring: bytes overwritten before a read */
+    GIOChannel *ch;             /* the pipe, until it is closed */
+    GMainContext *ctx;          /* stdin: where its watch goes */
+    bool watched;               /* stdin: the watch is attached */
+    bool stream;                /* stdin: kept open for guest-exec-write */
+    bool eof;                   /* stdin: close it once it is written */
+    GAPendingResponse *writer;  /* guest-exec-write waiting for room */
+    struct GuestExecInfo *gei;
 };
 typedef struct GuestExecIOData GuestExecIOData;
 
@@ -90,17 +489,60 @@ struct GuestExecInfo {
     GPid pid;
     int64_t pid_numeric;
     gint status;
+    bool has_input;
     bool has_output;
     gint finished;
+    GSource *timeout;
+    int64_t deadline;           /* of @timeout, in monotonic time */
+    bool timed_out;
     GuestExecIOData in;
     GuestExecIOData out;
     GuestExecIOData err;
+    GAPendingResponse *waiter;  /* guest-exec-wait */
+    guint wait_timer;
+    guint reap_timer;           /* forgets it once it exited */
+    /* for guest-exec-batch: called once it exited, takes it over */
+    void (*done)(struct GuestExecInfo *gei, void *opaque);
+    void *done_opaque;
+#ifdef G_OS_WIN32
+    struct GuestExecJob *job;   /* NULL if glib started it */
+#endif
     QTAILQ_ENTRY(GuestExecInfo) next;
 };
 typedef struct GuestExecInfo GuestExecInfo;
 
+#ifdef G_OS_WIN32
+/*
+ * A child started by guest_exec_win32_spawn() and everything it starts in
+ * turn are in a job object of their own, associated with a completion
+ * port that guest_exec_port_thread() waits on.  The port thread holds a
+ * reference until the job is empty, since messages can come in until
+ * then.
+ */
+typedef struct GuestExecJob {
+    HANDLE job;
+    DWORD pid;                  /* of the child itself */
+    GMainContext *ctx;          /* where its GuestExecInfo lives */
+    gint refcount;
+} GuestExecJob;
+
+static void guest_exec_job_unref(GuestExecJob *job)
+{
+    if (!g_atomic_int_dec_and_test(&job->refcount)) {
+        return;
+    }
+    CloseHandle(job->job);
+    if (job->ctx) {
+        g_main_context_unref(job->ctx);
+    }
+    g_free(job);
+}
+#endif
+
 static struct {
-    QTAILQ_HEAD(, GuestExecInfo) processes;
+    QTAILQ_HEAD(, GuestExecInfo) processes;     /* oldest first */
+    GHashTable *pids;           /* the same, by pid_numeric */
+    unsigned int count;
 } guest_exec_state = {
     .processes = QTAILQ_HEAD_INITIALIZER(guest_exec_state.processes),
 };
@@ -118,44 +560,66 @@ static GuestExecInfo *guest_exec_info_add(GPid pid)
 {
     GuestExecInfo *gei;
 
+    if (!guest_exec_state.pids) {
+        guest_exec_state.pids = g_hash_table_new(g_int64_hash,
+                                                 g_int64_equal);
+    }
     gei = g_new0(GuestExecInfo, 1);
     gei->pid = pid;
     gei->pid_numeric = gpid_to_int64(pid);
+    gei->in.gei = gei->out.gei = gei->err.gei = gei;
     QTAILQ_INSERT_TAIL(&guest_exec_state.processes, gei, next);
+    ga_busy_ref(ga_state);
+    g_hash_table_insert(guest_exec_state.pids, &gei->pid_numeric, gei);
+    guest_exec_state.count++;
 
     return gei;
 }
 
 static GuestExecInfo *guest_exec_info_find(int64_t pid_numeric)
 {
-    GuestExecInfo *gei;
-
-    QTAILQ_FOREACH(gei, &guest_exec_state.processes, next) {
-        if (gei->pid_numeric == pid_numeric) {
-            return gei;
-        }
+    if (!guest_exec_state.pids) {
+        return NULL;
     }
-
-    return NULL;
+    return g_hash_table_lookup(guest_exec_state.pids, &pid_numeric);
 }
 
-GuestExecStatus *qmp_guest_exec_status(int64_t pid, Error **err)
+static void guest_exec_decode_status(gint status,
+                                     bool *has_exitcode, int64_t *exitcode,
+                                     bool *has_signal, int64_t *signo)
 {
-    GuestExecInfo *gei;
-    GuestExecStatus *ges;
-
-    slog("guest-exec-status called, pid: %u", (uint32_t)pid);
-
-    gei = guest_exec_info_find(pid);
-    if (gei == NULL) {
-        error_setg(err, QERR_INVALID_PARAMETER, "pid");
-        return NULL;
+#ifdef G_OS_WIN32
+    /* Additionally WIN32 does not provide any additional information
+     * on whetherthe child exited or terminated via signal.
+     * We use this simple range check to distingish application exit code
+     * (usually value less then 256) and unhandled exception code with
+     * ntstatus (always value greater then 0xC0000005). */
+    if ((uint32_t)status < 0xC0000000U) {
+        *has_exitcode = true;
+        *exitcode = status;
+    } else {
+        *has_signal = true;
+        *signo = status;
     }
+#else
+    if (WIFEXITED(status)) {
+        *has_exitcode = true;
+        *exitcode = WEXITSTATUS(status);
+    } else if (WIFSIGNALED(status)) {
+        *has_signal = true;
+        *signo = WTERMSIG(status);
+    }
+#endif
+}
 
-    ges = g_new0(GuestExecStatus, 1);
-
+static bool guest_exec_info_finished(GuestExecInfo *gei)
+{
     bool finished = g_atomic_int_get(&gei->finished);
 
+    /* the input watch refers to gei as well */
+    if (gei->has_input) {
+        finished = finished && g_atomic_int_get(&gei->in.closed);
+    }
     /* need to wait till output channels are closed
      * to be sure we captured all output at this point */
     if (gei->has_output) {
@@ -163,6 +627,137 @@ GuestExecStatus *qmp_guest_exec_status(int64_t pid, Error **err)
         finished = finished && g_atomic_int_get(&gei->err.closed);
     }
 
+    return finished;
+}
+
+/* up to @len buffered bytes of @p, oldest first, out of its ring */
+static guchar *guest_exec_ring_take(GuestExecIOData *p, gsize len)
+{
+    guchar *buf = g_malloc(MAX(len, 1));
+    gsize first = MIN(len, p->size - p->head);
+
+    if (len) {
+        memcpy(buf, p->data + p->head, first);
+        memcpy(buf + first, p->data, len - first);
+        p->head = (p->head + len) % p->size;
+    }
+    p->length -= len;
+    p->offset += len;
+    return buf;
+}
+
+/* add output to the ring of @p, overwriting the oldest if it is full */
+static void guest_exec_ring_put(GuestExecIOData *p, const guchar *buf,
+                                gsize len)
+{
+    gsize over, pos, first;
+
+    if (!p->data) {
+        p->data = g_malloc(p->limit);
+        p->size = p->limit;
+    }
+    if (len > p->size) {
+        p->dropped += len - p->size;
+        p->offset += len - p->size;
+        p->truncated = true;
+        buf += len - p->size;
+        len = p->size;
+    }
+    if (p->length + len > p->size) {
+        over = p->length + len - p->size;
+        p->head = (p->head + over) % p->size;
+        p->length -= over;
+        p->dropped += over;
+        p->offset += over;
+        p->truncated = true;
+    }
+
+    pos = (p->head + p->length) % p->size;
+    first = MIN(len, p->size - pos);
+    memcpy(p->data + pos, buf, first);
+    memcpy(p->data, buf + first, len - first);
+    p->length += len;
+}
+
+/* turn what guest-exec-read did not take into a plain buffer */
+static void guest_exec_ring_flatten(GuestExecIOData *p)
+{
+    gsize len = p->length;
+    guchar *buf;
+
+    if (!p->ring || !p->data) {
+        return;
+    }
+    buf = guest_exec_ring_take(p, len);
+    g_free(p->data);
+    p->data = buf;
+    p->size = p->length = len;
+    p->ring = false;
+}
+
+static void guest_exec_info_remove(GuestExecInfo *gei)
+{
+    if (gei->reap_timer) {
+        g_source_remove(gei->reap_timer);
+    }
+    QTAILQ_REMOVE(&guest_exec_state.processes, gei, next);
+    ga_busy_unref(ga_state);
+    g_hash_table_remove(guest_exec_state.pids, &gei->pid_numeric);
+    guest_exec_state.count--;
+#ifdef G_OS_WIN32
+    if (gei->job) {
+        guest_exec_job_unref(gei->job);
+    }
+#endif
+    g_free(gei->out.data);
+    g_free(gei->err.data);
+    g_free(gei);
+}
+
+static gboolean guest_exec_reap(gpointer data)
+{
+    GuestExecInfo *gei = data;
+
+    slog("guest-exec: forgetting pid %" PRId64 ", which nobody asked about "
+         "after it exited", gei->pid_numeric);
+    gei->reap_timer = 0;
+    guest_exec_info_remove(gei);
+    return false;
+}
+
+/* make room for one more process in a full table by forgetting the
+ * oldest one that exited */
+static bool guest_exec_make_room(void)
+{
+    int max = ga_get_max_exec_processes(ga_state);
+    GuestExecInfo *gei;
+
+    if (!max || guest_exec_state.count < max) {
+        return true;
+    }
+    QTAILQ_FOREACH(gei, &guest_exec_state.processes, next) {
+        if (guest_exec_info_finished(gei)) {
+            slog("guest-exec: forgetting pid %" PRId64 " to make room",
+                 gei->pid_numeric);
+            guest_exec_info_remove(gei);
+            return true;
+        }
+    }
+    return false;
+}
+
+/* the status of @gei, which is freed if it finished */
+static GuestExecStatus *guest_exec_get_status(GuestExecInfo *gei)
+{
+    GuestExecStatus *ges;
+    const guchar *out_buf, *err_buf;
+    guchar *zout, *zerr;
+    size_t out_len, err_len;
+
+    ges = g_new0(GuestExecStatus, 1);
+
+    bool finished = guest_exec_info_finished(gei);
+
     ges->exited = finished;
     if (finished) {
         /* Glib has no portable way to parse exit status.
@@ -177,113 +772,461 @@ GuestExecStatus *qmp_guest_exec_status(int64_t pid, Error **err)
          *   https://msdn.microsoft.com/en-us/library/windows/desktop/ms683189(v=vs.85).aspx
          *   https://msdn.microsoft.com/en-us/library/aa260331(v=vs.60).aspx
          */
-#ifdef G_OS_WIN32
-        /* Additionally WIN32 does not provide any additional information
-         * on whetherthe child exited or terminated via signal.
-         * We use this simple range check to distingish application exit code
-         * (usually value less then 256) and unhandled exception code with
-         * ntstatus (always value greater then 0xC0000005). */
-        if ((uint32_t)gei->status < 0xC0000000U) {
-            ges->has_exitcode = true;
-            ges->exitcode = gei->status;
+        guest_exec_decode_status(gei->status,
+                                 &ges->has_exitcode, &ges->exitcode,
+                                 &ges->has_signal, &ges->signal);
+        guest_exec_ring_flatten(&gei->out);
+        guest_exec_ring_flatten(&gei->err);
+        zout = ga_compress(ga_state, gei->out.data, gei->out.length, &out_len);
+        if (zout) {
+            ges->has_out_compressed = ges->out_compressed = true;
+            out_buf = zout;
         } else {
-            ges->has_signal = true;
-            ges->signal = gei->status;
+            out_buf = gei->out.data;
+            out_len = gei->out.length;
         }
-#else
-        if (WIFEXITED(gei->status)) {
-            ges->has_exitcode = true;
-            ges->exitcode = WEXITSTATUS(gei->status);
-        } else if (WIFSIGNALED(gei->status)) {
-            ges->has_signal = true;
-            ges->signal = WTERMSIG(gei->status);
-        }
-#endif
-        if (gei->out.length > 0) {
-            ges->has_out_data = true;
-            ges->out_data = g_base64_encode(gei->out.data, gei->out.length);
-            g_free(gei->out.data);
-            ges->has_out_truncated = gei->out.truncated;
+        zerr = ga_compress(ga_state, gei->err.data, gei->err.length, &err_len);
+        if (zerr) {
+            ges->has_err_compressed = ges->err_compressed = true;
+            err_buf = zerr;
+        } else {
+            err_buf = gei->err.data;
+            err_len = gei->err.length;
         }
 
-        if (gei->err.length > 0) {
-            ges->has_err_data = true;
-            ges->err_data = g_base64_encode(gei->err.data, gei->err.length);
-            g_free(gei->err.data);
-            ges->has_err_truncated = gei->err.truncated;
+        if (ga_is_framed(ga_state) && (out_len > 0 || err_len > 0)) {
+            guchar *buf = qemu_buffer_pool_alloc(out_len + err_len);
+
+            memcpy(buf, out_buf, out_len);
+            memcpy(buf + out_len, err_buf, err_len);
+            ga_set_response_buffer(ga_state, buf, out_len + err_len);
+            ges->has_out_attached = ges->has_err_attached = true;
+            ges->out_attached = out_len;
+            ges->err_attached = err_len;
+        } else {
+            if (out_len > 0) {
+                ges->has_out_data = true;
+                ges->out_data = qemu_base64_encode(out_buf, out_len);
+            }
+
+            if (err_len > 0) {
+                ges->has_err_data = true;
+                ges->err_data = qemu_base64_encode(err_buf, err_len);
+            }
         }
+        /* output dropped from a ring may all have been read already */
+        ges->has_out_truncated = ges->out_truncated = gei->out.truncated;
+        ges->has_err_truncated = ges->err_truncated = gei->err.truncated;
+        g_free(zout);
+        g_free(zerr);
+
+        ges->has_timed_out = gei->timed_out;
+        ges->timed_out = gei->timed_out;
 
-        QTAILQ_REMOVE(&guest_exec_state.processes, gei, next);
-        g_free(gei);
+        guest_exec_info_remove(gei);
     }
 
     return ges;
 }
 
-/* Get environment variables or arguments array for execve(). */
-static char **guest_exec_get_args(const strList *entry, bool log)
+GuestExecStatus *qmp_guest_exec_status(int64_t pid, Error **err)
 {
-    const strList *it;
-    int count = 1, i = 0;  /* reserve for NULL terminator */
-    char **args;
-    char *str; /* for logging array of arguments */
-    size_t str_size = 1;
-
-    for (it = entry; it != NULL; it = it->next) {
-        count++;
-        str_size += 1 + strlen(it->value);
-    }
+    GuestExecInfo *gei;
 
-    str = g_malloc(str_size);
-    *str = 0;
-    args = g_malloc(count * sizeof(char *));
-    for (it = entry; it != NULL; it = it->next) {
-        args[i++] = it->value;
-        pstrcat(str, str_size, it->value);
-        if (it->next) {
-            pstrcat(str, str_size, " ");
-        }
-    }
-    args[i] = NULL;
+    slog("guest-exec-status called, pid: %u", (uint32_t)pid);
 
-    if (log) {
-        slog("guest-exec called: \"%s\"", str);
+    gei = guest_exec_info_find(pid);
+    if (gei == NULL) {
+        error_setg(err, QERR_INVALID_PARAMETER, "pid");
+        return NULL;
     }
-    g_free(str);
 
-    return args;
+    return guest_exec_get_status(gei);
 }
 
-static void guest_exec_child_watch(GPid pid, gint status, gpointer data)
+GuestExecProcessList *qmp_guest_exec_list(Error **err)
 {
-    GuestExecInfo *gei = (GuestExecInfo *)data;
+    GuestExecProcessList *head = NULL, **tail = &head;
+    GuestExecProcess *proc;
+    GuestExecInfo *gei;
 
-    g_debug("guest_exec_child_watch called, pid: %d, status: %u",
-            (int32_t)gpid_to_int64(pid), (uint32_t)status);
+    QTAILQ_FOREACH(gei, &guest_exec_state.processes, next) {
+        proc = g_new0(GuestExecProcess, 1);
+        proc->pid = gei->pid_numeric;
+        proc->exited = guest_exec_info_finished(gei);
+        if (proc->exited) {
+            guest_exec_decode_status(gei->status,
+                                     &proc->has_exitcode, &proc->exitcode,
+                                     &proc->has_signal, &proc->signal);
+        }
+        proc->out_length = gei->out.length;
+        proc->err_length = gei->err.length;
+        proc->waited_for = gei->waiter != NULL;
 
-    gei->status = status;
-    gei->finished = true;
+        *tail = g_new0(GuestExecProcessList, 1);
+        (*tail)->value = proc;
+        tail = &(*tail)->next;
+    }
 
-    g_spawn_close_pid(pid);
+    return head;
 }
 
-/** Reset ignored signals back to default. */
-static void guest_exec_task_setup(gpointer data)
+/* the answer to guest-exec-wait, for ga_complete_response() */
+static QObject *guest_exec_wait_result(void *opaque, Error **errp)
 {
-#if !defined(G_OS_WIN32)
-    struct sigaction sigact;
+    GuestExecStatus *ges;
+    JsonOutputVisitor *jov;
+    QObject *ret = NULL;
+    Error *err = NULL;
 
-    memset(&sigact, 0, sizeof(struct sigaction));
-    sigact.sa_handler = SIG_DFL;
+    /* leave the output for guest-exec-status if the client went away */
+    if (!ga_get_session(ga_state)) {
+        return NULL;
+    }
 
-    if (sigaction(SIGPIPE, &sigact, NULL) != 0) {
-        slog("sigaction() failed to reset child process's SIGPIPE: %s",
-             strerror(errno));
+    ges = guest_exec_get_status(opaque);
+    jov = json_output_visitor_new();
+    visit_type_GuestExecStatus(json_output_get_visitor(jov), &ges, "unused",
+                               &err);
+    if (!err) {
+        ret = json_output_get_qobject(jov);
     }
-#endif
+    error_propagate(errp, err);
+    json_output_visitor_cleanup(jov);
+    qapi_free_GuestExecStatus(ges);
+    return ret;
 }
 
-static gboolean guest_exec_input_watch(GIOChannel *ch,
+/* answer the guest-exec-wait for @gei, which may free it */
+static void guest_exec_wait_done(GuestExecInfo *gei)
+{
+    GAPendingResponse *waiter = gei->waiter;
+
+    if (!waiter) {
+        return;
+    }
+    if (gei->wait_timer) {
+        g_source_remove(gei->wait_timer);
+        gei->wait_timer = 0;
+    }
+    gei->waiter = NULL;
+    ga_complete_response(ga_state, waiter, guest_exec_wait_result, gei);
+}
+
+static gboolean guest_exec_wait_timeout(gpointer data)
+{
+    GuestExecInfo *gei = data;
+
+    gei->wait_timer = 0;
+    guest_exec_wait_done(gei);
+    return false;
+}
+
+/* once @gei has exited and its output is in, answer guest-exec-wait or
+ * start the countdown to forgetting it; this may free @gei */
+static void guest_exec_info_exited(GuestExecInfo *gei)
+{
+    int timeout = ga_get_exec_reap_timeout(ga_state);
+
+    if (!guest_exec_info_finished(gei)) {
+        return;
+    }
+    if (gei->done) {
+        gei->done(gei, gei->done_opaque);
+        return;
+    }
+    if (timeout) {
+        gei->reap_timer = g_timeout_add_seconds(timeout, guest_exec_reap, gei);
+    }
+    guest_exec_wait_done(gei);
+}
+
+/* the answer to a guest-exec-write that waited for room */
+static QObject *guest_exec_write_result(void *opaque, Error **errp)
+{
+    GuestExecIOData *p = opaque;
+    GuestExecWrite *gew;
+    JsonOutputVisitor *jov;
+    QObject *ret = NULL;
+    Error *err = NULL;
+
+    if (!p->ch) {
+        error_setg(errp, "stdin of the process was closed before it read "
+                   "the data");
+        return NULL;
+    }
+
+    gew = g_new0(GuestExecWrite, 1);
+    gew->pending = p->size - p->length;
+    jov = json_output_visitor_new();
+    visit_type_GuestExecWrite(json_output_get_visitor(jov), &gew, "unused",
+                              &err);
+    if (!err) {
+        ret = json_output_get_qobject(jov);
+    }
+    error_propagate(errp, err);
+    json_output_visitor_cleanup(jov);
+    qapi_free_GuestExecWrite(gew);
+    return ret;
+}
+
+static void guest_exec_write_done(GuestExecIOData *p)
+{
+    GAPendingResponse *writer = p->writer;
+
+    p->writer = NULL;
+    ga_complete_response(ga_state, writer, guest_exec_write_result, p);
+}
+
+/* close stdin of @p->gei, which may free it */
+static void guest_exec_input_close(GuestExecIOData *p)
+{
+    g_io_channel_shutdown(p->ch, true, NULL);
+    g_io_channel_unref(p->ch);
+    p->ch = NULL;
+    g_atomic_int_set(&p->closed, 1);
+    g_free(p->data);
+    p->data = NULL;
+    p->size = p->length = 0;
+    if (p->writer) {
+        guest_exec_write_done(p);
+    }
+    guest_exec_info_exited(p->gei);
+}
+
+GuestExecStatus *qmp_guest_exec_wait(int64_t pid, bool has_timeout_ms,
+                                     int64_t timeout_ms, Error **err)
+{
+    GuestExecInfo *gei;
+
+    gei = guest_exec_info_find(pid);
+    if (gei == NULL) {
+        error_setg(err, QERR_INVALID_PARAMETER, "pid");
+        return NULL;
+    }
+    if (has_timeout_ms && timeout_ms < 0) {
+        error_setg(err, QERR_INVALID_PARAMETER_VALUE, "timeout-ms",
+                   "a non-negative number");
+        return NULL;
+    }
+
+    /* a new wait takes over from one still pending */
+    guest_exec_wait_done(gei);
+
+    if (guest_exec_info_finished(gei) || (has_timeout_ms && !timeout_ms)) {
+        return guest_exec_get_status(gei);
+    }
+    gei->waiter = ga_defer_response(ga_state);
+    if (!gei->waiter) {
+        /* no id, so it cannot be answered out of order */
+        return guest_exec_get_status(gei);
+    }
+    if (has_timeout_ms) {
+        gei->wait_timer = g_timeout_add(MIN(timeout_ms, G_MAXUINT),
+                                        guest_exec_wait_timeout, gei);
+    }
+
+    /* dropped, the answer comes from guest_exec_wait_done() */
+    return g_new0(GuestExecStatus, 1);
+}
+
+/* Get environment variables or arguments array for execve(). */
+static char **guest_exec_get_args(const strList *entry, bool log)
+{
+    const strList *it;
+    int count = 1, i = 0;  /* reserve for NULL terminator */
+    char **args;
+    char *str; /* for logging array of arguments */
+    size_t str_size = 1;
+
+    for (it = entry; it != NULL; it = it->next) {
+        count++;
+        str_size += 1 + strlen(it->value);
+    }
+
+    str = g_malloc(str_size);
+    *str = 0;
+    args = g_malloc(count * sizeof(char *));
+    for (it = entry; it != NULL; it = it->next) {
+        args[i++] = it->value;
+        pstrcat(str, str_size, it->value);
+        if (it->next) {
+            pstrcat(str, str_size, " ");
+        }
+    }
+    args[i] = NULL;
+
+    if (log) {
+        slog("guest-exec called: \"%s\"", str);
+    }
+    g_free(str);
+
+    return args;
+}
+
+static void guest_exec_child_watch(GPid pid, gint status, gpointer data)
+{
+    GuestExecInfo *gei = (GuestExecInfo *)data;
+
+    g_debug("guest_exec_child_watch called, pid: %d, status: %u",
+            (int32_t)gpid_to_int64(pid), (uint32_t)status);
+
+    trace_qga_exec_exit(gei->pid_numeric, status);
+    gei->status = status;
+    gei->finished = true;
+
+    if (gei->timeout) {
+        g_source_destroy(gei->timeout);
+        g_source_unref(gei->timeout);
+        gei->timeout = NULL;
+    }
+
+    g_spawn_close_pid(pid);
+
+    /* an idle stdin stream has no watch to notice the exit */
+    if (gei->in.stream && gei->in.ch && !gei->in.watched) {
+        guest_exec_input_close(&gei->in);
+        return;
+    }
+    guest_exec_info_exited(gei);
+}
+
+static gboolean guest_exec_timeout(gpointer data)
+{
+    GuestExecInfo *gei = (GuestExecInfo *)data;
+
+    slog("guest-exec: killing pid %" PRId64 " after timeout",
+         gei->pid_numeric);
+    gei->timed_out = true;
+#ifdef G_OS_WIN32
+    /* the whole tree, as with the process group below */
+    if (gei->job) {
+        TerminateJobObject(gei->job->job, 1);
+    } else {
+        TerminateProcess(gei->pid, 1);
+    }
+#else
+    /* the child leads its own process group, see guest_exec_task_setup() */
+    kill(-gei->pid, SIGKILL);
+#endif
+
+    return false;
+}
+
+typedef struct GuestExecSetup {
+    bool new_pgrp;
+    int output_fd;
+    GuestExecLimits *limits;
+    char *cgroup_procs;
+} GuestExecSetup;
+
+#if !defined(G_OS_WIN32)
+/* ioprio_set() has no glibc wrapper */
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_WHO_PROCESS 1
+
+/* in the child between fork and exec: async-signal-safe calls only */
+static void guest_exec_setup_fail(const char *what)
+{
+    static const char msg[] = "qemu-ga: failed to set up limit: ";
+    ssize_t ret;
+
+    ret = write(STDERR_FILENO, msg, sizeof(msg) - 1);
+    ret = write(STDERR_FILENO, what, strlen(what));
+    ret = write(STDERR_FILENO, "\n", 1);
+    (void)ret;
+    _exit(127);
+}
+
+static void guest_exec_setup_rlimit(int resource, int64_t value,
+                                    const char *what)
+{
+    struct rlimit rl = { .rlim_cur = value, .rlim_max = value };
+
+    if (setrlimit(resource, &rl) < 0) {
+        guest_exec_setup_fail(what);
+    }
+}
+
+static void guest_exec_setup_limits(GuestExecSetup *setup)
+{
+    GuestExecLimits *limits = setup->limits;
+    int fd;
+
+    /* join the cgroup first, so that it accounts for everything else */
+    if (setup->cgroup_procs) {
+        /* "0" stands for the writing process, in cgroup v1 and v2 alike */
+        fd = open(setup->cgroup_procs, O_WRONLY);
+        if (fd < 0 || write(fd, "0", 1) != 1) {
+            guest_exec_setup_fail("cgroup");
+        }
+        close(fd);
+    }
+    if (limits->has_max_memory) {
+        guest_exec_setup_rlimit(RLIMIT_AS, limits->max_memory, "max-memory");
+    }
+    if (limits->has_max_files) {
+        guest_exec_setup_rlimit(RLIMIT_NOFILE, limits->max_files,
+                                "max-files");
+    }
+    if (limits->has_nice && setpriority(PRIO_PROCESS, 0, limits->nice) < 0) {
+        guest_exec_setup_fail("nice");
+    }
+    if (limits->has_ionice_class) {
+#ifdef SYS_ioprio_set
+        int ioprio;
+
+        if (limits->ionice_class == GUEST_EXEC_IONICE_CLASS_IDLE) {
+            ioprio = IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT;
+        } else {
+            ioprio = IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT |
+                     (limits->has_ionice_level ? limits->ionice_level : 4);
+        }
+        if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, ioprio) < 0) {
+            guest_exec_setup_fail("ionice");
+        }
+#else
+        guest_exec_setup_fail("ionice");
+#endif
+    }
+}
+#endif
+
+/** Reset ignored signals back to default.  If requested, also move the
+ * child into a process group of its own, so that a timeout can kill
+ * everything it started, send its stdout and stderr to a file, and apply
+ * resource limits. */
+static void guest_exec_task_setup(gpointer data)
+{
+#if !defined(G_OS_WIN32)
+    GuestExecSetup *setup = data;
+    struct sigaction sigact;
+
+    if (setup->new_pgrp) {
+        setpgid(0, 0);
+    }
+    /* glib has already set up the standard fds at this point */
+    if (setup->output_fd >= 0) {
+        dup2(setup->output_fd, STDOUT_FILENO);
+        dup2(setup->output_fd, STDERR_FILENO);
+    }
+    if (setup->limits) {
+        guest_exec_setup_limits(setup);
+    }
+
+    memset(&sigact, 0, sizeof(struct sigaction));
+    sigact.sa_handler = SIG_DFL;
+
+    if (sigaction(SIGPIPE, &sigact, NULL) != 0) {
+        slog("sigaction() failed to reset child process's SIGPIPE: %s",
+             strerror(errno));
+    }
+#endif
+}
+
+static gboolean guest_exec_input_watch(GIOChannel *ch,
         GIOCondition cond, gpointer p_)
 {
     GuestExecIOData *p = (GuestExecIOData *)p_;
@@ -293,6 +1236,11 @@ static gboolean guest_exec_input_watch(GIOChannel *ch,
 
     /* nothing left to write */
     if (p->size == p->length) {
+        if (p->stream && !p->eof && !p->gei->finished) {
+            /* guest-exec-write starts it again */
+            p->watched = false;
+            return false;
+        }
         goto done;
     }
 
@@ -302,6 +1250,10 @@ static gboolean guest_exec_input_watch(GIOChannel *ch,
     /* can be not 0 even if not G_IO_STATUS_NORMAL */
     if (bytes_written != 0) {
         p->length += bytes_written;
+        if (p->writer &&
+            p->size - p->length < GUEST_EXEC_WRITE_BUFFER) {
+            guest_exec_write_done(p);
+        }
     }
 
     /* continue write, our callback will be called again */
@@ -316,11 +1268,7 @@ static gboolean guest_exec_input_watch(GIOChannel *ch,
     }
 
 done:
-    g_io_channel_shutdown(ch, true, NULL);
-    g_io_channel_unref(ch);
-    g_atomic_int_set(&p->closed, 1);
-    g_free(p->data);
-
+    guest_exec_input_close(p);
     return false;
 }
 
@@ -335,14 +1283,30 @@ static gboolean guest_exec_output_watch(GIOChannel *ch,
         goto close;
     }
 
+    if (p->ring) {
+        gchar buf[GUEST_EXEC_READ_SIZE];
+
+        gstatus = g_io_channel_read_chars(ch, buf, sizeof(buf), &bytes_read,
+                                          NULL);
+        if (gstatus == G_IO_STATUS_EOF || gstatus == G_IO_STATUS_ERROR) {
+            goto close;
+        }
+        guest_exec_ring_put(p, (guchar *)buf, bytes_read);
+        return true;
+    }
+
     if (p->size == p->length) {
         gpointer t = NULL;
-        if (!p->truncated && p->size < GUEST_EXEC_MAX_OUTPUT) {
-            t = g_try_realloc(p->data, p->size + GUEST_EXEC_IO_SIZE);
+        /* grow geometrically, so that megabytes of output take a handful
+         * of reallocations and copies rather than one every 4KB */
+        gsize size = MIN(MAX(p->size * 2, GUEST_EXEC_READ_SIZE), p->limit);
+
+        if (!p->truncated && p->size < p->limit) {
+            t = g_try_realloc(p->data, size);
         }
         if (t == NULL) {
             /* ignore truncated output */
-            gchar buf[GUEST_EXEC_IO_SIZE];
+            gchar buf[GUEST_EXEC_READ_SIZE];
 
             p->truncated = true;
             gstatus = g_io_channel_read_chars(ch, buf, sizeof(buf),
@@ -353,7 +1317,7 @@ static gboolean guest_exec_output_watch(GIOChannel *ch,
 
             return true;
         }
-        p->size += GUEST_EXEC_IO_SIZE;
+        p->size = size;
         p->data = t;
     }
 
@@ -370,91 +1334,1986 @@ static gboolean guest_exec_output_watch(GIOChannel *ch,
     return true;
 
 close:
+    p->ch = NULL;
     g_io_channel_unref(ch);
     g_atomic_int_set(&p->closed, 1);
+    guest_exec_info_exited(p->gei);
     return false;
 }
 
-GuestExec *qmp_guest_exec(const char *path,
-                       bool has_arg, strList *arg,
-                       bool has_env, strList *env,
-                       bool has_input_data, const char *input_data,
-                       bool has_capture_output, bool capture_output,
-                       Error **err)
+static GIOChannel *guest_exec_channel_new(int fd)
 {
-    GPid pid;
-    GuestExec *ge = NULL;
-    GuestExecInfo *gei;
-    char **argv, **envp;
-    strList arglist;
-    gboolean ret;
-    GError *gerr = NULL;
-    gint in_fd, out_fd, err_fd;
-    GIOChannel *in_ch, *out_ch, *err_ch;
-    GSpawnFlags flags;
-    bool has_output = (has_capture_output && capture_output);
+    GIOChannel *ch;
 
-    arglist.value = (char *)path;
-    arglist.next = has_arg ? arg : NULL;
+#ifdef G_OS_WIN32
+    ch = g_io_channel_win32_new_fd(fd);
+#else
+    ch = g_io_channel_unix_new(fd);
+#endif
+    g_io_channel_set_encoding(ch, NULL, NULL);
+    g_io_channel_set_buffered(ch, false);
 
-    argv = guest_exec_get_args(&arglist, true);
-    envp = guest_exec_get_args(has_env ? env : NULL, false);
+    return ch;
+}
 
-    flags = G_SPAWN_SEARCH_PATH | G_SPAWN_DO_NOT_REAP_CHILD;
-    if (!has_output) {
-        flags |= G_SPAWN_STDOUT_TO_DEV_NULL | G_SPAWN_STDERR_TO_DEV_NULL;
+#if !defined(G_OS_WIN32)
+/*
+ * What glib does in the child to keep the agent's file descriptors from
+ * leaking into it, only from the parent: close in the child those of 3
+ * and up that are not close-on-exec anyway.  False if they cannot be
+ * told.
+ */
+static bool guest_exec_close_fds(posix_spawn_file_actions_t *fa)
+{
+    DIR *dir = opendir("/proc/self/fd");
+    struct dirent *de;
+    int fd, flags;
+
+    if (!dir) {
+        return false;
+    }
+    while ((de = readdir(dir))) {
+        fd = atoi(de->d_name);
+        if (fd < 3 || fd == dirfd(dir)) {
+            continue;
+        }
+        flags = fcntl(fd, F_GETFD);
+        if (flags >= 0 && !(flags & FD_CLOEXEC)) {
+            posix_spawn_file_actions_addclose(fa, fd);
+        }
     }
+    closedir(dir);
+    return true;
+}
 
-    ret = g_spawn_async_with_pipes(NULL, argv, envp, flags,
-            guest_exec_task_setup, NULL, &pid, has_input_data ? &in_fd : NULL,
-            has_output ? &out_fd : NULL, has_output ? &err_fd : NULL, &gerr);
-    if (!ret) {
-        error_setg(err, QERR_QGA_COMMAND_FAILED, gerr->message);
-        g_error_free(gerr);
-        goto done;
+/*
+ * Start @argv like g_spawn_async_with_pipes() does, but with
+ * posix_spawn(), which glibc implements with clone(CLONE_VM |
+ * CLONE_VFORK).  The fork() glib uses has to copy the page tables of the
+ * agent, which takes longer the larger it gets, and can fail under strict
+ * overcommit.  Only the setup of guest_exec_task_setup() that spawn
+ * attributes and file actions can express is done, so not @setup->limits.
+ * Returns -ENOTSUP if this cannot be used, 0 or -errno otherwise.
+ */
+static int guest_exec_posix_spawn(char **argv, char **envp,
+                                  GSpawnFlags flags, GuestExecSetup *setup,
+                                  GPid *pid, gint *in_fd, gint *out_fd,
+                                  gint *err_fd)
+{
+    posix_spawn_file_actions_t fa;
+    posix_spawnattr_t attr;
+    int pipes[3][2] = { { -1, -1 }, { -1, -1 }, { -1, -1 } };
+    gint *fds[3] = { in_fd, out_fd, err_fd };
+    short attr_flags = POSIX_SPAWN_SETSIGDEF;
+    sigset_t sigdef;
+    pid_t child;
+    int i, ret = 0;
+
+    if (setup->limits) {
+        return -ENOTSUP;
     }
 
-    ge = g_new0(GuestExec, 1);
-    ge->pid = gpid_to_int64(pid);
+    posix_spawn_file_actions_init(&fa);
+    posix_spawnattr_init(&attr);
 
-    gei = guest_exec_info_add(pid);
-    gei->has_output = has_output;
-    g_child_watch_add(pid, guest_exec_child_watch, gei);
+    for (i = 0; i < 3; i++) {
+        if (fds[i]) {
+            if (qemu_pipe(pipes[i]) < 0) {
+                ret = -errno;
+                goto out;
+            }
+            /* the child's end is pipes[0][0] for stdin, [1] otherwise */
+            posix_spawn_file_actions_adddup2(&fa, pipes[i][i ? 1 : 0], i);
+        } else if (i && setup->output_fd >= 0) {
+            posix_spawn_file_actions_adddup2(&fa, setup->output_fd, i);
+        } else if (i == 0 ||
+                   (i == 1 && (flags & G_SPAWN_STDOUT_TO_DEV_NULL)) ||
+                   (i == 2 && (flags & G_SPAWN_STDERR_TO_DEV_NULL))) {
+            posix_spawn_file_actions_addopen(&fa, i, "/dev/null",
+                                             i ? O_WRONLY : O_RDONLY, 0);
+        }
+    }
+    if (!guest_exec_close_fds(&fa)) {
+        ret = -ENOTSUP;
+        goto out;
+    }
 
-    if (has_input_data) {
-        gei->in.data = g_base64_decode(input_data, &gei->in.size);
-#ifdef G_OS_WIN32
-        in_ch = g_io_channel_win32_new_fd(in_fd);
-#else
-        in_ch = g_io_channel_unix_new(in_fd);
+    sigemptyset(&sigdef);
+    sigaddset(&sigdef, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &sigdef);
+    if (setup->new_pgrp) {
+        attr_flags |= POSIX_SPAWN_SETPGROUP;
+        posix_spawnattr_setpgroup(&attr, 0);
+    }
+#ifdef POSIX_SPAWN_USEVFORK
+    attr_flags |= POSIX_SPAWN_USEVFORK;
 #endif
-        g_io_channel_set_encoding(in_ch, NULL, NULL);
-        g_io_channel_set_buffered(in_ch, false);
-        g_io_channel_set_flags(in_ch, G_IO_FLAG_NONBLOCK, NULL);
-        g_io_add_watch(in_ch, G_IO_OUT, guest_exec_input_watch, &gei->in);
+    posix_spawnattr_setflags(&attr, attr_flags);
+
+    if (flags & G_SPAWN_SEARCH_PATH) {
+        ret = -posix_spawnp(&child, argv[0], &fa, &attr, argv,
+                            envp ? envp : environ);
+    } else {
+        ret = -posix_spawn(&child, argv[0], &fa, &attr, argv,
+                           envp ? envp : environ);
+    }
+    if (!ret) {
+        *pid = child;
     }
 
-    if (has_output) {
-#ifdef G_OS_WIN32
-        out_ch = g_io_channel_win32_new_fd(out_fd);
-        err_ch = g_io_channel_win32_new_fd(err_fd);
-#else
-        out_ch = g_io_channel_unix_new(out_fd);
-        err_ch = g_io_channel_unix_new(err_fd);
+out:
+    for (i = 0; i < 3; i++) {
+        if (pipes[i][0] < 0) {
+            continue;
+        }
+        /* keep the parent's end on success, close everything else */
+        close(pipes[i][i ? 1 : 0]);
+        if (ret) {
+            close(pipes[i][i ? 0 : 1]);
+        } else {
+            *fds[i] = pipes[i][i ? 0 : 1];
+        }
+    }
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&fa);
+    return ret;
+}
 #endif
-        g_io_channel_set_encoding(out_ch, NULL, NULL);
-        g_io_channel_set_encoding(err_ch, NULL, NULL);
-        g_io_channel_set_buffered(out_ch, false);
-        g_io_channel_set_buffered(err_ch, false);
-        g_io_add_watch(out_ch, G_IO_IN | G_IO_HUP,
-                guest_exec_output_watch, &gei->out);
-        g_io_add_watch(err_ch, G_IO_IN | G_IO_HUP,
-                guest_exec_output_watch, &gei->err);
+
+#ifdef G_OS_WIN32
+static HANDLE guest_exec_port;
+
+/* in the context of the GuestExecInfo: the child itself exited */
+static gboolean guest_exec_job_exited(gpointer opaque)
+{
+    GuestExecJob *job = opaque;
+    GuestExecInfo *gei = guest_exec_info_find(job->pid);
+    DWORD code = 1;
+
+    if (gei && gei->job == job && !gei->finished) {
+        GetExitCodeProcess(gei->pid, &code);
+        /* what it left running would hold the output pipes open */
+        if (gei->has_output) {
+            TerminateJobObject(job->job, code);
+        }
+        guest_exec_child_watch(gei->pid, code, gei);
+    }
+    guest_exec_job_unref(job);
+    return false;
+}
+
+static gpointer guest_exec_port_thread(gpointer opaque)
+{
+    GuestExecJob *job;
+    GSource *source;
+    LPOVERLAPPED ov;
+    ULONG_PTR key;
+    DWORD msg;
+
+    while (GetQueuedCompletionStatus(guest_exec_port, &msg, &key, &ov,
+                                     INFINITE)) {
+        job = (GuestExecJob *)key;
+        switch (msg) {
+        case JOB_OBJECT_MSG_EXIT_PROCESS:
+        case JOB_OBJECT_MSG_ABNORMAL_EXIT_PROCESS:
+            /* the pid of the process that exited comes in place of ov */
+            if ((DWORD)(ULONG_PTR)ov != job->pid) {
+                break;
+            }
+            g_atomic_int_inc(&job->refcount);
+            source = g_idle_source_new();
+            g_source_set_callback(source, guest_exec_job_exited, job, NULL);
+            g_source_attach(source, job->ctx);
+            g_source_unref(source);
+            break;
+        case JOB_OBJECT_MSG_ACTIVE_PROCESS_ZERO:
+            guest_exec_job_unref(job);
+            break;
+        }
     }
+    return NULL;
+}
 
-done:
-    g_free(argv);
-    g_free(envp);
+/* quote @arg the way CommandLineToArgvW() and the C runtime split it */
+static void guest_exec_win32_quote(GString *cmd, const char *arg)
+{
+    size_t backslashes = 0;
 
-    return ge;
+    if (cmd->len) {
+        g_string_append_c(cmd, ' ');
+    }
+    if (*arg && !strpbrk(arg, " \t\n\v\"")) {
+        g_string_append(cmd, arg);
+        return;
+    }
+
+    g_string_append_c(cmd, '"');
+    for (; *arg; arg++) {
+        if (*arg == '\\') {
+            backslashes++;
+            continue;
+        }
+        /* backslashes only escape themselves before a quote */
+        if (*arg == '"') {
+            backslashes = backslashes * 2 + 1;
+        }
+        for (; backslashes; backslashes--) {
+            g_string_append_c(cmd, '\\');
+        }
+        g_string_append_c(cmd, *arg);
+    }
+    for (backslashes *= 2; backslashes; backslashes--) {
+        g_string_append_c(cmd, '\\');
+    }
+    g_string_append_c(cmd, '"');
+}
+
+static bool guest_exec_win32_job_limits(HANDLE job, GuestExecLimits *limits)
+{
+    JOBOBJECT_EXTENDED_LIMIT_INFORMATION info;
+
+    memset(&info, 0, sizeof(info));
+    if (limits && limits->has_max_memory) {
+        info.BasicLimitInformation.LimitFlags |= JOB_OBJECT_LIMIT_JOB_MEMORY;
+        info.JobMemoryLimit = limits->max_memory;
+    }
+    if (limits && limits->has_nice) {
+        info.BasicLimitInformation.LimitFlags |=
+            JOB_OBJECT_LIMIT_PRIORITY_CLASS;
+        info.BasicLimitInformation.PriorityClass =
+            limits->nice < -10 ? HIGH_PRIORITY_CLASS :
+            limits->nice < 0 ? ABOVE_NORMAL_PRIORITY_CLASS :
+            limits->nice == 0 ? NORMAL_PRIORITY_CLASS :
+            limits->nice <= 10 ? BELOW_NORMAL_PRIORITY_CLASS :
+            IDLE_PRIORITY_CLASS;
+    }
+    return !info.BasicLimitInformation.LimitFlags ||
+           SetInformationJobObject(job, JobObjectExtendedLimitInformation,
+                                   &info, sizeof(info));
+}
+
+/*
+ * Start @argv like g_spawn_async_with_pipes() does, but suspended, put it
+ * into a job object with @setup->limits before it runs, and have its exit
+ * reported through the completion port rather than by a child watch, as
+ * the main loop can only wait on 64 handles at a time.  Only the pipes of
+ * the child and its NUL handles are inherited, not whatever other
+ * inheritable handles the agent has, such as the pipes of other children.
+ * Returns -ENOTSUP if this cannot be used, in particular when the agent
+ * itself is in a job that forbids nesting, -1 with @errp set if the child
+ * could not be started, 0 otherwise.
+ */
+static int guest_exec_win32_spawn(char **argv, char **envp,
+                                  GSpawnFlags flags, GuestExecSetup *setup,
+                                  GMainContext *ctx, GPid *pid,
+                                  GuestExecJob **jobp, gint *in_fd,
+                                  gint *out_fd, gint *err_fd, Error **errp)
+{
+    SECURITY_ATTRIBUTES sa = { sizeof(sa), NULL, TRUE };
+    JOBOBJECT_ASSOCIATE_COMPLETION_PORT port;
+    HANDLE pipes[3][2] = { { NULL, NULL }, { NULL, NULL }, { NULL, NULL } };
+    HANDLE std[3] = { NULL, NULL, NULL };
+    gint *fds[3] = { in_fd, out_fd, err_fd };
+    PROCESS_INFORMATION pi;
+#if (_WIN32_WINNT >= 0x0600)
+    STARTUPINFOEXW si;
+    SIZE_T size;
+#else
+    struct {
+        STARTUPINFOW StartupInfo;
+    } si;
+#endif
+    DWORD create_flags = CREATE_SUSPENDED | CREATE_UNICODE_ENVIRONMENT |
+                         CREATE_NO_WINDOW;
+    GuestExecJob *job = NULL;
+    GString *cmd, *env;
+    gunichar2 *wcmd = NULL, *wenv = NULL;
+    char *msg;
+    int i, ret = -ENOTSUP;
+
+    if (!guest_exec_port) {
+        guest_exec_port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL,
+                                                 0, 1);
+        if (!guest_exec_port) {
+            return -ENOTSUP;
+        }
+        g_thread_new("qga-exec-port", guest_exec_port_thread, NULL);
+    }
+
+    job = g_new0(GuestExecJob, 1);
+    job->job = CreateJobObjectW(NULL, NULL);
+    if (!job->job) {
+        g_free(job);
+        return -ENOTSUP;
+    }
+    /* one reference for the caller, one for the port thread */
+    job->refcount = 2;
+    job->ctx = ctx ? g_main_context_ref(ctx) : NULL;
+    port.CompletionKey = job;
+    port.CompletionPort = guest_exec_port;
+    if (!SetInformationJobObject(job->job,
+                                 JobObjectAssociateCompletionPortInformation,
+                                 &port, sizeof(port))) {
+        goto out;
+    }
+    if (!guest_exec_win32_job_limits(job->job, setup->limits)) {
+        ret = -1;
+        error_setg_win32(errp, GetLastError(),
+                         "failed to set the limits of the process");
+        goto out;
+    }
+
+    cmd = g_string_new("");
+    for (i = 0; argv[i]; i++) {
+        guest_exec_win32_quote(cmd, argv[i]);
+    }
+    wcmd = g_utf8_to_utf16(cmd->str, -1, NULL, NULL, NULL);
+    g_string_free(cmd, true);
+    if (envp) {
+        /* NUL separated, with an empty one at the end */
+        env = g_string_new("");
+        for (i = 0; envp[i]; i++) {
+            g_string_append_len(env, envp[i], strlen(envp[i]) + 1);
+        }
+        g_string_append_c(env, '\0');
+        wenv = g_utf8_to_utf16(env->str, env->len, NULL, NULL, NULL);
+        g_string_free(env, true);
+    }
+    if (!wcmd || (envp && !wenv)) {
+        ret = -1;
+        error_setg(errp, "the command line or environment is not UTF-8");
+        goto out;
+    }
+
+    for (i = 0; i < 3; i++) {
+        if (fds[i]) {
+            if (!CreatePipe(&pipes[i][0], &pipes[i][1], &sa, 0)) {
+                goto out;
+            }
+            /* the child's end is pipes[0][0] for stdin, [1] otherwise */
+            std[i] = pipes[i][i ? 1 : 0];
+            SetHandleInformation(pipes[i][i ? 0 : 1], HANDLE_FLAG_INHERIT, 0);
+        } else {
+            std[i] = CreateFileW(L"NUL", i ? GENERIC_WRITE : GENERIC_READ,
+                                 FILE_SHARE_READ | FILE_SHARE_WRITE, &sa,
+                                 OPEN_EXISTING, 0, NULL);
+            if (std[i] == INVALID_HANDLE_VALUE) {
+                std[i] = NULL;
+                goto out;
+            }
+        }
+    }
+
+    memset(&si, 0, sizeof(si));
+    si.StartupInfo.cb = sizeof(si.StartupInfo);
+    si.StartupInfo.dwFlags = STARTF_USESTDHANDLES;
+    si.StartupInfo.hStdInput = std[0];
+    si.StartupInfo.hStdOutput = std[1];
+    si.StartupInfo.hStdError = std[2];
+#if (_WIN32_WINNT >= 0x0600)
+    size = 0;
+    InitializeProcThreadAttributeList(NULL, 1, 0, &size);
+    si.lpAttributeList = g_malloc(size);
+    if (InitializeProcThreadAttributeList(si.lpAttributeList, 1, 0, &size) &&
+        UpdateProcThreadAttribute(si.lpAttributeList, 0,
+                                  PROC_THREAD_ATTRIBUTE_HANDLE_LIST, std,
+                                  sizeof(std), NULL, NULL)) {
+        si.StartupInfo.cb = sizeof(si);
+        create_flags |= EXTENDED_STARTUPINFO_PRESENT;
+    }
+#endif
+
+    if (!CreateProcessW(NULL, wcmd, NULL, NULL, TRUE, create_flags, wenv,
+                        NULL, &si.StartupInfo, &pi)) {
+        ret = -1;
+        /* worded the way glib does */
+        msg = g_win32_error_message(GetLastError());
+        error_setg(errp, "Failed to execute child process \"%s\" (%s)",
+                   argv[0], msg);
+        g_free(msg);
+        goto out_attr;
+    }
+    if (!AssignProcessToJobObject(job->job, pi.hProcess)) {
+        TerminateProcess(pi.hProcess, 1);
+        CloseHandle(pi.hThread);
+        CloseHandle(pi.hProcess);
+        goto out_attr;
+    }
+    job->pid = pi.dwProcessId;
+    ResumeThread(pi.hThread);
+    CloseHandle(pi.hThread);
+
+    *pid = pi.hProcess;
+    *jobp = job;
+    job = NULL;
+    ret = 0;
+
+out_attr:
+#if (_WIN32_WINNT >= 0x0600)
+    if (si.StartupInfo.cb == sizeof(si)) {
+        DeleteProcThreadAttributeList(si.lpAttributeList);
+    }
+    g_free(si.lpAttributeList);
+#endif
+out:
+    for (i = 0; i < 3; i++) {
+        if (std[i] && !fds[i]) {
+            CloseHandle(std[i]);
+        }
+        if (!pipes[i][0]) {
+            continue;
+        }
+        /* keep the parent's end on success, close everything else */
+        CloseHandle(pipes[i][i ? 1 : 0]);
+        if (ret) {
+            CloseHandle(pipes[i][i ? 0 : 1]);
+        } else {
+            *fds[i] = _open_osfhandle((intptr_t)pipes[i][i ? 0 : 1],
+                                      i ? _O_RDONLY : _O_WRONLY);
+        }
+    }
+    if (job) {
+        /* nothing will come through the port for a job that stays empty */
+        CloseHandle(job->job);
+        if (job->ctx) {
+            g_main_context_unref(job->ctx);
+        }
+        g_free(job);
+    }
+    g_free(wcmd);
+    g_free(wenv);
+    return ret;
+}
+#endif
+
+static void guest_exec_source_attach(GSource *source, GSourceFunc func,
+                                     gpointer data, GMainContext *ctx)
+{
+    g_source_set_callback(source, func, data, NULL);
+    g_source_attach(source, ctx);
+    g_source_unref(source);
+}
+
+/* pipes of the main context go through ga_io_add_watch(), see --epoll */
+static void guest_exec_watch(GIOChannel *ch, GIOCondition cond, GIOFunc func,
+                             gpointer data, GMainContext *ctx)
+{
+    if (!ctx) {
+        ga_io_add_watch(ch, cond, func, data);
+        return;
+    }
+    guest_exec_source_attach(g_io_create_watch(ch, cond),
+                             (GSourceFunc)func, data, ctx);
+}
+
+static void guest_exec_input_start(GuestExecIOData *p)
+{
+    if (p->watched) {
+        return;
+    }
+    p->watched = true;
+    guest_exec_watch(p->ch, G_IO_OUT, guest_exec_input_watch, p, p->ctx);
+}
+
+/*
+ * Start @argv and register it for guest-exec-status.  @input_data is
+ * written to its stdin, which is closed afterwards unless @input_stream
+ * keeps it open for guest-exec-write.  Output is captured up to
+ * @output_limit bytes per stream if @has_output is set, or into rings of
+ * that size for guest-exec-read if @output_ring is too.  Without
+ * @has_output, the child writes both straight to @output_fd if that is
+ * not -1.  @limits, checked by guest_exec_check_limits(), are applied if
+ * not NULL.  The child is killed after @timeout_ms if that is not 0.  All
+ * watches are attached to @ctx, NULL meaning the main loop.
+ */
+static GuestExecInfo *guest_exec_spawn(char **argv, char **envp,
+                                       GSpawnFlags flags,
+                                       const char *input_data,
+                                       bool input_stream,
+                                       bool has_output, gsize output_limit,
+                                       bool output_ring, int output_fd,
+                                       GuestExecLimits *limits,
+                                       int64_t timeout_ms,
+                                       GMainContext *ctx, Error **err)
+{
+    GPid pid;
+    GuestExecInfo *gei;
+    gboolean ret;
+    GError *gerr = NULL;
+    gint in_fd, out_fd, err_fd;
+    GIOChannel *in_ch, *out_ch, *err_ch;
+    GuestExecSetup setup = {
+        .new_pgrp = timeout_ms > 0,
+        .output_fd = output_fd,
+        .limits = limits,
+    };
+    int spawn_ret = -ENOTSUP;
+    bool has_input = input_data || input_stream;
+#if !defined(G_OS_WIN32)
+    char *msg;
+#else
+    GuestExecJob *job = NULL;
+    Error *local_err = NULL;
+#endif
+
+    if (limits && limits->has_cgroup) {
+        setup.cgroup_procs = g_build_filename(limits->cgroup, "cgroup.procs",
+                                              NULL);
+    }
+
+    if (!guest_exec_make_room()) {
+        error_setg(err, "too many processes started by guest-exec are "
+                   "still running");
+        return NULL;
+    }
+
+    flags |= G_SPAWN_DO_NOT_REAP_CHILD;
+    if (!has_output && output_fd < 0) {
+        flags |= G_SPAWN_STDOUT_TO_DEV_NULL | G_SPAWN_STDERR_TO_DEV_NULL;
+    }
+
+#if !defined(G_OS_WIN32)
+    spawn_ret = guest_exec_posix_spawn(argv, envp, flags, &setup, &pid,
+                                       has_input ? &in_fd : NULL,
+                                       has_output ? &out_fd : NULL,
+                                       has_output ? &err_fd : NULL);
+    if (spawn_ret && spawn_ret != -ENOTSUP) {
+        /* worded the way glib does */
+        msg = g_strdup_printf("Failed to execute child process \"%s\" (%s)",
+                              argv[0], strerror(-spawn_ret));
+        error_setg(err, QERR_QGA_COMMAND_FAILED, msg);
+        g_free(msg);
+        return NULL;
+    }
+#else
+    spawn_ret = guest_exec_win32_spawn(argv, envp, flags, &setup, ctx, &pid,
+                                       &job, has_input ? &in_fd : NULL,
+                                       has_output ? &out_fd : NULL,
+                                       has_output ? &err_fd : NULL,
+                                       &local_err);
+    if (spawn_ret && spawn_ret != -ENOTSUP) {
+        error_setg(err, QERR_QGA_COMMAND_FAILED,
+                   error_get_pretty(local_err));
+        error_free(local_err);
+        return NULL;
+    }
+    /* glib cannot apply the limits */
+    if (spawn_ret && limits) {
+        error_setg(err, QERR_QGA_COMMAND_FAILED,
+                   "cannot run the process in a job object to limit it");
+        return NULL;
+    }
+#endif
+    if (spawn_ret) {
+        ret = g_spawn_async_with_pipes(NULL, argv, envp, flags,
+                guest_exec_task_setup, &setup, &pid,
+                has_input ? &in_fd : NULL, has_output ? &out_fd : NULL,
+                has_output ? &err_fd : NULL, &gerr);
+        g_free(setup.cgroup_procs);
+        if (!ret) {
+            error_setg(err, QERR_QGA_COMMAND_FAILED, gerr->message);
+            g_error_free(gerr);
+            return NULL;
+        }
+    }
+
+    gei = guest_exec_info_add(pid);
+    trace_qga_exec_start(gei->pid_numeric, argv[0]);
+    gei->has_output = has_output;
+#ifdef G_OS_WIN32
+    /* the exit of a child in a job comes through the completion port */
+    gei->job = job;
+    if (!job) {
+        guest_exec_source_attach(g_child_watch_source_new(pid),
+                                 (GSourceFunc)guest_exec_child_watch, gei,
+                                 ctx);
+    }
+#else
+    guest_exec_source_attach(g_child_watch_source_new(pid),
+                             (GSourceFunc)guest_exec_child_watch, gei, ctx);
+#endif
+
+    if (timeout_ms > 0) {
+        gei->deadline = g_get_monotonic_time() + timeout_ms * 1000;
+        gei->timeout = g_timeout_source_new(timeout_ms);
+        g_source_set_callback(gei->timeout, guest_exec_timeout, gei, NULL);
+        g_source_attach(gei->timeout, ctx);
+    }
+
+    if (has_input) {
+        gei->has_input = true;
+        if (input_data) {
+            gei->in.data = qemu_base64_decode(input_data, &gei->in.size);
+        }
+        gei->in.stream = input_stream;
+        in_ch = guest_exec_channel_new(in_fd);
+        g_io_channel_set_flags(in_ch, G_IO_FLAG_NONBLOCK, NULL);
+        gei->in.ch = in_ch;
+        gei->in.ctx = ctx;
+        guest_exec_input_start(&gei->in);
+    }
+
+    if (has_output) {
+        gei->out.limit = output_limit;
+        gei->err.limit = output_limit;
+        gei->out.ring = gei->err.ring = output_ring;
+        out_ch = guest_exec_channel_new(out_fd);
+        err_ch = guest_exec_channel_new(err_fd);
+        gei->out.ch = out_ch;
+        gei->err.ch = err_ch;
+        guest_exec_watch(out_ch, G_IO_IN | G_IO_HUP, guest_exec_output_watch,
+                         &gei->out, ctx);
+        guest_exec_watch(err_ch, G_IO_IN | G_IO_HUP, guest_exec_output_watch,
+                         &gei->err, ctx);
+    }
+
+    return gei;
+}
+
+#if !defined(G_OS_WIN32)
+/* guest-upgrade-agent hands over processes nothing is waiting on */
+bool ga_exec_handoff_check(Error **errp)
+{
+    GuestExecInfo *gei;
+
+    QTAILQ_FOREACH(gei, &guest_exec_state.processes, next) {
+        if (gei->done || gei->waiter || gei->in.writer) {
+            error_setg(errp, "guest-exec processes are being waited on");
+            return false;
+        }
+    }
+    return true;
+}
+
+/* what is buffered for @p, oldest first; for stdin, what is left to write */
+static guchar *guest_exec_io_copy(GuestExecIOData *p, gsize *len)
+{
+    guchar *buf;
+    gsize first;
+
+    if (p == &p->gei->in) {
+        *len = p->size - p->length;
+        return g_memdup(p->data + p->length, *len);
+    }
+    *len = p->length;
+    if (!p->ring) {
+        return g_memdup(p->data, *len);
+    }
+    buf = g_malloc(MAX(*len, 1));
+    first = MIN(*len, p->size - p->head);
+    if (*len) {
+        memcpy(buf, p->data + p->head, first);
+        memcpy(buf + first, p->data, *len - first);
+    }
+    return buf;
+}
+
+static void guest_exec_io_save(GAHandoff *h, GuestExecIOData *p,
+                               const char *group)
+{
+    guchar *data;
+    gsize len;
+
+    g_key_file_set_boolean(h->keyfile, group, "closed", p->closed);
+    if (p->ch) {
+        g_key_file_set_integer(h->keyfile, group, "fd",
+                               g_io_channel_unix_get_fd(p->ch));
+        ga_handoff_keep_fd(h, g_io_channel_unix_get_fd(p->ch));
+    }
+    g_key_file_set_boolean(h->keyfile, group, "stream", p->stream);
+    g_key_file_set_boolean(h->keyfile, group, "eof", p->eof);
+    g_key_file_set_boolean(h->keyfile, group, "truncated", p->truncated);
+    g_key_file_set_boolean(h->keyfile, group, "ring", p->ring);
+    ga_handoff_set_int64(h, group, "limit", p->limit);
+    ga_handoff_set_int64(h, group, "offset", p->offset);
+    ga_handoff_set_int64(h, group, "dropped", p->dropped);
+    data = guest_exec_io_copy(p, &len);
+    ga_handoff_set_data(h, group, "data", data, len);
+    g_free(data);
+}
+
+void ga_exec_handoff_save(GAHandoff *h)
+{
+    GuestExecInfo *gei;
+    gchar *group, *io;
+
+    QTAILQ_FOREACH(gei, &guest_exec_state.processes, next) {
+        group = g_strdup_printf("exec %" PRId64, gei->pid_numeric);
+        g_key_file_set_integer(h->keyfile, group, "status", gei->status);
+        g_key_file_set_boolean(h->keyfile, group, "finished", gei->finished);
+        g_key_file_set_boolean(h->keyfile, group, "timed-out",
+                               gei->timed_out);
+        if (gei->timeout) {
+            ga_handoff_set_int64(h, group, "deadline", gei->deadline);
+        }
+        g_key_file_set_boolean(h->keyfile, group, "has-input",
+                               gei->has_input);
+        g_key_file_set_boolean(h->keyfile, group, "has-output",
+                               gei->has_output);
+        if (gei->has_input) {
+            io = g_strconcat(group, " in", NULL);
+            guest_exec_io_save(h, &gei->in, io);
+            g_free(io);
+        }
+        if (gei->has_output) {
+            io = g_strconcat(group, " out", NULL);
+            guest_exec_io_save(h, &gei->out, io);
+            g_free(io);
+            io = g_strconcat(group, " err", NULL);
+            guest_exec_io_save(h, &gei->err, io);
+            g_free(io);
+        }
+        g_free(group);
+    }
+}
+
+static void guest_exec_io_load(GAHandoff *h, GuestExecIOData *p,
+                               const char *group, bool input)
+{
+    GKeyFile *kf = h->keyfile;
+    guchar *data;
+    gsize len;
+
+    p->closed = g_key_file_get_boolean(kf, group, "closed", NULL);
+    p->stream = g_key_file_get_boolean(kf, group, "stream", NULL);
+    p->eof = g_key_file_get_boolean(kf, group, "eof", NULL);
+    p->ring = g_key_file_get_boolean(kf, group, "ring", NULL);
+    p->limit = ga_handoff_get_int64(h, group, "limit");
+    data = ga_handoff_get_data(h, group, "data", &len);
+    if (p->ring) {
+        if (len) {
+            guest_exec_ring_put(p, data, len);
+        }
+        g_free(data);
+    } else {
+        p->data = data;
+        p->size = len;
+        p->length = input ? 0 : len;
+    }
+    p->truncated = g_key_file_get_boolean(kf, group, "truncated", NULL);
+    p->offset = ga_handoff_get_int64(h, group, "offset");
+    p->dropped = ga_handoff_get_int64(h, group, "dropped");
+
+    if (p->closed || !g_key_file_has_key(kf, group, "fd", NULL)) {
+        return;
+    }
+    p->ch = guest_exec_channel_new(g_key_file_get_integer(kf, group, "fd",
+                                                          NULL));
+    qemu_set_cloexec(g_io_channel_unix_get_fd(p->ch));
+    if (input) {
+        g_io_channel_set_flags(p->ch, G_IO_FLAG_NONBLOCK, NULL);
+        guest_exec_input_start(p);
+    } else {
+        guest_exec_watch(p->ch, G_IO_IN | G_IO_HUP, guest_exec_output_watch,
+                         p, NULL);
+    }
+}
+
+void ga_exec_handoff_load(GAHandoff *h)
+{
+    gchar **groups = g_key_file_get_groups(h->keyfile, NULL);
+    GKeyFile *kf = h->keyfile;
+    GuestExecInfo *gei, *tmp;
+    int64_t deadline;
+    gchar *io;
+    GPid pid;
+    int i;
+
+    for (i = 0; groups[i]; i++) {
+        if (!g_str_has_prefix(groups[i], "exec ") ||
+            strchr(groups[i] + 5, ' ')) {
+            continue;
+        }
+        pid = g_ascii_strtoll(groups[i] + 5, NULL, 10);
+        gei = guest_exec_info_add(pid);
+        gei->status = g_key_file_get_integer(kf, groups[i], "status", NULL);
+        gei->finished = g_key_file_get_boolean(kf, groups[i], "finished",
+                                               NULL);
+        gei->timed_out = g_key_file_get_boolean(kf, groups[i], "timed-out",
+                                                NULL);
+        gei->has_input = g_key_file_get_boolean(kf, groups[i], "has-input",
+                                                NULL);
+        gei->has_output = g_key_file_get_boolean(kf, groups[i], "has-output",
+                                                 NULL);
+        if (!gei->finished) {
+            guest_exec_source_attach(g_child_watch_source_new(pid),
+                                     (GSourceFunc)guest_exec_child_watch,
+                                     gei, NULL);
+            deadline = ga_handoff_get_int64(h, groups[i], "deadline");
+            if (deadline) {
+                gei->deadline = deadline;
+                gei->timeout = g_timeout_source_new(
+                    MAX(deadline - g_get_monotonic_time(), 0) / 1000);
+                g_source_set_callback(gei->timeout, guest_exec_timeout, gei,
+                                      NULL);
+                g_source_attach(gei->timeout, NULL);
+            }
+        }
+        if (gei->has_input) {
+            io = g_strconcat(groups[i], " in", NULL);
+            guest_exec_io_load(h, &gei->in, io, true);
+            g_free(io);
+        }
+        if (gei->has_output) {
+            io = g_strconcat(groups[i], " out", NULL);
+            guest_exec_io_load(h, &gei->out, io, false);
+            g_free(io);
+            io = g_strconcat(groups[i], " err", NULL);
+            guest_exec_io_load(h, &gei->err, io, false);
+            g_free(io);
+        }
+    }
+    g_strfreev(groups);
+
+    /* start the countdown to forgetting those that are done */
+    QTAILQ_FOREACH_SAFE(gei, &guest_exec_state.processes, next, tmp) {
+        guest_exec_info_exited(gei);
+    }
+}
+#endif
+
+static bool guest_exec_check_limits(GuestExecLimits *limits, Error **errp)
+{
+#ifdef G_OS_WIN32
+    /* a job object has no equivalent for these */
+    const char *unsupported = limits->has_cgroup ? "cgroup" :
+                              limits->has_max_files ? "max-files" :
+                              limits->has_ionice_class ? "ionice-class" :
+                              limits->has_ionice_level ? "ionice-level" :
+                              NULL;
+
+    if (unsupported) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, unsupported,
+                   "a limit supported by Windows");
+        return false;
+    }
+#else
+    char *procs;
+    bool ok;
+
+    if (limits->has_cgroup) {
+        procs = g_build_filename(limits->cgroup, "cgroup.procs", NULL);
+        ok = g_path_is_absolute(limits->cgroup) &&
+             g_file_test(procs, G_FILE_TEST_IS_REGULAR);
+        g_free(procs);
+        if (!ok) {
+            error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "cgroup",
+                       "the absolute path of a cgroup directory");
+            return false;
+        }
+    }
+#endif
+    if (limits->has_max_memory && limits->max_memory <= 0) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "max-memory",
+                   "a positive number of bytes");
+        return false;
+    }
+    if (limits->has_max_files && limits->max_files <= 0) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "max-files",
+                   "a positive number");
+        return false;
+    }
+    if (limits->has_nice && (limits->nice < -20 || limits->nice > 19)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "nice",
+                   "a number between -20 and 19");
+        return false;
+    }
+    if (limits->has_ionice_level &&
+        (limits->ionice_level < 0 || limits->ionice_level > 7 ||
+         !limits->has_ionice_class ||
+         limits->ionice_class != GUEST_EXEC_IONICE_CLASS_BEST_EFFORT)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "ionice-level",
+                   "a number between 0 and 7, with class best-effort");
+        return false;
+    }
+    return true;
+}
+
+GuestExec *qmp_guest_exec(const char *path,
+                       bool has_arg, strList *arg,
+                       bool has_env, strList *env,
+                       bool has_input_data, const char *input_data,
+                       bool has_capture_output, bool capture_output,
+                       bool has_output_buffer, int64_t output_buffer,
+                       bool has_capture_to_file, const char *capture_to_file,
+                       bool has_limits, GuestExecLimits *limits,
+                       bool has_input_stream, bool input_stream,
+                       Error **err)
+{
+    GuestExec *ge = NULL;
+    GuestExecInfo *gei;
+    char **argv, **envp;
+    strList arglist;
+    bool has_output = (has_capture_output && capture_output) ||
+                      has_output_buffer;
+    gsize output_limit = GUEST_EXEC_MAX_OUTPUT;
+    int output_fd = -1;
+
+    if (has_output_buffer) {
+        if (output_buffer < GUEST_EXEC_IO_SIZE ||
+            output_buffer > GUEST_EXEC_MAX_OUTPUT) {
+            error_setg(err, QERR_INVALID_PARAMETER_VALUE, "output-buffer",
+                       "a number of bytes between 4096 and 16M");
+            return NULL;
+        }
+        output_limit = output_buffer;
+    }
+    if (has_limits && !guest_exec_check_limits(limits, err)) {
+        return NULL;
+    }
+    if (has_capture_to_file) {
+#ifdef G_OS_WIN32
+        error_setg(err, QERR_UNSUPPORTED);
+        return NULL;
+#else
+        if (has_output) {
+            error_setg(err, "capture-to-file cannot be combined with "
+                       "capture-output or output-buffer");
+            return NULL;
+        }
+        output_fd = qemu_open(capture_to_file,
+                              O_WRONLY | O_CREAT | O_TRUNC,
+                              S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+        if (output_fd < 0) {
+            error_setg_errno(err, errno, "failed to open file '%s'",
+                             capture_to_file);
+            return NULL;
+        }
+#endif
+    }
+
+    arglist.value = (char *)path;
+    arglist.next = has_arg ? arg : NULL;
+
+    argv = guest_exec_get_args(&arglist, true);
+    envp = guest_exec_get_args(has_env ? env : NULL, false);
+
+    gei = guest_exec_spawn(argv, envp, G_SPAWN_SEARCH_PATH,
+                           has_input_data ? input_data : NULL,
+                           has_input_stream && input_stream, has_output,
+                           output_limit, has_output_buffer, output_fd,
+                           has_limits ? limits : NULL, 0, NULL, err);
+    if (gei) {
+        ge = g_new0(GuestExec, 1);
+        ge->pid = gei->pid_numeric;
+    }
+    if (output_fd >= 0) {
+        close(output_fd);
+    }
+
+    g_free(argv);
+    g_free(envp);
+
+    return ge;
+}
+
+GuestExecWrite *qmp_guest_exec_write(int64_t pid, const char *data,
+                                     bool has_eof, bool eof, Error **err)
+{
+    GuestExecInfo *gei = guest_exec_info_find(pid);
+    GuestExecIOData *p;
+    GuestExecWrite *gew;
+    guchar *buf;
+    size_t len, pending;
+
+    if (!gei) {
+        error_setg(err, QERR_INVALID_PARAMETER, "pid");
+        return NULL;
+    }
+    p = &gei->in;
+    if (!p->stream) {
+        error_setg(err, "guest-exec-write needs a process started with "
+                   "input-stream");
+        return NULL;
+    }
+    if (!p->ch || p->eof) {
+        error_setg(err, "stdin of the process is closed");
+        return NULL;
+    }
+    pending = p->size - p->length;
+    if (p->writer || pending >= GUEST_EXEC_WRITE_BUFFER) {
+        error_setg(err, "the process has not read the data written before, "
+                   "wait for the previous guest-exec-write");
+        return NULL;
+    }
+
+    buf = qemu_base64_decode(data, &len);
+    if (len) {
+        /* drop what was written already, then append */
+        if (p->length) {
+            memmove(p->data, p->data + p->length, pending);
+        }
+        p->data = g_realloc(p->data, pending + len);
+        memcpy(p->data + pending, buf, len);
+        p->size = pending + len;
+        p->length = 0;
+        pending = p->size;
+    }
+    g_free(buf);
+    p->eof = has_eof && eof;
+    if (len || p->eof) {
+        guest_exec_input_start(p);
+    }
+
+    /* back-pressure: answer once there is room for the next write */
+    if (pending >= GUEST_EXEC_WRITE_BUFFER) {
+        p->writer = ga_defer_response(ga_state);
+        if (p->writer) {
+            return NULL;
+        }
+    }
+
+    gew = g_new0(GuestExecWrite, 1);
+    gew->pending = pending;
+    return gew;
+}
+
+GuestExecRead *qmp_guest_exec_read(int64_t pid, GuestExecStream stream,
+                                  bool has_max_bytes, int64_t max_bytes,
+                                  Error **err)
+{
+    GuestExecInfo *gei = guest_exec_info_find(pid);
+    GuestExecIOData *p;
+    GuestExecRead *ger;
+    guchar *buf, *compressed;
+    size_t len;
+
+    if (!gei) {
+        error_setg(err, QERR_INVALID_PARAMETER, "pid");
+        return NULL;
+    }
+    p = stream == GUEST_EXEC_STREAM_ERR ? &gei->err : &gei->out;
+    if (!p->ring) {
+        error_setg(err, "guest-exec-read needs a process started with "
+                   "output-buffer");
+        return NULL;
+    }
+    if (!has_max_bytes) {
+        max_bytes = p->length;
+    } else if (max_bytes < 0) {
+        error_setg(err, QERR_INVALID_PARAMETER_VALUE, "max-bytes",
+                   "a non-negative number");
+        return NULL;
+    }
+
+    ger = g_new0(GuestExecRead, 1);
+    ger->offset = p->offset;
+    ger->dropped = p->dropped;
+    ger->count = MIN(max_bytes, p->length);
+    buf = guest_exec_ring_take(p, ger->count);
+    ger->eof = g_atomic_int_get(&p->closed) && !p->length;
+
+    compressed = ga_compress(ga_state, buf, ger->count, &len);
+    if (compressed) {
+        g_free(buf);
+        buf = compressed;
+        ger->has_compressed = ger->compressed = true;
+    } else {
+        len = ger->count;
+    }
+    if (ga_is_framed(ga_state)) {
+        ga_set_response_attachment(ga_state, buf, len);
+        buf = NULL;
+    } else {
+        ger->has_buf_b64 = true;
+        ger->buf_b64 = qemu_base64_encode(buf, len);
+    }
+    g_free(buf);
+    return ger;
+}
+
+/*UserCheck*/
+/*########################################################################################################*/
+/* Default timeout and output limit of guest-user-check */
+#define GUEST_USER_CHECK_TIMEOUT 2
+#define GUEST_USER_CHECK_OUTPUT (64 * 1024)
+
+/*
+ * Run a check command.  @command is a shell command line unless @arg is
+ * given, in which case it is the program to run directly with the
+ * arguments in @arg.  By default the agent waits for the command, a
+ * private main context serving only its own watches; with @wait=false
+ * the pid is returned at once for use with guest-exec-status.
+ */
+struct UserCheck *qmp_guest_user_check(const char *command_name,
+                                       const char *command,
+                                       bool has_arg, strList *arg,
+                                       bool has_timeout, int64_t timeout,
+                                       bool has_output_limit,
+                                       int64_t output_limit,
+                                       bool has_wait, bool wait,
+                                       Error **errp)
+{
+    UserCheck *check;
+    GuestExecInfo *gei;
+    GMainContext *ctx = NULL;
+    char *shell_argv[] = { (char *)"/bin/sh", (char *)"-c",
+                           (char *)command, NULL };
+    char **argv = shell_argv;
+    strList arglist;
+
+    if (!has_timeout) {
+        timeout = GUEST_USER_CHECK_TIMEOUT;
+    }
+    if (!has_output_limit) {
+        output_limit = GUEST_USER_CHECK_OUTPUT;
+    }
+    if (!has_wait) {
+        wait = true;
+    }
+    /* never block the agent forever */
+    if (timeout < 0 || (wait && timeout == 0) ||
+        timeout > INT64_MAX / 1000) {
+        error_setg(errp, "value '%" PRId64 "' is invalid for argument timeout",
+                   timeout);
+        return NULL;
+    }
+    if (output_limit < 0 || output_limit > GUEST_EXEC_MAX_OUTPUT) {
+        error_setg(errp, "value '%" PRId64 "' is invalid for argument "
+                   "output-limit", output_limit);
+        return NULL;
+    }
+
+    slog("guest-user-check called: %s", command_name);
+
+    if (has_arg) {
+        arglist.value = (char *)command;
+        arglist.next = arg;
+        argv = guest_exec_get_args(&arglist, false);
+    }
+    if (wait) {
+        ctx = g_main_context_new();
+    }
+
+    gei = guest_exec_spawn(argv, NULL, has_arg ? G_SPAWN_SEARCH_PATH : 0,
+                           NULL, false, true, output_limit, false, -1, NULL,
+                           timeout * 1000,
+                           ctx, errp);
+    if (argv != shell_argv) {
+        g_free(argv);
+    }
+    if (!gei) {
+        if (ctx) {
+            g_main_context_unref(ctx);
+        }
+        return NULL;
+    }
+
+    check = g_new0(UserCheck, 1);
+    check->command_name = g_strdup(command_name);
+
+    if (!wait) {
+        check->result = g_strdup("");
+        check->has_pid = true;
+        check->pid = gei->pid_numeric;
+        return check;
+    }
+
+    while (!guest_exec_info_finished(gei)) {
+        g_main_context_iteration(ctx, true);
+    }
+    g_main_context_unref(ctx);
+
+    check->result = g_strndup((gchar *)gei->out.data, gei->out.length);
+    check->has_truncated = gei->out.truncated;
+    check->truncated = gei->out.truncated;
+    check->has_timed_out = gei->timed_out;
+    check->timed_out = gei->timed_out;
+    guest_exec_decode_status(gei->status,
+                             &check->has_exitcode, &check->exitcode,
+                             &check->has_signal, &check->signal);
+
+    guest_exec_info_remove(gei);
+    return check;
+}
+/*########################################################################################################*/
+
+/*Batch*/
+/*########################################################################################################*/
+static GuestBatchError *guest_batch_error(Error *err)
+{
+    GuestBatchError *e = g_new0(GuestBatchError, 1);
+
+    e->q_class = g_strdup(ErrorClass_lookup[error_get_class(err)]);
+    e->desc = g_strdup(error_get_pretty(err));
+    error_free(err);
+    return e;
+}
+
+/* go through qmp_dispatch() so that disabled commands stay disabled */
+static GuestBatchResult *guest_batch_run(GuestBatchCommand *cmd)
+{
+    GuestBatchResult *result = g_new0(GuestBatchResult, 1);
+    Error *local_err = NULL;
+    QDict *req, *rsp, *err;
+    QObject *obj;
+
+    if (!strcmp(cmd->execute, "guest-batch") ||
+        !strcmp(cmd->execute, "guest-sync-delimited")) {
+        error_setg(&local_err, "The command %s cannot be batched",
+                   cmd->execute);
+    } else if (cmd->has_arguments &&
+               qobject_type(cmd->arguments) != QTYPE_QDICT) {
+        error_setg(&local_err, QERR_INVALID_PARAMETER_TYPE, "arguments",
+                   "object");
+    }
+    if (local_err) {
+        result->has_error = true;
+        result->error = guest_batch_error(local_err);
+        return result;
+    }
+
+    req = qdict_new();
+    qdict_put(req, "execute", qstring_from_str(cmd->execute));
+    if (cmd->has_arguments) {
+        qobject_incref(cmd->arguments);
+        qdict_put_obj(req, "arguments", cmd->arguments);
+    }
+    /* results go into the batch response, they cannot be attachments */
+    ga_set_nested_dispatch(ga_state, true);
+    obj = qmp_dispatch(QOBJECT(req));
+    ga_set_nested_dispatch(ga_state, false);
+    QDECREF(req);
+    if (!obj) {
+        return result;
+    }
+
+    rsp = qobject_to_qdict(obj);
+    if (qdict_haskey(rsp, "return")) {
+        result->has_q_return = true;
+        result->q_return = qdict_get(rsp, "return");
+        qobject_incref(result->q_return);
+    } else {
+        err = qdict_get_qdict(rsp, "error");
+        result->has_error = true;
+        result->error = g_new0(GuestBatchError, 1);
+        result->error->q_class = g_strdup(qdict_get_str(err, "class"));
+        result->error->desc = g_strdup(qdict_get_str(err, "desc"));
+    }
+    qobject_decref(obj);
+    return result;
+}
+
+GuestBatchResultList *qmp_guest_batch(GuestBatchCommandList *commands,
+                                      Error **errp)
+{
+    GuestBatchResultList *head = NULL, **tail = &head;
+
+    for (; commands; commands = commands->next) {
+        *tail = g_new0(GuestBatchResultList, 1);
+        (*tail)->value = guest_batch_run(commands->value);
+        tail = &(*tail)->next;
+    }
+    return head;
+}
+
+#define GUEST_EXEC_BATCH_MAX 256
+#define GUEST_EXEC_BATCH_PARALLEL_DEFAULT 4
+#define GUEST_EXEC_BATCH_PARALLEL_MAX 64
+#define GUEST_EXEC_BATCH_OUTPUT_DEFAULT (64 * 1024)
+
+typedef struct GuestExecBatch GuestExecBatch;
+
+typedef struct GuestExecBatchJob {
+    GuestExecBatch *batch;
+    char **argv;
+    char **envp;
+    char *input_data;
+    GuestExecBatchResult *result;
+} GuestExecBatchJob;
+
+/* a guest-exec-batch in progress, the arguments copied since it may
+ * outlive its request */
+struct GuestExecBatch {
+    GuestExecBatchJob *jobs;
+    int count;
+    int started;
+    int running;
+    int finished;
+    int max_parallel;
+    int64_t timeout_ms;
+    gsize output_limit;
+    GAPendingResponse *pending;
+    GMainContext *ctx;          /* private if there is no pending */
+};
+
+static char **guest_exec_batch_strv(const char *first, strList *list)
+{
+    GPtrArray *arr = g_ptr_array_new();
+
+    if (first) {
+        g_ptr_array_add(arr, g_strdup(first));
+    }
+    for (; list; list = list->next) {
+        g_ptr_array_add(arr, g_strdup(list->value));
+    }
+    g_ptr_array_add(arr, NULL);
+    return (char **)g_ptr_array_free(arr, false);
+}
+
+static void guest_exec_batch_free(GuestExecBatch *batch)
+{
+    int i;
+
+    for (i = 0; i < batch->count; i++) {
+        g_strfreev(batch->jobs[i].argv);
+        g_strfreev(batch->jobs[i].envp);
+        g_free(batch->jobs[i].input_data);
+        qapi_free_GuestExecBatchResult(batch->jobs[i].result);
+    }
+    g_free(batch->jobs);
+    g_free(batch);
+}
+
+/* hands the results over */
+static GuestExecBatchResultList *guest_exec_batch_results(
+    GuestExecBatch *batch)
+{
+    GuestExecBatchResultList *head = NULL, **tail = &head;
+    int i;
+
+    for (i = 0; i < batch->count; i++) {
+        *tail = g_new0(GuestExecBatchResultList, 1);
+        (*tail)->value = batch->jobs[i].result;
+        batch->jobs[i].result = NULL;
+        tail = &(*tail)->next;
+    }
+    return head;
+}
+
+/* the answer to a deferred guest-exec-batch, for ga_complete_response() */
+static QObject *guest_exec_batch_answer(void *opaque, Error **errp)
+{
+    GuestExecBatchResultList *results = guest_exec_batch_results(opaque);
+    JsonOutputVisitor *jov = json_output_visitor_new();
+    QObject *ret = NULL;
+    Error *err = NULL;
+
+    visit_type_GuestExecBatchResultList(json_output_get_visitor(jov),
+                                        &results, "unused", &err);
+    if (!err) {
+        ret = json_output_get_qobject(jov);
+    }
+    error_propagate(errp, err);
+    json_output_visitor_cleanup(jov);
+    qapi_free_GuestExecBatchResultList(results);
+    return ret;
+}
+
+static void guest_exec_batch_start(GuestExecBatch *batch);
+
+static void guest_exec_batch_done(GuestExecInfo *gei, void *opaque)
+{
+    GuestExecBatchJob *job = opaque;
+    GuestExecBatch *batch = job->batch;
+    GuestExecBatchResult *r = job->result;
+
+    guest_exec_decode_status(gei->status, &r->has_exitcode, &r->exitcode,
+                             &r->has_signal, &r->signal);
+    if (gei->out.length) {
+        r->has_out_data = true;
+        r->out_data = qemu_base64_encode(gei->out.data, gei->out.length);
+    }
+    if (gei->err.length) {
+        r->has_err_data = true;
+        r->err_data = qemu_base64_encode(gei->err.data, gei->err.length);
+    }
+    r->has_out_truncated = r->out_truncated = gei->out.truncated;
+    r->has_err_truncated = r->err_truncated = gei->err.truncated;
+    r->has_timed_out = r->timed_out = gei->timed_out;
+    guest_exec_info_remove(gei);
+
+    batch->running--;
+    batch->finished++;
+    guest_exec_batch_start(batch);
+}
+
+/* start commands until @max_parallel run, answering once all are done */
+static void guest_exec_batch_start(GuestExecBatch *batch)
+{
+    GuestExecBatchJob *job;
+    GuestExecInfo *gei;
+    Error *local_err = NULL;
+
+    while (batch->running < batch->max_parallel &&
+           batch->started < batch->count) {
+        job = &batch->jobs[batch->started++];
+        gei = guest_exec_spawn(job->argv, job->envp, G_SPAWN_SEARCH_PATH,
+                               job->input_data, false, true,
+                               batch->output_limit, false, -1, NULL,
+                               batch->timeout_ms,
+                               batch->ctx, &local_err);
+        if (!gei) {
+            job->result->has_error = true;
+            job->result->error = guest_batch_error(local_err);
+            local_err = NULL;
+            batch->finished++;
+            continue;
+        }
+        gei->done = guest_exec_batch_done;
+        gei->done_opaque = job;
+        batch->running++;
+    }
+
+    if (batch->finished == batch->count && batch->pending) {
+        ga_complete_response(ga_state, batch->pending,
+                             guest_exec_batch_answer, batch);
+        guest_exec_batch_free(batch);
+    }
+}
+
+GuestExecBatchResultList *qmp_guest_exec_batch(
+    GuestExecBatchCommandList *commands,
+    bool has_max_parallel, int64_t max_parallel,
+    bool has_timeout, int64_t timeout,
+    bool has_output_limit, int64_t output_limit,
+    Error **errp)
+{
+    GuestExecBatchCommandList *l;
+    GuestExecBatchResultList *results;
+    GuestExecBatch *batch;
+    GuestExecBatchCommand *cmd;
+    int count = 0, i;
+
+    for (l = commands; l; l = l->next) {
+        count++;
+    }
+    if (!count || count > GUEST_EXEC_BATCH_MAX) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "commands",
+                   "a list of 1 to 256 commands");
+        return NULL;
+    }
+    if (!has_max_parallel) {
+        max_parallel = GUEST_EXEC_BATCH_PARALLEL_DEFAULT;
+    } else if (max_parallel < 1 ||
+               max_parallel > GUEST_EXEC_BATCH_PARALLEL_MAX) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "max-parallel",
+                   "a number between 1 and 64");
+        return NULL;
+    }
+    if (!has_timeout) {
+        timeout = 0;
+    } else if (timeout < 0 || timeout > INT64_MAX / 1000) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "timeout",
+                   "a non-negative number of seconds");
+        return NULL;
+    }
+    if (!has_output_limit) {
+        output_limit = GUEST_EXEC_BATCH_OUTPUT_DEFAULT;
+    } else if (output_limit < 0 || output_limit > GUEST_EXEC_MAX_OUTPUT) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "output-limit",
+                   "a number of bytes up to 16M");
+        return NULL;
+    }
+
+    slog("guest-exec-batch called, %d commands", count);
+
+    batch = g_new0(GuestExecBatch, 1);
+    batch->jobs = g_new0(GuestExecBatchJob, count);
+    batch->count = count;
+    batch->max_parallel = max_parallel;
+    batch->timeout_ms = timeout * 1000;
+    batch->output_limit = output_limit;
+    for (i = 0, l = commands; l; i++, l = l->next) {
+        cmd = l->value;
+        batch->jobs[i].batch = batch;
+        batch->jobs[i].argv = guest_exec_batch_strv(cmd->path,
+                                                    cmd->has_arg ? cmd->arg
+                                                                 : NULL);
+        batch->jobs[i].envp = cmd->has_env ?
+                              guest_exec_batch_strv(NULL, cmd->env) : NULL;
+        batch->jobs[i].input_data = g_strdup(cmd->has_input_data ?
+                                             cmd->input_data : NULL);
+        batch->jobs[i].result = g_new0(GuestExecBatchResult, 1);
+    }
+
+    batch->pending = ga_defer_response(ga_state);
+    if (batch->pending) {
+        /* the answer comes from guest_exec_batch_start() */
+        guest_exec_batch_start(batch);
+        return NULL;
+    }
+
+    /* never block the agent forever */
+    if (!timeout) {
+        guest_exec_batch_free(batch);
+        error_setg(errp, "guest-exec-batch needs a request id or a timeout");
+        return NULL;
+    }
+    batch->ctx = g_main_context_new();
+    guest_exec_batch_start(batch);
+    while (batch->finished < batch->count) {
+        g_main_context_iteration(batch->ctx, true);
+    }
+    g_main_context_unref(batch->ctx);
+
+    results = guest_exec_batch_results(batch);
+    guest_exec_batch_free(batch);
+    return results;
+}
+/*########################################################################################################*/
+
+/*FileChecksum*/
+/*########################################################################################################*/
+#define GUEST_FILE_CHECKSUM_BLOCK_DEFAULT (1024 * 1024)
+#define GUEST_FILE_CHECKSUM_BLOCKS_MAX (1024 * 1024)
+#define GUEST_FILE_CHECKSUM_READ_SIZE (1024 * 1024)
+
+/* read as much of @len as there is, 0 at the end of the file */
+static ssize_t guest_file_read_full(int fd, guchar *buf, size_t len)
+{
+    size_t done = 0;
+    ssize_t ret;
+
+    while (done < len) {
+        ret = read(fd, buf + done, len - done);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret < 0) {
+            return -errno;
+        }
+        if (ret == 0) {
+            break;
+        }
+        done += ret;
+    }
+    return done;
+}
+
+GuestFileChecksum *qmp_guest_file_checksum(const char *path, bool has_offset,
+                                           int64_t offset, bool has_length,
+                                           int64_t length,
+                                           bool has_block_size,
+                                           int64_t block_size, Error **errp)
+{
+    GuestFileChecksum *sums = NULL;
+    GAReader *reader = NULL;
+    intList **tail;
+    const guchar *data = NULL;
+    size_t data_len = 0;
+    struct stat st;
+    int64_t left, want, done;
+    uint32_t crc;
+    ssize_t n;
+    int fd;
+
+    if (!has_offset) {
+        offset = 0;
+    } else if (offset < 0) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "offset",
+                   "a non-negative number");
+        return NULL;
+    }
+    if (!has_length) {
+        length = INT64_MAX;
+    } else if (length < 0) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "length",
+                   "a non-negative number");
+        return NULL;
+    }
+    if (!has_block_size) {
+        block_size = GUEST_FILE_CHECKSUM_BLOCK_DEFAULT;
+    } else if (block_size < 1) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "block-size",
+                   "a positive number");
+        return NULL;
+    }
+
+    slog("guest-file-checksum called, filepath: %s", path);
+    fd = qemu_open(path, O_RDONLY | O_BINARY);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "failed to open file '%s'", path);
+        return NULL;
+    }
+    if (fstat(fd, &st) < 0) {
+        error_setg_errno(errp, errno, "failed to stat file '%s'", path);
+        goto out;
+    }
+    /* the range ends at the end of the file */
+    if (offset < st.st_size) {
+        length = MIN(length, st.st_size - offset);
+    } else {
+        length = 0;
+    }
+    if (length / block_size >= GUEST_FILE_CHECKSUM_BLOCKS_MAX) {
+        error_setg(errp, "the range has more than %d blocks, use a larger "
+                   "block-size", GUEST_FILE_CHECKSUM_BLOCKS_MAX);
+        goto out;
+    }
+
+    sums = g_new0(GuestFileChecksum, 1);
+    sums->size = st.st_size;
+    sums->offset = offset;
+    sums->block_size = block_size;
+    tail = &sums->crc32c;
+    reader = ga_reader_new(fd, offset, length,
+                           MIN(block_size, GUEST_FILE_CHECKSUM_READ_SIZE));
+
+    /* a block is read in pieces of at most 1MB, chaining the CRC */
+    for (left = length; left > 0; left -= want) {
+        if (ga_worker_cancelled()) {
+            error_setg(errp, "guest-file-checksum cancelled");
+            goto fail;
+        }
+        want = MIN(left, block_size);
+        crc = 0xffffffff;
+        for (done = 0; done < want; done += n) {
+            if (!data_len) {
+                n = ga_reader_next(reader, &data);
+                if (n < 0) {
+                    error_setg_errno(errp, -n, "failed to read file '%s'",
+                                     path);
+                    goto fail;
+                }
+                if (n == 0) {
+                    break;
+                }
+                data_len = n;
+            }
+            /* pieces of the reader's size, a block may end inside one */
+            n = MIN(want - done, data_len);
+            crc = crc32c(crc, data, n) ^ 0xffffffff;
+            data += n;
+            data_len -= n;
+        }
+        /* the file shrank meanwhile, the last block is what there was */
+        if (!done) {
+            break;
+        }
+        *tail = g_new0(intList, 1);
+        (*tail)->value = crc ^ 0xffffffff;
+        tail = &(*tail)->next;
+        if (done < want) {
+            break;
+        }
+    }
+    goto out;
+
+fail:
+    qapi_free_GuestFileChecksum(sums);
+    sums = NULL;
+out:
+    ga_reader_free(reader);
+    close(fd);
+    return sums;
+}
+/*########################################################################################################*/
+
+/*FileSearch*/
+/*########################################################################################################*/
+#define GUEST_FILE_SEARCH_MATCHES_DEFAULT 100
+#define GUEST_FILE_SEARCH_MATCHES_MAX 10000
+#define GUEST_FILE_SEARCH_CHUNK (64 * 1024)
+/* longer lines are cut into pieces of about this size */
+#define GUEST_FILE_SEARCH_LINE_MAX (64 * 1024)
+
+typedef struct GuestFileSearcher {
+    const char *literal;        /* case-sensitive text, or */
+    size_t literal_len;
+    GRegex *regex;              /* anything else, NULL for all lines */
+    guint max_matches;
+    GPtrArray *found;           /* GuestFileMatch, in the order seen */
+} GuestFileSearcher;
+
+/* memchr() for the first character is what makes this fast */
+static bool guest_file_search_literal(const guchar *line, size_t len,
+                                      const char *text, size_t text_len)
+{
+    const guchar *p = line, *end = line + len;
+
+    while ((size_t)(end - p) >= text_len &&
+           (p = memchr(p, text[0], end - p - text_len + 1))) {
+        if (!memcmp(p, text, text_len)) {
+            return true;
+        }
+        p++;
+    }
+    return false;
+}
+
+static bool guest_file_search_match(GuestFileSearcher *s, const guchar *line,
+                                    size_t len)
+{
+    if (s->literal) {
+        return guest_file_search_literal(line, len, s->literal,
+                                         s->literal_len);
+    }
+    if (s->regex) {
+        return g_regex_match_full(s->regex, (const gchar *)line, len, 0, 0,
+                                  NULL, NULL);
+    }
+    return true;
+}
+
+static void guest_file_search_add(GuestFileSearcher *s, int64_t offset,
+                                  const guchar *line, size_t len)
+{
+    GuestFileMatch *match = g_new0(GuestFileMatch, 1);
+
+    match->offset = offset;
+    match->line = g_strndup((const gchar *)line, len);
+    g_ptr_array_add(s->found, match);
+}
+
+/*
+ * Look at the lines from @offset on, reading at most @max_bytes.  Returns
+ * where the first line not looked at starts, or -errno.
+ */
+static int64_t guest_file_search_forward(GuestFileSearcher *s, int fd,
+                                         int64_t offset, int64_t max_bytes)
+{
+    guchar *buf = g_malloc(GUEST_FILE_SEARCH_CHUNK +
+                           GUEST_FILE_SEARCH_LINE_MAX);
+    guchar *nl;
+    size_t len = 0, start, end;
+    int64_t pos = offset;       /* of buf[0] */
+    bool full = false;
+    ssize_t n;
+
+    if (lseek(fd, offset, SEEK_SET) < 0) {
+        pos = -errno;
+        goto out;
+    }
+    while (!full && max_bytes > 0 && !ga_worker_cancelled()) {
+        n = guest_file_read_full(fd, buf + len,
+                                 MIN(GUEST_FILE_SEARCH_CHUNK, max_bytes));
+        if (n <= 0) {
+            pos = n < 0 ? n : pos;
+            break;
+        }
+        len += n;
+        max_bytes -= n;
+
+        for (start = 0; ; start = nl ? end + 1 : end) {
+            nl = memchr(buf + start, '\n',
+                        MIN(len - start, GUEST_FILE_SEARCH_LINE_MAX));
+            if (nl) {
+                end = nl - buf;
+            } else if (len - start >= GUEST_FILE_SEARCH_LINE_MAX) {
+                end = start + GUEST_FILE_SEARCH_LINE_MAX;
+            } else {
+                break;
+            }
+            if (guest_file_search_match(s, buf + start, end - start)) {
+                if (s->found->len == s->max_matches) {
+                    full = true;
+                    break;
+                }
+                guest_file_search_add(s, pos + start, buf + start,
+                                      end - start);
+            }
+        }
+        /* a last line without a newline is left for the next search */
+        memmove(buf, buf + start, len - start);
+        len -= start;
+        pos += start;
+    }
+
+out:
+    g_free(buf);
+    return pos;
+}
+
+static guchar *guest_file_search_last_newline(guchar *buf, size_t len)
+{
+    while (len--) {
+        if (buf[len] == '\n') {
+            return buf + len;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Look at the lines of the last @max_bytes of the file, but not before
+ * @offset, from the end backwards until max_matches are found.  Returns
+ * the end of the last complete line, or -errno.
+ */
+static int64_t guest_file_search_tail(GuestFileSearcher *s, int fd,
+                                      int64_t offset, int64_t size,
+                                      int64_t max_bytes)
+{
+    guchar *buf = g_malloc(GUEST_FILE_SEARCH_CHUNK +
+                           GUEST_FILE_SEARCH_LINE_MAX);
+    int64_t limit = MAX(offset, size - max_bytes);
+    int64_t pos = MAX(size, limit);     /* of buf[0] */
+    int64_t next = -1;
+    size_t len = 0, k;
+    int err = 0;
+    guchar *nl;
+    ssize_t n;
+
+    while (!ga_worker_cancelled()) {
+        /* the lines that are complete in buf, last one first */
+        while ((nl = guest_file_search_last_newline(buf, len))) {
+            k = nl - buf;
+            if (next < 0) {
+                /* what follows the last newline is left out */
+                next = pos + k + 1;
+            } else if (guest_file_search_match(s, nl + 1, len - k - 1)) {
+                guest_file_search_add(s, pos + k + 1, nl + 1, len - k - 1);
+                if (s->found->len == s->max_matches) {
+                    goto out;
+                }
+            }
+            len = k;
+        }
+        /* the first line of the range, unless max_bytes cut it */
+        if (pos == limit) {
+            if (next >= 0 && limit == offset &&
+                guest_file_search_match(s, buf, len)) {
+                guest_file_search_add(s, pos, buf, len);
+            }
+            break;
+        }
+        if (len >= GUEST_FILE_SEARCH_LINE_MAX) {
+            if (next >= 0 && guest_file_search_match(s, buf, len)) {
+                guest_file_search_add(s, pos, buf, len);
+                if (s->found->len == s->max_matches) {
+                    break;
+                }
+            }
+            len = 0;
+        }
+
+        n = MIN(GUEST_FILE_SEARCH_CHUNK, pos - limit);
+        memmove(buf + n, buf, len);
+        pos -= n;
+        if (lseek(fd, pos, SEEK_SET) < 0) {
+            err = errno;
+            break;
+        }
+        n = guest_file_read_full(fd, buf, n);
+        if (n < 0) {
+            err = -n;
+            break;
+        }
+        len += n;
+    }
+
+out:
+    g_free(buf);
+    if (err) {
+        return -err;
+    }
+    return next < 0 ? limit : next;
+}
+
+GuestFileSearch *qmp_guest_file_search(const char *path, bool has_pattern,
+                                       const char *pattern, bool has_regex,
+                                       bool regex, bool has_ignore_case,
+                                       bool ignore_case, bool has_offset,
+                                       int64_t offset, bool has_tail,
+                                       bool tail, bool has_max_matches,
+                                       int64_t max_matches,
+                                       bool has_max_bytes, int64_t max_bytes,
+                                       Error **errp)
+{
+    GuestFileSearcher s = { 0 };
+    GuestFileSearch *result = NULL;
+    GuestFileMatchList **list, *elem;
+    GError *gerr = NULL;
+    char *escaped;
+    struct stat st;
+    int64_t next;
+    guint i;
+    int fd;
+
+    if (!has_offset) {
+        offset = 0;
+    } else if (offset < 0) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "offset",
+                   "a non-negative number");
+        return NULL;
+    }
+    if (!has_max_matches) {
+        max_matches = GUEST_FILE_SEARCH_MATCHES_DEFAULT;
+    } else if (max_matches < 1 ||
+               max_matches > GUEST_FILE_SEARCH_MATCHES_MAX) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "max-matches",
+                   "a number from 1 to 10000");
+        return NULL;
+    }
+    /* enough for the longest line, so that every search gets somewhere */
+    if (!has_max_bytes) {
+        max_bytes = INT64_MAX;
+    } else if (max_bytes < GUEST_FILE_SEARCH_LINE_MAX) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "max-bytes",
+                   "at least 65536");
+        return NULL;
+    }
+
+    regex = has_regex && regex;
+    ignore_case = has_ignore_case && ignore_case;
+    tail = has_tail && tail;
+    if (has_pattern && (regex || ignore_case)) {
+        escaped = regex ? NULL : g_regex_escape_string(pattern, -1);
+        s.regex = g_regex_new(escaped ?: pattern,
+                              G_REGEX_RAW | G_REGEX_OPTIMIZE |
+                              (ignore_case ? G_REGEX_CASELESS : 0), 0, &gerr);
+        g_free(escaped);
+        if (!s.regex) {
+            error_setg(errp, "invalid regex '%s': %s", pattern,
+                       gerr->message);
+            g_error_free(gerr);
+            return NULL;
+        }
+    } else if (has_pattern && *pattern) {
+        s.literal = pattern;
+        s.literal_len = strlen(pattern);
+    }
+    s.max_matches = max_matches;
+    s.found = g_ptr_array_new();
+
+    slog("guest-file-search called, filepath: %s", path);
+    fd = qemu_open(path, O_RDONLY | O_BINARY);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "failed to open file '%s'", path);
+        goto out;
+    }
+    if (fstat(fd, &st) < 0) {
+        error_setg_errno(errp, errno, "failed to stat file '%s'", path);
+        close(fd);
+        goto out;
+    }
+    if (tail) {
+        next = guest_file_search_tail(&s, fd, offset, st.st_size, max_bytes);
+    } else {
+        next = guest_file_search_forward(&s, fd, offset, max_bytes);
+    }
+    close(fd);
+    if (ga_worker_cancelled()) {
+        error_setg(errp, "guest-file-search cancelled");
+        goto out;
+    }
+    if (next < 0) {
+        error_setg_errno(errp, -next, "failed to read file '%s'", path);
+        goto out;
+    }
+
+    result = g_new0(GuestFileSearch, 1);
+    result->size = st.st_size;
+    result->next_offset = next;
+    /* the tail was found last line first */
+    list = &result->matches;
+    for (i = 0; i < s.found->len; i++) {
+        elem = g_new0(GuestFileMatchList, 1);
+        elem->value = g_ptr_array_index(s.found,
+                                        tail ? s.found->len - 1 - i : i);
+        *list = elem;
+        list = &elem->next;
+    }
+    g_ptr_array_set_size(s.found, 0);
+
+out:
+    for (i = 0; i < s.found->len; i++) {
+        qapi_free_GuestFileMatch(g_ptr_array_index(s.found, i));
+    }
+    g_ptr_array_free(s.found, true);
+    if (s.regex) {
+        g_regex_unref(s.regex);
+    }
+    return result;
 }
+/*########################################################################################################*/
@@ -0,0 +1,655 @@
+/*
+ * QEMU Guest Agent latency histograms from BPF programs
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include <glib.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+#include <linux/perf_event.h>
+#include "qga/guest-agent-core.h"
+#include "qapi/error.h"
+
+/*
+ * Small BPF programs on scheduler, block and TCP tracepoints note when
+ * something starts waiting in a hash map, and when it is done add how long
+ * it took to a log2 histogram: an array of GA_BPF_SLOTS counters, slot n
+ * counting waits from 2^n up to 2^(n+1) microseconds, slot 0 those below
+ * 2.  The counters only grow; the agent reads them when asked.
+ *
+ * Guests have neither a compiler nor BTF, so the programs are put together
+ * here an instruction at a time, with the offsets of the tracepoint fields
+ * taken from their format files.  A histogram whose tracepoints the kernel
+ * lacks is left out.
+ *
+ * run-queue: from sched_wakeup, sched_wakeup_new, or a task being switched
+ *            out while still runnable, to sched_switch to the task
+ * block-io:  from block_rq_issue to block_rq_complete of the same sector
+ * tcp:       tcp_retransmit_skb, only counted
+ */
+
+#define GA_BPF_PENDING_MAX  10240   /* waits followed at a time */
+
+/* stack slots of the programs, below the frame pointer */
+#define GA_BPF_STACK_KEY    -16     /* up to 16 bytes */
+#define GA_BPF_STACK_TIME   -24
+#define GA_BPF_STACK_SLOT   -32
+
+typedef struct GABpfProgram {
+    GArray *insns;              /* of struct bpf_insn */
+    GArray *exits;              /* jumps to the end, to patch */
+} GABpfProgram;
+
+typedef struct GABpfField {
+    int offset;
+    int size;
+} GABpfField;
+
+struct GABpf {
+    int start[GA_BPF_NHISTOGRAMS];  /* hash maps, of when waits began */
+    int slots[GA_BPF_NHISTOGRAMS];  /* array maps of the counters */
+    int tcp_retransmits;            /* array map of one counter */
+    GArray *fds;                    /* to close: maps, programs, events */
+    int64_t since;
+};
+
+static const char *ga_bpf_tracefs[] = {
+    "/sys/kernel/tracing", "/sys/kernel/debug/tracing",
+};
+
+static void ga_bpf_emit(GABpfProgram *p, uint8_t code, int dst, int src,
+                        int16_t off, int32_t imm)
+{
+    struct bpf_insn insn;
+
+    memset(&insn, 0, sizeof(insn));
+    insn.code = code;
+    insn.dst_reg = dst;
+    insn.src_reg = src;
+    insn.off = off;
+    insn.imm = imm;
+    g_array_append_val(p->insns, insn);
+}
+
+#define GA_BPF_MOV_REG(p, dst, src) \
+    ga_bpf_emit(p, BPF_ALU64 | BPF_MOV | BPF_X, dst, src, 0, 0)
+#define GA_BPF_MOV_IMM(p, dst, imm) \
+    ga_bpf_emit(p, BPF_ALU64 | BPF_MOV | BPF_K, dst, 0, 0, imm)
+#define GA_BPF_ALU_REG(p, op, dst, src) \
+    ga_bpf_emit(p, BPF_ALU64 | (op) | BPF_X, dst, src, 0, 0)
+#define GA_BPF_ALU_IMM(p, op, dst, imm) \
+    ga_bpf_emit(p, BPF_ALU64 | (op) | BPF_K, dst, 0, 0, imm)
+#define GA_BPF_LDX(p, size, dst, src, off) \
+    ga_bpf_emit(p, BPF_LDX | (size) | BPF_MEM, dst, src, off, 0)
+#define GA_BPF_STX(p, size, dst, off, src) \
+    ga_bpf_emit(p, BPF_STX | (size) | BPF_MEM, dst, src, off, 0)
+#define GA_BPF_ST(p, size, dst, off, imm) \
+    ga_bpf_emit(p, BPF_ST | (size) | BPF_MEM, dst, 0, off, imm)
+#define GA_BPF_CALL(p, func) \
+    ga_bpf_emit(p, BPF_JMP | BPF_CALL, 0, 0, 0, func)
+
+/* a pointer to the stack slot at @off */
+static void ga_bpf_stack_ptr(GABpfProgram *p, int dst, int off)
+{
+    GA_BPF_MOV_REG(p, dst, BPF_REG_10);
+    GA_BPF_ALU_IMM(p, BPF_ADD, dst, off);
+}
+
+/* the map behind @fd, an instruction of two halves */
+static void ga_bpf_ld_map(GABpfProgram *p, int dst, int fd)
+{
+    ga_bpf_emit(p, BPF_LD | BPF_DW | BPF_IMM, dst, BPF_PSEUDO_MAP_FD, 0, fd);
+    ga_bpf_emit(p, 0, 0, 0, 0, 0);
+}
+
+/* a conditional jump forward, to be landed by ga_bpf_land() */
+static guint ga_bpf_jump(GABpfProgram *p, uint8_t op, int dst, int32_t imm)
+{
+    ga_bpf_emit(p, BPF_JMP | op | BPF_K, dst, 0, 0, imm);
+    return p->insns->len - 1;
+}
+
+static void ga_bpf_land(GABpfProgram *p, guint jump)
+{
+    g_array_index(p->insns, struct bpf_insn, jump).off =
+        p->insns->len - jump - 1;
+}
+
+/* a conditional jump to the end of the program */
+static void ga_bpf_jump_exit(GABpfProgram *p, uint8_t op, int dst,
+                             int32_t imm)
+{
+    guint jump = ga_bpf_jump(p, op, dst, imm);
+
+    g_array_append_val(p->exits, jump);
+}
+
+/* the end, which the jumps to it land on: return 0 */
+static void ga_bpf_exit(GABpfProgram *p)
+{
+    guint i;
+
+    for (i = 0; i < p->exits->len; i++) {
+        ga_bpf_land(p, g_array_index(p->exits, guint, i));
+    }
+    GA_BPF_MOV_IMM(p, BPF_REG_0, 0);
+    ga_bpf_emit(p, BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+}
+
+/* @dst = @field of the tracepoint record, which the program keeps in r6 */
+static void ga_bpf_ld_field(GABpfProgram *p, int dst, const GABpfField *f)
+{
+    static const uint8_t sizes[] = { 0, BPF_B, BPF_H, 0, BPF_W,
+                                     0, 0, 0, BPF_DW };
+
+    GA_BPF_LDX(p, sizes[f->size], dst, BPF_REG_6, f->offset);
+}
+
+/* start[key] = now, with the key at GA_BPF_STACK_KEY */
+static void ga_bpf_emit_start(GABpfProgram *p, int start)
+{
+    GA_BPF_CALL(p, BPF_FUNC_ktime_get_ns);
+    GA_BPF_STX(p, BPF_DW, BPF_REG_10, GA_BPF_STACK_TIME, BPF_REG_0);
+    ga_bpf_ld_map(p, BPF_REG_1, start);
+    ga_bpf_stack_ptr(p, BPF_REG_2, GA_BPF_STACK_KEY);
+    ga_bpf_stack_ptr(p, BPF_REG_3, GA_BPF_STACK_TIME);
+    GA_BPF_MOV_IMM(p, BPF_REG_4, BPF_ANY);
+    GA_BPF_CALL(p, BPF_FUNC_map_update_elem);
+}
+
+/*
+ * If start[key] is there, take it out and count now - start[key] into the
+ * histogram, then end the program
+ */
+static void ga_bpf_emit_finish(GABpfProgram *p, int start, int slots)
+{
+    int shift;
+
+    ga_bpf_ld_map(p, BPF_REG_1, start);
+    ga_bpf_stack_ptr(p, BPF_REG_2, GA_BPF_STACK_KEY);
+    GA_BPF_CALL(p, BPF_FUNC_map_lookup_elem);
+    ga_bpf_jump_exit(p, BPF_JEQ, BPF_REG_0, 0);
+    GA_BPF_LDX(p, BPF_DW, BPF_REG_7, BPF_REG_0, 0);
+    GA_BPF_CALL(p, BPF_FUNC_ktime_get_ns);
+    GA_BPF_ALU_REG(p, BPF_SUB, BPF_REG_0, BPF_REG_7);
+    GA_BPF_MOV_REG(p, BPF_REG_8, BPF_REG_0);
+    ga_bpf_ld_map(p, BPF_REG_1, start);
+    ga_bpf_stack_ptr(p, BPF_REG_2, GA_BPF_STACK_KEY);
+    GA_BPF_CALL(p, BPF_FUNC_map_delete_elem);
+
+    /* r9 = log2(r8 / 1000), without loops */
+    GA_BPF_ALU_IMM(p, BPF_DIV, BPF_REG_8, 1000);
+    GA_BPF_MOV_IMM(p, BPF_REG_9, 0);
+    for (shift = 32; shift; shift /= 2) {
+        GA_BPF_MOV_REG(p, BPF_REG_1, BPF_REG_8);
+        GA_BPF_ALU_IMM(p, BPF_RSH, BPF_REG_1, shift);
+        ga_bpf_emit(p, BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_1, 0, 2, 0);
+        GA_BPF_MOV_REG(p, BPF_REG_8, BPF_REG_1);
+        GA_BPF_ALU_IMM(p, BPF_ADD, BPF_REG_9, shift);
+    }
+
+    GA_BPF_STX(p, BPF_W, BPF_REG_10, GA_BPF_STACK_SLOT, BPF_REG_9);
+    ga_bpf_ld_map(p, BPF_REG_1, slots);
+    ga_bpf_stack_ptr(p, BPF_REG_2, GA_BPF_STACK_SLOT);
+    GA_BPF_CALL(p, BPF_FUNC_map_lookup_elem);
+    ga_bpf_jump_exit(p, BPF_JEQ, BPF_REG_0, 0);
+    GA_BPF_MOV_IMM(p, BPF_REG_1, 1);
+    ga_bpf_emit(p, BPF_STX | BPF_DW | BPF_XADD, BPF_REG_0, BPF_REG_1, 0, 0);
+    ga_bpf_exit(p);
+}
+
+static void ga_bpf_program_init(GABpfProgram *p)
+{
+    p->insns = g_array_new(false, false, sizeof(struct bpf_insn));
+    p->exits = g_array_new(false, false, sizeof(guint));
+    /* the tracepoint record */
+    GA_BPF_MOV_REG(p, BPF_REG_6, BPF_REG_1);
+}
+
+static void ga_bpf_keep_fd(GABpf *b, int fd)
+{
+    g_array_append_val(b->fds, fd);
+}
+
+/* close what was opened since @mark, after a histogram failed to load */
+static void ga_bpf_rollback(GABpf *b, guint mark)
+{
+    guint i;
+
+    for (i = mark; i < b->fds->len; i++) {
+        close(g_array_index(b->fds, int, i));
+    }
+    g_array_set_size(b->fds, mark);
+}
+
+static int ga_bpf_map_new(GABpf *b, enum bpf_map_type type, int key_size,
+                          int value_size, int max_entries, Error **errp)
+{
+    union bpf_attr attr;
+    int fd;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = type;
+    attr.key_size = key_size;
+    attr.value_size = value_size;
+    attr.max_entries = max_entries;
+    fd = syscall(__NR_bpf, BPF_MAP_CREATE, &attr, sizeof(attr));
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "failed to create a BPF map");
+        return -1;
+    }
+    ga_bpf_keep_fd(b, fd);
+    return fd;
+}
+
+static int ga_bpf_program_load(GABpf *b, GABpfProgram *p, const char *what,
+                               Error **errp)
+{
+    union bpf_attr attr;
+    int fd;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_TRACEPOINT;
+    attr.insns = (uintptr_t)p->insns->data;
+    attr.insn_cnt = p->insns->len;
+    /* bpf_ktime_get_ns() is for GPL programs only */
+    attr.license = (uintptr_t)"GPL";
+    fd = syscall(__NR_bpf, BPF_PROG_LOAD, &attr, sizeof(attr));
+    g_array_free(p->insns, true);
+    g_array_free(p->exits, true);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "failed to load the BPF program of %s",
+                         what);
+        return -1;
+    }
+    ga_bpf_keep_fd(b, fd);
+    return fd;
+}
+
+/* the contents of file @name of tracepoint @event, e.g. "sched/sched_switch" */
+static char *ga_bpf_event_file(const char *event, const char *name,
+                               Error **errp)
+{
+    char *path, *contents = NULL;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(ga_bpf_tracefs) && !contents; i++) {
+        path = g_strdup_printf("%s/events/%s/%s", ga_bpf_tracefs[i], event,
+                               name);
+        g_file_get_contents(path, &contents, NULL, NULL);
+        g_free(path);
+    }
+    if (!contents) {
+        error_setg(errp, "the kernel has no tracepoint %s, or tracefs is not "
+                   "mounted", event);
+    }
+    return contents;
+}
+
+/*
+ * Where @field is in the records of @event, from lines of its format file
+ * such as "field:pid_t pid;	offset:24;	size:4;	signed:1;"
+ */
+static bool ga_bpf_event_field(const char *event, const char *field,
+                               GABpfField *f, Error **errp)
+{
+    char *format = ga_bpf_event_file(event, "format", errp);
+    char **lines, *decl, *end, *name, *pos;
+    bool found = false;
+    int i;
+
+    if (!format) {
+        return false;
+    }
+    lines = g_strsplit(format, "\n", -1);
+    for (i = 0; lines[i] && !found; i++) {
+        decl = strstr(lines[i], "field:");
+        end = decl ? strchr(decl, ';') : NULL;
+        if (!end) {
+            continue;
+        }
+        *end = '\0';
+        name = strrchr(decl, ' ');
+        if (!name || strcmp(name + 1, field)) {
+            continue;
+        }
+        pos = strstr(end + 1, "offset:");
+        if (pos && sscanf(pos, "offset:%d;\tsize:%d;", &f->offset,
+                          &f->size) == 2 &&
+            f->size > 0 && f->size <= 8 && !(f->size & (f->size - 1))) {
+            found = true;
+        }
+    }
+    g_strfreev(lines);
+    g_free(format);
+    if (!found) {
+        error_setg(errp, "tracepoint %s has no field %s the agent can read",
+                   event, field);
+    }
+    return found;
+}
+
+/* run @prog on @event, on every CPU that is online */
+static bool ga_bpf_attach(GABpf *b, const char *event, int prog,
+                          Error **errp)
+{
+    struct perf_event_attr attr;
+    char *id = ga_bpf_event_file(event, "id", errp);
+    long cpu, ncpus = sysconf(_SC_NPROCESSORS_CONF);
+    int fd;
+
+    if (!id) {
+        return false;
+    }
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_TRACEPOINT;
+    attr.size = sizeof(attr);
+    attr.config = g_ascii_strtoull(id, NULL, 10);
+    attr.sample_period = 1;
+    attr.wakeup_events = 1;
+    g_free(id);
+
+    for (cpu = 0; cpu < ncpus; cpu++) {
+        fd = syscall(__NR_perf_event_open, &attr, -1, cpu, -1,
+                     PERF_FLAG_FD_CLOEXEC);
+        if (fd < 0 && errno == ENODEV) {
+            continue;               /* offline */
+        }
+        if (fd < 0) {
+            error_setg_errno(errp, errno, "failed to open tracepoint %s",
+                             event);
+            return false;
+        }
+        ga_bpf_keep_fd(b, fd);
+        if (ioctl(fd, PERF_EVENT_IOC_SET_BPF, prog) < 0 ||
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0) < 0) {
+            error_setg_errno(errp, errno, "failed to attach to tracepoint %s",
+                             event);
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool ga_bpf_histogram_maps(GABpf *b, int kind, int key_size,
+                                  Error **errp)
+{
+    b->start[kind] = ga_bpf_map_new(b, BPF_MAP_TYPE_HASH, key_size,
+                                    sizeof(uint64_t), GA_BPF_PENDING_MAX,
+                                    errp);
+    if (b->start[kind] < 0) {
+        return false;
+    }
+    b->slots[kind] = ga_bpf_map_new(b, BPF_MAP_TYPE_ARRAY, sizeof(uint32_t),
+                                    sizeof(uint64_t), GA_BPF_SLOTS, errp);
+    return b->slots[kind] >= 0;
+}
+
+static bool ga_bpf_load_run_queue(GABpf *b, Error **errp)
+{
+    GABpfField wakeup_pid, wakeup_new_pid, prev_pid, prev_state, next_pid;
+    int start, slots, prog;
+    GABpfProgram p;
+    guint skip, idle;
+
+    if (!ga_bpf_event_field("sched/sched_wakeup", "pid", &wakeup_pid,
+                            errp) ||
+        !ga_bpf_event_field("sched/sched_wakeup_new", "pid", &wakeup_new_pid,
+                            errp) ||
+        !ga_bpf_event_field("sched/sched_switch", "prev_pid", &prev_pid,
+                            errp) ||
+        !ga_bpf_event_field("sched/sched_switch", "prev_state", &prev_state,
+                            errp) ||
+        !ga_bpf_event_field("sched/sched_switch", "next_pid", &next_pid,
+                            errp) ||
+        !ga_bpf_histogram_maps(b, GA_BPF_RUN_QUEUE, sizeof(uint32_t),
+                               errp)) {
+        return false;
+    }
+    start = b->start[GA_BPF_RUN_QUEUE];
+    slots = b->slots[GA_BPF_RUN_QUEUE];
+
+    /* woken up: the task waits for a CPU from now on */
+    ga_bpf_program_init(&p);
+    ga_bpf_ld_field(&p, BPF_REG_0, &wakeup_pid);
+    GA_BPF_STX(&p, BPF_W, BPF_REG_10, GA_BPF_STACK_KEY, BPF_REG_0);
+    ga_bpf_emit_start(&p, start);
+    ga_bpf_exit(&p);
+    prog = ga_bpf_program_load(b, &p, "sched_wakeup", errp);
+    if (prog < 0 || !ga_bpf_attach(b, "sched/sched_wakeup", prog, errp)) {
+        return false;
+    }
+    if (wakeup_new_pid.offset == wakeup_pid.offset &&
+        wakeup_new_pid.size == wakeup_pid.size) {
+        if (!ga_bpf_attach(b, "sched/sched_wakeup_new", prog, errp)) {
+            return false;
+        }
+    } else {
+        ga_bpf_program_init(&p);
+        ga_bpf_ld_field(&p, BPF_REG_0, &wakeup_new_pid);
+        GA_BPF_STX(&p, BPF_W, BPF_REG_10, GA_BPF_STACK_KEY, BPF_REG_0);
+        ga_bpf_emit_start(&p, start);
+        ga_bpf_exit(&p);
+        prog = ga_bpf_program_load(b, &p, "sched_wakeup_new", errp);
+        if (prog < 0 ||
+            !ga_bpf_attach(b, "sched/sched_wakeup_new", prog, errp)) {
+            return false;
+        }
+    }
+
+    /*
+     * Switched out while runnable, when preempted: no state bit of
+     * TASK_REPORT is set.  The idle tasks, pid 0, are left out.
+     */
+    ga_bpf_program_init(&p);
+    ga_bpf_ld_field(&p, BPF_REG_0, &prev_state);
+    GA_BPF_ALU_IMM(&p, BPF_AND, BPF_REG_0, 0x7f);
+    skip = ga_bpf_jump(&p, BPF_JNE, BPF_REG_0, 0);
+    ga_bpf_ld_field(&p, BPF_REG_0, &prev_pid);
+    GA_BPF_STX(&p, BPF_W, BPF_REG_10, GA_BPF_STACK_KEY, BPF_REG_0);
+    idle = ga_bpf_jump(&p, BPF_JEQ, BPF_REG_0, 0);
+    ga_bpf_emit_start(&p, start);
+    ga_bpf_land(&p, skip);
+    ga_bpf_land(&p, idle);
+    /* switched in: the wait is over */
+    ga_bpf_ld_field(&p, BPF_REG_0, &next_pid);
+    GA_BPF_STX(&p, BPF_W, BPF_REG_10, GA_BPF_STACK_KEY, BPF_REG_0);
+    ga_bpf_jump_exit(&p, BPF_JEQ, BPF_REG_0, 0);
+    ga_bpf_emit_finish(&p, start, slots);
+    prog = ga_bpf_program_load(b, &p, "sched_switch", errp);
+    return prog >= 0 && ga_bpf_attach(b, "sched/sched_switch", prog, errp);
+}
+
+/* the key of a request: the device, then the sector */
+static void ga_bpf_block_key(GABpfProgram *p, const GABpfField *dev,
+                             const GABpfField *sector)
+{
+    ga_bpf_ld_field(p, BPF_REG_0, dev);
+    GA_BPF_STX(p, BPF_DW, BPF_REG_10, GA_BPF_STACK_KEY, BPF_REG_0);
+    ga_bpf_ld_field(p, BPF_REG_0, sector);
+    GA_BPF_STX(p, BPF_DW, BPF_REG_10, GA_BPF_STACK_KEY + 8, BPF_REG_0);
+}
+
+static bool ga_bpf_load_block_io(GABpf *b, Error **errp)
+{
+    GABpfField issue_dev, issue_sector, complete_dev, complete_sector;
+    int start, prog;
+    GABpfProgram p;
+
+    if (!ga_bpf_event_field("block/block_rq_issue", "dev", &issue_dev,
+                            errp) ||
+        !ga_bpf_event_field("block/block_rq_issue", "sector", &issue_sector,
+                            errp) ||
+        !ga_bpf_event_field("block/block_rq_complete", "dev", &complete_dev,
+                            errp) ||
+        !ga_bpf_event_field("block/block_rq_complete", "sector",
+                            &complete_sector, errp) ||
+        !ga_bpf_histogram_maps(b, GA_BPF_BLOCK_IO, 2 * sizeof(uint64_t),
+                               errp)) {
+        return false;
+    }
+    start = b->start[GA_BPF_BLOCK_IO];
+
+    ga_bpf_program_init(&p);
+    ga_bpf_block_key(&p, &issue_dev, &issue_sector);
+    ga_bpf_emit_start(&p, start);
+    ga_bpf_exit(&p);
+    prog = ga_bpf_program_load(b, &p, "block_rq_issue", errp);
+    if (prog < 0 || !ga_bpf_attach(b, "block/block_rq_issue", prog, errp)) {
+        return false;
+    }
+
+    ga_bpf_program_init(&p);
+    ga_bpf_block_key(&p, &complete_dev, &complete_sector);
+    ga_bpf_emit_finish(&p, start, b->slots[GA_BPF_BLOCK_IO]);
+    prog = ga_bpf_program_load(b, &p, "block_rq_complete", errp);
+    return prog >= 0 &&
+           ga_bpf_attach(b, "block/block_rq_complete", prog, errp);
+}
+
+static bool ga_bpf_load_tcp(GABpf *b, Error **errp)
+{
+    GABpfProgram p;
+    int count, prog;
+    char *id;
+
+    /* Linux 4.15 and later */
+    id = ga_bpf_event_file("tcp/tcp_retransmit_skb", "id", errp);
+    if (!id) {
+        return false;
+    }
+    g_free(id);
+    count = ga_bpf_map_new(b, BPF_MAP_TYPE_ARRAY, sizeof(uint32_t),
+                           sizeof(uint64_t), 1, errp);
+    if (count < 0) {
+        return false;
+    }
+
+    ga_bpf_program_init(&p);
+    GA_BPF_ST(&p, BPF_W, BPF_REG_10, GA_BPF_STACK_SLOT, 0);
+    ga_bpf_ld_map(&p, BPF_REG_1, count);
+    ga_bpf_stack_ptr(&p, BPF_REG_2, GA_BPF_STACK_SLOT);
+    GA_BPF_CALL(&p, BPF_FUNC_map_lookup_elem);
+    ga_bpf_jump_exit(&p, BPF_JEQ, BPF_REG_0, 0);
+    GA_BPF_MOV_IMM(&p, BPF_REG_1, 1);
+    ga_bpf_emit(&p, BPF_STX | BPF_DW | BPF_XADD, BPF_REG_0, BPF_REG_1, 0, 0);
+    ga_bpf_exit(&p);
+    prog = ga_bpf_program_load(b, &p, "tcp_retransmit_skb", errp);
+    if (prog < 0 || !ga_bpf_attach(b, "tcp/tcp_retransmit_skb", prog, errp)) {
+        return false;
+    }
+    b->tcp_retransmits = count;
+    return true;
+}
+
+/*
+ * Load and attach the programs; NULL if none of them could be, because
+ * the kernel lacks BPF or the agent is not privileged for example.
+ */
+GABpf *ga_bpf_new(Error **errp)
+{
+    static bool (*const loaders[])(GABpf *b, Error **errp) = {
+        ga_bpf_load_run_queue, ga_bpf_load_block_io, ga_bpf_load_tcp,
+    };
+    static const char *const names[] = { "run-queue", "block-io", "tcp" };
+    struct rlimit rl = { RLIM_INFINITY, RLIM_INFINITY };
+    GABpf *b = g_new0(GABpf, 1);
+    Error *local_err = NULL;
+    bool loaded = false;
+    guint mark;
+    int i;
+
+    for (i = 0; i < GA_BPF_NHISTOGRAMS; i++) {
+        b->start[i] = b->slots[i] = -1;
+    }
+    b->tcp_retransmits = -1;
+    b->fds = g_array_new(false, false, sizeof(int));
+    b->since = g_get_real_time() * 1000;
+    /* maps are charged to the locked memory of older kernels */
+    setrlimit(RLIMIT_MEMLOCK, &rl);
+
+    for (i = 0; i < ARRAY_SIZE(loaders); i++) {
+        mark = b->fds->len;
+        error_free(local_err);
+        local_err = NULL;
+        if (loaders[i](b, &local_err)) {
+            loaded = true;
+            continue;
+        }
+        g_debug("not collecting %s: %s", names[i],
+                error_get_pretty(local_err));
+        ga_bpf_rollback(b, mark);
+        if (i < GA_BPF_NHISTOGRAMS) {
+            b->start[i] = b->slots[i] = -1;
+        }
+    }
+
+    if (!loaded) {
+        error_propagate(errp, local_err);
+        ga_bpf_free(b);
+        return NULL;
+    }
+    error_free(local_err);
+    return b;
+}
+
+void ga_bpf_free(GABpf *b)
+{
+    if (!b) {
+        return;
+    }
+
+    ga_bpf_rollback(b, 0);
+    g_array_free(b->fds, true);
+    g_free(b);
+}
+
+/* when the counters started, in nanoseconds since the Epoch */
+int64_t ga_bpf_get_start_time(GABpf *b)
+{
+    return b->since;
+}
+
+static bool ga_bpf_map_read(int map, uint32_t key, uint64_t *value)
+{
+    union bpf_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = map;
+    attr.key = (uintptr_t)&key;
+    attr.value = (uintptr_t)value;
+    return syscall(__NR_bpf, BPF_MAP_LOOKUP_ELEM, &attr, sizeof(attr)) == 0;
+}
+
+/*
+ * The GA_BPF_SLOTS counters of histogram @kind, GA_BPF_RUN_QUEUE or
+ * GA_BPF_BLOCK_IO; false if it is not collected.
+ */
+bool ga_bpf_read_histogram(GABpf *b, int kind, uint64_t *slots)
+{
+    uint32_t i;
+
+    if (b->slots[kind] < 0) {
+        return false;
+    }
+    for (i = 0; i < GA_BPF_SLOTS; i++) {
+        if (!ga_bpf_map_read(b->slots[kind], i, &slots[i])) {
+            slots[i] = 0;
+        }
+    }
+    return true;
+}
+
+/* false if TCP retransmits are not counted */
+bool ga_bpf_read_tcp_retransmits(GABpf *b, uint64_t *count)
+{
+    return b->tcp_retransmits >= 0 &&
+           ga_bpf_map_read(b->tcp_retransmits, 0, count);
+}
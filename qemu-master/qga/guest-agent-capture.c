@@ -0,0 +1,167 @@
+/*
+ * QEMU Guest Agent traffic capture
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include <glib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "qga/guest-agent-core.h"
+#include "qapi/error.h"
+
+/*
+ * With --capture, every request the agent parses and every message it
+ * sends is written to a file, one JSON object per line:
+ *
+ *   {"t": 1523, "s": 1, "d": "in", "msg": {"execute": "guest-ping"}}
+ *   {"t": 1604, "s": 1, "d": "out", "msg": {"return": {}}}
+ *
+ * "t" is in microseconds since the capture started, "s" numbers the
+ * client sessions and "d" is the direction.  A request that came with an
+ * attachment has its length in "attachment"; the attachment itself is
+ * not kept.  tests/replay-qga sends a capture back to an agent.
+ *
+ * Everything runs on the main loop, so there is no locking.  The file is
+ * written through stdio and flushed within GA_CAPTURE_FLUSH_S of a
+ * record, rather than after each one.  Once it reaches @max_size, it is
+ * renamed to PATH.1, replacing the one before, and a new one is started,
+ * so that the two together never take more than twice that.
+ *
+ * The capture holds whatever the host sent, guest-set-user-password
+ * included, so only root can read it.
+ */
+struct GACapture {
+    char *path;
+    FILE *file;
+    size_t size;
+    size_t max_size;
+    int64_t start;
+    guint flush_timer;
+};
+
+#define GA_CAPTURE_FLUSH_S  1
+
+static FILE *ga_capture_open(const char *path, Error **errp)
+{
+    FILE *f;
+    int fd;
+
+    fd = qemu_open(path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY,
+                   S_IRUSR | S_IWUSR);
+    if (fd == -1) {
+        error_setg_errno(errp, errno, "failed to open capture file '%s'",
+                         path);
+        return NULL;
+    }
+    f = fdopen(fd, "w");
+    if (!f) {
+        error_setg_errno(errp, errno, "failed to open capture file '%s'",
+                         path);
+        close(fd);
+        return NULL;
+    }
+    return f;
+}
+
+GACapture *ga_capture_new(const char *path, size_t max_size, Error **errp)
+{
+    GACapture *c;
+    FILE *f;
+
+    f = ga_capture_open(path, errp);
+    if (!f) {
+        return NULL;
+    }
+    c = g_new0(GACapture, 1);
+    c->path = g_strdup(path);
+    c->file = f;
+    c->max_size = max_size;
+    c->start = g_get_monotonic_time();
+    return c;
+}
+
+static gboolean ga_capture_flush_cb(gpointer opaque)
+{
+    GACapture *c = opaque;
+
+    c->flush_timer = 0;
+    if (c->file) {
+        fflush(c->file);
+    }
+    return G_SOURCE_REMOVE;
+}
+
+/* start over in a new file once this one is full */
+static void ga_capture_rotate(GACapture *c)
+{
+    Error *err = NULL;
+    char *old;
+
+    fclose(c->file);
+    old = g_strdup_printf("%s.1", c->path);
+#ifdef _WIN32
+    unlink(old);
+#endif
+    if (rename(c->path, old) < 0) {
+        g_warning("failed to rotate capture file '%s': %s", c->path,
+                  strerror(errno));
+    }
+    g_free(old);
+
+    c->size = 0;
+    c->file = ga_capture_open(c->path, &err);
+    if (!c->file) {
+        g_warning("capture stopped: %s", error_get_pretty(err));
+        error_free(err);
+    }
+}
+
+void ga_capture_write(GACapture *c, unsigned int session, bool in,
+                      const char *json, size_t attachment_len)
+{
+    int n;
+
+    if (!c || !c->file) {
+        return;
+    }
+    if (attachment_len) {
+        n = fprintf(c->file, "{\"t\": %" PRId64 ", \"s\": %u, \"d\": \"%s\","
+                    " \"attachment\": %zu, \"msg\": %s}\n",
+                    g_get_monotonic_time() - c->start, session,
+                    in ? "in" : "out", attachment_len, json);
+    } else {
+        n = fprintf(c->file, "{\"t\": %" PRId64 ", \"s\": %u, \"d\": \"%s\","
+                    " \"msg\": %s}\n",
+                    g_get_monotonic_time() - c->start, session,
+                    in ? "in" : "out", json);
+    }
+    if (n > 0) {
+        c->size += n;
+    }
+    if (c->max_size && c->size >= c->max_size) {
+        ga_capture_rotate(c);
+    } else if (!c->flush_timer) {
+        c->flush_timer = g_timeout_add_seconds(GA_CAPTURE_FLUSH_S,
+                                               ga_capture_flush_cb, c);
+    }
+}
+
+void ga_capture_free(GACapture *c)
+{
+    if (!c) {
+        return;
+    }
+    if (c->flush_timer) {
+        g_source_remove(c->flush_timer);
+    }
+    if (c->file) {
+        fclose(c->file);
+    }
+    g_free(c->path);
+    g_free(c);
+}
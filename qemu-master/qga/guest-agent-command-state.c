@@ -14,32 +14,72 @@
 
 struct GACommandState {
     GSList *groups;
+    GSList *caches;
 };
 
+typedef struct GACommandCache {
+    void (*invalidate)(void);
+    void (*warm)(void);
+    bool cold;                  /* invalidated and not warmed since */
+} GACommandCache;
+
 typedef struct GACommandGroup {
     void (*init)(void);
     void (*cleanup)(void);
+    bool deferred;
+    volatile gsize initialized;
 } GACommandGroup;
 
 /* handle init/cleanup for stateful guest commands */
 
-void ga_command_state_add(GACommandState *cs,
-                          void (*init)(void),
-                          void (*cleanup)(void))
+static void ga_command_group_add(GACommandState *cs, void (*init)(void),
+                                 void (*cleanup)(void), bool deferred)
 {
     GACommandGroup *cg = g_new0(GACommandGroup, 1);
     cg->init = init;
     cg->cleanup = cleanup;
+    cg->deferred = deferred;
     cs->groups = g_slist_append(cs->groups, cg);
 }
 
+void ga_command_state_add(GACommandState *cs,
+                          void (*init)(void),
+                          void (*cleanup)(void))
+{
+    ga_command_group_add(cs, init, cleanup, false);
+}
+
+/*
+ * Like ga_command_state_add(), but @init is not run at startup: it runs
+ * from ga_command_state_init_deferred() once the channel is up, or from
+ * ga_command_state_run() if a command needs it first.
+ */
+void ga_command_state_add_deferred(GACommandState *cs,
+                                   void (*init)(void),
+                                   void (*cleanup)(void))
+{
+    g_assert(init);
+    ga_command_group_add(cs, init, cleanup, true);
+}
+
+/* run the init of @cg once, whichever thread gets here first */
+static void ga_command_group_run(GACommandGroup *cg)
+{
+    if (g_once_init_enter(&cg->initialized)) {
+        if (cg->init) {
+            cg->init();
+        }
+        g_once_init_leave(&cg->initialized, 1);
+    }
+}
+
 static void ga_command_group_init(gpointer opaque, gpointer unused)
 {
     GACommandGroup *cg = opaque;
 
     g_assert(cg);
-    if (cg->init) {
-        cg->init();
+    if (!cg->deferred) {
+        ga_command_group_run(cg);
     }
 }
 
@@ -49,11 +89,103 @@ void ga_command_state_init_all(GACommandState *cs)
     g_slist_foreach(cs->groups, ga_command_group_init, NULL);
 }
 
+/*
+ * Run the next deferred init that has not run yet.  Returns false once
+ * there is none left, so it can be used as an idle callback.
+ */
+bool ga_command_state_init_deferred(GACommandState *cs)
+{
+    GACommandGroup *cg;
+    GSList *l;
+
+    g_assert(cs);
+    for (l = cs->groups; l; l = l->next) {
+        cg = l->data;
+        if (cg->deferred && !g_atomic_pointer_get(&cg->initialized)) {
+            ga_command_group_run(cg);
+            return true;
+        }
+    }
+    return false;
+}
+
+/* make sure the deferred @init has run; may be called from any thread */
+void ga_command_state_run(GACommandState *cs, void (*init)(void))
+{
+    GSList *l;
+
+    g_assert(cs);
+    for (l = cs->groups; l; l = l->next) {
+        GACommandGroup *cg = l->data;
+
+        if (cg->init == init) {
+            ga_command_group_run(cg);
+            return;
+        }
+    }
+    g_assert_not_reached();
+}
+
+/*
+ * Register a cache of what commands found out about the system: @invalidate
+ * drops it, @warm, if not NULL, fills it again.  Both run in the main loop.
+ */
+void ga_command_state_add_cache(GACommandState *cs,
+                                void (*invalidate)(void),
+                                void (*warm)(void))
+{
+    GACommandCache *cc = g_new0(GACommandCache, 1);
+
+    g_assert(invalidate);
+    cc->invalidate = invalidate;
+    cc->warm = warm;
+    cs->caches = g_slist_append(cs->caches, cc);
+}
+
+/* drop every cache, they are warmed with ga_command_state_warm_next() */
+void ga_command_state_invalidate_all(GACommandState *cs)
+{
+    GACommandCache *cc;
+    GSList *l;
+
+    g_assert(cs);
+    for (l = cs->caches; l; l = l->next) {
+        cc = l->data;
+        cc->invalidate();
+        cc->cold = cc->warm != NULL;
+    }
+}
+
+/*
+ * Warm the next cache invalidated since it was last warmed.  Returns false
+ * once there is none left, so it can be used as an idle callback.
+ */
+bool ga_command_state_warm_next(GACommandState *cs)
+{
+    GACommandCache *cc;
+    GSList *l;
+
+    g_assert(cs);
+    for (l = cs->caches; l; l = l->next) {
+        cc = l->data;
+        if (cc->cold) {
+            cc->cold = false;
+            cc->warm();
+            return true;
+        }
+    }
+    return false;
+}
+
 static void ga_command_group_cleanup(gpointer opaque, gpointer unused)
 {
     GACommandGroup *cg = opaque;
 
     g_assert(cg);
+    /* a deferred group that never got initialized has nothing to undo */
+    if (cg->deferred && !g_atomic_pointer_get(&cg->initialized)) {
+        return;
+    }
     if (cg->cleanup) {
         cg->cleanup();
     }
@@ -12,10 +12,13 @@
  */
 #include "qapi/qmp/dispatch.h"
 #include "qemu-common.h"
+#include "qemu/notify.h"
+#include "block/coroutine.h"
 
 #define QGA_READ_COUNT_DEFAULT 4096
 
 typedef struct GAState GAState;
+typedef struct GASession GASession;
 typedef struct GACommandState GACommandState;
 extern GAState *ga_state;
 
@@ -24,20 +27,369 @@ void ga_command_state_init(GAState *s, GACommandState *cs);
 void ga_command_state_add(GACommandState *cs,
                           void (*init)(void),
                           void (*cleanup)(void));
+void ga_command_state_add_deferred(GACommandState *cs,
+                                   void (*init)(void),
+                                   void (*cleanup)(void));
 void ga_command_state_init_all(GACommandState *cs);
+bool ga_command_state_init_deferred(GACommandState *cs);
+void ga_command_state_run(GACommandState *cs, void (*init)(void));
 void ga_command_state_cleanup_all(GACommandState *cs);
+void ga_command_state_add_cache(GACommandState *cs,
+                                void (*invalidate)(void),
+                                void (*warm)(void));
+void ga_command_state_invalidate_all(GACommandState *cs);
+bool ga_command_state_warm_next(GACommandState *cs);
+void ga_notify_resume(GAState *s);
 GACommandState *ga_command_state_new(void);
+GACommandState *ga_get_command_state(GAState *s);
+void ga_busy_ref(GAState *s);
+void ga_busy_unref(GAState *s);
+void ga_get_startup_times(GAState *s, int64_t *channel_us, int64_t *ready_us);
 bool ga_logging_enabled(GAState *s);
 void ga_disable_logging(GAState *s);
 void ga_enable_logging(GAState *s);
 void GCC_FMT_ATTR(1, 2) slog(const gchar *fmt, ...);
 void ga_set_response_delimited(GAState *s);
+void ga_set_framing(GAState *s, bool framed);
+bool ga_set_serial_speed(GAState *s, int64_t speed, bool flow_control,
+                         Error **errp);
+bool ga_is_framed(GAState *s);
+void ga_set_compression(GAState *s, bool compress);
+bool ga_is_compressing(GAState *s);
+guchar *ga_compress(GAState *s, const guchar *data, size_t len,
+                    size_t *out_len);
+void ga_set_nested_dispatch(GAState *s, bool nested);
+const void *ga_get_attachment(GAState *s, size_t *len);
+void ga_set_response_attachment(GAState *s, void *data, size_t len);
+void ga_set_response_buffer(GAState *s, void *data, size_t len);
 bool ga_is_frozen(GAState *s);
 void ga_set_frozen(GAState *s);
 void ga_unset_frozen(GAState *s);
+const char *ga_get_state_dir(GAState *s);
 const char *ga_fsfreeze_hook(GAState *s);
+int ga_fsfreeze_hook_timeout(GAState *s);
+GASession *ga_get_session(GAState *s);
+void ga_add_session_close_notifier(GAState *s, Notifier *notifier);
+int ga_get_max_file_handles(GAState *s);
+int ga_get_max_exec_processes(GAState *s);
+int ga_get_exec_reap_timeout(GAState *s);
+bool ga_uses_pm_utils(GAState *s);
 int64_t ga_get_fd_handle(GAState *s, Error **errp);
+bool ga_cancel_request(GAState *s, QObject *id);
+
+typedef struct GAPendingResponse GAPendingResponse;
+/* the result for ga_complete_response() */
+typedef QObject *(*GAResponseFunc)(void *opaque, Error **errp);
+GAPendingResponse *ga_defer_response(GAState *s);
+void ga_complete_response(GAState *s, GAPendingResponse *pending,
+                          GAResponseFunc fn, void *opaque);
+bool ga_co_run(GAState *s, CoroutineEntry *entry, GAResponseFunc result,
+               void *opaque);
+#ifndef _WIN32
+GIOCondition ga_co_wait_fd(int fd, GIOCondition condition);
+#endif
+
+typedef struct GAStream GAStream;
+/* the next message of a stream, see ga_stream_new() */
+typedef QDict *(*GAStreamFunc)(void *opaque, void **attachment, size_t *len,
+                               bool *last);
+GAStream *ga_stream_new(GAState *s, int64_t credits, GAStreamFunc next,
+                        void *opaque, GDestroyNotify destroy);
+void ga_stream_add_credits(GAStream *stream, int64_t credits);
+void ga_stream_free(GAStream *stream);
+bool ga_worker_cancelled(void);
+
+typedef struct GALog GALog;
+GALog *ga_log_new(FILE *file);
+void ga_log_write(GALog *l, bool is_syslog, const char *text);
+void ga_log_flush(GALog *l);
+void ga_log_set_file(GALog *l, FILE *file);
+void ga_log_free(GALog *l);
+
+/* a message kept for guest-get-agent-log */
+typedef struct GALogRecordInfo {
+    uint64_t seq;
+    int64_t time;               /* ns since the epoch */
+    GLogLevelFlags level;
+    bool is_syslog;             /* logged with slog() */
+    const char *message;
+} GALogRecordInfo;
+
+typedef void (*GALogRecordFunc)(const GALogRecordInfo *r, void *opaque);
+void ga_log_record(GALog *l, GLogLevelFlags level, bool is_syslog,
+                   const char *message);
+uint64_t ga_log_foreach(GALog *l, uint64_t cursor, uint64_t *lost,
+                        GALogRecordFunc func, void *opaque);
+GALog *ga_get_log(GAState *s);
+
+/* --capture, see guest-agent-capture.c */
+typedef struct GACapture GACapture;
+GACapture *ga_capture_new(const char *path, size_t max_size, Error **errp);
+void ga_capture_write(GACapture *c, unsigned int session, bool in,
+                      const char *json, size_t attachment_len);
+void ga_capture_free(GACapture *c);
+
+/* see guest-agent-stats.c */
+#define GA_HISTOGRAM_SUB_BITS   3
+#define GA_HISTOGRAM_SUB        (1 << GA_HISTOGRAM_SUB_BITS)
+#define GA_HISTOGRAM_MAX_SHIFT  40
+/* the exact ones, those per power of two and the last one */
+#define GA_HISTOGRAM_BUCKETS    (GA_HISTOGRAM_SUB + GA_HISTOGRAM_SUB * \
+    (GA_HISTOGRAM_MAX_SHIFT - GA_HISTOGRAM_SUB_BITS) + 1)
+
+/* latencies in microseconds */
+typedef struct GAHistogram {
+    uint64_t count, total, min, max;
+    uint64_t buckets[GA_HISTOGRAM_BUCKETS];
+} GAHistogram;
+
+/* how long a request took to get parsed, run and answered */
+typedef enum GAStatsPhase {
+    GA_STATS_PARSE,
+    GA_STATS_DISPATCH,
+    GA_STATS_SERIALIZE,
+    GA_STATS_WRITE,
+    GA_STATS_PHASES
+} GAStatsPhase;
+
+/* what glib allocated during a dispatch, with --alloc-stats */
+typedef struct GAAllocCount {
+    uint64_t allocs, bytes;
+    int64_t live, peak;
+} GAAllocCount;
+
+typedef struct GACommandStats {
+    char *name;
+    uint64_t requests, errors;
+    GAHistogram phases[GA_STATS_PHASES];
+    uint64_t allocs, alloc_bytes, alloc_peak;
+} GACommandStats;
+
+typedef struct GAStatsTotals {
+    uint64_t bytes_in, bytes_out;
+    uint64_t requests, errors, parse_errors;
+} GAStatsTotals;
+
+typedef struct GAStats GAStats;
+typedef void (*GAStatsFunc)(const GACommandStats *cs, void *opaque);
+GAStats *ga_stats_new(void);
+void ga_stats_free(GAStats *st);
+void ga_stats_add_time(GAStats *st, const char *command, GAStatsPhase phase,
+                       int64_t us);
+void ga_stats_add_request(GAStats *st, const char *command, bool error);
+void ga_stats_add_parse_error(GAStats *st);
+void ga_stats_add_allocs(GAStats *st, const char *command,
+                         const GAAllocCount *count);
+void ga_stats_add_bytes(GAStats *st, size_t in, size_t out);
+void ga_stats_get_totals(GAStats *st, GAStatsTotals *totals);
+void ga_stats_foreach(GAStats *st, GAStatsFunc func, void *opaque);
+void ga_stats_reset(GAStats *st);
+void ga_histogram_add(GAHistogram *h, uint64_t value);
+uint64_t ga_histogram_bucket_limit(int i);
+uint64_t ga_histogram_quantile(const GAHistogram *h, unsigned int permille);
+GAStats *ga_get_stats(GAState *s);
+bool ga_alloc_stats_init(void);
+bool ga_alloc_stats_enabled(void);
+void ga_alloc_count_begin(GAAllocCount *count);
+void ga_alloc_count_end(void);
+
+/* a stall of the main loop, see guest-agent-watchdog.c */
+typedef struct GAStallInfo {
+    int64_t time;               /* when it ended, ns since the epoch */
+    int64_t lag_us;             /* how long the main loop was held up */
+    const char *culprit;        /* the command it was running, or NULL */
+    const char * const *stack;  /* a sample of its stack, or NULL */
+} GAStallInfo;
+
+typedef struct GAWatchdog GAWatchdog;
+typedef void (*GAStallFunc)(const GAStallInfo *stall, void *opaque);
+GAWatchdog *ga_watchdog_new(int64_t threshold_ms, GAStallFunc func,
+                            void *opaque);
+void ga_watchdog_free(GAWatchdog *w);
+void ga_watchdog_set_activity(GAWatchdog *w, const char *what);
+const GAHistogram *ga_watchdog_get_lag(GAWatchdog *w);
+void ga_watchdog_foreach_stall(GAWatchdog *w, GAStallFunc func,
+                               void *opaque);
+void ga_watchdog_reset(GAWatchdog *w);
+GAWatchdog *ga_get_watchdog(GAState *s);
+/* sends GUEST_AGENT_STALL, see commands.c */
+void ga_stall_event(const GAStallInfo *stall, void *opaque);
+
+#ifdef CONFIG_QGA_BPF
+/* latency histograms, see guest-agent-bpf.c */
+#define GA_BPF_SLOTS        64
+/* the histograms, in the order of GuestLatencyHistogramType */
+#define GA_BPF_RUN_QUEUE    0
+#define GA_BPF_BLOCK_IO     1
+#define GA_BPF_NHISTOGRAMS  2
+
+typedef struct GABpf GABpf;
+
+GABpf *ga_bpf_new(Error **errp);
+void ga_bpf_free(GABpf *b);
+int64_t ga_bpf_get_start_time(GABpf *b);
+bool ga_bpf_read_histogram(GABpf *b, int kind, uint64_t *slots);
+bool ga_bpf_read_tcp_retransmits(GABpf *b, uint64_t *count);
+GABpf *ga_get_bpf(GAState *s);
+#endif
+
+bool ga_loop_init(bool use_epoll);
+void ga_loop_cleanup(void);
+guint ga_io_add_watch(GIOChannel *channel, GIOCondition condition,
+                      GIOFunc func, gpointer data);
+void ga_io_remove_watch(guint id);
+
+/* bulk sequential reads, through io_uring where there is one */
+typedef struct GAReader GAReader;
+GAReader *ga_reader_new(int fd, int64_t offset, int64_t length,
+                        size_t chunk);
+ssize_t ga_reader_next(GAReader *r, const guchar **data);
+bool ga_reader_is_async(GAReader *r);
+void ga_reader_free(GAReader *r);
 
 #ifndef _WIN32
 void reopen_fd_to_null(int fd);
+
+typedef struct GASpawner GASpawner;
+GASpawner *ga_spawner_new(void);
+void ga_spawner_free(GASpawner *sp);
+bool ga_spawn_sync(GASpawner *sp, const char *path, const char *const *argv,
+                   const void *input, size_t input_len, int *status,
+                   Error **errp);
+GASpawner *ga_get_spawner(GAState *s);
+
+/*
+ * What an agent hands over to the binary guest-upgrade-agent execs in
+ * its place: the state, in @keyfile, and the file descriptors that stay
+ * open for it.  Clients are referred to by their index in @sessions.
+ */
+typedef struct GAHandoff {
+    GKeyFile *keyfile;
+    GPtrArray *sessions;
+    GArray *fds;
+} GAHandoff;
+
+int ga_handoff_session_index(GAHandoff *h, GASession *session);
+GASession *ga_handoff_session(GAHandoff *h, int index);
+void ga_handoff_keep_fd(GAHandoff *h, int fd);
+void ga_handoff_set_int64(GAHandoff *h, const char *group, const char *key,
+                          int64_t value);
+int64_t ga_handoff_get_int64(GAHandoff *h, const char *group,
+                             const char *key);
+void ga_handoff_set_data(GAHandoff *h, const char *group, const char *key,
+                         const void *data, size_t len);
+guchar *ga_handoff_get_data(GAHandoff *h, const char *group,
+                            const char *key, gsize *len);
+bool ga_schedule_upgrade(GAState *s, const char *path, Error **errp);
+const char *ga_get_exe_path(GAState *s);
+bool ga_file_handoff_check(Error **errp);
+void ga_file_handoff_save(GAHandoff *h);
+void ga_file_handoff_load(GAHandoff *h);
+bool ga_exec_handoff_check(Error **errp);
+void ga_exec_handoff_save(GAHandoff *h);
+void ga_exec_handoff_load(GAHandoff *h);
 #endif
+
+/* groups of a GASample that could be read */
+#define GA_SAMPLE_CPU       (1u << 0)
+#define GA_SAMPLE_MEMORY    (1u << 1)
+#define GA_SAMPLE_DISK      (1u << 2)
+#define GA_SAMPLE_NET       (1u << 3)
+#define GA_SAMPLE_NGROUPS   4
+#define GA_SAMPLE_ALL       ((1u << GA_SAMPLE_NGROUPS) - 1)
+
+/* one sample of the system counters; times in ms, sizes in bytes */
+typedef struct GASample {
+    uint64_t seq;
+    int64_t time;               /* ns since the epoch */
+    uint32_t present;           /* GA_SAMPLE_* */
+    uint64_t cpu_user, cpu_nice, cpu_system, cpu_idle;
+    uint64_t cpu_iowait, cpu_irq, cpu_softirq, cpu_steal;
+    uint64_t mem_total, mem_free, mem_available;
+    uint64_t swap_total, swap_free;
+    uint64_t disk_read_ios, disk_read_bytes;
+    uint64_t disk_write_ios, disk_write_bytes;
+    uint64_t net_rx_bytes, net_rx_packets;
+    uint64_t net_tx_bytes, net_tx_packets;
+} GASample;
+
+/* a slot being written holds this instead of a sequence number */
+#define GA_SAMPLE_SEQ_BUSY UINT64_MAX
+
+typedef struct GASampler GASampler;
+typedef void (*GASampleFunc)(const GASample *sample, void *opaque);
+
+/* the latest sample, published to shared memory for the host */
+typedef struct GAMetricsShm GAMetricsShm;
+GAMetricsShm *ga_metrics_shm_new(const char *path, Error **errp);
+void ga_metrics_shm_publish(GAMetricsShm *m, const GASample *sample,
+                            int64_t interval_ms);
+void ga_metrics_shm_free(GAMetricsShm *m);
+
+/* the samples, also kept in a file that outlives the agent */
+typedef struct GAMetricsSpool GAMetricsSpool;
+GAMetricsSpool *ga_metrics_spool_new(const char *path, size_t size,
+                                     Error **errp);
+void ga_metrics_spool_append(GAMetricsSpool *sp, const GASample *sample);
+uint64_t ga_metrics_spool_get_head(GAMetricsSpool *sp);
+uint64_t ga_metrics_spool_foreach(GAMetricsSpool *sp, uint64_t cursor,
+                                  uint64_t end, GASampleFunc func,
+                                  void *opaque);
+void ga_metrics_spool_pause(GAMetricsSpool *sp, bool paused);
+void ga_metrics_spool_free(GAMetricsSpool *sp);
+
+/*
+ * Rollups of the samples into buckets of 1s, 10s, 1m and 1h, in the
+ * order of GuestMetricsResolution.  The columns are the counters of a
+ * GASample from cpu_user on, in their order.  Counters that only grow,
+ * those of the cpu, disk and net groups, are rolled up as their rate per
+ * second since the sample before, the memory group as it is; @last is
+ * the value of the newest sample, as it is for all of them.
+ */
+#define GA_ROLLUP_NTIERS    4
+#define GA_ROLLUP_NCOLUMNS  21
+
+typedef struct GARollupBucket {
+    int64_t start;              /* ns since the epoch */
+    uint32_t samples;
+    uint32_t present;           /* GA_SAMPLE_*, groups with any values */
+    uint32_t count[GA_SAMPLE_NGROUPS];
+    double min[GA_ROLLUP_NCOLUMNS];
+    double max[GA_ROLLUP_NCOLUMNS];
+    double sum[GA_ROLLUP_NCOLUMNS];
+    double last[GA_ROLLUP_NCOLUMNS];
+} GARollupBucket;
+
+typedef void (*GARollupFunc)(const GARollupBucket *bucket, void *opaque);
+
+/*
+ * What the sampler collects: a sample is taken every @interval_ms, but a
+ * group in @groups is only read every @group_interval_ms (0 meaning every
+ * sample), rounded to a multiple of @interval_ms.  Tiers of rollups
+ * finer than @interval_ms are not kept.  Each sample is also written to
+ * @shm and @spool, which must outlive the sampler; samples that no longer
+ * fit in memory are read back from @spool.
+ */
+typedef struct GASamplerConfig {
+    int64_t interval_ms;        /* 0 disables the sampler */
+    size_t size;                /* number of samples kept */
+    uint32_t groups;            /* GA_SAMPLE_* */
+    int64_t group_interval_ms[GA_SAMPLE_NGROUPS];
+    size_t rollup_size[GA_ROLLUP_NTIERS]; /* buckets kept, 0 for none */
+    GAMetricsShm *shm;          /* not owned, NULL for none */
+    GAMetricsSpool *spool;      /* not owned, NULL for none */
+} GASamplerConfig;
+
+GASampler *ga_sampler_new(const GASamplerConfig *config);
+void ga_sampler_reconfigure(GASampler *s, const GASamplerConfig *config);
+void ga_sampler_free(GASampler *s);
+int64_t ga_sampler_get_interval(GASampler *s);
+uint64_t ga_sampler_foreach(GASampler *s, uint64_t cursor, uint64_t *lost,
+                            GASampleFunc func, void *opaque);
+int64_t ga_sampler_get_rollup_resolution(int tier);
+double ga_rollup_bucket_avg(const GARollupBucket *b, int col);
+bool ga_sampler_foreach_rollup(GASampler *s, int tier, int64_t start,
+                               int64_t end, GARollupFunc func, void *opaque);
+GASampler *ga_get_sampler(GAState *s);
+/* implemented per platform, called from the sampler thread */
+void ga_sample_collect(GASample *sample, uint32_t groups);
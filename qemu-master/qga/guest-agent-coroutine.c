@@ -0,0 +1,127 @@
+/*
+ * QEMU Guest Agent commands that run as coroutines
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include <glib.h>
+#include "qga/guest-agent-core.h"
+#include "block/coroutine.h"
+
+/*
+ * A command that spends its time waiting, on a program it runs or on a
+ * pipe, can run as a coroutine instead of blocking the agent: it yields
+ * in ga_co_wait_fd() and the main loop resumes it once the fd is ready.
+ * Everything still happens in the main thread, so unlike the commands
+ * that go to the worker threads it needs no locking, only to expect other
+ * requests to be handled while it waits.
+ *
+ * Only a request with an id can be answered out of order.  Without one
+ * the command runs to the end right away, as it always did, and the wait
+ * functions block.
+ */
+
+typedef struct GACoCommand {
+    GAState *s;
+    GAPendingResponse *pending;
+    CoroutineEntry *entry;
+    GAResponseFunc result;
+    void *opaque;
+} GACoCommand;
+
+static void coroutine_fn ga_co_command_entry(void *opaque)
+{
+    GACoCommand *cmd = opaque;
+
+    cmd->entry(cmd->opaque);
+    ga_complete_response(cmd->s, cmd->pending, cmd->result, cmd->opaque);
+    g_free(cmd->opaque);
+    g_free(cmd);
+}
+
+/**
+ * ga_co_run:
+ * @s: the agent
+ * @entry: the body of the command
+ * @result: builds the answer from @opaque once @entry has returned
+ * @opaque: the arguments and results of the command, allocated with
+ *          g_malloc()
+ *
+ * Run @entry in a new coroutine and answer the request being dispatched
+ * with @result when it is done; @opaque is then freed with g_free().
+ * If the request cannot be deferred, @entry is called directly instead,
+ * and the caller answers from @opaque and frees it.
+ *
+ * Returns: true if the request is answered later
+ */
+bool ga_co_run(GAState *s, CoroutineEntry *entry, GAResponseFunc result,
+               void *opaque)
+{
+    GAPendingResponse *pending = ga_defer_response(s);
+    GACoCommand *cmd;
+
+    if (!pending) {
+        entry(opaque);
+        return false;
+    }
+    cmd = g_new0(GACoCommand, 1);
+    cmd->s = s;
+    cmd->pending = pending;
+    cmd->entry = entry;
+    cmd->result = result;
+    cmd->opaque = opaque;
+    qemu_coroutine_enter(qemu_coroutine_create(ga_co_command_entry), cmd);
+    return true;
+}
+
+#ifndef _WIN32
+
+typedef struct GACoFdWait {
+    Coroutine *co;
+    GIOCondition revents;
+} GACoFdWait;
+
+static gboolean ga_co_fd_ready(GIOChannel *channel, GIOCondition condition,
+                               gpointer opaque)
+{
+    GACoFdWait *w = opaque;
+
+    w->revents = condition;
+    qemu_coroutine_enter(w->co, NULL);
+    return false;
+}
+
+/**
+ * ga_co_wait_fd:
+ * @fd: the file descriptor
+ * @condition: what to wait for
+ *
+ * Wait until @fd is ready for @condition, or hung up.  In a coroutine the
+ * main loop goes on meanwhile, otherwise this blocks.
+ *
+ * Returns: the conditions that are met
+ */
+GIOCondition ga_co_wait_fd(int fd, GIOCondition condition)
+{
+    GPollFD pfd = { .fd = fd, .events = condition };
+    GIOChannel *channel;
+    GACoFdWait w;
+
+    if (!qemu_in_coroutine()) {
+        while (g_poll(&pfd, 1, -1) < 0 && errno == EINTR) {
+            /* again */
+        }
+        return pfd.revents;
+    }
+
+    w.co = qemu_coroutine_self();
+    w.revents = 0;
+    channel = g_io_channel_unix_new(fd);
+    ga_io_add_watch(channel, condition | G_IO_HUP | G_IO_ERR, ga_co_fd_ready,
+                    &w);
+    g_io_channel_unref(channel);
+    qemu_coroutine_yield();
+    return w.revents;
+}
+
+#endif
@@ -0,0 +1,391 @@
+/*
+ * QEMU Guest Agent buffered log writer
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include <glib.h>
+#include <stdio.h>
+#ifndef _WIN32
+#include <syslog.h>
+#endif
+#include "qga/guest-agent-core.h"
+
+/*
+ * Lines are formatted by the thread that logs them and copied to a ring,
+ * which a writer thread empties in batches: a little while after the
+ * first line arrives, or at once when the ring is half full.  Whoever
+ * logs only ever holds @lock for a copy; the file and syslog are written
+ * to with just @io_lock held, so a slow log device stalls the writer and
+ * not the agent.  A line that does not fit in the ring is dropped and
+ * counted, and the count is logged with the next batch.
+ *
+ * Each line of the ring is a uint32_t length, with GA_LOG_SYSLOG set for
+ * slog() lines, followed by the text.
+ *
+ * Apart from that, the most recent messages are kept in @history whatever
+ * the log level and even while logging is disabled, for
+ * guest-get-agent-log.
+ */
+struct GALog {
+    CompatGMutex lock;          /* protects everything but @file and @out */
+    CompatGCond cond;
+    char *ring;
+    size_t head;                /* where the oldest line starts */
+    size_t used;
+    int64_t first;              /* when the ring stopped being empty */
+    uint64_t dropped;
+    GHashTable *repeats;        /* slog() line -> times in this window */
+    int64_t window;             /* when the window started */
+    GQueue history;             /* of GALogRecord, oldest first */
+    size_t history_size;
+    uint64_t history_seq;       /* seq of the next record */
+    bool stop;
+    GThread *thread;
+    CompatGMutex io_lock;       /* serializes writing out, protects below */
+    FILE *file;
+    char *out;                  /* a batch being written out */
+};
+
+#define GA_LOG_RING_SIZE    (256 * 1024)
+#define GA_LOG_LINE_MAX     (GA_LOG_RING_SIZE / 16)
+#define GA_LOG_SYSLOG       (1u << 31)
+/* how long the first line of a batch may wait */
+#define GA_LOG_DELAY_US     (100 * 1000)
+
+/*
+ * The same slog() line is passed on GA_LOG_REPEAT_BURST times in every
+ * window; after that, only how often it was repeated is, once the window
+ * is over.  Up to GA_LOG_REPEAT_LINES different lines are counted.
+ */
+#define GA_LOG_REPEAT_BURST     10
+#define GA_LOG_REPEAT_WINDOW_US (60 * G_USEC_PER_SEC)
+#define GA_LOG_REPEAT_LINES     256
+
+/* how much of the history is kept, and of any one message */
+#define GA_LOG_HISTORY_SIZE     (64 * 1024)
+#define GA_LOG_RECORD_MAX       1024
+
+typedef struct GALogRecord {
+    GALogRecordInfo info;
+    size_t size;
+    char message[];
+} GALogRecord;
+
+static void ga_log_ring_copy(GALog *l, size_t pos, const void *data,
+                             size_t len)
+{
+    size_t n;
+
+    pos %= GA_LOG_RING_SIZE;
+    n = MIN(len, GA_LOG_RING_SIZE - pos);
+    memcpy(l->ring + pos, data, n);
+    memcpy(l->ring, (const char *)data + n, len - n);
+}
+
+/* with @lock held */
+static void ga_log_append_locked(GALog *l, bool is_syslog, const char *text,
+                                 size_t len)
+{
+    uint32_t hdr;
+
+    len = MIN(len, GA_LOG_LINE_MAX);
+    if (l->used + sizeof(hdr) + len > GA_LOG_RING_SIZE) {
+        l->dropped++;
+        return;
+    }
+
+    hdr = len | (is_syslog ? GA_LOG_SYSLOG : 0);
+    ga_log_ring_copy(l, l->head + l->used, &hdr, sizeof(hdr));
+    ga_log_ring_copy(l, l->head + l->used + sizeof(hdr), text, len);
+    if (!l->used) {
+        l->first = g_get_monotonic_time();
+        g_cond_signal(&l->cond);
+    } else if (l->used < GA_LOG_RING_SIZE / 2 &&
+               l->used + sizeof(hdr) + len >= GA_LOG_RING_SIZE / 2) {
+        g_cond_signal(&l->cond);
+    }
+    l->used += sizeof(hdr) + len;
+}
+
+static void ga_log_report_repeat(gpointer key, gpointer value,
+                                 gpointer opaque)
+{
+    GALog *l = opaque;
+    unsigned int count = *(unsigned int *)value;
+    char *text;
+
+    if (count > GA_LOG_REPEAT_BURST) {
+        text = g_strdup_printf("%s (repeated %u more times)", (char *)key,
+                               count - GA_LOG_REPEAT_BURST);
+        ga_log_append_locked(l, true, text, strlen(text));
+        g_free(text);
+    }
+}
+
+/* with @lock held, start a new window if the current one is over */
+static void ga_log_roll_window_locked(GALog *l, int64_t now, bool force)
+{
+    if (!force && now - l->window < GA_LOG_REPEAT_WINDOW_US) {
+        return;
+    }
+    g_hash_table_foreach(l->repeats, ga_log_report_repeat, l);
+    g_hash_table_remove_all(l->repeats);
+    l->window = now;
+}
+
+/* with @lock held; whether @text was seen too often in this window */
+static bool ga_log_repeated_locked(GALog *l, const char *text)
+{
+    unsigned int *count;
+
+    ga_log_roll_window_locked(l, g_get_monotonic_time(), false);
+    count = g_hash_table_lookup(l->repeats, text);
+    if (count) {
+        return ++*count > GA_LOG_REPEAT_BURST;
+    }
+    if (g_hash_table_size(l->repeats) < GA_LOG_REPEAT_LINES) {
+        count = g_new(unsigned int, 1);
+        *count = 1;
+        g_hash_table_insert(l->repeats, g_strdup(text), count);
+    }
+    return false;
+}
+
+/**
+ * ga_log_write:
+ * @l: the log
+ * @is_syslog: whether @text goes to syslog rather than to the log file
+ * @text: the line, which for the log file includes its newline
+ *
+ * Queue @text to be written out by the writer thread.  This does not
+ * block on I/O and can be called from any thread.
+ */
+void ga_log_write(GALog *l, bool is_syslog, const char *text)
+{
+    g_mutex_lock(&l->lock);
+    if (!is_syslog || !ga_log_repeated_locked(l, text)) {
+        ga_log_append_locked(l, is_syslog, text, strlen(text));
+    }
+    g_mutex_unlock(&l->lock);
+}
+
+/**
+ * ga_log_record:
+ * @l: the log
+ * @level: the level @message was logged at
+ * @is_syslog: whether it came from slog()
+ * @message: the message, without a timestamp
+ *
+ * Add @message to the history, dropping the oldest records as needed.
+ */
+void ga_log_record(GALog *l, GLogLevelFlags level, bool is_syslog,
+                   const char *message)
+{
+    size_t len = MIN(strlen(message), GA_LOG_RECORD_MAX);
+    GALogRecord *r = g_malloc(sizeof(*r) + len + 1);
+
+    r->info.time = g_get_real_time() * 1000;
+    r->info.level = level;
+    r->info.is_syslog = is_syslog;
+    r->size = sizeof(*r) + len + 1;
+    memcpy(r->message, message, len);
+    r->message[len] = '\0';
+    r->info.message = r->message;
+
+    g_mutex_lock(&l->lock);
+    r->info.seq = l->history_seq++;
+    g_queue_push_tail(&l->history, r);
+    l->history_size += r->size;
+    while (l->history_size > GA_LOG_HISTORY_SIZE) {
+        r = g_queue_pop_head(&l->history);
+        l->history_size -= r->size;
+        g_free(r);
+    }
+    g_mutex_unlock(&l->lock);
+}
+
+/**
+ * ga_log_foreach:
+ *
+ * Call @func for the records of the history from @cursor on, oldest
+ * first, and return the cursor that continues after them.  @lost is set
+ * to the number of records since @cursor that were dropped before they
+ * could be read.  A @cursor from the future, such as one returned by a
+ * previous agent instance, starts over at the beginning.  @func is called
+ * with the log locked and must not log anything itself.
+ */
+uint64_t ga_log_foreach(GALog *l, uint64_t cursor, uint64_t *lost,
+                        GALogRecordFunc func, void *opaque)
+{
+    GALogRecord *r;
+    uint64_t first, next;
+    GList *e;
+
+    g_mutex_lock(&l->lock);
+    next = l->history_seq;
+    r = g_queue_peek_head(&l->history);
+    first = r ? r->info.seq : next;
+    if (cursor > next) {
+        cursor = 0;
+    }
+    *lost = cursor < first ? first - cursor : 0;
+    for (e = l->history.head; e; e = e->next) {
+        r = e->data;
+        if (r->info.seq >= cursor) {
+            func(&r->info, opaque);
+        }
+    }
+    g_mutex_unlock(&l->lock);
+
+    return next;
+}
+
+static void ga_log_write_out(GALog *l, const char *text, size_t len,
+                             bool is_syslog)
+{
+#ifndef _WIN32
+    if (is_syslog) {
+        syslog(LOG_INFO, "%.*s", (int)len, text);
+        return;
+    }
+#endif
+    if (fwrite(text, 1, len, l->file) != len) {
+        /* there is nowhere to report it */
+    }
+}
+
+/* write out what is in the ring, in the calling thread */
+static void ga_log_drain(GALog *l)
+{
+    size_t len, n, pos;
+    uint64_t dropped;
+    uint32_t hdr;
+    GTimeVal time;
+
+    g_mutex_lock(&l->io_lock);
+    g_mutex_lock(&l->lock);
+    len = l->used;
+    n = MIN(len, GA_LOG_RING_SIZE - l->head);
+    memcpy(l->out, l->ring + l->head, n);
+    memcpy(l->out + n, l->ring, len - n);
+    l->head = 0;
+    l->used = 0;
+    dropped = l->dropped;
+    l->dropped = 0;
+    g_mutex_unlock(&l->lock);
+
+    for (pos = 0; pos < len; pos += sizeof(hdr) + (hdr & ~GA_LOG_SYSLOG)) {
+        memcpy(&hdr, l->out + pos, sizeof(hdr));
+        ga_log_write_out(l, l->out + pos + sizeof(hdr),
+                         hdr & ~GA_LOG_SYSLOG, hdr & GA_LOG_SYSLOG);
+    }
+    if (dropped) {
+        g_get_current_time(&time);
+        fprintf(l->file, "%lu.%lu: warning: %" PRIu64 " log messages"
+                " dropped\n", time.tv_sec, time.tv_usec, dropped);
+    }
+    if (len || dropped) {
+        fflush(l->file);
+    }
+    g_mutex_unlock(&l->io_lock);
+}
+
+static gpointer ga_log_thread(gpointer opaque)
+{
+    GALog *l = opaque;
+    int64_t deadline;
+
+    g_mutex_lock(&l->lock);
+    while (!l->stop) {
+        if (!l->used) {
+            g_cond_wait(&l->cond, &l->lock);
+            continue;
+        }
+        deadline = l->first + GA_LOG_DELAY_US;
+        if (l->used < GA_LOG_RING_SIZE / 2 &&
+            g_get_monotonic_time() < deadline) {
+            g_cond_wait_until(&l->cond, &l->lock, deadline);
+            continue;
+        }
+        g_mutex_unlock(&l->lock);
+        ga_log_drain(l);
+        g_mutex_lock(&l->lock);
+    }
+    g_mutex_unlock(&l->lock);
+
+    return NULL;
+}
+
+/**
+ * ga_log_flush:
+ *
+ * Write out all queued lines before returning, e.g. before an error that
+ * terminates the agent or before the log file's filesystem is frozen.
+ */
+void ga_log_flush(GALog *l)
+{
+    ga_log_drain(l);
+}
+
+/* lines queued so far are written to the previous file */
+void ga_log_set_file(GALog *l, FILE *file)
+{
+    ga_log_drain(l);
+    g_mutex_lock(&l->io_lock);
+    l->file = file;
+    g_mutex_unlock(&l->io_lock);
+}
+
+/**
+ * ga_log_new:
+ * @file: where lines other than those for syslog go
+ *
+ * Start the writer thread.  Like the sampler, this should happen after
+ * the spawn helper is forked.
+ */
+GALog *ga_log_new(FILE *file)
+{
+    GALog *l = g_new0(GALog, 1);
+
+    g_mutex_init(&l->lock);
+    g_cond_init(&l->cond);
+    g_mutex_init(&l->io_lock);
+    l->ring = g_malloc(GA_LOG_RING_SIZE);
+    l->out = g_malloc(GA_LOG_RING_SIZE);
+    l->repeats = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                       g_free);
+    l->window = g_get_monotonic_time();
+    g_queue_init(&l->history);
+    l->file = file;
+    l->thread = g_thread_new("qga-log", ga_log_thread, l);
+
+    return l;
+}
+
+/* stop the writer thread and write out what is left */
+void ga_log_free(GALog *l)
+{
+    if (!l) {
+        return;
+    }
+
+    g_mutex_lock(&l->lock);
+    l->stop = true;
+    g_cond_signal(&l->cond);
+    ga_log_roll_window_locked(l, g_get_monotonic_time(), true);
+    g_mutex_unlock(&l->lock);
+    g_thread_join(l->thread);
+    ga_log_drain(l);
+
+    g_hash_table_destroy(l->repeats);
+    while (!g_queue_is_empty(&l->history)) {
+        g_free(g_queue_pop_head(&l->history));
+    }
+    g_mutex_clear(&l->lock);
+    g_cond_clear(&l->cond);
+    g_mutex_clear(&l->io_lock);
+    g_free(l->ring);
+    g_free(l->out);
+    g_free(l);
+}
@@ -0,0 +1,361 @@
+/*
+ * QEMU Guest Agent epoll based fd watches
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include <glib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+#include "qga/guest-agent-core.h"
+
+/*
+ * glib hands the fds of every source to poll() on each main loop
+ * iteration, after rebuilding the array from the sources.  With many
+ * clients and guest-exec pipes that is a lot of work for the one or two
+ * fds that are ready.  With --epoll the channel and guest-exec watches of
+ * the default main context go to a single epoll instance instead, which
+ * glib sees as one fd: the interest list is only touched when a watch is
+ * added or removed, and a wakeup costs in proportion to the fds that are
+ * ready.
+ *
+ * The watches stay level-triggered: the callbacks were written for glib
+ * watches and read one chunk per call, relying on being called again
+ * while data is left.
+ *
+ * ga_io_add_watch() and ga_io_remove_watch() fall back to the glib
+ * functions when epoll is not in use, so callers do not need to care.
+ */
+
+#ifdef __linux__
+
+/* events taken from epoll per dispatch; the rest are seen next time */
+#define GA_LOOP_MAX_EVENTS 64
+
+typedef struct GALoopFd GALoopFd;
+
+typedef struct GALoopWatch {
+    guint id;
+    GIOChannel *channel;
+    GIOCondition condition;
+    GIOFunc func;
+    gpointer data;
+    GALoopFd *fd;
+    bool removed;
+} GALoopWatch;
+
+struct GALoopFd {
+    int fd;
+    uint32_t events;            /* registered with epoll */
+    GList *watches;
+    bool removed;
+};
+
+typedef struct GALoopSource {
+    GSource source;
+    GPollFD pfd;
+} GALoopSource;
+
+static struct {
+    int epfd;
+    GALoopSource *source;
+    GHashTable *watches;        /* id -> GALoopWatch */
+    GHashTable *fds;            /* fd -> GALoopFd */
+    guint next_id;
+    int dispatching;
+    /*
+     * Removed while dispatching: the events taken from epoll may still
+     * point to them, so they are freed once the dispatch is over.
+     */
+    GSList *dead_watches;
+    GSList *dead_fds;
+} ga_loop = { .epfd = -1 };
+
+static uint32_t ga_loop_events(GIOCondition condition)
+{
+    uint32_t events = 0;
+
+    if (condition & G_IO_IN) {
+        events |= EPOLLIN;
+    }
+    if (condition & G_IO_PRI) {
+        events |= EPOLLPRI;
+    }
+    if (condition & G_IO_OUT) {
+        events |= EPOLLOUT;
+    }
+    return events;
+}
+
+static GIOCondition ga_loop_condition(uint32_t events)
+{
+    GIOCondition condition = 0;
+
+    if (events & EPOLLIN) {
+        condition |= G_IO_IN;
+    }
+    if (events & EPOLLPRI) {
+        condition |= G_IO_PRI;
+    }
+    if (events & EPOLLOUT) {
+        condition |= G_IO_OUT;
+    }
+    if (events & EPOLLHUP) {
+        condition |= G_IO_HUP;
+    }
+    if (events & EPOLLERR) {
+        condition |= G_IO_ERR;
+    }
+    return condition;
+}
+
+/* bring the epoll registration of @lfd in line with its watches */
+static void ga_loop_fd_update(GALoopFd *lfd)
+{
+    struct epoll_event ev = { .data.ptr = lfd };
+    GALoopWatch *w;
+    GList *l;
+    int op;
+
+    for (l = lfd->watches; l; l = l->next) {
+        w = l->data;
+        if (!w->removed) {
+            ev.events |= ga_loop_events(w->condition);
+        }
+    }
+    if (ev.events == lfd->events && lfd->watches) {
+        return;
+    }
+
+    if (!lfd->watches) {
+        /* the fd may be closed already, which removed it from the set */
+        epoll_ctl(ga_loop.epfd, EPOLL_CTL_DEL, lfd->fd, &ev);
+        g_hash_table_steal(ga_loop.fds, GINT_TO_POINTER(lfd->fd));
+        lfd->removed = true;
+        if (ga_loop.dispatching) {
+            ga_loop.dead_fds = g_slist_prepend(ga_loop.dead_fds, lfd);
+        } else {
+            g_free(lfd);
+        }
+        return;
+    }
+    op = lfd->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    if (epoll_ctl(ga_loop.epfd, op, lfd->fd, &ev) < 0 && op == EPOLL_CTL_MOD &&
+        errno == ENOENT) {
+        /* closed and opened again under the same number */
+        epoll_ctl(ga_loop.epfd, EPOLL_CTL_ADD, lfd->fd, &ev);
+    }
+    lfd->events = ev.events;
+}
+
+static void ga_loop_watch_free(GALoopWatch *w)
+{
+    g_io_channel_unref(w->channel);
+    g_free(w);
+}
+
+static void ga_loop_watch_remove(GALoopWatch *w)
+{
+    GALoopFd *lfd = w->fd;
+
+    if (w->removed) {
+        return;
+    }
+    w->removed = true;
+    g_hash_table_remove(ga_loop.watches, GUINT_TO_POINTER(w->id));
+    lfd->watches = g_list_remove(lfd->watches, w);
+    ga_loop_fd_update(lfd);
+    if (ga_loop.dispatching) {
+        ga_loop.dead_watches = g_slist_prepend(ga_loop.dead_watches, w);
+    } else {
+        ga_loop_watch_free(w);
+    }
+}
+
+static gboolean ga_loop_prepare(GSource *source, gint *timeout)
+{
+    *timeout = -1;
+    return false;
+}
+
+static gboolean ga_loop_check(GSource *source)
+{
+    GALoopSource *ls = (GALoopSource *)source;
+
+    return ls->pfd.revents != 0;
+}
+
+static gboolean ga_loop_dispatch(GSource *source, GSourceFunc callback,
+                                 gpointer user_data)
+{
+    struct epoll_event events[GA_LOOP_MAX_EVENTS];
+    GIOCondition condition;
+    GALoopWatch *w;
+    GList *watches, *l;
+    GALoopFd *lfd;
+    int i, n;
+
+    do {
+        n = epoll_wait(ga_loop.epfd, events, GA_LOOP_MAX_EVENTS, 0);
+    } while (n < 0 && errno == EINTR);
+
+    ga_loop.dispatching++;
+    for (i = 0; i < n; i++) {
+        lfd = events[i].data.ptr;
+        if (lfd->removed) {
+            continue;
+        }
+        condition = ga_loop_condition(events[i].events);
+        /* a callback may remove any watch, including the other ones */
+        watches = g_list_copy(lfd->watches);
+        for (l = watches; l; l = l->next) {
+            w = l->data;
+            if (w->removed || !(condition & w->condition)) {
+                continue;
+            }
+            if (!w->func(w->channel, condition & w->condition, w->data)) {
+                ga_loop_watch_remove(w);
+            }
+        }
+        g_list_free(watches);
+    }
+    ga_loop.dispatching--;
+
+    if (!ga_loop.dispatching) {
+        g_slist_free_full(ga_loop.dead_watches,
+                          (GDestroyNotify)ga_loop_watch_free);
+        ga_loop.dead_watches = NULL;
+        g_slist_free_full(ga_loop.dead_fds, g_free);
+        ga_loop.dead_fds = NULL;
+    }
+    return true;
+}
+
+static GSourceFuncs ga_loop_source_funcs = {
+    .prepare = ga_loop_prepare,
+    .check = ga_loop_check,
+    .dispatch = ga_loop_dispatch,
+};
+
+bool ga_loop_init(bool use_epoll)
+{
+    if (!use_epoll) {
+        return true;
+    }
+    ga_loop.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (ga_loop.epfd < 0) {
+        g_warning("epoll_create1 failed: %s, using glib's poll",
+                  strerror(errno));
+        return false;
+    }
+    ga_loop.watches = g_hash_table_new(NULL, NULL);
+    ga_loop.fds = g_hash_table_new_full(NULL, NULL, NULL, g_free);
+    ga_loop.source = (GALoopSource *)g_source_new(&ga_loop_source_funcs,
+                                                  sizeof(GALoopSource));
+    ga_loop.source->pfd.fd = ga_loop.epfd;
+    ga_loop.source->pfd.events = G_IO_IN;
+    g_source_add_poll(&ga_loop.source->source, &ga_loop.source->pfd);
+    g_source_attach(&ga_loop.source->source, NULL);
+    return true;
+}
+
+void ga_loop_cleanup(void)
+{
+    GHashTableIter iter;
+    gpointer w;
+
+    if (ga_loop.epfd < 0) {
+        return;
+    }
+    g_hash_table_iter_init(&iter, ga_loop.watches);
+    while (g_hash_table_iter_next(&iter, NULL, &w)) {
+        ga_loop_watch_free(w);
+    }
+    g_hash_table_destroy(ga_loop.watches);
+    g_hash_table_destroy(ga_loop.fds);
+    g_source_destroy(&ga_loop.source->source);
+    g_source_unref(&ga_loop.source->source);
+    close(ga_loop.epfd);
+    memset(&ga_loop, 0, sizeof(ga_loop));
+    ga_loop.epfd = -1;
+}
+
+guint ga_io_add_watch(GIOChannel *channel, GIOCondition condition,
+                      GIOFunc func, gpointer data)
+{
+    int fd = g_io_channel_unix_get_fd(channel);
+    GALoopWatch *w;
+    GALoopFd *lfd;
+
+    if (ga_loop.epfd < 0) {
+        return g_io_add_watch(channel, condition, func, data);
+    }
+
+    lfd = g_hash_table_lookup(ga_loop.fds, GINT_TO_POINTER(fd));
+    if (!lfd) {
+        lfd = g_new0(GALoopFd, 1);
+        lfd->fd = fd;
+        g_hash_table_insert(ga_loop.fds, GINT_TO_POINTER(fd), lfd);
+    }
+
+    w = g_new0(GALoopWatch, 1);
+    /* ids are never 0, like those of glib sources */
+    do {
+        w->id = ++ga_loop.next_id;
+    } while (!w->id ||
+             g_hash_table_lookup(ga_loop.watches, GUINT_TO_POINTER(w->id)));
+    w->channel = g_io_channel_ref(channel);
+    w->condition = condition;
+    w->func = func;
+    w->data = data;
+    w->fd = lfd;
+    g_hash_table_insert(ga_loop.watches, GUINT_TO_POINTER(w->id), w);
+    lfd->watches = g_list_prepend(lfd->watches, w);
+    ga_loop_fd_update(lfd);
+    return w->id;
+}
+
+void ga_io_remove_watch(guint id)
+{
+    GALoopWatch *w;
+
+    if (ga_loop.epfd < 0) {
+        g_source_remove(id);
+        return;
+    }
+    w = g_hash_table_lookup(ga_loop.watches, GUINT_TO_POINTER(id));
+    g_assert(w);
+    ga_loop_watch_remove(w);
+}
+
+#else
+
+bool ga_loop_init(bool use_epoll)
+{
+    if (use_epoll) {
+        g_warning("epoll is not available, using glib's poll");
+        return false;
+    }
+    return true;
+}
+
+void ga_loop_cleanup(void)
+{
+}
+
+guint ga_io_add_watch(GIOChannel *channel, GIOCondition condition,
+                      GIOFunc func, gpointer data)
+{
+    return g_io_add_watch(channel, condition, func, data);
+}
+
+void ga_io_remove_watch(guint id)
+{
+    g_source_remove(id);
+}
+
+#endif
@@ -0,0 +1,196 @@
+/*
+ * QEMU Guest Agent metrics page
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include <glib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#include "qga/guest-agent-core.h"
+#include "qga/metrics-page.h"
+#include "qapi/error.h"
+#include "qemu/atomic.h"
+
+/*
+ * With --metrics-shm, the sampler thread also writes each sample to a
+ * GAMetricsPage at the start of a shared memory region, so that the host
+ * can poll the metrics of many guests without a request to any of them.
+ * The region is normally the BAR of an ivshmem device, given as the
+ * path of its resource2 file in sysfs or as "ivshmem" for the first one
+ * found; on the host, QEMU started with
+ *
+ *   -device ivshmem,shm=qga-metrics-vm1,size=1M
+ *
+ * has it in /dev/shm/qga-metrics-vm1.  Any other file is mapped as it
+ * is, and grown to the size of the page if it is smaller.
+ *
+ * The sampler thread is the only writer; the host reads under the
+ * sequence count of the page, as metrics-page.h describes.
+ */
+struct GAMetricsShm {
+    volatile GAMetricsPage *page;
+    size_t map_size;
+};
+
+#define GA_METRICS_SHM_IVSHMEM "ivshmem"
+#define GA_PCI_DEVICES "/sys/bus/pci/devices"
+
+QEMU_BUILD_BUG_ON(GA_METRICS_PAGE_NCOUNTERS != GA_ROLLUP_NCOLUMNS);
+
+#ifndef _WIN32
+/* whether sysfs file @name of PCI device @dev reads as @id */
+static bool ga_pci_id_is(const char *dev, const char *name, unsigned int id)
+{
+    char *path, *contents;
+    bool ret = false;
+
+    path = g_build_filename(GA_PCI_DEVICES, dev, name, NULL);
+    if (g_file_get_contents(path, &contents, NULL, NULL)) {
+        ret = strtoul(contents, NULL, 16) == id;
+        g_free(contents);
+    }
+    g_free(path);
+    return ret;
+}
+
+/* the shared memory BAR of the first ivshmem device */
+static char *ga_metrics_shm_find_ivshmem(Error **errp)
+{
+    const char *name;
+    char *path = NULL;
+    GDir *dir;
+
+    dir = g_dir_open(GA_PCI_DEVICES, 0, NULL);
+    while (dir && !path && (name = g_dir_read_name(dir)) != NULL) {
+        if (ga_pci_id_is(name, "vendor", 0x1af4) &&
+            ga_pci_id_is(name, "device", 0x1110)) {
+            path = g_build_filename(GA_PCI_DEVICES, name, "resource2", NULL);
+        }
+    }
+    if (dir) {
+        g_dir_close(dir);
+    }
+    if (!path) {
+        error_setg(errp, "no ivshmem device found for the metrics page");
+    }
+    return path;
+}
+
+GAMetricsShm *ga_metrics_shm_new(const char *path, Error **errp)
+{
+    GAMetricsShm *m;
+    char *found = NULL;
+    struct stat st;
+    void *addr;
+    int fd;
+
+    if (!strcmp(path, GA_METRICS_SHM_IVSHMEM)) {
+        found = ga_metrics_shm_find_ivshmem(errp);
+        if (!found) {
+            return NULL;
+        }
+        path = found;
+    }
+
+    fd = qemu_open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    if (fd == -1) {
+        error_setg_errno(errp, errno, "failed to open metrics page '%s'",
+                         path);
+        g_free(found);
+        return NULL;
+    }
+    if (fstat(fd, &st) < 0 ||
+        (S_ISREG(st.st_mode) && st.st_size < (off_t)sizeof(GAMetricsPage) &&
+         ftruncate(fd, getpagesize()) < 0)) {
+        error_setg_errno(errp, errno, "failed to size metrics page '%s'",
+                         path);
+        goto fail;
+    }
+    /* a BAR file of sysfs reports the size of the BAR */
+    if (!S_ISREG(st.st_mode) && st.st_size &&
+        st.st_size < (off_t)sizeof(GAMetricsPage)) {
+        error_setg(errp, "metrics page '%s' is too small", path);
+        goto fail;
+    }
+    addr = mmap(NULL, getpagesize(), PROT_READ | PROT_WRITE, MAP_SHARED,
+                fd, 0);
+    if (addr == MAP_FAILED) {
+        error_setg_errno(errp, errno, "failed to map metrics page '%s'",
+                         path);
+        goto fail;
+    }
+    close(fd);
+    g_free(found);
+
+    m = g_new0(GAMetricsShm, 1);
+    m->page = addr;
+    m->map_size = getpagesize();
+
+    /* a sequence count of 0 tells readers there is no sample yet */
+    atomic_set(&m->page->seqcount, 0);
+    smp_wmb();
+    m->page->magic = GA_METRICS_PAGE_MAGIC;
+    m->page->version = GA_METRICS_PAGE_VERSION;
+    m->page->size = sizeof(GAMetricsPage);
+    return m;
+
+fail:
+    close(fd);
+    g_free(found);
+    return NULL;
+}
+
+/* called from the sampler thread */
+void ga_metrics_shm_publish(GAMetricsShm *m, const GASample *sample,
+                            int64_t interval_ms)
+{
+    volatile GAMetricsPage *page = m->page;
+    uint64_t seqcount = page->seqcount;
+
+    atomic_set(&page->seqcount, seqcount + 1);
+    smp_wmb();
+    page->interval_ms = interval_ms;
+    page->seq = sample->seq;
+    page->time = sample->time;
+    page->present = sample->present;
+    memcpy((void *)page->counters, &sample->cpu_user,
+           sizeof(page->counters));
+    smp_wmb();
+    atomic_set(&page->seqcount, seqcount + 2);
+}
+
+void ga_metrics_shm_free(GAMetricsShm *m)
+{
+    if (!m) {
+        return;
+    }
+    /* the host sees that there is no sample any more */
+    atomic_set(&m->page->seqcount, 0);
+    munmap((void *)m->page, m->map_size);
+    g_free(m);
+}
+#else
+GAMetricsShm *ga_metrics_shm_new(const char *path, Error **errp)
+{
+    error_setg(errp, "the metrics page is not supported on Windows");
+    return NULL;
+}
+
+void ga_metrics_shm_publish(GAMetricsShm *m, const GASample *sample,
+                            int64_t interval_ms)
+{
+}
+
+void ga_metrics_shm_free(GAMetricsShm *m)
+{
+}
+#endif
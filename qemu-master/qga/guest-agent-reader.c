@@ -0,0 +1,450 @@
+/*
+ * QEMU Guest Agent sequential file reads ahead of the consumer
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include <glib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "qga/guest-agent-core.h"
+#ifdef CONFIG_QGA_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include "qemu/atomic.h"
+#endif
+
+/*
+ * Bulk reads (file pulls, checksums, archives) consume a range of a file
+ * front to back in chunks.  Where the kernel has io_uring, GA_READER_DEPTH
+ * chunks are kept in flight in registered buffers, so the disk works on
+ * the next ones while the agent sends or hashes the current one, without
+ * another thread.  Elsewhere, CentOS 6 and 7 kernels, guests where
+ * io_uring is disabled and Windows, each chunk is a read() and the range
+ * ahead is handed to the kernel's own read-ahead with POSIX_FADV_WILLNEED
+ * where there is one.
+ *
+ * The agent only waits for a read when the chunk it wants is not done
+ * yet, so the ring needs no main loop source: whoever calls
+ * ga_reader_next() reaps the completions, from the main loop for streams
+ * or from the worker thread for background requests.
+ */
+#define GA_READER_DEPTH     4
+
+#ifdef CONFIG_QGA_IO_URING
+typedef struct GAReaderSlot {
+    int64_t offset;
+    size_t len;
+    ssize_t res;
+    bool busy;                  /* submitted, and not handed out yet */
+    bool done;                  /* its completion has been reaped */
+} GAReaderSlot;
+
+typedef struct GAReaderRing {
+    int fd;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    GAReaderSlot slots[GA_READER_DEPTH];
+    unsigned head;              /* the slot handed out next */
+    int64_t submitted;          /* end of what has been asked for */
+} GAReaderRing;
+
+/* -1 once the kernel said no, so that later readers do not ask again */
+static int ga_reader_io_uring_ok;
+#endif
+
+struct GAReader {
+    int fd;
+    int64_t offset;             /* of the next chunk handed out */
+    int64_t end;
+    size_t chunk;
+    guchar *buf;                /* GA_READER_DEPTH chunks with a ring */
+    bool eof;
+    int error;                  /* of the seek to @offset, without a ring */
+    int64_t advised;            /* end of the range passed to WILLNEED */
+#ifdef CONFIG_QGA_IO_URING
+    GAReaderRing *ring;
+#endif
+};
+
+#ifdef CONFIG_QGA_IO_URING
+static void ga_reader_ring_free(GAReaderRing *ring)
+{
+    if (ring->sqes) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    close(ring->fd);
+    g_free(ring);
+}
+
+/* a ring with the chunks of @r registered, or NULL to use read() */
+static GAReaderRing *ga_reader_ring_new(GAReader *r)
+{
+    struct io_uring_params p;
+    struct iovec iov[GA_READER_DEPTH];
+    GAReaderRing *ring;
+    int fd, i;
+
+    if (ga_reader_io_uring_ok < 0) {
+        return NULL;
+    }
+    memset(&p, 0, sizeof(p));
+    fd = syscall(__NR_io_uring_setup, GA_READER_DEPTH, &p);
+    if (fd < 0) {
+        /* ENOSYS before 5.1, EPERM where it is disabled */
+        g_debug("io_uring not available: %s", strerror(errno));
+        ga_reader_io_uring_ok = -1;
+        return NULL;
+    }
+
+    ring = g_new0(GAReaderRing, 1);
+    ring->fd = fd;
+    ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = p.cq_off.cqes +
+                         p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->sq_ring_size = MAX(ring->sq_ring_size, ring->cq_ring_size);
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        ring->sq_ring = NULL;
+        goto fail;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size,
+                             PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, fd,
+                             IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            ring->cq_ring = NULL;
+            goto fail;
+        }
+    }
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        goto fail;
+    }
+
+    ring->sq_head = (unsigned *)((char *)ring->sq_ring + p.sq_off.head);
+    ring->sq_tail = (unsigned *)((char *)ring->sq_ring + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)((char *)ring->sq_ring + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((char *)ring->sq_ring + p.sq_off.array);
+    ring->cq_head = (unsigned *)((char *)ring->cq_ring + p.cq_off.head);
+    ring->cq_tail = (unsigned *)((char *)ring->cq_ring + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)((char *)ring->cq_ring + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ring +
+                                         p.cq_off.cqes);
+
+    /* pinned once, so the kernel does not map the pages for every read */
+    for (i = 0; i < GA_READER_DEPTH; i++) {
+        iov[i].iov_base = r->buf + i * r->chunk;
+        iov[i].iov_len = r->chunk;
+    }
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, iov,
+                GA_READER_DEPTH) < 0) {
+        /* RLIMIT_MEMLOCK before 5.12; the next reader may be smaller */
+        g_debug("failed to register io_uring buffers: %s", strerror(errno));
+        goto fail;
+    }
+    ga_reader_io_uring_ok = 1;
+    return ring;
+
+fail:
+    ga_reader_ring_free(ring);
+    return NULL;
+}
+
+/* queue reads into the free slots, up to the end of the range */
+static int ga_reader_ring_fill(GAReader *r)
+{
+    GAReaderRing *ring = r->ring;
+    struct io_uring_sqe *sqe;
+    GAReaderSlot *slot;
+    unsigned tail, n = 0, i, k;
+    int ret;
+
+    tail = atomic_read(ring->sq_tail);
+    for (k = 0; k < GA_READER_DEPTH && ring->submitted < r->end; k++) {
+        i = (ring->head + k) % GA_READER_DEPTH;
+        slot = &ring->slots[i];
+        if (slot->busy) {
+            continue;
+        }
+        slot->offset = ring->submitted;
+        slot->len = MIN((int64_t)r->chunk, r->end - ring->submitted);
+        slot->busy = true;
+        slot->done = false;
+        ring->submitted += slot->len;
+
+        sqe = &ring->sqes[tail & *ring->sq_mask];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_READ_FIXED;
+        sqe->fd = r->fd;
+        sqe->off = slot->offset;
+        sqe->addr = (uintptr_t)(r->buf + i * r->chunk);
+        sqe->len = slot->len;
+        sqe->buf_index = i;
+        sqe->user_data = i;
+        ring->sq_array[tail & *ring->sq_mask] = tail & *ring->sq_mask;
+        tail++;
+        n++;
+    }
+    if (!n) {
+        return 0;
+    }
+    /* the entries must be visible before the tail that publishes them */
+    smp_wmb();
+    atomic_set(ring->sq_tail, tail);
+
+    do {
+        ret = syscall(__NR_io_uring_enter, ring->fd, n, 0, 0, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+    return ret < 0 ? -errno : 0;
+}
+
+/* whether a read is still in flight */
+static bool ga_reader_ring_busy(GAReaderRing *ring)
+{
+    int i;
+
+    for (i = 0; i < GA_READER_DEPTH; i++) {
+        if (ring->slots[i].busy && !ring->slots[i].done) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* note the completions there are, waiting for one if @wait */
+static int ga_reader_ring_reap(GAReader *r, bool wait)
+{
+    GAReaderRing *ring = r->ring;
+    struct io_uring_cqe *cqe;
+    unsigned head, tail;
+    bool reaped = false;
+    int ret;
+
+    for (;;) {
+        head = atomic_read(ring->cq_head);
+        tail = atomic_read(ring->cq_tail);
+        smp_rmb();
+        while (head != tail) {
+            cqe = &ring->cqes[head & *ring->cq_mask];
+            if (cqe->user_data < GA_READER_DEPTH) {
+                ring->slots[cqe->user_data].res = cqe->res;
+                ring->slots[cqe->user_data].done = true;
+            }
+            head++;
+            reaped = true;
+        }
+        smp_mb();
+        atomic_set(ring->cq_head, head);
+        if (reaped || !wait) {
+            return 0;
+        }
+        ret = syscall(__NR_io_uring_enter, ring->fd, 0, 1,
+                      IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0 && errno != EINTR) {
+            return -errno;
+        }
+    }
+}
+
+static ssize_t ga_reader_ring_next(GAReader *r, const guchar **data)
+{
+    GAReaderRing *ring = r->ring;
+    GAReaderSlot *slot = &ring->slots[ring->head];
+    guchar *buf = r->buf + ring->head * r->chunk;
+    ssize_t n;
+    int ret;
+
+    ret = ga_reader_ring_fill(r);
+    if (ret < 0) {
+        return ret;
+    }
+    if (!slot->busy) {
+        return 0;
+    }
+    while (!slot->done) {
+        ret = ga_reader_ring_reap(r, true);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    if (slot->res < 0) {
+        return slot->res;
+    }
+
+    /* a short read is the end of the file, or the kernel stopped early */
+    n = slot->res;
+    while (n < (ssize_t)slot->len) {
+        ret = pread(r->fd, buf + n, slot->len - n, slot->offset + n);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret < 0) {
+            return -errno;
+        }
+        if (ret == 0) {
+            r->eof = true;
+            break;
+        }
+        n += ret;
+    }
+
+    /* handed out now, read into again by the next call */
+    slot->busy = false;
+    ring->head = (ring->head + 1) % GA_READER_DEPTH;
+    *data = buf;
+    return n;
+}
+#endif
+
+/*
+ * Read the @length bytes of @fd from @offset, in chunks of @chunk bytes,
+ * ahead of ga_reader_next().  @fd stays open and must not be read from or
+ * seeked meanwhile; @length may run past the end of the file.
+ */
+GAReader *ga_reader_new(int fd, int64_t offset, int64_t length, size_t chunk)
+{
+    GAReader *r = g_new0(GAReader, 1);
+
+    r->fd = fd;
+    r->offset = offset;
+    r->end = length > INT64_MAX - offset ? INT64_MAX : offset + length;
+    r->chunk = chunk;
+    r->advised = offset;
+#ifdef CONFIG_QGA_IO_URING
+    if (posix_memalign((void **)&r->buf, getpagesize(),
+                       GA_READER_DEPTH * chunk) == 0) {
+        r->ring = ga_reader_ring_new(r);
+        if (r->ring) {
+            r->ring->submitted = offset;
+            return r;
+        }
+        free(r->buf);
+    }
+#endif
+    r->buf = g_malloc(chunk);
+    if (lseek(fd, offset, SEEK_SET) < 0) {
+        r->error = errno;
+    }
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, offset, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    return r;
+}
+
+/*
+ * The next chunk, in *@data until the next call: as many bytes as asked
+ * for, fewer at the end of the range or the file, 0 after it, or -errno.
+ */
+ssize_t ga_reader_next(GAReader *r, const guchar **data)
+{
+    int64_t ahead;
+    size_t want;
+    ssize_t n = 0, ret;
+
+    if (r->error) {
+        return -r->error;
+    }
+    if (r->eof || r->offset >= r->end) {
+        return 0;
+    }
+#ifdef CONFIG_QGA_IO_URING
+    if (r->ring) {
+        n = ga_reader_ring_next(r, data);
+        if (n > 0) {
+            r->offset += n;
+        }
+        if (n == 0) {
+            r->eof = true;
+        }
+        return n;
+    }
+#endif
+
+    /* keep the kernel GA_READER_DEPTH chunks ahead of us */
+    ahead = MIN(r->end - r->offset, (int64_t)GA_READER_DEPTH * r->chunk);
+    if (r->offset + ahead > r->advised) {
+#ifdef POSIX_FADV_WILLNEED
+        posix_fadvise(r->fd, r->advised, r->offset + ahead - r->advised,
+                      POSIX_FADV_WILLNEED);
+#endif
+        r->advised = r->offset + ahead;
+    }
+
+    want = MIN((int64_t)r->chunk, r->end - r->offset);
+    while (n < (ssize_t)want) {
+        ret = read(r->fd, r->buf + n, want - n);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret < 0) {
+            return -errno;
+        }
+        if (ret == 0) {
+            r->eof = true;
+            break;
+        }
+        n += ret;
+    }
+    r->offset += n;
+    *data = r->buf;
+    return n;
+}
+
+/* whether @r reads through io_uring */
+bool ga_reader_is_async(GAReader *r)
+{
+#ifdef CONFIG_QGA_IO_URING
+    return r->ring != NULL;
+#else
+    return false;
+#endif
+}
+
+void ga_reader_free(GAReader *r)
+{
+    if (!r) {
+        return;
+    }
+#ifdef CONFIG_QGA_IO_URING
+    if (r->ring) {
+        /* the reads still in flight are into the buffers about to go */
+        while (ga_reader_ring_busy(r->ring)) {
+            if (ga_reader_ring_reap(r, true) < 0) {
+                break;
+            }
+        }
+        ga_reader_ring_free(r->ring);
+        free(r->buf);
+        g_free(r);
+        return;
+    }
+#endif
+    g_free(r->buf);
+    g_free(r);
+}
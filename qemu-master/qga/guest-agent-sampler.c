@@ -0,0 +1,498 @@
+/*
+ * QEMU Guest Agent metrics sampler
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include <glib.h>
+#include "qga/guest-agent-core.h"
+#include "qemu/atomic.h"
+#include "qemu/rcu.h"
+
+/*
+ * A thread takes a GASample every @interval_ms into a ring of @size slots
+ * allocated up front.  It is the only writer; readers in the main loop
+ * do not take a lock but check the sequence number of each slot before
+ * and after copying it, and drop slots the writer has reused meanwhile.
+ * Reconfiguring happens in the main loop too, with the thread stopped;
+ * a resized ring replaces the old one under RCU, so readers on worker
+ * threads go on with the ring they found until they are done.  The
+ * sampler itself is freed the same way.
+ *
+ * With a spool, each sample is also written to a ring in a file, where
+ * readers find those the ring in memory no longer has, and the sequence
+ * numbers go on from those of the agent that wrote it before.
+ *
+ * Each sample also goes to the current bucket of the rollup tiers, which
+ * are rings of their own.  Buckets are aligned to multiples of their
+ * resolution since the Epoch, so those of different guests line up.
+ * The tiers are small and read rarely, so the lock covers them.
+ */
+typedef struct GARollupTier {
+    GARollupBucket *ring;
+    size_t size;                /* 0 if the tier is not kept */
+    uint64_t head;              /* buckets started so far */
+} GARollupTier;
+
+typedef struct GASampleRing {
+    struct rcu_head rcu;
+    size_t size;
+    GASample slots[];
+} GASampleRing;
+
+struct GASampler {
+    struct rcu_head rcu;
+    int64_t interval_ms;
+    uint32_t groups;
+    unsigned int every[GA_SAMPLE_NGROUPS]; /* read a group every n samples */
+    GAMetricsShm *shm;
+    GAMetricsSpool *spool;
+    GASampleRing *ring;         /* RCU */
+    uint64_t head;              /* seq of the next sample */
+    uint64_t first;             /* seq of the first sample in the ring */
+    GThread *thread;
+    CompatGMutex lock;          /* protects @stop and @tiers */
+    CompatGCond cond;
+    bool stop;
+    GARollupTier tiers[GA_ROLLUP_NTIERS];
+    /* sampler thread only: the counters when each group was last read */
+    uint64_t prev[GA_ROLLUP_NCOLUMNS];
+    int64_t prev_time[GA_SAMPLE_NGROUPS];
+};
+
+static const int64_t ga_rollup_resolution_ms[GA_ROLLUP_NTIERS] = {
+    1000, 10 * 1000, 60 * 1000, 60 * 60 * 1000
+};
+
+/* the groups whose counters only grow, rolled up as rates */
+#define GA_ROLLUP_RATES (GA_SAMPLE_CPU | GA_SAMPLE_DISK | GA_SAMPLE_NET)
+
+#define GA_ROLLUP_COLUMN(field, group) \
+    { offsetof(GASample, field), group }
+static const struct {
+    size_t offset;
+    int group;                  /* bit number of the GA_SAMPLE_* */
+} ga_rollup_columns[GA_ROLLUP_NCOLUMNS] = {
+    GA_ROLLUP_COLUMN(cpu_user, 0),
+    GA_ROLLUP_COLUMN(cpu_nice, 0),
+    GA_ROLLUP_COLUMN(cpu_system, 0),
+    GA_ROLLUP_COLUMN(cpu_idle, 0),
+    GA_ROLLUP_COLUMN(cpu_iowait, 0),
+    GA_ROLLUP_COLUMN(cpu_irq, 0),
+    GA_ROLLUP_COLUMN(cpu_softirq, 0),
+    GA_ROLLUP_COLUMN(cpu_steal, 0),
+    GA_ROLLUP_COLUMN(mem_total, 1),
+    GA_ROLLUP_COLUMN(mem_free, 1),
+    GA_ROLLUP_COLUMN(mem_available, 1),
+    GA_ROLLUP_COLUMN(swap_total, 1),
+    GA_ROLLUP_COLUMN(swap_free, 1),
+    GA_ROLLUP_COLUMN(disk_read_ios, 2),
+    GA_ROLLUP_COLUMN(disk_read_bytes, 2),
+    GA_ROLLUP_COLUMN(disk_write_ios, 2),
+    GA_ROLLUP_COLUMN(disk_write_bytes, 2),
+    GA_ROLLUP_COLUMN(net_rx_bytes, 3),
+    GA_ROLLUP_COLUMN(net_rx_packets, 3),
+    GA_ROLLUP_COLUMN(net_tx_bytes, 3),
+    GA_ROLLUP_COLUMN(net_tx_packets, 3),
+};
+
+static void ga_sampler_publish(GASampler *s, GASample *sample)
+{
+    uint64_t seq = sample->seq;
+    GASample *slot = &s->ring->slots[seq % s->ring->size];
+
+    sample->seq = GA_SAMPLE_SEQ_BUSY;
+    atomic_set(&slot->seq, GA_SAMPLE_SEQ_BUSY);
+    smp_wmb();
+    *slot = *sample;
+    smp_wmb();
+    atomic_set(&slot->seq, seq);
+    smp_wmb();
+    atomic_set(&s->head, seq + 1);
+}
+
+static void ga_rollup_tier_add(GARollupTier *t, int64_t resolution_ms,
+                               int64_t time, uint32_t groups,
+                               const double *values, const uint64_t *raw)
+{
+    int64_t start = time - time % (resolution_ms * 1000000);
+    GARollupBucket *b = NULL;
+    int col, i;
+
+    if (t->head) {
+        b = &t->ring[(t->head - 1) % t->size];
+    }
+    /* after the clock went back, samples go on to the newest bucket */
+    if (!b || start > b->start) {
+        b = &t->ring[t->head++ % t->size];
+        memset(b, 0, sizeof(*b));
+        b->start = start;
+    }
+
+    b->samples++;
+    for (col = 0; col < GA_ROLLUP_NCOLUMNS; col++) {
+        i = ga_rollup_columns[col].group;
+        if (!(groups & (1u << i))) {
+            continue;
+        }
+        if (!b->count[i]) {
+            b->min[col] = b->max[col] = values[col];
+        } else {
+            b->min[col] = MIN(b->min[col], values[col]);
+            b->max[col] = MAX(b->max[col], values[col]);
+        }
+        b->sum[col] += values[col];
+        b->last[col] = raw[col];
+    }
+    for (i = 0; i < GA_SAMPLE_NGROUPS; i++) {
+        if (groups & (1u << i)) {
+            b->count[i]++;
+        }
+    }
+    b->present |= groups;
+}
+
+/* called with the lock held */
+static void ga_rollup_add(GASampler *s, const GASample *sample)
+{
+    double values[GA_ROLLUP_NCOLUMNS];
+    uint64_t raw[GA_ROLLUP_NCOLUMNS];
+    uint32_t groups = sample->present, bit;
+    int col, i;
+
+    for (col = 0; col < GA_ROLLUP_NCOLUMNS; col++) {
+        i = ga_rollup_columns[col].group;
+        bit = 1u << i;
+        if (!(sample->present & bit)) {
+            continue;
+        }
+        memcpy(&raw[col], (const char *)sample + ga_rollup_columns[col].offset,
+               sizeof(raw[col]));
+        values[col] = raw[col];
+        if (bit & GA_ROLLUP_RATES) {
+            /* a rate needs an earlier reading, and no reset since */
+            if (!s->prev_time[i] || sample->time <= s->prev_time[i] ||
+                raw[col] < s->prev[col]) {
+                groups &= ~bit;
+            } else {
+                values[col] = (double)(raw[col] - s->prev[col]) * 1e9 /
+                              (sample->time - s->prev_time[i]);
+            }
+        }
+        s->prev[col] = raw[col];
+    }
+    for (i = 0; i < GA_SAMPLE_NGROUPS; i++) {
+        if (sample->present & (1u << i)) {
+            s->prev_time[i] = sample->time;
+        }
+    }
+
+    for (i = 0; i < GA_ROLLUP_NTIERS; i++) {
+        if (s->tiers[i].size) {
+            ga_rollup_tier_add(&s->tiers[i], ga_rollup_resolution_ms[i],
+                               sample->time, groups, values, raw);
+        }
+    }
+}
+
+static gpointer ga_sampler_thread(gpointer opaque)
+{
+    GASampler *s = opaque;
+    GASample sample;
+    gint64 next = g_get_monotonic_time(), now;
+    uint64_t seq = s->head;
+    uint32_t groups;
+    int i;
+
+    g_mutex_lock(&s->lock);
+    while (!s->stop) {
+        g_mutex_unlock(&s->lock);
+
+        groups = 0;
+        for (i = 0; i < GA_SAMPLE_NGROUPS; i++) {
+            if ((s->groups & (1u << i)) && seq % s->every[i] == 0) {
+                groups |= 1u << i;
+            }
+        }
+
+        memset(&sample, 0, sizeof(sample));
+        sample.seq = seq++;
+        sample.time = g_get_real_time() * 1000;
+        ga_sample_collect(&sample, groups);
+        if (s->shm) {
+            ga_metrics_shm_publish(s->shm, &sample, s->interval_ms);
+        }
+        if (s->spool) {
+            ga_metrics_spool_append(s->spool, &sample);
+        }
+        ga_sampler_publish(s, &sample);
+
+        /* keep to the interval; if a sample took too long, skip ahead */
+        next += s->interval_ms * 1000;
+        now = g_get_monotonic_time();
+        if (next < now) {
+            next = now;
+        }
+
+        g_mutex_lock(&s->lock);
+        ga_rollup_add(s, &sample);
+        while (!s->stop && g_cond_wait_until(&s->cond, &s->lock, next)) {
+            /* woken up early, but not to stop */
+        }
+    }
+    g_mutex_unlock(&s->lock);
+
+    return NULL;
+}
+
+static void ga_sampler_start(GASampler *s)
+{
+    s->stop = false;
+    s->thread = g_thread_new("qga-sampler", ga_sampler_thread, s);
+}
+
+static void ga_sampler_stop(GASampler *s)
+{
+    g_mutex_lock(&s->lock);
+    s->stop = true;
+    g_cond_signal(&s->cond);
+    g_mutex_unlock(&s->lock);
+    g_thread_join(s->thread);
+    s->thread = NULL;
+}
+
+static void ga_sampler_apply(GASampler *s, const GASamplerConfig *config)
+{
+    int64_t every;
+    int i;
+
+    g_assert(config->interval_ms > 0);
+    s->interval_ms = config->interval_ms;
+    s->groups = config->groups;
+    s->shm = config->shm;
+    s->spool = config->spool;
+    for (i = 0; i < GA_SAMPLE_NGROUPS; i++) {
+        every = (config->group_interval_ms[i] + s->interval_ms / 2) /
+                s->interval_ms;
+        s->every[i] = MAX(MIN(every, G_MAXUINT), 1);
+    }
+}
+
+static GASampleRing *ga_sample_ring_new(size_t size)
+{
+    GASampleRing *ring = g_malloc0(sizeof(*ring) + size * sizeof(GASample));
+
+    ring->size = size;
+    return ring;
+}
+
+/* move the samples that fit to a ring of @size slots */
+static void ga_sampler_resize(GASampler *s, size_t size)
+{
+    GASampleRing *old = s->ring, *ring = ga_sample_ring_new(size);
+    size_t keep = MIN(old->size, size);
+    uint64_t seq;
+
+    seq = s->head > keep ? s->head - keep : 0;
+    for (; seq < s->head; seq++) {
+        ring->slots[seq % size] = old->slots[seq % old->size];
+    }
+    atomic_rcu_set(&s->ring, ring);
+    g_free_rcu(old, rcu);
+}
+
+/* the same for the buckets of a tier; 0 drops the tier */
+static void ga_rollup_resize(GARollupTier *t, size_t size)
+{
+    GARollupBucket *ring = NULL;
+    uint64_t n;
+
+    if (size == t->size) {
+        return;
+    }
+    if (!size) {
+        t->head = 0;
+    } else {
+        ring = g_new0(GARollupBucket, size);
+    }
+    n = t->head > MIN(t->size, size) ? t->head - MIN(t->size, size) : 0;
+    for (; n < t->head; n++) {
+        ring[n % size] = t->ring[n % t->size];
+    }
+    g_free(t->ring);
+    t->ring = ring;
+    t->size = size;
+}
+
+static void ga_rollup_apply(GASampler *s, const GASamplerConfig *config)
+{
+    int i;
+
+    for (i = 0; i < GA_ROLLUP_NTIERS; i++) {
+        ga_rollup_resize(&s->tiers[i],
+                         ga_rollup_resolution_ms[i] < config->interval_ms ?
+                         0 : config->rollup_size[i]);
+    }
+}
+
+GASampler *ga_sampler_new(const GASamplerConfig *config)
+{
+    GASampler *s = g_new0(GASampler, 1);
+
+    g_assert(config->size > 0);
+    ga_sampler_apply(s, config);
+    s->ring = ga_sample_ring_new(config->size);
+    /* go on with the numbers of the spool, so that cursors stay valid */
+    if (s->spool) {
+        s->head = s->first = ga_metrics_spool_get_head(s->spool);
+    }
+    ga_rollup_apply(s, config);
+    g_mutex_init(&s->lock);
+    g_cond_init(&s->cond);
+    ga_sampler_start(s);
+
+    return s;
+}
+
+/*
+ * Change the intervals, groups and capacity of a running sampler.  The
+ * most recent samples are kept and cursors handed out before stay valid.
+ */
+void ga_sampler_reconfigure(GASampler *s, const GASamplerConfig *config)
+{
+    g_assert(config->size > 0);
+    ga_sampler_stop(s);
+    if (config->size != s->ring->size) {
+        ga_sampler_resize(s, config->size);
+    }
+    ga_sampler_apply(s, config);
+    ga_rollup_apply(s, config);
+    ga_sampler_start(s);
+}
+
+static void ga_sampler_destroy(GASampler *s)
+{
+    int i;
+
+    for (i = 0; i < GA_ROLLUP_NTIERS; i++) {
+        g_free(s->tiers[i].ring);
+    }
+    g_mutex_clear(&s->lock);
+    g_cond_clear(&s->cond);
+    g_free(s->ring);
+    g_free(s);
+}
+
+/* stop @s; it is freed once no reader can still be using it */
+void ga_sampler_free(GASampler *s)
+{
+    if (!s) {
+        return;
+    }
+
+    ga_sampler_stop(s);
+    call_rcu(s, ga_sampler_destroy, rcu);
+}
+
+int64_t ga_sampler_get_interval(GASampler *s)
+{
+    return s->interval_ms;
+}
+
+/*
+ * Call @func for the samples from @cursor on that are still in the ring,
+ * or in the spool for those the ring no longer has, oldest first, and
+ * return the cursor that continues after them.  @lost is set to the
+ * number of samples since @cursor that were overwritten before they could
+ * be read.  A @cursor from the future, such as one returned by a previous
+ * agent instance without a spool, starts over at the beginning.  Called
+ * within rcu_read_lock().
+ */
+uint64_t ga_sampler_foreach(GASampler *s, uint64_t cursor, uint64_t *lost,
+                            GASampleFunc func, void *opaque)
+{
+    GASample sample, *slot;
+    GASampleRing *ring;
+    uint64_t head, oldest, seq;
+
+    head = atomic_read(&s->head);
+    smp_rmb();
+    /* resizing keeps the samples before @head */
+    ring = atomic_rcu_read(&s->ring);
+    if (cursor > head) {
+        cursor = 0;
+    }
+    *lost = 0;
+    oldest = MAX(s->first, head > ring->size ? head - ring->size : 0);
+    if (cursor < oldest) {
+        if (s->spool) {
+            *lost = ga_metrics_spool_foreach(s->spool, cursor, oldest,
+                                             func, opaque);
+        } else {
+            *lost = oldest - cursor;
+        }
+        cursor = oldest;
+    }
+
+    for (seq = cursor; seq < head; seq++) {
+        slot = &ring->slots[seq % ring->size];
+        if (atomic_read(&slot->seq) != seq) {
+            (*lost)++;
+            continue;
+        }
+        smp_rmb();
+        sample = *slot;
+        smp_rmb();
+        /* the writer has lapped us while copying */
+        if (atomic_read(&slot->seq) != seq) {
+            (*lost)++;
+            continue;
+        }
+        func(&sample, opaque);
+    }
+
+    return head;
+}
+
+/* the width of the buckets of @tier, in milliseconds */
+int64_t ga_sampler_get_rollup_resolution(int tier)
+{
+    return ga_rollup_resolution_ms[tier];
+}
+
+/* the mean of column @col of @b, 0 if its group has no values */
+double ga_rollup_bucket_avg(const GARollupBucket *b, int col)
+{
+    uint32_t count = b->count[ga_rollup_columns[col].group];
+
+    return count ? b->sum[col] / count : 0;
+}
+
+/*
+ * Call @func for the buckets of @tier that overlap [@start, @end), in
+ * nanoseconds since the Epoch, oldest first.  The newest bucket may still
+ * be filling.  False if the tier is not kept.
+ */
+bool ga_sampler_foreach_rollup(GASampler *s, int tier, int64_t start,
+                               int64_t end, GARollupFunc func, void *opaque)
+{
+    GARollupTier *t = &s->tiers[tier];
+    int64_t width = ga_rollup_resolution_ms[tier] * 1000000;
+    GARollupBucket *b;
+    uint64_t n;
+
+    g_mutex_lock(&s->lock);
+    if (!t->size) {
+        g_mutex_unlock(&s->lock);
+        return false;
+    }
+    for (n = t->head > t->size ? t->head - t->size : 0; n < t->head; n++) {
+        b = &t->ring[n % t->size];
+        /* growing the ring leaves empty slots */
+        if (b->samples && b->start < end && b->start + width > start) {
+            func(b, opaque);
+        }
+    }
+    g_mutex_unlock(&s->lock);
+    return true;
+}
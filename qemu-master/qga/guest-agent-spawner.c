@@ -0,0 +1,391 @@
+/*
+ * QEMU Guest Agent helper process for running child programs
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include <glib.h>
+#include <dirent.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "qga/guest-agent-core.h"
+#include "qapi/error.h"
+
+extern char **environ;
+
+/*
+ * The helper is forked when the agent starts, while it is still small, and
+ * runs the programs that commands shell out to on its behalf.  Each fork()
+ * then copies the page tables of the helper instead of those of the agent,
+ * which keeps the cost of running a program low and constant however much
+ * memory the agent has come to use.
+ *
+ * The agent sends one request at a time over a socketpair and waits for
+ * the program to finish: a GASpawnRequest, the NUL terminated path and
+ * arguments, then the data for the program's stdin.  The helper answers
+ * with a GASpawnReply once the program has exited.  It exits itself when
+ * the agent closes its end.
+ *
+ * A command running as a coroutine waits for the reply in ga_co_wait_fd(),
+ * and the helper stays busy with its request until then: other coroutines
+ * queue up behind it, while anything else runs its program by forking the
+ * agent rather than block the main loop on the helper.
+ */
+struct GASpawner {
+    int fd;
+    pid_t pid;
+    bool busy;
+    CoQueue waiters;
+};
+
+typedef struct GASpawnRequest {
+    uint32_t argc;
+    uint32_t strings_len;       /* path and argc arguments */
+    uint32_t input_len;
+} GASpawnRequest;
+
+typedef struct GASpawnReply {
+    int32_t fork_errno;         /* the program was not started */
+    int32_t exec_errno;         /* it could not be executed */
+    int32_t status;             /* from waitpid() otherwise */
+} GASpawnReply;
+
+/* keep requests well below anything that could hurt the helper */
+#define GA_SPAWN_MAX_REQUEST (16 * 1024 * 1024)
+
+/* run @path in a new session with @input on its stdin, stdout and stderr
+ * going to /dev/null, and wait for it; this is the part shared by the
+ * helper and the agent when it has no helper
+ */
+static void ga_spawn_child(const char *path, const char *const *argv,
+                           const void *input, size_t input_len,
+                           GASpawnReply *reply)
+{
+    int in[2] = { -1, -1 }, err[2];
+    struct sigaction sigact;
+    pid_t pid, rpid;
+    ssize_t len;
+    int exec_errno;
+
+    memset(reply, 0, sizeof(*reply));
+    if (qemu_pipe(err) < 0) {
+        reply->fork_errno = errno;
+        return;
+    }
+    if (input_len && qemu_pipe(in) < 0) {
+        reply->fork_errno = errno;
+        close(err[0]);
+        close(err[1]);
+        return;
+    }
+
+    pid = fork();
+    if (pid == 0) {
+        setsid();
+        if (input_len) {
+            dup2(in[0], 0);
+        } else {
+            reopen_fd_to_null(0);
+        }
+        reopen_fd_to_null(1);
+        reopen_fd_to_null(2);
+        memset(&sigact, 0, sizeof(sigact));
+        sigact.sa_handler = SIG_DFL;
+        sigaction(SIGPIPE, &sigact, NULL);
+
+        execve(path, (char **)argv, environ);
+        exec_errno = errno;
+        if (write(err[1], &exec_errno, sizeof(exec_errno))) {
+            /* nothing more to do about it */
+        }
+        _exit(EXIT_FAILURE);
+    }
+    if (pid < 0) {
+        reply->fork_errno = errno;
+    }
+
+    close(err[1]);
+    if (input_len) {
+        close(in[0]);
+    }
+    if (pid > 0) {
+        do {
+            len = read(err[0], &exec_errno, sizeof(exec_errno));
+        } while (len < 0 && errno == EINTR);
+        if (len == sizeof(exec_errno)) {
+            reply->exec_errno = exec_errno;
+        } else if (input_len) {
+            /* a program that does not read all of it gets EPIPE */
+            qemu_write_full(in[1], input, input_len);
+        }
+    }
+    close(err[0]);
+    if (input_len) {
+        close(in[1]);
+    }
+    if (pid < 0) {
+        return;
+    }
+
+    do {
+        rpid = waitpid(pid, &reply->status, 0);
+    } while (rpid == -1 && errno == EINTR);
+    if (rpid == -1 && !reply->exec_errno) {
+        reply->fork_errno = errno;
+    }
+}
+
+static bool ga_spawn_read(int fd, void *buf, size_t len)
+{
+    ssize_t ret;
+
+    while (len) {
+        ret = read(fd, buf, len);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            return false;
+        }
+        buf = (char *)buf + ret;
+        len -= ret;
+    }
+    return true;
+}
+
+/* close everything but the socket, so the helper does not hold on to
+ * files the agent opened before forking it
+ */
+static void ga_spawner_close_fds(int keep)
+{
+    DIR *dir = opendir("/proc/self/fd");
+    struct dirent *de;
+    int fd;
+
+    if (!dir) {
+        return;
+    }
+    while ((de = readdir(dir))) {
+        fd = atoi(de->d_name);
+        if (fd > 2 && fd != keep && fd != dirfd(dir)) {
+            close(fd);
+        }
+    }
+    closedir(dir);
+}
+
+static void G_GNUC_NORETURN ga_spawner_main(int fd)
+{
+    struct sigaction sigact;
+    GASpawnRequest req;
+    GASpawnReply reply;
+    char *strings, **argv, *p;
+    uint8_t *input;
+    uint32_t i;
+
+    ga_spawner_close_fds(fd);
+    qemu_set_cloexec(fd);
+    /* the program may exit without reading its input */
+    memset(&sigact, 0, sizeof(sigact));
+    sigact.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sigact, NULL);
+
+    while (ga_spawn_read(fd, &req, sizeof(req))) {
+        if (req.strings_len > GA_SPAWN_MAX_REQUEST ||
+            req.input_len > GA_SPAWN_MAX_REQUEST ||
+            req.argc > req.strings_len) {
+            break;
+        }
+        strings = g_malloc(req.strings_len + 1);
+        input = g_malloc(req.input_len);
+        if (!ga_spawn_read(fd, strings, req.strings_len) ||
+            !ga_spawn_read(fd, input, req.input_len)) {
+            break;
+        }
+        strings[req.strings_len] = '\0';
+
+        /* the path, then the arguments */
+        argv = g_new0(char *, req.argc + 1);
+        p = strings + strlen(strings) + 1;
+        for (i = 0; i < req.argc && p < strings + req.strings_len; i++) {
+            argv[i] = p;
+            p += strlen(p) + 1;
+        }
+
+        ga_spawn_child(strings, (const char *const *)argv, input,
+                       req.input_len, &reply);
+        g_free(argv);
+        g_free(strings);
+        g_free(input);
+        if (qemu_write_full(fd, &reply, sizeof(reply)) != sizeof(reply)) {
+            break;
+        }
+    }
+    _exit(EXIT_SUCCESS);
+}
+
+/**
+ * ga_spawner_new:
+ *
+ * Fork the helper process.  This should happen early, before the agent
+ * has allocated much memory or started any threads.
+ *
+ * Returns: the helper, or NULL if it could not be started, in which case
+ * ga_spawn_sync() runs programs itself
+ */
+GASpawner *ga_spawner_new(void)
+{
+    GASpawner *sp;
+    int fds[2];
+    pid_t pid;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        g_warning("unable to create a socket for the spawn helper: %s",
+                  strerror(errno));
+        return NULL;
+    }
+
+    pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        ga_spawner_main(fds[1]);
+    }
+    close(fds[1]);
+    if (pid < 0) {
+        g_warning("unable to start the spawn helper: %s", strerror(errno));
+        close(fds[0]);
+        return NULL;
+    }
+    qemu_set_cloexec(fds[0]);
+
+    sp = g_new0(GASpawner, 1);
+    sp->fd = fds[0];
+    sp->pid = pid;
+    qemu_co_queue_init(&sp->waiters);
+    return sp;
+}
+
+static void ga_spawner_stop(GASpawner *sp)
+{
+    pid_t rpid;
+
+    if (sp->fd < 0) {
+        return;
+    }
+    close(sp->fd);
+    sp->fd = -1;
+    do {
+        rpid = waitpid(sp->pid, NULL, 0);
+    } while (rpid == -1 && errno == EINTR);
+}
+
+void ga_spawner_free(GASpawner *sp)
+{
+    if (!sp) {
+        return;
+    }
+    ga_spawner_stop(sp);
+    g_free(sp);
+}
+
+static bool ga_spawner_call(GASpawner *sp, const char *path,
+                            const char *const *argv,
+                            const void *input, size_t input_len,
+                            GASpawnReply *reply)
+{
+    GASpawnRequest req = { 0 };
+    GString *strings;
+    bool ok;
+    int i;
+
+    if (input_len > GA_SPAWN_MAX_REQUEST) {
+        return false;
+    }
+    strings = g_string_new(path);
+    g_string_append_c(strings, '\0');
+    for (i = 0; argv[i]; i++) {
+        g_string_append(strings, argv[i]);
+        g_string_append_c(strings, '\0');
+    }
+    req.argc = i;
+    req.strings_len = strings->len;
+    req.input_len = input_len;
+
+    ok = strings->len <= GA_SPAWN_MAX_REQUEST &&
+         qemu_write_full(sp->fd, &req, sizeof(req)) == sizeof(req) &&
+         qemu_write_full(sp->fd, strings->str, strings->len) ==
+             strings->len &&
+         qemu_write_full(sp->fd, input, input_len) == input_len &&
+         (!qemu_in_coroutine() || ga_co_wait_fd(sp->fd, G_IO_IN)) &&
+         ga_spawn_read(sp->fd, reply, sizeof(*reply));
+    g_string_free(strings, true);
+    return ok;
+}
+
+/**
+ * ga_spawn_sync:
+ * @sp: the helper to run the program, or NULL to fork the agent
+ * @path: the program to execute
+ * @argv: its NULL terminated arguments, including the name it is run as
+ * @input: what to write to its stdin, which is /dev/null if @input_len is 0
+ * @input_len: the length of @input
+ * @status: where to store the status waitpid() returned for it
+ * @errp: what went wrong if it could not be run
+ *
+ * Run @path in a new session, with the agent's environment and stdout and
+ * stderr going to /dev/null, and wait for it to exit.  If the helper fails
+ * it is not used again and programs are run by forking the agent instead.
+ * In a coroutine, the main loop goes on while the program runs.
+ *
+ * Returns: true if @path was executed
+ */
+bool ga_spawn_sync(GASpawner *sp, const char *path, const char *const *argv,
+                   const void *input, size_t input_len, int *status,
+                   Error **errp)
+{
+    GASpawnReply reply;
+    bool done = false;
+
+    if (sp && qemu_in_coroutine()) {
+        while (sp->busy) {
+            qemu_co_queue_wait(&sp->waiters);
+        }
+    }
+    if (sp && sp->fd >= 0 && !sp->busy) {
+        sp->busy = true;
+        done = ga_spawner_call(sp, path, argv, input, input_len, &reply);
+        sp->busy = false;
+        if (!done && sp->fd >= 0) {
+            g_warning("the spawn helper failed, running programs directly");
+            ga_spawner_stop(sp);
+            /* nobody will get the helper again, let every waiter fall back */
+            if (qemu_in_coroutine()) {
+                qemu_co_queue_restart_all(&sp->waiters);
+            } else {
+                while (qemu_co_enter_next(&sp->waiters)) {
+                    /* nothing */
+                }
+            }
+        }
+    }
+    if (sp && qemu_in_coroutine()) {
+        /* hand the helper (or the news that it is gone) to the next waiter */
+        qemu_co_queue_next(&sp->waiters);
+    }
+    if (!done) {
+        ga_spawn_child(path, argv, input, input_len, &reply);
+    }
+
+    if (reply.fork_errno) {
+        error_setg_errno(errp, reply.fork_errno,
+                         "failed to create child process");
+        return false;
+    }
+    if (reply.exec_errno) {
+        error_setg_errno(errp, reply.exec_errno, "failed to execute '%s'",
+                         path);
+        return false;
+    }
+    *status = reply.status;
+    return true;
+}
@@ -0,0 +1,274 @@
+/*
+ * QEMU Guest Agent metrics spool
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include <glib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#include "qga/guest-agent-core.h"
+#include "qapi/error.h"
+#include "qemu/atomic.h"
+
+/*
+ * With --metrics-spool, the sampler thread also writes each sample to a
+ * ring of that many slots in a file of the state directory, so that the
+ * history survives both a collector that does not ask for a while and a
+ * restart of the agent.  The file is mapped: a sample is a copy into the
+ * page cache, and the kernel writes it back when it likes, helped by an
+ * MS_ASYNC msync() every GA_SPOOL_SYNC_S.
+ *
+ * Slots are written and read like those of the ring in memory, under
+ * their sequence number.  The header has the next sequence number and the
+ * first one the file has, which a new agent goes on from.  A file of
+ * another layout or size is started over, keeping the numbers.
+ *
+ * Touching a mapping of a frozen filesystem blocks, so the main loop
+ * pauses the spool before freezing and waits for a sample being written
+ * to be done; the spool misses what is sampled until the thaw.  An agent
+ * started while frozen goes without it.
+ */
+#define GA_SPOOL_MAGIC      0x53414751  /* "QGAS" */
+#define GA_SPOOL_VERSION    1
+#define GA_SPOOL_SYNC_S     30
+
+typedef struct GASpoolHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t size;              /* slots */
+    uint64_t head;              /* seq of the next sample */
+    uint64_t first;             /* seq of the first sample in the file */
+    uint8_t reserved[32];
+} GASpoolHeader;
+
+struct GAMetricsSpool {
+    GASpoolHeader *header;
+    GASample *slots;
+    size_t size;
+    size_t map_size;
+    int paused;
+    int writing;                /* the sampler thread is in a slot */
+    int64_t synced;             /* sampler thread only */
+};
+
+QEMU_BUILD_BUG_ON(sizeof(GASpoolHeader) != 64);
+
+#ifndef _WIN32
+GAMetricsSpool *ga_metrics_spool_new(const char *path, size_t size,
+                                     Error **errp)
+{
+    GAMetricsSpool *sp;
+    GASpoolHeader hdr;
+    size_t map_size = sizeof(hdr) + size * sizeof(GASample);
+    uint64_t head = 0;
+    struct stat st;
+    bool reuse;
+    void *addr;
+    int fd, ret;
+
+    fd = qemu_open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    if (fd == -1) {
+        error_setg_errno(errp, errno, "failed to open metrics spool '%s'",
+                         path);
+        return NULL;
+    }
+    if (fstat(fd, &st) < 0) {
+        error_setg_errno(errp, errno, "failed to open metrics spool '%s'",
+                         path);
+        goto fail;
+    }
+    if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+        memset(&hdr, 0, sizeof(hdr));
+    }
+    if (hdr.magic == GA_SPOOL_MAGIC) {
+        head = hdr.head;
+    }
+    reuse = hdr.magic == GA_SPOOL_MAGIC && hdr.version == GA_SPOOL_VERSION &&
+            hdr.record_size == sizeof(GASample) && hdr.size == size &&
+            st.st_size == (off_t)map_size;
+    if (!reuse) {
+        /* written through a mapping, a hole would be a SIGBUS once the
+         * disk is full
+         */
+        if (ftruncate(fd, 0) < 0) {
+            error_setg_errno(errp, errno, "failed to size metrics spool '%s'",
+                             path);
+            goto fail;
+        }
+        ret = posix_fallocate(fd, 0, map_size);
+        if (ret) {
+            error_setg_errno(errp, ret, "failed to size metrics spool '%s'",
+                             path);
+            goto fail;
+        }
+    }
+    addr = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        error_setg_errno(errp, errno, "failed to map metrics spool '%s'",
+                         path);
+        goto fail;
+    }
+    close(fd);
+
+    sp = g_new0(GAMetricsSpool, 1);
+    sp->header = addr;
+    sp->slots = (GASample *)(sp->header + 1);
+    sp->size = size;
+    sp->map_size = map_size;
+    sp->synced = g_get_monotonic_time();
+    if (!reuse) {
+        sp->header->magic = GA_SPOOL_MAGIC;
+        sp->header->version = GA_SPOOL_VERSION;
+        sp->header->record_size = sizeof(GASample);
+        sp->header->size = size;
+        sp->header->head = sp->header->first = head;
+    }
+    return sp;
+
+fail:
+    close(fd);
+    return NULL;
+}
+
+/* called from the sampler thread */
+void ga_metrics_spool_append(GAMetricsSpool *sp, const GASample *sample)
+{
+    GASample *slot = &sp->slots[sample->seq % sp->size];
+    GASample copy = *sample;
+    int64_t now;
+
+    atomic_set(&sp->writing, 1);
+    smp_mb();
+    if (atomic_read(&sp->paused)) {
+        atomic_set(&sp->writing, 0);
+        return;
+    }
+
+    copy.seq = GA_SAMPLE_SEQ_BUSY;
+    atomic_set(&slot->seq, GA_SAMPLE_SEQ_BUSY);
+    smp_wmb();
+    *slot = copy;
+    smp_wmb();
+    atomic_set(&slot->seq, sample->seq);
+    smp_wmb();
+    atomic_set(&sp->header->head, sample->seq + 1);
+
+    now = g_get_monotonic_time();
+    if (now - sp->synced >= GA_SPOOL_SYNC_S * G_USEC_PER_SEC) {
+        msync(sp->header, sp->map_size, MS_ASYNC);
+        sp->synced = now;
+    }
+    smp_mb();
+    atomic_set(&sp->writing, 0);
+}
+
+uint64_t ga_metrics_spool_get_head(GAMetricsSpool *sp)
+{
+    return atomic_read(&sp->header->head);
+}
+
+/*
+ * Call @func for the samples from @cursor up to @end that the spool has,
+ * oldest first; how many of them it does not have.
+ */
+uint64_t ga_metrics_spool_foreach(GAMetricsSpool *sp, uint64_t cursor,
+                                  uint64_t end, GASampleFunc func,
+                                  void *opaque)
+{
+    uint64_t head, first, start, stop, seq, lost;
+    GASample sample, *slot;
+
+    head = atomic_read(&sp->header->head);
+    smp_rmb();
+    first = MAX(sp->header->first, head > sp->size ? head - sp->size : 0);
+    /* the spool lags behind the ring after a freeze */
+    start = MAX(cursor, first);
+    stop = MIN(end, head);
+    if (start >= stop) {
+        return end - cursor;
+    }
+    lost = start - cursor + end - stop;
+
+    for (seq = start; seq < stop; seq++) {
+        slot = &sp->slots[seq % sp->size];
+        if (atomic_read(&slot->seq) != seq) {
+            lost++;
+            continue;
+        }
+        smp_rmb();
+        sample = *slot;
+        smp_rmb();
+        if (atomic_read(&slot->seq) != seq) {
+            lost++;
+            continue;
+        }
+        func(&sample, opaque);
+    }
+    return lost;
+}
+
+/* stop and start writing to the spool, around a freeze */
+void ga_metrics_spool_pause(GAMetricsSpool *sp, bool paused)
+{
+    if (!sp) {
+        return;
+    }
+    atomic_set(&sp->paused, paused);
+    smp_mb();
+    while (paused && atomic_read(&sp->writing)) {
+        g_usleep(1000);
+    }
+}
+
+/* once the sampler thread has stopped */
+void ga_metrics_spool_free(GAMetricsSpool *sp)
+{
+    if (!sp) {
+        return;
+    }
+    if (!sp->paused) {
+        msync(sp->header, sp->map_size, MS_SYNC);
+    }
+    munmap(sp->header, sp->map_size);
+    g_free(sp);
+}
+#else
+GAMetricsSpool *ga_metrics_spool_new(const char *path, size_t size,
+                                     Error **errp)
+{
+    error_setg(errp, "the metrics spool is not supported on Windows");
+    return NULL;
+}
+
+void ga_metrics_spool_append(GAMetricsSpool *sp, const GASample *sample)
+{
+}
+
+uint64_t ga_metrics_spool_get_head(GAMetricsSpool *sp)
+{
+    return 0;
+}
+
+uint64_t ga_metrics_spool_foreach(GAMetricsSpool *sp, uint64_t cursor,
+                                  uint64_t end, GASampleFunc func,
+                                  void *opaque)
+{
+    return end - cursor;
+}
+
+void ga_metrics_spool_pause(GAMetricsSpool *sp, bool paused)
+{
+}
+
+void ga_metrics_spool_free(GAMetricsSpool *sp)
+{
+}
+#endif
@@ -0,0 +1,360 @@
+/*
+ * QEMU Guest Agent request statistics
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__linux__) || defined(_WIN32)
+#include <malloc.h>
+#endif
+#include "qga/guest-agent-core.h"
+#include "qemu/atomic.h"
+#include "qemu/host-utils.h"
+
+/*
+ * Counters and latency histograms of the requests, per command.  All of
+ * it is updated from the main loop: the workers only time the commands
+ * they run and hand that back with the result, so nothing needs a lock.
+ * The byte counters are the exception, and are updated atomically.
+ */
+struct GAStats {
+    GHashTable *commands;       /* name -> GACommandStats */
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t requests;
+    uint64_t errors;
+    uint64_t parse_errors;
+};
+
+/*
+ * The histograms are log-linear, like HDR histograms: values below
+ * GA_HISTOGRAM_SUB are counted exactly, the others in GA_HISTOGRAM_SUB
+ * buckets per power of two, so that a bucket is accurate to 1/8 of its
+ * values.  Everything from 2^GA_HISTOGRAM_MAX_SHIFT us, about 12 days, is
+ * in the last bucket.
+ */
+static int ga_histogram_index(uint64_t value)
+{
+    int shift;
+
+    if (value < GA_HISTOGRAM_SUB) {
+        return value;
+    }
+    shift = 63 - clz64(value);
+    if (shift >= GA_HISTOGRAM_MAX_SHIFT) {
+        return GA_HISTOGRAM_BUCKETS - 1;
+    }
+    shift -= GA_HISTOGRAM_SUB_BITS;
+    return GA_HISTOGRAM_SUB + shift * GA_HISTOGRAM_SUB +
+           ((value >> shift) & (GA_HISTOGRAM_SUB - 1));
+}
+
+/* the smallest value above those of bucket @i, G_MAXUINT64 for the last */
+uint64_t ga_histogram_bucket_limit(int i)
+{
+    int shift;
+
+    if (i < GA_HISTOGRAM_SUB) {
+        return i + 1;
+    }
+    if (i == GA_HISTOGRAM_BUCKETS - 1) {
+        return G_MAXUINT64;
+    }
+    i -= GA_HISTOGRAM_SUB;
+    shift = i / GA_HISTOGRAM_SUB;
+    return (uint64_t)(GA_HISTOGRAM_SUB + i % GA_HISTOGRAM_SUB + 1) << shift;
+}
+
+void ga_histogram_add(GAHistogram *h, uint64_t value)
+{
+    if (!h->count || value < h->min) {
+        h->min = value;
+    }
+    if (value > h->max) {
+        h->max = value;
+    }
+    h->count++;
+    h->total += value;
+    h->buckets[ga_histogram_index(value)]++;
+}
+
+/*
+ * The value below which @permille of the values are, to the accuracy of
+ * the buckets; it is never reported above the largest value seen.
+ */
+uint64_t ga_histogram_quantile(const GAHistogram *h, unsigned int permille)
+{
+    uint64_t want = (h->count * permille + 999) / 1000, seen = 0;
+    int i;
+
+    for (i = 0; i < GA_HISTOGRAM_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= want && seen) {
+            return MIN(ga_histogram_bucket_limit(i) - 1, h->max);
+        }
+    }
+    return h->max;
+}
+
+static GACommandStats *ga_stats_command(GAStats *st, const char *command)
+{
+    GACommandStats *cs = g_hash_table_lookup(st->commands, command);
+
+    if (!cs) {
+        /* the histograms are large, only commands that were used get them */
+        cs = g_new0(GACommandStats, 1);
+        cs->name = g_strdup(command);
+        g_hash_table_insert(st->commands, cs->name, cs);
+    }
+    return cs;
+}
+
+/* how long @phase of a @command request took */
+void ga_stats_add_time(GAStats *st, const char *command, GAStatsPhase phase,
+                       int64_t us)
+{
+    if (!command || us < 0) {
+        return;
+    }
+    ga_histogram_add(&ga_stats_command(st, command)->phases[phase], us);
+}
+
+/* a request was answered; @command is NULL if it is not one the agent
+ * knows, here and for ga_stats_add_time()
+ */
+void ga_stats_add_request(GAStats *st, const char *command, bool error)
+{
+    GACommandStats *cs;
+
+    st->requests++;
+    st->errors += error;
+    if (command) {
+        cs = ga_stats_command(st, command);
+        cs->requests++;
+        cs->errors += error;
+    }
+}
+
+void ga_stats_add_parse_error(GAStats *st)
+{
+    st->parse_errors++;
+}
+
+/* what a dispatch of @command allocated, see ga_alloc_count_begin() */
+void ga_stats_add_allocs(GAStats *st, const char *command,
+                         const GAAllocCount *count)
+{
+    GACommandStats *cs;
+
+    if (!command || !ga_alloc_stats_enabled()) {
+        return;
+    }
+    cs = ga_stats_command(st, command);
+    cs->allocs += count->allocs;
+    cs->alloc_bytes += count->bytes;
+    cs->alloc_peak = MAX(cs->alloc_peak, count->peak);
+}
+
+/* may be called from any thread */
+void ga_stats_add_bytes(GAStats *st, size_t in, size_t out)
+{
+    if (in) {
+        atomic_add(&st->bytes_in, in);
+    }
+    if (out) {
+        atomic_add(&st->bytes_out, out);
+    }
+}
+
+void ga_stats_get_totals(GAStats *st, GAStatsTotals *totals)
+{
+    totals->bytes_in = atomic_read(&st->bytes_in);
+    totals->bytes_out = atomic_read(&st->bytes_out);
+    totals->requests = st->requests;
+    totals->errors = st->errors;
+    totals->parse_errors = st->parse_errors;
+}
+
+static gint ga_stats_compare(gconstpointer a, gconstpointer b)
+{
+    const GACommandStats *x = a, *y = b;
+
+    return strcmp(x->name, y->name);
+}
+
+/* call @func for the commands that were used, by name */
+void ga_stats_foreach(GAStats *st, GAStatsFunc func, void *opaque)
+{
+    GList *list = g_hash_table_get_values(st->commands), *l;
+
+    list = g_list_sort(list, ga_stats_compare);
+    for (l = list; l; l = l->next) {
+        func(l->data, opaque);
+    }
+    g_list_free(list);
+}
+
+/* start over, as if no request was received yet */
+void ga_stats_reset(GAStats *st)
+{
+    g_hash_table_remove_all(st->commands);
+    atomic_set(&st->bytes_in, 0);
+    atomic_set(&st->bytes_out, 0);
+    st->requests = 0;
+    st->errors = 0;
+    st->parse_errors = 0;
+}
+
+static void ga_stats_command_free(gpointer data)
+{
+    GACommandStats *cs = data;
+
+    g_free(cs->name);
+    g_free(cs);
+}
+
+GAStats *ga_stats_new(void)
+{
+    GAStats *st = g_new0(GAStats, 1);
+
+    st->commands = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+                                         ga_stats_command_free);
+    return st;
+}
+
+void ga_stats_free(GAStats *st)
+{
+    if (!st) {
+        return;
+    }
+
+    g_hash_table_destroy(st->commands);
+    g_free(st);
+}
+
+/*
+ * With --alloc-stats, what glib allocates while a command is dispatched
+ * is counted for the command: g_malloc() and everything built on it, the
+ * QObjects of the response included, goes through a GMemVTable that adds to the GAAllocCount of the dispatch the calling
+ * thread runs, if any.  Memory libraries get with plain malloc() is not
+ * seen.
+ *
+ * Sizes are those malloc_usable_size() tells, so that memory from
+ * malloc() may still be given to g_free().  The peak is the most the
+ * dispatch had allocated and not yet freed at once; freeing what was
+ * allocated before it only lowers that.
+ *
+ * The vtable has to be set before glib allocates anything, so main()
+ * looks for the option first thing.  glib 2.46 and later ignore it, and
+ * the counts are then absent from guest-get-agent-stats.
+ */
+static bool ga_alloc_stats_on;
+static __thread GAAllocCount *ga_alloc_current;
+
+static size_t ga_alloc_size(gpointer mem, gsize n_bytes)
+{
+#if defined(__linux__)
+    return malloc_usable_size(mem);
+#elif defined(_WIN32)
+    return _msize(mem);
+#else
+    return n_bytes;
+#endif
+}
+
+static void ga_alloc_add(GAAllocCount *count, size_t size)
+{
+    count->allocs++;
+    count->bytes += size;
+    count->live += size;
+    count->peak = MAX(count->peak, count->live);
+}
+
+static gpointer ga_alloc_malloc(gsize n_bytes)
+{
+    GAAllocCount *count = ga_alloc_current;
+    gpointer mem = malloc(n_bytes);
+
+    if (count && mem) {
+        ga_alloc_add(count, ga_alloc_size(mem, n_bytes));
+    }
+    return mem;
+}
+
+static gpointer ga_alloc_calloc(gsize n_blocks, gsize n_block_bytes)
+{
+    GAAllocCount *count = ga_alloc_current;
+    gpointer mem = calloc(n_blocks, n_block_bytes);
+
+    if (count && mem) {
+        ga_alloc_add(count, ga_alloc_size(mem, n_blocks * n_block_bytes));
+    }
+    return mem;
+}
+
+/* counted as freeing the old block and allocating the new one */
+static gpointer ga_alloc_realloc(gpointer mem, gsize n_bytes)
+{
+    GAAllocCount *count = ga_alloc_current;
+    size_t old = count && mem ? ga_alloc_size(mem, 0) : 0;
+
+    mem = realloc(mem, n_bytes);
+    if (count && mem) {
+        count->live -= old;
+        ga_alloc_add(count, ga_alloc_size(mem, n_bytes));
+    }
+    return mem;
+}
+
+static void ga_alloc_free(gpointer mem)
+{
+    GAAllocCount *count = ga_alloc_current;
+
+    if (count && mem) {
+        count->live -= ga_alloc_size(mem, 0);
+    }
+    free(mem);
+}
+
+/* set the vtable, before anything else uses glib; false if it is ignored */
+bool ga_alloc_stats_init(void)
+{
+    static GMemVTable vtable = {
+        .malloc = ga_alloc_malloc,
+        .realloc = ga_alloc_realloc,
+        .free = ga_alloc_free,
+        .calloc = ga_alloc_calloc,
+        .try_malloc = ga_alloc_malloc,
+        .try_realloc = ga_alloc_realloc,
+    };
+    GAAllocCount probe = { 0 };
+
+    g_mem_set_vtable(&vtable);
+    ga_alloc_current = &probe;
+    g_free(g_malloc(1));
+    ga_alloc_current = NULL;
+    ga_alloc_stats_on = probe.allocs != 0;
+    return ga_alloc_stats_on;
+}
+
+bool ga_alloc_stats_enabled(void)
+{
+    return ga_alloc_stats_on;
+}
+
+/* count what this thread allocates into @count until ga_alloc_count_end() */
+void ga_alloc_count_begin(GAAllocCount *count)
+{
+    memset(count, 0, sizeof(*count));
+    if (ga_alloc_stats_on) {
+        ga_alloc_current = count;
+    }
+}
+
+void ga_alloc_count_end(void)
+{
+    ga_alloc_current = NULL;
+}
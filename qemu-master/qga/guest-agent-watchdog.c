@@ -0,0 +1,302 @@
+/*
+ * QEMU Guest Agent main loop stall detector
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include <glib.h>
+#include <string.h>
+#if defined(__linux__) && defined(__GLIBC__)
+#include <execinfo.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#define CONFIG_QGA_BACKTRACE
+#endif
+#include "qga/guest-agent-core.h"
+#include "qemu/atomic.h"
+
+/*
+ * Every command handler and watch runs on the main loop, so one that
+ * blocks, on a slow statfs() or a program it waits for, holds up every
+ * other request.  A timeout source in the main loop beats every
+ * @interval_us; how late each beat comes goes to the @lag histogram.
+ *
+ * A thread watches the beats.  Once one is @threshold_us overdue, it
+ * notes which command the main loop is running and, where it can, takes
+ * a sample of the main loop's stack: it sends the main thread SIGPROF,
+ * whose handler only records the return addresses, and turns them into
+ * symbols itself.  A main thread stuck in the kernel takes the signal
+ * only once it returns, so the thread waits for the sample a little while
+ * and goes without it otherwise.
+ *
+ * When the main loop beats again, the stall is over: it is kept with the
+ * last GA_WATCHDOG_STALLS ones, and passed to @func.
+ */
+
+#define GA_WATCHDOG_STALLS          16
+#define GA_WATCHDOG_FRAMES          32
+/* the shortest interval between beats */
+#define GA_WATCHDOG_INTERVAL_MIN_US (10 * 1000)
+/* how long to wait for the main thread to take a stack sample */
+#define GA_WATCHDOG_SAMPLE_WAIT_US  (100 * 1000)
+
+typedef struct GAStallRecord {
+    GAStallInfo info;
+    char **stack;
+} GAStallRecord;
+
+struct GAWatchdog {
+    int64_t threshold_us;
+    int64_t interval_us;
+    guint timer;
+    const char *activity;       /* set by the main loop, read atomically */
+    GAStallFunc func;
+    void *opaque;
+    CompatGMutex lock;          /* protects the fields up to @thread */
+    CompatGCond cond;
+    int64_t heartbeat;          /* when the main loop last beat */
+    bool sampled;               /* the stall since was seen by the thread */
+    const char *culprit;        /* and what the main loop was running */
+    char **stack;
+    bool stop;
+    GThread *thread;
+    /* main loop only */
+    GAHistogram lag;
+    GQueue stalls;              /* of GAStallRecord, oldest first */
+#ifdef CONFIG_QGA_BACKTRACE
+    pthread_t main_thread;
+#endif
+};
+
+#ifdef CONFIG_QGA_BACKTRACE
+static void *ga_watchdog_frames[GA_WATCHDOG_FRAMES];
+static int ga_watchdog_nframes;
+
+static void ga_watchdog_sample(int sig)
+{
+    /* backtrace() was called once already, nothing is left to load */
+    atomic_mb_set(&ga_watchdog_nframes,
+                  backtrace(ga_watchdog_frames, GA_WATCHDOG_FRAMES));
+}
+
+/* a sample of the main thread's stack, NULL if it takes too long */
+static char **ga_watchdog_backtrace(GAWatchdog *w)
+{
+    int64_t deadline = g_get_monotonic_time() + GA_WATCHDOG_SAMPLE_WAIT_US;
+    char **symbols, **stack;
+    int i, n, skip;
+
+    atomic_mb_set(&ga_watchdog_nframes, 0);
+    if (pthread_kill(w->main_thread, SIGPROF)) {
+        return NULL;
+    }
+    while (!(n = atomic_mb_read(&ga_watchdog_nframes))) {
+        if (g_get_monotonic_time() >= deadline) {
+            return NULL;
+        }
+        g_usleep(1000);
+    }
+    symbols = backtrace_symbols(ga_watchdog_frames, n);
+    if (!symbols) {
+        return NULL;
+    }
+    /* the first two frames are the signal handler and its trampoline */
+    skip = n > 2 ? 2 : 0;
+    stack = g_new0(char *, n - skip + 1);
+    for (i = skip; i < n; i++) {
+        stack[i - skip] = g_strdup(symbols[i]);
+    }
+    free(symbols);
+    return stack;
+}
+
+static void ga_watchdog_backtrace_init(GAWatchdog *w)
+{
+    struct sigaction sa;
+
+    w->main_thread = pthread_self();
+    /* loads libgcc, which the signal handler must not */
+    backtrace(ga_watchdog_frames, 1);
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = ga_watchdog_sample;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGPROF, &sa, NULL);
+}
+#else
+static char **ga_watchdog_backtrace(GAWatchdog *w)
+{
+    return NULL;
+}
+
+static void ga_watchdog_backtrace_init(GAWatchdog *w)
+{
+}
+#endif
+
+static gpointer ga_watchdog_thread(gpointer opaque)
+{
+    GAWatchdog *w = opaque;
+    const char *culprit;
+    int64_t deadline;
+    char **stack;
+
+    g_mutex_lock(&w->lock);
+    while (!w->stop) {
+        deadline = w->heartbeat + w->interval_us + w->threshold_us;
+        if (w->sampled) {
+            /* until the main loop beats again */
+            deadline = g_get_monotonic_time() + w->interval_us;
+        }
+        if (w->sampled || g_get_monotonic_time() < deadline) {
+            g_cond_wait_until(&w->cond, &w->lock, deadline);
+            continue;
+        }
+        w->sampled = true;
+        culprit = atomic_mb_read(&w->activity);
+        g_mutex_unlock(&w->lock);
+        stack = ga_watchdog_backtrace(w);
+        g_mutex_lock(&w->lock);
+        w->culprit = culprit;
+        w->stack = stack;
+    }
+    g_mutex_unlock(&w->lock);
+
+    return NULL;
+}
+
+static void ga_watchdog_record_free(GAStallRecord *r)
+{
+    g_strfreev(r->stack);
+    g_free(r);
+}
+
+static gboolean ga_watchdog_heartbeat(gpointer opaque)
+{
+    GAWatchdog *w = opaque;
+    int64_t now = g_get_monotonic_time(), lag;
+    GAStallRecord *r;
+    const char *culprit;
+    char **stack;
+    bool sampled;
+
+    g_mutex_lock(&w->lock);
+    lag = MAX(now - w->heartbeat - w->interval_us, 0);
+    w->heartbeat = now;
+    sampled = w->sampled;
+    culprit = w->culprit;
+    stack = w->stack;
+    w->sampled = false;
+    w->culprit = NULL;
+    w->stack = NULL;
+    g_mutex_unlock(&w->lock);
+
+    ga_histogram_add(&w->lag, lag);
+    if (lag < w->threshold_us && !sampled) {
+        g_strfreev(stack);
+        return true;
+    }
+
+    r = g_new0(GAStallRecord, 1);
+    r->info.time = g_get_real_time() * 1000;
+    r->info.lag_us = lag;
+    r->info.culprit = culprit;
+    r->info.stack = (const char * const *)stack;
+    r->stack = stack;
+    g_queue_push_tail(&w->stalls, r);
+    if (g_queue_get_length(&w->stalls) > GA_WATCHDOG_STALLS) {
+        ga_watchdog_record_free(g_queue_pop_head(&w->stalls));
+    }
+    g_warning("main loop stalled for %" PRId64 " ms%s%s", lag / 1000,
+              culprit ? " in " : "", culprit ?: "");
+    if (w->func) {
+        w->func(&r->info, w->opaque);
+    }
+    return true;
+}
+
+/**
+ * ga_watchdog_new:
+ * @threshold_ms: how long the main loop may be blocked before it counts
+ *                as a stall
+ * @func: called from the main loop at the end of each stall
+ * @opaque: for @func
+ *
+ * Start watching the main loop; this must be called from it.
+ */
+GAWatchdog *ga_watchdog_new(int64_t threshold_ms, GAStallFunc func,
+                            void *opaque)
+{
+    GAWatchdog *w = g_new0(GAWatchdog, 1);
+
+    w->threshold_us = threshold_ms * 1000;
+    w->interval_us = MAX(w->threshold_us / 2, GA_WATCHDOG_INTERVAL_MIN_US);
+    w->func = func;
+    w->opaque = opaque;
+    g_mutex_init(&w->lock);
+    g_cond_init(&w->cond);
+    g_queue_init(&w->stalls);
+    ga_watchdog_backtrace_init(w);
+    w->heartbeat = g_get_monotonic_time();
+    w->timer = g_timeout_add(w->interval_us / 1000, ga_watchdog_heartbeat, w);
+    w->thread = g_thread_new("qga-watchdog", ga_watchdog_thread, w);
+
+    return w;
+}
+
+void ga_watchdog_free(GAWatchdog *w)
+{
+    if (!w) {
+        return;
+    }
+
+    g_source_remove(w->timer);
+    g_mutex_lock(&w->lock);
+    w->stop = true;
+    g_cond_signal(&w->cond);
+    g_mutex_unlock(&w->lock);
+    g_thread_join(w->thread);
+
+    g_strfreev(w->stack);
+    while (!g_queue_is_empty(&w->stalls)) {
+        ga_watchdog_record_free(g_queue_pop_head(&w->stalls));
+    }
+    g_mutex_clear(&w->lock);
+    g_cond_clear(&w->cond);
+    g_free(w);
+}
+
+/*
+ * What the main loop is about to run, a string that stays around such as
+ * a command name, or NULL once it is done.  This only stores a pointer.
+ */
+void ga_watchdog_set_activity(GAWatchdog *w, const char *what)
+{
+    if (w) {
+        atomic_mb_set(&w->activity, what);
+    }
+}
+
+/* how late the beats of the main loop were, in microseconds */
+const GAHistogram *ga_watchdog_get_lag(GAWatchdog *w)
+{
+    return &w->lag;
+}
+
+/* the stalls that were kept, oldest first */
+void ga_watchdog_foreach_stall(GAWatchdog *w, GAStallFunc func, void *opaque)
+{
+    GList *l;
+
+    for (l = w->stalls.head; l; l = l->next) {
+        func(&((GAStallRecord *)l->data)->info, opaque);
+    }
+}
+
+void ga_watchdog_reset(GAWatchdog *w)
+{
+    memset(&w->lag, 0, sizeof(w->lag));
+    while (!g_queue_is_empty(&w->stalls)) {
+        ga_watchdog_record_free(g_queue_pop_head(&w->stalls));
+    }
+}
@@ -24,6 +24,10 @@
 #include <dirent.h>
 #include <errno.h>
 #include <unistd.h>
+#include <sys/resource.h>
+#ifdef CONFIG_MALLOC_TRIM
+#include <malloc.h>
+#endif
 #endif
 #include "qapi/qmp/json-streamer.h"
 #include "qapi/qmp/json-parser.h"
@@ -34,8 +38,18 @@
 #include "signal.h"
 #include "qapi/qmp/qerror.h"
 #include "qapi/qmp/dispatch.h"
+#include "qapi/qmp-event.h"
 #include "qga/channel.h"
 #include "qemu/bswap.h"
+#include "qemu/atomic.h"
+#include "qemu/buffer-pool.h"
+#include "qemu/iov.h"
+#include "qemu/rcu.h"
+#include "qemu/sockets.h"
+#include "qemu/systemd.h"
+#include "qemu/throttle.h"
+#include "trace/control.h"
+#include "trace.h"
 #ifdef _WIN32
 #include "qga/service-win32.h"
 #include "qga/vss-win32.h"
@@ -60,7 +74,38 @@
 #define QGA_FSFREEZE_HOOK_DEFAULT CONFIG_QEMU_CONFDIR "/fsfreeze-hook"
 #endif
 #define QGA_SENTINEL_BYTE 0xFF
+/* framed mode: 32-bit big-endian JSON and attachment lengths, then both */
+#define QGA_FRAME_HEADER_SIZE 8
+#ifdef CONFIG_QGA_LEAN
+#define QGA_FRAME_JSON_MAX (1 * 1024 * 1024)
+#define QGA_FRAME_ATTACHMENT_MAX (8 * 1024 * 1024)
+#define QGA_METRICS_HISTORY_DEFAULT 60
+/* buckets of the 1s, 10s, 1m and 1h rollups */
+#define QGA_METRICS_ROLLUP_DEFAULTS { 0, 60, 60, 24 }
+#else
+#define QGA_FRAME_JSON_MAX (16 * 1024 * 1024)
+#define QGA_FRAME_ATTACHMENT_MAX (64 * 1024 * 1024)
+#define QGA_METRICS_HISTORY_DEFAULT 600
+#define QGA_METRICS_ROLLUP_DEFAULTS { 120, 360, 120, 48 }
+#endif
+/* messages at least this large are given back to the system, see ga_trim() */
+#define QGA_TRIM_THRESHOLD (256 * 1024)
+/* seconds a large buffer is kept for the next message, see ga_trim() */
+#define QGA_BUFFER_POOL_IDLE 10
+#define QGA_FILE_HANDLES_MAX_DEFAULT 1024
+#define QGA_EXEC_PROCESSES_MAX_DEFAULT 1024
+#define QGA_EXEC_REAP_TIMEOUT_DEFAULT 3600
+/* megabytes a --capture file may grow to before it is rotated */
+#define QGA_CAPTURE_SIZE_DEFAULT 64
+/* seconds of --cpu-budget the agent may use up at once */
+#define QGA_CPU_BUDGET_WINDOW 10
 #define QGA_CONF_DEFAULT CONFIG_QEMU_CONFDIR G_DIR_SEPARATOR_S "qemu-ga.conf"
+#ifndef _WIN32
+/* names the state file guest-upgrade-agent leaves for the new binary */
+#define QGA_HANDOFF_ENV "QGA_HANDOFF"
+/* how long clients get to take their output before the exec, in ms */
+#define QGA_HANDOFF_FLUSH_MS 5000
+#endif
 
 static struct {
     const char *state_dir;
@@ -72,19 +117,145 @@ typedef struct GAPersistentState {
     int64_t fd_counter;
 } GAPersistentState;
 
-struct GAState {
+/* file handle ids are committed to the state file this many at a time */
+#define QGA_PSTATE_FD_BLOCK 1024
+
+/* how long it took to serialize and write a message, in microseconds */
+typedef struct GASendTimes {
+    int64_t serialize_us;
+    int64_t write_us;
+} GASendTimes;
+
+/*
+ * Besides the control channel, the agent can serve a telemetry and a bulk
+ * channel, each a byte stream of its own, so that requests on one are not
+ * held up behind what is in flight on another.  Events go to the
+ * telemetry channel if there is one.  What freezes, suspends, stops or
+ * replaces the agent is only accepted on the control channel.
+ */
+typedef enum GAChannelRole {
+    GA_CHANNEL_ROLE_CONTROL,
+    GA_CHANNEL_ROLE_TELEMETRY,
+    GA_CHANNEL_ROLE_BULK,
+    GA_CHANNEL_ROLE__MAX
+} GAChannelRole;
+
+static const char *ga_channel_role_names[GA_CHANNEL_ROLE__MAX] = {
+    "control", "telemetry", "bulk"
+};
+
+typedef struct GARoleChannel {
+    GAState *state;
+    GAChannelRole role;
+    GAChannel *channel;         /* NULL if not configured */
+    bool virtio;
+    bool listening;
+    bool serial;                /* isa-serial */
+    int serial_speed;           /* of the line, in bits/s */
+    bool serial_flow_control;   /* RTS/CTS */
+} GARoleChannel;
+
+/* per-client protocol state */
+struct GASession {
     JSONMessageParser parser;
+    GAChannelClient *client;
+    GARoleChannel *channel;     /* the client is of */
+    bool delimit_response;
+    bool framed;
+    bool framing_changed;       /* toggle framed after the next response */
+    int serial_speed_changed;   /* switch the line to this speed after the
+                                 * next response, 0 to leave it */
+    bool serial_flow_control_changed;
+    bool compress;              /* zlib-compress bulk data in responses */
+    GByteArray *frame;          /* framed input not processed yet */
+    const guint8 *attachment;   /* of the request being processed */
+    size_t attachment_len;
+    void *response_attachment;
+    size_t response_attachment_len;
+    bool response_attachment_pooled;    /* from the buffer pool */
+    GList *async_jobs;          /* GAAsyncJob, still running for us */
+    GQueue deferred;            /* bulk requests waiting for the main loop */
+    guint deferred_idle;        /* runs them one at a time */
+    GList *streams;             /* GAStream, sending to the client */
+    GList *pending;             /* GAPendingResponse, answered later */
+    int64_t parse_us;           /* of the request being processed */
+    GASendTimes send_times;     /* of the last response */
+    LeakyBucket rate;           /* --rate-limit, in requests */
+    int64_t rate_leak_ns;
+    unsigned int serial;        /* tells sessions apart in a --capture */
+};
+
+/* see ga_defer_response() */
+struct GAPendingResponse {
+    GASession *session;         /* NULL once the client has gone away */
+    QDict *req;
+    QObject *id;
+    bool answered;              /* cancelled, drop the result */
+};
+
+/* a command of the [ratelimit] group, see ga_ratelimit_check() */
+typedef struct GARateLimit {
+    LeakyBucket bucket;         /* in requests, for all clients together */
+    int64_t leak_ns;
+    char *cached_args;          /* the arguments of the last success, */
+    QObject *cached;            /* and what it returned */
+} GARateLimit;
+
+/* see ga_stream_new() */
+struct GAStream {
+    GASession *session;
+    int64_t credits;            /* messages that may be sent before more */
+    guint idle;                 /* sends them, one per main loop iteration */
+    GAStreamFunc next;
+    void *opaque;
+    GDestroyNotify destroy;
+};
+
+/* a request handed to the worker thread, see process_command() */
+typedef struct GAAsyncJob {
+    GASession *session;         /* NULL once the client has gone away */
+    QmpCommand *cmd;
+    QDict *req;
+    QObject *id;
+    QObject *rsp;
+    int64_t dispatch_us;        /* how long the worker took, or -1 */
+    GAAllocCount allocs;        /* what it allocated, with --alloc-stats */
+    int cancelled;              /* set by the main loop, seen by the worker */
+    bool answered;              /* timed out or cancelled, drop the result */
+    guint timer;                /* deadline */
+    int64_t timeout_ms;
+    char *key;                  /* command and arguments, if read-only */
+    GList *followers;           /* identical requests waiting for @rsp */
+    int64_t start;              /* of a follower, when it came in */
+} GAAsyncJob;
+
+struct GAState {
     GMainLoop *main_loop;
-    GAChannel *channel;
+    GAChannel *channel;         /* the control channel */
+    GARoleChannel channels[GA_CHANNEL_ROLE__MAX];
     bool virtio; /* fastpath to check for virtio to deal with poll() quirks */
+    bool listening;             /* clients connect to the channel */
+    const char *method;         /* of the channel, as configured */
     GACommandState *command_state;
     GLogLevelFlags log_level;
     FILE *log_file;
+    GALog *log;                 /* buffers the log once the agent runs */
+    GAStats *stats;             /* see guest-get-agent-stats */
+    GAWatchdog *watchdog;       /* NULL without --stall-threshold */
+    GACapture *capture;         /* NULL without --capture */
+    unsigned int sessions;      /* opened so far */
+#ifdef CONFIG_QGA_BPF
+    GABpf *bpf;                 /* NULL without --latency-histograms */
+#endif
     bool logging_enabled;
 #ifdef _WIN32
     GAService service;
 #endif
-    bool delimit_response;
+    GASession *session; /* the client whose request is being processed */
+    QDict *request;             /* and the request, with its id apart */
+    QObject *request_id;
+    bool response_deferred;     /* see ga_defer_response() */
+    bool nested_dispatch;
     bool frozen;
     GList *blacklist;
     char *state_filepath_isfrozen;
@@ -94,13 +265,69 @@ struct GAState {
     } deferred_options;
 #ifdef CONFIG_FSFREEZE
     const char *fsfreeze_hook;
+    int fsfreeze_hook_timeout;  /* seconds, 0 for none */
 #endif
+    gchar *state_dir;
     gchar *pstate_filepath;
     GAPersistentState pstate;
+    int64_t fd_reserved;        /* ids below it are in the state file */
+    GASampler *sampler;
+    GASamplerConfig sampler_config;
+    GAMetricsShm *metrics_shm;  /* NULL without --metrics-shm */
+    GAMetricsSpool *metrics_spool; /* NULL without --metrics-spool */
+#ifndef _WIN32
+    GASpawner *spawner;         /* runs the programs commands call */
+    char **argv;                /* for guest-upgrade-agent */
+    char *exe_path;             /* the binary the agent was started from */
+    char *upgrade_path;
+    guint upgrade_idle;
+    GAHandoff *handoff;         /* from the agent that exec'd this one */
+#endif
+    /* --metrics-interval and --metrics-history, -1 if not given */
+    int metrics_interval_arg;
+    int metrics_history_arg;
+    GThreadPool *async_pool;
+    GAsyncQueue *async_done;    /* jobs back from the workers */
+    unsigned int async_pending;
+    GHashTable *async_running;  /* key -> job, of read-only commands */
+    GHashTable *timeouts;       /* [timeouts] of the config, in ms */
+    GHashTable *ratelimits;     /* [ratelimit] of the config, GARateLimit */
+    double rate_limit;          /* requests per second per client, 0 for no
+                                 * limit */
+    int rate_limit_burst;
+    LeakyBucket cpu_budget;     /* --cpu-budget, in microseconds of CPU */
+    int64_t cpu_leak_ns;
+    int64_t cpu_used_us;
+    NotifierList session_close_notifiers;
+    int max_file_handles;       /* per client, 0 for no limit */
+    int max_exec_processes;     /* 0 for no limit */
+    int exec_reap_timeout;      /* seconds, 0 for never */
+    bool pm_utils;              /* suspend through pm-utils */
+    int idle_exit;              /* seconds, 0 for never */
+    guint idle_exit_timer;
+    int busy;                   /* see ga_busy_ref() */
+    guint trim_idle;            /* see ga_trim() */
+    guint buffer_pool_timer;    /* see ga_trim() */
+    guint warm_idle;            /* see ga_notify_resume() */
+#ifdef CLOCK_BOOTTIME
+    /* CLOCK_BOOTTIME and CLOCK_REALTIME ahead of CLOCK_MONOTONIC, in ns */
+    int64_t boot_offset;
+    int64_t real_offset;
+#endif
+    /* see ga_get_startup_times() */
+    int64_t start_time;
+    int64_t channel_us;
+    int64_t ready_us;
 };
 
 struct GAState *ga_state;
 
+/* threads for commands registered with QCO_WORKER */
+#define GA_WORKER_THREADS 4
+
+/* the job a worker thread is running, for ga_worker_cancelled() */
+static __thread GAAsyncJob *ga_worker_job;
+
 /* commands that are safe to issue while filesystems are frozen */
 static const char *ga_freeze_whitelist[] = {
     "guest-ping",
@@ -108,7 +335,10 @@ static const char *ga_freeze_whitelist[] = {
     "guest-sync",
     "guest-sync-delimited",
     "guest-fsfreeze-status",
+    "guest-fsfreeze-get-timings",
     "guest-fsfreeze-thaw",
+    "guest-get-agent-log",
+    "guest-get-agent-stats",
     NULL
 };
 
@@ -148,6 +378,20 @@ static void quit_handler(int sig)
 }
 
 #ifndef _WIN32
+/* written to by the SIGHUP handler, read in the main loop */
+static int reload_pipe[2] = { -1, -1 };
+
+static void reload_handler(int sig)
+{
+    int saved_errno = errno;
+    ssize_t ret;
+
+    /* if the pipe is full, a reload is pending already */
+    ret = write(reload_pipe[1], "", 1);
+    (void)ret;
+    errno = saved_errno;
+}
+
 static gboolean register_signal_handlers(void)
 {
     struct sigaction sigact;
@@ -165,6 +409,17 @@ static gboolean register_signal_handlers(void)
         g_error("error configuring signal handler: %s", strerror(errno));
     }
 
+    if (qemu_pipe(reload_pipe) == -1) {
+        g_error("error creating reload pipe: %s", strerror(errno));
+    }
+    qemu_set_nonblock(reload_pipe[0]);
+    qemu_set_nonblock(reload_pipe[1]);
+    sigact.sa_handler = reload_handler;
+    ret = sigaction(SIGHUP, &sigact, NULL);
+    if (ret == -1) {
+        g_error("error configuring signal handler: %s", strerror(errno));
+    }
+
     sigact.sa_handler = SIG_IGN;
     if (sigaction(SIGPIPE, &sigact, NULL) != 0) {
         g_error("error configuring SIGPIPE signal handler: %s",
@@ -198,12 +453,16 @@ static void usage(const char *cmd)
 "Usage: %s [-m <method> -p <path>] [<options>]\n"
 "QEMU Guest Agent %s\n"
 "\n"
-"  -m, --method      transport method: one of unix-listen, virtio-serial, or\n"
-"                    isa-serial (virtio-serial is the default)\n"
+"  -m, --method      transport method: one of unix-listen, virtio-serial,\n"
+"                    isa-serial, or vsock-listen (virtio-serial is the\n"
+"                    default)\n"
 "  -p, --path        device/socket path (the default for virtio-serial is:\n"
 "                    %s,\n"
 "                    the default for isa-serial is:\n"
-"                    %s)\n"
+"                    %s); vsock-listen takes <cid>:<port>\n"
+"                    ([general] telemetry-path and bulk-path in the config\n"
+"                    file open a telemetry and a bulk channel besides,\n"
+"                    with telemetry-method and bulk-method)\n"
 "  -l, --logfile     set logfile path, logs to stderr by default\n"
 "  -f, --pidfile     specify pidfile (default is %s)\n"
 #ifdef CONFIG_FSFREEZE
@@ -215,6 +474,12 @@ static void usage(const char *cmd)
 "                    If using -F with an argument, do not follow -F with a\n"
 "                    space.\n"
 "                    (for example: -F/var/run/fsfreezehook.sh)\n"
+"                    A directory is run by the agent itself: the programs\n"
+"                    in it run in parallel, in groups ordered by the number\n"
+"                    their names start with.\n"
+"  --fsfreeze-hook-timeout\n"
+"                    seconds each program of a hook directory may run\n"
+"                    before it is killed, 0 for no limit (default is 0)\n"
 #endif
 "  -t, --statedir    specify dir to store state information (absolute paths\n"
 "                    only, default is %s)\n"
@@ -228,6 +493,70 @@ static void usage(const char *cmd)
 "                    to list available RPCs)\n"
 "  -D, --dump-conf   dump a qemu-ga config file based on current config\n"
 "                    options / command-line parameters to stdout\n"
+"  -T, --trace FILE  enable trace events listed in the given file\n"
+"  --metrics-interval\n"
+"                    sample CPU, memory, disk and network counters every\n"
+"                    this many milliseconds for guest-get-metrics-history\n"
+"                    (default is 0, disabled)\n"
+"  --metrics-history number of samples to keep (default is %d)\n"
+"                    ([sampler] in the config file is re-read on SIGHUP)\n"
+"  --metrics-shm     also write each sample to this shared memory file for\n"
+"                    the host to read, e.g. the resource2 file of an\n"
+"                    ivshmem device, or \"ivshmem\" for the first one\n"
+"                    (Linux only)\n"
+"  --metrics-spool   also keep this many samples in a file of the state\n"
+"                    directory, which guest-get-metrics-history reads\n"
+"                    back after a restart (default is 0, none; Linux only)\n"
+"  --max-file-handles\n"
+"                    files a client may have open with guest-file-open at\n"
+"                    a time, 0 for no limit (default is %d)\n"
+"  --max-exec-processes\n"
+"                    processes started by guest-exec that are tracked at a\n"
+"                    time, 0 for no limit (default is %d)\n"
+"  --exec-reap-timeout\n"
+"                    seconds after which an exited guest-exec process that\n"
+"                    nobody asked about is forgotten, 0 for never (default\n"
+"                    is %d)\n"
+"  --idle-exit       exit after this many seconds without requests, once no\n"
+"                    files are open and nothing runs; only with systemd\n"
+"                    socket activation, which starts the agent again\n"
+"                    (default is 0, never)\n"
+"  --epoll           wait for the channel and guest-exec pipes with epoll\n"
+"                    rather than glib's poll (Linux only)\n"
+"  --pm-utils        check for and enter the guest-suspend-* modes with\n"
+"                    pm-utils' scripts rather than through /sys/power\n"
+"                    (Linux only)\n"
+"  --rate-limit      requests per second a client may make, 0 for no\n"
+"                    limit (default); [ratelimit] in the config file\n"
+"                    limits single commands\n"
+"  --rate-limit-burst\n"
+"                    requests a client may make at once (default is the\n"
+"                    rate, at least 1)\n"
+"  --cpu-budget      percent of a CPU the agent and the programs it runs\n"
+"                    may use on average, 0 for no limit (default); past\n"
+"                    it the [ratelimit] commands repeat their last result\n"
+"  --stall-threshold report the main loop being held up for this many\n"
+"                    milliseconds, with what held it up, in the agent\n"
+"                    stats and with GUEST_AGENT_STALL (default is 0,\n"
+"                    disabled)\n"
+"  --serial-speed    line speed of an isa-serial channel in bits/s, up to\n"
+"                    4000000 (default is %d); the host must open its end\n"
+"                    at the same speed, guest-sync can change it later\n"
+"  --serial-flow-control\n"
+"                    use RTS/CTS flow control on an isa-serial channel\n"
+"  --capture         write every request and response to this file, for\n"
+"                    tests/replay-qga; it holds passwords sent to\n"
+"                    guest-set-user-password too\n"
+"  --capture-size    megabytes the capture may grow to before it is moved\n"
+"                    to <file>.1 (default is %d, 0 for no limit)\n"
+"  --alloc-stats     count what glib allocates for each command, for\n"
+"                    guest-get-agent-stats; only on the command line, and\n"
+"                    only with glib older than 2.46\n"
+#ifdef CONFIG_QGA_BPF
+"  --latency-histograms\n"
+"                    load BPF programs that collect run-queue and block\n"
+"                    I/O latency histograms for guest-get-latency-histograms\n"
+#endif
 "  -h, --help        display this help and exit\n"
 "\n"
 "Report bugs to <mdroth@linux.vnet.ibm.com>\n"
@@ -236,7 +565,10 @@ static void usage(const char *cmd)
 #ifdef CONFIG_FSFREEZE
     QGA_FSFREEZE_HOOK_DEFAULT,
 #endif
-    dfl_pathnames.state_dir);
+    dfl_pathnames.state_dir, QGA_METRICS_HISTORY_DEFAULT,
+    QGA_FILE_HANDLES_MAX_DEFAULT, QGA_EXEC_PROCESSES_MAX_DEFAULT,
+    QGA_EXEC_REAP_TIMEOUT_DEFAULT, GA_CHANNEL_SERIAL_SPEED_DEFAULT,
+    QGA_CAPTURE_SIZE_DEFAULT);
 }
 
 static const char *ga_log_level_str(GLogLevelFlags level)
@@ -266,6 +598,10 @@ bool ga_logging_enabled(GAState *s)
 
 void ga_disable_logging(GAState *s)
 {
+    /* the log file may be about to be frozen */
+    if (s->log) {
+        ga_log_flush(s->log);
+    }
     s->logging_enabled = false;
 }
 
@@ -280,29 +616,145 @@ static void ga_log(const gchar *domain, GLogLevelFlags level,
     GAState *s = opaque;
     GTimeVal time;
     const char *level_str = ga_log_level_str(level);
+    bool is_syslog = false;
+    char *line;
+
+    level &= G_LOG_LEVEL_MASK;
+#ifndef _WIN32
+    is_syslog = g_strcmp0(domain, "syslog") == 0;
+#endif
+    /* kept for guest-get-agent-log even while frozen */
+    if (s->log) {
+        ga_log_record(s->log, level, is_syslog, msg);
+    }
 
     if (!ga_logging_enabled(s)) {
         return;
     }
 
-    level &= G_LOG_LEVEL_MASK;
-#ifndef _WIN32
-    if (g_strcmp0(domain, "syslog") == 0) {
-        syslog(LOG_INFO, "%s: %s", level_str, msg);
+    if (is_syslog) {
+        line = g_strdup_printf("%s: %s", level_str, msg);
     } else if (level & s->log_level) {
-#else
-    if (level & s->log_level) {
-#endif
         g_get_current_time(&time);
-        fprintf(s->log_file,
-                "%lu.%lu: %s: %s\n", time.tv_sec, time.tv_usec, level_str, msg);
+        line = g_strdup_printf("%lu.%lu: %s: %s\n", time.tv_sec, time.tv_usec,
+                               level_str, msg);
+    } else {
+        return;
+    }
+
+    if (s->log) {
+        ga_log_write(s->log, is_syslog, line);
+        /* errors may be the last thing the agent does */
+        if (level & (G_LOG_LEVEL_ERROR | G_LOG_LEVEL_CRITICAL)) {
+            ga_log_flush(s->log);
+        }
+    } else if (is_syslog) {
+#ifndef _WIN32
+        syslog(LOG_INFO, "%s", line);
+#endif
+    } else {
+        fputs(line, s->log_file);
         fflush(s->log_file);
     }
+    g_free(line);
 }
 
 void ga_set_response_delimited(GAState *s)
 {
-    s->delimit_response = true;
+    if (s->session) {
+        s->session->delimit_response = true;
+    }
+}
+
+/* switch the framing of the current client once the response is sent */
+void ga_set_framing(GAState *s, bool framed)
+{
+    if (s->session) {
+        s->session->framing_changed = framed != s->session->framed;
+    }
+}
+
+/*
+ * Switch the isa-serial line of the current client to @speed once the
+ * response is sent, for the host to follow once it has read it.
+ */
+bool ga_set_serial_speed(GAState *s, int64_t speed, bool flow_control,
+                         Error **errp)
+{
+    if (!s->session || !s->session->channel->serial) {
+        error_setg(errp, "the channel is not an isa-serial port");
+        return false;
+    }
+    if (speed > INT_MAX || !ga_channel_serial_speed_valid(speed)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "serial-speed",
+                   "a supported line speed");
+        return false;
+    }
+    s->session->serial_speed_changed = speed;
+    s->session->serial_flow_control_changed = flow_control;
+    return true;
+}
+
+void ga_set_compression(GAState *s, bool compress)
+{
+    if (s->session) {
+        s->session->compress = compress;
+    }
+}
+
+bool ga_is_compressing(GAState *s)
+{
+    return s->session && s->session->compress;
+}
+
+/* whether the current request came in a frame, and can have attachments */
+bool ga_is_framed(GAState *s)
+{
+    return s->session && s->session->framed && !s->nested_dispatch;
+}
+
+/* commands run from within another command do not get attachments */
+void ga_set_nested_dispatch(GAState *s, bool nested)
+{
+    s->nested_dispatch = nested;
+}
+
+const void *ga_get_attachment(GAState *s, size_t *len)
+{
+    if (!ga_is_framed(s) || !s->session->attachment_len) {
+        *len = 0;
+        return NULL;
+    }
+    *len = s->session->attachment_len;
+    return s->session->attachment;
+}
+
+static void ga_free_response_attachment(GASession *session)
+{
+    if (session->response_attachment_pooled) {
+        qemu_buffer_pool_free(session->response_attachment);
+    } else {
+        g_free(session->response_attachment);
+    }
+    session->response_attachment = NULL;
+    session->response_attachment_len = 0;
+    session->response_attachment_pooled = false;
+}
+
+/* @data is sent after the response and freed */
+void ga_set_response_attachment(GAState *s, void *data, size_t len)
+{
+    g_assert(ga_is_framed(s));
+    ga_free_response_attachment(s->session);
+    s->session->response_attachment = data;
+    s->session->response_attachment_len = len;
+}
+
+/* the same, for @data from qemu_buffer_pool_alloc() */
+void ga_set_response_buffer(GAState *s, void *data, size_t len)
+{
+    ga_set_response_attachment(s, data, len);
+    s->session->response_attachment_pooled = true;
 }
 
 static FILE *ga_open_logfile(const char *logfile)
@@ -363,20 +815,24 @@ static gint ga_strcmp(gconstpointer str1, gconstpointer str2)
     return strcmp(str1, str2);
 }
 
-/* disable commands that aren't safe for fsfreeze */
-static void ga_disable_non_whitelisted(QmpCommand *cmd, void *opaque)
+static bool ga_is_whitelisted(const char *name)
 {
-    bool whitelisted = false;
-    int i = 0;
-    const char *name = qmp_command_name(cmd);
+    int i;
 
-    while (ga_freeze_whitelist[i] != NULL) {
+    for (i = 0; ga_freeze_whitelist[i] != NULL; i++) {
         if (strcmp(name, ga_freeze_whitelist[i]) == 0) {
-            whitelisted = true;
+            return true;
         }
-        i++;
     }
-    if (!whitelisted) {
+    return false;
+}
+
+/* disable commands that aren't safe for fsfreeze */
+static void ga_disable_non_whitelisted(QmpCommand *cmd, void *opaque)
+{
+    const char *name = qmp_command_name(cmd);
+
+    if (!ga_is_whitelisted(name)) {
         g_debug("disabling command: %s", name);
         qmp_disable_command(name);
     }
@@ -431,6 +887,7 @@ void ga_set_frozen(GAState *s)
     qmp_for_each_command(ga_disable_non_whitelisted, NULL);
     g_warning("disabling logging due to filesystem freeze");
     ga_disable_logging(s);
+    ga_metrics_spool_pause(s->metrics_spool, true);
     s->frozen = true;
     if (!ga_create_file(s->state_filepath_isfrozen)) {
         g_warning("unable to create %s, fsfreeze may not function properly",
@@ -452,6 +909,9 @@ void ga_unset_frozen(GAState *s)
         if (!s->log_file) {
             s->log_file = stderr;
         }
+        if (s->log) {
+            ga_log_set_file(s->log, s->log_file);
+        }
         s->deferred_options.log_filepath = NULL;
     }
     ga_enable_logging(s);
@@ -465,6 +925,7 @@ void ga_unset_frozen(GAState *s)
 
     /* enable all disabled, non-blacklisted commands */
     qmp_for_each_command(ga_enable_non_blacklisted, s->blacklist);
+    ga_metrics_spool_pause(s->metrics_spool, false);
     s->frozen = false;
     if (!ga_delete_file(s->state_filepath_isfrozen)) {
         g_warning("unable to delete %s, fsfreeze may not function properly",
@@ -473,10 +934,217 @@ void ga_unset_frozen(GAState *s)
 }
 
 #ifdef CONFIG_FSFREEZE
+const char *ga_get_state_dir(GAState *s)
+{
+    return s->state_dir;
+}
+
 const char *ga_fsfreeze_hook(GAState *s)
 {
     return s->fsfreeze_hook;
 }
+
+int ga_fsfreeze_hook_timeout(GAState *s)
+{
+    return s->fsfreeze_hook_timeout;
+}
+#endif
+
+/* called within rcu_read_lock() */
+GASampler *ga_get_sampler(GAState *s)
+{
+    return atomic_rcu_read(&s->sampler);
+}
+
+GALog *ga_get_log(GAState *s)
+{
+    return s->log;
+}
+
+GAStats *ga_get_stats(GAState *s)
+{
+    return s->stats;
+}
+
+GAWatchdog *ga_get_watchdog(GAState *s)
+{
+    return s->watchdog;
+}
+
+#ifdef CONFIG_QGA_BPF
+GABpf *ga_get_bpf(GAState *s)
+{
+    return s->bpf;
+}
+#endif
+
+GACommandState *ga_get_command_state(GAState *s)
+{
+    return s->command_state;
+}
+
+/*
+ * Commands hold a reference for state that would be lost if the agent
+ * exited, such as open files and running processes, so that --idle-exit
+ * waits for it to go away.  May be called from any thread.
+ */
+void ga_busy_ref(GAState *s)
+{
+    atomic_inc(&s->busy);
+}
+
+void ga_busy_unref(GAState *s)
+{
+    atomic_dec(&s->busy);
+}
+
+static void ga_session_check_busy(gpointer data, gpointer opaque)
+{
+    GASession *session = ga_channel_client_get_data(data);
+    bool *busy = opaque;
+
+    /* a client of a listening channel would see its connection go away,
+     * and framing or compression the host turned on would be forgotten
+     */
+    *busy |= !session || session->channel->listening ||
+             session->async_jobs || !g_queue_is_empty(&session->deferred) ||
+             session->streams || session->pending ||
+             session->framed || session->compress;
+}
+
+/* call @func for the clients of all channels */
+static void ga_foreach_client(GAState *s, GFunc func, gpointer opaque)
+{
+    int i;
+
+    for (i = 0; i < GA_CHANNEL_ROLE__MAX; i++) {
+        if (s->channels[i].channel) {
+            ga_channel_foreach_client(s->channels[i].channel, func, opaque);
+        }
+    }
+}
+
+/* nothing has come in for --idle-exit seconds: quit unless still needed */
+static gboolean ga_idle_exit_cb(gpointer opaque)
+{
+    GAState *s = opaque;
+    bool busy = atomic_read(&s->busy) > 0 || s->async_pending ||
+                ga_is_frozen(s);
+
+    ga_foreach_client(s, ga_session_check_busy, &busy);
+    if (busy) {
+        return G_SOURCE_CONTINUE;
+    }
+    g_debug("idle for %d seconds, exiting", s->idle_exit);
+    s->idle_exit_timer = 0;
+    g_main_loop_quit(s->main_loop);
+    return G_SOURCE_REMOVE;
+}
+
+static void ga_idle_exit_rearm(GAState *s)
+{
+    if (!s->idle_exit) {
+        return;
+    }
+    if (s->idle_exit_timer) {
+        g_source_remove(s->idle_exit_timer);
+    }
+    s->idle_exit_timer = g_timeout_add_seconds(s->idle_exit, ga_idle_exit_cb,
+                                               s);
+}
+
+/*
+ * How long after the start the channel was open, and the deferred
+ * command state initialized, in us; -1 while that has yet to happen.
+ */
+void ga_get_startup_times(GAState *s, int64_t *channel_us, int64_t *ready_us)
+{
+    *channel_us = s->channel_us;
+    *ready_us = s->ready_us;
+}
+
+/* the deferred inits, one per iteration so requests are not held up */
+static gboolean ga_deferred_init_cb(gpointer opaque)
+{
+    GAState *s = opaque;
+
+    if (ga_command_state_init_deferred(s->command_state)) {
+        return G_SOURCE_CONTINUE;
+    }
+    s->ready_us = g_get_monotonic_time() - s->start_time;
+    g_debug("deferred initialization done after %" PRId64 "us", s->ready_us);
+    return G_SOURCE_REMOVE;
+}
+
+/* the caches invalidated by ga_notify_resume(), one per iteration too */
+static gboolean ga_warm_cb(gpointer opaque)
+{
+    GAState *s = opaque;
+
+    if (ga_command_state_warm_next(s->command_state)) {
+        return G_SOURCE_CONTINUE;
+    }
+    s->warm_idle = 0;
+    return G_SOURCE_REMOVE;
+}
+
+/*
+ * The guest was resumed, after a migration, a snapshot restore or a
+ * suspend: devices, addresses and mounts may all have changed.  Drop
+ * every cache at once and fill them again while the main loop is idle,
+ * so the first requests after the resume are both correct and fast.
+ */
+void ga_notify_resume(GAState *s)
+{
+    g_debug("guest resumed, refreshing the caches");
+    qmp_invalidate_cached_results();
+    ga_command_state_invalidate_all(s->command_state);
+    if (!s->warm_idle) {
+        s->warm_idle = g_idle_add(ga_warm_cb, s);
+    }
+}
+
+#ifdef CLOCK_BOOTTIME
+/* a jump of the clocks that much ahead of CLOCK_MONOTONIC is a resume */
+#define GA_RESUME_JUMP_NS (1000 * 1000 * 1000LL)
+
+static int64_t ga_clock_ahead(clockid_t clock)
+{
+    struct timespec ts, mono;
+
+    clock_gettime(clock, &ts);
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    return (ts.tv_sec - mono.tv_sec) * 1000000000LL +
+           ts.tv_nsec - mono.tv_nsec;
+}
+#endif
+
+/*
+ * Notice a resume nobody told us about: time spent suspended puts
+ * CLOCK_BOOTTIME ahead, and after a migration or a restore the wall clock
+ * is set again.  A few clock reads per request are cheap enough.
+ */
+static void ga_check_resume(GAState *s)
+{
+#ifdef CLOCK_BOOTTIME
+    int64_t boot = ga_clock_ahead(CLOCK_BOOTTIME);
+    int64_t real = ga_clock_ahead(CLOCK_REALTIME);
+    bool resumed = llabs(boot - s->boot_offset) > GA_RESUME_JUMP_NS ||
+                   llabs(real - s->real_offset) > GA_RESUME_JUMP_NS;
+
+    s->boot_offset = boot;
+    s->real_offset = real;
+    if (resumed) {
+        ga_notify_resume(s);
+    }
+#endif
+}
+
+#ifndef _WIN32
+GASpawner *ga_get_spawner(GAState *s)
+{
+    return s->spawner;
+}
 #endif
 
 static void become_daemon(const char *pidfile)
@@ -491,6 +1159,8 @@ static void become_daemon(const char *pidfile)
     if (pid > 0) {
         exit(EXIT_SUCCESS);
     }
+    /* the call_rcu thread stayed behind in the parent */
+    rcu_after_fork();
 
     if (pidfile) {
         if (!ga_open_pidfile(pidfile)) {
@@ -522,71 +1192,986 @@ fail:
 #endif
 }
 
-static int send_response(GAState *s, QObject *payload)
+#ifdef CONFIG_MALLOC_TRIM
+static gboolean ga_trim_cb(gpointer opaque)
+{
+    GAState *s = opaque;
+
+    s->trim_idle = 0;
+    malloc_trim(0);
+    return G_SOURCE_REMOVE;
+}
+#endif
+
+static gboolean ga_buffer_pool_cb(gpointer opaque)
+{
+    GAState *s = opaque;
+
+    if (qemu_buffer_pool_trim(QGA_BUFFER_POOL_IDLE * G_USEC_PER_SEC)) {
+        return G_SOURCE_CONTINUE;
+    }
+    s->buffer_pool_timer = 0;
+#ifdef CONFIG_MALLOC_TRIM
+    malloc_trim(0);
+#endif
+    return G_SOURCE_REMOVE;
+}
+
+/*
+ * A message of @len bytes went through; if it was a large one, hand the
+ * memory it took back to the system once the main loop is idle and the
+ * message is freed, instead of leaving it in the malloc arenas.  Large
+ * buffers that the message, or the request before it, left in the buffer
+ * pool for the next one go back once they have not been used for
+ * QGA_BUFFER_POOL_IDLE seconds.
+ */
+static void ga_trim(GAState *s, size_t len)
+{
+    if (!s->buffer_pool_timer && qemu_buffer_pool_idle()) {
+        s->buffer_pool_timer = g_timeout_add_seconds(QGA_BUFFER_POOL_IDLE,
+                                                     ga_buffer_pool_cb, s);
+    }
+#ifdef CONFIG_MALLOC_TRIM
+    if (len >= QGA_TRIM_THRESHOLD && !s->trim_idle) {
+        s->trim_idle = g_idle_add(ga_trim_cb, s);
+    }
+#endif
+}
+
+/*
+ * The payload is serialized once; the sentinel, newline, frame header and
+ * attachment go out next to it in the same writev() rather than being
+ * copied into a second string.
+ */
+static int send_payload(GAChannelClient *client, QObject *payload,
+                        bool delimit, bool framed,
+                        const void *attachment, size_t attachment_len,
+                        GASendTimes *times)
 {
-    const char *buf;
-    QString *payload_qstr, *response_qstr;
+    static char sentinel = QGA_SENTINEL_BYTE, newline = '\n';
+    guint8 hdr[QGA_FRAME_HEADER_SIZE];
+    struct iovec iov[3];
+    unsigned int iov_cnt = 0;
+    QString *payload_qstr;
     GIOStatus status;
+    int64_t start = g_get_monotonic_time(), written;
+    size_t len;
 
-    g_assert(payload && s->channel);
+    g_assert(payload && client);
 
     payload_qstr = qobject_to_json(payload);
     if (!payload_qstr) {
         return -EINVAL;
     }
+    len = qstring_get_length(payload_qstr);
+    written = g_get_monotonic_time();
+    if (ga_state->capture) {
+        GASession *session = ga_channel_client_get_data(client);
 
-    if (s->delimit_response) {
-        s->delimit_response = false;
-        response_qstr = qstring_new();
-        qstring_append_chr(response_qstr, QGA_SENTINEL_BYTE);
-        qstring_append(response_qstr, qstring_get_str(payload_qstr));
-        QDECREF(payload_qstr);
-    } else {
-        response_qstr = payload_qstr;
+        ga_capture_write(ga_state->capture, session ? session->serial : 0,
+                         false, qstring_get_str(payload_qstr), 0);
+    }
+
+    if (framed) {
+        stl_be_p(hdr, len);
+        stl_be_p(hdr + 4, attachment_len);
+        iov[iov_cnt++] = (struct iovec) { hdr, sizeof(hdr) };
+    } else if (delimit) {
+        iov[iov_cnt++] = (struct iovec) { &sentinel, 1 };
+    }
+    iov[iov_cnt++] = (struct iovec) {
+        (void *)qstring_get_str(payload_qstr), len
+    };
+    if (!framed) {
+        iov[iov_cnt++] = (struct iovec) { &newline, 1 };
+    } else if (attachment_len) {
+        iov[iov_cnt++] = (struct iovec) { (void *)attachment, attachment_len };
     }
 
-    qstring_append_chr(response_qstr, '\n');
-    buf = qstring_get_str(response_qstr);
-    status = ga_channel_write_all(s->channel, buf, strlen(buf));
-    QDECREF(response_qstr);
+    status = ga_channel_writev_all(client, iov, iov_cnt);
+    QDECREF(payload_qstr);
+    if (times) {
+        times->serialize_us = written - start;
+        times->write_us = g_get_monotonic_time() - written;
+    }
+    trace_qga_response_write(client, iov_size(iov, iov_cnt), written - start,
+                             g_get_monotonic_time() - written, status);
     if (status != G_IO_STATUS_NORMAL) {
         return -EIO;
     }
+    ga_stats_add_bytes(ga_state->stats, 0, iov_size(iov, iov_cnt));
+    ga_trim(ga_state, iov_size(iov, iov_cnt));
 
     return 0;
 }
 
-static void process_command(GAState *s, QDict *req)
+static bool ga_role_channel_set_serial_speed(GARoleChannel *rc, int speed,
+                                             bool flow_control)
 {
-    QObject *rsp = NULL;
     int ret;
 
-    g_assert(req);
-    g_debug("processing command");
-    rsp = qmp_dispatch(QOBJECT(req));
-    if (rsp) {
-        ret = send_response(s, rsp);
-        if (ret) {
-            g_warning("error sending response: %s", strerror(ret));
-        }
-        qobject_decref(rsp);
+    ret = ga_channel_set_serial_speed(rc->channel, speed, flow_control);
+    if (ret < 0) {
+        g_warning("failed to switch the %s channel to %d bits/s: %s",
+                  ga_channel_role_names[rc->role], speed, strerror(-ret));
+        return false;
     }
+    rc->serial_speed = speed;
+    rc->serial_flow_control = flow_control;
+    g_debug("%s channel switched to %d bits/s%s",
+            ga_channel_role_names[rc->role], speed,
+            flow_control ? " with RTS/CTS" : "");
+    return true;
 }
 
-/* handle requests/control events coming in over the channel */
-static void process_event(JSONMessageParser *parser, QList *tokens)
+static int send_response(GASession *session, QObject *payload)
 {
-    GAState *s = container_of(parser, GAState, parser);
-    QObject *obj;
-    QDict *qdict;
-    Error *err = NULL;
+    bool delimit = session->delimit_response;
+    int ret;
+
+    session->delimit_response = false;
+    ret = send_payload(session->client, payload, delimit, session->framed,
+                       session->response_attachment,
+                       session->response_attachment_len,
+                       &session->send_times);
+    ga_free_response_attachment(session);
+
+    if (session->framing_changed) {
+        session->framing_changed = false;
+        session->framed = !session->framed;
+        g_debug("client switched to %s framing",
+                session->framed ? "length-prefixed" : "json");
+    }
+    if (session->serial_speed_changed) {
+        ga_role_channel_set_serial_speed(session->channel,
+                                         session->serial_speed_changed,
+                                         session->serial_flow_control_changed);
+        session->serial_speed_changed = 0;
+    }
+    return ret;
+}
+
+static void send_event_client(gpointer data, gpointer opaque)
+{
+    GASession *session = ga_channel_client_get_data(data);
+    int ret;
+
+    ret = send_payload(data, opaque, false, session && session->framed,
+                       NULL, 0, NULL);
+    if (ret < 0) {
+        g_debug("error sending event: %s", strerror(-ret));
+    }
+}
+
+/*
+ * qapi_event_send_*() go to every connected client of the telemetry
+ * channel, or of the control channel without one, between responses
+ */
+static void send_event(unsigned event, QDict *qdict, Error **errp)
+{
+    GAChannel *c = ga_state->channels[GA_CHANNEL_ROLE_TELEMETRY].channel;
+
+    ga_channel_foreach_client(c ?: ga_state->channel, send_event_client,
+                              QOBJECT(qdict));
+}
+
+/* count the response to a request for @command, a registered command or
+ * NULL, that send_response() just sent
+ */
+static void ga_stats_response(GASession *session, const char *command,
+                              QObject *rsp)
+{
+    GAStats *st = ga_state->stats;
+
+    ga_stats_add_request(st, command,
+                         rsp && qdict_haskey(qobject_to_qdict(rsp), "error"));
+    if (rsp) {
+        ga_stats_add_time(st, command, GA_STATS_SERIALIZE,
+                          session->send_times.serialize_us);
+        ga_stats_add_time(st, command, GA_STATS_WRITE,
+                          session->send_times.write_us);
+    }
+}
+
+/*
+ * Limits on what clients may ask for.  --rate-limit gives each client a
+ * bucket of requests that refills at so many per second, and the
+ * [ratelimit] group of the config does the same for single commands,
+ * whoever asks.  A request that finds its bucket empty fails and says
+ * when to try again.
+ *
+ * --cpu-budget caps the share of a CPU that the agent, its worker
+ * threads and the programs it ran use on average, allowing for
+ * QGA_CPU_BUDGET_WINDOW seconds of it at once.  Past the budget, the
+ * commands of the [ratelimit] group are answered with what they returned
+ * last time for the same arguments, or fail if there is nothing to give.
+ *
+ * Control commands are never limited, so that a client can always
+ * resynchronize.
+ */
+
+static GARateLimit *ga_ratelimit_new(double rate, double burst)
+{
+    GARateLimit *rl = g_new0(GARateLimit, 1);
+
+    rl->bucket.avg = MAX(rate, 0);
+    rl->bucket.max = burst > 0 ? burst : MAX(rate, 1);
+    return rl;
+}
+
+static void ga_ratelimit_free(gpointer data)
+{
+    GARateLimit *rl = data;
+
+    qobject_decref(rl->cached);
+    g_free(rl->cached_args);
+    g_free(rl);
+}
+
+/* the CPU time of the agent and of the children it waited for */
+static int64_t ga_cpu_time_us(void)
+{
+#ifndef _WIN32
+    struct rusage self, children;
+
+    getrusage(RUSAGE_SELF, &self);
+    getrusage(RUSAGE_CHILDREN, &children);
+    return (self.ru_utime.tv_sec + self.ru_stime.tv_sec +
+            children.ru_utime.tv_sec + children.ru_stime.tv_sec) * 1000000LL +
+           self.ru_utime.tv_usec + self.ru_stime.tv_usec +
+           children.ru_utime.tv_usec + children.ru_stime.tv_usec;
+#else
+    FILETIME creation, exited, kernel, user;
+    ULARGE_INTEGER k, u;
+
+    if (!GetProcessTimes(GetCurrentProcess(), &creation, &exited, &kernel,
+                         &user)) {
+        return 0;
+    }
+    k.LowPart = kernel.dwLowDateTime;
+    k.HighPart = kernel.dwHighDateTime;
+    u.LowPart = user.dwLowDateTime;
+    u.HighPart = user.dwHighDateTime;
+    /* in units of 100 ns */
+    return (k.QuadPart + u.QuadPart) / 10;
+#endif
+}
+
+/* let @bkt leak what it has since *@leak_ns */
+static void ga_bucket_leak(LeakyBucket *bkt, int64_t *leak_ns)
+{
+    int64_t now = g_get_monotonic_time() * SCALE_US;
+
+    if (now > *leak_ns) {
+        throttle_leak_bucket(bkt, now - *leak_ns);
+    }
+    *leak_ns = now;
+}
+
+/* take a request out of @bkt; if there is none left, returns the ns
+ * until there is, and 0 otherwise
+ */
+static int64_t ga_bucket_take(LeakyBucket *bkt, int64_t *leak_ns)
+{
+    int64_t wait;
+
+    if (!bkt->avg) {
+        return 0;
+    }
+    ga_bucket_leak(bkt, leak_ns);
+    bkt->level += 1;
+    wait = throttle_compute_wait(bkt);
+    if (wait) {
+        bkt->level -= 1;
+    }
+    return wait;
+}
+
+static bool ga_cpu_over_budget(GAState *s)
+{
+    int64_t used;
+
+    if (!s->cpu_budget.avg) {
+        return false;
+    }
+    used = ga_cpu_time_us();
+    ga_bucket_leak(&s->cpu_budget, &s->cpu_leak_ns);
+    s->cpu_budget.level += used - s->cpu_used_us;
+    s->cpu_used_us = used;
+    return throttle_compute_wait(&s->cpu_budget) > 0;
+}
+
+/* the arguments of @req as JSON, to tell whether a cached result fits */
+static char *ga_request_args(QDict *req)
+{
+    QObject *args = qdict_get(req, "arguments");
+    QString *json;
+    char *str;
+
+    if (!args) {
+        return g_strdup("{}");
+    }
+    json = qobject_to_json(args);
+    str = g_strdup(qstring_get_str(json));
+    QDECREF(json);
+    return str;
+}
+
+/* keep what a command of the [ratelimit] group returned for @req */
+static void ga_ratelimit_cache(GAState *s, const char *command, QDict *req,
+                               QObject *rsp)
+{
+    GARateLimit *rl = command ? g_hash_table_lookup(s->ratelimits, command)
+                              : NULL;
+    QObject *ret;
+
+    if (!rl || !rsp) {
+        return;
+    }
+    ret = qdict_get(qobject_to_qdict(rsp), "return");
+    if (!ret) {
+        return;
+    }
+    qobject_incref(ret);
+    qobject_decref(rl->cached);
+    rl->cached = ret;
+    g_free(rl->cached_args);
+    rl->cached_args = ga_request_args(req);
+}
+
+/* @rsp of a job, for one of its followers */
+static QObject *ga_async_share_response(QObject *rsp)
+{
+    QDict *dict = qobject_to_qdict(rsp), *copy = qdict_new();
+    const QDictEntry *e;
+
+    for (e = qdict_first(dict); e; e = qdict_next(dict, e)) {
+        if (strcmp(qdict_entry_key(e), "id") != 0) {
+            qobject_incref(qdict_entry_value(e));
+            qdict_put_obj(copy, qdict_entry_key(e), qdict_entry_value(e));
+        }
+    }
+    return QOBJECT(copy);
+}
+
+static void ga_async_job_finish(GAState *s, GAAsyncJob *job)
+{
+    const char *command = qmp_command_name(job->cmd);
+    GList *followers = job->followers, *l;
+    GAAsyncJob *follower;
+    int ret;
+
+    /* a request that comes in from now on runs by itself */
+    if (job->key && g_hash_table_lookup(s->async_running, job->key) == job) {
+        g_hash_table_remove(s->async_running, job->key);
+    }
+    for (l = followers; l; l = l->next) {
+        follower = l->data;
+        follower->rsp = job->rsp ? ga_async_share_response(job->rsp) : NULL;
+    }
+    s->async_pending--;
+    if (job->timer) {
+        g_source_remove(job->timer);
+    }
+    if (job->session) {
+        job->session->async_jobs = g_list_remove(job->session->async_jobs,
+                                                 job);
+    }
+    ga_stats_add_time(s->stats, command, GA_STATS_DISPATCH, job->dispatch_us);
+    ga_stats_add_allocs(s->stats, command, &job->allocs);
+    if (!job->answered) {
+        ga_ratelimit_cache(s, command, job->req, job->rsp);
+    }
+    if (job->session && job->rsp && !job->answered) {
+        qdict_put_obj(qobject_to_qdict(job->rsp), "id", job->id);
+        job->id = NULL;
+        ret = send_response(job->session, job->rsp);
+        if (ret < 0) {
+            g_warning("error sending response: %s", strerror(-ret));
+        }
+        ga_stats_response(job->session, command, job->rsp);
+    } else if (job->answered) {
+        /* with the error ga_async_abort() sent */
+        ga_stats_add_request(s->stats, command, true);
+    }
+    qobject_decref(job->rsp);
+    qobject_decref(job->id);
+    QDECREF(job->req);
+    g_free(job->key);
+    g_free(job);
+
+    for (l = followers; l; l = l->next) {
+        follower = l->data;
+        follower->dispatch_us = g_get_monotonic_time() - follower->start;
+        ga_async_job_finish(s, follower);
+    }
+    g_list_free(followers);
+}
+
+/* idle callback, hands the worker's results to their clients */
+static gboolean ga_async_complete(gpointer opaque)
+{
+    GAState *s = opaque;
+    GAAsyncJob *job;
+
+    while ((job = g_async_queue_try_pop(s->async_done))) {
+        ga_async_job_finish(s, job);
+    }
+
+    return false;
+}
+
+static void ga_async_run(gpointer data, gpointer opaque)
+{
+    GAState *s = opaque;
+    GAAsyncJob *job = data;
+
+    /* the pool may end its threads when idle, so only for the job */
+    rcu_register_thread();
+    ga_worker_job = job;
+    job->dispatch_us = -1;
+    if (!atomic_read(&job->cancelled)) {
+        trace_qga_worker_dispatch_begin(job, qmp_command_name(job->cmd));
+        ga_alloc_count_begin(&job->allocs);
+        job->dispatch_us = g_get_monotonic_time();
+        job->rsp = qmp_dispatch_command(job->cmd, QOBJECT(job->req));
+        job->dispatch_us = g_get_monotonic_time() - job->dispatch_us;
+        ga_alloc_count_end();
+        trace_qga_worker_dispatch_end(job, qmp_command_name(job->cmd),
+                                      job->dispatch_us);
+    }
+    ga_worker_job = NULL;
+    rcu_unregister_thread();
+    g_async_queue_push(s->async_done, job);
+    g_idle_add(ga_async_complete, s);
+}
+
+/* wait for the workers to finish everything they were given */
+static void ga_async_drain(GAState *s)
+{
+    while (s->async_pending) {
+        ga_async_job_finish(s, g_async_queue_pop(s->async_done));
+    }
+}
+
+/* whether the request the calling worker thread runs has been given up
+ * on; long commands check this between steps and stop early
+ */
+bool ga_worker_cancelled(void)
+{
+    return ga_worker_job && atomic_read(&ga_worker_job->cancelled);
+}
+
+/* answer @req, which carries @id, with "<command> @what" */
+static void ga_send_abort_error(GASession *session, QDict *req, QObject *id,
+                                const char *what)
+{
+    Error *err = NULL;
+    QDict *rsp;
+    int ret;
+
+    error_setg(&err, "%s %s", qdict_get_str(req, "execute"), what);
+    rsp = qdict_new();
+    qdict_put_obj(rsp, "error", qmp_build_error_object(err));
+    error_free(err);
+    qobject_incref(id);
+    qdict_put_obj(rsp, "id", id);
+    ret = send_response(session, QOBJECT(rsp));
+    if (ret < 0) {
+        g_warning("error sending response: %s", strerror(-ret));
+    }
+    QDECREF(rsp);
+}
+
+/* answer the request of @job with an error right away, and tell the
+ * worker to stop unless others share the job; whatever it still comes up
+ * with is dropped
+ */
+static void ga_async_abort(GAAsyncJob *job, const char *what)
+{
+    /* the followers still want the result */
+    if (!job->followers) {
+        atomic_set(&job->cancelled, 1);
+    }
+    job->answered = true;
+    if (job->session) {
+        ga_send_abort_error(job->session, job->req, job->id, what);
+    }
+}
+
+static gboolean ga_async_timeout(gpointer opaque)
+{
+    GAAsyncJob *job = opaque;
+    char *what;
+
+    job->timer = 0;
+    what = g_strdup_printf("timed out after %" PRId64 " ms", job->timeout_ms);
+    ga_async_abort(job, what);
+    g_free(what);
+    return false;
+}
+
+/* whether the JSON of @id is @want */
+static bool ga_id_equal(QObject *id, QString *want)
+{
+    QString *have = qobject_to_json(id);
+    bool equal = strcmp(qstring_get_str(have), qstring_get_str(want)) == 0;
+
+    QDECREF(have);
+    return equal;
+}
+
+/* cancel the request of the current client that carries @id */
+bool ga_cancel_request(GAState *s, QObject *id)
+{
+    QString *want;
+    GAAsyncJob *job;
+    GAPendingResponse *pending;
+    QDict *req;
+    GList *l;
+    bool found = false;
+
+    if (!s->session) {
+        return false;
+    }
+    want = qobject_to_json(id);
+    /* one that did not even start yet */
+    for (l = s->session->deferred.head; l && !found; l = l->next) {
+        req = l->data;
+        if (ga_id_equal(qdict_get(req, "id"), want)) {
+            ga_send_abort_error(s->session, req, qdict_get(req, "id"),
+                                "was cancelled");
+            g_queue_delete_link(&s->session->deferred, l);
+            QDECREF(req);
+            found = true;
+            break;
+        }
+    }
+    for (l = s->session->async_jobs; l && !found; l = l->next) {
+        job = l->data;
+        if (job->answered) {
+            continue;
+        }
+        if (ga_id_equal(job->id, want)) {
+            ga_async_abort(job, "was cancelled");
+            found = true;
+        }
+    }
+    for (l = s->session->pending; l && !found; l = l->next) {
+        pending = l->data;
+        if (!pending->answered && ga_id_equal(pending->id, want)) {
+            ga_send_abort_error(s->session, pending->req, pending->id,
+                                "was cancelled");
+            pending->answered = true;
+            found = true;
+        }
+    }
+    QDECREF(want);
+
+    return found;
+}
+
+/*
+ * Run @req on a worker.  Hosts often have several clients asking the
+ * same thing at the same time, so a request for a read-only command that
+ * comes in while an identical one runs does not run again: it follows the
+ * job of that one, and gets a copy of its response, with its own id.  A
+ * follower times out and can be cancelled as usual; cancelling the job
+ * it follows only stops the worker if no one else waits for it.
+ */
+static void ga_async_submit(GAState *s, GASession *session, QmpCommand *cmd,
+                            QDict *req, QObject *id, int64_t timeout_ms)
+{
+    GAAsyncJob *job = g_new0(GAAsyncJob, 1), *leader = NULL;
+    char *args;
+
+    if (!s->async_pool) {
+        s->async_done = g_async_queue_new();
+        s->async_pool = g_thread_pool_new(ga_async_run, s, GA_WORKER_THREADS,
+                                          false, NULL);
+        s->async_running = g_hash_table_new(g_str_hash, g_str_equal);
+    }
+    if (qmp_command_is_read_only(cmd)) {
+        args = ga_request_args(req);
+        job->key = g_strdup_printf("%s %s", qmp_command_name(cmd), args);
+        g_free(args);
+        leader = g_hash_table_lookup(s->async_running, job->key);
+        if (leader && atomic_read(&leader->cancelled)) {
+            leader = NULL;
+        }
+    }
+
+    QINCREF(req);
+    job->session = session;
+    job->cmd = cmd;
+    job->req = req;
+    job->id = id;
+    if (timeout_ms > 0) {
+        job->timeout_ms = timeout_ms;
+        job->timer = g_timeout_add(MIN(timeout_ms, G_MAXUINT),
+                                   ga_async_timeout, job);
+    }
+    session->async_jobs = g_list_prepend(session->async_jobs, job);
+    s->async_pending++;
+    if (leader) {
+        trace_qga_worker_dispatch_shared(job, qmp_command_name(cmd), leader);
+        g_free(job->key);
+        job->key = NULL;
+        job->start = g_get_monotonic_time();
+        leader->followers = g_list_append(leader->followers, job);
+        return;
+    }
+    if (job->key) {
+        /* over one that was cancelled */
+        g_hash_table_replace(s->async_running, job->key, job);
+    }
+    g_thread_pool_push(s->async_pool, job, NULL);
+}
+
+static void ga_async_stop(GAState *s)
+{
+    if (!s->async_pool) {
+        return;
+    }
+    ga_async_drain(s);
+    g_thread_pool_free(s->async_pool, false, true);
+    g_async_queue_unref(s->async_done);
+    g_hash_table_destroy(s->async_running);
+}
+
+/* requests that carry an id may be answered out of order, so those for
+ * commands that can block for long go to a worker while the main loop
+ * goes on with the next request
+ */
+static bool ga_command_runs_on_worker(QmpCommand *cmd)
+{
+    return cmd && qmp_command_is_enabled(cmd) &&
+           qmp_command_runs_on_worker(cmd);
+}
+
+/* commands that get ahead of bulk requests: they are what the host uses
+ * to freeze and thaw for a backup, to check on or stop the agent, and to
+ * keep file streams going
+ */
+static bool ga_command_is_control(const char *name)
+{
+    return ga_is_whitelisted(name) ||
+           g_str_has_prefix(name, "guest-fsfreeze-") ||
+           g_str_has_prefix(name, "guest-file-stream-") ||
+           strcmp(name, "guest-shutdown") == 0;
+}
+
+/* a request that carries an id may be answered out of order, so one for
+ * a bulk command that would hold up the main loop can wait in the
+ * session's queue, and control commands read in the meantime overtake it
+ */
+static bool ga_request_can_wait(GASession *session, QDict *req)
+{
+    const char *command = qdict_get_try_str(req, "execute");
+    QmpCommand *cmd;
+
+    if (!qdict_haskey(req, "id") || !command || session->attachment) {
+        return false;
+    }
+    cmd = qmp_find_command(command);
+    return cmd && !ga_command_runs_on_worker(cmd) &&
+           !ga_command_is_control(command);
+}
+
+/* an error if @command may not run on the channel of @session, or NULL */
+static QObject *ga_role_check(GASession *session, const char *command)
+{
+    Error *err = NULL;
+    QDict *rsp;
+
+    if (session->channel->role == GA_CHANNEL_ROLE_CONTROL ||
+        !(g_str_has_prefix(command, "guest-fsfreeze-") ||
+          g_str_has_prefix(command, "guest-suspend-") ||
+          strcmp(command, "guest-shutdown") == 0 ||
+          strcmp(command, "guest-upgrade-agent") == 0)) {
+        return NULL;
+    }
+    error_setg(&err, "%s is only available on the control channel",
+               command);
+    rsp = qdict_new();
+    qdict_put_obj(rsp, "error", qmp_build_error_object(err));
+    error_free(err);
+    return QOBJECT(rsp);
+}
+
+/* the answer to @req for @command if a limit stands in its way, or NULL */
+static QObject *ga_ratelimit_check(GAState *s, GASession *session,
+                                   const char *command, QDict *req)
+{
+    GARateLimit *rl = g_hash_table_lookup(s->ratelimits, command);
+    Error *err = NULL;
+    QDict *rsp;
+    char *args;
+    int64_t wait;
+
+    if (ga_command_is_control(command)) {
+        return NULL;
+    }
+    wait = ga_bucket_take(&session->rate, &session->rate_leak_ns);
+    if (!wait && rl) {
+        wait = ga_bucket_take(&rl->bucket, &rl->leak_ns);
+    }
+    rsp = qdict_new();
+    if (wait) {
+        error_setg(&err, "%s is rate limited, retry in %" PRId64 " ms",
+                   command, DIV_ROUND_UP(wait, SCALE_MS));
+    } else if (rl && ga_cpu_over_budget(s)) {
+        args = ga_request_args(req);
+        if (rl->cached && strcmp(args, rl->cached_args) == 0) {
+            g_debug("over CPU budget, repeating the last result of %s",
+                    command);
+            qobject_incref(rl->cached);
+            qdict_put_obj(rsp, "return", rl->cached);
+        } else {
+            error_setg(&err, "%s is not available, the agent is over its "
+                       "CPU budget", command);
+        }
+        g_free(args);
+    } else {
+        QDECREF(rsp);
+        return NULL;
+    }
+    if (err) {
+        qdict_put_obj(rsp, "error", qmp_build_error_object(err));
+        error_free(err);
+    }
+    return QOBJECT(rsp);
+}
+
+static void process_command(GASession *session, QDict *req)
+{
+    QObject *rsp = NULL, *id;
+    QmpCommand *cmd = NULL;
+    const char *command;
+    int64_t timeout_ms = 0, dispatch_us;
+    GAAllocCount allocs;
+    int ret;
+
+    g_assert(req);
+    g_debug("processing command");
+
+    /* like QMP, echo an id given with the request in its response */
+    id = qdict_get(req, "id");
+    if (id) {
+        qobject_incref(id);
+        qdict_del(req, "id");
+    }
+    /* look the command up once, dispatch reuses it */
+    command = qdict_get_try_str(req, "execute");
+    if (command) {
+        cmd = qmp_find_command(command);
+    }
+    if (cmd && ga_state->timeouts) {
+        timeout_ms = GPOINTER_TO_INT(g_hash_table_lookup(ga_state->timeouts,
+                                                         command));
+    }
+    /* a deadline of the request's own beats the configured one */
+    if (qdict_haskey(req, "timeout")) {
+        timeout_ms = qdict_get_try_int(req, "timeout", 0);
+        qdict_del(req, "timeout");
+    }
+    ga_check_resume(ga_state);
+    rsp = cmd ? ga_role_check(session, command) : NULL;
+    if (!rsp && cmd) {
+        rsp = ga_ratelimit_check(ga_state, session, command, req);
+    }
+    if (rsp) {
+        goto respond;
+    }
+    if (id && ga_command_runs_on_worker(cmd)) {
+        ga_async_submit(ga_state, session, cmd, req, id, timeout_ms);
+        return;
+    }
+    /* nothing may be left running in the background once frozen */
+    if (cmd && strcmp(command, "guest-fsfreeze-freeze") == 0) {
+        ga_async_drain(ga_state);
+    }
+
+    ga_state->request = req;
+    ga_state->request_id = id;
+    trace_qga_dispatch_begin(session, command ?: "");
+    ga_watchdog_set_activity(ga_state->watchdog,
+                             cmd ? qmp_command_name(cmd) : NULL);
+    ga_alloc_count_begin(&allocs);
+    dispatch_us = g_get_monotonic_time();
+    rsp = qmp_dispatch_command(cmd, QOBJECT(req));
+    dispatch_us = g_get_monotonic_time() - dispatch_us;
+    ga_alloc_count_end();
+    ga_watchdog_set_activity(ga_state->watchdog, NULL);
+    trace_qga_dispatch_end(session, command ?: "", dispatch_us);
+    ga_stats_add_time(ga_state->stats, cmd ? command : NULL,
+                      GA_STATS_DISPATCH, dispatch_us);
+    ga_stats_add_allocs(ga_state->stats, cmd ? command : NULL, &allocs);
+    ga_state->request = NULL;
+    ga_state->request_id = NULL;
+    if (ga_state->response_deferred) {
+        /* the command answers later, see ga_defer_response() */
+        ga_state->response_deferred = false;
+        qobject_decref(rsp);
+        qobject_decref(id);
+        return;
+    }
+    ga_ratelimit_cache(ga_state, cmd ? command : NULL, req, rsp);
+
+respond:
+    if (rsp) {
+        if (id) {
+            qdict_put_obj(qobject_to_qdict(rsp), "id", id);
+            id = NULL;
+        }
+        ret = send_response(session, rsp);
+        if (ret) {
+            g_warning("error sending response: %s", strerror(ret));
+        }
+    }
+    ga_stats_response(session, cmd ? command : NULL, rsp);
+    qobject_decref(rsp);
+    qobject_decref(id);
+}
+
+/*
+ * Idle callback running the queued bulk requests of a session, one per
+ * main loop iteration so that requests read meanwhile get a look in
+ * first.  Nothing runs while filesystems are frozen.
+ */
+static gboolean ga_session_run_deferred(gpointer opaque)
+{
+    GASession *session = opaque;
+    QDict *req;
+
+    /* guest-cancel may have emptied the queue */
+    req = ga_is_frozen(ga_state) ? NULL : g_queue_pop_head(&session->deferred);
+    if (req) {
+        ga_state->session = session;
+        process_command(session, req);
+        ga_state->session = NULL;
+        QDECREF(req);
+    }
+
+    if (ga_is_frozen(ga_state) || g_queue_is_empty(&session->deferred)) {
+        session->deferred_idle = 0;
+        return false;
+    }
+    return true;
+}
+
+static void ga_session_schedule(GASession *session)
+{
+    if (!session->deferred_idle && !g_queue_is_empty(&session->deferred) &&
+        !ga_is_frozen(ga_state)) {
+        session->deferred_idle = g_idle_add(ga_session_run_deferred, session);
+    }
+}
+
+static void ga_session_resume(gpointer data, gpointer opaque)
+{
+    GASession *session = ga_channel_client_get_data(data);
+
+    if (session) {
+        ga_session_schedule(session);
+    }
+}
+
+static gboolean ga_stream_run(gpointer opaque)
+{
+    GAStream *stream = opaque;
+    GASession *session = stream->session;
+    void *attachment = NULL;
+    size_t len = 0;
+    bool last = true;
+    QDict *msg;
+    int ret;
+
+    /* attachments cannot go out once the client dropped back to json */
+    if (session->framed) {
+        ga_state->session = session;
+        msg = stream->next(stream->opaque, &attachment, &len, &last);
+        ga_state->session = NULL;
+        ret = send_payload(session->client, QOBJECT(msg), false, true,
+                           attachment, len, NULL);
+        if (ret < 0) {
+            g_debug("error sending stream: %s", strerror(-ret));
+            last = true;
+        }
+        QDECREF(msg);
+        g_free(attachment);
+    }
+
+    if (last) {
+        stream->idle = 0;
+        ga_stream_free(stream);
+        return false;
+    }
+    if (!--stream->credits) {
+        stream->idle = 0;
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Start sending messages to the client of the current request, which must
+ * be framed, after the response.  @next produces them one at a time, with
+ * an attachment it hands over, and says which is the last; up to @credits
+ * go out before the client grants more with ga_stream_add_credits().
+ * Requests of the client are processed in between.  @destroy is called on
+ * @opaque when the stream ends, by itself, with ga_stream_free() or when
+ * the client goes away.
+ */
+GAStream *ga_stream_new(GAState *s, int64_t credits, GAStreamFunc next,
+                        void *opaque, GDestroyNotify destroy)
+{
+    GAStream *stream = g_new0(GAStream, 1);
+
+    g_assert(ga_is_framed(s));
+    stream->session = s->session;
+    stream->next = next;
+    stream->opaque = opaque;
+    stream->destroy = destroy;
+    s->session->streams = g_list_prepend(s->session->streams, stream);
+    ga_stream_add_credits(stream, credits);
+    return stream;
+}
+
+void ga_stream_add_credits(GAStream *stream, int64_t credits)
+{
+    stream->credits += credits;
+    if (stream->credits > 0 && !stream->idle) {
+        stream->idle = g_idle_add(ga_stream_run, stream);
+    }
+}
+
+void ga_stream_free(GAStream *stream)
+{
+    GASession *session = stream->session;
+
+    if (stream->idle) {
+        g_source_remove(stream->idle);
+    }
+    session->streams = g_list_remove(session->streams, stream);
+    if (stream->destroy) {
+        stream->destroy(stream->opaque);
+    }
+    g_free(stream);
+}
+
+/* handle a request/control event, @obj is NULL if it could not be parsed */
+static void process_request(GASession *session, QObject *obj, Error *err)
+{
+    GAState *s = ga_state;
+    QDict *qdict;
+    const char *command;
+    bool frozen;
     int ret;
 
-    g_assert(s && parser);
-
-    g_debug("process_event: called");
-    obj = json_parser_parse_err(tokens, NULL, &err);
     if (err || !obj || qobject_type(obj) != QTYPE_QDICT) {
+        trace_qga_request_invalid(session);
+        ga_stats_add_parse_error(s->stats);
         qobject_decref(obj);
         qdict = qdict_new();
         if (!err) {
@@ -595,102 +2180,872 @@ static void process_event(JSONMessageParser *parser, QList *tokens)
         } else {
             g_warning("failed to parse event: %s", error_get_pretty(err));
         }
-        qdict_put_obj(qdict, "error", qmp_build_error_object(err));
-        error_free(err);
+        qdict_put_obj(qdict, "error", qmp_build_error_object(err));
+        error_free(err);
+    } else {
+        qdict = qobject_to_qdict(obj);
+        if (s->capture) {
+            QString *json = qobject_to_json(obj);
+
+            ga_capture_write(s->capture, session->serial, true,
+                             qstring_get_str(json), session->attachment_len);
+            QDECREF(json);
+        }
+    }
+
+    g_assert(qdict);
+
+    /* handle host->guest commands */
+    if (qdict_haskey(qdict, "execute")) {
+        command = qdict_get_try_str(qdict, "execute");
+        trace_qga_request_parsed(session, command ?: "", session->parse_us);
+        if (command && qmp_find_command(command)) {
+            ga_stats_add_time(s->stats, command, GA_STATS_PARSE,
+                              session->parse_us);
+        }
+        if (ga_request_can_wait(session, qdict)) {
+            g_queue_push_tail(&session->deferred, qdict);
+            ga_session_schedule(session);
+            return;
+        }
+        frozen = ga_is_frozen(s);
+        s->session = session;
+        process_command(session, qdict);
+        s->session = NULL;
+        if (frozen && !ga_is_frozen(s)) {
+            /* what was held back during the freeze can go now */
+            ga_foreach_client(s, ga_session_resume, NULL);
+        }
+    } else {
+        if (!qdict_haskey(qdict, "error")) {
+            QDECREF(qdict);
+            qdict = qdict_new();
+            g_warning("unrecognized payload format");
+            error_setg(&err, QERR_UNSUPPORTED);
+            qdict_put_obj(qdict, "error", qmp_build_error_object(err));
+            error_free(err);
+        }
+        ret = send_response(session, QOBJECT(qdict));
+        if (ret < 0) {
+            g_warning("error sending error response: %s", strerror(-ret));
+        }
+    }
+
+    QDECREF(qdict);
+}
+
+/* handle requests/control events coming in over the channel */
+static void process_event(JSONMessageParser *parser, GQueue *tokens)
+{
+    GASession *session = container_of(parser, GASession, parser);
+    QObject *obj;
+    Error *err = NULL;
+
+    g_assert(session && parser);
+
+    g_debug("process_event: called");
+    session->parse_us = g_get_monotonic_time();
+    obj = json_parser_parse_err(tokens, NULL, &err);
+    session->parse_us = g_get_monotonic_time() - session->parse_us;
+    process_request(session, obj, err);
+}
+
+/*
+ * Process the complete frames buffered for @session.  A bad header drops
+ * the session back to plain JSON, which the host resynchronizes with
+ * guest-sync-delimited as usual.
+ */
+static void process_frames(GASession *session)
+{
+    GByteArray *frame = session->frame;
+    uint32_t json_len, attachment_len;
+    size_t len, largest = 0;
+    QObject *obj;
+    char *json;
+
+    while (session->framed && frame->len >= QGA_FRAME_HEADER_SIZE) {
+        json_len = ldl_be_p(frame->data);
+        attachment_len = ldl_be_p(frame->data + 4);
+        if (!json_len || json_len > QGA_FRAME_JSON_MAX ||
+            attachment_len > QGA_FRAME_ATTACHMENT_MAX) {
+            /* most likely a client that never switched, let the json
+             * parser have a go at what it sent
+             */
+            g_warning("invalid frame header, falling back to json framing");
+            session->framed = false;
+            break;
+        }
+        len = QGA_FRAME_HEADER_SIZE + json_len + attachment_len;
+        if (frame->len < len) {
+            break;
+        }
+
+        json = g_strndup((char *)frame->data + QGA_FRAME_HEADER_SIZE,
+                         json_len);
+        session->attachment = frame->data + QGA_FRAME_HEADER_SIZE + json_len;
+        session->attachment_len = attachment_len;
+        session->parse_us = g_get_monotonic_time();
+        obj = qobject_from_json(json);
+        session->parse_us = g_get_monotonic_time() - session->parse_us;
+        process_request(session, obj, NULL);
+        session->attachment = NULL;
+        session->attachment_len = 0;
+        g_free(json);
+        g_byte_array_remove_range(frame, 0, len);
+        largest = MAX(largest, len);
+    }
+
+    if (!session->framed) {
+        /* start over with whatever followed the last frame */
+        json_message_parser_destroy(&session->parser);
+        json_message_parser_init(&session->parser, process_event);
+        if (frame->len) {
+            json_message_parser_feed(&session->parser, (char *)frame->data,
+                                     frame->len);
+            g_byte_array_set_size(frame, 0);
+        }
+    }
+
+    if (!frame->len && largest >= QGA_TRIM_THRESHOLD) {
+        /* don't keep the room a large frame needed */
+        g_byte_array_free(frame, true);
+        session->frame = g_byte_array_new();
+        ga_trim(ga_state, largest);
+    }
+}
+
+static void ga_session_free(gpointer data)
+{
+    GASession *session = data;
+    QDict *req;
+    GList *l;
+
+    /* whatever is still running for the client is dropped on completion */
+    for (l = session->async_jobs; l; l = l->next) {
+        ((GAAsyncJob *)l->data)->session = NULL;
+    }
+    g_list_free(session->async_jobs);
+    for (l = session->pending; l; l = l->next) {
+        ((GAPendingResponse *)l->data)->session = NULL;
+    }
+    g_list_free(session->pending);
+    if (session->deferred_idle) {
+        g_source_remove(session->deferred_idle);
+    }
+    while ((req = g_queue_pop_head(&session->deferred))) {
+        QDECREF(req);
+    }
+    while (session->streams) {
+        ga_stream_free(session->streams->data);
+    }
+    notifier_list_notify(&ga_state->session_close_notifiers, session);
+
+    json_message_parser_destroy(&session->parser);
+    g_byte_array_free(session->frame, true);
+    ga_free_response_attachment(session);
+    g_free(session);
+}
+
+static GASession *ga_session_new(GARoleChannel *rc, GAChannelClient *client)
+{
+    GAState *s = rc->state;
+    GASession *session = g_new0(GASession, 1);
+
+    session->client = client;
+    session->channel = rc;
+    session->frame = g_byte_array_new();
+    session->rate.avg = s->rate_limit;
+    session->rate.max = s->rate_limit_burst;
+    session->serial = ++s->sessions;
+    g_queue_init(&session->deferred);
+    json_message_parser_init(&session->parser, process_event);
+    ga_channel_client_set_data(client, session, ga_session_free);
+    return session;
+}
+
+/*
+ * Hosts send guest-sync before each command and guest-ping to see that
+ * the agent is alive, far more often than anything else and always in
+ * the same few bytes.  When one comes in a read of its own, in one of
+ * the forms below and with nothing else for the parser pending, it is
+ * answered from here, without the JSON parser, QObjects or dispatch:
+ *
+ *   {"execute": "guest-ping"}
+ *   {"execute": "guest-sync", "arguments": {"id": N}}
+ *   {"execute": "guest-sync-delimited", "arguments": {"id": N}}
+ *
+ * with any whitespace between the tokens.  Anything else, an "id" of the
+ * request or another argument included, goes the usual way, as do all
+ * requests while the traffic is captured.
+ */
+static void ga_fast_skip(const char **p, const char *end)
+{
+    while (*p < end && (**p == ' ' || **p == '\t' || **p == '\n' ||
+                        **p == '\r')) {
+        (*p)++;
+    }
+}
+
+static bool ga_fast_match(const char **p, const char *end, const char *token)
+{
+    size_t len = strlen(token);
+
+    ga_fast_skip(p, end);
+    if ((size_t)(end - *p) < len || memcmp(*p, token, len)) {
+        return false;
+    }
+    *p += len;
+    return true;
+}
+
+/* an integer that surely fits, as JSON writes it */
+static bool ga_fast_int(const char **p, const char *end, int64_t *value)
+{
+    const char *start, *s;
+    int64_t v = 0;
+    bool neg;
+
+    ga_fast_skip(p, end);
+    s = *p;
+    neg = s < end && *s == '-';
+    start = s += neg;
+    while (s < end && *s >= '0' && *s <= '9') {
+        if (s - start == 18) {
+            return false;
+        }
+        v = v * 10 + *s++ - '0';
+    }
+    if (s == start || (*start == '0' && s - start > 1)) {
+        return false;
+    }
+    *value = neg ? -v : v;
+    *p = s;
+    return true;
+}
+
+/* answer @buf if it is one of the requests above, false if it is not */
+static bool ga_fast_request(GASession *session, const char *buf, size_t len)
+{
+    const char *p = buf, *end = buf + len, *command;
+    char rsp[48];
+    struct iovec iov;
+    GIOStatus status;
+    QmpCommand *cmd;
+    int64_t id = 0, start;
+    bool delimit = false;
+    int n;
+
+    if (ga_state->capture || !g_queue_is_empty(session->parser.tokens) ||
+        qstring_get_length(session->parser.lexer.token) ||
+        !ga_fast_match(&p, end, "{") ||
+        !ga_fast_match(&p, end, "\"execute\"") ||
+        !ga_fast_match(&p, end, ":")) {
+        return false;
+    }
+    if (ga_fast_match(&p, end, "\"guest-ping\"")) {
+        command = "guest-ping";
+    } else if (ga_fast_match(&p, end, "\"guest-sync\"")) {
+        command = "guest-sync";
+    } else if (ga_fast_match(&p, end, "\"guest-sync-delimited\"")) {
+        command = "guest-sync-delimited";
+        delimit = true;
     } else {
-        qdict = qobject_to_qdict(obj);
+        return false;
+    }
+    if (strcmp(command, "guest-ping") != 0 &&
+        !(ga_fast_match(&p, end, ",") &&
+          ga_fast_match(&p, end, "\"arguments\"") &&
+          ga_fast_match(&p, end, ":") && ga_fast_match(&p, end, "{") &&
+          ga_fast_match(&p, end, "\"id\"") && ga_fast_match(&p, end, ":") &&
+          ga_fast_int(&p, end, &id) && ga_fast_match(&p, end, "}"))) {
+        return false;
+    }
+    if (!ga_fast_match(&p, end, "}")) {
+        return false;
+    }
+    ga_fast_skip(&p, end);
+    cmd = qmp_find_command(command);
+    if (p != end || !cmd || !qmp_command_is_enabled(cmd)) {
+        return false;
     }
 
-    g_assert(qdict);
+    trace_qga_request_fast(session, command);
+    ga_check_resume(ga_state);
+    rsp[0] = QGA_SENTINEL_BYTE;
+    if (strcmp(command, "guest-ping") == 0) {
+        slog("guest-ping called");
+        n = snprintf(rsp + 1, sizeof(rsp) - 1, "{\"return\": {}}\n");
+    } else {
+        n = snprintf(rsp + 1, sizeof(rsp) - 1, "{\"return\": %" PRId64 "}\n",
+                     id);
+    }
+    iov.iov_base = delimit ? rsp : rsp + 1;
+    iov.iov_len = n + delimit;
+    start = g_get_monotonic_time();
+    status = ga_channel_writev_all(session->client, &iov, 1);
+    trace_qga_response_write(session->client, iov.iov_len, 0,
+                             g_get_monotonic_time() - start, status);
+    if (status == G_IO_STATUS_NORMAL) {
+        ga_stats_add_bytes(ga_state->stats, 0, iov.iov_len);
+    } else {
+        g_warning("error sending response: %s", strerror(EIO));
+    }
+    ga_stats_add_request(ga_state->stats, command, false);
+    return true;
+}
 
-    /* handle host->guest commands */
-    if (qdict_haskey(qdict, "execute")) {
-        process_command(s, qdict);
+/* false return signals GAChannel to close the current client connection */
+static gboolean channel_event_cb(GAChannelClient *client,
+                                 GIOCondition condition, gpointer data)
+{
+    GARoleChannel *rc = data;
+    GAState *s = rc->state;
+    GASession *session = ga_channel_client_get_data(client);
+    const gchar *buf;
+    gsize count;
+    GError *err = NULL;
+    GIOStatus status;
+
+    if (!session) {
+        session = ga_session_new(rc, client);
+    }
+
+    status = ga_channel_read(client, &buf, &count);
+    if (err != NULL) {
+        g_warning("error reading channel: %s", err->message);
+        g_error_free(err);
+        return false;
+    }
+    switch (status) {
+    case G_IO_STATUS_ERROR:
+        g_warning("error reading channel");
+        return false;
+    case G_IO_STATUS_NORMAL:
+        trace_qga_channel_read(session, count);
+        ga_idle_exit_rearm(s);
+        ga_stats_add_bytes(s->stats, count, 0);
+        /* formatting a large buffer is expensive, skip it unless needed */
+        if (s->log_level & G_LOG_LEVEL_DEBUG) {
+            g_debug("read data, count: %d, data: %.*s", (int)count,
+                    (int)count, buf);
+        }
+        if (session->framed) {
+            g_byte_array_append(session->frame, (const guint8 *)buf, count);
+            process_frames(session);
+        } else if (!ga_fast_request(session, buf, count)) {
+            json_message_parser_feed(&session->parser, buf, count);
+        }
+        break;
+    case G_IO_STATUS_EOF:
+        g_debug("received EOF");
+        if (!rc->virtio) {
+            return false;
+        }
+        /* fall through */
+    case G_IO_STATUS_AGAIN:
+#ifdef _WIN32
+        /* virtio causes us to spin here when no process is attached to
+         * host-side chardev. sleep a bit to mitigate this
+         */
+        if (rc->virtio) {
+            usleep(100*1000);
+        }
+#endif
+        /* on POSIX the channel waits for the host to attach by itself */
+        return true;
+    default:
+        g_warning("unknown channel read status, closing");
+        return false;
+    }
+    return true;
+}
+
+static bool channel_method_parse(GARoleChannel *rc, const gchar *method,
+                                 GAChannelMethod *channel_method)
+{
+    if (strcmp(method, "virtio-serial") == 0) {
+        rc->virtio = true; /* virtio requires special handling in some cases */
+        *channel_method = GA_CHANNEL_VIRTIO_SERIAL;
+    } else if (strcmp(method, "isa-serial") == 0) {
+        rc->serial = true;
+        rc->serial_speed = GA_CHANNEL_SERIAL_SPEED_DEFAULT;
+        *channel_method = GA_CHANNEL_ISA_SERIAL;
+    } else if (strcmp(method, "unix-listen") == 0) {
+        rc->listening = true;
+        *channel_method = GA_CHANNEL_UNIX_LISTEN;
+    } else if (strcmp(method, "vsock-listen") == 0) {
+        rc->listening = true;
+        *channel_method = GA_CHANNEL_VSOCK_LISTEN;
     } else {
-        if (!qdict_haskey(qdict, "error")) {
-            QDECREF(qdict);
-            qdict = qdict_new();
-            g_warning("unrecognized payload format");
-            error_setg(&err, QERR_UNSUPPORTED);
-            qdict_put_obj(qdict, "error", qmp_build_error_object(err));
-            error_free(err);
+        g_critical("unsupported channel method/type: %s", method);
+        return false;
+    }
+    return true;
+}
+
+/* @listen_fd, if not -1, is the channel passed with socket activation */
+static gboolean channel_init(GAState *s, const gchar *method,
+                             const gchar *path, int listen_fd)
+{
+    GARoleChannel *rc = &s->channels[GA_CHANNEL_ROLE_CONTROL];
+    GAChannelMethod channel_method;
+
+    s->method = method;
+    if (!channel_method_parse(rc, method, &channel_method)) {
+        return false;
+    }
+    s->virtio = rc->virtio;
+    s->listening = rc->listening;
+
+#ifndef _WIN32
+    if (s->handoff) {
+        gsize nclients = 0;
+        gint *client_fds = g_key_file_get_integer_list(s->handoff->keyfile,
+                                                       "channel", "clients",
+                                                       &nclients, NULL);
+
+        s->channel = ga_channel_resume(channel_method, listen_fd, client_fds,
+                                       nclients, channel_event_cb, rc);
+        g_free(client_fds);
+        /* the line is left at the speed the agent before switched it to */
+        if (g_key_file_has_key(s->handoff->keyfile, "channel",
+                               "serial-speed", NULL)) {
+            rc->serial_speed = g_key_file_get_integer(s->handoff->keyfile,
+                                                      "channel",
+                                                      "serial-speed", NULL);
+            rc->serial_flow_control =
+                g_key_file_get_boolean(s->handoff->keyfile, "channel",
+                                       "serial-flow-control", NULL);
         }
-        ret = send_response(s, QOBJECT(qdict));
-        if (ret < 0) {
-            g_warning("error sending error response: %s", strerror(-ret));
+    } else
+#endif
+    s->channel = ga_channel_new(channel_method, path, listen_fd,
+                                channel_event_cb, rc);
+    if (!s->channel) {
+        g_critical("failed to create guest agent channel");
+        return false;
+    }
+    rc->channel = s->channel;
+
+    return true;
+}
+
+/* --serial-speed and --serial-flow-control, -1 if they could not be set */
+static int ga_serial_speed_init(GAState *s, int speed, bool flow_control)
+{
+    GARoleChannel *rc = &s->channels[GA_CHANNEL_ROLE_CONTROL];
+
+#ifndef _WIN32
+    if (s->handoff) {
+        return 0;
+    }
+#endif
+    if (!rc->serial ||
+        (speed == GA_CHANNEL_SERIAL_SPEED_DEFAULT && !flow_control)) {
+        return 0;
+    }
+    return ga_role_channel_set_serial_speed(rc, speed, flow_control) ? 0 : -1;
+}
+
+/*
+ * The telemetry and bulk channels.  They are opened anew after
+ * guest-upgrade-agent, their clients reconnect.
+ */
+static gboolean role_channel_init(GAState *s, GAChannelRole role,
+                                  const gchar *method, const gchar *path)
+{
+    GARoleChannel *rc = &s->channels[role];
+    GAChannelMethod channel_method;
+
+    if (!channel_method_parse(rc, method, &channel_method)) {
+        return false;
+    }
+    rc->channel = ga_channel_new(channel_method, path, -1,
+                                 channel_event_cb, rc);
+    if (!rc->channel) {
+        g_critical("failed to create guest agent %s channel",
+                   ga_channel_role_names[role]);
+        return false;
+    }
+    return true;
+}
+
+#ifndef _WIN32
+/*
+ * guest-upgrade-agent: the agent execs the new binary in its own place,
+ * so the process, and with it the children guest-exec started and the
+ * pid file, stays the same.  The channel and its clients, open file
+ * handles and the pipes of guest-exec processes are left open across the
+ * exec, and what the new agent needs to take them over goes to a key
+ * file in the state directory, named in QGA_HANDOFF_ENV.
+ */
+
+int ga_handoff_session_index(GAHandoff *h, GASession *session)
+{
+    guint i;
+
+    for (i = 0; i < h->sessions->len; i++) {
+        if (session && g_ptr_array_index(h->sessions, i) == session) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* NULL if @index is not a client that was handed over */
+GASession *ga_handoff_session(GAHandoff *h, int index)
+{
+    if (index < 0 || index >= h->sessions->len) {
+        return NULL;
+    }
+    return g_ptr_array_index(h->sessions, index);
+}
+
+void ga_handoff_keep_fd(GAHandoff *h, int fd)
+{
+    g_array_append_val(h->fds, fd);
+}
+
+void ga_handoff_set_int64(GAHandoff *h, const char *group, const char *key,
+                          int64_t value)
+{
+    gchar *str = g_strdup_printf("%" PRId64, value);
+
+    g_key_file_set_string(h->keyfile, group, key, str);
+    g_free(str);
+}
+
+/* 0 if @key is not there */
+int64_t ga_handoff_get_int64(GAHandoff *h, const char *group,
+                             const char *key)
+{
+    gchar *str = g_key_file_get_string(h->keyfile, group, key, NULL);
+    int64_t value = str ? g_ascii_strtoll(str, NULL, 10) : 0;
+
+    g_free(str);
+    return value;
+}
+
+void ga_handoff_set_data(GAHandoff *h, const char *group, const char *key,
+                         const void *data, size_t len)
+{
+    gchar *str;
+
+    if (!len) {
+        return;
+    }
+    str = g_base64_encode(data, len);
+    g_key_file_set_string(h->keyfile, group, key, str);
+    g_free(str);
+}
+
+/* what ga_handoff_set_data() stored, NULL if there was nothing */
+guchar *ga_handoff_get_data(GAHandoff *h, const char *group,
+                            const char *key, gsize *len)
+{
+    gchar *str = g_key_file_get_string(h->keyfile, group, key, NULL);
+    guchar *data = NULL;
+
+    *len = 0;
+    if (str) {
+        data = g_base64_decode(str, len);
+        g_free(str);
+    }
+    return data;
+}
+
+const char *ga_get_exe_path(GAState *s)
+{
+    return s->exe_path;
+}
+
+static GAHandoff *ga_handoff_new(void)
+{
+    GAHandoff *h = g_new0(GAHandoff, 1);
+
+    h->keyfile = g_key_file_new();
+    h->sessions = g_ptr_array_new();
+    h->fds = g_array_new(false, false, sizeof(int));
+    return h;
+}
+
+static void ga_handoff_free(GAHandoff *h)
+{
+    g_key_file_free(h->keyfile);
+    g_ptr_array_free(h->sessions, true);
+    g_array_free(h->fds, true);
+    g_free(h);
+}
+
+static void ga_session_check_handoff(gpointer data, gpointer opaque)
+{
+    GASession *session = ga_channel_client_get_data(data);
+    bool *busy = opaque;
+
+    *busy |= session &&
+             (session->async_jobs || !g_queue_is_empty(&session->deferred) ||
+              session->streams || session->pending);
+}
+
+/* only what is at rest can be handed over */
+static bool ga_upgrade_check(GAState *s, Error **errp)
+{
+    bool busy = s->async_pending;
+
+    if (ga_is_frozen(s)) {
+        error_setg(errp, "filesystems are frozen");
+        return false;
+    }
+    if (ga_channel_get_fd(s->channel) < 0) {
+        error_setg(errp, "the channel is closed");
+        return false;
+    }
+    ga_foreach_client(s, ga_session_check_handoff, &busy);
+    if (busy) {
+        error_setg(errp, "requests are still in progress");
+        return false;
+    }
+    return ga_file_handoff_check(errp) && ga_exec_handoff_check(errp);
+}
+
+static void ga_handoff_save_session(gpointer data, gpointer opaque)
+{
+    GAChannelClient *client = data;
+    GASession *session = ga_channel_client_get_data(client);
+    GAHandoff *h = opaque;
+    char *group;
+
+    group = g_strdup_printf("session %u", h->sessions->len);
+    g_ptr_array_add(h->sessions, session);
+    if (ga_state->listening) {
+        ga_handoff_keep_fd(h, ga_channel_client_get_fd(client));
+    }
+    if (session) {
+        g_key_file_set_boolean(h->keyfile, group, "framed", session->framed);
+        g_key_file_set_boolean(h->keyfile, group, "compress",
+                               session->compress);
+        ga_handoff_set_data(h, group, "frame", session->frame->data,
+                            session->frame->len);
+    }
+    g_free(group);
+}
+
+static void ga_handoff_save(GAState *s, GAHandoff *h)
+{
+    GARoleChannel *rc = &s->channels[GA_CHANNEL_ROLE_CONTROL];
+
+    g_key_file_set_string(h->keyfile, "channel", "method", s->method);
+    g_key_file_set_integer(h->keyfile, "channel", "fd",
+                           ga_channel_get_fd(s->channel));
+    ga_handoff_keep_fd(h, ga_channel_get_fd(s->channel));
+    if (rc->serial) {
+        g_key_file_set_integer(h->keyfile, "channel", "serial-speed",
+                               rc->serial_speed);
+        g_key_file_set_boolean(h->keyfile, "channel", "serial-flow-control",
+                               rc->serial_flow_control);
+    }
+    ga_channel_foreach_client(s->channel, ga_handoff_save_session, h);
+    if (s->listening) {
+        /* ga_handoff_save_session() kept them after the channel */
+        g_key_file_set_integer_list(h->keyfile, "channel", "clients",
+                                    &g_array_index(h->fds, int, 1),
+                                    h->fds->len - 1);
+    }
+
+    /* ids handed out from the reserved block go on from where they were */
+    ga_handoff_set_int64(h, "agent", "fd-counter", s->pstate.fd_counter);
+    ga_handoff_set_int64(h, "agent", "fd-reserved", s->fd_reserved);
+    /* argv[0] may be relative to a directory the daemon has left */
+    g_key_file_set_string(h->keyfile, "agent", "exe-path", s->upgrade_path);
+
+    ga_file_handoff_save(h);
+    ga_exec_handoff_save(h);
+}
+
+static void ga_set_cloexec(GArray *fds, bool cloexec)
+{
+    int flags, fd;
+    guint i;
+
+    for (i = 0; i < fds->len; i++) {
+        fd = g_array_index(fds, int, i);
+        flags = fcntl(fd, F_GETFD);
+        if (flags >= 0) {
+            fcntl(fd, F_SETFD,
+                  cloexec ? flags | FD_CLOEXEC : flags & ~FD_CLOEXEC);
         }
     }
+}
+
+static gboolean ga_upgrade_cb(gpointer opaque)
+{
+    GAState *s = opaque;
+    GAHandoff *h = NULL;
+    Error *err = NULL;
+    GError *gerr = NULL;
+    gchar *path = NULL, *data = NULL;
+    gsize len;
+
+    s->upgrade_idle = 0;
+    /* requests may have come in since guest-upgrade-agent was answered */
+    if (!ga_upgrade_check(s, &err)) {
+        goto out;
+    }
+    if (!ga_channel_flush(s->channel, QGA_HANDOFF_FLUSH_MS)) {
+        error_setg(&err, "clients did not take their output");
+        goto out;
+    }
 
-    QDECREF(qdict);
+    h = ga_handoff_new();
+    ga_handoff_save(s, h);
+    data = g_key_file_to_data(h->keyfile, &len, NULL);
+    path = g_build_filename(s->state_dir, "qga.handoff", NULL);
+    if (!g_file_set_contents(path, data, len, &gerr)) {
+        error_setg(&err, "failed to write %s: %s", path, gerr->message);
+        g_error_free(gerr);
+        goto out;
+    }
+
+    g_debug("upgrading to %s", s->upgrade_path);
+    ga_set_cloexec(h->fds, false);
+    /* the new agent forks a helper of its own */
+    ga_spawner_free(s->spawner);
+    s->spawner = NULL;
+    if (s->log) {
+        ga_log_flush(s->log);
+    }
+    g_setenv(QGA_HANDOFF_ENV, path, true);
+    execv(s->upgrade_path, s->argv);
+
+    /* carry on, and run programs without the helper */
+    error_setg_errno(&err, errno, "failed to execute '%s'", s->upgrade_path);
+    g_unsetenv(QGA_HANDOFF_ENV);
+    ga_set_cloexec(h->fds, true);
+    unlink(path);
+
+out:
+    g_warning("upgrade failed: %s", error_get_pretty(err));
+    error_free(err);
+    if (h) {
+        ga_handoff_free(h);
+    }
+    g_free(path);
+    g_free(data);
+    return false;
 }
 
-/* false return signals GAChannel to close the current client connection */
-static gboolean channel_event_cb(GIOCondition condition, gpointer data)
+/*
+ * Exec @path in the place of the agent once the request being processed
+ * is answered.  False if the state of the agent cannot be handed over,
+ * because requests are still in progress for example.
+ */
+bool ga_schedule_upgrade(GAState *s, const char *path, Error **errp)
 {
-    GAState *s = data;
-    gchar buf[QGA_READ_COUNT_DEFAULT+1];
-    gsize count;
-    GError *err = NULL;
-    GIOStatus status = ga_channel_read(s->channel, buf, QGA_READ_COUNT_DEFAULT, &count);
-    if (err != NULL) {
-        g_warning("error reading channel: %s", err->message);
-        g_error_free(err);
+    if (s->upgrade_idle) {
+        error_setg(errp, "an upgrade is pending already");
         return false;
     }
-    switch (status) {
-    case G_IO_STATUS_ERROR:
-        g_warning("error reading channel");
+    if (!ga_upgrade_check(s, errp)) {
         return false;
-    case G_IO_STATUS_NORMAL:
-        buf[count] = 0;
-        g_debug("read data, count: %d, data: %s", (int)count, buf);
-        json_message_parser_feed(&s->parser, (char *)buf, (int)count);
-        break;
-    case G_IO_STATUS_EOF:
-        g_debug("received EOF");
-        if (!s->virtio) {
-            return false;
-        }
-        /* fall through */
-    case G_IO_STATUS_AGAIN:
-        /* virtio causes us to spin here when no process is attached to
-         * host-side chardev. sleep a bit to mitigate this
-         */
-        if (s->virtio) {
-            usleep(100*1000);
-        }
+    }
+    g_free(s->upgrade_path);
+    s->upgrade_path = g_strdup(path);
+    s->upgrade_idle = g_idle_add(ga_upgrade_cb, s);
+    return true;
+}
+
+/*
+ * Read the state the agent that exec'd this one left, and remove it.
+ * The channel it names replaces the configured one.
+ */
+static bool ga_handoff_open(GAState *s, char **method, int *fd)
+{
+    const char *path = g_getenv(QGA_HANDOFF_ENV);
+    GError *gerr = NULL;
+    GAHandoff *h;
+
+    if (!path) {
         return true;
-    default:
-        g_warning("unknown channel read status, closing");
+    }
+    h = ga_handoff_new();
+    if (!g_key_file_load_from_file(h->keyfile, path, 0, &gerr)) {
+        g_critical("failed to load the state of the agent before the "
+                   "upgrade from %s: %s", path, gerr->message);
+        g_error_free(gerr);
+        ga_handoff_free(h);
         return false;
     }
+    unlink(path);
+    /* not for the programs the agent runs */
+    g_unsetenv(QGA_HANDOFF_ENV);
+
+    g_free(*method);
+    *method = g_key_file_get_string(h->keyfile, "channel", "method", NULL);
+    *fd = g_key_file_get_integer(h->keyfile, "channel", "fd", NULL);
+    qemu_set_cloexec(*fd);
+    g_free(s->exe_path);
+    s->exe_path = g_key_file_get_string(h->keyfile, "agent", "exe-path",
+                                        NULL);
+    s->handoff = h;
     return true;
 }
 
-static gboolean channel_init(GAState *s, const gchar *method, const gchar *path)
+static void ga_handoff_load_session(gpointer data, gpointer opaque)
 {
-    GAChannelMethod channel_method;
+    GAChannelClient *client = data;
+    GAHandoff *h = opaque;
+    GASession *session =
+        ga_session_new(&ga_state->channels[GA_CHANNEL_ROLE_CONTROL], client);
+    guchar *frame;
+    gchar *group;
+    gsize len;
+
+    if (ga_state->listening) {
+        qemu_set_cloexec(ga_channel_client_get_fd(client));
+    }
+    group = g_strdup_printf("session %u", h->sessions->len);
+    g_ptr_array_add(h->sessions, session);
+    session->framed = g_key_file_get_boolean(h->keyfile, group, "framed",
+                                             NULL);
+    session->compress = g_key_file_get_boolean(h->keyfile, group, "compress",
+                                               NULL);
+    frame = ga_handoff_get_data(h, group, "frame", &len);
+    g_byte_array_append(session->frame, frame, len);
+    g_free(frame);
+    g_free(group);
+}
 
-    if (strcmp(method, "virtio-serial") == 0) {
-        s->virtio = true; /* virtio requires special handling in some cases */
-        channel_method = GA_CHANNEL_VIRTIO_SERIAL;
-    } else if (strcmp(method, "isa-serial") == 0) {
-        channel_method = GA_CHANNEL_ISA_SERIAL;
-    } else if (strcmp(method, "unix-listen") == 0) {
-        channel_method = GA_CHANNEL_UNIX_LISTEN;
-    } else {
-        g_critical("unsupported channel method/type: %s", method);
-        return false;
+static void ga_handoff_process_frames(gpointer data, gpointer opaque)
+{
+    GASession *session = ga_channel_client_get_data(data);
+
+    if (session->frame->len) {
+        process_frames(session);
     }
+}
 
-    s->channel = ga_channel_new(channel_method, path, channel_event_cb, s);
-    if (!s->channel) {
-        g_critical("failed to create guest agent channel");
-        return false;
+/* take over the clients, files and processes of the agent before */
+static void ga_handoff_finish(GAState *s)
+{
+    GAHandoff *h = s->handoff;
+
+    ga_channel_foreach_client(s->channel, ga_handoff_load_session, h);
+    if (g_key_file_has_key(h->keyfile, "agent", "fd-counter", NULL)) {
+        s->pstate.fd_counter = ga_handoff_get_int64(h, "agent", "fd-counter");
+        s->fd_reserved = ga_handoff_get_int64(h, "agent", "fd-reserved");
     }
 
-    return true;
+    ga_file_handoff_load(h);
+    ga_exec_handoff_load(h);
+    g_debug("took over %u clients from the agent before the upgrade",
+            h->sessions->len);
+
+    s->handoff = NULL;
+    ga_handoff_free(h);
+    /* what the agent before read and did not get to */
+    ga_channel_foreach_client(s->channel, ga_handoff_process_frames, NULL);
 }
+#endif
 
 #ifdef _WIN32
 DWORD WINAPI service_ctrl_handler(DWORD ctrl, DWORD type, LPVOID data,
@@ -878,83 +3233,500 @@ out:
     if (keyfile) {
         g_key_file_free(keyfile);
     }
-    if (gerr) {
-        g_error_free(gerr);
+    if (gerr) {
+        g_error_free(gerr);
+    }
+
+    return ret;
+}
+
+/* the client whose request is being processed, NULL outside of requests */
+GASession *ga_get_session(GAState *s)
+{
+    return s->session;
+}
+
+/*
+ * Called by a command to answer the request being dispatched later from
+ * the main loop, with ga_complete_response(), instead of with what it
+ * returns now.  Only a request that carries an id can be answered out of
+ * order; NULL is returned for one that does not, and the command has to
+ * answer at once.
+ */
+GAPendingResponse *ga_defer_response(GAState *s)
+{
+    GAPendingResponse *pending;
+
+    if (!s->session || !s->request_id || s->nested_dispatch) {
+        return NULL;
+    }
+    g_assert(!s->response_deferred);
+
+    pending = g_new0(GAPendingResponse, 1);
+    pending->session = s->session;
+    QINCREF(s->request);
+    pending->req = s->request;
+    qobject_incref(s->request_id);
+    pending->id = s->request_id;
+    s->session->pending = g_list_prepend(s->session->pending, pending);
+    s->response_deferred = true;
+    return pending;
+}
+
+/*
+ * Answer a request deferred with ga_defer_response() and free @pending.
+ * @fn builds the result or sets an error, with the client of the request
+ * as the current session so that framing and compression settings and
+ * response attachments apply to it.  It is called even if the client has
+ * gone away or cancelled the request, and then the result is dropped.
+ */
+void ga_complete_response(GAState *s, GAPendingResponse *pending,
+                          GAResponseFunc fn, void *opaque)
+{
+    GASession *saved = s->session;
+    GASession *session = pending->answered ? NULL : pending->session;
+    Error *err = NULL;
+    QObject *ret;
+    QDict *rsp;
+    int r;
+
+    s->session = session;
+    ret = fn(opaque, &err);
+    if (session) {
+        rsp = qdict_new();
+        if (err) {
+            qdict_put_obj(rsp, "error", qmp_build_error_object(err));
+            qobject_decref(ret);
+        } else {
+            qdict_put_obj(rsp, "return", ret ? ret : QOBJECT(qdict_new()));
+        }
+        qdict_put_obj(rsp, "id", pending->id);
+        pending->id = NULL;
+        r = send_response(session, QOBJECT(rsp));
+        if (r < 0) {
+            g_warning("error sending response: %s", strerror(-r));
+        }
+        ga_stats_response(session, qdict_get_str(pending->req, "execute"),
+                          QOBJECT(rsp));
+        QDECREF(rsp);
+    } else {
+        qobject_decref(ret);
+    }
+    error_free(err);
+    s->session = saved;
+
+    if (pending->session) {
+        pending->session->pending = g_list_remove(pending->session->pending,
+                                                  pending);
+    }
+    QDECREF(pending->req);
+    qobject_decref(pending->id);
+    g_free(pending);
+}
+
+/* @notifier is called with the GASession of each client that goes away,
+ * after its streams have ended
+ */
+void ga_add_session_close_notifier(GAState *s, Notifier *notifier)
+{
+    notifier_list_add(&s->session_close_notifiers, notifier);
+}
+
+int ga_get_max_file_handles(GAState *s)
+{
+    return s->max_file_handles;
+}
+
+int ga_get_max_exec_processes(GAState *s)
+{
+    return s->max_exec_processes;
+}
+
+int ga_get_exec_reap_timeout(GAState *s)
+{
+    return s->exec_reap_timeout;
+}
+
+bool ga_uses_pm_utils(GAState *s)
+{
+    return s->pm_utils;
+}
+
+int64_t ga_get_fd_handle(GAState *s, Error **errp)
+{
+    int64_t handle;
+
+    g_assert(s->pstate_filepath);
+    /* we blacklist commands and avoid operations that potentially require
+     * writing to disk when we're in a frozen state. this includes opening
+     * new files, so we should never get here in that situation
+     */
+    g_assert(!ga_is_frozen(s));
+
+    /* This should never happen on a reasonable timeframe, as guest-file-open
+     * would have to be issued 2^63 times */
+    if (s->pstate.fd_counter >= INT64_MAX - QGA_PSTATE_FD_BLOCK) {
+        abort();
+    }
+
+    /* rather than writing the state file for every handle, record the end
+     * of a block of ids and hand them out from memory; a restarted agent
+     * continues after the block, so ids are still never reused
+     */
+    if (s->pstate.fd_counter >= s->fd_reserved) {
+        GAPersistentState next = s->pstate;
+
+        next.fd_counter += QGA_PSTATE_FD_BLOCK;
+        if (!write_persistent_state(&next, s->pstate_filepath)) {
+            error_setg(errp, "failed to commit persistent state to disk");
+            return -1;
+        }
+        s->fd_reserved = next.fd_counter;
+    }
+    handle = s->pstate.fd_counter++;
+
+    return handle;
+}
+
+static void ga_print_cmd(QmpCommand *cmd, void *opaque)
+{
+    printf("%s\n", qmp_command_name(cmd));
+}
+
+static GList *split_list(const gchar *str, const gchar *delim)
+{
+    GList *list = NULL;
+    int i;
+    gchar **strv;
+
+    strv = g_strsplit(str, delim, -1);
+    for (i = 0; strv[i]; i++) {
+        list = g_list_prepend(list, strv[i]);
+    }
+    g_free(strv);
+
+    return list;
+}
+
+typedef struct GAConfig {
+    char *channel_path;
+    /* of the telemetry and bulk channels, NULL for none */
+    char *role_method[GA_CHANNEL_ROLE__MAX];
+    char *role_path[GA_CHANNEL_ROLE__MAX];
+    char *method;
+    char *log_filepath;
+    char *pid_filepath;
+#ifdef CONFIG_FSFREEZE
+    char *fsfreeze_hook;
+    int fsfreeze_hook_timeout;
+#endif
+    char *state_dir;
+    char *trace_events;
+#ifdef _WIN32
+    const char *service;
+#endif
+    gchar *bliststr; /* blacklist may point to this string */
+    GList *blacklist;
+    GASamplerConfig sampler;
+    int metrics_interval_arg;
+    int metrics_history_arg;
+    char *metrics_shm;
+    int metrics_spool;
+    int max_file_handles;
+    int max_exec_processes;
+    int exec_reap_timeout;
+    int idle_exit;
+    int epoll;
+    int pm_utils;
+    int listen_fd;              /* from socket activation, or -1 */
+    GHashTable *timeouts;
+    GHashTable *ratelimits;
+    double rate_limit;
+    int rate_limit_burst;
+    int cpu_budget;
+    int stall_threshold;
+    int serial_speed;
+    int serial_flow_control;
+    char *capture;
+    int capture_size;
+#ifdef CONFIG_QGA_BPF
+    int latency_histograms;
+#endif
+    int daemonize;
+    GLogLevelFlags log_level;
+    int dumpconf;
+} GAConfig;
+
+static const char *sampler_group_names[GA_SAMPLE_NGROUPS] = {
+    "cpu", "memory", "disk", "net"
+};
+
+static const char *sampler_rollup_names[GA_ROLLUP_NTIERS] = {
+    "rollup-1s", "rollup-10s", "rollup-1m", "rollup-1h"
+};
+
+static void sampler_config_init(GASamplerConfig *sc)
+{
+    static const size_t rollup_size[] = QGA_METRICS_ROLLUP_DEFAULTS;
+
+    memset(sc, 0, sizeof(*sc));
+    sc->groups = GA_SAMPLE_ALL;
+    memcpy(sc->rollup_size, rollup_size, sizeof(sc->rollup_size));
+}
+
+/*
+ * metrics-interval and metrics-history of [general], then the [sampler]
+ * group: interval and history again, an enable flag and an interval for
+ * each group of counters, e.g. "disk=false" or "net-interval=10000", and
+ * the number of buckets of each rollup, e.g. "rollup-1h=168".
+ */
+static void sampler_config_load(GKeyFile *keyfile, GASamplerConfig *sc,
+                                GError **gerr)
+{
+    const char *group = "sampler";
+    char *key;
+    int i;
+
+    if (g_key_file_has_key(keyfile, "general", "metrics-interval", NULL)) {
+        sc->interval_ms =
+            g_key_file_get_integer(keyfile, "general", "metrics-interval",
+                                   gerr);
+    }
+    if (!*gerr &&
+        g_key_file_has_key(keyfile, "general", "metrics-history", NULL)) {
+        sc->size =
+            g_key_file_get_integer(keyfile, "general", "metrics-history",
+                                   gerr);
+    }
+    if (!*gerr && g_key_file_has_key(keyfile, group, "interval", NULL)) {
+        sc->interval_ms =
+            g_key_file_get_integer(keyfile, group, "interval", gerr);
+    }
+    if (!*gerr && g_key_file_has_key(keyfile, group, "history", NULL)) {
+        sc->size = g_key_file_get_integer(keyfile, group, "history", gerr);
+    }
+    for (i = 0; i < GA_SAMPLE_NGROUPS && !*gerr; i++) {
+        if (g_key_file_has_key(keyfile, group, sampler_group_names[i],
+                               NULL)) {
+            if (g_key_file_get_boolean(keyfile, group,
+                                       sampler_group_names[i], gerr)) {
+                sc->groups |= 1u << i;
+            } else {
+                sc->groups &= ~(1u << i);
+            }
+        }
+        key = g_strdup_printf("%s-interval", sampler_group_names[i]);
+        if (!*gerr && g_key_file_has_key(keyfile, group, key, NULL)) {
+            sc->group_interval_ms[i] =
+                g_key_file_get_integer(keyfile, group, key, gerr);
+        }
+        g_free(key);
+    }
+    for (i = 0; i < GA_ROLLUP_NTIERS && !*gerr; i++) {
+        if (g_key_file_has_key(keyfile, group, sampler_rollup_names[i],
+                               NULL)) {
+            sc->rollup_size[i] =
+                g_key_file_get_integer(keyfile, group,
+                                       sampler_rollup_names[i], gerr);
+        }
+    }
+}
+
+/* defaults, then the config file, then the command line */
+static void sampler_config_finish(GASamplerConfig *sc, int interval_arg,
+                                  int history_arg)
+{
+    if (interval_arg != -1) {
+        sc->interval_ms = interval_arg;
+    }
+    if (history_arg != -1) {
+        sc->size = history_arg;
+    }
+    if (sc->size == 0) {
+        sc->size = QGA_METRICS_HISTORY_DEFAULT;
+    }
+}
+
+static bool sampler_config_check(const GASamplerConfig *sc)
+{
+    int i;
+
+    if (sc->interval_ms < 0 || (ssize_t)sc->size <= 0) {
+        return false;
+    }
+    for (i = 0; i < GA_SAMPLE_NGROUPS; i++) {
+        if (sc->group_interval_ms[i] < 0) {
+            return false;
+        }
+    }
+    for (i = 0; i < GA_ROLLUP_NTIERS; i++) {
+        if ((ssize_t)sc->rollup_size[i] < 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void sampler_config_dump(GKeyFile *keyfile, const GASamplerConfig *sc)
+{
+    char *key;
+    int i;
+
+    g_key_file_set_integer(keyfile, "sampler", "interval", sc->interval_ms);
+    g_key_file_set_integer(keyfile, "sampler", "history", sc->size);
+    for (i = 0; i < GA_SAMPLE_NGROUPS; i++) {
+        g_key_file_set_boolean(keyfile, "sampler", sampler_group_names[i],
+                               sc->groups & (1u << i));
+        if (sc->group_interval_ms[i]) {
+            key = g_strdup_printf("%s-interval", sampler_group_names[i]);
+            g_key_file_set_integer(keyfile, "sampler", key,
+                                   sc->group_interval_ms[i]);
+            g_free(key);
+        }
+    }
+    for (i = 0; i < GA_ROLLUP_NTIERS; i++) {
+        g_key_file_set_integer(keyfile, "sampler", sampler_rollup_names[i],
+                               sc->rollup_size[i]);
+    }
+}
+
+/*
+ * The [timeouts] group gives commands that run in a worker a deadline in
+ * milliseconds, e.g. "guest-fstrim=600000".  0 means no deadline.
+ */
+static void timeouts_config_load(GKeyFile *keyfile, GHashTable *timeouts,
+                                 GError **gerr)
+{
+    gchar **keys;
+    int i, ms;
+
+    if (!g_key_file_has_group(keyfile, "timeouts")) {
+        return;
+    }
+    keys = g_key_file_get_keys(keyfile, "timeouts", NULL, gerr);
+    for (i = 0; keys && keys[i] && !*gerr; i++) {
+        ms = g_key_file_get_integer(keyfile, "timeouts", keys[i], gerr);
+        if (!*gerr) {
+            g_hash_table_insert(timeouts, g_strdup(keys[i]),
+                                GINT_TO_POINTER(MAX(ms, 0)));
+        }
+    }
+    g_strfreev(keys);
+}
+
+static void timeouts_config_dump(gpointer key, gpointer value,
+                                 gpointer opaque)
+{
+    g_key_file_set_integer(opaque, "timeouts", key, GPOINTER_TO_INT(value));
+}
+
+/*
+ * The [ratelimit] group limits commands to so many requests per second
+ * from all clients together, optionally with a burst, e.g.
+ * "guest-get-app-status=0.5;5".  A rate of 0 sets no limit, but lets
+ * --cpu-budget answer the command with its last result.
+ */
+static void ratelimits_config_load(GKeyFile *keyfile, GHashTable *ratelimits,
+                                   GError **gerr)
+{
+    gchar **keys;
+    gdouble *vals;
+    gsize n = 0;
+    int i;
+
+    if (!g_key_file_has_group(keyfile, "ratelimit")) {
+        return;
+    }
+    keys = g_key_file_get_keys(keyfile, "ratelimit", NULL, gerr);
+    for (i = 0; keys && keys[i] && !*gerr; i++) {
+        vals = g_key_file_get_double_list(keyfile, "ratelimit", keys[i], &n,
+                                          gerr);
+        if (!*gerr) {
+            g_hash_table_insert(ratelimits, g_strdup(keys[i]),
+                                ga_ratelimit_new(n > 0 ? vals[0] : 0,
+                                                 n > 1 ? vals[1] : 0));
+        }
+        g_free(vals);
     }
-
-    return ret;
+    g_strfreev(keys);
 }
 
-int64_t ga_get_fd_handle(GAState *s, Error **errp)
+static void ratelimits_config_dump(gpointer key, gpointer value,
+                                   gpointer opaque)
 {
-    int64_t handle;
+    GARateLimit *rl = value;
+    gdouble vals[] = { rl->bucket.avg, rl->bucket.max };
 
-    g_assert(s->pstate_filepath);
-    /* we blacklist commands and avoid operations that potentially require
-     * writing to disk when we're in a frozen state. this includes opening
-     * new files, so we should never get here in that situation
-     */
-    g_assert(!ga_is_frozen(s));
+    g_key_file_set_double_list(opaque, "ratelimit", key, vals, 2);
+}
 
-    handle = s->pstate.fd_counter++;
+#ifndef _WIN32
+/*
+ * Apply the sampler settings of the config file to the running agent.
+ * The rest of the configuration still needs a restart.
+ */
+static void ga_reload_config(GAState *s)
+{
+    const char *conf = g_getenv("QGA_CONF") ?: QGA_CONF_DEFAULT;
+    GASamplerConfig sc;
+    GASampler *sampler;
+    GError *gerr = NULL;
+    GKeyFile *keyfile;
 
-    /* This should never happen on a reasonable timeframe, as guest-file-open
-     * would have to be issued 2^63 times */
-    if (s->pstate.fd_counter == INT64_MAX) {
-        abort();
+    sampler_config_init(&sc);
+    keyfile = g_key_file_new();
+    if (g_key_file_load_from_file(keyfile, conf, 0, &gerr)) {
+        sampler_config_load(keyfile, &sc, &gerr);
     }
-
-    if (!write_persistent_state(&s->pstate, s->pstate_filepath)) {
-        error_setg(errp, "failed to commit persistent state to disk");
-        return -1;
+    g_key_file_free(keyfile);
+    if (gerr) {
+        g_warning("failed to reload configuration from %s: %s", conf,
+                  gerr->message);
+        g_error_free(gerr);
+        return;
+    }
+    sampler_config_finish(&sc, s->metrics_interval_arg,
+                          s->metrics_history_arg);
+    sc.shm = s->metrics_shm;
+    sc.spool = s->metrics_spool;
+    if (!sampler_config_check(&sc)) {
+        g_warning("invalid metrics sampler configuration in %s, ignored",
+                  conf);
+        return;
     }
 
-    return handle;
-}
-
-static void ga_print_cmd(QmpCommand *cmd, void *opaque)
-{
-    printf("%s\n", qmp_command_name(cmd));
+    if (!sc.interval_ms) {
+        sampler = s->sampler;
+        atomic_rcu_set(&s->sampler, NULL);
+        ga_sampler_free(sampler);
+    } else if (!s->sampler) {
+        atomic_rcu_set(&s->sampler, ga_sampler_new(&sc));
+    } else {
+        ga_sampler_reconfigure(s->sampler, &sc);
+    }
+    s->sampler_config = sc;
+    g_debug("reloaded sampler configuration from %s", conf);
 }
 
-static GList *split_list(const gchar *str, const gchar *delim)
+static gboolean reload_event_cb(GIOChannel *channel, GIOCondition condition,
+                                gpointer data)
 {
-    GList *list = NULL;
-    int i;
-    gchar **strv;
+    char buf[16];
 
-    strv = g_strsplit(str, delim, -1);
-    for (i = 0; strv[i]; i++) {
-        list = g_list_prepend(list, strv[i]);
+    while (read(reload_pipe[0], buf, sizeof(buf)) > 0) {
+        /* one reload for however many signals came in */
     }
-    g_free(strv);
-
-    return list;
+    ga_reload_config(data);
+    return TRUE;
 }
-
-typedef struct GAConfig {
-    char *channel_path;
-    char *method;
-    char *log_filepath;
-    char *pid_filepath;
-#ifdef CONFIG_FSFREEZE
-    char *fsfreeze_hook;
-#endif
-    char *state_dir;
-#ifdef _WIN32
-    const char *service;
 #endif
-    gchar *bliststr; /* blacklist may point to this string */
-    GList *blacklist;
-    int daemonize;
-    GLogLevelFlags log_level;
-    int dumpconf;
-} GAConfig;
 
 static void config_load(GAConfig *config)
 {
     GError *gerr = NULL;
     GKeyFile *keyfile;
+    char *key;
+    int i;
     const char *conf = g_getenv("QGA_CONF") ?: QGA_CONF_DEFAULT;
 
     /* read system config */
@@ -974,6 +3746,22 @@ static void config_load(GAConfig *config)
         config->channel_path =
             g_key_file_get_string(keyfile, "general", "path", &gerr);
     }
+    for (i = GA_CHANNEL_ROLE_TELEMETRY; i < GA_CHANNEL_ROLE__MAX; i++) {
+        key = g_strdup_printf("%s-method", ga_channel_role_names[i]);
+        if (g_key_file_has_key(keyfile, "general", key, NULL)) {
+            g_free(config->role_method[i]);
+            config->role_method[i] =
+                g_key_file_get_string(keyfile, "general", key, &gerr);
+        }
+        g_free(key);
+        key = g_strdup_printf("%s-path", ga_channel_role_names[i]);
+        if (g_key_file_has_key(keyfile, "general", key, NULL)) {
+            g_free(config->role_path[i]);
+            config->role_path[i] =
+                g_key_file_get_string(keyfile, "general", key, &gerr);
+        }
+        g_free(key);
+    }
     if (g_key_file_has_key(keyfile, "general", "logfile", NULL)) {
         config->log_filepath =
             g_key_file_get_string(keyfile, "general", "logfile", &gerr);
@@ -988,6 +3776,12 @@ static void config_load(GAConfig *config)
             g_key_file_get_string(keyfile,
                                   "general", "fsfreeze-hook", &gerr);
     }
+    if (g_key_file_has_key(keyfile, "general", "fsfreeze-hook-timeout",
+                           NULL)) {
+        config->fsfreeze_hook_timeout =
+            g_key_file_get_integer(keyfile, "general",
+                                   "fsfreeze-hook-timeout", &gerr);
+    }
 #endif
     if (g_key_file_has_key(keyfile, "general", "statedir", NULL)) {
         config->state_dir =
@@ -1004,6 +3798,96 @@ static void config_load(GAConfig *config)
         config->blacklist = g_list_concat(config->blacklist,
                                           split_list(config->bliststr, ","));
     }
+    if (g_key_file_has_key(keyfile, "general", "max-file-handles", NULL)) {
+        config->max_file_handles =
+            g_key_file_get_integer(keyfile, "general", "max-file-handles",
+                                   &gerr);
+    }
+    if (g_key_file_has_key(keyfile, "general", "max-exec-processes", NULL)) {
+        config->max_exec_processes =
+            g_key_file_get_integer(keyfile, "general", "max-exec-processes",
+                                   &gerr);
+    }
+    if (g_key_file_has_key(keyfile, "general", "exec-reap-timeout", NULL)) {
+        config->exec_reap_timeout =
+            g_key_file_get_integer(keyfile, "general", "exec-reap-timeout",
+                                   &gerr);
+    }
+    if (g_key_file_has_key(keyfile, "general", "idle-exit", NULL)) {
+        config->idle_exit =
+            g_key_file_get_integer(keyfile, "general", "idle-exit", &gerr);
+    }
+    if (g_key_file_has_key(keyfile, "general", "epoll", NULL)) {
+        config->epoll =
+            g_key_file_get_boolean(keyfile, "general", "epoll", &gerr);
+    }
+    if (g_key_file_has_key(keyfile, "general", "pm-utils", NULL)) {
+        config->pm_utils =
+            g_key_file_get_boolean(keyfile, "general", "pm-utils", &gerr);
+    }
+    if (!gerr) {
+        sampler_config_load(keyfile, &config->sampler, &gerr);
+    }
+    if (g_key_file_has_key(keyfile, "general", "rate-limit", NULL)) {
+        config->rate_limit =
+            g_key_file_get_double(keyfile, "general", "rate-limit", &gerr);
+    }
+    if (g_key_file_has_key(keyfile, "general", "rate-limit-burst", NULL)) {
+        config->rate_limit_burst =
+            g_key_file_get_integer(keyfile, "general", "rate-limit-burst",
+                                   &gerr);
+    }
+    if (g_key_file_has_key(keyfile, "general", "cpu-budget", NULL)) {
+        config->cpu_budget =
+            g_key_file_get_integer(keyfile, "general", "cpu-budget", &gerr);
+    }
+    if (g_key_file_has_key(keyfile, "general", "serial-speed", NULL)) {
+        config->serial_speed =
+            g_key_file_get_integer(keyfile, "general", "serial-speed", &gerr);
+    }
+    if (g_key_file_has_key(keyfile, "general", "serial-flow-control",
+                           NULL)) {
+        config->serial_flow_control =
+            g_key_file_get_boolean(keyfile, "general", "serial-flow-control",
+                                   &gerr);
+    }
+    if (g_key_file_has_key(keyfile, "general", "stall-threshold", NULL)) {
+        config->stall_threshold =
+            g_key_file_get_integer(keyfile, "general", "stall-threshold",
+                                   &gerr);
+    }
+    if (g_key_file_has_key(keyfile, "general", "metrics-shm", NULL)) {
+        g_free(config->metrics_shm);
+        config->metrics_shm =
+            g_key_file_get_string(keyfile, "general", "metrics-shm", &gerr);
+    }
+    if (g_key_file_has_key(keyfile, "general", "metrics-spool", NULL)) {
+        config->metrics_spool =
+            g_key_file_get_integer(keyfile, "general", "metrics-spool",
+                                   &gerr);
+    }
+    if (g_key_file_has_key(keyfile, "general", "capture", NULL)) {
+        g_free(config->capture);
+        config->capture =
+            g_key_file_get_string(keyfile, "general", "capture", &gerr);
+    }
+    if (g_key_file_has_key(keyfile, "general", "capture-size", NULL)) {
+        config->capture_size =
+            g_key_file_get_integer(keyfile, "general", "capture-size", &gerr);
+    }
+#ifdef CONFIG_QGA_BPF
+    if (g_key_file_has_key(keyfile, "general", "latency-histograms", NULL)) {
+        config->latency_histograms =
+            g_key_file_get_boolean(keyfile, "general", "latency-histograms",
+                                   &gerr);
+    }
+#endif
+    if (!gerr) {
+        timeouts_config_load(keyfile, config->timeouts, &gerr);
+    }
+    if (!gerr) {
+        ratelimits_config_load(keyfile, config->ratelimits, &gerr);
+    }
 
 end:
     g_key_file_free(keyfile);
@@ -1035,7 +3919,8 @@ static void config_dump(GAConfig *config)
 {
     GError *error = NULL;
     GKeyFile *keyfile;
-    gchar *tmp;
+    gchar *tmp, *key;
+    int i;
 
     keyfile = g_key_file_new();
     g_assert(keyfile);
@@ -1043,6 +3928,18 @@ static void config_dump(GAConfig *config)
     g_key_file_set_boolean(keyfile, "general", "daemon", config->daemonize);
     g_key_file_set_string(keyfile, "general", "method", config->method);
     g_key_file_set_string(keyfile, "general", "path", config->channel_path);
+    for (i = GA_CHANNEL_ROLE_TELEMETRY; i < GA_CHANNEL_ROLE__MAX; i++) {
+        if (!config->role_path[i]) {
+            continue;
+        }
+        key = g_strdup_printf("%s-method", ga_channel_role_names[i]);
+        g_key_file_set_string(keyfile, "general", key,
+                              config->role_method[i]);
+        g_free(key);
+        key = g_strdup_printf("%s-path", ga_channel_role_names[i]);
+        g_key_file_set_string(keyfile, "general", key, config->role_path[i]);
+        g_free(key);
+    }
     if (config->log_filepath) {
         g_key_file_set_string(keyfile, "general", "logfile",
                               config->log_filepath);
@@ -1053,6 +3950,8 @@ static void config_dump(GAConfig *config)
         g_key_file_set_string(keyfile, "general", "fsfreeze-hook",
                               config->fsfreeze_hook);
     }
+    g_key_file_set_integer(keyfile, "general", "fsfreeze-hook-timeout",
+                           config->fsfreeze_hook_timeout);
 #endif
     g_key_file_set_string(keyfile, "general", "statedir", config->state_dir);
     g_key_file_set_boolean(keyfile, "general", "verbose",
@@ -1060,6 +3959,46 @@ static void config_dump(GAConfig *config)
     tmp = list_join(config->blacklist, ',');
     g_key_file_set_string(keyfile, "general", "blacklist", tmp);
     g_free(tmp);
+    g_key_file_set_integer(keyfile, "general", "max-file-handles",
+                           config->max_file_handles);
+    g_key_file_set_integer(keyfile, "general", "max-exec-processes",
+                           config->max_exec_processes);
+    g_key_file_set_integer(keyfile, "general", "exec-reap-timeout",
+                           config->exec_reap_timeout);
+    g_key_file_set_integer(keyfile, "general", "idle-exit",
+                           config->idle_exit);
+    g_key_file_set_boolean(keyfile, "general", "epoll", config->epoll);
+    g_key_file_set_boolean(keyfile, "general", "pm-utils", config->pm_utils);
+    g_key_file_set_double(keyfile, "general", "rate-limit",
+                          config->rate_limit);
+    g_key_file_set_integer(keyfile, "general", "rate-limit-burst",
+                           config->rate_limit_burst);
+    g_key_file_set_integer(keyfile, "general", "cpu-budget",
+                           config->cpu_budget);
+    g_key_file_set_integer(keyfile, "general", "stall-threshold",
+                           config->stall_threshold);
+    g_key_file_set_integer(keyfile, "general", "serial-speed",
+                           config->serial_speed);
+    g_key_file_set_boolean(keyfile, "general", "serial-flow-control",
+                           config->serial_flow_control);
+    if (config->metrics_shm) {
+        g_key_file_set_string(keyfile, "general", "metrics-shm",
+                              config->metrics_shm);
+    }
+    g_key_file_set_integer(keyfile, "general", "metrics-spool",
+                           config->metrics_spool);
+    if (config->capture) {
+        g_key_file_set_string(keyfile, "general", "capture", config->capture);
+    }
+    g_key_file_set_integer(keyfile, "general", "capture-size",
+                           config->capture_size);
+#ifdef CONFIG_QGA_BPF
+    g_key_file_set_boolean(keyfile, "general", "latency-histograms",
+                           config->latency_histograms);
+#endif
+    sampler_config_dump(keyfile, &config->sampler);
+    g_hash_table_foreach(config->timeouts, timeouts_config_dump, keyfile);
+    g_hash_table_foreach(config->ratelimits, ratelimits_config_dump, keyfile);
 
     tmp = g_key_file_to_data(keyfile, NULL, &error);
     printf("%s", tmp);
@@ -1070,7 +4009,7 @@ static void config_dump(GAConfig *config)
 
 static void config_parse(GAConfig *config, int argc, char **argv)
 {
-    const char *sopt = "hVvdm:p:l:f:F::b:s:t:D";
+    const char *sopt = "hVvdm:p:l:f:F::b:s:t:DT:";
     int opt_ind = 0, ch;
     const struct option lopt[] = {
         { "help", 0, NULL, 'h' },
@@ -1080,6 +4019,7 @@ static void config_parse(GAConfig *config, int argc, char **argv)
         { "pidfile", 1, NULL, 'f' },
 #ifdef CONFIG_FSFREEZE
         { "fsfreeze-hook", 2, NULL, 'F' },
+        { "fsfreeze-hook-timeout", 1, NULL, 'O' },
 #endif
         { "verbose", 0, NULL, 'v' },
         { "method", 1, NULL, 'm' },
@@ -1090,6 +4030,29 @@ static void config_parse(GAConfig *config, int argc, char **argv)
         { "service", 1, NULL, 's' },
 #endif
         { "statedir", 1, NULL, 't' },
+        { "trace", 1, NULL, 'T' },
+        { "metrics-interval", 1, NULL, 'M' },
+        { "metrics-history", 1, NULL, 'H' },
+        { "metrics-shm", 1, NULL, 'G' },
+        { "metrics-spool", 1, NULL, 'K' },
+        { "max-file-handles", 1, NULL, 'N' },
+        { "max-exec-processes", 1, NULL, 'P' },
+        { "exec-reap-timeout", 1, NULL, 'R' },
+        { "idle-exit", 1, NULL, 'I' },
+        { "epoll", 0, NULL, 'E' },
+        { "pm-utils", 0, NULL, 'U' },
+        { "rate-limit", 1, NULL, 'A' },
+        { "rate-limit-burst", 1, NULL, 'B' },
+        { "cpu-budget", 1, NULL, 'C' },
+        { "stall-threshold", 1, NULL, 'S' },
+        { "serial-speed", 1, NULL, 'X' },
+        { "serial-flow-control", 0, NULL, 'Y' },
+        { "capture", 1, NULL, 'c' },
+        { "capture-size", 1, NULL, 'Z' },
+        { "alloc-stats", 0, NULL, 'W' },
+#ifdef CONFIG_QGA_BPF
+        { "latency-histograms", 0, NULL, 'L' },
+#endif
         { NULL, 0, NULL, 0 }
     };
 
@@ -1116,6 +4079,9 @@ static void config_parse(GAConfig *config, int argc, char **argv)
             g_free(config->fsfreeze_hook);
             config->fsfreeze_hook = g_strdup(optarg ?: QGA_FSFREEZE_HOOK_DEFAULT);
             break;
+        case 'O':
+            config->fsfreeze_hook_timeout = atoi(optarg);
+            break;
 #endif
         case 't':
             g_free(config->state_dir);
@@ -1131,9 +4097,77 @@ static void config_parse(GAConfig *config, int argc, char **argv)
         case 'd':
             config->daemonize = 1;
             break;
+        case 'M':
+            config->metrics_interval_arg = atoi(optarg);
+            break;
+        case 'H':
+            config->metrics_history_arg = atoi(optarg);
+            break;
+        case 'G':
+            g_free(config->metrics_shm);
+            config->metrics_shm = g_strdup(optarg);
+            break;
+        case 'K':
+            config->metrics_spool = atoi(optarg);
+            break;
+        case 'N':
+            config->max_file_handles = atoi(optarg);
+            break;
+        case 'P':
+            config->max_exec_processes = atoi(optarg);
+            break;
+        case 'R':
+            config->exec_reap_timeout = atoi(optarg);
+            break;
+        case 'I':
+            config->idle_exit = atoi(optarg);
+            break;
+        case 'E':
+            config->epoll = 1;
+            break;
+        case 'U':
+            config->pm_utils = 1;
+            break;
+        case 'A':
+            config->rate_limit = g_ascii_strtod(optarg, NULL);
+            break;
+        case 'B':
+            config->rate_limit_burst = atoi(optarg);
+            break;
+        case 'C':
+            config->cpu_budget = atoi(optarg);
+            break;
+        case 'S':
+            config->stall_threshold = atoi(optarg);
+            break;
+        case 'X':
+            config->serial_speed = atoi(optarg);
+            break;
+        case 'Y':
+            config->serial_flow_control = 1;
+            break;
+        case 'c':
+            g_free(config->capture);
+            config->capture = g_strdup(optarg);
+            break;
+        case 'Z':
+            config->capture_size = atoi(optarg);
+            break;
+        case 'W':
+            /* taken care of by main() */
+            break;
+#ifdef CONFIG_QGA_BPF
+        case 'L':
+            config->latency_histograms = 1;
+            break;
+#endif
         case 'D':
             config->dumpconf = 1;
             break;
+        case 'T':
+            g_free(config->trace_events);
+            config->trace_events = g_strdup(optarg);
+            break;
         case 'b': {
             if (is_help_option(optarg)) {
                 qmp_for_each_command(ga_print_cmd, NULL);
@@ -1185,15 +4219,26 @@ static void config_parse(GAConfig *config, int argc, char **argv)
 
 static void config_free(GAConfig *config)
 {
+    int i;
+
     g_free(config->method);
     g_free(config->log_filepath);
     g_free(config->pid_filepath);
     g_free(config->state_dir);
+    g_free(config->trace_events);
+    g_free(config->metrics_shm);
+    g_free(config->capture);
     g_free(config->channel_path);
+    for (i = 0; i < GA_CHANNEL_ROLE__MAX; i++) {
+        g_free(config->role_method[i]);
+        g_free(config->role_path[i]);
+    }
     g_free(config->bliststr);
 #ifdef CONFIG_FSFREEZE
     g_free(config->fsfreeze_hook);
 #endif
+    g_hash_table_destroy(config->timeouts);
+    g_hash_table_destroy(config->ratelimits);
     g_free(config);
 }
 
@@ -1232,6 +4277,8 @@ static bool check_is_frozen(GAState *s)
 
 static int run_agent(GAState *s, GAConfig *config)
 {
+    int i;
+
     ga_state = s;
 
     g_log_set_default_handler(ga_log, s);
@@ -1265,6 +4312,15 @@ static int run_agent(GAState *s, GAConfig *config)
         ga_disable_logging(s);
         qmp_for_each_command(ga_disable_non_whitelisted, NULL);
     } else {
+#ifndef _WIN32
+        if (config->daemonize && s->handoff) {
+            /* a daemon already, only the lock went away with the exec */
+            if (!ga_open_pidfile(config->pid_filepath)) {
+                g_critical("failed to create pidfile");
+                return EXIT_FAILURE;
+            }
+        } else
+#endif
         if (config->daemonize) {
             become_daemon(config->pid_filepath);
         }
@@ -1279,6 +4335,17 @@ static int run_agent(GAState *s, GAConfig *config)
         }
     }
 
+#ifndef _WIN32
+    /* while the agent is still small, and before it starts any threads */
+    s->spawner = ga_spawner_new();
+#endif
+    s->log = ga_log_new(s->log_file);
+    /* the simple backend starts a thread, it has to wait for the daemon */
+    if (config->trace_events && !trace_init_backends(config->trace_events,
+                                                     NULL)) {
+        return EXIT_FAILURE;
+    }
+
     /* load persistent state from disk */
     if (!read_persistent_state(&s->pstate,
                                s->pstate_filepath,
@@ -1287,6 +4354,14 @@ static int run_agent(GAState *s, GAConfig *config)
         return EXIT_FAILURE;
     }
 
+    s->timeouts = config->timeouts;
+    s->ratelimits = config->ratelimits;
+    s->rate_limit = config->rate_limit;
+    s->rate_limit_burst = config->rate_limit_burst ?:
+                          MAX(config->rate_limit, 1);
+    s->cpu_budget.avg = config->cpu_budget * 10000.0;
+    s->cpu_budget.max = s->cpu_budget.avg * QGA_CPU_BUDGET_WINDOW;
+    s->cpu_used_us = ga_cpu_time_us();
     config->blacklist = ga_command_blacklist_init(config->blacklist);
     if (config->blacklist) {
         GList *l = config->blacklist;
@@ -1297,10 +4372,54 @@ static int run_agent(GAState *s, GAConfig *config)
             l = g_list_next(l);
         } while (l);
     }
+    s->max_file_handles = config->max_file_handles;
+    s->max_exec_processes = config->max_exec_processes;
+    s->exec_reap_timeout = config->exec_reap_timeout;
+    s->pm_utils = config->pm_utils;
+    s->idle_exit = config->idle_exit;
+    notifier_list_init(&s->session_close_notifiers);
     s->command_state = ga_command_state_new();
     ga_command_state_init(s, s->command_state);
     ga_command_state_init_all(s->command_state);
-    json_message_parser_init(&s->parser, process_event);
+#ifdef CLOCK_BOOTTIME
+    s->boot_offset = ga_clock_ahead(CLOCK_BOOTTIME);
+    s->real_offset = ga_clock_ahead(CLOCK_REALTIME);
+#endif
+    if (config->metrics_shm) {
+        Error *err = NULL;
+
+        s->metrics_shm = ga_metrics_shm_new(config->metrics_shm, &err);
+        if (!s->metrics_shm) {
+            g_critical("%s", error_get_pretty(err));
+            error_free(err);
+            return EXIT_FAILURE;
+        }
+    }
+    if (config->metrics_spool && ga_is_frozen(s)) {
+        g_warning("filesystems are frozen, going without the metrics spool");
+    } else if (config->metrics_spool) {
+        Error *err = NULL;
+        char *path = g_build_filename(s->state_dir, "qga.metrics-spool",
+                                      NULL);
+
+        s->metrics_spool = ga_metrics_spool_new(path, config->metrics_spool,
+                                                &err);
+        g_free(path);
+        if (!s->metrics_spool) {
+            g_critical("%s", error_get_pretty(err));
+            error_free(err);
+            return EXIT_FAILURE;
+        }
+    }
+    s->sampler_config = config->sampler;
+    s->sampler_config.shm = s->metrics_shm;
+    s->sampler_config.spool = s->metrics_spool;
+    s->metrics_interval_arg = config->metrics_interval_arg;
+    s->metrics_history_arg = config->metrics_history_arg;
+    if (s->sampler_config.interval_ms > 0) {
+        atomic_rcu_set(&s->sampler, ga_sampler_new(&s->sampler_config));
+    }
+    qmp_event_set_func_emit(send_event);
     ga_state = s;
 #ifndef _WIN32
     if (!register_signal_handlers()) {
@@ -1310,10 +4429,67 @@ static int run_agent(GAState *s, GAConfig *config)
 #endif
 
     s->main_loop = g_main_loop_new(NULL, false);
-    if (!channel_init(ga_state, config->method, config->channel_path)) {
+    ga_loop_init(config->epoll);
+    if (config->stall_threshold) {
+        s->watchdog = ga_watchdog_new(config->stall_threshold,
+                                      ga_stall_event, NULL);
+    }
+    if (config->capture) {
+        Error *err = NULL;
+
+        s->capture = ga_capture_new(config->capture,
+                                    (size_t)config->capture_size << 20, &err);
+        if (!s->capture) {
+            g_critical("%s", error_get_pretty(err));
+            error_free(err);
+            return EXIT_FAILURE;
+        }
+    }
+#ifdef CONFIG_QGA_BPF
+    if (config->latency_histograms) {
+        Error *err = NULL;
+
+        /* the agent goes on without them */
+        s->bpf = ga_bpf_new(&err);
+        if (!s->bpf) {
+            g_warning("no latency histograms: %s", error_get_pretty(err));
+            error_free(err);
+        }
+    }
+#endif
+#ifndef _WIN32
+    {
+        GIOChannel *reload = g_io_channel_unix_new(reload_pipe[0]);
+
+        g_io_add_watch(reload, G_IO_IN, reload_event_cb, s);
+        g_io_channel_unref(reload);
+    }
+#endif
+    if (!channel_init(ga_state, config->method, config->channel_path,
+                      config->listen_fd)) {
         g_critical("failed to initialize guest agent channel");
         return EXIT_FAILURE;
     }
+    if (ga_serial_speed_init(s, config->serial_speed,
+                             config->serial_flow_control)) {
+        return EXIT_FAILURE;
+    }
+    for (i = GA_CHANNEL_ROLE_TELEMETRY; i < GA_CHANNEL_ROLE__MAX; i++) {
+        if (config->role_path[i] &&
+            !role_channel_init(ga_state, i, config->role_method[i],
+                               config->role_path[i])) {
+            return EXIT_FAILURE;
+        }
+    }
+#ifndef _WIN32
+    if (s->handoff) {
+        ga_handoff_finish(s);
+    }
+#endif
+    ga_idle_exit_rearm(s);
+    s->channel_us = g_get_monotonic_time() - s->start_time;
+    /* an idle source, so requests that come in right away go first */
+    g_idle_add(ga_deferred_init_cb, s);
 #ifndef _WIN32
     g_main_loop_run(ga_state->main_loop);
 #else
@@ -1382,13 +4558,115 @@ static int check_path(const char* path)
     return 0;
 }
 
+/*
+ * Use the descriptor systemd passed, if any: a listening socket, whose
+ * type decides the method, or a serial port given with ListenSpecial=.
+ */
+static bool socket_activation_init(GAConfig *config)
+{
+    unsigned int nfds = check_socket_activation();
+#ifndef _WIN32
+    struct sockaddr_storage ss;
+    socklen_t len = sizeof(ss);
+    const char *method = NULL;
+#endif
+
+    if (nfds == 0) {
+        return true;
+    }
+    if (nfds > 1) {
+        g_critical("qemu-ga only supports listening on one socket");
+        return false;
+    }
+    config->listen_fd = FIRST_SOCKET_ACTIVATION_FD;
+#ifndef _WIN32
+    if (getsockname(config->listen_fd, (struct sockaddr *)&ss, &len) == 0) {
+        if (ss.ss_family == AF_UNIX) {
+            method = "unix-listen";
+#if defined(CONFIG_AF_VSOCK) && defined(AF_VSOCK)
+        } else if (ss.ss_family == AF_VSOCK) {
+            method = "vsock-listen";
+#endif
+        } else {
+            g_critical("unsupported socket family %d passed by socket"
+                       " activation", ss.ss_family);
+            return false;
+        }
+    } else if (config->method && strcmp(config->method, "virtio-serial") &&
+               strcmp(config->method, "isa-serial")) {
+        g_critical("socket activation for method %s needs a socket",
+                   config->method);
+        return false;
+    }
+    if (method) {
+        g_free(config->method);
+        config->method = g_strdup(method);
+    }
+#endif
+    g_debug("using socket activation, method %s",
+            config->method ?: "virtio-serial");
+    return true;
+}
+
 int main(int argc, char **argv)
 {
     int ret = EXIT_SUCCESS;
-    GAState *s = g_new0(GAState, 1);
-    GAConfig *config = g_new0(GAConfig, 1);
+    GAState *s;
+    GAConfig *config;
+    bool alloc_stats = false;
+    int i;
+
+    /* before glib allocates anything, which parsing the options does */
+    for (i = 1; i < argc && strcmp(argv[i], "--"); i++) {
+        if (!strcmp(argv[i], "--alloc-stats")) {
+            alloc_stats = true;
+        }
+    }
+    if (alloc_stats && !ga_alloc_stats_init()) {
+        g_warning("--alloc-stats needs glib older than 2.46, ignoring it");
+    }
+#ifdef CONFIG_QGA_LEAN
+    /* the slice magazines cache memory per thread and never give it back */
+    g_setenv("G_SLICE", "always-malloc", false);
+#endif
+    s = g_new0(GAState, 1);
+    for (i = 0; i < GA_CHANNEL_ROLE__MAX; i++) {
+        s->channels[i].state = s;
+        s->channels[i].role = i;
+    }
+    config = g_new0(GAConfig, 1);
+    s->start_time = g_get_monotonic_time();
+    s->channel_us = -1;
+    s->ready_us = -1;
+    s->stats = ga_stats_new();
+#ifndef _WIN32
+    /* before daemonizing changes the directory */
+    s->argv = argv;
+    s->exe_path = g_find_program_in_path(argv[0]);
+    if (s->exe_path && !g_path_is_absolute(s->exe_path)) {
+        gchar *cwd = g_get_current_dir();
+        gchar *path = g_build_filename(cwd, s->exe_path, NULL);
+
+        g_free(s->exe_path);
+        s->exe_path = path;
+        g_free(cwd);
+    }
+#endif
 
     config->log_level = G_LOG_LEVEL_ERROR | G_LOG_LEVEL_CRITICAL;
+    sampler_config_init(&config->sampler);
+    config->metrics_interval_arg = -1;
+    config->metrics_history_arg = -1;
+    config->max_file_handles = QGA_FILE_HANDLES_MAX_DEFAULT;
+    config->max_exec_processes = QGA_EXEC_PROCESSES_MAX_DEFAULT;
+    config->exec_reap_timeout = QGA_EXEC_REAP_TIMEOUT_DEFAULT;
+    config->capture_size = QGA_CAPTURE_SIZE_DEFAULT;
+    config->serial_speed = GA_CHANNEL_SERIAL_SPEED_DEFAULT;
+    config->listen_fd = -1;
+    config->timeouts = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                             g_free, NULL);
+    config->ratelimits = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                               g_free, ga_ratelimit_free);
 
     module_call_init(MODULE_INIT_QAPI);
 
@@ -1405,9 +4683,104 @@ int main(int argc, char **argv)
     }
     check_path(dfl_pathnames.state_dir);
  
+    if (!socket_activation_init(config)) {
+        ret = EXIT_FAILURE;
+        goto end;
+    }
+#ifndef _WIN32
+    if (!ga_handoff_open(s, &config->method, &config->listen_fd)) {
+        ret = EXIT_FAILURE;
+        goto end;
+    }
+#endif
     if (config->method == NULL) {
         config->method = g_strdup("virtio-serial");
     }
+    for (i = GA_CHANNEL_ROLE_TELEMETRY; i < GA_CHANNEL_ROLE__MAX; i++) {
+        if (config->role_method[i] && !config->role_path[i]) {
+            g_critical("must specify a path for the %s channel",
+                       ga_channel_role_names[i]);
+            ret = EXIT_FAILURE;
+            goto end;
+        }
+        if (config->role_path[i] && !config->role_method[i]) {
+            config->role_method[i] = g_strdup("virtio-serial");
+        }
+    }
+
+    sampler_config_finish(&config->sampler, config->metrics_interval_arg,
+                          config->metrics_history_arg);
+    if (!sampler_config_check(&config->sampler)) {
+        g_critical("invalid metrics sampler configuration");
+        ret = EXIT_FAILURE;
+        goto end;
+    }
+    if (config->metrics_spool < 0) {
+        g_critical("invalid metrics-spool: %d", config->metrics_spool);
+        ret = EXIT_FAILURE;
+        goto end;
+    }
+    if (config->max_file_handles < 0) {
+        g_critical("invalid max-file-handles: %d", config->max_file_handles);
+        ret = EXIT_FAILURE;
+        goto end;
+    }
+    if (config->max_exec_processes < 0) {
+        g_critical("invalid max-exec-processes: %d",
+                   config->max_exec_processes);
+        ret = EXIT_FAILURE;
+        goto end;
+    }
+    if (config->exec_reap_timeout < 0) {
+        g_critical("invalid exec-reap-timeout: %d", config->exec_reap_timeout);
+        ret = EXIT_FAILURE;
+        goto end;
+    }
+#ifdef CONFIG_FSFREEZE
+    if (config->fsfreeze_hook_timeout < 0) {
+        g_critical("invalid fsfreeze-hook-timeout: %d",
+                   config->fsfreeze_hook_timeout);
+        ret = EXIT_FAILURE;
+        goto end;
+    }
+#endif
+    if (config->rate_limit < 0 || config->rate_limit_burst < 0) {
+        g_critical("invalid rate-limit: %g, burst %d", config->rate_limit,
+                   config->rate_limit_burst);
+        ret = EXIT_FAILURE;
+        goto end;
+    }
+    if (config->cpu_budget < 0) {
+        g_critical("invalid cpu-budget: %d", config->cpu_budget);
+        ret = EXIT_FAILURE;
+        goto end;
+    }
+    if (config->stall_threshold < 0) {
+        g_critical("invalid stall-threshold: %d", config->stall_threshold);
+        ret = EXIT_FAILURE;
+        goto end;
+    }
+    if (config->capture_size < 0) {
+        g_critical("invalid capture-size: %d", config->capture_size);
+        ret = EXIT_FAILURE;
+        goto end;
+    }
+    if (!ga_channel_serial_speed_valid(config->serial_speed)) {
+        g_critical("unsupported serial-speed: %d", config->serial_speed);
+        ret = EXIT_FAILURE;
+        goto end;
+    }
+    if (config->idle_exit < 0) {
+        g_critical("invalid idle-exit: %d", config->idle_exit);
+        ret = EXIT_FAILURE;
+        goto end;
+    }
+    /* nothing would start the agent again */
+    if (config->idle_exit && config->listen_fd == -1) {
+        g_critical("idle-exit requires socket activation");
+        ret = EXIT_FAILURE;
+        goto end;
+    }
 
     if (config->channel_path == NULL) {
         if (strcmp(config->method, "virtio-serial") == 0) {
@@ -1416,7 +4789,7 @@ int main(int argc, char **argv)
         } else if (strcmp(config->method, "isa-serial") == 0) {
             /* try the default path for the serial port - COM1 */
             config->channel_path = g_strdup(QGA_SERIAL_PATH_DEFAULT);
-        } else {
+        } else if (config->listen_fd == -1) {
             g_critical("must specify a path for this channel");
             ret = EXIT_FAILURE;
             goto end;
@@ -1427,7 +4800,9 @@ int main(int argc, char **argv)
     s->log_file = stderr;
 #ifdef CONFIG_FSFREEZE
     s->fsfreeze_hook = config->fsfreeze_hook;
+    s->fsfreeze_hook_timeout = config->fsfreeze_hook_timeout;
 #endif
+    s->state_dir = g_strdup(config->state_dir);
     s->pstate_filepath = g_strdup_printf("%s/qga.state", config->state_dir);
     s->state_filepath_isfrozen = g_strdup_printf("%s/qga.state.isfrozen",
                                                  config->state_dir);
@@ -1441,15 +4816,49 @@ int main(int argc, char **argv)
     ret = run_agent(s, config);
 
 end:
+    ga_async_stop(s);
+    ga_sampler_free(s->sampler);
+    /* the sampler thread has stopped */
+    ga_metrics_shm_free(s->metrics_shm);
+    ga_metrics_spool_free(s->metrics_spool);
     if (s->command_state) {
         ga_command_state_cleanup_all(s->command_state);
     }
+#ifndef _WIN32
+    /* after the cleanup, which may run the fsfreeze hook */
+    ga_spawner_free(s->spawner);
+    if (s->handoff) {
+        ga_handoff_free(s->handoff);
+    }
+    g_free(s->exe_path);
+    g_free(s->upgrade_path);
+#endif
+    for (i = GA_CHANNEL_ROLE_TELEMETRY; i < GA_CHANNEL_ROLE__MAX; i++) {
+        if (s->channels[i].channel) {
+            ga_channel_free(s->channels[i].channel);
+        }
+    }
     if (s->channel) {
         ga_channel_free(s->channel);
     }
+    ga_watchdog_free(s->watchdog);
+    ga_capture_free(s->capture);
+#ifdef CONFIG_QGA_BPF
+    ga_bpf_free(s->bpf);
+#endif
+    ga_loop_cleanup();
     g_list_foreach(config->blacklist, free_blacklist_entry, NULL);
+    g_free(s->state_dir);
     g_free(s->pstate_filepath);
     g_free(s->state_filepath_isfrozen);
+    ga_stats_free(s->stats);
+    if (s->log) {
+        GALog *log = s->log;
+
+        /* whatever is logged from now on is written out directly */
+        s->log = NULL;
+        ga_log_free(log);
+    }
 
     if (config->daemonize) {
         unlink(config->pid_filepath);
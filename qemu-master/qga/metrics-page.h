@@ -0,0 +1,72 @@
+/*
+ * QEMU Guest Agent metrics page
+ *
+ * The layout of the page the agent's sampler publishes its latest sample
+ * to with --metrics-shm, for the host to read directly out of the shared
+ * memory.  Nothing but this header is needed to read it.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#ifndef QGA_METRICS_PAGE_H
+#define QGA_METRICS_PAGE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#define GA_METRICS_PAGE_MAGIC       0x4d414751  /* "QGAM" */
+#define GA_METRICS_PAGE_VERSION     1
+#define GA_METRICS_PAGE_NCOUNTERS   21
+
+/*
+ * Everything is in the byte order of the guest.  @seqcount is odd while
+ * the agent writes a sample, and 0 before the first sample and after the
+ * agent exits: a reader copies the page between two reads of it that are
+ * equal and even, or tries again.  @counters are those of
+ * guest-get-metrics-history, in the order of the columns of
+ * guest-get-metrics-rollup: cpu-user to cpu-steal in milliseconds,
+ * mem-total to swap-free in bytes, then the disk and network counters.
+ * Only the groups in @present, 1 for cpu, 2 memory, 4 disk and 8 net,
+ * were read for this sample.
+ */
+typedef struct GAMetricsPage {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;              /* of the page as written */
+    uint32_t interval_ms;
+    uint64_t seqcount;
+    uint64_t seq;               /* of the sample */
+    int64_t time;               /* ns since the epoch */
+    uint32_t present;
+    uint32_t reserved;
+    uint64_t counters[GA_METRICS_PAGE_NCOUNTERS];
+} GAMetricsPage;
+
+/*
+ * Copy the latest sample out of @page, giving up after @tries attempts
+ * that raced with the agent.  False if there is no sample yet, or no
+ * page of a version this reader knows.
+ */
+static inline bool ga_metrics_page_read(const volatile GAMetricsPage *page,
+                                        GAMetricsPage *copy, int tries)
+{
+    uint64_t start;
+
+    while (tries-- > 0) {
+        start = __atomic_load_n(&page->seqcount, __ATOMIC_ACQUIRE);
+        if (start & 1) {
+            continue;
+        }
+        memcpy(copy, (const void *)page, sizeof(*copy));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&page->seqcount, __ATOMIC_RELAXED) != start) {
+            continue;
+        }
+        return start && copy->magic == GA_METRICS_PAGE_MAGIC &&
+               copy->version == GA_METRICS_PAGE_VERSION;
+    }
+    return false;
+}
+
+#endif
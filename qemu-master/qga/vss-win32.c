@@ -145,7 +145,8 @@ void ga_uninstall_vss_provider(void)
 }
 
 /* Call VSS requester and freeze/thaw filesystems and applications */
-void qga_vss_fsfreeze(int *nr_volume, Error **errp, bool freeze)
+void qga_vss_fsfreeze(int *nr_volume, QGAVSSRequest *req, Error **errp,
+                      bool freeze)
 {
     const char *func_name = freeze ? "requester_freeze" : "requester_thaw";
     QGAVSSRequesterFunc func;
@@ -162,5 +163,5 @@ void qga_vss_fsfreeze(int *nr_volume, Error **errp, bool freeze)
         return;
     }
 
-    func(nr_volume, &errset);
+    func(nr_volume, req, &errset);
 }
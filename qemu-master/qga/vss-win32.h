@@ -14,6 +14,7 @@
 #define VSS_WIN32_H
 
 #include "qapi/error.h"
+#include "qga/vss-win32/requester.h"
 
 bool vss_init(bool init_requester);
 void vss_deinit(bool deinit_requester);
@@ -22,6 +23,7 @@ bool vss_initialized(void);
 int ga_install_vss_provider(void);
 void ga_uninstall_vss_provider(void);
 
-void qga_vss_fsfreeze(int *nr_volume, Error **errp, bool freeze);
+void qga_vss_fsfreeze(int *nr_volume, QGAVSSRequest *req, Error **errp,
+                      bool freeze);
 
 #endif
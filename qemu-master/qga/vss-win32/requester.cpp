@@ -129,6 +129,31 @@ STDAPI requester_deinit(void)
     return S_OK;
 }
 
+/* microseconds from an arbitrary point, for QGAVSSTimings */
+static long long VssNowUs(void)
+{
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+
+    if (!freq.QuadPart) {
+        QueryPerformanceFrequency(&freq);
+    }
+    QueryPerformanceCounter(&now);
+    return now.QuadPart / freq.QuadPart * 1000000 +
+        now.QuadPart % freq.QuadPart * 1000000 / freq.QuadPart;
+}
+
+static bool IsWriterExcluded(BSTR bstrWriterName,
+                             const wchar_t *const *exclude_writers)
+{
+    for (; exclude_writers && *exclude_writers; exclude_writers++) {
+        if (!_wcsicmp(bstrWriterName, *exclude_writers)) {
+            return true;
+        }
+    }
+    return false;
+}
+
 static HRESULT WaitForAsync(IVssAsync *pAsync)
 {
     HRESULT ret, hr;
@@ -149,10 +174,14 @@ static HRESULT WaitForAsync(IVssAsync *pAsync)
     return ret;
 }
 
-static void AddComponents(ErrorSet *errset)
+/* Add the selectable components of all writers but @exclude_writers, which
+ * are kept out of the backup altogether.
+ */
+static void AddComponents(const wchar_t *const *exclude_writers,
+                          ErrorSet *errset)
 {
-    unsigned int cWriters, i;
-    VSS_ID id, idInstance, idWriter;
+    unsigned int cWriters, i, cExcluded = 0;
+    VSS_ID id, idInstance, idWriter, *excluded = NULL;
     BSTR bstrWriterName = NULL;
     VSS_USAGE_TYPE usage;
     VSS_SOURCE_TYPE source;
@@ -167,6 +196,7 @@ static void AddComponents(ErrorSet *errset)
         err_set(errset, hr, "failed to get writer metadata count");
         goto out;
     }
+    excluded = new VSS_ID[cWriters ? cWriters : 1];
 
     for (i = 0; i < cWriters; i++) {
         hr = vss_ctx.pVssbc->GetWriterMetadata(i, &id, pMetadata.replace());
@@ -184,6 +214,13 @@ static void AddComponents(ErrorSet *errset)
             goto out;
         }
 
+        if (IsWriterExcluded(bstrWriterName, exclude_writers)) {
+            excluded[cExcluded++] = idInstance;
+            SysFreeString(bstrWriterName);
+            bstrWriterName = NULL;
+            continue;
+        }
+
         hr = pMetadata->GetFileCounts(&c1, &c2, &cComponents);
         if (FAILED(hr)) {
             err_set(errset, hr, "failed to get file counts of %S",
@@ -225,7 +262,16 @@ static void AddComponents(ErrorSet *errset)
             info = NULL;
         }
     }
+
+    /* so that the excluded writers are not even frozen */
+    if (cExcluded) {
+        hr = vss_ctx.pVssbc->DisableWriterInstances(excluded, cExcluded);
+        if (FAILED(hr)) {
+            err_set(errset, hr, "failed to disable excluded writers");
+        }
+    }
 out:
+    delete[] excluded;
     if (bstrWriterName) {
         SysFreeString(bstrWriterName);
     }
@@ -234,8 +280,10 @@ out:
     }
 }
 
-void requester_freeze(int *num_vols, ErrorSet *errset)
+void requester_freeze(int *num_vols, QGAVSSRequest *req, ErrorSet *errset)
 {
+    QGAVSSTimings *t = &req->timings;
+    long long start;
     COMPointer<IVssAsync> pAsync;
     HANDLE volume;
     HRESULT hr;
@@ -252,6 +300,8 @@ void requester_freeze(int *num_vols, ErrorSet *errset)
         return;
     }
 
+    t->writer_metadata = t->add_volumes = t->prepare = t->freeze = -1;
+    t->thaw = -1;
     CoInitialize(NULL);
 
     /* Allow unrestricted access to events */
@@ -317,6 +367,7 @@ void requester_freeze(int *num_vols, ErrorSet *errset)
         goto out;
     }
 
+    start = VssNowUs();
     hr = vss_ctx.pVssbc->GatherWriterMetadata(pAsync.replace());
     if (SUCCEEDED(hr)) {
         hr = WaitForAsync(pAsync);
@@ -326,11 +377,13 @@ void requester_freeze(int *num_vols, ErrorSet *errset)
         goto out;
     }
 
-    AddComponents(errset);
+    AddComponents(req->exclude_writers, errset);
     if (err_is_set(errset)) {
         goto out;
     }
+    t->writer_metadata = VssNowUs() - start;
 
+    start = VssNowUs();
     hr = vss_ctx.pVssbc->StartSnapshotSet(&guidSnapshotSet);
     if (FAILED(hr)) {
         err_set(errset, hr, "failed to start snapshot set");
@@ -368,10 +421,13 @@ void requester_freeze(int *num_vols, ErrorSet *errset)
         }
     }
 
+    t->add_volumes = VssNowUs() - start;
+
     if (num_fixed_drives == 0) {
         goto out; /* If there is no fixed drive, just exit. */
     }
 
+    start = VssNowUs();
     hr = vss_ctx.pVssbc->PrepareForBackup(pAsync.replace());
     if (SUCCEEDED(hr)) {
         hr = WaitForAsync(pAsync);
@@ -389,12 +445,14 @@ void requester_freeze(int *num_vols, ErrorSet *errset)
         err_set(errset, hr, "failed to gather writer status");
         goto out;
     }
+    t->prepare = VssNowUs() - start;
 
     /*
      * Start VSS quiescing operations.
      * CQGAVssProvider::CommitSnapshots will kick vss_ctx.hEventFrozen
      * after the applications and filesystems are frozen.
      */
+    start = VssNowUs();
     hr = vss_ctx.pVssbc->DoSnapshotSet(&vss_ctx.pAsyncSnapshot);
     if (FAILED(hr)) {
         err_set(errset, hr, "failed to do snapshot set");
@@ -424,6 +482,7 @@ void requester_freeze(int *num_vols, ErrorSet *errset)
                 "couldn't receive Frozen event from VSS provider");
         goto out;
     }
+    t->freeze = VssNowUs() - start;
 
     *num_vols = vss_ctx.cFrozenVols = num_fixed_drives;
     return;
@@ -437,8 +496,9 @@ out:
 }
 
 
-void requester_thaw(int *num_vols, ErrorSet *errset)
+void requester_thaw(int *num_vols, QGAVSSRequest *req, ErrorSet *errset)
 {
+    long long start = VssNowUs();
     COMPointer<IVssAsync> pAsync;
 
     if (!vss_ctx.hEventThaw) {
@@ -499,6 +559,7 @@ void requester_thaw(int *num_vols, ErrorSet *errset)
         vss_ctx.pVssbc->AbortBackup();
     }
     *num_vols = vss_ctx.cFrozenVols;
+    req->timings.thaw = VssNowUs() - start;
     requester_cleanup();
 
     CoUninitialize();
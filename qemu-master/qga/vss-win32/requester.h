@@ -14,6 +14,7 @@
 #define VSS_WIN32_REQUESTER_H
 
 #include <basetyps.h>           /* STDAPI */
+#include <stddef.h>
 #include "qemu/compiler.h"
 
 #ifdef __cplusplus
@@ -35,9 +36,25 @@ typedef struct ErrorSet {
 STDAPI requester_init(void);
 STDAPI requester_deinit(void);
 
-typedef void (*QGAVSSRequesterFunc)(int *, ErrorSet *);
-void requester_freeze(int *num_vols, ErrorSet *errset);
-void requester_thaw(int *num_vols, ErrorSet *errset);
+/* How long the phases of the last freeze and thaw took, in microseconds,
+ * or -1 for those that did not run */
+typedef struct QGAVSSTimings {
+    long long writer_metadata;  /* GatherWriterMetadata and AddComponents */
+    long long add_volumes;      /* building the snapshot set */
+    long long prepare;          /* PrepareForBackup and GatherWriterStatus */
+    long long freeze;           /* DoSnapshotSet until the frozen event */
+    long long thaw;             /* from the thaw event to BackupComplete */
+} QGAVSSTimings;
+
+typedef struct QGAVSSRequest {
+    /* names of the writers not to involve, NULL terminated; may be NULL */
+    const wchar_t *const *exclude_writers;
+    QGAVSSTimings timings;      /* filled in by the requester */
+} QGAVSSRequest;
+
+typedef void (*QGAVSSRequesterFunc)(int *, QGAVSSRequest *, ErrorSet *);
+void requester_freeze(int *num_vols, QGAVSSRequest *req, ErrorSet *errset);
+void requester_thaw(int *num_vols, QGAVSSRequest *req, ErrorSet *errset);
 
 #ifdef __cplusplus
 }
@@ -17,6 +17,10 @@
 #include "qapi/qmp/qint.h"
 #include "qemu-common.h"
 #include "qapi/qmp/json-lexer.h"
+#include "qemu/host-utils.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define MAX_TOKEN_SIZE (64ULL << 20)
 
@@ -346,6 +350,97 @@ static int json_lexer_feed_char(JSONLexer *lexer, char ch, bool flush)
     return 0;
 }
 
+/**
+ * json_plain_prefix:
+ * @ptr: the bytes to look at
+ * @len: how many of them
+ * @quote: the quote that ends the string, '"' or '\''
+ *
+ * Return how many bytes at the start of @ptr are plain printable ASCII
+ * other than @quote and '\\', that is bytes that stand for themselves
+ * both inside a JSON string and when writing one out.  Base64 and most
+ * other bulk data is nothing but that, so look at 16 bytes at a time with
+ * SSE2, or a word at a time elsewhere, while nothing needs a closer look.
+ */
+size_t json_plain_prefix(const char *ptr, size_t len, char quote)
+{
+    size_t i = 0;
+    unsigned char c;
+
+#ifdef __SSE2__
+    const __m128i space = _mm_set1_epi8(0x20);
+    const __m128i del = _mm_set1_epi8(0x7f);
+    const __m128i q = _mm_set1_epi8(quote);
+    const __m128i bs = _mm_set1_epi8('\\');
+    __m128i v, t;
+    int mask;
+
+    while (i + sizeof(v) <= len) {
+        v = _mm_loadu_si128((const __m128i *)(ptr + i));
+        /* signed compare: bytes >= 0x80 count as below ' ' too */
+        t = _mm_cmplt_epi8(v, space);
+        t = _mm_or_si128(t, _mm_cmpeq_epi8(v, del));
+        t = _mm_or_si128(t, _mm_cmpeq_epi8(v, q));
+        t = _mm_or_si128(t, _mm_cmpeq_epi8(v, bs));
+        mask = _mm_movemask_epi8(t);
+        if (mask) {
+            return i + ctz32(mask);
+        }
+        i += sizeof(v);
+    }
+#else
+    /* truncation to 32-bit long okay */
+    const unsigned long ones = (unsigned long)0x0101010101010101ULL;
+    const unsigned long highs = ones << 7;
+    unsigned long w, t;
+
+    while (i + sizeof(w) <= len) {
+        memcpy(&w, ptr + i, sizeof(w));
+        /* any byte < 0x20, >= 0x7f, @quote or '\\'? */
+        t = (w - ones * 0x20) & ~w;
+        t |= w;
+        t |= ((w ^ (ones * 0x7f)) - ones) & ~(w ^ (ones * 0x7f));
+        t |= ((w ^ (ones * (unsigned char)quote)) - ones)
+             & ~(w ^ (ones * (unsigned char)quote));
+        t |= ((w ^ (ones * '\\')) - ones) & ~(w ^ (ones * '\\'));
+        if (t & highs) {
+            break;
+        }
+        i += sizeof(w);
+    }
+#endif
+    for (; i < len; i++) {
+        c = ptr[i];
+        if (c < 0x20 || c >= 0x7f || c == quote || c == '\\') {
+            break;
+        }
+    }
+    return i;
+}
+
+/*
+ * Inside a string, take the run of plain bytes at @buffer in one go
+ * instead of a byte at a time; they do not change the state.
+ */
+static size_t json_lexer_feed_plain(JSONLexer *lexer, const char *buffer,
+                                    size_t size)
+{
+    size_t n;
+
+    if (lexer->state == IN_DQ_STRING) {
+        n = json_plain_prefix(buffer, size, '"');
+    } else if (lexer->state == IN_SQ_STRING) {
+        n = json_plain_prefix(buffer, size, '\'');
+    } else {
+        return 0;
+    }
+    /* leave the byte that crosses the limit to json_lexer_feed_char() */
+    n = MIN(n, MAX_TOKEN_SIZE - lexer->token->length);
+    qstring_append_len(lexer->token, buffer, n);
+    lexer->x += n;
+    return n;
+}
+
 int json_lexer_feed(JSONLexer *lexer, const char *buffer, size_t size)
 {
     size_t i;
@@ -353,6 +448,10 @@ int json_lexer_feed(JSONLexer *lexer, const char *buffer, size_t size)
     for (i = 0; i < size; i++) {
         int err;
 
+        i += json_lexer_feed_plain(lexer, buffer + i, size - i);
+        if (i == size) {
+            break;
+        }
         err = json_lexer_feed_char(lexer, buffer[i], false);
         if (err < 0) {
             return err;
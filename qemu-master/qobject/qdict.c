@@ -29,14 +29,21 @@ static const QType qdict_type = {
 /**
  * qdict_new(): Create a new QDict
  *
+ * A new QDict is small: its entries are kept in a single list, and the
+ * hash table is only allocated once it holds more than QDICT_SMALL_MAX of
+ * them.  Most QDicts (parsed tokens, requests, the members of a struct)
+ * never get there.
+ *
  * Return strong reference.
  */
 QDict *qdict_new(void)
 {
     QDict *qdict;
 
-    qdict = g_malloc0(sizeof(*qdict));
+    qdict = g_slice_new0(QDict);
     QOBJECT_INIT(qdict, &qdict_type);
+    qdict->buckets = 1;
+    qdict->table = &qdict->small;
 
     return qdict;
 }
@@ -70,13 +77,18 @@ static unsigned int tdb_hash(const char *name)
 
 /**
  * alloc_entry(): allocate a new QDictEntry
+ *
+ * The key is stored right after the entry, in the same allocation.
  */
-static QDictEntry *alloc_entry(const char *key, QObject *value)
+static QDictEntry *alloc_entry(const char *key, unsigned int hash,
+                               QObject *value)
 {
     QDictEntry *entry;
+    size_t len = strlen(key) + 1;
 
-    entry = g_malloc0(sizeof(*entry));
-    entry->key = g_strdup(key);
+    entry = g_malloc0(sizeof(*entry) + len);
+    entry->key = memcpy(entry + 1, key, len);
+    entry->hash = hash;
     entry->value = value;
 
     return entry;
@@ -107,17 +119,70 @@ const char *qdict_entry_key(const QDictEntry *entry)
  * qdict_find(): List lookup function
  */
 static QDictEntry *qdict_find(const QDict *qdict,
-                              const char *key, unsigned int bucket)
+                              const char *key, unsigned int hash)
 {
     QDictEntry *entry;
 
-    QLIST_FOREACH(entry, &qdict->table[bucket], next)
-        if (!strcmp(entry->key, key))
+    QLIST_FOREACH(entry, &qdict->table[hash % qdict->buckets], next)
+        if (entry->hash == hash && !strcmp(entry->key, key))
             return entry;
 
     return NULL;
 }
 
+/**
+ * qdict_insert(): Add an entry to its list
+ *
+ * A small QDict keeps its list in the order of the buckets of the hash
+ * table, so that iterating over it gives the same order whether it grew
+ * or not.
+ */
+static void qdict_insert(QDict *qdict, QDictEntry *entry)
+{
+    unsigned int bucket = entry->hash % QDICT_BUCKET_MAX;
+    QDictEntry *e, *last = NULL;
+
+    if (qdict->buckets != 1) {
+        QLIST_INSERT_HEAD(&qdict->table[bucket], entry, next);
+        return;
+    }
+    QLIST_FOREACH(e, &qdict->small, next) {
+        if (e->hash % QDICT_BUCKET_MAX >= bucket) {
+            QLIST_INSERT_BEFORE(e, entry, next);
+            return;
+        }
+        last = e;
+    }
+    if (last) {
+        QLIST_INSERT_AFTER(last, entry, next);
+    } else {
+        QLIST_INSERT_HEAD(&qdict->small, entry, next);
+    }
+}
+
+/**
+ * qdict_grow(): Move the entries of a small QDict to a hash table
+ */
+static void qdict_grow(QDict *qdict)
+{
+    QDictEntry *entry, *prev = NULL;
+    unsigned int bucket;
+
+    qdict->table = g_new0(struct QDictBucket, QDICT_BUCKET_MAX);
+    qdict->buckets = QDICT_BUCKET_MAX;
+    /* the entries of a bucket follow each other, keep their order */
+    while ((entry = QLIST_FIRST(&qdict->small))) {
+        QLIST_REMOVE(entry, next);
+        bucket = entry->hash % QDICT_BUCKET_MAX;
+        if (prev && prev->hash % QDICT_BUCKET_MAX == bucket) {
+            QLIST_INSERT_AFTER(prev, entry, next);
+        } else {
+            QLIST_INSERT_HEAD(&qdict->table[bucket], entry, next);
+        }
+        prev = entry;
+    }
+}
+
 /**
  * qdict_put_obj(): Put a new QObject into the dictionary
  *
@@ -131,19 +196,22 @@ static QDictEntry *qdict_find(const QDict *qdict,
  */
 void qdict_put_obj(QDict *qdict, const char *key, QObject *value)
 {
-    unsigned int bucket;
+    unsigned int hash;
     QDictEntry *entry;
 
-    bucket = tdb_hash(key) % QDICT_BUCKET_MAX;
-    entry = qdict_find(qdict, key, bucket);
+    hash = tdb_hash(key);
+    entry = qdict_find(qdict, key, hash);
     if (entry) {
         /* replace key's value */
         qobject_decref(entry->value);
         entry->value = value;
     } else {
+        if (qdict->buckets == 1 && qdict->size == QDICT_SMALL_MAX) {
+            qdict_grow(qdict);
+        }
         /* allocate a new entry */
-        entry = alloc_entry(key, value);
-        QLIST_INSERT_HEAD(&qdict->table[bucket], entry, next);
+        entry = alloc_entry(key, hash, value);
+        qdict_insert(qdict, entry);
         qdict->size++;
     }
 }
@@ -158,7 +226,7 @@ QObject *qdict_get(const QDict *qdict, const char *key)
 {
     QDictEntry *entry;
 
-    entry = qdict_find(qdict, key, tdb_hash(key) % QDICT_BUCKET_MAX);
+    entry = qdict_find(qdict, key, tdb_hash(key));
     return (entry == NULL ? NULL : entry->value);
 }
 
@@ -169,8 +237,7 @@ QObject *qdict_get(const QDict *qdict, const char *key)
  */
 int qdict_haskey(const QDict *qdict, const char *key)
 {
-    unsigned int bucket = tdb_hash(key) % QDICT_BUCKET_MAX;
-    return (qdict_find(qdict, key, bucket) == NULL ? 0 : 1);
+    return (qdict_find(qdict, key, tdb_hash(key)) == NULL ? 0 : 1);
 }
 
 /**
@@ -354,20 +421,21 @@ void qdict_iter(const QDict *qdict,
                 void (*iter)(const char *key, QObject *obj, void *opaque),
                 void *opaque)
 {
-    int i;
+    unsigned int i;
     QDictEntry *entry;
 
-    for (i = 0; i < QDICT_BUCKET_MAX; i++) {
+    for (i = 0; i < qdict->buckets; i++) {
         QLIST_FOREACH(entry, &qdict->table[i], next)
             iter(entry->key, entry->value, opaque);
     }
 }
 
-static QDictEntry *qdict_next_entry(const QDict *qdict, int first_bucket)
+static QDictEntry *qdict_next_entry(const QDict *qdict,
+                                    unsigned int first_bucket)
 {
-    int i;
+    unsigned int i;
 
-    for (i = first_bucket; i < QDICT_BUCKET_MAX; i++) {
+    for (i = first_bucket; i < qdict->buckets; i++) {
         if (!QLIST_EMPTY(&qdict->table[i])) {
             return QLIST_FIRST(&qdict->table[i]);
         }
@@ -393,7 +461,7 @@ const QDictEntry *qdict_next(const QDict *qdict, const QDictEntry *entry)
 
     ret = QLIST_NEXT(entry, next);
     if (!ret) {
-        unsigned int bucket = tdb_hash(entry->key) % QDICT_BUCKET_MAX;
+        unsigned int bucket = entry->hash % qdict->buckets;
         ret = qdict_next_entry(qdict, bucket + 1);
     }
 
@@ -408,11 +476,11 @@ QDict *qdict_clone_shallow(const QDict *src)
 {
     QDict *dest;
     QDictEntry *entry;
-    int i;
+    unsigned int i;
 
     dest = qdict_new();
 
-    for (i = 0; i < QDICT_BUCKET_MAX; i++) {
+    for (i = 0; i < src->buckets; i++) {
         QLIST_FOREACH(entry, &src->table[i], next) {
             qobject_incref(entry->value);
             qdict_put_obj(dest, entry->key, entry->value);
@@ -432,7 +500,6 @@ static void qentry_destroy(QDictEntry *e)
     assert(e->value != NULL);
 
     qobject_decref(e->value);
-    g_free(e->key);
     g_free(e);
 }
 
@@ -445,7 +512,7 @@ void qdict_del(QDict *qdict, const char *key)
 {
     QDictEntry *entry;
 
-    entry = qdict_find(qdict, key, tdb_hash(key) % QDICT_BUCKET_MAX);
+    entry = qdict_find(qdict, key, tdb_hash(key));
     if (entry) {
         QLIST_REMOVE(entry, next);
         qentry_destroy(entry);
@@ -458,13 +525,13 @@ void qdict_del(QDict *qdict, const char *key)
  */
 static void qdict_destroy_obj(QObject *obj)
 {
-    int i;
+    unsigned int i;
     QDict *qdict;
 
     assert(obj != NULL);
     qdict = qobject_to_qdict(obj);
 
-    for (i = 0; i < QDICT_BUCKET_MAX; i++) {
+    for (i = 0; i < qdict->buckets; i++) {
         QDictEntry *entry = QLIST_FIRST(&qdict->table[i]);
         while (entry) {
             QDictEntry *tmp = QLIST_NEXT(entry, next);
@@ -474,7 +541,10 @@ static void qdict_destroy_obj(QObject *obj)
         }
     }
 
-    g_free(qdict);
+    if (qdict->table != &qdict->small) {
+        g_free(qdict->table);
+    }
+    g_slice_free(QDict, qdict);
 }
 
 /**
@@ -0,0 +1,73 @@
+/*
+ * QRawJSON Module
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2.1 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#include "qapi/qmp/qrawjson.h"
+#include "qapi/qmp/qobject.h"
+#include "qemu-common.h"
+
+static void qrawjson_destroy_obj(QObject *obj);
+
+static const QType qrawjson_type = {
+    .code = QTYPE_QRAWJSON,
+    .destroy = qrawjson_destroy_obj,
+};
+
+/**
+ * qrawjson_from_qstring(): Create a new QRawJSON holding the JSON text
+ * in @json, which must be a single valid JSON value
+ *
+ * Takes over the caller's reference to @json.
+ *
+ * Return strong reference.
+ */
+QRawJSON *qrawjson_from_qstring(QString *json)
+{
+    QRawJSON *qrj;
+
+    qrj = g_malloc(sizeof(*qrj));
+    qrj->json = json;
+    QOBJECT_INIT(qrj, &qrawjson_type);
+
+    return qrj;
+}
+
+/**
+ * qrawjson_get_qstring(): Get the JSON text
+ *
+ * Return weak reference.
+ */
+QString *qrawjson_get_qstring(const QRawJSON *qrj)
+{
+    return qrj->json;
+}
+
+/**
+ * qobject_to_qrawjson(): Convert a QObject into a QRawJSON
+ */
+QRawJSON *qobject_to_qrawjson(const QObject *obj)
+{
+    if (qobject_type(obj) != QTYPE_QRAWJSON) {
+        return NULL;
+    }
+
+    return container_of(obj, QRawJSON, base);
+}
+
+/**
+ * qrawjson_destroy_obj(): Free all memory allocated by a
+ * QRawJSON object
+ */
+static void qrawjson_destroy_obj(QObject *obj)
+{
+    QRawJSON *qrj;
+
+    assert(obj != NULL);
+    qrj = qobject_to_qrawjson(obj);
+    QDECREF(qrj->json);
+    g_free(qrj);
+}
@@ -13,6 +13,7 @@
 #include "qapi/qmp/qobject.h"
 #include "qapi/qmp/qstring.h"
 #include "qemu-common.h"
+#include "qemu/buffer-pool.h"
 
 static void qstring_destroy_obj(QObject *obj);
 
@@ -21,6 +22,57 @@ static const QType qstring_type = {
     .destroy = qstring_destroy_obj,
 };
 
+/*
+ * Large strings, such as the JSON text of a response that carries a file
+ * chunk, are kept in buffers of the buffer pool, so that the next one does
+ * not have to map and fault in its memory again.  Whether the string of a
+ * QString is one goes by its capacity.
+ */
+static bool qstring_buffer_pooled(size_t capacity)
+{
+    return capacity + 1 >= QEMU_BUFFER_POOL_MIN;
+}
+
+/* room for *@capacity bytes and the NUL; the capacity is updated to what
+ * the buffer holds
+ */
+static char *qstring_buffer_new(size_t *capacity)
+{
+    char *buf;
+
+    if (!qstring_buffer_pooled(*capacity)) {
+        return g_malloc(*capacity + 1);
+    }
+    buf = qemu_buffer_pool_alloc(*capacity + 1);
+    *capacity = qemu_buffer_pool_size(buf) - 1;
+    return buf;
+}
+
+static void qstring_buffer_free(char *buf, size_t capacity)
+{
+    if (qstring_buffer_pooled(capacity)) {
+        qemu_buffer_pool_free(buf);
+    } else {
+        g_free(buf);
+    }
+}
+
+/* grow the string of @qstring to hold @capacity bytes */
+static void qstring_set_capacity(QString *qstring, size_t capacity)
+{
+    char *string;
+
+    if (!qstring_buffer_pooled(capacity)) {
+        qstring->string = g_realloc(qstring->string, capacity + 1);
+    } else {
+        string = qstring_buffer_new(&capacity);
+        memcpy(string, qstring->string, qstring->length + 1);
+        qstring_buffer_free(qstring->string, qstring->capacity);
+        qstring->string = string;
+    }
+    qstring->capacity = capacity;
+}
+
 /**
  * qstring_new(): Create a new empty QString
  *
@@ -48,12 +100,12 @@ QString *qstring_from_substr(const char *str, int start, int end)
 {
     QString *qstring;
 
-    qstring = g_malloc(sizeof(*qstring));
+    qstring = g_slice_new(QString);
 
     qstring->length = end - start + 1;
     qstring->capacity = qstring->length;
 
-    qstring->string = g_malloc(qstring->capacity + 1);
+    qstring->string = qstring_buffer_new(&qstring->capacity);
     memcpy(qstring->string, str + start, qstring->length);
     qstring->string[qstring->length] = 0;
 
@@ -74,26 +126,49 @@ QString *qstring_from_str(const char *str)
 
 static void capacity_increase(QString *qstring, size_t len)
 {
-    if (qstring->capacity < (qstring->length + len)) {
-        qstring->capacity += len;
-        qstring->capacity *= 2; /* use exponential growth */
+    size_t capacity;
 
-        qstring->string = g_realloc(qstring->string, qstring->capacity + 1);
+    if (qstring->capacity < (qstring->length + len)) {
+        capacity = qstring->capacity + len;
+        /* use exponential growth; the pool's sizes are powers of two */
+        if (!qstring_buffer_pooled(capacity)) {
+            capacity *= 2;
+        }
+        qstring_set_capacity(qstring, capacity);
     }
 }
 
-/* qstring_append(): Append a C string to a QString
+/**
+ * qstring_reserve(): Make room for @len more bytes in a QString
+ *
+ * A hint for callers that know how much they are going to append, so
+ * that a large string is allocated once and at its final size.
  */
-void qstring_append(QString *qstring, const char *str)
+void qstring_reserve(QString *qstring, size_t len)
 {
-    size_t len = strlen(str);
+    if (qstring->capacity < qstring->length + len) {
+        qstring_set_capacity(qstring, qstring->length + len);
+    }
+}
 
+/**
+ * qstring_append_len(): Append the first @len bytes of @str to a QString
+ */
+void qstring_append_len(QString *qstring, const char *str, size_t len)
+{
     capacity_increase(qstring, len);
     memcpy(qstring->string + qstring->length, str, len);
     qstring->length += len;
     qstring->string[qstring->length] = 0;
 }
 
+/* qstring_append(): Append a C string to a QString
+ */
+void qstring_append(QString *qstring, const char *str)
+{
+    qstring_append_len(qstring, str, strlen(str));
+}
+
 void qstring_append_int(QString *qstring, int64_t value)
 {
     char num[32];
@@ -144,6 +219,6 @@ static void qstring_destroy_obj(QObject *obj)
 
     assert(obj != NULL);
     qs = qobject_to_qstring(obj);
-    g_free(qs->string);
-    g_free(qs);
+    qstring_buffer_free(qs->string, qs->capacity);
+    g_slice_free(QString, qs);
 }
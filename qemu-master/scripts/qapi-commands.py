@@ -120,33 +120,80 @@ def gen_marshal_input_visit(arg_type, dealloc=False):
     return ret
 
 
+def gen_free_retval(ret_type):
+    # Schema types are freed with their qapi_free_FOO(), which may not
+    # go through the dealloc visitor (see qapi-types.py --slab)
+    if (isinstance(ret_type, QAPISchemaArrayType) and
+            isinstance(ret_type.element_type, QAPISchemaBuiltinType)):
+        return None
+    if isinstance(ret_type, (QAPISchemaObjectType, QAPISchemaArrayType,
+                             QAPISchemaAlternateType)):
+        return mcgen('''
+    qapi_free_%(c_name)s(ret_in);
+''',
+                     c_name=ret_type.c_name())
+    return None
+
+
 def gen_marshal_output(ret_type):
+    # with --json-output, results are serialized straight to JSON text
+    # and handed back as a QRawJSON, instead of as a QObject tree
+    if json_output:
+        ov_type, ov, pfx = 'JsonOutputVisitor', 'jov', 'json_output'
+    else:
+        ov_type, ov, pfx = 'QmpOutputVisitor', 'qov', 'qmp_output'
+    free_retval = gen_free_retval(ret_type)
+    if free_retval:
+        return mcgen('''
+
+static void qmp_marshal_output_%(c_name)s(%(c_type)s ret_in, QObject **ret_out, Error **errp)
+{
+    Error *err = NULL;
+    %(ov_type)s *%(ov)s = %(pfx)s_visitor_new();
+    Visitor *v;
+
+    v = %(pfx)s_get_visitor(%(ov)s);
+    visit_type_%(c_name)s(v, &ret_in, "unused", &err);
+    if (err) {
+        goto out;
+    }
+    *ret_out = %(pfx)s_get_qobject(%(ov)s);
+
+out:
+    error_propagate(errp, err);
+    %(pfx)s_visitor_cleanup(%(ov)s);
+%(free_retval)s}
+''',
+                     c_type=ret_type.c_type(), c_name=ret_type.c_name(),
+                     ov_type=ov_type, ov=ov, pfx=pfx,
+                     free_retval=free_retval)
     return mcgen('''
 
 static void qmp_marshal_output_%(c_name)s(%(c_type)s ret_in, QObject **ret_out, Error **errp)
 {
     Error *err = NULL;
-    QmpOutputVisitor *qov = qmp_output_visitor_new();
+    %(ov_type)s *%(ov)s = %(pfx)s_visitor_new();
     QapiDeallocVisitor *qdv;
     Visitor *v;
 
-    v = qmp_output_get_visitor(qov);
+    v = %(pfx)s_get_visitor(%(ov)s);
     visit_type_%(c_name)s(v, &ret_in, "unused", &err);
     if (err) {
         goto out;
     }
-    *ret_out = qmp_output_get_qobject(qov);
+    *ret_out = %(pfx)s_get_qobject(%(ov)s);
 
 out:
     error_propagate(errp, err);
-    qmp_output_visitor_cleanup(qov);
+    %(pfx)s_visitor_cleanup(%(ov)s);
     qdv = qapi_dealloc_visitor_new();
     v = qapi_dealloc_get_visitor(qdv);
     visit_type_%(c_name)s(v, &ret_in, "unused", NULL);
     qapi_dealloc_visitor_cleanup(qdv);
 }
 ''',
-                 c_type=ret_type.c_type(), c_name=ret_type.c_name())
+                 c_type=ret_type.c_type(), c_name=ret_type.c_name(),
+                 ov_type=ov_type, ov=ov, pfx=pfx)
 
 
 def gen_marshal_proto(name):
@@ -190,10 +237,178 @@ out:
     return ret
 
 
-def gen_register_command(name, success_response):
-    options = 'QCO_NO_OPTIONS'
+# The builtin types --fast marshals without visitors: their QType, how to
+# get the C value out of the QObject obj, the type name the input visitor
+# uses in its error, and how to turn retval into a QObject
+fast_scalars = {
+    'int': ('QTYPE_QINT', 'qint_get_int(qobject_to_qint(obj))', 'integer',
+            'qint_from_int(retval)'),
+    'int64': ('QTYPE_QINT', 'qint_get_int(qobject_to_qint(obj))', 'integer',
+              'qint_from_int(retval)'),
+    'bool': ('QTYPE_QBOOL', 'qbool_get_bool(qobject_to_qbool(obj))',
+             'boolean', 'qbool_from_bool(retval)'),
+    'str': ('QTYPE_QSTRING', 'qstring_get_str(qobject_to_qstring(obj))',
+            'string', 'qstring_from_str(retval ? retval : "")'),
+}
+
+
+def is_fast(arg_type, ret_type):
+    if arg_type:
+        for memb in arg_type.members:
+            if memb.type.name not in fast_scalars:
+                return False
+    return not ret_type or ret_type.name in fast_scalars
+
+
+def gen_fast_marshal_vars(arg_type, ret_type):
+    ret = mcgen('''
+    Error *err = NULL;
+''')
+
+    if ret_type:
+        ret += mcgen('''
+    %(c_type)s retval;
+''',
+                     c_type=ret_type.c_type())
+
+    if arg_type and arg_type.members:
+        ret += mcgen('''
+    QObject *obj;
+''')
+        for memb in arg_type.members:
+            if memb.optional:
+                ret += mcgen('''
+    bool has_%(c_name)s = false;
+''',
+                             c_name=c_name(memb.name))
+            # strings point into args, which outlives the call
+            ret += mcgen('''
+    %(c_type)s %(c_name)s = %(c_null)s;
+''',
+                         c_name=c_name(memb.name),
+                         c_type=memb.type.c_type(is_param=True),
+                         c_null=memb.type.c_null())
+    else:
+        ret += mcgen('''
+
+    (void)args;
+''')
+
+    return ret
+
+
+def gen_fast_marshal_input(arg_type):
+    ret = ''
+
+    if not arg_type:
+        return ret
+
+    for memb in arg_type.members:
+        qtype, get, type_name, _ = fast_scalars[memb.type.name]
+        ret += mcgen('''
+
+    obj = qdict_get(args, "%(name)s");
+''',
+                     name=memb.name)
+        if memb.optional:
+            ret += mcgen('''
+    if (obj) {
+''')
+            push_indent()
+        # like the input visitor, a missing member is of the wrong type
+        ret += mcgen('''
+    if (%(missing)sqobject_type(obj) != %(qtype)s) {
+        error_setg(&err, QERR_INVALID_PARAMETER_TYPE, "%(name)s",
+                   "%(type_name)s");
+        goto out;
+    }
+''',
+                     missing=not memb.optional and '!obj || ' or '',
+                     qtype=qtype, name=memb.name, type_name=type_name)
+        if memb.optional:
+            ret += mcgen('''
+    has_%(c_name)s = true;
+''',
+                         c_name=c_name(memb.name))
+        ret += mcgen('''
+    %(c_name)s = %(get)s;
+''',
+                     c_name=c_name(memb.name), get=get)
+        if memb.optional:
+            pop_indent()
+            ret += mcgen('''
+    }
+''')
+    return ret
+
+
+def gen_fast_call(name, arg_type, ret_type):
+    argstr = ''
+    if arg_type:
+        for memb in arg_type.members:
+            if memb.optional:
+                argstr += 'has_%s, ' % c_name(memb.name)
+            argstr += '%s, ' % c_name(memb.name)
+
+    lhs = ''
+    if ret_type:
+        lhs = 'retval = '
+
+    ret = mcgen('''
+
+    %(lhs)sqmp_%(c_name)s(%(args)s&err);
+''',
+                c_name=c_name(name), args=argstr, lhs=lhs)
+    if ret_type:
+        ret += gen_err_check()
+        ret += mcgen('''
+
+    *ret = QOBJECT(%(qobj)s);
+''',
+                     qobj=fast_scalars[ret_type.name][3])
+        if ret_type.name == 'str':
+            ret += mcgen('''
+    g_free(retval);
+''')
+    return ret
+
+
+def gen_fast_marshal(name, arg_type, ret_type):
+    ret = mcgen('''
+
+%(proto)s
+{
+''',
+                proto=gen_marshal_proto(name))
+
+    ret += gen_fast_marshal_vars(arg_type, ret_type)
+    ret += gen_fast_marshal_input(arg_type)
+    ret += gen_fast_call(name, arg_type, ret_type)
+
+    if re.search('^ *goto out;', ret, re.MULTILINE):
+        ret += mcgen('''
+
+out:
+''')
+    ret += mcgen('''
+    error_propagate(errp, err);
+}
+''')
+    return ret
+
+
+def gen_register_command(name, success_response, worker, cacheable,
+                         read_only):
+    options = []
     if not success_response:
-        options = 'QCO_NO_SUCCESS_RESP'
+        options.append('QCO_NO_SUCCESS_RESP')
+    if worker:
+        options.append('QCO_WORKER')
+    if cacheable:
+        options.append('QCO_CACHEABLE')
+    if read_only:
+        options.append('QCO_READ_ONLY')
+    options = ' | '.join(options) or 'QCO_NO_OPTIONS'
 
     ret = mcgen('''
     qmp_register_command("%(name)s", qmp_marshal_%(c_name)s, %(opts)s);
@@ -238,28 +453,42 @@ class QAPISchemaGenCommandVisitor(QAPISchemaVisitor):
         self._visited_ret_types = None
 
     def visit_command(self, name, info, arg_type, ret_type,
-                      gen, success_response):
+                      gen, success_response, worker, cacheable, read_only):
         if not gen:
             return
         self.decl += gen_command_decl(name, arg_type, ret_type)
-        if ret_type and ret_type not in self._visited_ret_types:
+        fast = fast_mode and is_fast(arg_type, ret_type)
+        if (ret_type and not fast and
+                ret_type not in self._visited_ret_types):
             self._visited_ret_types.add(ret_type)
             self.defn += gen_marshal_output(ret_type)
         if middle_mode:
             self.decl += gen_marshal_decl(name)
-        self.defn += gen_marshal(name, arg_type, ret_type)
+        if fast:
+            self.defn += gen_fast_marshal(name, arg_type, ret_type)
+        else:
+            self.defn += gen_marshal(name, arg_type, ret_type)
         if not middle_mode:
-            self._regy += gen_register_command(name, success_response)
+            self._regy += gen_register_command(name, success_response,
+                                               worker, cacheable, read_only)
 
 
 middle_mode = False
+json_output = False
+# with --fast, commands whose arguments and result are all int, bool or
+# str read args and build their result directly, without visitors
+fast_mode = False
 
 (input_file, output_dir, do_c, do_h, prefix, opts) = \
-    parse_command_line("m", ["middle"])
+    parse_command_line("mjf", ["middle", "json-output", "fast"])
 
 for o, a in opts:
     if o in ("-m", "--middle"):
         middle_mode = True
+    if o in ("-j", "--json-output"):
+        json_output = True
+    if o in ("-f", "--fast"):
+        fast_mode = True
 
 c_comment = '''
 /*
@@ -299,8 +528,10 @@ fdef.write(mcgen('''
 #include "qemu/module.h"
 #include "qapi/qmp/types.h"
 #include "qapi/qmp/dispatch.h"
+#include "qapi/qmp/qerror.h"
 #include "qapi/visitor.h"
 #include "qapi/qmp-output-visitor.h"
+#include "qapi/json-output-visitor.h"
 #include "qapi/qmp-input-visitor.h"
 #include "qapi/dealloc-visitor.h"
 #include "%(prefix)sqapi-types.h"
@@ -10,6 +10,7 @@
 # See the COPYING file in the top-level directory.
 
 from qapi import *
+import hashlib
 
 
 # Caveman's json.dumps() replacement (we're stuck at Python 2.4)
@@ -65,17 +66,25 @@ class QAPISchemaGenIntrospectVisitor(QAPISchemaVisitor):
         # TODO can generate awfully long lines
         jsons.extend(self._jsons)
         name = prefix + 'qmp_schema_json'
+        hash_name = prefix + 'qmp_schema_hash'
         self.decl = mcgen('''
 extern const char %(c_name)s[];
+extern const char %(hash_name)s[];
 ''',
-                          c_name=c_name(name))
-        lines = to_json(jsons).split('\n')
+                          c_name=c_name(name), hash_name=c_name(hash_name))
+        json = to_json(jsons)
+        lines = json.split('\n')
         c_string = '\n    '.join([to_c_string(line) for line in lines])
+        # lets a client that has seen the schema before skip fetching it
         self.defn = mcgen('''
 const char %(c_name)s[] = %(c_string)s;
+
+const char %(hash_name)s[] = "%(hash)s";
 ''',
                           c_name=c_name(name),
-                          c_string=c_string)
+                          c_string=c_string,
+                          hash_name=c_name(hash_name),
+                          hash=hashlib.sha256(json).hexdigest())
         self._schema = None
         self._jsons = None
         self._used_types = None
@@ -152,7 +161,7 @@ const char %(c_name)s[] = %(c_string)s;
                                     for m in variants.variants]})
 
     def visit_command(self, name, info, arg_type, ret_type,
-                      gen, success_response):
+                      gen, success_response, worker, cacheable, read_only):
         arg_type = arg_type or self._schema.the_empty_object_type
         ret_type = ret_type or self._schema.the_empty_object_type
         self._gen_json(name, 'command',
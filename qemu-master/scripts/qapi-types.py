@@ -59,6 +59,22 @@ def gen_struct_fields(members):
     return ret
 
 
+# With --slab, the has_ flags go after the members, where they pack
+# together instead of each taking a word of padding before a pointer
+def gen_struct_fields_compact(members):
+    ret = ''
+
+    for memb in members:
+        ret += gen_struct_field(memb.name, memb.type, False)
+    for memb in members:
+        if memb.optional:
+            ret += mcgen('''
+    bool has_%(c_name)s;
+''',
+                         c_name=c_name(memb.name))
+    return ret
+
+
 def gen_struct(name, base, members):
     ret = mcgen('''
 
@@ -69,7 +85,10 @@ struct %(c_name)s {
     if base:
         ret += gen_struct_field('base', base, False)
 
-    ret += gen_struct_fields(members)
+    if slab_mode:
+        ret += gen_struct_fields_compact(members)
+    else:
+        ret += gen_struct_fields(members)
 
     # Make sure that all structs have at least one field; this avoids
     # potential issues with attempting to malloc space for zero-length
@@ -205,6 +224,205 @@ void qapi_free_%(c_name)s(%(c_name)s *obj)
     return ret
 
 
+# With --slab, structs and lists of structs are freed directly instead of
+# through the dealloc visitor, and qapi_FOOList_new(n) allocates a list of
+# n zeroed nodes and values in a single block.  The blocks are registered
+# by the address of their first node, so that qapi_free_FOOList() frees
+# them with one g_free() and still copes with nodes and values that were
+# replaced or appended with g_new0().  The dealloc visitor knows nothing
+# about them: a slab list must only be freed through qapi_free_*(), which
+# holds as long as no union or alternate contains one.
+
+def gen_slab_registry():
+    return mcgen('''
+
+typedef struct QapiSlab {
+    char *start;
+    size_t size;
+} QapiSlab;
+
+static GHashTable *qapi_slabs;
+G_LOCK_DEFINE_STATIC(qapi_slabs);
+
+static void *qapi_slab_new(size_t size)
+{
+    QapiSlab *slab = g_new(QapiSlab, 1);
+
+    slab->start = g_malloc0(size);
+    slab->size = size;
+    G_LOCK(qapi_slabs);
+    if (!qapi_slabs) {
+        qapi_slabs = g_hash_table_new(NULL, NULL);
+    }
+    g_hash_table_insert(qapi_slabs, slab->start, slab);
+    G_UNLOCK(qapi_slabs);
+    return slab->start;
+}
+
+/* Unregister and return the slab whose first node is @head, if any */
+static QapiSlab *qapi_slab_steal(void *head)
+{
+    QapiSlab *slab = NULL;
+
+    G_LOCK(qapi_slabs);
+    if (qapi_slabs) {
+        slab = g_hash_table_lookup(qapi_slabs, head);
+        if (slab) {
+            g_hash_table_remove(qapi_slabs, head);
+        }
+    }
+    G_UNLOCK(qapi_slabs);
+    return slab;
+}
+
+static bool qapi_slab_contains(QapiSlab *slab, void *p)
+{
+    return slab && (char *)p >= slab->start &&
+        (char *)p < slab->start + slab->size;
+}
+
+static void qapi_slab_free(QapiSlab *slab)
+{
+    if (slab) {
+        g_free(slab->start);
+        g_free(slab);
+    }
+}
+''')
+
+
+def gen_slab_list_decl(name):
+    return mcgen('''
+
+%(c_name)s *qapi_%(c_name)s_new(size_t n);
+''',
+                 c_name=c_name(name))
+
+
+def gen_slab_list(name, element_type):
+    return mcgen('''
+
+typedef struct %(c_name)sSlabEntry {
+    %(c_name)s node;
+    %(c_elt_name)s value;
+} %(c_name)sSlabEntry;
+
+%(c_name)s *qapi_%(c_name)s_new(size_t n)
+{
+    %(c_name)sSlabEntry *e;
+    size_t i;
+
+    if (!n) {
+        return NULL;
+    }
+    e = qapi_slab_new(n * sizeof(*e));
+    for (i = 0; i < n; i++) {
+        e[i].node.value = &e[i].value;
+        e[i].node.next = i + 1 < n ? &e[i + 1].node : NULL;
+    }
+    return &e[0].node;
+}
+
+void qapi_free_%(c_name)s(%(c_name)s *obj)
+{
+    QapiSlab *slab;
+    %(c_name)s *next;
+
+    if (!obj) {
+        return;
+    }
+
+    slab = qapi_slab_steal(obj);
+    for (; obj; obj = next) {
+        next = obj->next;
+        if (qapi_slab_contains(slab, obj->value)) {
+            qapi_free_%(c_elt_name)s_members(obj->value);
+        } else {
+            qapi_free_%(c_elt_name)s(obj->value);
+        }
+        if (!qapi_slab_contains(slab, obj)) {
+            g_free(obj);
+        }
+    }
+    qapi_slab_free(slab);
+}
+''',
+                 c_name=c_name(name), c_elt_name=element_type.c_name())
+
+
+def gen_free_members_decl(name):
+    return mcgen('''
+
+static void qapi_free_%(c_name)s_members(%(c_name)s *obj);
+''',
+                 c_name=c_name(name))
+
+
+def gen_free_member(c_member, typ):
+    if isinstance(typ, QAPISchemaBuiltinType):
+        if typ.name == 'str':
+            return 'g_free(obj->%s);' % c_member
+        if typ.name == 'any':
+            return 'qobject_decref(obj->%s);' % c_member
+        return None
+    if isinstance(typ, QAPISchemaEnumType):
+        return None
+    return 'qapi_free_%s(obj->%s);' % (typ.c_name(), c_member)
+
+
+def gen_free_members(name, base, members):
+    ret = mcgen('''
+
+static void qapi_free_%(c_name)s_members(%(c_name)s *obj)
+{
+''',
+                c_name=c_name(name))
+
+    if base:
+        ret += mcgen('''
+    %(free)s
+''',
+                     free=gen_free_member('base', base))
+
+    for memb in members:
+        free = gen_free_member(c_name(memb.name), memb.type)
+        if not free:
+            continue
+        if memb.optional:
+            ret += mcgen('''
+    if (obj->has_%(c_name)s) {
+        %(free)s
+    }
+''',
+                         c_name=c_name(memb.name), free=free)
+        else:
+            ret += mcgen('''
+    %(free)s
+''',
+                         free=free)
+
+    ret += mcgen('''
+}
+
+void qapi_free_%(c_name)s(%(c_name)s *obj)
+{
+    if (!obj) {
+        return;
+    }
+
+    qapi_free_%(c_name)s_members(obj);
+    g_free(obj);
+}
+''',
+                 c_name=c_name(name))
+    return ret
+
+
+def is_slab_element(typ):
+    return (isinstance(typ, QAPISchemaObjectType) and not typ.variants
+            and not typ.is_implicit())
+
+
 class QAPISchemaGenTypeVisitor(QAPISchemaVisitor):
     def __init__(self):
         self.decl = None
@@ -212,6 +430,7 @@ class QAPISchemaGenTypeVisitor(QAPISchemaVisitor):
         self._fwdecl = None
         self._fwdefn = None
         self._btin = None
+        self._slab_lists = False
 
     def visit_begin(self, schema):
         self.decl = ''
@@ -219,10 +438,13 @@ class QAPISchemaGenTypeVisitor(QAPISchemaVisitor):
         self._fwdecl = ''
         self._fwdefn = ''
         self._btin = guardstart('QAPI_TYPES_BUILTIN')
+        self._slab_lists = False
 
     def visit_end(self):
         self.decl = self._fwdecl + self.decl
         self._fwdecl = None
+        if self._slab_lists:
+            self._fwdefn = gen_slab_registry() + self._fwdefn
         self.defn = self._fwdefn + self.defn
         self._fwdefn = None
         # To avoid header dependency hell, we always generate
@@ -253,6 +475,13 @@ class QAPISchemaGenTypeVisitor(QAPISchemaVisitor):
             self._btin += gen_type_cleanup_decl(name)
             if do_builtins:
                 self.defn += gen_type_cleanup(name)
+        elif slab_mode and is_slab_element(element_type):
+            self._fwdecl += gen_fwd_object_or_array(name)
+            self.decl += gen_array(name, element_type)
+            self.decl += gen_type_cleanup_decl(name)
+            self.decl += gen_slab_list_decl(name)
+            self.defn += gen_slab_list(name, element_type)
+            self._slab_lists = True
         else:
             self._fwdecl += gen_fwd_object_or_array(name)
             self.decl += gen_array(name, element_type)
@@ -263,9 +492,15 @@ class QAPISchemaGenTypeVisitor(QAPISchemaVisitor):
         if variants:
             assert not members      # not implemented
             self.decl += gen_union(name, base, variants)
+            self._gen_type_cleanup(name)
+        elif slab_mode:
+            self.decl += gen_struct(name, base, members)
+            self.decl += gen_type_cleanup_decl(name)
+            self._fwdefn += gen_free_members_decl(name)
+            self.defn += gen_free_members(name, base, members)
         else:
             self.decl += gen_struct(name, base, members)
-        self._gen_type_cleanup(name)
+            self._gen_type_cleanup(name)
 
     def visit_alternate_type(self, name, info, variants):
         self._fwdecl += gen_fwd_object_or_array(name)
@@ -279,13 +514,17 @@ class QAPISchemaGenTypeVisitor(QAPISchemaVisitor):
 # do_builtins, enabled by command line option -b.  See also
 # QAPISchemaGenTypeVisitor.visit_end().
 do_builtins = False
+# --slab: see gen_slab_registry()
+slab_mode = False
 
 (input_file, output_dir, do_c, do_h, prefix, opts) = \
-    parse_command_line("b", ["builtins"])
+    parse_command_line("bs", ["builtins", "slab"])
 
 for o, a in opts:
     if o in ("-b", "--builtins"):
         do_builtins = True
+    if o in ("-s", "--slab"):
+        slab_mode = True
 
 c_comment = '''
 /*
@@ -321,6 +560,11 @@ h_comment = '''
                             'qapi-types.c', 'qapi-types.h',
                             c_comment, h_comment)
 
+if slab_mode:
+    fdef.write(mcgen('''
+#include <glib.h>
+'''))
+
 fdef.write(mcgen('''
 #include "qapi/dealloc-visitor.h"
 #include "%(prefix)sqapi-types.h"
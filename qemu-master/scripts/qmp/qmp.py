@@ -171,6 +171,40 @@ class QEMUMonitorProtocol:
             qmp_cmd['id'] = id
         return self.cmd_obj(qmp_cmd)
 
+    def cmd_obj_list(self, qmp_cmds):
+        """
+        Send several QMP commands in one go and wait for all the responses.
+
+        Each command is given an integer id, replacing any it had, so that
+        responses arriving out of order can be matched up.  Responses
+        without an id are taken to answer the oldest command still
+        waiting, as servers that do not echo ids answer in order.
+
+        @param qmp_cmds: list of QMP commands as Python dicts
+        @return list of QMP responses in the order of qmp_cmds; entries are
+                None if the connection was closed before they arrived
+        """
+        resps = [None] * len(qmp_cmds)
+        waiting = range(len(qmp_cmds))
+        data = ''.join([json.dumps(dict(c, id=i))
+                        for i, c in enumerate(qmp_cmds)])
+        try:
+            self.__sock.sendall(data)
+        except socket.error, err:
+            if err[0] == errno.EPIPE:
+                return resps
+            raise socket.error(err)
+        while waiting:
+            resp = self.__json_read()
+            if resp is None:
+                break
+            i = resp.get('id')
+            if i not in waiting:
+                i = waiting[0]
+            waiting.remove(i)
+            resps[i] = resp
+        return resps
+
     def command(self, cmd, **kwds):
         ret = self.cmd(cmd, kwds)
         if ret.has_key('error'):
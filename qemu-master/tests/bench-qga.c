@@ -0,0 +1,344 @@
+/*
+ * qemu-ga request rate, latency and throughput benchmarks
+ *
+ * Every benchmark prints one JSON object per line on stdout, e.g.
+ *
+ *   {"bench": "guest-ping", "requests": 2000, "errors": 0,
+ *    "rate": 18420.3, "p50-us": 51, "p99-us": 97, "max-us": 340}
+ *
+ * File benchmarks also report "chunk" and "mb-per-s".  Latencies are
+ * measured on the client, from sending the request to having parsed the
+ * response, so they include the socket round trip.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include <locale.h>
+#include <glib.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libqtest.h"
+#include "libqga.h"
+#include "qapi/qmp/qjson.h"
+#include "qapi/qmp/qint.h"
+
+typedef struct {
+    const char *name;
+    int64_t *lat;
+    int requests;
+    int errors;
+    int64_t bytes;
+    int64_t elapsed_us;
+} BenchResult;
+
+static int iterations = 1000;
+static int exec_iterations = 100;
+static int file_size_mb = 16;
+static gchar *filter;
+
+static void bench_send(int fd, const char *req, size_t len)
+{
+    ssize_t ret;
+
+    while (len) {
+        ret = write(fd, req, len);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        g_assert_cmpint(ret, >, 0);
+        req += ret;
+        len -= ret;
+    }
+}
+
+/* send the pre-formatted @req and time it, the response or NULL on error */
+static QDict *bench_request(int fd, const char *req, BenchResult *res)
+{
+    int64_t start = g_get_monotonic_time();
+    QDict *rsp;
+
+    bench_send(fd, req, strlen(req));
+    rsp = qmp_fd_receive(fd);
+    g_assert_nonnull(rsp);
+    res->lat[res->requests++] = g_get_monotonic_time() - start;
+    if (qdict_haskey(rsp, "error")) {
+        res->errors++;
+        QDECREF(rsp);
+        return NULL;
+    }
+    return rsp;
+}
+
+static void bench_begin(BenchResult *res, const char *name, int max)
+{
+    memset(res, 0, sizeof(*res));
+    res->name = name;
+    res->lat = g_new(int64_t, max);
+    res->elapsed_us = g_get_monotonic_time();
+}
+
+static int cmp_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static int64_t bench_percentile(BenchResult *res, int pct)
+{
+    int i = (int64_t)res->requests * pct / 100;
+
+    return res->lat[MIN(i, res->requests - 1)];
+}
+
+static void bench_end(BenchResult *res, int64_t chunk)
+{
+    res->elapsed_us = g_get_monotonic_time() - res->elapsed_us;
+    qsort(res->lat, res->requests, sizeof(*res->lat), cmp_int64);
+
+    printf("{\"bench\": \"%s\", \"requests\": %d, \"errors\": %d,"
+           " \"rate\": %.1f", res->name, res->requests, res->errors,
+           res->requests * 1e6 / MAX(res->elapsed_us, 1));
+    if (res->requests) {
+        printf(", \"p50-us\": %" PRId64 ", \"p99-us\": %" PRId64
+               ", \"max-us\": %" PRId64, bench_percentile(res, 50),
+               bench_percentile(res, 99), res->lat[res->requests - 1]);
+    }
+    if (chunk) {
+        printf(", \"chunk\": %" PRId64 ", \"mb-per-s\": %.1f", chunk,
+               res->bytes / (double)MAX(res->elapsed_us, 1));
+    }
+    printf("}\n");
+    fflush(stdout);
+    g_free(res->lat);
+}
+
+static bool bench_wanted(const char *name)
+{
+    return !filter || g_pattern_match_simple(filter, name);
+}
+
+/* commands without arguments, run @iterations times each */
+static const char *simple_commands[] = {
+    "guest-ping",
+    "guest-info",
+    "guest-get-time",
+    "guest-get-vcpus",
+    "guest-get-fsinfo",
+    "guest-get-memory-block-info",
+    "guest-get-memory-status",
+    "guest-get-numa-info",
+    "guest-get-system-info",
+    "guest-get-disk-status",
+    "guest-get-processes",
+    "guest-get-oom-status",
+    "guest-get-cpu-stats",
+    "guest-get-disk-io-stats",
+    "guest-get-network-stats",
+    "guest-get-memory-pressure",
+    "guest-get-top-processes",
+    NULL
+};
+
+static void bench_simple(int fd, const char *command)
+{
+    gchar *req = g_strdup_printf("{\"execute\": \"%s\"}", command);
+    BenchResult res;
+    QDict *rsp;
+    int i;
+
+    bench_begin(&res, command, iterations);
+    for (i = 0; i < iterations; i++) {
+        rsp = bench_request(fd, req, &res);
+        QDECREF(rsp);
+    }
+    bench_end(&res, 0);
+    g_free(req);
+}
+
+static int64_t bench_file_open(int fd, const char *mode)
+{
+    QDict *rsp;
+    int64_t handle;
+
+    rsp = qmp_fd(fd, "{'execute': 'guest-file-open',"
+                 " 'arguments': { 'path': 'foo', 'mode': %s } }", mode);
+    g_assert(!qdict_haskey(rsp, "error"));
+    handle = qdict_get_int(rsp, "return");
+    QDECREF(rsp);
+    return handle;
+}
+
+static void bench_file_close(int fd, int64_t handle)
+{
+    QDict *rsp;
+
+    rsp = qmp_fd(fd, "{'execute': 'guest-file-close',"
+                 " 'arguments': { 'handle': %" PRId64 " } }", handle);
+    g_assert(!qdict_haskey(rsp, "error"));
+    QDECREF(rsp);
+}
+
+/* write, then read back, file_size_mb of data in @chunk sized requests */
+static void bench_file(int fd, int64_t chunk)
+{
+    int count = MAX((int64_t)file_size_mb * 1024 * 1024 / chunk, 1);
+    gchar *wname, *rname, *data, *enc, *req;
+    BenchResult res;
+    int64_t handle;
+    QDict *rsp;
+    int i;
+
+    data = g_malloc(chunk);
+    memset(data, 'x', chunk);
+    enc = g_base64_encode((guchar *)data, chunk);
+    g_free(data);
+
+    wname = g_strdup_printf("guest-file-write-%" PRId64, chunk);
+    rname = g_strdup_printf("guest-file-read-%" PRId64, chunk);
+
+    /* the read benchmark needs the file even if this one is not wanted */
+    if (bench_wanted(wname) || bench_wanted(rname)) {
+        handle = bench_file_open(fd, "w");
+        req = g_strdup_printf("{\"execute\": \"guest-file-write\","
+                              " \"arguments\": {\"handle\": %" PRId64 ","
+                              " \"buf-b64\": \"%s\"}}", handle, enc);
+        bench_begin(&res, wname, count);
+        for (i = 0; i < count; i++) {
+            rsp = bench_request(fd, req, &res);
+            if (rsp) {
+                res.bytes += qdict_get_int(qdict_get_qdict(rsp, "return"),
+                                           "count");
+            }
+            QDECREF(rsp);
+        }
+        if (bench_wanted(wname)) {
+            bench_end(&res, chunk);
+        } else {
+            g_free(res.lat);
+        }
+        g_free(req);
+        bench_file_close(fd, handle);
+    }
+    g_free(enc);
+
+    if (bench_wanted(rname)) {
+        handle = bench_file_open(fd, "r");
+        req = g_strdup_printf("{\"execute\": \"guest-file-read\","
+                              " \"arguments\": {\"handle\": %" PRId64 ","
+                              " \"count\": %" PRId64 "}}", handle, chunk);
+        bench_begin(&res, rname, count);
+        for (i = 0; i < count; i++) {
+            rsp = bench_request(fd, req, &res);
+            if (rsp) {
+                res.bytes += qdict_get_int(qdict_get_qdict(rsp, "return"),
+                                           "count");
+            }
+            QDECREF(rsp);
+        }
+        bench_end(&res, chunk);
+        g_free(req);
+        bench_file_close(fd, handle);
+    }
+    g_free(wname);
+    g_free(rname);
+}
+
+/*
+ * "guest-exec" times the request that spawns /bin/true, "guest-exec-exit"
+ * the time until guest-exec-status first reports it exited.
+ */
+static void bench_exec(int fd)
+{
+    const char *req = "{\"execute\": \"guest-exec\","
+                      " \"arguments\": {\"path\": \"/bin/true\"}}";
+    BenchResult spawn, exited;
+    int64_t pid, start;
+    QDict *rsp, *val;
+    bool done;
+    int i;
+
+    bench_begin(&spawn, "guest-exec", exec_iterations);
+    bench_begin(&exited, "guest-exec-exit", exec_iterations);
+    for (i = 0; i < exec_iterations; i++) {
+        start = g_get_monotonic_time();
+        rsp = bench_request(fd, req, &spawn);
+        if (!rsp) {
+            continue;
+        }
+        pid = qdict_get_int(qdict_get_qdict(rsp, "return"), "pid");
+        QDECREF(rsp);
+
+        do {
+            rsp = qmp_fd(fd, "{'execute': 'guest-exec-status',"
+                         " 'arguments': { 'pid': %" PRId64 " } }", pid);
+            g_assert(!qdict_haskey(rsp, "error"));
+            val = qdict_get_qdict(rsp, "return");
+            done = qdict_get_bool(val, "exited");
+            if (done && qdict_get_try_int(val, "exitcode", 0)) {
+                exited.errors++;
+            }
+            QDECREF(rsp);
+        } while (!done);
+        exited.lat[exited.requests++] = g_get_monotonic_time() - start;
+    }
+    bench_end(&spawn, 0);
+    bench_end(&exited, 0);
+}
+
+static GOptionEntry options[] = {
+    { "iterations", 'n', 0, G_OPTION_ARG_INT, &iterations,
+      "requests per command benchmark (default 1000)", "N" },
+    { "exec-iterations", 'e', 0, G_OPTION_ARG_INT, &exec_iterations,
+      "processes spawned by the guest-exec benchmark (default 100)", "N" },
+    { "file-size", 's', 0, G_OPTION_ARG_INT, &file_size_mb,
+      "MB written and read per file chunk size (default 16)", "MB" },
+    { "bench", 'b', 0, G_OPTION_ARG_STRING, &filter,
+      "only run benchmarks whose name matches PATTERN", "PATTERN" },
+    { NULL }
+};
+
+int main(int argc, char **argv)
+{
+    static const int64_t chunks[] = { 4096, 65536, 1024 * 1024 };
+    GOptionContext *ctx;
+    GError *err = NULL;
+    TestFixture fix;
+    int i;
+
+    setlocale(LC_ALL, "");
+    ctx = g_option_context_new("- benchmark qemu-ga in the current directory");
+    g_option_context_add_main_entries(ctx, options, NULL);
+    if (!g_option_context_parse(ctx, &argc, &argv, &err)) {
+        fprintf(stderr, "%s\n", err->message);
+        return EXIT_FAILURE;
+    }
+    g_option_context_free(ctx);
+    if (iterations <= 0 || exec_iterations <= 0 || file_size_mb <= 0) {
+        fprintf(stderr, "counts and sizes must be positive\n");
+        return EXIT_FAILURE;
+    }
+
+    fixture_setup(&fix, NULL);
+
+    for (i = 0; simple_commands[i]; i++) {
+        if (bench_wanted(simple_commands[i])) {
+            bench_simple(fix.fd, simple_commands[i]);
+        }
+    }
+    for (i = 0; i < G_N_ELEMENTS(chunks); i++) {
+        bench_file(fix.fd, chunks[i]);
+    }
+    if (bench_wanted("guest-exec") || bench_wanted("guest-exec-exit")) {
+        bench_exec(fix.fd);
+    }
+
+    fixture_tear_down(&fix, NULL);
+    g_free(filter);
+    return EXIT_SUCCESS;
+}
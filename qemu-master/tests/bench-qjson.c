@@ -0,0 +1,388 @@
+/*
+ * JSON parser, serializer and QMP visitor benchmarks on qemu-ga payloads
+ *
+ * Every corpus is run through each codec stage, and each stage prints one
+ * JSON object per line on stdout, e.g.
+ *
+ *   {"corpus": "processes-5000", "stage": "qobject-from-json",
+ *    "messages": 12, "bytes": 1203391, "mb-per-s": 81.4,
+ *    "allocs-per-msg": 95012.0}
+ *
+ * Allocations are counted by wrapping the glibc allocator, and reported
+ * as -1 elsewhere.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "qemu-common.h"
+#include "qga-qapi-types.h"
+#include "qga-qapi-visit.h"
+#include "qapi/error.h"
+#include "qapi/qmp/types.h"
+#include "qapi/qmp/qjson.h"
+#include "qapi/qmp/json-parser.h"
+#include "qapi/qmp/json-streamer.h"
+#include "qapi/qmp-input-visitor.h"
+#include "qapi/qmp-output-visitor.h"
+#include "qapi/json-output-visitor.h"
+
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static uint64_t allocs;
+
+void *malloc(size_t size)
+{
+    allocs++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    allocs++;
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    allocs++;
+    return __libc_realloc(ptr, size);
+}
+#define ALLOCS_COUNTED 1
+#else
+static uint64_t allocs;
+#define ALLOCS_COUNTED 0
+#endif
+
+static int min_time_ms = 500;
+static gchar *filter;
+
+/* a QAPI type, how to visit it, and a sample value of it */
+typedef struct {
+    const char *name;
+    void (*visit)(Visitor *v, void **obj, const char *name, Error **errp);
+    void (*free)(void *obj);
+    void *obj;
+} Corpus;
+
+typedef struct {
+    const Corpus *corpus;
+    QObject *qobj;
+    QString *json;
+} Payload;
+
+typedef void (*StageFunc)(Payload *p);
+
+static void stage_report(const char *corpus, const char *stage,
+                         int messages, uint64_t bytes, uint64_t nallocs,
+                         int64_t elapsed_us)
+{
+    printf("{\"corpus\": \"%s\", \"stage\": \"%s\", \"messages\": %d,"
+           " \"bytes\": %" PRIu64 ", \"mb-per-s\": %.1f,"
+           " \"allocs-per-msg\": %.1f}\n",
+           corpus, stage, messages, bytes,
+           bytes / (double)MAX(elapsed_us, 1),
+           ALLOCS_COUNTED ? (double)nallocs / messages : -1.0);
+    fflush(stdout);
+}
+
+/* run @fn until min_time_ms passed, then report it */
+static void stage_run(Payload *p, const char *stage, StageFunc fn)
+{
+    gchar *name = g_strdup_printf("%s/%s", p->corpus->name, stage);
+    int64_t start, elapsed;
+    uint64_t nallocs;
+    int n = 0;
+
+    if (filter && !g_pattern_match_simple(filter, name)) {
+        g_free(name);
+        return;
+    }
+    nallocs = allocs;
+    start = g_get_monotonic_time();
+    do {
+        fn(p);
+        n++;
+        elapsed = g_get_monotonic_time() - start;
+    } while (elapsed < min_time_ms * 1000);
+    nallocs = allocs - nallocs;
+    stage_report(p->corpus->name, stage, n,
+                 (uint64_t)n * qstring_get_length(p->json), nallocs, elapsed);
+    g_free(name);
+}
+
+static void stage_qmp_output(Payload *p)
+{
+    QmpOutputVisitor *qov = qmp_output_visitor_new();
+    void *obj = p->corpus->obj;
+    QObject *ret;
+
+    p->corpus->visit(qmp_output_get_visitor(qov), &obj, "unused",
+                     &error_abort);
+    ret = qmp_output_get_qobject(qov);
+    qmp_output_visitor_cleanup(qov);
+    qobject_decref(ret);
+}
+
+static void stage_json_output(Payload *p)
+{
+    JsonOutputVisitor *jov = json_output_visitor_new();
+    void *obj = p->corpus->obj;
+    QObject *ret;
+
+    p->corpus->visit(json_output_get_visitor(jov), &obj, "unused",
+                     &error_abort);
+    ret = json_output_get_qobject(jov);
+    json_output_visitor_cleanup(jov);
+    qobject_decref(ret);
+}
+
+static void stage_to_json(Payload *p)
+{
+    QString *str = qobject_to_json(p->qobj);
+
+    QDECREF(str);
+}
+
+static void stage_from_json(Payload *p)
+{
+    QObject *obj = qobject_from_json(qstring_get_str(p->json));
+
+    g_assert(obj);
+    qobject_decref(obj);
+}
+
+static void stage_emit(JSONMessageParser *parser, GQueue *tokens)
+{
+    QObject *obj = json_parser_parse(tokens, NULL);
+
+    g_assert(obj);
+    qobject_decref(obj);
+}
+
+/* what the agent does with the bytes read from the channel */
+static void stage_feed(Payload *p)
+{
+    const char *str = qstring_get_str(p->json);
+    size_t len = qstring_get_length(p->json), chunk;
+    JSONMessageParser parser;
+
+    json_message_parser_init(&parser, stage_emit);
+    for (; len; str += chunk, len -= chunk) {
+        chunk = MIN(len, 4096);
+        json_message_parser_feed(&parser, str, chunk);
+    }
+    json_message_parser_destroy(&parser);
+}
+
+static void stage_qmp_input(Payload *p)
+{
+    QmpInputVisitor *qiv = qmp_input_visitor_new_strict(p->qobj);
+    void *obj = NULL;
+
+    p->corpus->visit(qmp_input_get_visitor(qiv), &obj, "unused",
+                     &error_abort);
+    qmp_input_visitor_cleanup(qiv);
+    p->corpus->free(obj);
+}
+
+static void run_corpus(const Corpus *c)
+{
+    QmpOutputVisitor *qov = qmp_output_visitor_new();
+    void *obj = c->obj;
+    Payload p = { .corpus = c };
+
+    c->visit(qmp_output_get_visitor(qov), &obj, "unused", &error_abort);
+    p.qobj = qmp_output_get_qobject(qov);
+    qmp_output_visitor_cleanup(qov);
+    p.json = qobject_to_json(p.qobj);
+
+    stage_run(&p, "qmp-output-visitor", stage_qmp_output);
+    stage_run(&p, "json-output-visitor", stage_json_output);
+    stage_run(&p, "qobject-to-json", stage_to_json);
+    stage_run(&p, "qobject-from-json", stage_from_json);
+    stage_run(&p, "json-message-parser-feed", stage_feed);
+    stage_run(&p, "qmp-input-visitor", stage_qmp_input);
+
+    qobject_decref(p.qobj);
+    QDECREF(p.json);
+}
+
+/*
+ * Lots of small requests, run through the streaming parser one after
+ * another as they would arrive on the channel.
+ */
+static void run_small_requests(int count)
+{
+    GString *buf = g_string_new(NULL);
+    JSONMessageParser parser;
+    int64_t start, elapsed;
+    uint64_t nallocs;
+    int i, n = 0;
+
+    if (filter && !g_pattern_match_simple(filter, "small-requests/"
+                                          "json-message-parser-feed")) {
+        g_string_free(buf, true);
+        return;
+    }
+    for (i = 0; i < count; i++) {
+        g_string_append_printf(buf, "{\"execute\": \"guest-file-read\","
+                               " \"arguments\": {\"handle\": %d,"
+                               " \"count\": 4096}, \"id\": %d}\n", 1000 + i, i);
+    }
+
+    nallocs = allocs;
+    start = g_get_monotonic_time();
+    do {
+        json_message_parser_init(&parser, stage_emit);
+        json_message_parser_feed(&parser, buf->str, buf->len);
+        json_message_parser_destroy(&parser);
+        n++;
+        elapsed = g_get_monotonic_time() - start;
+    } while (elapsed < min_time_ms * 1000);
+    nallocs = allocs - nallocs;
+    stage_report("small-requests", "json-message-parser-feed", n * count,
+                 (uint64_t)n * buf->len, nallocs, elapsed);
+    g_string_free(buf, true);
+}
+
+static GuestFileRead *make_file_read(size_t size)
+{
+    GuestFileRead *r = g_new0(GuestFileRead, 1);
+    guchar *data = g_malloc(size);
+    size_t i;
+
+    for (i = 0; i < size; i++) {
+        data[i] = i * 7;
+    }
+    r->count = size;
+    r->has_buf_b64 = true;
+    r->buf_b64 = g_base64_encode(data, size);
+    g_free(data);
+    return r;
+}
+
+static GuestProcessInfoList *make_processes(int count)
+{
+    GuestProcessInfoList *head = NULL, *e;
+    GuestProcessInfo *info;
+    int i;
+
+    for (i = count; i > 0; i--) {
+        info = g_new0(GuestProcessInfo, 1);
+        info->pid = i;
+        info->comm = g_strdup_printf("kworker/%d:%d", i % 64, i % 3);
+        info->has_state = true;
+        info->state = g_strdup(i % 10 ? "S" : "R");
+        info->rss = (uint64_t)i * 4096 * 37;
+        info->threads = 1 + i % 16;
+        info->utime = (uint64_t)i * 1013;
+        info->stime = (uint64_t)i * 311;
+        info->has_utime_delta = info->has_stime_delta = true;
+        info->utime_delta = i % 100;
+        info->stime_delta = i % 7;
+        e = g_new0(GuestProcessInfoList, 1);
+        e->value = info;
+        e->next = head;
+        head = e;
+    }
+    return head;
+}
+
+static GuestFilesystemInfoList *make_fsinfo(int count)
+{
+    GuestFilesystemInfoList *head = NULL, *e;
+    GuestFilesystemInfo *fs;
+    GuestDiskAddress *addr;
+    int i;
+
+    for (i = count; i > 0; i--) {
+        addr = g_new0(GuestDiskAddress, 1);
+        addr->pci_controller = g_new0(GuestPCIAddress, 1);
+        addr->pci_controller->slot = 4 + i / 8;
+        addr->pci_controller->function = i % 8;
+        addr->bus_type = GUEST_DISK_BUS_TYPE_SCSI;
+        addr->unit = i;
+
+        fs = g_new0(GuestFilesystemInfo, 1);
+        fs->name = g_strdup_printf("sd%c%c1", 'a' + i / 26, 'a' + i % 26);
+        fs->mountpoint = g_strdup_printf("/data/volume%02d", i);
+        fs->type = g_strdup("xfs");
+        fs->disk = g_new0(GuestDiskAddressList, 1);
+        fs->disk->value = addr;
+        fs->has_total_bytes = fs->has_used_bytes = fs->has_avail_bytes = true;
+        fs->total_bytes = (uint64_t)i << 34;
+        fs->used_bytes = fs->total_bytes / 3;
+        fs->avail_bytes = fs->total_bytes - fs->used_bytes;
+        fs->has_total_inodes = fs->has_used_inodes = true;
+        fs->total_inodes = (uint64_t)i << 20;
+        fs->used_inodes = fs->total_inodes / 5;
+
+        e = g_new0(GuestFilesystemInfoList, 1);
+        e->value = fs;
+        e->next = head;
+        head = e;
+    }
+    return head;
+}
+
+static void free_file_read(void *obj)
+{
+    qapi_free_GuestFileRead(obj);
+}
+
+static void free_processes(void *obj)
+{
+    qapi_free_GuestProcessInfoList(obj);
+}
+
+static void free_fsinfo(void *obj)
+{
+    qapi_free_GuestFilesystemInfoList(obj);
+}
+
+static GOptionEntry options[] = {
+    { "min-time", 't', 0, G_OPTION_ARG_INT, &min_time_ms,
+      "run every stage for at least MS milliseconds (default 500)", "MS" },
+    { "bench", 'b', 0, G_OPTION_ARG_STRING, &filter,
+      "only run corpus/stage names matching PATTERN", "PATTERN" },
+    { NULL }
+};
+
+int main(int argc, char **argv)
+{
+    Corpus corpora[] = {
+        { "file-read-16m", (void *)visit_type_GuestFileRead, free_file_read,
+          make_file_read(16 * 1024 * 1024) },
+        { "processes-5000", (void *)visit_type_GuestProcessInfoList,
+          free_processes, make_processes(5000) },
+        { "fsinfo-64", (void *)visit_type_GuestFilesystemInfoList,
+          free_fsinfo, make_fsinfo(64) },
+    };
+    GOptionContext *ctx;
+    GError *err = NULL;
+    int i;
+
+    ctx = g_option_context_new("- benchmark the JSON and QObject codecs");
+    g_option_context_add_main_entries(ctx, options, NULL);
+    if (!g_option_context_parse(ctx, &argc, &argv, &err)) {
+        fprintf(stderr, "%s\n", err->message);
+        return EXIT_FAILURE;
+    }
+    g_option_context_free(ctx);
+
+    run_small_requests(10000);
+    for (i = 0; i < ARRAY_SIZE(corpora); i++) {
+        run_corpus(&corpora[i]);
+        corpora[i].free(corpora[i].obj);
+    }
+    g_free(filter);
+    return EXIT_SUCCESS;
+}
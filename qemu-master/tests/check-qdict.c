@@ -32,8 +32,7 @@ static void qdict_new_test(void)
     g_assert(qdict->base.refcnt == 1);
     g_assert(qobject_type(QOBJECT(qdict)) == QTYPE_QDICT);
 
-    // destroy doesn't exit yet
-    g_free(qdict);
+    QDECREF(qdict);
 }
 
 static void qdict_put_obj_test(void)
@@ -49,15 +48,12 @@ static void qdict_put_obj_test(void)
     qdict_put_obj(qdict, "", QOBJECT(qint_from_int(num)));
 
     g_assert(qdict_size(qdict) == 1);
-    ent = QLIST_FIRST(&qdict->table[12345 % QDICT_BUCKET_MAX]);
+    ent = QLIST_FIRST(&qdict->table[12345 % qdict->buckets]);
+    g_assert(ent->hash == 12345);
     qi = qobject_to_qint(ent->value);
     g_assert(qint_get_int(qi) == num);
 
-    // destroy doesn't exit yet
-    QDECREF(qi);
-    g_free(ent->key);
-    g_free(ent);
-    g_free(qdict);
+    QDECREF(qdict);
 }
 
 static void qdict_destroy_simple_test(void)
@@ -249,6 +245,48 @@ static void qdict_iterapi_test(void)
     QDECREF(tests_dict);
 }
 
+static void qdict_grow_test(void)
+{
+    QDict *small = qdict_new();
+    QDict *grown = qdict_new();
+    const QDictEntry *a, *b;
+    char key[16];
+    int i;
+
+    for (i = 0; i < QDICT_SMALL_MAX * 4; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        if (i < QDICT_SMALL_MAX) {
+            qdict_put(small, key, qint_from_int(i));
+        }
+        qdict_put(grown, key, qint_from_int(i));
+    }
+    g_assert(small->buckets == 1);
+    g_assert(grown->buckets == QDICT_BUCKET_MAX);
+
+    for (i = 0; i < QDICT_SMALL_MAX * 4; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        g_assert(qdict_get_int(grown, key) == i);
+        if (i >= QDICT_SMALL_MAX) {
+            g_assert(!qdict_haskey(small, key));
+            qdict_del(grown, key);
+        }
+    }
+    g_assert(qdict_size(grown) == QDICT_SMALL_MAX);
+
+    /* growing does not change the order of iteration */
+    a = qdict_first(small);
+    b = qdict_first(grown);
+    while (a && b) {
+        g_assert_cmpstr(qdict_entry_key(a), ==, qdict_entry_key(b));
+        a = qdict_next(small, a);
+        b = qdict_next(grown, b);
+    }
+    g_assert(!a && !b);
+
+    QDECREF(small);
+    QDECREF(grown);
+}
+
 static void qdict_flatten_test(void)
 {
     QList *list1 = qlist_new();
@@ -734,6 +772,7 @@ int main(int argc, char **argv)
     g_test_add_func("/public/del", qdict_del_test);
     g_test_add_func("/public/to_qdict", qobject_to_qdict_test);
     g_test_add_func("/public/iterapi", qdict_iterapi_test);
+    g_test_add_func("/public/grow", qdict_grow_test);
     g_test_add_func("/public/flatten", qdict_flatten_test);
     g_test_add_func("/public/array_split", qdict_array_split_test);
     g_test_add_func("/public/array_entries", qdict_array_entries_test);
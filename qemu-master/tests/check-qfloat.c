@@ -32,8 +32,7 @@ static void qfloat_from_double_test(void)
     g_assert(qf->base.refcnt == 1);
     g_assert(qobject_type(QOBJECT(qf)) == QTYPE_QFLOAT);
 
-    // destroy doesn't exit yet
-    g_free(qf);
+    QDECREF(qf);
 }
 
 static void qfloat_destroy_test(void)
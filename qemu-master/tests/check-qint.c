@@ -31,8 +31,7 @@ static void qint_from_int_test(void)
     g_assert(qi->base.refcnt == 1);
     g_assert(qobject_type(QOBJECT(qi)) == QTYPE_QINT);
 
-    // destroy doesn't exit yet
-    g_free(qi);
+    QDECREF(qi);
 }
 
 static void qint_destroy_test(void)
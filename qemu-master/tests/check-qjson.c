@@ -77,6 +77,54 @@ static void escaped_string(void)
     }
 }
 
+/* escapes anywhere in a long string, around the bulk copy of plain runs */
+static void long_escaped_string(void)
+{
+    static const struct {
+        const char *decoded;
+        const char *encoded;
+    } specials[] = {
+        { "\"", "\\\"" },
+        { "\\", "\\\\" },
+        { "\n", "\\n" },
+        { "\x7f", "\\u007F" },
+        { "\xc2\xa2", "\\u00A2" },
+    };
+    char plain[41];
+    int i, pos;
+
+    memset(plain, 'a', sizeof(plain) - 1);
+    plain[sizeof(plain) - 1] = 0;
+
+    for (i = 0; i < ARRAY_SIZE(specials); i++) {
+        for (pos = 0; pos < sizeof(plain); pos++) {
+            char *decoded, *encoded;
+            QString *in, *out;
+            QObject *obj;
+
+            decoded = g_strdup_printf("%.*s%s%s", pos, plain,
+                                      specials[i].decoded, plain + pos);
+            encoded = g_strdup_printf("\"%.*s%s%s\"", pos, plain,
+                                      specials[i].encoded, plain + pos);
+            in = qstring_from_str(decoded);
+            out = qobject_to_json(QOBJECT(in));
+            g_assert_cmpstr(qstring_get_str(out), ==, encoded);
+
+            /* and back, through the lexer and parser */
+            obj = qobject_from_json(encoded);
+            g_assert(obj != NULL);
+            g_assert_cmpstr(qstring_get_str(qobject_to_qstring(obj)), ==,
+                            decoded);
+
+            qobject_decref(obj);
+            QDECREF(out);
+            QDECREF(in);
+            g_free(encoded);
+            g_free(decoded);
+        }
+    }
+}
+
 static void simple_string(void)
 {
     int i;
@@ -1490,6 +1538,7 @@ int main(int argc, char **argv)
 
     g_test_add_func("/literals/string/simple", simple_string);
     g_test_add_func("/literals/string/escaped", escaped_string);
+    g_test_add_func("/literals/string/long_escaped", long_escaped_string);
     g_test_add_func("/literals/string/utf8", utf8_string);
     g_test_add_func("/literals/string/single_quote", single_quote_string);
     g_test_add_func("/literals/string/vararg", vararg_string);
@@ -29,8 +29,7 @@ static void qlist_new_test(void)
     g_assert(qlist->base.refcnt == 1);
     g_assert(qobject_type(QOBJECT(qlist)) == QTYPE_QLIST);
 
-    // destroy doesn't exist yet
-    g_free(qlist);
+    QDECREF(qlist);
 }
 
 static void qlist_append_test(void)
@@ -48,10 +47,7 @@ static void qlist_append_test(void)
     g_assert(entry != NULL);
     g_assert(entry->value == QOBJECT(qi));
 
-    // destroy doesn't exist yet
-    QDECREF(qi);
-    g_free(entry);
-    g_free(qlist);
+    QDECREF(qlist);
 }
 
 static void qobject_to_qlist_test(void)
@@ -62,8 +58,7 @@ static void qobject_to_qlist_test(void)
 
     g_assert(qobject_to_qlist(QOBJECT(qlist)) == qlist);
 
-    // destroy doesn't exist yet
-    g_free(qlist);
+    QDECREF(qlist);
 }
 
 static void qlist_destroy_test(void)
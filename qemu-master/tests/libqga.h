@@ -0,0 +1,50 @@
+/*
+ * Fixture shared by the qemu-ga tests and benchmarks
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#ifndef LIBQGA_H
+#define LIBQGA_H
+
+#include <glib.h>
+
+typedef struct {
+    char *test_dir;
+    GMainLoop *loop;
+    int fd;
+    GPid pid;
+} TestFixture;
+
+/**
+ * connect_qga:
+ * @path: the unix socket qemu-ga listens on
+ *
+ * Connect to @path, retrying for up to ten seconds while qemu-ga starts.
+ *
+ * Returns: the connected socket, or -1.
+ */
+int connect_qga(char *path);
+
+/**
+ * fixture_setup:
+ * @fixture: the fixture to fill in
+ * @data: extra qemu-ga command line arguments, or NULL
+ *
+ * Spawn ./qemu-ga listening on a unix socket in a fresh temporary
+ * directory, which is also its state directory, and connect to it.
+ * If QTEST_QGA_WRAPPER is set, its words come first on the command line,
+ * e.g. to run the agent under valgrind.
+ */
+void fixture_setup(TestFixture *fixture, gconstpointer data);
+
+/**
+ * fixture_tear_down:
+ * @fixture: the fixture set up by fixture_setup()
+ * @data: unused
+ *
+ * Stop qemu-ga, check that it exited cleanly and remove the directory.
+ */
+void fixture_tear_down(TestFixture *fixture, gconstpointer data);
+
+#endif
@@ -0,0 +1,423 @@
+/*
+ * qemu-ga multi-agent load generator
+ *
+ * Drives --agents fresh agents from the current directory, or the agents
+ * listening on the --connect sockets, from one thread, the way a host
+ * side collector drives many guests.  Each agent gets --rate requests a
+ * second, picked from --mix, for --duration seconds; with --rate 0 each
+ * agent gets its next request once the last one is answered.  At the end
+ * one JSON object is printed per command and one for all of them:
+ *
+ *   {"load": "guest-get-time", "requests": 9001, "errors": 0,
+ *    "rate": 300.0, "p50-us": 88, "p99-us": 410, "p999-us": 1290,
+ *    "max-us": 2210}
+ *   {"load": "total", "agents": 64, "requests": 384013, ...,
+ *    "missed": 0, "cpu-us-per-request": 31.4}
+ *
+ * At a fixed rate latencies are measured from when a request was due
+ * rather than from when it went out, so an agent that falls behind shows
+ * in them instead of just slowing the generator down.  No more than
+ * --window requests are outstanding per agent; the ones that were due
+ * past that are counted as "missed" and not sent.
+ *
+ * The CPU cost is what /proc/<pid>/stat says the agents used over the run,
+ * divided by the requests they answered.  The agents' pids come from
+ * SO_PEERCRED, so this works for --connect as long as they run on the
+ * same host.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include <locale.h>
+#include <glib.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "libqtest.h"
+#include "libqga.h"
+#include "qapi/qmp/json-parser.h"
+#include "qapi/qmp/json-streamer.h"
+#include "qapi/qmp/qjson.h"
+#include "qapi/qmp/qint.h"
+
+#define LOAD_MIX_DEFAULT \
+    "guest-ping=30,guest-get-time=20,guest-info=5,guest-get-vcpus=10," \
+    "guest-get-memory-status=10,guest-get-cpu-stats=10," \
+    "guest-get-network-stats=5,guest-get-fsinfo=5,guest-get-disk-status=5"
+
+typedef struct {
+    char *command;
+    char *req;                  /* the request but for its id */
+    int weight;
+    GArray *lat;
+    int errors;
+} LoadOp;
+
+typedef struct {
+    LoadOp *op;
+    int64_t due;                /* when it was due, or sent */
+} LoadPending;
+
+typedef struct {
+    TestFixture fix;            /* if spawned */
+    bool spawned;
+    int fd;
+    pid_t pid;                  /* of the agent, or 0 if unknown */
+    int64_t cpu_ticks;          /* at the start */
+    JSONMessageParser parser;
+    GHashTable *pending;        /* id -> LoadPending */
+    int64_t next_id;
+    int64_t next_due;
+} LoadConn;
+
+static int agents = 1;
+static gchar **connect_paths;
+static double rate = 100;
+static int duration = 10;
+static int window = 32;
+static gchar *mix;
+
+static LoadOp *ops;
+static int nops, total_weight;
+static GRand *mix_rand;
+static int64_t answered, missed;
+
+/* utime + stime of @pid, -1 if it cannot be read */
+static int64_t load_cpu_ticks(pid_t pid)
+{
+    gchar *path, *contents, *p;
+    unsigned long long utime, stime;
+    int64_t ret = -1;
+
+    if (!pid) {
+        return -1;
+    }
+    path = g_strdup_printf("/proc/%d/stat", pid);
+    if (g_file_get_contents(path, &contents, NULL, NULL)) {
+        /* skip the command name, which may contain anything */
+        p = strrchr(contents, ')');
+        if (p && sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u"
+                        " %llu %llu", &utime, &stime) == 2) {
+            ret = utime + stime;
+        }
+        g_free(contents);
+    }
+    g_free(path);
+    return ret;
+}
+
+static void load_parse_mix(void)
+{
+    gchar **items;
+    char *eq;
+    int i;
+
+    items = g_strsplit(mix ?: LOAD_MIX_DEFAULT, ",", -1);
+    nops = g_strv_length(items);
+    ops = g_new0(LoadOp, nops);
+    for (i = 0; i < nops; i++) {
+        eq = strchr(items[i], '=');
+        ops[i].weight = eq ? atoi(eq + 1) : 1;
+        if (eq) {
+            *eq = '\0';
+        }
+        if (!*items[i] || ops[i].weight <= 0) {
+            fprintf(stderr, "bad --mix entry '%s'\n", items[i]);
+            exit(EXIT_FAILURE);
+        }
+        ops[i].command = g_strdup(items[i]);
+        ops[i].req = g_strdup_printf("{\"execute\": \"%s\", \"id\": ",
+                                     items[i]);
+        ops[i].lat = g_array_new(false, false, sizeof(int64_t));
+        total_weight += ops[i].weight;
+    }
+    g_strfreev(items);
+}
+
+static void load_response(JSONMessageParser *parser, GQueue *tokens)
+{
+    LoadConn *c = container_of(parser, LoadConn, parser);
+    LoadPending *p;
+    QObject *obj;
+    QDict *rsp;
+    int64_t id, lat;
+
+    obj = json_parser_parse(tokens, NULL);
+    g_assert(obj && qobject_type(obj) == QTYPE_QDICT);
+    rsp = qobject_to_qdict(obj);
+    if (!qdict_haskey(rsp, "id")) {
+        /* an event */
+        QDECREF(rsp);
+        return;
+    }
+    id = qdict_get_int(rsp, "id");
+    p = g_hash_table_lookup(c->pending, &id);
+    g_assert(p);
+
+    lat = g_get_monotonic_time() - p->due;
+    g_array_append_val(p->op->lat, lat);
+    p->op->errors += qdict_haskey(rsp, "error");
+    answered++;
+    g_hash_table_remove(c->pending, &id);
+    QDECREF(rsp);
+}
+
+static void load_send(LoadConn *c, int64_t due)
+{
+    LoadPending *p = g_new(LoadPending, 1);
+    int64_t *key = g_new(int64_t, 1);
+    int pick = g_rand_int_range(mix_rand, 0, total_weight);
+    gchar *req;
+    size_t len, off = 0;
+    ssize_t ret;
+
+    for (p->op = ops; pick >= p->op->weight; p->op++) {
+        pick -= p->op->weight;
+    }
+    p->due = due;
+    *key = c->next_id++;
+    g_hash_table_insert(c->pending, key, p);
+
+    req = g_strdup_printf("%s%" PRId64 "}", p->op->req, *key);
+    len = strlen(req);
+    while (off < len) {
+        ret = write(c->fd, req + off, len - off);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        g_assert_cmpint(ret, >, 0);
+        off += ret;
+    }
+    g_free(req);
+}
+
+static void load_receive(LoadConn *c)
+{
+    char buf[4096];
+    ssize_t len;
+
+    len = read(c->fd, buf, sizeof(buf));
+    if (len < 0 && errno == EINTR) {
+        return;
+    }
+    if (len <= 0) {
+        fprintf(stderr, "agent %d went away\n", c->pid);
+        exit(EXIT_FAILURE);
+    }
+    json_message_parser_feed(&c->parser, buf, len);
+}
+
+static void load_conn_init(LoadConn *c, const char *path)
+{
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    if (path) {
+        c->fd = connect_qga((char *)path);
+        if (c->fd == -1) {
+            fprintf(stderr, "cannot connect to %s\n", path);
+            exit(EXIT_FAILURE);
+        }
+    } else {
+        fixture_setup(&c->fix, NULL);
+        c->spawned = true;
+        c->fd = c->fix.fd;
+    }
+    if (!getsockopt(c->fd, SOL_SOCKET, SO_PEERCRED, &cred, &len)) {
+        c->pid = cred.pid;
+    }
+    json_message_parser_init(&c->parser, load_response);
+    c->pending = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+                                       g_free, g_free);
+}
+
+static int cmp_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* in tenths of a percent */
+static int64_t load_percentile(GArray *lat, int permille)
+{
+    guint i = (int64_t)lat->len * permille / 1000;
+
+    return g_array_index(lat, int64_t, MIN(i, lat->len - 1));
+}
+
+static void load_report(const char *name, GArray *lat, int errors,
+                        int64_t elapsed_us, const char *extra)
+{
+    printf("{\"load\": \"%s\"%s, \"requests\": %u, \"errors\": %d,"
+           " \"rate\": %.1f", name, extra, lat->len, errors,
+           lat->len * 1e6 / MAX(elapsed_us, 1));
+    if (lat->len) {
+        g_array_sort(lat, cmp_int64);
+        printf(", \"p50-us\": %" PRId64 ", \"p99-us\": %" PRId64
+               ", \"p999-us\": %" PRId64 ", \"max-us\": %" PRId64,
+               load_percentile(lat, 500), load_percentile(lat, 990),
+               load_percentile(lat, 999),
+               g_array_index(lat, int64_t, lat->len - 1));
+    }
+}
+
+static GOptionEntry options[] = {
+    { "agents", 'n', 0, G_OPTION_ARG_INT, &agents,
+      "agents to spawn (default 1)", "N" },
+    { "connect", 'c', 0, G_OPTION_ARG_FILENAME_ARRAY, &connect_paths,
+      "drive the agent on this unix socket instead, may be repeated",
+      "PATH" },
+    { "rate", 'r', 0, G_OPTION_ARG_DOUBLE, &rate,
+      "requests per second per agent, 0 for one at a time (default 100)",
+      "R" },
+    { "duration", 'd', 0, G_OPTION_ARG_INT, &duration,
+      "seconds to run (default 10)", "S" },
+    { "window", 'w', 0, G_OPTION_ARG_INT, &window,
+      "requests outstanding per agent at most (default 32)", "N" },
+    { "mix", 'm', 0, G_OPTION_ARG_STRING, &mix,
+      "commands to send and their weights, as command=weight,...", "MIX" },
+    { NULL }
+};
+
+int main(int argc, char **argv)
+{
+    GOptionContext *ctx;
+    GError *err = NULL;
+    LoadConn *conns;
+    struct pollfd *pfds;
+    GArray *all;
+    int64_t start, end, now, interval, timeout, ticks, cpu_ticks = 0;
+    bool cpu_known = true;
+    gchar *extra;
+    int n, i, j;
+
+    setlocale(LC_ALL, "");
+    ctx = g_option_context_new("- drive many qemu-ga at once");
+    g_option_context_add_main_entries(ctx, options, NULL);
+    if (!g_option_context_parse(ctx, &argc, &argv, &err)) {
+        fprintf(stderr, "%s\n", err->message);
+        return EXIT_FAILURE;
+    }
+    g_option_context_free(ctx);
+    n = connect_paths ? g_strv_length(connect_paths) : agents;
+    if (n <= 0 || rate < 0 || duration <= 0 || window <= 0) {
+        fprintf(stderr, "need at least one agent, a rate of at least 0 and"
+                " a positive duration and window\n");
+        return EXIT_FAILURE;
+    }
+    load_parse_mix();
+    mix_rand = g_rand_new_with_seed(1);
+    interval = rate ? (int64_t)(G_USEC_PER_SEC / rate) : 0;
+
+    conns = g_new0(LoadConn, n);
+    pfds = g_new0(struct pollfd, n);
+    for (i = 0; i < n; i++) {
+        load_conn_init(&conns[i], connect_paths ? connect_paths[i] : NULL);
+        pfds[i].fd = conns[i].fd;
+        pfds[i].events = POLLIN;
+    }
+
+    start = g_get_monotonic_time();
+    for (i = 0; i < n; i++) {
+        conns[i].cpu_ticks = load_cpu_ticks(conns[i].pid);
+        /* spread the agents over the first interval */
+        conns[i].next_due = start + interval * i / n;
+    }
+    end = start + (int64_t)duration * G_USEC_PER_SEC;
+
+    while ((now = g_get_monotonic_time()) < end) {
+        timeout = end - now;
+        for (i = 0; i < n; i++) {
+            LoadConn *c = &conns[i];
+
+            if (!interval) {
+                if (!g_hash_table_size(c->pending)) {
+                    load_send(c, now);
+                }
+                continue;
+            }
+            while (c->next_due <= now) {
+                if (g_hash_table_size(c->pending) < window) {
+                    load_send(c, c->next_due);
+                } else {
+                    missed++;
+                }
+                c->next_due += interval;
+            }
+            timeout = MIN(timeout, c->next_due - now);
+        }
+        if (poll(pfds, n, (timeout + 999) / 1000) < 0) {
+            g_assert_cmpint(errno, ==, EINTR);
+            continue;
+        }
+        for (i = 0; i < n; i++) {
+            if (pfds[i].revents) {
+                load_receive(&conns[i]);
+            }
+        }
+    }
+    /* let what is outstanding come back */
+    for (i = 0; i < n; i++) {
+        while (g_hash_table_size(conns[i].pending)) {
+            load_receive(&conns[i]);
+        }
+    }
+    now = g_get_monotonic_time();
+
+    for (i = 0; i < n; i++) {
+        ticks = load_cpu_ticks(conns[i].pid);
+        if (ticks == -1 || conns[i].cpu_ticks == -1) {
+            cpu_known = false;
+        }
+        cpu_ticks += ticks - conns[i].cpu_ticks;
+    }
+
+    all = g_array_new(false, false, sizeof(int64_t));
+    j = 0;
+    for (i = 0; i < nops; i++) {
+        g_array_append_vals(all, ops[i].lat->data, ops[i].lat->len);
+        j += ops[i].errors;
+        load_report(ops[i].command, ops[i].lat, ops[i].errors, now - start,
+                    "");
+        printf("}\n");
+    }
+    extra = g_strdup_printf(", \"agents\": %d", n);
+    load_report("total", all, j, now - start, extra);
+    g_free(extra);
+    printf(", \"missed\": %" PRId64, missed);
+    if (cpu_known && answered) {
+        printf(", \"cpu-us-per-request\": %.1f",
+               cpu_ticks * 1e6 / sysconf(_SC_CLK_TCK) / answered);
+    }
+    printf("}\n");
+    fflush(stdout);
+
+    for (i = 0; i < n; i++) {
+        json_message_parser_destroy(&conns[i].parser);
+        g_hash_table_destroy(conns[i].pending);
+        if (conns[i].spawned) {
+            fixture_tear_down(&conns[i].fix, NULL);
+        } else {
+            close(conns[i].fd);
+        }
+    }
+    for (i = 0; i < nops; i++) {
+        g_free(ops[i].command);
+        g_free(ops[i].req);
+        g_array_free(ops[i].lat, true);
+    }
+    g_free(ops);
+    g_array_free(all, true);
+    g_free(pfds);
+    g_free(conns);
+    g_rand_free(mix_rand);
+    g_strfreev(connect_paths);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,421 @@
+/*
+ * qemu-ga traffic replay
+ *
+ * Sends the requests of a capture, as written by qemu-ga --capture, to a
+ * fresh agent in the current directory, at the pace they were captured
+ * at or --speed times faster, and prints the latencies one JSON object
+ * per command and one for all of them:
+ *
+ *   {"replay": "guest-get-fsinfo", "requests": 120, "errors": 0,
+ *    "p50-us": 310, "p90-us": 402, "p99-us": 1210, "max-us": 1870}
+ *   {"replay": "total", "requests": 4210, "errors": 3, "skipped": 12,
+ *    "elapsed-s": 60.2, "p50-us": 57, ...}
+ *
+ * With --speed 0 every request is sent once the one before is answered.
+ * The sessions of the capture all go over one connection.  Requests that
+ * came with an attachment are skipped, and so are those --skip matches:
+ * by default the ones that change the system the test runs on, run
+ * programs or stream; --skip '' replays everything.  guest-file-open
+ * handles are mapped to those the agent hands out this time round, by
+ * pairing requests with responses in the order of the capture; other
+ * handles and pids are sent as they were, and most likely fail.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include <locale.h>
+#include <glib.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libqtest.h"
+#include "libqga.h"
+#include "qapi/qmp/qjson.h"
+#include "qapi/qmp/qint.h"
+
+#define REPLAY_SKIP_DEFAULT \
+    "guest-sync-delimited,guest-set-*,guest-sync-time,guest-upgrade-agent," \
+    "guest-shutdown,guest-suspend-*,guest-fsfreeze-*,guest-fstrim*," \
+    "guest-provision,guest-ssh-*,guest-reclaim-memory,guest-exec*," \
+    "guest-file-pull,guest-file-push*,guest-file-stream-*,guest-log-follow"
+
+typedef struct {
+    int64_t t;                  /* us into the capture */
+    QDict *msg;
+    const char *command;
+    int64_t handle;             /* guest-file-open returned it, or -1 */
+} ReplayRequest;
+
+typedef struct {
+    const ReplayRequest *req;
+    char *id;                   /* as JSON, or NULL */
+    int64_t sent;
+} ReplayPending;
+
+typedef struct {
+    GArray *lat;
+    int errors;
+} ReplayStats;
+
+static double speed = 1.0;
+static gchar *skip = NULL;
+static int only_session;
+
+static GPtrArray *requests;     /* of ReplayRequest */
+static int skipped;
+static GQueue pending;          /* of ReplayPending, oldest first */
+static GHashTable *handles;     /* captured handle -> this one */
+static GHashTable *stats;       /* command -> ReplayStats */
+static ReplayStats total;
+
+static bool replay_skip(const char *command, gchar **patterns)
+{
+    int i;
+
+    for (i = 0; patterns[i]; i++) {
+        if (*patterns[i] && g_pattern_match_simple(patterns[i], command)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* the "in" records of @path, with the handles guest-file-open returned */
+static void replay_load(const char *path)
+{
+    GHashTable *unanswered;     /* session -> GQueue of ReplayRequest */
+    gchar **lines, **patterns;
+    GError *err = NULL;
+    gchar *contents;
+    ReplayRequest *r;
+    QObject *obj;
+    QDict *rec, *msg;
+    GQueue *q;
+    const char *dir, *command;
+    int64_t session;
+    int i;
+
+    if (!g_file_get_contents(path, &contents, NULL, &err)) {
+        fprintf(stderr, "%s\n", err->message);
+        exit(EXIT_FAILURE);
+    }
+    patterns = g_strsplit(skip ?: REPLAY_SKIP_DEFAULT, ",", -1);
+    unanswered = g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free,
+                                       (GDestroyNotify)g_queue_free);
+    requests = g_ptr_array_new();
+
+    lines = g_strsplit(contents, "\n", -1);
+    g_free(contents);
+    for (i = 0; lines[i]; i++) {
+        if (!*lines[i]) {
+            continue;
+        }
+        obj = qobject_from_json(lines[i]);
+        if (!obj || qobject_type(obj) != QTYPE_QDICT) {
+            fprintf(stderr, "%s:%d: not a capture record\n", path, i + 1);
+            exit(EXIT_FAILURE);
+        }
+        rec = qobject_to_qdict(obj);
+        dir = qdict_get_try_str(rec, "d");
+        msg = qdict_get_qdict(rec, "msg");
+        session = qdict_get_try_int(rec, "s", 0);
+        if (!dir || !msg ||
+            (only_session && session != only_session)) {
+            QDECREF(rec);
+            continue;
+        }
+
+        q = g_hash_table_lookup(unanswered, &session);
+        if (!q) {
+            q = g_queue_new();
+            g_hash_table_insert(unanswered, g_memdup(&session,
+                                                     sizeof(session)), q);
+        }
+        if (!strcmp(dir, "out")) {
+            /* the response to the oldest request, unless an event */
+            if (qdict_haskey(msg, "return") || qdict_haskey(msg, "error")) {
+                r = g_queue_pop_head(q);
+                if (r && !strcmp(r->command, "guest-file-open") &&
+                    qdict_haskey(msg, "return")) {
+                    r->handle = qdict_get_int(msg, "return");
+                }
+            }
+            QDECREF(rec);
+            continue;
+        }
+
+        command = qdict_get_try_str(msg, "execute");
+        if (!command) {
+            QDECREF(rec);
+            continue;
+        }
+        r = g_new0(ReplayRequest, 1);
+        r->t = qdict_get_try_int(rec, "t", 0);
+        r->msg = msg;
+        QINCREF(msg);
+        r->command = command;
+        r->handle = -1;
+        g_queue_push_tail(q, r);
+        if (qdict_haskey(rec, "attachment") ||
+            replay_skip(command, patterns)) {
+            skipped++;
+        } else {
+            g_ptr_array_add(requests, r);
+        }
+        QDECREF(rec);
+    }
+    g_strfreev(lines);
+    g_strfreev(patterns);
+    g_hash_table_destroy(unanswered);
+}
+
+static void replay_send(int fd, const ReplayRequest *r)
+{
+    ReplayPending *p = g_new0(ReplayPending, 1);
+    QDict *args = qdict_get_qdict(r->msg, "arguments");
+    QString *json;
+    gpointer mapped;
+    const char *buf;
+    size_t len;
+    ssize_t ret;
+
+    if (args &&
+        g_hash_table_lookup_extended(handles, GINT_TO_POINTER(
+                                         qdict_get_try_int(args, "handle",
+                                                           -1)),
+                                     NULL, &mapped)) {
+        qdict_put(args, "handle", qint_from_int(GPOINTER_TO_INT(mapped)));
+    }
+    if (qdict_haskey(r->msg, "id")) {
+        json = qobject_to_json(qdict_get(r->msg, "id"));
+        p->id = g_strdup(qstring_get_str(json));
+        QDECREF(json);
+    }
+    p->req = r;
+    p->sent = g_get_monotonic_time();
+    g_queue_push_tail(&pending, p);
+
+    json = qobject_to_json(QOBJECT(r->msg));
+    buf = qstring_get_str(json);
+    len = qstring_get_length(json);
+    while (len) {
+        ret = write(fd, buf, len);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        g_assert_cmpint(ret, >, 0);
+        buf += ret;
+        len -= ret;
+    }
+    QDECREF(json);
+}
+
+static void replay_account(ReplayStats *st, int64_t lat, bool error)
+{
+    if (!st->lat) {
+        st->lat = g_array_new(false, false, sizeof(int64_t));
+    }
+    g_array_append_val(st->lat, lat);
+    st->errors += error;
+}
+
+/* read one message and account for the request it answers */
+static void replay_receive(int fd)
+{
+    QDict *rsp = qmp_fd_receive(fd);
+    ReplayPending *p = NULL;
+    ReplayStats *st;
+    QString *json;
+    GList *l;
+    int64_t lat;
+    bool error;
+
+    g_assert_nonnull(rsp);
+    if (qdict_haskey(rsp, "event")) {
+        QDECREF(rsp);
+        return;
+    }
+    if (qdict_haskey(rsp, "id")) {
+        json = qobject_to_json(qdict_get(rsp, "id"));
+        for (l = pending.head; l; l = l->next) {
+            ReplayPending *cand = l->data;
+
+            if (cand->id && !strcmp(cand->id, qstring_get_str(json))) {
+                p = cand;
+                break;
+            }
+        }
+        QDECREF(json);
+    } else {
+        for (l = pending.head; l; l = l->next) {
+            if (!((ReplayPending *)l->data)->id) {
+                p = l->data;
+                break;
+            }
+        }
+    }
+    if (!p) {
+        fprintf(stderr, "unexpected response\n");
+        exit(EXIT_FAILURE);
+    }
+    g_queue_delete_link(&pending, l);
+
+    lat = g_get_monotonic_time() - p->sent;
+    error = qdict_haskey(rsp, "error");
+    if (!error && p->req->handle != -1) {
+        g_hash_table_insert(handles, GINT_TO_POINTER(p->req->handle),
+                            GINT_TO_POINTER(qdict_get_int(rsp, "return")));
+    }
+    st = g_hash_table_lookup(stats, p->req->command);
+    if (!st) {
+        st = g_new0(ReplayStats, 1);
+        g_hash_table_insert(stats, (gpointer)p->req->command, st);
+    }
+    replay_account(st, lat, error);
+    replay_account(&total, lat, error);
+    g_free(p->id);
+    g_free(p);
+    QDECREF(rsp);
+}
+
+/* wait until @until, taking in responses, or for one response if -1 */
+static void replay_wait(int fd, int64_t until)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    int64_t now;
+    int ret;
+
+    for (;;) {
+        now = g_get_monotonic_time();
+        if (until != -1 && now >= until) {
+            return;
+        }
+        ret = poll(&pfd, 1, until == -1 ? -1 : (until - now + 999) / 1000);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        g_assert_cmpint(ret, >=, 0);
+        if (ret) {
+            replay_receive(fd);
+            if (until == -1) {
+                return;
+            }
+        }
+    }
+}
+
+static int cmp_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static int64_t replay_percentile(GArray *lat, int pct)
+{
+    guint i = (int64_t)lat->len * pct / 100;
+
+    return g_array_index(lat, int64_t, MIN(i, lat->len - 1));
+}
+
+static void replay_report(const char *name, ReplayStats *st,
+                          const char *extra)
+{
+    guint n = st->lat ? st->lat->len : 0;
+
+    printf("{\"replay\": \"%s\", \"requests\": %u, \"errors\": %d%s",
+           name, n, st->errors, extra);
+    if (n) {
+        g_array_sort(st->lat, cmp_int64);
+        printf(", \"p50-us\": %" PRId64 ", \"p90-us\": %" PRId64
+               ", \"p99-us\": %" PRId64 ", \"max-us\": %" PRId64,
+               replay_percentile(st->lat, 50), replay_percentile(st->lat, 90),
+               replay_percentile(st->lat, 99),
+               g_array_index(st->lat, int64_t, n - 1));
+        g_array_free(st->lat, true);
+    }
+    printf("}\n");
+}
+
+static GOptionEntry options[] = {
+    { "speed", 'x', 0, G_OPTION_ARG_DOUBLE, &speed,
+      "how many times faster than captured, 0 for back to back"
+      " (default 1)", "X" },
+    { "skip", 0, 0, G_OPTION_ARG_STRING, &skip,
+      "comma separated patterns of commands not to send (default: those"
+      " that change the system, run programs or stream)", "PATTERNS" },
+    { "session", 0, 0, G_OPTION_ARG_INT, &only_session,
+      "replay only this session of the capture (default all)", "N" },
+    { NULL }
+};
+
+int main(int argc, char **argv)
+{
+    GOptionContext *ctx;
+    GError *err = NULL;
+    TestFixture fix;
+    GList *names, *l;
+    const ReplayRequest *r;
+    int64_t start, t0;
+    gchar *extra;
+    guint i;
+
+    setlocale(LC_ALL, "");
+    ctx = g_option_context_new("CAPTURE - replay a qemu-ga capture to the"
+                               " qemu-ga in the current directory");
+    g_option_context_add_main_entries(ctx, options, NULL);
+    if (!g_option_context_parse(ctx, &argc, &argv, &err)) {
+        fprintf(stderr, "%s\n", err->message);
+        return EXIT_FAILURE;
+    }
+    g_option_context_free(ctx);
+    if (argc != 2 || speed < 0) {
+        fprintf(stderr, "need one capture file and a speed of at least 0\n");
+        return EXIT_FAILURE;
+    }
+
+    replay_load(argv[1]);
+    g_queue_init(&pending);
+    handles = g_hash_table_new(NULL, NULL);
+    stats = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, g_free);
+
+    fixture_setup(&fix, NULL);
+    start = g_get_monotonic_time();
+    t0 = requests->len ? ((ReplayRequest *)requests->pdata[0])->t : 0;
+    for (i = 0; i < requests->len; i++) {
+        r = requests->pdata[i];
+        if (speed) {
+            replay_wait(fix.fd, start + (int64_t)((r->t - t0) / speed));
+        } else {
+            while (pending.length) {
+                replay_wait(fix.fd, -1);
+            }
+        }
+        replay_send(fix.fd, r);
+    }
+    while (pending.length) {
+        replay_wait(fix.fd, -1);
+    }
+
+    names = g_list_sort(g_hash_table_get_keys(stats),
+                        (GCompareFunc)strcmp);
+    for (l = names; l; l = l->next) {
+        replay_report(l->data, g_hash_table_lookup(stats, l->data), "");
+    }
+    g_list_free(names);
+    extra = g_strdup_printf(", \"skipped\": %d, \"elapsed-s\": %.1f",
+                            skipped, (g_get_monotonic_time() - start) / 1e6);
+    replay_report("total", &total, extra);
+    g_free(extra);
+    fflush(stdout);
+
+    fixture_tear_down(&fix, NULL);
+    g_hash_table_destroy(stats);
+    g_hash_table_destroy(handles);
+    return EXIT_SUCCESS;
+}
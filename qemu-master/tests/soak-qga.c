@@ -0,0 +1,317 @@
+/*
+ * qemu-ga long-run soak test
+ *
+ * Sends a long stream of mixed requests to one agent and samples what it
+ * holds every --interval requests, printing one JSON object per line:
+ *
+ *   {"soak": "sample", "requests": 200000, "elapsed-s": 41.2,
+ *    "rss": 6455296, "heap": 1180432, "open-fds": 9}
+ *
+ * The first sample after --warmup requests is the baseline, so that caches
+ * the agent fills on first use do not count as growth.  At the end the
+ * smallest of the last three samples of each value is compared with the
+ * baseline, and the test fails if it grew by more than its budget.  That
+ * also fails if the agent does not exit cleanly, which is how the leak
+ * checkers report: run the agent under valgrind with
+ * QTEST_QGA_WRAPPER (make soak-qga-valgrind), or build it with
+ * --extra-cflags=-fsanitize=address --extra-ldflags=-fsanitize=address
+ * and run make soak-qga.  "heap" is what malloc counts, so it stays flat
+ * under either; RSS and file descriptors still apply.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include <locale.h>
+#include <glib.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libqtest.h"
+#include "libqga.h"
+#include "qapi/qmp/qjson.h"
+#include "qapi/qmp/qint.h"
+
+typedef struct {
+    int64_t requests;
+    int64_t rss;
+    int64_t heap;
+    int64_t open_fds;
+} SoakSample;
+
+static int64_t requests = 1000000;
+static int64_t interval = 10000;
+static int64_t warmup = 50000;
+static int64_t rss_budget_kb = 4096;
+static int64_t heap_budget_kb = 1024;
+static int open_fds_budget;
+static int seed = 1;
+
+static int64_t sent;
+static int64_t errors;
+
+/* send @req, the response, counting error responses */
+static QDict *soak_request(int fd, const char *req)
+{
+    QDict *rsp;
+
+    rsp = qmp_fd(fd, req);
+    g_assert_nonnull(rsp);
+    sent++;
+    if (qdict_haskey(rsp, "error")) {
+        errors++;
+    }
+    return rsp;
+}
+
+static void soak_simple(int fd, const char *req)
+{
+    QDECREF(soak_request(fd, req));
+}
+
+/* open, write, read back and close a file */
+static void soak_file(int fd)
+{
+    QDict *rsp;
+    int64_t handle;
+
+    rsp = soak_request(fd, "{'execute': 'guest-file-open',"
+                       " 'arguments': { 'path': 'foo', 'mode': 'w+' } }");
+    g_assert(!qdict_haskey(rsp, "error"));
+    handle = qdict_get_int(rsp, "return");
+    QDECREF(rsp);
+
+    rsp = qmp_fd(fd, "{'execute': 'guest-file-write',"
+                 " 'arguments': { 'handle': %" PRId64 ","
+                 " 'buf-b64': 'aGVsbG8gd29ybGQK' } }", handle);
+    sent++;
+    g_assert(!qdict_haskey(rsp, "error"));
+    QDECREF(rsp);
+    rsp = qmp_fd(fd, "{'execute': 'guest-file-seek',"
+                 " 'arguments': { 'handle': %" PRId64 ","
+                 " 'offset': 0, 'whence': 0 } }", handle);
+    sent++;
+    g_assert(!qdict_haskey(rsp, "error"));
+    QDECREF(rsp);
+    rsp = qmp_fd(fd, "{'execute': 'guest-file-read',"
+                 " 'arguments': { 'handle': %" PRId64 " } }", handle);
+    sent++;
+    g_assert(!qdict_haskey(rsp, "error"));
+    QDECREF(rsp);
+    rsp = qmp_fd(fd, "{'execute': 'guest-file-close',"
+                 " 'arguments': { 'handle': %" PRId64 " } }", handle);
+    sent++;
+    g_assert(!qdict_haskey(rsp, "error"));
+    QDECREF(rsp);
+}
+
+/* run /bin/echo with its output captured and poll until it is reaped */
+static void soak_exec(int fd)
+{
+    QDict *rsp;
+    int64_t pid;
+    bool exited;
+
+    rsp = soak_request(fd, "{'execute': 'guest-exec',"
+                       " 'arguments': { 'path': '/bin/echo',"
+                       " 'arg': [ 'soak' ], 'capture-output': true } }");
+    g_assert(!qdict_haskey(rsp, "error"));
+    pid = qdict_get_int(qdict_get_qdict(rsp, "return"), "pid");
+    QDECREF(rsp);
+
+    do {
+        rsp = qmp_fd(fd, "{'execute': 'guest-exec-status',"
+                     " 'arguments': { 'pid': %" PRId64 " } }", pid);
+        sent++;
+        g_assert(!qdict_haskey(rsp, "error"));
+        exited = qdict_get_bool(qdict_get_qdict(rsp, "return"), "exited");
+        QDECREF(rsp);
+        if (!exited) {
+            g_usleep(1000);
+        }
+    } while (!exited);
+}
+
+/*
+ * The mix, by weight: mostly cheap queries, then the commands that read
+ * /proc and /sys, error paths, and the stateful sequences that allocate
+ * handles and child processes.
+ */
+typedef struct {
+    int weight;
+    const char *req;                /* NULL for @func */
+    void (*func)(int fd);
+} SoakOp;
+
+static const SoakOp soak_ops[] = {
+    { 30, "{'execute': 'guest-ping'}" },
+    { 10, "{'execute': 'guest-sync', 'arguments': { 'id': 1 } }" },
+    { 10, "{'execute': 'guest-get-time'}" },
+    { 5, "{'execute': 'guest-info'}" },
+    { 5, "{'execute': 'guest-get-memory-status'}" },
+    { 5, "{'execute': 'guest-get-vcpus'}" },
+    { 5, "{'execute': 'guest-get-cpu-stats'}" },
+    { 5, "{'execute': 'guest-get-network-stats'}" },
+    { 3, "{'execute': 'guest-network-get-interfaces'}" },
+    { 3, "{'execute': 'guest-get-fsinfo'}" },
+    { 3, "{'execute': 'guest-get-disk-status'}" },
+    { 3, "{'execute': 'guest-get-system-info'}" },
+    { 2, "{'execute': 'guest-get-agent-stats'}" },
+    { 1, "{'execute': 'guest-get-processes'}" },
+    { 3, "{'execute': 'guest-no-such-command'}" },
+    { 2, "{'execute': 'guest-file-close',"
+         " 'arguments': { 'handle': 123456789 } }" },
+    { 2, "{'execute': 'guest-exec-status', 'arguments': { 'pid': 1 } }" },
+    { 2, NULL, soak_file },
+    { 1, NULL, soak_exec },
+};
+
+static void soak_sample(int fd, SoakSample *s, gint64 start)
+{
+    QDict *rsp, *val;
+
+    rsp = qmp_fd(fd, "{'execute': 'guest-get-agent-stats'}");
+    g_assert(!qdict_haskey(rsp, "error"));
+    val = qdict_get_qdict(rsp, "return");
+    s->requests = sent;
+    s->rss = qdict_get_try_int(val, "rss", 0);
+    s->heap = qdict_get_try_int(val, "heap", 0);
+    s->open_fds = qdict_get_try_int(val, "open-fds", 0);
+    QDECREF(rsp);
+
+    printf("{\"soak\": \"sample\", \"requests\": %" PRId64 ","
+           " \"elapsed-s\": %.1f, \"rss\": %" PRId64 ", \"heap\": %" PRId64
+           ", \"open-fds\": %" PRId64 "}\n", s->requests,
+           (g_get_monotonic_time() - start) / 1e6, s->rss, s->heap,
+           s->open_fds);
+    fflush(stdout);
+}
+
+/* the growth of the smallest of the last three values since @base */
+static int64_t soak_growth(const GArray *samples, const SoakSample *base,
+                           size_t offset)
+{
+    int64_t v, min = INT64_MAX;
+    guint i;
+
+    for (i = MAX(samples->len, 3) - 3; i < samples->len; i++) {
+        memcpy(&v, (const char *)&g_array_index(samples, SoakSample, i) +
+               offset, sizeof(v));
+        min = MIN(min, v);
+    }
+    memcpy(&v, (const char *)base + offset, sizeof(v));
+    return min - v;
+}
+
+static bool soak_check(const char *what, int64_t growth, int64_t budget)
+{
+    bool ok = growth <= budget;
+
+    printf("{\"soak\": \"%s\", \"growth\": %" PRId64 ", \"budget\": %" PRId64
+           ", \"result\": \"%s\"}\n", what, growth, budget,
+           ok ? "ok" : "fail");
+    return ok;
+}
+
+static GOptionEntry options[] = {
+    { "requests", 'n', 0, G_OPTION_ARG_INT64, &requests,
+      "requests to send in all (default 1000000)", "N" },
+    { "interval", 'i', 0, G_OPTION_ARG_INT64, &interval,
+      "requests between samples (default 10000)", "N" },
+    { "warmup", 'w', 0, G_OPTION_ARG_INT64, &warmup,
+      "requests before the baseline sample (default 50000)", "N" },
+    { "rss-budget", 0, 0, G_OPTION_ARG_INT64, &rss_budget_kb,
+      "KiB the resident set may grow by (default 4096)", "KIB" },
+    { "heap-budget", 0, 0, G_OPTION_ARG_INT64, &heap_budget_kb,
+      "KiB the heap in use may grow by (default 1024)", "KIB" },
+    { "fd-budget", 0, 0, G_OPTION_ARG_INT, &open_fds_budget,
+      "file descriptors the agent may gain (default 0)", "N" },
+    { "seed", 's', 0, G_OPTION_ARG_INT, &seed,
+      "seed of the request mix (default 1)", "N" },
+    { NULL }
+};
+
+int main(int argc, char **argv)
+{
+    GOptionContext *ctx;
+    GError *err = NULL;
+    TestFixture fix;
+    GArray *samples;
+    SoakSample s, base;
+    const SoakOp *op;
+    gint64 start;
+    GRand *rand;
+    int total = 0, pick;
+    bool ok = true;
+    guint i;
+
+    setlocale(LC_ALL, "");
+    ctx = g_option_context_new("- soak test qemu-ga in the current directory");
+    g_option_context_add_main_entries(ctx, options, NULL);
+    if (!g_option_context_parse(ctx, &argc, &argv, &err)) {
+        fprintf(stderr, "%s\n", err->message);
+        return EXIT_FAILURE;
+    }
+    g_option_context_free(ctx);
+    if (requests <= 0 || interval <= 0 || warmup < 0 ||
+        warmup + 3 * interval > requests) {
+        fprintf(stderr, "need positive counts, and at least three samples"
+                " after the warm-up\n");
+        return EXIT_FAILURE;
+    }
+
+    for (i = 0; i < G_N_ELEMENTS(soak_ops); i++) {
+        total += soak_ops[i].weight;
+    }
+    rand = g_rand_new_with_seed(seed);
+    samples = g_array_new(false, false, sizeof(SoakSample));
+
+    fixture_setup(&fix, NULL);
+    start = g_get_monotonic_time();
+    while (sent < requests) {
+        pick = g_rand_int_range(rand, 0, total);
+        for (op = soak_ops; pick >= op->weight; op++) {
+            pick -= op->weight;
+        }
+        if (op->req) {
+            soak_simple(fix.fd, op->req);
+        } else {
+            op->func(fix.fd);
+        }
+
+        /* the stateful ones send several requests, so compare the span */
+        if (sent >= warmup &&
+            (!samples->len || sent - g_array_index(samples, SoakSample,
+                                                   samples->len - 1).requests
+                              >= interval)) {
+            soak_sample(fix.fd, &s, start);
+            g_array_append_val(samples, s);
+        }
+    }
+    soak_sample(fix.fd, &s, start);
+    g_array_append_val(samples, s);
+
+    base = g_array_index(samples, SoakSample, 0);
+    ok &= soak_check("rss", soak_growth(samples, &base,
+                                        offsetof(SoakSample, rss)),
+                     rss_budget_kb * 1024);
+    ok &= soak_check("heap", soak_growth(samples, &base,
+                                         offsetof(SoakSample, heap)),
+                     heap_budget_kb * 1024);
+    ok &= soak_check("open-fds", soak_growth(samples, &base,
+                                             offsetof(SoakSample, open_fds)),
+                     open_fds_budget);
+    printf("{\"soak\": \"done\", \"requests\": %" PRId64 ", \"errors\": %"
+           PRId64 ", \"elapsed-s\": %.1f}\n", sent, errors,
+           (g_get_monotonic_time() - start) / 1e6);
+
+    /* the leak checkers report through the exit status of the agent */
+    fixture_tear_down(&fix, NULL);
+    g_array_free(samples, true);
+    g_rand_free(rand);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
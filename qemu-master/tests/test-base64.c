@@ -0,0 +1,123 @@
+/*
+ * base64.c unit-tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include <string.h>
+
+#include "qemu/base64.h"
+
+static void fill(uint8_t *buf, size_t len, unsigned int seed)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        seed = seed * 1103515245 + 12345;
+        buf[i] = seed >> 16;
+    }
+}
+
+/* every length up to a few groups, against glib */
+static void test_base64_encode(void)
+{
+    uint8_t buf[64];
+    char *a, *b;
+    size_t len;
+
+    fill(buf, sizeof(buf), 1);
+    for (len = 0; len <= sizeof(buf); len++) {
+        a = qemu_base64_encode(buf, len);
+        b = g_base64_encode(buf, len);
+        g_assert_cmpstr(a, ==, b);
+        g_assert_cmpint(strlen(a), ==, qemu_base64_encoded_len(len));
+        g_free(a);
+        g_free(b);
+    }
+}
+
+/* runs long enough for the vector loops, at every alignment, against glib */
+static void test_base64_long(void)
+{
+    uint8_t buf[300], *a, *b;
+    size_t off, len, len1;
+    gsize len2;
+    char *text, *expect;
+
+    fill(buf, sizeof(buf), 2);
+    for (off = 0; off < 32; off++) {
+        for (len = 64; len + off <= sizeof(buf); len += 37) {
+            text = qemu_base64_encode(buf + off, len);
+            expect = g_base64_encode(buf + off, len);
+            g_assert_cmpstr(text, ==, expect);
+            g_free(expect);
+
+            a = qemu_base64_decode(text + off % 4 * 4, &len1);
+            g_assert_cmpint(len1, ==, len - off % 4 * 3);
+            g_assert(memcmp(a, buf + off + off % 4 * 3, len1) == 0);
+            g_free(a);
+
+            /* anything outside the alphabet in the middle of a long run */
+            text[len / 2] = "\n=!\x80"[off % 4];
+            a = qemu_base64_decode(text, &len1);
+            b = g_base64_decode(text, &len2);
+            g_assert_cmpint(len1, ==, len2);
+            g_assert(memcmp(a, b, len1) == 0);
+            g_free(a);
+            g_free(b);
+            g_free(text);
+        }
+    }
+}
+
+static void test_base64_roundtrip(void)
+{
+    size_t len = 100000, out_len;
+    uint8_t *buf = g_malloc(len), *out;
+    char *text;
+
+    fill(buf, len, 3);
+    text = qemu_base64_encode(buf, len);
+    out = qemu_base64_decode(text, &out_len);
+    g_assert_cmpint(out_len, ==, len);
+    g_assert(memcmp(buf, out, len) == 0);
+    g_free(buf);
+    g_free(text);
+    g_free(out);
+}
+
+/* malformed input is treated exactly the way g_base64_decode() treats it */
+static void test_base64_decode_lenient(void)
+{
+    static const char *const inputs[] = {
+        "", "=", "QQ", "QQ==", "QUI=", "QUJD", "QUJDRA==", "QU=D",
+        "QUJD\nRA==\n", " Q U J D ", "Q!U#J$D", "QUJDR", "====",
+        "QUJD=QUJD", "QUJD\x80\xff", "QQ==QUJD", "QUJD\r\nQUJD\r\n",
+    };
+    size_t i, len1;
+    gsize len2;
+    uint8_t *a, *b;
+
+    for (i = 0; i < ARRAY_SIZE(inputs); i++) {
+        a = qemu_base64_decode(inputs[i], &len1);
+        b = g_base64_decode(inputs[i], &len2);
+        g_assert_cmpint(len1, ==, len2);
+        g_assert(memcmp(a, b, len1) == 0);
+        g_free(a);
+        g_free(b);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/base64/encode", test_base64_encode);
+    g_test_add_func("/base64/long", test_base64_long);
+    g_test_add_func("/base64/roundtrip", test_base64_roundtrip);
+    g_test_add_func("/base64/decode_lenient", test_base64_decode_lenient);
+
+    return g_test_run();
+}
@@ -0,0 +1,86 @@
+/*
+ * buffer-pool.c unit-tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include <string.h>
+
+#include "qemu/buffer-pool.h"
+
+/* small buffers are exact and not kept, large ones a power of two */
+static void test_buffer_pool_size(void)
+{
+    void *buf;
+
+    buf = qemu_buffer_pool_alloc(100);
+    g_assert_cmpint(qemu_buffer_pool_size(buf), ==, 100);
+    qemu_buffer_pool_free(buf);
+    g_assert_cmpint(qemu_buffer_pool_idle(), ==, 0);
+
+    buf = qemu_buffer_pool_alloc(QEMU_BUFFER_POOL_MIN + 1);
+    g_assert_cmpint(qemu_buffer_pool_size(buf), ==, 2 * QEMU_BUFFER_POOL_MIN);
+    memset(buf, 0xa5, qemu_buffer_pool_size(buf));
+    qemu_buffer_pool_free(buf);
+    g_assert_cmpint(qemu_buffer_pool_idle(), ==, 2 * QEMU_BUFFER_POOL_MIN);
+
+    g_assert_cmpint(qemu_buffer_pool_trim(0), ==, 0);
+    g_assert_cmpint(qemu_buffer_pool_idle(), ==, 0);
+}
+
+/* a freed buffer comes back for a request of its class */
+static void test_buffer_pool_reuse(void)
+{
+    void *a, *b;
+
+    a = qemu_buffer_pool_alloc(3 * 1024 * 1024);
+    qemu_buffer_pool_free(a);
+    b = qemu_buffer_pool_alloc(4 * 1024 * 1024);
+    g_assert(a == b);
+    qemu_buffer_pool_free(b);
+
+    /* not for another class */
+    b = qemu_buffer_pool_alloc(5 * 1024 * 1024);
+    g_assert(a != b);
+    qemu_buffer_pool_free(b);
+
+    /* recently used buffers survive a trim */
+    g_assert_cmpint(qemu_buffer_pool_trim(G_USEC_PER_SEC * 3600), ==,
+                    12 * 1024 * 1024);
+    qemu_buffer_pool_trim(0);
+}
+
+/* only a few buffers of a class are kept */
+static void test_buffer_pool_bound(void)
+{
+    void *bufs[16];
+    size_t i;
+
+    for (i = 0; i < G_N_ELEMENTS(bufs); i++) {
+        bufs[i] = qemu_buffer_pool_alloc(QEMU_BUFFER_POOL_MIN);
+    }
+    for (i = 0; i < G_N_ELEMENTS(bufs); i++) {
+        qemu_buffer_pool_free(bufs[i]);
+    }
+    g_assert_cmpint(qemu_buffer_pool_idle(), <,
+                    G_N_ELEMENTS(bufs) * QEMU_BUFFER_POOL_MIN);
+    qemu_buffer_pool_trim(0);
+
+    /* nor any buffer over the largest class */
+    bufs[0] = qemu_buffer_pool_alloc(QEMU_BUFFER_POOL_MAX + 1);
+    qemu_buffer_pool_free(bufs[0]);
+    g_assert_cmpint(qemu_buffer_pool_idle(), ==, 0);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/buffer-pool/size", test_buffer_pool_size);
+    g_test_add_func("/buffer-pool/reuse", test_buffer_pool_reuse);
+    g_test_add_func("/buffer-pool/bound", test_buffer_pool_bound);
+
+    return g_test_run();
+}
@@ -0,0 +1,204 @@
+/*
+ * JSON Output Visitor unit-tests.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+
+#include "qemu-common.h"
+#include "qapi/json-output-visitor.h"
+#include "test-qapi-types.h"
+#include "test-qapi-visit.h"
+#include "qapi/qmp/types.h"
+
+typedef struct TestOutputVisitorData {
+    JsonOutputVisitor *jov;
+    Visitor *ov;
+} TestOutputVisitorData;
+
+static void visitor_output_setup(TestOutputVisitorData *data,
+                                 const void *unused)
+{
+    data->jov = json_output_visitor_new();
+    g_assert(data->jov != NULL);
+
+    data->ov = json_output_get_visitor(data->jov);
+    g_assert(data->ov != NULL);
+}
+
+static void visitor_output_teardown(TestOutputVisitorData *data,
+                                    const void *unused)
+{
+    json_output_visitor_cleanup(data->jov);
+    data->jov = NULL;
+    data->ov = NULL;
+}
+
+/* the text visited so far, as qobject_to_json() puts it on the wire */
+static char *visitor_get_json(TestOutputVisitorData *data)
+{
+    QObject *obj = json_output_get_qobject(data->jov);
+    QString *json;
+    char *str;
+
+    g_assert(obj != NULL);
+    json = qobject_to_json(obj);
+    str = g_strdup(qstring_get_str(json));
+    QDECREF(json);
+    qobject_decref(obj);
+    return str;
+}
+
+static void test_visitor_out_scalars(TestOutputVisitorData *data,
+                                     const void *unused)
+{
+    int64_t value = -42;
+    Error *err = NULL;
+    char *str;
+
+    visit_type_int(data->ov, &value, NULL, &err);
+    g_assert(!err);
+
+    str = visitor_get_json(data);
+    g_assert_cmpstr(str, ==, "-42");
+    g_free(str);
+}
+
+static void test_visitor_out_str(TestOutputVisitorData *data,
+                                 const void *unused)
+{
+    char *string = (char *) "a \"quoted\"\tline\n";
+    Error *err = NULL;
+    char *str;
+
+    visit_type_str(data->ov, &string, NULL, &err);
+    g_assert(!err);
+
+    str = visitor_get_json(data);
+    g_assert_cmpstr(str, ==, "\"a \\\"quoted\\\"\\tline\\n\"");
+    g_free(str);
+}
+
+static void test_visitor_out_struct(TestOutputVisitorData *data,
+                                    const void *unused)
+{
+    UserDefZero base = { .integer = 1 };
+    UserDefOne ud = { .base = &base }, *pud = &ud;
+    Error *err = NULL;
+    char *str;
+
+    ud.string = (char *) "hi";
+    ud.has_enum1 = true;
+    ud.enum1 = ENUM_ONE_VALUE2;
+
+    visit_type_UserDefOne(data->ov, &pud, "unused", &err);
+    g_assert(!err);
+
+    /* members come out in schema order, base first */
+    str = visitor_get_json(data);
+    g_assert_cmpstr(str, ==,
+                    "{\"integer\": 1, \"string\": \"hi\", "
+                    "\"enum1\": \"value2\"}");
+    g_free(str);
+}
+
+static void test_visitor_out_list(TestOutputVisitorData *data,
+                                  const void *unused)
+{
+    UserDefOneList *head = NULL, *node;
+    Error *err = NULL;
+    QObject *obj;
+    QList *list;
+    char *str;
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        node = g_new0(UserDefOneList, 1);
+        node->value = g_new0(UserDefOne, 1);
+        node->value->base = g_new0(UserDefZero, 1);
+        node->value->base->integer = i;
+        node->value->string = g_strdup("x");
+        node->next = head;
+        head = node;
+    }
+
+    visit_type_UserDefOneList(data->ov, &head, "unused", &err);
+    g_assert(!err);
+    qapi_free_UserDefOneList(head);
+
+    /* the text must parse back to what the QMP visitor would produce */
+    str = visitor_get_json(data);
+    obj = qobject_from_json(str);
+    g_assert(obj != NULL);
+    list = qobject_to_qlist(obj);
+    g_assert(list != NULL);
+    g_assert_cmpint(qlist_size(list), ==, 3);
+    g_assert_cmpint(qdict_get_int(qobject_to_qdict(qlist_peek(list)),
+                                  "integer"), ==, 2);
+    qobject_decref(obj);
+    g_free(str);
+}
+
+static void test_visitor_out_any(TestOutputVisitorData *data,
+                                 const void *unused)
+{
+    QDict *dict = qdict_new();
+    QObject *obj;
+    Error *err = NULL;
+    char *str;
+
+    qdict_put(dict, "value", qint_from_int(7));
+    obj = QOBJECT(dict);
+    visit_type_any(data->ov, &obj, NULL, &err);
+    g_assert(!err);
+    QDECREF(dict);
+
+    str = visitor_get_json(data);
+    g_assert_cmpstr(str, ==, "{\"value\": 7}");
+    g_free(str);
+}
+
+static void test_visitor_out_empty(TestOutputVisitorData *data,
+                                   const void *unused)
+{
+    QObject *obj = json_output_get_qobject(data->jov);
+
+    g_assert(qobject_type(obj) == QTYPE_QNULL);
+    qobject_decref(obj);
+}
+
+static void
+output_visitor_test_add(const char *testpath,
+                        TestOutputVisitorData *data,
+                        void (*test_func)(TestOutputVisitorData *data,
+                                          const void *user_data))
+{
+    g_test_add(testpath, TestOutputVisitorData, data, visitor_output_setup,
+               test_func, visitor_output_teardown);
+}
+
+int main(int argc, char **argv)
+{
+    TestOutputVisitorData out_visitor_data;
+
+    g_test_init(&argc, &argv, NULL);
+
+    output_visitor_test_add("/json-visitor/output/int",
+                            &out_visitor_data, test_visitor_out_scalars);
+    output_visitor_test_add("/json-visitor/output/str",
+                            &out_visitor_data, test_visitor_out_str);
+    output_visitor_test_add("/json-visitor/output/struct",
+                            &out_visitor_data, test_visitor_out_struct);
+    output_visitor_test_add("/json-visitor/output/list",
+                            &out_visitor_data, test_visitor_out_list);
+    output_visitor_test_add("/json-visitor/output/any",
+                            &out_visitor_data, test_visitor_out_any);
+    output_visitor_test_add("/json-visitor/output/empty",
+                            &out_visitor_data, test_visitor_out_empty);
+
+    g_test_run();
+
+    return 0;
+}
@@ -4,120 +4,25 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <arpa/inet.h>
 #include <unistd.h>
 #include <inttypes.h>
+#include <zlib.h>
 
 #include "libqtest.h"
+#include "libqga.h"
+#include "qapi/qmp/qjson.h"
+#include "qapi/qmp/qint.h"
+#include "qapi/qmp/qfloat.h"
 #include "config-host.h"
-
-typedef struct {
-    char *test_dir;
-    GMainLoop *loop;
-    int fd;
-    GPid pid;
-} TestFixture;
-
-static int connect_qga(char *path)
-{
-    int s, ret, len, i = 0;
-    struct sockaddr_un remote;
-
-    s = socket(AF_UNIX, SOCK_STREAM, 0);
-    g_assert(s != -1);
-
-    remote.sun_family = AF_UNIX;
-    do {
-        strcpy(remote.sun_path, path);
-        len = strlen(remote.sun_path) + sizeof(remote.sun_family);
-        ret = connect(s, (struct sockaddr *)&remote, len);
-        if (ret == -1) {
-            g_usleep(G_USEC_PER_SEC);
-        }
-        if (i++ == 10) {
-            return -1;
-        }
-    } while (ret == -1);
-
-    return s;
-}
-
-static void qga_watch(GPid pid, gint status, gpointer user_data)
-{
-    TestFixture *fixture = user_data;
-
-    g_assert_cmpint(status, ==, 0);
-    g_main_loop_quit(fixture->loop);
-}
-
-static void
-fixture_setup(TestFixture *fixture, gconstpointer data)
-{
-    const gchar *extra_arg = data;
-    GError *error = NULL;
-    gchar *cwd, *path, *cmd, **argv = NULL;
-
-    fixture->loop = g_main_loop_new(NULL, FALSE);
-
-    fixture->test_dir = g_strdup("/tmp/qgatest.XXXXXX");
-    g_assert_nonnull(mkdtemp(fixture->test_dir));
-
-    path = g_build_filename(fixture->test_dir, "sock", NULL);
-    cwd = g_get_current_dir();
-    cmd = g_strdup_printf("%s%cqemu-ga -m unix-listen -t %s -p %s %s %s",
-                          cwd, G_DIR_SEPARATOR,
-                          fixture->test_dir, path,
-                          getenv("QTEST_LOG") ? "-v" : "",
-                          extra_arg ?: "");
-    g_shell_parse_argv(cmd, NULL, &argv, &error);
-    g_assert_no_error(error);
-
-    g_spawn_async(fixture->test_dir, argv, NULL,
-                  G_SPAWN_SEARCH_PATH|G_SPAWN_DO_NOT_REAP_CHILD,
-                  NULL, NULL, &fixture->pid, &error);
-    g_assert_no_error(error);
-
-    g_child_watch_add(fixture->pid, qga_watch, fixture);
-
-    fixture->fd = connect_qga(path);
-    g_assert_cmpint(fixture->fd, !=, -1);
-
-    g_strfreev(argv);
-    g_free(cmd);
-    g_free(cwd);
-    g_free(path);
-}
-
-static void
-fixture_tear_down(TestFixture *fixture, gconstpointer data)
-{
-    gchar *tmp;
-
-    kill(fixture->pid, SIGTERM);
-
-    g_main_loop_run(fixture->loop);
-    g_main_loop_unref(fixture->loop);
-
-    g_spawn_close_pid(fixture->pid);
-
-    tmp = g_build_filename(fixture->test_dir, "foo", NULL);
-    g_unlink(tmp);
-    g_free(tmp);
-
-    tmp = g_build_filename(fixture->test_dir, "qga.state", NULL);
-    g_unlink(tmp);
-    g_free(tmp);
-
-    tmp = g_build_filename(fixture->test_dir, "sock", NULL);
-    g_unlink(tmp);
-    g_free(tmp);
-
-    g_rmdir(fixture->test_dir);
-    g_free(fixture->test_dir);
-}
+#include "qemu/crc32c.h"
+#include "qga/metrics-page.h"
 
 static void qmp_assertion_message_error(const char     *domain,
                                         const char     *file,
@@ -177,6 +82,7 @@ static void test_qga_sync(gconstpointer fix)
 {
     const TestFixture *fixture = fix;
     guint32 v, r = g_random_int();
+    const char *raw;
     QDict *ret;
     gchar *cmd;
 
@@ -192,416 +98,4911 @@ static void test_qga_sync(gconstpointer fix)
     g_assert_cmpint(r, ==, v);
 
     QDECREF(ret);
-}
 
-static void test_qga_ping(gconstpointer fix)
-{
-    const TestFixture *fixture = fix;
-    QDict *ret;
+    /* answered without the parser, unless it deviates from the usual form */
+    raw = "{\"execute\":\"guest-sync\",\"arguments\":{\"id\":-42}}\n";
+    g_assert_cmpint(write(fixture->fd, raw, strlen(raw)), ==, strlen(raw));
+    ret = qmp_fd_receive(fixture->fd);
+    g_assert_nonnull(ret);
+    g_assert_cmpint(qdict_get_int(ret, "return"), ==, -42);
+    QDECREF(ret);
 
-    ret = qmp_fd(fixture->fd, "{'execute': 'guest-ping'}");
+    raw = "{\"execute\": \"guest-sync\", \"arguments\": {\"id\": 4.2}}";
+    g_assert_cmpint(write(fixture->fd, raw, strlen(raw)), ==, strlen(raw));
+    ret = qmp_fd_receive(fixture->fd);
     g_assert_nonnull(ret);
-    qmp_assert_no_error(ret);
+    g_assert(qdict_haskey(ret, "error"));
+    QDECREF(ret);
 
+    /* only an isa-serial channel has a line speed */
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-sync',"
+                 " 'arguments': {'id': 1, 'serial-speed': 115200 } }");
+    g_assert_nonnull(ret);
+    g_assert(qdict_haskey(ret, "error"));
     QDECREF(ret);
 }
 
-static void test_qga_invalid_cmd(gconstpointer fix)
+/* open foo, the handle or -1 if it failed as @fail says it should */
+static int64_t qga_file_open(int fd, bool fail)
 {
-    const TestFixture *fixture = fix;
-    QDict *ret, *error;
-    const gchar *class, *desc;
+    QDict *ret;
+    int64_t id = -1;
 
-    ret = qmp_fd(fixture->fd, "{'execute': 'guest-invalid-cmd'}");
+    ret = qmp_fd(fd, "{'execute': 'guest-file-open',"
+                 " 'arguments': { 'path': 'foo', 'mode': 'a' } }");
     g_assert_nonnull(ret);
+    g_assert_cmpint(qdict_haskey(ret, "error"), ==, fail);
+    if (!fail) {
+        id = qdict_get_int(ret, "return");
+    }
+    QDECREF(ret);
+    return id;
+}
 
-    error = qdict_get_qdict(ret, "error");
-    class = qdict_get_try_str(error, "class");
-    desc = qdict_get_try_str(error, "desc");
-
-    g_assert_cmpstr(class, ==, "CommandNotFound");
-    g_assert_cmpint(strlen(desc), >, 0);
+#ifdef __linux__
+static int qga_count_fds(GPid pid)
+{
+    gchar *path = g_strdup_printf("/proc/%d/fd", (int)pid);
+    GDir *dir = g_dir_open(path, 0, NULL);
+    int count = 0;
 
-    QDECREF(ret);
+    g_assert_nonnull(dir);
+    while (g_dir_read_name(dir)) {
+        count++;
+    }
+    g_dir_close(dir);
+    g_free(path);
+    return count;
 }
+#endif
 
-static void test_qga_info(gconstpointer fix)
+/* the lines found with @args, "offset:line" each, and the next-offset */
+static gchar *qga_file_search(int fd, const char *path, const char *args,
+                              int64_t *next)
 {
-    const TestFixture *fixture = fix;
-    QDict *ret, *val;
-    const gchar *version;
+    GString *lines = g_string_new("");
+    const QListEntry *e;
+    QDict *ret, *val, *match;
+    gchar *cmd;
 
-    ret = qmp_fd(fixture->fd, "{'execute': 'guest-info'}");
+    cmd = g_strdup_printf("{'execute': 'guest-file-search',"
+                          " 'arguments': {'path': '%s'%s}}", path, args);
+    ret = qmp_fd(fd, cmd);
+    g_free(cmd);
     g_assert_nonnull(ret);
     qmp_assert_no_error(ret);
-
     val = qdict_get_qdict(ret, "return");
-    version = qdict_get_try_str(val, "version");
-    g_assert_cmpstr(version, ==, QEMU_VERSION);
-
+    QLIST_FOREACH_ENTRY(qdict_get_qlist(val, "matches"), e) {
+        match = qobject_to_qdict(qlist_entry_obj(e));
+        g_string_append_printf(lines, "%s%" PRId64 ":%s",
+                               lines->len ? " " : "",
+                               qdict_get_int(match, "offset"),
+                               qdict_get_str(match, "line"));
+    }
+    *next = qdict_get_int(val, "next-offset");
     QDECREF(ret);
+    return g_string_free(lines, false);
 }
 
-static void test_qga_get_vcpus(gconstpointer fix)
+static void test_qga_file_search(gconstpointer fix)
 {
     const TestFixture *fixture = fix;
+    const char data[] = "alpha 1\nbeta 2\nALPHA 3\ngamma 4\nalpha 5\npartial";
+    gchar *path, *cmd, *lines;
+    int64_t next;
     QDict *ret;
-    QList *list;
-    const QListEntry *entry;
-
-    ret = qmp_fd(fixture->fd, "{'execute': 'guest-get-vcpus'}");
-    g_assert_nonnull(ret);
-    qmp_assert_no_error(ret);
 
-    /* check there is at least a cpu */
-    list = qdict_get_qlist(ret, "return");
-    entry = qlist_first(list);
-    g_assert(qdict_haskey(qobject_to_qdict(entry->value), "online"));
-    g_assert(qdict_haskey(qobject_to_qdict(entry->value), "logical-id"));
+    path = g_build_filename(fixture->test_dir, "log", NULL);
+    g_assert(g_file_set_contents(path, data, sizeof(data) - 1, NULL));
+
+    /* the unterminated last line is left for later */
+    lines = qga_file_search(fixture->fd, path, ", 'pattern': 'alpha'", &next);
+    g_assert_cmpstr(lines, ==, "0:alpha 1 31:alpha 5");
+    g_assert_cmpint(next, ==, 39);
+    g_free(lines);
+
+    lines = qga_file_search(fixture->fd, path,
+                            ", 'pattern': 'alpha', 'ignore-case': true",
+                            &next);
+    g_assert_cmpstr(lines, ==, "0:alpha 1 15:ALPHA 3 31:alpha 5");
+    g_free(lines);
+
+    lines = qga_file_search(fixture->fd, path,
+                            ", 'pattern': '^[ab].* [0-9]$', 'regex': true",
+                            &next);
+    g_assert_cmpstr(lines, ==, "0:alpha 1 8:beta 2 31:alpha 5");
+    g_free(lines);
+
+    /* resuming where the previous search stopped */
+    lines = qga_file_search(fixture->fd, path,
+                            ", 'pattern': 'alpha', 'max-matches': 1", &next);
+    g_assert_cmpstr(lines, ==, "0:alpha 1");
+    g_assert_cmpint(next, ==, 31);
+    g_free(lines);
+    cmd = g_strdup_printf(", 'pattern': 'alpha', 'offset': %" PRId64, next);
+    lines = qga_file_search(fixture->fd, path, cmd, &next);
+    g_assert_cmpstr(lines, ==, "31:alpha 5");
+    g_assert_cmpint(next, ==, 39);
+    g_free(lines);
+    g_free(cmd);
 
+    lines = qga_file_search(fixture->fd, path,
+                            ", 'tail': true, 'max-matches': 2", &next);
+    g_assert_cmpstr(lines, ==, "23:gamma 4 31:alpha 5");
+    g_assert_cmpint(next, ==, 39);
+    g_free(lines);
+    lines = qga_file_search(fixture->fd, path,
+                            ", 'tail': true, 'pattern': 'a 1', 'offset': 8",
+                            &next);
+    g_assert_cmpstr(lines, ==, "");
+    g_free(lines);
+
+    cmd = g_strdup_printf("{'execute': 'guest-file-search',"
+                          " 'arguments': {'path': '%s', 'pattern': '(',"
+                          " 'regex': true}}", path);
+    ret = qmp_fd(fixture->fd, cmd);
+    g_free(cmd);
+    g_assert_nonnull(ret);
+    g_assert(qdict_haskey(ret, "error"));
     QDECREF(ret);
+
+    unlink(path);
+    g_free(path);
 }
 
-static void test_qga_get_fsinfo(gconstpointer fix)
+/* the names in the listing of @args, which must have a cursor if @cursor */
+static gchar *qga_file_list(int fd, const char *args, gchar **cursor)
 {
-    const TestFixture *fixture = fix;
-    QDict *ret;
-    QList *list;
-    const QListEntry *entry;
+    GString *names = g_string_new("");
+    const QListEntry *e;
+    QDict *ret, *val, *entry;
+    gchar *cmd;
 
-    ret = qmp_fd(fixture->fd, "{'execute': 'guest-get-fsinfo'}");
+    cmd = g_strdup_printf("{'execute': 'guest-file-list',"
+                          " 'arguments': {%s}}", args);
+    ret = qmp_fd(fd, cmd);
+    g_free(cmd);
     g_assert_nonnull(ret);
     qmp_assert_no_error(ret);
-
-    /* check there is at least a fs */
-    list = qdict_get_qlist(ret, "return");
-    entry = qlist_first(list);
-    g_assert(qdict_haskey(qobject_to_qdict(entry->value), "name"));
-    g_assert(qdict_haskey(qobject_to_qdict(entry->value), "mountpoint"));
-    g_assert(qdict_haskey(qobject_to_qdict(entry->value), "type"));
-    g_assert(qdict_haskey(qobject_to_qdict(entry->value), "disk"));
-
+    val = qdict_get_qdict(ret, "return");
+    QLIST_FOREACH_ENTRY(qdict_get_qlist(val, "entries"), e) {
+        entry = qobject_to_qdict(qlist_entry_obj(e));
+        g_string_append_printf(names, "%s%s", names->len ? " " : "",
+                               qdict_get_str(entry, "name"));
+    }
+    g_assert_cmpint(qdict_haskey(val, "cursor"), ==, !!cursor);
+    if (cursor) {
+        *cursor = g_strdup(qdict_get_str(val, "cursor"));
+    }
     QDECREF(ret);
+    return g_string_free(names, false);
 }
 
-static void test_qga_get_memory_block_info(gconstpointer fix)
+static void test_qga_file_list(gconstpointer fix)
 {
     const TestFixture *fixture = fix;
-    QDict *ret, *val;
-    int64_t size;
+    static const char *const files[] = { "a", "b/c.log", "b/d", "e.log" };
+    gchar *dir, *path, *args, *names, *cursor;
+    const QListEntry *e;
+    QDict *ret, *entry;
+    int i;
+
+    dir = g_build_filename(fixture->test_dir, "list", NULL);
+    path = g_build_filename(dir, "b", NULL);
+    g_assert_cmpint(g_mkdir_with_parents(path, 0700), ==, 0);
+    g_free(path);
+    for (i = 0; i < G_N_ELEMENTS(files); i++) {
+        path = g_build_filename(dir, files[i], NULL);
+        g_assert(g_file_set_contents(path, "xyz", 3, NULL));
+        g_free(path);
+    }
 
-    ret = qmp_fd(fixture->fd, "{'execute': 'guest-get-memory-block-info'}");
+    args = g_strdup_printf("'path': '%s'", dir);
+    names = qga_file_list(fixture->fd, args, NULL);
+    g_assert_cmpstr(names, ==, "a b e.log");
+    g_free(names);
+    g_free(args);
+
+    args = g_strdup_printf("'path': '%s', 'depth': 1, 'pattern': '*.log'",
+                           dir);
+    names = qga_file_list(fixture->fd, args, NULL);
+    g_assert_cmpstr(names, ==, "b/c.log e.log");
+    g_free(names);
+    g_free(args);
+
+    /* in pages of two, the cursor being the last entry of a page */
+    args = g_strdup_printf("'path': '%s', 'depth': 1, 'max-entries': 2",
+                           dir);
+    names = qga_file_list(fixture->fd, args, &cursor);
+    g_assert_cmpstr(names, ==, "a b");
+    g_assert_cmpstr(cursor, ==, "b");
+    g_free(names);
+    g_free(args);
+    args = g_strdup_printf("'path': '%s', 'depth': 1, 'max-entries': 2,"
+                           " 'cursor': '%s'", dir, cursor);
+    g_free(cursor);
+    names = qga_file_list(fixture->fd, args, &cursor);
+    g_assert_cmpstr(names, ==, "b/c.log b/d");
+    g_assert_cmpstr(cursor, ==, "b/d");
+    g_free(names);
+    g_free(args);
+    args = g_strdup_printf("'path': '%s', 'depth': 1, 'max-entries': 2,"
+                           " 'cursor': '%s'", dir, cursor);
+    g_free(cursor);
+    names = qga_file_list(fixture->fd, args, NULL);
+    g_assert_cmpstr(names, ==, "e.log");
+    g_free(names);
+    g_free(args);
+
+    /* the status of the entries */
+    path = g_strdup_printf("{'execute': 'guest-file-list',"
+                           " 'arguments': {'path': '%s'}}", dir);
+    ret = qmp_fd(fixture->fd, path);
+    g_free(path);
     g_assert_nonnull(ret);
-
-    /* some systems might not expose memory block info in sysfs */
-    if (!qdict_haskey(ret, "error")) {
-        /* check there is at least some memory */
-        val = qdict_get_qdict(ret, "return");
-        size = qdict_get_int(val, "size");
-        g_assert_cmpint(size, >, 0);
+    qmp_assert_no_error(ret);
+    QLIST_FOREACH_ENTRY(qdict_get_qlist(qdict_get_qdict(ret, "return"),
+                                        "entries"), e) {
+        entry = qobject_to_qdict(qlist_entry_obj(e));
+        if (!strcmp(qdict_get_str(entry, "name"), "b")) {
+            g_assert_cmpstr(qdict_get_str(entry, "type"), ==, "directory");
+            g_assert_cmpint(qdict_get_int(entry, "mode"), ==, 0700);
+        } else {
+            g_assert_cmpstr(qdict_get_str(entry, "type"), ==, "file");
+            g_assert_cmpint(qdict_get_int(entry, "size"), ==, 3);
+        }
+        g_assert_cmpint(qdict_get_int(entry, "mtime"), >, 0);
     }
+    QDECREF(ret);
 
+    path = g_strdup_printf("{'execute': 'guest-file-list',"
+                           " 'arguments': {'path': '%s/a'}}", dir);
+    ret = qmp_fd(fixture->fd, path);
+    g_free(path);
+    g_assert_nonnull(ret);
+    g_assert(qdict_haskey(ret, "error"));
     QDECREF(ret);
+
+    for (i = G_N_ELEMENTS(files) - 1; i >= 0; i--) {
+        path = g_build_filename(dir, files[i], NULL);
+        unlink(path);
+        g_free(path);
+    }
+    path = g_build_filename(dir, "b", NULL);
+    g_rmdir(path);
+    g_free(path);
+    g_rmdir(dir);
+    g_free(dir);
 }
 
-static void test_qga_get_memory_blocks(gconstpointer fix)
+static void test_qga_file_read_many(gconstpointer fix)
 {
     const TestFixture *fixture = fix;
-    QDict *ret;
-    QList *list;
-    const QListEntry *entry;
-
-    ret = qmp_fd(fixture->fd, "{'execute': 'guest-get-memory-blocks'}");
+    gchar *path, *cmd;
+    const QListEntry *e;
+    QDict *ret, *file;
+    guchar *buf;
+    gsize len;
+    int i = 0;
+
+    path = g_build_filename(fixture->test_dir, "many", NULL);
+    g_assert(g_file_set_contents(path, "0123456789", 10, NULL));
+
+    /* relative, absolute, capped, missing */
+    cmd = g_strdup_printf("{'execute': 'guest-file-read-many',"
+                          " 'arguments': {'dir': '%s', 'files': ["
+                          " {'path': 'many'}, {'path': '%s'},"
+                          " {'path': 'many', 'max-size': 4},"
+                          " {'path': 'none'} ]}}", fixture->test_dir, path);
+    ret = qmp_fd(fixture->fd, cmd);
+    g_free(cmd);
     g_assert_nonnull(ret);
-
-    /* some systems might not expose memory block info in sysfs */
-    if (!qdict_haskey(ret, "error")) {
-        list = qdict_get_qlist(ret, "return");
-        entry = qlist_first(list);
-        /* newer versions of qga may return empty list without error */
-        if (entry) {
-            g_assert(qdict_haskey(qobject_to_qdict(entry->value), "phys-index"));
-            g_assert(qdict_haskey(qobject_to_qdict(entry->value), "online"));
+    qmp_assert_no_error(ret);
+    QLIST_FOREACH_ENTRY(qdict_get_qlist(ret, "return"), e) {
+        file = qobject_to_qdict(qlist_entry_obj(e));
+        if (i == 3) {
+            g_assert_cmpstr(qdict_get_str(file, "path"), ==, "none");
+            g_assert(qdict_haskey(file, "error"));
+            g_assert(!qdict_haskey(file, "buf-b64"));
+            i++;
+            continue;
+        }
+        g_assert(!qdict_haskey(file, "error"));
+        buf = g_base64_decode(qdict_get_str(file, "buf-b64"), &len);
+        g_assert_cmpint(qdict_get_int(file, "count"), ==, len);
+        if (i == 2) {
+            g_assert_cmpint(len, ==, 4);
+            g_assert(!memcmp(buf, "0123", 4));
+            g_assert(qdict_get_bool(file, "truncated"));
+        } else {
+            g_assert_cmpint(len, ==, 10);
+            g_assert(!memcmp(buf, "0123456789", 10));
+            g_assert(!qdict_get_bool(file, "truncated"));
         }
+        g_free(buf);
+        i++;
     }
+    g_assert_cmpint(i, ==, 4);
+    QDECREF(ret);
 
+    /* the sizes are checked before anything is read */
+    cmd = g_strdup_printf("{'execute': 'guest-file-read-many',"
+                          " 'arguments': {'files': [ {'path': '%s'} ],"
+                          " 'max-size': 100000000}}", path);
+    ret = qmp_fd(fixture->fd, cmd);
+    g_free(cmd);
+    g_assert_nonnull(ret);
+    g_assert(qdict_haskey(ret, "error"));
     QDECREF(ret);
+
+    unlink(path);
+    g_free(path);
 }
 
-static void test_qga_network_get_interfaces(gconstpointer fix)
+static void test_qga_file_watch(gconstpointer fix)
 {
     const TestFixture *fixture = fix;
-    QDict *ret;
-    QList *list;
-    const QListEntry *entry;
+    gchar *dir, *path, *cmd;
+    const QListEntry *e;
+    QDict *ret, *val, *change;
+    int64_t watch;
+    FILE *f;
+    int i, n = 0;
 
-    ret = qmp_fd(fixture->fd, "{'execute': 'guest-network-get-interfaces'}");
+    dir = g_build_filename(fixture->test_dir, "watch", NULL);
+    g_assert_cmpint(g_mkdir_with_parents(dir, 0700), ==, 0);
+    path = g_build_filename(dir, "conf", NULL);
+
+    cmd = g_strdup_printf("{'execute': 'guest-file-watch', 'arguments':"
+                          " {'path': '%s', 'events': ['close-write']}}",
+                          dir);
+    ret = qmp_fd(fixture->fd, cmd);
+    g_free(cmd);
     g_assert_nonnull(ret);
     qmp_assert_no_error(ret);
+    watch = qdict_get_int(qdict_get_qdict(ret, "return"), "watch");
+    QDECREF(ret);
 
-    /* check there is at least an interface */
-    list = qdict_get_qlist(ret, "return");
-    entry = qlist_first(list);
-    g_assert(qdict_haskey(qobject_to_qdict(entry->value), "name"));
+    /* the writes are coalesced into one change of the file */
+    for (i = 0; i < 3; i++) {
+        f = fopen(path, "w");
+        g_assert(f != NULL);
+        fputs("x", f);
+        fclose(f);
+    }
+    for (i = 0; i < 500 && !n; i++) {
+        ret = qmp_fd(fixture->fd, "{'execute': 'guest-file-watch-read'}");
+        g_assert_nonnull(ret);
+        qmp_assert_no_error(ret);
+        val = qdict_get_qdict(ret, "return");
+        g_assert(!qdict_get_bool(val, "overflow"));
+        QLIST_FOREACH_ENTRY(qdict_get_qlist(val, "changes"), e) {
+            change = qobject_to_qdict(qlist_entry_obj(e));
+            g_assert_cmpint(qdict_get_int(change, "watch"), ==, watch);
+            g_assert_cmpstr(qdict_get_str(change, "path"), ==, path);
+            g_assert_cmpint(qdict_get_int(change, "count"), >=, 1);
+            n++;
+        }
+        QDECREF(ret);
+        if (!n) {
+            g_usleep(10 * 1000);
+        }
+    }
+    g_assert_cmpint(n, >, 0);
 
+    cmd = g_strdup_printf("{'execute': 'guest-file-unwatch', 'arguments':"
+                          " {'watch': %" PRId64 "}}", watch);
+    ret = qmp_fd(fixture->fd, cmd);
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+    QDECREF(ret);
+    ret = qmp_fd(fixture->fd, cmd);
+    g_assert_nonnull(ret);
+    g_assert(qdict_haskey(ret, "error"));
     QDECREF(ret);
+    g_free(cmd);
+
+    unlink(path);
+    g_free(path);
+    g_rmdir(dir);
+    g_free(dir);
 }
 
-static void test_qga_file_ops(gconstpointer fix)
+static void test_qga_log_follow(gconstpointer fix)
 {
     const TestFixture *fixture = fix;
-    const guchar helloworld[] = "Hello World!\n";
-    const char *b64;
-    gchar *cmd, *path, *enc;
-    guchar *dec;
+    gchar *dir, *path, *cmd;
     QDict *ret, *val;
-    int64_t id, eof;
-    gsize count;
+    QList *lines;
+    int64_t follow, cursor;
     FILE *f;
-    char tmp[100];
 
-    /* open */
-    ret = qmp_fd(fixture->fd, "{'execute': 'guest-file-open',"
-                 " 'arguments': { 'path': 'foo', 'mode': 'w+' } }");
-    g_assert_nonnull(ret);
-    qmp_assert_no_error(ret);
-    id = qdict_get_int(ret, "return");
+#ifdef CONFIG_QGA_LEAN
+    /* compiled out of lean builds */
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-log-ack',"
+                 " 'arguments': {'follow': 1, 'cursor': 0}}");
+    g_assert(qdict_haskey(ret, "error"));
     QDECREF(ret);
+    return;
+#endif
 
-    enc = g_base64_encode(helloworld, sizeof(helloworld));
-    /* write */
-    cmd = g_strdup_printf("{'execute': 'guest-file-write',"
-                          " 'arguments': { 'handle': %" PRId64 ","
-                          " 'buf-b64': '%s' } }", id, enc);
+    dir = g_build_filename(fixture->test_dir, "logs", NULL);
+    g_assert_cmpint(g_mkdir_with_parents(dir, 0700), ==, 0);
+    path = g_build_filename(dir, "app.log", NULL);
+
+    cmd = g_strdup_printf("{'execute': 'guest-log-follow', 'arguments':"
+                          " {'paths': ['%s/*.log'], 'batch-delay': 0}}",
+                          dir);
     ret = qmp_fd(fixture->fd, cmd);
+    g_free(cmd);
     g_assert_nonnull(ret);
     qmp_assert_no_error(ret);
+    follow = qdict_get_int(qdict_get_qdict(ret, "return"), "follow");
+    QDECREF(ret);
 
-    val = qdict_get_qdict(ret, "return");
-    count = qdict_get_int(val, "count");
-    eof = qdict_get_bool(val, "eof");
-    g_assert_cmpint(count, ==, sizeof(helloworld));
-    g_assert_cmpint(eof, ==, 0);
+    /* a file that appears later is sent from its start */
+    f = fopen(path, "w");
+    g_assert(f != NULL);
+    fputs("hello\nworld\nnot a line yet", f);
+    fclose(f);
+
+    ret = qmp_fd_receive(fixture->fd);
+    g_assert_nonnull(ret);
+    g_assert_cmpstr(qdict_get_str(ret, "event"), ==, "GUEST_LOG_LINES");
+    val = qdict_get_qdict(ret, "data");
+    g_assert_cmpint(qdict_get_int(val, "follow"), ==, follow);
+    g_assert_cmpstr(qdict_get_str(val, "path"), ==, path);
+    cursor = qdict_get_int(val, "cursor");
+    g_assert_cmpint(cursor, ==, 1);
+    lines = qdict_get_qlist(val, "lines");
+    g_assert_cmpint(qlist_size(lines), ==, 2);
+    g_assert_cmpstr(qstring_get_str(qobject_to_qstring(qlist_peek(lines))),
+                    ==, "hello");
     QDECREF(ret);
-    g_free(cmd);
 
-    /* flush */
-    cmd = g_strdup_printf("{'execute': 'guest-file-flush',"
-                          " 'arguments': {'handle': %" PRId64 "} }",
-                          id);
+    cmd = g_strdup_printf("{'execute': 'guest-log-ack', 'arguments':"
+                          " {'follow': %" PRId64 ", 'cursor': %" PRId64 "}}",
+                          follow, cursor);
     ret = qmp_fd(fixture->fd, cmd);
+    g_free(cmd);
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
     QDECREF(ret);
+
+    /* a cursor that was never sent */
+    cmd = g_strdup_printf("{'execute': 'guest-log-ack', 'arguments':"
+                          " {'follow': %" PRId64 ", 'cursor': 5}}", follow);
+    ret = qmp_fd(fixture->fd, cmd);
     g_free(cmd);
+    g_assert_nonnull(ret);
+    g_assert(qdict_haskey(ret, "error"));
+    QDECREF(ret);
 
-    /* close */
-    cmd = g_strdup_printf("{'execute': 'guest-file-close',"
-                          " 'arguments': {'handle': %" PRId64 "} }",
-                          id);
+    cmd = g_strdup_printf("{'execute': 'guest-log-unfollow', 'arguments':"
+                          " {'follow': %" PRId64 "}}", follow);
     ret = qmp_fd(fixture->fd, cmd);
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
     QDECREF(ret);
+    ret = qmp_fd(fixture->fd, cmd);
     g_free(cmd);
+    g_assert_nonnull(ret);
+    g_assert(qdict_haskey(ret, "error"));
+    QDECREF(ret);
 
-    /* check content */
-    path = g_build_filename(fixture->test_dir, "foo", NULL);
-    f = fopen(path, "r");
-    g_assert_nonnull(f);
-    count = fread(tmp, 1, sizeof(tmp), f);
-    g_assert_cmpint(count, ==, sizeof(helloworld));
-    tmp[count] = 0;
-    g_assert_cmpstr(tmp, ==, (char *)helloworld);
-    fclose(f);
+    unlink(path);
+    g_free(path);
+    g_rmdir(dir);
+    g_free(dir);
+}
 
-    /* open */
-    ret = qmp_fd(fixture->fd, "{'execute': 'guest-file-open',"
-                 " 'arguments': { 'path': 'foo', 'mode': 'r' } }");
+static void test_qga_file_handles(gconstpointer data)
+{
+    TestFixture fix;
+    int64_t id1, id2, id3;
+    gchar *path, *cmd;
+    QDict *ret;
+    int fd;
+#ifdef __linux__
+    int fds, i;
+#endif
+
+    fixture_setup(&fix, "--max-file-handles=2");
+
+    id1 = qga_file_open(fix.fd, false);
+    qga_file_open(fix.fd, false);
+    qga_file_open(fix.fd, true);
+
+    /* handles belong to the client that opened them */
+    path = g_build_filename(fix.test_dir, "sock", NULL);
+    fd = connect_qga(path);
+    g_free(path);
+    g_assert_cmpint(fd, !=, -1);
+    cmd = g_strdup_printf("{'execute': 'guest-file-flush',"
+                          " 'arguments': {'handle': %" PRId64 "} }", id1);
+    ret = qmp_fd(fd, cmd);
+    g_assert_nonnull(ret);
+    g_assert(qdict_haskey(ret, "error"));
+    QDECREF(ret);
+
+    /* and are counted per client */
+    id2 = qga_file_open(fd, false);
+    id3 = qga_file_open(fd, false);
+    g_assert_cmpint(id2, !=, id3);
+
+    /* the handles of a client that goes away are closed */
+#ifdef __linux__
+    fds = qga_count_fds(fix.pid);
+#endif
+    close(fd);
+#ifdef __linux__
+    for (i = 0; i < 50 && qga_count_fds(fix.pid) > fds - 3; i++) {
+        g_usleep(10 * 1000);
+    }
+    g_assert_cmpint(qga_count_fds(fix.pid), ==, fds - 3);
+#endif
+
+    /* closing one frees a slot */
+    ret = qmp_fd(fix.fd, cmd);
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+    QDECREF(ret);
+    g_free(cmd);
+    cmd = g_strdup_printf("{'execute': 'guest-file-close',"
+                          " 'arguments': {'handle': %" PRId64 "} }", id1);
+    ret = qmp_fd(fix.fd, cmd);
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+    QDECREF(ret);
+    g_free(cmd);
+    qga_file_open(fix.fd, false);
+
+    fixture_tear_down(&fix, NULL);
+}
+
+static void test_qga_multi_client(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    const char *partial = "{'execute': 'guest-";
+    gchar *path;
+    QDict *ret;
+    int fd;
+
+    path = g_build_filename(fixture->test_dir, "sock", NULL);
+    fd = connect_qga(path);
+    g_free(path);
+    g_assert_cmpint(fd, !=, -1);
+
+    /* a half-sent request on one connection does not hold up the other */
+    g_assert_cmpint(write(fd, partial, strlen(partial)), ==, strlen(partial));
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-sync',"
+                 " 'arguments': {'id': 42}}");
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+    g_assert_cmpint(qdict_get_int(ret, "return"), ==, 42);
+    QDECREF(ret);
+
+    g_assert_cmpint(write(fd, "ping'}", 6), ==, 6);
+    ret = qmp_fd_receive(fd);
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+    QDECREF(ret);
+
+    close(fd);
+}
+
+static void test_qga_slow_reader(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    const char *req = "{'execute': 'guest-info'}";
+    gchar *path;
+    QDict *ret;
+    int fd, i;
+
+    path = g_build_filename(fixture->test_dir, "sock", NULL);
+    fd = connect_qga(path);
+    g_free(path);
+    g_assert_cmpint(fd, !=, -1);
+
+    /* queue up more output than the socket holds and don't read it */
+    for (i = 0; i < 200; i++) {
+        g_assert_cmpint(write(fd, req, strlen(req)), ==, strlen(req));
+    }
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-ping'}");
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+    QDECREF(ret);
+
+    for (i = 0; i < 200; i++) {
+        ret = qmp_fd_receive(fd);
+        g_assert_nonnull(ret);
+        qmp_assert_no_error(ret);
+        QDECREF(ret);
+    }
+
+    close(fd);
+}
+
+static void test_qga_request_id(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    QDict *ret;
+    bool seen_fsinfo = false, seen_ping = false;
+    int i, id, seen = 0;
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-ping', 'id': 'abc'}");
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+    g_assert_cmpstr(qdict_get_try_str(ret, "id"), ==, "abc");
+    QDECREF(ret);
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-ping'}");
+    g_assert_nonnull(ret);
+    g_assert(!qdict_haskey(ret, "id"));
+    QDECREF(ret);
+
+    /* fsinfo may be answered after the ping sent behind it */
+    qmp_fd_send(fixture->fd, "{'execute': 'guest-get-fsinfo', 'id': 1}");
+    qmp_fd_send(fixture->fd, "{'execute': 'guest-ping', 'id': 2}");
+    for (i = 0; i < 2; i++) {
+        ret = qmp_fd_receive(fixture->fd);
+        g_assert_nonnull(ret);
+        qmp_assert_no_error(ret);
+        if (qdict_get_int(ret, "id") == 1) {
+            g_assert(!seen_fsinfo);
+            seen_fsinfo = true;
+        } else {
+            g_assert_cmpint(qdict_get_int(ret, "id"), ==, 2);
+            g_assert(!seen_ping);
+            seen_ping = true;
+        }
+        QDECREF(ret);
+    }
+
+    /* identical read-only requests may share a run, not an id */
+    qmp_fd_send(fixture->fd, "{'execute': 'guest-get-fsinfo', 'id': 3}");
+    qmp_fd_send(fixture->fd, "{'execute': 'guest-get-fsinfo', 'id': 4}");
+    for (i = 0; i < 2; i++) {
+        ret = qmp_fd_receive(fixture->fd);
+        g_assert_nonnull(ret);
+        qmp_assert_no_error(ret);
+        g_assert_nonnull(qdict_get_qlist(ret, "return"));
+        id = qdict_get_int(ret, "id");
+        g_assert(id == 3 || id == 4);
+        g_assert(!(seen & (1 << id)));
+        seen |= 1 << id;
+        QDECREF(ret);
+    }
+}
+
+static void test_qga_cancel(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    QDict *ret, *error;
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-cancel',"
+                 " 'arguments': {'id': 'nonexistent'}}");
+    g_assert_nonnull(ret);
+    error = qdict_get_qdict(ret, "error");
+    g_assert_nonnull(error);
+    g_assert_cmpstr(qdict_get_try_str(error, "class"), ==, "GenericError");
+    QDECREF(ret);
+
+    /* a generous deadline does not get in the way */
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-get-fsinfo', 'id': 7,"
+                 " 'timeout': 60000}");
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+    g_assert_cmpint(qdict_get_int(ret, "id"), ==, 7);
+    QDECREF(ret);
+
+    /* nor does one on a command that runs in the main loop */
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-ping', 'timeout': 1}");
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+    QDECREF(ret);
+}
+
+/* requests that arrive together, so the agent sees them in one read */
+static void qga_send_raw(int fd, const char *json)
+{
+    g_assert_cmpint(write(fd, json, strlen(json)), ==, strlen(json));
+}
+
+static void test_qga_priority(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    QDict *ret;
+
+    /* a bulk request with an id waits for the ping read after it */
+    qga_send_raw(fixture->fd, "{\"execute\": \"guest-get-time\", \"id\": 1}"
+                 "{\"execute\": \"guest-ping\", \"id\": 2}");
+    ret = qmp_fd_receive(fixture->fd);
+    qmp_assert_no_error(ret);
+    g_assert_cmpint(qdict_get_int(ret, "id"), ==, 2);
+    QDECREF(ret);
+    ret = qmp_fd_receive(fixture->fd);
+    qmp_assert_no_error(ret);
+    g_assert_cmpint(qdict_get_int(ret, "id"), ==, 1);
+    QDECREF(ret);
+
+    /* and can be cancelled before it ever runs */
+    qga_send_raw(fixture->fd, "{\"execute\": \"guest-get-time\", \"id\": 3}"
+                 "{\"execute\": \"guest-cancel\","
+                 " \"arguments\": {\"id\": 3}}");
+    ret = qmp_fd_receive(fixture->fd);
+    g_assert_nonnull(qdict_get_qdict(ret, "error"));
+    g_assert_cmpint(qdict_get_int(ret, "id"), ==, 3);
+    QDECREF(ret);
+    ret = qmp_fd_receive(fixture->fd);
+    qmp_assert_no_error(ret);
+    g_assert(!qdict_haskey(ret, "id"));
+    QDECREF(ret);
+}
+
+static void frame_send(int fd, const char *json, const void *att,
+                       uint32_t att_len)
+{
+    uint32_t hdr[2] = { htonl(strlen(json)), htonl(att_len) };
+
+    g_assert_cmpint(write(fd, hdr, sizeof(hdr)), ==, sizeof(hdr));
+    g_assert_cmpint(write(fd, json, strlen(json)), ==, strlen(json));
+    if (att_len) {
+        g_assert_cmpint(write(fd, att, att_len), ==, att_len);
+    }
+}
+
+static void frame_read(int fd, void *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len) {
+        n = read(fd, buf, len);
+        g_assert_cmpint(n, >, 0);
+        buf = (char *)buf + n;
+        len -= n;
+    }
+}
+
+static QDict *frame_receive(int fd, char **att, uint32_t *att_len)
+{
+    uint32_t hdr[2];
+    char *json;
+    QObject *obj;
+
+    frame_read(fd, hdr, sizeof(hdr));
+    json = g_malloc0(ntohl(hdr[0]) + 1);
+    frame_read(fd, json, ntohl(hdr[0]));
+    *att_len = ntohl(hdr[1]);
+    *att = g_malloc(*att_len + 1);
+    frame_read(fd, *att, *att_len);
+
+    obj = qobject_from_json(json);
+    g_free(json);
+    g_assert(obj);
+    return qobject_to_qdict(obj);
+}
+
+static void test_qga_framing(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    const char data[] = "raw\0bytes\xff";
+    uint32_t att_len;
+    unsigned char c;
+    int64_t id;
+    char *path, *cmd, *att;
+    QDict *ret, *val;
+    int fd;
+
+    path = g_build_filename(fixture->test_dir, "sock", NULL);
+    fd = connect_qga(path);
+    g_free(path);
+    g_assert_cmpint(fd, !=, -1);
+
+    /* the response to the switch still comes as plain json */
+    qmp_fd_send(fd, "{'execute': 'guest-sync-delimited',"
+                " 'arguments': {'id': 1, 'framing': 'length-prefixed'}}");
+    g_assert_cmpint(read(fd, &c, 1), ==, 1);
+    g_assert_cmpint(c, ==, 0xff);
+    ret = qmp_fd_receive(fd);
     g_assert_nonnull(ret);
     qmp_assert_no_error(ret);
+    QDECREF(ret);
+    g_assert_cmpint(read(fd, &c, 1), ==, 1);
+    g_assert_cmpint(c, ==, '\n');
+
+    path = g_build_filename(fixture->test_dir, "foo", NULL);
+    cmd = g_strdup_printf("{\"execute\": \"guest-file-open\","
+                          " \"arguments\": {\"path\": \"%s\","
+                          " \"mode\": \"w+\"}}", path);
+    g_free(path);
+    frame_send(fd, cmd, NULL, 0);
+    g_free(cmd);
+    ret = frame_receive(fd, &att, &att_len);
+    qmp_assert_no_error(ret);
     id = qdict_get_int(ret, "return");
     QDECREF(ret);
+    g_free(att);
+
+    cmd = g_strdup_printf("{\"execute\": \"guest-file-write\","
+                          " \"arguments\": {\"handle\": %" PRId64 "}}", id);
+    frame_send(fd, cmd, data, sizeof(data));
+    g_free(cmd);
+    ret = frame_receive(fd, &att, &att_len);
+    qmp_assert_no_error(ret);
+    val = qdict_get_qdict(ret, "return");
+    g_assert_cmpint(qdict_get_int(val, "count"), ==, sizeof(data));
+    QDECREF(ret);
+    g_free(att);
+
+    cmd = g_strdup_printf("{\"execute\": \"guest-file-seek\","
+                          " \"arguments\": {\"handle\": %" PRId64 ","
+                          " \"offset\": 0, \"whence\": 0}}", id);
+    frame_send(fd, cmd, NULL, 0);
+    g_free(cmd);
+    ret = frame_receive(fd, &att, &att_len);
+    qmp_assert_no_error(ret);
+    QDECREF(ret);
+    g_free(att);
+
+    /* the data comes back as the attachment, not as base64 */
+    cmd = g_strdup_printf("{\"execute\": \"guest-file-read\","
+                          " \"arguments\": {\"handle\": %" PRId64 "}}", id);
+    frame_send(fd, cmd, NULL, 0);
+    g_free(cmd);
+    ret = frame_receive(fd, &att, &att_len);
+    qmp_assert_no_error(ret);
+    val = qdict_get_qdict(ret, "return");
+    g_assert_cmpint(qdict_get_int(val, "count"), ==, sizeof(data));
+    g_assert(!qdict_haskey(val, "buf-b64"));
+    g_assert_cmpint(att_len, ==, sizeof(data));
+    g_assert(memcmp(att, data, sizeof(data)) == 0);
+    QDECREF(ret);
+    g_free(att);
+
+    cmd = g_strdup_printf("{\"execute\": \"guest-file-close\","
+                          " \"arguments\": {\"handle\": %" PRId64 "}}", id);
+    frame_send(fd, cmd, NULL, 0);
+    g_free(cmd);
+    ret = frame_receive(fd, &att, &att_len);
+    qmp_assert_no_error(ret);
+    QDECREF(ret);
+    g_free(att);
+
+    /* plain json where a header is expected drops back to json */
+    ret = qmp_fd(fd, "{'execute': 'guest-ping'}");
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+    QDECREF(ret);
+
+    close(fd);
+}
+
+static void test_qga_compression(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    gchar *path, *cmd, *data, *dec;
+    guchar *zbuf;
+    gsize zlen;
+    uLongf len;
+    QList *list;
+    QDict *ret, *val;
+    unsigned char c;
+    int64_t id;
+    int fd;
+
+    data = g_malloc(64 * 1024);
+    memset(data, 'a', 64 * 1024);
+    path = g_build_filename(fixture->test_dir, "compressible", NULL);
+    g_assert(g_file_set_contents(path, data, 64 * 1024, NULL));
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-info'}");
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+    val = qdict_get_qdict(ret, "return");
+    list = qdict_get_qlist(val, "compression");
+    g_assert_cmpstr(qstring_get_str(qobject_to_qstring(qlist_peek(list))),
+                    ==, "zlib");
+    QDECREF(ret);
+
+    cmd = g_build_filename(fixture->test_dir, "sock", NULL);
+    fd = connect_qga(cmd);
+    g_free(cmd);
+    g_assert_cmpint(fd, !=, -1);
+
+    qmp_fd_send(fd, "{'execute': 'guest-sync-delimited',"
+                " 'arguments': {'id': 1, 'compression': 'zlib'}}");
+    g_assert_cmpint(read(fd, &c, 1), ==, 1);
+    g_assert_cmpint(c, ==, 0xff);
+    ret = qmp_fd_receive(fd);
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+    QDECREF(ret);
+
+    cmd = g_strdup_printf("{'execute': 'guest-file-open',"
+                          " 'arguments': {'path': '%s'}}", path);
+    ret = qmp_fd(fd, cmd);
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+    id = qdict_get_int(ret, "return");
+    QDECREF(ret);
+    g_free(cmd);
 
-    /* read */
     cmd = g_strdup_printf("{'execute': 'guest-file-read',"
-                          " 'arguments': { 'handle': %" PRId64 "} }",
-                          id);
-    ret = qmp_fd(fixture->fd, cmd);
+                          " 'arguments': {'handle': %" PRId64 ","
+                          " 'count': 65536}}", id);
+    ret = qmp_fd(fd, cmd);
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+    g_free(cmd);
     val = qdict_get_qdict(ret, "return");
-    count = qdict_get_int(val, "count");
-    eof = qdict_get_bool(val, "eof");
-    b64 = qdict_get_str(val, "buf-b64");
-    g_assert_cmpint(count, ==, sizeof(helloworld));
-    g_assert(eof);
-    g_assert_cmpstr(b64, ==, enc);
+    g_assert_cmpint(qdict_get_int(val, "count"), ==, 64 * 1024);
+    g_assert(qdict_get_bool(val, "compressed"));
+    zbuf = g_base64_decode(qdict_get_str(val, "buf-b64"), &zlen);
+    g_assert_cmpint(zlen, <, 64 * 1024);
+    len = 64 * 1024;
+    dec = g_malloc(len);
+    g_assert_cmpint(uncompress((Bytef *)dec, &len, zbuf, zlen), ==, Z_OK);
+    g_assert_cmpint(len, ==, 64 * 1024);
+    g_assert(memcmp(dec, data, len) == 0);
+    QDECREF(ret);
+    g_free(zbuf);
+    g_free(dec);
+
+    cmd = g_strdup_printf("{'execute': 'guest-file-close',"
+                          " 'arguments': {'handle': %" PRId64 "}}", id);
+    ret = qmp_fd(fd, cmd);
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+    QDECREF(ret);
+    g_free(cmd);
+
+    close(fd);
+    unlink(path);
+    g_free(path);
+    g_free(data);
+}
+
+static void test_qga_file_stream(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    size_t size = 100000, chunk = 40000, pos;
+    uint32_t att_len;
+    unsigned char c;
+    int64_t stream;
+    char *path, *cmd, *data, *att, *back;
+    QDict *ret, *val;
+    int fd, i;
+
+    data = g_malloc(size);
+    for (pos = 0; pos < size; pos++) {
+        data[pos] = pos * 7;
+    }
+    path = g_build_filename(fixture->test_dir, "sock", NULL);
+    fd = connect_qga(path);
+    g_free(path);
+    g_assert_cmpint(fd, !=, -1);
+
+    qmp_fd_send(fd, "{'execute': 'guest-sync-delimited',"
+                " 'arguments': {'id': 1, 'framing': 'length-prefixed'}}");
+    g_assert_cmpint(read(fd, &c, 1), ==, 1);
+    g_assert_cmpint(c, ==, 0xff);
+    ret = qmp_fd_receive(fd);
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+    QDECREF(ret);
+    g_assert_cmpint(read(fd, &c, 1), ==, 1);
+    g_assert_cmpint(c, ==, '\n');
+
+    /* push: the chunks are not answered, closing says how much arrived */
+    path = g_build_filename(fixture->test_dir, "pushed", NULL);
+    cmd = g_strdup_printf("{\"execute\": \"guest-file-push\","
+                          " \"arguments\": {\"path\": \"%s\"}}", path);
+    frame_send(fd, cmd, NULL, 0);
+    g_free(cmd);
+    ret = frame_receive(fd, &att, &att_len);
+    qmp_assert_no_error(ret);
+    stream = qdict_get_int(qdict_get_qdict(ret, "return"), "stream");
+    QDECREF(ret);
+    g_free(att);
+
+    cmd = g_strdup_printf("{\"execute\": \"guest-file-push-data\","
+                          " \"arguments\": {\"stream\": %" PRId64 "}}",
+                          stream);
+    for (pos = 0; pos < size; pos += chunk) {
+        frame_send(fd, cmd, data + pos, MIN(chunk, size - pos));
+    }
+    g_free(cmd);
+
+    cmd = g_strdup_printf("{\"execute\": \"guest-file-stream-close\","
+                          " \"arguments\": {\"stream\": %" PRId64 "}}",
+                          stream);
+    frame_send(fd, cmd, NULL, 0);
+    g_free(cmd);
+    ret = frame_receive(fd, &att, &att_len);
+    qmp_assert_no_error(ret);
+    val = qdict_get_qdict(ret, "return");
+    g_assert_cmpint(qdict_get_int(val, "count"), ==, size);
+    QDECREF(ret);
+    g_free(att);
+
+    /* pull with credits for two chunks of the three */
+    cmd = g_strdup_printf("{\"execute\": \"guest-file-pull\","
+                          " \"arguments\": {\"path\": \"%s\","
+                          " \"chunk-size\": %zu, \"credits\": 2}}",
+                          path, chunk);
+    frame_send(fd, cmd, NULL, 0);
+    g_free(cmd);
+    ret = frame_receive(fd, &att, &att_len);
+    qmp_assert_no_error(ret);
+    val = qdict_get_qdict(ret, "return");
+    stream = qdict_get_int(val, "stream");
+    g_assert_cmpint(qdict_get_int(val, "size"), ==, size);
+    QDECREF(ret);
+    g_free(att);
+
+    back = g_malloc(size);
+    for (i = 0, pos = 0; i < 3; i++) {
+        if (i == 2) {
+            /* out of credits, the agent answers requests but sends no data */
+            frame_send(fd, "{\"execute\": \"guest-ping\", \"id\": 5}",
+                       NULL, 0);
+            ret = frame_receive(fd, &att, &att_len);
+            g_assert_cmpint(qdict_get_int(ret, "id"), ==, 5);
+            QDECREF(ret);
+            g_free(att);
+
+            cmd = g_strdup_printf("{\"execute\": \"guest-file-stream-credit\","
+                                  " \"arguments\": {\"stream\": %" PRId64 ","
+                                  " \"credits\": 4}}", stream);
+            frame_send(fd, cmd, NULL, 0);
+            g_free(cmd);
+            ret = frame_receive(fd, &att, &att_len);
+            qmp_assert_no_error(ret);
+            QDECREF(ret);
+            g_free(att);
+        }
+
+        ret = frame_receive(fd, &att, &att_len);
+        g_assert_cmpstr(qdict_get_str(ret, "event"), ==, "GUEST_FILE_DATA");
+        val = qdict_get_qdict(ret, "data");
+        g_assert_cmpint(qdict_get_int(val, "stream"), ==, stream);
+        g_assert_cmpint(qdict_get_int(val, "offset"), ==, pos);
+        g_assert_cmpint(qdict_get_int(val, "count"), ==, att_len);
+        g_assert(qdict_get_bool(val, "eof") == (i == 2));
+        memcpy(back + pos, att, att_len);
+        pos += att_len;
+        QDECREF(ret);
+        g_free(att);
+    }
+    g_assert_cmpint(pos, ==, size);
+    g_assert(memcmp(back, data, size) == 0);
+
+    /* the stream went away with the last chunk */
+    cmd = g_strdup_printf("{\"execute\": \"guest-file-stream-close\","
+                          " \"arguments\": {\"stream\": %" PRId64 "}}",
+                          stream);
+    frame_send(fd, cmd, NULL, 0);
+    g_free(cmd);
+    ret = frame_receive(fd, &att, &att_len);
+    g_assert(qdict_haskey(ret, "error"));
+    QDECREF(ret);
+    g_free(att);
+
+    close(fd);
+    unlink(path);
+    g_free(path);
+    g_free(back);
+    g_free(data);
+}
+
+static void test_qga_file_sparse(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    size_t chunk = 65536, hole = 4 * 1024 * 1024, size = 2 * chunk + hole;
+    size_t pos;
+    uint32_t att_len;
+    unsigned char c;
+    int64_t stream, count;
+    char *path, *cmd, *data, *att, *back;
+    QDict *ret, *val;
+    struct stat st;
+    bool eof = false;
+    int fd;
+
+    data = g_malloc(chunk);
+    memset(data, 0x5a, chunk);
+    path = g_build_filename(fixture->test_dir, "sock", NULL);
+    fd = connect_qga(path);
+    g_free(path);
+    g_assert_cmpint(fd, !=, -1);
+
+    qmp_fd_send(fd, "{'execute': 'guest-sync-delimited',"
+                " 'arguments': {'id': 1, 'framing': 'length-prefixed'}}");
+    g_assert_cmpint(read(fd, &c, 1), ==, 1);
+    g_assert_cmpint(c, ==, 0xff);
+    ret = qmp_fd_receive(fd);
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+    QDECREF(ret);
+    g_assert_cmpint(read(fd, &c, 1), ==, 1);
+    g_assert_cmpint(c, ==, '\n');
+
+    /* data, a hole, data */
+    path = g_build_filename(fixture->test_dir, "sparse", NULL);
+    cmd = g_strdup_printf("{\"execute\": \"guest-file-push\","
+                          " \"arguments\": {\"path\": \"%s\"}}", path);
+    frame_send(fd, cmd, NULL, 0);
+    g_free(cmd);
+    ret = frame_receive(fd, &att, &att_len);
+    qmp_assert_no_error(ret);
+    stream = qdict_get_int(qdict_get_qdict(ret, "return"), "stream");
+    QDECREF(ret);
+    g_free(att);
+
+    cmd = g_strdup_printf("{\"execute\": \"guest-file-push-data\","
+                          " \"arguments\": {\"stream\": %" PRId64 "}}",
+                          stream);
+    frame_send(fd, cmd, data, chunk);
+    g_free(cmd);
+    cmd = g_strdup_printf("{\"execute\": \"guest-file-push-hole\","
+                          " \"arguments\": {\"stream\": %" PRId64 ","
+                          " \"length\": %zu}}", stream, hole);
+    frame_send(fd, cmd, NULL, 0);
+    g_free(cmd);
+    cmd = g_strdup_printf("{\"execute\": \"guest-file-push-data\","
+                          " \"arguments\": {\"stream\": %" PRId64 "}}",
+                          stream);
+    frame_send(fd, cmd, data, chunk);
+    g_free(cmd);
+
+    cmd = g_strdup_printf("{\"execute\": \"guest-file-stream-close\","
+                          " \"arguments\": {\"stream\": %" PRId64 "}}",
+                          stream);
+    frame_send(fd, cmd, NULL, 0);
+    g_free(cmd);
+    ret = frame_receive(fd, &att, &att_len);
+    qmp_assert_no_error(ret);
+    g_assert_cmpint(qdict_get_int(qdict_get_qdict(ret, "return"), "count"),
+                    ==, size);
+    QDECREF(ret);
+    g_free(att);
+    g_assert_cmpint(stat(path, &st), ==, 0);
+    g_assert_cmpint(st.st_size, ==, size);
+
+    /* whatever the file system made of the hole, the zeros come back */
+    cmd = g_strdup_printf("{\"execute\": \"guest-file-pull\","
+                          " \"arguments\": {\"path\": \"%s\","
+                          " \"chunk-size\": %zu, \"sparse\": true}}",
+                          path, chunk);
+    frame_send(fd, cmd, NULL, 0);
+    g_free(cmd);
+    ret = frame_receive(fd, &att, &att_len);
+    qmp_assert_no_error(ret);
+    QDECREF(ret);
+    g_free(att);
+
+    back = g_malloc0(size);
+    for (pos = 0; !eof; pos += count) {
+        ret = frame_receive(fd, &att, &att_len);
+        g_assert_cmpstr(qdict_get_str(ret, "event"), ==, "GUEST_FILE_DATA");
+        val = qdict_get_qdict(ret, "data");
+        g_assert_cmpint(qdict_get_int(val, "offset"), ==, pos);
+        count = qdict_get_int(val, "count");
+        g_assert_cmpint(pos + count, <=, size);
+        if (qdict_haskey(val, "hole")) {
+            g_assert_cmpint(att_len, ==, 0);
+        } else {
+            g_assert_cmpint(count, ==, att_len);
+            memcpy(back + pos, att, att_len);
+        }
+        eof = qdict_get_bool(val, "eof");
+        QDECREF(ret);
+        g_free(att);
+    }
+    g_assert_cmpint(pos, ==, size);
+    g_assert(memcmp(back, data, chunk) == 0);
+    g_assert(memcmp(back + chunk + hole, data, chunk) == 0);
+    for (pos = chunk; pos < chunk + hole; pos++) {
+        g_assert_cmpint(back[pos], ==, 0);
+    }
+
+    close(fd);
+    unlink(path);
+    g_free(path);
+    g_free(back);
+    g_free(data);
+}
+
+/* the whole stream of a guest-file-archive, and the last event's data */
+static GByteArray *qga_file_archive(int fd, const char *args, QDict **last)
+{
+    GByteArray *out = g_byte_array_new();
+    uint32_t att_len;
+    int64_t stream;
+    char *cmd, *att;
+    QDict *ret, *val;
+
+    cmd = g_strdup_printf("{\"execute\": \"guest-file-archive\","
+                          " \"arguments\": {%s, \"chunk-size\": 1000}}", args);
+    frame_send(fd, cmd, NULL, 0);
+    g_free(cmd);
+    ret = frame_receive(fd, &att, &att_len);
+    qmp_assert_no_error(ret);
+    stream = qdict_get_int(qdict_get_qdict(ret, "return"), "stream");
+    QDECREF(ret);
+    g_free(att);
+
+    for (;;) {
+        ret = frame_receive(fd, &att, &att_len);
+        g_assert_cmpstr(qdict_get_str(ret, "event"), ==, "GUEST_FILE_DATA");
+        val = qdict_get_qdict(ret, "data");
+        g_assert_cmpint(qdict_get_int(val, "stream"), ==, stream);
+        g_assert_cmpint(qdict_get_int(val, "offset"), ==, out->len);
+        g_assert_cmpint(qdict_get_int(val, "count"), ==, att_len);
+        g_assert(!qdict_haskey(val, "error"));
+        g_byte_array_append(out, (guint8 *)att, att_len);
+        g_free(att);
+        if (qdict_get_bool(val, "eof")) {
+            QINCREF(val);
+            *last = val;
+            QDECREF(ret);
+            return out;
+        }
+        QDECREF(ret);
+    }
+}
+
+/* the names and contents of the members of a tar, as "name:type:data" */
+static GString *tar_members(const guint8 *tar, size_t len)
+{
+    GString *s = g_string_new("");
+    char *longname = NULL;
+    size_t pos = 0, size;
+    unsigned int sum, i;
+
+    while (pos + 512 <= len && tar[pos]) {
+        g_assert(memcmp(tar + pos + 257, "ustar", 6) == 0);
+        for (sum = 0, i = 0; i < 512; i++) {
+            sum += i >= 148 && i < 156 ? ' ' : tar[pos + i];
+        }
+        g_assert_cmpint(strtoul((char *)tar + pos + 148, NULL, 8), ==, sum);
+        size = strtoull((char *)tar + pos + 124, NULL, 8);
+        g_assert_cmpint(pos + 512 + size, <=, len);
+        if (tar[pos + 156] == 'L') {
+            longname = g_strndup((char *)tar + pos + 512, size);
+        } else {
+            g_string_append_printf(s, "%s:%c:",
+                                   longname ? longname :
+                                   (char *)tar + pos, tar[pos + 156]);
+            if (tar[pos + 156] == '2') {
+                g_string_append(s, (char *)tar + pos + 157);
+            }
+            g_string_append_len(s, (char *)tar + pos + 512, size);
+            g_string_append_c(s, '\n');
+            g_free(longname);
+            longname = NULL;
+        }
+        pos += 512 + (size + 511) / 512 * 512;
+    }
+    /* two zero blocks end it */
+    g_assert_cmpint(pos + 1024, ==, len);
+    for (i = 0; i < 1024; i++) {
+        g_assert_cmpint(tar[pos + i], ==, 0);
+    }
+    return s;
+}
+
+static void test_qga_file_archive(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    static const char *const files[] = { "a", "skip.tmp", "link" };
+    const char *expected;
+    GByteArray *tar;
+    guint8 unzipped[65536];
+    unsigned char c;
+    char *dir, *path, *args, *longdir, *members;
+    QDict *ret, *last;
+    GString *s;
+    z_stream zs;
+    size_t i;
+    int fd;
+
+    dir = g_build_filename(fixture->test_dir, "arch", NULL);
+    /* subdirectory names run over the 100 characters of a tar header */
+    longdir = g_strnfill(60, 'd');
+    path = g_build_filename(dir, longdir, longdir, NULL);
+    g_assert_cmpint(g_mkdir_with_parents(path, 0755), ==, 0);
+    g_free(path);
+    path = g_build_filename(dir, longdir, longdir, "deep", NULL);
+    g_assert(g_file_set_contents(path, "deep data", -1, NULL));
+    g_free(path);
+    path = g_build_filename(dir, "a", NULL);
+    g_assert(g_file_set_contents(path, "hello", -1, NULL));
+    g_free(path);
+    path = g_build_filename(dir, "skip.tmp", NULL);
+    g_assert(g_file_set_contents(path, "left out", -1, NULL));
+    g_free(path);
+    path = g_build_filename(dir, "link", NULL);
+    g_assert_cmpint(symlink("a", path), ==, 0);
+    g_free(path);
+
+    path = g_build_filename(fixture->test_dir, "sock", NULL);
+    fd = connect_qga(path);
+    g_free(path);
+    g_assert_cmpint(fd, !=, -1);
+    qmp_fd_send(fd, "{'execute': 'guest-sync-delimited',"
+                " 'arguments': {'id': 1, 'framing': 'length-prefixed'}}");
+    g_assert_cmpint(read(fd, &c, 1), ==, 1);
+    g_assert_cmpint(c, ==, 0xff);
+    ret = qmp_fd_receive(fd);
+    qmp_assert_no_error(ret);
+    QDECREF(ret);
+    g_assert_cmpint(read(fd, &c, 1), ==, 1);
+    g_assert_cmpint(c, ==, '\n');
+
+    args = g_strdup_printf("\"paths\": [\"%s\"], \"exclude\": [\"*.tmp\"]",
+                           dir);
+    tar = qga_file_archive(fd, args, &last);
+    g_assert_cmpint(qdict_get_int(last, "skipped"), ==, 0);
+    QDECREF(last);
+    s = tar_members(tar->data, tar->len);
+    g_byte_array_free(tar, true);
+
+    /* in directory order, so compare line by line */
+    expected = dir[0] == '/' ? dir + 1 : dir;
+    members = g_strdup_printf("%s/:5:\n", expected);
+    g_assert(g_str_has_prefix(s->str, members));
+    g_free(members);
+    members = g_strdup_printf("\n%s/a:0:hello\n", expected);
+    g_assert(strstr(s->str, members));
+    g_free(members);
+    members = g_strdup_printf("\n%s/link:2:a\n", expected);
+    g_assert(strstr(s->str, members));
+    g_free(members);
+    members = g_strdup_printf("\n%s/%s/%s/deep:0:deep data\n", expected,
+                              longdir, longdir);
+    g_assert(strstr(s->str, members));
+    g_free(members);
+    g_assert(!strstr(s->str, "skip.tmp"));
+    g_string_free(s, true);
+
+    /* gzip, and a size limit that leaves no room for the long name below */
+    g_free(args);
+    args = g_strdup_printf("\"paths\": [\"%s/a\", \"%s/%s\"],"
+                           " \"gzip\": true, \"max-size\": 3072",
+                           dir, dir, longdir);
+    tar = qga_file_archive(fd, args, &last);
+    g_assert_cmpint(qdict_get_int(last, "skipped"), ==, 1);
+    QDECREF(last);
+    g_assert_cmpint(tar->data[0], ==, 0x1f);
+    g_assert_cmpint(tar->data[1], ==, 0x8b);
+    memset(&zs, 0, sizeof(zs));
+    g_assert_cmpint(inflateInit2(&zs, 15 + 16), ==, Z_OK);
+    zs.next_in = tar->data;
+    zs.avail_in = tar->len;
+    zs.next_out = unzipped;
+    zs.avail_out = sizeof(unzipped);
+    g_assert_cmpint(inflate(&zs, Z_FINISH), ==, Z_STREAM_END);
+    s = tar_members(unzipped, zs.total_out);
+    inflateEnd(&zs);
+    g_byte_array_free(tar, true);
+    members = g_strdup_printf("%s/a:0:hello\n%s/%s/:5:\n", expected,
+                              expected, longdir);
+    g_assert_cmpstr(s->str, ==, members);
+    g_free(members);
+    g_string_free(s, true);
+
+    close(fd);
+    path = g_build_filename(dir, longdir, longdir, "deep", NULL);
+    unlink(path);
+    g_free(path);
+    path = g_build_filename(dir, longdir, longdir, NULL);
+    g_rmdir(path);
+    g_free(path);
+    path = g_build_filename(dir, longdir, NULL);
+    g_rmdir(path);
+    g_free(path);
+    for (i = 0; i < ARRAY_SIZE(files); i++) {
+        path = g_build_filename(dir, files[i], NULL);
+        unlink(path);
+        g_free(path);
+    }
+    g_rmdir(dir);
+    g_free(args);
+    g_free(longdir);
+    g_free(dir);
+}
+
+static void test_qga_ping(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    QDict *ret;
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-ping'}");
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+
+    QDECREF(ret);
+}
+
+static void test_qga_invalid_cmd(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    QDict *ret, *error;
+    const gchar *class, *desc;
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-invalid-cmd'}");
+    g_assert_nonnull(ret);
+
+    error = qdict_get_qdict(ret, "error");
+    class = qdict_get_try_str(error, "class");
+    desc = qdict_get_try_str(error, "desc");
+
+    g_assert_cmpstr(class, ==, "CommandNotFound");
+    g_assert_cmpint(strlen(desc), >, 0);
+
+    QDECREF(ret);
+}
+
+static void test_qga_info(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    QDict *ret, *val;
+    const gchar *version;
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-info'}");
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+
+    val = qdict_get_qdict(ret, "return");
+    version = qdict_get_try_str(val, "version");
+    g_assert_cmpstr(version, ==, QEMU_VERSION);
+
+    QDECREF(ret);
+}
+
+static void test_qga_query_schema(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    QDict *ret, *val, *info;
+    const QListEntry *entry;
+    gchar *hash;
+    bool found = false;
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-info'}");
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+    val = qdict_get_qdict(ret, "return");
+    hash = g_strdup(qdict_get_str(val, "schema-hash"));
+    g_assert_cmpint(strlen(hash), ==, 64);
+    QDECREF(ret);
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-query-schema'}");
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+    val = qdict_get_qdict(ret, "return");
+    g_assert_cmpstr(qdict_get_str(val, "hash"), ==, hash);
+
+    for (entry = qlist_first(qdict_get_qlist(val, "schema")); entry;
+         entry = qlist_next(entry)) {
+        info = qobject_to_qdict(entry->value);
+        if (!strcmp(qdict_get_str(info, "name"), "guest-query-schema")) {
+            g_assert_cmpstr(qdict_get_str(info, "meta-type"), ==, "command");
+            found = true;
+        }
+    }
+    g_assert(found);
+
+    g_free(hash);
+    QDECREF(ret);
+}
+
+static void test_qga_get_agent_log(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    QDict *ret, *val, *rec;
+    QList *list;
+    const QListEntry *entry;
+    int64_t cursor;
+    bool found;
+    gchar *cmd;
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-get-agent-log'}");
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+    val = qdict_get_qdict(ret, "return");
+    cursor = qdict_get_int(val, "cursor");
+    list = qdict_get_qlist(val, "records");
+    g_assert_cmpint(qlist_size(list), >=, 1);
+    g_assert_cmpint(qlist_size(list) + qdict_get_int(val, "lost"), ==,
+                    cursor);
+    QDECREF(ret);
+
+    /* only what was logged since, which includes processing this */
+    cmd = g_strdup_printf("{'execute': 'guest-get-agent-log',"
+                          " 'arguments': {'cursor': %" PRId64 "}}", cursor);
+    ret = qmp_fd(fixture->fd, cmd);
+    g_free(cmd);
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+    val = qdict_get_qdict(ret, "return");
+    g_assert_cmpint(qdict_get_int(val, "lost"), ==, 0);
+    list = qdict_get_qlist(val, "records");
+    g_assert_cmpint(qlist_size(list), >=, 1);
+    rec = qobject_to_qdict(qlist_peek(list));
+    g_assert_cmpint(qdict_get_int(rec, "seq"), ==, cursor);
+    found = false;
+    QLIST_FOREACH_ENTRY(list, entry) {
+        rec = qobject_to_qdict(entry->value);
+        g_assert_cmpint(qdict_get_int(rec, "time"), >, 0);
+        if (!strcmp(qdict_get_str(rec, "message"), "processing command")) {
+            g_assert_cmpstr(qdict_get_str(rec, "level"), ==, "debug");
+            g_assert(!qdict_get_bool(rec, "syslog"));
+            found = true;
+        }
+    }
+    g_assert(found);
+    QDECREF(ret);
+}
+
+static void test_qga_get_agent_stats(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    QDict *ret, *val, *cmd, *lat;
+    const QListEntry *entry, *b;
+    int64_t sum;
+    bool found = false;
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-ping'}");
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+    QDECREF(ret);
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-get-agent-stats',"
+                 " 'arguments': {'histograms': true}}");
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+    val = qdict_get_qdict(ret, "return");
+    g_assert_cmpint(qdict_get_int(val, "bytes-in"), >, 0);
+    g_assert_cmpint(qdict_get_int(val, "bytes-out"), >, 0);
+    g_assert_cmpint(qdict_get_int(val, "requests"), >=, 1);
+    g_assert_cmpint(qdict_get_int(val, "startup-us"), >, 0);
+    if (qdict_haskey(val, "ready-us")) {
+        g_assert_cmpint(qdict_get_int(val, "ready-us"), >=,
+                        qdict_get_int(val, "startup-us"));
+    }
+    if (qdict_haskey(val, "rss")) {
+        g_assert_cmpint(qdict_get_int(val, "rss"), >, 0);
+        g_assert_cmpint(qdict_get_int(val, "peak-rss"), >=,
+                        qdict_get_int(val, "rss"));
+    }
+    if (qdict_haskey(val, "heap")) {
+        g_assert_cmpint(qdict_get_int(val, "heap"), >, 0);
+    }
+    /* at least the channel and its listening socket */
+    g_assert_cmpint(qdict_get_int(val, "open-fds"), >=, 2);
+    /* without --stall-threshold */
+    g_assert(!qdict_haskey(val, "main-loop-lag"));
+    g_assert(!qdict_haskey(val, "stalls"));
+    QLIST_FOREACH_ENTRY(qdict_get_qlist(val, "commands"), entry) {
+        cmd = qobject_to_qdict(entry->value);
+        if (strcmp(qdict_get_str(cmd, "name"), "guest-ping")) {
+            continue;
+        }
+        found = true;
+        g_assert_cmpint(qdict_get_int(cmd, "requests"), >=, 1);
+        lat = qdict_get_qdict(cmd, "dispatch");
+        g_assert_cmpint(qdict_get_int(lat, "count"), >=, 1);
+        g_assert_cmpint(qdict_get_int(lat, "p50"), <=,
+                        qdict_get_int(lat, "max"));
+        sum = 0;
+        QLIST_FOREACH_ENTRY(qdict_get_qlist(lat, "buckets"), b) {
+            sum += qdict_get_int(qobject_to_qdict(b->value), "count");
+        }
+        g_assert_cmpint(sum, ==, qdict_get_int(lat, "count"));
+        lat = qdict_get_qdict(cmd, "write");
+        g_assert_cmpint(qdict_get_int(lat, "count"), >=, 1);
+    }
+    g_assert(found);
+    QDECREF(ret);
+}
+
+static void test_qga_get_vcpus(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    QDict *ret;
+    QList *list;
+    const QListEntry *entry;
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-get-vcpus'}");
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+
+    /* check there is at least a cpu */
+    list = qdict_get_qlist(ret, "return");
+    entry = qlist_first(list);
+    g_assert(qdict_haskey(qobject_to_qdict(entry->value), "online"));
+    g_assert(qdict_haskey(qobject_to_qdict(entry->value), "logical-id"));
+
+    QDECREF(ret);
+
+    /* putting the first cpu in the state it is in changes nothing */
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-set-vcpus-batch',"
+                 " 'arguments': { 'vcpus': [ { 'logical-id': 0,"
+                 " 'online': true }, { 'logical-id': -1,"
+                 " 'online': false } ] } }");
+    qmp_assert_no_error(ret);
+    list = qdict_get_qlist(ret, "return");
+    entry = qlist_first(list);
+    g_assert_cmpint(qdict_get_int(qobject_to_qdict(entry->value),
+                                  "logical-id"), ==, 0);
+    g_assert(!qdict_haskey(qobject_to_qdict(entry->value), "error"));
+    entry = qlist_next(entry);
+    g_assert(qdict_haskey(qobject_to_qdict(entry->value), "error"));
+    QDECREF(ret);
+}
+
+static void test_qga_get_fsinfo(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    QDict *ret, *val;
+    QList *list;
+    const QListEntry *entry;
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-get-fsinfo'}");
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+
+    /* check there is at least a fs */
+    list = qdict_get_qlist(ret, "return");
+    entry = qlist_first(list);
+    g_assert(qdict_haskey(qobject_to_qdict(entry->value), "name"));
+    g_assert(qdict_haskey(qobject_to_qdict(entry->value), "mountpoint"));
+    g_assert(qdict_haskey(qobject_to_qdict(entry->value), "type"));
+    g_assert(qdict_haskey(qobject_to_qdict(entry->value), "disk"));
+
+    /* usage, or why there is none */
+    QLIST_FOREACH_ENTRY(list, entry) {
+        val = qobject_to_qdict(entry->value);
+        if (qdict_haskey(val, "usage-error")) {
+            continue;
+        }
+        g_assert(qdict_get_int(val, "used-bytes") <=
+                 qdict_get_int(val, "total-bytes"));
+        g_assert(qdict_haskey(val, "avail-bytes"));
+    }
+    QDECREF(ret);
+
+    /* answered in time or not, every filesystem is there */
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-get-fsinfo',"
+                 " 'arguments': { 'timeout': 0 } }");
+    qmp_assert_no_error(ret);
+    list = qdict_get_qlist(ret, "return");
+    QLIST_FOREACH_ENTRY(list, entry) {
+        val = qobject_to_qdict(entry->value);
+        g_assert(qdict_haskey(val, "usage-error") ||
+                 qdict_haskey(val, "total-bytes"));
+    }
+    QDECREF(ret);
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-get-fsinfo',"
+                 " 'arguments': { 'timeout': -1 } }");
+    g_assert(qdict_haskey(ret, "error"));
+    QDECREF(ret);
+}
+
+static void test_qga_get_memory_status(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    QDict *ret, *val;
+    int64_t total;
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-get-memory-status'}");
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+
+    val = qdict_get_qdict(ret, "return");
+    total = qdict_get_int(val, "total-bytes");
+    g_assert_cmpint(total, >, 0);
+    g_assert_cmpint(qdict_get_int(val, "total"), ==, total >> 20);
+    g_assert_cmpint(qdict_get_int(val, "free-bytes"), <=, total);
+    g_assert_cmpint(qdict_get_int(val, "used"), <=,
+                    qdict_get_int(val, "total"));
+    g_assert(qdict_haskey(val, "swap"));
+
+    QDECREF(ret);
+}
+
+static void test_qga_get_numa_info(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    QDict *ret, *node;
+    const QListEntry *entry;
+    int64_t id = -1;
+    int i;
+
+    /* twice, the second time through the descriptors kept open */
+    for (i = 0; i < 2; i++) {
+        ret = qmp_fd(fixture->fd, "{'execute': 'guest-get-numa-info'}");
+        g_assert_nonnull(ret);
+        qmp_assert_no_error(ret);
+
+        entry = qlist_first(qdict_get_qlist(qdict_get_qdict(ret, "return"),
+                                            "nodes"));
+        for (; entry; entry = qlist_next(entry)) {
+            node = qobject_to_qdict(entry->value);
+            g_assert_cmpint(qdict_get_int(node, "id"), >, id);
+            id = qdict_get_int(node, "id");
+            g_assert(qdict_haskey(node, "cpus"));
+            if (qdict_haskey(node, "total-bytes")) {
+                g_assert_cmpint(qdict_get_int(node, "free-bytes"), <=,
+                                qdict_get_int(node, "total-bytes"));
+            }
+        }
+        id = -1;
+        QDECREF(ret);
+    }
+}
+
+static void test_qga_get_system_info(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    QDict *ret, *val;
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-get-system-info'}");
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+
+    val = qdict_get_qdict(ret, "return");
+    g_assert_cmpstr(qdict_get_str(val, "os-name"), ==, "Linux");
+    g_assert_cmpstr(qdict_get_str(val, "kernel-version"), !=, "");
+    g_assert_cmpstr(qdict_get_str(val, "fqdn"), !=, "");
+    g_assert(qdict_haskey(val, "system-version"));
+    g_assert(qdict_haskey(val, "lastlogin"));
+
+    QDECREF(ret);
+}
+
+static void test_qga_get_users(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    const QListEntry *entry;
+    QDict *ret, *login;
+    int i;
+
+    /* the second time comes from the cache, unless utmp changed */
+    for (i = 0; i < 2; i++) {
+        ret = qmp_fd(fixture->fd, "{'execute': 'guest-get-users'}");
+        g_assert_nonnull(ret);
+        qmp_assert_no_error(ret);
+        QLIST_FOREACH_ENTRY(qdict_get_qlist(ret, "return"), entry) {
+            login = qobject_to_qdict(entry->value);
+            g_assert(qdict_haskey(login, "user"));
+            g_assert_cmpint(qdict_get_int(login, "pid"), >, 0);
+            g_assert(qdict_haskey(login, "login-time"));
+        }
+        QDECREF(ret);
+    }
+}
+
+static void test_qga_get_disk_status(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    QDict *ret, *info;
+    QList *list;
+    const QListEntry *entry;
+    int64_t total, used;
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-get-disk-status'}");
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+
+    list = qdict_get_qlist(ret, "return");
+    QLIST_FOREACH_ENTRY(list, entry) {
+        g_assert(qdict_haskey(qobject_to_qdict(entry->value), "mount-place"));
+        info = qdict_get_qdict(qobject_to_qdict(entry->value), "mount-info");
+        g_assert(qdict_haskey(info, "total"));
+        g_assert(qdict_haskey(info, "used"));
+        g_assert(qdict_haskey(info, "writable"));
+        total = qdict_get_int(info, "total-bytes");
+        used = qdict_get_int(info, "used-bytes");
+        g_assert_cmpint(used, <=, total);
+        g_assert_cmpint(qdict_get_int(info, "avail-bytes"), <=, total);
+    }
+
+    QDECREF(ret);
+}
+
+static void test_qga_disk_forecast(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    QDict *ret = NULL, *info;
+    QList *list;
+    const QListEntry *entry;
+    int i;
+
+    /* three readings over at least a second give a fill rate */
+    for (i = 0; i < 4; i++) {
+        if (i) {
+            QDECREF(ret);
+            g_usleep(600 * 1000);
+        }
+        ret = qmp_fd(fixture->fd, "{'execute': 'guest-get-disk-status'}");
+        g_assert_nonnull(ret);
+        qmp_assert_no_error(ret);
+    }
+
+    list = qdict_get_qlist(ret, "return");
+    QLIST_FOREACH_ENTRY(list, entry) {
+        info = qdict_get_qdict(qobject_to_qdict(entry->value), "mount-info");
+        g_assert(qdict_haskey(info, "fill-rate"));
+        if (qdict_haskey(info, "time-to-full")) {
+            g_assert_cmpfloat(qdict_get_double(info, "fill-rate"), >, 0);
+            g_assert_cmpint(qdict_get_int(info, "time-to-full"), >=, 0);
+        }
+    }
+    QDECREF(ret);
+
+#ifndef CONFIG_QGA_LEAN
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-set-alert-rules',"
+                 " 'arguments': {'rules': [{'type': 'time-to-full',"
+                 " 'threshold': 3600, 'mountpoint': '/'}]}}");
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+    QDECREF(ret);
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-set-alert-rules',"
+                 " 'arguments': {'rules': []}}");
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+    QDECREF(ret);
+#endif
+}
+
+static void test_qga_get_processes(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    QDict *ret, *val;
+    QList *list;
+    const QListEntry *entry;
+    int64_t rss, prev_rss = INT64_MAX;
+    int count = 0;
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-get-processes',"
+                 " 'arguments': {'sort': 'rss', 'limit': 5}}");
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+
+    /* at least the agent itself is running */
+    list = qdict_get_qlist(ret, "return");
+    QLIST_FOREACH_ENTRY(list, entry) {
+        val = qobject_to_qdict(entry->value);
+        g_assert_cmpint(qdict_get_int(val, "pid"), >, 0);
+        g_assert(qdict_haskey(val, "comm"));
+        g_assert(qdict_haskey(val, "state"));
+        g_assert_cmpint(qdict_get_int(val, "threads"), >, 0);
+        rss = qdict_get_int(val, "rss");
+        g_assert_cmpint(rss, <=, prev_rss);
+        prev_rss = rss;
+        count++;
+    }
+    g_assert_cmpint(count, >, 0);
+    g_assert_cmpint(count, <=, 5);
+
+    QDECREF(ret);
+}
+
+static void test_qga_get_process_changes(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    QDict *ret, *val;
+    gchar *token, *cmd;
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-get-process-changes'}");
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+    val = qdict_get_qdict(ret, "return");
+    g_assert(qdict_get_bool(val, "full"));
+    g_assert(!qlist_empty(qdict_get_qlist(val, "processes")));
+    token = g_strdup(qdict_get_str(val, "token"));
+    QDECREF(ret);
+
+    cmd = g_strdup_printf("{'execute': 'guest-get-process-changes',"
+                          " 'arguments': {'since': '%s'}}", token);
+    ret = qmp_fd(fixture->fd, cmd);
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+    val = qdict_get_qdict(ret, "return");
+    g_assert(!qdict_get_bool(val, "full"));
+    g_assert_cmpstr(qdict_get_str(val, "token"), !=, token);
+    QDECREF(ret);
+    g_free(cmd);
+
+    /* a token the agent did not give out gets everything */
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-get-process-changes',"
+                 " 'arguments': {'since': 'bogus'}}");
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+    g_assert(qdict_get_bool(qdict_get_qdict(ret, "return"), "full"));
+    QDECREF(ret);
+
+    g_free(token);
+}
+
+static void test_qga_get_oom_status(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    QDict *ret, *val;
+    int64_t cursor;
+    gchar *cmd;
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-get-oom-status'}");
+    g_assert_nonnull(ret);
+
+    /* the guest might not have a readable kernel log */
+    if (qdict_haskey(ret, "error")) {
+        QDECREF(ret);
+        return;
+    }
+    val = qdict_get_qdict(ret, "return");
+    cursor = qdict_get_int(val, "cursor");
+    g_assert_cmpint(qdict_get_int(val, "count"), ==, cursor);
+    QDECREF(ret);
+
+    /* nothing new since the cursor, unless the OOM killer just ran */
+    cmd = g_strdup_printf("{'execute': 'guest-get-oom-status',"
+                          " 'arguments': {'cursor': %" PRId64 "}}", cursor);
+    ret = qmp_fd(fixture->fd, cmd);
+    g_free(cmd);
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+    val = qdict_get_qdict(ret, "return");
+    g_assert_cmpint(qdict_get_int(val, "cursor"), >=, cursor);
+    g_assert_cmpint(qdict_get_int(val, "count"), ==,
+                    qdict_get_int(val, "cursor") - cursor);
+
+    QDECREF(ret);
+}
+
+static void test_qga_get_kernel_log(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    const QListEntry *entry;
+    QDict *ret, *val, *rec;
+    int64_t cursor;
+    gchar *cmd;
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-get-kernel-log',"
+                 " 'arguments': {'pattern': '('}}");
+    g_assert_nonnull(ret);
+    g_assert(qdict_haskey(ret, "error"));
+    QDECREF(ret);
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-get-kernel-log',"
+                 " 'arguments': {'level': 'warning', 'limit': 8}}");
+    g_assert_nonnull(ret);
+
+    /* /dev/kmsg may not be readable */
+    if (qdict_haskey(ret, "error")) {
+        QDECREF(ret);
+        return;
+    }
+    val = qdict_get_qdict(ret, "return");
+    cursor = qdict_get_int(val, "cursor");
+    g_assert(!qdict_get_bool(val, "truncated"));
+    g_assert_cmpint(qlist_size(qdict_get_qlist(val, "records")), <=, 8);
+    QLIST_FOREACH_ENTRY(qdict_get_qlist(val, "records"), entry) {
+        rec = qobject_to_qdict(entry->value);
+        g_assert_cmpint(qdict_get_int(rec, "seq"), <, cursor);
+        g_assert(qdict_haskey(rec, "message"));
+    }
+    QDECREF(ret);
+
+    cmd = g_strdup_printf("{'execute': 'guest-get-kernel-log',"
+                          " 'arguments': {'cursor': %" PRId64 "}}", cursor);
+    ret = qmp_fd(fixture->fd, cmd);
+    g_free(cmd);
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+    val = qdict_get_qdict(ret, "return");
+    g_assert_cmpint(qdict_get_int(val, "cursor"), >=, cursor);
+    QLIST_FOREACH_ENTRY(qdict_get_qlist(val, "records"), entry) {
+        rec = qobject_to_qdict(entry->value);
+        g_assert_cmpint(qdict_get_int(rec, "seq"), >=, cursor);
+    }
+    QDECREF(ret);
+}
+
+static void test_qga_get_cpu_stats(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    QDict *ret, *val, *total;
+    double sum;
+    int i;
+
+    /* the first call is relative to boot, the second to the first */
+    for (i = 0; i < 2; i++) {
+        ret = qmp_fd(fixture->fd, "{'execute': 'guest-get-cpu-stats'}");
+        g_assert_nonnull(ret);
+        qmp_assert_no_error(ret);
+        val = qdict_get_qdict(ret, "return");
+        g_assert(qdict_haskey(val, "interval") == (i > 0));
+        g_assert_cmpint(qlist_size(qdict_get_qlist(val, "cpus")), >=, 1);
+        total = qdict_get_qdict(val, "total");
+        g_assert(!qdict_haskey(total, "cpu"));
+        sum = qdict_get_double(total, "user") +
+              qdict_get_double(total, "nice") +
+              qdict_get_double(total, "system") +
+              qdict_get_double(total, "idle") +
+              qdict_get_double(total, "iowait") +
+              qdict_get_double(total, "irq") +
+              qdict_get_double(total, "softirq") +
+              qdict_get_double(total, "steal");
+        /* nothing at all may have been accounted in between */
+        g_assert(sum == 0 || (sum > 99.9 && sum < 100.1));
+        QDECREF(ret);
+    }
+}
+
+static void test_qga_get_disk_io_stats(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    QDict *ret, *val;
+    QListEntry *entry;
+    int i;
+
+    /* rates are only reported once a disk was seen before */
+    for (i = 0; i < 2; i++) {
+        ret = qmp_fd(fixture->fd, "{'execute': 'guest-get-disk-io-stats'}");
+        g_assert_nonnull(ret);
+        qmp_assert_no_error(ret);
+        QLIST_FOREACH_ENTRY(qdict_get_qlist(ret, "return"), entry) {
+            val = qobject_to_qdict(entry->value);
+            g_assert(qdict_haskey(val, "name"));
+            g_assert(qdict_haskey(val, "disk"));
+            g_assert(qdict_haskey(val, "read-ios"));
+            g_assert(qdict_haskey(val, "write-bytes"));
+            g_assert(qdict_haskey(val, "interval") == (i > 0));
+            if (i > 0) {
+                g_assert(qdict_get_double(val, "util") >= 0);
+                g_assert(qdict_get_double(val, "util") <= 100);
+            }
+        }
+        QDECREF(ret);
+    }
+}
+
+static void test_qga_get_top_processes(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    QDict *ret, *val;
+    QList *list;
+    QListEntry *entry;
+    int64_t fds = G_MAXINT64;
+
+#ifdef CONFIG_QGA_LEAN
+    /* compiled out of lean builds */
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-get-top-processes'}");
+    g_assert(qdict_haskey(ret, "error"));
+    QDECREF(ret);
+    return;
+#endif
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-get-top-processes',"
+                 " 'arguments': {'sort': 'fds', 'limit': 3}}");
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+    val = qdict_get_qdict(ret, "return");
+    g_assert(qdict_get_bool(val, "complete"));
+    g_assert_cmpint(qdict_get_int(val, "scanned"), >=, 1);
+    list = qdict_get_qlist(val, "processes");
+    /* at least the agent itself holds open descriptors */
+    g_assert_cmpint(qlist_size(list), >=, 1);
+    g_assert_cmpint(qlist_size(list), <=, 3);
+    QLIST_FOREACH_ENTRY(list, entry) {
+        val = qobject_to_qdict(entry->value);
+        g_assert(qdict_haskey(val, "comm"));
+        g_assert(qdict_haskey(val, "read-bytes"));
+        g_assert_cmpint(qdict_get_int(val, "fds"), <=, fds);
+        fds = qdict_get_int(val, "fds");
+    }
+    QDECREF(ret);
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-get-top-processes',"
+                 " 'arguments': {'budget': 0}}");
+    g_assert_nonnull(ret);
+    g_assert(qdict_haskey(ret, "error"));
+    QDECREF(ret);
+}
+
+static void test_qga_get_process_memory(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    QDict *ret, *val;
+    QList *list;
+    QListEntry *entry;
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-get-process-memory',"
+                 " 'arguments': {'pids': [%d, 0]}}", fixture->pid);
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+    list = qdict_get_qlist(ret, "return");
+    g_assert_cmpint(qlist_size(list), ==, 1);
+    val = qobject_to_qdict(qlist_peek(list));
+    g_assert_cmpint(qdict_get_int(val, "pid"), ==, fixture->pid);
+    g_assert(qdict_haskey(val, "comm"));
+    g_assert_cmpint(qdict_get_int(val, "rss"), >, 0);
+    g_assert_cmpint(qdict_get_int(val, "pss"), <=,
+                    qdict_get_int(val, "rss"));
+    g_assert_cmpint(qdict_get_int(val, "uss"), <=,
+                    qdict_get_int(val, "pss"));
+    g_assert_cmpint(qdict_get_int(val, "anon") + qdict_get_int(val, "file"),
+                    ==, qdict_get_int(val, "rss"));
+    QDECREF(ret);
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-get-process-memory',"
+                 " 'arguments': {'top': 3}}");
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+    list = qdict_get_qlist(ret, "return");
+    g_assert_cmpint(qlist_size(list), >=, 1);
+    g_assert_cmpint(qlist_size(list), <=, 3);
+    QLIST_FOREACH_ENTRY(list, entry) {
+        val = qobject_to_qdict(entry->value);
+        g_assert(qdict_haskey(val, "swap"));
+        g_assert_cmpint(qdict_get_int(val, "rss"), >, 0);
+    }
+    QDECREF(ret);
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-get-process-memory',"
+                 " 'arguments': {'pids': [1], 'top': 3}}");
+    g_assert_nonnull(ret);
+    g_assert(qdict_haskey(ret, "error"));
+    QDECREF(ret);
+}
+
+static void test_qga_reclaim_memory(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    QDict *ret, *val;
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-reclaim-memory',"
+                 " 'arguments': {'drop-caches': 4}}");
+    g_assert_nonnull(ret);
+    g_assert(qdict_haskey(ret, "error"));
+    QDECREF(ret);
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-reclaim-memory',"
+                 " 'arguments': {'cgroup': '/'}}");
+    g_assert_nonnull(ret);
+    g_assert(qdict_haskey(ret, "error"));
+    QDECREF(ret);
+
+    /* with nothing to do, it only measures */
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-reclaim-memory'}");
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+    val = qdict_get_qdict(ret, "return");
+    g_assert_cmpint(qdict_get_int(val, "available-before"), >, 0);
+    g_assert_cmpint(qdict_get_int(val, "available-after"), >, 0);
+    g_assert(!qdict_haskey(val, "cgroup-reclaimed"));
+    g_assert(!qdict_haskey(val, "thp-defrag-previous"));
+    QDECREF(ret);
+}
+
+static void test_qga_get_memory_pressure(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    QDict *ret, *val;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        ret = qmp_fd(fixture->fd, "{'execute': 'guest-get-memory-pressure'}");
+        g_assert_nonnull(ret);
+        qmp_assert_no_error(ret);
+        val = qdict_get_qdict(ret, "return");
+        g_assert(qdict_haskey(val, "pgscan"));
+        g_assert(qdict_haskey(val, "pswpout"));
+        g_assert(qdict_haskey(val, "interval") == (i > 0));
+        g_assert(qdict_haskey(val, "pgsteal-rate") == (i > 0));
+        if (qdict_haskey(val, "memory")) {
+            g_assert(qdict_haskey(qdict_get_qdict(val, "memory"), "some"));
+        }
+        QDECREF(ret);
+    }
+}
+
+static void test_qga_batch(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    QDict *ret, *val;
+    QList *list;
+    const QListEntry *entry;
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-batch',"
+                 " 'arguments': {'commands': ["
+                 " {'execute': 'guest-sync', 'arguments': {'id': 42}},"
+                 " {'execute': 'guest-invalid-cmd'},"
+                 " {'execute': 'guest-batch',"
+                 "  'arguments': {'commands': []}},"
+                 " {'execute': 'guest-ping'}]}}");
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+    list = qdict_get_qlist(ret, "return");
+    g_assert_cmpint(qlist_size(list), ==, 4);
+
+    /* results come back in order, errors do not stop the batch */
+    entry = qlist_first(list);
+    val = qobject_to_qdict(entry->value);
+    g_assert_cmpint(qdict_get_int(val, "return"), ==, 42);
+    entry = qlist_next(entry);
+    val = qdict_get_qdict(qobject_to_qdict(entry->value), "error");
+    g_assert_cmpstr(qdict_get_str(val, "class"), ==, "CommandNotFound");
+    entry = qlist_next(entry);
+    g_assert(qdict_haskey(qobject_to_qdict(entry->value), "error"));
+    entry = qlist_next(entry);
+    g_assert(qdict_haskey(qobject_to_qdict(entry->value), "return"));
+
+    QDECREF(ret);
+}
+
+static void test_qga_user_check(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    QDict *ret, *val;
+
+    /* no shell: the argument reaches the program unexpanded */
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-user-check',"
+                 " 'arguments': {'command-name': 'echo',"
+                 " 'command': 'echo', 'arg': ['$HOME;']}}");
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+    val = qdict_get_qdict(ret, "return");
+    g_assert_cmpstr(qdict_get_str(val, "command-name"), ==, "echo");
+    g_assert_cmpstr(qdict_get_str(val, "result"), ==, "$HOME;\n");
+    g_assert_cmpint(qdict_get_int(val, "exitcode"), ==, 0);
+    QDECREF(ret);
+
+    /* legacy shell command line, killed at the timeout */
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-user-check',"
+                 " 'arguments': {'command-name': 'sleep',"
+                 " 'command': 'echo start; sleep 10', 'timeout': 1}}");
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+    val = qdict_get_qdict(ret, "return");
+    g_assert_cmpstr(qdict_get_str(val, "result"), ==, "start\n");
+    g_assert(qdict_get_bool(val, "timed-out"));
+    g_assert_cmpint(qdict_get_int(val, "signal"), ==, SIGKILL);
+    QDECREF(ret);
+}
+
+static void test_qga_get_memory_block_info(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    QDict *ret, *val;
+    int64_t size;
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-get-memory-block-info'}");
+    g_assert_nonnull(ret);
+
+    /* some systems might not expose memory block info in sysfs */
+    if (!qdict_haskey(ret, "error")) {
+        /* check there is at least some memory */
+        val = qdict_get_qdict(ret, "return");
+        size = qdict_get_int(val, "size");
+        g_assert_cmpint(size, >, 0);
+    }
+
+    QDECREF(ret);
+}
+
+static void test_qga_get_memory_blocks(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    QDict *ret, *blk;
+    QList *list;
+    const QListEntry *entry;
+    int64_t changed = 0;
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-get-memory-blocks'}");
+    g_assert_nonnull(ret);
+
+    /* some systems might not expose memory block info in sysfs */
+    if (!qdict_haskey(ret, "error")) {
+        list = qdict_get_qlist(ret, "return");
+        entry = qlist_first(list);
+        /* newer versions of qga may return empty list without error */
+        if (entry) {
+            g_assert(qdict_haskey(qobject_to_qdict(entry->value), "phys-index"));
+            g_assert(qdict_haskey(qobject_to_qdict(entry->value), "online"));
+        }
+        for (; entry; entry = qlist_next(entry)) {
+            blk = qobject_to_qdict(entry->value);
+            g_assert_cmpint(qdict_get_int(blk, "changed"), >, 0);
+            changed = MAX(changed, qdict_get_int(blk, "changed"));
+        }
+    }
+
+    QDECREF(ret);
+
+    /* nothing was hot-plugged since, presumably */
+    if (changed) {
+        ret = qmp_fd(fixture->fd, "{'execute': 'guest-get-memory-blocks',"
+                     " 'arguments': {'changed-since': %" PRId64 "}}",
+                     changed);
+        g_assert_nonnull(ret);
+        list = qdict_get_qlist(ret, "return");
+        g_assert(qlist_empty(list));
+        QDECREF(ret);
+    }
+}
+
+static void test_qga_network_get_interfaces(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    QDict *ret, *val, *addr;
+    QList *list;
+    const QListEntry *entry, *e;
+    size_t count[2];
+    bool found_lo;
+    int i;
+
+    /* the second time, the table kept from the first one is used */
+    for (i = 0; i < 2; i++) {
+        ret = qmp_fd(fixture->fd,
+                     "{'execute': 'guest-network-get-interfaces'}");
+        g_assert_nonnull(ret);
+        qmp_assert_no_error(ret);
+
+        /* check there is at least an interface */
+        list = qdict_get_qlist(ret, "return");
+        entry = qlist_first(list);
+        g_assert(qdict_haskey(qobject_to_qdict(entry->value), "name"));
+
+        count[i] = qlist_size(list);
+        found_lo = false;
+        QLIST_FOREACH_ENTRY(list, entry) {
+            val = qobject_to_qdict(entry->value);
+            if (strcmp(qdict_get_str(val, "name"), "lo") ||
+                !qdict_haskey(val, "ip-addresses")) {
+                continue;
+            }
+            QLIST_FOREACH_ENTRY(qdict_get_qlist(val, "ip-addresses"), e) {
+                addr = qobject_to_qdict(e->value);
+                if (!strcmp(qdict_get_str(addr, "ip-address"), "127.0.0.1")) {
+                    g_assert_cmpint(qdict_get_int(addr, "prefix"), ==, 8);
+                    found_lo = true;
+                }
+            }
+        }
+        g_assert(found_lo);
+
+        QDECREF(ret);
+    }
+    g_assert_cmpint(count[0], ==, count[1]);
+}
+
+static void test_qga_get_network_stats(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    QDict *ret, *val, *stats;
+    const QListEntry *entry;
+    bool found_lo = false;
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-get-network-stats'}");
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+
+    QLIST_FOREACH_ENTRY(qdict_get_qlist(ret, "return"), entry) {
+        val = qobject_to_qdict(entry->value);
+        g_assert_cmpint(qdict_get_int(val, "ifindex"), >, 0);
+        stats = qdict_get_qdict(val, "statistics");
+        g_assert(qdict_haskey(stats, "rx-bytes"));
+        g_assert(qdict_haskey(stats, "tx-dropped"));
+        if (!strcmp(qdict_get_str(val, "name"), "lo")) {
+            g_assert(qdict_get_bool(val, "up"));
+            found_lo = true;
+        }
+    }
+    g_assert(found_lo);
+
+    QDECREF(ret);
+}
+
+static void test_qga_get_sockets(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    struct sockaddr_in addr = { .sin_family = AF_INET };
+    socklen_t addrlen = sizeof(addr);
+    QDict *ret, *val, *sock;
+    const QListEntry *entry;
+    gchar *cmd;
+    int fd, n = 0;
+
+    /* a listener of our own, for the agent to find with its owner */
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    g_assert_cmpint(fd, >=, 0);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    g_assert_cmpint(bind(fd, (struct sockaddr *)&addr, sizeof(addr)), ==, 0);
+    g_assert_cmpint(listen(fd, 7), ==, 0);
+    g_assert_cmpint(getsockname(fd, (struct sockaddr *)&addr, &addrlen), ==,
+                    0);
+
+    cmd = g_strdup_printf("{'execute': 'guest-get-sockets', 'arguments':"
+                          " {'port': %d, 'connections': true}}",
+                          ntohs(addr.sin_port));
+    ret = qmp_fd(fixture->fd, cmd);
+    g_free(cmd);
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+    val = qdict_get_qdict(ret, "return");
+    QLIST_FOREACH_ENTRY(qdict_get_qlist(val, "listening"), entry) {
+        sock = qobject_to_qdict(entry->value);
+        g_assert_cmpint(qdict_get_int(sock, "port"), ==,
+                        ntohs(addr.sin_port));
+        g_assert_cmpstr(qdict_get_str(sock, "protocol"), ==, "tcp");
+        g_assert_cmpstr(qdict_get_str(sock, "address"), ==, "127.0.0.1");
+        g_assert_cmpint(qdict_get_int(sock, "backlog"), ==, 7);
+        g_assert_cmpint(qdict_get_int(sock, "pid"), ==, getpid());
+        n++;
+    }
+    g_assert_cmpint(n, ==, 1);
+    g_assert(qdict_haskey(val, "connections"));
+    QDECREF(ret);
+
+    close(fd);
+}
+
+static void test_qga_net_probe(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    struct sockaddr_in addr = { .sin_family = AF_INET };
+    socklen_t addrlen = sizeof(addr);
+    QDict *ret, *val;
+    QList *list;
+    gchar *cmd;
+    int fd;
+
+    /* a listener of our own, the kernel accepts the connects for us */
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    g_assert_cmpint(fd, >=, 0);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    g_assert_cmpint(bind(fd, (struct sockaddr *)&addr, sizeof(addr)), ==, 0);
+    g_assert_cmpint(listen(fd, 8), ==, 0);
+    g_assert_cmpint(getsockname(fd, (struct sockaddr *)&addr, &addrlen), ==,
+                    0);
+
+    cmd = g_strdup_printf("{'execute': 'guest-net-probe', 'arguments':"
+                          " {'targets': [{'host': '127.0.0.1', 'port': %d},"
+                          " {'host': 'qga-test.invalid', 'port': 1}],"
+                          " 'count': 2, 'timeout': 2000}}",
+                          ntohs(addr.sin_port));
+    ret = qmp_fd(fixture->fd, cmd);
+    g_free(cmd);
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+    list = qdict_get_qlist(ret, "return");
+    g_assert_cmpint(qlist_size(list), ==, 2);
+
+    val = qobject_to_qdict(qlist_peek(list));
+    g_assert_cmpstr(qdict_get_str(val, "address"), ==, "127.0.0.1");
+    g_assert_cmpint(qdict_get_int(val, "sent"), ==, 2);
+    g_assert_cmpint(qdict_get_int(val, "received"), ==, 2);
+    g_assert_cmpint(qdict_get_int(val, "rtt-min"), <=,
+                    qdict_get_int(val, "rtt-max"));
+
+    /* a name that does not resolve is reported, not probed */
+    val = qobject_to_qdict(qlist_entry_obj(qlist_next(qlist_first(list))));
+    g_assert_cmpstr(qdict_get_str(val, "host"), ==, "qga-test.invalid");
+    g_assert_cmpint(qdict_get_int(val, "sent"), ==, 0);
+    g_assert(qdict_haskey(val, "error"));
+    QDECREF(ret);
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-net-probe', 'arguments':"
+                 " {'targets': [{'host': '127.0.0.1'}], 'count': 0}}");
+    g_assert_nonnull(ret);
+    g_assert(qdict_haskey(ret, "error"));
+    QDECREF(ret);
+
+    close(fd);
+}
+
+static void test_qga_get_service_status(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    QDict *ret, *val;
+    QList *list;
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-get-service-status',"
+                 " 'arguments': {'units': ['qga-test-no-such-unit']}}");
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+    list = qdict_get_qlist(ret, "return");
+    g_assert_cmpint(qlist_size(list), ==, 1);
+    val = qobject_to_qdict(qlist_peek(list));
+    g_assert_cmpstr(qdict_get_str(val, "name"), ==, "qga-test-no-such-unit");
+    g_assert_cmpstr(qdict_get_str(val, "active-state"), !=, "active");
+    g_assert(!qdict_haskey(val, "main-pid"));
+    QDECREF(ret);
+
+    /* never a path, nor an option to the init script */
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-get-service-status',"
+                 " 'arguments': {'units': ['../../bin/true']}}");
+    g_assert_nonnull(ret);
+    g_assert(qdict_haskey(ret, "error"));
+    QDECREF(ret);
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-get-service-status',"
+                 " 'arguments': {'units': ['--help']}}");
+    g_assert_nonnull(ret);
+    g_assert(qdict_haskey(ret, "error"));
+    QDECREF(ret);
+}
+
+static void test_qga_get_packages(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    QDict *ret, *val;
+    gchar *cmd;
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-get-packages'}");
+    g_assert_nonnull(ret);
+    if (qdict_haskey(ret, "error")) {
+        /* neither rpm nor dpkg on this host */
+        QDECREF(ret);
+        return;
+    }
+    val = qdict_get_qdict(ret, "return");
+    g_assert(qdict_get_bool(val, "full"));
+    g_assert_cmpint(qlist_size(qdict_get_qlist(val, "removed")), ==, 0);
+
+    /* nothing changed in between */
+    cmd = g_strdup_printf("{'execute': 'guest-get-packages',"
+                          " 'arguments': {'since': '%s'}}",
+                          qdict_get_str(val, "token"));
+    QDECREF(ret);
+    ret = qmp_fd(fixture->fd, cmd);
+    g_free(cmd);
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+    val = qdict_get_qdict(ret, "return");
+    g_assert(!qdict_get_bool(val, "full"));
+    g_assert_cmpint(qlist_size(qdict_get_qlist(val, "installed")), ==, 0);
+    g_assert_cmpint(qlist_size(qdict_get_qlist(val, "removed")), ==, 0);
+    QDECREF(ret);
+
+    /* a token of another agent gets everything */
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-get-packages',"
+                 " 'arguments': {'since': '0:1'}}");
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+    g_assert(qdict_get_bool(qdict_get_qdict(ret, "return"), "full"));
+    QDECREF(ret);
+}
+
+static void test_qga_get_cgroup_stats(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    const QListEntry *entry;
+    QDict *ret, *cg;
+    QList *list;
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-get-cgroup-stats',"
+                 " 'arguments': {'depth': 0}}");
+    g_assert_nonnull(ret);
+    g_assert(qdict_haskey(ret, "error"));
+    QDECREF(ret);
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-get-cgroup-stats',"
+                 " 'arguments': {'depth': 1, 'top': 2}}");
+    g_assert_nonnull(ret);
+    if (qdict_haskey(ret, "error")) {
+        /* no cgroup file system mounted */
+        QDECREF(ret);
+        return;
+    }
+    list = qdict_get_qlist(ret, "return");
+    g_assert_cmpint(qlist_size(list), <=, 2);
+    QLIST_FOREACH_ENTRY(list, entry) {
+        cg = qobject_to_qdict(entry->value);
+        g_assert(qdict_get_str(cg, "path")[0] == '/');
+        g_assert(!strchr(qdict_get_str(cg, "path") + 1, '/'));
+        g_assert(qdict_haskey(cg, "cpu-ms"));
+    }
+    QDECREF(ret);
+}
+
+static void test_qga_profile(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    QDict *ret, *val;
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-get-profile'}");
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+    val = qdict_get_qdict(ret, "return");
+    g_assert(!qdict_haskey(val, "name"));
+    g_assert_cmpint(qlist_size(qdict_get_qlist(val, "files")), ==, 0);
+    g_assert(!qdict_get_bool(val, "drifted"));
+    QDECREF(ret);
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-set-profile',"
+                 " 'arguments': {'name': 'bad', 'settings':"
+                 " [{'key': '/etc/passwd', 'value': 'x'}]}}");
+    g_assert_nonnull(ret);
+    g_assert(qdict_haskey(ret, "error"));
+    QDECREF(ret);
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-set-profile',"
+                 " 'arguments': {'name': 'bad', 'settings':"
+                 " [{'key': '/sys/../etc/passwd', 'value': 'x'}]}}");
+    g_assert_nonnull(ret);
+    g_assert(qdict_haskey(ret, "error"));
+    QDECREF(ret);
+
+    /* nothing was applied, so there is nothing to reset */
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-reset-profile'}");
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+    QDECREF(ret);
+}
+
+static void test_qga_provision(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    gchar *path, *cmd, *contents;
+    QDict *ret, *val, *step;
+    QList *steps;
+    struct stat st;
+    int i;
+
+    path = g_build_filename(fixture->test_dir, "provision", "app.conf",
+                           NULL);
+    cmd = g_strdup_printf("{'execute': 'guest-provision', 'arguments':"
+                          " {'id': 'first-boot',"
+                          " 'files': [{'path': '%s', 'content': 'a2V5PTEK',"
+                          " 'mode': 384}],"
+                          " 'commands': [{'argv': ['sh', '-c', 'echo hi']}]}}",
+                          path);
+
+    /* the second run finds everything done */
+    for (i = 0; i < 2; i++) {
+        ret = qmp_fd(fixture->fd, cmd);
+        g_assert_nonnull(ret);
+        qmp_assert_no_error(ret);
+        val = qdict_get_qdict(ret, "return");
+        g_assert(qdict_get_bool(val, "complete"));
+        steps = qdict_get_qlist(val, "steps");
+        g_assert_cmpint(qlist_size(steps), ==, 2);
+        step = qobject_to_qdict(qlist_peek(steps));
+        g_assert_cmpstr(qdict_get_str(step, "type"), ==, "file");
+        g_assert_cmpstr(qdict_get_str(step, "status"), ==,
+                        i ? "unchanged" : "changed");
+        QDECREF(ret);
+    }
+    g_free(cmd);
+
+    g_assert(g_file_get_contents(path, &contents, NULL, NULL));
+    g_assert_cmpstr(contents, ==, "key=1\n");
+    g_free(contents);
+    g_assert_cmpint(stat(path, &st), ==, 0);
+    g_assert_cmpint(st.st_mode & 0777, ==, 0600);
+
+    /* a failing command stops the bundle */
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-provision', 'arguments':"
+                 " {'commands': [{'argv': ['sh', '-c', 'exit 3']},"
+                 " {'argv': ['true']}]}}");
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+    val = qdict_get_qdict(ret, "return");
+    g_assert(!qdict_get_bool(val, "complete"));
+    steps = qdict_get_qlist(val, "steps");
+    step = qobject_to_qdict(qlist_pop(steps));
+    g_assert_cmpstr(qdict_get_str(step, "status"), ==, "failed");
+    g_assert_cmpint(qdict_get_int(step, "exit-code"), ==, 3);
+    QDECREF(step);
+    step = qobject_to_qdict(qlist_peek(steps));
+    g_assert_cmpstr(qdict_get_str(step, "status"), ==, "skipped");
+    QDECREF(ret);
+
+    /* a malformed bundle is rejected before anything is applied */
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-provision', 'arguments':"
+                 " {'files': [{'path': 'relative', 'content': ''}]}}");
+    g_assert_nonnull(ret);
+    g_assert(qdict_haskey(ret, "error"));
+    QDECREF(ret);
+
+    g_free(path);
+}
+
+static void test_qga_ssh_authorized_keys(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    QDict *ret;
+
+    /* only failures: success would touch the ~/.ssh of whoever runs this */
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-ssh-add-authorized-keys',"
+                 " 'arguments': {'username': 'qga-no-such-user',"
+                 " 'keys': ['ssh-ed25519 AAAA test']}}");
+    g_assert_nonnull(ret);
+    g_assert(qdict_haskey(ret, "error"));
+    QDECREF(ret);
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-ssh-set-authorized-keys',"
+                 " 'arguments': {'username': 'root',"
+                 " 'keys': ['ssh-ed25519 AAAA a\\nssh-rsa AAAB b']}}");
+    g_assert_nonnull(ret);
+    g_assert(qdict_haskey(ret, "error"));
+    QDECREF(ret);
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-ssh-remove-authorized-keys',"
+                 " 'arguments': {'username': 'root', 'keys': ['# comment']}}");
+    g_assert_nonnull(ret);
+    g_assert(qdict_haskey(ret, "error"));
+    QDECREF(ret);
+}
+
+static void test_qga_set_net_queues(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    QDict *ret, *val;
+    QList *list;
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-set-net-queues',"
+                 " 'arguments': {'interfaces': ['../lo']}}");
+    g_assert_nonnull(ret);
+    g_assert(qdict_haskey(ret, "error"));
+    QDECREF(ret);
+
+    /* the loopback device has a single queue, nothing changes */
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-set-net-queues',"
+                 " 'arguments': {'interfaces': ['lo'], 'irq-affinity': false,"
+                 " 'xps': false}}");
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+    list = qdict_get_qlist(ret, "return");
+    g_assert_cmpint(qlist_size(list), ==, 1);
+    val = qobject_to_qdict(qlist_peek(list));
+    g_assert_cmpstr(qdict_get_str(val, "name"), ==, "lo");
+    g_assert_cmpint(qdict_get_int(val, "combined"), ==, 1);
+    g_assert_cmpint(qdict_get_int(val, "irqs"), ==, 0);
+    QDECREF(ret);
+}
+
+static void test_qga_set_block_queue_params(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    QDict *ret;
+
+    /* nothing to set */
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-set-block-queue-params',"
+                 " 'arguments': {'devices': [{'name': 'vda'}],"
+                 " 'params': {}}}");
+    g_assert_nonnull(ret);
+    g_assert(qdict_haskey(ret, "error"));
+    QDECREF(ret);
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-set-block-queue-params',"
+                 " 'arguments': {'devices': [{'name': '../../kernel'}],"
+                 " 'params': {'read-ahead-kb': 128}}}");
+    g_assert_nonnull(ret);
+    g_assert(qdict_haskey(ret, "error"));
+    QDECREF(ret);
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-set-block-queue-params',"
+                 " 'arguments': {'devices': [{'name': 'vda'}],"
+                 " 'params': {'scheduler': 'none; reboot'}}}");
+    g_assert_nonnull(ret);
+    g_assert(qdict_haskey(ret, "error"));
+    QDECREF(ret);
+}
+
+static void test_qga_alert_rules(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    QDict *ret, *val;
+
+#ifdef CONFIG_QGA_LEAN
+    /* compiled out of lean builds */
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-get-alert-rules'}");
+    g_assert(qdict_haskey(ret, "error"));
+    QDECREF(ret);
+    return;
+#endif
+
+    /* a rule that always matches fires at the first check */
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-set-alert-rules',"
+                 " 'arguments': {'interval': 1, 'rules':"
+                 " [{'type': 'load-average', 'threshold': 0}]}}");
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+    QDECREF(ret);
+
+    ret = qmp_fd_receive(fixture->fd);
+    g_assert_nonnull(ret);
+    g_assert_cmpstr(qdict_get_str(ret, "event"), ==, "GUEST_ALERT");
+    val = qdict_get_qdict(ret, "data");
+    g_assert_cmpstr(qdict_get_str(val, "type"), ==, "load-average");
+    g_assert(qdict_get_bool(val, "active"));
+    QDECREF(ret);
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-set-alert-rules',"
+                 " 'arguments': {'rules': []}}");
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+    QDECREF(ret);
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-get-alert-rules'}");
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+    val = qdict_get_qdict(ret, "return");
+    g_assert_cmpint(qlist_size(qdict_get_qlist(val, "rules")), ==, 0);
+    QDECREF(ret);
+
+    /* thresholds are mandatory but for oom-kill */
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-set-alert-rules',"
+                 " 'arguments': {'rules': [{'type': 'disk-usage'}]}}");
+    g_assert_nonnull(ret);
+    g_assert(qdict_haskey(ret, "error"));
+    QDECREF(ret);
+}
+
+static void test_qga_health(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    QDict *ret, *val;
+    QList *list;
+    const char *status;
+    int i;
+
+#ifdef CONFIG_QGA_LEAN
+    /* compiled out of lean builds */
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-get-health'}");
+    g_assert(qdict_haskey(ret, "error"));
+    QDECREF(ret);
+    return;
+#endif
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-set-health-checks',"
+                 " 'arguments': {'checks':"
+                 " [{'name': 'root', 'type': 'file', 'interval': 1,"
+                 "   'path': '/'},"
+                 "  {'name': 'false', 'type': 'exec', 'interval': 1,"
+                 "   'argv': ['false']}]}}");
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+    QDECREF(ret);
+
+    /* the first runs are spread over the first interval */
+    for (i = 0; i < 200; i++) {
+        ret = qmp_fd(fixture->fd, "{'execute': 'guest-get-health'}");
+        g_assert_nonnull(ret);
+        qmp_assert_no_error(ret);
+        list = qdict_get_qlist(ret, "return");
+        g_assert_cmpint(qlist_size(list), ==, 2);
+        val = qobject_to_qdict(qlist_entry_obj(qlist_next(qlist_first(list))));
+        status = qdict_get_str(val, "status");
+        if (strcmp(status, "pending")) {
+            break;
+        }
+        QDECREF(ret);
+        g_usleep(20 * 1000);
+    }
+    g_assert_cmpstr(status, ==, "failing");
+    g_assert_cmpint(qdict_get_int(val, "exit-code"), ==, 1);
+    g_assert_cmpint(qdict_get_int(val, "failures"), >=, 1);
+    QDECREF(ret);
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-get-health'}");
+    g_assert_nonnull(ret);
+    val = qobject_to_qdict(qlist_peek(qdict_get_qlist(ret, "return")));
+    g_assert_cmpstr(qdict_get_str(val, "name"), ==, "root");
+    g_assert_cmpstr(qdict_get_str(val, "type"), ==, "file");
+    QDECREF(ret);
+
+    /* a bad set leaves the checks in place */
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-set-health-checks',"
+                 " 'arguments': {'checks':"
+                 " [{'name': 'web', 'type': 'http', 'interval': 1,"
+                 "   'host': 'localhost', 'port': 80}]}}");
+    g_assert_nonnull(ret);
+    g_assert(qdict_haskey(ret, "error"));
+    QDECREF(ret);
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-get-health'}");
+    g_assert_nonnull(ret);
+    g_assert_cmpint(qlist_size(qdict_get_qlist(ret, "return")), ==, 2);
+    QDECREF(ret);
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-set-health-checks',"
+                 " 'arguments': {'checks': []}}");
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+    QDECREF(ret);
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-get-health'}");
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+    g_assert_cmpint(qlist_size(qdict_get_qlist(ret, "return")), ==, 0);
+    QDECREF(ret);
+}
+
+static void test_qga_file_ops(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    const guchar helloworld[] = "Hello World!\n";
+    const char *b64;
+    gchar *cmd, *path, *enc;
+    guchar *dec;
+    QDict *ret, *val;
+    int64_t id, eof;
+    gsize count;
+    GKeyFile *keyfile;
+    FILE *f;
+    char tmp[100];
+
+    /* open */
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-file-open',"
+                 " 'arguments': { 'path': 'foo', 'mode': 'w+' } }");
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+    id = qdict_get_int(ret, "return");
+    QDECREF(ret);
+
+    /* the state file records the end of the block the id came from */
+    path = g_build_filename(fixture->test_dir, "qga.state", NULL);
+    keyfile = g_key_file_new();
+    g_assert(g_key_file_load_from_file(keyfile, path, 0, NULL));
+    g_assert_cmpint(g_key_file_get_integer(keyfile, "global", "fd_counter",
+                                           NULL), >, id);
+    g_key_file_free(keyfile);
+    g_free(path);
+
+    enc = g_base64_encode(helloworld, sizeof(helloworld));
+    /* write */
+    cmd = g_strdup_printf("{'execute': 'guest-file-write',"
+                          " 'arguments': { 'handle': %" PRId64 ","
+                          " 'buf-b64': '%s' } }", id, enc);
+    ret = qmp_fd(fixture->fd, cmd);
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+
+    val = qdict_get_qdict(ret, "return");
+    count = qdict_get_int(val, "count");
+    eof = qdict_get_bool(val, "eof");
+    g_assert_cmpint(count, ==, sizeof(helloworld));
+    g_assert_cmpint(eof, ==, 0);
+    QDECREF(ret);
+    g_free(cmd);
+
+    /* flush */
+    cmd = g_strdup_printf("{'execute': 'guest-file-flush',"
+                          " 'arguments': {'handle': %" PRId64 "} }",
+                          id);
+    ret = qmp_fd(fixture->fd, cmd);
+    QDECREF(ret);
+    g_free(cmd);
+
+    /* close */
+    cmd = g_strdup_printf("{'execute': 'guest-file-close',"
+                          " 'arguments': {'handle': %" PRId64 "} }",
+                          id);
+    ret = qmp_fd(fixture->fd, cmd);
+    QDECREF(ret);
+    g_free(cmd);
+
+    /* check content */
+    path = g_build_filename(fixture->test_dir, "foo", NULL);
+    f = fopen(path, "r");
+    g_assert_nonnull(f);
+    count = fread(tmp, 1, sizeof(tmp), f);
+    g_assert_cmpint(count, ==, sizeof(helloworld));
+    tmp[count] = 0;
+    g_assert_cmpstr(tmp, ==, (char *)helloworld);
+    fclose(f);
+
+    /* open */
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-file-open',"
+                 " 'arguments': { 'path': 'foo', 'mode': 'r' } }");
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+    id = qdict_get_int(ret, "return");
+    QDECREF(ret);
+
+    /* read */
+    cmd = g_strdup_printf("{'execute': 'guest-file-read',"
+                          " 'arguments': { 'handle': %" PRId64 "} }",
+                          id);
+    ret = qmp_fd(fixture->fd, cmd);
+    val = qdict_get_qdict(ret, "return");
+    count = qdict_get_int(val, "count");
+    eof = qdict_get_bool(val, "eof");
+    b64 = qdict_get_str(val, "buf-b64");
+    g_assert_cmpint(count, ==, sizeof(helloworld));
+    g_assert(eof);
+    g_assert_cmpstr(b64, ==, enc);
+
+    QDECREF(ret);
+    g_free(cmd);
+    g_free(enc);
+
+    /* read eof */
+    cmd = g_strdup_printf("{'execute': 'guest-file-read',"
+                          " 'arguments': { 'handle': %" PRId64 "} }",
+                          id);
+    ret = qmp_fd(fixture->fd, cmd);
+    val = qdict_get_qdict(ret, "return");
+    count = qdict_get_int(val, "count");
+    eof = qdict_get_bool(val, "eof");
+    b64 = qdict_get_str(val, "buf-b64");
+    g_assert_cmpint(count, ==, 0);
+    g_assert(eof);
+    g_assert_cmpstr(b64, ==, "");
+    QDECREF(ret);
+    g_free(cmd);
+
+    /* seek */
+    cmd = g_strdup_printf("{'execute': 'guest-file-seek',"
+                          " 'arguments': { 'handle': %" PRId64 ", "
+                          " 'offset': %d, 'whence': %d } }",
+                          id, 6, SEEK_SET);
+    ret = qmp_fd(fixture->fd, cmd);
+    qmp_assert_no_error(ret);
+    val = qdict_get_qdict(ret, "return");
+    count = qdict_get_int(val, "position");
+    eof = qdict_get_bool(val, "eof");
+    g_assert_cmpint(count, ==, 6);
+    g_assert(!eof);
+    QDECREF(ret);
+    g_free(cmd);
+
+    /* partial read */
+    cmd = g_strdup_printf("{'execute': 'guest-file-read',"
+                          " 'arguments': { 'handle': %" PRId64 "} }",
+                          id);
+    ret = qmp_fd(fixture->fd, cmd);
+    val = qdict_get_qdict(ret, "return");
+    count = qdict_get_int(val, "count");
+    eof = qdict_get_bool(val, "eof");
+    b64 = qdict_get_str(val, "buf-b64");
+    g_assert_cmpint(count, ==, sizeof(helloworld) - 6);
+    g_assert(eof);
+    dec = g_base64_decode(b64, &count);
+    g_assert_cmpint(count, ==, sizeof(helloworld) - 6);
+    g_assert_cmpmem(dec, count, helloworld + 6, sizeof(helloworld) - 6);
+    g_free(dec);
+
+    QDECREF(ret);
+    g_free(cmd);
+
+    /* close */
+    cmd = g_strdup_printf("{'execute': 'guest-file-close',"
+                          " 'arguments': {'handle': %" PRId64 "} }",
+                          id);
+    ret = qmp_fd(fixture->fd, cmd);
+    QDECREF(ret);
+    g_free(cmd);
+}
+
+static void test_qga_file_pread(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    const char *const caching[] = { "buffered", "unbuffered" };
+    gchar *cmd, *enc;
+    guchar *dec;
+    QDict *ret, *val;
+    int64_t id;
+    gsize count;
+    int i;
+
+    for (i = 0; i < G_N_ELEMENTS(caching); i++) {
+        cmd = g_strdup_printf("{'execute': 'guest-file-open',"
+                              " 'arguments': { 'path': 'bar', 'mode': 'w+',"
+                              " 'caching': '%s' } }", caching[i]);
+        ret = qmp_fd(fixture->fd, cmd);
+        g_assert_nonnull(ret);
+        qmp_assert_no_error(ret);
+        id = qdict_get_int(ret, "return");
+        QDECREF(ret);
+        g_free(cmd);
+
+        /* a buffered write is seen by the positional read */
+        enc = g_base64_encode((const guchar *)"abcdef", 6);
+        cmd = g_strdup_printf("{'execute': 'guest-file-write',"
+                              " 'arguments': { 'handle': %" PRId64 ","
+                              " 'buf-b64': '%s' } }", id, enc);
+        ret = qmp_fd(fixture->fd, cmd);
+        qmp_assert_no_error(ret);
+        QDECREF(ret);
+        g_free(cmd);
+        g_free(enc);
+
+        enc = g_base64_encode((const guchar *)"XY", 2);
+        cmd = g_strdup_printf("{'execute': 'guest-file-pwrite',"
+                              " 'arguments': { 'handle': %" PRId64 ","
+                              " 'offset': 2, 'buf-b64': '%s' } }", id, enc);
+        ret = qmp_fd(fixture->fd, cmd);
+        qmp_assert_no_error(ret);
+        val = qdict_get_qdict(ret, "return");
+        g_assert_cmpint(qdict_get_int(val, "count"), ==, 2);
+        QDECREF(ret);
+        g_free(cmd);
+        g_free(enc);
+
+        cmd = g_strdup_printf("{'execute': 'guest-file-pread',"
+                              " 'arguments': { 'handle': %" PRId64 ","
+                              " 'offset': 1, 'count': 4 } }", id);
+        ret = qmp_fd(fixture->fd, cmd);
+        qmp_assert_no_error(ret);
+        val = qdict_get_qdict(ret, "return");
+        g_assert_cmpint(qdict_get_int(val, "count"), ==, 4);
+        g_assert(!qdict_get_bool(val, "eof"));
+        dec = g_base64_decode(qdict_get_str(val, "buf-b64"), &count);
+        g_assert_cmpmem(dec, count, "bXYe", 4);
+        g_free(dec);
+        QDECREF(ret);
+        g_free(cmd);
+
+        /* the handle position is still at the end of the first write */
+        cmd = g_strdup_printf("{'execute': 'guest-file-pread',"
+                              " 'arguments': { 'handle': %" PRId64 ","
+                              " 'offset': 4 } }", id);
+        ret = qmp_fd(fixture->fd, cmd);
+        qmp_assert_no_error(ret);
+        val = qdict_get_qdict(ret, "return");
+        g_assert_cmpint(qdict_get_int(val, "count"), ==, 2);
+        g_assert(qdict_get_bool(val, "eof"));
+        QDECREF(ret);
+        g_free(cmd);
+
+        cmd = g_strdup_printf("{'execute': 'guest-file-seek',"
+                              " 'arguments': { 'handle': %" PRId64 ", "
+                              " 'offset': 0, 'whence': %d } }",
+                              id, SEEK_CUR);
+        ret = qmp_fd(fixture->fd, cmd);
+        qmp_assert_no_error(ret);
+        val = qdict_get_qdict(ret, "return");
+        g_assert_cmpint(qdict_get_int(val, "position"), ==, 6);
+        QDECREF(ret);
+        g_free(cmd);
+
+        cmd = g_strdup_printf("{'execute': 'guest-file-close',"
+                              " 'arguments': {'handle': %" PRId64 "} }", id);
+        ret = qmp_fd(fixture->fd, cmd);
+        qmp_assert_no_error(ret);
+        QDECREF(ret);
+        g_free(cmd);
+    }
+}
+
+/* guest-file-read or guest-file-pread, @data the contents of the file */
+static void qga_file_read_check(int fd, const char *cmd, const guchar *data,
+                                int64_t offset, int64_t count, bool eof)
+{
+    QDict *ret, *val;
+    guchar *dec;
+    gsize len;
+
+    ret = qmp_fd(fd, cmd);
+    qmp_assert_no_error(ret);
+    val = qdict_get_qdict(ret, "return");
+    g_assert_cmpint(qdict_get_int(val, "count"), ==, count);
+    g_assert(qdict_get_bool(val, "eof") == eof);
+    dec = g_base64_decode(qdict_get_str(val, "buf-b64"), &len);
+    g_assert_cmpmem(dec, len, data + offset, count);
+    g_free(dec);
+    QDECREF(ret);
+}
+
+/* large reads come from a mapping of the file, small ones through stdio */
+static void test_qga_file_read_mapped(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    size_t size = 200000, pos;
+    guchar *data = g_malloc(size);
+    gchar *path, *cmd;
+    QDict *ret;
+    int64_t id;
+
+    for (pos = 0; pos < size; pos++) {
+        data[pos] = pos * 11 + (pos >> 12);
+    }
+    path = g_build_filename(fixture->test_dir, "mapped", NULL);
+    g_assert(g_file_set_contents(path, (gchar *)data, size, NULL));
+
+    cmd = g_strdup_printf("{'execute': 'guest-file-open',"
+                          " 'arguments': { 'path': '%s' } }", path);
+    ret = qmp_fd(fixture->fd, cmd);
+    qmp_assert_no_error(ret);
+    id = qdict_get_int(ret, "return");
+    QDECREF(ret);
+    g_free(cmd);
+
+    /* the stdio buffer read ahead, the mapped read starts after 1 byte */
+    cmd = g_strdup_printf("{'execute': 'guest-file-read', 'arguments':"
+                          " { 'handle': %" PRId64 ", 'count': 1 } }", id);
+    qga_file_read_check(fixture->fd, cmd, data, 0, 1, false);
+    g_free(cmd);
+    cmd = g_strdup_printf("{'execute': 'guest-file-read', 'arguments':"
+                          " { 'handle': %" PRId64 ", 'count': 100000 } }",
+                          id);
+    qga_file_read_check(fixture->fd, cmd, data, 1, 100000, false);
+    g_free(cmd);
+    cmd = g_strdup_printf("{'execute': 'guest-file-read', 'arguments':"
+                          " { 'handle': %" PRId64 ", 'count': 10 } }", id);
+    qga_file_read_check(fixture->fd, cmd, data, 100001, 10, false);
+    g_free(cmd);
+    cmd = g_strdup_printf("{'execute': 'guest-file-read', 'arguments':"
+                          " { 'handle': %" PRId64 ", 'count': 200000 } }",
+                          id);
+    qga_file_read_check(fixture->fd, cmd, data, 100011, size - 100011, true);
+    qga_file_read_check(fixture->fd, cmd, data, size, 0, true);
+    g_free(cmd);
+
+    cmd = g_strdup_printf("{'execute': 'guest-file-pread', 'arguments':"
+                          " { 'handle': %" PRId64 ", 'offset': 5000,"
+                          " 'count': 70000 } }", id);
+    qga_file_read_check(fixture->fd, cmd, data, 5000, 70000, false);
+    g_free(cmd);
+
+    cmd = g_strdup_printf("{'execute': 'guest-file-close',"
+                          " 'arguments': {'handle': %" PRId64 "} }", id);
+    ret = qmp_fd(fixture->fd, cmd);
+    qmp_assert_no_error(ret);
+    QDECREF(ret);
+    g_free(cmd);
+
+    unlink(path);
+    g_free(path);
+    g_free(data);
+}
+
+/* guest-file-upload-write of @str at @offset, the new offset or -1 */
+static int64_t qga_file_upload_write(int fd, const char *path,
+                                     int64_t offset, const char *str)
+{
+    gchar *cmd, *enc = g_base64_encode((const guchar *)str, strlen(str));
+    QDict *ret;
+    int64_t next = -1;
+
+    cmd = g_strdup_printf("{'execute': 'guest-file-upload-write',"
+                          " 'arguments': { 'path': '%s', 'offset': %" PRId64
+                          ", 'buf-b64': '%s' } }", path, offset, enc);
+    ret = qmp_fd(fd, cmd);
+    if (!qdict_haskey(ret, "error")) {
+        next = qdict_get_int(qdict_get_qdict(ret, "return"), "offset");
+    }
+    QDECREF(ret);
+    g_free(cmd);
+    g_free(enc);
+    return next;
+}
+
+static void test_qga_file_upload(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    gchar *path, *staged, *cmd, *contents;
+    struct stat st;
+    QDict *ret;
+
+    path = g_build_filename(fixture->test_dir, "upload", NULL);
+    staged = g_build_filename(fixture->test_dir, ".upload.qga-upload", NULL);
+    g_assert(g_file_set_contents(path, "old", -1, NULL));
+    g_assert_cmpint(chmod(path, 0640), ==, 0);
+
+    cmd = g_strdup_printf("{'execute': 'guest-file-upload-begin',"
+                          " 'arguments': { 'path': '%s' } }", path);
+    ret = qmp_fd(fixture->fd, cmd);
+    qmp_assert_no_error(ret);
+    g_assert_cmpint(qdict_get_int(qdict_get_qdict(ret, "return"), "offset"),
+                    ==, 0);
+    QDECREF(ret);
+
+    g_assert_cmpint(qga_file_upload_write(fixture->fd, path, 0, "hello "),
+                    ==, 6);
+    g_assert(g_file_get_contents(path, &contents, NULL, NULL));
+    g_assert_cmpstr(contents, ==, "old");
+    g_free(contents);
+
+    /* resuming finds what was staged; chunks may be sent again */
+    ret = qmp_fd(fixture->fd, cmd);
+    qmp_assert_no_error(ret);
+    g_assert_cmpint(qdict_get_int(qdict_get_qdict(ret, "return"), "offset"),
+                    ==, 6);
+    QDECREF(ret);
+    g_free(cmd);
+    g_assert_cmpint(qga_file_upload_write(fixture->fd, path, 3, "lo world"),
+                    ==, 11);
+    g_assert_cmpint(qga_file_upload_write(fixture->fd, path, 20, "gap"),
+                    ==, -1);
+
+    cmd = g_strdup_printf("{'execute': 'guest-file-upload-commit',"
+                          " 'arguments': { 'path': '%s', 'size': 5 } }", path);
+    ret = qmp_fd(fixture->fd, cmd);
+    g_assert(qdict_haskey(ret, "error"));
+    QDECREF(ret);
+    g_free(cmd);
+    cmd = g_strdup_printf("{'execute': 'guest-file-upload-commit',"
+                          " 'arguments': { 'path': '%s', 'size': 11 } }",
+                          path);
+    ret = qmp_fd(fixture->fd, cmd);
+    qmp_assert_no_error(ret);
+    QDECREF(ret);
+    g_free(cmd);
+
+    g_assert(g_file_get_contents(path, &contents, NULL, NULL));
+    g_assert_cmpstr(contents, ==, "hello world");
+    g_free(contents);
+    g_assert_cmpint(stat(path, &st), ==, 0);
+    g_assert_cmpint(st.st_mode & 0777, ==, 0640);
+    g_assert(!g_file_test(staged, G_FILE_TEST_EXISTS));
+    g_assert_cmpint(qga_file_upload_write(fixture->fd, path, 0, "x"), ==, -1);
+
+    /* an aborted upload leaves the file alone */
+    cmd = g_strdup_printf("{'execute': 'guest-file-upload-begin',"
+                          " 'arguments': { 'path': '%s' } }", path);
+    ret = qmp_fd(fixture->fd, cmd);
+    qmp_assert_no_error(ret);
+    QDECREF(ret);
+    g_free(cmd);
+    g_assert_cmpint(qga_file_upload_write(fixture->fd, path, 0, "new"), ==, 3);
+    cmd = g_strdup_printf("{'execute': 'guest-file-upload-abort',"
+                          " 'arguments': { 'path': '%s' } }", path);
+    ret = qmp_fd(fixture->fd, cmd);
+    qmp_assert_no_error(ret);
+    QDECREF(ret);
+    g_free(cmd);
+    g_assert(!g_file_test(staged, G_FILE_TEST_EXISTS));
+    g_assert(g_file_get_contents(path, &contents, NULL, NULL));
+    g_assert_cmpstr(contents, ==, "hello world");
+    g_free(contents);
+
+    unlink(path);
+    g_free(path);
+    g_free(staged);
+}
+
+/* guest-exec-read of @stream, returning the decoded bytes */
+static gchar *qga_exec_read(int fd, int64_t pid, const char *stream,
+                            int max, int64_t *offset, int64_t *dropped,
+                            bool *eof)
+{
+    gchar *cmd, *max_arg, *data;
+    QDict *ret, *val;
+    gsize len;
+
+    max_arg = max < 0 ? g_strdup("") :
+              g_strdup_printf(", 'max-bytes': %d", max);
+    cmd = g_strdup_printf("{'execute': 'guest-exec-read',"
+                          " 'arguments': { 'pid': %" PRId64 ","
+                          " 'stream': '%s'%s } }", pid, stream, max_arg);
+    ret = qmp_fd(fd, cmd);
+    qmp_assert_no_error(ret);
+    val = qdict_get_qdict(ret, "return");
+    data = (gchar *)g_base64_decode(qdict_get_str(val, "buf-b64"), &len);
+    data = g_realloc(data, len + 1);
+    data[len] = '\0';
+    g_assert_cmpint(qdict_get_int(val, "count"), ==, len);
+    *offset = qdict_get_int(val, "offset");
+    *dropped = qdict_get_int(val, "dropped");
+    *eof = qdict_get_bool(val, "eof");
+    QDECREF(ret);
+    g_free(cmd);
+    g_free(max_arg);
+    return data;
+}
+
+/* output is read while the process runs, only the newest is kept */
+/* guest-exec-status of @pid once it has exited */
+static QDict *qga_exec_wait(int fd, int64_t pid)
+{
+    QDict *ret;
+    int i;
+
+    for (i = 0; ; i++) {
+        ret = qmp_fd(fd, "{'execute': 'guest-exec-status',"
+                     " 'arguments': { 'pid': %" PRId64 " } }", pid);
+        qmp_assert_no_error(ret);
+        if (qdict_get_bool(qdict_get_qdict(ret, "return"), "exited") ||
+            i == 250) {
+            return ret;
+        }
+        QDECREF(ret);
+        g_usleep(20 * 1000);
+    }
+}
+
+static void test_qga_exec_read(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    gchar *data, *expected;
+    int64_t pid, offset, dropped;
+    QDict *ret, *val;
+    gsize len;
+    bool eof;
+    int i;
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-exec', 'arguments': {"
+                 " 'path': '/bin/sh', 'arg': [ '-c', 'printf hello; sleep 1;"
+                 " head -c 10000 /dev/zero | tr \\\\\\\\0 x; printf END >&2' ],"
+                 " 'output-buffer': 4096 } }");
+    qmp_assert_no_error(ret);
+    pid = qdict_get_int(qdict_get_qdict(ret, "return"), "pid");
+    QDECREF(ret);
+
+    for (i = 0; ; i++) {
+        data = qga_exec_read(fixture->fd, pid, "out", -1, &offset, &dropped,
+                             &eof);
+        if (*data || i == 100) {
+            break;
+        }
+        g_free(data);
+        g_usleep(20 * 1000);
+    }
+    g_assert_cmpstr(data, ==, "hello");
+    g_assert_cmpint(offset, ==, 0);
+    g_assert_cmpint(dropped, ==, 0);
+    g_assert(!eof);
+    g_free(data);
+
+    /* 10000 bytes through a 4096 byte buffer */
+    for (i = 0; ; i++) {
+        data = qga_exec_read(fixture->fd, pid, "out", 0, &offset, &dropped,
+                             &eof);
+        g_free(data);
+        if (dropped == 10000 - 4096 || i == 250) {
+            break;
+        }
+        g_usleep(20 * 1000);
+    }
+    g_assert_cmpint(dropped, ==, 10000 - 4096);
+    data = qga_exec_read(fixture->fd, pid, "out", 1000, &offset, &dropped,
+                         &eof);
+    g_assert_cmpint(offset, ==, 5 + 10000 - 4096);
+    g_assert_cmpint(strlen(data), ==, 1000);
+    g_free(data);
+    data = qga_exec_read(fixture->fd, pid, "out", -1, &offset, &dropped,
+                         &eof);
+    expected = g_strnfill(4096 - 1000, 'x');
+    g_assert_cmpstr(data, ==, expected);
+    g_assert_cmpint(offset, ==, 5 + 10000 - 3096);
+    g_free(expected);
+    g_free(data);
+
+    for (i = 0; !eof && i < 100; i++) {
+        g_usleep(20 * 1000);
+        data = qga_exec_read(fixture->fd, pid, "out", -1, &offset, &dropped,
+                             &eof);
+        g_assert_cmpstr(data, ==, "");
+        g_free(data);
+    }
+    g_assert(eof);
+
+    /* stderr was left for guest-exec-status */
+    ret = qga_exec_wait(fixture->fd, pid);
+    val = qdict_get_qdict(ret, "return");
+    g_assert(qdict_get_bool(val, "exited"));
+    g_assert_cmpint(qdict_get_int(val, "exitcode"), ==, 0);
+    g_assert(qdict_get_bool(val, "out-truncated"));
+    g_assert(!qdict_haskey(val, "out-data"));
+    data = (gchar *)g_base64_decode(qdict_get_str(val, "err-data"), &len);
+    g_assert_cmpmem(data, len, "END", 3);
+    g_free(data);
+    QDECREF(ret);
+}
+
+static void test_qga_exec_capture(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    gchar *path, *data, *expected;
+    int64_t pid;
+    QDict *ret, *val;
+    gsize len;
+
+    /* megabytes of captured output, well past the first allocation */
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-exec', 'arguments': {"
+                 " 'path': '/bin/sh', 'arg': [ '-c', 'head -c 3000000"
+                 " /dev/zero | tr \\\\\\\\0 x' ], 'capture-output': true } }");
+    qmp_assert_no_error(ret);
+    pid = qdict_get_int(qdict_get_qdict(ret, "return"), "pid");
+    QDECREF(ret);
+    ret = qga_exec_wait(fixture->fd, pid);
+    val = qdict_get_qdict(ret, "return");
+    g_assert(qdict_get_bool(val, "exited"));
+    g_assert(!qdict_haskey(val, "out-truncated"));
+    data = (gchar *)g_base64_decode(qdict_get_str(val, "out-data"), &len);
+    expected = g_strnfill(3000000, 'x');
+    g_assert_cmpmem(data, len, expected, 3000000);
+    g_free(expected);
+    g_free(data);
+    QDECREF(ret);
+
+    /* both streams straight into a file */
+    path = g_build_filename(fixture->test_dir, "exec-out", NULL);
+    g_file_set_contents(path, "stale contents", -1, NULL);
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-exec', 'arguments': {"
+                 " 'path': '/bin/sh', 'arg': [ '-c', 'echo out; echo err >&2'"
+                 " ], 'capture-to-file': %s } }", path);
+    qmp_assert_no_error(ret);
+    pid = qdict_get_int(qdict_get_qdict(ret, "return"), "pid");
+    QDECREF(ret);
+    ret = qga_exec_wait(fixture->fd, pid);
+    val = qdict_get_qdict(ret, "return");
+    g_assert(qdict_get_bool(val, "exited"));
+    g_assert_cmpint(qdict_get_int(val, "exitcode"), ==, 0);
+    g_assert(!qdict_haskey(val, "out-data"));
+    g_assert(!qdict_haskey(val, "err-data"));
+    QDECREF(ret);
+    g_assert(g_file_get_contents(path, &data, NULL, NULL));
+    g_assert_cmpstr(data, ==, "out\nerr\n");
+    g_free(data);
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-exec', 'arguments': {"
+                 " 'path': '/bin/true', 'capture-output': true,"
+                 " 'capture-to-file': %s } }", path);
+    g_assert_nonnull(qdict_get_qdict(ret, "error"));
+    QDECREF(ret);
+
+    unlink(path);
+    g_free(path);
+}
+
+static void test_qga_exec_limits(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    gchar *data;
+    int64_t pid;
+    QDict *ret, *val;
+    gsize len;
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-exec', 'arguments': {"
+                 " 'path': '/bin/sh', 'arg': [ '-c', 'ulimit -n; ulimit -v;"
+                 " nice' ], 'capture-output': true,"
+                 " 'limits': { 'max-files': 64, 'max-memory': 1073741824,"
+                 " 'nice': 5, 'ionice-class': 'best-effort',"
+                 " 'ionice-level': 6 } } }");
+    qmp_assert_no_error(ret);
+    pid = qdict_get_int(qdict_get_qdict(ret, "return"), "pid");
+    QDECREF(ret);
+    ret = qga_exec_wait(fixture->fd, pid);
+    val = qdict_get_qdict(ret, "return");
+    g_assert(qdict_get_bool(val, "exited"));
+    g_assert_cmpint(qdict_get_int(val, "exitcode"), ==, 0);
+    data = (gchar *)g_base64_decode(qdict_get_str(val, "out-data"), &len);
+    g_assert_cmpmem(data, len, "64\n1048576\n5\n", 13);
+    g_free(data);
+    QDECREF(ret);
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-exec', 'arguments': {"
+                 " 'path': '/bin/true', 'limits': { 'nice': 20 } } }");
+    g_assert_nonnull(qdict_get_qdict(ret, "error"));
+    QDECREF(ret);
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-exec', 'arguments': {"
+                 " 'path': '/bin/true', 'limits': { 'ionice-level': 3 } } }");
+    g_assert_nonnull(qdict_get_qdict(ret, "error"));
+    QDECREF(ret);
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-exec', 'arguments': {"
+                 " 'path': '/bin/true', 'limits': { 'cgroup': %s } } }",
+                 fixture->test_dir);
+    g_assert_nonnull(qdict_get_qdict(ret, "error"));
+    QDECREF(ret);
+}
+
+static void test_qga_exec_wait(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    int64_t pid;
+    QDict *ret, *val;
+    gchar *data;
+    gsize len;
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-exec', 'arguments': {"
+                 " 'path': '/bin/sh', 'arg': [ '-c', 'sleep 0.5; echo done' ],"
+                 " 'capture-output': true } }");
+    qmp_assert_no_error(ret);
+    pid = qdict_get_int(qdict_get_qdict(ret, "return"), "pid");
+    QDECREF(ret);
+
+    /* without an id it cannot wait, nor can it with a timeout of 0 */
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-exec-wait',"
+                 " 'arguments': { 'pid': %" PRId64 " } }", pid);
+    qmp_assert_no_error(ret);
+    g_assert(!qdict_get_bool(qdict_get_qdict(ret, "return"), "exited"));
+    QDECREF(ret);
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-exec-wait', 'id': 1,"
+                 " 'arguments': { 'pid': %" PRId64 ", 'timeout-ms': 0 } }",
+                 pid);
+    qmp_assert_no_error(ret);
+    g_assert(!qdict_get_bool(qdict_get_qdict(ret, "return"), "exited"));
+    QDECREF(ret);
+
+    /* one that times out, then one answered when the process exits,
+     * while other requests go on */
+    qmp_fd_send(fixture->fd, "{'execute': 'guest-exec-wait', 'id': 2,"
+                " 'arguments': { 'pid': %" PRId64 ", 'timeout-ms': 50 } }",
+                pid);
+    ret = qmp_fd_receive(fixture->fd);
+    qmp_assert_no_error(ret);
+    g_assert_cmpint(qdict_get_int(ret, "id"), ==, 2);
+    g_assert(!qdict_get_bool(qdict_get_qdict(ret, "return"), "exited"));
+    QDECREF(ret);
+
+    qmp_fd_send(fixture->fd, "{'execute': 'guest-exec-wait', 'id': 3,"
+                " 'arguments': { 'pid': %" PRId64 " } }", pid);
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-ping', 'id': 4}");
+    qmp_assert_no_error(ret);
+    g_assert_cmpint(qdict_get_int(ret, "id"), ==, 4);
+    QDECREF(ret);
+    ret = qmp_fd_receive(fixture->fd);
+    qmp_assert_no_error(ret);
+    g_assert_cmpint(qdict_get_int(ret, "id"), ==, 3);
+    val = qdict_get_qdict(ret, "return");
+    g_assert(qdict_get_bool(val, "exited"));
+    g_assert_cmpint(qdict_get_int(val, "exitcode"), ==, 0);
+    data = (gchar *)g_base64_decode(qdict_get_str(val, "out-data"), &len);
+    g_assert_cmpmem(data, len, "done\n", 5);
+    g_free(data);
+    QDECREF(ret);
+
+    /* the answer reaped it */
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-exec-status',"
+                 " 'arguments': { 'pid': %" PRId64 " } }", pid);
+    g_assert_nonnull(qdict_get_qdict(ret, "error"));
+    QDECREF(ret);
+}
+
+/* guest-exec of /bin/sh -c @script, returning the pid */
+static int64_t qga_exec_start(int fd, const char *script)
+{
+    QDict *ret;
+    int64_t pid;
+
+    ret = qmp_fd(fd, "{'execute': 'guest-exec', 'arguments': {"
+                 " 'path': '/bin/sh', 'arg': [ '-c', %s ] } }", script);
+    qmp_assert_no_error(ret);
+    pid = qdict_get_int(qdict_get_qdict(ret, "return"), "pid");
+    QDECREF(ret);
+    return pid;
+}
+
+/* the pids guest-exec-list returns, separated by spaces; if @exited is
+ * not 0, becomes true once that of them exited */
+static gchar *qga_exec_list(int fd, int64_t exited, bool *done)
+{
+    GString *pids = g_string_new("");
+    QListEntry *entry;
+    QDict *ret, *proc;
+
+    ret = qmp_fd(fd, "{'execute': 'guest-exec-list'}");
+    qmp_assert_no_error(ret);
+    QLIST_FOREACH_ENTRY(qobject_to_qlist(qdict_get(ret, "return")), entry) {
+        proc = qobject_to_qdict(qlist_entry_obj(entry));
+        g_string_append_printf(pids, "%s%" PRId64, pids->len ? " " : "",
+                               qdict_get_int(proc, "pid"));
+        if (qdict_get_int(proc, "pid") == exited && done) {
+            *done = qdict_get_bool(proc, "exited");
+        }
+    }
+    QDECREF(ret);
+    return g_string_free(pids, false);
+}
+
+static void test_qga_exec_table(gconstpointer data)
+{
+    TestFixture fix;
+    gchar *pids, *expected;
+    int64_t pid1, pid2, pid3;
+    bool done = false;
+    QDict *ret;
+    int i;
+
+    fixture_setup(&fix, "--max-exec-processes=2 --exec-reap-timeout=1");
+
+    /* an exited process nobody asks about is forgotten */
+    pid1 = qga_exec_start(fix.fd, "exit 3");
+    for (i = 0; !done && i < 100; i++) {
+        g_free(qga_exec_list(fix.fd, pid1, &done));
+        g_usleep(20 * 1000);
+    }
+    g_assert(done);
+    /* g_timeout_add_seconds() may take up to another second */
+    for (i = 0; i < 150; i++) {
+        pids = qga_exec_list(fix.fd, 0, NULL);
+        if (!*pids) {
+            break;
+        }
+        g_free(pids);
+        g_usleep(20 * 1000);
+    }
+    g_assert_cmpstr(pids, ==, "");
+    g_free(pids);
+
+    /* a full table loses the exited one to make room */
+    pid1 = qga_exec_start(fix.fd, "exit 0");
+    pid2 = qga_exec_start(fix.fd, "sleep 3");
+    done = false;
+    for (i = 0; !done && i < 100; i++) {
+        g_free(qga_exec_list(fix.fd, pid1, &done));
+        g_usleep(20 * 1000);
+    }
+    g_assert(done);
+    pid3 = qga_exec_start(fix.fd, "sleep 3");
+    pids = qga_exec_list(fix.fd, 0, NULL);
+    expected = g_strdup_printf("%" PRId64 " %" PRId64, pid2, pid3);
+    g_assert_cmpstr(pids, ==, expected);
+    g_free(expected);
+    g_free(pids);
+
+    /* but not one that is still running */
+    ret = qmp_fd(fix.fd, "{'execute': 'guest-exec', 'arguments': {"
+                 " 'path': '/bin/true' } }");
+    g_assert_nonnull(qdict_get_qdict(ret, "error"));
+    QDECREF(ret);
+
+    fixture_tear_down(&fix, NULL);
+}
+
+static void test_qga_file_checksum(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    const int64_t offsets[] = { 0, 5000 };
+    guchar data[10000];
+    gchar *path, *cmd;
+    QDict *ret, *val;
+    QListEntry *entry;
+    int64_t pos, len;
+    int i;
+
+    for (pos = 0; pos < sizeof(data); pos++) {
+        data[pos] = pos * 13;
+    }
+    path = g_build_filename(fixture->test_dir, "sums", NULL);
+    g_assert(g_file_set_contents(path, (gchar *)data, sizeof(data), NULL));
+
+    for (i = 0; i < G_N_ELEMENTS(offsets); i++) {
+        cmd = g_strdup_printf("{'execute': 'guest-file-checksum',"
+                              " 'arguments': {'path': '%s', 'offset': %"
+                              PRId64 ", 'block-size': 4096}}",
+                              path, offsets[i]);
+        ret = qmp_fd(fixture->fd, cmd);
+        g_assert_nonnull(ret);
+        qmp_assert_no_error(ret);
+        val = qdict_get_qdict(ret, "return");
+        g_assert_cmpint(qdict_get_int(val, "size"), ==, sizeof(data));
+        g_assert_cmpint(qdict_get_int(val, "block-size"), ==, 4096);
+
+        /* the last block is what is left of the file */
+        pos = offsets[i];
+        QLIST_FOREACH_ENTRY(qdict_get_qlist(val, "crc32c"), entry) {
+            len = MIN(4096, sizeof(data) - pos);
+            g_assert_cmpint(pos, <, sizeof(data));
+            g_assert_cmpint(qint_get_int(qobject_to_qint(entry->value)), ==,
+                            crc32c(0xffffffff, data + pos, len));
+            pos += len;
+        }
+        g_assert_cmpint(pos, ==, sizeof(data));
+        QDECREF(ret);
+        g_free(cmd);
+    }
+
+    cmd = g_strdup_printf("{'execute': 'guest-file-checksum',"
+                          " 'arguments': {'path': '%s', 'block-size': 0}}",
+                          path);
+    ret = qmp_fd(fixture->fd, cmd);
+    g_assert(qdict_haskey(ret, "error"));
+    QDECREF(ret);
+    g_free(cmd);
+
+    unlink(path);
+    g_free(path);
+}
+
+static void test_qga_exec_write(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    int64_t pid;
+    QDict *ret, *val;
+    gsize len = 1536 * 1024;
+    guchar *big;
+    gchar *b64, *data;
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-exec-write', 'arguments':"
+                 " { 'pid': %" PRId64 ", 'data': '' } }",
+                 qga_exec_start(fixture->fd, "true"));
+    g_assert_nonnull(qdict_get_qdict(ret, "error"));
+    QDECREF(ret);
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-exec', 'arguments': {"
+                 " 'path': '/bin/sh', 'arg': [ '-c', 'sleep 0.3; wc -c' ],"
+                 " 'input-data': 'YWJj', 'input-stream': true,"
+                 " 'capture-output': true } }");
+    qmp_assert_no_error(ret);
+    pid = qdict_get_int(qdict_get_qdict(ret, "return"), "pid");
+    QDECREF(ret);
+
+    /* more than the agent buffers: answered once the process reads it,
+     * while other requests go on */
+    big = g_malloc0(len);
+    b64 = g_base64_encode(big, len);
+    qmp_fd_send(fixture->fd, "{'execute': 'guest-exec-write', 'id': 1,"
+                " 'arguments': { 'pid': %" PRId64 ", 'data': %s } }",
+                pid, b64);
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-ping', 'id': 2}");
+    qmp_assert_no_error(ret);
+    g_assert_cmpint(qdict_get_int(ret, "id"), ==, 2);
+    QDECREF(ret);
+    ret = qmp_fd_receive(fixture->fd);
+    qmp_assert_no_error(ret);
+    g_assert_cmpint(qdict_get_int(ret, "id"), ==, 1);
+    g_assert_cmpint(qdict_get_int(qdict_get_qdict(ret, "return"),
+                                  "pending"), <, 1024 * 1024);
+    QDECREF(ret);
+    g_free(b64);
+    g_free(big);
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-exec-write', 'arguments':"
+                 " { 'pid': %" PRId64 ", 'data': 'Cg==', 'eof': true } }",
+                 pid);
+    qmp_assert_no_error(ret);
+    QDECREF(ret);
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-exec-write', 'arguments':"
+                 " { 'pid': %" PRId64 ", 'data': '' } }", pid);
+    g_assert_nonnull(qdict_get_qdict(ret, "error"));
+    QDECREF(ret);
+
+    ret = qga_exec_wait(fixture->fd, pid);
+    val = qdict_get_qdict(ret, "return");
+    g_assert_cmpint(qdict_get_int(val, "exitcode"), ==, 0);
+    data = (gchar *)g_base64_decode(qdict_get_str(val, "out-data"), &len);
+    g_assert_cmpmem(data, len, "1572868\n", 8);
+    g_free(data);
+    QDECREF(ret);
+
+    /* a process that exits without reading its open stdin */
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-exec', 'arguments': {"
+                 " 'path': 'true', 'input-stream': true } }");
+    qmp_assert_no_error(ret);
+    pid = qdict_get_int(qdict_get_qdict(ret, "return"), "pid");
+    QDECREF(ret);
+    ret = qga_exec_wait(fixture->fd, pid);
+    g_assert_cmpint(qdict_get_int(qdict_get_qdict(ret, "return"),
+                                  "exitcode"), ==, 0);
+    QDECREF(ret);
+}
+
+static void test_qga_exec_batch(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    QDict *ret, *val;
+    QList *list;
+    gchar *data;
+    gsize len;
+
+    /* answered when the last one exits, with results in order even
+     * though the first finishes last */
+    qmp_fd_send(fixture->fd, "{'execute': 'guest-exec-batch', 'id': 1,"
+                " 'arguments': { 'max-parallel': 2, 'commands': ["
+                " { 'path': '/bin/sh', 'arg': [ '-c', 'sleep 0.3; echo a' ] },"
+                " { 'path': '/bin/sh', 'arg': [ '-c', 'cat; exit 3' ],"
+                "   'input-data': 'Yg==' },"
+                " { 'path': '/bin/sh', 'arg': [ '-c', 'echo c >&2' ] },"
+                " { 'path': '/nonexistent' } ] } }");
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-ping', 'id': 2}");
+    qmp_assert_no_error(ret);
+    g_assert_cmpint(qdict_get_int(ret, "id"), ==, 2);
+    QDECREF(ret);
+    ret = qmp_fd_receive(fixture->fd);
+    qmp_assert_no_error(ret);
+    g_assert_cmpint(qdict_get_int(ret, "id"), ==, 1);
+    list = qdict_get_qlist(ret, "return");
+    g_assert_cmpint(qlist_size(list), ==, 4);
+
+    val = qobject_to_qdict(qlist_pop(list));
+    g_assert_cmpint(qdict_get_int(val, "exitcode"), ==, 0);
+    data = (gchar *)g_base64_decode(qdict_get_str(val, "out-data"), &len);
+    g_assert_cmpmem(data, len, "a\n", 2);
+    g_free(data);
+    g_assert(!qdict_haskey(val, "err-data"));
+    QDECREF(val);
+
+    val = qobject_to_qdict(qlist_pop(list));
+    g_assert_cmpint(qdict_get_int(val, "exitcode"), ==, 3);
+    g_assert_cmpstr(qdict_get_str(val, "out-data"), ==, "Yg==");
+    QDECREF(val);
+
+    val = qobject_to_qdict(qlist_pop(list));
+    g_assert_cmpint(qdict_get_int(val, "exitcode"), ==, 0);
+    g_assert_cmpstr(qdict_get_str(val, "err-data"), ==, "Ywo=");
+    QDECREF(val);
+
+    val = qobject_to_qdict(qlist_pop(list));
+    g_assert(!qdict_haskey(val, "exitcode"));
+    g_assert_nonnull(qdict_get_qdict(val, "error"));
+    QDECREF(val);
+    QDECREF(ret);
+
+    /* without an id it needs a timeout, which kills what overruns it */
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-exec-batch',"
+                 " 'arguments': { 'commands': [ { 'path': 'true' } ] } }");
+    g_assert_nonnull(qdict_get_qdict(ret, "error"));
+    QDECREF(ret);
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-exec-batch',"
+                 " 'arguments': { 'timeout': 1, 'output-limit': 2,"
+                 " 'commands': [ { 'path': 'sleep', 'arg': [ '10' ] },"
+                 " { 'path': 'echo', 'arg': [ 'abc' ] } ] } }");
+    qmp_assert_no_error(ret);
+    list = qdict_get_qlist(ret, "return");
+    val = qobject_to_qdict(qlist_pop(list));
+    g_assert(qdict_get_bool(val, "timed-out"));
+    g_assert_cmpint(qdict_get_int(val, "signal"), ==, SIGKILL);
+    QDECREF(val);
+    val = qobject_to_qdict(qlist_pop(list));
+    g_assert_cmpstr(qdict_get_str(val, "out-data"), ==, "YWI=");
+    g_assert(qdict_get_bool(val, "out-truncated"));
+    QDECREF(val);
+    QDECREF(ret);
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-exec-batch',"
+                 " 'arguments': { 'max-parallel': 0,"
+                 " 'commands': [ { 'path': 'true' } ] } }");
+    g_assert_nonnull(qdict_get_qdict(ret, "error"));
+    QDECREF(ret);
+}
+
+static void test_qga_get_time(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    QDict *ret;
+    int64_t time;
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-get-time'}");
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+
+    time = qdict_get_int(ret, "return");
+    g_assert_cmpint(time, >, 0);
+
+    QDECREF(ret);
+}
+
+static void test_qga_set_time(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    QDict *ret;
+    int64_t current, time;
+    gchar *cmd;
+
+    /* get current time */
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-get-time'}");
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+    current = qdict_get_int(ret, "return");
+    g_assert_cmpint(current, >, 0);
+    QDECREF(ret);
+
+    /* set some old time */
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-set-time',"
+                 " 'arguments': { 'time': 1000 } }");
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+    QDECREF(ret);
+
+    /* check old time */
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-get-time'}");
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+    time = qdict_get_int(ret, "return");
+    g_assert_cmpint(time / 1000, <, G_USEC_PER_SEC * 10);
+    QDECREF(ret);
+
+    /* set back current time */
+    cmd = g_strdup_printf("{'execute': 'guest-set-time',"
+                          " 'arguments': { 'time': %" PRId64 " } }",
+                          current + time * 1000);
+    ret = qmp_fd(fixture->fd, cmd);
+    g_free(cmd);
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+    QDECREF(ret);
+}
+
+static void test_qga_sync_time_invalid(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    QDict *ret;
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-sync-time',"
+                 " 'arguments': { 'offset': 0, 'step-threshold': -1 } }");
+    g_assert_nonnull(ret);
+    g_assert_nonnull(qdict_get_qdict(ret, "error"));
+    QDECREF(ret);
+}
+
+static void test_qga_notify_resume(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    QDict *ret;
+    QList *list;
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-notify-resume'}");
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+    QDECREF(ret);
+
+    /* the caches were dropped, the answers are the same */
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-network-get-interfaces'}");
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+    list = qdict_get_qlist(ret, "return");
+    g_assert_nonnull(qlist_first(list));
+    QDECREF(ret);
+}
+
+static void test_qga_fstrim(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    QDict *ret;
+    QList *list;
+    const QListEntry *entry;
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-fstrim',"
+                 " arguments: { minimum: 4194304 } }");
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+    list = qdict_get_qlist(ret, "return");
+    entry = qlist_first(list);
+    g_assert(qdict_haskey(qobject_to_qdict(entry->value), "paths"));
+
+    QDECREF(ret);
+}
+
+static void test_qga_fstrim_job(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    QDict *ret, *val;
+    int64_t id;
+    int i;
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-fstrim-start',"
+                 " 'arguments': { 'max-parallel': 0 } }");
+    g_assert(qdict_haskey(ret, "error"));
+    QDECREF(ret);
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-fstrim-start',"
+                 " 'arguments': { 'chunk-size': 4096 } }");
+    g_assert(qdict_haskey(ret, "error"));
+    QDECREF(ret);
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-fstrim-status',"
+                 " 'arguments': { 'id': 12345 } }");
+    g_assert(qdict_haskey(ret, "error"));
+    QDECREF(ret);
+
+    if (!g_getenv("QGA_TEST_SIDE_EFFECTING")) {
+        return;
+    }
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-fstrim-start',"
+                 " 'arguments': { 'chunk-size': 1073741824,"
+                 " 'max-parallel': 2 } }");
+    qmp_assert_no_error(ret);
+    id = qdict_get_int(qdict_get_qdict(ret, "return"), "id");
+    QDECREF(ret);
+
+    /* a finished job is gone once its status was returned */
+    for (i = 0; i < 600; i++) {
+        ret = qmp_fd(fixture->fd, "{'execute': 'guest-fstrim-status',"
+                     " 'arguments': { 'id': %" PRId64 " } }", id);
+        qmp_assert_no_error(ret);
+        val = qdict_get_qdict(ret, "return");
+        g_assert(qdict_haskey(val, "paths"));
+        if (qdict_get_bool(val, "finished")) {
+            QDECREF(ret);
+            break;
+        }
+        QDECREF(ret);
+        g_usleep(100 * 1000);
+    }
+    g_assert_cmpint(i, <, 600);
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-fstrim-status',"
+                 " 'arguments': { 'id': %" PRId64 " } }", id);
+    g_assert(qdict_haskey(ret, "error"));
+    QDECREF(ret);
+}
+
+static void test_qga_file_prefetch(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    size_t size = 100000;
+    char *path, *data;
+    QDict *ret, *val;
+    QList *list;
+    int64_t id;
+    int i;
+
+    data = g_malloc0(size);
+    path = g_build_filename(fixture->test_dir, "prefetch", NULL);
+    g_assert(g_file_set_contents(path, data, size, NULL));
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-file-residency',"
+                 " 'arguments': {'paths': ['%s', '/nonexistent']}}", path);
+    qmp_assert_no_error(ret);
+    list = qdict_get_qlist(ret, "return");
+    g_assert_cmpint(qlist_size(list), ==, 2);
+    val = qobject_to_qdict(qlist_peek(list));
+    g_assert_cmpint(qdict_get_int(val, "size"), ==, size);
+    g_assert_cmpint(qdict_get_int(val, "cached"), <=, size);
+    g_assert(!qdict_haskey(val, "error"));
+    QDECREF(ret);
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-file-prefetch',"
+                 " 'arguments': {'paths': ['%s', '/nonexistent']}}", path);
+    qmp_assert_no_error(ret);
+    id = qdict_get_int(qdict_get_qdict(ret, "return"), "id");
+    QDECREF(ret);
+
+    for (i = 0; i < 100; i++) {
+        ret = qmp_fd(fixture->fd, "{'execute': 'guest-file-prefetch-status',"
+                     " 'arguments': {'id': %" PRId64 "}}", id);
+        qmp_assert_no_error(ret);
+        val = qdict_get_qdict(ret, "return");
+        g_assert_cmpint(qdict_get_int(val, "total"), ==, size);
+        if (qdict_get_bool(val, "finished")) {
+            g_assert_cmpint(qdict_get_int(val, "done"), ==, size);
+            g_assert_cmpint(qdict_get_int(val, "failed"), ==, 1);
+            QDECREF(ret);
+            break;
+        }
+        QDECREF(ret);
+        g_usleep(50 * 1000);
+    }
+    g_assert_cmpint(i, <, 100);
+
+    unlink(path);
+    g_free(path);
+    g_free(data);
+}
+
+static void test_qga_file_ops(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    const QListEntry *e;
+    char *dir, *link;
+    struct stat st;
+    QDict *ret, *val;
+    QList *list;
+    int n = 0;
+
+    dir = g_build_filename(fixture->test_dir, "ops", NULL);
+    link = g_build_filename(dir, "c", "link", NULL);
+
+    /* nothing is done when an operation is not valid */
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-file-ops',"
+                 " 'arguments': {'ops': ["
+                 " {'op': 'mkdir', 'path': '%s'},"
+                 " {'op': 'chmod', 'path': '%s'}]}}", dir, dir);
+    g_assert(qdict_haskey(ret, "error"));
+    QDECREF(ret);
+    g_assert(stat(dir, &st) < 0);
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-file-ops',"
+                 " 'arguments': {'stop-on-error': false, 'ops': ["
+                 " {'op': 'mkdir', 'path': '%s/a/b/', 'parents': true},"
+                 " {'op': 'chmod', 'path': '%s/a/b', 'mode': 448},"
+                 " {'op': 'rename', 'path': '%s/a', 'target': '%s/c'},"
+                 " {'op': 'symlink', 'path': '%s', 'target': 'b'},"
+                 " {'op': 'unlink', 'path': '%s/a/b'},"
+                 " {'op': 'mkdir', 'path': '%s/c', 'parents': true}]}}",
+                 dir, dir, dir, dir, link, dir, dir);
+    qmp_assert_no_error(ret);
+    list = qdict_get_qlist(ret, "return");
+    QLIST_FOREACH_ENTRY(list, e) {
+        val = qobject_to_qdict(qlist_entry_obj(e));
+        /* only the unlink fails, /a is /c by then */
+        g_assert_cmpint(qdict_get_bool(val, "success"), ==, n != 4);
+        g_assert_cmpint(qdict_haskey(val, "error"), ==, n == 4);
+        n++;
+    }
+    g_assert_cmpint(n, ==, 6);
+    QDECREF(ret);
+
+    g_assert(stat(link, &st) == 0);
+    g_assert(S_ISDIR(st.st_mode));
+    g_assert_cmpint(st.st_mode & 07777, ==, 0700);
+
+    /* the rest is left undone after a failure */
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-file-ops',"
+                 " 'arguments': {'ops': ["
+                 " {'op': 'rmdir', 'path': '%s/c'},"
+                 " {'op': 'unlink', 'path': '%s'}]}}", dir, link);
+    qmp_assert_no_error(ret);
+    list = qdict_get_qlist(ret, "return");
+    g_assert_cmpint(qlist_size(list), ==, 1);
+    QDECREF(ret);
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-file-ops',"
+                 " 'arguments': {'ops': ["
+                 " {'op': 'unlink', 'path': '%s'},"
+                 " {'op': 'rmdir', 'path': '%s/c/b'},"
+                 " {'op': 'rmdir', 'path': '%s/c'},"
+                 " {'op': 'rmdir', 'path': '%s'}]}}", link, dir, dir, dir);
+    qmp_assert_no_error(ret);
+    list = qdict_get_qlist(ret, "return");
+    QLIST_FOREACH_ENTRY(list, e) {
+        val = qobject_to_qdict(qlist_entry_obj(e));
+        g_assert(qdict_get_bool(val, "success"));
+    }
+    g_assert_cmpint(qlist_size(list), ==, 4);
+    QDECREF(ret);
+    g_assert(stat(dir, &st) < 0);
+
+    g_free(dir);
+    g_free(link);
+}
+
+static void test_qga_file_copy(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    size_t size = 300000, pos;
+    char *src, *dst, *data, *copy;
+    gsize copy_len;
+    QDict *ret, *val;
+    int64_t id;
+    int i;
+
+    data = g_malloc(size);
+    for (pos = 0; pos < size; pos++) {
+        data[pos] = pos * 13;
+    }
+    src = g_build_filename(fixture->test_dir, "copy-src", NULL);
+    dst = g_build_filename(fixture->test_dir, "copy-dst", NULL);
+    g_assert(g_file_set_contents(src, data, size, NULL));
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-file-copy-start',"
+                 " 'arguments': {'src': '%s', 'dst': '%s'}}", src, src);
+    g_assert(qdict_haskey(ret, "error"));
+    QDECREF(ret);
+
+    /* a range, and nothing past the end of the source */
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-file-copy-start',"
+                 " 'arguments': {'src': '%s', 'dst': '%s',"
+                 " 'offset': 1000, 'length': 1000000}}", src, dst);
+    qmp_assert_no_error(ret);
+    id = qdict_get_int(qdict_get_qdict(ret, "return"), "id");
+    QDECREF(ret);
+
+    for (i = 0; i < 100; i++) {
+        ret = qmp_fd(fixture->fd, "{'execute': 'guest-file-copy-status',"
+                     " 'arguments': {'id': %" PRId64 "}}", id);
+        qmp_assert_no_error(ret);
+        val = qdict_get_qdict(ret, "return");
+        g_assert_cmpint(qdict_get_int(val, "total"), ==, size - 1000);
+        if (qdict_get_bool(val, "finished")) {
+            g_assert(!qdict_haskey(val, "error"));
+            g_assert(qdict_haskey(val, "method"));
+            g_assert_cmpint(qdict_get_int(val, "done"), ==, size - 1000);
+            QDECREF(ret);
+            break;
+        }
+        QDECREF(ret);
+        g_usleep(50 * 1000);
+    }
+    g_assert_cmpint(i, <, 100);
+
+    g_assert(g_file_get_contents(dst, &copy, &copy_len, NULL));
+    g_assert_cmpint(copy_len, ==, size - 1000);
+    g_assert(memcmp(copy, data + 1000, copy_len) == 0);
+    g_free(copy);
+
+    /* a finished job is gone once its status was returned */
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-file-copy-status',"
+                 " 'arguments': {'id': %" PRId64 "}}", id);
+    g_assert(qdict_haskey(ret, "error"));
+    QDECREF(ret);
+
+    unlink(src);
+    unlink(dst);
+    g_free(src);
+    g_free(dst);
+    g_free(data);
+}
+
+static void test_qga_memory_blocks_job(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    QDict *ret, *val, *blk = NULL;
+    const QListEntry *entry;
+    int64_t id, index;
+    int i;
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-set-memory-blocks-start',"
+                 " 'arguments': { 'ranges': [] } }");
+    g_assert(qdict_haskey(ret, "error"));
+    QDECREF(ret);
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-set-memory-blocks-start',"
+                 " 'arguments': { 'ranges': [ { 'first': 0, 'last': 1,"
+                 " 'online': true } ], 'max-parallel': 0 } }");
+    g_assert(qdict_haskey(ret, "error"));
+    QDECREF(ret);
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-set-memory-blocks-status',"
+                 " 'arguments': { 'id': 12345 } }");
+    g_assert(qdict_haskey(ret, "error"));
+    QDECREF(ret);
+
+    /* onlining an online block changes nothing */
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-get-memory-blocks'}");
+    if (qdict_haskey(ret, "error")) {
+        QDECREF(ret);
+        return;
+    }
+    entry = qlist_first(qdict_get_qlist(ret, "return"));
+    for (; entry && !blk; entry = qlist_next(entry)) {
+        blk = qobject_to_qdict(entry->value);
+        if (!qdict_get_bool(blk, "online")) {
+            blk = NULL;
+        }
+    }
+    if (!blk) {
+        QDECREF(ret);
+        return;
+    }
+    index = qdict_get_int(blk, "phys-index");
+    QDECREF(ret);
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-set-memory-blocks-start',"
+                 " 'arguments': { 'ranges': [ { 'first': %" PRId64 ","
+                 " 'last': %" PRId64 ", 'online': true } ],"
+                 " 'max-parallel': 2 } }", index, index);
+    qmp_assert_no_error(ret);
+    id = qdict_get_int(qdict_get_qdict(ret, "return"), "id");
+    QDECREF(ret);
+
+    /* a finished job is gone once its status was returned */
+    for (i = 0; i < 100; i++) {
+        ret = qmp_fd(fixture->fd,
+                     "{'execute': 'guest-set-memory-blocks-status',"
+                     " 'arguments': { 'id': %" PRId64 " } }", id);
+        qmp_assert_no_error(ret);
+        val = qdict_get_qdict(ret, "return");
+        g_assert_cmpint(qdict_get_int(val, "total"), ==, 1);
+        if (qdict_get_bool(val, "finished")) {
+            g_assert_cmpint(qdict_get_int(val, "done"), ==, 1);
+            g_assert_cmpint(qdict_get_int(val, "failed"), ==, 0);
+            QDECREF(ret);
+            break;
+        }
+        QDECREF(ret);
+        g_usleep(10 * 1000);
+    }
+    g_assert_cmpint(i, <, 100);
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-set-memory-blocks-status',"
+                 " 'arguments': { 'id': %" PRId64 " } }", id);
+    g_assert(qdict_haskey(ret, "error"));
+    QDECREF(ret);
+}
+
+static void test_qga_blacklist(gconstpointer data)
+{
+    TestFixture fix;
+    QDict *ret, *error;
+    const gchar *class, *desc;
+
+    fixture_setup(&fix, "-b guest-ping,guest-get-time");
+
+    /* check blacklist */
+    ret = qmp_fd(fix.fd, "{'execute': 'guest-ping'}");
+    g_assert_nonnull(ret);
+    error = qdict_get_qdict(ret, "error");
+    class = qdict_get_try_str(error, "class");
+    desc = qdict_get_try_str(error, "desc");
+    g_assert_cmpstr(class, ==, "GenericError");
+    g_assert_nonnull(g_strstr_len(desc, -1, "has been disabled"));
+    QDECREF(ret);
+
+    ret = qmp_fd(fix.fd, "{'execute': 'guest-get-time'}");
+    g_assert_nonnull(ret);
+    error = qdict_get_qdict(ret, "error");
+    class = qdict_get_try_str(error, "class");
+    desc = qdict_get_try_str(error, "desc");
+    g_assert_cmpstr(class, ==, "GenericError");
+    g_assert_nonnull(g_strstr_len(desc, -1, "has been disabled"));
+    QDECREF(ret);
+
+    /* check something work */
+    ret = qmp_fd(fix.fd, "{'execute': 'guest-get-fsinfo'}");
+    qmp_assert_no_error(ret);
+    QDECREF(ret);
+
+    fixture_tear_down(&fix, NULL);
+}
+
+static void test_qga_rate_limit(gconstpointer data)
+{
+    TestFixture fix;
+    QDict *ret, *error;
+    const gchar *desc;
+    int i;
+
+    fixture_setup(&fix, "--rate-limit=0.1 --rate-limit-burst=2");
+
+    for (i = 0; i < 2; i++) {
+        ret = qmp_fd(fix.fd, "{'execute': 'guest-get-time'}");
+        qmp_assert_no_error(ret);
+        QDECREF(ret);
+    }
+
+    ret = qmp_fd(fix.fd, "{'execute': 'guest-get-time'}");
+    g_assert_nonnull(ret);
+    error = qdict_get_qdict(ret, "error");
+    g_assert_cmpstr(qdict_get_try_str(error, "class"), ==, "GenericError");
+    desc = qdict_get_try_str(error, "desc");
+    g_assert_nonnull(g_strstr_len(desc, -1, "rate limited"));
+    QDECREF(ret);
+
+    /* control commands always go through */
+    ret = qmp_fd(fix.fd, "{'execute': 'guest-ping'}");
+    qmp_assert_no_error(ret);
+    QDECREF(ret);
+
+    fixture_tear_down(&fix, NULL);
+}
+
+static void test_qga_stall_threshold(gconstpointer data)
+{
+    TestFixture fix;
+    QDict *ret, *val, *lat;
+
+    fixture_setup(&fix, "--stall-threshold=50");
+
+    /* a few heartbeats */
+    g_usleep(200 * 1000);
+    ret = qmp_fd(fix.fd, "{'execute': 'guest-get-agent-stats'}");
+    qmp_assert_no_error(ret);
+    val = qdict_get_qdict(ret, "return");
+    lat = qdict_get_qdict(val, "main-loop-lag");
+    g_assert_nonnull(lat);
+    g_assert_cmpint(qdict_get_int(lat, "count"), >, 0);
+    g_assert_cmpint(qdict_get_int(lat, "p50"), <=,
+                    qdict_get_int(lat, "max"));
+    g_assert_nonnull(qdict_get_qlist(val, "stalls"));
+    QDECREF(ret);
+
+    fixture_tear_down(&fix, NULL);
+}
+
+/* requests and responses go to the capture, one record per line */
+static void test_qga_capture(gconstpointer data)
+{
+    TestFixture fix;
+    gchar *path, *arg, *contents, **lines;
+    QObject *obj;
+    QDict *ret, *rec, *msg;
+
+    path = g_strdup_printf("/tmp/qgacapture.%d", getpid());
+    arg = g_strdup_printf("--capture=%s", path);
+    fixture_setup(&fix, arg);
+
+    ret = qmp_fd(fix.fd, "{'execute': 'guest-ping'}");
+    qmp_assert_no_error(ret);
+    QDECREF(ret);
+
+    /* flushed at the latest on exit */
+    fixture_tear_down(&fix, NULL);
+    g_assert(g_file_get_contents(path, &contents, NULL, NULL));
+    lines = g_strsplit(contents, "\n", -1);
+    g_assert_cmpint(g_strv_length(lines), ==, 3);
+
+    obj = qobject_from_json(lines[0]);
+    g_assert_nonnull(obj);
+    rec = qobject_to_qdict(obj);
+    g_assert_cmpstr(qdict_get_str(rec, "d"), ==, "in");
+    g_assert_cmpint(qdict_get_int(rec, "s"), ==, 1);
+    msg = qdict_get_qdict(rec, "msg");
+    g_assert_cmpstr(qdict_get_str(msg, "execute"), ==, "guest-ping");
+    QDECREF(rec);
+
+    obj = qobject_from_json(lines[1]);
+    g_assert_nonnull(obj);
+    rec = qobject_to_qdict(obj);
+    g_assert_cmpstr(qdict_get_str(rec, "d"), ==, "out");
+    g_assert(qdict_haskey(qdict_get_qdict(rec, "msg"), "return"));
+    QDECREF(rec);
+
+    g_strfreev(lines);
+    g_free(contents);
+    unlink(path);
+    g_free(arg);
+    g_free(path);
+}
+
+/* the channel, file handles and processes outlive the upgrade */
+static void test_qga_upgrade(gconstpointer data)
+{
+    TestFixture fix;
+    int64_t id, pid;
+    QDict *ret, *val;
+    gchar *cmd, *out;
+    gsize len;
+
+    fixture_setup(&fix, NULL);
 
+    id = qga_file_open(fix.fd, false);
+    ret = qmp_fd(fix.fd, "{'execute': 'guest-exec', 'arguments': {"
+                 " 'path': '/bin/sh', 'arg': [ '-c', 'sleep 1; printf done' ],"
+                 " 'capture-output': true } }");
+    qmp_assert_no_error(ret);
+    pid = qdict_get_int(qdict_get_qdict(ret, "return"), "pid");
     QDECREF(ret);
-    g_free(cmd);
-    g_free(enc);
 
-    /* read eof */
-    cmd = g_strdup_printf("{'execute': 'guest-file-read',"
-                          " 'arguments': { 'handle': %" PRId64 "} }",
-                          id);
-    ret = qmp_fd(fixture->fd, cmd);
-    val = qdict_get_qdict(ret, "return");
-    count = qdict_get_int(val, "count");
-    eof = qdict_get_bool(val, "eof");
-    b64 = qdict_get_str(val, "buf-b64");
-    g_assert_cmpint(count, ==, 0);
-    g_assert(eof);
-    g_assert_cmpstr(b64, ==, "");
+    /* a binary that does not run is refused up front */
+    ret = qmp_fd(fix.fd, "{'execute': 'guest-upgrade-agent',"
+                 " 'arguments': { 'path': '/nonexistent' } }");
+    g_assert_nonnull(qdict_get_qdict(ret, "error"));
     QDECREF(ret);
-    g_free(cmd);
 
-    /* seek */
-    cmd = g_strdup_printf("{'execute': 'guest-file-seek',"
-                          " 'arguments': { 'handle': %" PRId64 ", "
-                          " 'offset': %d, 'whence': %d } }",
-                          id, 6, SEEK_SET);
-    ret = qmp_fd(fixture->fd, cmd);
+    ret = qmp_fd(fix.fd, "{'execute': 'guest-upgrade-agent'}");
     qmp_assert_no_error(ret);
-    val = qdict_get_qdict(ret, "return");
-    count = qdict_get_int(val, "position");
-    eof = qdict_get_bool(val, "eof");
-    g_assert_cmpint(count, ==, 6);
-    g_assert(!eof);
     QDECREF(ret);
-    g_free(cmd);
 
-    /* partial read */
-    cmd = g_strdup_printf("{'execute': 'guest-file-read',"
-                          " 'arguments': { 'handle': %" PRId64 "} }",
-                          id);
-    ret = qmp_fd(fixture->fd, cmd);
-    val = qdict_get_qdict(ret, "return");
-    count = qdict_get_int(val, "count");
-    eof = qdict_get_bool(val, "eof");
-    b64 = qdict_get_str(val, "buf-b64");
-    g_assert_cmpint(count, ==, sizeof(helloworld) - 6);
-    g_assert(eof);
-    dec = g_base64_decode(b64, &count);
-    g_assert_cmpint(count, ==, sizeof(helloworld) - 6);
-    g_assert_cmpmem(dec, count, helloworld + 6, sizeof(helloworld) - 6);
-    g_free(dec);
+    /* answered by the new agent, on the same connection */
+    ret = qmp_fd(fix.fd, "{'execute': 'guest-sync',"
+                 " 'arguments': { 'id': 42 } }");
+    qmp_assert_no_error(ret);
+    g_assert_cmpint(qdict_get_int(ret, "return"), ==, 42);
+    QDECREF(ret);
 
+    cmd = g_strdup_printf("{'execute': 'guest-file-write',"
+                          " 'arguments': { 'handle': %" PRId64 ","
+                          " 'buf-b64': 'aGVsbG8=' } }", id);
+    ret = qmp_fd(fix.fd, cmd);
+    qmp_assert_no_error(ret);
+    g_assert_cmpint(qdict_get_int(qdict_get_qdict(ret, "return"), "count"),
+                    ==, 5);
     QDECREF(ret);
     g_free(cmd);
-
-    /* close */
     cmd = g_strdup_printf("{'execute': 'guest-file-close',"
-                          " 'arguments': {'handle': %" PRId64 "} }",
-                          id);
-    ret = qmp_fd(fixture->fd, cmd);
+                          " 'arguments': { 'handle': %" PRId64 " } }", id);
+    ret = qmp_fd(fix.fd, cmd);
+    qmp_assert_no_error(ret);
     QDECREF(ret);
     g_free(cmd);
+
+    ret = qga_exec_wait(fix.fd, pid);
+    val = qdict_get_qdict(ret, "return");
+    g_assert(qdict_get_bool(val, "exited"));
+    g_assert_cmpint(qdict_get_int(val, "exitcode"), ==, 0);
+    out = (gchar *)g_base64_decode(qdict_get_str(val, "out-data"), &len);
+    g_assert_cmpint(len, ==, 4);
+    g_assert(memcmp(out, "done", 4) == 0);
+    g_free(out);
+    QDECREF(ret);
+
+    fixture_tear_down(&fix, NULL);
 }
 
-static void test_qga_get_time(gconstpointer fix)
+/* the log is written out in the background, and what is left at exit */
+static void test_qga_log(gconstpointer data)
 {
-    const TestFixture *fixture = fix;
+    TestFixture fix;
     QDict *ret;
-    int64_t time;
+    gchar *dir, *path, *log = NULL;
+    int i;
 
-    ret = qmp_fd(fixture->fd, "{'execute': 'guest-get-time'}");
+    fixture_setup(&fix, "-v -l qga.log");
+    dir = g_strdup(fix.test_dir);
+    path = g_build_filename(dir, "qga.log", NULL);
+
+    ret = qmp_fd(fix.fd, "{'execute': 'guest-ping'}");
     g_assert_nonnull(ret);
     qmp_assert_no_error(ret);
+    QDECREF(ret);
 
-    time = qdict_get_int(ret, "return");
-    g_assert_cmpint(time, >, 0);
+    for (i = 0; i < 50; i++) {
+        g_free(log);
+        g_assert(g_file_get_contents(path, &log, NULL, NULL));
+        if (strstr(log, "processing command")) {
+            break;
+        }
+        g_usleep(100 * 1000);
+    }
+    g_assert_nonnull(strstr(log, "processing command"));
+    g_free(log);
 
-    QDECREF(ret);
+    fixture_tear_down(&fix, NULL);
+    g_assert(g_file_get_contents(path, &log, NULL, NULL));
+    g_assert_nonnull(strstr(log, "quitting"));
+    g_assert_null(strstr(log, "dropped"));
+    g_free(log);
+
+    g_unlink(path);
+    g_rmdir(dir);
+    g_free(path);
+    g_free(dir);
 }
 
-static void test_qga_set_time(gconstpointer fix)
+static void test_qga_metrics_history(gconstpointer data)
 {
-    const TestFixture *fixture = fix;
-    QDict *ret;
-    int64_t current, time;
+    TestFixture fix;
+    QDict *ret, *val;
+    QList *list;
+    int64_t cursor, count;
+    guchar *buf;
+    gsize len;
     gchar *cmd;
 
-    /* get current time */
-    ret = qmp_fd(fixture->fd, "{'execute': 'guest-get-time'}");
+    fixture_setup(&fix, "--metrics-interval=50 --metrics-history=4");
+
+    /* wait until the ring has wrapped */
+    g_usleep(400 * 1000);
+    ret = qmp_fd(fix.fd, "{'execute': 'guest-get-metrics-history'}");
     g_assert_nonnull(ret);
     qmp_assert_no_error(ret);
-    current = qdict_get_int(ret, "return");
-    g_assert_cmpint(current, >, 0);
+    val = qdict_get_qdict(ret, "return");
+    g_assert_cmpint(qdict_get_int(val, "interval"), ==, 50);
+    cursor = qdict_get_int(val, "cursor");
+    list = qdict_get_qlist(val, "samples");
+    g_assert_cmpint(qlist_size(list), <=, 4);
+    g_assert_cmpint(qlist_size(list) + qdict_get_int(val, "lost"), ==,
+                    cursor);
+    g_assert_cmpint(cursor, >, 4);
     QDECREF(ret);
 
-    /* set some old time */
-    ret = qmp_fd(fixture->fd, "{'execute': 'guest-set-time',"
-                 " 'arguments': { 'time': 1000 } }");
+    g_usleep(120 * 1000);
+    cmd = g_strdup_printf("{'execute': 'guest-get-metrics-history',"
+                          " 'arguments': {'cursor': %" PRId64 "}}", cursor);
+    ret = qmp_fd(fix.fd, cmd);
+    g_free(cmd);
     g_assert_nonnull(ret);
     qmp_assert_no_error(ret);
+    val = qdict_get_qdict(ret, "return");
+    list = qdict_get_qlist(val, "samples");
+    g_assert_cmpint(qlist_size(list), >=, 1);
+    val = qobject_to_qdict(qlist_peek(list));
+    g_assert_cmpint(qdict_get_int(val, "seq"), ==, cursor);
+    g_assert(qdict_haskey(val, "memory"));
     QDECREF(ret);
 
-    /* check old time */
-    ret = qmp_fd(fixture->fd, "{'execute': 'guest-get-time'}");
+    /* compact: version, count and number of columns lead the buffer */
+    ret = qmp_fd(fix.fd, "{'execute': 'guest-get-metrics-history',"
+                 " 'arguments': {'format': 'compact'}}");
     g_assert_nonnull(ret);
     qmp_assert_no_error(ret);
-    time = qdict_get_int(ret, "return");
-    g_assert_cmpint(time / 1000, <, G_USEC_PER_SEC * 10);
+    val = qdict_get_qdict(ret, "return");
+    g_assert(!qdict_haskey(val, "samples"));
+    count = qdict_get_int(val, "count");
+    g_assert_cmpint(count, >=, 1);
+    g_assert_cmpint(count, <=, 4);
+    buf = g_base64_decode(qdict_get_str(val, "buf-b64"), &len);
+    g_assert_cmpint(len, >, 3);
+    g_assert_cmpint(buf[0], ==, 1);
+    g_assert_cmpint(buf[1], ==, count);
+    g_assert_cmpint(buf[2], >=, 24);
+    g_free(buf);
     QDECREF(ret);
 
-    /* set back current time */
-    cmd = g_strdup_printf("{'execute': 'guest-set-time',"
-                          " 'arguments': { 'time': %" PRId64 " } }",
-                          current + time * 1000);
-    ret = qmp_fd(fixture->fd, cmd);
-    g_free(cmd);
+    fixture_tear_down(&fix, NULL);
+}
+
+static void test_qga_metrics_shm(gconstpointer data)
+{
+    TestFixture fix;
+    GAMetricsPage copy;
+    QDict *ret, *val;
+    uint64_t seq;
+    gchar *path;
+    void *page;
+    int fd;
+
+    fixture_setup(&fix, "--metrics-interval=50 --metrics-shm=metrics.page");
+
+    g_usleep(300 * 1000);
+    path = g_build_filename(fix.test_dir, "metrics.page", NULL);
+    fd = open(path, O_RDONLY);
+    g_assert_cmpint(fd, !=, -1);
+    page = mmap(NULL, sizeof(GAMetricsPage), PROT_READ, MAP_SHARED, fd, 0);
+    g_assert(page != MAP_FAILED);
+    close(fd);
+
+    g_assert(ga_metrics_page_read(page, &copy, 100));
+    g_assert_cmpint(copy.interval_ms, ==, 50);
+    g_assert_cmpint(copy.present & 2, ==, 2);
+    /* mem-total */
+    g_assert_cmpint(copy.counters[8], >, 0);
+    seq = copy.seq;
+
+    /* the page has the newest sample of the history */
+    ret = qmp_fd(fix.fd, "{'execute': 'guest-get-metrics-history'}");
     g_assert_nonnull(ret);
     qmp_assert_no_error(ret);
+    val = qdict_get_qdict(ret, "return");
+    g_assert_cmpint(qdict_get_int(val, "cursor"), >=, seq);
     QDECREF(ret);
+    g_usleep(120 * 1000);
+    g_assert(ga_metrics_page_read(page, &copy, 100));
+    g_assert_cmpint(copy.seq, >, seq);
+
+    /* the mapping keeps the file */
+    g_unlink(path);
+    g_free(path);
+    fixture_tear_down(&fix, NULL);
+    g_assert(!ga_metrics_page_read(page, &copy, 100));
+    munmap(page, sizeof(GAMetricsPage));
 }
 
-static void test_qga_fstrim(gconstpointer fix)
+static void test_qga_metrics_spool(gconstpointer data)
 {
-    const TestFixture *fixture = fix;
-    QDict *ret;
+    TestFixture fix;
+    QDict *ret, *val;
     QList *list;
-    const QListEntry *entry;
+    int64_t cursor;
+    gchar *path;
 
-    ret = qmp_fd(fixture->fd, "{'execute': 'guest-fstrim',"
-                 " arguments: { minimum: 4194304 } }");
+    fixture_setup(&fix, "--metrics-interval=50 --metrics-history=4"
+                  " --metrics-spool=64");
+
+    /* what the ring in memory lost, the spool still has */
+    g_usleep(500 * 1000);
+    ret = qmp_fd(fix.fd, "{'execute': 'guest-get-metrics-history'}");
     g_assert_nonnull(ret);
     qmp_assert_no_error(ret);
-    list = qdict_get_qlist(ret, "return");
-    entry = qlist_first(list);
-    g_assert(qdict_haskey(qobject_to_qdict(entry->value), "paths"));
-
+    val = qdict_get_qdict(ret, "return");
+    cursor = qdict_get_int(val, "cursor");
+    list = qdict_get_qlist(val, "samples");
+    g_assert_cmpint(cursor, >, 4);
+    g_assert_cmpint(qlist_size(list), >, 4);
+    g_assert_cmpint(qlist_size(list) + qdict_get_int(val, "lost"), ==,
+                    cursor);
+    val = qobject_to_qdict(qlist_peek(list));
+    g_assert_cmpint(qdict_get_int(val, "seq"), ==, 0);
     QDECREF(ret);
+
+    path = g_build_filename(fix.test_dir, "qga.metrics-spool", NULL);
+    g_assert(g_file_test(path, G_FILE_TEST_EXISTS));
+    g_unlink(path);
+    g_free(path);
+    fixture_tear_down(&fix, NULL);
 }
 
-static void test_qga_blacklist(gconstpointer data)
+/* the @n-th number of @list, which may have come out as an integer */
+static double qga_qlist_nth_number(QList *list, int n)
+{
+    const QListEntry *entry = qlist_first(list);
+    QObject *obj;
+
+    while (n--) {
+        entry = qlist_next(entry);
+    }
+    obj = qlist_entry_obj(entry);
+    if (qobject_type(obj) == QTYPE_QINT) {
+        return qint_get_int(qobject_to_qint(obj));
+    }
+    return qfloat_get_double(qobject_to_qfloat(obj));
+}
+
+static void test_qga_metrics_rollup(gconstpointer data)
 {
     TestFixture fix;
-    QDict *ret, *error;
-    const gchar *class, *desc;
+    QDict *ret, *val, *bucket;
+    QList *list, *min, *max, *avg;
+    double lo, hi, mean;
+    int64_t start;
+    int i;
+
+    fixture_setup(&fix, "--metrics-interval=100");
+
+    /* a full bucket of 1s and the start of the next */
+    g_usleep(2200 * 1000);
+    ret = qmp_fd(fix.fd, "{'execute': 'guest-get-metrics-rollup',"
+                 " 'arguments': {'resolution': '1s'}}");
+    qmp_assert_no_error(ret);
+    val = qdict_get_qdict(ret, "return");
+    g_assert_cmpint(qdict_get_int(val, "resolution"), ==, 1000);
+    list = qdict_get_qlist(val, "columns");
+    g_assert_cmpint(qlist_size(list), ==, 21);
+    g_assert_cmpstr(qstring_get_str(qobject_to_qstring(qlist_peek(list))),
+                    ==, "cpu-user");
+    list = qdict_get_qlist(val, "buckets");
+    g_assert_cmpint(qlist_size(list), >=, 2);
+    bucket = qobject_to_qdict(qlist_entry_obj(qlist_next(qlist_first(list))));
+    start = qdict_get_int(bucket, "time");
+    g_assert_cmpint(start % 1000000000, ==, 0);
+    g_assert_cmpint(qdict_get_int(bucket, "samples"), >=, 5);
+    g_assert_cmpint(qdict_get_int(bucket, "samples"), <=, 11);
+    g_assert(qdict_get_int(bucket, "present") & 2);
+    min = qdict_get_qlist(bucket, "min");
+    max = qdict_get_qlist(bucket, "max");
+    avg = qdict_get_qlist(bucket, "avg");
+    for (i = 0; i < 21; i++) {
+        lo = qga_qlist_nth_number(min, i);
+        hi = qga_qlist_nth_number(max, i);
+        mean = qga_qlist_nth_number(avg, i);
+        g_assert(lo <= hi);
+        /* give or take the rounding of the sum */
+        g_assert(mean >= lo - 1e-5 * (ABS(lo) + 1));
+        g_assert(mean <= hi + 1e-5 * (ABS(hi) + 1));
+    }
+    /* memory-total */
+    g_assert(qga_qlist_nth_number(qdict_get_qlist(bucket, "last"), 8) > 0);
+    QDECREF(ret);
 
-    fixture_setup(&fix, "-b guest-ping,guest-get-time");
+    /* a time range */
+    ret = qmp_fd(fix.fd, "{'execute': 'guest-get-metrics-rollup',"
+                 " 'arguments': {'resolution': '1s', 'start': %" PRId64 ","
+                 " 'end': %" PRId64 "}}", start, start + 1000000000);
+    qmp_assert_no_error(ret);
+    list = qdict_get_qlist(qdict_get_qdict(ret, "return"), "buckets");
+    g_assert_cmpint(qlist_size(list), ==, 1);
+    bucket = qobject_to_qdict(qlist_peek(list));
+    g_assert_cmpint(qdict_get_int(bucket, "time"), ==, start);
+    QDECREF(ret);
 
-    /* check blacklist */
-    ret = qmp_fd(fix.fd, "{'execute': 'guest-ping'}");
+    ret = qmp_fd(fix.fd, "{'execute': 'guest-get-metrics-rollup',"
+                 " 'arguments': {'resolution': '1h'}}");
+    qmp_assert_no_error(ret);
+    list = qdict_get_qlist(qdict_get_qdict(ret, "return"), "buckets");
+    g_assert_cmpint(qlist_size(list), >=, 1);
+    QDECREF(ret);
+
+    fixture_tear_down(&fix, NULL);
+}
+
+/* collecting takes an option and privileges, so it is off here */
+static void test_qga_latency_histograms(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    QDict *ret;
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-get-latency-histograms'}");
     g_assert_nonnull(ret);
-    error = qdict_get_qdict(ret, "error");
-    class = qdict_get_try_str(error, "class");
-    desc = qdict_get_try_str(error, "desc");
-    g_assert_cmpstr(class, ==, "GenericError");
-    g_assert_nonnull(g_strstr_len(desc, -1, "has been disabled"));
+    g_assert_nonnull(qdict_get_qdict(ret, "error"));
     QDECREF(ret);
+}
 
-    ret = qmp_fd(fix.fd, "{'execute': 'guest-get-time'}");
+static void test_qga_role_channels(gconstpointer data)
+{
+    TestFixture fix;
+    QDict *ret;
+    gchar *conf, *path;
+    int fd, tmp;
+    GError *error = NULL;
+
+    tmp = g_file_open_tmp(NULL, &conf, &error);
+    g_assert_no_error(error);
+    close(tmp);
+    g_file_set_contents(conf, "[general]\n"
+                        "telemetry-method=unix-listen\n"
+                        "telemetry-path=telemetry\n", -1, &error);
+    g_assert_no_error(error);
+    g_setenv("QGA_CONF", conf, true);
+    fixture_setup(&fix, NULL);
+    g_unsetenv("QGA_CONF");
+
+    path = g_build_filename(fix.test_dir, "telemetry", NULL);
+    fd = connect_qga(path);
+    g_assert_cmpint(fd, !=, -1);
+
+    ret = qmp_fd(fd, "{'execute': 'guest-ping'}");
     g_assert_nonnull(ret);
-    error = qdict_get_qdict(ret, "error");
-    class = qdict_get_try_str(error, "class");
-    desc = qdict_get_try_str(error, "desc");
-    g_assert_cmpstr(class, ==, "GenericError");
-    g_assert_nonnull(g_strstr_len(desc, -1, "has been disabled"));
+    qmp_assert_no_error(ret);
     QDECREF(ret);
 
-    /* check something work */
-    ret = qmp_fd(fix.fd, "{'execute': 'guest-get-fsinfo'}");
+    /* freezing stays with the control channel */
+    ret = qmp_fd(fd, "{'execute': 'guest-fsfreeze-status'}");
+    g_assert_nonnull(ret);
+    g_assert(qdict_haskey(ret, "error"));
+    QDECREF(ret);
+    ret = qmp_fd(fix.fd, "{'execute': 'guest-fsfreeze-status'}");
+    g_assert_nonnull(ret);
     qmp_assert_no_error(ret);
     QDECREF(ret);
 
+    close(fd);
+    g_unlink(path);
+    g_free(path);
     fixture_tear_down(&fix, NULL);
+    g_unlink(conf);
+    g_free(conf);
 }
 
 static void test_qga_config(gconstpointer data)
@@ -617,10 +5018,16 @@ static void test_qga_config(gconstpointer data)
         "daemon=false\n"
         "method=virtio-serial\n"
         "path=/path/to/org.qemu.guest_agent.0\n"
+        "telemetry-path=/path/to/org.qemu.guest_agent.telemetry\n"
         "pidfile=/var/foo/qemu-ga.pid\n"
         "statedir=/var/state\n"
         "verbose=true\n"
-        "blacklist=guest-ping;guest-get-time\n";
+        "blacklist=guest-ping;guest-get-time\n"
+        "[sampler]\n"
+        "interval=500\n"
+        "history=32\n"
+        "disk=false\n"
+        "net-interval=2000\n";
 
     tmp = g_file_open_tmp(NULL, &conf, &error);
     g_assert_no_error(error);
@@ -665,6 +5072,17 @@ static void test_qga_config(gconstpointer data)
     g_assert_cmpstr(str, ==, "/path/to/org.qemu.guest_agent.0");
     g_free(str);
 
+    str = g_key_file_get_string(kf, "general", "telemetry-method", &error);
+    g_assert_no_error(error);
+    g_assert_cmpstr(str, ==, "virtio-serial");
+    g_free(str);
+
+    str = g_key_file_get_string(kf, "general", "telemetry-path", &error);
+    g_assert_no_error(error);
+    g_assert_cmpstr(str, ==, "/path/to/org.qemu.guest_agent.telemetry");
+    g_free(str);
+    g_assert_false(g_key_file_has_key(kf, "general", "bulk-path", NULL));
+
     str = g_key_file_get_string(kf, "general", "pidfile", &error);
     g_assert_no_error(error);
     g_assert_cmpstr(str, ==, "/var/foo/qemu-ga.pid");
@@ -689,6 +5107,20 @@ static void test_qga_config(gconstpointer data)
     g_assert_no_error(error);
     g_strfreev(strv);
 
+    g_assert_cmpint(g_key_file_get_integer(kf, "sampler", "interval",
+                                           &error), ==, 500);
+    g_assert_no_error(error);
+    g_assert_cmpint(g_key_file_get_integer(kf, "sampler", "history",
+                                           &error), ==, 32);
+    g_assert_no_error(error);
+    g_assert_true(g_key_file_get_boolean(kf, "sampler", "cpu", &error));
+    g_assert_no_error(error);
+    g_assert_false(g_key_file_get_boolean(kf, "sampler", "disk", &error));
+    g_assert_no_error(error);
+    g_assert_cmpint(g_key_file_get_integer(kf, "sampler", "net-interval",
+                                           &error), ==, 2000);
+    g_assert_no_error(error);
+
     g_free(out);
     g_free(err);
     g_free(conf);
@@ -714,6 +5146,119 @@ static void test_qga_fsfreeze_status(gconstpointer fix)
     QDECREF(ret);
 }
 
+/* freezing no filesystem at all goes through the same states */
+static void test_qga_fsfreeze_prepare(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    QDict *ret, *val;
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-fsfreeze-commit'}");
+    g_assert(qdict_haskey(ret, "error"));
+    QDECREF(ret);
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-fsfreeze-prepare',"
+                 " 'arguments': { 'mountpoints': ['/nonexistent'] } }");
+    qmp_assert_no_error(ret);
+    QDECREF(ret);
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-fsfreeze-get-timings'}");
+    qmp_assert_no_error(ret);
+    val = qdict_get_qdict(ret, "return");
+    g_assert_cmpstr(qdict_get_str(val, "status"), ==, "thawed");
+    g_assert(qdict_get_bool(val, "prepared"));
+    g_assert(qdict_haskey(val, "sync"));
+    g_assert(!qdict_haskey(val, "frozen"));
+    QDECREF(ret);
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-fsfreeze-commit'}");
+    qmp_assert_no_error(ret);
+    val = qdict_get_qdict(ret, "return");
+    g_assert_cmpstr(qdict_get_str(val, "status"), ==, "frozen");
+    g_assert(!qdict_get_bool(val, "prepared"));
+    g_assert_cmpint(qdict_get_int(val, "filesystems"), ==, 0);
+    g_assert(qdict_haskey(val, "freeze"));
+    QDECREF(ret);
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-fsfreeze-thaw'}");
+    qmp_assert_no_error(ret);
+    QDECREF(ret);
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-fsfreeze-get-timings'}");
+    qmp_assert_no_error(ret);
+    val = qdict_get_qdict(ret, "return");
+    g_assert_cmpstr(qdict_get_str(val, "status"), ==, "thawed");
+    g_assert(qdict_get_int(val, "frozen") >= 0);
+    g_assert(qdict_haskey(val, "thaw"));
+    QDECREF(ret);
+}
+
+/*
+ * With an id, guest-fsfreeze-thaw runs its hook in a coroutine: other
+ * requests are answered meanwhile, but a freeze has to wait for the hook.
+ */
+static void test_qga_fsfreeze_thaw_hook(gconstpointer data)
+{
+    TestFixture fix;
+    gchar *hook, *running, *release, *script;
+    QDict *ret, *error;
+    int i;
+
+    /* qemu-ga runs in the test directory */
+    fixture_setup(&fix, "-Fhook");
+    hook = g_build_filename(fix.test_dir, "hook", NULL);
+    running = g_build_filename(fix.test_dir, "running", NULL);
+    release = g_build_filename(fix.test_dir, "release", NULL);
+    script = g_strdup_printf("#!/bin/sh\n"
+                             "[ \"$1\" = thaw ] || exit 0\n"
+                             "touch %s\n"
+                             "while [ ! -e %s ]; do sleep 0.01; done\n",
+                             running, release);
+    g_assert(g_file_set_contents(hook, script, -1, NULL));
+    g_assert_cmpint(chmod(hook, 0755), ==, 0);
+
+    qmp_fd_send(fix.fd, "{'execute': 'guest-fsfreeze-thaw', 'id': 1}");
+    for (i = 0; i < 500 && !g_file_test(running, G_FILE_TEST_EXISTS); i++) {
+        g_usleep(10 * 1000);
+    }
+    g_assert(g_file_test(running, G_FILE_TEST_EXISTS));
+
+    ret = qmp_fd(fix.fd, "{'execute': 'guest-ping', 'id': 2}");
+    qmp_assert_no_error(ret);
+    g_assert_cmpint(qdict_get_int(ret, "id"), ==, 2);
+    QDECREF(ret);
+
+    ret = qmp_fd(fix.fd, "{'execute': 'guest-fsfreeze-freeze-list', 'id': 3,"
+                 " 'arguments': { 'mountpoints': ['/nonexistent'] } }");
+    g_assert_cmpint(qdict_get_int(ret, "id"), ==, 3);
+    error = qdict_get_qdict(ret, "error");
+    g_assert_nonnull(error);
+    g_assert_nonnull(strstr(qdict_get_str(error, "desc"), "still running"));
+    QDECREF(ret);
+
+    g_assert(g_file_set_contents(release, "", 0, NULL));
+    ret = qmp_fd_receive(fix.fd);
+    qmp_assert_no_error(ret);
+    g_assert_cmpint(qdict_get_int(ret, "id"), ==, 1);
+    g_assert_cmpint(qdict_get_int(ret, "return"), ==, 0);
+    QDECREF(ret);
+
+    /* and once it is done, freezing works again */
+    ret = qmp_fd(fix.fd, "{'execute': 'guest-fsfreeze-freeze-list',"
+                 " 'arguments': { 'mountpoints': ['/nonexistent'] } }");
+    qmp_assert_no_error(ret);
+    QDECREF(ret);
+    ret = qmp_fd(fix.fd, "{'execute': 'guest-fsfreeze-thaw'}");
+    qmp_assert_no_error(ret);
+    QDECREF(ret);
+
+    g_unlink(hook);
+    g_unlink(running);
+    g_unlink(release);
+    g_free(hook);
+    g_free(running);
+    g_free(release);
+    g_free(script);
+    fixture_tear_down(&fix, NULL);
+}
+
 static void test_qga_fsfreeze_and_thaw(gconstpointer fix)
 {
     const TestFixture *fixture = fix;
@@ -748,24 +5293,130 @@ int main(int argc, char **argv)
     fixture_setup(&fix, NULL);
 
     g_test_add_data_func("/qga/sync-delimited", &fix, test_qga_sync_delimited);
+    g_test_add_data_func("/qga/multi-client", &fix, test_qga_multi_client);
+    g_test_add_data_func("/qga/request-id", &fix, test_qga_request_id);
+    g_test_add_data_func("/qga/cancel", &fix, test_qga_cancel);
+    g_test_add_data_func("/qga/priority", &fix, test_qga_priority);
+    g_test_add_data_func("/qga/slow-reader", &fix, test_qga_slow_reader);
+    g_test_add_data_func("/qga/framing", &fix, test_qga_framing);
+    g_test_add_data_func("/qga/compression", &fix, test_qga_compression);
+    g_test_add_data_func("/qga/file-stream", &fix, test_qga_file_stream);
+    g_test_add_data_func("/qga/file-sparse", &fix, test_qga_file_sparse);
     g_test_add_data_func("/qga/sync", &fix, test_qga_sync);
     g_test_add_data_func("/qga/ping", &fix, test_qga_ping);
     g_test_add_data_func("/qga/info", &fix, test_qga_info);
+    g_test_add_data_func("/qga/query-schema", &fix, test_qga_query_schema);
+    g_test_add_data_func("/qga/get-agent-log", &fix, test_qga_get_agent_log);
+    g_test_add_data_func("/qga/get-agent-stats", &fix,
+                         test_qga_get_agent_stats);
     g_test_add_data_func("/qga/network-get-interfaces", &fix,
                          test_qga_network_get_interfaces);
+    g_test_add_data_func("/qga/get-network-stats", &fix,
+                         test_qga_get_network_stats);
+    g_test_add_data_func("/qga/get-sockets", &fix, test_qga_get_sockets);
+    g_test_add_data_func("/qga/net-probe", &fix, test_qga_net_probe);
+    g_test_add_data_func("/qga/get-service-status", &fix,
+                         test_qga_get_service_status);
+    g_test_add_data_func("/qga/get-packages", &fix, test_qga_get_packages);
+    g_test_add_data_func("/qga/get-cgroup-stats", &fix,
+                         test_qga_get_cgroup_stats);
+    g_test_add_data_func("/qga/set-net-queues", &fix, test_qga_set_net_queues);
+    g_test_add_data_func("/qga/profile", &fix, test_qga_profile);
+    g_test_add_data_func("/qga/provision", &fix, test_qga_provision);
+    g_test_add_data_func("/qga/ssh-authorized-keys", &fix,
+                         test_qga_ssh_authorized_keys);
+    g_test_add_data_func("/qga/set-block-queue-params", &fix,
+                         test_qga_set_block_queue_params);
+    g_test_add_data_func("/qga/alert-rules", &fix, test_qga_alert_rules);
+    g_test_add_data_func("/qga/health", &fix, test_qga_health);
     g_test_add_data_func("/qga/get-vcpus", &fix, test_qga_get_vcpus);
     g_test_add_data_func("/qga/get-fsinfo", &fix, test_qga_get_fsinfo);
+    g_test_add_data_func("/qga/get-memory-status", &fix,
+                         test_qga_get_memory_status);
+    g_test_add_data_func("/qga/get-numa-info", &fix,
+                         test_qga_get_numa_info);
+    g_test_add_data_func("/qga/get-system-info", &fix,
+                         test_qga_get_system_info);
+    g_test_add_data_func("/qga/get-users", &fix, test_qga_get_users);
+    g_test_add_data_func("/qga/get-disk-status", &fix,
+                         test_qga_get_disk_status);
+    g_test_add_data_func("/qga/disk-forecast", &fix, test_qga_disk_forecast);
+    g_test_add_data_func("/qga/get-processes", &fix, test_qga_get_processes);
+    g_test_add_data_func("/qga/get-process-changes", &fix,
+                         test_qga_get_process_changes);
+    g_test_add_data_func("/qga/get-oom-status", &fix, test_qga_get_oom_status);
+    g_test_add_data_func("/qga/get-kernel-log", &fix, test_qga_get_kernel_log);
+    g_test_add_data_func("/qga/user-check", &fix, test_qga_user_check);
+    g_test_add_data_func("/qga/get-cpu-stats", &fix, test_qga_get_cpu_stats);
+    g_test_add_data_func("/qga/get-disk-io-stats", &fix,
+                         test_qga_get_disk_io_stats);
+    g_test_add_data_func("/qga/get-memory-pressure", &fix,
+                         test_qga_get_memory_pressure);
+    g_test_add_data_func("/qga/reclaim-memory", &fix, test_qga_reclaim_memory);
+    g_test_add_data_func("/qga/get-top-processes", &fix,
+                         test_qga_get_top_processes);
+    g_test_add_data_func("/qga/get-process-memory", &fix,
+                         test_qga_get_process_memory);
+    g_test_add_data_func("/qga/batch", &fix, test_qga_batch);
     g_test_add_data_func("/qga/get-memory-block-info", &fix,
                          test_qga_get_memory_block_info);
     g_test_add_data_func("/qga/get-memory-blocks", &fix,
                          test_qga_get_memory_blocks);
+    g_test_add_data_func("/qga/memory-blocks-job", &fix,
+                         test_qga_memory_blocks_job);
     g_test_add_data_func("/qga/file-ops", &fix, test_qga_file_ops);
+    g_test_add_data_func("/qga/file-pread", &fix, test_qga_file_pread);
+    g_test_add_data_func("/qga/file-read-mapped", &fix,
+                         test_qga_file_read_mapped);
+    g_test_add_data_func("/qga/file-checksum", &fix, test_qga_file_checksum);
+    g_test_add_data_func("/qga/file-handles", NULL, test_qga_file_handles);
+    g_test_add_data_func("/qga/file-list", &fix, test_qga_file_list);
+    g_test_add_data_func("/qga/file-read-many", &fix,
+                         test_qga_file_read_many);
+    g_test_add_data_func("/qga/file-watch", &fix, test_qga_file_watch);
+    g_test_add_data_func("/qga/log-follow", &fix, test_qga_log_follow);
+    g_test_add_data_func("/qga/file-search", &fix, test_qga_file_search);
+    g_test_add_data_func("/qga/file-archive", &fix, test_qga_file_archive);
+    g_test_add_data_func("/qga/file-upload", &fix, test_qga_file_upload);
+    g_test_add_data_func("/qga/exec-read", &fix, test_qga_exec_read);
+    g_test_add_data_func("/qga/exec-capture", &fix, test_qga_exec_capture);
+    g_test_add_data_func("/qga/exec-limits", &fix, test_qga_exec_limits);
+    g_test_add_data_func("/qga/exec-wait", &fix, test_qga_exec_wait);
+    g_test_add_data_func("/qga/exec-table", NULL, test_qga_exec_table);
+    g_test_add_data_func("/qga/exec-batch", &fix, test_qga_exec_batch);
+    g_test_add_data_func("/qga/exec-write", &fix, test_qga_exec_write);
     g_test_add_data_func("/qga/get-time", &fix, test_qga_get_time);
+    g_test_add_data_func("/qga/sync-time-invalid", &fix,
+                         test_qga_sync_time_invalid);
+    g_test_add_data_func("/qga/notify-resume", &fix, test_qga_notify_resume);
     g_test_add_data_func("/qga/invalid-cmd", &fix, test_qga_invalid_cmd);
     g_test_add_data_func("/qga/fsfreeze-status", &fix,
                          test_qga_fsfreeze_status);
-
+    g_test_add_data_func("/qga/fsfreeze-prepare", &fix,
+                         test_qga_fsfreeze_prepare);
+    g_test_add_data_func("/qga/fsfreeze-thaw-hook", NULL,
+                         test_qga_fsfreeze_thaw_hook);
+
+    g_test_add_data_func("/qga/fstrim-job", &fix, test_qga_fstrim_job);
+    g_test_add_data_func("/qga/file-copy", &fix, test_qga_file_copy);
+    g_test_add_data_func("/qga/file-prefetch", &fix, test_qga_file_prefetch);
+    g_test_add_data_func("/qga/file-ops", &fix, test_qga_file_ops);
     g_test_add_data_func("/qga/blacklist", NULL, test_qga_blacklist);
+    g_test_add_data_func("/qga/rate-limit", NULL, test_qga_rate_limit);
+    g_test_add_data_func("/qga/stall-threshold", NULL,
+                         test_qga_stall_threshold);
+    g_test_add_data_func("/qga/capture", NULL, test_qga_capture);
+    g_test_add_data_func("/qga/upgrade", NULL, test_qga_upgrade);
+    g_test_add_data_func("/qga/log", NULL, test_qga_log);
+    g_test_add_data_func("/qga/metrics-history", NULL,
+                         test_qga_metrics_history);
+    g_test_add_data_func("/qga/metrics-shm", NULL, test_qga_metrics_shm);
+    g_test_add_data_func("/qga/metrics-spool", NULL, test_qga_metrics_spool);
+    g_test_add_data_func("/qga/role-channels", NULL, test_qga_role_channels);
+    g_test_add_data_func("/qga/metrics-rollup", NULL,
+                         test_qga_metrics_rollup);
+    g_test_add_data_func("/qga/latency-histograms", &fix,
+                         test_qga_latency_histograms);
     g_test_add_data_func("/qga/config", NULL, test_qga_config);
 
     if (g_getenv("QGA_TEST_SIDE_EFFECTING")) {
@@ -46,6 +46,19 @@ UserDefTwo *qmp_user_def_cmd2(UserDefOne *ud1a,
     return ret;
 }
 
+/* counts the calls that got past the result cache */
+static int64_t user_def_cmd_cached_calls;
+
+UserDefOne *qmp_user_def_cmd_cached(Error **errp)
+{
+    UserDefOne *ret = g_new0(UserDefOne, 1);
+
+    ret->base = g_new0(UserDefZero, 1);
+    ret->base->integer = ++user_def_cmd_cached_calls;
+    ret->string = g_strdup("cached");
+    return ret;
+}
+
 int64_t qmp_guest_get_time(int64_t a, bool has_b, int64_t b, Error **errp)
 {
     return a + (has_b ? b : 0);
@@ -103,6 +116,34 @@ static void test_dispatch_cmd_error(void)
     QDECREF(req);
 }
 
+/* test dispatching a command the caller looked up already */
+static void test_dispatch_cmd_found(void)
+{
+    QDict *req = qdict_new();
+    QmpCommand *cmd;
+    QObject *resp;
+
+    assert(qmp_find_command("no_such_cmd") == NULL);
+    cmd = qmp_find_command("user_def_cmd");
+    assert(cmd != NULL);
+    assert(!strcmp(qmp_command_name(cmd), "user_def_cmd"));
+
+    qdict_put_obj(req, "execute", QOBJECT(qstring_from_str("user_def_cmd")));
+    resp = qmp_dispatch_command(cmd, QOBJECT(req));
+    assert(resp != NULL);
+    assert(!qdict_haskey(qobject_to_qdict(resp), "error"));
+    qobject_decref(resp);
+
+    /* arguments that are not an object are refused */
+    qdict_put(req, "arguments", qint_from_int(1));
+    resp = qmp_dispatch_command(cmd, QOBJECT(req));
+    assert(resp != NULL);
+    assert(qdict_haskey(qobject_to_qdict(resp), "error"));
+
+    qobject_decref(resp);
+    QDECREF(req);
+}
+
 static QObject *test_qmp_dispatch(QDict *req)
 {
     QObject *resp_obj;
@@ -169,6 +210,37 @@ static void test_dispatch_cmd_io(void)
     QDECREF(req);
 }
 
+/* test that results of cacheable commands are reused until invalidated */
+static void test_dispatch_cmd_cached(void)
+{
+    QDict *req = qdict_new();
+    QDict *ret;
+
+    qdict_put(req, "execute", qstring_from_str("user_def_cmd_cached"));
+
+    ret = qobject_to_qdict(test_qmp_dispatch(req));
+    assert(qdict_get_int(ret, "integer") == 1);
+    QDECREF(ret);
+
+    ret = qobject_to_qdict(test_qmp_dispatch(req));
+    assert(qdict_get_int(ret, "integer") == 1);
+    QDECREF(ret);
+
+    /* toggling any command may change what a cached result says */
+    qmp_disable_command("user_def_cmd");
+    qmp_enable_command("user_def_cmd");
+    ret = qobject_to_qdict(test_qmp_dispatch(req));
+    assert(qdict_get_int(ret, "integer") == 2);
+    QDECREF(ret);
+
+    qmp_invalidate_cached_results();
+    ret = qobject_to_qdict(test_qmp_dispatch(req));
+    assert(qdict_get_int(ret, "integer") == 3);
+    QDECREF(ret);
+
+    QDECREF(req);
+}
+
 /* test generated dealloc functions for generated types */
 static void test_dealloc_types(void)
 {
@@ -245,6 +317,8 @@ int main(int argc, char **argv)
     g_test_add_func("/0.15/dispatch_cmd", test_dispatch_cmd);
     g_test_add_func("/0.15/dispatch_cmd_error", test_dispatch_cmd_error);
     g_test_add_func("/0.15/dispatch_cmd_io", test_dispatch_cmd_io);
+    g_test_add_func("/0.15/dispatch_cmd_found", test_dispatch_cmd_found);
+    g_test_add_func("/0.15/dispatch_cmd_cached", test_dispatch_cmd_cached);
     g_test_add_func("/0.15/dealloc_types", test_dealloc_types);
     g_test_add_func("/0.15/dealloc_partial", test_dealloc_partial);
 
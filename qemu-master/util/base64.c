@@ -0,0 +1,573 @@
+/*
+ * Base64 encoding and decoding
+ *
+ * Copyright (c) 2015 Red Hat, Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * The output is the same as g_base64_encode()/g_base64_decode() produce,
+ * but whole 3-byte/4-character groups are converted at a time instead of
+ * going through glib's per-byte state machine, which makes both directions
+ * several times faster on the multi-megabyte payloads of guest-file-read
+ * and friends.  Long runs go through vector loops where the CPU has them:
+ * SSSE3 or AVX2 on x86, picked at startup from cpuid, and NEON on aarch64.
+ */
+
+#include "qemu/base64.h"
+#include "qemu/bswap.h"
+
+static const char base64_alphabet[64] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+#define B64_PAD     0x40    /* '=', decodes as zero */
+#define B64_SKIP    0xff    /* not part of the alphabet, ignored */
+
+#define R4(x) x, x, x, x
+#define R16(x) R4(x), R4(x), R4(x), R4(x)
+
+static const uint8_t base64_rank[256] = {
+    R16(B64_SKIP), R16(B64_SKIP),
+    /* ' ' .. '/' */
+    R4(B64_SKIP), R4(B64_SKIP), B64_SKIP, B64_SKIP, B64_SKIP, 62,
+    B64_SKIP, B64_SKIP, B64_SKIP, 63,
+    /* '0' .. '?' */
+    52, 53, 54, 55, 56, 57, 58, 59, 60, 61,
+    B64_SKIP, B64_SKIP, B64_SKIP, B64_PAD, B64_SKIP, B64_SKIP,
+    /* '@' .. 'O' */
+    B64_SKIP, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14,
+    /* 'P' .. '_' */
+    15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25,
+    B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP,
+    /* '`' .. 'o' */
+    B64_SKIP, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+    /* 'p' .. DEL */
+    41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51,
+    B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP,
+    R16(B64_SKIP), R16(B64_SKIP), R16(B64_SKIP), R16(B64_SKIP),
+    R16(B64_SKIP), R16(B64_SKIP), R16(B64_SKIP), R16(B64_SKIP),
+};
+
+/* Every pair of output characters, indexed by the 12 bits they encode */
+static char base64_pairs[4096][2];
+
+/* The rank of each character shifted into place for the four positions of
+ * a group, so that a group decodes with four lookups ORed together.  '='
+ * and skipped characters set a bit above the 24 data bits instead.
+ */
+#define B64_SLOW    (1u << 24)
+static uint32_t base64_digits[4][256];
+
+/*
+ * The vector loops convert whole blocks from the start of @in, as many as
+ * @len allows, and return how much of @in they did; the scalar code goes
+ * on from there.  Decoding stops at the first block with anything but
+ * digits in it, for the scalar code to deal with.
+ */
+typedef size_t Base64EncodeBlocks(const uint8_t *in, size_t len, char *out);
+typedef size_t Base64DecodeBlocks(const uint8_t *in, size_t len,
+                                  uint8_t *out);
+
+static size_t base64_encode_none(const uint8_t *in, size_t len, char *out)
+{
+    return 0;
+}
+
+static size_t base64_decode_none(const uint8_t *in, size_t len, uint8_t *out)
+{
+    return 0;
+}
+
+static Base64EncodeBlocks *base64_encode_blocks = base64_encode_none;
+static Base64DecodeBlocks *base64_decode_blocks = base64_decode_none;
+
+#ifdef CONFIG_BASE64_X86
+#include <cpuid.h>
+#pragma GCC push_options
+#pragma GCC target("ssse3")
+#include <tmmintrin.h>
+
+/*
+ * The 16 6-bit values of 12 bytes, one per byte: a shuffle gives each
+ * 32-bit lane the 3 bytes of a group, and two 16-bit multiplies shift its
+ * 4 values into place.
+ */
+static inline __m128i base64_enc_split_ssse3(__m128i v)
+{
+    __m128i hi, lo;
+
+    v = _mm_shuffle_epi8(v, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7,
+                                         4, 5, 3, 4, 1, 2, 0, 1));
+    hi = _mm_mulhi_epu16(_mm_and_si128(v, _mm_set1_epi32(0x0fc0fc00)),
+                         _mm_set1_epi32(0x04000040));
+    lo = _mm_mullo_epi16(_mm_and_si128(v, _mm_set1_epi32(0x003f03f0)),
+                         _mm_set1_epi32(0x01000010));
+    return _mm_or_si128(hi, lo);
+}
+
+/* 6-bit values to characters, by adding the offset of their part of the
+ * alphabet: 'A' for 0-25, 'a' - 26, '0' - 52, '+' - 62 and '/' - 63
+ */
+static inline __m128i base64_enc_chars_ssse3(__m128i v)
+{
+    const __m128i offsets = _mm_setr_epi8(65, 71, -4, -4, -4, -4, -4, -4,
+                                          -4, -4, -4, -4, -19, -16, 0, 0);
+    __m128i part;
+
+    part = _mm_subs_epu8(v, _mm_set1_epi8(51));
+    part = _mm_sub_epi8(part, _mm_cmpgt_epi8(v, _mm_set1_epi8(25)));
+    return _mm_add_epi8(v, _mm_shuffle_epi8(offsets, part));
+}
+
+static size_t base64_encode_ssse3(const uint8_t *in, size_t len, char *out)
+{
+    size_t done;
+    __m128i v;
+
+    /* a load reads 4 bytes past the 12 it encodes */
+    for (done = 0; len - done >= 16; done += 12, out += 16) {
+        v = _mm_loadu_si128((const __m128i *)(in + done));
+        v = base64_enc_chars_ssse3(base64_enc_split_ssse3(v));
+        _mm_storeu_si128((__m128i *)out, v);
+    }
+    return done;
+}
+
+/*
+ * 16 characters to their 6-bit values, false if one is not a digit.  Both
+ * nibbles of a character index a class bitmap, and only for characters
+ * outside the alphabet do the two have a bit in common.  The high nibble
+ * then picks the offset of the part of the alphabet, and '/', which shares
+ * its high nibble with '+', gets its own.
+ */
+static inline bool base64_dec_values_ssse3(__m128i *v)
+{
+    const __m128i class_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11,
+                                           0x11, 0x11, 0x11, 0x11,
+                                           0x11, 0x11, 0x13, 0x1a,
+                                           0x1b, 0x1b, 0x1b, 0x1a);
+    const __m128i class_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02,
+                                           0x04, 0x08, 0x04, 0x08,
+                                           0x10, 0x10, 0x10, 0x10,
+                                           0x10, 0x10, 0x10, 0x10);
+    const __m128i offsets = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71,
+                                          0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i slash = _mm_set1_epi8(0x2f);
+    __m128i hi, lo, bad;
+
+    hi = _mm_and_si128(_mm_srli_epi32(*v, 4), slash);
+    lo = _mm_and_si128(*v, slash);
+    bad = _mm_and_si128(_mm_shuffle_epi8(class_lo, lo),
+                        _mm_shuffle_epi8(class_hi, hi));
+    if (_mm_movemask_epi8(_mm_cmpgt_epi8(bad, _mm_setzero_si128()))) {
+        return false;
+    }
+    hi = _mm_add_epi8(hi, _mm_cmpeq_epi8(*v, slash));
+    *v = _mm_add_epi8(*v, _mm_shuffle_epi8(offsets, hi));
+    return true;
+}
+
+/* 16 6-bit values to the 12 bytes they make, at the start of the vector */
+static inline __m128i base64_dec_pack_ssse3(__m128i v)
+{
+    v = _mm_maddubs_epi16(v, _mm_set1_epi32(0x01400140));
+    v = _mm_madd_epi16(v, _mm_set1_epi32(0x00011000));
+    return _mm_shuffle_epi8(v, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8,
+                                             14, 13, 12, -1, -1, -1, -1));
+}
+
+static size_t base64_decode_ssse3(const uint8_t *in, size_t len, uint8_t *out)
+{
+    size_t done;
+    __m128i v;
+
+    /* a store writes 4 bytes past the 12 it decodes; the output has room
+     * for them as long as 4 more characters follow
+     */
+    for (done = 0; len - done >= 20; done += 16, out += 12) {
+        v = _mm_loadu_si128((const __m128i *)(in + done));
+        if (!base64_dec_values_ssse3(&v)) {
+            break;
+        }
+        _mm_storeu_si128((__m128i *)out, base64_dec_pack_ssse3(v));
+    }
+    return done;
+}
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+/* the SSSE3 loops on both 128-bit lanes at once, see there */
+static size_t base64_encode_avx2(const uint8_t *in, size_t len, char *out)
+{
+    const __m256i split = _mm256_set_epi8(10, 11, 9, 10, 7, 8, 6, 7,
+                                          4, 5, 3, 4, 1, 2, 0, 1,
+                                          10, 11, 9, 10, 7, 8, 6, 7,
+                                          4, 5, 3, 4, 1, 2, 0, 1);
+    const __m256i offsets = _mm256_setr_epi8(65, 71, -4, -4, -4, -4, -4, -4,
+                                             -4, -4, -4, -4, -19, -16, 0, 0,
+                                             65, 71, -4, -4, -4, -4, -4, -4,
+                                             -4, -4, -4, -4, -19, -16, 0, 0);
+    __m256i v, hi, lo, part;
+    size_t done;
+
+    /* 12 bytes for each lane; the second load reads 4 bytes past them */
+    for (done = 0; len - done >= 28; done += 24, out += 32) {
+        v = _mm256_castsi128_si256(
+            _mm_loadu_si128((const __m128i *)(in + done)));
+        v = _mm256_inserti128_si256(
+            v, _mm_loadu_si128((const __m128i *)(in + done + 12)), 1);
+        v = _mm256_shuffle_epi8(v, split);
+        hi = _mm256_mulhi_epu16(
+            _mm256_and_si256(v, _mm256_set1_epi32(0x0fc0fc00)),
+            _mm256_set1_epi32(0x04000040));
+        lo = _mm256_mullo_epi16(
+            _mm256_and_si256(v, _mm256_set1_epi32(0x003f03f0)),
+            _mm256_set1_epi32(0x01000010));
+        v = _mm256_or_si256(hi, lo);
+        part = _mm256_subs_epu8(v, _mm256_set1_epi8(51));
+        part = _mm256_sub_epi8(part,
+                               _mm256_cmpgt_epi8(v, _mm256_set1_epi8(25)));
+        v = _mm256_add_epi8(v, _mm256_shuffle_epi8(offsets, part));
+        _mm256_storeu_si256((__m256i *)out, v);
+    }
+    return done;
+}
+
+static size_t base64_decode_avx2(const uint8_t *in, size_t len, uint8_t *out)
+{
+    const __m256i class_lo = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11,
+                                              0x11, 0x11, 0x11, 0x11,
+                                              0x11, 0x11, 0x13, 0x1a,
+                                              0x1b, 0x1b, 0x1b, 0x1a,
+                                              0x15, 0x11, 0x11, 0x11,
+                                              0x11, 0x11, 0x11, 0x11,
+                                              0x11, 0x11, 0x13, 0x1a,
+                                              0x1b, 0x1b, 0x1b, 0x1a);
+    const __m256i class_hi = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02,
+                                              0x04, 0x08, 0x04, 0x08,
+                                              0x10, 0x10, 0x10, 0x10,
+                                              0x10, 0x10, 0x10, 0x10,
+                                              0x10, 0x10, 0x01, 0x02,
+                                              0x04, 0x08, 0x04, 0x08,
+                                              0x10, 0x10, 0x10, 0x10,
+                                              0x10, 0x10, 0x10, 0x10);
+    const __m256i offsets = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71,
+                                             0, 0, 0, 0, 0, 0, 0, 0,
+                                             0, 16, 19, 4, -65, -65, -71, -71,
+                                             0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i pack = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8,
+                                          14, 13, 12, -1, -1, -1, -1,
+                                          2, 1, 0, 6, 5, 4, 10, 9, 8,
+                                          14, 13, 12, -1, -1, -1, -1);
+    const __m256i slash = _mm256_set1_epi8(0x2f);
+    __m256i v, hi, lo, bad;
+    size_t done;
+
+    /* a store writes 8 bytes past the 24 it decodes; the output has room
+     * for them as long as 8 more characters follow
+     */
+    for (done = 0; len - done >= 40; done += 32, out += 24) {
+        v = _mm256_loadu_si256((const __m256i *)(in + done));
+        hi = _mm256_and_si256(_mm256_srli_epi32(v, 4), slash);
+        lo = _mm256_and_si256(v, slash);
+        bad = _mm256_and_si256(_mm256_shuffle_epi8(class_lo, lo),
+                               _mm256_shuffle_epi8(class_hi, hi));
+        if (_mm256_movemask_epi8(_mm256_cmpgt_epi8(bad,
+                                                   _mm256_setzero_si256()))) {
+            break;
+        }
+        hi = _mm256_add_epi8(hi, _mm256_cmpeq_epi8(v, slash));
+        v = _mm256_add_epi8(v, _mm256_shuffle_epi8(offsets, hi));
+        v = _mm256_maddubs_epi16(v, _mm256_set1_epi32(0x01400140));
+        v = _mm256_madd_epi16(v, _mm256_set1_epi32(0x00011000));
+        v = _mm256_shuffle_epi8(v, pack);
+        /* the 12 bytes of the second lane right after those of the first */
+        v = _mm256_permutevar8x32_epi32(v, _mm256_setr_epi32(0, 1, 2, 4, 5, 6,
+                                                             7, 7));
+        _mm256_storeu_si256((__m256i *)out, v);
+    }
+    return done;
+}
+#pragma GCC pop_options
+
+/* AVX2 needs the OS to save the upper halves of the registers, too */
+static bool base64_has_avx2(unsigned int ecx1)
+{
+    unsigned int a, b, c, d, xcr0, xcr0_hi;
+
+    if (!(ecx1 & bit_OSXSAVE) || __get_cpuid_max(0, NULL) < 7) {
+        return false;
+    }
+    __asm__("xgetbv" : "=a"(xcr0), "=d"(xcr0_hi) : "c"(0));
+    if ((xcr0 & 6) != 6) {
+        return false;
+    }
+    __cpuid_count(7, 0, a, b, c, d);
+    return b & bit_AVX2;
+}
+
+static void base64_init_blocks(void)
+{
+    unsigned int a, b, c, d;
+
+    if (!__get_cpuid(1, &a, &b, &c, &d) || !(c & bit_SSSE3)) {
+        return;
+    }
+    if (base64_has_avx2(c)) {
+        base64_encode_blocks = base64_encode_avx2;
+        base64_decode_blocks = base64_decode_avx2;
+    } else {
+        base64_encode_blocks = base64_encode_ssse3;
+        base64_decode_blocks = base64_decode_ssse3;
+    }
+}
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+
+/*
+ * vld3q/vst4q do the regrouping: the first, second and third bytes of 16
+ * groups land in a vector each, and the four characters of each group go
+ * out from four.  The alphabet is a table lookup.
+ */
+static size_t base64_encode_neon(const uint8_t *in, size_t len, char *out)
+{
+    const uint8_t *chars = (const uint8_t *)base64_alphabet;
+    const uint8x16x4_t alphabet = { {
+        vld1q_u8(chars), vld1q_u8(chars + 16),
+        vld1q_u8(chars + 32), vld1q_u8(chars + 48),
+    } };
+    const uint8x16_t mask = vdupq_n_u8(63);
+    uint8x16x3_t src;
+    uint8x16x4_t dst;
+    size_t done;
+    int i;
+
+    for (done = 0; len - done >= 48; done += 48, out += 64) {
+        src = vld3q_u8(in + done);
+        dst.val[0] = vshrq_n_u8(src.val[0], 2);
+        dst.val[1] = vandq_u8(vorrq_u8(vshlq_n_u8(src.val[0], 4),
+                                       vshrq_n_u8(src.val[1], 4)), mask);
+        dst.val[2] = vandq_u8(vorrq_u8(vshlq_n_u8(src.val[1], 2),
+                                       vshrq_n_u8(src.val[2], 6)), mask);
+        dst.val[3] = vandq_u8(src.val[2], mask);
+        for (i = 0; i < 4; i++) {
+            dst.val[i] = vqtbl4q_u8(alphabet, dst.val[i]);
+        }
+        vst4q_u8((uint8_t *)out, dst);
+    }
+    return done;
+}
+
+/*
+ * The ranks of the first 128 characters are two tables of 64: a character
+ * past the first table gets 0 from it and is looked up in the second.
+ * Characters from 128 up are 0 after both, and are caught by their top
+ * bit; '=' and the others outside the alphabet by their rank.
+ */
+static size_t base64_decode_neon(const uint8_t *in, size_t len, uint8_t *out)
+{
+    const uint8x16x4_t ranks_lo = { {
+        vld1q_u8(base64_rank), vld1q_u8(base64_rank + 16),
+        vld1q_u8(base64_rank + 32), vld1q_u8(base64_rank + 48),
+    } };
+    const uint8x16x4_t ranks_hi = { {
+        vld1q_u8(base64_rank + 64), vld1q_u8(base64_rank + 80),
+        vld1q_u8(base64_rank + 96), vld1q_u8(base64_rank + 112),
+    } };
+    uint8x16x4_t src;
+    uint8x16x3_t dst;
+    uint8x16_t bad;
+    size_t done;
+    int i;
+
+    for (done = 0; len - done >= 64; done += 64, out += 48) {
+        src = vld4q_u8(in + done);
+        bad = vdupq_n_u8(0);
+        for (i = 0; i < 4; i++) {
+            bad = vorrq_u8(bad, vandq_u8(src.val[i], vdupq_n_u8(0x80)));
+            src.val[i] = vqtbx4q_u8(vqtbl4q_u8(ranks_lo, src.val[i]),
+                                    ranks_hi,
+                                    vsubq_u8(src.val[i], vdupq_n_u8(64)));
+            bad = vorrq_u8(bad, src.val[i]);
+        }
+        if (vmaxvq_u8(bad) > 63) {
+            break;
+        }
+        dst.val[0] = vorrq_u8(vshlq_n_u8(src.val[0], 2),
+                              vshrq_n_u8(src.val[1], 4));
+        dst.val[1] = vorrq_u8(vshlq_n_u8(src.val[1], 4),
+                              vshrq_n_u8(src.val[2], 2));
+        dst.val[2] = vorrq_u8(vshlq_n_u8(src.val[2], 6), src.val[3]);
+        vst3q_u8(out, dst);
+    }
+    return done;
+}
+
+static void base64_init_blocks(void)
+{
+    base64_encode_blocks = base64_encode_neon;
+    base64_decode_blocks = base64_decode_neon;
+}
+#else
+static void base64_init_blocks(void)
+{
+}
+#endif
+
+static void __attribute__((constructor)) base64_init(void)
+{
+    int i, j;
+
+    base64_init_blocks();
+
+    for (i = 0; i < 4096; i++) {
+        base64_pairs[i][0] = base64_alphabet[i >> 6];
+        base64_pairs[i][1] = base64_alphabet[i & 63];
+    }
+    for (i = 0; i < 256; i++) {
+        for (j = 0; j < 4; j++) {
+            base64_digits[j][i] = base64_rank[i] & 0xc0 ? B64_SLOW :
+                                  base64_rank[i] << (18 - 6 * j);
+        }
+    }
+}
+
+/* encode @in into the qemu_base64_encoded_len(@len) characters at @out */
+static size_t base64_encode_buf(const uint8_t *in, size_t len, char *out)
+{
+    const uint8_t *p = in;
+    char *q = out;
+    size_t done;
+    uint32_t v;
+
+    done = base64_encode_blocks(p, len, q);
+    p += done;
+    q += done / 3 * 4;
+    len -= done;
+
+    for (; len >= 3; len -= 3, p += 3, q += 4) {
+        v = (p[0] << 16) | (p[1] << 8) | p[2];
+        memcpy(q, base64_pairs[v >> 12], 2);
+        memcpy(q + 2, base64_pairs[v & 0xfff], 2);
+    }
+
+    if (len) {
+        v = p[0] << 16;
+        if (len == 2) {
+            v |= p[1] << 8;
+        }
+        q[0] = base64_alphabet[v >> 18];
+        q[1] = base64_alphabet[(v >> 12) & 63];
+        q[2] = len == 2 ? base64_alphabet[(v >> 6) & 63] : '=';
+        q[3] = '=';
+        q += 4;
+    }
+
+    return q - out;
+}
+
+/**
+ * qemu_base64_encode:
+ * @in: the binary data to encode
+ * @len: the length of @in
+ *
+ * A faster g_base64_encode().
+ *
+ * Returns: the NUL-terminated base64 text, free with g_free()
+ */
+char *qemu_base64_encode(const void *in, size_t len)
+{
+    char *out = g_malloc(qemu_base64_encoded_len(len) + 1);
+
+    out[base64_encode_buf(in, len, out)] = '\0';
+    return out;
+}
+
+/**
+ * qemu_base64_decode_buf:
+ * @in: the base64 text
+ * @len: the length of @in
+ * @out: where to store the decoded data, qemu_base64_decoded_max(@len)
+ *       bytes
+ *
+ * Decode like qemu_base64_decode(), into a caller buffer.
+ *
+ * Returns: the length of the decoded data
+ */
+size_t qemu_base64_decode_buf(const char *in, size_t len, uint8_t *out)
+{
+    const uint8_t *p = (const uint8_t *)in;
+    const uint8_t *end = p + len;
+    uint8_t *q = out;
+    uint8_t rank;
+    bool pad[4];
+    uint32_t v = 0;
+    size_t done;
+    int i = 0;
+
+    while (p < end) {
+        if (i == 0) {
+            done = base64_decode_blocks(p, end - p, q);
+            p += done;
+            q += done / 4 * 3;
+            while (end - p >= 4) {
+                v = base64_digits[0][p[0]] | base64_digits[1][p[1]] |
+                    base64_digits[2][p[2]] | base64_digits[3][p[3]];
+                if (v & B64_SLOW) {
+                    break;
+                }
+                /* the 3 byte slack at the end of out covers the 4th byte */
+                stl_be_p(q, v << 8);
+                p += 4;
+                q += 3;
+            }
+            if (p == end) {
+                break;
+            }
+        }
+
+        rank = base64_rank[*p++];
+        if (rank == B64_SKIP) {
+            continue;
+        }
+        pad[i] = rank == B64_PAD;
+        v = (v << 6) | (rank & 63);
+        if (++i == 4) {
+            *q++ = v >> 16;
+            if (!pad[2]) {
+                *q++ = v >> 8;
+            }
+            if (!pad[3]) {
+                *q++ = v;
+            }
+            i = 0;
+            v = 0;
+        }
+    }
+
+    return q - out;
+}
+
+/**
+ * qemu_base64_decode:
+ * @in: the NUL-terminated base64 text
+ * @out_len: where to store the length of the decoded data
+ *
+ * A faster g_base64_decode(), accepting exactly the same input: characters
+ * outside the base64 alphabet are skipped, '=' counts as a zero digit and
+ * drops the output byte it stands for, and a trailing partial group is
+ * discarded.  Only runs of well-formed groups take the fast path.
+ *
+ * Returns: the decoded data, free with g_free()
+ */
+uint8_t *qemu_base64_decode(const char *in, size_t *out_len)
+{
+    size_t len = strlen(in);
+    uint8_t *out = g_malloc(qemu_base64_decoded_max(len));
+
+    *out_len = qemu_base64_decode_buf(in, len, out);
+    return out;
+}
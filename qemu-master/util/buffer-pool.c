@@ -0,0 +1,169 @@
+/*
+ * Pool of large buffers
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * A bulk transfer through qemu-ga goes through several buffers of the size
+ * of a chunk for every chunk: the data read, the JSON text it is encoded
+ * to, the response the text ends up in.  Past malloc's mmap threshold each
+ * of them is mapped when allocated and unmapped when freed, so that every
+ * chunk pays for faulting in and zeroing megabytes of fresh pages.  The
+ * pool instead keeps freed buffers, in power-of-two size classes, and hands
+ * them out again with their pages still there.  It keeps a few per class
+ * and a bounded amount in all, and qemu_buffer_pool_trim() gives back
+ * those that have not been used for a while.
+ */
+
+#include "qemu/buffer-pool.h"
+#include "qemu/atomic.h"
+#include "qemu/host-utils.h"
+
+#define BUFFER_POOL_MIN_SHIFT   17
+#define BUFFER_POOL_CLASSES     11      /* 128 KiB to 128 MiB */
+#define BUFFER_POOL_KEEP        4       /* per class */
+#define BUFFER_POOL_IDLE_MAX    (256 * 1024 * 1024)
+
+/* in front of each buffer, and the size of malloc's alignment */
+typedef struct BufferHeader {
+    uint64_t size;              /* usable */
+    int64_t freed;              /* when it went into the pool */
+} BufferHeader;
+
+QEMU_BUILD_BUG_ON(QEMU_BUFFER_POOL_MIN != 1 << BUFFER_POOL_MIN_SHIFT);
+QEMU_BUILD_BUG_ON(QEMU_BUFFER_POOL_MAX !=
+                  QEMU_BUFFER_POOL_MIN << (BUFFER_POOL_CLASSES - 1));
+QEMU_BUILD_BUG_ON(sizeof(BufferHeader) != 16);
+
+static CompatGMutex buffer_pool_lock;
+static GQueue buffer_pool[BUFFER_POOL_CLASSES];     /* last freed first */
+/* bytes in the pool, written under the lock */
+static size_t buffer_pool_idle;
+
+/* the class of a buffer of @size, at least QEMU_BUFFER_POOL_MIN */
+static int buffer_pool_class(size_t size)
+{
+    return 64 - clz64(size - 1) - BUFFER_POOL_MIN_SHIFT;
+}
+
+/**
+ * qemu_buffer_pool_alloc:
+ * @size: the number of bytes needed
+ *
+ * Allocate a buffer of at least @size bytes, from the pool if it is large
+ * and the pool has one.  Its contents are undefined.
+ *
+ * Returns: the buffer, free with qemu_buffer_pool_free()
+ */
+void *qemu_buffer_pool_alloc(size_t size)
+{
+    BufferHeader *hdr = NULL;
+    int cls;
+
+    if (size >= QEMU_BUFFER_POOL_MIN && size <= SIZE_MAX / 2) {
+        cls = buffer_pool_class(size);
+        size = (size_t)QEMU_BUFFER_POOL_MIN << cls;
+        if (cls < BUFFER_POOL_CLASSES) {
+            g_mutex_lock(&buffer_pool_lock);
+            hdr = g_queue_pop_head(&buffer_pool[cls]);
+            if (hdr) {
+                atomic_set(&buffer_pool_idle, buffer_pool_idle - size);
+            }
+            g_mutex_unlock(&buffer_pool_lock);
+        }
+    }
+    if (!hdr) {
+        hdr = g_malloc(sizeof(*hdr) + size);
+        hdr->size = size;
+    }
+    return hdr + 1;
+}
+
+/**
+ * qemu_buffer_pool_size:
+ * @buf: a buffer from qemu_buffer_pool_alloc()
+ *
+ * Returns: how many bytes @buf can hold, which may be more than asked for
+ */
+size_t qemu_buffer_pool_size(const void *buf)
+{
+    return ((const BufferHeader *)buf - 1)->size;
+}
+
+/**
+ * qemu_buffer_pool_free:
+ * @buf: a buffer from qemu_buffer_pool_alloc(), or NULL
+ *
+ * Put @buf back into the pool, or free it if the pool has no room for it.
+ */
+void qemu_buffer_pool_free(void *buf)
+{
+    BufferHeader *hdr;
+    GQueue *q;
+
+    if (!buf) {
+        return;
+    }
+    hdr = (BufferHeader *)buf - 1;
+    if (hdr->size >= QEMU_BUFFER_POOL_MIN &&
+        hdr->size <= QEMU_BUFFER_POOL_MAX) {
+        q = &buffer_pool[buffer_pool_class(hdr->size)];
+        g_mutex_lock(&buffer_pool_lock);
+        if (g_queue_get_length(q) < BUFFER_POOL_KEEP &&
+            buffer_pool_idle + hdr->size <= BUFFER_POOL_IDLE_MAX) {
+            hdr->freed = g_get_monotonic_time();
+            g_queue_push_head(q, hdr);
+            atomic_set(&buffer_pool_idle, buffer_pool_idle + hdr->size);
+            hdr = NULL;
+        }
+        g_mutex_unlock(&buffer_pool_lock);
+    }
+    g_free(hdr);
+}
+
+/**
+ * qemu_buffer_pool_idle:
+ *
+ * Returns: the number of bytes in the pool, as of lately
+ */
+size_t qemu_buffer_pool_idle(void)
+{
+    return atomic_read(&buffer_pool_idle);
+}
+
+/**
+ * qemu_buffer_pool_trim:
+ * @idle_us: how long a buffer may stay in the pool unused
+ *
+ * Free the buffers that have been in the pool for @idle_us or longer; all
+ * of them for 0.
+ *
+ * Returns: the number of bytes still in the pool
+ */
+size_t qemu_buffer_pool_trim(int64_t idle_us)
+{
+    int64_t now = g_get_monotonic_time();
+    GSList *expired = NULL, *l;
+    BufferHeader *hdr;
+    size_t idle;
+    int i;
+
+    g_mutex_lock(&buffer_pool_lock);
+    for (i = 0; i < BUFFER_POOL_CLASSES; i++) {
+        while ((hdr = g_queue_peek_tail(&buffer_pool[i])) &&
+               now - hdr->freed >= idle_us) {
+            g_queue_pop_tail(&buffer_pool[i]);
+            atomic_set(&buffer_pool_idle, buffer_pool_idle - hdr->size);
+            expired = g_slist_prepend(expired, hdr);
+        }
+    }
+    idle = buffer_pool_idle;
+    g_mutex_unlock(&buffer_pool_lock);
+
+    /* munmap() outside of the lock */
+    for (l = expired; l; l = l->next) {
+        g_free(l->data);
+    }
+    g_slist_free(expired);
+    return idle;
+}
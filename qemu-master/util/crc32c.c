@@ -105,7 +105,8 @@ static const uint32_t crc32c_table[256] = {
 };
 
 
-uint32_t crc32c(uint32_t crc, const uint8_t *data, unsigned int length)
+static uint32_t crc32c_generic(uint32_t crc, const uint8_t *data,
+                               unsigned int length)
 {
     while (length--) {
         crc = crc32c_table[(crc ^ *data++) & 0xFFL] ^ (crc >> 8);
@@ -113,3 +114,63 @@ uint32_t crc32c(uint32_t crc, const uint8_t *data, unsigned int length)
     return crc^0xffffffff;
 }
 
+/*
+ * CONFIG_CRC32C_SSE42 is set by configure when the compiler can build the
+ * function below for SSE4.2 through #pragma GCC target while the rest of
+ * the file stays generic.  Whether the CPU has the instruction is checked
+ * once at startup with cpuid; until then, and without it, the table is
+ * used.
+ */
+#ifdef CONFIG_CRC32C_SSE42
+#include <cpuid.h>
+#pragma GCC push_options
+#pragma GCC target("sse4.2")
+#include <nmmintrin.h>
+
+/* The crc32 instruction does one step of the table lookup above for 1, 4
+ * or 8 bytes at a time, with the same bit order.
+ */
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *data,
+                             unsigned int length)
+{
+    for (; length && ((uintptr_t)data & 7); length--) {
+        crc = _mm_crc32_u8(crc, *data++);
+    }
+#ifdef __x86_64__
+    for (; length >= 8; length -= 8, data += 8) {
+        crc = _mm_crc32_u64(crc, *(const uint64_t *)data);
+    }
+#endif
+    for (; length >= 4; length -= 4, data += 4) {
+        crc = _mm_crc32_u32(crc, *(const uint32_t *)data);
+    }
+    for (; length; length--) {
+        crc = _mm_crc32_u8(crc, *data++);
+    }
+    return crc^0xffffffff;
+}
+#pragma GCC pop_options
+
+static uint32_t (*crc32c_impl)(uint32_t, const uint8_t *, unsigned int) =
+    crc32c_generic;
+
+static void __attribute__((constructor)) crc32c_init(void)
+{
+    unsigned int a, b, c, d;
+
+    if (__get_cpuid(1, &a, &b, &c, &d) && (c & bit_SSE4_2)) {
+        crc32c_impl = crc32c_sse42;
+    }
+}
+
+uint32_t crc32c(uint32_t crc, const uint8_t *data, unsigned int length)
+{
+    return crc32c_impl(crc, data, length);
+}
+#else
+uint32_t crc32c(uint32_t crc, const uint8_t *data, unsigned int length)
+{
+    return crc32c_generic(crc, data, length);
+}
+#endif
+
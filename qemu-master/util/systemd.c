@@ -0,0 +1,55 @@
+/*
+ * systemd socket activation support
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "qemu/error-report.h"
+#include "qemu/systemd.h"
+
+#ifndef _WIN32
+unsigned check_socket_activation(void)
+{
+    const char *s;
+    unsigned long pid;
+    unsigned long nr_fds;
+    unsigned i;
+    int fd;
+
+    s = getenv("LISTEN_PID");
+    if (s == NULL || qemu_strtoul(s, NULL, 10, &pid) < 0 ||
+        pid != getpid()) {
+        return 0;
+    }
+
+    s = getenv("LISTEN_FDS");
+    if (s == NULL || qemu_strtoul(s, NULL, 10, &nr_fds) < 0) {
+        return 0;
+    }
+    assert(nr_fds <= UINT_MAX);
+
+    /* so they are not passed on to the processes we might start */
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_PID");
+
+    for (i = 0; i < nr_fds; i++) {
+        fd = FIRST_SOCKET_ACTIVATION_FD + i;
+        if (fcntl(fd, F_SETFD, FD_CLOEXEC) == -1) {
+            /* an invalid descriptor: socket activation went wrong */
+            error_report("Socket activation failed: "
+                         "invalid file descriptor fd = %d: %s",
+                         fd, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    return (unsigned) nr_fds;
+}
+#else
+unsigned check_socket_activation(void)
+{
+    return 0;
+}
+#endif
@@ -26,22 +26,6 @@
 #include "qemu/timer.h"
 #include "block/aio.h"
 
-/* This function make a bucket leak
- *
- * @bkt:   the bucket to make leak
- * @delta_ns: the time delta
- */
-void throttle_leak_bucket(LeakyBucket *bkt, int64_t delta_ns)
-{
-    double leak;
-
-    /* compute how much to leak */
-    leak = (bkt->avg * (double) delta_ns) / NANOSECONDS_PER_SECOND;
-
-    /* make the bucket leak */
-    bkt->level = MAX(bkt->level - leak, 0);
-}
-
 /* Calculate the time delta since last leak and make proportionals leaks
  *
  * @now:      the current timestamp in ns
@@ -64,41 +48,6 @@ static void throttle_do_leak(ThrottleState *ts, int64_t now)
     }
 }
 
-/* do the real job of computing the time to wait
- *
- * @limit: the throttling limit
- * @extra: the number of operation to delay
- * @ret:   the time to wait in ns
- */
-static int64_t throttle_do_compute_wait(double limit, double extra)
-{
-    double wait = extra * NANOSECONDS_PER_SECOND;
-    wait /= limit;
-    return wait;
-}
-
-/* This function compute the wait time in ns that a leaky bucket should trigger
- *
- * @bkt: the leaky bucket we operate on
- * @ret: the resulting wait time in ns or 0 if the operation can go through
- */
-int64_t throttle_compute_wait(LeakyBucket *bkt)
-{
-    double extra; /* the number of extra units blocking the io */
-
-    if (!bkt->avg) {
-        return 0;
-    }
-
-    extra = bkt->level - bkt->max;
-
-    if (extra <= 0) {
-        return 0;
-    }
-
-    return throttle_do_compute_wait(bkt->avg, extra);
-}
-
 /* This function compute the time that must be waited while this IO
  *
  * @is_write:   true if the current IO is a write, false if it's a read
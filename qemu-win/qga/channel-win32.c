@@ -8,6 +8,14 @@
 #include "qga/guest-agent-core.h"
 #include "qga/channel.h"
 
+/*
+ * While nobody is connected on the host side, virtio-serial reads fail at
+ * once.  Retry them after a delay doubling up to QGA_RETRY_MAX_MS instead
+ * of spinning.
+ */
+#define QGA_RETRY_MIN_MS 100
+#define QGA_RETRY_MAX_MS 2000
+
 typedef struct GAChannelReadState {
     guint thread_id;
     uint8_t *buf;
@@ -16,6 +24,8 @@ typedef struct GAChannelReadState {
     size_t pending; /* pending buffered bytes to read */
     OVERLAPPED ov;
     bool ov_pending; /* whether on async read is outstanding */
+    int retry_ms; /* current delay after a hangup, 0 if connected */
+    gint64 retry_at; /* monotonic time of the next read after a hangup */
 } GAChannelReadState;
 
 struct GAChannel {
@@ -38,6 +48,13 @@ typedef struct GAWatch {
  * Called by glib prior to polling to set up poll events if polling is needed.
  *
  */
+static void ga_channel_hangup(GAChannelReadState *rs)
+{
+    rs->retry_ms = rs->retry_ms ? MIN(rs->retry_ms * 2, QGA_RETRY_MAX_MS)
+                                : QGA_RETRY_MIN_MS;
+    rs->retry_at = g_get_monotonic_time() + rs->retry_ms * 1000LL;
+}
+
 static gboolean ga_channel_prepare(GSource *source, gint *timeout_ms)
 {
     GAWatch *watch = (GAWatch *)source;
@@ -46,8 +63,21 @@ static gboolean ga_channel_prepare(GSource *source, gint *timeout_ms)
     DWORD count_read, count_to_read = 0;
     bool success;
     GIOCondition new_events = 0;
+    gint64 now;
 
     g_debug("prepare");
+    /* wait on the overlapped read's event, without any timeout */
+    *timeout_ms = -1;
+
+    /* after a hangup, hold the next read back until the retry time */
+    if (!rs->ov_pending && rs->retry_ms) {
+        now = g_get_monotonic_time();
+        if (now < rs->retry_at) {
+            *timeout_ms = (rs->retry_at - now + 999) / 1000;
+            goto out;
+        }
+    }
+
     /* go ahead and submit another read if there's room in the buffer
      * and no previous reads are outstanding
      */
@@ -71,6 +101,12 @@ static gboolean ga_channel_prepare(GSource *source, gint *timeout_ms)
     if (success) {
         rs->pending += count_read;
         rs->ov_pending = false;
+        if (count_read) {
+            rs->retry_ms = 0;
+        } else {
+            ga_channel_hangup(rs);
+            new_events |= G_IO_HUP;
+        }
     } else {
         if (GetLastError() == ERROR_IO_PENDING) {
             rs->ov_pending = true;
@@ -80,8 +116,6 @@ static gboolean ga_channel_prepare(GSource *source, gint *timeout_ms)
     }
 
 out:
-    /* dont block forever, iterate the main loop every once and a while */
-    *timeout_ms = 500;
     /* if there's data in the read buffer, or another event is pending,
      * skip polling and issue user cb.
      */
@@ -107,20 +141,26 @@ static gboolean ga_channel_check(GSource *source)
 
     g_debug("check");
 
-    /* failing this implies we issued a read that completed immediately,
-     * yet no data was placed into the buffer (and thus we did not skip
-     * polling). but since EOF is not obtainable until we retrieve an
-     * overlapped result, it must be the case that there was data placed
-     * into the buffer, or an error was generated by Readfile(). in either
-     * case, we should've skipped the polling for this round.
+    /* no read outstanding: we only waited for the retry time after a
+     * hangup, the next prepare submits the read. a read that completed
+     * immediately always leaves an event pending, so polling is skipped
+     * in that case.
      */
-    g_assert(rs->ov_pending);
+    if (!rs->ov_pending) {
+        return !!c->pending_events;
+    }
 
     success = GetOverlappedResult(c->handle, &rs->ov, &count_read, FALSE);
     if (success) {
         g_debug("thread: overlapped result, count_read: %d", (int)count_read);
         rs->pending += count_read;
-        new_events |= G_IO_IN;
+        if (count_read) {
+            rs->retry_ms = 0;
+            new_events |= G_IO_IN;
+        } else {
+            ga_channel_hangup(rs);
+            new_events |= G_IO_HUP;
+        }
     } else {
         error = GetLastError();
         if (error == 0 || error == ERROR_HANDLE_EOF ||
@@ -134,6 +174,7 @@ static gboolean ga_channel_check(GSource *source)
              * virtio-win driver, this seems to be replaced with EOA, so
              * handle that in the same fashion.
              */
+            ga_channel_hangup(rs);
             new_events |= G_IO_HUP;
         } else if (error != ERROR_IO_INCOMPLETE) {
             g_critical("error retrieving overlapped result: %d", (int)error);
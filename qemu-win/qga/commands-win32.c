@@ -26,12 +26,20 @@
 #include <setupapi.h>
 #include <initguid.h>
 #include <windows.h>
+#ifdef CONFIG_QGA_CM_NOTIFY
+#include <cfgmgr32.h>
+#endif
 #endif
 #include <lm.h>
 #include <psapi.h>
+#include <pdh.h>
+#if (_WIN32_WINNT >= 0x0600)
+#include <winevt.h>
+#endif
 
 #include "qga/guest-agent-core.h"
 #include "qga/vss-win32.h"
+#include "qga/bc/collect.h"
 #include "qga-qmp-commands.h"
 #include "qapi/qmp/qerror.h"
 #include "qemu/queue.h"
@@ -219,11 +227,33 @@ void qmp_guest_file_close(int64_t handle, Error **errp)
     g_free(gfh);
 }
 
+/*
+ * Privileges enabled in the process token stay enabled until the agent
+ * exits, so each is only adjusted once; the commands that need one call
+ * acquire_privilege() every time and only the first call does any work.
+ */
+static const char *acquired_privileges[] = {
+    SE_SHUTDOWN_NAME,
+    SE_SYSTEMTIME_NAME,
+};
+
+static bool privilege_acquired[G_N_ELEMENTS(acquired_privileges)];
+
 static void acquire_privilege(const char *name, Error **errp)
 {
     HANDLE token = NULL;
     TOKEN_PRIVILEGES priv;
     Error *local_err = NULL;
+    int i;
+
+    for (i = 0; i < G_N_ELEMENTS(acquired_privileges); i++) {
+        if (!strcmp(acquired_privileges[i], name)) {
+            break;
+        }
+    }
+    if (i < G_N_ELEMENTS(acquired_privileges) && privilege_acquired[i]) {
+        return;
+    }
 
     if (OpenProcessToken(GetCurrentProcess(),
         TOKEN_ADJUST_PRIVILEGES|TOKEN_QUERY, &token))
@@ -242,6 +272,9 @@ static void acquire_privilege(const char *name, Error **errp)
                        "unable to acquire requested privilege");
             goto out;
         }
+        if (i < G_N_ELEMENTS(acquired_privileges)) {
+            privilege_acquired[i] = true;
+        }
 
     } else {
         error_setg(&local_err, QERR_QGA_COMMAND_FAILED,
@@ -257,6 +290,23 @@ out:
     }
 }
 
+/* enable the privileges up front; a command retries any that failed */
+static void acquire_privileges_init(void)
+{
+    Error *local_err = NULL;
+    int i;
+
+    for (i = 0; i < G_N_ELEMENTS(acquired_privileges); i++) {
+        acquire_privilege(acquired_privileges[i], &local_err);
+        if (local_err) {
+            g_debug("%s: %s", acquired_privileges[i],
+                    error_get_pretty(local_err));
+            error_free(local_err);
+            local_err = NULL;
+        }
+    }
+}
+
 static void execute_async(DWORD WINAPI (*func)(LPVOID), LPVOID opaque,
                           Error **errp)
 {
@@ -442,6 +492,325 @@ void qmp_guest_file_flush(int64_t handle, Error **errp)
     }
 }
 
+#define GUEST_FILE_LIST_DEPTH_MAX 64
+#define GUEST_FILE_LIST_ENTRIES_DEFAULT 1000
+#define GUEST_FILE_LIST_ENTRIES_MAX 100000
+
+#ifndef FIND_FIRST_EX_LARGE_FETCH
+#define FIND_FIRST_EX_LARGE_FETCH 2
+#endif
+
+typedef struct GuestFileLister {
+    char *pattern;              /* case folded */
+    int64_t depth;
+    int64_t left;               /* entries that may still be added */
+    GuestFileEntryList **tail;
+    const char *last;           /* name of the last entry added */
+    bool truncated;
+} GuestFileLister;
+
+/* what the directory enumeration tells of an entry */
+typedef struct GuestFileFound {
+    char *name;
+    DWORD attrs;
+    DWORD reparse_tag;
+    int64_t size;
+    int64_t mtime;
+} GuestFileFound;
+
+static bool guest_file_is_link(const GuestFileFound *f)
+{
+    return (f->attrs & FILE_ATTRIBUTE_REPARSE_POINT) &&
+           (f->reparse_tag == IO_REPARSE_TAG_SYMLINK ||
+            f->reparse_tag == IO_REPARSE_TAG_MOUNT_POINT);
+}
+
+static GuestFileType guest_file_type(const GuestFileFound *f)
+{
+    if (guest_file_is_link(f)) {
+        return GUEST_FILE_TYPE_SYMLINK;
+    }
+    if (f->attrs & FILE_ATTRIBUTE_DIRECTORY) {
+        return GUEST_FILE_TYPE_DIRECTORY;
+    }
+    return GUEST_FILE_TYPE_FILE;
+}
+
+static gint guest_file_found_cmp(gconstpointer a, gconstpointer b)
+{
+    return strcmp((*(GuestFileFound * const *)a)->name,
+                  (*(GuestFileFound * const *)b)->name);
+}
+
+static void guest_file_found_free(gpointer p)
+{
+    GuestFileFound *f = p;
+
+    g_free(f->name);
+    g_free(f);
+}
+
+/*
+ * The size, times and attributes of every entry come with its name, so
+ * nothing is opened.  FindExInfoBasic leaves out the short 8.3 names and
+ * FIND_FIRST_EX_LARGE_FETCH has the directory read in larger batches;
+ * Windows before 7 has neither, and gets the plain enumeration.
+ */
+static HANDLE guest_file_find_first(const WCHAR *pattern,
+                                    WIN32_FIND_DATAW *data)
+{
+    static bool basic_unsupported;
+    HANDLE h;
+
+    if (!basic_unsupported) {
+        h = FindFirstFileExW(pattern, FindExInfoBasic, data,
+                             FindExSearchNameMatch, NULL,
+                             FIND_FIRST_EX_LARGE_FETCH);
+        if (h != INVALID_HANDLE_VALUE ||
+            GetLastError() != ERROR_INVALID_PARAMETER) {
+            return h;
+        }
+        basic_unsupported = true;
+    }
+    return FindFirstFileExW(pattern, FindExInfoStandard, data,
+                            FindExSearchNameMatch, NULL, 0);
+}
+
+/* the entries of @dir, sorted by name, or NULL if it cannot be read */
+static GPtrArray *guest_file_list_read(const WCHAR *dir)
+{
+    WIN32_FIND_DATAW data;
+    GuestFileFound *f;
+    GPtrArray *found;
+    WCHAR *pattern;
+    size_t len;
+    HANDLE h;
+    char *name;
+
+    len = wcslen(dir);
+    pattern = g_new(WCHAR, len + 3);
+    memcpy(pattern, dir, len * sizeof(WCHAR));
+    if (len && dir[len - 1] != L'\\' && dir[len - 1] != L'/') {
+        pattern[len++] = L'\\';
+    }
+    pattern[len++] = L'*';
+    pattern[len] = L'\0';
+    h = guest_file_find_first(pattern, &data);
+    g_free(pattern);
+    if (h == INVALID_HANDLE_VALUE) {
+        return NULL;
+    }
+
+    found = g_ptr_array_new_with_free_func(guest_file_found_free);
+    do {
+        if (!wcscmp(data.cFileName, L".") || !wcscmp(data.cFileName, L"..")) {
+            continue;
+        }
+        name = g_utf16_to_utf8(data.cFileName, -1, NULL, NULL, NULL);
+        if (!name) {
+            continue;
+        }
+        f = g_new0(GuestFileFound, 1);
+        f->name = name;
+        f->attrs = data.dwFileAttributes;
+        f->reparse_tag = data.dwReserved0;
+        f->size = ((int64_t)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+        f->mtime = ((((int64_t)data.ftLastWriteTime.dwHighDateTime << 32) |
+                     data.ftLastWriteTime.dwLowDateTime) - W32_FT_OFFSET) /
+                   10000000;
+        g_ptr_array_add(found, f);
+    } while (FindNextFileW(h, &data));
+    FindClose(h);
+
+    g_ptr_array_sort(found, guest_file_found_cmp);
+    return found;
+}
+
+static bool guest_file_list_match(GuestFileLister *l, const char *name)
+{
+    char *folded;
+    bool ret;
+
+    if (!l->pattern) {
+        return true;
+    }
+    folded = g_utf8_casefold(name, -1);
+    ret = g_pattern_match_simple(l->pattern, folded);
+    g_free(folded);
+    return ret;
+}
+
+static void guest_file_list_add(GuestFileLister *l, char *name,
+                                const GuestFileFound *f)
+{
+    GuestFileEntry *entry = g_new0(GuestFileEntry, 1);
+
+    entry->name = name;
+    entry->type = guest_file_type(f);
+    entry->size = f->size;
+    entry->mtime = f->mtime;
+    entry->mode = 0444;
+    if (!(f->attrs & FILE_ATTRIBUTE_READONLY)) {
+        entry->mode |= 0222;
+    }
+    if (f->attrs & FILE_ATTRIBUTE_DIRECTORY) {
+        entry->mode |= 0111;
+    }
+    *l->tail = g_new0(GuestFileEntryList, 1);
+    (*l->tail)->value = entry;
+    l->tail = &(*l->tail)->next;
+    l->last = name;
+    l->left--;
+}
+
+/*
+ * Add the entries of @found, the contents of @dir, named @prefix\<name>,
+ * in order.  @resume are the components of the cursor below @dir that are
+ * still to be skipped, NULL when listing from the start.  Returns false
+ * when the listing is to stop.
+ */
+static bool guest_file_list_dir(GuestFileLister *l, const WCHAR *dir,
+                                GPtrArray *found, const char *prefix,
+                                int64_t level, char **resume)
+{
+    GuestFileFound *f;
+    GPtrArray *sub_found;
+    WCHAR *wname, *subdir;
+    char *path, **sub;
+    bool ok = true, added;
+    guint i;
+
+    for (i = 0; i < found->len && ok; i++) {
+        f = g_ptr_array_index(found, i);
+        sub = NULL;
+        if (resume && *resume) {
+            if (strcmp(f->name, resume[0]) < 0) {
+                continue;
+            }
+            /* the cursor itself was sent, but maybe not all below it */
+            if (!strcmp(f->name, resume[0])) {
+                sub = resume + 1;
+            }
+            resume = NULL;
+        }
+
+        path = prefix ? g_strconcat(prefix, "\\", f->name, NULL) :
+                        g_strdup(f->name);
+        added = !sub && guest_file_list_match(l, f->name);
+        if (added && !l->left) {
+            l->truncated = true;
+            g_free(path);
+            break;
+        }
+        if (added) {
+            guest_file_list_add(l, path, f);
+        }
+
+        if ((f->attrs & FILE_ATTRIBUTE_DIRECTORY) &&
+            !(f->attrs & FILE_ATTRIBUTE_REPARSE_POINT) && level < l->depth) {
+            wname = g_utf8_to_utf16(f->name, -1, NULL, NULL, NULL);
+            subdir = g_new(WCHAR, wcslen(dir) + wcslen(wname) + 2);
+            wcscpy(subdir, dir);
+            if (*dir && dir[wcslen(dir) - 1] != L'\\' &&
+                dir[wcslen(dir) - 1] != L'/') {
+                wcscat(subdir, L"\\");
+            }
+            wcscat(subdir, wname);
+            sub_found = guest_file_list_read(subdir);
+            if (sub_found) {
+                ok = guest_file_list_dir(l, subdir, sub_found, path,
+                                         level + 1, sub);
+                g_ptr_array_free(sub_found, true);
+            }
+            g_free(subdir);
+            g_free(wname);
+        }
+        if (!added) {
+            g_free(path);
+        }
+    }
+
+    return ok && !l->truncated;
+}
+
+GuestFileListing *qmp_guest_file_list(const char *path, bool has_depth,
+                                      int64_t depth, bool has_pattern,
+                                      const char *pattern,
+                                      bool has_max_entries,
+                                      int64_t max_entries, bool has_cursor,
+                                      const char *cursor, Error **errp)
+{
+    GuestFileListing *listing;
+    GuestFileLister l = { 0 };
+    GPtrArray *found;
+    char **resume = NULL;
+    WCHAR *wpath;
+    DWORD attrs;
+
+    if (!has_depth) {
+        depth = 0;
+    } else if (depth < 0 || depth > GUEST_FILE_LIST_DEPTH_MAX) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "depth",
+                   "a number from 0 to 64");
+        return NULL;
+    }
+    if (!has_max_entries) {
+        max_entries = GUEST_FILE_LIST_ENTRIES_DEFAULT;
+    } else if (max_entries < 1 || max_entries > GUEST_FILE_LIST_ENTRIES_MAX) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "max-entries",
+                   "a number from 1 to 100000");
+        return NULL;
+    }
+
+    slog("guest-file-list called, path: %s", path);
+    wpath = g_utf8_to_utf16(path, -1, NULL, NULL, NULL);
+    if (!wpath) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "path",
+                   "a UTF-8 path");
+        return NULL;
+    }
+    attrs = GetFileAttributesW(wpath);
+    if (attrs == INVALID_FILE_ATTRIBUTES) {
+        error_setg_win32(errp, GetLastError(),
+                         "failed to open directory '%s'", path);
+        g_free(wpath);
+        return NULL;
+    }
+    if (!(attrs & FILE_ATTRIBUTE_DIRECTORY)) {
+        error_setg_win32(errp, ERROR_DIRECTORY,
+                         "failed to open directory '%s'", path);
+        g_free(wpath);
+        return NULL;
+    }
+    found = guest_file_list_read(wpath);
+    if (!found) {
+        error_setg_win32(errp, GetLastError(),
+                         "failed to open directory '%s'", path);
+        g_free(wpath);
+        return NULL;
+    }
+
+    listing = g_new0(GuestFileListing, 1);
+    l.pattern = has_pattern ? g_utf8_casefold(pattern, -1) : NULL;
+    l.depth = depth;
+    l.left = max_entries;
+    l.tail = &listing->entries;
+    if (has_cursor) {
+        resume = g_strsplit(cursor, "\\", -1);
+    }
+    guest_file_list_dir(&l, wpath, found, NULL, 0, resume);
+    g_ptr_array_free(found, true);
+    g_strfreev(resume);
+    g_free(l.pattern);
+    g_free(wpath);
+
+    if (l.truncated) {
+        listing->has_cursor = true;
+        listing->cursor = g_strdup(l.last);
+    }
+    return listing;
+}
+
 #ifdef CONFIG_QGA_NTDDSCSI
 
 static STORAGE_BUS_TYPE win2qemu[] = {
@@ -479,32 +848,48 @@ DEFINE_GUID(GUID_DEVINTERFACE_VOLUME,
         0x53f5630dL, 0xb6bf, 0x11d0, 0x94, 0xf2,
         0x00, 0xa0, 0xc9, 0x1e, 0xfb, 0x8b);
 
-static GuestPCIAddress *get_pci_info(char *guid, Error **errp)
+/*
+ * get_pci_info() used to enumerate every volume device and read its
+ * properties for each volume guest-get-fsinfo looked at, which took
+ * seconds with many disks.  The devices are now enumerated once, into a
+ * map from physical device object name to PCI address, that is thrown
+ * away when a volume arrives or goes away.  CM_Register_Notification()
+ * reports that on Windows 8 and later; it is looked up at run time, and
+ * without it the map lasts GUEST_DEVMAP_MAX_AGE_MS.  A volume the map
+ * does not know makes it be rebuilt at once, whatever its age.
+ */
+#define GUEST_DEVMAP_MAX_AGE_MS 30000
+
+static struct {
+    GHashTable *pci;            /* device name -> GuestPCIAddress or NULL */
+    int64_t built_at;           /* g_get_monotonic_time() */
+    volatile LONG stale;
+#ifdef CONFIG_QGA_CM_NOTIFY
+    HCMNOTIFICATION notify;
+#endif
+} guest_devmap_state;
+
+static GHashTable *guest_devmap_build(Error **errp)
 {
     HDEVINFO dev_info;
     SP_DEVINFO_DATA dev_info_data;
     DWORD size = 0;
     int i;
-    char dev_name[MAX_PATH];
     char *buffer = NULL;
-    GuestPCIAddress *pci = NULL;
-    char *name = g_strdup(&guid[4]);
-
-    if (!QueryDosDevice(name, dev_name, ARRAY_SIZE(dev_name))) {
-        error_setg_win32(errp, GetLastError(), "failed to get dos device name");
-        goto out;
-    }
+    GuestPCIAddress *pci;
+    GHashTable *map;
 
     dev_info = SetupDiGetClassDevs(&GUID_DEVINTERFACE_VOLUME, 0, 0,
                                    DIGCF_PRESENT | DIGCF_DEVICEINTERFACE);
     if (dev_info == INVALID_HANDLE_VALUE) {
         error_setg_win32(errp, GetLastError(), "failed to get devices tree");
-        goto out;
+        return NULL;
     }
 
+    map = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
     dev_info_data.cbSize = sizeof(SP_DEVINFO_DATA);
     for (i = 0; SetupDiEnumDeviceInfo(dev_info, i, &dev_info_data); i++) {
-        DWORD addr, bus, slot, func, dev, data, size2;
+        DWORD addr, bus, slot, data, size2;
         while (!SetupDiGetDeviceRegistryProperty(dev_info, &dev_info_data,
                                             SPDRP_PHYSICAL_DEVICE_OBJECT_NAME,
                                             &data, (PBYTE)buffer, size,
@@ -519,56 +904,173 @@ static GuestPCIAddress *get_pci_info(char *guid, Error **errp)
             } else {
                 error_setg_win32(errp, GetLastError(),
                         "failed to get device name");
+                g_hash_table_destroy(map);
+                map = NULL;
                 goto out;
             }
         }
 
-        if (g_strcmp0(buffer, dev_name)) {
-            continue;
-        }
-
         /* There is no need to allocate buffer in the next functions. The size
          * is known and ULONG according to
          * https://support.microsoft.com/en-us/kb/253232
          * https://msdn.microsoft.com/en-us/library/windows/hardware/ff543095(v=vs.85).aspx
+         *
+         * The function retrieves the device's address. This value will be
+         * transformed into device function and number.  UINumber of
+         * DEVICE_CAPABILITIES is typically a user-perceived slot number.
+         * A device without them is kept, so that it does not count as new.
          */
-        if (!SetupDiGetDeviceRegistryProperty(dev_info, &dev_info_data,
-                   SPDRP_BUSNUMBER, &data, (PBYTE)&bus, size, NULL)) {
-            break;
+        pci = NULL;
+        if (SetupDiGetDeviceRegistryProperty(dev_info, &dev_info_data,
+                   SPDRP_BUSNUMBER, &data, (PBYTE)&bus, sizeof(bus), NULL) &&
+            SetupDiGetDeviceRegistryProperty(dev_info, &dev_info_data,
+                   SPDRP_ADDRESS, &data, (PBYTE)&addr, sizeof(addr), NULL) &&
+            SetupDiGetDeviceRegistryProperty(dev_info, &dev_info_data,
+                   SPDRP_UI_NUMBER, &data, (PBYTE)&slot, sizeof(slot),
+                   NULL)) {
+            /* SetupApi gives us the same information as driver with
+             * IoGetDeviceProperty. According to Microsoft
+             * https://support.microsoft.com/en-us/kb/253232
+             * FunctionNumber = (USHORT)((propertyAddress) & 0x0000FFFF);
+             * DeviceNumber = (USHORT)(((propertyAddress) >> 16) & 0x0000FFFF);
+             * SPDRP_ADDRESS is propertyAddress, so we do the same.*/
+            pci = g_malloc0(sizeof(*pci));
+            pci->domain = (addr >> 16) & 0x0000FFFF;
+            pci->slot = slot;
+            pci->function = addr & 0x0000FFFF;
+            pci->bus = bus;
         }
+        g_hash_table_replace(map, g_strdup(buffer), pci);
+    }
+out:
+    SetupDiDestroyDeviceInfoList(dev_info);
+    g_free(buffer);
+    return map;
+}
 
-        /* The function retrieves the device's address. This value will be
-         * transformed into device function and number */
-        if (!SetupDiGetDeviceRegistryProperty(dev_info, &dev_info_data,
-                   SPDRP_ADDRESS, &data, (PBYTE)&addr, size, NULL)) {
-            break;
+#ifdef CONFIG_QGA_CM_NOTIFY
+typedef CONFIGRET (WINAPI *CMRegisterNotificationFunc)(PCM_NOTIFY_FILTER,
+                                                       PVOID,
+                                                       PCM_NOTIFY_CALLBACK,
+                                                       PHCMNOTIFICATION);
+typedef CONFIGRET (WINAPI *CMUnregisterNotificationFunc)(HCMNOTIFICATION);
+
+/* runs on a thread pool thread, it only marks the map */
+static DWORD CALLBACK guest_devmap_changed(HCMNOTIFICATION notify,
+                                           PVOID ctx, CM_NOTIFY_ACTION action,
+                                           PCM_NOTIFY_EVENT_DATA data,
+                                           DWORD size)
+{
+    InterlockedExchange(&guest_devmap_state.stale, 1);
+    return ERROR_SUCCESS;
+}
+
+static bool guest_devmap_watch(void)
+{
+    static CMRegisterNotificationFunc register_notification;
+    static bool looked_up;
+    CM_NOTIFY_FILTER filter;
+    CONFIGRET ret;
+
+    if (guest_devmap_state.notify) {
+        return true;
+    }
+    if (!looked_up) {
+        register_notification = (CMRegisterNotificationFunc)GetProcAddress(
+            LoadLibraryA("cfgmgr32.dll"), "CM_Register_Notification");
+        looked_up = true;
+    }
+    if (!register_notification) {
+        return false;
+    }
+
+    memset(&filter, 0, sizeof(filter));
+    filter.cbSize = sizeof(filter);
+    filter.FilterType = CM_NOTIFY_FILTER_TYPE_DEVICEINTERFACE;
+    filter.u.DeviceInterface.ClassGuid = GUID_DEVINTERFACE_VOLUME;
+    ret = register_notification(&filter, NULL, guest_devmap_changed,
+                                &guest_devmap_state.notify);
+    if (ret != CR_SUCCESS) {
+        g_debug("failed to watch volume devices: %lu", ret);
+        guest_devmap_state.notify = NULL;
+        return false;
+    }
+    return true;
+}
+#else
+static bool guest_devmap_watch(void)
+{
+    return false;
+}
+#endif
+
+static void guest_devmap_cleanup(void)
+{
+#ifdef CONFIG_QGA_CM_NOTIFY
+    if (guest_devmap_state.notify) {
+        CMUnregisterNotificationFunc unregister_notification =
+            (CMUnregisterNotificationFunc)GetProcAddress(
+                GetModuleHandleA("cfgmgr32.dll"),
+                "CM_Unregister_Notification");
+
+        if (unregister_notification) {
+            unregister_notification(guest_devmap_state.notify);
         }
+    }
+#endif
+    if (guest_devmap_state.pci) {
+        g_hash_table_destroy(guest_devmap_state.pci);
+    }
+    memset(&guest_devmap_state, 0, sizeof(guest_devmap_state));
+}
+
+static GuestPCIAddress *get_pci_info(char *guid, Error **errp)
+{
+    char dev_name[MAX_PATH];
+    GuestPCIAddress *pci = NULL;
+    char *name = g_strdup(&guid[4]);
+    int64_t now = g_get_monotonic_time();
+    bool watched, fresh = false;
+    gpointer found;
+
+    if (!QueryDosDevice(name, dev_name, ARRAY_SIZE(dev_name))) {
+        error_setg_win32(errp, GetLastError(), "failed to get dos device name");
+        goto out;
+    }
 
-        /* This call returns UINumber of DEVICE_CAPABILITIES structure.
-         * This number is typically a user-perceived slot number. */
-        if (!SetupDiGetDeviceRegistryProperty(dev_info, &dev_info_data,
-                   SPDRP_UI_NUMBER, &data, (PBYTE)&slot, size, NULL)) {
+    /* mark the map stale before enumerating, so no change is missed */
+    watched = guest_devmap_watch();
+    if (guest_devmap_state.pci &&
+        (InterlockedExchange(&guest_devmap_state.stale, 0) ||
+         (!watched &&
+          now - guest_devmap_state.built_at > GUEST_DEVMAP_MAX_AGE_MS * 1000))) {
+        g_hash_table_destroy(guest_devmap_state.pci);
+        guest_devmap_state.pci = NULL;
+    }
+    for (;;) {
+        if (!guest_devmap_state.pci) {
+            guest_devmap_state.pci = guest_devmap_build(errp);
+            if (!guest_devmap_state.pci) {
+                goto out;
+            }
+            guest_devmap_state.built_at = now;
+            fresh = true;
+        }
+        if (g_hash_table_lookup_extended(guest_devmap_state.pci, dev_name,
+                                         NULL, &found)) {
             break;
         }
-
-        /* SetupApi gives us the same information as driver with
-         * IoGetDeviceProperty. According to Microsoft
-         * https://support.microsoft.com/en-us/kb/253232
-         * FunctionNumber = (USHORT)((propertyAddress) & 0x0000FFFF);
-         * DeviceNumber = (USHORT)(((propertyAddress) >> 16) & 0x0000FFFF);
-         * SPDRP_ADDRESS is propertyAddress, so we do the same.*/
-
-        func = addr & 0x0000FFFF;
-        dev = (addr >> 16) & 0x0000FFFF;
-        pci = g_malloc0(sizeof(*pci));
-        pci->domain = dev;
-        pci->slot = slot;
-        pci->function = func;
-        pci->bus = bus;
-        break;
+        if (fresh) {
+            goto out;
+        }
+        /* a volume that arrived since */
+        g_hash_table_destroy(guest_devmap_state.pci);
+        guest_devmap_state.pci = NULL;
+    }
+    if (found) {
+        pci = g_memdup(found, sizeof(*pci));
     }
 out:
-    g_free(buffer);
     g_free(name);
     return pci;
 }
@@ -946,25 +1448,57 @@ void qmp_guest_suspend_hybrid(Error **errp)
     error_setg(errp, QERR_UNSUPPORTED);
 }
 
+/*
+ * The adapter enumeration buffer is kept between calls; it is only
+ * reallocated when the adapters no longer fit.  The interface list built
+ * from it is cached as well, and thrown away when Windows reports an
+ * interface or address change, or after GUEST_NET_CACHE_MAX_AGE_MS in case
+ * something changed that no notification covers, like an adapter rename.
+ */
+#define GUEST_NET_BUF_SIZE_INITIAL (16 * 1024)
+#define GUEST_NET_CACHE_MAX_AGE_MS 30000
+
+static struct {
+    IP_ADAPTER_ADDRESSES *buf;
+    ULONG size;
+    GuestNetworkInterfaceList *interfaces;
+    int64_t cached_at;          /* g_get_monotonic_time() */
+    volatile LONG stale;
+#if (_WIN32_WINNT >= 0x0600)
+    HANDLE iface_notify;
+    HANDLE addr_notify;
+#endif
+} guest_net_state;
+
+/* the returned list belongs to guest_net_state, valid until the next call */
 static IP_ADAPTER_ADDRESSES *guest_get_adapters_addresses(Error **errp)
 {
-    IP_ADAPTER_ADDRESSES *adptr_addrs = NULL;
-    ULONG adptr_addrs_len = 0;
+    ULONG flags = GAA_FLAG_INCLUDE_PREFIX | GAA_FLAG_SKIP_ANYCAST |
+                  GAA_FLAG_SKIP_MULTICAST | GAA_FLAG_SKIP_DNS_SERVER;
+    ULONG size;
     DWORD ret;
 
-    /* Call the first time to get the adptr_addrs_len. */
-    GetAdaptersAddresses(AF_UNSPEC, GAA_FLAG_INCLUDE_PREFIX,
-                         NULL, adptr_addrs, &adptr_addrs_len);
-
-    adptr_addrs = g_malloc(adptr_addrs_len);
-    ret = GetAdaptersAddresses(AF_UNSPEC, GAA_FLAG_INCLUDE_PREFIX,
-                               NULL, adptr_addrs, &adptr_addrs_len);
+    if (!guest_net_state.buf) {
+        guest_net_state.size = GUEST_NET_BUF_SIZE_INITIAL;
+        guest_net_state.buf = g_malloc(guest_net_state.size);
+    }
+    /* adapters can be added between the calls, retry until they fit */
+    for (;;) {
+        size = guest_net_state.size;
+        ret = GetAdaptersAddresses(AF_UNSPEC, flags, NULL,
+                                   guest_net_state.buf, &size);
+        if (ret != ERROR_BUFFER_OVERFLOW) {
+            break;
+        }
+        g_free(guest_net_state.buf);
+        guest_net_state.size = size + size / 4;
+        guest_net_state.buf = g_malloc(guest_net_state.size);
+    }
     if (ret != ERROR_SUCCESS) {
         error_setg_win32(errp, ret, "failed to get adapters addresses");
-        g_free(adptr_addrs);
-        adptr_addrs = NULL;
+        return NULL;
     }
-    return adptr_addrs;
+    return guest_net_state.buf;
 }
 
 static char *guest_wctomb_dup(WCHAR *wstr)
@@ -1012,6 +1546,10 @@ static int64_t guest_ip_prefix(IP_ADAPTER_UNICAST_ADDRESS *ip_addr)
      */
     return ip_addr->OnLinkPrefixLength;
 }
+
+static void guest_ip_prefix_done(void)
+{
+}
 #else
 /* When using the Windows XP and 2003 build environment, do the best we can to
  * figure out the prefix.
@@ -1034,40 +1572,49 @@ static IP_ADAPTER_INFO *guest_get_adapters_info(void)
     return adptr_info;
 }
 
+/* taken on first use and kept until guest_ip_prefix_done() */
+static IP_ADAPTER_INFO *guest_adapters_info;
+
 static int64_t guest_ip_prefix(IP_ADAPTER_UNICAST_ADDRESS *ip_addr)
 {
     int64_t prefix = -1; /* Use for AF_INET6 and unknown/undetermined values. */
-    IP_ADAPTER_INFO *adptr_info, *info;
+    IP_ADAPTER_INFO *info;
     IP_ADDR_STRING *ip;
     struct in_addr *p;
 
     if (ip_addr->Address.lpSockaddr->sa_family != AF_INET) {
         return prefix;
     }
-    adptr_info = guest_get_adapters_info();
-    if (adptr_info == NULL) {
-        return prefix;
+    if (!guest_adapters_info) {
+        guest_adapters_info = guest_get_adapters_info();
+        if (guest_adapters_info == NULL) {
+            return prefix;
+        }
     }
 
     /* Match up the passed in ip_addr with one found in adaptr_info.
      * The matching one in adptr_info will have the netmask.
      */
     p = &((struct sockaddr_in *)ip_addr->Address.lpSockaddr)->sin_addr;
-    for (info = adptr_info; info; info = info->Next) {
+    for (info = guest_adapters_info; info; info = info->Next) {
         for (ip = &info->IpAddressList; ip; ip = ip->Next) {
             if (p->S_un.S_addr == inet_addr(ip->IpAddress.String)) {
                 prefix = ctpop32(inet_addr(ip->IpMask.String));
-                goto out;
+                return prefix;
             }
         }
     }
-out:
-    g_free(adptr_info);
     return prefix;
 }
+
+static void guest_ip_prefix_done(void)
+{
+    g_free(guest_adapters_info);
+    guest_adapters_info = NULL;
+}
 #endif
 
-GuestNetworkInterfaceList *qmp_guest_network_get_interfaces(Error **errp)
+static GuestNetworkInterfaceList *guest_net_build(Error **errp)
 {
     IP_ADAPTER_ADDRESSES *adptr_addrs, *addr;
     IP_ADAPTER_UNICAST_ADDRESS *ip_addr = NULL;
@@ -1091,7 +1638,7 @@ GuestNetworkInterfaceList *qmp_guest_network_get_interfaces(Error **errp)
     ret = WSAStartup(wsa_version, &wsa_data);
     if (ret != 0) {
         error_setg_win32(errp, ret, "failed socket startup");
-        goto out;
+        return NULL;
     }
 
     for (addr = adptr_addrs; addr; addr = addr->Next) {
@@ -1155,11 +1702,134 @@ GuestNetworkInterfaceList *qmp_guest_network_get_interfaces(Error **errp)
         }
     }
     WSACleanup();
-out:
-    g_free(adptr_addrs);
+    guest_ip_prefix_done();
+    return head;
+}
+
+static GuestIpAddressList *guest_ip_address_list_copy(GuestIpAddressList *list)
+{
+    GuestIpAddressList *head = NULL, **tail = &head, *entry;
+    GuestIpAddress *ip;
+
+    for (; list; list = list->next) {
+        ip = g_memdup(list->value, sizeof(*ip));
+        ip->ip_address = g_strdup(ip->ip_address);
+        entry = g_new0(GuestIpAddressList, 1);
+        entry->value = ip;
+        *tail = entry;
+        tail = &entry->next;
+    }
+    return head;
+}
+
+static GuestNetworkInterfaceList *guest_net_copy(
+    GuestNetworkInterfaceList *list)
+{
+    GuestNetworkInterfaceList *head = NULL, **tail = &head, *entry;
+    GuestNetworkInterface *iface;
+
+    for (; list; list = list->next) {
+        iface = g_memdup(list->value, sizeof(*iface));
+        iface->name = g_strdup(iface->name);
+        iface->hardware_address = g_strdup(iface->hardware_address);
+        iface->ip_addresses = guest_ip_address_list_copy(iface->ip_addresses);
+        entry = g_new0(GuestNetworkInterfaceList, 1);
+        entry->value = iface;
+        *tail = entry;
+        tail = &entry->next;
+    }
     return head;
 }
 
+#if (_WIN32_WINNT >= 0x0600)
+static VOID WINAPI guest_net_iface_changed(PVOID ctx, PMIB_IPINTERFACE_ROW row,
+                                           MIB_NOTIFICATION_TYPE type)
+{
+    InterlockedExchange(&guest_net_state.stale, 1);
+}
+
+static VOID WINAPI guest_net_addr_changed(PVOID ctx,
+                                          PMIB_UNICASTIPADDRESS_ROW row,
+                                          MIB_NOTIFICATION_TYPE type)
+{
+    InterlockedExchange(&guest_net_state.stale, 1);
+}
+
+/* the callbacks run on a thread pool thread, they only mark the cache */
+static bool guest_net_watch(void)
+{
+    DWORD ret;
+
+    if (guest_net_state.iface_notify && guest_net_state.addr_notify) {
+        return true;
+    }
+    if (!guest_net_state.iface_notify) {
+        ret = NotifyIpInterfaceChange(AF_UNSPEC, guest_net_iface_changed,
+                                      NULL, FALSE,
+                                      &guest_net_state.iface_notify);
+        if (ret != NO_ERROR) {
+            g_debug("failed to watch network interfaces: %lu", ret);
+            guest_net_state.iface_notify = NULL;
+            return false;
+        }
+    }
+    ret = NotifyUnicastIpAddressChange(AF_UNSPEC, guest_net_addr_changed,
+                                       NULL, FALSE,
+                                       &guest_net_state.addr_notify);
+    if (ret != NO_ERROR) {
+        g_debug("failed to watch network addresses: %lu", ret);
+        guest_net_state.addr_notify = NULL;
+        return false;
+    }
+    return true;
+}
+#else
+static bool guest_net_watch(void)
+{
+    return false;
+}
+#endif
+
+GuestNetworkInterfaceList *qmp_guest_network_get_interfaces(Error **errp)
+{
+    int64_t now = g_get_monotonic_time();
+    bool watched;
+
+    /* mark the cache stale before enumerating, so no change is missed */
+    watched = guest_net_watch();
+    if (InterlockedExchange(&guest_net_state.stale, 0) ||
+        now - guest_net_state.cached_at > GUEST_NET_CACHE_MAX_AGE_MS * 1000) {
+        qapi_free_GuestNetworkInterfaceList(guest_net_state.interfaces);
+        guest_net_state.interfaces = NULL;
+    }
+    if (!guest_net_state.interfaces) {
+        GuestNetworkInterfaceList *list = guest_net_build(errp);
+
+        if (!list || !watched) {
+            return list;
+        }
+        guest_net_state.interfaces = list;
+        guest_net_state.cached_at = now;
+    }
+    return guest_net_copy(guest_net_state.interfaces);
+}
+
+static void guest_net_cleanup(void)
+{
+#if (_WIN32_WINNT >= 0x0600)
+    if (guest_net_state.iface_notify) {
+        CancelMibChangeNotify2(guest_net_state.iface_notify);
+    }
+    if (guest_net_state.addr_notify) {
+        CancelMibChangeNotify2(guest_net_state.addr_notify);
+    }
+#endif
+    qapi_free_GuestNetworkInterfaceList(guest_net_state.interfaces);
+    g_free(guest_net_state.buf);
+    memset(&guest_net_state, 0, sizeof(guest_net_state));
+}
+
+
 int64_t qmp_guest_get_time(Error **errp)
 {
     SYSTEMTIME ts = {0};
@@ -1371,33 +2041,63 @@ GList *ga_command_blacklist_init(GList *blacklist)
     return blacklist;
 }
 
+static void guest_proc_cleanup(void);
+static void guest_net_cleanup(void);
+static void guest_password_cleanup(void);
+static void guest_cpustat_cleanup(void);
+static void guest_diskstat_cleanup(void);
+static void guest_netstat_cleanup(void);
+static void guest_evtlog_init(void);
+static void guest_evtlog_cleanup(void);
+
 /* register init/cleanup routines for stateful command groups */
 void ga_command_state_init(GAState *s, GACommandState *cs)
 {
     if (!vss_initialized()) {
         ga_command_state_add(cs, NULL, guest_fsfreeze_cleanup);
     }
+    ga_command_state_add(cs, acquire_privileges_init, NULL);
+    ga_command_state_add(cs, NULL, guest_proc_cleanup);
+    ga_command_state_add(cs, NULL, guest_net_cleanup);
+    ga_command_state_add(cs, NULL, guest_password_cleanup);
+    ga_command_state_add(cs, ga_collect_system_init,
+                         ga_collect_system_cleanup);
+    ga_command_state_add(cs, NULL, guest_cpustat_cleanup);
+    ga_command_state_add(cs, NULL, guest_diskstat_cleanup);
+    ga_command_state_add(cs, NULL, guest_netstat_cleanup);
+#ifdef CONFIG_QGA_NTDDSCSI
+    ga_command_state_add(cs, NULL, guest_devmap_cleanup);
+#endif
+    ga_command_state_add(cs, guest_evtlog_init, guest_evtlog_cleanup);
+    ga_command_state_add(cs, NULL, ga_collect_services_cleanup);
+    ga_command_state_add(cs, NULL, ga_collect_packages_cleanup);
 }
 
 /*Password*/
 /*########################################################################################################*/
+/* the account whose password is changed, converted once */
+static wchar_t *guest_password_user;
+
 struct ErrNO *qmp_change_password(const char *new_password, Error **errp)
 {
     struct ErrNO *err1 = g_new0(struct ErrNO, 1);
     NET_API_STATUS nas;
     char rawpasswddata[512] = {0};
-    wchar_t *user, *wpass;
+    wchar_t *wpass;
     USER_INFO_1003 pi1003 = { 0, };
-    char user_input[36] = "administrator";
 
     strncpy(rawpasswddata, new_password, 511);
     rawpasswddata[511] = '\0';
 
-    user = g_utf8_to_utf16(user_input, -1, NULL, NULL, NULL);
+    if (!guest_password_user) {
+        guest_password_user = g_utf8_to_utf16("administrator", -1, NULL, NULL,
+                                              NULL);
+    }
     wpass = g_utf8_to_utf16(rawpasswddata, -1, NULL, NULL, NULL);
+    SecureZeroMemory(rawpasswddata, sizeof(rawpasswddata));
 
     pi1003.usri1003_password = wpass;
-    nas = NetUserSetInfo(NULL, user,
+    nas = NetUserSetInfo(NULL, guest_password_user,
                          1003, (LPBYTE)&pi1003,
                          NULL);
 
@@ -1406,13 +2106,19 @@ struct ErrNO *qmp_change_password(const char *new_password, Error **errp)
         error_setg(errp, "failed to set password: %s", msg);
         g_free(msg);
         err1->errnum = -1;
+    } else {
+        err1->errnum = 0;
     }
 
-    g_free(user);
+    SecureZeroMemory(wpass, wcslen(wpass) * sizeof(*wpass));
     g_free(wpass);
-    err1->errnum = 0;
-	return err1;
+    return err1;
+}
 
+static void guest_password_cleanup(void)
+{
+    g_free(guest_password_user);
+    guest_password_user = NULL;
 }
 /*########################################################################################################*/
 /*Hostname*/
@@ -1421,15 +2127,21 @@ struct ErrNO *qmp_change_hostname(const char *new_hostname, Error **errp)
 {
 	struct ErrNO *err1 = g_new0(struct ErrNO, 1);
 	int ret = 0;
-	wchar_t *whostname = NULL;
+	wchar_t whostname[NETBIOS_HOST_NAME_MAX_LEN + 1];
 	char hostname[NETBIOS_HOST_NAME_MAX_LEN + 1] = {0};
 	int rename_errno = 0;
 
 	strncpy(hostname, new_hostname, NETBIOS_HOST_NAME_MAX_LEN);
 	hostname[NETBIOS_HOST_NAME_MAX_LEN] = '\0';
 
-	whostname = g_utf8_to_utf16(hostname, -1, NULL, NULL, NULL);
-	ret = SetComputerNameExW(5, whostname);
+	/* the name is short, convert it on the stack */
+	if (!MultiByteToWideChar(CP_UTF8, 0, hostname, -1, whostname,
+	                         G_N_ELEMENTS(whostname))) {
+		g_debug("error converting hostname %lu", GetLastError());
+		err1->errnum = -1;
+		return err1;
+	}
+	ret = SetComputerNameExW(ComputerNamePhysicalDnsHostname, whostname);
 
 	if (ret == 0)
 	{
@@ -1443,146 +2155,278 @@ struct ErrNO *qmp_change_hostname(const char *new_hostname, Error **errp)
 		err1->errnum = 0;
 	}
 
-	g_free(whostname);
-
 	return err1;
 }
 
 /*APPStatus*/
 /*########################################################################################################*/
-char* _get_app_status(DWORD process_id)
-{
-	TCHAR sz_process_name[1024] = {0};
-	char *info = g_malloc0(10240);
-	char *process_name = NULL;
-	int pointer = 0;
-	//process name
-	HMODULE h_mod;
-	DWORD cb_needed;
-	//memery
-	PROCESS_MEMORY_COUNTERS pmc;
-
-	HANDLE h_process = OpenProcess(PROCESS_QUERY_INFORMATION|
-	                                       PROCESS_VM_READ,
-	                                       FALSE, process_id);
-
-	if (NULL == h_process)
-	{
-		g_debug("OpenProcess error %d", (int)GetLastError());
-		goto APP_ERR3;
-	}
+/*
+ * SYSTEM_PROCESS_INFORMATION as returned by NtQuerySystemInformation();
+ * winternl.h leaves most of the members we need undocumented.
+ */
+typedef struct GuestNtProcessInfo {
+    ULONG NextEntryOffset;
+    ULONG NumberOfThreads;
+    LARGE_INTEGER WorkingSetPrivateSize;
+    ULONG HardFaultCount;
+    ULONG NumberOfThreadsHighWatermark;
+    ULONGLONG CycleTime;
+    LARGE_INTEGER CreateTime;
+    LARGE_INTEGER UserTime;
+    LARGE_INTEGER KernelTime;
+    struct {
+        USHORT Length;
+        USHORT MaximumLength;
+        PWSTR Buffer;
+    } ImageName;
+    LONG BasePriority;
+    HANDLE UniqueProcessId;
+    HANDLE InheritedFromUniqueProcessId;
+    ULONG HandleCount;
+    ULONG SessionId;
+    ULONG_PTR UniqueProcessKey;
+    SIZE_T PeakVirtualSize;
+    SIZE_T VirtualSize;
+    ULONG PageFaultCount;
+    SIZE_T PeakWorkingSetSize;
+    SIZE_T WorkingSetSize;
+    SIZE_T QuotaPeakPagedPoolUsage;
+    SIZE_T QuotaPagedPoolUsage;
+    SIZE_T QuotaPeakNonPagedPoolUsage;
+    SIZE_T QuotaNonPagedPoolUsage;
+    SIZE_T PagefileUsage;
+    SIZE_T PeakPagefileUsage;
+    SIZE_T PrivatePageCount;
+} GuestNtProcessInfo;
+
+#define NT_SYSTEM_PROCESS_INFORMATION 5
+
+typedef struct GuestProcSample {
+    uint64_t create_time;
+    uint64_t utime;             /* 100ns units */
+    uint64_t stime;             /* 100ns units */
+    unsigned int generation;
+} GuestProcSample;
+
+/* per-pid CPU times of the previous snapshot, used to compute the deltas */
+static struct {
+    GHashTable *samples;
+    unsigned int generation;
+    ULONG snapshot_size;
+} guest_proc_state;
 
-	if ( EnumProcessModules(h_process, &h_mod, sizeof(h_mod),
-			 &cb_needed) == 0)
-	{
-		g_debug("EnumProcessModules error %d", (int)GetLastError());
-		goto APP_ERR2;
-	}
+static void ga_collect_error(Error **errp, GError *gerr)
+{
+    error_setg(errp, "%s", gerr->message);
+    g_error_free(gerr);
+}
 
-	if (GetModuleBaseNameW(h_process, h_mod, sz_process_name,
-					   sizeof(sz_process_name)/sizeof(TCHAR)) == 0)
-	{
-		g_debug("GetModuleBaseNameW error %d", (int)GetLastError());
-		goto APP_ERR1;
-	}
+static void *ga_nt_query_system_information(ULONG info_class,
+                                            ULONG *size_hint, Error **errp)
+{
+    GError *gerr = NULL;
+    void *buf;
 
-	process_name = g_utf16_to_utf8(sz_process_name, -1, NULL, NULL, NULL);
+    buf = ga_collect_nt_query(info_class, size_hint, &gerr);
+    if (!buf) {
+        ga_collect_error(errp, gerr);
+    }
+    return buf;
+}
 
-	if ( GetProcessMemoryInfo(h_process, &pmc, sizeof(pmc)) == 0)
-	{
-		g_debug("GetProcessMemoryInfo error %d", (int)GetLastError());
-		goto APP_ERR0;
-	}
+static gboolean guest_proc_sample_expired(gpointer key, gpointer value,
+                                          gpointer opaque)
+{
+    GuestProcSample *sample = value;
+
+    return sample->generation != GPOINTER_TO_UINT(opaque);
+}
+
+/*
+ * Convert a snapshot into a GuestProcessInfo array.  CPU time deltas are
+ * computed against the samples kept from the previous snapshot, which are
+ * then replaced by the current ones.  @legacy, if not NULL, receives the
+ * old guest-get-app-status rendering of the snapshot.
+ */
+static GPtrArray *guest_proc_scan(GString *legacy, Error **errp)
+{
+    GuestNtProcessInfo *snapshot, *p;
+    GuestProcessInfo *info;
+    GuestProcSample cur, *prev;
+    GPtrArray *procs;
+    bool first;
+
+    /* all processes, with a single system call */
+    snapshot = ga_nt_query_system_information(NT_SYSTEM_PROCESS_INFORMATION,
+                                              &guest_proc_state.snapshot_size,
+                                              errp);
+    if (!snapshot) {
+        return NULL;
+    }
 
-	sprintf(info, "%s pid:%d mem:%zdKB vmem:%zdKB", process_name,
-			process_id, pmc.WorkingSetSize/1024, pmc.PagefileUsage/1024);
+    if (!guest_proc_state.samples) {
+        guest_proc_state.samples = g_hash_table_new_full(g_direct_hash,
+                                                         g_direct_equal,
+                                                         NULL, g_free);
+    }
+    first = guest_proc_state.generation == 0;
+    guest_proc_state.generation++;
 
-	goto APP_OK;
+    procs = g_ptr_array_new_with_free_func(
+        (GDestroyNotify)qapi_free_GuestProcessInfo);
 
-APP_OK:
-	CloseHandle(h_process);
-	g_free(process_name);
-	return info;
+    for (p = snapshot; ;
+         p = (GuestNtProcessInfo *)((char *)p + p->NextEntryOffset)) {
+        /* skip the System Idle Process */
+        if (p->UniqueProcessId) {
+            info = g_new0(GuestProcessInfo, 1);
+            info->pid = (uintptr_t)p->UniqueProcessId;
+            if (p->ImageName.Buffer) {
+                info->comm = g_utf16_to_utf8(p->ImageName.Buffer,
+                                             p->ImageName.Length / 2,
+                                             NULL, NULL, NULL);
+            }
+            if (!info->comm) {
+                info->comm = g_strdup("");
+            }
+            info->rss = p->WorkingSetSize;
+            info->threads = p->NumberOfThreads;
+
+            cur.create_time = p->CreateTime.QuadPart;
+            cur.utime = p->UserTime.QuadPart;
+            cur.stime = p->KernelTime.QuadPart;
+            info->utime = cur.utime / 10000;
+            info->stime = cur.stime / 10000;
+
+            prev = g_hash_table_lookup(guest_proc_state.samples,
+                                       GINT_TO_POINTER(info->pid));
+            if (!first) {
+                /* a new or recycled pid consumed all its CPU time since */
+                bool known = prev && prev->create_time == cur.create_time;
+
+                info->has_utime_delta = true;
+                info->utime_delta = (cur.utime -
+                                     (known ? prev->utime : 0)) / 10000;
+                info->has_stime_delta = true;
+                info->stime_delta = (cur.stime -
+                                     (known ? prev->stime : 0)) / 10000;
+            }
+            if (!prev) {
+                prev = g_new0(GuestProcSample, 1);
+                g_hash_table_insert(guest_proc_state.samples,
+                                    GINT_TO_POINTER(info->pid), prev);
+            }
+            *prev = cur;
+            prev->generation = guest_proc_state.generation;
+
+            if (legacy) {
+                g_string_append_printf(legacy, "%s pid:%" PRId64 " mem:%"
+                                       PRIu64 "KB vmem:%" PRIu64 "KB ",
+                                       info->comm, info->pid,
+                                       (uint64_t)p->WorkingSetSize / 1024,
+                                       (uint64_t)p->PagefileUsage / 1024);
+            }
+            g_ptr_array_add(procs, info);
+        }
+        if (!p->NextEntryOffset) {
+            break;
+        }
+    }
+    g_free(snapshot);
 
-APP_ERR0:
-APP_ERR1:
-APP_ERR2:
-	CloseHandle(h_process);
-APP_ERR3:
-	g_free(info);
-	return NULL;
+    g_hash_table_foreach_remove(guest_proc_state.samples,
+                                guest_proc_sample_expired,
+                                GUINT_TO_POINTER(guest_proc_state.generation));
+    return procs;
 }
 
-struct APPStatus *qmp_guest_get_app_status(Error **errp)
+static uint64_t guest_proc_cpu(const GuestProcessInfo *info)
 {
+    if (info->has_utime_delta) {
+        return info->utime_delta + info->stime_delta;
+    }
+    return info->utime + info->stime;
+}
 
-    // Get a handle to the process.
-    APPStatus *status = g_new0(struct APPStatus, 1);
-    char *process_name = NULL;
-    char * app_info = g_malloc0(102400);
-    char * error1 = g_malloc0(10);
-    char * error2 = g_malloc0(10);
-    DWORD aProcesses[1024], cbNeeded, cProcesses;
-    unsigned int i;
-    int pointer = 0;
-    int len = 0;
+static gint guest_proc_cmp_cpu(gconstpointer a, gconstpointer b)
+{
+    uint64_t ca = guest_proc_cpu(*(GuestProcessInfo * const *)a);
+    uint64_t cb = guest_proc_cpu(*(GuestProcessInfo * const *)b);
 
-    strncpy(error1, "error1", sizeof("error1"));
-    strncpy(error2, "error2", sizeof("error2"));
-    if (!EnumProcesses(aProcesses, sizeof(aProcesses), &cbNeeded))
-    {
-        g_debug("EnumProcesses error %d", (int)GetLastError());
-        g_free(error2);
-        status->appStatus = error1;
-        goto STATUS_ERR3;
-    }
-    // Calculate how many process identifiers were returned.
-    cProcesses = cbNeeded / sizeof(DWORD);
-    if (cProcesses > 1024)
-    {
-        g_debug("process entries are too large");
-        status->appStatus = error2;
-        g_free(error1);
-        goto STATUS_ERR2;
+    return ca < cb ? 1 : ca > cb ? -1 : 0;
+}
+
+static gint guest_proc_cmp_rss(gconstpointer a, gconstpointer b)
+{
+    uint64_t ra = (*(GuestProcessInfo * const *)a)->rss;
+    uint64_t rb = (*(GuestProcessInfo * const *)b)->rss;
+
+    return ra < rb ? 1 : ra > rb ? -1 : 0;
+}
+
+static void guest_proc_cleanup(void)
+{
+    if (guest_proc_state.samples) {
+        g_hash_table_destroy(guest_proc_state.samples);
+        guest_proc_state.samples = NULL;
     }
-    // Print the name and process identifier for each process.
-    for ( i = 0; i < cProcesses; i++ )
-    {
-        if( aProcesses[i] != 0 )
-        {
-            process_name = _get_app_status(aProcesses[i]);
-            if (process_name == NULL)
-            {
-                continue;
-            }
-            else
-            {
-                len = strlen(process_name);
-                strncpy((app_info + pointer), process_name, len);
-                g_free(process_name);
-                pointer += len;
-                *(app_info + pointer) = ' ';
-                pointer += 1;
-            }
-        }
+}
+
+GuestProcessInfoList *qmp_guest_get_processes(bool has_sort,
+                                              GuestProcessSortKey sort,
+                                              bool has_limit, int64_t limit,
+                                              Error **errp)
+{
+    GuestProcessInfoList *head = NULL, **link = &head, *entry;
+    GPtrArray *procs;
+    guint i;
+
+    if (has_limit && limit < 0) {
+        error_setg(errp, "value '%" PRId64 "' is invalid for argument limit",
+                   limit);
+        return NULL;
     }
 
-    status->appStatus = app_info;
-    goto STATUS_OK;
+    procs = guest_proc_scan(NULL, errp);
+    if (!procs) {
+        return NULL;
+    }
+
+    if (has_sort || has_limit) {
+        g_ptr_array_sort(procs, has_sort && sort == GUEST_PROCESS_SORT_KEY_RSS ?
+                         guest_proc_cmp_rss : guest_proc_cmp_cpu);
+    }
 
-STATUS_OK:
-	g_free(error1);
-	g_free(error2);
-	return status;
+    for (i = 0; i < procs->len && (!has_limit || i < limit); i++) {
+        entry = g_new0(GuestProcessInfoList, 1);
+        entry->value = g_ptr_array_index(procs, i);
+        g_ptr_array_index(procs, i) = NULL;
+
+        *link = entry;
+        link = &entry->next;
+    }
 
-STATUS_ERR0:
+    g_ptr_array_free(procs, TRUE);
+    return head;
+}
 
-STATUS_ERR1:
+struct APPStatus *qmp_guest_get_app_status(Error **errp)
+{
+    APPStatus *status;
+    GPtrArray *procs;
+    GString *text;
+
+    text = g_string_new("");
+    procs = guest_proc_scan(text, errp);
+    if (!procs) {
+        g_string_free(text, true);
+        return NULL;
+    }
+    g_ptr_array_free(procs, TRUE);
 
-STATUS_ERR2:
-STATUS_ERR3:
-	g_free(app_info);
-	return status;
+    status = g_new0(APPStatus, 1);
+    status->appStatus = g_string_free(text, false);
+    return status;
 }
 /*########################################################################################################*/
 
@@ -1590,21 +2434,44 @@ STATUS_ERR3:
 /*########################################################################################################*/
 GuestMemoryStatus *qmp_guest_get_memory_status(Error **errp)
 {
-    int used, available, total;
-    MEMORYSTATUS s;
-
-    SwapInfo *info = g_new0(SwapInfo, 1);
-    GuestMemoryStatus *status = g_new0(GuestMemoryStatus, 1);
-    GlobalMemoryStatus(&s);
-    total = (int)(s.dwTotalPhys/1048576);
-    used = (int)(s.dwMemoryLoad/100.0*s.dwTotalPhys/1048576);
-    status->total = total;
-    status->used = used;
+    GuestMemoryStatus *status;
+    SwapInfo *swap;
+    GuestMeminfo mi;
+    GError *gerr = NULL;
+    uint64_t total, avail, cached, swap_total, swap_free;
+
+    if (!ga_collect_memory(&mi, &gerr)) {
+        ga_collect_error(errp, gerr);
+        return NULL;
+    }
+    total = mi.value[MEMINFO_MEM_TOTAL];
+    avail = mi.value[MEMINFO_MEM_AVAILABLE];
+    cached = mi.value[MEMINFO_CACHED];
+    swap_total = mi.value[MEMINFO_SWAP_TOTAL];
+    swap_free = mi.value[MEMINFO_SWAP_FREE];
+
+    swap = g_new0(SwapInfo, 1);
+    swap->total = swap_total >> 20;
+    swap->used = (swap_total - swap_free) >> 20;
+    swap->has_total_bytes = true;
+    swap->total_bytes = swap_total;
+    swap->has_free_bytes = true;
+    swap->free_bytes = swap_free;
+
+    /* the legacy members are in MiB */
+    status = g_new0(GuestMemoryStatus, 1);
+    status->total = total >> 20;
+    status->used = (total - avail) >> 20;
     status->buffer = 0;
-    status->cached = 0;
-    info->total = 0;
-    info->used = 0;
-    status->swap = info;
+    status->cached = cached >> 20;
+    status->swap = swap;
+
+    status->has_total_bytes = true;
+    status->total_bytes = total;
+    status->has_available_bytes = true;
+    status->available_bytes = avail;
+    status->has_cached_bytes = true;
+    status->cached_bytes = cached;
 
     return status;
 }
@@ -1614,177 +2481,1336 @@ GuestMemoryStatus *qmp_guest_get_memory_status(Error **errp)
 /*########################################################################################################*/
 GuestSystemInfo *qmp_guest_get_system_info(Error **errp)
 {
-    DWORD  bufCharCount = 32767;
-    char infoBuf[32767]="";
+    GuestSystemInfo *info = g_new0(GuestSystemInfo, 1);
+    GACollectSystem si = { NULL };
 
-    GuestSystemInfo *info = g_malloc0(sizeof(GuestSystemInfo));
+    ga_collect_system(&si);
+    info->os_name = si.os_name;
+    info->kernel_version = si.kernel_version;
+    info->system_version = si.system_version;
+    info->fqdn = si.fqdn;
+    info->lastlogin = si.lastlogin;
+    g_free(si.pretty_name);
 
-    DWORD dwVersion = 0;
-    DWORD dwMajorVersion = 0;
-    DWORD dwMinorVersion = 0;
-    DWORD dwBuild = 0;
+    return info;
+}
+/*########################################################################################################*/
 
-    char majorver[50];
-    char minorver[50];
-    char build[100];
-    char system_ver[200];
+/*DiskStatus*/
+/*########################################################################################################*/
+/* the legacy members are gigabytes with at most two decimals, e.g. "49.5G" */
+struct GuestDiskStatusList *qmp_guest_get_disk_status(Error **errp)
+{
+    GuestDiskStatusList *head = NULL, **link = &head, *entry;
+    GuestDiskStatus *status;
+    MountInfo *info;
+    GACollectFsForecast fc;
+    GACollectDisk *disk;
+    GPtrArray *disks;
+    GError *gerr = NULL;
+    guint i;
+
+    disks = ga_collect_disks(&gerr);
+    if (!disks) {
+        ga_collect_error(errp, gerr);
+        return NULL;
+    }
 
-    dwVersion = GetVersion();
+    for (i = 0; i < disks->len; i++) {
+        disk = g_ptr_array_index(disks, i);
+
+        info = g_new0(MountInfo, 1);
+        info->total = ga_collect_size_gb(disk->total);
+        info->used = ga_collect_size_gb(disk->total - disk->avail);
+        info->writable = disk->writable;
+        info->has_total_bytes = true;
+        info->total_bytes = disk->total;
+        info->has_used_bytes = true;
+        info->used_bytes = disk->used;
+        info->has_avail_bytes = true;
+        info->avail_bytes = disk->avail;
+        if (ga_collect_fs_forecast(disk->mount, &fc)) {
+            info->has_fill_rate = true;
+            info->fill_rate = fc.fill_rate;
+            info->has_time_to_full = fc.has_time_to_full;
+            info->time_to_full = fc.time_to_full;
+        }
 
-    itoa(LOBYTE(LOWORD(dwVersion)), majorver, 10);
-    itoa(HIBYTE(LOWORD(dwVersion)), minorver, 10);
-    itoa(HIWORD(dwVersion), build, 10);
-    g_debug("majorver:%s\n", majorver);
-    strcpy(system_ver, majorver);
-    g_debug("system_ver:%s\n", system_ver);
-    strcat(system_ver, ".");
-    strcat(system_ver, minorver);
-    strcat(system_ver, " (");
-    strcat(system_ver, build);
-    strcat(system_ver, ")");
+        status = g_new0(GuestDiskStatus, 1);
+        status->mount_place = g_strdup(disk->mount);
+        status->mount_info = info;
 
-    GetComputerNameW(infoBuf, &bufCharCount);
-    char * name = g_utf16_to_utf8(infoBuf, -1, NULL, NULL, NULL);
-    info->os_name = g_strdup(name);
+        entry = g_new0(GuestDiskStatusList, 1);
+        entry->value = status;
 
-    g_free(name);
+        *link = entry;
+        link = &entry->next;
+    }
+    g_ptr_array_free(disks, true);
 
-    info->kernel_version = g_strdup("");
-    info->system_version = g_strdup(system_ver);
-    info->fqdn = g_strdup("");
-    info->lastlogin = g_strdup("");
-    return info;
+    return head;
 }
 /*########################################################################################################*/
 
-/*DiskStatus*/
+/*PerfStats*/
 /*########################################################################################################*/
-struct GuestDiskStatusList *qmp_guest_get_disk_status(Error **errp)
+/*
+ * CPU, disk and network statistics from the performance counters.  Each
+ * group keeps one PDH query open with its counters added on first use, so
+ * a call only costs a PdhCollectQueryData().  The raw counter values are
+ * read rather than the formatted ones: they are the cumulative times and
+ * counts since boot, from which the rates over the time since the previous
+ * call are computed the same way as from /proc on Linux.
+ */
+typedef PDH_STATUS (WINAPI *PdhAddEnglishCounterWFunc)(PDH_HQUERY, LPCWSTR,
+                                                       DWORD_PTR,
+                                                       PDH_HCOUNTER *);
+
+#define GUEST_PERF_MAX_COUNTERS 8
+
+typedef struct GuestPerfQuery {
+    const char *what;
+    const WCHAR *paths[GUEST_PERF_MAX_COUNTERS];
+    PDH_HQUERY query;
+    PDH_HCOUNTER counters[GUEST_PERF_MAX_COUNTERS];
+    int ncounters;
+    /* raw values of every counter, one array per counter */
+    PDH_RAW_COUNTER_ITEM_W *items[GUEST_PERF_MAX_COUNTERS];
+    DWORD nitems[GUEST_PERF_MAX_COUNTERS];
+    DWORD size[GUEST_PERF_MAX_COUNTERS];
+} GuestPerfQuery;
+
+enum {
+    PERF_CPU_USER, PERF_CPU_PRIVILEGED, PERF_CPU_IDLE, PERF_CPU_INTERRUPT,
+    PERF_CPU_DPC,
+};
+
+static GuestPerfQuery guest_perf_cpu = {
+    .what = "processor",
+    .paths = {
+        L"\\Processor(*)\\% User Time",
+        L"\\Processor(*)\\% Privileged Time",
+        L"\\Processor(*)\\% Idle Time",
+        L"\\Processor(*)\\% Interrupt Time",
+        L"\\Processor(*)\\% DPC Time",
+    },
+};
+
+enum {
+    PERF_DISK_RD_IOS, PERF_DISK_WR_IOS, PERF_DISK_RD_BYTES, PERF_DISK_WR_BYTES,
+    PERF_DISK_RD_TIME, PERF_DISK_WR_TIME, PERF_DISK_IDLE_TIME,
+};
+
+static GuestPerfQuery guest_perf_disk = {
+    .what = "physical disk",
+    .paths = {
+        L"\\PhysicalDisk(*)\\Disk Reads/sec",
+        L"\\PhysicalDisk(*)\\Disk Writes/sec",
+        L"\\PhysicalDisk(*)\\Disk Read Bytes/sec",
+        L"\\PhysicalDisk(*)\\Disk Write Bytes/sec",
+        L"\\PhysicalDisk(*)\\% Disk Read Time",
+        L"\\PhysicalDisk(*)\\% Disk Write Time",
+        L"\\PhysicalDisk(*)\\% Idle Time",
+    },
+};
+
+/* Vista and later read the interface table instead, see below */
+#if (_WIN32_WINNT < 0x0600)
+enum {
+    PERF_NET_RX_BYTES, PERF_NET_RX_PACKETS, PERF_NET_RX_ERRS,
+    PERF_NET_RX_DROPPED, PERF_NET_TX_BYTES, PERF_NET_TX_PACKETS,
+    PERF_NET_TX_ERRS, PERF_NET_TX_DROPPED,
+};
+
+static GuestPerfQuery guest_perf_net = {
+    .what = "network interface",
+    .paths = {
+        L"\\Network Interface(*)\\Bytes Received/sec",
+        L"\\Network Interface(*)\\Packets Received/sec",
+        L"\\Network Interface(*)\\Packets Received Errors",
+        L"\\Network Interface(*)\\Packets Received Discarded",
+        L"\\Network Interface(*)\\Bytes Sent/sec",
+        L"\\Network Interface(*)\\Packets Sent/sec",
+        L"\\Network Interface(*)\\Packets Outbound Errors",
+        L"\\Network Interface(*)\\Packets Outbound Discarded",
+    },
+};
+#endif
+
+/*
+ * Counter names are localized, PdhAddEnglishCounterW() (Vista and later)
+ * takes the English ones whatever the language of the guest.
+ */
+static PDH_STATUS guest_perf_add_counter(PDH_HQUERY query, const WCHAR *path,
+                                         PDH_HCOUNTER *counter)
+{
+    static PdhAddEnglishCounterWFunc add_english;
+    static bool looked_up;
+
+    if (!looked_up) {
+        add_english = (PdhAddEnglishCounterWFunc)GetProcAddress(
+            GetModuleHandleA("pdh.dll"), "PdhAddEnglishCounterW");
+        looked_up = true;
+    }
+    if (add_english) {
+        return add_english(query, path, 0, counter);
+    }
+    return PdhAddCounterW(query, path, 0, counter);
+}
+
+static void guest_perf_close(GuestPerfQuery *pq)
+{
+    int i;
+
+    if (pq->query) {
+        PdhCloseQuery(pq->query);
+        pq->query = NULL;
+    }
+    for (i = 0; i < pq->ncounters; i++) {
+        g_free(pq->items[i]);
+        pq->items[i] = NULL;
+        pq->nitems[i] = 0;
+        pq->size[i] = 0;
+    }
+    pq->ncounters = 0;
+}
+
+static bool guest_perf_open(GuestPerfQuery *pq, Error **errp)
 {
-    int DiskCount = 0;
-    int DSLength = GetLogicalDriveStrings(0,NULL);
-    char* DStr = g_malloc0(DSLength);
-    int i = 0;
-    int si = 0;
-    BOOL fResult;
-    unsigned __int64 i64FreeBytesToCaller;
-    unsigned __int64 i64TotalBytes;
-    unsigned __int64 i64FreeBytes;
-
-    DWORD DiskInfo = GetLogicalDrives();
-
-    GuestDiskStatusList *head, **link;
-    head = NULL;
-    link = &head;
-    GuestDiskStatus *status = NULL;
-    GuestDiskStatusList *entry = NULL;
-
-    while(DiskInfo){
-        if(DiskInfo&1){
-            ++DiskCount;
-        }
-        DiskInfo = DiskInfo >> 1;
-    }
-
-    GetLogicalDriveStrings(DSLength,(LPTSTR)DStr);
-
-    while(i<DSLength/4){
-
-        char mountplace[10] = {DStr[si]};
-
-        strcat(mountplace, ":");
-        strcat(mountplace, "\\");
-        char dir[3]={DStr[si],':','\\'};
-        fResult = GetDiskFreeSpaceEx (dir,
-                                      (PULARGE_INTEGER)&i64FreeBytesToCaller,
-                                      (PULARGE_INTEGER)&i64TotalBytes,
-                                      (PULARGE_INTEGER)&i64FreeBytes);
-        if(fResult){
-            status = g_malloc0(sizeof *status);
-            MountInfo *info = g_malloc0(sizeof(MountInfo));
-            float totalspace = (float)i64TotalBytes/1073741824;
-            float freespace = (float)i64FreeBytesToCaller/1073741824;
-            float usedspace = totalspace - freespace;
-
-            g_debug("totalspace: %f\n", totalspace);
-            g_debug("freespace: %f\n", freespace);
-            g_debug("usedspace: %f\n", usedspace);
-
-            char *str = g_malloc0(25*sizeof(char));
-            char *p = NULL;
-            char *before = NULL;
-            char *after = NULL;
-            char *after_cut = g_malloc0(1);
-
-            if(totalspace < 0.1){
-                info->total = g_strdup("0");
-                info->used = g_strdup("0");
-                info->writable = true;
+    PDH_STATUS status;
+    int i;
+
+    if (pq->query) {
+        return true;
+    }
+    status = PdhOpenQueryW(NULL, 0, &pq->query);
+    if (status != ERROR_SUCCESS) {
+        error_setg(errp, "failed to open %s performance query: 0x%lx",
+                   pq->what, (unsigned long)status);
+        pq->query = NULL;
+        return false;
+    }
+    for (i = 0; i < GUEST_PERF_MAX_COUNTERS && pq->paths[i]; i++) {
+        status = guest_perf_add_counter(pq->query, pq->paths[i],
+                                        &pq->counters[i]);
+        if (status != ERROR_SUCCESS) {
+            error_setg(errp, "failed to add %s performance counter: 0x%lx",
+                       pq->what, (unsigned long)status);
+            guest_perf_close(pq);
+            return false;
+        }
+        pq->ncounters++;
+    }
+    return true;
+}
+
+/* sample every counter of @pq and fetch the raw values of all instances */
+static bool guest_perf_collect(GuestPerfQuery *pq, Error **errp)
+{
+    PDH_STATUS status;
+    DWORD size;
+    int i;
+
+    if (!guest_perf_open(pq, errp)) {
+        return false;
+    }
+    status = PdhCollectQueryData(pq->query);
+    if (status != ERROR_SUCCESS) {
+        error_setg(errp, "failed to collect %s performance data: 0x%lx",
+                   pq->what, (unsigned long)status);
+        return false;
+    }
+
+    for (i = 0; i < pq->ncounters; i++) {
+        /* the buffers are kept and only grow when instances are added */
+        for (;;) {
+            size = pq->size[i];
+            status = PdhGetRawCounterArrayW(pq->counters[i], &size,
+                                            &pq->nitems[i], pq->items[i]);
+            if (status != PDH_MORE_DATA) {
+                break;
             }
-            else{
-                gcvt(totalspace, 25, str);
-                before=strtok(str,".");
-
-                g_debug("before: %s\n", before);
-
-                if(before){
-                    after=strtok(NULL,".");
-
-                    g_debug("after: %s\n", after);
-
-                    if(after){
-                        strncpy(after_cut, after, 2);
-
-                        g_debug("after_cut: %s\n", after_cut);
-
-                    }
-                }
-
-                strcpy(str, before);
-                strcat(str, ".");
-                strcat(str, after_cut);
-                strcat(str, "G");
-
-                g_debug("total: %s\n", str);
-
-                info->total = g_strdup(str);
-                if(usedspace < 0.1){
-                    info->used = g_strdup("0");
-                    g_debug("used: %s\n", str);
-                }
-                else{
-                    gcvt(usedspace, 25, str);
-                    before=strtok(str,".");
-                    if(before){
-                        after=strtok(NULL,".");
-                        strncpy(after_cut, after, 2);
-                    }
-                    strcpy(str, before);
-                    strcat(str, ".");
-                    strcat(str, after_cut);
-                    strcat(str, "G");
-                    info->used = g_strdup(str);
-                    g_debug("used: %s\n", str);
-                }
-                info->writable = true;
+            g_free(pq->items[i]);
+            pq->size[i] = size + size / 4;
+            pq->items[i] = g_malloc(pq->size[i]);
+        }
+        if (status == PDH_CSTATUS_NO_INSTANCE ||
+            status == PDH_NO_DATA) {
+            pq->nitems[i] = 0;
+        } else if (status != ERROR_SUCCESS) {
+            error_setg(errp, "failed to read %s performance data: 0x%lx",
+                       pq->what, (unsigned long)status);
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * The raw value of counter @counter for the instance the first counter
+ * lists at @index.  Every counter of a query normally lists the same
+ * instances in the same order; the name is looked up if it does not.
+ */
+static uint64_t guest_perf_value(GuestPerfQuery *pq, int counter,
+                                 DWORD index)
+{
+    const WCHAR *name = pq->items[0][index].szName;
+    PDH_RAW_COUNTER_ITEM_W *items = pq->items[counter];
+    DWORD i;
+
+    if (index < pq->nitems[counter] && !wcscmp(items[index].szName, name)) {
+        return items[index].RawValue.FirstValue;
+    }
+    for (i = 0; i < pq->nitems[counter]; i++) {
+        if (!wcscmp(items[i].szName, name)) {
+            return items[i].RawValue.FirstValue;
+        }
+    }
+    return 0;
+}
+
+/* @cur minus @prev per second of @elapsed_us; counters may wrap */
+static double guest_counter_rate(uint64_t cur, uint64_t prev,
+                                 int64_t elapsed_us)
+{
+    return cur > prev ? (cur - prev) * 1e6 / elapsed_us : 0;
+}
+
+static uint64_t guest_perf_uptime_ms(void)
+{
+#if (_WIN32_WINNT >= 0x0600)
+    return GetTickCount64();
+#else
+    return GetTickCount();
+#endif
+}
+
+/* CPU */
+
+enum {
+    CPUSTAT_USER, CPUSTAT_SYSTEM, CPUSTAT_IDLE, CPUSTAT_IRQ, CPUSTAT_SOFTIRQ,
+    CPUSTAT_MAX
+};
+
+/* 100ns units */
+typedef struct GuestCpuTicks {
+    bool valid;
+    uint64_t t[CPUSTAT_MAX];
+} GuestCpuTicks;
+
+/*
+ * What the previous guest-get-cpu-stats call saw.  @cpus is indexed by
+ * CPU number and grows if CPUs are added.
+ */
+static struct {
+    int64_t time;               /* g_get_monotonic_time() */
+    GuestCpuTicks total;
+    GuestCpuTicks *cpus;
+    int ncpus;
+} guest_cpustat_state;
+
+/* what each time column took of the time between @prev and @cur */
+static GuestCpuUsage *guest_cpustat_usage(const GuestCpuTicks *prev,
+                                          const GuestCpuTicks *cur)
+{
+    GuestCpuUsage *usage = g_new0(GuestCpuUsage, 1);
+    double d[CPUSTAT_MAX], total = 0;
+    uint64_t before;
+    int i;
+
+    for (i = 0; i < CPUSTAT_MAX; i++) {
+        before = prev->valid ? prev->t[i] : 0;
+        d[i] = cur->t[i] > before ? cur->t[i] - before : 0;
+        total += d[i];
+    }
+    if (total > 0) {
+        for (i = 0; i < CPUSTAT_MAX; i++) {
+            d[i] = d[i] * 100 / total;
+        }
+    }
+
+    usage->user = d[CPUSTAT_USER];
+    usage->system = d[CPUSTAT_SYSTEM];
+    usage->idle = d[CPUSTAT_IDLE];
+    usage->irq = d[CPUSTAT_IRQ];
+    usage->softirq = d[CPUSTAT_SOFTIRQ];
+    return usage;
+}
+
+/*
+ * Privileged time includes the time spent on interrupts and DPCs, which
+ * are reported as irq and softirq like Linux does.
+ */
+static void guest_cpustat_ticks(GuestPerfQuery *pq, DWORD index,
+                                GuestCpuTicks *ticks)
+{
+    uint64_t privileged = guest_perf_value(pq, PERF_CPU_PRIVILEGED, index);
+    uint64_t irq = guest_perf_value(pq, PERF_CPU_INTERRUPT, index);
+    uint64_t softirq = guest_perf_value(pq, PERF_CPU_DPC, index);
+
+    ticks->valid = true;
+    ticks->t[CPUSTAT_USER] = guest_perf_value(pq, PERF_CPU_USER, index);
+    ticks->t[CPUSTAT_SYSTEM] = privileged > irq + softirq ?
+                               privileged - irq - softirq : 0;
+    ticks->t[CPUSTAT_IDLE] = guest_perf_value(pq, PERF_CPU_IDLE, index);
+    ticks->t[CPUSTAT_IRQ] = irq;
+    ticks->t[CPUSTAT_SOFTIRQ] = softirq;
+}
+
+GuestCpuStats *qmp_guest_get_cpu_stats(bool has_cgroups, bool cgroups,
+                                       Error **errp)
+{
+    GuestPerfQuery *pq = &guest_perf_cpu;
+    GuestCpuUsageList *head = NULL, **tail = &head, *entry;
+    GuestCpuStats *stats;
+    GuestCpuTicks cur, total = { .valid = false };
+    GuestCpuUsage *usage;
+    const WCHAR *name;
+    WCHAR *end;
+    int64_t now;
+    long cpu;
+    DWORD i;
+
+    if (!guest_perf_collect(pq, errp)) {
+        return NULL;
+    }
+    now = g_get_monotonic_time();
+
+    for (i = 0; i < pq->nitems[0]; i++) {
+        name = pq->items[0][i].szName;
+        if (!wcscmp(name, L"_Total")) {
+            guest_cpustat_ticks(pq, i, &total);
+            continue;
+        }
+        cpu = wcstol(name, &end, 10);
+        if (*end || cpu < 0) {
+            continue;
+        }
+        if (cpu >= guest_cpustat_state.ncpus) {
+            guest_cpustat_state.cpus = g_renew(GuestCpuTicks,
+                                               guest_cpustat_state.cpus,
+                                               cpu + 1);
+            memset(guest_cpustat_state.cpus + guest_cpustat_state.ncpus, 0,
+                   (cpu + 1 - guest_cpustat_state.ncpus) *
+                   sizeof(GuestCpuTicks));
+            guest_cpustat_state.ncpus = cpu + 1;
+        }
+
+        guest_cpustat_ticks(pq, i, &cur);
+        usage = guest_cpustat_usage(&guest_cpustat_state.cpus[cpu], &cur);
+        usage->has_cpu = true;
+        usage->cpu = cpu;
+        guest_cpustat_state.cpus[cpu] = cur;
+
+        entry = g_new0(GuestCpuUsageList, 1);
+        entry->value = usage;
+        *tail = entry;
+        tail = &entry->next;
+    }
+
+    stats = g_new0(GuestCpuStats, 1);
+    if (guest_cpustat_state.time) {
+        stats->has_interval = true;
+        stats->interval = (now - guest_cpustat_state.time) / 1000;
+    }
+    stats->total = guest_cpustat_usage(&guest_cpustat_state.total, &total);
+    stats->cpus = head;
+    guest_cpustat_state.total = total;
+    guest_cpustat_state.time = now;
+    return stats;
+}
+
+static void guest_cpustat_cleanup(void)
+{
+    guest_perf_close(&guest_perf_cpu);
+    g_free(guest_cpustat_state.cpus);
+    memset(&guest_cpustat_state, 0, sizeof(guest_cpustat_state));
+}
+
+/* Disks */
+
+enum {
+    DISKSTAT_RD_IOS, DISKSTAT_RD_BYTES, DISKSTAT_RD_TIME,
+    DISKSTAT_WR_IOS, DISKSTAT_WR_BYTES, DISKSTAT_WR_TIME,
+    DISKSTAT_IDLE_TIME, DISKSTAT_MAX
+};
+
+/* the previous values of a disk; the times are in 100ns units */
+typedef struct GuestDiskIOSnapshot {
+    int64_t time;               /* g_get_monotonic_time(), 0 if none yet */
+    uint64_t v[DISKSTAT_MAX];
+    GuestDiskAddressList *disk;
+    unsigned int generation;
+} GuestDiskIOSnapshot;
+
+static struct {
+    GHashTable *disks;          /* "PhysicalDriveN" -> GuestDiskIOSnapshot */
+    unsigned int generation;
+} guest_diskstat_state;
+
+static void guest_diskstat_snapshot_free(gpointer p)
+{
+    GuestDiskIOSnapshot *snap = p;
+
+    qapi_free_GuestDiskAddressList(snap->disk);
+    g_free(snap);
+}
+
+static GuestDiskAddressList *guest_disk_address_list_copy(
+    GuestDiskAddressList *list)
+{
+    GuestDiskAddressList *head = NULL, **tail = &head, *entry;
+    GuestDiskAddress *addr;
+
+    for (; list; list = list->next) {
+        addr = g_memdup(list->value, sizeof(*addr));
+        if (addr->pci_controller) {
+            addr->pci_controller = g_memdup(addr->pci_controller,
+                                            sizeof(GuestPCIAddress));
+        }
+        entry = g_new0(GuestDiskAddressList, 1);
+        entry->value = addr;
+        *tail = entry;
+        tail = &entry->next;
+    }
+    return head;
+}
+
+/* milliseconds spent per request completed between the two snapshots */
+static double guest_diskstat_await(uint64_t time, uint64_t prev_time,
+                                   uint64_t ios, uint64_t prev_ios)
+{
+    if (ios <= prev_ios || time <= prev_time) {
+        return 0;
+    }
+    return (double)(time - prev_time) / 10000 / (ios - prev_ios);
+}
+
+static GuestDiskIOStats *guest_diskstat_entry(const char *name,
+                                              GuestDiskIOSnapshot *snap,
+                                              const uint64_t *v, int64_t now)
+{
+    GuestDiskIOStats *stats = g_new0(GuestDiskIOStats, 1);
+    int64_t elapsed_us = now - snap->time;
+    uint64_t uptime_ms = guest_perf_uptime_ms();
+    uint64_t idle_ms = v[DISKSTAT_IDLE_TIME] / 10000;
+
+    stats->name = g_strdup(name);
+    stats->disk = guest_disk_address_list_copy(snap->disk);
+    stats->read_ios = v[DISKSTAT_RD_IOS];
+    stats->read_bytes = v[DISKSTAT_RD_BYTES];
+    stats->read_ms = v[DISKSTAT_RD_TIME] / 10000;
+    stats->write_ios = v[DISKSTAT_WR_IOS];
+    stats->write_bytes = v[DISKSTAT_WR_BYTES];
+    stats->write_ms = v[DISKSTAT_WR_TIME] / 10000;
+    /* there is no busy time counter, only idle time */
+    stats->io_ms = uptime_ms > idle_ms ? uptime_ms - idle_ms : 0;
+
+    if (snap->time && elapsed_us > 0) {
+        const uint64_t *p = snap->v;
+
+        stats->has_interval = true;
+        stats->interval = elapsed_us / 1000;
+        stats->has_read_iops = true;
+        stats->read_iops = guest_counter_rate(v[DISKSTAT_RD_IOS],
+                                              p[DISKSTAT_RD_IOS], elapsed_us);
+        stats->has_write_iops = true;
+        stats->write_iops = guest_counter_rate(v[DISKSTAT_WR_IOS],
+                                               p[DISKSTAT_WR_IOS],
+                                               elapsed_us);
+        stats->has_read_bps = true;
+        stats->read_bps = guest_counter_rate(v[DISKSTAT_RD_BYTES],
+                                             p[DISKSTAT_RD_BYTES],
+                                             elapsed_us);
+        stats->has_write_bps = true;
+        stats->write_bps = guest_counter_rate(v[DISKSTAT_WR_BYTES],
+                                              p[DISKSTAT_WR_BYTES],
+                                              elapsed_us);
+        stats->has_read_await = true;
+        stats->read_await = guest_diskstat_await(v[DISKSTAT_RD_TIME],
+                                                 p[DISKSTAT_RD_TIME],
+                                                 v[DISKSTAT_RD_IOS],
+                                                 p[DISKSTAT_RD_IOS]);
+        stats->has_write_await = true;
+        stats->write_await = guest_diskstat_await(v[DISKSTAT_WR_TIME],
+                                                  p[DISKSTAT_WR_TIME],
+                                                  v[DISKSTAT_WR_IOS],
+                                                  p[DISKSTAT_WR_IOS]);
+        /* idle time is in 100ns units, elapsed_us in microseconds */
+        stats->has_util = true;
+        stats->util = 100 - guest_counter_rate(v[DISKSTAT_IDLE_TIME],
+                                               p[DISKSTAT_IDLE_TIME],
+                                               elapsed_us) / 1e5;
+        stats->util = MAX(MIN(stats->util, 100), 0);
+    }
+
+    memcpy(snap->v, v, sizeof(snap->v));
+    snap->time = now;
+    return stats;
+}
+
+static gboolean guest_diskstat_expired(gpointer key, gpointer value,
+                                       gpointer opaque)
+{
+    GuestDiskIOSnapshot *snap = value;
+
+    return snap->generation != guest_diskstat_state.generation;
+}
+
+/* the addresses of \\.\PhysicalDriveN, looked up once per disk */
+static GuestDiskAddressList *guest_diskstat_resolve(const char *name)
+{
+    Error *local_err = NULL;
+    GuestDiskAddressList *disk;
+    /* build_guest_disk_info() drops the trailing backslash of a volume */
+    char *path = g_strdup_printf("\\\\.\\%s\\", name);
+
+    disk = build_guest_disk_info(path, &local_err);
+    if (local_err) {
+        g_debug("failed to get the address of %s: %s", name,
+                error_get_pretty(local_err));
+        error_free(local_err);
+    }
+    g_free(path);
+    return disk;
+}
+
+/*
+ * PhysicalDisk instances are named after the disk number followed by the
+ * drive letters of its volumes, e.g. "0 C: D:".
+ */
+GuestDiskIOStatsList *qmp_guest_get_disk_io_stats(Error **errp)
+{
+    GuestPerfQuery *pq = &guest_perf_disk;
+    GuestDiskIOStatsList *head = NULL, **tail = &head, *entry;
+    GuestDiskIOSnapshot *snap;
+    uint64_t v[DISKSTAT_MAX];
+    char name[32];
+    WCHAR *end;
+    int64_t now;
+    long num;
+    DWORD i;
+
+    if (!guest_perf_collect(pq, errp)) {
+        return NULL;
+    }
+    now = g_get_monotonic_time();
+    if (!guest_diskstat_state.disks) {
+        guest_diskstat_state.disks =
+            g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                  guest_diskstat_snapshot_free);
+    }
+    guest_diskstat_state.generation++;
+
+    for (i = 0; i < pq->nitems[0]; i++) {
+        num = wcstol(pq->items[0][i].szName, &end, 10);
+        if (end == pq->items[0][i].szName || num < 0) {
+            continue;           /* _Total */
+        }
+        v[DISKSTAT_RD_IOS] = guest_perf_value(pq, PERF_DISK_RD_IOS, i);
+        v[DISKSTAT_RD_BYTES] = guest_perf_value(pq, PERF_DISK_RD_BYTES, i);
+        v[DISKSTAT_RD_TIME] = guest_perf_value(pq, PERF_DISK_RD_TIME, i);
+        v[DISKSTAT_WR_IOS] = guest_perf_value(pq, PERF_DISK_WR_IOS, i);
+        v[DISKSTAT_WR_BYTES] = guest_perf_value(pq, PERF_DISK_WR_BYTES, i);
+        v[DISKSTAT_WR_TIME] = guest_perf_value(pq, PERF_DISK_WR_TIME, i);
+        v[DISKSTAT_IDLE_TIME] = guest_perf_value(pq, PERF_DISK_IDLE_TIME, i);
+        /* not those that never did any I/O */
+        if (!v[DISKSTAT_RD_IOS] && !v[DISKSTAT_WR_IOS]) {
+            continue;
+        }
+
+        snprintf(name, sizeof(name), "PhysicalDrive%ld", num);
+        snap = g_hash_table_lookup(guest_diskstat_state.disks, name);
+        if (!snap) {
+            snap = g_new0(GuestDiskIOSnapshot, 1);
+            snap->disk = guest_diskstat_resolve(name);
+            g_hash_table_insert(guest_diskstat_state.disks, g_strdup(name),
+                                snap);
+        }
+        snap->generation = guest_diskstat_state.generation;
+
+        entry = g_new0(GuestDiskIOStatsList, 1);
+        entry->value = guest_diskstat_entry(name, snap, v, now);
+        *tail = entry;
+        tail = &entry->next;
+    }
+
+    /* forget disks that went away */
+    g_hash_table_foreach_remove(guest_diskstat_state.disks,
+                                guest_diskstat_expired, NULL);
+    return head;
+}
+
+static void guest_diskstat_cleanup(void)
+{
+    guest_perf_close(&guest_perf_disk);
+    if (guest_diskstat_state.disks) {
+        g_hash_table_destroy(guest_diskstat_state.disks);
+    }
+    memset(&guest_diskstat_state, 0, sizeof(guest_diskstat_state));
+}
+
+/* Network */
+
+static char *guest_netstat_mac(IP_ADAPTER_ADDRESSES *addr)
+{
+    GString *mac;
+    ULONG i;
+
+    if (!addr->PhysicalAddressLength) {
+        return NULL;
+    }
+    mac = g_string_new(NULL);
+    for (i = 0; i < addr->PhysicalAddressLength; i++) {
+        g_string_append_printf(mac, "%s%02x", i ? ":" : "",
+                               addr->PhysicalAddress[i]);
+    }
+    return g_string_free(mac, false);
+}
+
+static GuestNetworkStatsList *guest_netstat_entry(
+    IP_ADAPTER_ADDRESSES *addr, GuestNetworkInterfaceStat *stat)
+{
+    GuestNetworkStats *stats = g_new0(GuestNetworkStats, 1);
+    GuestNetworkStatsList *entry = g_new0(GuestNetworkStatsList, 1);
+
+    stats->name = guest_wctomb_dup(addr->FriendlyName);
+    stats->ifindex = addr->IfIndex ? addr->IfIndex : addr->Ipv6IfIndex;
+    stats->up = addr->OperStatus == IfOperStatusUp;
+    stats->hardware_address = guest_netstat_mac(addr);
+    stats->has_hardware_address = stats->hardware_address != NULL;
+    stats->statistics = stat;
+    entry->value = stats;
+    return entry;
+}
+
+#if (_WIN32_WINNT >= 0x0600)
+/*
+ * The interface table has the 64-bit counters of every interface in one
+ * call.  It also lists filter and tunnel pseudo interfaces; only those of
+ * the adapters guest-network-get-interfaces reports are returned.
+ */
+GuestNetworkStatsList *qmp_guest_get_network_stats(Error **errp)
+{
+    GuestNetworkStatsList *head = NULL, **tail = &head;
+    IP_ADAPTER_ADDRESSES *adptr_addrs, *addr;
+    GuestNetworkInterfaceStat *stat;
+    MIB_IF_TABLE2 *table;
+    MIB_IF_ROW2 *row;
+    DWORD ret;
+    ULONG i;
+
+    adptr_addrs = guest_get_adapters_addresses(errp);
+    if (!adptr_addrs) {
+        return NULL;
+    }
+    ret = GetIfTable2(&table);
+    if (ret != NO_ERROR) {
+        error_setg_win32(errp, ret, "failed to get the interface table");
+        return NULL;
+    }
+
+    for (addr = adptr_addrs; addr; addr = addr->Next) {
+        for (i = 0; i < table->NumEntries; i++) {
+            if (table->Table[i].InterfaceLuid.Value == addr->Luid.Value) {
+                break;
             }
-            status->mount_place = g_strdup(mountplace);
-            status->mount_info = info;
-            g_free(str);
         }
-        i++;
-        si += 4;
+        if (i == table->NumEntries) {
+            continue;
+        }
+        row = &table->Table[i];
 
-        entry = g_malloc0(sizeof *entry);
+        stat = g_new0(GuestNetworkInterfaceStat, 1);
+        stat->rx_bytes = row->InOctets;
+        stat->rx_packets = row->InUcastPkts + row->InNUcastPkts;
+        stat->rx_errs = row->InErrors;
+        stat->rx_dropped = row->InDiscards;
+        stat->tx_bytes = row->OutOctets;
+        stat->tx_packets = row->OutUcastPkts + row->OutNUcastPkts;
+        stat->tx_errs = row->OutErrors;
+        stat->tx_dropped = row->OutDiscards;
+
+        *tail = guest_netstat_entry(addr, stat);
+        tail = &(*tail)->next;
+    }
+    FreeMibTable(table);
+
+    return head;
+}
+
+static void guest_netstat_cleanup(void)
+{
+}
+#else
+/*
+ * Network Interface instances are named after the adapter description,
+ * with the characters that are special in counter paths replaced.
+ */
+static bool guest_netstat_match(const WCHAR *instance, const WCHAR *desc)
+{
+    WCHAR c;
+
+    for (; *instance && *desc; instance++, desc++) {
+        switch (*desc) {
+        case L'(':
+            c = L'[';
+            break;
+        case L')':
+            c = L']';
+            break;
+        case L'#':
+        case L'/':
+        case L'\\':
+            c = L'_';
+            break;
+        default:
+            c = *desc;
+            break;
+        }
+        if (*instance != c) {
+            return false;
+        }
+    }
+    return !*instance && !*desc;
+}
+
+GuestNetworkStatsList *qmp_guest_get_network_stats(Error **errp)
+{
+    GuestPerfQuery *pq = &guest_perf_net;
+    GuestNetworkStatsList *head = NULL, **tail = &head;
+    IP_ADAPTER_ADDRESSES *adptr_addrs, *addr;
+    GuestNetworkInterfaceStat *stat;
+    DWORD i;
+
+    if (!guest_perf_collect(pq, errp)) {
+        return NULL;
+    }
+    adptr_addrs = guest_get_adapters_addresses(errp);
+    if (!adptr_addrs) {
+        return NULL;
+    }
+
+    for (i = 0; i < pq->nitems[0]; i++) {
+        for (addr = adptr_addrs; addr; addr = addr->Next) {
+            if (guest_netstat_match(pq->items[0][i].szName,
+                                    addr->Description)) {
+                break;
+            }
+        }
+        if (!addr) {
+            continue;
+        }
+
+        stat = g_new0(GuestNetworkInterfaceStat, 1);
+        stat->rx_bytes = guest_perf_value(pq, PERF_NET_RX_BYTES, i);
+        stat->rx_packets = guest_perf_value(pq, PERF_NET_RX_PACKETS, i);
+        stat->rx_errs = guest_perf_value(pq, PERF_NET_RX_ERRS, i);
+        stat->rx_dropped = guest_perf_value(pq, PERF_NET_RX_DROPPED, i);
+        stat->tx_bytes = guest_perf_value(pq, PERF_NET_TX_BYTES, i);
+        stat->tx_packets = guest_perf_value(pq, PERF_NET_TX_PACKETS, i);
+        stat->tx_errs = guest_perf_value(pq, PERF_NET_TX_ERRS, i);
+        stat->tx_dropped = guest_perf_value(pq, PERF_NET_TX_DROPPED, i);
+
+        *tail = guest_netstat_entry(addr, stat);
+        tail = &(*tail)->next;
+    }
+
+    return head;
+}
+
+static void guest_netstat_cleanup(void)
+{
+    guest_perf_close(&guest_perf_net);
+}
+#endif
+/*########################################################################################################*/
+
+/*Services*/
+/*########################################################################################################*/
+GuestServiceStatusList *qmp_guest_get_service_status(strList *units,
+                                                     Error **errp)
+{
+    GuestServiceStatusList *head = NULL, **link = &head, *entry;
+    GuestServiceStatus *status;
+    GACollectService *svc;
+    GPtrArray *services;
+    GError *gerr = NULL;
+    char **names;
+    strList *u;
+    size_t n = 0;
+    guint i;
+
+    for (u = units; u; u = u->next) {
+        n++;
+    }
+    names = g_new0(char *, n + 1);
+    for (u = units, i = 0; u; u = u->next, i++) {
+        names[i] = u->value;
+    }
+    services = ga_collect_services(names, &gerr);
+    g_free(names);
+    if (!services) {
+        ga_collect_error(errp, gerr);
+        return NULL;
+    }
+
+    for (i = 0; i < services->len; i++) {
+        svc = g_ptr_array_index(services, i);
+        status = g_new0(GuestServiceStatus, 1);
+        status->name = g_strdup(svc->name);
+        status->load_state = g_strdup(svc->load_state);
+        status->active_state = g_strdup(svc->active_state);
+        if (svc->sub_state) {
+            status->has_sub_state = true;
+            status->sub_state = g_strdup(svc->sub_state);
+        }
+        if (svc->main_pid > 0) {
+            status->has_main_pid = true;
+            status->main_pid = svc->main_pid;
+        }
+        entry = g_new0(GuestServiceStatusList, 1);
         entry->value = status;
+        *link = entry;
+        link = &entry->next;
+    }
+    g_ptr_array_free(services, true);
 
+    return head;
+}
+/*########################################################################################################*/
+
+/*Packages*/
+/*########################################################################################################*/
+static GuestPackageList *guest_package_list(GPtrArray *packages)
+{
+    GuestPackageList *head = NULL, **link = &head, *entry;
+    GACollectPackage *pkg;
+    GuestPackage *p;
+    guint i;
+
+    for (i = 0; i < packages->len; i++) {
+        pkg = g_ptr_array_index(packages, i);
+        p = g_new0(GuestPackage, 1);
+        p->name = g_strdup(pkg->name);
+        p->version = g_strdup(pkg->version);
+        p->arch = g_strdup(pkg->arch);
+        entry = g_new0(GuestPackageList, 1);
+        entry->value = p;
         *link = entry;
         link = &entry->next;
     }
+    return head;
+}
 
+GuestPackages *qmp_guest_get_packages(bool has_since, const char *since,
+                                      Error **errp)
+{
+    GuestPackages *ret;
+    GACollectPackages pk;
+    GError *gerr = NULL;
 
-    g_free(DStr);
+    if (!ga_collect_packages(has_since ? since : NULL, &pk, &gerr)) {
+        ga_collect_error(errp, gerr);
+        return NULL;
+    }
 
-    return head;
+    ret = g_new0(GuestPackages, 1);
+    ret->manager = GUEST_PACKAGE_MANAGER_REGISTRY;
+    ret->token = pk.token;
+    pk.token = NULL;
+    ret->full = pk.full;
+    ret->installed = guest_package_list(pk.installed);
+    ret->removed = guest_package_list(pk.removed);
+    ga_collect_packages_clear(&pk);
+
+    return ret;
+}
+/*########################################################################################################*/
+
+/*EventLog*/
+/*########################################################################################################*/
+#if (_WIN32_WINNT >= 0x0600)
+/*
+ * The agent subscribes to the events guest-get-kernel-log reports when it
+ * starts, from the oldest one still in the logs.  Windows calls
+ * guest_evtlog_deliver() on a thread pool thread for each event, as it is
+ * logged, so nothing polls.  The callback renders the event and adds it to
+ * a ring of the last GUEST_EVTLOG_MAX_RECORDS, which the commands read
+ * under @lock; rendering takes @render_lock, so that the commands never
+ * wait for it.  Formatting a message needs the metadata of its provider,
+ * which takes long to open, so those handles are kept too.
+ */
+#define GUEST_EVTLOG_MAX_RECORDS    2048
+#define GUEST_EVTLOG_DEFAULT_LIMIT  256
+/* between the Windows (1601) and Unix epochs, in 100ns units */
+#define GUEST_EVTLOG_EPOCH_DIFF     116444736000000000LL
+
+static const WCHAR guest_evtlog_query[] =
+    L"<QueryList><Query Id='0'>"
+    /* low virtual memory, 2004 */
+    L"<Select Path='System'>*[System[Provider"
+    L"[@Name='Microsoft-Windows-Resource-Exhaustion-Detector']]]</Select>"
+    L"<Select Path='System'>*[System[Provider[@Name='disk' or @Name='Ntfs'"
+    L" or @Name='Microsoft-Windows-Ntfs' or @Name='volmgr'"
+    L" or @Name='storvsc' or @Name='viostor' or @Name='vioscsi']"
+    L" and (Level=1 or Level=2 or Level=3)]]</Select>"
+    /* unexpected shutdown, rebooted without shutting down, bug check */
+    L"<Select Path='System'>*[System[(Provider[@Name='EventLog']"
+    L" and EventID=6008) or (Provider[@Name='Microsoft-Windows-Kernel-Power']"
+    L" and EventID=41) or (Provider"
+    L"[@Name='Microsoft-Windows-WER-SystemErrorReporting']"
+    L" and EventID=1001)]]</Select>"
+    /* application crashes, their reports and hangs */
+    L"<Select Path='Application'>*[System[(Provider"
+    L"[@Name='Application Error'] and EventID=1000) or (Provider"
+    L"[@Name='Windows Error Reporting'] and EventID=1001) or (Provider"
+    L"[@Name='Application Hang'] and EventID=1002)]]</Select>"
+    L"</Query></QueryList>";
+
+typedef struct GuestEvtlogRecord {
+    int64_t seq;
+    GuestKernelLogLevel level;
+    int facility;
+    int64_t time;
+    int event_id;
+    char *source;
+    char *message;
+} GuestEvtlogRecord;
+
+static struct {
+    CRITICAL_SECTION lock;      /* protects the ring and @next_seq */
+    GuestEvtlogRecord ring[GUEST_EVTLOG_MAX_RECORDS];
+    unsigned int head, count;
+    int64_t next_seq;
+    CRITICAL_SECTION render_lock; /* protects the rest, for the callback */
+    EVT_HANDLE render_ctx;
+    GHashTable *publishers;     /* provider name -> EVT_HANDLE or NULL */
+    EVT_HANDLE subscription;
+    bool initialized;
+} guest_evtlog_state;
+
+static GuestKernelLogLevel guest_evtlog_level(BYTE level)
+{
+    switch (level) {
+    case 1:
+        return GUEST_KERNEL_LOG_LEVEL_CRIT;
+    case 2:
+        return GUEST_KERNEL_LOG_LEVEL_ERR;
+    case 3:
+        return GUEST_KERNEL_LOG_LEVEL_WARNING;
+    case 5:
+        return GUEST_KERNEL_LOG_LEVEL_DEBUG;
+    default:
+        return GUEST_KERNEL_LOG_LEVEL_INFO;
+    }
+}
+
+static void guest_evtlog_close(gpointer handle)
+{
+    if (handle) {
+        EvtClose(handle);
+    }
+}
+
+static EVT_HANDLE guest_evtlog_publisher(const WCHAR *provider)
+{
+    gpointer key = g_utf16_to_utf8(provider, -1, NULL, NULL, NULL);
+    gpointer pub;
+
+    if (!key) {
+        return NULL;
+    }
+    if (g_hash_table_lookup_extended(guest_evtlog_state.publishers, key,
+                                     NULL, &pub)) {
+        g_free(key);
+        return pub;
+    }
+    /* NULL too, so a provider without metadata is not tried again */
+    pub = EvtOpenPublisherMetadata(NULL, provider, NULL, 0, 0);
+    g_hash_table_insert(guest_evtlog_state.publishers, key, pub);
+    return pub;
+}
+
+static char *guest_evtlog_message(EVT_HANDLE pub, EVT_HANDLE event)
+{
+    WCHAR *buf = NULL;
+    DWORD size = 0, used = 0;
+    char *msg = NULL;
+
+    if (!pub) {
+        return g_strdup("");
+    }
+    if (!EvtFormatMessage(pub, event, 0, 0, NULL, EvtFormatMessageEvent,
+                          0, NULL, &used) &&
+        GetLastError() == ERROR_INSUFFICIENT_BUFFER) {
+        size = used;
+        buf = g_new(WCHAR, size);
+        if (EvtFormatMessage(pub, event, 0, 0, NULL, EvtFormatMessageEvent,
+                             size, buf, &used)) {
+            msg = g_utf16_to_utf8(buf, -1, NULL, NULL, NULL);
+        }
+        g_free(buf);
+    }
+    return msg ?: g_strdup("");
+}
+
+/* the value of a system property, 0 if the event has none */
+#define GUEST_EVTLOG_VALUE(values, prop, type, field) \
+    ((values)[prop].Type == (type) ? (values)[prop].field : 0)
+
+/* called with render_lock held */
+static bool guest_evtlog_render(EVT_HANDLE event, GuestEvtlogRecord *r)
+{
+    EVT_VARIANT *values = NULL;
+    DWORD size = 0, used = 0, count;
+    const WCHAR *provider, *channel;
+
+    if (!EvtRender(guest_evtlog_state.render_ctx, event,
+                   EvtRenderEventValues, size, values, &used, &count)) {
+        if (GetLastError() != ERROR_INSUFFICIENT_BUFFER) {
+            return false;
+        }
+        size = used;
+        values = g_malloc(size);
+        if (!EvtRender(guest_evtlog_state.render_ctx, event,
+                       EvtRenderEventValues, size, values, &used, &count)) {
+            g_free(values);
+            return false;
+        }
+    }
+
+    provider = GUEST_EVTLOG_VALUE(values, EvtSystemProviderName,
+                                  EvtVarTypeString, StringVal);
+    channel = GUEST_EVTLOG_VALUE(values, EvtSystemChannel, EvtVarTypeString,
+                                 StringVal);
+    r->level = guest_evtlog_level(GUEST_EVTLOG_VALUE(values, EvtSystemLevel,
+                                                     EvtVarTypeByte,
+                                                     ByteVal));
+    r->facility = channel && !wcscmp(channel, L"Application");
+    r->event_id = GUEST_EVTLOG_VALUE(values, EvtSystemEventID,
+                                     EvtVarTypeUInt16, UInt16Val);
+    r->time = (GUEST_EVTLOG_VALUE(values, EvtSystemTimeCreated,
+                                  EvtVarTypeFileTime, FileTimeVal) -
+               GUEST_EVTLOG_EPOCH_DIFF) * 100;
+    if (provider) {
+        r->source = g_utf16_to_utf8(provider, -1, NULL, NULL, NULL);
+        r->message = guest_evtlog_message(guest_evtlog_publisher(provider),
+                                          event);
+    }
+    g_free(values);
+    return true;
+}
+
+static void guest_evtlog_add(EVT_HANDLE event)
+{
+    GuestEvtlogRecord *rec, r = { 0 };
+    bool ok;
+
+    EnterCriticalSection(&guest_evtlog_state.render_lock);
+    ok = guest_evtlog_render(event, &r);
+    LeaveCriticalSection(&guest_evtlog_state.render_lock);
+    if (!ok) {
+        return;
+    }
+    if (!r.message) {
+        r.message = g_strdup("");
+    }
+
+    EnterCriticalSection(&guest_evtlog_state.lock);
+    if (guest_evtlog_state.count == GUEST_EVTLOG_MAX_RECORDS) {
+        rec = &guest_evtlog_state.ring[guest_evtlog_state.head];
+        g_free(rec->source);
+        g_free(rec->message);
+        guest_evtlog_state.head = (guest_evtlog_state.head + 1) %
+                                  GUEST_EVTLOG_MAX_RECORDS;
+        guest_evtlog_state.count--;
+    }
+    r.seq = guest_evtlog_state.next_seq++;
+    guest_evtlog_state.ring[(guest_evtlog_state.head +
+                             guest_evtlog_state.count++) %
+                            GUEST_EVTLOG_MAX_RECORDS] = r;
+    LeaveCriticalSection(&guest_evtlog_state.lock);
+}
+
+static DWORD WINAPI guest_evtlog_deliver(EVT_SUBSCRIBE_NOTIFY_ACTION action,
+                                         PVOID ctx, EVT_HANDLE event)
+{
+    if (action == EvtSubscribeActionDeliver) {
+        guest_evtlog_add(event);
+    } else {
+        /* the event log service stopped, or the query broke */
+        g_debug("event log subscription error: %lu", (DWORD)(ULONG_PTR)event);
+    }
+    return ERROR_SUCCESS;
+}
+
+static void guest_evtlog_init(void)
+{
+    InitializeCriticalSection(&guest_evtlog_state.lock);
+    InitializeCriticalSection(&guest_evtlog_state.render_lock);
+    guest_evtlog_state.initialized = true;
+    guest_evtlog_state.next_seq = 1;
+    guest_evtlog_state.publishers =
+        g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                              guest_evtlog_close);
+    guest_evtlog_state.render_ctx = EvtCreateRenderContext(0, NULL,
+                                                EvtRenderContextSystem);
+    if (!guest_evtlog_state.render_ctx) {
+        g_warning("failed to create event render context: %lu",
+                  GetLastError());
+        return;
+    }
+    guest_evtlog_state.subscription =
+        EvtSubscribe(NULL, NULL, NULL, guest_evtlog_query, NULL, NULL,
+                     guest_evtlog_deliver, EvtSubscribeStartAtOldestRecord);
+    if (!guest_evtlog_state.subscription) {
+        g_warning("failed to subscribe to the event log: %lu",
+                  GetLastError());
+    }
+}
+
+static void guest_evtlog_cleanup(void)
+{
+    unsigned int i;
+    GuestEvtlogRecord *rec;
+
+    if (!guest_evtlog_state.initialized) {
+        return;
+    }
+    /* waits for a callback that is running */
+    if (guest_evtlog_state.subscription) {
+        EvtClose(guest_evtlog_state.subscription);
+    }
+    if (guest_evtlog_state.render_ctx) {
+        EvtClose(guest_evtlog_state.render_ctx);
+    }
+    g_hash_table_destroy(guest_evtlog_state.publishers);
+    for (i = 0; i < guest_evtlog_state.count; i++) {
+        rec = &guest_evtlog_state.ring[(guest_evtlog_state.head + i) %
+                                       GUEST_EVTLOG_MAX_RECORDS];
+        g_free(rec->source);
+        g_free(rec->message);
+    }
+    DeleteCriticalSection(&guest_evtlog_state.lock);
+    DeleteCriticalSection(&guest_evtlog_state.render_lock);
+    memset(&guest_evtlog_state, 0, sizeof(guest_evtlog_state));
 }
+
+static GuestKernelLogRecord *guest_evtlog_to_qapi(GuestEvtlogRecord *rec)
+{
+    GuestKernelLogRecord *r = g_new0(GuestKernelLogRecord, 1);
+
+    r->seq = rec->seq;
+    r->level = rec->level;
+    r->facility = rec->facility;
+    r->time = rec->time;
+    r->message = g_strdup(rec->message);
+    r->has_source = rec->source != NULL;
+    r->source = g_strdup(rec->source);
+    r->has_event_id = true;
+    r->event_id = rec->event_id;
+    return r;
+}
+
+GuestKernelLog *qmp_guest_get_kernel_log(bool has_cursor, int64_t cursor,
+                                         bool has_level,
+                                         GuestKernelLogLevel level,
+                                         bool has_facility, int64_t facility,
+                                         bool has_pattern, const char *pattern,
+                                         bool has_limit, int64_t limit,
+                                         Error **errp)
+{
+    GuestKernelLog *log;
+    GuestKernelLogRecordList **link, *entry;
+    GuestEvtlogRecord *rec;
+    GRegex *re = NULL;
+    GError *gerr = NULL;
+    int64_t oldest;
+    unsigned int i;
+
+    if (has_facility && facility < 0) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "facility",
+                   "0 or 1");
+        return NULL;
+    }
+    if (has_limit && limit <= 0) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "limit",
+                   "a positive number");
+        return NULL;
+    }
+    if (!has_limit) {
+        limit = GUEST_EVTLOG_DEFAULT_LIMIT;
+    }
+    if (!guest_evtlog_state.subscription) {
+        error_setg(errp, "not subscribed to the event log");
+        return NULL;
+    }
+    if (has_pattern) {
+        re = g_regex_new(pattern, G_REGEX_OPTIMIZE, 0, &gerr);
+        if (!re) {
+            error_setg(errp, "invalid pattern '%s': %s", pattern,
+                       gerr->message);
+            g_error_free(gerr);
+            return NULL;
+        }
+    }
+
+    EnterCriticalSection(&guest_evtlog_state.lock);
+    /* a cursor from the future belongs to an earlier run of the agent */
+    if (!has_cursor || cursor < 0 || cursor > guest_evtlog_state.next_seq) {
+        cursor = 0;
+    }
+    oldest = guest_evtlog_state.next_seq - guest_evtlog_state.count;
+
+    log = g_new0(GuestKernelLog, 1);
+    log->truncated = has_cursor && cursor && cursor < oldest;
+    log->cursor = guest_evtlog_state.next_seq;
+    link = &log->records;
+    for (i = 0; i < guest_evtlog_state.count; i++) {
+        rec = &guest_evtlog_state.ring[(guest_evtlog_state.head + i) %
+                                       GUEST_EVTLOG_MAX_RECORDS];
+        if (rec->seq < cursor ||
+            rec->level > (has_level ? level : GUEST_KERNEL_LOG_LEVEL_INFO) ||
+            (has_facility && rec->facility != facility) ||
+            (re && !g_regex_match(re, rec->message, 0, NULL))) {
+            continue;
+        }
+        entry = g_new0(GuestKernelLogRecordList, 1);
+        entry->value = guest_evtlog_to_qapi(rec);
+        *link = entry;
+        link = &entry->next;
+        if (--limit == 0) {
+            log->cursor = rec->seq + 1;
+            break;
+        }
+    }
+    LeaveCriticalSection(&guest_evtlog_state.lock);
+
+    if (re) {
+        g_regex_unref(re);
+    }
+    return log;
+}
+#else
+static void guest_evtlog_init(void)
+{
+}
+
+static void guest_evtlog_cleanup(void)
+{
+}
+
+GuestKernelLog *qmp_guest_get_kernel_log(bool has_cursor, int64_t cursor,
+                                         bool has_level,
+                                         GuestKernelLogLevel level,
+                                         bool has_facility, int64_t facility,
+                                         bool has_pattern, const char *pattern,
+                                         bool has_limit, int64_t limit,
+                                         Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
+#endif
 /*########################################################################################################*/
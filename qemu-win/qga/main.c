@@ -644,12 +644,15 @@ static gboolean channel_event_cb(GIOCondition condition, gpointer data)
         }
         /* fall through */
     case G_IO_STATUS_AGAIN:
+#ifndef _WIN32
         /* virtio causes us to spin here when no process is attached to
          * host-side chardev. sleep a bit to mitigate this
          */
         if (s->virtio) {
             usleep(100*1000);
         }
+#endif
+        /* the win32 channel delays its own reads after a hangup */
         return true;
     default:
         g_warning("unknown channel read status, closing");
@@ -684,6 +687,58 @@ static gboolean channel_init(GAState *s, const gchar *method, const gchar *path)
 }
 
 #ifdef _WIN32
+/* how long the SCM should wait for the stop before giving up on us */
+#define QGA_SERVICE_STOP_WAIT_HINT_MS 3000
+
+typedef struct GAServiceStopSource {
+    GSource source;
+    GPollFD pollfd;
+} GAServiceStopSource;
+
+static gboolean service_stop_prepare(GSource *source, gint *timeout_ms)
+{
+    *timeout_ms = -1;
+    return false;
+}
+
+static gboolean service_stop_check(GSource *source)
+{
+    GAServiceStopSource *stop = (GAServiceStopSource *)source;
+
+    return !!stop->pollfd.revents;
+}
+
+/* runs in the main loop thread once the control handler set stop_event */
+static gboolean service_stop_dispatch(GSource *source, GSourceFunc unused,
+                                      gpointer user_data)
+{
+    GAService *service = &ga_state->service;
+
+    ResetEvent(service->stop_event);
+    quit_handler(SIGTERM);
+    if (ga_is_frozen(ga_state)) {
+        /* quit_handler() refused, tell the SCM we are still here */
+        g_warning("not stopping the service while filesystems are frozen");
+        service->status.dwCurrentState = SERVICE_RUNNING;
+        service->status.dwWaitHint = 0;
+        SetServiceStatus(service->status_handle, &service->status);
+    }
+    return true;
+}
+
+static GSourceFuncs service_stop_funcs = {
+    service_stop_prepare,
+    service_stop_check,
+    service_stop_dispatch,
+    NULL
+};
+
+/*
+ * The control handler runs in a thread of the service dispatcher.  It only
+ * reports the state change and signals stop_event, which the main loop
+ * waits on together with the channel, so a stop is acted upon at once
+ * whether the agent is idle or busy with a command.
+ */
 DWORD WINAPI service_ctrl_handler(DWORD ctrl, DWORD type, LPVOID data,
                                   LPVOID ctx)
 {
@@ -694,9 +749,14 @@ DWORD WINAPI service_ctrl_handler(DWORD ctrl, DWORD type, LPVOID data,
     {
         case SERVICE_CONTROL_STOP:
         case SERVICE_CONTROL_SHUTDOWN:
-            quit_handler(SIGTERM);
+        case SERVICE_CONTROL_PRESHUTDOWN:
             service->status.dwCurrentState = SERVICE_STOP_PENDING;
+            service->status.dwWaitHint = QGA_SERVICE_STOP_WAIT_HINT_MS;
             SetServiceStatus(service->status_handle, &service->status);
+            SetEvent(service->stop_event);
+            break;
+
+        case SERVICE_CONTROL_INTERROGATE:
             break;
 
         default:
@@ -708,6 +768,20 @@ DWORD WINAPI service_ctrl_handler(DWORD ctrl, DWORD type, LPVOID data,
 VOID WINAPI service_main(DWORD argc, TCHAR *argv[])
 {
     GAService *service = &ga_state->service;
+    GAServiceStopSource *stop;
+    GSource *source;
+
+    service->stop_event = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (!service->stop_event) {
+        g_critical("failed to create the service stop event");
+        return;
+    }
+    source = g_source_new(&service_stop_funcs, sizeof(GAServiceStopSource));
+    stop = (GAServiceStopSource *)source;
+    stop->pollfd.fd = (gintptr)service->stop_event;
+    stop->pollfd.events = G_IO_IN;
+    g_source_add_poll(source, &stop->pollfd);
+    g_source_attach(source, NULL);
 
     service->status_handle = RegisterServiceCtrlHandlerEx(QGA_SERVICE_NAME,
         service_ctrl_handler, NULL);
@@ -719,7 +793,9 @@ VOID WINAPI service_main(DWORD argc, TCHAR *argv[])
 
     service->status.dwServiceType = SERVICE_WIN32;
     service->status.dwCurrentState = SERVICE_RUNNING;
-    service->status.dwControlsAccepted = SERVICE_ACCEPT_STOP | SERVICE_ACCEPT_SHUTDOWN;
+    /* preshutdown comes first, while the host can still talk to us */
+    service->status.dwControlsAccepted = SERVICE_ACCEPT_STOP |
+        SERVICE_ACCEPT_SHUTDOWN | SERVICE_ACCEPT_PRESHUTDOWN;
     service->status.dwWin32ExitCode = NO_ERROR;
     service->status.dwServiceSpecificExitCode = NO_ERROR;
     service->status.dwCheckPoint = 0;
@@ -728,7 +804,13 @@ VOID WINAPI service_main(DWORD argc, TCHAR *argv[])
 
     g_main_loop_run(ga_state->main_loop);
 
+    g_source_destroy(source);
+    g_source_unref(source);
+    CloseHandle(service->stop_event);
+    service->stop_event = NULL;
+
     service->status.dwCurrentState = SERVICE_STOPPED;
+    service->status.dwWaitHint = 0;
     SetServiceStatus(service->status_handle, &service->status);
 }
 #endif
@@ -0,0 +1,3100 @@
+/*
+ * BCLinux guest status collectors, procfs backend
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include <glib.h>
+#include <crypt.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <shadow.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <utmp.h>
+#include <utmpx.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+#include <sys/utsname.h>
+#include <sys/wait.h>
+#include <sys/xattr.h>
+#include <linux/connector.h>
+#include <linux/cn_proc.h>
+#include <linux/netlink.h>
+#ifdef GA_COLLECT_GDBUS
+#include <gio/gio.h>
+#endif
+#include "collect.h"
+
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
+#ifndef HOST_NAME_MAX
+#define HOST_NAME_MAX 255
+#endif
+#ifndef _PATH_LASTLOG
+#define _PATH_LASTLOG "/var/log/lastlog"
+#endif
+
+/* read all of a file in /proc, which reports a size of 0, into @buf */
+static ssize_t collect_read_proc(const char *path, char *buf, size_t size,
+                                 GError **errp)
+{
+    ssize_t len;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        g_set_error(errp, GA_COLLECT_ERROR, errno, "failed to open %s: %s",
+                    path, g_strerror(errno));
+        return -1;
+    }
+    len = pread(fd, buf, size - 1, 0);
+    close(fd);
+    if (len <= 0) {
+        g_set_error(errp, GA_COLLECT_ERROR, len ? errno : EIO,
+                    "failed to read %s: %s", path,
+                    g_strerror(len ? errno : EIO));
+        return -1;
+    }
+    buf[len] = '\0';
+    return len;
+}
+
+/* run in the child: its own process group, so a timeout kills a pipeline */
+static void collect_run_setup(gpointer data)
+{
+    setpgid(0, 0);
+}
+
+/*
+ * Run @argv, never through a shell, and keep up to @max bytes of what it
+ * prints in @out; the rest is drained.  It is killed, with anything it
+ * started, if it has not exited after @timeout_ms.
+ *
+ * Returns: the wait status, or -1 if it could not be run or was killed
+ */
+static int collect_run(const char *const *argv, size_t max, int timeout_ms,
+                       GString *out, GError **errp)
+{
+    struct pollfd pfd = { .events = POLLIN };
+    gint64 deadline, timeout = 0;
+    char buf[4096];
+    ssize_t n;
+    int status;
+    pid_t ret;
+    GPid child;
+    GError *err = NULL;
+
+    if (!g_spawn_async_with_pipes(NULL, (char **)argv, NULL,
+                                  G_SPAWN_SEARCH_PATH |
+                                  G_SPAWN_DO_NOT_REAP_CHILD |
+                                  G_SPAWN_STDERR_TO_DEV_NULL,
+                                  collect_run_setup, NULL, &child, NULL,
+                                  &pfd.fd, NULL, &err)) {
+        g_debug("failed to run %s: %s", argv[0], err->message);
+        g_propagate_error(errp, err);
+        return -1;
+    }
+
+    deadline = g_get_monotonic_time() + (gint64)timeout_ms * 1000;
+    for (;;) {
+        timeout = (deadline - g_get_monotonic_time()) / 1000;
+        if (timeout <= 0) {
+            break;
+        }
+        if (poll(&pfd, 1, timeout) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (!pfd.revents) {
+            continue;
+        }
+        n = read(pfd.fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        if (out->len < max) {
+            g_string_append_len(out, buf, MIN((size_t)n, max - out->len));
+        }
+    }
+    close(pfd.fd);
+
+    /* the output may be closed early, the deadline holds for the exit too */
+    while ((ret = waitpid(child, &status, WNOHANG)) == 0 ||
+           (ret < 0 && errno == EINTR)) {
+        if (g_get_monotonic_time() >= deadline) {
+            break;
+        }
+        g_usleep(10 * 1000);
+    }
+    if (ret <= 0) {
+        g_debug("%s timed out", argv[0]);
+        kill(-child, SIGKILL);
+        while (waitpid(child, &status, 0) < 0 && errno == EINTR) {
+            /* again */
+        }
+    }
+    g_spawn_close_pid(child);
+
+    return ret <= 0 ? -1 : status;
+}
+
+/* Memory */
+
+/* fill @mi from a single read of /proc/meminfo */
+bool ga_collect_memory(GuestMeminfo *mi, GError **errp)
+{
+    char buf[8192];
+
+    memset(mi, 0, sizeof(*mi));
+    if (collect_read_proc("/proc/meminfo", buf, sizeof(buf), errp) < 0) {
+        return false;
+    }
+    ga_parse_meminfo(buf, mi);
+    return true;
+}
+
+/* System */
+
+/*
+ * uname() and the distribution name do not change while the agent runs and
+ * are read once.  The fqdn needs a resolver lookup, so it is cached as
+ * well, and resolved again when the host name changes.
+ */
+static struct {
+    bool initialized;
+    struct utsname uts;
+    char *pretty_name;
+    char *hostname;             /* host name @fqdn was resolved for */
+    char *fqdn;
+    const char *hostname_file;  /* where the distribution keeps the name */
+    bool hostname_sysconfig;    /* ...as HOSTNAME= in a shell-style file */
+} collect_system;
+
+G_LOCK_DEFINE_STATIC(collect_system);
+
+/* look up @key in os-release(5), without the quotes around the value */
+char *ga_collect_os_release(const char *key)
+{
+    static const char * const release_files[] = {
+        "/etc/os-release", "/usr/lib/os-release", NULL
+    };
+    char *contents, *line, *end, *value = NULL;
+    size_t keylen = strlen(key), len;
+    int i;
+
+    for (i = 0; release_files[i] && !value; i++) {
+        if (!g_file_get_contents(release_files[i], &contents, NULL, NULL)) {
+            continue;
+        }
+        for (line = contents; line && !value; line = end) {
+            end = strchr(line, '\n');
+            if (end) {
+                *end++ = '\0';
+            }
+            if (!strncmp(line, key, keylen) && line[keylen] == '=') {
+                value = g_strdup(g_strstrip(line + keylen + 1));
+            }
+        }
+        g_free(contents);
+    }
+
+    if (value) {
+        len = strlen(value);
+        if (len >= 2 && (value[0] == '"' || value[0] == '\'') &&
+            value[len - 1] == value[0]) {
+            memmove(value, value + 1, len - 2);
+            value[len - 2] = '\0';
+        }
+    }
+    return value;
+}
+
+static char *collect_pretty_name(void)
+{
+    char *contents, *end, *name;
+
+    name = ga_collect_os_release("PRETTY_NAME");
+    if (name) {
+        return name;
+    }
+
+    /* older releases such as CentOS 6 only have /etc/system-release */
+    if (g_file_get_contents("/etc/system-release", &contents, NULL, NULL)) {
+        end = strchr(contents, '\n');
+        if (end) {
+            *end = '\0';
+        }
+        name = g_strdup(g_strstrip(contents));
+        g_free(contents);
+    }
+    return name;
+}
+
+/*
+ * Pick the file the persistent host name lives in: SUSE keeps it in
+ * /etc/HOSTNAME, other os-release distributions in /etc/hostname, and
+ * pre-systemd Red Hat releases as HOSTNAME= in /etc/sysconfig/network.
+ */
+static void collect_find_hostname_file_locked(void)
+{
+    char *id = ga_collect_os_release("ID");
+    char *id_like = ga_collect_os_release("ID_LIKE");
+
+    collect_system.hostname_sysconfig = false;
+    if ((id && strstr(id, "suse")) || (id_like && strstr(id_like, "suse"))) {
+        collect_system.hostname_file = "/etc/HOSTNAME";
+    } else if (id || access("/etc/hostname", F_OK) == 0) {
+        collect_system.hostname_file = "/etc/hostname";
+    } else if (access("/etc/sysconfig/network", F_OK) == 0) {
+        collect_system.hostname_file = "/etc/sysconfig/network";
+        collect_system.hostname_sysconfig = true;
+    } else if (access("/etc/HOSTNAME", F_OK) == 0) {
+        collect_system.hostname_file = "/etc/HOSTNAME";
+    } else {
+        collect_system.hostname_file = NULL;
+    }
+
+    g_free(id);
+    g_free(id_like);
+}
+
+static void collect_system_init_locked(void)
+{
+    if (collect_system.initialized) {
+        return;
+    }
+    if (uname(&collect_system.uts) < 0) {
+        g_warning("failed to get uname: %s", g_strerror(errno));
+    }
+    collect_system.pretty_name = collect_pretty_name();
+    collect_find_hostname_file_locked();
+    collect_system.initialized = true;
+}
+
+/* optional: ga_collect_system() does it on first use otherwise */
+void ga_collect_system_init(void)
+{
+    G_LOCK(collect_system);
+    collect_system_init_locked();
+    G_UNLOCK(collect_system);
+}
+
+static void collect_system_invalidate_fqdn_locked(void)
+{
+    g_free(collect_system.hostname);
+    collect_system.hostname = NULL;
+    g_free(collect_system.fqdn);
+    collect_system.fqdn = NULL;
+}
+
+/* the host name was just changed, don't wait for a lookup to notice */
+void ga_collect_system_invalidate_fqdn(void)
+{
+    G_LOCK(collect_system);
+    collect_system_invalidate_fqdn_locked();
+    G_UNLOCK(collect_system);
+}
+
+void ga_collect_system_cleanup(void)
+{
+    G_LOCK(collect_system);
+    g_free(collect_system.pretty_name);
+    collect_system.pretty_name = NULL;
+    collect_system_invalidate_fqdn_locked();
+    collect_system.initialized = false;
+    G_UNLOCK(collect_system);
+}
+
+/* what "hostname -f" prints: the canonical name the resolver returns */
+static char *collect_fqdn_locked(void)
+{
+    struct addrinfo hints, *res;
+    char hostname[HOST_NAME_MAX + 1];
+
+    if (gethostname(hostname, sizeof(hostname)) < 0) {
+        return g_strdup("");
+    }
+    hostname[HOST_NAME_MAX] = '\0';
+
+    if (collect_system.fqdn && !strcmp(collect_system.hostname, hostname)) {
+        return g_strdup(collect_system.fqdn);
+    }
+    collect_system_invalidate_fqdn_locked();
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_flags = AI_CANONNAME;
+    if (getaddrinfo(hostname, NULL, &hints, &res) == 0) {
+        if (res->ai_canonname) {
+            collect_system.fqdn = g_strdup(res->ai_canonname);
+        }
+        freeaddrinfo(res);
+    }
+    if (!collect_system.fqdn) {
+        collect_system.fqdn = g_strdup(hostname);
+    }
+    collect_system.hostname = g_strdup(hostname);
+    return g_strdup(collect_system.fqdn);
+}
+
+/* root's entry of the lastlog database, formatted like lastlog(8) */
+static char *collect_lastlogin(void)
+{
+    struct lastlog ll;
+    struct passwd *pw;
+    const char *user;
+    char date[64];
+    time_t t;
+    int fd;
+    ssize_t len;
+
+    fd = open(_PATH_LASTLOG, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return g_strdup("");
+    }
+    len = pread(fd, &ll, sizeof(ll), 0);
+    close(fd);
+
+    pw = getpwuid(0);
+    user = pw ? pw->pw_name : "root";
+    if (len != sizeof(ll) || ll.ll_time == 0) {
+        return g_strdup_printf("%-16s **Never logged in**", user);
+    }
+
+    t = ll.ll_time;
+    if (!strftime(date, sizeof(date), "%a %b %e %H:%M:%S %z %Y",
+                  localtime(&t))) {
+        date[0] = '\0';
+    }
+    return g_strdup_printf("%-16s %-8.*s %-16.*s %s", user,
+                           (int)sizeof(ll.ll_line), ll.ll_line,
+                           (int)sizeof(ll.ll_host), ll.ll_host, date);
+}
+
+void ga_collect_system(GACollectSystem *si)
+{
+    G_LOCK(collect_system);
+    collect_system_init_locked();
+    si->os_name = g_strdup(collect_system.uts.sysname);
+    si->kernel_version = g_strdup(collect_system.uts.release);
+    si->system_version = g_strdup(collect_system.uts.version);
+    si->fqdn = collect_fqdn_locked();
+    si->pretty_name = g_strdup(collect_system.pretty_name);
+    G_UNLOCK(collect_system);
+
+    si->lastlogin = collect_lastlogin();
+}
+
+/* Disks */
+
+typedef struct CollectMount {
+    char *dir;
+    unsigned int devmajor;
+    unsigned int devminor;
+} CollectMount;
+
+/*
+ * The block device backed mounts of /proc/self/mountinfo.  The kernel
+ * flags the open file with POLLPRI once for every change of the mount
+ * table, so it is only parsed again after such a change.
+ */
+static struct {
+    int fd;                     /* polled for changes, -1 if unavailable */
+    bool valid;
+    GArray *mounts;             /* CollectMount */
+} collect_mounts = { .fd = -1 };
+
+G_LOCK_DEFINE_STATIC(collect_mounts);
+
+/* undo the octal escapes of spaces, tabs and such in mount table fields */
+static void collect_decode_mntname(char *name)
+{
+    char *in = name, *out = name;
+
+    while (*in) {
+        if (in[0] == '\\' && in[1] >= '0' && in[1] <= '3' &&
+            in[2] >= '0' && in[2] <= '7' && in[3] >= '0' && in[3] <= '7') {
+            *out++ = (in[1] - '0') << 6 | (in[2] - '0') << 3 | (in[3] - '0');
+            in += 4;
+        } else {
+            *out++ = *in++;
+        }
+    }
+    *out = '\0';
+}
+
+static void collect_mounts_clear(void)
+{
+    guint i;
+
+    if (!collect_mounts.mounts) {
+        return;
+    }
+    for (i = 0; i < collect_mounts.mounts->len; i++) {
+        g_free(g_array_index(collect_mounts.mounts, CollectMount, i).dir);
+    }
+    g_array_set_size(collect_mounts.mounts, 0);
+}
+
+/* btrfs reports major number 0, the device it is on tells the real one */
+static bool collect_dev_major_minor(const char *devpath,
+                                    unsigned int *devmajor,
+                                    unsigned int *devminor)
+{
+    struct stat st;
+
+    if (stat(devpath, &st) < 0 || !S_ISBLK(st.st_mode)) {
+        return false;
+    }
+    *devmajor = major(st.st_rdev);
+    *devminor = minor(st.st_rdev);
+    return true;
+}
+
+static bool collect_mounts_read(GError **errp)
+{
+    CollectMount m;
+    char *contents, *line, *end, *dash, *dir;
+    unsigned int devmajor, devminor;
+    int dir_s, dir_e, type_s, type_e, dev_s, dev_e;
+    GError *err = NULL;
+    guint i;
+
+    if (!g_file_get_contents("/proc/self/mountinfo", &contents, NULL, &err)) {
+        g_propagate_error(errp, err);
+        return false;
+    }
+
+    collect_mounts_clear();
+    for (line = contents; line && *line; line = end) {
+        end = strchr(line, '\n');
+        if (end) {
+            *end++ = '\0';
+        }
+        /* 36 35 98:0 /mnt1 /mnt2 rw,noatime master:1 - ext3 /dev/root ... */
+        dir_e = 0;
+        if (sscanf(line, "%*u %*u %u:%u %*s %n%*s%n",
+                   &devmajor, &devminor, &dir_s, &dir_e) < 2 || !dir_e) {
+            continue;
+        }
+        dash = strstr(line + dir_e, " - ");
+        if (!dash) {
+            continue;
+        }
+        type_e = dev_e = 0;
+        if (sscanf(dash, " - %n%*s%n %n%*s%n",
+                   &type_s, &type_e, &dev_s, &dev_e) < 0 || !dev_e) {
+            continue;
+        }
+        line[dir_e] = '\0';
+        dash[type_e] = '\0';
+        dash[dev_e] = '\0';
+        dir = line + dir_s;
+        collect_decode_mntname(dir);
+        collect_decode_mntname(dash + dev_s);
+        /* no device behind it: pseudo and network file systems */
+        if (devmajor == 0 &&
+            (strcmp(dash + type_s, "btrfs") ||
+             !collect_dev_major_minor(dash + dev_s, &devmajor, &devminor))) {
+            continue;
+        }
+
+        /* like df, report each device once even if mounted repeatedly */
+        for (i = 0; i < collect_mounts.mounts->len; i++) {
+            CollectMount *prev = &g_array_index(collect_mounts.mounts,
+                                                CollectMount, i);
+            if (prev->devmajor == devmajor && prev->devminor == devminor) {
+                break;
+            }
+        }
+        if (i < collect_mounts.mounts->len) {
+            continue;
+        }
+
+        m.dir = g_strdup(dir);
+        m.devmajor = devmajor;
+        m.devminor = devminor;
+        g_array_append_val(collect_mounts.mounts, m);
+    }
+    g_free(contents);
+    return true;
+}
+
+static bool collect_mounts_stale(void)
+{
+    struct pollfd pfd = { .fd = collect_mounts.fd, .events = POLLPRI };
+
+    if (!collect_mounts.valid) {
+        return true;
+    }
+    return poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLPRI | POLLERR));
+}
+
+/*
+ * Usage of the local, block device backed file systems.  Network and
+ * pseudo file systems are never passed to statvfs() and cannot block.
+ */
+GPtrArray *ga_collect_disks(GError **errp)
+{
+    GPtrArray *disks;
+    GACollectDisk *disk;
+    CollectMount *m;
+    struct statvfs buf;
+    guint i;
+
+    G_LOCK(collect_mounts);
+    if (!collect_mounts.mounts) {
+        collect_mounts.mounts = g_array_new(false, false,
+                                            sizeof(CollectMount));
+    }
+    if (collect_mounts.fd == -1) {
+        /* before reading, so that no change goes unnoticed */
+        collect_mounts.fd = open("/proc/self/mountinfo",
+                                 O_RDONLY | O_CLOEXEC);
+    }
+    if (collect_mounts_stale()) {
+        if (!collect_mounts_read(errp)) {
+            collect_mounts.valid = false;
+            G_UNLOCK(collect_mounts);
+            return NULL;
+        }
+        collect_mounts.valid = collect_mounts.fd != -1;
+    }
+
+    disks = g_ptr_array_new_with_free_func(ga_collect_disk_free);
+    for (i = 0; i < collect_mounts.mounts->len; i++) {
+        m = &g_array_index(collect_mounts.mounts, CollectMount, i);
+        if (statvfs(m->dir, &buf) < 0) {
+            g_debug("failed to statvfs '%s': %s", m->dir, g_strerror(errno));
+            continue;
+        }
+
+        disk = g_new0(GACollectDisk, 1);
+        disk->mount = g_strdup(m->dir);
+        disk->total = (uint64_t)buf.f_blocks * buf.f_frsize;
+        disk->used = (uint64_t)(buf.f_blocks - buf.f_bfree) * buf.f_frsize;
+        disk->avail = (uint64_t)buf.f_bavail * buf.f_frsize;
+        disk->writable = !(buf.f_flag & ST_RDONLY);
+        ga_collect_fs_usage_add(disk->mount, disk->used, disk->avail);
+        g_ptr_array_add(disks, disk);
+    }
+    G_UNLOCK(collect_mounts);
+
+    return disks;
+}
+
+/* read the mount table again next time, changed or not */
+void ga_collect_disks_invalidate(void)
+{
+    G_LOCK(collect_mounts);
+    collect_mounts.valid = false;
+    G_UNLOCK(collect_mounts);
+}
+
+void ga_collect_disks_cleanup(void)
+{
+    G_LOCK(collect_mounts);
+    collect_mounts_clear();
+    if (collect_mounts.mounts) {
+        g_array_free(collect_mounts.mounts, true);
+        collect_mounts.mounts = NULL;
+    }
+    collect_mounts.valid = false;
+    if (collect_mounts.fd != -1) {
+        close(collect_mounts.fd);
+        collect_mounts.fd = -1;
+    }
+    G_UNLOCK(collect_mounts);
+    ga_collect_fs_usage_cleanup();
+}
+
+/* Services */
+
+#define COLLECT_SERVICES_MAX 256
+#define COLLECT_SERVICE_TTL_US (2 * G_USEC_PER_SEC)
+#define COLLECT_SERVICE_TIMEOUT_MS 5000   /* per D-Bus call or script */
+
+typedef struct CollectServiceEntry {
+    GACollectService *svc;
+    gint64 expires;
+} CollectServiceEntry;
+
+/*
+ * The last answer for each unit asked about, so that a monitor polling
+ * the same few units every second costs one query per unit and TTL.
+ * With gio, systemd is asked over D-Bus, preferably on its private
+ * socket; otherwise, and on hosts that do not run systemd, the init
+ * script answers "service NAME status".
+ */
+static struct {
+    GHashTable *cache;          /* name -> CollectServiceEntry */
+#ifdef GA_COLLECT_GDBUS
+    GDBusConnection *bus;
+    bool peer;                  /* on /run/systemd/private, not the bus */
+#endif
+} collect_services;
+
+G_LOCK_DEFINE_STATIC(collect_services);
+
+static void collect_service_entry_free(gpointer p)
+{
+    CollectServiceEntry *entry = p;
+
+    ga_collect_service_free(entry->svc);
+    g_free(entry);
+}
+
+static GACollectService *collect_service_new(const char *name)
+{
+    GACollectService *svc = g_new0(GACollectService, 1);
+
+    svc->name = g_strdup(name);
+    svc->restarts = -1;
+    svc->memory = -1;
+    return svc;
+}
+
+static GACollectService *collect_service_copy(const GACollectService *svc)
+{
+    GACollectService *copy = g_memdup(svc, sizeof(*svc));
+
+    copy->name = g_strdup(svc->name);
+    copy->load_state = g_strdup(svc->load_state);
+    copy->active_state = g_strdup(svc->active_state);
+    copy->sub_state = g_strdup(svc->sub_state);
+    return copy;
+}
+
+/*
+ * What systemd accepts in a unit name.  Without a '/' and a leading '.'
+ * or '-', the name of an init script is also a plain file in
+ * /etc/init.d that cannot pass for an option.
+ */
+static bool collect_service_name_valid(const char *name)
+{
+    size_t len = strlen(name);
+
+    if (!len || len > 255 || name[0] == '.' || name[0] == '-') {
+        return false;
+    }
+    return strspn(name, "abcdefghijklmnopqrstuvwxyz"
+                        "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                        "0123456789:-_.\\@") == len;
+}
+
+/* like sd_booted(): is systemd the init system? */
+static bool collect_systemd_booted(void)
+{
+    struct stat st;
+
+    return lstat("/run/systemd/system", &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+#ifdef GA_COLLECT_GDBUS
+
+static const char *const collect_unit_types[] = {
+    ".service", ".socket", ".target", ".device", ".mount", ".automount",
+    ".swap", ".timer", ".path", ".slice", ".scope", NULL
+};
+
+/* "sshd" means "sshd.service", as it does to systemctl */
+static char *collect_unit_name(const char *name)
+{
+    const char *const *type;
+
+    for (type = collect_unit_types; *type; type++) {
+        if (g_str_has_suffix(name, *type)) {
+            return g_strdup(name);
+        }
+    }
+    return g_strconcat(name, ".service", NULL);
+}
+
+/*
+ * systemd's private socket takes the calls of root without a dbus-daemon
+ * in between, and still works when that is not running; the system bus
+ * is the fallback.  systemd drops the private connections when it
+ * re-executes, so a closed connection is opened again.
+ */
+static GDBusConnection *collect_systemd_bus_locked(GError **errp)
+{
+    GDBusConnection *bus;
+    GError *err = NULL;
+
+    if (collect_services.bus) {
+        if (!g_dbus_connection_is_closed(collect_services.bus)) {
+            return collect_services.bus;
+        }
+        g_object_unref(collect_services.bus);
+        collect_services.bus = NULL;
+    }
+
+#if !GLIB_CHECK_VERSION(2, 36, 0)
+    g_type_init();
+#endif
+    bus = g_dbus_connection_new_for_address_sync(
+        "unix:path=/run/systemd/private",
+        G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT, NULL, NULL, &err);
+    if (bus) {
+        collect_services.peer = true;
+    } else {
+        g_debug("systemd private socket: %s", err->message);
+        g_error_free(err);
+        bus = g_bus_get_sync(G_BUS_TYPE_SYSTEM, NULL, errp);
+        if (!bus) {
+            return NULL;
+        }
+        /* the shared connection would exit() the agent with the bus */
+        g_dbus_connection_set_exit_on_close(bus, false);
+        collect_services.peer = false;
+    }
+    collect_services.bus = bus;
+    return bus;
+}
+
+static GVariant *collect_systemd_call(GDBusConnection *bus, const char *path,
+                                      const char *iface, const char *method,
+                                      GVariant *args, const char *reply_type,
+                                      GError **errp)
+{
+    return g_dbus_connection_call_sync(bus,
+        collect_services.peer ? NULL : "org.freedesktop.systemd1",
+        path, iface, method, args, G_VARIANT_TYPE(reply_type),
+        G_DBUS_CALL_FLAGS_NONE, COLLECT_SERVICE_TIMEOUT_MS, NULL, errp);
+}
+
+/* the properties of @iface on the unit object @path, as an a{sv} */
+static GVariant *collect_systemd_get_all(GDBusConnection *bus,
+                                         const char *path, const char *iface,
+                                         GError **errp)
+{
+    GVariant *reply, *props;
+
+    reply = collect_systemd_call(bus, path,
+                                 "org.freedesktop.DBus.Properties", "GetAll",
+                                 g_variant_new("(s)", iface), "(a{sv})",
+                                 errp);
+    if (!reply) {
+        return NULL;
+    }
+    props = g_variant_get_child_value(reply, 0);
+    g_variant_unref(reply);
+    return props;
+}
+
+/*
+ * LoadUnit() rather than GetUnit(), which fails for the units that are
+ * not loaded: those are reported inactive, or "not-found" when missing.
+ */
+static GACollectService *collect_service_systemd(GDBusConnection *bus,
+                                                 const char *name,
+                                                 GError **errp)
+{
+    GACollectService *svc = NULL;
+    GVariant *reply, *props;
+    char *unit, *path;
+    guint32 u32;
+    guint64 u64;
+
+    unit = collect_unit_name(name);
+    reply = collect_systemd_call(bus, "/org/freedesktop/systemd1",
+                                 "org.freedesktop.systemd1.Manager",
+                                 "LoadUnit", g_variant_new("(s)", unit),
+                                 "(o)", errp);
+    if (!reply) {
+        goto out;
+    }
+    g_variant_get(reply, "(o)", &path);
+    g_variant_unref(reply);
+
+    props = collect_systemd_get_all(bus, path,
+                                    "org.freedesktop.systemd1.Unit", errp);
+    if (!props) {
+        goto out_path;
+    }
+    svc = collect_service_new(name);
+    g_variant_lookup(props, "LoadState", "s", &svc->load_state);
+    g_variant_lookup(props, "ActiveState", "s", &svc->active_state);
+    g_variant_lookup(props, "SubState", "s", &svc->sub_state);
+    g_variant_unref(props);
+    if (!svc->load_state) {
+        svc->load_state = g_strdup("unknown");
+    }
+    if (!svc->active_state) {
+        svc->active_state = g_strdup("unknown");
+    }
+
+    if (!g_str_has_suffix(unit, ".service") ||
+        g_strcmp0(svc->load_state, "loaded")) {
+        goto out_path;
+    }
+    props = collect_systemd_get_all(bus, path,
+                                    "org.freedesktop.systemd1.Service", errp);
+    if (!props) {
+        ga_collect_service_free(svc);
+        svc = NULL;
+        goto out_path;
+    }
+    if (g_variant_lookup(props, "MainPID", "u", &u32)) {
+        svc->main_pid = u32;
+    }
+    /* systemd 235 and later */
+    if (g_variant_lookup(props, "NRestarts", "u", &u32)) {
+        svc->restarts = u32;
+    }
+    /* all ones without memory accounting */
+    if (g_variant_lookup(props, "MemoryCurrent", "t", &u64) &&
+        u64 != G_MAXUINT64) {
+        svc->memory = u64;
+    }
+    g_variant_unref(props);
+
+out_path:
+    g_free(path);
+out:
+    g_free(unit);
+    return svc;
+}
+
+#endif /* GA_COLLECT_GDBUS */
+
+/*
+ * Ask the init script with "service NAME status", never through a shell,
+ * and map the LSB exit status: 0 running, 1 and 2 dead though a pid or
+ * lock file is left, 3 not running.  systemctl, which "service" hands
+ * over to on systemd hosts, also answers 4 for a unit it does not know.
+ */
+static GACollectService *collect_service_sysv(const char *name)
+{
+    const char *argv[] = { "service", NULL, "status", NULL };
+    GACollectService *svc = collect_service_new(name);
+    GString *out = g_string_new(NULL);
+    char *script, *base, *pid;
+    int status;
+
+    base = g_str_has_suffix(name, ".service") ?
+           g_strndup(name, strlen(name) - strlen(".service")) :
+           g_strdup(name);
+    if (!collect_systemd_booted()) {
+        script = g_build_filename("/etc/init.d", base, NULL);
+        if (access(script, X_OK) < 0) {
+            svc->load_state = g_strdup("not-found");
+            svc->active_state = g_strdup("inactive");
+            svc->sub_state = g_strdup("dead");
+            g_free(script);
+            goto out;
+        }
+        g_free(script);
+    }
+
+    argv[1] = base;
+    status = collect_run(argv, 4096, COLLECT_SERVICE_TIMEOUT_MS, out, NULL);
+    if (status < 0 || !WIFEXITED(status)) {
+        svc->active_state = g_strdup("unknown");
+        goto out;
+    }
+    switch (WEXITSTATUS(status)) {
+    case 0:
+        svc->active_state = g_strdup("active");
+        svc->sub_state = g_strdup("running");
+        /* "sshd (pid  1234) is running..." */
+        pid = strstr(out->str, "pid");
+        if (pid) {
+            svc->main_pid = strtoll(pid + strcspn(pid, "0123456789\n"),
+                                    NULL, 10);
+        }
+        break;
+    case 1:
+    case 2:
+        svc->active_state = g_strdup("failed");
+        svc->sub_state = g_strdup("dead");
+        break;
+    case 3:
+        svc->active_state = g_strdup("inactive");
+        svc->sub_state = g_strdup("dead");
+        break;
+    case 4:
+        svc->load_state = g_strdup("not-found");
+        svc->active_state = g_strdup("inactive");
+        svc->sub_state = g_strdup("dead");
+        goto out;
+    default:
+        svc->active_state = g_strdup("unknown");
+        break;
+    }
+    svc->load_state = g_strdup("loaded");
+
+out:
+    if (!svc->load_state) {
+        svc->load_state = g_strdup("unknown");
+    }
+    g_string_free(out, true);
+    g_free(base);
+    return svc;
+}
+
+static GACollectService *collect_service_locked(const char *name,
+                                                GError **errp)
+{
+#ifdef GA_COLLECT_GDBUS
+    GDBusConnection *bus;
+    GACollectService *svc;
+    GError *err = NULL;
+    int tries = 2;
+
+    while (collect_systemd_booted() && tries--) {
+        bus = collect_systemd_bus_locked(&err);
+        if (!bus) {
+            g_debug("no D-Bus connection to systemd: %s", err->message);
+            g_error_free(err);
+            break;
+        }
+        svc = collect_service_systemd(bus, name, &err);
+        if (svc) {
+            return svc;
+        }
+        if (!tries || !g_dbus_connection_is_closed(bus)) {
+            g_propagate_error(errp, err);
+            return NULL;
+        }
+        g_error_free(err);
+        err = NULL;
+    }
+#endif
+    return collect_service_sysv(name);
+}
+
+/*
+ * The state of each of @units, a NULL terminated list of unit or init
+ * script names, in the same order.  An answer younger than
+ * COLLECT_SERVICE_TTL_US is served from the cache.
+ */
+GPtrArray *ga_collect_services(char **units, GError **errp)
+{
+    CollectServiceEntry *entry;
+    GACollectService *svc;
+    GPtrArray *services;
+    gint64 now;
+    char **unit;
+
+    if (g_strv_length(units) > COLLECT_SERVICES_MAX) {
+        g_set_error(errp, GA_COLLECT_ERROR, 0,
+                    "at most %d units can be asked for at once",
+                    COLLECT_SERVICES_MAX);
+        return NULL;
+    }
+    for (unit = units; *unit; unit++) {
+        if (!collect_service_name_valid(*unit)) {
+            g_set_error(errp, GA_COLLECT_ERROR, 0,
+                        "invalid unit name '%s'", *unit);
+            return NULL;
+        }
+    }
+
+    services = g_ptr_array_new_with_free_func(ga_collect_service_free);
+    G_LOCK(collect_services);
+    if (!collect_services.cache) {
+        collect_services.cache =
+            g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                  collect_service_entry_free);
+    }
+    for (unit = units; *unit; unit++) {
+        now = g_get_monotonic_time();
+        entry = g_hash_table_lookup(collect_services.cache, *unit);
+        if (entry && entry->expires > now) {
+            g_ptr_array_add(services, collect_service_copy(entry->svc));
+            continue;
+        }
+
+        svc = collect_service_locked(*unit, errp);
+        if (!svc) {
+            G_UNLOCK(collect_services);
+            g_ptr_array_free(services, true);
+            return NULL;
+        }
+        if (!entry) {
+            if (g_hash_table_size(collect_services.cache) >=
+                COLLECT_SERVICES_MAX) {
+                g_hash_table_remove_all(collect_services.cache);
+            }
+            entry = g_new0(CollectServiceEntry, 1);
+            g_hash_table_insert(collect_services.cache, g_strdup(*unit),
+                                entry);
+        } else {
+            ga_collect_service_free(entry->svc);
+        }
+        entry->svc = collect_service_copy(svc);
+        entry->expires = g_get_monotonic_time() + COLLECT_SERVICE_TTL_US;
+        g_ptr_array_add(services, svc);
+    }
+    G_UNLOCK(collect_services);
+
+    return services;
+}
+
+/* ask again next time, however recent the answers are */
+void ga_collect_services_invalidate(void)
+{
+    G_LOCK(collect_services);
+    if (collect_services.cache) {
+        g_hash_table_remove_all(collect_services.cache);
+    }
+    G_UNLOCK(collect_services);
+}
+
+void ga_collect_services_cleanup(void)
+{
+    G_LOCK(collect_services);
+    if (collect_services.cache) {
+        g_hash_table_destroy(collect_services.cache);
+        collect_services.cache = NULL;
+    }
+#ifdef GA_COLLECT_GDBUS
+    if (collect_services.bus) {
+        g_object_unref(collect_services.bus);
+        collect_services.bus = NULL;
+    }
+#endif
+    G_UNLOCK(collect_services);
+}
+
+/* Packages */
+
+#define COLLECT_PACKAGES_REMOVED_MAX 4096
+#define COLLECT_RPM_TIMEOUT_MS 60000
+#define COLLECT_RPM_OUTPUT_MAX (16 * 1024 * 1024)
+#define COLLECT_DPKG_STATUS "/var/lib/dpkg/status"
+
+typedef struct CollectPackage {
+    GACollectPackage pkg;
+    guint32 generation;         /* the one it appeared, or went away, in */
+} CollectPackage;
+
+/* sqlite from rpm 4.16, ndb on SUSE, Berkeley DB before */
+static const char *const collect_rpmdb_files[] = {
+    "/var/lib/rpm/rpmdb.sqlite", "/usr/lib/sysimage/rpm/rpmdb.sqlite",
+    "/var/lib/rpm/Packages.db", "/usr/lib/sysimage/rpm/Packages.db",
+    "/var/lib/rpm/Packages", NULL
+};
+
+/*
+ * The installed packages, read again only once the database file has
+ * changed.  Every package and every removal is tagged with the generation
+ * it was seen in, so a caller that passes the token of an earlier answer
+ * only gets the differences.  The token also carries when this inventory
+ * was first built, so the tokens of a previous agent never match.
+ */
+static struct {
+    GACollectPackageManager manager;
+    const char *db;             /* NULL until found */
+    struct stat db_st;
+    struct stat wal_st;         /* of the sqlite write-ahead log, if any */
+    bool valid;
+    guint64 instance;
+    guint32 generation;
+    guint32 horizon;            /* the oldest generation a token can be of */
+    GHashTable *packages;       /* "name\tversion\tarch" -> CollectPackage */
+    GQueue removed;             /* CollectPackage, oldest first */
+} collect_packages;
+
+G_LOCK_DEFINE_STATIC(collect_packages);
+
+static void collect_package_entry_free(gpointer p)
+{
+    CollectPackage *entry = p;
+
+    g_free(entry->pkg.name);
+    g_free(entry->pkg.version);
+    g_free(entry->pkg.arch);
+    g_free(entry);
+}
+
+static GACollectPackage *collect_package_copy(const GACollectPackage *pkg)
+{
+    GACollectPackage *copy = g_new(GACollectPackage, 1);
+
+    copy->name = g_strdup(pkg->name);
+    copy->version = g_strdup(pkg->version);
+    copy->arch = g_strdup(pkg->arch);
+    return copy;
+}
+
+/* takes the strings; several versions of a package can be installed */
+static void collect_packages_insert(GHashTable *table, char *name,
+                                    char *version, char *arch)
+{
+    CollectPackage *entry = g_new0(CollectPackage, 1);
+
+    entry->pkg.name = name;
+    entry->pkg.version = version;
+    entry->pkg.arch = arch;
+    g_hash_table_replace(table, g_strjoin("\t", name, version, arch, NULL),
+                         entry);
+}
+
+static bool collect_packages_read_rpm(GHashTable *table, GError **errp)
+{
+    const char *argv[] = {
+        "rpm", "-qa", "--qf",
+        "%{NAME}\t%|EPOCH?{%{EPOCH}:}:{}|%{VERSION}-%{RELEASE}\t%{ARCH}\n",
+        NULL
+    };
+    GString *out = g_string_new(NULL);
+    char *line, *end, **fields;
+    int status;
+
+    status = collect_run(argv, COLLECT_RPM_OUTPUT_MAX, COLLECT_RPM_TIMEOUT_MS,
+                         out, NULL);
+    if (status < 0 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+        g_set_error(errp, GA_COLLECT_ERROR, 0, "failed to query rpm");
+        g_string_free(out, true);
+        return false;
+    }
+
+    for (line = out->str; *line; line = end) {
+        end = strchr(line, '\n');
+        if (!end) {
+            /* cut short at COLLECT_RPM_OUTPUT_MAX */
+            break;
+        }
+        *end++ = '\0';
+        fields = g_strsplit(line, "\t", 3);
+        if (g_strv_length(fields) == 3) {
+            collect_packages_insert(table, fields[0], fields[1], fields[2]);
+            g_free(fields);
+        } else {
+            g_strfreev(fields);
+        }
+    }
+    g_string_free(out, true);
+    return true;
+}
+
+/* the paragraphs of dpkg's status file whose Status ends in "installed" */
+static bool collect_packages_read_dpkg(GHashTable *table, GError **errp)
+{
+    char *contents, *line, *end, *name = NULL, *version = NULL, *arch = NULL;
+    bool installed = false;
+    GError *err = NULL;
+
+    if (!g_file_get_contents(COLLECT_DPKG_STATUS, &contents, NULL, &err)) {
+        g_propagate_error(errp, err);
+        return false;
+    }
+
+    for (line = contents; ; line = end) {
+        if (line) {
+            end = strchr(line, '\n');
+            if (end) {
+                *end++ = '\0';
+            }
+        }
+        /* a blank line, or the end of the file, ends a paragraph */
+        if (!line || !*line) {
+            if (installed && name && version) {
+                collect_packages_insert(table, name, version,
+                                        arch ? arch : g_strdup(""));
+                name = version = arch = NULL;
+            }
+            g_free(name);
+            g_free(version);
+            g_free(arch);
+            name = version = arch = NULL;
+            installed = false;
+            if (!line) {
+                break;
+            }
+        } else if (g_str_has_prefix(line, "Package:")) {
+            g_free(name);
+            name = g_strdup(g_strstrip(line + strlen("Package:")));
+        } else if (g_str_has_prefix(line, "Version:")) {
+            g_free(version);
+            version = g_strdup(g_strstrip(line + strlen("Version:")));
+        } else if (g_str_has_prefix(line, "Architecture:")) {
+            g_free(arch);
+            arch = g_strdup(g_strstrip(line + strlen("Architecture:")));
+        } else if (g_str_has_prefix(line, "Status:")) {
+            installed = g_str_has_suffix(g_strchomp(line), " installed");
+        }
+    }
+    g_free(contents);
+    return true;
+}
+
+static bool collect_packages_find_db(void)
+{
+    const char *const *f;
+
+    for (f = collect_rpmdb_files; *f; f++) {
+        if (access(*f, F_OK) == 0) {
+            collect_packages.manager = GA_COLLECT_PACKAGES_RPM;
+            collect_packages.db = *f;
+            return true;
+        }
+    }
+    if (access(COLLECT_DPKG_STATUS, F_OK) == 0) {
+        collect_packages.manager = GA_COLLECT_PACKAGES_DPKG;
+        collect_packages.db = COLLECT_DPKG_STATUS;
+        return true;
+    }
+    return false;
+}
+
+/* sqlite writes to the -wal file and only later to the database itself */
+static void collect_packages_stat(struct stat *db_st, struct stat *wal_st)
+{
+    char *wal = g_strconcat(collect_packages.db, "-wal", NULL);
+
+    if (stat(collect_packages.db, db_st) < 0) {
+        memset(db_st, 0, sizeof(*db_st));
+    }
+    if (stat(wal, wal_st) < 0) {
+        memset(wal_st, 0, sizeof(*wal_st));
+    }
+    g_free(wal);
+}
+
+static bool collect_stat_changed(const struct stat *a, const struct stat *b)
+{
+    return a->st_ino != b->st_ino || a->st_size != b->st_size ||
+           a->st_mtim.tv_sec != b->st_mtim.tv_sec ||
+           a->st_mtim.tv_nsec != b->st_mtim.tv_nsec;
+}
+
+/* tag what came and went since the last read with a new generation */
+static void collect_packages_diff_locked(GHashTable *table)
+{
+    guint32 generation = collect_packages.generation + 1;
+    CollectPackage *entry, *old;
+    GHashTableIter iter;
+    gpointer key;
+    bool changed = false;
+
+    g_hash_table_iter_init(&iter, table);
+    while (g_hash_table_iter_next(&iter, &key, (gpointer *)&entry)) {
+        old = g_hash_table_lookup(collect_packages.packages, key);
+        entry->generation = old ? old->generation : generation;
+        changed |= !old;
+    }
+
+    g_hash_table_iter_init(&iter, collect_packages.packages);
+    while (g_hash_table_iter_next(&iter, &key, (gpointer *)&old)) {
+        if (!g_hash_table_lookup(table, key)) {
+            g_hash_table_iter_steal(&iter);
+            g_free(key);
+            old->generation = generation;
+            g_queue_push_tail(&collect_packages.removed, old);
+            changed = true;
+        }
+    }
+
+    if (changed) {
+        collect_packages.generation = generation;
+    }
+    while (collect_packages.removed.length > COLLECT_PACKAGES_REMOVED_MAX) {
+        old = g_queue_pop_head(&collect_packages.removed);
+        collect_packages.horizon = old->generation;
+        collect_package_entry_free(old);
+    }
+}
+
+static bool collect_packages_refresh_locked(GError **errp)
+{
+    struct stat db_st, wal_st;
+    GHashTableIter iter;
+    CollectPackage *entry;
+    GHashTable *table;
+    bool ok;
+
+    if (!collect_packages.db && !collect_packages_find_db()) {
+        g_set_error(errp, GA_COLLECT_ERROR, 0,
+                    "no rpm or dpkg database found");
+        return false;
+    }
+    /* before reading, so that no change goes unnoticed */
+    collect_packages_stat(&db_st, &wal_st);
+    if (collect_packages.valid &&
+        !collect_stat_changed(&db_st, &collect_packages.db_st) &&
+        !collect_stat_changed(&wal_st, &collect_packages.wal_st)) {
+        return true;
+    }
+
+    table = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                  collect_package_entry_free);
+    if (collect_packages.manager == GA_COLLECT_PACKAGES_RPM) {
+        ok = collect_packages_read_rpm(table, errp);
+    } else {
+        ok = collect_packages_read_dpkg(table, errp);
+    }
+    if (!ok) {
+        g_hash_table_destroy(table);
+        return false;
+    }
+
+    if (collect_packages.packages) {
+        collect_packages_diff_locked(table);
+        g_hash_table_destroy(collect_packages.packages);
+    } else {
+        collect_packages.instance = g_get_real_time();
+        collect_packages.generation = 1;
+        collect_packages.horizon = 1;
+        g_hash_table_iter_init(&iter, table);
+        while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&entry)) {
+            entry->generation = 1;
+        }
+    }
+    collect_packages.packages = table;
+    collect_packages.db_st = db_st;
+    collect_packages.wal_st = wal_st;
+    collect_packages.valid = true;
+    return true;
+}
+
+/*
+ * The installed packages, or with the @since token of an earlier answer
+ * only those installed and removed after it.  All of them are returned,
+ * with @full set, when the token is too old or not of this agent.
+ */
+bool ga_collect_packages(const char *since, GACollectPackages *pk,
+                         GError **errp)
+{
+    CollectPackage *entry;
+    GHashTableIter iter;
+    GList *l;
+    guint64 instance = 0;
+    guint32 generation = 0;
+    int end = 0;
+
+    memset(pk, 0, sizeof(*pk));
+    G_LOCK(collect_packages);
+    if (!collect_packages_refresh_locked(errp)) {
+        G_UNLOCK(collect_packages);
+        return false;
+    }
+
+    pk->full = !since ||
+        sscanf(since, "%" G_GINT64_MODIFIER "x:%u%n",
+               &instance, &generation, &end) != 2 || since[end] ||
+        instance != collect_packages.instance ||
+        generation < collect_packages.horizon ||
+        generation > collect_packages.generation;
+    pk->manager = collect_packages.manager;
+    pk->token = g_strdup_printf("%" G_GINT64_MODIFIER "x:%u",
+                                collect_packages.instance,
+                                collect_packages.generation);
+
+    pk->installed = g_ptr_array_new_with_free_func(ga_collect_package_free);
+    g_hash_table_iter_init(&iter, collect_packages.packages);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&entry)) {
+        if (pk->full || entry->generation > generation) {
+            g_ptr_array_add(pk->installed, collect_package_copy(&entry->pkg));
+        }
+    }
+    pk->removed = g_ptr_array_new_with_free_func(ga_collect_package_free);
+    for (l = collect_packages.removed.head; l && !pk->full; l = l->next) {
+        entry = l->data;
+        if (entry->generation > generation) {
+            g_ptr_array_add(pk->removed, collect_package_copy(&entry->pkg));
+        }
+    }
+    G_UNLOCK(collect_packages);
+
+    g_ptr_array_sort(pk->installed, ga_collect_package_compare);
+    g_ptr_array_sort(pk->removed, ga_collect_package_compare);
+    return true;
+}
+
+/* look for the database and read it again next time, changed or not */
+void ga_collect_packages_invalidate(void)
+{
+    G_LOCK(collect_packages);
+    collect_packages.db = NULL;
+    collect_packages.valid = false;
+    G_UNLOCK(collect_packages);
+}
+
+void ga_collect_packages_cleanup(void)
+{
+    CollectPackage *entry;
+
+    G_LOCK(collect_packages);
+    if (collect_packages.packages) {
+        g_hash_table_destroy(collect_packages.packages);
+        collect_packages.packages = NULL;
+    }
+    while ((entry = g_queue_pop_head(&collect_packages.removed))) {
+        collect_package_entry_free(entry);
+    }
+    collect_packages.db = NULL;
+    collect_packages.valid = false;
+    G_UNLOCK(collect_packages);
+}
+
+/* Processes */
+
+#define COLLECT_PROC_CPU_THRESHOLD_MS 100
+#define COLLECT_PROC_RSS_THRESHOLD (1024 * 1024)
+#define COLLECT_PROC_EXITS_MAX 4096
+#define COLLECT_PROC_PENDING_MAX 65536
+#define COLLECT_PROC_EVENTS_RCVBUF (4 * 1024 * 1024)
+/* threads a scan reads /proc with at most, the calling one included */
+#define COLLECT_PROC_SCAN_THREADS_MAX 8
+/* fewer pids than this per thread are not worth starting one for */
+#define COLLECT_PROC_SCAN_THREAD_MIN 2048
+
+/*
+ * Per-pid CPU times of the previous scan, used to compute the deltas, and
+ * what was last reported of the process to the callers that only want
+ * the changes: the generation it changed in, and its values then.
+ */
+typedef struct CollectProcSample {
+    uint64_t starttime;
+    uint64_t utime;             /* clock ticks */
+    uint64_t stime;             /* clock ticks */
+    unsigned int generation;
+    unsigned int changed;
+    uint64_t reported_cpu;      /* ms */
+    uint64_t reported_rss;
+    char reported_state;
+    char comm[64];
+} CollectProcSample;
+
+typedef struct CollectProcExit {
+    GACollectProcExit rec;
+    unsigned int generation;
+} CollectProcExit;
+
+/* a process as a scanning thread read it, before it is merged */
+typedef struct CollectProcRead {
+    GACollectProcess proc;
+    CollectProcSample cur;
+} CollectProcRead;
+
+/* one thread's share of the pids of a scan, and what it read of them */
+typedef struct CollectProcScan {
+    int proc_fd;                /* /proc */
+    const int *pids;
+    size_t npids;
+    GArray *reads;              /* CollectProcRead */
+    pthread_t thread;
+    bool started;
+} CollectProcScan;
+
+/*
+ * Every scan is a generation.  A caller that passes the token of an
+ * earlier answer to ga_collect_process_changes() gets the processes that
+ * appeared or changed by more than the thresholds since, and the exits.
+ * Those come from the proc connector when the agent may listen to it:
+ * the kernel then reports every process that exits, those that came and
+ * went between two scans included.  Its events are read as they arrive,
+ * on the main loop, so that the name of a short lived process can still
+ * be found in /proc.  Without it, the exits are those of the processes a
+ * scan saw and the next one did not.
+ */
+static struct {
+    GHashTable *samples;
+    unsigned int generation;
+    guint64 instance;
+    unsigned int horizon;       /* the oldest generation a token can be of */
+    GQueue exits;               /* CollectProcExit, oldest first */
+    bool events_opened;
+    int events_fd;              /* -1 without the proc connector */
+    guint events_watch;
+    unsigned int events_lost;   /* the generation events were last lost in */
+    GHashTable *pending;        /* pid -> comm of processes not scanned yet */
+} collect_procs = { .events_fd = -1 };
+
+G_LOCK_DEFINE_STATIC(collect_procs);
+
+uint64_t ga_collect_ticks_to_ms(uint64_t ticks)
+{
+    static long clk_tck;
+
+    if (!clk_tck) {
+        clk_tck = sysconf(_SC_CLK_TCK);
+        if (clk_tck <= 0) {
+            clk_tck = 100;
+        }
+    }
+    return ticks * 1000 / clk_tck;
+}
+
+/*
+ * Parse the contents of /proc/<pid>/stat.  The command name is enclosed in
+ * parentheses and may itself contain spaces and parentheses, so the fixed
+ * fields are located from the last ')'.
+ */
+static bool collect_proc_parse_stat(char *buf, GACollectProcess *proc,
+                                    CollectProcSample *sample)
+{
+    char *comm, *end;
+    int64_t rss;
+
+    comm = strchr(buf, '(');
+    end = strrchr(buf, ')');
+    if (!comm || !end || end < comm) {
+        return false;
+    }
+    *end = '\0';
+
+    if (sscanf(buf, "%" SCNd64, &proc->pid) != 1 ||
+        sscanf(end + 1, " %c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u"
+               " %" SCNu64 " %" SCNu64 " %*d %*d %*d %*d %" SCNd64
+               " %*d %" SCNu64 " %*u %" SCNd64,
+               &proc->state, &sample->utime, &sample->stime, &proc->threads,
+               &sample->starttime, &rss) != 6) {
+        return false;
+    }
+    g_strlcpy(proc->comm, comm + 1, sizeof(proc->comm));
+    proc->rss = rss > 0 ? (uint64_t)rss * getpagesize() : 0;
+    proc->utime = ga_collect_ticks_to_ms(sample->utime);
+    proc->stime = ga_collect_ticks_to_ms(sample->stime);
+    return true;
+}
+
+/* the exit of @pid, with its wait status if known, in @generation */
+static void collect_proc_exit_locked(int64_t pid, const char *comm,
+                                     bool has_status, int status,
+                                     unsigned int generation)
+{
+    CollectProcExit *e = g_new0(CollectProcExit, 1);
+
+    e->rec.pid = pid;
+    g_strlcpy(e->rec.comm, comm, sizeof(e->rec.comm));
+    e->rec.has_status = has_status;
+    if (has_status) {
+        e->rec.exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+        e->rec.signal = WIFSIGNALED(status) ? WTERMSIG(status) : 0;
+    }
+    e->generation = generation;
+    g_queue_push_tail(&collect_procs.exits, e);
+    while (collect_procs.exits.length > COLLECT_PROC_EXITS_MAX) {
+        e = g_queue_pop_head(&collect_procs.exits);
+        collect_procs.horizon = e->generation;
+        g_free(e);
+    }
+}
+
+static gboolean collect_proc_sample_expired(gpointer key, gpointer value,
+                                            gpointer opaque)
+{
+    CollectProcSample *sample = value;
+
+    if (sample->generation == GPOINTER_TO_UINT(opaque)) {
+        return false;
+    }
+    /* the proc connector reported it already */
+    if (collect_procs.events_fd == -1) {
+        collect_proc_exit_locked(GPOINTER_TO_INT(key), sample->comm, false, 0,
+                                 sample->generation + 1);
+    }
+    return true;
+}
+
+/* whether @proc changed enough since it was last reported */
+static bool collect_proc_changed(const CollectProcSample *sample,
+                                 const GACollectProcess *proc)
+{
+    uint64_t cpu = proc->utime + proc->stime;
+
+    return cpu - sample->reported_cpu >= COLLECT_PROC_CPU_THRESHOLD_MS ||
+           (proc->rss > sample->reported_rss ?
+            proc->rss - sample->reported_rss :
+            sample->reported_rss - proc->rss) >= COLLECT_PROC_RSS_THRESHOLD ||
+           proc->state != sample->reported_state;
+}
+
+/* read /proc/<pid>/stat of a share of the pids, without the lock */
+static void *collect_proc_scan_thread(void *opaque)
+{
+    CollectProcScan *scan = opaque;
+    CollectProcRead r;
+    char path[64], buf[1024];
+    ssize_t len;
+    size_t i;
+    int fd;
+
+    for (i = 0; i < scan->npids; i++) {
+        snprintf(path, sizeof(path), "%d/stat", scan->pids[i]);
+        fd = openat(scan->proc_fd, path, O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            /* the process exited while we were scanning */
+            continue;
+        }
+        len = pread(fd, buf, sizeof(buf) - 1, 0);
+        close(fd);
+        if (len <= 0) {
+            continue;
+        }
+        buf[len] = '\0';
+        memset(&r, 0, sizeof(r));
+        if (collect_proc_parse_stat(buf, &r.proc, &r.cur)) {
+            g_array_append_val(scan->reads, r);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Read the stat file of each of @pids, on up to
+ * COLLECT_PROC_SCAN_THREADS_MAX threads for a large number of processes.
+ * The pids are split in runs, one per thread, and what the threads read
+ * comes back in the same order.
+ */
+static CollectProcScan *collect_proc_scan(int proc_fd, const int *pids,
+                                          size_t npids, unsigned int *nscans)
+{
+    CollectProcScan *scans;
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int n, i;
+
+    n = MIN(npids / COLLECT_PROC_SCAN_THREAD_MIN,
+            MIN(COLLECT_PROC_SCAN_THREADS_MAX, MAX(ncpus, 1)));
+    n = MAX(n, 1);
+    scans = g_new0(CollectProcScan, n);
+    for (i = 0; i < n; i++) {
+        scans[i].proc_fd = proc_fd;
+        scans[i].pids = pids + npids * i / n;
+        scans[i].npids = npids * (i + 1) / n - npids * i / n;
+        scans[i].reads = g_array_sized_new(false, false,
+                                           sizeof(CollectProcRead),
+                                           scans[i].npids);
+    }
+    /* the first run is left to this thread, as are those no thread was
+     * started for
+     */
+    for (i = 1; i < n; i++) {
+        scans[i].started = pthread_create(&scans[i].thread, NULL,
+                                          collect_proc_scan_thread,
+                                          &scans[i]) == 0;
+    }
+    for (i = 0; i < n; i++) {
+        if (i == 0 || !scans[i].started) {
+            collect_proc_scan_thread(&scans[i]);
+        }
+    }
+    for (i = 1; i < n; i++) {
+        if (scans[i].started) {
+            pthread_join(scans[i].thread, NULL);
+        }
+    }
+    *nscans = n;
+    return scans;
+}
+
+/*
+ * Compute the CPU time deltas of a process read by a scan against the
+ * sample kept from the previous scan, which it then replaces.
+ */
+static void collect_proc_merge_locked(CollectProcRead *r, bool first)
+{
+    GACollectProcess *proc = &r->proc;
+    CollectProcSample *cur = &r->cur, *prev;
+    bool known;
+
+    prev = g_hash_table_lookup(collect_procs.samples,
+                               GINT_TO_POINTER(proc->pid));
+    /* a new or recycled pid consumed all its CPU time since then */
+    known = prev && prev->starttime == cur->starttime;
+    if (!first) {
+        proc->has_delta = true;
+        proc->utime_delta = ga_collect_ticks_to_ms(
+            cur->utime - (known ? prev->utime : 0));
+        proc->stime_delta = ga_collect_ticks_to_ms(
+            cur->stime - (known ? prev->stime : 0));
+    }
+    if (!prev) {
+        prev = g_new0(CollectProcSample, 1);
+        g_hash_table_insert(collect_procs.samples,
+                            GINT_TO_POINTER(proc->pid), prev);
+    }
+    if (!known || collect_proc_changed(prev, proc)) {
+        cur->changed = collect_procs.generation;
+        cur->reported_cpu = proc->utime + proc->stime;
+        cur->reported_rss = proc->rss;
+        cur->reported_state = proc->state;
+    } else {
+        cur->changed = prev->changed;
+        cur->reported_cpu = prev->reported_cpu;
+        cur->reported_rss = prev->reported_rss;
+        cur->reported_state = prev->reported_state;
+    }
+    g_strlcpy(cur->comm, proc->comm, sizeof(cur->comm));
+    if (collect_procs.pending) {
+        g_hash_table_remove(collect_procs.pending,
+                            GINT_TO_POINTER(proc->pid));
+    }
+    *prev = *cur;
+    prev->generation = collect_procs.generation;
+}
+
+/*
+ * Read all processes from /proc, one open and one read per process, on
+ * several threads when there are many.  CPU time deltas are computed
+ * against the samples kept from the previous scan, which are then
+ * replaced by the current ones; processes that exited meanwhile are
+ * dropped from the cache.
+ */
+static GArray *collect_processes_locked(GError **errp)
+{
+    GArray *procs, *pids;
+    CollectProcScan *scans;
+    CollectProcRead *r;
+    struct dirent *de;
+    DIR *dir;
+    unsigned int nscans, i;
+    bool first;
+    guint j;
+    int pid;
+
+    dir = opendir("/proc");
+    if (!dir) {
+        g_set_error(errp, GA_COLLECT_ERROR, errno,
+                    "failed to open /proc: %s", g_strerror(errno));
+        return NULL;
+    }
+
+    if (!collect_procs.samples) {
+        collect_procs.samples = g_hash_table_new_full(g_direct_hash,
+                                                      g_direct_equal,
+                                                      NULL, g_free);
+        collect_procs.instance = g_get_real_time();
+        collect_procs.horizon = 1;
+    }
+    first = collect_procs.generation == 0;
+    collect_procs.generation++;
+
+    pids = g_array_new(false, false, sizeof(int));
+    while ((de = readdir(dir)) != NULL) {
+        if (g_ascii_isdigit(de->d_name[0])) {
+            pid = atoi(de->d_name);
+            g_array_append_val(pids, pid);
+        }
+    }
+    scans = collect_proc_scan(dirfd(dir), (int *)pids->data, pids->len,
+                              &nscans);
+    closedir(dir);
+
+    procs = g_array_sized_new(false, false, sizeof(GACollectProcess),
+                              pids->len);
+    for (i = 0; i < nscans; i++) {
+        for (j = 0; j < scans[i].reads->len; j++) {
+            r = &g_array_index(scans[i].reads, CollectProcRead, j);
+            collect_proc_merge_locked(r, first);
+            g_array_append_val(procs, r->proc);
+        }
+        g_array_free(scans[i].reads, true);
+    }
+    g_free(scans);
+    g_array_free(pids, true);
+
+    g_hash_table_foreach_remove(collect_procs.samples,
+                                collect_proc_sample_expired,
+                                GUINT_TO_POINTER(collect_procs.generation));
+    return procs;
+}
+
+GArray *ga_collect_processes(GError **errp)
+{
+    GArray *procs;
+
+    G_LOCK(collect_procs);
+    procs = collect_processes_locked(errp);
+    G_UNLOCK(collect_procs);
+    return procs;
+}
+
+/* remember the name of a process that may exit before the next scan */
+static void collect_proc_event_comm(int pid)
+{
+    char path[64], buf[64];
+    ssize_t len;
+
+    snprintf(path, sizeof(path), "/proc/%d/comm", pid);
+    len = collect_read_proc(path, buf, sizeof(buf), NULL);
+    if (len <= 0) {
+        return;
+    }
+    if (g_hash_table_size(collect_procs.pending) >= COLLECT_PROC_PENDING_MAX) {
+        /* exits were lost, these will never be removed */
+        g_hash_table_remove_all(collect_procs.pending);
+    }
+    g_hash_table_replace(collect_procs.pending, GINT_TO_POINTER(pid),
+                         g_strdup(g_strchomp(buf)));
+}
+
+static void collect_proc_event(const struct proc_event *ev)
+{
+    CollectProcSample *sample;
+    const char *comm;
+    int pid;
+
+    switch (ev->what) {
+    case PROC_EVENT_FORK:
+        /* threads are not processes */
+        if (ev->event_data.fork.child_pid == ev->event_data.fork.child_tgid) {
+            collect_proc_event_comm(ev->event_data.fork.child_pid);
+        }
+        break;
+    case PROC_EVENT_EXEC:
+        collect_proc_event_comm(ev->event_data.exec.process_pid);
+        break;
+    case PROC_EVENT_EXIT:
+        pid = ev->event_data.exit.process_pid;
+        if (pid != ev->event_data.exit.process_tgid) {
+            break;
+        }
+        sample = g_hash_table_lookup(collect_procs.samples,
+                                     GINT_TO_POINTER(pid));
+        comm = g_hash_table_lookup(collect_procs.pending,
+                                   GINT_TO_POINTER(pid));
+        if (!comm) {
+            comm = sample ? sample->comm : "";
+        }
+        /* the next scan is the first not to see it */
+        collect_proc_exit_locked(pid, comm, true,
+                                 ev->event_data.exit.exit_code,
+                                 collect_procs.generation + 1);
+        g_hash_table_remove(collect_procs.pending, GINT_TO_POINTER(pid));
+        break;
+    default:
+        break;
+    }
+}
+
+/* with the lock held */
+static void collect_proc_events_read(void)
+{
+    char buf[4096] __attribute__((aligned(NLMSG_ALIGNTO)));
+    struct nlmsghdr *nlh;
+    struct cn_msg *msg;
+    ssize_t len;
+
+    for (;;) {
+        len = recv(collect_procs.events_fd, buf, sizeof(buf), 0);
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+        if (len < 0 && errno == ENOBUFS) {
+            collect_procs.events_lost = collect_procs.generation + 1;
+            continue;
+        }
+        if (len <= 0) {
+            break;
+        }
+        for (nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, len);
+             nlh = NLMSG_NEXT(nlh, len)) {
+            msg = NLMSG_DATA(nlh);
+            if (nlh->nlmsg_type != NLMSG_DONE ||
+                nlh->nlmsg_len < NLMSG_LENGTH(sizeof(*msg) +
+                                              sizeof(struct proc_event)) ||
+                msg->id.idx != CN_IDX_PROC || msg->id.val != CN_VAL_PROC) {
+                continue;
+            }
+            collect_proc_event((const struct proc_event *)msg->data);
+        }
+    }
+}
+
+static gboolean collect_proc_events_cb(GIOChannel *chan, GIOCondition cond,
+                                       gpointer opaque)
+{
+    G_LOCK(collect_procs);
+    collect_proc_events_read();
+    G_UNLOCK(collect_procs);
+    return true;
+}
+
+static bool collect_proc_events_send(int fd, enum proc_cn_mcast_op op)
+{
+    struct {
+        struct nlmsghdr nlh;
+        struct cn_msg msg;
+        enum proc_cn_mcast_op op;
+    } __attribute__((packed)) req;
+
+    memset(&req, 0, sizeof(req));
+    req.nlh.nlmsg_len = sizeof(req);
+    req.nlh.nlmsg_type = NLMSG_DONE;
+    req.nlh.nlmsg_pid = getpid();
+    req.msg.id.idx = CN_IDX_PROC;
+    req.msg.id.val = CN_VAL_PROC;
+    req.msg.len = sizeof(req.op);
+    req.op = op;
+    return send(fd, &req, sizeof(req), 0) == sizeof(req);
+}
+
+/*
+ * Listen to the proc connector, which takes CAP_NET_ADMIN.  The large
+ * receive buffer holds the events of a burst of short lived processes
+ * until the main loop gets to them.
+ */
+static void collect_proc_events_open_locked(void)
+{
+    struct sockaddr_nl addr = {
+        .nl_family = AF_NETLINK,
+        .nl_groups = CN_IDX_PROC,
+    };
+    int size = COLLECT_PROC_EVENTS_RCVBUF;
+    GIOChannel *chan;
+    int fd;
+
+    collect_procs.events_opened = true;
+    fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK,
+                NETLINK_CONNECTOR);
+    if (fd == -1) {
+        g_debug("no proc connector: %s", g_strerror(errno));
+        return;
+    }
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        !collect_proc_events_send(fd, PROC_CN_MCAST_LISTEN)) {
+        g_debug("cannot listen to the proc connector: %s",
+                g_strerror(errno));
+        close(fd);
+        return;
+    }
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size))) {
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    }
+    collect_procs.events_fd = fd;
+    collect_procs.pending = g_hash_table_new_full(g_direct_hash,
+                                                  g_direct_equal,
+                                                  NULL, g_free);
+    chan = g_io_channel_unix_new(fd);
+    collect_procs.events_watch = g_io_add_watch(chan, G_IO_IN,
+                                                collect_proc_events_cb,
+                                                NULL);
+    g_io_channel_unref(chan);
+}
+
+static gint collect_proc_exit_cmp(gconstpointer a, gconstpointer b)
+{
+    int64_t pa = ((const GACollectProcExit *)a)->pid;
+    int64_t pb = ((const GACollectProcExit *)b)->pid;
+
+    return pa < pb ? -1 : pa > pb;
+}
+
+/*
+ * The processes, or with the @since token of an earlier answer only those
+ * that appeared or changed since and the exits since.  All of them are
+ * returned, with @full set, when the token is too old or not of this
+ * agent.  The first call starts listening to the proc connector.
+ */
+bool ga_collect_process_changes(const char *since,
+                                GACollectProcChanges *ch, GError **errp)
+{
+    CollectProcSample *sample;
+    CollectProcExit *e;
+    GACollectProcess *proc;
+    GArray *procs;
+    GList *l;
+    guint64 instance = 0;
+    unsigned int generation = 0;
+    int end = 0;
+    guint i;
+
+    memset(ch, 0, sizeof(*ch));
+    G_LOCK(collect_procs);
+    if (!collect_procs.events_opened) {
+        collect_proc_events_open_locked();
+    }
+    if (collect_procs.events_fd != -1) {
+        collect_proc_events_read();
+    }
+    procs = collect_processes_locked(errp);
+    if (!procs) {
+        G_UNLOCK(collect_procs);
+        return false;
+    }
+
+    ch->full = !since ||
+        sscanf(since, "%" G_GINT64_MODIFIER "x:%u%n",
+               &instance, &generation, &end) != 2 || since[end] ||
+        instance != collect_procs.instance ||
+        generation < collect_procs.horizon ||
+        generation >= collect_procs.generation;
+    ch->token = g_strdup_printf("%" G_GINT64_MODIFIER "x:%u",
+                                collect_procs.instance,
+                                collect_procs.generation);
+    ch->exits_complete = collect_procs.events_fd != -1 && !ch->full &&
+                         collect_procs.events_lost <= generation;
+
+    ch->procs = g_array_new(false, false, sizeof(GACollectProcess));
+    for (i = 0; i < procs->len; i++) {
+        proc = &g_array_index(procs, GACollectProcess, i);
+        sample = g_hash_table_lookup(collect_procs.samples,
+                                     GINT_TO_POINTER(proc->pid));
+        if (ch->full || (sample && sample->changed > generation)) {
+            g_array_append_val(ch->procs, *proc);
+        }
+    }
+    ch->exits = g_array_new(false, false, sizeof(GACollectProcExit));
+    for (l = collect_procs.exits.head; l && !ch->full; l = l->next) {
+        e = l->data;
+        if (e->generation > generation) {
+            g_array_append_val(ch->exits, e->rec);
+        }
+    }
+    G_UNLOCK(collect_procs);
+
+    g_array_free(procs, true);
+    g_array_sort(ch->exits, collect_proc_exit_cmp);
+    return true;
+}
+
+void ga_collect_process_changes_clear(GACollectProcChanges *ch)
+{
+    g_free(ch->token);
+    if (ch->procs) {
+        g_array_free(ch->procs, true);
+    }
+    if (ch->exits) {
+        g_array_free(ch->exits, true);
+    }
+}
+
+static uint64_t collect_proc_cpu(const GACollectProcess *proc)
+{
+    if (proc->has_delta) {
+        return proc->utime_delta + proc->stime_delta;
+    }
+    return proc->utime + proc->stime;
+}
+
+static gint collect_proc_cmp_cpu(gconstpointer a, gconstpointer b)
+{
+    uint64_t ca = collect_proc_cpu(a), cb = collect_proc_cpu(b);
+
+    return ca < cb ? 1 : ca > cb ? -1 : 0;
+}
+
+static gint collect_proc_cmp_rss(gconstpointer a, gconstpointer b)
+{
+    uint64_t ra = ((const GACollectProcess *)a)->rss;
+    uint64_t rb = ((const GACollectProcess *)b)->rss;
+
+    return ra < rb ? 1 : ra > rb ? -1 : 0;
+}
+
+/* busiest since the previous scan first, or the largest with @by_rss */
+void ga_collect_processes_sort(GArray *procs, bool by_rss)
+{
+    g_array_sort(procs, by_rss ? collect_proc_cmp_rss : collect_proc_cmp_cpu);
+}
+
+/* move @p[@i] down the heap of @n, whose top is the one that sorts last */
+static void collect_proc_heap_down(GACollectProcess *p, size_t n, size_t i,
+                                   GCompareFunc cmp)
+{
+    GACollectProcess tmp;
+    size_t child;
+
+    while ((child = 2 * i + 1) < n) {
+        if (child + 1 < n && cmp(&p[child + 1], &p[child]) > 0) {
+            child++;
+        }
+        if (cmp(&p[child], &p[i]) <= 0) {
+            break;
+        }
+        tmp = p[i];
+        p[i] = p[child];
+        p[child] = tmp;
+        i = child;
+    }
+}
+
+/*
+ * Keep only the first @n of the order ga_collect_processes_sort() gives,
+ * sorted.  A heap of @n picks them out, so that asking for the top few of
+ * a great many processes does not sort them all.
+ */
+void ga_collect_processes_top(GArray *procs, bool by_rss, size_t n)
+{
+    GCompareFunc cmp = by_rss ? collect_proc_cmp_rss : collect_proc_cmp_cpu;
+    GACollectProcess *p = (GACollectProcess *)procs->data;
+    size_t i;
+
+    if (n < procs->len) {
+        for (i = n / 2; i-- > 0;) {
+            collect_proc_heap_down(p, n, i, cmp);
+        }
+        for (i = n; n && i < procs->len; i++) {
+            if (cmp(&p[i], &p[0]) < 0) {
+                p[0] = p[i];
+                collect_proc_heap_down(p, n, 0, cmp);
+            }
+        }
+        g_array_set_size(procs, n);
+    }
+    g_array_sort(procs, cmp);
+}
+
+void ga_collect_processes_cleanup(void)
+{
+    G_LOCK(collect_procs);
+    if (collect_procs.events_fd != -1) {
+        g_source_remove(collect_procs.events_watch);
+        collect_proc_events_send(collect_procs.events_fd,
+                                 PROC_CN_MCAST_IGNORE);
+        close(collect_procs.events_fd);
+        g_hash_table_destroy(collect_procs.pending);
+    }
+    if (collect_procs.samples) {
+        g_hash_table_destroy(collect_procs.samples);
+    }
+    while (!g_queue_is_empty(&collect_procs.exits)) {
+        g_free(g_queue_pop_head(&collect_procs.exits));
+    }
+    memset(&collect_procs, 0, sizeof(collect_procs));
+    collect_procs.events_fd = -1;
+    G_UNLOCK(collect_procs);
+}
+
+#define COLLECT_APP_STATUS_MAX_LINES 200
+
+/*
+ * The text of guest-get-app-status, roughly what "top -b" used to show:
+ * one line per process, busiest first.
+ */
+char *ga_collect_app_status(GError **errp)
+{
+    GACollectProcess *proc;
+    GArray *procs;
+    GString *text;
+    uint64_t cs;
+    guint i;
+
+    procs = ga_collect_processes(errp);
+    if (!procs) {
+        return NULL;
+    }
+    ga_collect_processes_sort(procs, false);
+
+    text = g_string_new("  PID S        RES THR     TIME+ COMMAND\n");
+    for (i = 0; i < procs->len && i < COLLECT_APP_STATUS_MAX_LINES - 1; i++) {
+        proc = &g_array_index(procs, GACollectProcess, i);
+        cs = (proc->utime + proc->stime) / 10;
+        g_string_append_printf(text, "%5" PRId64 " %c %10" PRIu64 " %3" PRId64
+                               " %3" PRIu64 ":%02u.%02u %s\n",
+                               proc->pid, proc->state, proc->rss / 1024,
+                               proc->threads, cs / 6000,
+                               (unsigned)(cs / 100 % 60), (unsigned)(cs % 100),
+                               proc->comm);
+    }
+    g_array_free(procs, true);
+
+    return g_string_free(text, false);
+}
+
+/* Log files */
+
+#define COLLECT_TAIL_LINE_MAX 4096
+
+static void collect_tail_update_head(GACollectTail *t)
+{
+    ssize_t len = MIN(sizeof(t->head), t->offset);
+
+    if (len > t->head_len) {
+        len = pread(t->fd, t->head, len, 0);
+        t->head_len = MAX(len, 0);
+    }
+}
+
+/* switch to the file now at the path, unless it is the one open */
+static bool collect_tail_switch(GACollectTail *t)
+{
+    struct stat st;
+    int fd;
+
+    if (stat(t->path, &st) < 0 || (t->fd != -1 && st.st_ino == t->ino)) {
+        return false;
+    }
+    fd = open(t->path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return false;
+    }
+    if (t->fd != -1) {
+        close(t->fd);
+    }
+    fstat(fd, &st);
+    t->fd = fd;
+    t->ino = st.st_ino;
+    t->offset = 0;
+    t->head_len = 0;
+    return true;
+}
+
+/*
+ * Start following @path, from its end if @at_end, else from its start.  A
+ * file that does not exist yet is read from its start once it appears.
+ */
+void ga_collect_tail_open(GACollectTail *t, const char *path, bool at_end)
+{
+    struct stat st;
+
+    memset(t, 0, sizeof(*t));
+    t->path = g_strdup(path);
+    t->fd = -1;
+    if (collect_tail_switch(t) && at_end && fstat(t->fd, &st) == 0) {
+        t->offset = st.st_size;
+        collect_tail_update_head(t);
+    }
+}
+
+/* continue at @offset if the file open still is inode @ino */
+bool ga_collect_tail_seek(GACollectTail *t, uint64_t ino, int64_t offset)
+{
+    struct stat st;
+
+    if (t->fd == -1 || t->ino != ino || fstat(t->fd, &st) < 0 ||
+        offset < 0 || offset > st.st_size) {
+        return false;
+    }
+    t->offset = offset;
+    t->head_len = 0;
+    collect_tail_update_head(t);
+    return true;
+}
+
+/*
+ * Pass the complete lines added since the last call to @func, without
+ * their newline.  A line longer than 4 KiB comes in pieces.  The file is
+ * followed when it is truncated in place or, once it was read to its end,
+ * when another one took its place, as log rotation does.  Returns false if
+ * @func stopped early; the line it refused is passed again next time.
+ */
+bool ga_collect_tail_read(GACollectTail *t, GACollectLineFunc func,
+                          void *opaque)
+{
+    char buf[COLLECT_TAIL_LINE_MAX + 1], *start, *nl;
+    struct stat st;
+    ssize_t len;
+
+    do {
+        if (t->fd == -1) {
+            continue;
+        }
+
+        /*
+         * Truncated in place, e.g. by logrotate's copytruncate.  The file
+         * may have grown past our offset again, so check that it still
+         * starts with the same bytes as well.
+         */
+        if ((fstat(t->fd, &st) == 0 && st.st_size < t->offset) ||
+            pread(t->fd, buf, t->head_len, 0) != t->head_len ||
+            memcmp(buf, t->head, t->head_len)) {
+            t->offset = 0;
+            t->head_len = 0;
+        }
+
+        for (;;) {
+            len = pread(t->fd, buf, sizeof(buf) - 1, t->offset);
+            if (len <= 0) {
+                break;
+            }
+            buf[len] = '\0';
+
+            start = buf;
+            while ((nl = memchr(start, '\n', buf + len - start))) {
+                *nl = '\0';
+                if (!func(start, nl - start, opaque)) {
+                    t->offset += start - buf;
+                    collect_tail_update_head(t);
+                    return false;
+                }
+                start = nl + 1;
+            }
+            if (start == buf && len == sizeof(buf) - 1) {
+                if (!func(buf, len, opaque)) {
+                    return false;
+                }
+                start = buf + len;
+            }
+            t->offset += start - buf;
+            if (len < sizeof(buf) - 1) {
+                break;
+            }
+        }
+        collect_tail_update_head(t);
+    } while (collect_tail_switch(t));
+
+    return true;
+}
+
+void ga_collect_tail_close(GACollectTail *t)
+{
+    if (t->fd != -1) {
+        close(t->fd);
+    }
+    g_free(t->path);
+    memset(t, 0, sizeof(*t));
+    t->fd = -1;
+}
+
+/* OOM kills */
+
+/*
+ * OOM kills are collected incrementally.  Trees with a /dev/kmsg reader
+ * feed its messages to ga_collect_oom_record(); otherwise the syslog file
+ * is followed, remembering the inode and offset reached so that each line
+ * is parsed only once.  Every kill found gets the next sequence number;
+ * the most recent ones are kept in a small ring for reporting.
+ */
+static struct {
+    bool initialized;
+    GACollectTail log;          /* path NULL if there is no syslog file */
+    int64_t seq;                /* number of kills seen so far */
+    GACollectOOMKill kills[GA_COLLECT_OOM_MAX_KILLS];
+} collect_oom;
+
+G_LOCK_DEFINE_STATIC(collect_oom);
+
+static void collect_oom_record_locked(const char *msg, int64_t time)
+{
+    GACollectOOMKill *rec;
+    const char *p;
+    unsigned int pid;
+
+    /* "Out of memory: Kill(ed) process", also for memory cgroups */
+    p = strstr(msg, "ut of memory: Kill");
+    if (!p) {
+        return;
+    }
+
+    rec = &collect_oom.kills[collect_oom.seq % GA_COLLECT_OOM_MAX_KILLS];
+    collect_oom.seq++;
+
+    rec->time = time;
+    rec->pid = -1;
+    rec->comm[0] = '\0';
+    p = strstr(p, " process ");
+    if (p && sscanf(p, " process %u (%15[^)])", &pid, rec->comm) >= 1) {
+        rec->pid = pid;
+    }
+}
+
+/* count @msg, logged at @time (ns since the Epoch), if it is an OOM kill */
+void ga_collect_oom_record(const char *msg, int64_t time)
+{
+    G_LOCK(collect_oom);
+    collect_oom_record_locked(msg, time);
+    G_UNLOCK(collect_oom);
+}
+
+/* syslog lines start with either "Oct 14 15:22:25" or an RFC 3339 time */
+static int64_t collect_oom_parse_syslog_time(const char *line)
+{
+    GTimeVal tv;
+    struct tm tm, now_tm;
+    time_t now, t;
+    char stamp[64];
+    const char *end;
+
+    end = strchr(line, ' ');
+    if (end && end - line < sizeof(stamp)) {
+        memcpy(stamp, line, end - line);
+        stamp[end - line] = '\0';
+        if (g_time_val_from_iso8601(stamp, &tv)) {
+            return tv.tv_sec * 1000000000LL + tv.tv_usec * 1000LL;
+        }
+    }
+
+    now = time(NULL);
+    localtime_r(&now, &now_tm);
+    memset(&tm, 0, sizeof(tm));
+    if (!strptime(line, "%b %d %H:%M:%S", &tm)) {
+        return now * 1000000000LL;
+    }
+    /* the year is not logged; a date in the future is from last year */
+    tm.tm_year = now_tm.tm_year;
+    tm.tm_isdst = -1;
+    t = mktime(&tm);
+    if (t > now + 86400) {
+        tm.tm_year--;
+        tm.tm_isdst = -1;
+        t = mktime(&tm);
+    }
+    return t * 1000000000LL;
+}
+
+static bool collect_oom_line(const char *line, size_t len, void *opaque)
+{
+    collect_oom_record_locked(line, collect_oom_parse_syslog_time(line));
+    return true;
+}
+
+/* pick up the kills written to the syslog file since the last scan */
+bool ga_collect_oom_scan_syslog(GError **errp)
+{
+    static const char * const log_paths[] = {
+        "/var/log/messages", "/var/log/kern.log", "/var/log/syslog", NULL
+    };
+    bool found;
+    int i;
+
+    G_LOCK(collect_oom);
+    if (!collect_oom.initialized) {
+        for (i = 0; log_paths[i]; i++) {
+            if (access(log_paths[i], R_OK) == 0) {
+                ga_collect_tail_open(&collect_oom.log, log_paths[i], false);
+                break;
+            }
+        }
+        collect_oom.initialized = true;
+    }
+    found = collect_oom.log.path != NULL;
+    if (found) {
+        ga_collect_tail_read(&collect_oom.log, collect_oom_line, NULL);
+    }
+    G_UNLOCK(collect_oom);
+
+    if (!found) {
+        g_set_error(errp, GA_COLLECT_ERROR, ENOENT,
+                    "no kernel log available");
+        return false;
+    }
+    return true;
+}
+
+/* the sequence number the next kill will get */
+int64_t ga_collect_oom_count(void)
+{
+    int64_t seq;
+
+    G_LOCK(collect_oom);
+    seq = collect_oom.seq;
+    G_UNLOCK(collect_oom);
+    return seq;
+}
+
+/* copy kill number @seq to @rec; false if it dropped out of the ring */
+bool ga_collect_oom_kill(int64_t seq, GACollectOOMKill *rec)
+{
+    bool found;
+
+    G_LOCK(collect_oom);
+    found = seq >= 0 && seq < collect_oom.seq &&
+            seq >= collect_oom.seq - GA_COLLECT_OOM_MAX_KILLS;
+    if (found) {
+        *rec = collect_oom.kills[seq % GA_COLLECT_OOM_MAX_KILLS];
+    }
+    G_UNLOCK(collect_oom);
+    return found;
+}
+
+void ga_collect_oom_cleanup(void)
+{
+    G_LOCK(collect_oom);
+    if (collect_oom.log.path) {
+        ga_collect_tail_close(&collect_oom.log);
+    }
+    memset(&collect_oom, 0, sizeof(collect_oom));
+    G_UNLOCK(collect_oom);
+}
+
+/* Logins */
+
+/*
+ * The USER_PROCESS records of utmp.  login(1), sshd and the display
+ * managers rewrite the file on every login and logout, so it is only read
+ * again once inotify reports a change of it.
+ */
+static struct {
+    int fd;                     /* inotify, -1 if unavailable */
+    bool valid;
+    GPtrArray *logins;          /* GACollectLogin, with @user, @tty, @host,
+                                 * @pid, @time and @session only */
+} collect_logins = { .fd = -1 };
+
+G_LOCK_DEFINE_STATIC(collect_logins);
+
+#define COLLECT_UTMP_EVENTS (IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | \
+                             IN_MOVE_SELF | IN_DELETE_SELF)
+
+void ga_collect_login_free(gpointer p)
+{
+    GACollectLogin *login = p;
+
+    g_free(login->user);
+    g_free(login->tty);
+    g_free(login->host);
+    g_free(login->session);
+    g_free(login->session_type);
+    g_free(login->session_state);
+    g_free(login);
+}
+
+static GACollectLogin *collect_login_copy(const GACollectLogin *login)
+{
+    GACollectLogin *copy = g_new0(GACollectLogin, 1);
+
+    *copy = *login;
+    copy->user = g_strdup(login->user);
+    copy->tty = g_strdup(login->tty);
+    copy->host = g_strdup(login->host);
+    copy->session = g_strdup(login->session);
+    return copy;
+}
+
+/* the value of @key in a KEY=VALUE file of systemd-logind */
+static char *collect_logind_value(const char *contents, const char *key)
+{
+    size_t len = strlen(key);
+    const char *line, *end;
+
+    for (line = contents; line && *line; line = end ? end + 1 : NULL) {
+        end = strchr(line, '\n');
+        if (!strncmp(line, key, len) && line[len] == '=') {
+            line += len + 1;
+            return end ? g_strndup(line, end - line) : g_strdup(line);
+        }
+    }
+    return NULL;
+}
+
+/* the logind session @pid is in, from its session-ID.scope */
+static char *collect_login_session(int64_t pid)
+{
+    char *path, *contents, *scope, *end, *session = NULL;
+
+    path = g_strdup_printf("/proc/%" PRId64 "/cgroup", pid);
+    if (g_file_get_contents(path, &contents, NULL, NULL)) {
+        scope = strstr(contents, "/session-");
+        end = scope ? strstr(scope, ".scope") : NULL;
+        if (end && !memchr(scope, '\n', end - scope)) {
+            session = g_strndup(scope + 9, end - scope - 9);
+        }
+        g_free(contents);
+    }
+    g_free(path);
+    return session;
+}
+
+/* what logind says about the session now, it changes on a VT switch */
+static void collect_login_session_state(GACollectLogin *login)
+{
+    char *path, *contents;
+
+    if (!login->session) {
+        return;
+    }
+    path = g_build_filename("/run/systemd/sessions", login->session, NULL);
+    if (g_file_get_contents(path, &contents, NULL, NULL)) {
+        login->session_type = collect_logind_value(contents, "TYPE");
+        login->session_state = collect_logind_value(contents, "STATE");
+        g_free(contents);
+    }
+    g_free(path);
+}
+
+static void collect_logins_read(void)
+{
+    GACollectLogin *login;
+    struct utmpx *ut;
+
+    g_ptr_array_set_size(collect_logins.logins, 0);
+    setutxent();
+    while ((ut = getutxent()) != NULL) {
+        if (ut->ut_type != USER_PROCESS) {
+            continue;
+        }
+        login = g_new0(GACollectLogin, 1);
+        login->user = g_strndup(ut->ut_user, sizeof(ut->ut_user));
+        login->tty = g_strndup(ut->ut_line, sizeof(ut->ut_line));
+        login->host = g_strndup(ut->ut_host, sizeof(ut->ut_host));
+        login->pid = ut->ut_pid;
+        login->time = ut->ut_tv.tv_sec;
+        login->session = collect_login_session(login->pid);
+        g_ptr_array_add(collect_logins.logins, login);
+    }
+    endutxent();
+}
+
+/* drain the inotify events, whether there were any */
+static bool collect_logins_stale(void)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool changed = false;
+
+    while (read(collect_logins.fd, buf, sizeof(buf)) > 0) {
+        changed = true;
+    }
+    return changed || !collect_logins.valid;
+}
+
+/* seconds since the terminal was last typed on, as w(1) tells, or -1 */
+static int64_t collect_tty_idle(const char *tty, time_t now)
+{
+    struct stat st;
+    char *path;
+    int ret;
+
+    if (!*tty || strstr(tty, "..")) {
+        return -1;
+    }
+    path = g_build_filename("/dev", tty, NULL);
+    ret = stat(path, &st);
+    g_free(path);
+    if (ret < 0) {
+        return -1;
+    }
+    return now > st.st_atime ? now - st.st_atime : 0;
+}
+
+/* who is logged in now */
+GPtrArray *ga_collect_logins(void)
+{
+    GPtrArray *logins;
+    GACollectLogin *login;
+    time_t now = time(NULL);
+    guint i;
+
+    G_LOCK(collect_logins);
+    if (!collect_logins.logins) {
+        collect_logins.logins =
+            g_ptr_array_new_with_free_func(ga_collect_login_free);
+    }
+    if (collect_logins.fd == -1) {
+        collect_logins.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    }
+    if (collect_logins.fd == -1 || collect_logins_stale()) {
+        /* before reading, so that no change goes unnoticed; a file put
+         * in place of the old one needs a watch of its own
+         */
+        collect_logins.valid = collect_logins.fd != -1 &&
+            inotify_add_watch(collect_logins.fd, _PATH_UTMP,
+                              COLLECT_UTMP_EVENTS) >= 0;
+        collect_logins_read();
+    }
+
+    logins = g_ptr_array_new_with_free_func(ga_collect_login_free);
+    for (i = 0; i < collect_logins.logins->len; i++) {
+        login = g_ptr_array_index(collect_logins.logins, i);
+        /* left behind by a process that died without logging out */
+        if (kill(login->pid, 0) < 0 && errno == ESRCH) {
+            continue;
+        }
+        login = collect_login_copy(login);
+        login->idle = collect_tty_idle(login->tty, now);
+        collect_login_session_state(login);
+        g_ptr_array_add(logins, login);
+    }
+    G_UNLOCK(collect_logins);
+
+    return logins;
+}
+
+void ga_collect_logins_cleanup(void)
+{
+    G_LOCK(collect_logins);
+    if (collect_logins.logins) {
+        g_ptr_array_free(collect_logins.logins, true);
+        collect_logins.logins = NULL;
+    }
+    collect_logins.valid = false;
+    if (collect_logins.fd != -1) {
+        close(collect_logins.fd);
+        collect_logins.fd = -1;
+    }
+    G_UNLOCK(collect_logins);
+}
+
+/* Accounts */
+
+/*
+ * Replace @path with @len bytes of @data so that readers see either the old
+ * or the new file, never a partial one: write a temporary file next to it,
+ * sync it and rename it over the original.  Symbolic links are followed;
+ * mode, ownership and SELinux label of the original file are kept.
+ * Returns 0 or an errno value.
+ */
+int ga_collect_replace_file(const char *path, const char *data, size_t len)
+{
+    char *target, *tmp, *dir;
+    char label[256];
+    struct stat st;
+    bool have_st = false;
+    mode_t mode = 0644;
+    ssize_t n, label_len = -1;
+    size_t done = 0;
+    int fd, dirfd, ret = 0;
+
+    target = realpath(path, NULL);
+    if (!target) {
+        if (errno != ENOENT) {
+            return errno;
+        }
+        target = g_strdup(path);
+    } else if (stat(target, &st) == 0) {
+        have_st = true;
+        mode = st.st_mode & 07777;
+        label_len = getxattr(target, "security.selinux", label,
+                             sizeof(label));
+    }
+
+    tmp = g_strdup_printf("%s.XXXXXX", target);
+    fd = mkstemp(tmp);
+    if (fd < 0) {
+        ret = errno;
+        goto out;
+    }
+    if (fchmod(fd, mode) < 0 ||
+        (have_st && fchown(fd, st.st_uid, st.st_gid) < 0)) {
+        ret = errno;
+    }
+    if (!ret && label_len > 0 &&
+        fsetxattr(fd, "security.selinux", label, label_len, 0) < 0) {
+        ret = errno;
+    }
+    while (!ret && done < len) {
+        n = write(fd, data + done, len - done);
+        if (n < 0 && errno != EINTR) {
+            ret = errno;
+        } else if (n > 0) {
+            done += n;
+        }
+    }
+    if (!ret && fsync(fd) < 0) {
+        ret = errno;
+    }
+    if (close(fd) < 0 && !ret) {
+        ret = errno;
+    }
+    if (!ret && rename(tmp, target) < 0) {
+        ret = errno;
+    }
+    if (ret) {
+        unlink(tmp);
+        goto out;
+    }
+
+    /* make the rename itself durable */
+    dir = g_path_get_dirname(target);
+    dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirfd >= 0) {
+        fsync(dirfd);
+        close(dirfd);
+    }
+    g_free(dir);
+
+out:
+    g_free(tmp);
+    g_free(target);
+    return ret;
+}
+
+/* SHA-512 crypt(3) hash of @password with a random salt, or NULL */
+static char *collect_crypt_password(const char *password)
+{
+    static const char salt_chars[] =
+        "./0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+    unsigned char rnd[16];
+    char salt[3 + sizeof(rnd) + 2] = "$6$";
+    struct crypt_data *data;
+    char *hash = NULL, *ret;
+    int fd, i;
+
+    fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (read(fd, rnd, sizeof(rnd)) != sizeof(rnd)) {
+        close(fd);
+        return NULL;
+    }
+    close(fd);
+    for (i = 0; i < sizeof(rnd); i++) {
+        salt[3 + i] = salt_chars[rnd[i] & 63];
+    }
+    salt[3 + i] = '$';
+
+    data = g_new0(struct crypt_data, 1);
+    ret = crypt_r(password, salt, data);
+    /* failures give NULL or a "*" token, and old libcs ignore "$6$" */
+    if (ret && g_str_has_prefix(ret, "$6$")) {
+        hash = g_strdup(ret);
+    }
+    memset(data, 0, sizeof(*data));
+    g_free(data);
+
+    return hash;
+}
+
+/*
+ * Store @hash as the password of @user in /etc/shadow, with the file
+ * locked against other shadow tools.  Returns 0 or an errno value,
+ * ENOENT if @user has no shadow entry.
+ */
+static int collect_shadow_set_password(const char *user, const char *hash)
+{
+    char *contents, *line, *end, *entry, **fields;
+    size_t userlen = strlen(user);
+    GString *out;
+    bool found = false;
+    int ret;
+
+    if (lckpwdf() < 0) {
+        return errno ? errno : EAGAIN;
+    }
+    if (!g_file_get_contents("/etc/shadow", &contents, NULL, NULL)) {
+        ulckpwdf();
+        return ENOENT;
+    }
+
+    out = g_string_sized_new(strlen(contents) + strlen(hash));
+    for (line = contents; *line; line = end) {
+        end = strchr(line, '\n');
+        end = end ? end + 1 : line + strlen(line);
+        if (found || strncmp(line, user, userlen) || line[userlen] != ':') {
+            g_string_append_len(out, line, end - line);
+            continue;
+        }
+        entry = g_strndup(line, end - line);
+        fields = g_strsplit(entry, ":", -1);
+        g_free(entry);
+        if (g_strv_length(fields) >= 3) {
+            /* the password and the day it was last changed */
+            g_free(fields[1]);
+            fields[1] = g_strdup(hash);
+            g_free(fields[2]);
+            fields[2] = g_strdup_printf("%ld", (long)(time(NULL) / 86400));
+            line = g_strjoinv(":", fields);
+            g_string_append(out, line);
+            g_free(line);
+            found = true;
+        } else {
+            g_string_append_len(out, line, end - line);
+        }
+        g_strfreev(fields);
+    }
+
+    ret = found ? ga_collect_replace_file("/etc/shadow", out->str, out->len) :
+          ENOENT;
+    ulckpwdf();
+
+    memset(out->str, 0, out->len);
+    g_string_free(out, true);
+    g_free(contents);
+    return ret;
+}
+
+/* hand "@user:@password" to chpasswd(8) on its standard input */
+static bool collect_chpasswd(const char *user, const char *password)
+{
+    const char *argv[] = { "chpasswd", NULL };
+    char *line;
+    size_t len, done = 0;
+    ssize_t n;
+    GPid child;
+    int fd, status = -1;
+
+    if (!g_spawn_async_with_pipes(NULL, (char **)argv, NULL,
+                                  G_SPAWN_SEARCH_PATH |
+                                  G_SPAWN_DO_NOT_REAP_CHILD |
+                                  G_SPAWN_STDOUT_TO_DEV_NULL |
+                                  G_SPAWN_STDERR_TO_DEV_NULL,
+                                  NULL, NULL, &child, &fd, NULL, NULL,
+                                  NULL)) {
+        return false;
+    }
+
+    line = g_strdup_printf("%s:%s\n", user, password);
+    len = strlen(line);
+    while (done < len) {
+        n = write(fd, line + done, len - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+    close(fd);
+    memset(line, 0, len);
+    g_free(line);
+
+    while (waitpid(child, &status, 0) < 0 && errno == EINTR) {
+        /* again */
+    }
+    g_spawn_close_pid(child);
+
+    return done == len && WIFEXITED(status) && !WEXITSTATUS(status);
+}
+
+/*
+ * Set the password of @user.  The hash is computed and written to
+ * /etc/shadow in process; chpasswd is only run where @user has no shadow
+ * entry or the libc cannot do SHA-512 hashes.
+ * Returns 0, an errno value, or 1 if chpasswd failed.
+ */
+int ga_collect_change_password(const char *user, const char *password)
+{
+    char *hash;
+    int ret = ENOENT;
+
+    hash = collect_crypt_password(password);
+    if (hash) {
+        ret = collect_shadow_set_password(user, hash);
+        g_free(hash);
+    }
+    if (ret != ENOENT) {
+        return ret;
+    }
+    return collect_chpasswd(user, password) ? 0 : 1;
+}
+
+bool ga_collect_hostname_valid(const char *hostname, GError **errp)
+{
+    size_t len = strlen(hostname), i;
+
+    if (len == 0 || len > HOST_NAME_MAX) {
+        g_set_error(errp, GA_COLLECT_ERROR, EINVAL,
+                    "host name must be 1 to %d characters", HOST_NAME_MAX);
+        return false;
+    }
+    for (i = 0; i < len; i++) {
+        if (!g_ascii_isalnum(hostname[i]) && !strchr("-._", hostname[i])) {
+            g_set_error(errp, GA_COLLECT_ERROR, EINVAL,
+                        "invalid character '%c' in host name", hostname[i]);
+            return false;
+        }
+    }
+    return true;
+}
+
+/* @contents with its HOSTNAME= line set to @hostname, or one appended */
+static char *collect_sysconfig_set_hostname(const char *contents,
+                                            const char *hostname)
+{
+    GString *out = g_string_sized_new(strlen(contents) + strlen(hostname));
+    const char *line, *end, *p;
+    bool found = false;
+
+    for (line = contents; *line; line = end) {
+        end = strchr(line, '\n');
+        end = end ? end + 1 : line + strlen(line);
+        for (p = line; *p == ' ' || *p == '\t'; p++) {
+            /* skip indentation */
+        }
+        if (!found && g_str_has_prefix(p, "HOSTNAME=")) {
+            g_string_append_printf(out, "HOSTNAME=%s\n", hostname);
+            found = true;
+            continue;
+        }
+        g_string_append_len(out, line, end - line);
+        if (end[-1] != '\n') {
+            g_string_append_c(out, '\n');
+        }
+    }
+    if (!found) {
+        g_string_append_printf(out, "HOSTNAME=%s\n", hostname);
+    }
+
+    return g_string_free(out, false);
+}
+
+/*
+ * Set the running host name, which has to be ga_collect_hostname_valid(),
+ * and store it where the distribution reads it at boot.  Returns 0, the
+ * errno value of the step that failed, or 1 if this distribution keeps
+ * the host name somewhere unknown.
+ */
+int ga_collect_change_hostname(const char *hostname)
+{
+    const char *file;
+    char *contents = NULL, *data;
+    bool sysconfig;
+    int ret;
+
+    G_LOCK(collect_system);
+    collect_system_init_locked();
+    collect_system_invalidate_fqdn_locked();
+    file = collect_system.hostname_file;
+    sysconfig = collect_system.hostname_sysconfig;
+    G_UNLOCK(collect_system);
+
+    if (sethostname(hostname, strlen(hostname)) < 0) {
+        ret = errno;
+        g_warning("sethostname failed: %s", g_strerror(ret));
+        return ret;
+    }
+    if (!file) {
+        return 1;
+    }
+
+    if (sysconfig) {
+        g_file_get_contents(file, &contents, NULL, NULL);
+        data = collect_sysconfig_set_hostname(contents ? contents : "",
+                                              hostname);
+        g_free(contents);
+    } else {
+        data = g_strdup_printf("%s\n", hostname);
+    }
+
+    ret = ga_collect_replace_file(file, data, strlen(data));
+    if (ret) {
+        g_warning("failed to write %s: %s", file, g_strerror(ret));
+    }
+    g_free(data);
+    return ret;
+}
+
+/* Checks */
+
+/*
+ * Run @command through /bin/sh as guest-user-check does and return at
+ * most @max bytes of its output.  The command and whatever it started
+ * are killed once @timeout_ms have passed; what it printed until then is
+ * still returned.  NULL only if the shell could not be run.
+ */
+char *ga_collect_check(const char *command, int timeout_ms, size_t max,
+                       GError **errp)
+{
+    const char *argv[] = { "/bin/sh", "-c", command, NULL };
+    GString *out = g_string_new("");
+    GError *err = NULL;
+
+    if (collect_run(argv, max, timeout_ms, out, &err) < 0 && err) {
+        g_set_error(errp, GA_COLLECT_ERROR, err->code,
+                    "failed to run '%s': %s", command, err->message);
+        g_error_free(err);
+        g_string_free(out, true);
+        return NULL;
+    }
+    return g_string_free(out, false);
+}
+
+/*
+ * Run @argv directly, as collect_run() does, for guest-provision.
+ *
+ * Returns: the wait status, or -1 if it could not be run, which sets
+ * @errp, or was killed at @timeout_ms, which does not
+ */
+int ga_collect_run(const char *const *argv, size_t max, int timeout_ms,
+                   GString *out, GError **errp)
+{
+    return collect_run(argv, max, timeout_ms, out, errp);
+}
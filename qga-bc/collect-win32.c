@@ -0,0 +1,870 @@
+/*
+ * BCLinux guest status collectors, Windows backend
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include <glib.h>
+#include <windows.h>
+#include <psapi.h>
+#include <stdio.h>
+#include <string.h>
+#include "collect.h"
+
+typedef LONG (WINAPI *NtQuerySystemInformationFunc)(ULONG, PVOID, ULONG,
+                                                    PULONG);
+typedef LONG (WINAPI *RtlGetVersionFunc)(OSVERSIONINFOEXW *);
+
+#define NT_SYSTEM_PAGEFILE_INFORMATION 18
+#define NT_STATUS_INFO_LENGTH_MISMATCH ((LONG)0xC0000004)
+
+static void collect_set_win32_error(GError **errp, DWORD err,
+                                    const char *what)
+{
+    char *msg = g_win32_error_message(err);
+
+    g_set_error(errp, GA_COLLECT_ERROR, err, "%s: %s", what, msg);
+    g_free(msg);
+}
+
+/*
+ * Query a SystemInformationClass that returns a variable sized table.
+ * @size_hint holds the buffer size to try first and is updated with the
+ * size that was needed, so repeated queries usually take a single call.
+ */
+void *ga_collect_nt_query(ULONG info_class, ULONG *size_hint, GError **errp)
+{
+    static NtQuerySystemInformationFunc query;
+    void *buf;
+    ULONG needed = 0;
+    LONG status;
+
+    if (!query) {
+        query = (NtQuerySystemInformationFunc)GetProcAddress(
+            GetModuleHandleA("ntdll.dll"), "NtQuerySystemInformation");
+        if (!query) {
+            collect_set_win32_error(errp, GetLastError(),
+                                    "failed to find NtQuerySystemInformation");
+            return NULL;
+        }
+    }
+    if (!*size_hint) {
+        *size_hint = 4096;
+    }
+
+    for (;;) {
+        buf = g_malloc(*size_hint);
+        status = query(info_class, buf, *size_hint, &needed);
+        if (status != NT_STATUS_INFO_LENGTH_MISMATCH) {
+            break;
+        }
+        g_free(buf);
+        /* leave some room for entries added in the meantime */
+        *size_hint = MAX(needed, *size_hint) + *size_hint / 4;
+    }
+
+    if (status < 0) {
+        g_free(buf);
+        g_set_error(errp, GA_COLLECT_ERROR, status,
+                    "NtQuerySystemInformation failed: 0x%lx",
+                    (unsigned long)status);
+        return NULL;
+    }
+    return buf;
+}
+
+/* Memory */
+
+/* SYSTEM_PAGEFILE_INFORMATION; the sizes are in pages */
+typedef struct CollectPagefileInfo {
+    ULONG NextEntryOffset;
+    ULONG TotalSize;
+    ULONG TotalInUse;
+    ULONG PeakUsage;
+    struct {
+        USHORT Length;
+        USHORT MaximumLength;
+        PWSTR Buffer;
+    } PageFileName;
+} CollectPagefileInfo;
+
+static ULONG collect_pagefile_info_size;
+
+static void collect_meminfo_set(GuestMeminfo *mi, GuestMeminfoField field,
+                                uint64_t val)
+{
+    mi->value[field] = val;
+    mi->present |= 1u << field;
+}
+
+/*
+ * Windows has no free memory in the /proc/meminfo sense: the standby list
+ * counts as available, so only MEMINFO_MEM_AVAILABLE is set.  Swap is the
+ * page files rather than the commit limit.
+ */
+bool ga_collect_memory(GuestMeminfo *mi, GError **errp)
+{
+    MEMORYSTATUSEX ms;
+    PERFORMANCE_INFORMATION pi;
+    CollectPagefileInfo *pagefiles, *p;
+    uint64_t swap_total = 0, swap_used = 0;
+
+    memset(mi, 0, sizeof(*mi));
+
+    ms.dwLength = sizeof(ms);
+    if (!GlobalMemoryStatusEx(&ms)) {
+        collect_set_win32_error(errp, GetLastError(),
+                                "failed to get memory status");
+        return false;
+    }
+    pi.cb = sizeof(pi);
+    if (!GetPerformanceInfo(&pi, sizeof(pi))) {
+        collect_set_win32_error(errp, GetLastError(),
+                                "failed to get performance information");
+        return false;
+    }
+
+    pagefiles = ga_collect_nt_query(NT_SYSTEM_PAGEFILE_INFORMATION,
+                                    &collect_pagefile_info_size, errp);
+    if (!pagefiles) {
+        return false;
+    }
+    for (p = pagefiles; p->TotalSize;
+         p = (CollectPagefileInfo *)((char *)p + p->NextEntryOffset)) {
+        swap_total += (uint64_t)p->TotalSize * pi.PageSize;
+        swap_used += (uint64_t)p->TotalInUse * pi.PageSize;
+        if (!p->NextEntryOffset) {
+            break;
+        }
+    }
+    g_free(pagefiles);
+
+    collect_meminfo_set(mi, MEMINFO_MEM_TOTAL, ms.ullTotalPhys);
+    collect_meminfo_set(mi, MEMINFO_MEM_AVAILABLE, ms.ullAvailPhys);
+    collect_meminfo_set(mi, MEMINFO_CACHED,
+                        (uint64_t)pi.SystemCache * pi.PageSize);
+    collect_meminfo_set(mi, MEMINFO_SWAP_TOTAL, swap_total);
+    collect_meminfo_set(mi, MEMINFO_SWAP_FREE, swap_total - swap_used);
+    return true;
+}
+
+/* System */
+
+static struct {
+    bool initialized;
+    char *computer_name;
+    char *version;
+} collect_system;
+
+G_LOCK_DEFINE_STATIC(collect_system);
+
+/* GetVersion() reports 6.2 from Windows 8 on, RtlGetVersion() does not lie */
+static char *collect_version(void)
+{
+    RtlGetVersionFunc get_version;
+    OSVERSIONINFOEXW vi;
+    DWORD v;
+
+    get_version = (RtlGetVersionFunc)GetProcAddress(
+        GetModuleHandleA("ntdll.dll"), "RtlGetVersion");
+    memset(&vi, 0, sizeof(vi));
+    vi.dwOSVersionInfoSize = sizeof(vi);
+    if (get_version && get_version(&vi) == 0) {
+        return g_strdup_printf("%lu.%lu (%lu)", vi.dwMajorVersion,
+                               vi.dwMinorVersion, vi.dwBuildNumber);
+    }
+
+    v = GetVersion();
+    return g_strdup_printf("%u.%u (%u)", LOBYTE(LOWORD(v)),
+                           HIBYTE(LOWORD(v)), HIWORD(v));
+}
+
+static char *collect_computer_name(COMPUTER_NAME_FORMAT format)
+{
+    WCHAR buf[MAX_COMPUTERNAME_LENGTH + 256];
+    DWORD len = G_N_ELEMENTS(buf);
+
+    if (!GetComputerNameExW(format, buf, &len)) {
+        return g_strdup("");
+    }
+    return g_utf16_to_utf8(buf, len, NULL, NULL, NULL);
+}
+
+static void collect_system_init_locked(void)
+{
+    if (collect_system.initialized) {
+        return;
+    }
+    collect_system.computer_name =
+        collect_computer_name(ComputerNameNetBIOS);
+    collect_system.version = collect_version();
+    collect_system.initialized = true;
+}
+
+void ga_collect_system_init(void)
+{
+    G_LOCK(collect_system);
+    collect_system_init_locked();
+    G_UNLOCK(collect_system);
+}
+
+/* the fqdn is not cached on Windows, the API call is cheap */
+void ga_collect_system_invalidate_fqdn(void)
+{
+}
+
+void ga_collect_system_cleanup(void)
+{
+    G_LOCK(collect_system);
+    g_free(collect_system.computer_name);
+    collect_system.computer_name = NULL;
+    g_free(collect_system.version);
+    collect_system.version = NULL;
+    collect_system.initialized = false;
+    G_UNLOCK(collect_system);
+}
+
+/* os-name has always been the computer name on Windows */
+void ga_collect_system(GACollectSystem *si)
+{
+    G_LOCK(collect_system);
+    collect_system_init_locked();
+    si->os_name = g_strdup(collect_system.computer_name);
+    si->system_version = g_strdup(collect_system.version);
+    G_UNLOCK(collect_system);
+
+    si->kernel_version = g_strdup("");
+    si->fqdn = collect_computer_name(ComputerNameDnsFullyQualified);
+    si->lastlogin = g_strdup("");
+}
+
+/* Disks */
+
+/*
+ * Usage of every local fixed volume that is mounted somewhere.  Removable
+ * and optical drives are skipped: querying an empty or spinning up drive
+ * can stall for seconds.
+ */
+GPtrArray *ga_collect_disks(GError **errp)
+{
+    GPtrArray *disks;
+    GACollectDisk *disk;
+    WCHAR volume[MAX_PATH], paths[MAX_PATH + 1];
+    ULARGE_INTEGER avail, total, total_free;
+    DWORD flags, len;
+    UINT type;
+    HANDLE h;
+
+    h = FindFirstVolumeW(volume, G_N_ELEMENTS(volume));
+    if (h == INVALID_HANDLE_VALUE) {
+        collect_set_win32_error(errp, GetLastError(),
+                                "failed to find volumes");
+        return NULL;
+    }
+
+    disks = g_ptr_array_new_with_free_func(ga_collect_disk_free);
+    do {
+        type = GetDriveTypeW(volume);
+        if (type != DRIVE_FIXED && type != DRIVE_RAMDISK) {
+            continue;
+        }
+        /* the first mount point, e.g. "C:\", if the volume has any */
+        if (!GetVolumePathNamesForVolumeNameW(volume, paths,
+                                              G_N_ELEMENTS(paths), &len) ||
+            !paths[0]) {
+            continue;
+        }
+        if (!GetDiskFreeSpaceExW(volume, &avail, &total, &total_free)) {
+            g_debug("failed to get free space of volume: %lu",
+                    GetLastError());
+            continue;
+        }
+        if (!GetVolumeInformationW(volume, NULL, 0, NULL, NULL, &flags,
+                                   NULL, 0)) {
+            flags = 0;
+        }
+
+        disk = g_new0(GACollectDisk, 1);
+        disk->mount = g_utf16_to_utf8(paths, -1, NULL, NULL, NULL);
+        disk->total = total.QuadPart;
+        disk->used = total.QuadPart - total_free.QuadPart;
+        disk->avail = avail.QuadPart;
+        disk->writable = !(flags & FILE_READ_ONLY_VOLUME);
+        ga_collect_fs_usage_add(disk->mount, disk->used, disk->avail);
+        g_ptr_array_add(disks, disk);
+    } while (FindNextVolumeW(h, volume, G_N_ELEMENTS(volume)));
+
+    FindVolumeClose(h);
+    return disks;
+}
+
+/* nothing is kept between calls */
+void ga_collect_disks_invalidate(void)
+{
+}
+
+void ga_collect_disks_cleanup(void)
+{
+    ga_collect_fs_usage_cleanup();
+}
+
+/* Services */
+
+#define COLLECT_SERVICES_MAX 256
+#define COLLECT_SERVICES_BUF_SIZE_INITIAL (64 * 1024)
+
+/*
+ * The service control manager is opened on first use and kept open, like
+ * the buffer EnumServicesStatusEx() fills, which grows to the size of the
+ * service table once and is reused from then on.  Every call takes one
+ * snapshot of all Win32 services, so the states it returns are consistent
+ * with each other, and costs one round trip to services.exe however many
+ * services are asked for.
+ */
+static struct {
+    SC_HANDLE manager;
+    BYTE *buf;
+    DWORD size;
+} collect_services;
+
+G_LOCK_DEFINE_STATIC(collect_services);
+
+static bool
+collect_services_snapshot_locked(ENUM_SERVICE_STATUS_PROCESSW **svcs,
+                                 DWORD *count, GError **errp)
+{
+    DWORD needed, resume;
+    DWORD err;
+
+    if (!collect_services.manager) {
+        collect_services.manager = OpenSCManagerW(NULL, NULL,
+                                                  SC_MANAGER_ENUMERATE_SERVICE);
+        if (!collect_services.manager) {
+            collect_set_win32_error(errp, GetLastError(),
+                                    "failed to open the service manager");
+            return false;
+        }
+    }
+    if (!collect_services.buf) {
+        collect_services.size = COLLECT_SERVICES_BUF_SIZE_INITIAL;
+        collect_services.buf = g_malloc(collect_services.size);
+    }
+
+    /* services can be installed between the calls, retry until they fit */
+    for (;;) {
+        resume = 0;
+        if (EnumServicesStatusExW(collect_services.manager,
+                                  SC_ENUM_PROCESS_INFO, SERVICE_WIN32,
+                                  SERVICE_STATE_ALL, collect_services.buf,
+                                  collect_services.size, &needed, count,
+                                  &resume, NULL)) {
+            break;
+        }
+        err = GetLastError();
+        if (err != ERROR_MORE_DATA) {
+            /* the manager may have gone away, open it again next time */
+            CloseServiceHandle(collect_services.manager);
+            collect_services.manager = NULL;
+            collect_set_win32_error(errp, err,
+                                    "failed to enumerate services");
+            return false;
+        }
+        /* @needed is what the services left out take */
+        g_free(collect_services.buf);
+        collect_services.size += needed + needed / 4;
+        collect_services.buf = g_malloc(collect_services.size);
+    }
+
+    *svcs = (ENUM_SERVICE_STATUS_PROCESSW *)collect_services.buf;
+    return true;
+}
+
+static const ENUM_SERVICE_STATUS_PROCESSW *
+collect_service_find(const ENUM_SERVICE_STATUS_PROCESSW *svcs, DWORD count,
+                     const WCHAR *name)
+{
+    DWORD i;
+
+    /* the names are case insensitive; the display name is the fallback */
+    for (i = 0; i < count; i++) {
+        if (!_wcsicmp(svcs[i].lpServiceName, name)) {
+            return &svcs[i];
+        }
+    }
+    for (i = 0; i < count; i++) {
+        if (svcs[i].lpDisplayName && !_wcsicmp(svcs[i].lpDisplayName, name)) {
+            return &svcs[i];
+        }
+    }
+    return NULL;
+}
+
+/* the SCM states in the words of systemd, with the SCM's as sub-state */
+static void collect_service_state(GACollectService *svc,
+                                  const SERVICE_STATUS_PROCESS *st)
+{
+    const char *active, *sub;
+
+    switch (st->dwCurrentState) {
+    case SERVICE_STOPPED:
+        /* a service that stopped with an error code is a failed unit */
+        if (st->dwWin32ExitCode != NO_ERROR &&
+            st->dwWin32ExitCode != ERROR_SERVICE_NEVER_STARTED) {
+            active = "failed";
+        } else {
+            active = "inactive";
+        }
+        sub = "stopped";
+        break;
+    case SERVICE_START_PENDING:
+        active = "activating";
+        sub = "start-pending";
+        break;
+    case SERVICE_STOP_PENDING:
+        active = "deactivating";
+        sub = "stop-pending";
+        break;
+    case SERVICE_RUNNING:
+        active = "active";
+        sub = "running";
+        break;
+    case SERVICE_CONTINUE_PENDING:
+        active = "active";
+        sub = "continue-pending";
+        break;
+    case SERVICE_PAUSE_PENDING:
+        active = "active";
+        sub = "pause-pending";
+        break;
+    case SERVICE_PAUSED:
+        active = "active";
+        sub = "paused";
+        break;
+    default:
+        active = "unknown";
+        sub = NULL;
+        break;
+    }
+    svc->load_state = g_strdup("loaded");
+    svc->active_state = g_strdup(active);
+    svc->sub_state = g_strdup(sub);
+    svc->main_pid = st->dwProcessId;
+}
+
+/*
+ * The state of each of @units, a NULL terminated list of service names or
+ * display names, in the same order, from one snapshot of the service
+ * table.  Drivers are not Win32 services and are reported not found.
+ */
+GPtrArray *ga_collect_services(char **units, GError **errp)
+{
+    const ENUM_SERVICE_STATUS_PROCESSW *found;
+    ENUM_SERVICE_STATUS_PROCESSW *svcs;
+    GACollectService *svc;
+    GPtrArray *services;
+    DWORD count;
+    WCHAR *name;
+    char **unit;
+
+    if (g_strv_length(units) > COLLECT_SERVICES_MAX) {
+        g_set_error(errp, GA_COLLECT_ERROR, 0,
+                    "at most %d units can be asked for at once",
+                    COLLECT_SERVICES_MAX);
+        return NULL;
+    }
+
+    services = g_ptr_array_new_with_free_func(ga_collect_service_free);
+    G_LOCK(collect_services);
+    if (!collect_services_snapshot_locked(&svcs, &count, errp)) {
+        G_UNLOCK(collect_services);
+        g_ptr_array_free(services, true);
+        return NULL;
+    }
+    for (unit = units; *unit; unit++) {
+        svc = g_new0(GACollectService, 1);
+        svc->name = g_strdup(*unit);
+        svc->restarts = -1;
+        svc->memory = -1;
+
+        name = g_utf8_to_utf16(*unit, -1, NULL, NULL, NULL);
+        found = name ? collect_service_find(svcs, count, name) : NULL;
+        g_free(name);
+        if (found) {
+            collect_service_state(svc, &found->ServiceStatusProcess);
+        } else {
+            svc->load_state = g_strdup("not-found");
+            svc->active_state = g_strdup("inactive");
+            svc->sub_state = g_strdup("dead");
+        }
+        g_ptr_array_add(services, svc);
+    }
+    G_UNLOCK(collect_services);
+
+    return services;
+}
+
+/* nothing is cached between calls, each takes a new snapshot */
+void ga_collect_services_invalidate(void)
+{
+}
+
+void ga_collect_services_cleanup(void)
+{
+    G_LOCK(collect_services);
+    if (collect_services.manager) {
+        CloseServiceHandle(collect_services.manager);
+        collect_services.manager = NULL;
+    }
+    g_free(collect_services.buf);
+    collect_services.buf = NULL;
+    collect_services.size = 0;
+    G_UNLOCK(collect_services);
+}
+
+/* Packages */
+
+#define COLLECT_PACKAGES_REMOVED_MAX 4096
+#define COLLECT_UNINSTALL_KEY \
+    L"Software\\Microsoft\\Windows\\CurrentVersion\\Uninstall"
+
+typedef struct CollectPackage {
+    GACollectPackage pkg;       /* @pkg.name is NULL if it is not listed */
+    FILETIME written;           /* of its key, when it was read */
+    guint32 generation;         /* the one it appeared, or went away, in */
+} CollectPackage;
+
+typedef struct CollectUninstallView {
+    REGSAM sam;
+    const char *arch;
+} CollectUninstallView;
+
+/*
+ * The programs "Programs and Features" lists, read from the Uninstall
+ * keys of the registry rather than through WMI, whose Win32_Product class
+ * takes minutes and runs a consistency check, even repairs, of every MSI
+ * package.  A 64-bit Windows has a second set of keys for 32-bit
+ * programs.  Listing the keys gives the last write time of each, so only
+ * those that changed since the previous call are opened and read again.
+ * Generations and tokens work as on Linux, see collect-posix.c.
+ */
+static struct {
+    bool valid;
+    guint64 instance;
+    guint32 generation;
+    guint32 horizon;            /* the oldest generation a token can be of */
+    GHashTable *packages;       /* "arch\key" -> CollectPackage */
+    GQueue removed;             /* CollectPackage, oldest first */
+} collect_packages;
+
+G_LOCK_DEFINE_STATIC(collect_packages);
+
+static void collect_package_entry_free(gpointer p)
+{
+    CollectPackage *entry = p;
+
+    g_free(entry->pkg.name);
+    g_free(entry->pkg.version);
+    g_free(entry->pkg.arch);
+    g_free(entry);
+}
+
+static GACollectPackage *collect_package_copy(const GACollectPackage *pkg)
+{
+    GACollectPackage *copy = g_new(GACollectPackage, 1);
+
+    copy->name = g_strdup(pkg->name);
+    copy->version = g_strdup(pkg->version);
+    copy->arch = g_strdup(pkg->arch);
+    return copy;
+}
+
+/* the Uninstall key of 32-bit programs only exists on 64-bit Windows */
+static const CollectUninstallView *collect_uninstall_views(int *n)
+{
+    static const CollectUninstallView views64[] = {
+        { KEY_WOW64_64KEY, "x64" }, { KEY_WOW64_32KEY, "x86" }
+    };
+    static const CollectUninstallView views32[] = {
+        { 0, "x86" }
+    };
+    SYSTEM_INFO si;
+
+    GetNativeSystemInfo(&si);
+    if (si.wProcessorArchitecture == PROCESSOR_ARCHITECTURE_INTEL) {
+        *n = G_N_ELEMENTS(views32);
+        return views32;
+    }
+    *n = G_N_ELEMENTS(views64);
+    return views64;
+}
+
+static char *collect_reg_string(HKEY key, const WCHAR *value)
+{
+    WCHAR buf[1024];
+    DWORD type, size = sizeof(buf) - sizeof(WCHAR);
+
+    if (RegQueryValueExW(key, value, NULL, &type, (BYTE *)buf,
+                         &size) != ERROR_SUCCESS ||
+        (type != REG_SZ && type != REG_EXPAND_SZ)) {
+        return NULL;
+    }
+    /* the registry does not promise the terminating null */
+    buf[size / sizeof(WCHAR)] = L'\0';
+    return g_utf16_to_utf8(buf, -1, NULL, NULL, NULL);
+}
+
+/*
+ * Read the program of the Uninstall subkey @name.  It is left unnamed,
+ * as "Programs and Features" leaves it out, if it has no display name,
+ * is a system component or is an update of another program.
+ */
+static CollectPackage *collect_package_read(HKEY parent, const WCHAR *name,
+                                            const CollectUninstallView *view)
+{
+    CollectPackage *entry = g_new0(CollectPackage, 1);
+    DWORD system = 0, size = sizeof(system);
+    char *parent_name;
+    HKEY key;
+
+    if (RegOpenKeyExW(parent, name, 0, KEY_QUERY_VALUE | view->sam,
+                      &key) != ERROR_SUCCESS) {
+        return entry;
+    }
+    RegQueryValueExW(key, L"SystemComponent", NULL, NULL, (BYTE *)&system,
+                     &size);
+    parent_name = collect_reg_string(key, L"ParentKeyName");
+    if (system != 1 && !parent_name) {
+        entry->pkg.name = collect_reg_string(key, L"DisplayName");
+        if (entry->pkg.name && !*entry->pkg.name) {
+            g_free(entry->pkg.name);
+            entry->pkg.name = NULL;
+        }
+    }
+    if (entry->pkg.name) {
+        entry->pkg.version = collect_reg_string(key, L"DisplayVersion");
+        if (!entry->pkg.version) {
+            entry->pkg.version = g_strdup("");
+        }
+        entry->pkg.arch = g_strdup(view->arch);
+    }
+    g_free(parent_name);
+    RegCloseKey(key);
+    return entry;
+}
+
+static bool collect_package_same(const CollectPackage *a,
+                                 const CollectPackage *b)
+{
+    return !g_strcmp0(a->pkg.name, b->pkg.name) &&
+           !g_strcmp0(a->pkg.version, b->pkg.version) &&
+           !g_strcmp0(a->pkg.arch, b->pkg.arch);
+}
+
+/* a listed program went away in @generation */
+static void collect_package_removed_locked(CollectPackage *entry,
+                                           guint32 generation)
+{
+    if (!entry->pkg.name) {
+        collect_package_entry_free(entry);
+        return;
+    }
+    entry->generation = generation;
+    g_queue_push_tail(&collect_packages.removed, entry);
+}
+
+/* read the subkeys of one view that changed, add their ids to @seen */
+static bool collect_packages_read_view_locked(const CollectUninstallView *view,
+                                              GHashTable *seen,
+                                              guint32 generation)
+{
+    CollectPackage *entry, *old;
+    WCHAR name[256];
+    FILETIME written;
+    gpointer orig;
+    bool changed = false;
+    DWORD i, len;
+    LONG ret;
+    HKEY key;
+    char *id, *name8;
+
+    ret = RegOpenKeyExW(HKEY_LOCAL_MACHINE, COLLECT_UNINSTALL_KEY, 0,
+                        KEY_READ | view->sam, &key);
+    if (ret != ERROR_SUCCESS) {
+        g_debug("failed to open the %s Uninstall key: %ld", view->arch, ret);
+        return false;
+    }
+    for (i = 0; ; i++) {
+        len = G_N_ELEMENTS(name);
+        ret = RegEnumKeyExW(key, i, name, &len, NULL, NULL, NULL, &written);
+        if (ret == ERROR_NO_MORE_ITEMS) {
+            break;
+        }
+        if (ret != ERROR_SUCCESS) {
+            continue;
+        }
+        name8 = g_utf16_to_utf8(name, len, NULL, NULL, NULL);
+        if (!name8) {
+            continue;
+        }
+        id = g_strdup_printf("%s\\%s", view->arch, name8);
+        g_free(name8);
+        g_hash_table_insert(seen, id, id);
+
+        if (!g_hash_table_lookup_extended(collect_packages.packages, id,
+                                          &orig, (gpointer *)&old)) {
+            old = NULL;
+        }
+        if (old && !CompareFileTime(&old->written, &written)) {
+            continue;
+        }
+        entry = collect_package_read(key, name, view);
+        entry->written = written;
+        if (old && collect_package_same(old, entry)) {
+            old->written = written;
+            collect_package_entry_free(entry);
+            continue;
+        }
+        if (old) {
+            g_hash_table_steal(collect_packages.packages, id);
+            g_free(orig);
+            changed |= old->pkg.name != NULL;
+            collect_package_removed_locked(old, generation);
+        }
+        entry->generation = generation;
+        changed |= entry->pkg.name != NULL;
+        g_hash_table_replace(collect_packages.packages, g_strdup(id), entry);
+    }
+    RegCloseKey(key);
+    return changed;
+}
+
+static void collect_packages_refresh_locked(void)
+{
+    const CollectUninstallView *views;
+    guint32 generation;
+    CollectPackage *entry;
+    GHashTableIter iter;
+    GHashTable *seen;
+    gpointer key;
+    bool changed = false;
+    int i, n;
+
+    if (!collect_packages.valid) {
+        collect_packages.packages =
+            g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                  collect_package_entry_free);
+        collect_packages.instance = g_get_real_time();
+        collect_packages.generation = 0;
+        collect_packages.horizon = 1;
+        collect_packages.valid = true;
+    }
+    generation = collect_packages.generation + 1;
+
+    seen = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    views = collect_uninstall_views(&n);
+    for (i = 0; i < n; i++) {
+        changed |= collect_packages_read_view_locked(&views[i], seen,
+                                                     generation);
+    }
+    g_hash_table_iter_init(&iter, collect_packages.packages);
+    while (g_hash_table_iter_next(&iter, &key, (gpointer *)&entry)) {
+        if (!g_hash_table_lookup(seen, key)) {
+            g_hash_table_iter_steal(&iter);
+            g_free(key);
+            changed |= entry->pkg.name != NULL;
+            collect_package_removed_locked(entry, generation);
+        }
+    }
+    g_hash_table_destroy(seen);
+
+    if (changed || generation == 1) {
+        collect_packages.generation = generation;
+    }
+    while (collect_packages.removed.length > COLLECT_PACKAGES_REMOVED_MAX) {
+        entry = g_queue_pop_head(&collect_packages.removed);
+        collect_packages.horizon = entry->generation;
+        collect_package_entry_free(entry);
+    }
+}
+
+/*
+ * The installed programs, or with the @since token of an earlier answer
+ * only those installed and removed after it.  All of them are returned,
+ * with @full set, when the token is too old or not of this agent.
+ */
+bool ga_collect_packages(const char *since, GACollectPackages *pk,
+                         GError **errp)
+{
+    CollectPackage *entry;
+    GHashTableIter iter;
+    GList *l;
+    guint64 instance = 0;
+    guint32 generation = 0;
+    int end = 0;
+
+    memset(pk, 0, sizeof(*pk));
+    G_LOCK(collect_packages);
+    collect_packages_refresh_locked();
+
+    pk->full = !since ||
+        sscanf(since, "%" G_GINT64_MODIFIER "x:%u%n",
+               &instance, &generation, &end) != 2 || since[end] ||
+        instance != collect_packages.instance ||
+        generation < collect_packages.horizon ||
+        generation > collect_packages.generation;
+    pk->manager = GA_COLLECT_PACKAGES_REGISTRY;
+    pk->token = g_strdup_printf("%" G_GINT64_MODIFIER "x:%u",
+                                collect_packages.instance,
+                                collect_packages.generation);
+
+    pk->installed = g_ptr_array_new_with_free_func(ga_collect_package_free);
+    g_hash_table_iter_init(&iter, collect_packages.packages);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&entry)) {
+        if (entry->pkg.name && (pk->full || entry->generation > generation)) {
+            g_ptr_array_add(pk->installed, collect_package_copy(&entry->pkg));
+        }
+    }
+    pk->removed = g_ptr_array_new_with_free_func(ga_collect_package_free);
+    for (l = collect_packages.removed.head; l && !pk->full; l = l->next) {
+        entry = l->data;
+        if (entry->generation > generation) {
+            g_ptr_array_add(pk->removed, collect_package_copy(&entry->pkg));
+        }
+    }
+    G_UNLOCK(collect_packages);
+
+    g_ptr_array_sort(pk->installed, ga_collect_package_compare);
+    g_ptr_array_sort(pk->removed, ga_collect_package_compare);
+    return true;
+}
+
+/* read every key again next time, whatever its last write time */
+void ga_collect_packages_invalidate(void)
+{
+    CollectPackage *entry;
+    GHashTableIter iter;
+
+    G_LOCK(collect_packages);
+    if (collect_packages.valid) {
+        g_hash_table_iter_init(&iter, collect_packages.packages);
+        while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&entry)) {
+            memset(&entry->written, 0, sizeof(entry->written));
+        }
+    }
+    G_UNLOCK(collect_packages);
+}
+
+void ga_collect_packages_cleanup(void)
+{
+    CollectPackage *entry;
+
+    G_LOCK(collect_packages);
+    if (collect_packages.valid) {
+        g_hash_table_destroy(collect_packages.packages);
+    }
+    while ((entry = g_queue_pop_head(&collect_packages.removed))) {
+        collect_package_entry_free(entry);
+    }
+    memset(&collect_packages, 0, sizeof(collect_packages));
+    G_UNLOCK(collect_packages);
+}
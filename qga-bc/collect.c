@@ -0,0 +1,391 @@
+/*
+ * BCLinux guest status collectors, the platform neutral parts
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include <glib.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include "collect.h"
+
+GQuark ga_collect_error_quark(void)
+{
+    return g_quark_from_static_string("ga-collect-error-quark");
+}
+
+static int guest_meminfo_field(const char *key, size_t len)
+{
+#define KEY_IS(name) (len == sizeof(name) - 1 && !memcmp(key, name, len))
+    switch (key[0]) {
+    case 'M':
+        if (KEY_IS("MemTotal")) {
+            return MEMINFO_MEM_TOTAL;
+        } else if (KEY_IS("MemFree")) {
+            return MEMINFO_MEM_FREE;
+        } else if (KEY_IS("MemAvailable")) {
+            return MEMINFO_MEM_AVAILABLE;
+        }
+        break;
+    case 'B':
+        if (KEY_IS("Buffers")) {
+            return MEMINFO_BUFFERS;
+        }
+        break;
+    case 'C':
+        if (KEY_IS("Cached")) {
+            return MEMINFO_CACHED;
+        }
+        break;
+    case 'S':
+        if (KEY_IS("SwapTotal")) {
+            return MEMINFO_SWAP_TOTAL;
+        } else if (KEY_IS("SwapFree")) {
+            return MEMINFO_SWAP_FREE;
+        } else if (KEY_IS("Shmem")) {
+            return MEMINFO_SHMEM;
+        } else if (KEY_IS("Slab")) {
+            return MEMINFO_SLAB;
+        }
+        break;
+    case 'H':
+        if (KEY_IS("HugePages_Total")) {
+            return MEMINFO_HUGEPAGES_TOTAL;
+        } else if (KEY_IS("HugePages_Free")) {
+            return MEMINFO_HUGEPAGES_FREE;
+        } else if (KEY_IS("Hugepagesize")) {
+            return MEMINFO_HUGEPAGESIZE;
+        }
+        break;
+    }
+    return -1;
+#undef KEY_IS
+}
+
+/*
+ * Fill @mi from @buf, in the format of /proc/meminfo or of the meminfo of a
+ * NUMA node, whose lines start with "Node N ".  Values given in kB are
+ * converted to bytes; the HugePages counts stay page counts.
+ */
+void ga_parse_meminfo(char *buf, GuestMeminfo *mi)
+{
+    char *line, *colon, *nl, *end;
+    uint64_t val;
+    int field;
+
+    memset(mi, 0, sizeof(*mi));
+
+    for (line = buf; *line; line = nl + 1) {
+        nl = strchr(line, '\n');
+        if (!nl) {
+            nl = line + strlen(line) - 1;
+        }
+        if (!strncmp(line, "Node ", 5)) {
+            line += 5;
+            while (g_ascii_isdigit(*line) || *line == ' ') {
+                line++;
+            }
+        }
+        colon = memchr(line, ':', nl - line);
+        if (!colon) {
+            continue;
+        }
+        field = guest_meminfo_field(line, colon - line);
+        if (field < 0) {
+            continue;
+        }
+        val = strtoull(colon + 1, &end, 10);
+        while (*end == ' ') {
+            end++;
+        }
+        if (end[0] == 'k' && end[1] == 'B') {
+            val *= 1024;
+        }
+        mi->value[field] = val;
+        mi->present |= 1u << field;
+    }
+}
+
+void ga_collect_system_clear(GACollectSystem *si)
+{
+    g_free(si->os_name);
+    g_free(si->kernel_version);
+    g_free(si->system_version);
+    g_free(si->fqdn);
+    g_free(si->lastlogin);
+    g_free(si->pretty_name);
+    memset(si, 0, sizeof(*si));
+}
+
+void ga_collect_disk_free(gpointer p)
+{
+    GACollectDisk *disk = p;
+
+    g_free(disk->mount);
+    g_free(disk);
+}
+
+void ga_collect_service_free(gpointer p)
+{
+    GACollectService *svc = p;
+
+    g_free(svc->name);
+    g_free(svc->load_state);
+    g_free(svc->active_state);
+    g_free(svc->sub_state);
+    g_free(svc);
+}
+
+void ga_collect_package_free(gpointer p)
+{
+    GACollectPackage *pkg = p;
+
+    g_free(pkg->name);
+    g_free(pkg->version);
+    g_free(pkg->arch);
+    g_free(pkg);
+}
+
+void ga_collect_packages_clear(GACollectPackages *pk)
+{
+    g_free(pk->token);
+    if (pk->installed) {
+        g_ptr_array_free(pk->installed, true);
+    }
+    if (pk->removed) {
+        g_ptr_array_free(pk->removed, true);
+    }
+}
+
+/* by name, then architecture and version */
+gint ga_collect_package_compare(gconstpointer a, gconstpointer b)
+{
+    const GACollectPackage *pa = *(GACollectPackage *const *)a;
+    const GACollectPackage *pb = *(GACollectPackage *const *)b;
+    int ret;
+
+    ret = strcmp(pa->name, pb->name);
+    if (!ret) {
+        ret = strcmp(pa->arch, pb->arch);
+    }
+    if (!ret) {
+        ret = strcmp(pa->version, pb->version);
+    }
+    return ret;
+}
+
+/*
+ * Format a byte count the way "df -h" does: powers of 1024, rounded up,
+ * with one decimal digit below 10.
+ */
+char *ga_collect_size_human(uint64_t bytes)
+{
+    static const char units[] = "KMGTPE";
+    double size = bytes;
+    uint64_t rounded;
+    int i = -1;
+
+    if (bytes < 1024) {
+        return g_strdup_printf("%" PRIu64, bytes);
+    }
+    while (size >= 1024 && units[i + 1]) {
+        size /= 1024;
+        i++;
+    }
+
+    if (size < 10) {
+        rounded = size * 10;
+        if (rounded < size * 10) {
+            rounded++;
+        }
+        if (rounded < 100) {
+            return g_strdup_printf("%u.%u%c", (unsigned)(rounded / 10),
+                                   (unsigned)(rounded % 10), units[i]);
+        }
+        size = 10;
+    }
+
+    rounded = size;
+    if (rounded < size) {
+        rounded++;
+    }
+    if (rounded >= 1024 && units[i + 1]) {
+        return g_strdup_printf("1.0%c", units[i + 1]);
+    }
+    return g_strdup_printf("%u%c", (unsigned)rounded, units[i]);
+}
+
+/* the Windows agent's format, gigabytes with at most two decimals: "49.5G" */
+char *ga_collect_size_gb(uint64_t bytes)
+{
+    uint64_t hundredths = bytes * 100 / (1024 * 1024 * 1024);
+
+    if (hundredths < 10) {
+        return g_strdup("0");
+    }
+    if (hundredths % 10 == 0) {
+        if (hundredths % 100 == 0) {
+            return g_strdup_printf("%" PRIu64 "G", hundredths / 100);
+        }
+        return g_strdup_printf("%" PRIu64 ".%uG", hundredths / 100,
+                               (unsigned)(hundredths % 100 / 10));
+    }
+    return g_strdup_printf("%" PRIu64 ".%02uG", hundredths / 100,
+                           (unsigned)(hundredths % 100));
+}
+
+/* File system usage trends */
+
+#define COLLECT_FS_POINTS 32
+#define COLLECT_FS_MOUNTS_MAX 256
+#define COLLECT_FS_STEP_US (G_USEC_PER_SEC / 2)
+#define COLLECT_FS_WINDOW_US (60 * 60 * G_USEC_PER_SEC)
+
+typedef struct CollectFsPoint {
+    int64_t time;               /* monotonic, us */
+    uint64_t used;
+} CollectFsPoint;
+
+typedef struct CollectFsTrend {
+    CollectFsPoint points[COLLECT_FS_POINTS];
+    unsigned int head;          /* points recorded so far */
+    uint64_t avail;             /* of the newest point */
+} CollectFsTrend;
+
+/*
+ * The usage of each file system, as recorded whenever the agent reads it
+ * anyway, in a short ring per mount point.  Nothing is fitted until a
+ * forecast is asked for.  Readings closer together than
+ * COLLECT_FS_STEP_US replace each other, and the ring starts over when
+ * the usage drops by more than 1/64th of the size, as after a clean up,
+ * so that what came before does not drag the rate down.
+ */
+static GHashTable *collect_fs_trends;
+
+G_LOCK_DEFINE_STATIC(collect_fs_trends);
+
+static CollectFsPoint *collect_fs_point(CollectFsTrend *t, unsigned int n)
+{
+    return &t->points[n % COLLECT_FS_POINTS];
+}
+
+/* make room by dropping the mount point read the longest time ago */
+static void collect_fs_trends_evict_locked(void)
+{
+    GHashTableIter iter;
+    CollectFsTrend *t;
+    gpointer key, value, oldest = NULL;
+    int64_t oldest_time = G_MAXINT64, time;
+
+    g_hash_table_iter_init(&iter, collect_fs_trends);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        t = value;
+        time = collect_fs_point(t, t->head - 1)->time;
+        if (time < oldest_time) {
+            oldest_time = time;
+            oldest = key;
+        }
+    }
+    g_hash_table_remove(collect_fs_trends, oldest);
+}
+
+void ga_collect_fs_usage_add(const char *mount, uint64_t used,
+                             uint64_t avail)
+{
+    int64_t now = g_get_monotonic_time();
+    CollectFsPoint *last;
+    CollectFsTrend *t;
+
+    G_LOCK(collect_fs_trends);
+    if (!collect_fs_trends) {
+        collect_fs_trends = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                  g_free, g_free);
+    }
+    t = g_hash_table_lookup(collect_fs_trends, mount);
+    if (!t) {
+        if (g_hash_table_size(collect_fs_trends) >= COLLECT_FS_MOUNTS_MAX) {
+            collect_fs_trends_evict_locked();
+        }
+        t = g_new0(CollectFsTrend, 1);
+        g_hash_table_insert(collect_fs_trends, g_strdup(mount), t);
+    }
+
+    if (t->head) {
+        last = collect_fs_point(t, t->head - 1);
+        if (used + (used + avail) / 64 < last->used) {
+            t->head = 0;
+        } else if (now - last->time < COLLECT_FS_STEP_US) {
+            t->head--;
+        }
+    }
+    last = collect_fs_point(t, t->head++);
+    last->time = now;
+    last->used = used;
+    t->avail = avail;
+    G_UNLOCK(collect_fs_trends);
+}
+
+/*
+ * The fill rate of @mount, by a least squares fit over the readings of
+ * the last COLLECT_FS_WINDOW_US, and how long until it is full at that
+ * rate.  False without three readings at least a second apart in all.
+ */
+bool ga_collect_fs_forecast(const char *mount, GACollectFsForecast *fc)
+{
+    double sx = 0, sy = 0, sxx = 0, sxy = 0, x, y, n = 0, d;
+    const CollectFsPoint *p, *newest;
+    CollectFsTrend *t;
+    unsigned int i, first;
+
+    memset(fc, 0, sizeof(*fc));
+    G_LOCK(collect_fs_trends);
+    t = collect_fs_trends ? g_hash_table_lookup(collect_fs_trends, mount)
+                          : NULL;
+    if (!t || !t->head) {
+        G_UNLOCK(collect_fs_trends);
+        return false;
+    }
+
+    newest = collect_fs_point(t, t->head - 1);
+    first = t->head > COLLECT_FS_POINTS ? t->head - COLLECT_FS_POINTS : 0;
+    for (i = first; i < t->head; i++) {
+        p = collect_fs_point(t, i);
+        if (newest->time - p->time > COLLECT_FS_WINDOW_US) {
+            continue;
+        }
+        /* relative to the newest point, to keep the sums small */
+        x = (p->time - newest->time) / (double)G_USEC_PER_SEC;
+        y = (double)p->used - (double)newest->used;
+        sx += x;
+        sy += y;
+        sxx += x * x;
+        sxy += x * y;
+        n++;
+        fc->window = MAX(fc->window, -(int64_t)x);
+    }
+    fc->points = n;
+    d = n * sxx - sx * sx;
+    if (n < 3 || fc->window < 1 || d <= 0) {
+        G_UNLOCK(collect_fs_trends);
+        return false;
+    }
+    fc->fill_rate = (n * sxy - sx * sy) / d;
+    if (fc->fill_rate > 0) {
+        fc->has_time_to_full = true;
+        /* no further ahead than 68 years */
+        fc->time_to_full = MIN(t->avail / fc->fill_rate, (double)G_MAXINT32);
+    }
+    G_UNLOCK(collect_fs_trends);
+    return true;
+}
+
+void ga_collect_fs_usage_cleanup(void)
+{
+    G_LOCK(collect_fs_trends);
+    if (collect_fs_trends) {
+        g_hash_table_destroy(collect_fs_trends);
+        collect_fs_trends = NULL;
+    }
+    G_UNLOCK(collect_fs_trends);
+}
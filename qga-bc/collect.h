@@ -0,0 +1,279 @@
+/*
+ * BCLinux guest status collectors shared by every qemu-ga tree
+ *
+ * qemu-master, qemu-kvm-0.12.1.2 and qemu-win all build these sources,
+ * through the qga/bc link of each tree.  They only use glib and the
+ * platform's own APIs, never QEMU headers, because those differ between
+ * the trees; each tree's commands-*.c turns the results into its QAPI
+ * types.  collect.c is platform neutral, collect-posix.c reads procfs and
+ * collect-win32.c the Windows APIs.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#ifndef QGA_BC_COLLECT_H
+#define QGA_BC_COLLECT_H
+
+#include <glib.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define GA_COLLECT_ERROR ga_collect_error_quark()
+
+GQuark ga_collect_error_quark(void);
+
+/* Memory */
+
+typedef enum GuestMeminfoField {
+    MEMINFO_MEM_TOTAL,
+    MEMINFO_MEM_FREE,
+    MEMINFO_MEM_AVAILABLE,
+    MEMINFO_BUFFERS,
+    MEMINFO_CACHED,
+    MEMINFO_SWAP_TOTAL,
+    MEMINFO_SWAP_FREE,
+    MEMINFO_SHMEM,
+    MEMINFO_SLAB,
+    MEMINFO_HUGEPAGES_TOTAL,
+    MEMINFO_HUGEPAGES_FREE,
+    MEMINFO_HUGEPAGESIZE,
+    MEMINFO_MAX
+} GuestMeminfoField;
+
+/*
+ * The memory counters we know about, named after /proc/meminfo; sizes are
+ * in bytes.  A backend only sets the fields its platform has.
+ */
+typedef struct GuestMeminfo {
+    uint64_t value[MEMINFO_MAX];
+    uint32_t present;           /* bitmap of the fields found */
+} GuestMeminfo;
+
+#define MEMINFO_HAS(mi, field) (((mi)->present >> (field)) & 1)
+
+void ga_parse_meminfo(char *buf, GuestMeminfo *mi);
+bool ga_collect_memory(GuestMeminfo *mi, GError **errp);
+
+/* System */
+
+typedef struct GACollectSystem {
+    char *os_name;
+    char *kernel_version;
+    char *system_version;
+    char *fqdn;
+    char *lastlogin;
+    char *pretty_name;          /* NULL if unknown */
+} GACollectSystem;
+
+void ga_collect_system_init(void);
+void ga_collect_system_invalidate_fqdn(void);
+void ga_collect_system_cleanup(void);
+void ga_collect_system(GACollectSystem *si);
+void ga_collect_system_clear(GACollectSystem *si);
+#ifndef _WIN32
+char *ga_collect_os_release(const char *key);
+#endif
+
+/* Disks */
+
+typedef struct GACollectDisk {
+    char *mount;
+    uint64_t total;
+    uint64_t used;
+    uint64_t avail;             /* to unprivileged users */
+    bool writable;
+} GACollectDisk;
+
+GPtrArray *ga_collect_disks(GError **errp);
+void ga_collect_disks_invalidate(void);
+void ga_collect_disks_cleanup(void);
+void ga_collect_disk_free(gpointer p);
+char *ga_collect_size_human(uint64_t bytes);
+char *ga_collect_size_gb(uint64_t bytes);
+
+/*
+ * How fast a file system fills up, from the usage recorded for it by
+ * ga_collect_disks() and ga_collect_fs_usage_add(); see collect.c.
+ */
+typedef struct GACollectFsForecast {
+    double fill_rate;           /* bytes per second, < 0 when shrinking */
+    bool has_time_to_full;      /* only when filling up */
+    int64_t time_to_full;       /* seconds */
+    unsigned int points;        /* readings the rate is fitted to */
+    int64_t window;             /* seconds they span */
+} GACollectFsForecast;
+
+void ga_collect_fs_usage_add(const char *mount, uint64_t used,
+                             uint64_t avail);
+bool ga_collect_fs_forecast(const char *mount, GACollectFsForecast *fc);
+void ga_collect_fs_usage_cleanup(void);
+
+/* Services */
+
+typedef struct GACollectService {
+    char *name;                 /* as asked for */
+    char *load_state;           /* "loaded", "not-found", ..., "unknown" */
+    char *active_state;         /* "active", "inactive", ..., "unknown" */
+    char *sub_state;            /* "running", "dead", ..., NULL if unknown */
+    int64_t main_pid;           /* 0 if none */
+    int64_t restarts;           /* -1 if unknown */
+    int64_t memory;             /* bytes, -1 if unknown */
+} GACollectService;
+
+GPtrArray *ga_collect_services(char **units, GError **errp);
+void ga_collect_services_invalidate(void);
+void ga_collect_services_cleanup(void);
+void ga_collect_service_free(gpointer p);
+
+/* Packages */
+
+typedef enum GACollectPackageManager {
+    GA_COLLECT_PACKAGES_RPM,
+    GA_COLLECT_PACKAGES_DPKG,
+    GA_COLLECT_PACKAGES_REGISTRY,
+} GACollectPackageManager;
+
+typedef struct GACollectPackage {
+    char *name;
+    char *version;              /* [epoch:]version-release */
+    char *arch;
+} GACollectPackage;
+
+typedef struct GACollectPackages {
+    GACollectPackageManager manager;
+    char *token;                /* pass as @since to get what changed next */
+    bool full;                  /* @installed lists every package */
+    GPtrArray *installed;       /* GACollectPackage */
+    GPtrArray *removed;         /* GACollectPackage, empty if @full */
+} GACollectPackages;
+
+bool ga_collect_packages(const char *since, GACollectPackages *pk,
+                         GError **errp);
+void ga_collect_packages_clear(GACollectPackages *pk);
+void ga_collect_packages_invalidate(void);
+void ga_collect_packages_cleanup(void);
+void ga_collect_package_free(gpointer p);
+gint ga_collect_package_compare(gconstpointer a, gconstpointer b);
+
+#ifndef _WIN32
+/* Processes */
+
+typedef struct GACollectProcess {
+    int64_t pid;
+    char comm[64];
+    char state;                 /* as in /proc/<pid>/stat */
+    uint64_t rss;               /* bytes */
+    int64_t threads;
+    uint64_t utime;             /* ms */
+    uint64_t stime;             /* ms */
+    bool has_delta;             /* false on the first scan */
+    uint64_t utime_delta;       /* ms since the previous scan */
+    uint64_t stime_delta;       /* ms since the previous scan */
+} GACollectProcess;
+
+typedef struct GACollectProcExit {
+    int64_t pid;
+    char comm[64];              /* empty if unknown */
+    bool has_status;            /* from the proc connector */
+    int exit_code;              /* -1 if killed by a signal */
+    int signal;                 /* 0 if it exited */
+} GACollectProcExit;
+
+typedef struct GACollectProcChanges {
+    char *token;                /* pass as @since to get what changed next */
+    bool full;                  /* @procs lists every process */
+    bool exits_complete;        /* @exits has every exit since @since */
+    GArray *procs;              /* GACollectProcess */
+    GArray *exits;              /* GACollectProcExit */
+} GACollectProcChanges;
+
+GArray *ga_collect_processes(GError **errp);
+bool ga_collect_process_changes(const char *since,
+                                GACollectProcChanges *ch, GError **errp);
+void ga_collect_process_changes_clear(GACollectProcChanges *ch);
+void ga_collect_processes_sort(GArray *procs, bool by_rss);
+void ga_collect_processes_top(GArray *procs, bool by_rss, size_t n);
+void ga_collect_processes_cleanup(void);
+uint64_t ga_collect_ticks_to_ms(uint64_t ticks);
+char *ga_collect_app_status(GError **errp);
+
+/* Log files */
+
+typedef struct GACollectTail {
+    char *path;
+    int fd;                     /* -1 while there is no file */
+    uint64_t ino;
+    int64_t offset;             /* of the first line not read yet */
+    char head[64];              /* start of the file, to detect truncation */
+    int head_len;
+} GACollectTail;
+
+/* return false to stop before @line, which is then passed again */
+typedef bool (*GACollectLineFunc)(const char *line, size_t len,
+                                  void *opaque);
+
+void ga_collect_tail_open(GACollectTail *t, const char *path, bool at_end);
+bool ga_collect_tail_seek(GACollectTail *t, uint64_t ino, int64_t offset);
+bool ga_collect_tail_read(GACollectTail *t, GACollectLineFunc func,
+                          void *opaque);
+void ga_collect_tail_close(GACollectTail *t);
+
+/* OOM kills */
+
+#define GA_COLLECT_OOM_MAX_KILLS 128
+
+typedef struct GACollectOOMKill {
+    int64_t time;               /* ns since the Epoch */
+    int64_t pid;                /* -1 if unknown */
+    char comm[16];
+} GACollectOOMKill;
+
+void ga_collect_oom_record(const char *msg, int64_t time);
+bool ga_collect_oom_scan_syslog(GError **errp);
+int64_t ga_collect_oom_count(void);
+bool ga_collect_oom_kill(int64_t seq, GACollectOOMKill *rec);
+void ga_collect_oom_cleanup(void);
+
+/* Logins */
+
+typedef struct GACollectLogin {
+    char *user;
+    char *tty;                  /* without /dev/, may be empty */
+    char *host;                 /* remote host, empty for a local login */
+    int64_t pid;                /* of the login process */
+    int64_t time;               /* of the login, s since the Epoch */
+    int64_t idle;               /* s since the tty was last used, -1 if
+                                 * unknown */
+    char *session;              /* systemd-logind session, NULL if none */
+    char *session_type;         /* "tty", "x11", ..., NULL if unknown */
+    char *session_state;        /* "active", "online", ..., NULL if
+                                 * unknown */
+} GACollectLogin;
+
+GPtrArray *ga_collect_logins(void);
+void ga_collect_logins_cleanup(void);
+void ga_collect_login_free(gpointer p);
+
+/* Accounts */
+
+int ga_collect_replace_file(const char *path, const char *data, size_t len);
+int ga_collect_change_password(const char *user, const char *password);
+bool ga_collect_hostname_valid(const char *hostname, GError **errp);
+int ga_collect_change_hostname(const char *hostname);
+
+/* Checks */
+
+char *ga_collect_check(const char *command, int timeout_ms, size_t max,
+                       GError **errp);
+int ga_collect_run(const char *const *argv, size_t max, int timeout_ms,
+                   GString *out, GError **errp);
+#endif
+
+#ifdef _WIN32
+#include <windows.h>
+
+void *ga_collect_nt_query(ULONG info_class, ULONG *size_hint,
+                          GError **errp);
+#endif
+
+#endif /* QGA_BC_COLLECT_H */